@@ -0,0 +1,332 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#include <malloc.h>
+#endif
+
+#include <uv.h>
+
+#include "../include/raft.h"
+
+#include "allocs.h"
+
+/* Allocations of a single call site, keyed by the return address in it. */
+struct slot
+{
+    void *addr;
+    unsigned long long n;
+    unsigned long long bytes;
+};
+
+static uv_mutex_t mutex; /* Serialize hooks called by disk threads */
+static struct slot slots[ALLOCS__MAX_SITES]; /* Open addressing hash table */
+static struct slot other;                    /* Sites not fitting in it */
+static unsigned n_slots = 0;
+static bool counting = false;
+static unsigned long long n_allocs = 0;
+static unsigned long long n_bytes = 0;
+static long long live = 0; /* Usable size of the blocks allocated */
+static long long base = 0; /* Live memory when counting started */
+static long long peak = 0; /* Highest live memory since then */
+
+/* Index of the frame of the call site in the backtrace taken by a hook: 1 if
+ * raft_malloc() and friends tail call the hook, 2 otherwise. */
+static int skip = 2;
+
+/* Capture the call site of the allocation in progress, or NULL. */
+#if defined(__GLIBC__)
+#define CAPTURE(SITE)                                                   \
+    do {                                                                \
+        void *frames_[3];                                               \
+        SITE = NULL;                                                    \
+        if (counting && backtrace(frames_, skip + 1) > skip) {          \
+            SITE = frames_[skip];                                       \
+        }                                                               \
+    } while (0)
+#else
+#define CAPTURE(SITE) SITE = NULL
+#endif
+
+static size_t usable_size(void *ptr)
+{
+#if defined(__GLIBC__)
+    return malloc_usable_size(ptr);
+#else
+    (void)ptr;
+    return 0;
+#endif
+}
+
+static struct slot *lookup(void *addr)
+{
+    unsigned i = (unsigned)(((uintptr_t)addr >> 2) % ALLOCS__MAX_SITES);
+
+    while (slots[i].n > 0) {
+        if (slots[i].addr == addr) {
+            return &slots[i];
+        }
+        i = (i + 1) % ALLOCS__MAX_SITES;
+    }
+
+    /* Keep a free slot, so lookups terminate. */
+    if (n_slots == ALLOCS__MAX_SITES - 1) {
+        return &other;
+    }
+    n_slots++;
+    slots[i].addr = addr;
+
+    return &slots[i];
+}
+
+/* Account for a new block of @size bytes requested from @site. */
+static void allocated(void *ptr, size_t size, void *site)
+{
+    struct slot *slot;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    uv_mutex_lock(&mutex);
+    live += (long long)usable_size(ptr);
+    if (counting) {
+        n_allocs++;
+        n_bytes += size;
+        if (live > peak) {
+            peak = live;
+        }
+        slot = lookup(site);
+        slot->n++;
+        slot->bytes += size;
+    }
+    uv_mutex_unlock(&mutex);
+}
+
+static void released(size_t size)
+{
+    uv_mutex_lock(&mutex);
+    live -= (long long)size;
+    uv_mutex_unlock(&mutex);
+}
+
+static void *heap_malloc(void *data, size_t size)
+{
+    void *site;
+    void *ptr;
+    (void)data;
+    CAPTURE(site);
+    ptr = malloc(size);
+    allocated(ptr, size, site);
+    return ptr;
+}
+
+static void heap_free(void *data, void *ptr)
+{
+    (void)data;
+    if (ptr != NULL) {
+        released(usable_size(ptr));
+    }
+    free(ptr);
+}
+
+static void *heap_calloc(void *data, size_t nmemb, size_t size)
+{
+    void *site;
+    void *ptr;
+    (void)data;
+    CAPTURE(site);
+    ptr = calloc(nmemb, size);
+    allocated(ptr, nmemb * size, site);
+    return ptr;
+}
+
+static void *heap_realloc(void *data, void *ptr, size_t size)
+{
+    size_t old = ptr != NULL ? usable_size(ptr) : 0;
+    void *site;
+    void *new_ptr;
+    (void)data;
+    CAPTURE(site);
+    new_ptr = realloc(ptr, size);
+    if (new_ptr != NULL || size == 0) {
+        released(old);
+    }
+    allocated(new_ptr, size, site);
+    return new_ptr;
+}
+
+static void *heap_aligned_alloc(void *data, size_t alignment, size_t size)
+{
+    void *site;
+    void *ptr;
+    (void)data;
+    CAPTURE(site);
+    ptr = aligned_alloc(alignment, size);
+    allocated(ptr, size, site);
+    return ptr;
+}
+
+static struct raft_heap heap = {NULL,        heap_malloc,  heap_free,
+                                heap_calloc, heap_realloc, heap_aligned_alloc};
+
+#if defined(__GLIBC__)
+/* Backtrace of the last allocation made while probing. */
+static void *probe_frames[3];
+
+static void *probe_malloc(void *data, size_t size)
+{
+    (void)data;
+    backtrace(probe_frames, 3);
+    return malloc(size);
+}
+
+/* Find out whether raft_malloc() tail calls the hook, in which case the frame
+ * of the hook is directly followed by the frame of the caller. */
+__attribute__((noinline)) static void probe(void)
+{
+    struct raft_heap probe_heap = heap;
+    void *frames[2];
+    void *ptr;
+
+    probe_heap.malloc = probe_malloc;
+    raft_heap_set(&probe_heap);
+    ptr = raft_malloc(1);
+    raft_heap_set_default();
+    raft_free(ptr);
+
+    backtrace(frames, 2);
+    skip = probe_frames[2] == frames[1] ? 1 : 2;
+}
+#endif
+
+void allocs__install(void)
+{
+    uv_mutex_init(&mutex);
+#if defined(__GLIBC__)
+    probe();
+#endif
+    raft_heap_set(&heap);
+}
+
+void allocs__uninstall(void)
+{
+    raft_heap_set_default();
+    uv_mutex_destroy(&mutex);
+}
+
+void allocs__start(void)
+{
+    uv_mutex_lock(&mutex);
+    memset(slots, 0, sizeof slots);
+    memset(&other, 0, sizeof other);
+    n_slots = 0;
+    n_allocs = 0;
+    n_bytes = 0;
+    base = live;
+    peak = live;
+    counting = true;
+    uv_mutex_unlock(&mutex);
+}
+
+void allocs__stop(void)
+{
+    uv_mutex_lock(&mutex);
+    counting = false;
+    uv_mutex_unlock(&mutex);
+}
+
+void allocs__totals(unsigned long long *n,
+                    unsigned long long *bytes,
+                    unsigned long long *peak_)
+{
+    uv_mutex_lock(&mutex);
+    *n = n_allocs;
+    *bytes = n_bytes;
+    *peak_ = (unsigned long long)(peak - base);
+    uv_mutex_unlock(&mutex);
+}
+
+/* Name the call site with the given return address, as "module(function+off)"
+ * or "module(+off)", without the directory of the module. */
+static void name_site(void *addr, char *name, size_t len)
+{
+    const char *symbol = "?";
+    const char *cursor;
+#if defined(__GLIBC__)
+    char **symbols = NULL;
+    if (addr != NULL) {
+        symbols = backtrace_symbols(&addr, 1);
+    }
+    if (symbols != NULL) {
+        symbol = symbols[0];
+    }
+#else
+    (void)addr;
+#endif
+
+    cursor = strrchr(symbol, '/');
+    if (cursor != NULL) {
+        symbol = cursor + 1;
+    }
+    strncpy(name, symbol, len - 1);
+    name[len - 1] = '\0';
+
+    /* Drop the absolute address. */
+    cursor = strstr(name, " [");
+    if (cursor != NULL) {
+        name[cursor - name] = '\0';
+    }
+
+#if defined(__GLIBC__)
+    free(symbols);
+#endif
+}
+
+static int compare_sites(const void *p1, const void *p2)
+{
+    const struct allocs__site *s1 = p1;
+    const struct allocs__site *s2 = p2;
+    return s1->n > s2->n ? -1 : s1->n < s2->n;
+}
+
+int allocs__sites(struct allocs__site **sites, unsigned *n)
+{
+    unsigned i;
+
+    uv_mutex_lock(&mutex);
+
+    *sites = malloc((n_slots + 1) * sizeof **sites);
+    if (*sites == NULL) {
+        uv_mutex_unlock(&mutex);
+        return -1;
+    }
+
+    *n = 0;
+    for (i = 0; i < ALLOCS__MAX_SITES; i++) {
+        struct allocs__site *site = &(*sites)[*n];
+        if (slots[i].n == 0) {
+            continue;
+        }
+        name_site(slots[i].addr, site->name, sizeof site->name);
+        site->n = slots[i].n;
+        site->bytes = slots[i].bytes;
+        *n += 1;
+    }
+    if (other.n > 0) {
+        struct allocs__site *site = &(*sites)[*n];
+        strcpy(site->name, "other");
+        site->n = other.n;
+        site->bytes = other.bytes;
+        *n += 1;
+    }
+
+    uv_mutex_unlock(&mutex);
+
+    qsort(*sites, *n, sizeof **sites, compare_sites);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * Allocator counting the allocations made through raft_malloc() and friends,
+ * broken down by call site.
+ */
+
+#ifndef BENCHMARK_ALLOCS_H
+#define BENCHMARK_ALLOCS_H
+
+#include <stddef.h>
+
+/* Maximum number of call sites tracked, further ones are counted together. */
+#define ALLOCS__MAX_SITES 1024
+
+/* Allocations made from a single call site. */
+struct allocs__site
+{
+    char name[128];           /* Function and offset, or module and offset */
+    unsigned long long n;     /* Number of allocations */
+    unsigned long long bytes; /* Number of bytes requested */
+};
+
+/**
+ * Install the counting allocator with raft_heap_set(), without counting yet.
+ * It forwards to the stdlib, so memory can be freed after uninstalling it.
+ */
+void allocs__install(void);
+
+void allocs__uninstall(void);
+
+/**
+ * Reset all counters and start counting.
+ */
+void allocs__start(void);
+
+void allocs__stop(void);
+
+/**
+ * Return the number of allocations and of bytes requested while counting, and
+ * the peak of live memory above the amount live when counting started.
+ */
+void allocs__totals(unsigned long long *n,
+                    unsigned long long *bytes,
+                    unsigned long long *peak);
+
+/**
+ * Return the call sites that allocated while counting, sorted by decreasing
+ * number of allocations, in an array to be released with free(). Call sites
+ * are the first callers of raft_malloc() and friends. Functions private to the
+ * library are named after their module and offset, which can be passed to
+ * addr2line -f -e.
+ */
+int allocs__sites(struct allocs__site **sites, unsigned *n);
+
+#endif /* BENCHMARK_ALLOCS_H */
@@ -0,0 +1,54 @@
+/**
+ * Benchmark commands and common helpers.
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/* Maximum number of values in a list option. */
+#define BENCHMARK__MAX_VALUES 16
+
+/**
+ * Parse a comma-separated list of positive integers, such as "1,16,256", into
+ * @values, setting @n to their number. Return -1 if the list is malformed or
+ * holds more than BENCHMARK__MAX_VALUES values.
+ */
+int benchmark__parse_list(const char *arg, unsigned long *values, unsigned *n);
+
+/**
+ * Measure the throughput and commit latency of commands submitted to the leader
+ * of a cluster, running either on the fixture or on io_uv over loopback TCP.
+ */
+int cluster__run(int argc, char *argv[]);
+
+/**
+ * Measure the throughput and latency of appending entries to open segments of
+ * a data directory.
+ */
+int disk__run(int argc, char *argv[]);
+
+/**
+ * Measure how long writes are unavailable after the leader of a cluster dies,
+ * running either on the fixture or on io_uv over loopback TCP.
+ */
+int failover__run(int argc, char *argv[]);
+
+/**
+ * Measure the time taken to load data directories holding many segments and
+ * snapshots, as done when a server restarts.
+ */
+int load__run(int argc, char *argv[]);
+
+/**
+ * Replay a workload trace recorded by io_uv on the fixture, and measure the
+ * commit latency of its commands.
+ */
+int replay__run(int argc, char *argv[]);
+
+/**
+ * Measure the throughput and memory usage of sending a snapshot to a new server
+ * and installing it, running on io_uv over loopback TCP.
+ */
+int snapshot__run(int argc, char *argv[]);
+
+#endif /* BENCHMARK_H */
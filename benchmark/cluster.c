@@ -0,0 +1,764 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+#if defined(RAFT_FIXTURE)
+#include "../include/raft/fixture.h"
+#endif
+
+#include "allocs.h"
+#include "benchmark.h"
+#include "fs.h"
+#include "fsm.h"
+#include "latency.h"
+
+#define MAX_SERVERS 5
+#define DEFAULT_DURATION 5
+#define DEFAULT_INFLIGHT 64
+#define DEFAULT_SIZE 128
+#define DEFAULT_PORT 9100
+#define MAX_SITES 20
+
+/* Parameters of a run. */
+struct options
+{
+    bool tcp;              /* Whether to use io_uv over loopback TCP */
+    unsigned n_servers;    /* Cluster size */
+    unsigned rate;         /* Target ops/s, or 0 to keep @inflight ops */
+    unsigned inflight;     /* Maximum number of ops in flight */
+    size_t size;           /* Size of each command */
+    unsigned duration;     /* Length of the measurement, in seconds */
+    unsigned latency[2];   /* Network latency range of the fixture, in ms */
+    unsigned disk[4];      /* Fixture disk model, see raft_fixture_set_disk */
+    unsigned port;         /* First TCP port to listen to */
+    const char *dir;       /* Parent of the data directories, if TCP */
+    bool allocs;           /* Whether to count allocations by call site */
+    const char *record;    /* Prefix of the workload traces, if TCP */
+};
+
+/* Submit commands to the leader and measure their commit latency.
+ *
+ * With a target rate, commands are submitted as time goes by, independently of
+ * earlier ones completing (open loop), up to the maximum number in flight.
+ * Otherwise that maximum is kept in flight at all times (closed loop). */
+struct driver
+{
+    const struct options *options;
+    struct raft *leader;
+    unsigned long long (*now)(struct driver *d); /* Current time in nsecs */
+    void *data;
+    bool measuring;                /* Whether the measurement is running */
+    unsigned long long start;      /* Time the measurement started */
+    unsigned long long end;        /* Time the measurement ended */
+    unsigned n_inflight;           /* Commands in flight */
+    unsigned long long n_submitted; /* Commands submitted while measuring */
+    unsigned long long n_committed; /* Commands committed while measuring */
+    unsigned long long n_failed;    /* Commands failed while measuring */
+    unsigned long long n_sent;      /* AppendEntries sent while measuring */
+    unsigned long long n_stored;    /* Entries persisted while measuring */
+    struct latency latency;        /* Commit latency of commands */
+};
+
+struct op
+{
+    struct raft_apply req;
+    struct driver *driver;
+    unsigned long long submitted_at;
+};
+
+static void driver_submit(struct driver *d);
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    struct op *op = req->data;
+    struct driver *d = op->driver;
+
+    d->n_inflight--;
+    if (d->measuring) {
+        if (status == 0) {
+            d->n_committed++;
+            latency__add(&d->latency, d->now(d) - op->submitted_at);
+        } else {
+            d->n_failed++;
+        }
+    }
+    free(op);
+
+    if (d->measuring && d->options->rate == 0) {
+        driver_submit(d);
+    }
+}
+
+/* Submit a single command, return false if it wasn't. */
+static bool driver_submit_one(struct driver *d)
+{
+    struct raft_buffer buf;
+    struct op *op;
+    int rv;
+
+    op = malloc(sizeof *op);
+    buf.len = d->options->size;
+    buf.base = raft_malloc(buf.len);
+    if (op == NULL || buf.base == NULL) {
+        free(op);
+        raft_free(buf.base);
+        return false;
+    }
+    memset(buf.base, 0, buf.len);
+
+    op->req.data = op;
+    op->driver = d;
+    op->submitted_at = d->now(d);
+
+    /* In open loop, measure from the time the command was due, so that delays
+     * caused by hitting the in-flight limit are accounted for. */
+    if (d->options->rate > 0) {
+        op->submitted_at =
+            d->start + d->n_submitted * 1000000000ULL / d->options->rate;
+    }
+
+    rv = raft_apply(d->leader, &op->req, &buf, 1, apply_cb);
+    if (rv != 0) {
+        raft_free(buf.base);
+        free(op);
+        d->n_failed++;
+        return false;
+    }
+
+    d->n_inflight++;
+    d->n_submitted++;
+
+    return true;
+}
+
+/* Submit the commands that are due. */
+static void driver_submit(struct driver *d)
+{
+    unsigned long long target = ~0ULL;
+
+    if (d->options->rate > 0) {
+        target = (d->now(d) - d->start) * d->options->rate / 1000000000ULL;
+    }
+
+    while (d->n_inflight < d->options->inflight && d->n_submitted < target) {
+        if (!driver_submit_one(d)) {
+            break;
+        }
+    }
+}
+
+static void driver_start(struct driver *d, struct raft *leader)
+{
+    d->leader = leader;
+    d->measuring = true;
+    d->start = d->now(d);
+    if (d->options->allocs) {
+        allocs__start();
+    }
+    driver_submit(d);
+}
+
+static void driver_stop(struct driver *d)
+{
+    if (d->options->allocs) {
+        allocs__stop();
+    }
+    d->measuring = false;
+    d->end = d->now(d);
+}
+
+/* Count the AppendEntries messages sent and the entries persisted by all
+ * servers, to break allocations down by them. */
+static void trace_cb(void *data, const struct raft_trace *trace)
+{
+    struct driver *d = data;
+
+    if (!d->measuring) {
+        return;
+    }
+    if (trace->point == RAFT_TRACE_SEND &&
+        trace->type == RAFT_IO_APPEND_ENTRIES) {
+        d->n_sent++;
+    } else if (trace->point == RAFT_TRACE_APPEND_DONE && trace->status == 0) {
+        d->n_stored += trace->n;
+    }
+}
+
+static void driver_watch(struct driver *d, struct raft *r)
+{
+    if (d->options->allocs) {
+        r->data = d;
+        raft_set_tracer(r, trace_cb);
+    }
+}
+
+static double per(unsigned long long value, unsigned long long n)
+{
+    return n > 0 ? (double)value / (double)n : 0;
+}
+
+static void driver_report_allocs(struct driver *d)
+{
+    struct allocs__site *sites;
+    unsigned long long n;
+    unsigned long long bytes;
+    unsigned long long peak;
+    unsigned n_sites;
+    unsigned i;
+
+    allocs__totals(&n, &bytes, &peak);
+    if (allocs__sites(&sites, &n_sites) != 0) {
+        fprintf(stderr, "error: out of memory\n");
+        return;
+    }
+
+    printf("\n  %-44s %10s %12s %8s %8s %8s %10s\n", "site", "allocs", "bytes",
+           "/apply", "/append", "/entry", "B/apply");
+    printf("  %-44s %10llu %12llu %8.2f %8.2f %8.2f %10.1f\n", "total", n,
+           bytes, per(n, d->n_committed), per(n, d->n_sent),
+           per(n, d->n_stored), per(bytes, d->n_committed));
+    for (i = 0; i < n_sites && i < MAX_SITES; i++) {
+        struct allocs__site *s = &sites[i];
+        printf("  %-44.44s %10llu %12llu %8.2f %8.2f %8.2f %10.1f\n", s->name,
+               s->n, s->bytes, per(s->n, d->n_committed),
+               per(s->n, d->n_sent), per(s->n, d->n_stored),
+               per(s->bytes, d->n_committed));
+    }
+    printf("  %llu applied, %llu AppendEntries sent, %llu entries stored, "
+           "peak live %llu bytes\n\n",
+           d->n_committed, d->n_sent, d->n_stored, peak);
+
+    free(sites);
+}
+
+static void driver_report(struct driver *d)
+{
+    const struct options *o = d->options;
+    double secs = (double)(d->end - d->start) / 1e9;
+
+    printf("%-8s %7u %6u %8u %6zu %10.0f %8llu %8llu %8llu %8llu %8llu %8llu\n",
+           o->tcp ? "tcp" : "fixture", o->n_servers, o->rate, o->inflight,
+           o->size, d->n_committed / secs,
+           latency__percentile(&d->latency, 0.5),
+           latency__percentile(&d->latency, 0.9),
+           latency__percentile(&d->latency, 0.99),
+           latency__percentile(&d->latency, 0.999),
+           latency__percentile(&d->latency, 1), d->n_failed);
+}
+
+#if defined(RAFT_FIXTURE)
+
+/* Run on the in-memory fixture, whose time is simulated. */
+static unsigned long long fixture_now(struct driver *d)
+{
+    struct raft_fixture *f = d->data;
+    return f->time * 1000000ULL;
+}
+
+static int run_fixture(struct driver *d)
+{
+    const struct options *o = d->options;
+    struct raft_fixture f;
+    struct raft_configuration configuration;
+    struct raft_fsm fsms[MAX_SERVERS];
+    unsigned long long counts[MAX_SERVERS];
+    raft_time end;
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < o->n_servers; i++) {
+        fsm__init(&fsms[i], &counts[i]);
+    }
+
+    rv = raft_fixture_init(&f, o->n_servers, fsms);
+    if (rv != 0) {
+        goto err;
+    }
+    for (i = 0; i < o->n_servers; i++) {
+        raft_set_log_level(raft_fixture_get(&f, i), RAFT_ERROR);
+        driver_watch(d, raft_fixture_get(&f, i));
+        raft_fixture_set_latency(&f, i, o->latency[0], o->latency[1]);
+        raft_fixture_set_disk(&f, i, o->disk[0], o->disk[1], o->disk[2],
+                              o->disk[3]);
+    }
+
+    rv = raft_fixture_configuration(&f, o->n_servers, &configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_bootstrap(&f, &configuration);
+    raft_configuration_close(&configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_start(&f);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+
+    raft_fixture_elect(&f, 0);
+
+    d->now = fixture_now;
+    d->data = &f;
+    driver_start(d, raft_fixture_get(&f, 0));
+
+    end = f.time + o->duration * 1000;
+    while (f.time < end) {
+        driver_submit(d);
+        raft_fixture_step(&f);
+    }
+
+    driver_stop(d);
+    raft_fixture_close(&f);
+
+    return 0;
+
+err_after_fixture_init:
+    raft_fixture_close(&f);
+err:
+    fprintf(stderr, "error: fixture: %s\n", raft_strerror(rv));
+    return rv;
+}
+
+#endif /* RAFT_FIXTURE */
+
+/* Run on io_uv instances sharing an event loop and connected over loopback
+ * TCP, using real time. */
+struct server
+{
+    struct raft_io_uv_transport transport;
+    struct raft_io io;
+    struct raft_fsm fsm;
+    unsigned long long count;
+    struct raft raft;
+    char dir[PATH_MAX];
+    char address[32];
+};
+
+struct cluster
+{
+    const struct options *options;
+    struct uv_loop_s loop;
+    struct uv_timer_s timer;
+    struct server servers[MAX_SERVERS];
+    unsigned n_servers; /* Number of servers initialized */
+    struct driver *driver;
+    unsigned long long deadline; /* When to stop waiting or measuring */
+};
+
+static unsigned long long tcp_now(struct driver *d)
+{
+    (void)d;
+    return uv_hrtime();
+}
+
+static void cluster_shutdown(struct cluster *c)
+{
+    unsigned i;
+    uv_timer_stop(&c->timer);
+    uv_close((struct uv_handle_s *)&c->timer, NULL);
+    for (i = 0; i < c->n_servers; i++) {
+        raft_close(&c->servers[i].raft, NULL);
+    }
+}
+
+static void timer_cb(uv_timer_t *timer)
+{
+    struct cluster *c = timer->data;
+    struct driver *d = c->driver;
+    unsigned i;
+
+    if (d->measuring) {
+        if (uv_hrtime() >= c->deadline) {
+            driver_stop(d);
+            cluster_shutdown(c);
+            return;
+        }
+        driver_submit(d);
+        return;
+    }
+
+    for (i = 0; i < c->n_servers; i++) {
+        struct raft *r = &c->servers[i].raft;
+        if (raft_state(r) == RAFT_LEADER) {
+            c->deadline = uv_hrtime() + c->options->duration * 1000000000ULL;
+            driver_start(d, r);
+            return;
+        }
+    }
+
+    if (uv_hrtime() >= c->deadline) {
+        fprintf(stderr, "error: no leader elected\n");
+        cluster_shutdown(c);
+    }
+}
+
+static int server_init(struct cluster *c, unsigned i)
+{
+    const struct options *o = c->options;
+    struct server *s = &c->servers[i];
+    struct raft_configuration configuration;
+    unsigned j;
+    int rv;
+
+    rv = fs__make_dir(o->dir, "cluster", s->dir);
+    if (rv != 0) {
+        return RAFT_ERR_IO;
+    }
+    sprintf(s->address, "127.0.0.1:%u", o->port + i);
+
+    rv = raft_io_uv_tcp_init(&s->transport, &c->loop);
+    if (rv != 0) {
+        goto err_after_make_dir;
+    }
+    rv = raft_io_uv_init(&s->io, &c->loop, s->dir, &s->transport);
+    if (rv != 0) {
+        goto err_after_tcp_init;
+    }
+    if (o->record != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "%s.%u", o->record, i + 1);
+        rv = raft_io_uv_set_recording(&s->io, path);
+        if (rv != 0) {
+            goto err_after_io_init;
+        }
+    }
+    fsm__init(&s->fsm, &s->count);
+
+    rv = raft_init(&s->raft, &s->io, &s->fsm, i + 1, s->address);
+    if (rv != 0) {
+        goto err_after_io_init;
+    }
+    raft_set_log_level(&s->raft, RAFT_ERROR);
+    driver_watch(c->driver, &s->raft);
+
+    raft_configuration_init(&configuration);
+    for (j = 0; j < o->n_servers; j++) {
+        char address[32];
+        sprintf(address, "127.0.0.1:%u", o->port + j);
+        rv = raft_configuration_add(&configuration, j + 1, address, true);
+        if (rv != 0) {
+            break;
+        }
+    }
+    if (rv == 0) {
+        rv = raft_bootstrap(&s->raft, &configuration);
+    }
+    raft_configuration_close(&configuration);
+    if (rv != 0) {
+        goto err_after_raft_init;
+    }
+
+    rv = raft_start(&s->raft);
+    if (rv != 0) {
+        goto err_after_raft_init;
+    }
+
+    return 0;
+
+err_after_raft_init:
+    raft_close(&s->raft, NULL);
+    uv_run(&c->loop, UV_RUN_NOWAIT);
+err_after_io_init:
+    raft_io_uv_close(&s->io);
+err_after_tcp_init:
+    raft_io_uv_tcp_close(&s->transport);
+err_after_make_dir:
+    fs__remove_dir(s->dir);
+    return rv;
+}
+
+static void server_close(struct server *s)
+{
+    raft_io_uv_close(&s->io);
+    raft_io_uv_tcp_close(&s->transport);
+}
+
+static int run_tcp(struct driver *d)
+{
+    struct cluster c;
+    unsigned i;
+    int rv;
+
+    c.options = d->options;
+    c.driver = d;
+    c.n_servers = 0;
+
+    uv_loop_init(&c.loop);
+    uv_timer_init(&c.loop, &c.timer);
+    c.timer.data = &c;
+
+    for (i = 0; i < d->options->n_servers; i++) {
+        rv = server_init(&c, i);
+        if (rv != 0) {
+            fprintf(stderr, "error: server %u: %s\n", i + 1,
+                    raft_strerror(rv));
+            cluster_shutdown(&c);
+            goto out;
+        }
+        c.n_servers++;
+    }
+
+    d->now = tcp_now;
+    d->data = &c;
+    c.deadline = uv_hrtime() + 10 * 1000000000ULL;
+    uv_timer_start(&c.timer, timer_cb, 1, 1);
+
+    rv = 0;
+out:
+    uv_run(&c.loop, UV_RUN_DEFAULT);
+    for (i = 0; i < c.n_servers; i++) {
+        server_close(&c.servers[i]);
+    }
+    uv_run(&c.loop, UV_RUN_DEFAULT);
+    uv_loop_close(&c.loop);
+    for (i = 0; i < c.n_servers; i++) {
+        fs__remove_dir(c.servers[i].dir);
+    }
+
+    if (rv == 0 && d->end == 0) {
+        rv = RAFT_ERR_IO_CONNECT;
+    }
+
+    return rv;
+}
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark cluster [options] [<dir>]\n\n");
+    printf("Submit commands to the leader of a cluster and measure their\n");
+    printf("commit latency. With --tcp, servers run the libuv backend in\n");
+    printf("data directories created under <dir> and talk over loopback.\n");
+    printf("Otherwise they run on the in-memory fixture, in simulated\n");
+    printf("time, with millisecond resolution.\n\n");
+    printf("  -t, --tcp               use libuv and loopback TCP\n");
+    printf("  -n, --servers=N         number of servers, 3 or 5 (3)\n");
+    printf("  -r, --rate=LIST         target ops/s, 0 for closed loop (0)\n");
+    printf("  -i, --inflight=LIST     maximum ops in flight (%d)\n",
+           DEFAULT_INFLIGHT);
+    printf("  -s, --size=N            command size in bytes (%d)\n",
+           DEFAULT_SIZE);
+    printf("  -d, --duration=SECS     length of each run (%d)\n",
+           DEFAULT_DURATION);
+    printf("  -l, --latency=MIN,MAX   fixture network latency in ms (1,5)\n");
+    printf("  -D, --disk=MIN,MAX,MBPS,DEPTH\n");
+    printf("                          fixture disk sync latency in ms,\n");
+    printf("                          bandwidth in MB/s and queue depth\n");
+    printf("                          (instantaneous writes)\n");
+    printf("  -p, --port=PORT         first TCP port (%d)\n", DEFAULT_PORT);
+    printf("  -a, --allocs            count allocations by call site\n");
+    printf("  -R, --record=PREFIX     record the workload trace of each\n");
+    printf("                          server with --tcp, to PREFIX.<id>\n\n");
+    printf("Latencies are in microseconds, from raft_apply() to its\n");
+    printf("callback, or from the time a command was due with a rate.\n\n");
+    printf("With --allocs, the allocations made through raft_malloc() while\n");
+    printf("measuring are reported per command applied, per AppendEntries\n");
+    printf("sent and per entry persisted by any server, for the %d call\n",
+           MAX_SITES);
+    printf("sites allocating the most. On the fixture they include the\n");
+    printf("simulated I/O. Private functions are named after their module\n");
+    printf("and offset, to pass to addr2line -f -e.\n");
+}
+
+static int parse_one(const char *arg, unsigned *value)
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 1) {
+        return -1;
+    }
+    *value = (unsigned)values[0];
+    return 0;
+}
+
+int cluster__run(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"tcp", no_argument, NULL, 't'},
+        {"servers", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"inflight", required_argument, NULL, 'i'},
+        {"size", required_argument, NULL, 's'},
+        {"duration", required_argument, NULL, 'd'},
+        {"latency", required_argument, NULL, 'l'},
+        {"disk", required_argument, NULL, 'D'},
+        {"port", required_argument, NULL, 'p'},
+        {"allocs", no_argument, NULL, 'a'},
+        {"record", required_argument, NULL, 'R'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options o;
+    unsigned long rates[BENCHMARK__MAX_VALUES] = {0};
+    unsigned long inflights[BENCHMARK__MAX_VALUES] = {DEFAULT_INFLIGHT};
+    unsigned long latency[BENCHMARK__MAX_VALUES];
+    unsigned long disk[BENCHMARK__MAX_VALUES];
+    unsigned n_rates = 1;
+    unsigned n_inflights = 1;
+    unsigned size = DEFAULT_SIZE;
+    unsigned n;
+    unsigned i, j;
+    int opt;
+    int rv;
+
+    o.tcp = false;
+    o.n_servers = 3;
+    o.duration = DEFAULT_DURATION;
+    o.latency[0] = 1;
+    o.latency[1] = 5;
+    memset(o.disk, 0, sizeof o.disk);
+    o.port = DEFAULT_PORT;
+    o.dir = NULL;
+    o.allocs = false;
+    o.record = NULL;
+
+    while ((opt = getopt_long(argc, argv, "tn:r:i:s:d:l:D:p:aR:h",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                o.tcp = true;
+                rv = 0;
+                break;
+            case 'n':
+                rv = parse_one(optarg, &o.n_servers);
+                if (rv == 0 && o.n_servers != 3 && o.n_servers != 5) {
+                    rv = -1;
+                }
+                break;
+            case 'r':
+                /* Zero is a valid rate, so parse it on its own. */
+                if (strcmp(optarg, "0") == 0) {
+                    rates[0] = 0;
+                    n_rates = 1;
+                    rv = 0;
+                } else {
+                    rv = benchmark__parse_list(optarg, rates, &n_rates);
+                }
+                break;
+            case 'i':
+                rv = benchmark__parse_list(optarg, inflights, &n_inflights);
+                break;
+            case 's':
+                rv = parse_one(optarg, &size);
+                break;
+            case 'd':
+                rv = parse_one(optarg, &o.duration);
+                break;
+            case 'l':
+                rv = benchmark__parse_list(optarg, latency, &n);
+                if (rv == 0 && (n != 2 || latency[0] > latency[1])) {
+                    rv = -1;
+                }
+                if (rv == 0) {
+                    o.latency[0] = (unsigned)latency[0];
+                    o.latency[1] = (unsigned)latency[1];
+                }
+                break;
+            case 'D':
+                rv = benchmark__parse_list(optarg, disk, &n);
+                if (rv == 0 &&
+                    (n != 4 || disk[0] > disk[1] || disk[2] > 4000)) {
+                    rv = -1;
+                }
+                if (rv == 0) {
+                    o.disk[0] = (unsigned)disk[0];
+                    o.disk[1] = (unsigned)disk[1];
+                    o.disk[2] = (unsigned)disk[2] * 1000000;
+                    o.disk[3] = (unsigned)disk[3];
+                }
+                break;
+            case 'p':
+                rv = parse_one(optarg, &o.port);
+                break;
+            case 'a':
+                o.allocs = true;
+                rv = 0;
+                break;
+            case 'R':
+                o.record = optarg;
+                rv = 0;
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (o.tcp) {
+        if (optind != argc - 1) {
+            usage();
+            return 1;
+        }
+        o.dir = argv[optind];
+    } else if (optind != argc) {
+        usage();
+        return 1;
+    }
+#if !defined(RAFT_FIXTURE)
+    if (!o.tcp) {
+        fprintf(stderr, "error: built without the fixture, use --tcp\n");
+        return 1;
+    }
+#endif
+    o.size = size;
+
+    if (o.allocs) {
+        allocs__install();
+    }
+
+    printf("%-8s %7s %6s %8s %6s %10s %8s %8s %8s %8s %8s %8s\n", "io",
+           "servers", "rate", "inflight", "size", "ops/s", "p50", "p90",
+           "p99", "p999", "max", "failed");
+
+    for (i = 0; i < n_rates; i++) {
+        for (j = 0; j < n_inflights; j++) {
+            struct driver d;
+
+            o.rate = (unsigned)rates[i];
+            o.inflight = (unsigned)inflights[j];
+
+            memset(&d, 0, sizeof d);
+            d.options = &o;
+            latency__init(&d.latency);
+
+            if (o.tcp) {
+                rv = run_tcp(&d);
+            } else {
+#if defined(RAFT_FIXTURE)
+                rv = run_fixture(&d);
+#else
+                rv = -1;
+#endif
+            }
+            if (rv == 0) {
+                driver_report(&d);
+                if (o.allocs) {
+                    driver_report_allocs(&d);
+                }
+                fflush(stdout);
+            }
+            latency__close(&d.latency);
+            if (rv != 0) {
+                goto out;
+            }
+        }
+    }
+
+out:
+    if (o.allocs) {
+        allocs__uninstall();
+    }
+
+    return rv == 0 ? 0 : 1;
+}
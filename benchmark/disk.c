@@ -0,0 +1,335 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+
+#include "benchmark.h"
+#include "fs.h"
+#include "latency.h"
+
+#define DEFAULT_COUNT 2000
+
+/* A single run, appending batches of equally sized entries to a fresh data
+ * directory while keeping a fixed number of appends in flight. */
+struct run
+{
+    struct uv_loop_s loop;
+    struct raft_io_uv_transport transport;
+    struct raft_io io;
+    char dir[PATH_MAX];
+    bool direct;            /* Whether to use direct I/O */
+    size_t size;            /* Size of each entry */
+    unsigned batch;         /* Entries per append */
+    unsigned concurrency;   /* Appends in flight */
+    unsigned count;         /* Total number of appends */
+    unsigned n_submitted;   /* Appends submitted so far */
+    unsigned n_completed;   /* Appends completed so far */
+    unsigned n_inflight;    /* Appends in flight */
+    int status;             /* First error hit, if any */
+    struct latency latency; /* Latency of each append */
+    uint64_t start;         /* Time the first append was submitted */
+    uint64_t end;           /* Time the last append completed */
+};
+
+struct append
+{
+    struct run *run;
+    struct raft_entry *entries;
+    uint64_t submitted_at;
+};
+
+static void append_cb(void *data, int status);
+
+/* Submit new appends until the target concurrency or count is reached. */
+static void submit(struct run *r)
+{
+    while (r->status == 0 && r->n_inflight < r->concurrency &&
+           r->n_submitted < r->count) {
+        struct append *a;
+        char *batch;
+        unsigned i;
+        int rv;
+
+        a = malloc(sizeof *a);
+        if (a == NULL) {
+            r->status = RAFT_ENOMEM;
+            return;
+        }
+        a->entries = raft_malloc(r->batch * sizeof *a->entries);
+        batch = raft_malloc(r->batch * r->size);
+        if (a->entries == NULL || batch == NULL) {
+            raft_free(batch);
+            raft_free(a->entries);
+            free(a);
+            r->status = RAFT_ENOMEM;
+            return;
+        }
+        memset(batch, r->n_submitted & 0xff, r->batch * r->size);
+
+        for (i = 0; i < r->batch; i++) {
+            a->entries[i].term = 1;
+            a->entries[i].type = RAFT_COMMAND;
+            a->entries[i].buf.base = batch + i * r->size;
+            a->entries[i].buf.len = r->size;
+            a->entries[i].batch = batch;
+        }
+        a->run = r;
+        a->submitted_at = uv_hrtime();
+
+        rv = r->io.append(&r->io, a->entries, r->batch, a, append_cb);
+        if (rv != 0) {
+            raft_free(batch);
+            raft_free(a->entries);
+            free(a);
+            r->status = rv;
+            return;
+        }
+
+        r->n_submitted++;
+        r->n_inflight++;
+    }
+}
+
+static void append_cb(void *data, int status)
+{
+    struct append *a = data;
+    struct run *r = a->run;
+
+    if (latency__add(&r->latency, uv_hrtime() - a->submitted_at) != 0) {
+        status = RAFT_ENOMEM;
+    }
+    if (status != 0 && r->status == 0) {
+        r->status = status;
+    }
+
+    raft_free(a->entries[0].batch);
+    raft_free(a->entries);
+    free(a);
+
+    r->n_completed++;
+    r->n_inflight--;
+
+    submit(r);
+
+    if (r->n_inflight == 0) {
+        r->end = uv_hrtime();
+        r->io.close(&r->io, NULL);
+    }
+}
+
+static int run_start(struct run *r)
+{
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    struct raft_entry *entries;
+    size_t n_entries;
+    int rv;
+
+    rv = r->io.init(&r->io, 1, "127.0.0.1:9001");
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = r->io.load(&r->io, &term, &voted_for, &snapshot, &entries,
+                    &n_entries);
+    if (rv != 0) {
+        r->io.close(&r->io, NULL);
+        return rv;
+    }
+    /* The data directory is fresh, so there's nothing to release. */
+    (void)term;
+    (void)voted_for;
+    (void)snapshot;
+    (void)entries;
+    (void)n_entries;
+
+    r->start = uv_hrtime();
+    submit(r);
+    if (r->n_inflight == 0) {
+        r->io.close(&r->io, NULL);
+        return r->status;
+    }
+
+    return 0;
+}
+
+static int run(struct run *r, const char *parent)
+{
+    const char *mode = r->direct ? "direct" : "buffered";
+    struct raft_io_uv_stats stats;
+    double secs;
+    int rv;
+
+    r->n_submitted = 0;
+    r->n_completed = 0;
+    r->n_inflight = 0;
+    r->status = 0;
+    latency__init(&r->latency);
+
+    rv = fs__make_dir(parent, "disk", r->dir);
+    if (rv != 0) {
+        return -1;
+    }
+
+    uv_loop_init(&r->loop);
+    raft_io_uv_tcp_init(&r->transport, &r->loop);
+    rv = raft_io_uv_init(&r->io, &r->loop, r->dir, &r->transport);
+    if (rv != 0) {
+        fprintf(stderr, "error: init io: %s\n", raft_strerror(rv));
+        goto out;
+    }
+    r->io.log_level = RAFT_ERROR;
+    raft_io_uv_set_direct_io(&r->io, r->direct);
+
+    rv = run_start(r);
+    uv_run(&r->loop, UV_RUN_DEFAULT);
+    if (rv == 0) {
+        rv = r->status;
+    }
+
+    raft_io_uv_stats(&r->io, &stats);
+    raft_io_uv_close(&r->io);
+
+    if (rv != 0) {
+        printf("%-8s %8zu %6u %5u  error: %s\n", mode, r->size, r->batch,
+               r->concurrency, raft_strerror(rv));
+        goto out;
+    }
+
+    secs = (double)(r->end - r->start) / 1e9;
+    printf("%-8s %8zu %6u %5u %10.0f %8.1f %8llu %8llu %8llu %9.0f\n",
+           mode, r->size, r->batch, r->concurrency,
+           r->n_completed * r->batch / secs,
+           r->n_completed * r->batch * r->size / secs / (1024 * 1024),
+           latency__percentile(&r->latency, 0.5),
+           latency__percentile(&r->latency, 0.99),
+           latency__percentile(&r->latency, 0.999),
+           stats.append_write.count / secs);
+    fflush(stdout);
+
+out:
+    raft_io_uv_tcp_close(&r->transport);
+    uv_run(&r->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&r->loop);
+    latency__close(&r->latency);
+    fs__remove_dir(r->dir);
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark disk [options] <dir>\n\n");
+    printf("Append entries to fresh data directories created under <dir>,\n");
+    printf("for each combination of the given parameters.\n\n");
+    printf("  -s, --sizes=LIST        entry sizes in bytes (8,1024,16384)\n");
+    printf("  -b, --batches=LIST      entries per append (1,16)\n");
+    printf("  -c, --concurrency=LIST  appends in flight (1,4,16)\n");
+    printf("  -n, --count=N           appends per run (%d)\n", DEFAULT_COUNT);
+    printf("  -m, --mode=MODE         direct, buffered or both (both)\n\n");
+    printf("Latencies are in microseconds. Each segment write is durable on\n");
+    printf("completion, so writes/s is the rate of device flushes.\n");
+}
+
+int disk__run(int argc, char *argv[])
+{
+    static struct option options[] = {
+        {"sizes", required_argument, NULL, 's'},
+        {"batches", required_argument, NULL, 'b'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"count", required_argument, NULL, 'n'},
+        {"mode", required_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    unsigned long sizes[BENCHMARK__MAX_VALUES] = {8, 1024, 16384};
+    unsigned long batches[BENCHMARK__MAX_VALUES] = {1, 16};
+    unsigned long concurrency[BENCHMARK__MAX_VALUES] = {1, 4, 16};
+    unsigned n_sizes = 3;
+    unsigned n_batches = 2;
+    unsigned n_concurrency = 3;
+    unsigned long count = DEFAULT_COUNT;
+    bool modes[2] = {true, true}; /* Direct and buffered */
+    struct run r;
+    unsigned i, j, k, m;
+    int opt;
+    int rv;
+
+    while ((opt = getopt_long(argc, argv, "s:b:c:n:m:h", options, NULL)) !=
+           -1) {
+        unsigned n;
+        switch (opt) {
+            case 's':
+                rv = benchmark__parse_list(optarg, sizes, &n_sizes);
+                break;
+            case 'b':
+                rv = benchmark__parse_list(optarg, batches, &n_batches);
+                break;
+            case 'c':
+                rv = benchmark__parse_list(optarg, concurrency,
+                                           &n_concurrency);
+                break;
+            case 'n':
+                rv = benchmark__parse_list(optarg, &count, &n);
+                if (rv == 0 && n != 1) {
+                    rv = -1;
+                }
+                break;
+            case 'm':
+                rv = 0;
+                modes[0] = strcmp(optarg, "buffered") != 0;
+                modes[1] = strcmp(optarg, "direct") != 0;
+                if (strcmp(optarg, "direct") != 0 &&
+                    strcmp(optarg, "buffered") != 0 &&
+                    strcmp(optarg, "both") != 0) {
+                    rv = -1;
+                }
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    printf("%-8s %8s %6s %5s %10s %8s %8s %8s %8s %9s\n", "mode", "size",
+           "batch", "conc", "entries/s", "MB/s", "p50", "p99", "p999",
+           "writes/s");
+
+    for (m = 0; m < 2; m++) {
+        if (!modes[m]) {
+            continue;
+        }
+        for (i = 0; i < n_sizes; i++) {
+            for (j = 0; j < n_batches; j++) {
+                for (k = 0; k < n_concurrency; k++) {
+                    r.direct = m == 0;
+                    r.size = sizes[i];
+                    r.batch = (unsigned)batches[j];
+                    r.concurrency = (unsigned)concurrency[k];
+                    r.count = (unsigned)count;
+                    if (run(&r, argv[optind]) != 0) {
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
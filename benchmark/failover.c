@@ -0,0 +1,855 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+#if defined(RAFT_FIXTURE)
+#include "../include/raft/fixture.h"
+#endif
+
+#include "benchmark.h"
+#include "fs.h"
+#include "fsm.h"
+#include "latency.h"
+
+#define MAX_SERVERS 5
+#define DEFAULT_RUNS 10
+#define DEFAULT_RATE 1000
+#define DEFAULT_INFLIGHT 256
+#define DEFAULT_SIZE 128
+#define DEFAULT_WARMUP 1000
+#define DEFAULT_ELECTION_TIMEOUT 1000
+#define DEFAULT_HEARTBEAT_TIMEOUT 100
+#define DEFAULT_PORT 9200
+
+/* Give up on a run if no command commits within this many election timeouts
+ * after killing the leader. */
+#define MAX_ELECTION_TIMEOUTS 20
+
+/* Parameters of a set of runs. */
+struct options
+{
+    bool tcp;                   /* Whether to use io_uv over loopback TCP */
+    unsigned n_servers;         /* Cluster size */
+    unsigned runs;              /* Number of runs */
+    unsigned rate;              /* Commands submitted per second */
+    unsigned inflight;          /* Maximum number of commands in flight */
+    size_t size;                /* Size of each command */
+    unsigned warmup;            /* Load before killing the leader, in ms */
+    unsigned election_timeout;  /* Election timeout of all servers */
+    unsigned heartbeat_timeout; /* Heartbeat timeout of all servers */
+    bool pre_vote;              /* Whether the pre-vote round is enabled */
+    unsigned adaptive[2];       /* Adaptive election timeout bounds, if any */
+    unsigned latency[2];        /* Network latency range of the fixture */
+    unsigned port;              /* First TCP port to listen to */
+    const char *dir;            /* Parent of the data directories, if TCP */
+};
+
+/* A single run: commands are submitted at a fixed rate to whichever live
+ * server is leader, then the leader is killed and we wait until a command
+ * commits again.
+ *
+ * A command fails if it was in flight on the killed leader, if there was no
+ * live leader when it was due, or if the new leader rejected it. */
+struct trial
+{
+    const struct options *options;
+    unsigned long long (*now)(struct trial *t); /* Current time in nsecs */
+    struct raft *(*leader)(struct trial *t);    /* Live leader, if any */
+    void *data;
+    unsigned long long start;        /* When the load started */
+    unsigned long long n_attempts;   /* Commands that were due so far */
+    unsigned n_inflight;             /* Commands in flight on live servers */
+    struct raft *killed;             /* Killed leader, if any */
+    unsigned long long killed_at;    /* When it was killed */
+    unsigned long long elected_at;   /* When a live leader was found again */
+    unsigned long long committed_at; /* When a command committed again */
+    unsigned long long n_failed;     /* Commands failed since the kill */
+};
+
+struct op
+{
+    struct raft_apply req;
+    struct trial *trial;
+    struct raft *raft; /* Server the command was submitted to */
+};
+
+/* Whether failures currently count. */
+static bool trial_recovering(struct trial *t)
+{
+    return t->killed != NULL && t->committed_at == 0;
+}
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    struct op *op = req->data;
+    struct trial *t = op->trial;
+
+    /* The commands in flight on the killed leader were already accounted for
+     * when it was killed. */
+    if (op->raft != t->killed) {
+        t->n_inflight--;
+        if (trial_recovering(t)) {
+            if (status == 0) {
+                t->committed_at = t->now(t);
+            } else {
+                t->n_failed++;
+            }
+        }
+    }
+
+    free(op);
+}
+
+/* Submit a single command to the current leader, return false if it wasn't. */
+static bool trial_submit_one(struct trial *t)
+{
+    struct raft *leader;
+    struct raft_buffer buf;
+    struct op *op;
+    int rv;
+
+    leader = t->leader(t);
+    if (leader == NULL) {
+        return false;
+    }
+
+    op = malloc(sizeof *op);
+    buf.len = t->options->size;
+    buf.base = raft_malloc(buf.len);
+    if (op == NULL || buf.base == NULL) {
+        free(op);
+        raft_free(buf.base);
+        return false;
+    }
+    memset(buf.base, 0, buf.len);
+
+    op->req.data = op;
+    op->trial = t;
+    op->raft = leader;
+
+    rv = raft_apply(leader, &op->req, &buf, 1, apply_cb);
+    if (rv != 0) {
+        raft_free(buf.base);
+        free(op);
+        return false;
+    }
+
+    t->n_inflight++;
+
+    return true;
+}
+
+/* Submit the commands that are due. */
+static void trial_submit(struct trial *t)
+{
+    const struct options *o = t->options;
+    unsigned long long now = t->now(t);
+    unsigned long long due = (now - t->start) * o->rate / 1000000000ULL;
+
+    while (t->n_attempts < due && t->n_inflight < o->inflight) {
+        unsigned long long due_at;
+        bool submitted = false;
+
+        due_at = t->start + t->n_attempts * 1000000000ULL / o->rate;
+        t->n_attempts++;
+
+        /* Time might have jumped past the election of the new leader, but the
+         * commands that were due before it had nowhere to go. */
+        if (!trial_recovering(t) ||
+            (t->elected_at != 0 && due_at >= t->elected_at)) {
+            submitted = trial_submit_one(t);
+        }
+
+        if (!submitted && trial_recovering(t)) {
+            t->n_failed++;
+        }
+    }
+}
+
+static void trial_start(struct trial *t)
+{
+    t->start = t->now(t);
+}
+
+static void trial_kill(struct trial *t, struct raft *leader)
+{
+    t->killed = leader;
+    t->killed_at = t->now(t);
+    t->n_failed = t->n_inflight;
+    t->n_inflight = 0;
+}
+
+/* Record when a live leader shows up after the kill. */
+static void trial_check(struct trial *t)
+{
+    if (t->killed != NULL && t->elected_at == 0 && t->leader(t) != NULL) {
+        t->elected_at = t->now(t);
+    }
+}
+
+/* Timeout for a command to commit again after the kill, in msecs. */
+static unsigned trial_timeout(const struct options *o)
+{
+    return o->election_timeout * MAX_ELECTION_TIMEOUTS;
+}
+
+/* Apply the settings under test to a server. */
+static void configure(struct raft *r, const struct options *o)
+{
+    raft_set_log_level(r, RAFT_ERROR);
+    raft_set_election_timeout(r, o->election_timeout);
+    raft_set_heartbeat_timeout(r, o->heartbeat_timeout);
+    raft_set_pre_vote(r, o->pre_vote);
+    if (o->adaptive[1] != 0) {
+        raft_set_adaptive_election_timeout(r, o->adaptive[0], o->adaptive[1]);
+    }
+}
+
+/* Return the live leader with the highest term among the given servers. */
+static struct raft *pick_leader(struct raft *rafts[], bool alive[], unsigned n)
+{
+    struct raft *leader = NULL;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        struct raft *r = rafts[i];
+        if (!alive[i] || raft_state(r) != RAFT_LEADER) {
+            continue;
+        }
+        if (leader == NULL || r->current_term > leader->current_term) {
+            leader = r;
+        }
+    }
+
+    return leader;
+}
+
+#if defined(RAFT_FIXTURE)
+
+/* Run on the in-memory fixture, whose time is simulated. */
+static unsigned long long fixture_now(struct trial *t)
+{
+    struct raft_fixture *f = t->data;
+    return f->time * 1000000ULL;
+}
+
+static struct raft *fixture_leader(struct trial *t)
+{
+    struct raft_fixture *f = t->data;
+    struct raft *rafts[MAX_SERVERS];
+    bool alive[MAX_SERVERS];
+    unsigned i;
+
+    for (i = 0; i < raft_fixture_n(f); i++) {
+        rafts[i] = raft_fixture_get(f, i);
+        alive[i] = raft_fixture_alive(f, i);
+    }
+
+    return pick_leader(rafts, alive, raft_fixture_n(f));
+}
+
+static int run_fixture(struct trial *t, unsigned seed)
+{
+    const struct options *o = t->options;
+    struct raft_fixture f;
+    struct raft_configuration configuration;
+    struct raft_fsm fsms[MAX_SERVERS];
+    unsigned long long counts[MAX_SERVERS];
+    struct raft *leader;
+    raft_time end;
+    unsigned i;
+    int rv;
+
+    /* The fixture draws election timeouts and latencies from rand(). */
+    srand(seed);
+
+    for (i = 0; i < o->n_servers; i++) {
+        fsm__init(&fsms[i], &counts[i]);
+    }
+
+    rv = raft_fixture_init(&f, o->n_servers, fsms);
+    if (rv != 0) {
+        goto err;
+    }
+    for (i = 0; i < o->n_servers; i++) {
+        configure(raft_fixture_get(&f, i), o);
+        raft_fixture_set_latency(&f, i, o->latency[0], o->latency[1]);
+    }
+
+    rv = raft_fixture_configuration(&f, o->n_servers, &configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_bootstrap(&f, &configuration);
+    raft_configuration_close(&configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_start(&f);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+
+    t->now = fixture_now;
+    t->leader = fixture_leader;
+    t->data = &f;
+
+    if (!raft_fixture_step_until_has_leader(&f, trial_timeout(o))) {
+        rv = RAFT_ERR_NOT_LEADER;
+        goto err_after_fixture_init;
+    }
+
+    trial_start(t);
+    end = f.time + o->warmup;
+    while (f.time < end) {
+        trial_submit(t);
+        raft_fixture_step(&f);
+    }
+
+    leader = fixture_leader(t);
+    if (leader == NULL) {
+        rv = RAFT_ERR_NOT_LEADER;
+        goto err_after_fixture_init;
+    }
+    raft_fixture_kill(&f, leader->id - 1);
+    trial_kill(t, leader);
+
+    end = f.time + trial_timeout(o);
+    while (t->committed_at == 0 && f.time < end) {
+        trial_submit(t);
+        raft_fixture_step(&f);
+        trial_check(t);
+    }
+
+    raft_fixture_close(&f);
+
+    return 0;
+
+err_after_fixture_init:
+    raft_fixture_close(&f);
+err:
+    fprintf(stderr, "error: fixture: %s\n", raft_strerror(rv));
+    return rv;
+}
+
+#endif /* RAFT_FIXTURE */
+
+/* Run on io_uv instances sharing an event loop and connected over loopback
+ * TCP, using real time. Killing the leader closes it, along with its
+ * connections. */
+struct server
+{
+    struct raft_io_uv_transport transport;
+    struct raft_io io;
+    struct raft_fsm fsm;
+    unsigned long long count;
+    struct raft raft;
+    bool alive;
+    char dir[PATH_MAX];
+    char address[32];
+};
+
+enum { CLUSTER_ELECT, CLUSTER_WARMUP, CLUSTER_RECOVER, CLUSTER_DONE };
+
+struct cluster
+{
+    const struct options *options;
+    struct uv_loop_s loop;
+    struct uv_timer_s timer;
+    struct server servers[MAX_SERVERS];
+    unsigned n_servers; /* Number of servers initialized */
+    struct trial *trial;
+    int phase;                   /* Current phase of the run */
+    unsigned long long deadline; /* When the current phase ends */
+};
+
+static unsigned long long tcp_now(struct trial *t)
+{
+    (void)t;
+    return uv_hrtime();
+}
+
+static struct raft *tcp_leader(struct trial *t)
+{
+    struct cluster *c = t->data;
+    struct raft *rafts[MAX_SERVERS];
+    bool alive[MAX_SERVERS];
+    unsigned i;
+
+    for (i = 0; i < c->n_servers; i++) {
+        rafts[i] = &c->servers[i].raft;
+        alive[i] = c->servers[i].alive;
+    }
+
+    return pick_leader(rafts, alive, c->n_servers);
+}
+
+static void cluster_shutdown(struct cluster *c)
+{
+    unsigned i;
+    c->phase = CLUSTER_DONE;
+    uv_timer_stop(&c->timer);
+    uv_close((struct uv_handle_s *)&c->timer, NULL);
+    for (i = 0; i < c->n_servers; i++) {
+        if (c->servers[i].alive) {
+            raft_close(&c->servers[i].raft, NULL);
+        }
+    }
+}
+
+static void timer_cb(uv_timer_t *timer)
+{
+    struct cluster *c = timer->data;
+    const struct options *o = c->options;
+    struct trial *t = c->trial;
+    unsigned long long now = uv_hrtime();
+    struct raft *leader;
+
+    switch (c->phase) {
+        case CLUSTER_ELECT:
+            if (tcp_leader(t) != NULL) {
+                trial_start(t);
+                c->deadline = now + o->warmup * 1000000ULL;
+                c->phase = CLUSTER_WARMUP;
+            } else if (now >= c->deadline) {
+                fprintf(stderr, "error: no leader elected\n");
+                cluster_shutdown(c);
+            }
+            break;
+        case CLUSTER_WARMUP:
+            trial_submit(t);
+            if (now < c->deadline) {
+                break;
+            }
+            leader = tcp_leader(t);
+            if (leader == NULL) {
+                break;
+            }
+            c->servers[leader->id - 1].alive = false;
+            trial_kill(t, leader);
+            raft_close(leader, NULL);
+            c->deadline = now + trial_timeout(o) * 1000000ULL;
+            c->phase = CLUSTER_RECOVER;
+            break;
+        case CLUSTER_RECOVER:
+            trial_submit(t);
+            trial_check(t);
+            if (t->committed_at != 0 || now >= c->deadline) {
+                cluster_shutdown(c);
+            }
+            break;
+    }
+}
+
+static int server_init(struct cluster *c, unsigned i)
+{
+    const struct options *o = c->options;
+    struct server *s = &c->servers[i];
+    struct raft_configuration configuration;
+    unsigned j;
+    int rv;
+
+    rv = fs__make_dir(o->dir, "failover", s->dir);
+    if (rv != 0) {
+        return RAFT_ERR_IO;
+    }
+    sprintf(s->address, "127.0.0.1:%u", o->port + i);
+
+    rv = raft_io_uv_tcp_init(&s->transport, &c->loop);
+    if (rv != 0) {
+        goto err_after_make_dir;
+    }
+    rv = raft_io_uv_init(&s->io, &c->loop, s->dir, &s->transport);
+    if (rv != 0) {
+        goto err_after_tcp_init;
+    }
+    fsm__init(&s->fsm, &s->count);
+
+    rv = raft_init(&s->raft, &s->io, &s->fsm, i + 1, s->address);
+    if (rv != 0) {
+        goto err_after_io_init;
+    }
+    configure(&s->raft, o);
+
+    raft_configuration_init(&configuration);
+    for (j = 0; j < o->n_servers; j++) {
+        char address[32];
+        sprintf(address, "127.0.0.1:%u", o->port + j);
+        rv = raft_configuration_add(&configuration, j + 1, address, true);
+        if (rv != 0) {
+            break;
+        }
+    }
+    if (rv == 0) {
+        rv = raft_bootstrap(&s->raft, &configuration);
+    }
+    raft_configuration_close(&configuration);
+    if (rv != 0) {
+        goto err_after_raft_init;
+    }
+
+    rv = raft_start(&s->raft);
+    if (rv != 0) {
+        goto err_after_raft_init;
+    }
+    s->alive = true;
+
+    return 0;
+
+err_after_raft_init:
+    raft_close(&s->raft, NULL);
+    uv_run(&c->loop, UV_RUN_NOWAIT);
+err_after_io_init:
+    raft_io_uv_close(&s->io);
+err_after_tcp_init:
+    raft_io_uv_tcp_close(&s->transport);
+err_after_make_dir:
+    fs__remove_dir(s->dir);
+    return rv;
+}
+
+static void server_close(struct server *s)
+{
+    raft_io_uv_close(&s->io);
+    raft_io_uv_tcp_close(&s->transport);
+}
+
+static int run_tcp(struct trial *t)
+{
+    struct cluster c;
+    unsigned i;
+    int rv;
+
+    c.options = t->options;
+    c.trial = t;
+    c.n_servers = 0;
+
+    uv_loop_init(&c.loop);
+    uv_timer_init(&c.loop, &c.timer);
+    c.timer.data = &c;
+
+    for (i = 0; i < t->options->n_servers; i++) {
+        rv = server_init(&c, i);
+        if (rv != 0) {
+            fprintf(stderr, "error: server %u: %s\n", i + 1,
+                    raft_strerror(rv));
+            cluster_shutdown(&c);
+            goto out;
+        }
+        c.n_servers++;
+    }
+
+    t->now = tcp_now;
+    t->leader = tcp_leader;
+    t->data = &c;
+    c.phase = CLUSTER_ELECT;
+    c.deadline = uv_hrtime() + trial_timeout(t->options) * 1000000ULL;
+    uv_timer_start(&c.timer, timer_cb, 1, 1);
+
+    rv = 0;
+out:
+    uv_run(&c.loop, UV_RUN_DEFAULT);
+    for (i = 0; i < c.n_servers; i++) {
+        server_close(&c.servers[i]);
+    }
+    uv_run(&c.loop, UV_RUN_DEFAULT);
+    uv_loop_close(&c.loop);
+    for (i = 0; i < c.n_servers; i++) {
+        fs__remove_dir(c.servers[i].dir);
+    }
+
+    if (rv == 0 && t->killed == NULL) {
+        rv = RAFT_ERR_NOT_LEADER;
+    }
+
+    return rv;
+}
+
+/* Outcome of all the runs with the same settings. */
+struct results
+{
+    struct latency elected;   /* Time from the kill to a new leader */
+    struct latency committed; /* Time from the kill to a new commit */
+    unsigned long long n_failed;
+    unsigned n_timeouts; /* Runs where no command committed again */
+};
+
+static void report(const struct options *o, struct results *r)
+{
+    char adaptive[32];
+
+    if (o->adaptive[1] != 0) {
+        sprintf(adaptive, "%u-%u", o->adaptive[0], o->adaptive[1]);
+    } else {
+        strcpy(adaptive, "off");
+    }
+
+    printf("%-8s %7u %8u %9u %7s %9s %5u %8.1f %8.1f %8.1f %8.1f %8.1f %8u\n",
+           o->tcp ? "tcp" : "fixture", o->n_servers, o->election_timeout,
+           o->heartbeat_timeout, o->pre_vote ? "on" : "off", adaptive, o->runs,
+           latency__percentile(&r->elected, 0.5) / 1000.0,
+           latency__percentile(&r->elected, 1) / 1000.0,
+           latency__percentile(&r->committed, 0.5) / 1000.0,
+           latency__percentile(&r->committed, 1) / 1000.0,
+           (double)r->n_failed / o->runs, r->n_timeouts);
+}
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark failover [options] [<dir>]\n\n");
+    printf("Submit commands at a steady rate to the leader of a cluster,\n");
+    printf("kill it and measure how long writes are unavailable. With\n");
+    printf("--tcp, servers run the libuv backend in data directories\n");
+    printf("created under <dir> and talk over loopback. Otherwise they run\n");
+    printf("on the in-memory fixture, in simulated time.\n\n");
+    printf("  -t, --tcp               use libuv and loopback TCP\n");
+    printf("  -n, --servers=N         number of servers, 3 or 5 (3)\n");
+    printf("  -R, --runs=N            runs for each setting (%d)\n",
+           DEFAULT_RUNS);
+    printf("  -r, --rate=N            commands per second (%d)\n",
+           DEFAULT_RATE);
+    printf("  -i, --inflight=N        maximum commands in flight (%d)\n",
+           DEFAULT_INFLIGHT);
+    printf("  -s, --size=N            command size in bytes (%d)\n",
+           DEFAULT_SIZE);
+    printf("  -w, --warmup=MSECS      load before the kill (%d)\n",
+           DEFAULT_WARMUP);
+    printf("  -e, --election=LIST     election timeouts in ms (%d)\n",
+           DEFAULT_ELECTION_TIMEOUT);
+    printf("  -b, --heartbeat=LIST    heartbeat timeouts in ms (%d)\n",
+           DEFAULT_HEARTBEAT_TIMEOUT);
+    printf("  -P, --pre-vote          enable the pre-vote round\n");
+    printf("  -a, --adaptive=MIN,MAX  adaptive election timeout bounds\n");
+    printf("  -l, --latency=MIN,MAX   fixture network latency in ms (1,5)\n");
+    printf("  -p, --port=PORT         first TCP port (%d)\n\n", DEFAULT_PORT);
+    printf("Times are in milliseconds from the kill, until a live server\n");
+    printf("is leader (elected) and until a command commits again\n");
+    printf("(commit). Failed commands, averaged over runs, include those in\n");
+    printf("flight on the killed leader and those due while there was no\n");
+    printf("leader. Runs where nothing commits within %d election\n",
+           MAX_ELECTION_TIMEOUTS);
+    printf("timeouts are reported as timeouts.\n");
+}
+
+static int parse_one(const char *arg, unsigned *value)
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 1) {
+        return -1;
+    }
+    *value = (unsigned)values[0];
+    return 0;
+}
+
+static int parse_range(const char *arg, unsigned range[2])
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 2 ||
+        values[0] > values[1]) {
+        return -1;
+    }
+    range[0] = (unsigned)values[0];
+    range[1] = (unsigned)values[1];
+    return 0;
+}
+
+/* Run all the runs with the current settings and report their outcome. */
+static int run_all(const struct options *o)
+{
+    struct results r;
+    unsigned i;
+    int rv = 0;
+
+    latency__init(&r.elected);
+    latency__init(&r.committed);
+    r.n_failed = 0;
+    r.n_timeouts = 0;
+
+    for (i = 0; i < o->runs; i++) {
+        struct trial t;
+
+        memset(&t, 0, sizeof t);
+        t.options = o;
+
+        if (o->tcp) {
+            rv = run_tcp(&t);
+        } else {
+#if defined(RAFT_FIXTURE)
+            rv = run_fixture(&t, i + 1);
+#else
+            rv = -1;
+#endif
+        }
+        if (rv != 0) {
+            break;
+        }
+
+        r.n_failed += t.n_failed;
+        if (t.committed_at == 0) {
+            r.n_timeouts++;
+            continue;
+        }
+        latency__add(&r.elected, t.elected_at - t.killed_at);
+        latency__add(&r.committed, t.committed_at - t.killed_at);
+    }
+
+    if (rv == 0) {
+        report(o, &r);
+        fflush(stdout);
+    }
+
+    latency__close(&r.elected);
+    latency__close(&r.committed);
+
+    return rv;
+}
+
+int failover__run(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"tcp", no_argument, NULL, 't'},
+        {"servers", required_argument, NULL, 'n'},
+        {"runs", required_argument, NULL, 'R'},
+        {"rate", required_argument, NULL, 'r'},
+        {"inflight", required_argument, NULL, 'i'},
+        {"size", required_argument, NULL, 's'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"election", required_argument, NULL, 'e'},
+        {"heartbeat", required_argument, NULL, 'b'},
+        {"pre-vote", no_argument, NULL, 'P'},
+        {"adaptive", required_argument, NULL, 'a'},
+        {"latency", required_argument, NULL, 'l'},
+        {"port", required_argument, NULL, 'p'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options o;
+    unsigned long elections[BENCHMARK__MAX_VALUES] = {
+        DEFAULT_ELECTION_TIMEOUT};
+    unsigned long heartbeats[BENCHMARK__MAX_VALUES] = {
+        DEFAULT_HEARTBEAT_TIMEOUT};
+    unsigned n_elections = 1;
+    unsigned n_heartbeats = 1;
+    unsigned size = DEFAULT_SIZE;
+    unsigned i, j;
+    int opt;
+    int rv;
+
+    o.tcp = false;
+    o.n_servers = 3;
+    o.runs = DEFAULT_RUNS;
+    o.rate = DEFAULT_RATE;
+    o.inflight = DEFAULT_INFLIGHT;
+    o.warmup = DEFAULT_WARMUP;
+    o.pre_vote = false;
+    o.adaptive[0] = 0;
+    o.adaptive[1] = 0;
+    o.latency[0] = 1;
+    o.latency[1] = 5;
+    o.port = DEFAULT_PORT;
+    o.dir = NULL;
+
+    while ((opt = getopt_long(argc, argv, "tn:R:r:i:s:w:e:b:Pa:l:p:h",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                o.tcp = true;
+                rv = 0;
+                break;
+            case 'n':
+                rv = parse_one(optarg, &o.n_servers);
+                if (rv == 0 && o.n_servers != 3 && o.n_servers != 5) {
+                    rv = -1;
+                }
+                break;
+            case 'R':
+                rv = parse_one(optarg, &o.runs);
+                break;
+            case 'r':
+                rv = parse_one(optarg, &o.rate);
+                break;
+            case 'i':
+                rv = parse_one(optarg, &o.inflight);
+                break;
+            case 's':
+                rv = parse_one(optarg, &size);
+                break;
+            case 'w':
+                rv = parse_one(optarg, &o.warmup);
+                break;
+            case 'e':
+                rv = benchmark__parse_list(optarg, elections, &n_elections);
+                break;
+            case 'b':
+                rv = benchmark__parse_list(optarg, heartbeats, &n_heartbeats);
+                break;
+            case 'P':
+                o.pre_vote = true;
+                rv = 0;
+                break;
+            case 'a':
+                rv = parse_range(optarg, o.adaptive);
+                break;
+            case 'l':
+                rv = parse_range(optarg, o.latency);
+                break;
+            case 'p':
+                rv = parse_one(optarg, &o.port);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (o.tcp) {
+        if (optind != argc - 1) {
+            usage();
+            return 1;
+        }
+        o.dir = argv[optind];
+    } else if (optind != argc) {
+        usage();
+        return 1;
+    }
+#if !defined(RAFT_FIXTURE)
+    if (!o.tcp) {
+        fprintf(stderr, "error: built without the fixture, use --tcp\n");
+        return 1;
+    }
+#endif
+    o.size = size;
+
+    printf("%-8s %7s %8s %9s %7s %9s %5s %8s %8s %8s %8s %8s %8s\n", "io",
+           "servers", "election", "heartbeat", "prevote", "adaptive", "runs",
+           "elect50", "electmax", "commit50", "commitmx", "failed",
+           "timeouts");
+
+    for (i = 0; i < n_elections; i++) {
+        for (j = 0; j < n_heartbeats; j++) {
+            o.election_timeout = (unsigned)elections[i];
+            o.heartbeat_timeout = (unsigned)heartbeats[j];
+            if (o.heartbeat_timeout >= o.election_timeout) {
+                continue;
+            }
+            if (run_all(&o) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
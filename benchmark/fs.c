@@ -0,0 +1,75 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+int fs__make_dir(const char *parent, const char *prefix, char *path)
+{
+    int rv;
+
+    rv = snprintf(path, PATH_MAX, "%s/%s-XXXXXX", parent, prefix);
+    if (rv < 0 || rv >= PATH_MAX) {
+        fprintf(stderr, "error: directory path too long\n");
+        return -1;
+    }
+
+    if (mkdtemp(path) == NULL) {
+        perror("error: create directory");
+        return -1;
+    }
+
+    return 0;
+}
+
+void fs__remove_dir(const char *path)
+{
+    char filename[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+        unlink(filename);
+    }
+    closedir(dir);
+
+    rmdir(path);
+}
+
+void fs__evict_dir(const char *path)
+{
+    char filename[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_REG) {
+            continue;
+        }
+        snprintf(filename, sizeof filename, "%s/%s", path, entry->d_name);
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    closedir(dir);
+}
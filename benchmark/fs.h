@@ -0,0 +1,28 @@
+/**
+ * File system helpers.
+ */
+
+#ifndef BENCHMARK_FS_H
+#define BENCHMARK_FS_H
+
+#include <limits.h>
+
+/**
+ * Create a new uniquely named directory under @parent, with the given @prefix,
+ * and store its path in @path, which must hold PATH_MAX bytes.
+ */
+int fs__make_dir(const char *parent, const char *prefix, char *path);
+
+/**
+ * Remove the regular files in the directory at @path, and then the directory
+ * itself.
+ */
+void fs__remove_dir(const char *path);
+
+/**
+ * Drop the cached pages of the regular files in the directory at @path, so
+ * that they are read again from the device.
+ */
+void fs__evict_dir(const char *path);
+
+#endif /* BENCHMARK_FS_H */
@@ -0,0 +1,49 @@
+#include <string.h>
+
+#include "fsm.h"
+
+static int fsm_apply(struct raft_fsm *fsm, const struct raft_buffer *buf)
+{
+    (void)buf;
+    (*(unsigned long long *)fsm->data)++;
+    return 0;
+}
+
+static int fsm_snapshot(struct raft_fsm *fsm,
+                        struct raft_buffer *bufs[],
+                        unsigned *n_bufs)
+{
+    *bufs = raft_malloc(sizeof **bufs);
+    if (*bufs == NULL) {
+        return RAFT_ENOMEM;
+    }
+    (*bufs)[0].len = sizeof(unsigned long long);
+    (*bufs)[0].base = raft_malloc((*bufs)[0].len);
+    if ((*bufs)[0].base == NULL) {
+        raft_free(*bufs);
+        return RAFT_ENOMEM;
+    }
+    memcpy((*bufs)[0].base, fsm->data, (*bufs)[0].len);
+    *n_bufs = 1;
+    return 0;
+}
+
+static int fsm_restore(struct raft_fsm *fsm, struct raft_buffer *buf)
+{
+    if (buf->len == sizeof(unsigned long long)) {
+        memcpy(fsm->data, buf->base, buf->len);
+    }
+    raft_free(buf->base);
+    return 0;
+}
+
+void fsm__init(struct raft_fsm *fsm, unsigned long long *count)
+{
+    memset(fsm, 0, sizeof *fsm);
+    *count = 0;
+    fsm->version = 1;
+    fsm->data = count;
+    fsm->apply = fsm_apply;
+    fsm->snapshot = fsm_snapshot;
+    fsm->restore = fsm_restore;
+}
@@ -0,0 +1,16 @@
+/**
+ * Trivial state machine counting the commands it applies.
+ */
+
+#ifndef BENCHMARK_FSM_H
+#define BENCHMARK_FSM_H
+
+#include "../include/raft.h"
+
+/**
+ * Initialize a state machine storing the number of applied commands in
+ * @count, which is reset to zero.
+ */
+void fsm__init(struct raft_fsm *fsm, unsigned long long *count);
+
+#endif /* BENCHMARK_FSM_H */
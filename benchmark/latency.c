@@ -0,0 +1,61 @@
+#include <stdlib.h>
+
+#include "latency.h"
+
+void latency__init(struct latency *l)
+{
+    l->samples = NULL;
+    l->n = 0;
+    l->cap = 0;
+    l->sorted = true;
+}
+
+void latency__close(struct latency *l)
+{
+    free(l->samples);
+}
+
+int latency__add(struct latency *l, unsigned long long nsecs)
+{
+    if (l->n == l->cap) {
+        unsigned cap = l->cap == 0 ? 1024 : l->cap * 2;
+        unsigned long long *samples;
+        samples = realloc(l->samples, cap * sizeof *samples);
+        if (samples == NULL) {
+            return -1;
+        }
+        l->samples = samples;
+        l->cap = cap;
+    }
+    l->samples[l->n] = nsecs / 1000;
+    l->n++;
+    l->sorted = false;
+    return 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+unsigned long long latency__percentile(struct latency *l, double fraction)
+{
+    unsigned i;
+
+    if (l->n == 0) {
+        return 0;
+    }
+    if (!l->sorted) {
+        qsort(l->samples, l->n, sizeof *l->samples, compare);
+        l->sorted = true;
+    }
+
+    i = (unsigned)(fraction * l->n);
+    if (i >= l->n) {
+        i = l->n - 1;
+    }
+
+    return l->samples[i];
+}
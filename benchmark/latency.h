@@ -0,0 +1,36 @@
+/**
+ * Collect latency samples and compute their percentiles.
+ */
+
+#ifndef BENCHMARK_LATENCY_H
+#define BENCHMARK_LATENCY_H
+
+#include <stdbool.h>
+
+struct latency
+{
+    unsigned long long *samples; /* Recorded samples, in microseconds */
+    unsigned n;                  /* Number of samples */
+    unsigned cap;                /* Capacity of the samples array */
+    bool sorted;                 /* Whether samples are in ascending order */
+};
+
+/**
+ * Initialize an empty set of samples.
+ */
+void latency__init(struct latency *l);
+
+void latency__close(struct latency *l);
+
+/**
+ * Record a new sample, given in nanoseconds. Return -1 if out of memory.
+ */
+int latency__add(struct latency *l, unsigned long long nsecs);
+
+/**
+ * Return the sample below which the given fraction of all samples fall, in
+ * microseconds, or 0 if there are no samples.
+ */
+unsigned long long latency__percentile(struct latency *l, double fraction);
+
+#endif /* BENCHMARK_LATENCY_H */
@@ -0,0 +1,638 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+
+#include "benchmark.h"
+#include "fs.h"
+
+#define DEFAULT_ENTRIES 100000
+#define DEFAULT_SIZE 1024
+#define DEFAULT_BATCH 64
+#define DEFAULT_RUNS 3
+
+/* Appends in flight while generating the log. */
+#define GENERATE_INFLIGHT 4
+
+/* Size of the chunks of an installed snapshot. */
+#define INSTALL_CHUNK_SIZE (1024 * 1024)
+
+/* Parameters of the data directory to generate and load. */
+struct options
+{
+    unsigned long entries; /* Number of entries in the log */
+    size_t size;           /* Size of each entry */
+    unsigned batch;        /* Entries per append */
+    size_t segment_size;   /* Size of open segments, or 0 for the default */
+    size_t snapshot;       /* Size of the snapshot of the first half */
+    size_t install;        /* Size of the snapshot installed afterwards */
+    bool cold;             /* Whether to drop cached pages before loading */
+};
+
+/* A libuv-based raft_io instance operating on a data directory. */
+struct session
+{
+    struct uv_loop_s loop;
+    struct raft_io_uv_transport transport;
+    struct raft_io io;
+    unsigned n_pending; /* Requests in flight */
+    int status;         /* First error hit, if any */
+};
+
+static int session_open(struct session *s,
+                        const struct options *o,
+                        const char *dir)
+{
+    int rv;
+
+    s->n_pending = 0;
+    s->status = 0;
+
+    uv_loop_init(&s->loop);
+    raft_io_uv_tcp_init(&s->transport, &s->loop);
+    rv = raft_io_uv_init(&s->io, &s->loop, dir, &s->transport);
+    if (rv != 0) {
+        goto err;
+    }
+    s->io.log_level = RAFT_ERROR;
+
+    rv = s->io.init(&s->io, 1, "127.0.0.1:9001");
+    if (rv != 0) {
+        goto err_after_io_init;
+    }
+    if (o->segment_size > 0) {
+        rv = raft_io_uv_set_segment_size(&s->io, o->segment_size);
+        if (rv != 0) {
+            s->io.close(&s->io, NULL);
+            uv_run(&s->loop, UV_RUN_DEFAULT);
+            goto err_after_io_init;
+        }
+    }
+
+    return 0;
+
+err_after_io_init:
+    raft_io_uv_close(&s->io);
+err:
+    raft_io_uv_tcp_close(&s->transport);
+    uv_run(&s->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&s->loop);
+    fprintf(stderr, "error: open %s: %s\n", dir, raft_strerror(rv));
+    return rv;
+}
+
+/* Run the loop until all requests in flight have completed. */
+static int session_wait(struct session *s)
+{
+    while (s->n_pending > 0) {
+        uv_run(&s->loop, UV_RUN_ONCE);
+    }
+    return s->status;
+}
+
+static void session_close(struct session *s)
+{
+    s->io.close(&s->io, NULL);
+    uv_run(&s->loop, UV_RUN_DEFAULT);
+    raft_io_uv_close(&s->io);
+    raft_io_uv_tcp_close(&s->transport);
+    uv_run(&s->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&s->loop);
+}
+
+static void session_done(struct session *s, int status)
+{
+    s->n_pending--;
+    if (status != 0 && s->status == 0) {
+        s->status = status;
+    }
+}
+
+static void release_loaded(struct raft_snapshot *snapshot,
+                           struct raft_entry *entries,
+                           size_t n)
+{
+    void *batch = NULL;
+    size_t i;
+
+    if (snapshot != NULL) {
+        raft_configuration_close(&snapshot->configuration);
+        raft_free(snapshot->bufs[0].base);
+        raft_free(snapshot->bufs);
+        raft_free(snapshot);
+    }
+    for (i = 0; i < n; i++) {
+        if (entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_free(batch);
+        }
+    }
+    raft_free(entries);
+}
+
+/* State of the generation of a data directory. */
+struct generator
+{
+    const struct options *options;
+    struct session session;
+    unsigned long next;            /* Index of the next entry to append */
+    struct raft_snapshot snapshot; /* Snapshot being stored */
+    struct raft_buffer data;       /* Snapshot data */
+    struct raft_buffer chunk;      /* Chunk of the data being installed */
+    struct raft_io_snapshot_put put;
+};
+
+struct append
+{
+    struct generator *generator;
+    struct raft_entry *entries;
+};
+
+static void append_cb(void *data, int status);
+
+/* Submit new appends until the log has all its entries. */
+static void append_submit(struct generator *g)
+{
+    const struct options *o = g->options;
+    struct session *s = &g->session;
+
+    while (s->status == 0 && s->n_pending < GENERATE_INFLIGHT &&
+           g->next <= o->entries) {
+        struct append *a;
+        unsigned n = o->batch;
+        char *batch;
+        unsigned i;
+        int rv;
+
+        if (n > o->entries - g->next + 1) {
+            n = (unsigned)(o->entries - g->next + 1);
+        }
+        a = malloc(sizeof *a);
+        if (a == NULL) {
+            s->status = RAFT_ENOMEM;
+            return;
+        }
+        a->entries = raft_malloc(n * sizeof *a->entries);
+        batch = raft_malloc(n * o->size);
+        if (a->entries == NULL || batch == NULL) {
+            raft_free(batch);
+            raft_free(a->entries);
+            free(a);
+            s->status = RAFT_ENOMEM;
+            return;
+        }
+        memset(batch, g->next & 0xff, n * o->size);
+        for (i = 0; i < n; i++) {
+            a->entries[i].term = 1;
+            a->entries[i].type = RAFT_COMMAND;
+            a->entries[i].buf.base = batch + i * o->size;
+            a->entries[i].buf.len = o->size;
+            a->entries[i].batch = batch;
+        }
+        a->generator = g;
+
+        rv = s->io.append(&s->io, a->entries, n, a, append_cb);
+        if (rv != 0) {
+            raft_free(batch);
+            raft_free(a->entries);
+            free(a);
+            s->status = rv;
+            return;
+        }
+
+        g->next += n;
+        s->n_pending++;
+    }
+}
+
+static void append_cb(void *data, int status)
+{
+    struct append *a = data;
+    struct generator *g = a->generator;
+
+    raft_free(a->entries[0].batch);
+    raft_free(a->entries);
+    free(a);
+
+    session_done(&g->session, status);
+    append_submit(g);
+}
+
+static void put_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct generator *g = req->data;
+    session_done(&g->session, status);
+}
+
+static int snapshot_init(struct generator *g,
+                         raft_term term,
+                         raft_index index,
+                         size_t size)
+{
+    g->snapshot.term = term;
+    g->snapshot.index = index;
+    raft_configuration_init(&g->snapshot.configuration);
+    g->snapshot.configuration_index = 1;
+    g->data.len = size;
+    g->data.base = raft_malloc(size);
+    g->snapshot.bufs = &g->data;
+    g->snapshot.n_bufs = 1;
+    g->put.data = g;
+
+    if (g->data.base == NULL) {
+        return RAFT_ENOMEM;
+    }
+    memset(g->data.base, index & 0xff, size);
+
+    return raft_configuration_add(&g->snapshot.configuration, 1,
+                                  "127.0.0.1:9001", true);
+}
+
+static void snapshot_close(struct generator *g)
+{
+    raft_configuration_close(&g->snapshot.configuration);
+    raft_free(g->data.base);
+}
+
+/* Store a snapshot of the first half of the log, as done when the state
+ * machine is snapshotted. */
+static int generate_snapshot(struct generator *g)
+{
+    struct session *s = &g->session;
+    int rv;
+
+    rv = snapshot_init(g, 1, g->options->entries / 2, g->options->snapshot);
+    if (rv != 0) {
+        goto out;
+    }
+    rv = s->io.snapshot_put(&s->io, &g->put, &g->snapshot, put_cb);
+    if (rv != 0) {
+        goto out;
+    }
+    s->n_pending++;
+    rv = session_wait(s);
+
+out:
+    snapshot_close(g);
+    return rv;
+}
+
+static void install_chunk_cb(struct raft_io_snapshot_put *req, int status);
+
+/* Submit the chunk following the last one written. */
+static int install_submit(struct generator *g)
+{
+    struct session *s = &g->session;
+    size_t offset = 0;
+    bool done;
+    int rv;
+
+    if (g->chunk.base != NULL) {
+        offset = (size_t)((char *)g->chunk.base - (char *)g->data.base) +
+                 g->chunk.len;
+    }
+    g->chunk.base = (char *)g->data.base + offset;
+    g->chunk.len = g->data.len - offset;
+    if (g->chunk.len > INSTALL_CHUNK_SIZE) {
+        g->chunk.len = INSTALL_CHUNK_SIZE;
+    }
+    done = offset + g->chunk.len == g->data.len;
+
+    rv = s->io.snapshot_put_chunk(&s->io, &g->put, &g->snapshot, offset,
+                                  &g->chunk, done, install_chunk_cb);
+    if (rv != 0) {
+        return rv;
+    }
+    s->n_pending++;
+
+    return 0;
+}
+
+static void install_chunk_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct generator *g = req->data;
+    struct session *s = &g->session;
+    int rv;
+
+    session_done(s, status);
+    if (s->status != 0 ||
+        (char *)g->chunk.base + g->chunk.len == (char *)g->data.base +
+                                                     g->data.len) {
+        return;
+    }
+    rv = install_submit(g);
+    if (rv != 0) {
+        s->status = rv;
+    }
+}
+
+/* Install a snapshot past the end of the log, as a follower does when it
+ * receives it through InstallSnapshot RPCs: the whole log is truncated and the
+ * snapshot is written chunk by chunk. */
+static int generate_install(struct generator *g, uint64_t *duration)
+{
+    struct session *s = &g->session;
+    uint64_t start;
+    int rv;
+
+    rv = snapshot_init(g, 2, g->options->entries + 1, g->options->install);
+    if (rv != 0) {
+        goto out;
+    }
+    g->chunk.base = NULL;
+    g->chunk.len = 0;
+
+    start = uv_hrtime();
+    rv = s->io.truncate(&s->io, 1);
+    if (rv != 0) {
+        goto out;
+    }
+    rv = install_submit(g);
+    if (rv != 0) {
+        goto out;
+    }
+    rv = session_wait(s);
+    *duration = uv_hrtime() - start;
+
+out:
+    snapshot_close(g);
+    return rv;
+}
+
+static int generate(const struct options *o, const char *dir)
+{
+    struct generator g;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    struct raft_entry *entries;
+    size_t n_entries;
+    uint64_t start = uv_hrtime();
+    uint64_t install = 0;
+    int rv;
+
+    memset(&g, 0, sizeof g);
+    g.options = o;
+    g.next = 1;
+
+    rv = session_open(&g.session, o, dir);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = g.session.io.load(&g.session.io, &term, &voted_for, &snapshot,
+                           &entries, &n_entries);
+    if (rv != 0) {
+        goto out;
+    }
+    /* The data directory is fresh, so there's nothing to release. */
+
+    append_submit(&g);
+    rv = session_wait(&g.session);
+    if (rv == 0 && o->snapshot > 0) {
+        rv = generate_snapshot(&g);
+    }
+    printf("# generated %lu entries of %zu bytes in %.1f s\n", o->entries,
+           o->size, (double)(uv_hrtime() - start) / 1e9);
+    if (rv == 0 && o->install > 0) {
+        rv = generate_install(&g, &install);
+        printf("# installed a snapshot of %zu bytes in %.1f ms\n", o->install,
+               (double)install / 1e6);
+    }
+
+out:
+    fflush(stdout);
+    session_close(&g.session);
+    if (rv != 0) {
+        fprintf(stderr, "error: generate: %s\n", raft_strerror(rv));
+    }
+    return rv;
+}
+
+/* Load the data directory, as done when a server restarts. */
+static int load(const struct options *o,
+                const char *dir,
+                unsigned threads,
+                bool mmap,
+                unsigned run)
+{
+    struct session s;
+    struct raft_io_uv_stats stats;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    struct raft_entry *entries;
+    size_t n_entries;
+    size_t bytes;
+    uint64_t duration;
+    int rv;
+
+    if (o->cold) {
+        fs__evict_dir(dir);
+    }
+
+    rv = session_open(&s, o, dir);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = raft_io_uv_set_load_threads(&s.io, threads);
+    if (rv != 0) {
+        fprintf(stderr, "error: load threads: %s\n", raft_strerror(rv));
+        goto out;
+    }
+    raft_io_uv_set_load_mmap(&s.io, mmap);
+
+    duration = uv_hrtime();
+    rv = s.io.load(&s.io, &term, &voted_for, &snapshot, &entries, &n_entries);
+    duration = uv_hrtime() - duration;
+    if (rv != 0) {
+        fprintf(stderr, "error: load: %s\n", raft_strerror(rv));
+        goto out;
+    }
+
+    raft_io_uv_stats(&s.io, &stats);
+    bytes = n_entries * o->size;
+    if (snapshot != NULL) {
+        bytes += snapshot->bufs[0].len;
+    }
+    release_loaded(snapshot, entries, n_entries);
+
+    printf("%7u %4s %3u %9.1f %8.1f %8.1f %8.1f %8.1f %8llu %9llu %8.1f\n",
+           threads, mmap ? "on" : "off", run, (double)duration / 1e6,
+           (double)stats.load.list / 1e3, (double)stats.load.snapshot / 1e3,
+           (double)stats.load.segments / 1e3,
+           (double)stats.load.checksum / 1e3, stats.load.n_segments,
+           stats.load.n_entries,
+           (double)bytes / (1024 * 1024) / ((double)duration / 1e9));
+    fflush(stdout);
+
+out:
+    session_close(&s);
+    return rv;
+}
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark load [options] <dir>\n\n");
+    printf("Generate a data directory under <dir> and time how long it\n");
+    printf("takes to load it, as done when a server restarts, for each\n");
+    printf("combination of load threads and mmap modes.\n\n");
+    printf("  -n, --entries=N         entries in the log (%d)\n",
+           DEFAULT_ENTRIES);
+    printf("  -s, --size=N            entry size in bytes (%d)\n",
+           DEFAULT_SIZE);
+    printf("  -b, --batch=N           entries per append (%d)\n",
+           DEFAULT_BATCH);
+    printf("  -g, --segment-size=N    open segment size in bytes\n");
+    printf("  -S, --snapshot=N        snapshot the first half of the log,\n");
+    printf("                          with N bytes of data\n");
+    printf("  -i, --install=N         then install a snapshot of N bytes\n");
+    printf("                          past the log, replacing it\n");
+    printf("  -t, --threads=LIST      load threads (1,4)\n");
+    printf("  -m, --mmap=MODE         on, off or both (both)\n");
+    printf("  -r, --runs=N            loads of each combination (%d)\n",
+           DEFAULT_RUNS);
+    printf("  -C, --cold              drop cached pages before each load\n\n");
+    printf("Times are in milliseconds. The checksum time is part of the\n");
+    printf("segments time, summed across threads. The first load closes the\n");
+    printf("open segment, so it's the only one recovering it.\n");
+}
+
+static int parse_size(const char *arg, size_t *value)
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 1) {
+        return -1;
+    }
+    *value = values[0];
+    return 0;
+}
+
+int load__run(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"entries", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"batch", required_argument, NULL, 'b'},
+        {"segment-size", required_argument, NULL, 'g'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"install", required_argument, NULL, 'i'},
+        {"threads", required_argument, NULL, 't'},
+        {"mmap", required_argument, NULL, 'm'},
+        {"runs", required_argument, NULL, 'r'},
+        {"cold", no_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options o;
+    unsigned long threads[BENCHMARK__MAX_VALUES] = {1, 4};
+    unsigned n_threads = 2;
+    bool modes[2] = {true, true}; /* On and off */
+    size_t value = 0;
+    size_t runs = DEFAULT_RUNS;
+    char dir[PATH_MAX];
+    unsigned i, m, k;
+    int opt;
+    int rv;
+
+    memset(&o, 0, sizeof o);
+    o.entries = DEFAULT_ENTRIES;
+    o.size = DEFAULT_SIZE;
+    o.batch = DEFAULT_BATCH;
+
+    while ((opt = getopt_long(argc, argv, "n:s:b:g:S:i:t:m:r:Ch",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                rv = parse_size(optarg, &value);
+                o.entries = value;
+                break;
+            case 's':
+                rv = parse_size(optarg, &o.size);
+                break;
+            case 'b':
+                rv = parse_size(optarg, &value);
+                o.batch = (unsigned)value;
+                break;
+            case 'g':
+                rv = parse_size(optarg, &o.segment_size);
+                break;
+            case 'S':
+                rv = parse_size(optarg, &o.snapshot);
+                break;
+            case 'i':
+                rv = parse_size(optarg, &o.install);
+                break;
+            case 't':
+                rv = benchmark__parse_list(optarg, threads, &n_threads);
+                break;
+            case 'm':
+                rv = 0;
+                modes[0] = strcmp(optarg, "off") != 0;
+                modes[1] = strcmp(optarg, "on") != 0;
+                if (strcmp(optarg, "on") != 0 && strcmp(optarg, "off") != 0 &&
+                    strcmp(optarg, "both") != 0) {
+                    rv = -1;
+                }
+                break;
+            case 'r':
+                rv = parse_size(optarg, &runs);
+                break;
+            case 'C':
+                o.cold = true;
+                rv = 0;
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+
+    rv = fs__make_dir(argv[optind], "load", dir);
+    if (rv != 0) {
+        return 1;
+    }
+
+    rv = generate(&o, dir);
+    if (rv != 0) {
+        goto out;
+    }
+
+    printf("%7s %4s %3s %9s %8s %8s %8s %8s %8s %9s %8s\n", "threads", "mmap",
+           "run", "total", "list", "snapshot", "segments", "checksum",
+           "n_segs", "entries", "MB/s");
+
+    for (i = 0; i < n_threads; i++) {
+        for (m = 0; m < 2; m++) {
+            if (!modes[m]) {
+                continue;
+            }
+            for (k = 0; k < runs; k++) {
+                rv = load(&o, dir, (unsigned)threads[i], m == 0, k + 1);
+                if (rv != 0) {
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    fs__remove_dir(dir);
+    return rv == 0 ? 0 : 1;
+}
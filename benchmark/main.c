@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "benchmark.h"
+
+struct command
+{
+    const char *name;
+    const char *help;
+    int (*run)(int argc, char *argv[]);
+};
+
+static struct command commands[] = {
+    {"cluster", "replicate commands across a cluster", cluster__run},
+    {"disk", "append entries to a data directory", disk__run},
+    {"failover", "kill the leader and measure unavailability", failover__run},
+    {"load", "load a data directory at startup", load__run},
+    {"replay", "replay a recorded workload trace on the fixture",
+     replay__run},
+    {"snapshot", "send and install a snapshot on a new server",
+     snapshot__run},
+    {NULL, NULL, NULL},
+};
+
+int benchmark__parse_list(const char *arg, unsigned long *values, unsigned *n)
+{
+    const char *cursor = arg;
+    char *end;
+
+    *n = 0;
+    while (*cursor != '\0') {
+        unsigned long value = strtoul(cursor, &end, 10);
+        if (end == cursor || value == 0 || *n == BENCHMARK__MAX_VALUES) {
+            return -1;
+        }
+        values[*n] = value;
+        *n += 1;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        cursor = end;
+    }
+
+    return *n > 0 ? 0 : -1;
+}
+
+static void usage(void)
+{
+    struct command *c;
+
+    printf("usage: raft-benchmark <command> [options]\n\n");
+    printf("commands:\n");
+    for (c = commands; c->name != NULL; c++) {
+        printf("  %-10s %s\n", c->name, c->help);
+    }
+    printf("\nrun 'raft-benchmark <command> --help' for command options\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct command *c;
+
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    for (c = commands; c->name != NULL; c++) {
+        if (strcmp(argv[1], c->name) == 0) {
+            return c->run(argc - 1, argv + 1);
+        }
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,579 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+#if defined(RAFT_FIXTURE)
+#include "../include/raft/fixture.h"
+#endif
+
+#include "benchmark.h"
+#include "fsm.h"
+#include "latency.h"
+
+#define MAX_SERVERS 9
+#define DEFAULT_SEED 1
+#define MAX_ENTRIES 64
+
+/* Give up waiting for commands to commit this long after the last one was
+ * submitted, in ms. */
+#define DRAIN_TIMEOUT 10000
+
+/* Parameters of a replay. */
+struct options
+{
+    const char *path;    /* Trace to replay */
+    unsigned n_servers;  /* Cluster size, or 0 to infer it from the trace */
+    unsigned latency[2]; /* Network latency range, in ms */
+    unsigned disk[4];    /* Disk model, see raft_fixture_set_disk */
+    bool has_latency;    /* Whether the network latency was given */
+    bool has_disk;       /* Whether the disk model was given */
+    unsigned seed;       /* Seed of the random latencies of the fixture */
+};
+
+/* Entries appended by the recording server while it was leader, which are
+ * replayed as a single command each. */
+struct proposal
+{
+    unsigned long long time; /* Microseconds since the first proposal */
+    unsigned n;              /* Number of entries */
+    unsigned long long size; /* Bytes of entry data */
+};
+
+/* State of a peer of the recording server, to sample round trip times. */
+struct peer
+{
+    unsigned id;
+    unsigned n_outstanding;  /* AppendEntries sent and not answered yet */
+    unsigned long long sent; /* When a lone heartbeat was sent, or 0 */
+};
+
+/* Workload and latency model extracted from a trace. */
+struct trace
+{
+    struct proposal *proposals; /* Commands to submit */
+    unsigned n_proposals;
+    unsigned long long n_entries; /* Entries in all proposals */
+    unsigned long long bytes;     /* Bytes in all proposals */
+    struct latency append;        /* Latency of appends */
+    struct latency rtt;           /* Round trip time of heartbeats */
+    unsigned depth;               /* Most appends in flight */
+    struct peer peers[MAX_SERVERS - 1];
+    unsigned n_peers;
+};
+
+static struct peer *trace_peer(struct trace *t, unsigned id)
+{
+    unsigned i;
+
+    for (i = 0; i < t->n_peers; i++) {
+        if (t->peers[i].id == id) {
+            return &t->peers[i];
+        }
+    }
+    if (t->n_peers == MAX_SERVERS - 1) {
+        return NULL;
+    }
+    t->peers[t->n_peers].id = id;
+    t->peers[t->n_peers].n_outstanding = 0;
+    t->peers[t->n_peers].sent = 0;
+
+    return &t->peers[t->n_peers++];
+}
+
+/* Sample the round trip time of heartbeats sent while no other AppendEntries
+ * to the same peer was outstanding, since results of messages carrying
+ * entries also include the disk latency of the peer, and can be overtaken by
+ * results of later heartbeats. */
+static void trace_message(struct trace *t,
+                          const struct raft_io_uv_record *record)
+{
+    struct peer *peer = trace_peer(t, record->server_id);
+
+    if (peer == NULL) {
+        return;
+    }
+
+    if (record->kind == RAFT_IO_UV_RECORD_SEND &&
+        record->type == RAFT_IO_APPEND_ENTRIES) {
+        peer->sent = 0;
+        if (peer->n_outstanding == 0 && record->n == 0) {
+            peer->sent = record->time + 1;
+        }
+        peer->n_outstanding++;
+    } else if (record->kind == RAFT_IO_UV_RECORD_RECV &&
+               record->type == RAFT_IO_APPEND_ENTRIES_RESULT) {
+        if (peer->n_outstanding == 1 && peer->sent != 0) {
+            latency__add(&t->rtt, (record->time + 1 - peer->sent) * 1000);
+        }
+        if (peer->n_outstanding > 0) {
+            peer->n_outstanding--;
+        }
+        peer->sent = 0;
+    }
+}
+
+static int trace_add_proposal(struct trace *t,
+                              const struct raft_io_uv_record *record,
+                              unsigned *cap)
+{
+    struct proposal *p;
+
+    if (t->n_proposals == *cap) {
+        unsigned new_cap = *cap == 0 ? 1024 : *cap * 2;
+        p = realloc(t->proposals, new_cap * sizeof *p);
+        if (p == NULL) {
+            return -1;
+        }
+        t->proposals = p;
+        *cap = new_cap;
+    }
+
+    p = &t->proposals[t->n_proposals++];
+    p->time = record->time;
+    p->n = record->n;
+    p->size = record->size;
+    t->n_entries += record->n;
+    t->bytes += record->size;
+
+    return 0;
+}
+
+/* Read the trace at @path. The recording server is deemed leader whenever it
+ * last sent AppendEntries rather than received it, and its appends are then
+ * taken as commands. */
+static int trace_load(struct trace *t, const char *path)
+{
+    struct raft_io_uv_record record;
+    unsigned char buf[RAFT_IO_UV_RECORD_SIZE];
+    unsigned long long format = 0;
+    unsigned n_inflight = 0;
+    unsigned cap = 0;
+    bool leader = true;
+    FILE *file;
+    unsigned i;
+
+    memset(t, 0, sizeof *t);
+    latency__init(&t->append);
+    latency__init(&t->rtt);
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("error: open trace");
+        return -1;
+    }
+    if (fread(buf, 8, 1, file) == 1) {
+        for (i = 8; i > 0; i--) {
+            format = format << 8 | buf[i - 1]; /* Little endian */
+        }
+    }
+    if (format != RAFT_IO_UV_RECORD_FORMAT) {
+        fprintf(stderr, "error: %s is not a trace\n", path);
+        goto err;
+    }
+
+    while (fread(buf, sizeof buf, 1, file) == 1) {
+        raft_io_uv_decode_record(buf, &record);
+        switch (record.kind) {
+            case RAFT_IO_UV_RECORD_APPEND:
+                n_inflight++;
+                if (n_inflight > t->depth) {
+                    t->depth = n_inflight;
+                }
+                if (leader && trace_add_proposal(t, &record, &cap) != 0) {
+                    fprintf(stderr, "error: out of memory\n");
+                    goto err;
+                }
+                break;
+            case RAFT_IO_UV_RECORD_APPEND_DONE:
+                if (n_inflight > 0) {
+                    n_inflight--;
+                }
+                if (record.type == 0) {
+                    latency__add(&t->append, record.latency * 1000ULL);
+                }
+                break;
+            case RAFT_IO_UV_RECORD_SEND:
+            case RAFT_IO_UV_RECORD_RECV:
+                if (record.type == RAFT_IO_APPEND_ENTRIES) {
+                    leader = record.kind == RAFT_IO_UV_RECORD_SEND;
+                }
+                trace_message(t, &record);
+                break;
+        }
+    }
+    fclose(file);
+
+    for (i = t->n_proposals; i > 0; i--) {
+        t->proposals[i - 1].time -= t->proposals[0].time;
+    }
+
+    return 0;
+
+err:
+    fclose(file);
+    free(t->proposals);
+    latency__close(&t->append);
+    latency__close(&t->rtt);
+    return -1;
+}
+
+static void trace_close(struct trace *t)
+{
+    free(t->proposals);
+    latency__close(&t->append);
+    latency__close(&t->rtt);
+}
+
+/* Round microseconds to milliseconds. */
+static unsigned to_msecs(unsigned long long usecs)
+{
+    return (unsigned)((usecs + 500) / 1000);
+}
+
+/* Fit the latency models of the fixture to the trace, unless given: the disk
+ * sync latency ranges from the 10th to the 90th percentile of the recorded
+ * append latencies, and the one-way network latency from half the 5th to half
+ * the 50th percentile of the heartbeat round trips, but at least 1 ms since
+ * that's the resolution of the fixture. */
+static void fit_model(struct options *o, struct trace *t)
+{
+    if (!o->has_disk && t->append.n > 0) {
+        o->disk[0] = to_msecs(latency__percentile(&t->append, 0.1));
+        o->disk[1] = to_msecs(latency__percentile(&t->append, 0.9));
+        o->disk[2] = 0;
+        o->disk[3] = t->depth > 0 ? t->depth : 1;
+    }
+    if (!o->has_latency && t->rtt.n > 0) {
+        o->latency[0] = to_msecs(latency__percentile(&t->rtt, 0.05) / 2);
+        o->latency[1] = to_msecs(latency__percentile(&t->rtt, 0.5) / 2);
+        if (o->latency[0] == 0) {
+            o->latency[0] = 1;
+        }
+        if (o->latency[1] <= o->latency[0]) {
+            o->latency[1] = o->latency[0] + 1;
+        }
+    }
+    if (o->n_servers == 0) {
+        o->n_servers = t->n_peers + 1;
+    }
+}
+
+#if defined(RAFT_FIXTURE)
+
+struct replay
+{
+    struct raft_fixture *f;
+    struct latency latency; /* Commit latency of commands */
+    unsigned n_inflight;    /* Commands in flight */
+    unsigned long long n_committed;
+    unsigned long long n_failed;
+};
+
+struct op
+{
+    struct raft_apply req;
+    struct replay *replay;
+    raft_time submitted_at;
+};
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    struct op *op = req->data;
+    struct replay *r = op->replay;
+
+    r->n_inflight--;
+    if (status == 0) {
+        r->n_committed++;
+        latency__add(&r->latency,
+                     (r->f->time - op->submitted_at) * 1000000ULL);
+    } else {
+        r->n_failed++;
+    }
+    free(op);
+}
+
+/* Submit the proposal as a single command with its number of entries, up to
+ * MAX_ENTRIES, sharing its data evenly. */
+static void submit(struct replay *r, const struct proposal *p)
+{
+    struct raft_buffer bufs[MAX_ENTRIES];
+    unsigned n = p->n < MAX_ENTRIES ? p->n : MAX_ENTRIES;
+    struct op *op;
+    unsigned i;
+    int rv;
+
+    op = malloc(sizeof *op);
+    if (op == NULL) {
+        r->n_failed++;
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        bufs[i].len = p->size / n + (i < p->size % n ? 1 : 0);
+        if (bufs[i].len == 0) {
+            bufs[i].len = 8;
+        }
+        bufs[i].base = raft_calloc(1, bufs[i].len);
+        if (bufs[i].base == NULL) {
+            break;
+        }
+    }
+    if (i < n) {
+        while (i > 0) {
+            raft_free(bufs[--i].base);
+        }
+        free(op);
+        r->n_failed++;
+        return;
+    }
+
+    op->req.data = op;
+    op->replay = r;
+    op->submitted_at = r->f->time;
+
+    rv = raft_apply(raft_fixture_get(r->f, 0), &op->req, bufs, n, apply_cb);
+    if (rv != 0) {
+        for (i = 0; i < n; i++) {
+            raft_free(bufs[i].base);
+        }
+        free(op);
+        r->n_failed++;
+        return;
+    }
+    r->n_inflight++;
+}
+
+/* Submit each proposal at the time it was recorded, relative to the first, to
+ * server 0, stepping the fixture up to that time in between. */
+static int run(const struct options *o, const struct trace *t)
+{
+    struct raft_fixture f;
+    struct raft_configuration configuration;
+    struct raft_fsm fsms[MAX_SERVERS];
+    unsigned long long counts[MAX_SERVERS];
+    struct replay r;
+    raft_time start;
+    raft_time end;
+    unsigned i;
+    int rv;
+
+    srand(o->seed);
+
+    for (i = 0; i < o->n_servers; i++) {
+        fsm__init(&fsms[i], &counts[i]);
+    }
+
+    rv = raft_fixture_init(&f, o->n_servers, fsms);
+    if (rv != 0) {
+        goto err;
+    }
+    for (i = 0; i < o->n_servers; i++) {
+        raft_set_log_level(raft_fixture_get(&f, i), RAFT_ERROR);
+        raft_fixture_set_latency(&f, i, o->latency[0], o->latency[1]);
+        raft_fixture_set_disk(&f, i, o->disk[0], o->disk[1], o->disk[2],
+                              o->disk[3]);
+    }
+
+    rv = raft_fixture_configuration(&f, o->n_servers, &configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_bootstrap(&f, &configuration);
+    raft_configuration_close(&configuration);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+    rv = raft_fixture_start(&f);
+    if (rv != 0) {
+        goto err_after_fixture_init;
+    }
+
+    raft_fixture_elect(&f, 0);
+
+    memset(&r, 0, sizeof r);
+    r.f = &f;
+    latency__init(&r.latency);
+
+    start = f.time;
+    i = 0;
+    while (i < t->n_proposals) {
+        raft_time due = start + t->proposals[i].time / 1000;
+        if (f.time >= due) {
+            submit(&r, &t->proposals[i]);
+            i++;
+            continue;
+        }
+        raft_fixture_step_to(&f, due);
+    }
+    end = f.time + DRAIN_TIMEOUT;
+    while (r.n_inflight > 0 && f.time < end) {
+        raft_fixture_step(&f);
+    }
+
+    printf("%7u %7u %7u %9u %9u %6u %10llu %8llu %8llu %8llu %8llu %8llu "
+           "%8llu\n",
+           o->n_servers, o->latency[0], o->latency[1], o->disk[0], o->disk[1],
+           o->disk[3], r.n_committed, latency__percentile(&r.latency, 0.5),
+           latency__percentile(&r.latency, 0.9),
+           latency__percentile(&r.latency, 0.99),
+           latency__percentile(&r.latency, 0.999),
+           latency__percentile(&r.latency, 1), r.n_failed + r.n_inflight);
+
+    latency__close(&r.latency);
+    raft_fixture_close(&f);
+
+    return 0;
+
+err_after_fixture_init:
+    raft_fixture_close(&f);
+err:
+    fprintf(stderr, "error: fixture: %s\n", raft_strerror(rv));
+    return rv;
+}
+
+#endif /* RAFT_FIXTURE */
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark replay [options] <trace>\n\n");
+    printf("Replay on the in-memory fixture a trace recorded with\n");
+    printf("raft_io_uv_set_recording() on a leader: each batch of entries\n");
+    printf("it appended as leader is submitted again as a command at the\n");
+    printf("same relative time, and its commit latency is measured in\n");
+    printf("simulated time, with millisecond resolution. The cluster size\n");
+    printf("and the network and disk models are fitted to the trace, unless\n");
+    printf("given.\n\n");
+    printf("  -n, --servers=N         number of servers\n");
+    printf("  -l, --latency=MIN,MAX   network latency in ms, MIN < MAX\n");
+    printf("  -D, --disk=MIN,MAX,MBPS,DEPTH\n");
+    printf("                          disk sync latency in ms, bandwidth in\n");
+    printf("                          MB/s and queue depth\n");
+    printf("  -S, --seed=N            seed of the random latencies (%d)\n\n",
+           DEFAULT_SEED);
+    printf("Latencies are in microseconds, from raft_apply() to its\n");
+    printf("callback. The disk sync latency is fitted to the 10th and 90th\n");
+    printf("percentiles of the recorded append latencies, and the network\n");
+    printf("latency to half the 5th and 50th percentiles of the round trip\n");
+    printf("times of heartbeats sent while nothing else was outstanding.\n");
+}
+
+static int parse_one(const char *arg, unsigned *value)
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 1) {
+        return -1;
+    }
+    *value = (unsigned)values[0];
+    return 0;
+}
+
+int replay__run(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"servers", required_argument, NULL, 'n'},
+        {"latency", required_argument, NULL, 'l'},
+        {"disk", required_argument, NULL, 'D'},
+        {"seed", required_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options o;
+    struct trace t;
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    int opt;
+    int rv;
+
+    o.n_servers = 0;
+    o.latency[0] = 1;
+    o.latency[1] = 5;
+    memset(o.disk, 0, sizeof o.disk);
+    o.has_latency = false;
+    o.has_disk = false;
+    o.seed = DEFAULT_SEED;
+
+    while ((opt = getopt_long(argc, argv, "n:l:D:S:h", long_options, NULL)) !=
+           -1) {
+        switch (opt) {
+            case 'n':
+                rv = parse_one(optarg, &o.n_servers);
+                if (rv == 0 && o.n_servers > MAX_SERVERS) {
+                    rv = -1;
+                }
+                break;
+            case 'l':
+                rv = benchmark__parse_list(optarg, values, &n);
+                if (rv == 0 && (n != 2 || values[0] >= values[1])) {
+                    rv = -1;
+                }
+                if (rv == 0) {
+                    o.latency[0] = (unsigned)values[0];
+                    o.latency[1] = (unsigned)values[1];
+                    o.has_latency = true;
+                }
+                break;
+            case 'D':
+                rv = benchmark__parse_list(optarg, values, &n);
+                if (rv == 0 &&
+                    (n != 4 || values[0] > values[1] || values[2] > 4000)) {
+                    rv = -1;
+                }
+                if (rv == 0) {
+                    o.disk[0] = (unsigned)values[0];
+                    o.disk[1] = (unsigned)values[1];
+                    o.disk[2] = (unsigned)values[2] * 1000000;
+                    o.disk[3] = (unsigned)values[3];
+                    o.has_disk = true;
+                }
+                break;
+            case 'S':
+                rv = parse_one(optarg, &o.seed);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+    o.path = argv[optind];
+
+    if (trace_load(&t, o.path) != 0) {
+        return 1;
+    }
+    fit_model(&o, &t);
+
+    printf("%u commands, %llu entries, %llu bytes over %.3f s, %u appends "
+           "in flight at most, %u heartbeat round trips sampled\n\n",
+           t.n_proposals, t.n_entries, t.bytes,
+           t.n_proposals > 0
+               ? (double)t.proposals[t.n_proposals - 1].time / 1e6
+               : 0.0,
+           t.depth, t.rtt.n);
+
+#if defined(RAFT_FIXTURE)
+    printf("%7s %7s %7s %9s %9s %6s %10s %8s %8s %8s %8s %8s %8s\n",
+           "servers", "netmin", "netmax", "disk_min", "disk_max", "depth",
+           "commands", "p50", "p90", "p99", "p999", "max", "failed");
+    rv = run(&o, &t);
+#else
+    fprintf(stderr, "error: built without the fixture\n");
+    rv = -1;
+#endif
+
+    trace_close(&t);
+
+    return rv == 0 ? 0 : 1;
+}
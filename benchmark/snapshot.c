@@ -0,0 +1,727 @@
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+
+#include "benchmark.h"
+#include "fs.h"
+#include "latency.h"
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_SIZE 64
+#define DEFAULT_CHUNK 4096
+#define DEFAULT_TIMEOUT 60
+#define DEFAULT_PORT 9300
+
+/* Size of the chunks serialized by the streaming state machine. */
+#define FSM_CHUNK_SIZE (1024 * 1024)
+
+#define MEGABYTE (1024 * 1024)
+
+/* Parameters of a set of runs. */
+struct options
+{
+    unsigned runs;      /* Number of runs */
+    size_t size;        /* Size of the state machine snapshot */
+    size_t chunk;       /* Maximum size of an InstallSnapshot chunk */
+    bool streaming;     /* Whether the FSM serializes and restores in chunks */
+    unsigned timeout;   /* Time limit of a run, in seconds */
+    unsigned port;      /* First TCP port to listen to */
+    const char *dir;    /* Parent of the data directories */
+};
+
+/* State machine holding @size bytes of random data, which are serialized as is.
+ * Restored data is discarded, so the memory used on the receiving end is only
+ * the library's own. */
+struct state
+{
+    char *data;
+    size_t size;
+    size_t restored; /* Bytes restored so far */
+};
+
+static int state_apply(struct raft_fsm *fsm, const struct raft_buffer *buf)
+{
+    (void)fsm;
+    (void)buf;
+    return 0;
+}
+
+static int state_snapshot(struct raft_fsm *fsm,
+                          struct raft_buffer *bufs[],
+                          unsigned *n_bufs)
+{
+    struct state *s = fsm->data;
+
+    *bufs = raft_malloc(sizeof **bufs);
+    if (*bufs == NULL) {
+        return RAFT_ENOMEM;
+    }
+    (*bufs)[0].len = s->size;
+    (*bufs)[0].base = raft_malloc(s->size);
+    if ((*bufs)[0].base == NULL) {
+        raft_free(*bufs);
+        return RAFT_ENOMEM;
+    }
+    memcpy((*bufs)[0].base, s->data, s->size);
+    *n_bufs = 1;
+
+    return 0;
+}
+
+static int state_snapshot_chunk(struct raft_fsm *fsm,
+                                size_t offset,
+                                struct raft_buffer *buf,
+                                bool *done)
+{
+    struct state *s = fsm->data;
+    size_t len = s->size - offset;
+
+    if (len > FSM_CHUNK_SIZE) {
+        len = FSM_CHUNK_SIZE;
+    }
+    buf->len = len;
+    buf->base = raft_malloc(len > 0 ? len : 1);
+    if (buf->base == NULL) {
+        return RAFT_ENOMEM;
+    }
+    memcpy(buf->base, s->data + offset, len);
+    *done = offset + len == s->size;
+
+    return 0;
+}
+
+static int state_restore(struct raft_fsm *fsm, struct raft_buffer *buf)
+{
+    struct state *s = fsm->data;
+    s->restored = buf->len;
+    raft_free(buf->base);
+    return 0;
+}
+
+static int state_restore_chunk(struct raft_fsm *fsm,
+                               size_t offset,
+                               struct raft_buffer *buf,
+                               bool done)
+{
+    struct state *s = fsm->data;
+    (void)done;
+    s->restored = offset + buf->len;
+    raft_free(buf->base);
+    return 0;
+}
+
+static void state_init(struct raft_fsm *fsm,
+                       struct state *s,
+                       const struct options *o)
+{
+    memset(fsm, 0, sizeof *fsm);
+    fsm->version = 1;
+    fsm->data = s;
+    fsm->apply = state_apply;
+    fsm->snapshot = state_snapshot;
+    fsm->restore = state_restore;
+    if (o->streaming) {
+        fsm->version = 6;
+        fsm->snapshot_chunk = state_snapshot_chunk;
+        fsm->restore_chunk = state_restore_chunk;
+    }
+    s->data = NULL;
+    s->size = 0;
+    s->restored = 0;
+}
+
+/* Fill the state with data that doesn't compress. */
+static int state_fill(struct state *s, size_t size)
+{
+    unsigned long long x = 88172645463325252ULL;
+    size_t i;
+
+    s->data = malloc(size);
+    if (s->data == NULL) {
+        return RAFT_ENOMEM;
+    }
+    for (i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        s->data[i] = (char)x;
+    }
+    s->size = size;
+
+    return 0;
+}
+
+/* What each end reports to the parent process. Times are taken with
+ * uv_hrtime(), which is the same clock in all processes. */
+struct outcome
+{
+    int status;                      /* 0 if successful, or an error code */
+    bool timed_out;                  /* Whether the time limit was hit */
+    unsigned long long added_at;     /* When the follower was added */
+    unsigned long long sent_at;      /* When the leader sent the snapshot */
+    unsigned long long installed_at; /* When the follower installed it */
+    unsigned long long applied_at;   /* When it applied the first entry */
+    size_t bytes;                    /* Snapshot data sent or installed */
+    long rss;                        /* Peak resident set size, in KB */
+};
+
+enum {
+    NODE_ELECT,    /* Leader waiting to be elected */
+    NODE_SNAPSHOT, /* Leader waiting for its snapshot to be taken */
+    NODE_ADD,      /* Leader about to add the follower */
+    NODE_SEND,     /* Leader sending the snapshot to the follower */
+    NODE_RECEIVE,  /* Follower waiting for the snapshot and one entry */
+    NODE_DONE
+};
+
+/* A server running in its own process, so that its peak memory usage can be
+ * measured separately. Server 1 bootstraps itself as the only voter and becomes
+ * leader, takes a snapshot dropping all entries, then adds server 2, which
+ * starts with an empty data directory, and submits a command that it can only
+ * replicate to it after the snapshot. */
+struct node
+{
+    const struct options *options;
+    struct uv_loop_s loop;
+    struct uv_timer_s timer;
+    struct uv_signal_s signal; /* SIGTERM from the parent stops the server */
+    struct raft_io_uv_transport transport;
+    struct raft_io io;
+    struct raft_fsm fsm;
+    struct state state;
+    struct raft raft;
+    char dir[PATH_MAX];
+    char address[32];
+    int phase;                   /* Current phase of the run */
+    unsigned long long deadline; /* When to give up */
+    struct outcome outcome;
+};
+
+static void node_close_cb(struct raft *r)
+{
+    (void)r;
+}
+
+static void node_shutdown(struct node *n)
+{
+    if (n->phase == NODE_DONE) {
+        return;
+    }
+    n->phase = NODE_DONE;
+    uv_close((struct uv_handle_s *)&n->timer, NULL);
+    uv_close((struct uv_handle_s *)&n->signal, NULL);
+    raft_close(&n->raft, node_close_cb);
+}
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    (void)status;
+    free(req);
+}
+
+/* Submit an empty command to the leader. */
+static int node_submit(struct node *n)
+{
+    struct raft_apply *req;
+    struct raft_buffer buf;
+    int rv;
+
+    req = malloc(sizeof *req);
+    buf.len = 8;
+    buf.base = raft_malloc(buf.len);
+    if (req == NULL || buf.base == NULL) {
+        free(req);
+        raft_free(buf.base);
+        return RAFT_ENOMEM;
+    }
+    memset(buf.base, 0, buf.len);
+
+    rv = raft_apply(&n->raft, req, &buf, 1, apply_cb);
+    if (rv != 0) {
+        raft_free(buf.base);
+        free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Events are only recorded, and acted upon at the next tick, since the server
+ * can't be closed or reconfigured from within its own callbacks. */
+static void watch_cb(void *data, int event, void *payload)
+{
+    struct node *n = data;
+    struct raft_lifecycle_event *info = payload;
+
+    switch (event) {
+        case RAFT_EVENT_SNAPSHOT_TAKEN:
+            if (n->phase != NODE_SNAPSHOT) {
+                break;
+            }
+            n->outcome.status = info->status;
+            n->phase = NODE_ADD;
+            break;
+        case RAFT_EVENT_SNAPSHOT_SENT:
+            if (n->phase == NODE_SEND && n->outcome.sent_at == 0) {
+                n->outcome.sent_at = uv_hrtime();
+                n->outcome.bytes = info->bytes;
+            }
+            break;
+        case RAFT_EVENT_SNAPSHOT_INSTALLED:
+            n->outcome.status = info->status;
+            n->outcome.installed_at = uv_hrtime();
+            n->outcome.bytes = info->bytes;
+            break;
+        case RAFT_EVENT_COMMAND_APPLIED:
+            if (n->outcome.installed_at != 0 && n->outcome.applied_at == 0) {
+                n->outcome.applied_at = uv_hrtime();
+            }
+            break;
+    }
+}
+
+/* Add the follower and submit the entry it must apply after the snapshot. */
+static int node_add(struct node *n)
+{
+    char address[32];
+    int rv;
+
+    raft_set_snapshot_threshold(&n->raft, 0, 0, 0);
+    sprintf(address, "127.0.0.1:%u", n->options->port + 1);
+    n->outcome.added_at = uv_hrtime();
+
+    rv = raft_add_server(&n->raft, 2, address);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return node_submit(n);
+}
+
+static void timer_cb(uv_timer_t *timer)
+{
+    struct node *n = timer->data;
+    int rv = 0;
+
+    if (n->outcome.status != 0 || n->outcome.applied_at != 0) {
+        node_shutdown(n);
+        return;
+    }
+    if (uv_hrtime() >= n->deadline) {
+        n->outcome.timed_out = true;
+        node_shutdown(n);
+        return;
+    }
+
+    switch (n->phase) {
+        case NODE_ELECT:
+            if (raft_state(&n->raft) != RAFT_LEADER) {
+                break;
+            }
+            n->phase = NODE_SNAPSHOT;
+            raft_set_snapshot_threshold(&n->raft, 1, 0, 0);
+            rv = node_submit(n);
+            break;
+        case NODE_ADD:
+            n->phase = NODE_SEND;
+            rv = node_add(n);
+            break;
+    }
+    if (rv != 0) {
+        n->outcome.status = rv;
+        node_shutdown(n);
+    }
+}
+
+/* The parent sends SIGTERM to the leader once the follower is done. */
+static void signal_cb(uv_signal_t *signal, int signum)
+{
+    struct node *n = signal->data;
+    (void)signum;
+    node_shutdown(n);
+}
+
+static int node_start(struct node *n, unsigned id)
+{
+    const struct options *o = n->options;
+    struct raft_configuration configuration;
+    int rv;
+
+    rv = fs__make_dir(o->dir, "snapshot", n->dir);
+    if (rv != 0) {
+        return RAFT_ERR_IO;
+    }
+    sprintf(n->address, "127.0.0.1:%u", o->port + id - 1);
+
+    rv = raft_io_uv_tcp_init(&n->transport, &n->loop);
+    if (rv != 0) {
+        goto err_after_make_dir;
+    }
+    rv = raft_io_uv_init(&n->io, &n->loop, n->dir, &n->transport);
+    if (rv != 0) {
+        goto err_after_tcp_init;
+    }
+
+    rv = raft_init(&n->raft, &n->io, &n->fsm, id, n->address);
+    if (rv != 0) {
+        goto err_after_io_init;
+    }
+    n->raft.data = n;
+    raft_set_log_level(&n->raft, RAFT_ERROR);
+    raft_set_snapshot_threshold(&n->raft, 0, 0, 0);
+    raft_set_snapshot_trailing(&n->raft, 0, 0);
+    raft_set_snapshot_chunk_size(&n->raft, o->chunk);
+    raft_watch(&n->raft, RAFT_EVENT_SNAPSHOT_TAKEN, watch_cb);
+    raft_watch(&n->raft, RAFT_EVENT_SNAPSHOT_SENT, watch_cb);
+    raft_watch(&n->raft, RAFT_EVENT_SNAPSHOT_INSTALLED, watch_cb);
+    raft_watch(&n->raft, RAFT_EVENT_COMMAND_APPLIED, watch_cb);
+
+    if (id == 1) {
+        raft_configuration_init(&configuration);
+        rv = raft_configuration_add(&configuration, id, n->address, true);
+        if (rv == 0) {
+            rv = raft_bootstrap(&n->raft, &configuration);
+        }
+        raft_configuration_close(&configuration);
+        if (rv != 0) {
+            goto err_after_raft_init;
+        }
+    }
+
+    rv = raft_start(&n->raft);
+    if (rv != 0) {
+        goto err_after_raft_init;
+    }
+
+    return 0;
+
+err_after_raft_init:
+    raft_close(&n->raft, NULL);
+    uv_run(&n->loop, UV_RUN_NOWAIT);
+err_after_io_init:
+    raft_io_uv_close(&n->io);
+err_after_tcp_init:
+    raft_io_uv_tcp_close(&n->transport);
+err_after_make_dir:
+    fs__remove_dir(n->dir);
+    return rv;
+}
+
+/* Run server @id in the current process and write its outcome to @out_fd. */
+static void node_run(const struct options *o, unsigned id, int out_fd)
+{
+    struct node n;
+    struct rusage usage;
+    ssize_t written;
+    int rv;
+
+    memset(&n, 0, sizeof n);
+    n.options = o;
+    n.phase = id == 1 ? NODE_ELECT : NODE_RECEIVE;
+    n.deadline = uv_hrtime() + o->timeout * 1000000000ULL;
+
+    state_init(&n.fsm, &n.state, o);
+    if (id == 1) {
+        rv = state_fill(&n.state, o->size);
+        if (rv != 0) {
+            n.outcome.status = rv;
+            goto out;
+        }
+    }
+
+    uv_loop_init(&n.loop);
+    uv_signal_init(&n.loop, &n.signal);
+    n.signal.data = &n;
+    uv_signal_start(&n.signal, signal_cb, SIGTERM);
+
+    rv = node_start(&n, id);
+    if (rv != 0) {
+        n.outcome.status = rv;
+        uv_close((struct uv_handle_s *)&n.signal, NULL);
+        uv_run(&n.loop, UV_RUN_DEFAULT);
+        uv_loop_close(&n.loop);
+        goto out;
+    }
+
+    uv_timer_init(&n.loop, &n.timer);
+    n.timer.data = &n;
+    uv_timer_start(&n.timer, timer_cb, 1, 1);
+
+    uv_run(&n.loop, UV_RUN_DEFAULT);
+    raft_io_uv_close(&n.io);
+    raft_io_uv_tcp_close(&n.transport);
+    uv_run(&n.loop, UV_RUN_DEFAULT);
+    uv_loop_close(&n.loop);
+    fs__remove_dir(n.dir);
+
+out:
+    free(n.state.data);
+    getrusage(RUSAGE_SELF, &usage);
+    n.outcome.rss = usage.ru_maxrss;
+    written = write(out_fd, &n.outcome, sizeof n.outcome);
+    (void)written;
+}
+
+/* Fork a process running server @id, returning its PID and setting @fd to the
+ * pipe its outcome will be read from. */
+static pid_t spawn(const struct options *o, unsigned id, int *fd)
+{
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        node_run(o, id, fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    *fd = fds[0];
+
+    return pid;
+}
+
+/* Read the outcome of a server process and reap it. */
+static int collect(pid_t pid, int fd, struct outcome *outcome)
+{
+    ssize_t n = read(fd, outcome, sizeof *outcome);
+    close(fd);
+    waitpid(pid, NULL, 0);
+    return n == (ssize_t)sizeof *outcome ? 0 : -1;
+}
+
+/* A single run: transfer the snapshot of the leader to a new follower. */
+static int run_one(const struct options *o,
+                   struct outcome *leader,
+                   struct outcome *follower)
+{
+    pid_t pids[2];
+    int fds[2];
+    int rv;
+
+    /* The follower listens before the leader tries to reach it. */
+    pids[1] = spawn(o, 2, &fds[1]);
+    if (pids[1] < 0) {
+        return -1;
+    }
+    pids[0] = spawn(o, 1, &fds[0]);
+    if (pids[0] < 0) {
+        kill(pids[1], SIGKILL);
+        collect(pids[1], fds[1], follower);
+        return -1;
+    }
+
+    /* If the follower failed early, the leader might be killed before it
+     * handles the signal, and only the follower's outcome matters. */
+    rv = collect(pids[1], fds[1], follower);
+    kill(pids[0], SIGTERM);
+    if (collect(pids[0], fds[0], leader) != 0) {
+        memset(leader, 0, sizeof *leader);
+        if (rv == 0 && follower->status == 0 && !follower->timed_out) {
+            rv = -1;
+        }
+    }
+
+    return rv;
+}
+
+static void usage(void)
+{
+    printf("usage: raft-benchmark snapshot [options] <dir>\n\n");
+    printf("Take a snapshot of a state machine on a leader, add a server\n");
+    printf("with an empty data directory and measure how long it takes to\n");
+    printf("receive and install the snapshot. Both servers run the libuv\n");
+    printf("backend in data directories created under <dir>, in separate\n");
+    printf("processes talking over loopback TCP.\n\n");
+    printf("  -R, --runs=N        runs for each setting (%d)\n", DEFAULT_RUNS);
+    printf("  -s, --size=LIST     snapshot sizes in megabytes (%d)\n",
+           DEFAULT_SIZE);
+    printf("  -c, --chunk=LIST    InstallSnapshot chunk sizes in KB (%d)\n",
+           DEFAULT_CHUNK);
+    printf("  -S, --streaming     serialize and restore the FSM in chunks\n");
+    printf("  -t, --timeout=SECS  time limit of a run (%d)\n",
+           DEFAULT_TIMEOUT);
+    printf("  -p, --port=PORT     first TCP port (%d)\n\n", DEFAULT_PORT);
+    printf("Times are in milliseconds from adding the server, until it has\n");
+    printf("installed the snapshot (install) and until it has applied the\n");
+    printf("first entry after it (apply). Throughput is the snapshot size\n");
+    printf("over the median install time. Peak RSS is in megabytes, the\n");
+    printf("leader's including the state itself, the follower's only what\n");
+    printf("the library uses, since the restored data is discarded.\n");
+}
+
+static int parse_one(const char *arg, unsigned *value)
+{
+    unsigned long values[BENCHMARK__MAX_VALUES];
+    unsigned n;
+    if (benchmark__parse_list(arg, values, &n) != 0 || n != 1) {
+        return -1;
+    }
+    *value = (unsigned)values[0];
+    return 0;
+}
+
+/* Run all the runs with the current settings and report their outcome. */
+static int run_all(const struct options *o)
+{
+    struct latency installed;
+    struct latency applied;
+    long leader_rss = 0;
+    long follower_rss = 0;
+    double install50;
+    unsigned i;
+    int rv = 0;
+
+    latency__init(&installed);
+    latency__init(&applied);
+
+    for (i = 0; i < o->runs; i++) {
+        struct outcome leader;
+        struct outcome follower;
+
+        rv = run_one(o, &leader, &follower);
+        if (rv != 0) {
+            fprintf(stderr, "error: can't run servers\n");
+            break;
+        }
+        if (leader.status != 0 || follower.status != 0) {
+            rv = leader.status != 0 ? leader.status : follower.status;
+            fprintf(stderr, "error: %s\n", raft_strerror(rv));
+            break;
+        }
+        if (follower.timed_out || follower.applied_at == 0) {
+            fprintf(stderr, "error: snapshot not installed within %us\n",
+                    o->timeout);
+            rv = -1;
+            break;
+        }
+        latency__add(&installed, follower.installed_at - leader.added_at);
+        latency__add(&applied, follower.applied_at - leader.added_at);
+        if (leader.rss > leader_rss) {
+            leader_rss = leader.rss;
+        }
+        if (follower.rss > follower_rss) {
+            follower_rss = follower.rss;
+        }
+    }
+
+    if (rv == 0) {
+        install50 = latency__percentile(&installed, 0.5) / 1000.0;
+        printf("%8zu %8zu %9s %5u %9.1f %9.1f %8.1f %8.1f %8.1f %8.1f\n",
+               o->size / MEGABYTE, o->chunk / 1024,
+               o->streaming ? "stream" : "whole", o->runs, install50,
+               latency__percentile(&installed, 1) / 1000.0,
+               install50 > 0 ? o->size / (double)MEGABYTE / install50 * 1000
+                             : 0,
+               latency__percentile(&applied, 0.5) / 1000.0,
+               leader_rss / 1024.0, follower_rss / 1024.0);
+        fflush(stdout);
+    }
+
+    latency__close(&installed);
+    latency__close(&applied);
+
+    return rv;
+}
+
+int snapshot__run(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"runs", required_argument, NULL, 'R'},
+        {"size", required_argument, NULL, 's'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"streaming", no_argument, NULL, 'S'},
+        {"timeout", required_argument, NULL, 't'},
+        {"port", required_argument, NULL, 'p'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct options o;
+    unsigned long sizes[BENCHMARK__MAX_VALUES] = {DEFAULT_SIZE};
+    unsigned long chunks[BENCHMARK__MAX_VALUES] = {DEFAULT_CHUNK};
+    unsigned n_sizes = 1;
+    unsigned n_chunks = 1;
+    unsigned i, j;
+    int opt;
+    int rv;
+
+    o.runs = DEFAULT_RUNS;
+    o.streaming = false;
+    o.timeout = DEFAULT_TIMEOUT;
+    o.port = DEFAULT_PORT;
+
+    while ((opt = getopt_long(argc, argv, "R:s:c:St:p:h", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+            case 'R':
+                rv = parse_one(optarg, &o.runs);
+                break;
+            case 's':
+                rv = benchmark__parse_list(optarg, sizes, &n_sizes);
+                break;
+            case 'c':
+                rv = benchmark__parse_list(optarg, chunks, &n_chunks);
+                break;
+            case 'S':
+                o.streaming = true;
+                rv = 0;
+                break;
+            case 't':
+                rv = parse_one(optarg, &o.timeout);
+                break;
+            case 'p':
+                rv = parse_one(optarg, &o.port);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                rv = -1;
+                break;
+        }
+        if (rv != 0) {
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 1;
+    }
+    o.dir = argv[optind];
+
+    printf("%8s %8s %9s %5s %9s %9s %8s %8s %8s %8s\n", "size", "chunk",
+           "fsm", "runs", "install50", "installmx", "MB/s", "apply50",
+           "leadrss", "follrss");
+
+    for (i = 0; i < n_sizes; i++) {
+        for (j = 0; j < n_chunks; j++) {
+            o.size = sizes[i] * MEGABYTE;
+            o.chunk = chunks[j] * 1024;
+            if (run_all(&o) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
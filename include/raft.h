@@ -21,6 +21,7 @@ enum {
     RAFT_ERR_LEADERSHIP_LOST,
     RAFT_ERR_SHUTDOWN,
     RAFT_ERR_CONFIGURATION_BUSY,
+    RAFT_ERR_TIMEOUT,
     RAFT_ERR_IO,
     RAFT_ERR_IO_CORRUPT,
     RAFT_ERR_IO_CANCELED,
@@ -29,7 +30,9 @@ enum {
     RAFT_ERR_IO_MALFORMED,
     RAFT_ERR_IO_NOTEMPTY,
     RAFT_ERR_IO_TOOBIG,
-    RAFT_ERR_IO_CONNECT
+    RAFT_ERR_IO_CONNECT,
+    RAFT_EINVAL,
+    RAFT_EBACKPRESSURE
 };
 
 /**
@@ -48,6 +51,7 @@ enum {
     X(RAFT_ERR_LEADERSHIP_LOST, "server has lost leadership")            \
     X(RAFT_ERR_CONFIGURATION_BUSY,                                       \
       "a configuration change is already in progress")                   \
+    X(RAFT_ERR_TIMEOUT, "operation timed out")                           \
     X(RAFT_ERR_IO, "I/O error")                                          \
     X(RAFT_ERR_IO_CORRUPT, "persisted data is corrupted")                \
     X(RAFT_ERR_IO_CANCELED, "operation canceled")                        \
@@ -56,7 +60,9 @@ enum {
     X(RAFT_ERR_IO_MALFORMED, "encoded data is malformed")                \
     X(RAFT_ERR_IO_NOTEMPTY, "persisted log is not empty")                \
     X(RAFT_ERR_IO_TOOBIG, "data is too big")                             \
-    X(RAFT_ERR_IO_CONNECT, "no connection to remote server available")
+    X(RAFT_ERR_IO_CONNECT, "no connection to remote server available")  \
+    X(RAFT_EINVAL, "invalid parameter")                                  \
+    X(RAFT_EBACKPRESSURE, "too much uncommitted data")
 
 /**
  * Return the error message describing the given error code.
@@ -92,9 +98,28 @@ struct raft_buffer
  */
 struct raft_server
 {
-    unsigned id;   /* Server ID, must be greater than zero. */
-    char *address; /* Server address. User defined. */
-    bool voting;   /* Whether this is a voting server. */
+    unsigned id;             /* Server ID, must be greater than zero. */
+    char *address;           /* Server address. User defined. */
+    bool voting;             /* Whether this is a voting server. */
+    bool witness;            /* Whether this is a witness, see below. */
+    unsigned short priority; /* Election priority, see below. */
+    int joint;               /* Side of a joint configuration, see below. */
+};
+
+/**
+ * Highest election priority of a server.
+ */
+#define RAFT_MAX_PRIORITY 255
+
+/**
+ * Side of a joint configuration that a voting server belongs to, while the
+ * cluster transitions from an old set of voters to a new one, see
+ * raft_replace_voters(). Voters that are part of both sets, and all voters of
+ * a non-joint configuration, have a zero value.
+ */
+enum {
+    RAFT_OUTGOING = 1, /* Voter only in the old set. */
+    RAFT_INCOMING      /* Voter only in the new set. */
 };
 
 /**
@@ -104,6 +129,10 @@ struct raft_configuration
 {
     struct raft_server *servers; /* Array of servers member of the cluster. */
     unsigned n;                  /* Number of servers in the array. */
+    unsigned n_voting;           /* Cached number of voting servers. */
+    unsigned n_outgoing;         /* Cached number of outgoing voters. */
+    unsigned n_incoming;         /* Cached number of incoming voters. */
+    void *lookup;                /* Cached ID lookup table, if large. */
 };
 
 /**
@@ -132,10 +161,38 @@ int raft_configuration_add(struct raft_configuration *c,
                            const char *address,
                            const bool voting);
 
+/**
+ * Add a witness server to a raft configuration, with the same rules as
+ * raft_configuration_add().
+ *
+ * A witness is a voting server that only breaks ties: it receives the index
+ * and term of each log entry but not the payload of RAFT_COMMAND entries, and
+ * it is never sent snapshot data. It can't become leader and its FSM is never
+ * invoked. Since its log has no payloads, a witness can't be turned into a
+ * regular server, it must be removed and added back with a fresh log.
+ */
+int raft_configuration_add_witness(struct raft_configuration *c,
+                                   const unsigned id,
+                                   const char *address);
+
+/**
+ * Set the election priority of the server with the given ID, between 0 (the
+ * default) and #RAFT_MAX_PRIORITY.
+ *
+ * When there's no leader, servers with a higher priority time out earlier than
+ * others, so they are likely to win the election. A leader with a lower
+ * priority than a voting follower whose log is up-to-date transfers leadership
+ * to it. Configurations with non-zero priorities can't be decoded by versions
+ * of this library which don't support them.
+ */
+int raft_configuration_set_priority(struct raft_configuration *c,
+                                    unsigned id,
+                                    unsigned short priority);
+
 /**
  * Log entry types.
  */
-enum { RAFT_COMMAND = 1, RAFT_CONFIGURATION };
+enum { RAFT_COMMAND = 1, RAFT_CONFIGURATION, RAFT_BATCH };
 
 /**
  * A single entry in the raft log.
@@ -173,6 +230,17 @@ struct raft_entry
     void *batch;            /* Batch that buf's memory points to, if any. */
 };
 
+/**
+ * Counter for the entries of a batch that are still alive, i.e. that are either
+ * in the log or have outstanding references. When it drops to zero, the memory
+ * that @batch points to gets released.
+ */
+struct raft_batch_ref
+{
+    void *batch;    /* Memory shared by the entries of the batch */
+    unsigned count; /* Number of live entries of the batch */
+};
+
 /**
  * Counter for outstanding references to a log entry. When an entry is first
  * appended to the log, its refcount is set to one (the log itself is the only
@@ -182,33 +250,105 @@ struct raft_entry
  * decreased by one. Likewise, whenever an I/O request is completed the refcount
  * of the relevant entries is decreased by one. When the refcount drops to zero
  * the memory that its @buf attribute points to gets released, or, if the @batch
- * attribute is non-NULL, a check is made to see if all other entries of the
- * same batch also have a zero refcount, and the memory that @batch points to
- * gets released if that's the case.
+ * attribute is non-NULL, the counter of live entries of the batch is decreased
+ * and the memory that @batch points to gets released if it drops to zero.
+ *
+ * The refcounts of the entries in the log are stored in an array parallel to
+ * the circular buffer of entries. Entries deleted from the log while still
+ * being referenced have their refcount moved to a list of detached entries.
  */
 struct raft_entry_ref
 {
-    raft_term term;              /* Term of the entry being ref-counted */
-    raft_index index;            /* Index of the entry being ref-counted */
-    unsigned short count;        /* Number of references */
-    struct raft_entry_ref *next; /* Next item in the bucket (for collisions) */
+    raft_term term;               /* Term of the entry being ref-counted */
+    raft_index index;             /* Index of the entry being ref-counted */
+    unsigned short count;         /* Number of references */
+    struct raft_batch_ref *batch; /* Counter of the entry's batch, if any */
+    struct raft_entry_ref *next;  /* Next detached entry */
+};
+
+/**
+ * Number of entry slots in each block of the in-memory log.
+ */
+#define RAFT_LOG_BLOCK_SIZE 256
+
+/**
+ * Fixed-size block of log entries, along with their reference counts.
+ */
+struct raft_log_block
+{
+    struct raft_entry entries[RAFT_LOG_BLOCK_SIZE];
+    struct raft_entry_ref refs[RAFT_LOG_BLOCK_SIZE];
+};
+
+/**
+ * Run of consecutive log entries with the same term.
+ */
+struct raft_log_run
+{
+    raft_term term;   /* Term of the entries in the run */
+    raft_index first; /* Index of the first entry in the run */
 };
 
 /**
  * In-memory cache of the persistent raft log stored on disk.
  *
- * The raft log cache is implemented as a circular buffer of log entries, which
- * makes some frequent operations very efficient (e.g. deleting the first N
- * entries when snapshotting).
+ * The raft log cache is implemented as a deque of fixed-size blocks of log
+ * entries, which makes some frequent operations very efficient (e.g. deleting
+ * the first N entries when snapshotting) and lets it grow and shrink one block
+ * at a time, without ever moving entries around.
+ *
+ * The slots of the blocks in use are numbered from 0 to @size, starting from
+ * the first slot of the block at position @head in the blocks ring.
+ *
+ * The @runs table tracks where each term starts, so terms can be looked up in
+ * O(log terms), also for the last entries shifted away by a snapshot, back to
+ * the first entry with their term.
  */
 struct raft_log
 {
-    struct raft_entry *entries;  /* Buffer of log entries. */
-    size_t size;                 /* Number of available slots in the buffer */
-    size_t front, back;          /* Indexes of used slots [front, back). */
-    raft_index offset;           /* Index offest of the first entry. */
-    struct raft_entry_ref *refs; /* Log entries reference counts hash table */
-    size_t refs_size;            /* Size of the reference counts hash table */
+    struct raft_log_block **blocks;  /* Ring of pointers to blocks in use */
+    size_t n_blocks;                 /* Length of the blocks ring */
+    size_t head;                     /* Position of the first block in use */
+    size_t size;                     /* Number of slots of the blocks in use */
+    size_t front, back;              /* Indexes of used slots [front, back). */
+    raft_index offset;               /* Index offest of the first entry. */
+    struct raft_entry_ref *detached; /* Deleted entries still referenced */
+    raft_index evicted;              /* Last entry whose payload was evicted */
+    size_t n_bytes;                  /* Size of payloads held in memory */
+    struct raft_log_run *runs;       /* Terms of entries, including shifted */
+    size_t n_runs;                   /* Number of runs in use */
+    size_t runs_cap;                 /* Length of the runs array */
+};
+
+/**
+ * Free-list of fixed-size objects, used internally to recycle the request
+ * objects allocated at a steady pace on the replication path.
+ */
+struct raft_pool
+{
+    void *free;      /* First free object, linked through its first bytes */
+    unsigned n_free; /* Number of free objects */
+    unsigned n_used; /* Number of objects currently handed out */
+    unsigned peak;   /* Highest number of objects handed out at once */
+};
+
+/**
+ * Smoothed estimate of a time interval, such as a round-trip time.
+ */
+struct raft_interval
+{
+    unsigned mean; /* Mean of the samples, in msecs times 8 */
+    unsigned var;  /* Mean deviation of the samples, in msecs times 4 */
+    bool sampled;  /* Whether any sample was taken */
+};
+
+/**
+ * Token bucket limiting the rate at which background data is sent.
+ */
+struct raft_bucket
+{
+    raft_time time;   /* Time of the last refill */
+    long long tokens; /* Bytes that can be sent, negative if overdrawn */
 };
 
 /**
@@ -222,6 +362,8 @@ struct raft_request_vote
     unsigned candidate_id;     /* ID of the server requesting the vote. */
     raft_index last_log_index; /* Index of candidate's last log entry. */
     raft_index last_log_term;  /* Term of log entry at last_log_index. */
+    bool pre_vote;             /* True if this is a pre-vote request. */
+    bool disrupt_leader;       /* True if sent because of TimeoutNow. */
 };
 
 /**
@@ -231,6 +373,7 @@ struct raft_request_vote_result
 {
     raft_term term;    /* Receiver's current_term (candidate updates itself). */
     bool vote_granted; /* True means candidate received vote. */
+    bool pre_vote;     /* True if this is the result of a pre-vote request. */
 };
 
 /**
@@ -248,6 +391,8 @@ struct raft_append_entries
     raft_index leader_commit;   /* Leader's commit_index. */
     struct raft_entry *entries; /* Log entries to append. */
     unsigned n_entries;         /* Size of the log entries array. */
+    bool hibernate;             /* Leader stops sending heartbeats. */
+    raft_index seq;             /* Leader's heartbeat round. */
 };
 
 /**
@@ -258,6 +403,11 @@ struct raft_append_entries_result
     raft_term term; /* Receiver's current_term, for leader to update itself. */
     bool success; /* True if follower had entry matching prev_log_index/term. */
     raft_index last_log_index; /* Receiver's last log entry index, as hint */
+    raft_term conflict_term;   /* Term of the entry at prev_log_index, if any */
+    raft_index conflict_index; /* First index of conflict_term, as hint */
+    raft_index snapshot_index; /* Snapshot being received, if resumable */
+    size_t snapshot_offset;    /* Its data received so far, or 0 */
+    raft_index seq;            /* Latest heartbeat round received */
 };
 
 /**
@@ -271,7 +421,88 @@ struct raft_install_snapshot
     raft_term last_term;   /* Term of last_index */
     struct raft_configuration conf; /* Config as of last_index */
     raft_index conf_index;          /* Index of configuration */
-    struct raft_buffer data;        /* Raw snapshot data */
+    size_t offset;                  /* Offset of this chunk in the data */
+    bool done;                      /* Whether this is the last chunk */
+    struct raft_buffer data;        /* Raw snapshot data chunk */
+};
+
+/**
+ * Hold the arguments of a ReadIndex RPC, sent by followers to ask the leader for
+ * a commit index that is safe to serve linearizable reads from (Section 6.4).
+ */
+struct raft_read_index
+{
+    raft_term term; /* Follower's current term. */
+    raft_index id;  /* Request identifier, echoed back by the leader. */
+};
+
+/**
+ * Hold the result of a ReadIndex RPC.
+ */
+struct raft_read_index_result
+{
+    raft_term term;   /* Leader's current term. */
+    raft_index id;    /* Identifier of the request being answered. */
+    raft_index index; /* Index to wait for, or 0 if the read failed. */
+};
+
+/**
+ * Hold the arguments of a TimeoutNow RPC, sent by a leader transferring its
+ * leadership to ask the target server to start an election immediately
+ * (Section 3.10).
+ */
+struct raft_timeout_now
+{
+    raft_term term;            /* Leader's current term. */
+    raft_index last_log_index; /* Index of leader's last log entry. */
+    raft_term last_log_term;   /* Term of log entry at last_log_index. */
+};
+
+/**
+ * Hold the arguments of a SendSnapshot RPC, sent by a leader to ask a follower
+ * to stream its own snapshot to a server lagging behind, in its place.
+ */
+struct raft_send_snapshot
+{
+    raft_term term;        /* Leader's current term. */
+    unsigned server_id;    /* ID of the server to send the snapshot to. */
+    raft_index last_index; /* Minimum index of the snapshot to send. */
+};
+
+/**
+ * Hold the result of a SendSnapshot RPC. A result is sent after each chunk of
+ * the snapshot, and a final one once the transfer is over.
+ */
+struct raft_send_snapshot_result
+{
+    raft_term term;        /* Follower's current term. */
+    unsigned server_id;    /* ID of the server the snapshot is sent to. */
+    raft_index last_index; /* Index of the snapshot, or 0 if failed. */
+    bool done;             /* Whether the transfer is over. */
+};
+
+/**
+ * Hold the arguments of a Propose RPC, sent by followers to forward to the
+ * leader the commands submitted with raft_apply().
+ */
+struct raft_propose
+{
+    raft_term term;             /* Follower's current term. */
+    raft_index id;              /* Request identifier, echoed back. */
+    struct raft_entry *entries; /* Commands to append. */
+    unsigned n_entries;         /* Size of the entries array. */
+};
+
+/**
+ * Hold the result of a Propose RPC, sent once the leader has applied the
+ * commands or failed to append them.
+ */
+struct raft_propose_result
+{
+    raft_term term;   /* Leader's current term. */
+    raft_index id;    /* Identifier of the request being answered. */
+    raft_index index; /* Index of the first command, or 0 if failed. */
+    int status;       /* Status of the request. */
 };
 
 /**
@@ -282,7 +513,14 @@ enum {
     RAFT_IO_APPEND_ENTRIES_RESULT,
     RAFT_IO_REQUEST_VOTE,
     RAFT_IO_REQUEST_VOTE_RESULT,
-    RAFT_IO_INSTALL_SNAPSHOT
+    RAFT_IO_INSTALL_SNAPSHOT,
+    RAFT_IO_READ_INDEX,
+    RAFT_IO_READ_INDEX_RESULT,
+    RAFT_IO_TIMEOUT_NOW,
+    RAFT_IO_SEND_SNAPSHOT,
+    RAFT_IO_SEND_SNAPSHOT_RESULT,
+    RAFT_IO_PROPOSE,
+    RAFT_IO_PROPOSE_RESULT
 };
 
 /**
@@ -299,6 +537,13 @@ struct raft_message
         struct raft_append_entries append_entries;
         struct raft_append_entries_result append_entries_result;
         struct raft_install_snapshot install_snapshot;
+        struct raft_read_index read_index;
+        struct raft_read_index_result read_index_result;
+        struct raft_timeout_now timeout_now;
+        struct raft_send_snapshot send_snapshot;
+        struct raft_send_snapshot_result send_snapshot_result;
+        struct raft_propose propose;
+        struct raft_propose_result propose_result;
     };
 };
 
@@ -323,6 +568,16 @@ struct raft_snapshot
     unsigned n_bufs;
 };
 
+/**
+ * Range of bytes of the data of a snapshot which differ from the data of the
+ * previous one.
+ */
+struct raft_snapshot_patch
+{
+    size_t offset;          /* Offset of the range in the snapshot data */
+    struct raft_buffer buf; /* New content of the range */
+};
+
 /**
  * Asynchronous request to send an RPC message.
  */
@@ -359,6 +614,81 @@ struct raft_io_snapshot_get
     raft_io_snapshot_get_cb cb; /* Request callback */
 };
 
+/**
+ * Asynchronous request to load a chunk of the data of a snapshot.
+ */
+struct raft_io_snapshot_read;
+typedef void (*raft_io_snapshot_read_cb)(struct raft_io_snapshot_read *req,
+                                         struct raft_snapshot *snapshot,
+                                         size_t size,
+                                         int status);
+struct raft_io_snapshot_read
+{
+    void *data;                  /* User data */
+    raft_io_snapshot_read_cb cb; /* Request callback */
+};
+
+/**
+ * Asynchronous request to read persisted log entries.
+ */
+struct raft_io_read;
+typedef void (*raft_io_read_cb)(struct raft_io_read *req,
+                                struct raft_entry *entries,
+                                unsigned n,
+                                int status);
+struct raft_io_read
+{
+    void *data;         /* User data */
+    raft_io_read_cb cb; /* Request callback */
+};
+
+/**
+ * Request to run a callback at the end of the current event loop iteration.
+ */
+struct raft_io_defer;
+typedef void (*raft_io_defer_cb)(struct raft_io_defer *req);
+struct raft_io_defer
+{
+    void *data;          /* User data */
+    raft_io_defer_cb cb; /* Request callback */
+};
+
+/**
+ * Asynchronous request to persist the current term and vote.
+ */
+struct raft_io_set_meta;
+typedef void (*raft_io_set_meta_cb)(struct raft_io_set_meta *req, int status);
+struct raft_io_set_meta
+{
+    void *data;             /* User data */
+    raft_io_set_meta_cb cb; /* Request callback */
+};
+
+/**
+ * Asynchronous request to load the persisted state, see raft_io->load_async.
+ *
+ * The @term, @voted_for and @snapshot fields are set by the backend before it
+ * invokes either callback for the first time, and ownership of the snapshot
+ * is then transferred to the raft instance. The @batch callback takes
+ * ownership of the given entries, exactly like the synchronous load does, and
+ * returns 0 to let the load continue, or an error code to abort it, in which
+ * case the request callback is then invoked with that status.
+ */
+struct raft_io_load;
+typedef int (*raft_io_load_batch_cb)(struct raft_io_load *req,
+                                     struct raft_entry *entries,
+                                     size_t n);
+typedef void (*raft_io_load_cb)(struct raft_io_load *req, int status);
+struct raft_io_load
+{
+    void *data;                     /* User data */
+    raft_term term;                 /* Persisted term */
+    unsigned voted_for;             /* Persisted vote */
+    struct raft_snapshot *snapshot; /* Most recent snapshot, if any */
+    raft_io_load_batch_cb batch;    /* Batch callback */
+    raft_io_load_cb cb;             /* Request callback */
+};
+
 /**
  * Logging levels.
  */
@@ -371,12 +701,16 @@ enum { RAFT_DEBUG, RAFT_INFO, RAFT_WARN, RAFT_ERROR };
 struct raft_io;
 typedef void (*raft_io_tick_cb)(struct raft_io *io);
 typedef void (*raft_io_recv_cb)(struct raft_io *io, struct raft_message *msg);
+typedef void (*raft_io_recv_batch_cb)(struct raft_io *io,
+                                      struct raft_message msgs[],
+                                      unsigned n);
 typedef void (*raft_io_close_cb)(struct raft_io *io);
+typedef void (*raft_io_wakeup_cb)(struct raft_io *io);
 
 struct raft_io
 {
     /**
-     * API version implemented by this instance. Currently 1.
+     * API version implemented by this instance. Currently 16.
      */
     int version;
 
@@ -390,6 +724,13 @@ struct raft_io
      */
     void *impl;
 
+    /**
+     * Minimum level of the messages passed to @emit. Messages with a lower
+     * level are discarded before being formatted. The default of
+     * #RAFT_DEBUG lets all messages through.
+     */
+    int log_level;
+
     int (*init)(struct raft_io *io, unsigned id, const char *address);
 
     /**
@@ -502,6 +843,309 @@ struct raft_io
      * Emit a log message.
      */
     void (*emit)(struct raft_io *io, int level, const char *format, ...);
+
+    /**
+     * Asynchronously persist the given term along with a vote for the given
+     * server (0 meaning no vote) as a single change, invoking @cb once the
+     * change is durable. Requests must complete in the order they were
+     * submitted.
+     *
+     * This method is optional and available since version 2: if it is not
+     * NULL, it's used in place of @set_term_and_vote (or @set_term followed by
+     * @set_vote) when starting an election
+     * and in place of @set_vote when granting a vote, so the caller doesn't
+     * block on disk I/O. Pending requests must be completed, possibly with an
+     * error, before @close invokes its callback.
+     */
+    int (*set_meta)(struct raft_io *io,
+                    struct raft_io_set_meta *req,
+                    raft_term term,
+                    unsigned server_id,
+                    raft_io_set_meta_cb cb);
+
+    /**
+     * Asynchronously write a chunk of the data of the given snapshot, starting
+     * at the given offset. Chunks are submitted in order, and a chunk at offset
+     * 0 starts a new snapshot, discarding any incomplete one. Once the chunk
+     * with @done set has been written, the snapshot is complete and it's the
+     * one returned by @snapshot_get. The bufs field of @snapshot is ignored,
+     * and its configuration is only used along with the last chunk.
+     *
+     * This method is optional and available since version 3: if it is NULL,
+     * the chunks of a snapshot being received are accumulated in memory and
+     * stored with @snapshot_put.
+     */
+    int (*snapshot_put_chunk)(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              size_t offset,
+                              const struct raft_buffer *buf,
+                              bool done,
+                              raft_io_snapshot_put_cb cb);
+
+    /**
+     * Asynchronously load up to @len bytes of the data of the snapshot with the
+     * given @term and @index, starting at @offset, or of the most recent
+     * snapshot if @index is 0. The callback gets the snapshot metadata, a
+     * single buffer holding the chunk and the total size of the data. If that
+     * snapshot is not available anymore, it must fail with RAFT_ERR_IO.
+     *
+     * This method is optional and available since version 4: if it is not
+     * NULL, leaders load the snapshots they send chunk by chunk, instead of
+     * loading the whole data with @snapshot_get.
+     */
+    int (*snapshot_read)(struct raft_io *io,
+                         struct raft_io_snapshot_read *req,
+                         raft_term term,
+                         raft_index index,
+                         size_t offset,
+                         size_t len,
+                         raft_io_snapshot_read_cb cb);
+
+    /**
+     * Return #true if messages sent to the server with the given ID can't be
+     * delivered right now and would only pile up, e.g. because the connection
+     * to it is down and the queue of messages waiting for it is full.
+     *
+     * This method is optional and available since version 5: if it is not
+     * NULL, leaders stop sending AppendEntries messages to congested servers,
+     * instead of building messages that would just be dropped.
+     */
+    bool (*congested)(struct raft_io *io, unsigned id);
+
+    /**
+     * Set a callback to be invoked in place of the @recv_cb passed to @start
+     * when several messages were received together, for example because they
+     * were parsed out of a single socket read. The messages are passed in the
+     * order they were received, and their content is handed over as with
+     * @recv_cb. The array itself is owned by the implementation.
+     *
+     * This method is optional and available since version 6: if it is not
+     * NULL, it's invoked right before @start, and followers fold consecutive
+     * AppendEntries messages from the leader into a single log append and
+     * disk write.
+     */
+    void (*set_recv_batch)(struct raft_io *io, raft_io_recv_batch_cb cb);
+
+    /**
+     * Set a callback to be invoked in the loop thread after @wakeup has been
+     * called.
+     *
+     * This method is optional and available since version 7: if both it and
+     * @wakeup are not NULL, it's invoked right before @start, and
+     * raft_submit() can be used.
+     */
+    void (*set_wakeup)(struct raft_io *io, raft_io_wakeup_cb cb);
+
+    /**
+     * Make the callback set with @set_wakeup fire soon in the loop thread.
+     * Unlike all other methods, this one can be called from any thread.
+     * Several calls made before the callback fires might result in a single
+     * invocation.
+     */
+    void (*wakeup)(struct raft_io *io);
+
+    /**
+     * Record that all entries up to the given index are committed. This is
+     * only a hint: the implementation is free to persist it lazily, for
+     * example along with the next metadata write, and it's fine to lose the
+     * most recent values after a crash.
+     *
+     * This method is optional and available since version 8: if both it and
+     * @load_commit are not NULL, it's invoked every time the commit index
+     * advances, and at startup the entries up to the commit index returned by
+     * @load_commit are applied right away, instead of waiting for the leader
+     * to tell us what's committed.
+     */
+    void (*set_commit)(struct raft_io *io, raft_index commit);
+
+    /**
+     * Return the last commit index that was persisted with @set_commit, or
+     * zero if none is known. It's invoked right after @load.
+     */
+    raft_index (*load_commit)(struct raft_io *io);
+
+    /**
+     * Asynchronously store a new snapshot whose data is the data of the
+     * snapshot at index @base, which must be the most recent one, resized to
+     * @size bytes and with the given @patches applied in order. The bufs field
+     * of @snapshot is ignored.
+     *
+     * This method is optional and available since version 9: if it is not
+     * NULL and the FSM implements @snapshot_patch, snapshots are stored by
+     * writing only what changed since the previous one.
+     */
+    int (*snapshot_put_patch)(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              raft_index base,
+                              const struct raft_snapshot_patch patches[],
+                              unsigned n_patches,
+                              size_t size,
+                              raft_io_snapshot_put_cb cb);
+
+    /**
+     * Asynchronously send the given AppendEntries @messages, one per target
+     * server, which all carry the same entries, i.e. the same range of the
+     * log with the same payload buffers. This is equivalent to calling
+     * @send for each message, and sets @statuses[i] to what @send would have
+     * returned for the i'th one: the callback is fired only for the messages
+     * whose status is 0. The implementation can take advantage of the shared
+     * entries payload, e.g. by encoding it once, and of knowing the whole set
+     * of messages, e.g. by writing them in a single pass. Return 0 if all
+     * messages were submitted, or the first non-zero status.
+     *
+     * This method is optional and available since version 10: if it is not
+     * NULL, the messages carrying new entries to followers are submitted
+     * together with it.
+     */
+    int (*broadcast)(struct raft_io *io,
+                     struct raft_io_send *reqs[],
+                     const struct raft_message messages[],
+                     unsigned n,
+                     int statuses[],
+                     raft_io_send_cb cb);
+
+    /**
+     * Asynchronously load the same state as @load, without blocking the
+     * caller. The entries following the snapshot, if any, are passed to the
+     * @batch callback in index order, possibly split across several calls,
+     * and the @cb callback is invoked once all of them have been passed, or
+     * the load has failed. If the backend is closed in the meantime, the
+     * request callback must still be invoked, before the close one.
+     *
+     * This method is optional and available since version 11: if it is not
+     * NULL, it is used by raft_start() in place of @load, and the instance
+     * completes starting once the request callback has been invoked.
+     */
+    int (*load_async)(struct raft_io *io,
+                      struct raft_io_load *req,
+                      raft_io_load_batch_cb batch,
+                      raft_io_load_cb cb);
+
+    /**
+     * Asynchronously truncate all log entries from the given index onwards and
+     * append the given entries in their place, as @truncate followed by
+     * @append would do. The implementation can take advantage of knowing both
+     * at once, e.g. by preparing the write of the new entries while the old
+     * ones are being removed. The callback is invoked once the truncation and
+     * the new entries are both durable. If this method fails, the truncation
+     * might still take place.
+     *
+     * This method is optional and available since version 12: if it is not
+     * NULL, it's used when a follower replaces conflicting entries with the
+     * ones sent by the leader.
+     */
+    int (*replace)(struct raft_io *io,
+                   raft_index index,
+                   const struct raft_entry entries[],
+                   unsigned n,
+                   void *data,
+                   void (*cb)(void *data, int status));
+
+    /**
+     * Asynchronously read up to @n persisted log entries, starting from the one
+     * at @index.
+     *
+     * The implementation can return less entries than requested, and it must
+     * invoke the callback with zero entries if the entry at @index is not
+     * available anymore. The entries array and the entries payload must be
+     * allocated with raft_malloc, with the @batch attribute of each entry being
+     * set to the memory block holding its payload. Once the request is
+     * completed ownership of such memory is transfered to the raft instance.
+     * If the request fails, the callback must be invoked with no entries.
+     *
+     * This method is optional and available since version 13: if it is not
+     * NULL, and neither is @last_readable, entries can be evicted from the
+     * in-memory log cache.
+     */
+    int (*read)(struct raft_io *io,
+                struct raft_io_read *req,
+                raft_index index,
+                unsigned n,
+                raft_io_read_cb cb);
+
+    /**
+     * Return the index of the last persisted entry that @read can currently
+     * return. Entries that are durable but still held in a form the
+     * implementation can't read back (e.g. a segment still open for writing)
+     * must not be included, since the in-memory log cache evicts only entries
+     * up to this index.
+     *
+     * This method is available since version 13 and must be set along with
+     * @read.
+     */
+    raft_index (*last_readable)(struct raft_io *io);
+
+    /**
+     * Invoke @cb once all the events of the current event loop iteration have
+     * been processed.
+     *
+     * This method is optional and available since version 14: if it is NULL,
+     * group commit is not available.
+     */
+    int (*defer)(struct raft_io *io,
+                 struct raft_io_defer *req,
+                 raft_io_defer_cb cb);
+
+    /**
+     * Invoke the @tick_cb callback passed to @start only once, after @msecs
+     * milliseconds, replacing any deadline set by a previous call. After the
+     * first call the implementation must stop invoking @tick_cb periodically,
+     * and will be asked for a new deadline every time @tick_cb fires.
+     *
+     * This method is optional and available since version 15: if it is NULL,
+     * @tick_cb is invoked periodically.
+     */
+    void (*tick_after)(struct raft_io *io, unsigned msecs);
+
+    /**
+     * Synchronously persist the given term along with a vote for the given
+     * server, as a single change. This is equivalent to set_term() followed by
+     * set_vote(), but the implementation should make the change durable in one
+     * go (e.g. with a single write and fsync()).
+     *
+     * This method is optional and available since version 16: if it is NULL,
+     * @set_term and @set_vote are used instead.
+     */
+    int (*set_term_and_vote)(struct raft_io *io,
+                             raft_term term,
+                             unsigned server_id);
+};
+
+/**
+ * Asynchronous request to apply a committed RAFT_COMMAND entry to the state
+ * machine. The memory of the request is owned by the raft library.
+ */
+struct raft_fsm_apply;
+typedef void (*raft_fsm_apply_cb)(struct raft_fsm_apply *req, int status);
+struct raft_fsm_apply
+{
+    void *data;         /* Custom user data. */
+    raft_index index;   /* Index of the entry being applied. */
+    unsigned partition; /* Partition of the entry, see raft_fsm->partition */
+    struct raft *raft;
+    raft_fsm_apply_cb cb;
+    int status;
+    bool done;
+    void *queue[2];
+};
+
+/**
+ * Asynchronous request to take a snapshot of the state machine. The memory of
+ * the request is owned by the raft library.
+ */
+struct raft_fsm_snapshot;
+typedef void (*raft_fsm_snapshot_cb)(struct raft_fsm_snapshot *req,
+                                     struct raft_buffer bufs[],
+                                     unsigned n_bufs,
+                                     int status);
+struct raft_fsm_snapshot
+{
+    void *data;       /* Custom user data. */
+    raft_index index; /* Index of the last entry applied to the snapshot. */
+    struct raft *raft;
+    raft_fsm_snapshot_cb cb;
 };
 
 /**
@@ -510,7 +1154,7 @@ struct raft_io
  */
 struct raft_fsm
 {
-    int version; /* API version implemented by this instance. Currently 1. */
+    int version; /* API version implemented by this instance. Currently 9. */
     void *data;  /* Custom user data. */
 
     /**
@@ -529,6 +1173,130 @@ struct raft_fsm
      * Restore a snapshot of the state machine.
      */
     int (*restore)(struct raft_fsm *fsm, struct raft_buffer *buf);
+
+    /**
+     * Apply a range of @n contiguous committed RAFT_COMMAND entries to the
+     * state machine in one go, the i'th buffer holding the payload of the entry
+     * at index @index + i.
+     *
+     * This method is optional and available since version 2: if it is NULL,
+     * entries are applied one by one using @apply. If it fails, none of the
+     * entries is considered applied.
+     */
+    int (*apply_batch)(struct raft_fsm *fsm,
+                       const struct raft_buffer bufs[],
+                       raft_index index,
+                       unsigned n);
+
+    /**
+     * Start applying a committed RAFT_COMMAND entry to the state machine,
+     * without blocking the raft event loop.
+     *
+     * This method is optional and available since version 3: if it is not
+     * NULL, it's used in place of @apply and @apply_batch. The FSM must invoke
+     * @cb once done, from the same thread running the raft event loop, and
+     * must not touch the @buf memory after that. Requests may complete in any
+     * order, but their completion is acknowledged to clients in log order. If
+     * @cb is invoked with a non-zero status, the entry is submitted again.
+     */
+    int (*apply_async)(struct raft_fsm *fsm,
+                       struct raft_fsm_apply *req,
+                       const struct raft_buffer *buf,
+                       raft_fsm_apply_cb cb);
+
+    /**
+     * Serialize the next chunk of a snapshot of the state machine into @buf,
+     * whose memory is then owned by the raft library, and set @done if it's
+     * the last one. A call with @offset 0 starts a new snapshot, discarding any
+     * incomplete one, and the data of all further chunks must reflect the
+     * state at that time, even if more entries get applied in the meantime.
+     *
+     * This method is optional and available since version 4: if it is not
+     * NULL and the raft_io backend implements @snapshot_put_chunk, it's used
+     * in place of @snapshot, so the snapshot is written to disk while being
+     * serialized, without holding it all in memory.
+     */
+    int (*snapshot_chunk)(struct raft_fsm *fsm,
+                          size_t offset,
+                          struct raft_buffer *buf,
+                          bool *done);
+
+    /**
+     * Start taking a snapshot of the state machine, without blocking the raft
+     * event loop.
+     *
+     * This method is optional and available since version 5: if it is not
+     * NULL, it's used in place of @snapshot and @snapshot_chunk. The FSM must
+     * capture a point-in-time view of its state before returning, for example
+     * a copy-on-write version or a forked child, since entries keep being
+     * applied while the view is serialized. It must then invoke @cb from the
+     * same thread running the raft event loop, passing buffers allocated with
+     * raft_malloc, whose ownership is transferred to the raft library.
+     */
+    int (*snapshot_async)(struct raft_fsm *fsm,
+                          struct raft_fsm_snapshot *req,
+                          raft_fsm_snapshot_cb cb);
+
+    /**
+     * Restore a chunk of a snapshot of the state machine, starting at @offset
+     * of the snapshot data. A call with @offset 0 begins a new restore, and the
+     * call with @done set ends it. The FSM takes over the memory of @buf,
+     * unless it fails.
+     *
+     * This method is optional and available since version 6: if it is not
+     * NULL and the raft_io backend implements @snapshot_read, a snapshot
+     * received from the leader in chunks is restored chunk by chunk once it's
+     * on disk, instead of being loaded whole in memory and passed to
+     * @restore.
+     */
+    int (*restore_chunk)(struct raft_fsm *fsm,
+                         size_t offset,
+                         struct raft_buffer *buf,
+                         bool done);
+
+    /**
+     * Return the index of the last entry whose effects the state machine has
+     * made durable on its own, for example along with its data, or zero.
+     *
+     * This method is optional and available since version 7: if it is not
+     * NULL, it's invoked at startup, and neither the snapshot on disk (if not
+     * more recent) nor the entries up to the returned index are fed again to
+     * the state machine.
+     */
+    raft_index (*applied)(struct raft_fsm *fsm);
+
+    /**
+     * Return the partition of the state touched by the RAFT_COMMAND entry
+     * with the given payload. It should be cheap, for example a hash of the
+     * key of the command.
+     *
+     * This method is optional and available since version 8, and only used
+     * along with @apply_async: if it is not NULL, a command is not submitted
+     * while an earlier command of the same partition is still being applied,
+     * or has failed, so each partition sees its commands in log order and the
+     * FSM can apply commands of different partitions concurrently, e.g. by
+     * routing each request to a worker based on its @partition field.
+     * Submission stops at the first command whose partition is busy, and
+     * resumes when that partition catches up.
+     */
+    unsigned (*partition)(struct raft_fsm *fsm, const struct raft_buffer *buf);
+
+    /**
+     * Describe how the snapshot data of the current state differs from the
+     * data of the last snapshot taken, as ranges of bytes to overwrite, and set
+     * @size to the size of the new data. The @patches array and the memory of
+     * its buffers are allocated with raft_malloc and owned by the raft library.
+     *
+     * This method is optional and available since version 9: if it is not
+     * NULL and the raft_io backend implements @snapshot_put_patch, it's used in
+     * place of the other snapshot methods whenever the last snapshot taken by
+     * this instance is also the most recent one stored, so only the changes
+     * get written to disk.
+     */
+    int (*snapshot_patch)(struct raft_fsm *fsm,
+                          struct raft_snapshot_patch *patches[],
+                          unsigned *n_patches,
+                          size_t *size);
 };
 
 /**
@@ -547,10 +1315,67 @@ extern const char *raft_state_names[];
  */
 struct raft_replication
 {
-    raft_index next_index;  /* Next entry to send */
-    raft_index match_index; /* Highest applied idx */
-    raft_time last_contact; /* Timestamp of last RPC received */
-    unsigned short state;   /* Probe, pipeline or snapshot */
+    raft_index next_index;     /* Next entry to send */
+    raft_index match_index;    /* Highest applied idx */
+    raft_time last_contact;    /* Timestamp of last RPC received */
+    unsigned short state;      /* Probe, pipeline or snapshot */
+    size_t inflight_bytes;     /* Entries payload being sent, in bytes */
+    bool reading;              /* Whether entries are being read from disk */
+    raft_time ack_time;        /* Start of latest round acknowledged */
+    raft_index ack_seq;        /* Latest heartbeat round acknowledged */
+    raft_time last_send;       /* Timestamp of last AppendEntries sent */
+    raft_index last_commit;    /* Commit index sent with the last request */
+    bool sending_snapshot;     /* Whether snapshot chunks are being sent */
+    unsigned delegate_id;      /* Follower sending the snapshot for us, or 0 */
+    raft_time delegate_ack;    /* Timestamp of last result from the delegate */
+    raft_index resume_index;   /* Snapshot the server has part of, or 0 */
+    size_t resume_offset;      /* Offset to resume sending it from */
+    struct raft_bucket bucket; /* Budget of entries read back from disk */
+    struct raft_interval rtt;  /* Round-trip time of AppendEntries RPCs */
+    raft_time rtt_start;       /* When the round trip being timed started */
+    raft_index rtt_index;      /* Last index it covers, or 0 if none */
+    bool backtracking;         /* Probing after a log mismatch */
+    bool fast;                 /* Among the fastest ones forming a quorum */
+};
+
+/**
+ * How leaders probe a follower they didn't hear from within the contact
+ * timeout, see raft_set_contact_timeout().
+ */
+enum {
+    RAFT_PROBE_HEARTBEAT = 0, /* Send heartbeats until the follower answers */
+    RAFT_PROBE_REWIND         /* Resend the entries after its match index */
+};
+
+/**
+ * Limits applied when sending AppendEntries RPCs to a follower. A value of zero
+ * means no limit. At least one entry is always sent to a follower whose
+ * in-flight window is not full, even if it exceeds max_bytes.
+ */
+struct raft_append_limits
+{
+    unsigned max_entries;      /* Max n. of entries per message */
+    size_t max_bytes;          /* Max entries payload per message */
+    size_t max_inflight_bytes; /* Max payload being sent to a follower */
+};
+
+/**
+ * Number of buckets of commit latency histograms. Bucket 0 counts latencies
+ * below 1 millisecond, bucket i counts latencies of at least 2^(i-1) and less
+ * than 2^i milliseconds, and the last bucket also counts all longer ones.
+ */
+#define RAFT_LATENCY_BUCKETS 16
+
+/**
+ * Cumulative counters kept by a raft instance since it was initialized.
+ */
+struct raft_counters
+{
+    unsigned long long n_appended;  /* Entries written to the local log */
+    unsigned long long n_committed; /* Entries committed */
+    unsigned long long n_applied;   /* Commands applied to the FSM */
+    unsigned long long n_elections; /* Elections started */
+    unsigned long long commit_latency[RAFT_LATENCY_BUCKETS]; /* Histogram */
 };
 
 /**
@@ -591,13 +1416,170 @@ enum {
      * The event data is a pointer to an unsigned int holding the ID of the
      * server that was being promoted.
      */
-    RAFT_EVENT_PROMOTION_ABORTED
+    RAFT_EVENT_PROMOTION_ABORTED,
+
+    /**
+     * Fired when a leader that rejected commands with #RAFT_EBACKPRESSURE
+     * accepts them again, see @raft_set_max_uncommitted_bytes.
+     *
+     * The event data is a pointer to a size_t holding the payload size of the
+     * commands still uncommitted.
+     */
+    RAFT_EVENT_PRESSURE_RELIEVED,
+
+    /**
+     * Fired when the commit index advances.
+     *
+     * The event data is a pointer to a @raft_index holding the new commit
+     * index.
+     */
+    RAFT_EVENT_COMMIT_ADVANCED,
+
+    /**
+     * Fired once per batch of log entries applied, after the
+     * #RAFT_EVENT_COMMAND_APPLIED events of the individual commands.
+     *
+     * The event data is a pointer to a @raft_applied_range.
+     */
+    RAFT_EVENT_RANGE_APPLIED,
+
+    /**
+     * Fired when a snapshot taken by this server has been stored, or failed
+     * to be.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the index
+     * and size of the snapshot, and the time spent taking and storing it.
+     */
+    RAFT_EVENT_SNAPSHOT_TAKEN,
+
+    /**
+     * Fired when this server has sent a whole snapshot to another server, as
+     * leader or on behalf of the leader.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the ID of
+     * the receiving server, the snapshot index, the amount of data sent and
+     * the time the transfer took.
+     */
+    RAFT_EVENT_SNAPSHOT_SENT,
+
+    /**
+     * Fired when a snapshot received from another server has been stored and
+     * restored.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the ID of
+     * the sending server, the snapshot index and size, and the time since its
+     * first chunk was received.
+     */
+    RAFT_EVENT_SNAPSHOT_INSTALLED,
+
+    /**
+     * Fired by the leader when a server to be promoted with @raft_promote
+     * starts catching up with the log.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the ID of
+     * the server and the index of the last entry it has to replicate in the
+     * first catch-up round.
+     */
+    RAFT_EVENT_CATCH_UP_STARTED,
+
+    /**
+     * Fired by the leader when a server being promoted has caught up with the
+     * log, right before it becomes voting. Servers failing to catch up fire
+     * #RAFT_EVENT_PROMOTION_ABORTED instead.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the ID of
+     * the server, its match index, the payload of the entries it replicated
+     * that are still in the log, and the time catching up took.
+     */
+    RAFT_EVENT_CATCH_UP_FINISHED,
+
+    /**
+     * Fired by the leader when a leadership transfer completes, either
+     * successfully or not.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the ID of
+     * the target server, the time since the transfer started, and the status
+     * passed to the transfer callback.
+     */
+    RAFT_EVENT_LEADERSHIP_TRANSFERRED,
+
+    /**
+     * Fired when raft_start() has completed starting an instance whose backend
+     * loads its state asynchronously, either successfully or not.
+     *
+     * The event data is a pointer to a @raft_lifecycle_event with the index of
+     * the last entry loaded, the time the load took, and its status. If that
+     * is not 0 the instance stays unavailable and can only be closed.
+     */
+    RAFT_EVENT_STARTED
 };
 
 /**
  * Number of available event types.
  */
-#define RAFT_EVENT_N (RAFT_EVENT_PROMOTION_ABORTED + 1)
+#define RAFT_EVENT_N (RAFT_EVENT_STARTED + 1)
+
+/**
+ * Details of snapshot, catch-up, leadership transfer and start events. Fields
+ * not mentioned by the event are 0.
+ */
+struct raft_lifecycle_event
+{
+    unsigned server_id; /* Other server involved */
+    raft_index index;   /* Snapshot index, or match index */
+    raft_time duration; /* Time taken, in milliseconds */
+    size_t bytes;       /* Amount of data stored or transferred */
+    int status;         /* 0 if successful, or an error code */
+};
+
+/**
+ * Range of log entries applied, passed with #RAFT_EVENT_RANGE_APPLIED.
+ */
+struct raft_applied_range
+{
+    raft_index first; /* Index of the first entry applied */
+    raft_index last;  /* Index of the last entry applied, the new watermark */
+};
+
+/**
+ * Trace point IDs. The meaning of the fields of @raft_trace depends on the
+ * trace point, fields not mentioned are 0.
+ */
+enum {
+    RAFT_TRACE_SEND = 1,    /* Message of @type sent to @server_id */
+    RAFT_TRACE_RECV,        /* Message of @type received from @server_id */
+    RAFT_TRACE_APPEND,      /* @n entries from @index submitted to disk */
+    RAFT_TRACE_APPEND_DONE, /* @n entries from @index persisted, or @status */
+    RAFT_TRACE_COMMIT,      /* Commit index advanced to @index */
+    RAFT_TRACE_APPLY,       /* Command at @index applied */
+    RAFT_TRACE_ELECTION,    /* Election for @term, @type 1 if pre-vote */
+    RAFT_TRACE_STATE        /* State changed to @type in @term */
+};
+
+/**
+ * Structured arguments of a trace point. For messages, @term and @index are
+ * the term and the most relevant index carried by the message, if any: the
+ * first entry of AppendEntries, the last log index of AppendEntries results,
+ * RequestVote and TimeoutNow, and the last index of InstallSnapshot. The
+ * @status of AppendEntries and RequestVote results is 0 if successful, 1
+ * otherwise. The @index of elections is the candidate's last log index.
+ */
+struct raft_trace
+{
+    int point;          /* Trace point ID */
+    int type;           /* Message type or state code */
+    unsigned server_id; /* Peer server, if any */
+    raft_term term;     /* Term involved */
+    raft_index index;   /* Entry index involved */
+    unsigned n;         /* Number of entries */
+    int status;         /* Outcome, if any */
+};
+
+/**
+ * Callback receiving trace points, along with the @data pointer set on the
+ * raft instance.
+ */
+typedef void (*raft_trace_cb)(void *data, const struct raft_trace *trace);
 
 /**
  * Hold and drive the state of a single raft server in a cluster.
@@ -700,6 +1682,213 @@ struct raft
      */
     unsigned heartbeat_timeout;
 
+    /**
+     * Read lease timeout in milliseconds (default 0, meaning disabled). If a
+     * majority of voting servers acknowledged the leader within this amount of
+     * milliseconds, raft_read_lease() serves reads locally without contacting
+     * other servers. Each acknowledgement counts from the start of the
+     * heartbeat round it echoes, which precedes the sending of the
+     * AppendEntries RPC it answers, not from its arrival: followers reset
+     * their election timer after that, so the lease expires before any of
+     * them can start an election, whatever the network delay. It must be
+     * lower than @election_timeout, or than the lower bound of the adaptive
+     * election timeout if enabled, leaving enough margin to account for clock
+     * drift between servers. A new round starts at least every heartbeat
+     * timeout, so it should also be higher than twice @heartbeat_timeout,
+     * otherwise the lease often expires between rounds.
+     */
+    unsigned read_lease_timeout;
+
+    /**
+     * Milliseconds after which a leader with nothing left to replicate stops
+     * sending heartbeats (default 0, meaning never). See
+     * raft_set_hibernate_timeout().
+     */
+    unsigned hibernate_timeout;
+
+    /**
+     * Milliseconds without hearing from a follower after which leaders assume
+     * that the entries optimistically sent to it were lost (default 5000), and
+     * how they probe it from then on (default #RAFT_PROBE_HEARTBEAT).
+     */
+    unsigned contact_timeout;
+    int probe_strategy;
+
+    /**
+     * Whether to run a pre-vote round before starting an election (default
+     * false).
+     *
+     * From Section §9.6:
+     *
+     *   In the Pre-Vote algorithm, a candidate only increments its term if it
+     *   first learns from a majority of the cluster that they would be willing
+     *   to grant the candidate their votes (if the candidate's log is
+     *   sufficiently up-to-date, and the voters have not received heartbeats
+     *   from a valid leader for at least a baseline election timeout).
+     */
+    bool pre_vote;
+
+    /**
+     * Bounds of the adaptive election timeout, in milliseconds (default 0,
+     * meaning disabled). See raft_set_adaptive_election_timeout().
+     */
+    struct
+    {
+        unsigned min;     /* Lower bound */
+        unsigned max;     /* Upper bound, or 0 if disabled */
+        unsigned timeout; /* Current value, or 0 if not yet known */
+    } election_adaptive;
+
+    /**
+     * Whether followers forward to the leader the commands submitted with
+     * raft_apply(), instead of failing with #RAFT_ERR_NOT_LEADER (default
+     * false).
+     */
+    bool apply_forwarding;
+
+    /**
+     * Whether the commands of a raft_apply() call, or of the raft_submit()
+     * calls handled together, are packed into a single #RAFT_BATCH entry
+     * (default false).
+     */
+    bool apply_batching;
+
+    /**
+     * Limits applied when sending AppendEntries RPCs to followers.
+     */
+    struct raft_append_limits append_limits;
+
+    /**
+     * Replication budget of non-voting servers (learners), such as read
+     * replicas or backup sites, which don't take part in the quorum. Unless
+     * @custom_limits is set, learners get the same append limits as voting
+     * servers. A @heartbeat_timeout of zero means the regular one.
+     */
+    struct
+    {
+        bool custom_limits;
+        struct raft_append_limits append_limits;
+        unsigned heartbeat_timeout;
+    } learners;
+
+    /**
+     * Backpressure state (disabled by default). When @max_bytes is not zero, a
+     * leader rejects new commands while the commands it appended but not yet
+     * committed hold at least @max_bytes of payload.
+     */
+    struct
+    {
+        size_t max_bytes; /* High-water mark of uncommitted payload */
+        bool rejecting;   /* Whether commands are being rejected */
+    } backpressure;
+
+    /**
+     * Maximum size in bytes of the entries payload held in the in-memory log
+     * cache (default 0, meaning no limit). Once it's exceeded, the payload of
+     * the oldest entries which have been both persisted and applied is evicted
+     * from memory, and read back from disk if needed to replicate them.
+     */
+    size_t log_cache_size;
+
+    /**
+     * Group commit state (disabled by default). When enabled, the entries
+     * appended by raft_apply() during an event loop iteration are written to
+     * disk and sent to followers together, at the end of the iteration.
+     */
+    struct
+    {
+        bool enabled;
+        bool scheduled;           /* Whether @req is pending */
+        raft_index index;         /* First entry to replicate, or 0 */
+        struct raft_io_defer req; /* Deferred replication request */
+    } group_commit;
+
+    /**
+     * AppendEntries messages carrying new entries, collected while triggering
+     * replication when the raft_io backend implements broadcast(), and
+     * submitted together once all followers have been visited.
+     */
+    struct
+    {
+        struct raft_io_send **reqs;    /* Requests of the collected messages */
+        struct raft_message *messages; /* Collected messages, or NULL */
+        int *statuses;                 /* Submission result of each message */
+        unsigned n;                    /* Number of collected messages */
+    } broadcast;
+
+    /**
+     * Batched acknowledgements state (disabled by default). When enabled,
+     * followers acknowledge all the entries persisted during an event loop
+     * iteration with a single AppendEntries result, which can be held back for
+     * up to @max_delay milliseconds to be merged with later ones.
+     */
+    struct
+    {
+        bool enabled;
+        unsigned max_delay;       /* Max msecs a result can be held back */
+        bool scheduled;           /* Whether @req is pending */
+        raft_term term;           /* Term of the held back result, or 0 */
+        unsigned leader_id;       /* Leader the held back result is for */
+        raft_time time;           /* When the result was first held back */
+        struct raft_io_defer req; /* Deferred acknowledgement request */
+    } ack_batch;
+
+    /**
+     * Commit notifications state (disabled by default). When enabled, leaders
+     * tell followers about a new commit index at the end of the event loop
+     * iteration in which it advanced, rather than with the next AppendEntries
+     * request.
+     */
+    struct
+    {
+        bool enabled;
+        bool scheduled;           /* Whether @req is pending */
+        struct raft_io_defer req; /* Deferred notification request */
+    } commit_notify;
+
+    /**
+     * Apply budget (disabled by default). When set, at most @max_entries
+     * committed entries are applied to the FSM per event loop iteration, and
+     * the remaining ones are applied in the following iterations, so that
+     * a large backlog doesn't delay the handling of other events.
+     */
+    struct
+    {
+        unsigned max_entries;     /* Max entries per iteration, 0 for no max */
+        unsigned n;               /* Entries applied in this iteration */
+        bool scheduled;           /* Whether @req is pending */
+        struct raft_io_defer req; /* Deferred apply request */
+    } apply_budget;
+
+    /**
+     * Rate limits of background transfers (disabled by default), i.e. snapshots
+     * and entries read back from disk for followers lagging behind, in bytes
+     * per second. A rate of zero means no limit.
+     */
+    struct
+    {
+        size_t peer_rate;          /* Max rate towards a single server */
+        size_t total_rate;         /* Max rate towards all servers */
+        struct raft_bucket bucket; /* Budget shared by all servers */
+        void *throttled[2];        /* Snapshot transfers waiting for budget */
+    } background;
+
+    /**
+     * Recycled request objects: AppendEntries sends of the leader, appends of
+     * the entries received by followers and the sends of their results.
+     */
+    struct
+    {
+        struct raft_pool send_append_entries;
+        struct raft_pool follower_append;
+        struct raft_pool send;
+    } pools;
+
+    /**
+     * Counters reported by raft_stats().
+     */
+    struct raft_counters counters;
+
     /**
      * The fields below hold the part of the server's volatile state which
      * is always applicable regardless of the whether the server is
@@ -710,6 +1899,21 @@ struct raft
     raft_index last_applied; /* Highest log entry applied to the FSM */
     raft_index last_stored;  /* Highest log entry persisted on disk */
 
+    /**
+     * Highest log entry submitted to the FSM with @apply_async, and queue of
+     * the submissions which have not yet been acknowledged, in log order. The
+     * @last_applied watermark only moves past an entry once it and all entries
+     * before it were applied.
+     */
+    raft_index last_applying;
+    void *fsm_apply_reqs[2];
+
+    /**
+     * Number of commands of the #RAFT_BATCH entry following @last_applied that
+     * were already applied, if applying the others failed.
+     */
+    unsigned batch_applied;
+
     /**
      * Current server state of this raft instance, along with a union defining
      * state-specific values.
@@ -727,6 +1931,49 @@ struct raft
                 unsigned id;
                 const char *address;
             } current_leader;
+
+            /**
+             * Queue of read requests forwarded to the leader, along with the
+             * ID of the last ReadIndex RPC sent and when it was sent, if
+             * it's still waiting for a result.
+             */
+            void *read_reqs[2];
+            raft_index read_id;
+            raft_time read_time;
+            bool read_inflight;
+
+            /**
+             * Queue of apply requests forwarded to the leader, and ID of the
+             * last Propose RPC sent.
+             */
+            void *apply_reqs[2];
+            raft_index apply_id;
+
+            /**
+             * Server we are sending our snapshot to on behalf of the leader,
+             * and ID of that leader, or 0.
+             */
+            unsigned snapshot_target;
+            unsigned snapshot_leader;
+
+            /**
+             * Arrival time of the last heartbeat from the current leader, or 0
+             * if entries were received since, and the estimate of the interval
+             * between heartbeats, used by the adaptive election timeout.
+             */
+            raft_time heartbeat_time;
+            struct raft_interval heartbeat_interval;
+
+            /**
+             * Whether the leader hibernated, suspending our election timer.
+             */
+            bool hibernating;
+
+            /**
+             * Latest heartbeat round received from the current leader, echoed
+             * back in our AppendEntries results.
+             */
+            raft_index seq;
         } follower_state;
 
         struct
@@ -736,7 +1983,12 @@ struct raft
              * which is specific to candidates. This state is reinitialized
              * after the server starts a new election round.
              */
-            bool *votes; /* For each server, whether vote was granted */
+            unsigned long long *votes; /* Bitset of servers granting a vote */
+            unsigned long long votes_inline; /* Bitset up to 64 servers */
+            unsigned n_votes_old;  /* Granted votes of the old voters */
+            unsigned n_votes_new;  /* Granted votes of the new voters */
+            bool in_pre_vote;      /* True while running the pre-vote round */
+            bool disrupt_leader;   /* True if started because of TimeoutNow */
         } candidate_state;
 
         struct
@@ -756,11 +2008,54 @@ struct raft
             unsigned short round_number; /* Number of the current sync round */
             raft_index round_index;      /* Target of the current round */
             unsigned round_duration;     /* Duration of the current round */
+            raft_index round_start;      /* Promotee match idx at round start */
+            unsigned round_deadline;     /* Max round duration, 0 if none */
+            unsigned round_idle;         /* Time since promotee progressed */
+            raft_time catch_up_start;    /* When the promotee started */
+            raft_index catch_up_from;    /* Promotee match index then */
 
             /**
              * Queue of outstanding apply requests.
              */
             void *apply_reqs[2];
+
+            /**
+             * Queue of outstanding read requests.
+             */
+            void *read_reqs[2];
+
+            /**
+             * Leadership transfer in progress, if any, start time of the last
+             * one towards a server with a higher priority, or 0, and when we
+             * last sent TimeoutNow, or 0.
+             */
+            struct raft_transfer *transfer;
+            raft_time priority_transfer;
+            raft_time timeout_now;
+
+            /**
+             * Payload size of the commands appended in this term and not yet
+             * committed.
+             */
+            size_t uncommitted_bytes;
+
+            /**
+             * Whether we stopped sending heartbeats, since when we had nothing
+             * to replicate, or 0 if we had, and when we last woke up.
+             */
+            bool hibernating;
+            raft_time idle_time;
+            raft_time wake_time;
+
+            /**
+             * Current heartbeat round, carried by our AppendEntries RPCs. A
+             * result echoing it shows that its sender still followed us after
+             * the round started. Also keep when the current and the previous
+             * round started.
+             */
+            raft_index seq;
+            raft_time seq_time;
+            raft_time prev_seq_time;
         } leader_state;
     };
 
@@ -795,8 +2090,59 @@ struct raft
         raft_term term;                  /* Term of last saved snapshot */
         raft_index index;                /* Index of last saved snapshot */
         struct raft_snapshot pending;    /* In progress snapshot */
+        size_t size;                     /* Size of last saved snapshot */
         unsigned threshold;              /* N. of entries before snapshot */
+        size_t threshold_bytes;          /* Size of entries before snapshot */
+        unsigned threshold_ratio;        /* Same, in % of snapshot size */
+        unsigned trailing;               /* N. of entries to retain */
+        size_t trailing_bytes;           /* Size of entries to retain */
         struct raft_io_snapshot_put put; /* Store snapshot request */
+        struct raft_fsm_snapshot take;   /* Take snapshot request */
+        raft_time start;                 /* When the pending one started */
+        size_t chunk_size;               /* Max data per InstallSnapshot */
+        bool delegate;                   /* Let followers send snapshots */
+        void *shared;                    /* Snapshot loaded for sending */
+        struct
+        {
+            raft_index base;                     /* Last snapshot taken */
+            struct raft_snapshot_patch *patches; /* Changes being stored */
+            unsigned n;                          /* Number of patches */
+            size_t size;                         /* Size of the new data */
+            bool storing;                        /* Whether being stored */
+        } patch;                         /* Snapshot stored as changes */
+        struct
+        {
+            size_t offset;      /* Amount of data serialized so far */
+            unsigned n_pending; /* Number of chunks being written */
+            bool done;          /* Whether the last chunk was serialized */
+            int status;         /* First error occurred, if any */
+        } stream;                        /* Snapshot being taken in chunks */
+        struct
+        {
+            raft_index index;       /* Index of the snapshot, or 0 if none */
+            raft_term term;         /* Term of the snapshot */
+            size_t offset;          /* Amount of data received so far */
+            unsigned sender;        /* Server sending the snapshot */
+            struct raft_buffer buf; /* Data received so far, if in memory */
+        } install;                  /* Snapshot being received in chunks */
+        struct
+        {
+            unsigned sender; /* Server that sent it */
+            raft_time start; /* When its first chunk was received */
+        } received;          /* Last snapshot being received or restored */
+        struct
+        {
+            raft_index base;  /* Snapshot index the size is relative to */
+            raft_index index; /* Last entry accounted for */
+            size_t size;      /* Size of entries in (base, index] */
+        } applied;            /* Entries applied since last snapshot */
+        struct
+        {
+            unsigned quiet;       /* Idle time a due snapshot waits for */
+            unsigned factor;      /* Thresholds multiplier forcing it */
+            raft_time last_apply; /* When entries were last applied */
+            bool waiting;         /* Whether a due snapshot is waiting */
+        } deferral;               /* Snapshots deferred to quiet periods */
     } snapshot;
 
     /**
@@ -804,10 +2150,33 @@ struct raft
      */
     void (*watchers[RAFT_EVENT_N])(void *, int, void *);
 
+    /**
+     * Registered tracer, see raft_set_tracer().
+     */
+    raft_trace_cb tracer;
+
     /**
      * Callback to invoke once a close request has completed.
      */
     void (*close_cb)(struct raft *r);
+    bool io_closed; /* Whether the I/O backend has been closed */
+
+    /**
+     * Asynchronous load issued by raft_start(), see raft_io->load_async.
+     */
+    struct
+    {
+        struct raft_io_load req; /* Pending request */
+        raft_time start;         /* When it was issued */
+        bool pending;            /* Whether it's in flight */
+    } load;
+
+    /**
+     * Requests submitted with raft_submit() and not yet appended, most recent
+     * first. Pushed to by any thread without locking, and drained by the loop
+     * thread.
+     */
+    struct raft_apply *submitted;
 };
 
 /**
@@ -832,6 +2201,10 @@ int raft_bootstrap(struct raft *r, const struct raft_configuration *conf);
 
 /**
  * Start this raft instance.
+ *
+ * If the backend implements raft_io->load_async, this function returns as
+ * soon as the load has been submitted, and the instance stays unavailable
+ * until it completes. A #RAFT_EVENT_STARTED event is then fired.
  */
 int raft_start(struct raft *r);
 
@@ -853,11 +2226,259 @@ int raft_start(struct raft *r);
  */
 void raft_set_election_timeout(struct raft *r, unsigned msecs);
 
+/**
+ * Enable the adaptive election timeout, bounded between @min and @max
+ * milliseconds, or disable it if @max is zero.
+ *
+ * When enabled, leaders measure the round-trip time of AppendEntries RPCs to
+ * each voting follower and use ten times the highest one, deviation included,
+ * as election timeout, sending heartbeats every tenth of it. Followers derive
+ * the same value from the interval between the heartbeats they receive. Until
+ * an estimate is available, the static election and heartbeat timeouts are
+ * used. All servers of a cluster should use the same bounds.
+ */
+void raft_set_adaptive_election_timeout(struct raft *r,
+                                        unsigned min,
+                                        unsigned max);
+
 /**
  * Set the heartbeat timeout.
  */
 void raft_set_heartbeat_timeout(struct raft *r, unsigned msecs);
 
+/**
+ * Set the read lease timeout.
+ */
+void raft_set_read_lease_timeout(struct raft *r, unsigned msecs);
+
+/**
+ * Let leaders hibernate once all servers have all entries and no request has
+ * been submitted for @msecs milliseconds. A hibernating leader sends a last
+ * round of heartbeats telling followers to suspend their election timers, and
+ * then stops sending heartbeats altogether, so idle groups use no CPU or
+ * network. The default of 0 disables hibernation.
+ *
+ * Any new entry, read request or leadership transfer wakes the leader up, as
+ * do vote requests from servers that missed the last round. Followers wake up
+ * when they get entries or a regular heartbeat, when submitting a request or
+ * when receiving a vote request. Since hibernating followers don't detect the
+ * failure of the leader by themselves, the application must call raft_wake()
+ * once it notices that a peer is unreachable.
+ */
+void raft_set_hibernate_timeout(struct raft *r, unsigned msecs);
+
+/**
+ * Resume the timers suspended by hibernation, if any: leaders send heartbeats
+ * again and followers start counting the election timeout from now.
+ */
+void raft_wake(struct raft *r);
+
+/**
+ * Set the contact timeout and the probe strategy used for followers that
+ * didn't answer within it.
+ *
+ * With #RAFT_PROBE_HEARTBEAT, leaders only send heartbeats to such followers
+ * until they answer one, so a follower coming back from a long pause gets new
+ * entries only after a further round trip. With #RAFT_PROBE_REWIND, leaders
+ * resend entries right after the last one known to be replicated, at every
+ * heartbeat, so the follower can catch up as soon as it's back, at the cost of
+ * sending entries to followers which might be down.
+ */
+void raft_set_contact_timeout(struct raft *r, unsigned msecs, int strategy);
+
+/**
+ * Enable or disable the pre-vote round run by candidates before incrementing
+ * their term.
+ */
+void raft_set_pre_vote(struct raft *r, bool enabled);
+
+/**
+ * Set the limits applied to AppendEntries RPCs sent to followers.
+ *
+ * The @max_entries and @max_bytes parameters cap the number of entries and the
+ * size of the entries payload of a single message. The @max_inflight_bytes
+ * parameter caps the total size of entries payload that can be in the process
+ * of being sent to a single follower: once it's reached, only heartbeats are
+ * sent to that follower until some of the pending sends complete. A value of
+ * zero disables the relevant limit.
+ *
+ * By default there is no limit on the number of entries, a message carries at
+ * most 4 megabytes of entries and at most 16 megabytes can be in flight.
+ */
+void raft_set_append_entries_limits(struct raft *r,
+                                    unsigned max_entries,
+                                    size_t max_bytes,
+                                    size_t max_inflight_bytes);
+
+/**
+ * Set the maximum payload size of the commands that a leader holds appended but
+ * not yet committed, which grows when disks or followers are slow.
+ *
+ * Once it's reached, @raft_apply and @raft_submit fail with
+ * #RAFT_EBACKPRESSURE, until enough commands get committed for the uncommitted
+ * payload to drop to half of @max_bytes. At that point a
+ * #RAFT_EVENT_PRESSURE_RELIEVED event is fired. A value of zero, the default,
+ * disables the limit.
+ */
+void raft_set_max_uncommitted_bytes(struct raft *r, size_t max_bytes);
+
+/**
+ * Set the limits applied to AppendEntries RPCs sent to non-voting servers,
+ * with the same meaning as in raft_set_append_entries_limits(). By default
+ * non-voting servers get the same limits as voting ones. A server being
+ * promoted is always treated as a voting one.
+ */
+void raft_set_learner_append_entries_limits(struct raft *r,
+                                            unsigned max_entries,
+                                            size_t max_bytes,
+                                            size_t max_inflight_bytes);
+
+/**
+ * Set the interval between heartbeats sent to non-voting servers. Since they
+ * never start elections, this can be longer than the heartbeat timeout, in
+ * order to reduce the send work of the leader. Values lower than the heartbeat
+ * timeout have no effect. By default, or if @msecs is zero, non-voting
+ * servers get heartbeats as often as voting ones.
+ */
+void raft_set_learner_heartbeat_timeout(struct raft *r, unsigned msecs);
+
+/**
+ * Set the maximum size of the entries payload held in the in-memory log cache.
+ *
+ * By default there is no limit and all entries since the last snapshot are
+ * kept in memory. Setting a limit has no effect if the #raft_io implementation
+ * does not support reading entries back from disk.
+ */
+void raft_set_log_cache_size(struct raft *r, size_t bytes);
+
+/**
+ * Enable or disable group commit of the entries appended by raft_apply(). It
+ * has no effect if the I/O backend doesn't implement raft_io->defer.
+ */
+void raft_set_group_commit(struct raft *r, bool enabled);
+
+/**
+ * Enable or disable batching of the AppendEntries results sent by followers.
+ * When enabled, the entries persisted during the same loop iteration are
+ * acknowledged with a single result for the highest stored index. If
+ * @max_delay is not zero, the result is further held back for up to
+ * @max_delay milliseconds, merging the entries persisted in the meantime.
+ *
+ * It has no effect if the I/O backend doesn't implement raft_io->defer. If
+ * the backend doesn't implement raft_io->tick_after either, held back results
+ * are sent at the first tick after @max_delay has elapsed.
+ */
+void raft_set_ack_batching(struct raft *r, bool enabled, unsigned max_delay);
+
+/**
+ * Enable or disable commit notifications. When enabled, a leader whose commit
+ * index advances sends an AppendEntries request carrying it to the followers
+ * that weren't told about it yet, at most once per loop iteration. It has no
+ * effect if the I/O backend doesn't implement raft_io->defer.
+ */
+void raft_set_commit_notify(struct raft *r, bool enabled);
+
+/**
+ * Set the maximum number of committed entries applied to the FSM during a
+ * single loop iteration. Entries committed beyond that are applied in the
+ * following iterations. A value of zero, the default, means no limit. It has
+ * no effect if the I/O backend doesn't implement raft_io->defer.
+ */
+void raft_set_apply_budget(struct raft *r, unsigned max_entries);
+
+/**
+ * Set when a new snapshot should be taken.
+ *
+ * A snapshot is taken as soon as any of the following criteria is met: at
+ * least @n entries were applied since the last snapshot, the total payload size
+ * of those entries reaches @bytes, or it reaches @ratio percent of the size of
+ * the last snapshot. The first two criteria bound the amount of log data to
+ * replay at startup, while the last one keeps the disk usage of the log
+ * proportional to the size of the state. A value of zero disables the relevant
+ * criterion. By default a snapshot is taken every 1024 entries.
+ */
+void raft_set_snapshot_threshold(struct raft *r,
+                                 unsigned n,
+                                 size_t bytes,
+                                 unsigned ratio);
+
+/**
+ * Set whether a snapshot that is due according to the criteria set with
+ * raft_set_snapshot_threshold() waits for a quiet period, so that taking and
+ * storing it doesn't compete with peaks of traffic for CPU and disk.
+ *
+ * If @quiet is not zero, a due snapshot is taken only once no entry has been
+ * applied for @quiet milliseconds, unless the entries applied since the last
+ * snapshot reach @factor times any of the thresholds, in which case it's taken
+ * right away, so the log doesn't grow without bounds. It's disabled by
+ * default.
+ */
+void raft_set_snapshot_deferral(struct raft *r,
+                                unsigned quiet,
+                                unsigned factor);
+
+/**
+ * Set how many entries to retain in the log after a snapshot is taken, so that
+ * followers which are only slightly behind can still catch up by receiving
+ * entries instead of a whole snapshot.
+ *
+ * At least the last @n entries are retained, and older entries are retained
+ * too until their total payload size reaches @bytes. A value of zero disables
+ * the relevant criterion. By default the last 100 entries are retained.
+ */
+void raft_set_snapshot_trailing(struct raft *r, unsigned n, size_t bytes);
+
+/**
+ * Set the maximum amount of snapshot data that a leader sends in a single
+ * InstallSnapshot RPC. Larger snapshots are sent in several chunks, so neither
+ * the messages nor the follower need to hold the whole snapshot in memory. A
+ * value of zero sends the whole snapshot at once. The default is 4 megabytes.
+ */
+void raft_set_snapshot_chunk_size(struct raft *r, size_t size);
+
+/**
+ * Set whether a leader can ask an up-to-date follower holding the same or a
+ * newer snapshot to send it to a server lagging behind, instead of reading and
+ * sending it itself. This frees the leader's disk and network for client
+ * requests while new servers are brought up. If the follower can't send its
+ * snapshot, or stops reporting progress for an election timeout, the leader
+ * sends its own. All servers must support the SendSnapshot RPC. It's disabled
+ * by default.
+ */
+void raft_set_snapshot_delegation(struct raft *r, bool enabled);
+
+/**
+ * Set the maximum rate in bytes per second of background transfers, i.e. the
+ * snapshots and the entries read back from disk sent to servers lagging behind,
+ * so they don't compete for bandwidth with the replication to the others. The
+ * @peer_rate limit applies to each server and the @total_rate one to all of
+ * them together. A value of zero disables the relevant limit, which is the
+ * default. Up to one second worth of budget can be accumulated, and snapshots
+ * are sent in smaller chunks while throttled. Half of the budget of all servers
+ * is reserved to the voting servers with the lowest round-trip times that form
+ * a quorum along with the leader.
+ */
+void raft_set_background_rate(struct raft *r,
+                              size_t peer_rate,
+                              size_t total_rate);
+
+/**
+ * Enable or disable the forwarding of raft_apply() requests from followers to
+ * the current leader. See raft_apply(). All servers must support the Propose
+ * RPC. It's disabled by default.
+ */
+void raft_set_apply_forwarding(struct raft *r, bool enabled);
+
+/**
+ * Enable or disable packing the commands of each raft_apply() call, and of all
+ * raft_submit() calls handled in the same loop iteration, into a single
+ * #RAFT_BATCH entry. This saves the per-entry overhead on disk, on the wire and
+ * in memory. The commands are unpacked when applied, and passed to the FSM one
+ * at a time. All servers must support #RAFT_BATCH entries. It's disabled by
+ * default.
+ */
+void raft_set_apply_batching(struct raft *r, bool enabled);
+
 /**
  * Return the code of the current raft state.
  */
@@ -878,6 +2499,46 @@ void raft_leader(struct raft *r, unsigned *id, const char **address);
  */
 raft_index raft_last_applied(struct raft *r);
 
+/**
+ * Replication progress of a server, as seen by the leader.
+ */
+struct raft_server_stats
+{
+    unsigned id;            /* Server ID */
+    raft_index next_index;  /* Next entry to send */
+    raft_index match_index; /* Highest entry known to be replicated */
+    raft_index lag;         /* Entries of the leader not yet replicated */
+    size_t lag_bytes;       /* Payload of those entries still in the log */
+    raft_time last_contact; /* Timestamp of last RPC received */
+};
+
+/**
+ * Statistics of a raft instance.
+ */
+struct raft_stats
+{
+    unsigned short state;              /* Current state code */
+    raft_term term;                    /* Current term */
+    raft_index last_index;             /* Index of last entry in the log */
+    raft_index commit_index;           /* Highest entry known to be committed */
+    raft_index last_applied;           /* Highest entry applied to the FSM */
+    struct raft_counters counters;     /* Cumulative counters */
+    struct raft_server_stats *servers; /* Progress of the other servers */
+    unsigned n_servers;                /* Length of @servers */
+};
+
+/**
+ * Fill @stats with the current statistics of this raft instance.
+ *
+ * The commit latency histogram counts the time from raft_apply() or from the
+ * loop thread picking up a request submitted with raft_submit(), to the firing
+ * of the request callback. If this server is the leader, @servers is set to an
+ * array allocated with raft_malloc(), holding the replication progress of all
+ * other servers in the configuration, which must be released with raft_free().
+ * Otherwise it's set to NULL.
+ */
+int raft_stats(struct raft *r, struct raft_stats *stats);
+
 /**
  * Return the amount of milliseconds left before the next timeout triggers. If
  * the instance is in leader state this is the heartbeat timeout, otherwise it's
@@ -897,6 +2558,11 @@ struct raft_apply
     raft_index index;
     raft_apply_cb cb;
     void *queue[2];
+    raft_time time;                 /* When the entries were appended */
+    const struct raft_buffer *bufs; /* Used by raft_submit() */
+    unsigned n;                     /* Used by raft_submit() */
+    struct raft_apply *next;        /* Used by raft_submit() */
+    raft_index forward_id;          /* Used when forwarded to the leader */
 };
 
 /**
@@ -918,6 +2584,19 @@ struct raft_apply
  * The ownership of the memory of the @bufs array itself is not transferred to
  * the raft library, and, if allocated dynamically, must be deallocated by the
  * caller.
+ *
+ * If batching is enabled with raft_set_apply_batching() and @n is greater than
+ * one, a single #RAFT_BATCH entry holding a copy of the commands is created
+ * instead, and their payloads are released before returning.
+ *
+ * If this server is a follower that knows the current leader and forwarding
+ * is enabled with raft_set_apply_forwarding(), the commands are sent to the
+ * leader with a Propose RPC instead, and @cb fires once the leader has applied
+ * them, with @index set to the index of the first one. If the leader rejects
+ * them, the error it returned is passed to @cb. If no result arrives within an
+ * election timeout @cb fires with #RAFT_ERR_TIMEOUT, and if we stop following
+ * the leader in the meantime with #RAFT_ERR_LEADERSHIP_LOST. In both cases the
+ * commands might or might not get committed.
  */
 int raft_apply(struct raft *r,
                struct raft_apply *req,
@@ -925,6 +2604,123 @@ int raft_apply(struct raft *r,
                const unsigned n,
                raft_apply_cb cb);
 
+/**
+ * Like raft_apply(), but the payloads of the commands are copied, so the
+ * ownership of the memory pointed at by the @bufs array is not transferred to
+ * the raft library and it can be released or reused as soon as this function
+ * returns.
+ *
+ * All the commands of a request are copied into a single allocation shared by
+ * their entries, which is released once none of them is needed anymore. This
+ * is meant for small commands, which would otherwise each need their own heap
+ * allocation. If batching is enabled with raft_set_apply_batching() and @n is
+ * greater than one, the commands are copied into a single #RAFT_BATCH entry
+ * as for raft_apply().
+ */
+int raft_apply_copy(struct raft *r,
+                    struct raft_apply *req,
+                    const struct raft_buffer bufs[],
+                    const unsigned n,
+                    raft_apply_cb cb);
+
+/**
+ * Like raft_apply(), but it can be called from any thread.
+ *
+ * The request is pushed to a lock-free queue and the loop thread is woken up
+ * with raft_io->wakeup. All requests submitted before the loop thread runs are
+ * then appended to the log and written to disk together. Errors, including
+ * #RAFT_ERR_NOT_LEADER, are reported to @cb, which always fires in the loop
+ * thread. Requests still queued when raft_close() is called fail with
+ * #RAFT_ERR_SHUTDOWN. No request must be submitted after that.
+ *
+ * The @bufs array must be kept valid until @cb fires. Return #RAFT_EINVAL if
+ * the I/O backend doesn't implement raft_io->wakeup.
+ */
+int raft_submit(struct raft *r,
+                struct raft_apply *req,
+                const struct raft_buffer bufs[],
+                const unsigned n,
+                raft_apply_cb cb);
+
+/**
+ * Asynchronous request to perform a linearizable read using the ReadIndex
+ * protocol (Section 6.4).
+ */
+struct raft_read;
+typedef void (*raft_read_cb)(struct raft_read *req, int status);
+struct raft_read
+{
+    void *data;
+    raft_index index; /* Commit index the read must wait for */
+    raft_time time;   /* Time the leadership check was started */
+    raft_index seq;   /* Heartbeat round that must confirm leadership */
+    bool confirmed;   /* Whether leadership was confirmed */
+    raft_read_cb cb;
+    void *queue[2];
+};
+
+/**
+ * Request to serve a linearizable read without appending an entry to the log.
+ *
+ * If this server is the leader, it records the current commit index and sends
+ * a round of heartbeats to confirm that it's still the leader. The callback is
+ * invoked with status 0 once a majority of voting servers has acknowledged the
+ * heartbeats and the FSM has applied all entries up to the recorded index: at
+ * that point the FSM can be queried locally. If an entry of the current term
+ * has not been committed yet, the read waits for it. Reads submitted while a
+ * round is in flight share the next one, since only results echoing a round
+ * started after the read was submitted can confirm it.
+ *
+ * If this server is a follower, it asks the current leader for its read index
+ * with a ReadIndex RPC, and invokes the callback once its own FSM has applied
+ * all entries up to that index.
+ */
+int raft_read_index(struct raft *r, struct raft_read *req, raft_read_cb cb);
+
+/**
+ * Like raft_read_index(), but if the leader holds a valid read lease and the
+ * FSM is up-to-date with the commit index, the callback is invoked right away,
+ * before this function returns, without any round trip to other servers. The
+ * leader holds no lease while a leadership transfer is in progress, nor for an
+ * election timeout after it sent TimeoutNow to the target.
+ */
+int raft_read_lease(struct raft *r, struct raft_read *req, raft_read_cb cb);
+
+/**
+ * Asynchronous request to transfer leadership to another server (Section
+ * 3.10).
+ */
+struct raft_transfer;
+typedef void (*raft_transfer_cb)(struct raft_transfer *req, int status);
+struct raft_transfer
+{
+    void *data;
+    unsigned id;     /* ID of the target server */
+    raft_time start; /* Time the transfer was started */
+    bool sent;       /* Whether TimeoutNow was sent to the target */
+    raft_transfer_cb cb;
+};
+
+/**
+ * Transfer leadership to the voting server with the given ID, which must not be
+ * a witness.
+ *
+ * The leader stops accepting new entries, brings the log of the target server
+ * up-to-date and then sends it a TimeoutNow message, which makes it start an
+ * election right away without waiting for its election timeout. The callback
+ * is invoked with status 0 when this server steps down after sending the
+ * TimeoutNow message, or with #RAFT_ERR_TIMEOUT if that does not happen within
+ * an election timeout, in which case this server keeps being the leader and
+ * accepts new entries again.
+ *
+ * While a transfer is in progress, raft_apply() and further calls to this
+ * function fail with #RAFT_ERR_NOT_LEADER.
+ */
+int raft_transfer_leadership(struct raft *r,
+                             struct raft_transfer *req,
+                             unsigned id,
+                             raft_transfer_cb cb);
+
 /**
  * Add a new non-voting server to the cluster configuration.
  */
@@ -940,6 +2736,26 @@ int raft_promote(struct raft *r, const unsigned id);
  */
 int raft_remove_server(struct raft *r, const unsigned id);
 
+/**
+ * Replace several voters in a single configuration transition, promoting the
+ * given non-voting servers and removing the given voting ones.
+ *
+ * The servers to promote must have been added with raft_add_server() first, so
+ * they catch up with the log while still non-voting. A joint configuration is
+ * then appended, in which entries and elections need a majority of both the
+ * old and the new voters, and once it's committed the leader automatically
+ * appends the final configuration with only the new voters. No other
+ * configuration change can be made until that one is committed too.
+ *
+ * Joint configurations are encoded in a format that older versions of this
+ * library can't decode, so all servers must be upgraded before using this.
+ */
+int raft_replace_voters(struct raft *r,
+                        const unsigned promote[],
+                        unsigned n_promote,
+                        const unsigned remove[],
+                        unsigned n_remove);
+
 /**
  * Register a callback to be fired upon the given event.
  *
@@ -952,6 +2768,26 @@ int raft_remove_server(struct raft *r, const unsigned id);
  */
 void raft_watch(struct raft *r, int event, void (*cb)(void *, int, void *));
 
+/**
+ * Register a callback to be invoked at each trace point hit, or disable it if
+ * @cb is NULL, the default.
+ *
+ * Trace points are placed on the replication, disk I/O and election paths,
+ * where logging would be too costly to enable in production. When the library
+ * is built with <sys/sdt.h> available, each trace point is also a USDT probe
+ * of the "raft" provider, named after the trace point ID without prefix
+ * (e.g. "append_done"), with the server ID followed by the @raft_trace fields
+ * as arguments. Probes cost a no-op instruction when no tracer is attached,
+ * and a disabled callback costs a single branch.
+ */
+void raft_set_tracer(struct raft *r, raft_trace_cb cb);
+
+/**
+ * Set the minimum level of the messages emitted by the instance and its I/O
+ * backend. Messages with a lower level cost a single comparison.
+ */
+void raft_set_log_level(struct raft *r, int level);
+
 /**
  * User-definable dynamic memory allocation functions.
  *
@@ -984,4 +2820,16 @@ void raft_heap_set(struct raft_heap *heap);
  */
 void raft_heap_set_default();
 
+/**
+ * Use a custom dynamic memory allocator in the calling thread only, overriding
+ * the process-wide one. Passing NULL clears it.
+ *
+ * All the work of a raft instance and of its io_uv backend happens in the
+ * thread running their loop, so a process hosting each group on its own loop
+ * thread can give each group its own allocator. The disk threads of an io_uv
+ * instance use the allocator of the thread that initialized it. Buffers passed
+ * to @raft_submit from other threads must come from the same allocator.
+ */
+void raft_heap_set_thread(struct raft_heap *heap);
+
 #endif /* RAFT_H */
@@ -8,7 +8,7 @@
 
 #include "../raft.h"
 
-#define RAFT_FIXTURE_MAX_SERVERS 8
+#define RAFT_FIXTURE_MAX_SERVERS 64
 
 struct raft_fixture_server
 {
@@ -134,16 +134,21 @@ void raft_fixture_depose(struct raft_fixture *f);
  *    entries). The in-memory I/O implementation assigns a random latency to
  *    each RPC message, which will get delivered to the receiver only after that
  *    amount of time elapses. If the sender and the receiver are currently
- *    disconnected, the RPC message is simply dropped.
+ *    disconnected, the RPC message is simply dropped. Likewise, if a disk model
+ *    was set with @raft_fixture_set_disk, the callbacks of disk writes are
+ *    fired only once their completion time is reached.
  *
- * 2. All pending RPC messages across all servers are scanned and the one with
- *    the lowest delivery time is picked. All servers are scanned too, and the
- *    one with the lowest timer expiration time is picked (that will be either
- *    election timer or heartbeat timer, depending on the server state). The two
- *    times are compared and the lower one is picked. If there's an RPC to be
- *    delivered, the receiver's @raft_io_recv_cb callback gets fired. Then the
- *    @raft_io_tick_cb callback of all servers is invoked, with amount of time
- *    elapsed. The timer of each remaining RPC message is updated accordingly.
+ * 2. The time of the next event is determined, that is the lowest between the
+ *    delivery time of the first pending RPC message of each server, the
+ *    completion time of its first disk write in flight and the expiration time
+ *    of its timer (that will be either election timer or heartbeat timer,
+ *    depending on the server state). The time of all servers is advanced to
+ *    it, then the disk writes whose time has come are completed, the
+ *    @raft_io_tick_cb callback of the servers whose timer has expired is
+ *    invoked, and the RPC messages whose latency has elapsed are delivered,
+ *    firing the receiver's @raft_io_recv_cb callback. Servers whose timer has
+ *    not expired are not ticked, so the cost of a step only depends on the
+ *    events it fires.
  *
  * 3. The current cluster leader is detected (if any). When detecting the leader
  *    the Election Safety property is checked: no servers can be in leader state
@@ -164,6 +169,13 @@ void raft_fixture_depose(struct raft_fixture *f);
  */
 void raft_fixture_step(struct raft_fixture *f);
 
+/**
+ * Like @raft_fixture_step(), but if @time is in the future and the next event
+ * is due after it, just advance the time of all servers to @time. This lets
+ * callers submit requests at precise times.
+ */
+void raft_fixture_step_to(struct raft_fixture *f, raft_time time);
+
 /**
  * Step the cluster until the given @stop function returns #true, or @max_msecs
  * have elapsed.
@@ -246,6 +258,19 @@ void raft_fixture_set_latency(struct raft_fixture *f,
                               unsigned min,
                               unsigned max);
 
+/**
+ * Set the disk model of the @i'th server: writes complete after a random
+ * sync latency between @min and @max milliseconds, transferring their data at
+ * @bandwidth bytes per second (zero meaning unlimited), with at most @depth of
+ * them in flight. See raft_io_stub_set_disk().
+ */
+void raft_fixture_set_disk(struct raft_fixture *f,
+                           unsigned i,
+                           unsigned min,
+                           unsigned max,
+                           unsigned bandwidth,
+                           unsigned depth);
+
 /**
  * Set the persisted term of the @i'th server.
  */
@@ -0,0 +1,56 @@
+/**
+ * Implementation of the @raft_io interface wrapping another one and injecting
+ * latency into its disk writes and network sends, meant for benchmarks.
+ */
+#ifndef RAFT_IO_DELAY_H
+#define RAFT_IO_DELAY_H
+
+struct raft_io;
+
+/**
+ * Configure the given @raft_io instance to forward all calls to @inner, which
+ * must have been initialized already and whose data field is taken over by the
+ * wrapper. Disk writes and network sends are delayed as configured with
+ * raft_io_delay_set_disk() and raft_io_delay_set_network(), and by default are
+ * not delayed at all.
+ *
+ * Delayed events are released when the tick of @inner fires: if @inner
+ * implements tick_after the wrapper requests ticks at the exact times needed,
+ * otherwise delays are rounded up to the tick interval.
+ */
+int raft_io_delay_init(struct raft_io *io, struct raft_io *inner);
+
+/**
+ * Release all memory held by the given wrapper, once its close callback has
+ * fired. The inner instance is left untouched.
+ */
+void raft_io_delay_close(struct raft_io *io);
+
+/**
+ * Delay the completion of asynchronous disk writes of entries, snapshots and
+ * metadata. Once @inner has completed a write, the write waits for the transfer
+ * of its data at @bandwidth bytes per second (zero meaning unlimited) after the
+ * previous writes, and then for a random latency between @min and @max
+ * milliseconds. Writes complete in the order @inner completed them, while
+ * synchronous writes are not delayed.
+ */
+void raft_io_delay_set_disk(struct raft_io *io,
+                            unsigned min,
+                            unsigned max,
+                            unsigned bandwidth);
+
+/**
+ * Delay the messages sent to the server with the given @id, or to all servers
+ * without specific settings if @id is zero. A message first waits for the
+ * transfer of its data at @bandwidth bytes per second (zero meaning unlimited)
+ * after the previous messages to the same server, and then for a random latency
+ * between @min and @max milliseconds, after which it's handed to @inner.
+ * Messages to the same server are handed over in order.
+ */
+int raft_io_delay_set_network(struct raft_io *io,
+                              unsigned id,
+                              unsigned min,
+                              unsigned max,
+                              unsigned bandwidth);
+
+#endif /* RAFT_IO_DELAY_H */
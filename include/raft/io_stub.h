@@ -42,6 +42,22 @@ void raft_io_stub_set_random(struct raft_io *io, int (*f)(int, int));
  */
 void raft_io_stub_set_latency(struct raft_io *io, unsigned min, unsigned max);
 
+/**
+ * Model the disk persisting appended entries and snapshots. The data of a
+ * write is stored as soon as its request is flushed, but its callback is fired
+ * only once the write completes. A write first waits until less than @depth
+ * writes are in flight, then for its data to be transferred at @bandwidth
+ * bytes per second (zero meaning unlimited), and finally for a random sync
+ * latency between @min and @max milliseconds. Writes complete in the order
+ * they were flushed. By default, or if @depth is zero, writes complete as soon
+ * as they are flushed.
+ */
+void raft_io_stub_set_disk(struct raft_io *io,
+                           unsigned min,
+                           unsigned max,
+                           unsigned bandwidth,
+                           unsigned depth);
+
 /**
  * Set the initial term stored in this instance.
  */
@@ -62,12 +78,24 @@ void raft_io_stub_set_entries(struct raft_io *io,
 
 /**
  * Advance the stub time by the given number of milliseconds, and invoke the
- * tick callback accordingly. Also, update the timers of messages in the
- * transmit queue, and if any of them expires deliver it to the destination peer
- * (if connected).
+ * tick callback accordingly. Also, complete the disk writes whose time has
+ * come and deliver the messages in the transmit queue whose latency has
+ * elapsed to their destination peer (if connected).
  */
 void raft_io_stub_advance(struct raft_io *io, unsigned msecs);
 
+/**
+ * Deliver all messages in the transmit queue whose latency has elapsed at the
+ * current stub time, without invoking the tick callback.
+ */
+void raft_io_stub_transmit(struct raft_io *io);
+
+/**
+ * Fire the callbacks of all disk writes completed at the current stub time,
+ * without invoking the tick callback.
+ */
+void raft_io_stub_complete(struct raft_io *io);
+
 /**
  * Flush the oldest request in the pending I/O queue, invoking the associated
  * callback as appropriate.
@@ -77,7 +105,8 @@ void raft_io_stub_advance(struct raft_io *io, unsigned msecs);
 bool raft_io_stub_flush(struct raft_io *io);
 
 /**
- * Flush all pending I/O requests.
+ * Flush all pending I/O requests. Writes in flight on the disk model are
+ * completed later, see raft_io_stub_set_disk().
  */
 void raft_io_stub_flush_all(struct raft_io *io);
 
@@ -87,6 +116,12 @@ void raft_io_stub_flush_all(struct raft_io *io);
  */
 int raft_io_stub_next_deliver_timeout(struct raft_io *io);
 
+/**
+ * Return the amount of milliseconds left before the next disk write in flight
+ * completes. If no write is in flight, return -1.
+ */
+int raft_io_stub_next_complete_timeout(struct raft_io *io);
+
 /**
  * Manually trigger the delivery of a message, invoking the recv callback.
  */
@@ -114,6 +149,16 @@ void raft_io_stub_appending(struct raft_io *io,
  */
 unsigned raft_io_stub_n_sending(struct raft_io *io);
 
+/**
+ * Return the number of times raft_io->broadcast() was called.
+ */
+unsigned raft_io_stub_n_broadcasts(struct raft_io *io);
+
+/**
+ * Return the number of times raft_io->replace() was called.
+ */
+unsigned raft_io_stub_n_replaces(struct raft_io *io);
+
 /**
  * Return a pointer to the message associated with the i'th pending raft_io_send
  * request, or NULL.
@@ -165,4 +210,17 @@ void raft_io_stub_reconnect(struct raft_io *io, struct raft_io *other);
  */
 void raft_io_stub_drop(struct raft_io *io, int type, bool flag);
 
+/**
+ * Enable or disable reporting the server with the given ID as congested. This
+ * only has effect if the version of @io is at least 5.
+ */
+void raft_io_stub_congest(struct raft_io *io, unsigned id, bool flag);
+
+/**
+ * If raft_io->wakeup was called since the last time, fire the callback set with
+ * raft_io->set_wakeup and return true. This only has effect if the version of
+ * @io is at least 7.
+ */
+bool raft_io_stub_wakeup(struct raft_io *io);
+
 #endif /* RAFT_IO_STUB_H */
@@ -1,10 +1,13 @@
 #ifndef RAFT_IO_UV_H
 #define RAFT_IO_UV_H
 
+#include <stdbool.h>
+
 #include <uv.h>
 
-#define RAFT_IO_UV_METADATA_SIZE (8 * 4)              /* Four 64-bit words */
+#define RAFT_IO_UV_METADATA_SIZE (8 * 5)              /* Five 64-bit words */
 #define RAFT_IO_UV_MAX_SEGMENT_SIZE (8 * 1024 * 1024) /* 8 Megabytes */
+#define RAFT_IO_UV_PREPARE_POOL_SIZE 2 /* Default max prepared segments */
 
 struct raft_io;
 struct raft_io_uv_transport;
@@ -25,8 +28,8 @@ struct raft_io_uv_transport;
  * contiguous entries that are part of the log. Closed segments are never
  * written to again (but may be renamed and truncated if a suffix of the log is
  * truncated). Open segments are where newly appended entries go. Once an open
- * segment reaches RAFT_IO_UV_MAX_SEGMENT_SIZE, it is closed and a new one is
- * used.
+ * segment reaches its maximum size (RAFT_IO_UV_MAX_SEGMENT_SIZE by default, see
+ * raft_io_uv_set_segment_size()), it is closed and a new one is used.
  *
  * Metadata files are named "metadata1" and "metadata2". The code alternates
  * between these so that there is always at least one readable metadata file.
@@ -83,6 +86,421 @@ int raft_io_uv_init(struct raft_io *io,
 
 void raft_io_uv_close(struct raft_io *io);
 
+/**
+ * Set the size of newly created open segments, which must be a non-zero
+ * multiple of the block size of the file system of the data directory. Fail
+ * with #RAFT_EINVAL if it's not, or with #RAFT_ERR_BUSY if open segments have
+ * already been created with the current size.
+ */
+int raft_io_uv_set_segment_size(struct raft_io *io, size_t size);
+
+/**
+ * Set the number of threads running blocking disk I/O, such as fsyncs and
+ * segment renames. These threads are dedicated to this instance, so their
+ * latency is not affected by work that the application queues to the libuv
+ * threadpool. Must be called before raft_io->init(), fail with #RAFT_ERR_BUSY
+ * otherwise, or with #RAFT_EINVAL if @n is 0 or greater than 8. The default is
+ * 2.
+ */
+int raft_io_uv_set_disk_threads(struct raft_io *io, unsigned n);
+
+/**
+ * Set how many open segments to create in advance and keep ready for writing,
+ * at most, so that appends don't have to wait for a new segment when the
+ * current one is full. Fewer are kept when writes are slow: just enough to
+ * hold the next few seconds of writes at the rate segments have recently been
+ * filled, and a single one for idle instances. Fail with #RAFT_EINVAL if @n is
+ * 0.
+ */
+int raft_io_uv_set_prepare_pool_size(struct raft_io *io, unsigned n);
+
+/**
+ * Hold back the write of newly appended entries for up to @max_delay
+ * microseconds, so it can be coalesced with entries appended shortly after,
+ * trading some latency for fewer device flushes. Writes are never held back
+ * once at least @min_bytes are queued (if non-zero), or for longer than half
+ * of the average write latency measured so far. The timer used for the delay
+ * has millisecond resolution, but a delay shorter than that still lets all
+ * entries appended in the same event loop iteration be written together. A
+ * @max_delay of 0, the default, disables coalescing.
+ */
+void raft_io_uv_set_append_coalescing(struct raft_io *io,
+                                      unsigned max_delay,
+                                      size_t min_bytes);
+
+/**
+ * Back large segment write buffers with transparent huge pages, reducing TLB
+ * pressure under sustained load at the cost of rounding their size up to a
+ * multiple of 2 megabytes. Write buffers are reused across open segments in
+ * any case. Disabled by default.
+ */
+void raft_io_uv_set_huge_pages(struct raft_io *io, bool enabled);
+
+/**
+ * Open segments created from now on with direct I/O and write them with
+ * NOWAIT, if the file system supports it. When disabled, or when the file
+ * system does not support direct I/O (e.g. tmpfs or ZFS), segments are written
+ * through the page cache from the threadpool, with a single fdatasync() call
+ * for each group of coalesced append requests. Enabled by default.
+ */
+void raft_io_uv_set_direct_io(struct raft_io *io, bool enabled);
+
+/**
+ * Set the number of threads used by raft_io->load to read and decode closed
+ * segments in parallel, including the calling one. Fail with #RAFT_EINVAL if
+ * @n is 0 or greater than 8. The default is 4.
+ */
+int raft_io_uv_set_load_threads(struct raft_io *io, unsigned n);
+
+/**
+ * Pin the disk threads, and the threads loading closed segments at startup, to
+ * the @n CPUs listed in @cpus, placing them on the NUMA node of the storage
+ * device. Passing an empty list lets them run on any CPU, which is the
+ * default. Must be called before raft_io->init(), fail with #RAFT_ERR_BUSY
+ * otherwise, or with #RAFT_EINVAL if a CPU number is 1024 or greater. Only
+ * supported on Linux, ignored elsewhere.
+ */
+int raft_io_uv_set_disk_cpus(struct raft_io *io,
+                             const unsigned cpus[],
+                             unsigned n);
+
+/**
+ * Prefer the memory of the given NUMA node for the write buffers of open
+ * segments and the receive buffers of incoming connections, moving their pages
+ * there if needed. Otherwise, which is the default or if @node is -1, they
+ * are placed on the node of the loop thread when first used. Fail with
+ * #RAFT_EINVAL if @node is lower than -1, or 1024 or greater. Only supported on
+ * Linux, ignored elsewhere.
+ */
+int raft_io_uv_set_numa_node(struct raft_io *io, int node);
+
+/**
+ * Read closed segments through a memory mapping when loading them at startup,
+ * parsing their batches in place, rather than with read() calls into a buffer.
+ * Entries read afterwards, for example to catch up a follower, are always read
+ * with read() calls. Enabled by default.
+ */
+void raft_io_uv_set_load_mmap(struct raft_io *io, bool enabled);
+
+/**
+ * Store a checksum for each entry in new segments, instead of a single one for
+ * the data of each batch. A corrupted entry can then be told apart from the
+ * rest of its batch, and entries which are already covered by a snapshot, or
+ * which fall outside the range read with raft_io->read, are not checksummed
+ * when loading. Segments written this way can't be loaded by older versions.
+ * Must be called before any entry is appended.
+ * Disabled by default.
+ */
+void raft_io_uv_set_entry_checksums(struct raft_io *io, bool enabled);
+
+/**
+ * Write the entry headers of new segments in a compact encoding, with the term
+ * of each entry relative to the previous one and variable-length data sizes,
+ * instead of 16 bytes for each entry. This matters mostly for small entries.
+ * Segments written this way can't be loaded by older versions. Must be called
+ * before any entry is appended.
+ * Disabled by default.
+ */
+void raft_io_uv_set_compact_entries(struct raft_io *io, bool enabled);
+
+/**
+ * Write snapshot files to @dir rather than to the data directory given to
+ * raft_io_uv_init(), for example to keep them on bulk storage, so that their
+ * writes don't compete with the ones of the log. The directory is created if
+ * it doesn't exist. Snapshots already in the data directory are still found
+ * and eventually removed. Must be called before raft_io->init().
+ */
+int raft_io_uv_set_snapshot_dir(struct raft_io *io, const char *dir);
+
+/**
+ * Keep the files holding the current term and vote in @dir rather than in the
+ * data directory given to raft_io_uv_init(). The directory is created if it
+ * doesn't exist. If the metadata found in the data directory is more recent,
+ * e.g. because @dir is new, it gets copied to @dir first. Must be called before
+ * raft_io->init().
+ */
+int raft_io_uv_set_metadata_dir(struct raft_io *io, const char *dir);
+
+/**
+ * Set the directory where closed segments that are no longer needed, because
+ * all their entries are included in a snapshot, get moved instead of being
+ * deleted. By default no archive directory is set and such segments are
+ * removed. The directory is created if it does not exist and it can be on a
+ * different file system than the data directory.
+ */
+int raft_io_uv_set_archive_dir(struct raft_io *io, const char *dir);
+
+/**
+ * Number of buckets of latency histograms. Bucket 0 counts latencies below 1
+ * microsecond, bucket i counts latencies of at least 2^(i-1) and less than 2^i
+ * microseconds, and the last bucket also counts all longer ones.
+ */
+#define RAFT_IO_UV_LATENCY_BUCKETS 24
+
+/**
+ * Histogram of the latencies of a disk operation.
+ */
+struct raft_io_uv_latency
+{
+    unsigned long long count; /* Number of samples */
+    unsigned long long total; /* Sum of all samples, in microseconds */
+    unsigned long long max;   /* Highest sample, in microseconds */
+    unsigned long long buckets[RAFT_IO_UV_LATENCY_BUCKETS];
+};
+
+/**
+ * Breakdown of the time spent by the last raft_io->load call, in microseconds.
+ */
+struct raft_io_uv_load_stats
+{
+    unsigned long long list;       /* Listing snapshots and segments */
+    unsigned long long snapshot;   /* Loading the most recent snapshot */
+    unsigned long long segments;   /* Reading and decoding segments */
+    unsigned long long checksum;   /* Checking batches, across all threads */
+    unsigned long long n_segments; /* Number of segments read */
+    unsigned long long n_entries;  /* Number of entries loaded */
+};
+
+/**
+ * Time spent by the event loop running raft code, see
+ * raft_io_uv_set_stall_threshold().
+ */
+struct raft_io_uv_loop_stats
+{
+    struct raft_io_uv_latency busy;   /* Loop iterations, between polls */
+    struct raft_io_uv_latency tick;   /* Tick callbacks */
+    struct raft_io_uv_latency recv;   /* Receive callbacks */
+    struct raft_io_uv_latency append; /* Append completion callbacks */
+    struct raft_io_uv_latency defer;  /* Deferred callbacks */
+    unsigned long long n_stalls;      /* Samples above the threshold */
+};
+
+/**
+ * Disk statistics of a libuv-based @raft_io instance.
+ */
+struct raft_io_uv_stats
+{
+    struct raft_io_uv_latency append_queue; /* Appends waiting for a segment */
+    struct raft_io_uv_latency append_write; /* Writes of open segments */
+    struct raft_io_uv_latency finalize;     /* Truncate and rename of segments */
+    struct raft_io_uv_latency metadata;     /* Metadata writes and fsyncs */
+    struct raft_io_uv_latency snapshot;     /* Snapshot writes */
+    unsigned long long n_write_fallbacks;   /* Writes run in the threadpool */
+    struct raft_io_uv_load_stats load;      /* Last load of the data dir */
+    struct raft_io_uv_loop_stats loop;      /* Event loop stalls */
+};
+
+/**
+ * Fill @stats with the disk statistics collected since raft_io_uv_init().
+ *
+ * The append queue latency is the time an append request waits before its
+ * entries are encoded into an open segment ready for writing, while the append
+ * write latency is the time from the submission of a segment write to its
+ * completion. The finalize, metadata and snapshot latencies only count the time
+ * spent performing the operation in a disk thread, not the time spent waiting
+ * for one. The write fallbacks count the segment writes that couldn't be
+ * submitted to the kernel without blocking and were run in the libuv
+ * threadpool. The load breakdown covers the last raft_io->load call: the
+ * checksum time is included in the segments time, but when closed segments
+ * are loaded in parallel it's summed across threads.
+ */
+void raft_io_uv_stats(struct raft_io *io, struct raft_io_uv_stats *stats);
+
+/**
+ * Kinds of event loop stalls.
+ */
+enum {
+    RAFT_IO_UV_STALL_BUSY = 0, /* Loop iteration */
+    RAFT_IO_UV_STALL_TICK,     /* Tick callback */
+    RAFT_IO_UV_STALL_RECV,     /* Receive callback */
+    RAFT_IO_UV_STALL_APPEND,   /* Append completion callback */
+    RAFT_IO_UV_STALL_DEFER     /* Deferred callback */
+};
+
+/**
+ * Callback invoked when the event loop stalls for @usecs microseconds.
+ */
+typedef void (*raft_io_uv_stall_cb)(struct raft_io *io,
+                                    int kind,
+                                    unsigned long long usecs);
+
+/**
+ * Measure how long the event loop is kept busy, and report stalls of at least
+ * @threshold microseconds. A @threshold of 0, the default, disables this.
+ *
+ * The busy time of a loop iteration goes from the end of a poll for I/O to
+ * the start of the next one, and the time spent in each tick, receive, append
+ * completion and deferred callback is measured as well, so stalls can be
+ * attributed to the raft code they ran: the FSM apply callback is invoked by
+ * append completion and receive callbacks, or as a deferred callback when its
+ * budget is exhausted. All samples are added to the loop statistics returned
+ * by raft_io_uv_stats(), while the ones above the threshold are counted as
+ * stalls and passed to @cb, if not NULL.
+ */
+void raft_io_uv_set_stall_threshold(struct raft_io *io,
+                                    unsigned threshold,
+                                    raft_io_uv_stall_cb cb);
+
+/**
+ * Kinds of records of a workload trace, see raft_io_uv_set_recording().
+ */
+enum {
+    RAFT_IO_UV_RECORD_APPEND = 1,  /* Entries submitted by raft_io->append */
+    RAFT_IO_UV_RECORD_APPEND_DONE, /* Completion of an append */
+    RAFT_IO_UV_RECORD_SEND,        /* Message submitted by raft_io->send */
+    RAFT_IO_UV_RECORD_RECV         /* Message passed to the receive callback */
+};
+
+/**
+ * Format version of workload traces, and size of each of their records.
+ */
+#define RAFT_IO_UV_RECORD_FORMAT 1
+#define RAFT_IO_UV_RECORD_SIZE 32
+
+/**
+ * A single record of a workload trace.
+ */
+struct raft_io_uv_record
+{
+    unsigned long long time; /* Microseconds since the recording started */
+    unsigned long long size; /* Bytes of entries or snapshot data */
+    unsigned latency;        /* Microseconds taken by a completed append */
+    unsigned n;              /* Number of entries */
+    unsigned server_id;      /* Peer server of a message */
+    int kind;                /* Kind of record */
+    int type;                /* Message type, or status of a completion */
+};
+
+/**
+ * Record a trace of the workload of this instance to the file at @path,
+ * replacing it: the number and size of the entries of each append and the
+ * latency of its completion, as well as the type, peer and size of each
+ * message sent and received, all timestamped. The trace can be replayed on
+ * the fixture with `raft-benchmark replay`. A @path of NULL stops recording,
+ * which also happens when the instance is closed.
+ *
+ * A trace starts with its format version as a 64-bit value, followed by
+ * records of RAFT_IO_UV_RECORD_SIZE bytes each, see raft_io_uv_decode_record().
+ * Records are buffered in memory and written from the loop thread to the page
+ * cache every 2048 records, so the trace should live on a local file system.
+ * Recording stops if a write fails.
+ */
+int raft_io_uv_set_recording(struct raft_io *io, const char *path);
+
+/**
+ * Decode the RAFT_IO_UV_RECORD_SIZE bytes at @buf into @record, as written to a
+ * trace by raft_io_uv_set_recording().
+ */
+void raft_io_uv_decode_record(const void *buf,
+                              struct raft_io_uv_record *record);
+
+/**
+ * Set the maximum number of bytes of messages that can be queued for a peer
+ * server while the connection to it is down. Once the queue is full, the
+ * oldest messages are failed with RAFT_ERR_IO_CONNECT to make room for new
+ * ones, and the peer is reported as congested, so leaders stop replicating to
+ * it until it's reachable again. Groups attached to the same host share this
+ * setting. The default is 1 megabyte.
+ */
+void raft_io_uv_set_send_queue_size(struct raft_io *io, size_t size);
+
+/**
+ * Set the delays in milliseconds between attempts to connect to a peer server.
+ * The first retry happens after @min_delay, and the delay doubles after each
+ * failed attempt, up to @max_delay. Each delay is picked at random between half
+ * of its value and its full value. Groups attached to the same host share this
+ * setting. The defaults are 100 milliseconds and 10 seconds.
+ */
+int raft_io_uv_set_connect_retry_delay(struct raft_io *io,
+                                       unsigned min_delay,
+                                       unsigned max_delay);
+
+/**
+ * Compress with LZ4 the entries of AppendEntries messages and the data of
+ * InstallSnapshot messages whose size is at least @threshold bytes. A
+ * @threshold of 0, the default, disables compression. Groups attached to the
+ * same host share this setting.
+ *
+ * Compressed messages can only be decoded by servers built with LZ4 support,
+ * so compression must be enabled only once all servers in the cluster have
+ * been upgraded. Return #RAFT_EINVAL if this library was built without LZ4
+ * support.
+ */
+int raft_io_uv_set_compression(struct raft_io *io, size_t threshold);
+
+/**
+ * Network state that can be shared by several raft groups running in the same
+ * process, for example one group per shard.
+ *
+ * All groups attached to the same host use a single transport, and therefore a
+ * single listening socket and a single outgoing connection to each peer
+ * server. Every message is tagged with the ID of the group it belongs to and
+ * dispatched to that group upon receival. Messages for groups that are not
+ * attached to the receiving host are discarded.
+ *
+ * All groups attached to the same host must be initialized with the same
+ * server ID and address, and each of them must use its own data directory.
+ */
+struct raft_io_uv_host;
+typedef void (*raft_io_uv_host_close_cb)(struct raft_io_uv_host *host);
+struct raft_io_uv_host
+{
+    void *data;                        /* User data */
+    void *impl;                        /* Implementation-defined state */
+    raft_io_uv_host_close_cb close_cb; /* Implementation-defined */
+};
+
+/**
+ * Initialize a host object using the given transport. The transport must not
+ * be used by anything else.
+ */
+int raft_io_uv_host_init(struct raft_io_uv_host *host,
+                         struct uv_loop_s *loop,
+                         struct raft_io_uv_transport *transport);
+
+/**
+ * Close the host, closing all its connections and the transport. All groups
+ * attached to the host must have been closed already. The @cb callback is
+ * invoked once it's safe to release the memory of the host and transport
+ * objects.
+ */
+void raft_io_uv_host_close(struct raft_io_uv_host *host,
+                           raft_io_uv_host_close_cb cb);
+
+/**
+ * Write the entries of all groups attached to the host without syncing each
+ * write, and instead persist them with a single sync of each file system
+ * holding a data directory. Appends of all groups completing while a sync is
+ * running are covered by the next one, so the number of syncs doesn't grow
+ * with the number of groups. Append callbacks fire only once the data is
+ * durable.
+ *
+ * This must be called before attaching any group, otherwise #RAFT_EINVAL is
+ * returned.
+ */
+int raft_io_uv_host_set_shared_sync(struct raft_io_uv_host *host,
+                                    bool enabled);
+
+/**
+ * Limit the number of open segments prepared in advance by all groups attached
+ * to the host together, or remove the limit if @n is 0, the default. A group
+ * can always prepare the segment it's waiting for, even beyond the limit.
+ */
+void raft_io_uv_host_set_prepare_budget(struct raft_io_uv_host *host,
+                                        unsigned n);
+
+/**
+ * Like raft_io_uv_init(), but instead of owning a dedicated transport, attach
+ * the @io instance to the given @host as the member of the raft group with the
+ * given ID. Group IDs must be unique within the host. Instances created with
+ * raft_io_uv_init() use group 0, so they can talk to a group 0 attached to a
+ * host.
+ */
+int raft_io_uv_init_group(struct raft_io *io,
+                          struct raft_io_uv_host *host,
+                          const char *dir,
+                          unsigned group);
+
 /**
  * Callback invoked by the transport implementation when a new incoming
  * connection has been established.
@@ -97,6 +515,17 @@ typedef void (*raft_io_uv_accept_cb)(struct raft_io_uv_transport *t,
                                      const char *address,
                                      struct uv_stream_s *stream);
 
+/**
+ * Like #raft_io_uv_accept_cb, but also passing the bitmap of optional wire
+ * features that the connecting server advertised in its handshake, or 0 if it
+ * didn't advertise any.
+ */
+typedef void (*raft_io_uv_accept_features_cb)(struct raft_io_uv_transport *t,
+                                              unsigned id,
+                                              const char *address,
+                                              unsigned long long features,
+                                              struct uv_stream_s *stream);
+
 /**
  * Callback invoked by the transport implementation after a connect request has
  * completed. If status is #0, then @stream will point to a valid handle, which
@@ -183,6 +612,33 @@ struct raft_io_uv_transport
      */
     void (*close)(struct raft_io_uv_transport *t,
                   raft_io_uv_transport_close_cb cb);
+
+    /**
+     * API version implemented by this transport, or 0 for transports which
+     * only implement the methods above. Currently 2.
+     */
+    int version;
+
+    /**
+     * Set the bitmap of optional wire features that this server can decode,
+     * which must be advertised in the handshake of outgoing connections. It's
+     * called before @listen_features.
+     *
+     * This method is available since version 2.
+     */
+    void (*advertise)(struct raft_io_uv_transport *t,
+                      unsigned long long features);
+
+    /**
+     * Like @listen, but the @cb callback also gets the features advertised by
+     * the connecting server. If a server doesn't advertise a feature, messages
+     * sent to it must not use it, so features can be rolled out to a cluster
+     * one server at a time.
+     *
+     * This method is available since version 2.
+     */
+    int (*listen_features)(struct raft_io_uv_transport *t,
+                           raft_io_uv_accept_features_cb cb);
 };
 
 /**
@@ -190,6 +646,39 @@ struct raft_io_uv_transport
  */
 int raft_io_uv_tcp_init(struct raft_io_uv_transport *t, struct uv_loop_s *loop);
 
+/**
+ * Init a transport interface that uses Unix domain sockets, for servers running
+ * on the same machine. Server addresses are the file system paths of their
+ * listening sockets, which must not exist when the transport starts listening.
+ * The transport must be released with raft_io_uv_tcp_close().
+ */
+int raft_io_uv_unix_init(struct raft_io_uv_transport *t,
+                         struct uv_loop_s *loop);
+
+/**
+ * Socket options applied by the TCP transport to the listening socket and to
+ * every connection it establishes or accepts. A zero value leaves the system
+ * default in place. Unix domain socket transports only use the buffer sizes.
+ */
+struct raft_io_uv_tcp_options
+{
+    bool no_delay;          /* Disable Nagle's algorithm (TCP_NODELAY) */
+    int send_buffer_size;   /* Socket send buffer size (SO_SNDBUF) */
+    int recv_buffer_size;   /* Socket receive buffer size (SO_RCVBUF) */
+    unsigned user_timeout;  /* Milliseconds before dropping unacknowledged
+                               data (TCP_USER_TIMEOUT) */
+    unsigned keepalive;     /* Seconds of idle before keepalive probes */
+    unsigned busy_poll;     /* Microseconds to busy poll (SO_BUSY_POLL) */
+};
+
+/**
+ * Set the socket options of a TCP transport. This must be called before the
+ * transport is used. Return #RAFT_EINVAL if an option is not supported on this
+ * platform.
+ */
+int raft_io_uv_tcp_set_options(struct raft_io_uv_transport *t,
+                               const struct raft_io_uv_tcp_options *options);
+
 void raft_io_uv_tcp_close(struct raft_io_uv_transport *t);
 
 #endif /* RAFT_IO_UV_H */
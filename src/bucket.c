@@ -0,0 +1,84 @@
+#include "bucket.h"
+
+#include <limits.h>
+#include <stdint.h>
+
+/* Time after which an idle bucket is full for sure. */
+#define MAX_ELAPSED (60 * 60 * 1000)
+
+void bucket__init(struct raft_bucket *b)
+{
+    b->time = 0;
+    b->tokens = LLONG_MAX;
+}
+
+/* Add the tokens accumulated since the last refill. */
+static void refill(struct raft_bucket *b, size_t rate, raft_time now)
+{
+    long long burst = (long long)rate;
+    raft_time elapsed;
+    long long tokens;
+
+    /* A full bucket doesn't accumulate more tokens. */
+    if (b->tokens >= burst) {
+        b->tokens = burst;
+        b->time = now;
+        return;
+    }
+
+    if (now <= b->time) {
+        return;
+    }
+    elapsed = now - b->time;
+    if (elapsed > MAX_ELAPSED) {
+        elapsed = MAX_ELAPSED;
+    }
+
+    tokens = (long long)(elapsed * rate / 1000);
+    if (tokens >= burst - b->tokens) {
+        b->tokens = burst;
+        b->time = now;
+        return;
+    }
+
+    /* Only account for the time needed to add whole tokens, rounding up, so
+     * fractions are not lost nor added twice. */
+    b->tokens += tokens;
+    b->time += ((raft_time)tokens * 1000 + rate - 1) / rate;
+}
+
+size_t bucket__available(struct raft_bucket *b, size_t rate, raft_time now)
+{
+    if (rate == 0) {
+        return SIZE_MAX;
+    }
+    refill(b, rate, now);
+    return b->tokens > 0 ? (size_t)b->tokens : 0;
+}
+
+void bucket__take(struct raft_bucket *b, size_t rate, size_t size)
+{
+    if (rate == 0) {
+        return;
+    }
+    b->tokens -= (long long)size;
+}
+
+unsigned bucket__delay(struct raft_bucket *b, size_t rate, raft_time now)
+{
+    raft_time deadline;
+
+    if (rate == 0) {
+        return 0;
+    }
+    refill(b, rate, now);
+    if (b->tokens > 0) {
+        return 0;
+    }
+
+    /* Time at which the first token gets added, rounding up. */
+    deadline =
+        b->time + ((raft_time)(1 - b->tokens) * 1000 + rate - 1) / rate;
+
+    return deadline > now ? (unsigned)(deadline - now) : 0;
+}
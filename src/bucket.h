@@ -0,0 +1,37 @@
+/**
+ * Token buckets limiting the rate of data transfers.
+ *
+ * A bucket is refilled at the given rate, in bytes per second, holding up to
+ * one second worth of tokens. Sending data takes tokens out of it and can
+ * overdraw it, so data of any size can be sent as soon as some tokens are
+ * available, while the average rate is still respected.
+ */
+
+#ifndef RAFT_BUCKET_H
+#define RAFT_BUCKET_H
+
+#include "../include/raft.h"
+
+/**
+ * Initialize a full bucket.
+ */
+void bucket__init(struct raft_bucket *b);
+
+/**
+ * Return the number of bytes that can be sent at time @now with the given rate,
+ * or SIZE_MAX if @rate is zero, meaning no limit.
+ */
+size_t bucket__available(struct raft_bucket *b, size_t rate, raft_time now);
+
+/**
+ * Take the tokens needed to send @size bytes with the given rate.
+ */
+void bucket__take(struct raft_bucket *b, size_t rate, size_t size);
+
+/**
+ * Return the number of milliseconds after @now when some bytes can be sent
+ * again with the given rate.
+ */
+unsigned bucket__delay(struct raft_bucket *b, size_t rate, raft_time now);
+
+#endif /* RAFT_BUCKET_H */
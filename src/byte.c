@@ -1,7 +1,64 @@
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define BYTE__CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define BYTE__CRC32C_ARMV8 1
+#endif
 
 #include "byte.h"
 
+size_t byte__sizeof_varint(uint64_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+void byte__put_varint(void **cursor, uint64_t value)
+{
+    uint8_t *p = *cursor;
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    *cursor = p;
+}
+
+bool byte__get_varint(const void **cursor, const void *end, uint64_t *value)
+{
+    const uint8_t *p = *cursor;
+    unsigned shift = 0;
+
+    *value = 0;
+
+    while (p < (const uint8_t *)end) {
+        uint8_t b = *p++;
+        /* The tenth byte can only hold the highest bit. */
+        if (shift == 63 && b > 1) {
+            return false;
+        }
+        *value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *cursor = p;
+            return true;
+        }
+        shift += 7;
+        if (shift > 63) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
 /* Taken from https://github.com/gcc-mirror/gcc/blob/master/libiberty/crc32.c */
 
 static const unsigned crc32_table[] = {
@@ -61,3 +118,135 @@ unsigned byte__crc32(const void *buf, const size_t size, const unsigned init)
     }
     return crc;
 }
+
+/* Reversed CRC32C (Castagnoli) polynomial. */
+#define CRC32C_POLY 0x82f63b78
+
+/* Lookup tables for the slice-by-8 algorithm, filled at load time. */
+static uint32_t crc32c_table[8][256];
+
+/* Software implementation processing 8 bytes at a time. */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *cursor, size_t size)
+{
+#if defined(__BYTE_ORDER) && (__BYTE_ORDER == __LITTLE_ENDIAN)
+    while (size > 0 && ((uintptr_t)cursor & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *cursor) & 0xff] ^ (crc >> 8);
+        cursor++;
+        size--;
+    }
+    while (size >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, cursor, sizeof lo);
+        memcpy(&hi, cursor + 4, sizeof hi);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        cursor += 8;
+        size -= 8;
+    }
+#endif
+    while (size > 0) {
+        crc = crc32c_table[0][(crc ^ *cursor) & 0xff] ^ (crc >> 8);
+        cursor++;
+        size--;
+    }
+    return crc;
+}
+
+#if defined(BYTE__CRC32C_SSE42)
+/* Implementation using the SSE4.2 crc32 instruction. */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc,
+    const uint8_t *cursor,
+    size_t size)
+{
+    uint64_t crc64;
+    while (size > 0 && ((uintptr_t)cursor & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *cursor);
+        cursor++;
+        size--;
+    }
+    crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, cursor, sizeof word);
+        crc64 = _mm_crc32_u64(crc64, word);
+        cursor += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *cursor);
+        cursor++;
+        size--;
+    }
+    return crc;
+}
+#elif defined(BYTE__CRC32C_ARMV8)
+/* Implementation using the ARMv8 CRC32 instructions. */
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *cursor, size_t size)
+{
+    while (size > 0 && ((uintptr_t)cursor & 7) != 0) {
+        crc = __crc32cb(crc, *cursor);
+        cursor++;
+        size--;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, cursor, sizeof word);
+        crc = __crc32cd(crc, word);
+        cursor += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = __crc32cb(crc, *cursor);
+        cursor++;
+        size--;
+    }
+    return crc;
+}
+#endif
+
+/* Implementation in use, selected at load time. */
+static uint32_t (*crc32c_impl)(uint32_t crc,
+                               const uint8_t *cursor,
+                               size_t size) = crc32c_sw;
+
+__attribute__((constructor)) static void crc32c_init(void)
+{
+    uint32_t crc;
+    unsigned i;
+    unsigned j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+
+#if defined(BYTE__CRC32C_SSE42)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+    }
+#elif defined(BYTE__CRC32C_ARMV8)
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+unsigned byte__crc32c(const void *buf, const size_t size, const unsigned init)
+{
+    return ~crc32c_impl(~(uint32_t)init, buf, size);
+}
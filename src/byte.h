@@ -2,12 +2,14 @@
  * Byte-level utilities:
  *
  * - Convert between big-endian and little-endian representations.
- * - Calculate CRC32 checksum.
+ * - Encode and decode variable-length integers.
+ * - Calculate CRC32 and CRC32C checksums.
  */
 
 #ifndef RAFT_BYTE_H_
 #define RAFT_BYTE_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -26,7 +28,8 @@ RAFT_INLINE uint32_t byte__flip32(uint32_t v)
 #if defined(__BYTE_ORDER) && (__BYTE_ORDER == __LITTLE_ENDIAN)
     return v;
 #elif defined(__BYTE_ORDER) && (__BYTE_ORDER == __BIG_ENDIAN) && \
-    defined(__GNUC__) && __GNUC__ >= 4 && __GNUC_MINOR__ >= 8
+    defined(__GNUC__) &&                                         \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
     return __builtin_bswap32(v);
 #else
     union {
@@ -49,7 +52,8 @@ RAFT_INLINE uint64_t byte__flip64(uint64_t v)
 #if defined(__BYTE_ORDER) && (__BYTE_ORDER == __LITTLE_ENDIAN)
     return v;
 #elif defined(__BYTE_ORDER) && (__BYTE_ORDER == __BIG_ENDIAN) && \
-    defined(__GNUC__) && __GNUC__ >= 4 && __GNUC_MINOR__ >= 8
+    defined(__GNUC__) &&                                         \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
     return __builtin_bswap64(v);
 #else
     union {
@@ -123,9 +127,46 @@ RAFT_INLINE size_t byte__pad64(size_t size)
     return size;
 }
 
+/**
+ * Return the number of bytes needed to encode the given value as a varint,
+ * i.e. in groups of 7 bits, least significant first, with the high bit of each
+ * byte set if more bytes follow.
+ */
+size_t byte__sizeof_varint(uint64_t value);
+
+void byte__put_varint(void **cursor, uint64_t value);
+
+/**
+ * Decode a varint without reading past @end. Return false if the data ends
+ * before the varint does or if the value doesn't fit in 64 bits.
+ */
+bool byte__get_varint(const void **cursor, const void *end, uint64_t *value);
+
+/**
+ * Map signed values to unsigned ones so that values close to zero have short
+ * varint encodings: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+ */
+RAFT_INLINE uint64_t byte__zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+RAFT_INLINE int64_t byte__unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
 /**
  * Calculate the CRC32 checksum of the given data buffer.
  */
 unsigned byte__crc32(const void *buf, size_t size, unsigned init);
 
+/**
+ * Calculate the CRC32C (Castagnoli) checksum of the given data buffer, using
+ * hardware instructions if available. The checksum of a buffer split in two
+ * parts can be obtained by passing the checksum of the first part as @init of
+ * the second.
+ */
+unsigned byte__crc32c(const void *buf, size_t size, unsigned init);
+
 #endif /* RAFT_BYTE_H_ */
@@ -1,32 +1,82 @@
+#include <string.h>
+
 #include "../include/raft.h"
 
 #include "assert.h"
+#include "byte.h"
+#include "client.h"
 #include "configuration.h"
 #include "log.h"
 #include "election.h"
+#include "entry.h"
+#include "io.h"
 #include "logging.h"
 #include "membership.h"
 #include "queue.h"
 #include "replication.h"
 #include "state.h"
+#include "tick.h"
+#include "trace.h"
+#include "transfer.h"
+#include "watch.h"
 
-int raft_apply(struct raft *r,
-               struct raft_apply *req,
-               const struct raft_buffer bufs[],
-               const unsigned n,
-               raft_apply_cb cb)
+/* Propose RPC sent by a follower on behalf of an apply request. */
+struct propose
+{
+    struct raft_io_send send;
+    struct raft_entry *entries; /* Commands being forwarded */
+    unsigned n;                 /* Number of commands */
+};
+
+/* Return the payload size of the commands of the current term between the
+ * given indexes. */
+static size_t commands_size(struct raft *r, raft_index first, raft_index last)
+{
+    size_t size = 0;
+    raft_index index;
+
+    for (index = first; index <= last; index++) {
+        const struct raft_entry *entry = log__get(&r->log, index);
+        if (entry != NULL && entry->type != RAFT_CONFIGURATION &&
+            entry->term == r->current_term) {
+            size += entry->buf.len;
+        }
+    }
+
+    return size;
+}
+
+/* Append the entries of an apply request to the log, without replicating
+ * them yet. The entries have the given @type, and a #RAFT_BATCH one is passed
+ * as a single packed buffer. If @arena is not NULL, it holds a copy of the
+ * payloads of the commands in @bufs, each padded to 8 bytes, and the entries
+ * point into it rather than to @bufs. */
+static int apply_append(struct raft *r,
+                        struct raft_apply *req,
+                        const struct raft_buffer bufs[],
+                        const unsigned n,
+                        const int type,
+                        void *arena,
+                        raft_apply_cb cb)
 {
     raft_index index;
     raft_term term;
+    unsigned i;
     int rv;
 
-    assert(r != NULL);
-    assert(bufs != NULL);
-    assert(n > 0);
+    /* Don't accept new entries while transferring leadership, since they would
+     * delay the target from catching up. */
+    if (r->state != RAFT_LEADER || r->leader_state.transfer != NULL) {
+        return RAFT_ERR_NOT_LEADER;
+    }
 
-    if (r->state != RAFT_LEADER) {
-        rv = RAFT_ERR_NOT_LEADER;
-        goto err;
+    /* Once the high-water mark is reached, keep rejecting commands until the
+     * pressure is relieved. */
+    if (r->backpressure.max_bytes > 0 &&
+        (r->backpressure.rejecting ||
+         r->leader_state.uncommitted_bytes >= r->backpressure.max_bytes)) {
+        r->backpressure.rejecting = true;
+        return RAFT_EBACKPRESSURE;
     }
 
     debugf(r->io, "client request: %d entries", n);
@@ -38,40 +88,622 @@ int raft_apply(struct raft *r,
 
     req->index = index;
     req->cb = cb;
+    req->time = io__time(r->io);
 
     /* Append the new entries to the log. */
-    rv = log__append_commands(&r->log, r->current_term, bufs, n);
+    if (type == RAFT_BATCH) {
+        assert(n == 1);
+        rv = log__append(&r->log, r->current_term, RAFT_BATCH, &bufs[0], NULL);
+    } else if (arena != NULL) {
+        uint8_t *cursor = arena;
+        rv = 0;
+        for (i = 0; i < n && rv == 0; i++) {
+            struct raft_buffer buf;
+            buf.base = cursor;
+            buf.len = bufs[i].len;
+            rv = log__append(&r->log, r->current_term, RAFT_COMMAND, &buf,
+                             arena);
+            cursor += byte__pad64(bufs[i].len);
+        }
+        if (rv != 0 && log__last_index(&r->log) >= index) {
+            log__discard(&r->log, index);
+        }
+    } else {
+        rv = log__append_commands(&r->log, r->current_term, bufs, n);
+    }
     if (rv != 0) {
-        goto err;
+        return rv;
+    }
+
+    for (i = 0; i < n; i++) {
+        r->leader_state.uncommitted_bytes += bufs[i].len;
     }
 
     RAFT__QUEUE_PUSH(&r->leader_state.apply_reqs, &req->queue);
 
-    rv = raft_replication__trigger(r, index);
+    return 0;
+}
+
+/* Remove from the log the entries appended from the given index onward. */
+static void apply_discard(struct raft *r, raft_index index)
+{
+    size_t size = commands_size(r, index, log__last_index(&r->log));
+    assert(r->leader_state.uncommitted_bytes >= size);
+    r->leader_state.uncommitted_bytes -= size;
+    log__discard(&r->log, index);
+}
+
+/* Release the commands of a Propose RPC once they have been sent. */
+static void propose_send_cb(struct raft_io_send *req, int status)
+{
+    struct propose *propose = req->data;
+    unsigned i;
+
+    (void)status;
+
+    for (i = 0; i < propose->n; i++) {
+        raft_free(propose->entries[i].buf.base);
+    }
+    raft_free(propose->entries);
+    raft_free(propose);
+}
+
+/* Return true if the apply requests submitted to us must be forwarded to the
+ * leader. */
+static bool must_forward(struct raft *r)
+{
+    return r->state == RAFT_FOLLOWER && r->apply_forwarding;
+}
+
+/* Forward an apply request submitted to a follower to the current leader. */
+static int follower_apply(struct raft *r,
+                          struct raft_apply *req,
+                          const struct raft_buffer bufs[],
+                          const unsigned n,
+                          raft_apply_cb cb)
+{
+    const struct raft_server *leader = NULL;
+    struct raft_message message;
+    struct propose *propose;
+    unsigned i;
+    int rv;
+
+    /* Let the election timer detect a failed leader. */
+    tick__wake(r);
+
+    if (r->follower_state.current_leader.id != 0) {
+        leader = configuration__get(&r->configuration,
+                                    r->follower_state.current_leader.id);
+    }
+    if (leader == NULL) {
+        rv = RAFT_ERR_NOT_LEADER;
+        goto err;
+    }
+
+    propose = raft_malloc(sizeof *propose);
+    if (propose == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    propose->entries = raft_malloc(n * sizeof *propose->entries);
+    if (propose->entries == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_propose_alloc;
+    }
+    for (i = 0; i < n; i++) {
+        propose->entries[i].term = r->current_term;
+        propose->entries[i].type = RAFT_COMMAND;
+        propose->entries[i].buf = bufs[i];
+        propose->entries[i].batch = NULL;
+    }
+    propose->n = n;
+    propose->send.data = propose;
+
+    message.type = RAFT_IO_PROPOSE;
+    message.server_id = leader->id;
+    message.server_address = leader->address;
+    message.propose.term = r->current_term;
+    message.propose.id = r->follower_state.apply_id + 1;
+    message.propose.entries = propose->entries;
+    message.propose.n_entries = n;
+
+    debugf(r->io, "forward client request: %d entries", n);
+
+    trace__send(r, &message);
+    rv = io__send(r->io, &propose->send, &message, propose_send_cb);
+    if (rv != 0) {
+        goto err_after_entries_alloc;
+    }
+
+    r->follower_state.apply_id++;
+
+    req->index = 0;
+    req->cb = cb;
+    req->time = io__time(r->io);
+    req->forward_id = r->follower_state.apply_id;
+
+    RAFT__QUEUE_PUSH(&r->follower_state.apply_reqs, &req->queue);
+
+    /* Make sure we'll check for a missing result at the next heartbeat
+     * timeout. */
+    tick__schedule(r);
+
+    return 0;
+
+err_after_entries_alloc:
+    raft_free(propose->entries);
+err_after_propose_alloc:
+    raft_free(propose);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Release the payloads of commands which were packed into a batch. */
+static void free_packed(const struct raft_buffer bufs[], const unsigned n)
+{
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        raft_free(bufs[i].base);
+    }
+}
+
+int raft_apply(struct raft *r,
+               struct raft_apply *req,
+               const struct raft_buffer bufs[],
+               const unsigned n,
+               raft_apply_cb cb)
+{
+    struct raft_buffer packed;
+    bool batch;
+    int rv;
+
+    assert(r != NULL);
+    assert(bufs != NULL);
+    assert(n > 0);
+
+    if (must_forward(r)) {
+        return follower_apply(r, req, bufs, n, cb);
+    }
+
+    batch = r->apply_batching && n > 1;
+    if (batch) {
+        rv = entry__pack(bufs, n, &packed);
+        if (rv != 0) {
+            goto err;
+        }
+        rv = apply_append(r, req, &packed, 1, RAFT_BATCH, NULL, cb);
+    } else {
+        rv = apply_append(r, req, bufs, n, RAFT_COMMAND, NULL, cb);
+    }
+    if (rv != 0) {
+        goto err_after_pack;
+    }
+
+    rv = raft_replication__trigger_grouped(r, req->index);
     if (rv != 0) {
         goto err_after_log_append;
     }
 
+    if (batch) {
+        free_packed(bufs, n);
+    }
+
     return 0;
 
 err_after_log_append:
-    log__discard(&r->log, index);
+    apply_discard(r, req->index);
+    RAFT__QUEUE_REMOVE(&req->queue);
+err_after_pack:
+    if (batch) {
+        raft_free(packed.base);
+    }
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Forward copies of the given commands to the leader. */
+static int follower_apply_copy(struct raft *r,
+                               struct raft_apply *req,
+                               const struct raft_buffer bufs[],
+                               const unsigned n,
+                               raft_apply_cb cb)
+{
+    struct raft_buffer *copies;
+    unsigned i;
+    int rv;
+
+    copies = raft_calloc(n, sizeof *copies);
+    if (copies == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    for (i = 0; i < n; i++) {
+        copies[i].len = bufs[i].len;
+        copies[i].base = raft_malloc(bufs[i].len > 0 ? bufs[i].len : 1);
+        if (copies[i].base == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_copies_alloc;
+        }
+        memcpy(copies[i].base, bufs[i].base, bufs[i].len);
+    }
+
+    rv = follower_apply(r, req, copies, n, cb);
+    if (rv != 0) {
+        goto err_after_copies_alloc;
+    }
+
+    raft_free(copies);
+
+    return 0;
+
+err_after_copies_alloc:
+    for (i = 0; i < n; i++) {
+        if (copies[i].base != NULL) {
+            raft_free(copies[i].base);
+        }
+    }
+    raft_free(copies);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+int raft_apply_copy(struct raft *r,
+                    struct raft_apply *req,
+                    const struct raft_buffer bufs[],
+                    const unsigned n,
+                    raft_apply_cb cb)
+{
+    struct raft_buffer packed;
+    bool batch;
+    uint8_t *cursor;
+    unsigned i;
+    int rv;
+
+    assert(r != NULL);
+    assert(bufs != NULL);
+    assert(n > 0);
+
+    if (must_forward(r)) {
+        return follower_apply_copy(r, req, bufs, n, cb);
+    }
+
+    /* Copy the commands either into a batch entry, or into a single arena
+     * shared by all the command entries of this request. */
+    batch = r->apply_batching && n > 1;
+    if (batch) {
+        rv = entry__pack(bufs, n, &packed);
+        if (rv != 0) {
+            goto err;
+        }
+        rv = apply_append(r, req, &packed, 1, RAFT_BATCH, NULL, cb);
+    } else {
+        packed.len = 0;
+        for (i = 0; i < n; i++) {
+            packed.len += byte__pad64(bufs[i].len);
+        }
+        packed.base = raft_malloc(packed.len > 0 ? packed.len : 8);
+        if (packed.base == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
+        cursor = packed.base;
+        for (i = 0; i < n; i++) {
+            memcpy(cursor, bufs[i].base, bufs[i].len);
+            cursor += byte__pad64(bufs[i].len);
+        }
+        rv = apply_append(r, req, bufs, n, RAFT_COMMAND, packed.base, cb);
+    }
+    if (rv != 0) {
+        goto err_after_pack;
+    }
+
+    rv = raft_replication__trigger_grouped(r, req->index);
+    if (rv != 0) {
+        goto err_after_log_append;
+    }
+
+    return 0;
+
+err_after_log_append:
+    apply_discard(r, req->index);
     RAFT__QUEUE_REMOVE(&req->queue);
+err_after_pack:
+    raft_free(packed.base);
 err:
     assert(rv != 0);
     return rv;
 }
 
+bool raft_client__has_wakeup(struct raft *r)
+{
+    return r->io->version >= 7 && r->io->set_wakeup != NULL &&
+           r->io->wakeup != NULL;
+}
+
+int raft_submit(struct raft *r,
+                struct raft_apply *req,
+                const struct raft_buffer bufs[],
+                const unsigned n,
+                raft_apply_cb cb)
+{
+    struct raft_apply *head;
+
+    assert(r != NULL);
+    assert(bufs != NULL);
+    assert(n > 0);
+
+    if (!raft_client__has_wakeup(r)) {
+        return RAFT_EINVAL;
+    }
+
+    req->bufs = bufs;
+    req->n = n;
+    req->cb = cb;
+
+    /* Push the request on top of the stack of submitted ones. Only the thread
+     * that makes the stack non-empty needs to wake up the loop. */
+    head = __atomic_load_n(&r->submitted, __ATOMIC_RELAXED);
+    do {
+        req->next = head;
+    } while (!__atomic_compare_exchange_n(&r->submitted, &head, req, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        r->io->wakeup(r->io);
+    }
+
+    return 0;
+}
+
+/* Take all submitted requests, returning them in submission order. */
+static struct raft_apply *take_submitted(struct raft *r)
+{
+    struct raft_apply *head;
+    struct raft_apply *reversed = NULL;
+
+    head = __atomic_exchange_n(&r->submitted, NULL, __ATOMIC_ACQUIRE);
+    while (head != NULL) {
+        struct raft_apply *next = head->next;
+        head->next = reversed;
+        reversed = head;
+        head = next;
+    }
+
+    return reversed;
+}
+
+/* Pack the commands of the given submitted requests into a single #RAFT_BATCH
+ * entry and append it to the log, without replicating it yet. Return the index
+ * of the entry, or 0 if the requests could not be appended and have failed. */
+static raft_index submit_batch(struct raft *r, struct raft_apply *reqs)
+{
+    struct raft_buffer *bufs;
+    struct raft_buffer packed;
+    struct raft_apply *req;
+    unsigned n = 0;
+    int rv;
+
+    for (req = reqs; req != NULL; req = req->next) {
+        n += req->n;
+    }
+
+    bufs = raft_malloc(n * sizeof *bufs);
+    if (bufs == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    n = 0;
+    for (req = reqs; req != NULL; req = req->next) {
+        memcpy(&bufs[n], req->bufs, req->n * sizeof *bufs);
+        n += req->n;
+    }
+
+    rv = entry__pack(bufs, n, &packed);
+    raft_free(bufs);
+    if (rv != 0) {
+        goto err;
+    }
+
+    rv = apply_append(r, reqs, &packed, 1, RAFT_BATCH, NULL, reqs->cb);
+    if (rv != 0) {
+        raft_free(packed.base);
+        goto err;
+    }
+
+    /* All requests share the entry, and complete when it's applied. */
+    for (req = reqs->next; req != NULL; req = req->next) {
+        req->index = reqs->index;
+        req->time = reqs->time;
+        RAFT__QUEUE_PUSH(&r->leader_state.apply_reqs, &req->queue);
+    }
+
+    return reqs->index;
+
+err:
+    req = reqs;
+    while (req != NULL) {
+        struct raft_apply *next = req->next;
+        if (req->cb != NULL) {
+            req->cb(req, rv);
+        }
+        req = next;
+    }
+    return 0;
+}
+
+/* Append the entries of each of the given submitted requests to the log,
+ * without replicating them yet. Return the index of the first one, or 0 if
+ * all requests have failed. */
+static raft_index submit_each(struct raft *r, struct raft_apply *reqs)
+{
+    struct raft_apply *req = reqs;
+    raft_index index = 0;
+    int rv;
+
+    while (req != NULL) {
+        struct raft_apply *next = req->next;
+        if (must_forward(r)) {
+            rv = follower_apply(r, req, req->bufs, req->n, req->cb);
+        } else {
+            rv = apply_append(r, req, req->bufs, req->n, RAFT_COMMAND, NULL,
+                              req->cb);
+        }
+        if (rv != 0) {
+            if (req->cb != NULL) {
+                req->cb(req, rv);
+            }
+        } else if (index == 0) {
+            index = req->index;
+        }
+        req = next;
+    }
+
+    return index;
+}
+
+void raft_client__submit_cb(struct raft_io *io)
+{
+    struct raft *r = io->data;
+    struct raft_apply *reqs;
+    struct raft_apply *req;
+    raft_index index;
+    bool batch;
+    int rv;
+
+    reqs = take_submitted(r);
+    if (reqs == NULL) {
+        return;
+    }
+
+    /* Append the entries of all requests, and then replicate them at once. */
+    batch = r->apply_batching && !must_forward(r) &&
+            (reqs->next != NULL || reqs->n > 1);
+    if (batch) {
+        index = submit_batch(r, reqs);
+    } else {
+        index = submit_each(r, reqs);
+    }
+
+    if (index == 0) {
+        return;
+    }
+
+    rv = raft_replication__trigger_grouped(r, index);
+    if (rv == 0) {
+        /* The payloads of batched commands were copied. */
+        for (req = batch ? reqs : NULL; req != NULL; req = req->next) {
+            free_packed(req->bufs, req->n);
+        }
+        return;
+    }
+
+    /* Fail the requests appended above, which are the last ones queued. */
+    if (batch) {
+        raft_free(log__get(&r->log, index)->buf.base);
+    }
+    apply_discard(r, index);
+    while (!RAFT__QUEUE_IS_EMPTY(&r->leader_state.apply_reqs)) {
+        raft__queue *tail = RAFT__QUEUE_TAIL(&r->leader_state.apply_reqs);
+        req = RAFT__QUEUE_DATA(tail, struct raft_apply, queue);
+        if (req->index < index) {
+            break;
+        }
+        RAFT__QUEUE_REMOVE(tail);
+        if (req->cb != NULL) {
+            req->cb(req, rv);
+        }
+    }
+}
+
+void raft_client__fail_submitted(struct raft *r, int status)
+{
+    struct raft_apply *req = take_submitted(r);
+
+    while (req != NULL) {
+        struct raft_apply *next = req->next;
+        if (req->cb != NULL) {
+            req->cb(req, status);
+        }
+        req = next;
+    }
+}
+
+void raft_client__recv_forwarded(struct raft *r,
+                                 const struct raft_propose_result *result)
+{
+    raft__queue *head;
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    RAFT__QUEUE_FOREACH(head, &r->follower_state.apply_reqs)
+    {
+        struct raft_apply *req;
+        req = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
+        if (req->forward_id != result->id) {
+            continue;
+        }
+        RAFT__QUEUE_REMOVE(head);
+        req->index = result->index;
+        if (req->cb != NULL) {
+            req->cb(req, result->status);
+        }
+        return;
+    }
+
+    debugf(r->io, "stale propose result -> ignore");
+}
+
+void raft_client__expire_forwarded(struct raft *r)
+{
+    raft_time now = io__time(r->io);
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    /* Requests are queued in the order they were forwarded. */
+    while (!RAFT__QUEUE_IS_EMPTY(&r->follower_state.apply_reqs)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&r->follower_state.apply_reqs);
+        struct raft_apply *req;
+        req = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
+        if (now - req->time < r->election_timeout) {
+            break;
+        }
+        RAFT__QUEUE_REMOVE(head);
+        if (req->cb != NULL) {
+            req->cb(req, RAFT_ERR_TIMEOUT);
+        }
+    }
+}
+
+void raft_client__committed(struct raft *r, raft_index first, raft_index last)
+{
+    size_t *uncommitted = &r->leader_state.uncommitted_bytes;
+    size_t size = commands_size(r, first, last);
+
+    *uncommitted = *uncommitted >= size ? *uncommitted - size : 0;
+
+    if (r->backpressure.rejecting &&
+        *uncommitted <= r->backpressure.max_bytes / 2) {
+        r->backpressure.rejecting = false;
+        raft_watch__pressure_relieved(r, *uncommitted);
+    }
+}
+
 static int raft_client__change_configuration(
     struct raft *r,
     const struct raft_configuration *configuration)
 {
     raft_index index;
     raft_term term = r->current_term;
+    raft_term last_term;
     int rv;
 
-    /* Index of the entry being appended. */
-    index = log__last_index(&r->log) + 1;
+    /* Index of the entry being appended, which follows the snapshot if no
+     * entry was retained after it. */
+    local_last_index_and_term(r, &index, &last_term);
+    index += 1;
 
     /* Encode the new configuration and append it to the log. */
     rv = log__append_configuration(&r->log, term, configuration);
@@ -111,6 +743,61 @@ err:
     return rv;
 }
 
+int raft_transfer_leadership(struct raft *r,
+                             struct raft_transfer *req,
+                             const unsigned id,
+                             raft_transfer_cb cb)
+{
+    const struct raft_server *server;
+    size_t server_index;
+    int rv;
+
+    assert(r != NULL);
+    assert(req != NULL);
+
+    if (r->state != RAFT_LEADER || r->leader_state.transfer != NULL) {
+        rv = RAFT_ERR_NOT_LEADER;
+        goto err;
+    }
+
+    tick__wake(r);
+
+    server = configuration__get(&r->configuration, id);
+    if (server == NULL || !server->voting || server->witness ||
+        server->id == r->id) {
+        rv = RAFT_EBADID;
+        goto err;
+    }
+
+    debugf(r->io, "transfer leadership to server %d", id);
+
+    req->id = id;
+    req->start = io__time(r->io);
+    req->sent = false;
+    req->cb = cb;
+
+    r->leader_state.transfer = req;
+
+    /* If the target is already up-to-date, this sends TimeoutNow right
+     * away. Otherwise push the missing entries to it. */
+    raft_transfer__progress(r);
+    if (!req->sent) {
+        server_index = configuration__index_of(&r->configuration, id);
+        rv = raft_replication__send_append_entries(r, server_index);
+        if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+            /* This error is not fatal. */
+            warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
+                  id, raft_strerror(rv), rv);
+        }
+    }
+
+    return 0;
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
 int raft_add_server(struct raft *r, const unsigned id, const char *address)
 {
     struct raft_configuration configuration;
@@ -185,11 +872,11 @@ int raft_promote(struct raft *r, const unsigned id)
     if (r->leader_state.replication[server_index].match_index == last_index) {
         /* The log of this non-voting server is already up-to-date, so we can
          * ask its promotion immediately. */
-        r->configuration.servers[server_index].voting = true;
+        configuration__set_voting(&r->configuration, server_index, true);
 
         rv = raft_client__change_configuration(r, &r->configuration);
         if (rv != 0) {
-            r->configuration.servers[server_index].voting = false;
+            configuration__set_voting(&r->configuration, server_index, false);
             return rv;
         }
 
@@ -198,10 +885,21 @@ int raft_promote(struct raft *r, const unsigned id)
 
     r->leader_state.promotee_id = server->id;
 
-    /* Initialize the first catch-up round. */
+    /* Initialize the first catch-up round. Its duration is not bounded, since
+     * nothing is known yet about how fast the server can receive entries and
+     * snapshot chunks: it only needs to keep making progress. */
     r->leader_state.round_number = 1;
     r->leader_state.round_index = last_index;
     r->leader_state.round_duration = 0;
+    r->leader_state.round_start =
+        r->leader_state.replication[server_index].match_index;
+    r->leader_state.round_deadline = 0;
+    r->leader_state.round_idle = 0;
+    r->leader_state.catch_up_start = io__time(r->io);
+    r->leader_state.catch_up_from = r->leader_state.round_start;
+
+    raft_watch__lifecycle(r, RAFT_EVENT_CATCH_UP_STARTED, server->id,
+                          last_index, r->leader_state.catch_up_start, 0, 0);
 
     /* Immediately initiate an AppendEntries request. */
     rv = raft_replication__send_append_entries(r, server_index);
@@ -266,3 +964,144 @@ err:
     assert(rv != 0);
     return rv;
 }
+
+/* Check that the given server can take part in a voter replacement, either as
+ * a non-voter to promote or as a voter to remove. */
+static int check_replaced(struct raft *r, unsigned id, bool voting)
+{
+    const struct raft_server *server;
+
+    server = configuration__get(&r->configuration, id);
+    if (server == NULL || server->witness) {
+        return RAFT_EBADID;
+    }
+    if (server->voting != voting) {
+        return voting ? RAFT_EBADID : RAFT_EALREADYVOTING;
+    }
+
+    return 0;
+}
+
+int raft_replace_voters(struct raft *r,
+                        const unsigned promote[],
+                        unsigned n_promote,
+                        const unsigned remove[],
+                        unsigned n_remove)
+{
+    struct raft_configuration configuration;
+    size_t i;
+    int rv;
+
+    rv = raft_membership__can_change_configuration(r);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (n_promote + n_remove == 0) {
+        return RAFT_EINVAL;
+    }
+    for (i = 0; i < n_promote; i++) {
+        rv = check_replaced(r, promote[i], false);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+    for (i = 0; i < n_remove; i++) {
+        rv = check_replaced(r, remove[i], true);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    debugf(r->io, "replace voters: %u promoted, %u removed", n_promote,
+           n_remove);
+
+    /* Make a copy of the current configuration, and mark the servers to be
+     * promoted and removed as voting only in the new and the old set. */
+    raft_configuration_init(&configuration);
+
+    rv = configuration__copy(&r->configuration, &configuration);
+    if (rv != 0) {
+        goto err;
+    }
+
+    for (i = 0; i < n_promote; i++) {
+        size_t j = configuration__index_of(&configuration, promote[i]);
+        configuration__set_voting(&configuration, j, true);
+        configuration__set_joint(&configuration, j, RAFT_INCOMING);
+    }
+    for (i = 0; i < n_remove; i++) {
+        size_t j = configuration__index_of(&configuration, remove[i]);
+        configuration__set_joint(&configuration, j, RAFT_OUTGOING);
+    }
+
+    /* The new set of voters can't be empty. */
+    if (configuration.n_voting == configuration.n_outgoing) {
+        rv = RAFT_EINVAL;
+        goto err_after_configuration_copy;
+    }
+
+    rv = raft_client__change_configuration(r, &configuration);
+    if (rv != 0) {
+        goto err_after_configuration_copy;
+    }
+
+    return 0;
+
+err_after_configuration_copy:
+    raft_configuration_close(&configuration);
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+int raft_client__leave_joint(struct raft *r)
+{
+    struct raft_configuration configuration;
+    size_t i;
+    size_t j;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+    assert(configuration__is_joint(&r->configuration));
+    assert(r->configuration_uncommitted_index == 0);
+
+    debugf(r->io, "leave joint configuration");
+
+    /* Make a copy of the current configuration without the outgoing voters,
+     * turning the incoming ones into regular voters. */
+    raft_configuration_init(&configuration);
+
+    rv = configuration__copy(&r->configuration, &configuration);
+    if (rv != 0) {
+        goto err;
+    }
+
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+        if (server->joint == RAFT_OUTGOING) {
+            rv = configuration__remove(&configuration, server->id);
+            if (rv != 0) {
+                goto err_after_configuration_copy;
+            }
+        } else if (server->joint == RAFT_INCOMING) {
+            j = configuration__index_of(&configuration, server->id);
+            configuration__set_joint(&configuration, j, 0);
+        }
+    }
+
+    rv = raft_client__change_configuration(r, &configuration);
+    if (rv != 0) {
+        goto err_after_configuration_copy;
+    }
+
+    return 0;
+
+err_after_configuration_copy:
+    raft_configuration_close(&configuration);
+
+err:
+    assert(rv != 0);
+    return rv;
+}
@@ -0,0 +1,53 @@
+/**
+ * Client requests.
+ */
+
+#ifndef RAFT_CLIENT_H
+#define RAFT_CLIENT_H
+
+#include "../include/raft.h"
+
+/**
+ * Return true if the I/O backend can wake up the loop thread, as required by
+ * raft_submit().
+ */
+bool raft_client__has_wakeup(struct raft *r);
+
+/**
+ * Callback to be passed to raft_io->set_wakeup. It appends the entries of all
+ * requests submitted with raft_submit() so far.
+ */
+void raft_client__submit_cb(struct raft_io *io);
+
+/**
+ * Fail all requests submitted with raft_submit() and not yet appended.
+ */
+void raft_client__fail_submitted(struct raft *r, int status);
+
+/**
+ * Fire the callback of the apply request that was forwarded to the leader with
+ * the Propose RPC answered by the given result.
+ */
+void raft_client__recv_forwarded(struct raft *r,
+                                 const struct raft_propose_result *result);
+
+/**
+ * Fail with #RAFT_ERR_TIMEOUT the apply requests forwarded to the leader that
+ * didn't get a result within an election timeout.
+ */
+void raft_client__expire_forwarded(struct raft *r);
+
+/**
+ * Update the backpressure state after the leader has committed the entries
+ * from @first to @last.
+ */
+void raft_client__committed(struct raft *r, raft_index first, raft_index last);
+
+/**
+ * Append the configuration that ends the current joint configuration, once it
+ * has been committed: the outgoing voters are removed and the incoming ones
+ * become regular voters.
+ */
+int raft_client__leave_joint(struct raft *r);
+
+#endif /* RAFT_CLIENT_H */
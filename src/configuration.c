@@ -1,16 +1,110 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "assert.h"
 #include "byte.h"
 #include "configuration.h"
 
-/* Current encoding format version. */
+/* Encoding format versions. The second one adds the election priority of each
+ * server, and is used only if some server has a non-zero priority, so that
+ * older decoders can still read other configurations. */
 #define ENCODING_FORMAT 1
+#define ENCODING_FORMAT_PRIORITY 2
+
+/* Encoding format of joint configurations, which always includes priorities.
+ * Older decoders reject it, and must not be used while a joint configuration
+ * is in flight. */
+#define ENCODING_FORMAT_JOINT 3
+
+/* Values of the voting flag byte of a witness server and of the voters of only
+ * one side of a joint configuration. */
+#define ROLE_WITNESS 2
+#define ROLE_OUTGOING 3
+#define ROLE_INCOMING 4
+
+/* Minimum number of servers for which a lookup table is kept. Smaller
+ * configurations are just scanned. */
+#define LOOKUP_MIN_SERVERS 16
+
+/* Entry of the lookup table of a configuration, which is sorted by ID. */
+struct lookup_slot
+{
+    unsigned id;
+    unsigned index;        /* Position in the servers array. */
+    unsigned voting_index; /* Position among voting servers, or n if not. */
+};
+
+static int lookup_slot_cmp(const void *a, const void *b)
+{
+    const struct lookup_slot *s1 = a;
+    const struct lookup_slot *s2 = b;
+    return s1->id < s2->id ? -1 : s1->id > s2->id;
+}
+
+/* Update the cached numbers of voting servers and the lookup table, after the
+ * servers array has changed. The lookup table is best-effort: if it can't be
+ * allocated lookups fall back to a linear scan. */
+static void refresh(struct raft_configuration *c)
+{
+    struct lookup_slot *slots;
+    unsigned i;
+    unsigned j = 0;
+
+    raft_free(c->lookup);
+    c->lookup = NULL;
+
+    c->n_voting = 0;
+    c->n_outgoing = 0;
+    c->n_incoming = 0;
+    for (i = 0; i < c->n; i++) {
+        const struct raft_server *server = &c->servers[i];
+        if (!server->voting) {
+            continue;
+        }
+        c->n_voting++;
+        if (server->joint == RAFT_OUTGOING) {
+            c->n_outgoing++;
+        } else if (server->joint == RAFT_INCOMING) {
+            c->n_incoming++;
+        }
+    }
+
+    if (c->n < LOOKUP_MIN_SERVERS) {
+        return;
+    }
+
+    slots = raft_malloc(c->n * sizeof *slots);
+    if (slots == NULL) {
+        return;
+    }
+    for (i = 0; i < c->n; i++) {
+        slots[i].id = c->servers[i].id;
+        slots[i].index = i;
+        slots[i].voting_index = c->servers[i].voting ? j++ : c->n;
+    }
+    qsort(slots, c->n, sizeof *slots, lookup_slot_cmp);
+
+    c->lookup = slots;
+}
+
+/* Return the slot of the server with the given ID in the lookup table, or NULL
+ * if there's no table or no such server. */
+static const struct lookup_slot *lookup(const struct raft_configuration *c,
+                                        unsigned id)
+{
+    struct lookup_slot key;
+    key.id = id;
+    return bsearch(&key, c->lookup, c->n, sizeof key, lookup_slot_cmp);
+}
 
 void raft_configuration_init(struct raft_configuration *c)
 {
     c->servers = NULL;
     c->n = 0;
+    c->n_voting = 0;
+    c->n_outgoing = 0;
+    c->n_incoming = 0;
+    c->lookup = NULL;
 }
 
 void raft_configuration_close(struct raft_configuration *c)
@@ -24,6 +118,8 @@ void raft_configuration_close(struct raft_configuration *c)
     if (c->servers != NULL) {
         raft_free(c->servers);
     }
+    raft_free(c->lookup);
+    c->lookup = NULL;
 }
 
 size_t configuration__index_of(const struct raft_configuration *c,
@@ -31,6 +127,10 @@ size_t configuration__index_of(const struct raft_configuration *c,
 {
     size_t i;
     assert(c != NULL);
+    if (c->lookup != NULL) {
+        const struct lookup_slot *slot = lookup(c, id);
+        return slot != NULL ? slot->index : c->n;
+    }
     for (i = 0; i < c->n; i++) {
         if (c->servers[i].id == id) {
             return i;
@@ -46,6 +146,11 @@ size_t configuration__index_of_voting(const struct raft_configuration *c,
     size_t j = 0;
     assert(c != NULL);
 
+    if (c->lookup != NULL) {
+        const struct lookup_slot *slot = lookup(c, id);
+        return slot != NULL ? slot->voting_index : c->n;
+    }
+
     for (i = 0; i < c->n; i++) {
         if (c->servers[i].id == id) {
             if (c->servers[i].voting) {
@@ -83,17 +188,65 @@ const struct raft_server *configuration__get(const struct raft_configuration *c,
 
 size_t configuration__n_voting(const struct raft_configuration *c)
 {
-    size_t i;
-    size_t n = 0;
     assert(c != NULL);
+    return c->n_voting;
+}
 
-    for (i = 0; i < c->n; i++) {
-        if (c->servers[i].voting) {
-            n++;
-        }
+void configuration__set_voting(struct raft_configuration *c,
+                               size_t i,
+                               bool voting)
+{
+    assert(i < c->n);
+    c->servers[i].voting = voting;
+    refresh(c);
+}
+
+bool configuration__is_joint(const struct raft_configuration *c)
+{
+    return c->n_outgoing + c->n_incoming > 0;
+}
+
+void configuration__set_joint(struct raft_configuration *c,
+                              size_t i,
+                              int joint)
+{
+    assert(i < c->n);
+    assert(joint == 0 || c->servers[i].voting);
+    c->servers[i].joint = joint;
+    refresh(c);
+}
+
+void configuration__quorum_init(struct configuration__quorum *q)
+{
+    q->n_old = 0;
+    q->n_new = 0;
+}
+
+void configuration__quorum_add(const struct raft_configuration *c,
+                               size_t i,
+                               struct configuration__quorum *q)
+{
+    const struct raft_server *server;
+
+    assert(i < c->n);
+    server = &c->servers[i];
+
+    if (!server->voting) {
+        return;
+    }
+    if (server->joint != RAFT_INCOMING) {
+        q->n_old++;
     }
+    if (server->joint != RAFT_OUTGOING) {
+        q->n_new++;
+    }
+}
 
-    return n;
+bool configuration__quorum_reached(const struct raft_configuration *c,
+                                   const struct configuration__quorum *q)
+{
+    return q->n_old > (c->n_voting - c->n_incoming) / 2 &&
+           q->n_new > (c->n_voting - c->n_outgoing) / 2;
 }
 
 int configuration__copy(const struct raft_configuration *c1,
@@ -111,7 +264,11 @@ int configuration__copy(const struct raft_configuration *c1,
         if (rv != 0) {
             return rv;
         }
+        c2->servers[c2->n - 1].witness = server->witness;
+        c2->servers[c2->n - 1].priority = server->priority;
+        c2->servers[c2->n - 1].joint = server->joint;
     }
+    refresh(c2);
 
     return 0;
 }
@@ -166,9 +323,64 @@ int raft_configuration_add(struct raft_configuration *c,
     c->n++;
     c->servers = servers;
 
+    refresh(c);
+
     return 0;
 }
 
+int raft_configuration_add_witness(struct raft_configuration *c,
+                                   const unsigned id,
+                                   const char *address)
+{
+    int rv;
+
+    rv = raft_configuration_add(c, id, address, true);
+    if (rv != 0) {
+        return rv;
+    }
+    c->servers[c->n - 1].witness = true;
+
+    return 0;
+}
+
+int raft_configuration_set_priority(struct raft_configuration *c,
+                                    const unsigned id,
+                                    const unsigned short priority)
+{
+    size_t i = configuration__index_of(c, id);
+
+    if (i == c->n) {
+        return RAFT_EBADID;
+    }
+    if (priority > RAFT_MAX_PRIORITY) {
+        return RAFT_EINVAL;
+    }
+    c->servers[i].priority = priority;
+
+    return 0;
+}
+
+/* Return true if some server has a non-zero priority. */
+static bool has_priorities(const struct raft_configuration *c)
+{
+    size_t i;
+
+    for (i = 0; i < c->n; i++) {
+        if (c->servers[i].priority != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool configuration__is_witness(const struct raft_configuration *c, unsigned id)
+{
+    const struct raft_server *server = configuration__get(c, id);
+
+    return server != NULL && server->witness;
+}
+
 int configuration__remove(struct raft_configuration *c, const unsigned id)
 {
     size_t i;
@@ -189,6 +401,7 @@ int configuration__remove(struct raft_configuration *c, const unsigned id)
         raft_free(c->servers);
         c->n = 0;
         c->servers = NULL;
+        refresh(c);
         return 0;
     }
 
@@ -218,6 +431,8 @@ int configuration__remove(struct raft_configuration *c, const unsigned id)
     c->servers = servers;
     c->n--;
 
+    refresh(c);
+
     return 0;
 }
 
@@ -241,6 +456,11 @@ size_t configuration__encoded_size(const struct raft_configuration *c)
         n++;                              /* Voting flag */
     };
 
+    /* Then one byte for each priority, if any. */
+    if (has_priorities(c) || configuration__is_joint(c)) {
+        n += c->n;
+    }
+
     n = byte__pad64(n);
 
     return n;
@@ -249,10 +469,19 @@ size_t configuration__encoded_size(const struct raft_configuration *c)
 void configuration__encode_to_buf(const struct raft_configuration *c, void *buf)
 {
     void *cursor = buf;
+    bool joint = configuration__is_joint(c);
+    bool priorities = joint || has_priorities(c);
+    uint8_t format = ENCODING_FORMAT;
     size_t i;
 
+    if (joint) {
+        format = ENCODING_FORMAT_JOINT;
+    } else if (priorities) {
+        format = ENCODING_FORMAT_PRIORITY;
+    }
+
     /* Encoding format version */
-    byte__put8(&cursor, ENCODING_FORMAT);
+    byte__put8(&cursor, format);
 
     /* Number of servers */
     byte__put64(&cursor, c->n);
@@ -267,7 +496,20 @@ void configuration__encode_to_buf(const struct raft_configuration *c, void *buf)
         strcpy((char *)cursor, server->address);
         cursor += strlen(server->address) + 1;
 
-        byte__put8(&cursor, server->voting);
+        /* Witnesses are voting, so older decoders just see a voter. */
+        if (server->witness) {
+            byte__put8(&cursor, ROLE_WITNESS);
+        } else if (server->joint == RAFT_OUTGOING) {
+            byte__put8(&cursor, ROLE_OUTGOING);
+        } else if (server->joint == RAFT_INCOMING) {
+            byte__put8(&cursor, ROLE_INCOMING);
+        } else {
+            byte__put8(&cursor, server->voting);
+        }
+
+        if (priorities) {
+            byte__put8(&cursor, (uint8_t)server->priority);
+        }
     };
 }
 
@@ -295,6 +537,7 @@ int configuration__decode(const struct raft_buffer *buf,
                           struct raft_configuration *c)
 {
     const void *cursor;
+    uint8_t format;
     size_t i;
     size_t n;
 
@@ -311,7 +554,9 @@ int configuration__decode(const struct raft_buffer *buf,
     cursor = buf->base;
 
     /* Check the encoding format version */
-    if (byte__get8(&cursor) != ENCODING_FORMAT) {
+    format = byte__get8(&cursor);
+    if (format != ENCODING_FORMAT && format != ENCODING_FORMAT_PRIORITY &&
+        format != ENCODING_FORMAT_JOINT) {
         return RAFT_EMALFORMED;
     }
 
@@ -323,7 +568,7 @@ int configuration__decode(const struct raft_buffer *buf,
         unsigned id;
         size_t address_len = 0;
         const char *address;
-        bool voting;
+        uint8_t role;
         int rv;
 
         /* Server ID. */
@@ -342,13 +587,34 @@ int configuration__decode(const struct raft_buffer *buf,
         address = (const char *)cursor;
         cursor += address_len + 1;
 
-        /* Voting flag. */
-        voting = byte__get8(&cursor);
+        /* Role: voting flag, witness or side of a joint configuration. */
+        role = byte__get8(&cursor);
+        if ((role == ROLE_OUTGOING || role == ROLE_INCOMING) &&
+            format != ENCODING_FORMAT_JOINT) {
+            return RAFT_EMALFORMED;
+        }
 
-        rv = raft_configuration_add(c, id, address, voting);
+        if (role == ROLE_WITNESS) {
+            rv = raft_configuration_add_witness(c, id, address);
+        } else {
+            rv = raft_configuration_add(c, id, address, role != 0);
+        }
         if (rv != 0) {
             return rv;
         }
+        if (role == ROLE_OUTGOING) {
+            configuration__set_joint(c, c->n - 1, RAFT_OUTGOING);
+        } else if (role == ROLE_INCOMING) {
+            configuration__set_joint(c, c->n - 1, RAFT_INCOMING);
+        }
+
+        /* Election priority. */
+        if (format != ENCODING_FORMAT) {
+            if (cursor >= buf->base + buf->len) {
+                return RAFT_EMALFORMED;
+            }
+            c->servers[c->n - 1].priority = byte__get8(&cursor);
+        }
     }
 
     return 0;
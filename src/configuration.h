@@ -9,9 +9,60 @@
 
 /**
  * Return the number of voting servers.
+ *
+ * This and the lookups below use values cached by raft_configuration_add(),
+ * configuration__remove() and configuration__set_voting(), so the servers
+ * array must not be modified directly.
  */
 size_t configuration__n_voting(const struct raft_configuration *c);
 
+/**
+ * Set the voting flag of the i'th server.
+ */
+void configuration__set_voting(struct raft_configuration *c,
+                               size_t i,
+                               bool voting);
+
+/**
+ * Return true if the configuration is joint, i.e. some voter is part of only
+ * its old or only its new set of voters.
+ */
+bool configuration__is_joint(const struct raft_configuration *c);
+
+/**
+ * Set the side of a joint configuration of the i'th server, which must be
+ * voting, or clear it if zero.
+ */
+void configuration__set_joint(struct raft_configuration *c,
+                              size_t i,
+                              int joint);
+
+/**
+ * Count of voting servers acknowledging something, such as granting a vote or
+ * storing an entry, on each side of a possibly joint configuration.
+ */
+struct configuration__quorum
+{
+    unsigned n_old; /* Acknowledgements from voters of the old set. */
+    unsigned n_new; /* Acknowledgements from voters of the new set. */
+};
+
+void configuration__quorum_init(struct configuration__quorum *q);
+
+/**
+ * Count an acknowledgement from the i'th server, if it's voting.
+ */
+void configuration__quorum_add(const struct raft_configuration *c,
+                               size_t i,
+                               struct configuration__quorum *q);
+
+/**
+ * Return true if the acknowledgements are a majority of both the old and the
+ * new voters. For non-joint configurations the two sets are the same.
+ */
+bool configuration__quorum_reached(const struct raft_configuration *c,
+                                   const struct configuration__quorum *q);
+
 /**
  * Return the index of the server with the given ID (relative to the c->servers
  * array). If there's no server with the given ID, return the number of servers.
@@ -32,6 +83,11 @@ size_t configuration__index_of_voting(const struct raft_configuration *c,
 const struct raft_server *configuration__get(const struct raft_configuration *c,
                                              unsigned id);
 
+/**
+ * Return true if the server with the given ID is a witness.
+ */
+bool configuration__is_witness(const struct raft_configuration *c, unsigned id);
+
 /**
  * Remove a server from a raft configuration. The given ID must match the one of
  * an existing server in the configuration.
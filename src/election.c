@@ -1,18 +1,161 @@
+#include <string.h>
+
 #include "election.h"
 #include "assert.h"
 #include "configuration.h"
+#include "interval.h"
+#include "io.h"
 #include "log.h"
 #include "logging.h"
+#include "trace.h"
+
+/* Ratio between the adaptive election timeout and the measured round-trip
+ * time, which is also the number of heartbeats sent within the timeout. */
+#define ADAPTIVE_FACTOR 10
+
+/* Return a random election timeout between @timeout and twice @timeout. If
+ * some voting server has a higher priority than us, add a fraction of @timeout
+ * proportional to the gap, so that it's likely to time out first. */
+static unsigned random_timeout(struct raft *r, unsigned timeout)
+{
+    const struct raft_server *self;
+    unsigned highest = 0;
+    unsigned rand;
+    size_t i;
+
+    rand = (unsigned)r->io->random(r->io, (int)timeout, 2 * (int)timeout);
+
+    self = configuration__get(&r->configuration, r->id);
+    if (self == NULL) {
+        return rand;
+    }
+
+    for (i = 0; i < r->configuration.n; i++) {
+        const struct raft_server *server = &r->configuration.servers[i];
+        if (server->voting && server->priority > highest) {
+            highest = server->priority;
+        }
+    }
+
+    if (self->priority < highest) {
+        rand += (unsigned)((unsigned long long)timeout *
+                           (highest - self->priority) / highest);
+    }
+
+    return rand;
+}
 
 void raft_election__reset_timer(struct raft *r)
 {
     assert(r != NULL);
 
-    r->election_timeout_rand =
-        r->io->random(r->io, r->election_timeout, 2 * r->election_timeout);
+    r->election_timeout_rand = random_timeout(r, raft_election__timeout(r));
     r->timer = 0;
 }
 
+unsigned raft_election__timeout(const struct raft *r)
+{
+    if (r->election_adaptive.max != 0 && r->election_adaptive.timeout != 0) {
+        return r->election_adaptive.timeout;
+    }
+    return r->election_timeout;
+}
+
+unsigned raft_election__heartbeat_timeout(const struct raft *r)
+{
+    unsigned timeout;
+
+    if (r->election_adaptive.max == 0 || r->election_adaptive.timeout == 0) {
+        return r->heartbeat_timeout;
+    }
+
+    timeout = r->election_adaptive.timeout / ADAPTIVE_FACTOR;
+    return timeout > 0 ? timeout : 1;
+}
+
+/* Set the adaptive election timeout from the given interval bound. */
+static void set_adaptive_timeout(struct raft *r, unsigned bound)
+{
+    unsigned timeout = bound * ADAPTIVE_FACTOR;
+
+    if (timeout < r->election_adaptive.min) {
+        timeout = r->election_adaptive.min;
+    }
+    if (timeout > r->election_adaptive.max) {
+        timeout = r->election_adaptive.max;
+    }
+
+    if (timeout == r->election_adaptive.timeout) {
+        return;
+    }
+
+    debugf(r->io, "adaptive election timeout %u -> %u",
+           r->election_adaptive.timeout, timeout);
+    r->election_adaptive.timeout = timeout;
+
+    /* Pick a new randomized timeout without resetting the timer. */
+    if (r->state != RAFT_LEADER) {
+        r->election_timeout_rand = random_timeout(r, timeout);
+    }
+}
+
+void raft_election__update_timeout(struct raft *r)
+{
+    unsigned bound = 0;
+    bool sampled = false;
+    size_t i;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (r->election_adaptive.max == 0) {
+        return;
+    }
+
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+        struct raft_interval *rtt = &r->leader_state.replication[i].rtt;
+
+        if (server->id == r->id || !server->voting || !rtt->sampled) {
+            continue;
+        }
+        if (interval__bound(rtt) > bound) {
+            bound = interval__bound(rtt);
+        }
+        sampled = true;
+    }
+
+    if (sampled) {
+        set_adaptive_timeout(r, bound);
+    }
+}
+
+void raft_election__leader_contact(struct raft *r, bool heartbeat)
+{
+    raft_time now;
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    if (r->election_adaptive.max == 0) {
+        return;
+    }
+
+    /* Only the interval between consecutive heartbeats tells about the pace
+     * set by the leader. */
+    if (!heartbeat) {
+        r->follower_state.heartbeat_time = 0;
+        return;
+    }
+
+    now = io__time(r->io);
+    if (r->follower_state.heartbeat_time != 0) {
+        struct raft_interval *interval = &r->follower_state.heartbeat_interval;
+        interval__sample(interval,
+                         (unsigned)(now - r->follower_state.heartbeat_time));
+        set_adaptive_timeout(r, interval__bound(interval));
+    }
+    r->follower_state.heartbeat_time = now;
+}
+
 static void raft_election__send_request_vote_cb(struct raft_io_send *req,
                                                 int status)
 {
@@ -71,9 +214,19 @@ static int raft_election__send_request_vote(struct raft *r,
     /* TODO: account for snapshots */
 
     message.type = RAFT_IO_REQUEST_VOTE;
-    message.request_vote.term = r->current_term;
     message.request_vote.candidate_id = r->id;
 
+    /* During pre-vote we ask for votes in the term that we would start, but
+     * without having incremented our own term yet. */
+    if (r->candidate_state.in_pre_vote) {
+        message.request_vote.term = r->current_term + 1;
+        message.request_vote.pre_vote = true;
+    } else {
+        message.request_vote.term = r->current_term;
+        message.request_vote.pre_vote = false;
+    }
+    message.request_vote.disrupt_leader = r->candidate_state.disrupt_leader;
+
     local_last_index_and_term(r, &message.request_vote.last_log_index,
                               &message.request_vote.last_log_term);
 
@@ -85,7 +238,8 @@ static int raft_election__send_request_vote(struct raft *r,
         return RAFT_ENOMEM;
     }
 
-    rv = r->io->send(r->io, req, &message, raft_election__send_request_vote_cb);
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, raft_election__send_request_vote_cb);
     if (rv != 0) {
         raft_free(req);
         return rv;
@@ -94,12 +248,109 @@ static int raft_election__send_request_vote(struct raft *r,
     return 0;
 }
 
+bool raft_election__async_meta(struct raft *r)
+{
+    return r->io->version >= 2 && r->io->set_meta != NULL;
+}
+
+/* Return true if the I/O backend can persist the term and the vote at once. */
+static bool has_set_term_and_vote(struct raft *r)
+{
+    return r->io->version >= 16 && r->io->set_term_and_vote != NULL;
+}
+
+/* Send RequestVote RPCs to all other voting servers. */
+static void raft_election__send_request_votes(struct raft *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->configuration.n; i++) {
+        const struct raft_server *server = &r->configuration.servers[i];
+        int rv;
+
+        if (server->id == r->id || !server->voting) {
+            continue;
+        }
+
+        rv = raft_election__send_request_vote(r, server);
+        if (rv != 0) {
+            /* This is not a critical failure, let's just log it. */
+            warnf(r->io, "failed to send vote request to server %ld: %s (%d)",
+                  server->id, raft_strerror(rv), rv);
+        }
+    }
+}
+
+/* Pending request to persist the term and the self-vote of a new election. */
+struct raft_election__persist
+{
+    struct raft_io_set_meta req;
+    struct raft *raft;
+    raft_term term;
+};
+
+static void raft_election__persist_cb(struct raft_io_set_meta *req, int status)
+{
+    struct raft_election__persist *request = req->data;
+    struct raft *r = request->raft;
+    raft_term term = request->term;
+
+    raft_free(request);
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        return;
+    }
+
+    if (status != 0) {
+        /* The election timer will eventually start a new round. */
+        warnf(r->io, "failed to persist term %ld: %s (%d)", term,
+              raft_strerror(status), status);
+        return;
+    }
+
+    /* If the election is over or a new one has started, there's nothing to
+     * do. */
+    if (r->state != RAFT_CANDIDATE || r->current_term != term ||
+        r->candidate_state.in_pre_vote) {
+        debugf(r->io, "election for term %ld is over -> don't send requests",
+               term);
+        return;
+    }
+
+    raft_election__send_request_votes(r);
+}
+
+/* Persist the given term and the self-vote asynchronously. */
+static int raft_election__persist(struct raft *r, raft_term term)
+{
+    struct raft_election__persist *request;
+    int rv;
+
+    request = raft_malloc(sizeof *request);
+    if (request == NULL) {
+        return RAFT_ENOMEM;
+    }
+    request->raft = r;
+    request->term = term;
+    request->req.data = request;
+
+    rv = r->io->set_meta(r->io, &request->req, term, r->id,
+                         raft_election__persist_cb);
+    if (rv != 0) {
+        raft_free(request);
+        return rv;
+    }
+
+    return 0;
+}
+
 int raft_election__start(struct raft *r)
 {
     raft_term term;
     size_t n_voting;
     size_t voting_index;
-    size_t i;
+    size_t n_words;
+    bool persisting = false;
     int rv;
 
     assert(r != NULL);
@@ -119,15 +370,40 @@ int raft_election__start(struct raft *r)
     assert(n_voting <= r->configuration.n);
     assert(voting_index < n_voting);
 
-    /* Increment current term */
-    term = r->current_term + 1;
-    rv = r->io->set_term(r->io, term);
-    if (rv != 0) {
-        goto err;
+    /* During the pre-vote round we don't touch our persistent state, since we
+     * don't want to disrupt the cluster unless we know we can win.
+     *
+     * From Section §9.6:
+     *
+     *   If the candidate receives votes from a majority of the cluster, it can
+     *   then increment its term and start a normal election.
+     */
+    if (r->candidate_state.in_pre_vote) {
+        debugf(r->io, "start pre-vote round for term %ld",
+               r->current_term + 1);
+        trace__point(r, election, RAFT_TRACE_ELECTION, 1, 0,
+                     r->current_term + 1, log__last_index(&r->log), 0, 0);
+        goto request_votes;
     }
 
-    /* Vote for self */
-    rv = r->io->set_vote(r->io, r->id);
+    /* Increment current term and vote for self, persisting both at once. If
+     * the backend supports it, the write happens asynchronously and the vote
+     * requests are sent once it completes. */
+    term = r->current_term + 1;
+    r->counters.n_elections++;
+    trace__point(r, election, RAFT_TRACE_ELECTION, 0, 0, term,
+                 log__last_index(&r->log), 0, 0);
+    if (raft_election__async_meta(r)) {
+        rv = raft_election__persist(r, term);
+        persisting = true;
+    } else if (has_set_term_and_vote(r)) {
+        rv = r->io->set_term_and_vote(r->io, term, r->id);
+    } else {
+        rv = r->io->set_term(r->io, term);
+        if (rv == 0) {
+            rv = r->io->set_vote(r->io, r->id);
+        }
+    }
     if (rv != 0) {
         goto err;
     }
@@ -136,33 +412,24 @@ int raft_election__start(struct raft *r)
     r->current_term = term;
     r->voted_for = r->id;
 
+request_votes:
+
     /* Reset election timer. */
     raft_election__reset_timer(r);
 
     assert(r->candidate_state.votes != NULL);
 
-    /* Initialize the votes array and send vote requests. */
-    for (i = 0; i < n_voting; i++) {
-        if (i == voting_index) {
-            r->candidate_state.votes[i] = true; /* We vote for ourselves */
-        } else {
-            r->candidate_state.votes[i] = false;
-        }
-    }
-    for (i = 0; i < r->configuration.n; i++) {
-        const struct raft_server *server = &r->configuration.servers[i];
-        int rv;
-
-        if (server->id == r->id || !server->voting) {
-            continue;
-        }
-
-        rv = raft_election__send_request_vote(r, server);
-        if (rv != 0) {
-            /* This is not a critical failure, let's just log it. */
-            warnf(r->io, "failed to send vote request to server %ld: %s (%d)",
-                  server->id, raft_strerror(rv), rv);
-        }
+    /* Initialize the votes bitset with our own vote and send vote
+     * requests. */
+    n_words = (r->configuration.n + 63) / 64;
+    memset(r->candidate_state.votes, 0,
+           n_words * sizeof *r->candidate_state.votes);
+    r->candidate_state.n_votes_old = 0;
+    r->candidate_state.n_votes_new = 0;
+    raft_election__tally(r, configuration__index_of(&r->configuration, r->id));
+
+    if (!persisting) {
+        raft_election__send_request_votes(r);
     }
 
     return 0;
@@ -194,7 +461,10 @@ int raft_election__vote(struct raft *r,
         return 0;
     }
 
-    if (r->voted_for != 0 && r->voted_for != args->candidate_id) {
+    /* A pre-vote request for a term higher than ours doesn't conflict with the
+     * vote we might have granted in the current term. */
+    if (r->voted_for != 0 && r->voted_for != args->candidate_id &&
+        !(args->pre_vote && args->term > r->current_term)) {
         debugf(r->io, "local server already voted -> not granting vote");
         return 0;
     }
@@ -235,9 +505,17 @@ int raft_election__vote(struct raft *r,
     return 0;
 
 grant_vote:
-    rv = r->io->set_vote(r->io, args->candidate_id);
-    if (rv != 0) {
-        return rv;
+    /* Granting a pre-vote doesn't change our state. */
+    if (args->pre_vote) {
+        *granted = true;
+        return 0;
+    }
+
+    if (!raft_election__async_meta(r)) {
+        rv = r->io->set_vote(r->io, args->candidate_id);
+        if (rv != 0) {
+            return rv;
+        }
     }
 
     *granted = true;
@@ -249,24 +527,29 @@ grant_vote:
     return 0;
 }
 
-bool raft_election__tally(struct raft *r, size_t votes_index)
+bool raft_election__tally(struct raft *r, size_t i)
 {
-    size_t n_voting = configuration__n_voting(&r->configuration);
-    size_t votes = 0;
-    size_t i;
-    size_t half = n_voting / 2;
+    struct configuration__quorum votes;
+    unsigned long long *word;
+    unsigned long long bit;
 
     assert(r != NULL);
     assert(r->state == RAFT_CANDIDATE);
     assert(r->candidate_state.votes != NULL);
-
-    r->candidate_state.votes[votes_index] = true;
-
-    for (i = 0; i < n_voting; i++) {
-        if (r->candidate_state.votes[i]) {
-            votes++;
-        }
+    assert(i < r->configuration.n);
+
+    votes.n_old = r->candidate_state.n_votes_old;
+    votes.n_new = r->candidate_state.n_votes_new;
+
+    /* Count each server only once, since duplicate results can arrive. */
+    word = &r->candidate_state.votes[i / 64];
+    bit = 1ULL << (i % 64);
+    if ((*word & bit) == 0) {
+        *word |= bit;
+        configuration__quorum_add(&r->configuration, i, &votes);
+        r->candidate_state.n_votes_old = votes.n_old;
+        r->candidate_state.n_votes_new = votes.n_new;
     }
 
-    return votes >= half + 1;
+    return configuration__quorum_reached(&r->configuration, &votes);
 }
@@ -9,7 +9,9 @@
 
 /**
  * Reset the election_timer clock and set election_timeout_rand to a random
- * value between election_timeout and 2 * election_timeout.
+ * value between election_timeout and 2 * election_timeout, delayed by up to
+ * another election_timeout if some voting server has a higher priority than
+ * this one.
  *
  * From Section §3.4:
  *
@@ -34,6 +36,35 @@
  */
 void raft_election__reset_timer(struct raft *r);
 
+/**
+ * Return the baseline election timeout, which is the adaptive one if enabled
+ * and known, or @election_timeout otherwise.
+ */
+unsigned raft_election__timeout(const struct raft *r);
+
+/**
+ * Return the interval between heartbeats sent by leaders, which is a tenth of
+ * the adaptive election timeout if enabled and known, or @heartbeat_timeout
+ * otherwise.
+ */
+unsigned raft_election__heartbeat_timeout(const struct raft *r);
+
+/**
+ * Update the adaptive election timeout of a leader after a new round-trip time
+ * measurement, using ten times the highest round-trip time bound of the voting
+ * followers, so that the election timeout stays an order of magnitude larger
+ * than the broadcast time.
+ */
+void raft_election__update_timeout(struct raft *r);
+
+/**
+ * Called by followers when receiving an AppendEntries RPC from the current
+ * leader, which is a @heartbeat if it has no entries. Consecutive heartbeats
+ * are sent every tenth of the leader's adaptive election timeout, so the
+ * interval between them is used to derive the follower's own one.
+ */
+void raft_election__leader_contact(struct raft *r, bool heartbeat);
+
 /**
  * Start a new election round.
  *
@@ -52,9 +83,21 @@ void raft_election__reset_timer(struct raft *r);
  *   To begin an election, a follower increments its current term and
  *   transitions to candidate state.  It then votes for itself and issues
  *   RequestVote RPCs in parallel to each of the other servers in the cluster.
+ *
+ * If the candidate is in the pre-vote round, the current term is left
+ * untouched and pre-vote requests are sent instead.
+ *
+ * If the I/O backend supports asynchronous metadata writes, the RequestVote
+ * RPCs are sent only once the new term and the self-vote are durable.
  */
 int raft_election__start(struct raft *r);
 
+/**
+ * Return true if the I/O backend can persist the term and vote asynchronously,
+ * see raft_io->set_meta.
+ */
+bool raft_election__async_meta(struct raft *r);
+
 /**
  * Decide whether our vote should be granted to the requesting server and update
  * our state accordingly.
@@ -66,18 +109,21 @@ int raft_election__start(struct raft *r);
  *   - If votedFor is null or candidateId, and candidate's log is at least as
  *     up-to-date as receiver's log, grant vote.
  *
- * The outcome of the decision is stored through the @granted pointer.
+ * The outcome of the decision is stored through the @granted pointer. If the
+ * request is a pre-vote, the vote is not persisted and the state is left
+ * unchanged. If the I/O backend supports asynchronous metadata writes, the vote
+ * is only recorded in memory and the caller must persist it before replying.
  */
 int raft_election__vote(struct raft *r,
                         const struct raft_request_vote *args,
                         bool *granted);
 
 /**
- * Update the votes array by adding the vote from the server at the given
- * index. Return true if with this vote the server has reached the majority of
- * votes and won elections.
+ * Update the votes bitset by adding the vote from the i'th server in the
+ * configuration, which must be voting. Return true if with this vote the
+ * server has reached the majority of votes and won elections.
  */
-bool raft_election__tally(struct raft *r, size_t votes_index);
+bool raft_election__tally(struct raft *r, size_t i);
 
 void local_last_index_and_term(struct raft *r,
                                raft_index *index,
@@ -1,5 +1,8 @@
+#include <string.h>
+
 #include "entry.h"
 #include "assert.h"
+#include "byte.h"
 
 void entry_batches__destroy(struct raft_entry *entries, unsigned n)
 {
@@ -19,3 +22,79 @@ void entry_batches__destroy(struct raft_entry *entries, unsigned n)
     }
     raft_free(entries);
 }
+
+int entry__pack(const struct raft_buffer bufs[],
+                unsigned n,
+                struct raft_buffer *buf)
+{
+    void *cursor;
+    unsigned i;
+
+    assert(n > 0);
+
+    buf->len = 8 + n * 8;
+    for (i = 0; i < n; i++) {
+        buf->len += byte__pad64(bufs[i].len);
+    }
+
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    cursor = buf->base;
+    byte__put64(&cursor, n);
+    for (i = 0; i < n; i++) {
+        byte__put64(&cursor, bufs[i].len);
+    }
+    for (i = 0; i < n; i++) {
+        size_t padding = byte__pad64(bufs[i].len) - bufs[i].len;
+        memcpy(cursor, bufs[i].base, bufs[i].len);
+        memset((uint8_t *)cursor + bufs[i].len, 0, padding);
+        cursor = (uint8_t *)cursor + bufs[i].len + padding;
+    }
+
+    return 0;
+}
+
+int entry__unpack(const struct raft_buffer *buf,
+                  struct raft_buffer **bufs,
+                  unsigned *n)
+{
+    const void *cursor = buf->base;
+    uint8_t *data;
+    size_t left;
+    uint64_t count;
+    unsigned i;
+
+    if (buf->len < 8) {
+        return RAFT_EMALFORMED;
+    }
+    count = byte__get64(&cursor);
+    left = buf->len - 8;
+    if (count == 0 || count > left / 8) {
+        return RAFT_EMALFORMED;
+    }
+
+    *n = (unsigned)count;
+    *bufs = raft_malloc(*n * sizeof **bufs);
+    if (*bufs == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    data = (uint8_t *)buf->base + 8 + *n * 8;
+    left -= *n * 8;
+    for (i = 0; i < *n; i++) {
+        size_t len = (size_t)byte__get64(&cursor);
+        if (len > left || byte__pad64(len) > left) {
+            raft_free(*bufs);
+            return RAFT_EMALFORMED;
+        }
+        (*bufs)[i].base = data;
+        (*bufs)[i].len = len;
+        data += byte__pad64(len);
+        left -= byte__pad64(len);
+    }
+
+    return 0;
+}
@@ -9,5 +9,32 @@
  */
 void entry_batches__destroy(struct raft_entry *entries, unsigned n);
 
+/**
+ * Pack the given commands into the payload of a single #RAFT_BATCH entry,
+ * allocating a new buffer which the caller owns.
+ *
+ * The payload has the following layout, with each command padded to a multiple
+ * of 8 bytes:
+ *
+ * [8 bytes] Number of commands N
+ * [8 bytes] Size of the 1st command
+ *   ...
+ * [8 bytes] Size of the Nth command
+ * [...    ] Data of the 1st command
+ *   ...
+ * [...    ] Data of the Nth command
+ */
+int entry__pack(const struct raft_buffer bufs[],
+                unsigned n,
+                struct raft_buffer *buf);
+
+/**
+ * Unpack the commands stored in the payload of a #RAFT_BATCH entry. The
+ * allocated @bufs array is owned by the caller and points into @buf.
+ */
+int entry__unpack(const struct raft_buffer *buf,
+                  struct raft_buffer **bufs,
+                  unsigned *n);
+
 #endif /* RAFT_ENTRY_H */
 
@@ -69,6 +69,7 @@ int raft_fixture_init(struct raft_fixture *f, unsigned n, struct raft_fsm *fsms)
 
     f->time = 0;
     f->n = n;
+    f->leader_id = 0;
 
     /* Initialize all servers */
     for (i = 0; i < n; i++) {
@@ -189,62 +190,108 @@ static void flush_io(struct raft_fixture *f)
     }
 }
 
-/* Figure what's the lowest delivery timer across all stub I/O instances,
- * i.e. the time at which the next message should be delivered (if any is
- * pending). */
-static int lowest_deliver_timeout(struct raft_fixture *f)
+/* Return the time at which the i'th server must be ticked, i.e. one
+ * millisecond past the expiration of its timer, since timers expire only once
+ * they are strictly greater than their timeout. Servers that are not running
+ * don't need to be ticked. */
+static raft_time tick_deadline(struct raft_fixture *f, unsigned i)
 {
-    int min_timeout = -1;
-    size_t i;
+    struct raft *r = &f->servers[i].raft;
+    if (raft_state(r) == RAFT_UNAVAILABLE) {
+        return (raft_time)-1;
+    }
+    return r->last_tick + raft_next_timeout(r) + 1;
+}
 
-    for (i = 0; i < f->n; i++) {
-        struct raft_io *io = &f->servers[i].io;
-        int timeout;
-        timeout = raft_io_stub_next_deliver_timeout(io);
-        if (timeout == -1) {
-            continue;
-        }
-        if (min_timeout == -1 || timeout < min_timeout) {
-            min_timeout = timeout;
-        }
+/* Return the time at which the next message sent by the i'th server must be
+ * delivered, or -1 if there's none. */
+static raft_time deliver_deadline(struct raft_fixture *f, unsigned i)
+{
+    int timeout = raft_io_stub_next_deliver_timeout(&f->servers[i].io);
+    if (timeout == -1) {
+        return (raft_time)-1;
     }
+    return f->time + (unsigned)timeout + 1;
+}
 
-    return min_timeout;
+/* Return the time at which the next disk write of the i'th server completes,
+ * or -1 if there's none in flight. */
+static raft_time complete_deadline(struct raft_fixture *f, unsigned i)
+{
+    int timeout = raft_io_stub_next_complete_timeout(&f->servers[i].io);
+    if (timeout == -1) {
+        return (raft_time)-1;
+    }
+    return f->time + (unsigned)timeout;
 }
 
-/* Check what's the raft instance whose timer is closest to expiration. */
-static unsigned lowest_raft_timeout(struct raft_fixture *f)
+/* Return the time of the next event across all alive servers, either a message
+ * delivery, a disk write completion or a timer expiration. Each stub keeps its
+ * messages and disk writes ordered by time and each timer deadline is a
+ * constant-time computation, so this is linear in the number of servers
+ * regardless of the traffic. */
+static raft_time next_event(struct raft_fixture *f)
 {
-    size_t i;
-    unsigned min_timeout = 0; /* Lowest remaining time before expiration */
+    raft_time time = (raft_time)-1;
+    unsigned i;
 
     for (i = 0; i < f->n; i++) {
-        struct raft *r = &f->servers[i].raft;
-        unsigned timeout; /* Milliseconds remaining before expiration. */
-
-        timeout = raft_next_timeout(r);
-        if (i == 0 || timeout <= min_timeout) {
-            min_timeout = timeout;
+        raft_time deadline;
+        if (!f->servers[i].alive) {
+            continue;
+        }
+        deadline = tick_deadline(f, i);
+        if (deadline < time) {
+            time = deadline;
+        }
+        deadline = deliver_deadline(f, i);
+        if (deadline < time) {
+            time = deadline;
+        }
+        deadline = complete_deadline(f, i);
+        if (deadline < time) {
+            time = deadline;
         }
     }
 
-    return min_timeout;
+    /* Always make progress. */
+    if (time <= f->time) {
+        time = f->time + 1;
+    }
+
+    return time;
 }
 
-/* Fire either a message delivery or a raft tick, depending on whose timer is
- * closest to expiration. */
-static void advance(struct raft_fixture *f, unsigned msecs)
+/* Advance the time of all alive servers to the given value, then complete
+ * their disk writes whose time has come, tick the ones whose timer has expired
+ * and deliver the messages whose latency has elapsed. Other servers are not
+ * ticked, as it happens with backends implementing raft_io->tick_after. */
+static void advance(struct raft_fixture *f, raft_time time)
 {
-    size_t i;
+    unsigned i;
+
+    f->time = time;
 
     for (i = 0; i < f->n; i++) {
         struct raft_fixture_server *s = &f->servers[i];
         if (!s->alive) {
             continue;
         }
-        raft_io_stub_advance(&s->io, msecs);
+        raft_io_stub_set_time(&s->io, (unsigned)time);
+    }
+
+    for (i = 0; i < f->n; i++) {
+        struct raft_fixture_server *s = &f->servers[i];
+        if (!s->alive) {
+            continue;
+        }
+        raft_io_stub_complete(&s->io);
+        if (tick_deadline(f, i) <= time) {
+            raft_io_stub_advance(&s->io, 0);
+        } else {
+            raft_io_stub_transmit(&s->io);
+        }
     }
-    f->time += msecs;
 }
 
 /* Update the leader and check for election safety.
@@ -380,7 +427,13 @@ static void check_leader_append_only(struct raft_fixture *f)
     raft = raft_fixture_get(f, f->leader_id - 1);
     last = log__last_index(&f->log);
 
-    for (index = 1; index <= last; index++) {
+    /* Only compare entries that were not compacted away by a snapshot. */
+    index = log__first_index(&f->log);
+    if (log__first_index(&raft->log) > index) {
+        index = log__first_index(&raft->log);
+    }
+
+    for (; index <= last; index++) {
         const struct raft_entry *entry1;
         const struct raft_entry *entry2;
 
@@ -404,19 +457,43 @@ static void check_leader_append_only(struct raft_fixture *f)
 }
 
 /* Make a copy of the the current leader log, in order to perform the Leader
- * Append-Only check at the next iteration. */
-static void copy_leader_log(struct raft_fixture *f)
+ * Append-Only check at the next iteration. If the leader has not changed, the
+ * copy taken at the previous iteration has just been checked, so only drop the
+ * entries that the leader doesn't hold anymore and append the new ones. */
+static void copy_leader_log(struct raft_fixture *f, bool changed)
 {
     struct raft *raft = raft_fixture_get(f, f->leader_id - 1);
     struct raft_entry *entries;
+    raft_index first = log__first_index(&raft->log);
+    raft_index last = log__last_index(&f->log);
     unsigned n;
     size_t i;
     int rc;
 
-    log__close(&f->log);
-    log__init(&f->log);
+    /* Skip entries compacted away by a snapshot or evicted from memory. */
+    if (first <= raft->log.evicted) {
+        first = raft->log.evicted + 1;
+    }
+
+    if (!changed && last != 0 && first <= last) {
+        if (log__first_index(&f->log) < first) {
+            log__shift(&f->log, first - 1);
+        }
+        first = last + 1;
+    } else {
+        log__close(&f->log);
+        log__init(&f->log);
+        if (first == 0 || first > log__last_index(&raft->log)) {
+            return;
+        }
+        log__set_offset(&f->log, first - 1);
+    }
 
-    rc = log__acquire(&raft->log, 1, &entries, &n);
+    if (first > log__last_index(&raft->log)) {
+        return;
+    }
+
+    rc = log__acquire(&raft->log, first, &entries, &n);
     assert(rc == 0);
 
     for (i = 0; i < n; i++) {
@@ -429,7 +506,7 @@ static void copy_leader_log(struct raft_fixture *f)
         assert(rc == 0);
     }
 
-    log__release(&raft->log, 1, entries, n);
+    log__release(&raft->log, first, entries, n);
 }
 
 /* Update the commit index to match the one from the current leader. */
@@ -441,45 +518,48 @@ static void update_commit_index(struct raft_fixture *f)
     }
 }
 
-void raft_fixture_step(struct raft_fixture *f)
+/* Step the cluster without advancing the time past @limit, if in the
+ * future. */
+static void step(struct raft_fixture *f, raft_time limit)
 {
-    int deliver_timeout;
-    unsigned raft_timeout;
-    unsigned timeout;
+    raft_time time;
+    bool changed;
 
     /* First flush I/O operations. */
     flush_io(f);
 
-    /* Second, figure what's the message with the lowest timer (i.e. the
-     * message that should be delivered first) */
-    deliver_timeout = lowest_deliver_timeout(f);
-
-    /* Now check what's the raft instance whose timer is closest to
-     * expiration. */
-    raft_timeout = lowest_raft_timeout(f);
-
-    /* Fire either a raft tick or a message delivery. */
-    if (deliver_timeout != -1 && (unsigned)deliver_timeout < raft_timeout) {
-        timeout = deliver_timeout;
-    } else {
-        timeout = raft_timeout;
+    /* Then jump to the time of the next message delivery or timer expiration,
+     * and fire them. */
+    time = next_event(f);
+    if (time > limit && limit > f->time) {
+        time = limit;
     }
-
-    advance(f, timeout + 1);
+    advance(f, time);
 
     /* If the leader has not changed check the Leader Append-Only
      * guarantee. */
-    if (!update_leader(f)) {
+    changed = update_leader(f);
+    if (!changed) {
         check_leader_append_only(f);
     }
 
     /* If we have a leader, update leader-related state . */
     if (f->leader_id != 0) {
-        copy_leader_log(f);
+        copy_leader_log(f, changed);
         update_commit_index(f);
     }
 }
 
+void raft_fixture_step(struct raft_fixture *f)
+{
+    step(f, (raft_time)-1);
+}
+
+void raft_fixture_step_to(struct raft_fixture *f, raft_time time)
+{
+    step(f, time);
+}
+
 bool raft_fixture_step_until(struct raft_fixture *f,
                              bool (*stop)(struct raft_fixture *f, void *arg),
                              void *arg,
@@ -698,6 +778,7 @@ int raft_fixture_grow(struct raft_fixture *f, struct raft_fsm *fsm)
     if (rc != 0) {
         return rc;
     }
+    raft_io_stub_set_time(&s->io, (unsigned)f->time);
 
     connect_to_all(f, i);
     for (j = 0; j < f->n; j++) {
@@ -722,6 +803,26 @@ void raft_fixture_set_random(struct raft_fixture *f,
     raft_io_stub_set_random(&s->io, random);
 }
 
+void raft_fixture_set_latency(struct raft_fixture *f,
+                              unsigned i,
+                              unsigned min,
+                              unsigned max)
+{
+    struct raft_fixture_server *s = &f->servers[i];
+    raft_io_stub_set_latency(&s->io, min, max);
+}
+
+void raft_fixture_set_disk(struct raft_fixture *f,
+                           unsigned i,
+                           unsigned min,
+                           unsigned max,
+                           unsigned bandwidth,
+                           unsigned depth)
+{
+    struct raft_fixture_server *s = &f->servers[i];
+    raft_io_stub_set_disk(&s->io, min, max, bandwidth, depth);
+}
+
 void raft_fixture_set_term(struct raft_fixture *f, unsigned i, raft_term term)
 {
     struct raft_fixture_server *s = &f->servers[i];
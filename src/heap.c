@@ -2,6 +2,8 @@
 
 #include "../include/raft.h"
 
+#include "heap.h"
+
 static void *default_malloc(void *data, size_t size)
 {
     (void)data;
@@ -43,24 +45,42 @@ struct raft_heap default_heap = {
 
 struct raft_heap *current_heap = &default_heap;
 
+/* Heap of the calling thread, overriding the process-wide one if set. */
+static __thread struct raft_heap *thread_heap = NULL;
+
+struct raft_heap *heap__current(void)
+{
+    return thread_heap != NULL ? thread_heap : current_heap;
+}
+
 void *raft_malloc(size_t size)
 {
-    return current_heap->malloc(current_heap->data, size);
+    struct raft_heap *h = heap__current();
+    return h->malloc(h->data, size);
 }
 
 void raft_free(void *ptr)
 {
-    current_heap->free(current_heap->data, ptr);
+    struct raft_heap *h = heap__current();
+    h->free(h->data, ptr);
 }
 
 void *raft_calloc(size_t nmemb, size_t size)
 {
-    return current_heap->calloc(current_heap->data, nmemb, size);
+    struct raft_heap *h = heap__current();
+    return h->calloc(h->data, nmemb, size);
 }
 
 void *raft_realloc(void *ptr, size_t size)
 {
-    return current_heap->realloc(current_heap->data, ptr, size);
+    struct raft_heap *h = heap__current();
+    return h->realloc(h->data, ptr, size);
+}
+
+void *raft_aligned_alloc(size_t alignment, size_t size)
+{
+    struct raft_heap *h = heap__current();
+    return h->aligned_alloc(h->data, alignment, size);
 }
 
 void raft_heap_set(struct raft_heap *heap)
@@ -72,3 +92,8 @@ void raft_heap_set_default()
 {
     current_heap = &default_heap;
 }
+
+void raft_heap_set_thread(struct raft_heap *heap)
+{
+    thread_heap = heap;
+}
@@ -0,0 +1,15 @@
+/**
+ * Dynamic memory allocation.
+ */
+
+#ifndef RAFT_HEAP_H
+#define RAFT_HEAP_H
+
+#include "../include/raft.h"
+
+/**
+ * Return the allocator used by the calling thread.
+ */
+struct raft_heap *heap__current(void);
+
+#endif /* RAFT_HEAP_H */
@@ -0,0 +1,34 @@
+#include "interval.h"
+
+void interval__init(struct raft_interval *i)
+{
+    i->mean = 0;
+    i->var = 0;
+    i->sampled = false;
+}
+
+void interval__sample(struct raft_interval *i, unsigned msecs)
+{
+    long long err;
+
+    /* The first sample sets the mean and half of it as deviation. */
+    if (!i->sampled) {
+        i->mean = msecs << 3;
+        i->var = msecs << 1;
+        i->sampled = true;
+        return;
+    }
+
+    /* mean = 7/8 mean + 1/8 sample, var = 3/4 var + 1/4 |mean - sample|. */
+    err = (long long)msecs - (i->mean >> 3);
+    i->mean = (unsigned)((long long)i->mean + err);
+    if (err < 0) {
+        err = -err;
+    }
+    i->var = (unsigned)((long long)i->var + err - (i->var >> 2));
+}
+
+unsigned interval__bound(const struct raft_interval *i)
+{
+    return (i->mean >> 3) + i->var;
+}
@@ -0,0 +1,30 @@
+/**
+ * Smoothed estimates of time intervals, such as round-trip times.
+ *
+ * Samples are averaged like the round-trip time estimates of TCP's
+ * retransmission timer (RFC 6298), tracking both the mean of the interval and
+ * its mean deviation, so that an upper bound for most intervals can be derived.
+ */
+
+#ifndef RAFT_INTERVAL_H
+#define RAFT_INTERVAL_H
+
+#include "../include/raft.h"
+
+/**
+ * Initialize an estimate with no samples.
+ */
+void interval__init(struct raft_interval *i);
+
+/**
+ * Update the estimate with an interval of @msecs milliseconds.
+ */
+void interval__sample(struct raft_interval *i, unsigned msecs);
+
+/**
+ * Return the mean of the interval plus four times its mean deviation, in
+ * milliseconds, or 0 if no sample was taken yet.
+ */
+unsigned interval__bound(const struct raft_interval *i);
+
+#endif /* RAFT_INTERVAL_H */
@@ -0,0 +1,84 @@
+/**
+ * Calls to the raft_io methods used on hot paths.
+ *
+ * When built with RAFT_IO_UV_DIRECT, calls on instances backed by io_uv are
+ * made directly to its implementation, after checking the method pointer, so
+ * that the compiler doesn't have to go through the pointer and link time
+ * optimization can inline them. Other backends, such as the stub used by the
+ * tests, still go through the pointer.
+ */
+
+#ifndef RAFT_IO_H_
+#define RAFT_IO_H_
+
+#include "../include/raft.h"
+
+#include "byte.h"
+
+#if defined(RAFT_IO_UV_DIRECT)
+#include "io_uv.h"
+#endif
+
+RAFT_INLINE raft_time io__time(struct raft_io *io)
+{
+#if defined(RAFT_IO_UV_DIRECT)
+    if (io->time == io_uv__time) {
+        return io_uv__time(io);
+    }
+#endif
+    return io->time(io);
+}
+
+RAFT_INLINE int io__send(struct raft_io *io,
+                         struct raft_io_send *req,
+                         const struct raft_message *message,
+                         raft_io_send_cb cb)
+{
+#if defined(RAFT_IO_UV_DIRECT)
+    if (io->send == io_uv__send) {
+        return io_uv__send(io, req, message, cb);
+    }
+#endif
+    return io->send(io, req, message, cb);
+}
+
+RAFT_INLINE int io__broadcast(struct raft_io *io,
+                              struct raft_io_send *reqs[],
+                              const struct raft_message messages[],
+                              unsigned n,
+                              int statuses[],
+                              raft_io_send_cb cb)
+{
+#if defined(RAFT_IO_UV_DIRECT)
+    if (io->broadcast == io_uv__broadcast) {
+        return io_uv__broadcast(io, reqs, messages, n, statuses, cb);
+    }
+#endif
+    return io->broadcast(io, reqs, messages, n, statuses, cb);
+}
+
+RAFT_INLINE int io__append(struct raft_io *io,
+                           const struct raft_entry entries[],
+                           unsigned n,
+                           void *data,
+                           void (*cb)(void *data, int status))
+{
+#if defined(RAFT_IO_UV_DIRECT)
+    if (io->append == io_uv__append) {
+        return io_uv__append(io, entries, n, data, cb);
+    }
+#endif
+    return io->append(io, entries, n, data, cb);
+}
+
+RAFT_INLINE bool io__congested(struct raft_io *io, unsigned id)
+{
+#if defined(RAFT_IO_UV_DIRECT)
+    if (io->congested == io_uv__congested) {
+        return io_uv__congested(io, id);
+    }
+#endif
+    return io->congested(io, id);
+}
+
+#endif /* RAFT_IO_H_ */
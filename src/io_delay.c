@@ -0,0 +1,1061 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_delay.h"
+
+#include "assert.h"
+#include "queue.h"
+
+/* Size of the buffer used to format log messages before forwarding them. */
+#define EMIT_BUF_SIZE 1024
+
+/* Rough size of the fixed part of a message, added to the size of its payload
+ * when computing transfer times. */
+#define MESSAGE_HEADER_SIZE 64
+
+/* Types of delayed events. */
+enum {
+    IO_DELAY__SEND = 1,
+    IO_DELAY__APPEND,
+    IO_DELAY__SNAPSHOT_PUT,
+    IO_DELAY__SET_META
+};
+
+/* Delay settings of the disk or of the link to a server. */
+struct io_delay__link
+{
+    unsigned min_latency; /* Milliseconds */
+    unsigned max_latency; /* Milliseconds */
+    unsigned bandwidth;   /* Bytes per second, or zero if unlimited */
+};
+
+/* Timeline of the disk or of the link to a server. */
+struct io_delay__line
+{
+    raft_time transfer; /* When the last transfer ends, in microseconds */
+    raft_time last;     /* Release time of the last event, in milliseconds */
+};
+
+/* Link to another server. */
+struct io_delay__peer
+{
+    unsigned id;                /* Server ID */
+    bool custom;                /* Whether the settings below apply */
+    struct io_delay__link link; /* Specific settings of this server */
+    struct io_delay__line line; /* Timeline of the messages sent to it */
+};
+
+/* Disk write or message held until its release time. */
+struct io_delay__event
+{
+    struct io_delay *d; /* Wrapper instance */
+    int type;           /* Event type */
+    size_t size;        /* Bytes to transfer */
+    raft_time time;     /* Release time */
+    int status;         /* Result of a completed disk write */
+    union {
+        struct
+        {
+            struct raft_io_send req;
+            struct raft_io_send *outer;
+            struct raft_message message;
+        } send;
+        struct
+        {
+            void *data;
+            void (*cb)(void *data, int status);
+        } append;
+        struct
+        {
+            struct raft_io_snapshot_put req;
+            struct raft_io_snapshot_put *outer;
+        } snapshot_put;
+        struct
+        {
+            struct raft_io_set_meta req;
+            struct raft_io_set_meta *outer;
+        } set_meta;
+    };
+    raft__queue queue; /* Link in the queue of held events */
+};
+
+struct io_delay
+{
+    struct raft_io *io;            /* Wrapper instance */
+    struct raft_io *inner;         /* Wrapped instance */
+    struct io_delay__link disk;    /* Disk settings */
+    struct io_delay__line writes;  /* Timeline of disk writes */
+    struct io_delay__link network; /* Default settings of links */
+    struct io_delay__peer *peers;  /* Links to other servers */
+    unsigned n_peers;              /* Length of the peers array */
+    raft__queue events;            /* Held events, by release time */
+    unsigned msecs;                /* Tick interval passed to start */
+    raft_time deadline;            /* When the tick callback is due */
+    raft_io_tick_cb tick_cb;
+    raft_io_recv_cb recv_cb;
+    raft_io_recv_batch_cb recv_batch_cb;
+    raft_io_wakeup_cb wakeup_cb;
+    raft_io_close_cb close_cb;
+    bool closing;
+};
+
+/* Return the link to the server with the given ID, creating it if needed. */
+static struct io_delay__peer *get_peer(struct io_delay *d, unsigned id)
+{
+    struct io_delay__peer *peers;
+    struct io_delay__peer *peer;
+    unsigned i;
+
+    for (i = 0; i < d->n_peers; i++) {
+        if (d->peers[i].id == id) {
+            return &d->peers[i];
+        }
+    }
+
+    peers = raft_realloc(d->peers, (d->n_peers + 1) * sizeof *peers);
+    if (peers == NULL) {
+        return NULL;
+    }
+    d->peers = peers;
+
+    peer = &d->peers[d->n_peers];
+    peer->id = id;
+    peer->custom = false;
+    peer->line.transfer = 0;
+    peer->line.last = 0;
+    d->n_peers++;
+
+    return peer;
+}
+
+/* Return the time at which an event transferring @size bytes through the given
+ * link and timeline should be released, and update the timeline. */
+static raft_time line_submit(struct io_delay *d,
+                             const struct io_delay__link *link,
+                             struct io_delay__line *line,
+                             size_t size)
+{
+    raft_time start = d->inner->time(d->inner) * 1000;
+    raft_time end;
+    unsigned latency;
+
+    if (link->bandwidth != 0) {
+        if (line->transfer > start) {
+            start = line->transfer;
+        }
+        start += (raft_time)size * 1000000 / link->bandwidth;
+        line->transfer = start;
+    }
+
+    latency = link->min_latency;
+    if (link->max_latency > latency) {
+        latency = (unsigned)d->inner->random(d->inner, (int)latency,
+                                             (int)link->max_latency);
+    }
+
+    /* Round up to the next millisecond, keeping events in order. */
+    end = (start + (raft_time)latency * 1000 + 999) / 1000;
+    if (end < line->last) {
+        end = line->last;
+    }
+    line->last = end;
+
+    return end;
+}
+
+/* Return true if an event with the given release time can be released right
+ * away, without overtaking any held event that is due. */
+static bool is_due(struct io_delay *d, raft_time time)
+{
+    struct io_delay__event *head;
+    raft__queue *q;
+    raft_time now;
+
+    if (d->closing) {
+        return false;
+    }
+
+    now = d->inner->time(d->inner);
+    if (time > now) {
+        return false;
+    }
+
+    if (RAFT__QUEUE_IS_EMPTY(&d->events)) {
+        return true;
+    }
+    q = RAFT__QUEUE_HEAD(&d->events);
+    head = RAFT__QUEUE_DATA(q, struct io_delay__event, queue);
+
+    return head->time > now;
+}
+
+/* Return true if the inner instance can be asked for the next tick. */
+static bool has_tick_after(struct raft_io *inner)
+{
+    return inner->version >= 15 && inner->tick_after != NULL;
+}
+
+/* Ask the inner instance to tick when either the next held event or the tick
+ * callback is due. */
+static void schedule(struct io_delay *d)
+{
+    struct io_delay__event *head;
+    raft__queue *q;
+    raft_time next = d->deadline;
+    raft_time now;
+
+    if (!has_tick_after(d->inner) || d->closing) {
+        return;
+    }
+
+    if (!RAFT__QUEUE_IS_EMPTY(&d->events)) {
+        q = RAFT__QUEUE_HEAD(&d->events);
+        head = RAFT__QUEUE_DATA(q, struct io_delay__event, queue);
+        if (head->time < next) {
+            next = head->time;
+        }
+    }
+
+    now = d->inner->time(d->inner);
+    d->inner->tick_after(d->inner, next > now ? (unsigned)(next - now) : 0);
+}
+
+/* Hold the given event until its release time, after the held events with the
+ * same or an earlier release time. */
+static void hold(struct io_delay *d, struct io_delay__event *event)
+{
+    raft__queue *q;
+
+    RAFT__QUEUE_FOREACH(q, &d->events)
+    {
+        struct io_delay__event *other;
+        other = RAFT__QUEUE_DATA(q, struct io_delay__event, queue);
+        if (other->time > event->time) {
+            break;
+        }
+    }
+
+    /* Insert before q, which is either a later event or the queue head. */
+    RAFT__QUEUE_PUSH(q, &event->queue);
+
+    schedule(d);
+}
+
+static void send_cb(struct raft_io_send *req, int status)
+{
+    struct io_delay__event *event = req->data;
+    struct raft_io_send *outer = event->send.outer;
+    raft_free((char *)event->send.message.server_address);
+    raft_free(event);
+    outer->cb(outer, status);
+}
+
+/* Hand a message over to the inner instance. */
+static int send_submit(struct io_delay__event *event)
+{
+    struct io_delay *d = event->d;
+    return d->inner->send(d->inner, &event->send.req, &event->send.message,
+                          send_cb);
+}
+
+/* Invoke the callback of a completed disk write and release its event. */
+static void disk_finish(struct io_delay__event *event)
+{
+    int status = event->status;
+
+    switch (event->type) {
+        case IO_DELAY__APPEND: {
+            void *data = event->append.data;
+            void (*cb)(void *data, int status) = event->append.cb;
+            raft_free(event);
+            cb(data, status);
+            break;
+        }
+        case IO_DELAY__SNAPSHOT_PUT: {
+            struct raft_io_snapshot_put *outer = event->snapshot_put.outer;
+            raft_free(event);
+            outer->cb(outer, status);
+            break;
+        }
+        case IO_DELAY__SET_META: {
+            struct raft_io_set_meta *outer = event->set_meta.outer;
+            raft_free(event);
+            outer->cb(outer, status);
+            break;
+        }
+        default:
+            assert(0);
+    }
+}
+
+/* Release a held event. */
+static void release(struct io_delay__event *event)
+{
+    struct raft_io_send *outer;
+    int rv;
+
+    if (event->type != IO_DELAY__SEND) {
+        disk_finish(event);
+        return;
+    }
+
+    /* We told the caller that the message was submitted, so any failure must
+     * now be reported through the callback. */
+    if (event->d->closing) {
+        rv = RAFT_ERR_IO_CANCELED;
+    } else {
+        rv = send_submit(event);
+    }
+    if (rv != 0) {
+        outer = event->send.outer;
+        raft_free((char *)event->send.message.server_address);
+        raft_free(event);
+        outer->cb(outer, rv);
+    }
+}
+
+/* Release all held events that are due. */
+static void release_due(struct io_delay *d)
+{
+    struct io_delay__event *event;
+    raft__queue *q;
+    raft_time now = d->inner->time(d->inner);
+
+    while (!RAFT__QUEUE_IS_EMPTY(&d->events)) {
+        q = RAFT__QUEUE_HEAD(&d->events);
+        event = RAFT__QUEUE_DATA(q, struct io_delay__event, queue);
+        if (event->time > now) {
+            break;
+        }
+        RAFT__QUEUE_REMOVE(q);
+        release(event);
+    }
+}
+
+/* A disk write was completed by the inner instance. */
+static void disk_done(struct io_delay__event *event, int status)
+{
+    struct io_delay *d = event->d;
+
+    event->status = status;
+    event->time = line_submit(d, &d->disk, &d->writes, event->size);
+
+    if (is_due(d, event->time)) {
+        disk_finish(event);
+        return;
+    }
+
+    hold(d, event);
+}
+
+static struct io_delay__event *event_create(struct io_delay *d, int type)
+{
+    struct io_delay__event *event;
+    event = raft_malloc(sizeof *event);
+    if (event == NULL) {
+        return NULL;
+    }
+    event->d = d;
+    event->type = type;
+    event->size = 0;
+    event->time = 0;
+    event->status = 0;
+    return event;
+}
+
+static int io_delay__init(struct raft_io *io, unsigned id, const char *address)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->init(d->inner, id, address);
+}
+
+static int io_delay__load(struct raft_io *io,
+                          raft_term *term,
+                          unsigned *voted_for,
+                          struct raft_snapshot **snapshot,
+                          struct raft_entry *entries[],
+                          size_t *n_entries)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->load(d->inner, term, voted_for, snapshot, entries,
+                          n_entries);
+}
+
+static int io_delay__load_async(struct raft_io *io,
+                                struct raft_io_load *req,
+                                raft_io_load_batch_cb batch,
+                                raft_io_load_cb cb)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->load_async(d->inner, req, batch, cb);
+}
+
+static void tick_cb(struct raft_io *inner)
+{
+    struct io_delay *d = inner->data;
+    raft_time now;
+
+    release_due(d);
+
+    /* Without tick_after, the inner instance ticks periodically, exactly when
+     * the tick callback expects it. */
+    now = d->inner->time(d->inner);
+    if (!has_tick_after(d->inner) || now >= d->deadline) {
+        d->deadline = now + d->msecs;
+        d->tick_cb(d->io);
+    }
+
+    schedule(d);
+}
+
+static void recv_cb(struct raft_io *inner, struct raft_message *message)
+{
+    struct io_delay *d = inner->data;
+    d->recv_cb(d->io, message);
+}
+
+static void recv_batch_cb(struct raft_io *inner,
+                          struct raft_message messages[],
+                          unsigned n)
+{
+    struct io_delay *d = inner->data;
+    d->recv_batch_cb(d->io, messages, n);
+}
+
+static int io_delay__start(struct raft_io *io,
+                           unsigned msecs,
+                           raft_io_tick_cb tick,
+                           raft_io_recv_cb recv)
+{
+    struct io_delay *d = io->impl;
+    d->msecs = msecs;
+    d->deadline = d->inner->time(d->inner) + msecs;
+    d->tick_cb = tick;
+    d->recv_cb = recv;
+    return d->inner->start(d->inner, msecs, tick_cb, recv_cb);
+}
+
+static void io_delay__tick_after(struct raft_io *io, unsigned msecs)
+{
+    struct io_delay *d = io->impl;
+    d->deadline = d->inner->time(d->inner) + msecs;
+    schedule(d);
+}
+
+static void close_cb(struct raft_io *inner)
+{
+    struct io_delay *d = inner->data;
+    struct io_delay__event *event;
+    raft__queue *q;
+
+    /* Release all held events right away, canceling the messages that did not
+     * reach the inner instance. */
+    while (!RAFT__QUEUE_IS_EMPTY(&d->events)) {
+        q = RAFT__QUEUE_HEAD(&d->events);
+        event = RAFT__QUEUE_DATA(q, struct io_delay__event, queue);
+        RAFT__QUEUE_REMOVE(q);
+        release(event);
+    }
+
+    if (d->close_cb != NULL) {
+        d->close_cb(d->io);
+    }
+}
+
+static int io_delay__close(struct raft_io *io, raft_io_close_cb cb)
+{
+    struct io_delay *d = io->impl;
+    d->closing = true;
+    d->close_cb = cb;
+    return d->inner->close(d->inner, close_cb);
+}
+
+static int io_delay__bootstrap(struct raft_io *io,
+                               const struct raft_configuration *conf)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->bootstrap(d->inner, conf);
+}
+
+static int io_delay__set_term(struct raft_io *io, raft_term term)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->set_term(d->inner, term);
+}
+
+static int io_delay__set_vote(struct raft_io *io, unsigned server_id)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->set_vote(d->inner, server_id);
+}
+
+static int io_delay__set_term_and_vote(struct raft_io *io,
+                                       raft_term term,
+                                       unsigned server_id)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->set_term_and_vote(d->inner, term, server_id);
+}
+
+/* Return the number of bytes to transfer for the given message. */
+static size_t message_size(const struct raft_message *message)
+{
+    size_t size = MESSAGE_HEADER_SIZE;
+    unsigned i;
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            for (i = 0; i < message->append_entries.n_entries; i++) {
+                size += message->append_entries.entries[i].buf.len;
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            size += message->install_snapshot.data.len;
+            break;
+        case RAFT_IO_PROPOSE:
+            for (i = 0; i < message->propose.n_entries; i++) {
+                size += message->propose.entries[i].buf.len;
+            }
+            break;
+    }
+
+    return size;
+}
+
+static int io_delay__send(struct raft_io *io,
+                          struct raft_io_send *req,
+                          const struct raft_message *message,
+                          raft_io_send_cb cb)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    struct io_delay__peer *peer;
+    const struct io_delay__link *link;
+    char *address = NULL;
+    int rv;
+
+    peer = get_peer(d, message->server_id);
+    if (peer == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    link = peer->custom ? &peer->link : &d->network;
+
+    event = event_create(d, IO_DELAY__SEND);
+    if (event == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    /* The address might not outlive the message, if the configuration
+     * changes while it's held. */
+    if (message->server_address != NULL) {
+        address = raft_malloc(strlen(message->server_address) + 1);
+        if (address == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_event_alloc;
+        }
+        strcpy(address, message->server_address);
+    }
+
+    req->cb = cb;
+    event->send.req.data = event;
+    event->send.outer = req;
+    event->send.message = *message;
+    event->send.message.server_address = address;
+    event->size = message_size(message);
+    event->time = line_submit(d, link, &peer->line, event->size);
+
+    if (is_due(d, event->time)) {
+        rv = send_submit(event);
+        if (rv != 0) {
+            goto err_after_address_alloc;
+        }
+        return 0;
+    }
+
+    hold(d, event);
+
+    return 0;
+
+err_after_address_alloc:
+    raft_free(address);
+err_after_event_alloc:
+    raft_free(event);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+static void append_cb(void *data, int status)
+{
+    disk_done(data, status);
+}
+
+static int io_delay__append(struct raft_io *io,
+                            const struct raft_entry entries[],
+                            unsigned n,
+                            void *data,
+                            void (*cb)(void *data, int status))
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    unsigned i;
+    int rv;
+
+    event = event_create(d, IO_DELAY__APPEND);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+    event->append.data = data;
+    event->append.cb = cb;
+    for (i = 0; i < n; i++) {
+        event->size += entries[i].buf.len;
+    }
+
+    rv = d->inner->append(d->inner, entries, n, event, append_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+static int io_delay__truncate(struct raft_io *io, raft_index index)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->truncate(d->inner, index);
+}
+
+static int io_delay__replace(struct raft_io *io,
+                             raft_index index,
+                             const struct raft_entry entries[],
+                             unsigned n,
+                             void *data,
+                             void (*cb)(void *data, int status))
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    unsigned i;
+    int rv;
+
+    event = event_create(d, IO_DELAY__APPEND);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+    event->append.data = data;
+    event->append.cb = cb;
+    for (i = 0; i < n; i++) {
+        event->size += entries[i].buf.len;
+    }
+
+    rv = d->inner->replace(d->inner, index, entries, n, event, append_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+static void snapshot_put_cb(struct raft_io_snapshot_put *req, int status)
+{
+    disk_done(req->data, status);
+}
+
+/* Create the event tracking a snapshot write of @size bytes. */
+static struct io_delay__event *snapshot_put_event(
+    struct io_delay *d,
+    struct raft_io_snapshot_put *req,
+    size_t size,
+    raft_io_snapshot_put_cb cb)
+{
+    struct io_delay__event *event;
+    event = event_create(d, IO_DELAY__SNAPSHOT_PUT);
+    if (event == NULL) {
+        return NULL;
+    }
+    req->cb = cb;
+    event->snapshot_put.req.data = event;
+    event->snapshot_put.outer = req;
+    event->size = size;
+    return event;
+}
+
+static int io_delay__snapshot_put(struct raft_io *io,
+                                  struct raft_io_snapshot_put *req,
+                                  const struct raft_snapshot *snapshot,
+                                  raft_io_snapshot_put_cb cb)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    size_t size = 0;
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < snapshot->n_bufs; i++) {
+        size += snapshot->bufs[i].len;
+    }
+
+    event = snapshot_put_event(d, req, size, cb);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    rv = d->inner->snapshot_put(d->inner, &event->snapshot_put.req, snapshot,
+                                snapshot_put_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+static int io_delay__snapshot_get(struct raft_io *io,
+                                  struct raft_io_snapshot_get *req,
+                                  raft_io_snapshot_get_cb cb)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->snapshot_get(d->inner, req, cb);
+}
+
+static int io_delay__read(struct raft_io *io,
+                          struct raft_io_read *req,
+                          raft_index index,
+                          unsigned n,
+                          raft_io_read_cb cb)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->read(d->inner, req, index, n, cb);
+}
+
+static raft_index io_delay__last_readable(struct raft_io *io)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->last_readable(d->inner);
+}
+
+static int io_delay__defer(struct raft_io *io,
+                           struct raft_io_defer *req,
+                           raft_io_defer_cb cb)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->defer(d->inner, req, cb);
+}
+
+static raft_time io_delay__time(struct raft_io *io)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->time(d->inner);
+}
+
+static int io_delay__random(struct raft_io *io, int min, int max)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->random(d->inner, min, max);
+}
+
+static void io_delay__emit(struct raft_io *io,
+                           int level,
+                           const char *format,
+                           ...)
+{
+    struct io_delay *d = io->impl;
+    char buf[EMIT_BUF_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof buf, format, args);
+    va_end(args);
+    d->inner->emit(d->inner, level, "%s", buf);
+}
+
+static void set_meta_cb(struct raft_io_set_meta *req, int status)
+{
+    disk_done(req->data, status);
+}
+
+static int io_delay__set_meta(struct raft_io *io,
+                              struct raft_io_set_meta *req,
+                              raft_term term,
+                              unsigned server_id,
+                              raft_io_set_meta_cb cb)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    int rv;
+
+    event = event_create(d, IO_DELAY__SET_META);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+    req->cb = cb;
+    event->set_meta.req.data = event;
+    event->set_meta.outer = req;
+
+    rv = d->inner->set_meta(d->inner, &event->set_meta.req, term, server_id,
+                            set_meta_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+static int io_delay__snapshot_put_chunk(struct raft_io *io,
+                                        struct raft_io_snapshot_put *req,
+                                        const struct raft_snapshot *snapshot,
+                                        size_t offset,
+                                        const struct raft_buffer *buf,
+                                        bool done,
+                                        raft_io_snapshot_put_cb cb)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    int rv;
+
+    event = snapshot_put_event(d, req, buf->len, cb);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    rv = d->inner->snapshot_put_chunk(d->inner, &event->snapshot_put.req,
+                                      snapshot, offset, buf, done,
+                                      snapshot_put_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+static int io_delay__snapshot_read(struct raft_io *io,
+                                   struct raft_io_snapshot_read *req,
+                                   raft_term term,
+                                   raft_index index,
+                                   size_t offset,
+                                   size_t len,
+                                   raft_io_snapshot_read_cb cb)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->snapshot_read(d->inner, req, term, index, offset, len,
+                                   cb);
+}
+
+static bool io_delay__congested(struct raft_io *io, unsigned id)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->congested(d->inner, id);
+}
+
+static void io_delay__set_recv_batch(struct raft_io *io,
+                                     raft_io_recv_batch_cb cb)
+{
+    struct io_delay *d = io->impl;
+    d->recv_batch_cb = cb;
+    d->inner->set_recv_batch(d->inner, recv_batch_cb);
+}
+
+static void wakeup_cb(struct raft_io *inner)
+{
+    struct io_delay *d = inner->data;
+    d->wakeup_cb(d->io);
+}
+
+static void io_delay__set_wakeup(struct raft_io *io, raft_io_wakeup_cb cb)
+{
+    struct io_delay *d = io->impl;
+    d->wakeup_cb = cb;
+    d->inner->set_wakeup(d->inner, wakeup_cb);
+}
+
+static void io_delay__wakeup(struct raft_io *io)
+{
+    struct io_delay *d = io->impl;
+    d->inner->wakeup(d->inner);
+}
+
+static void io_delay__set_commit(struct raft_io *io, raft_index commit)
+{
+    struct io_delay *d = io->impl;
+    d->inner->set_commit(d->inner, commit);
+}
+
+static raft_index io_delay__load_commit(struct raft_io *io)
+{
+    struct io_delay *d = io->impl;
+    return d->inner->load_commit(d->inner);
+}
+
+static int io_delay__snapshot_put_patch(
+    struct raft_io *io,
+    struct raft_io_snapshot_put *req,
+    const struct raft_snapshot *snapshot,
+    raft_index base,
+    const struct raft_snapshot_patch patches[],
+    unsigned n_patches,
+    size_t size,
+    raft_io_snapshot_put_cb cb)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__event *event;
+    size_t written = 0;
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < n_patches; i++) {
+        written += patches[i].buf.len;
+    }
+
+    event = snapshot_put_event(d, req, written, cb);
+    if (event == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    rv = d->inner->snapshot_put_patch(d->inner, &event->snapshot_put.req,
+                                      snapshot, base, patches, n_patches,
+                                      size, snapshot_put_cb);
+    if (rv != 0) {
+        raft_free(event);
+        return rv;
+    }
+
+    return 0;
+}
+
+int raft_io_delay_init(struct raft_io *io, struct raft_io *inner)
+{
+    struct io_delay *d;
+
+    assert(io != NULL);
+    assert(inner != NULL);
+
+    d = raft_malloc(sizeof *d);
+    if (d == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    d->io = io;
+    d->inner = inner;
+    d->disk.min_latency = 0;
+    d->disk.max_latency = 0;
+    d->disk.bandwidth = 0;
+    d->writes.transfer = 0;
+    d->writes.last = 0;
+    d->network.min_latency = 0;
+    d->network.max_latency = 0;
+    d->network.bandwidth = 0;
+    d->peers = NULL;
+    d->n_peers = 0;
+    RAFT__QUEUE_INIT(&d->events);
+    d->msecs = 0;
+    d->deadline = 0;
+    d->tick_cb = NULL;
+    d->recv_cb = NULL;
+    d->recv_batch_cb = NULL;
+    d->wakeup_cb = NULL;
+    d->close_cb = NULL;
+    d->closing = false;
+
+    inner->data = d;
+
+    /* Optional methods are available only if the inner instance has them.
+     * Broadcasts are not, so that each message is delayed on its own. */
+    io->version = inner->version;
+    io->impl = d;
+    io->log_level = inner->log_level;
+    io->init = io_delay__init;
+    io->load = io_delay__load;
+    io->start = io_delay__start;
+    io->tick_after = has_tick_after(inner) ? io_delay__tick_after : NULL;
+    io->close = io_delay__close;
+    io->bootstrap = io_delay__bootstrap;
+    io->set_term = io_delay__set_term;
+    io->set_vote = io_delay__set_vote;
+    io->set_term_and_vote =
+        inner->set_term_and_vote != NULL ? io_delay__set_term_and_vote : NULL;
+    io->send = io_delay__send;
+    io->append = io_delay__append;
+    io->truncate = io_delay__truncate;
+    io->snapshot_put = io_delay__snapshot_put;
+    io->snapshot_get = io_delay__snapshot_get;
+    io->read = inner->read != NULL ? io_delay__read : NULL;
+    io->last_readable =
+        inner->last_readable != NULL ? io_delay__last_readable : NULL;
+    io->defer = inner->defer != NULL ? io_delay__defer : NULL;
+    io->time = io_delay__time;
+    io->random = io_delay__random;
+    io->emit = io_delay__emit;
+    io->set_meta = inner->set_meta != NULL ? io_delay__set_meta : NULL;
+    io->snapshot_put_chunk =
+        inner->snapshot_put_chunk != NULL ? io_delay__snapshot_put_chunk : NULL;
+    io->snapshot_read =
+        inner->snapshot_read != NULL ? io_delay__snapshot_read : NULL;
+    io->congested = inner->congested != NULL ? io_delay__congested : NULL;
+    io->set_recv_batch =
+        inner->set_recv_batch != NULL ? io_delay__set_recv_batch : NULL;
+    io->set_wakeup = inner->set_wakeup != NULL ? io_delay__set_wakeup : NULL;
+    io->wakeup = inner->wakeup != NULL ? io_delay__wakeup : NULL;
+    io->set_commit = inner->set_commit != NULL ? io_delay__set_commit : NULL;
+    io->load_commit = inner->load_commit != NULL ? io_delay__load_commit : NULL;
+    io->snapshot_put_patch =
+        inner->snapshot_put_patch != NULL ? io_delay__snapshot_put_patch : NULL;
+    io->broadcast = NULL;
+    io->load_async = inner->load_async != NULL ? io_delay__load_async : NULL;
+    io->replace = inner->replace != NULL ? io_delay__replace : NULL;
+
+    return 0;
+}
+
+void raft_io_delay_close(struct raft_io *io)
+{
+    struct io_delay *d = io->impl;
+    assert(RAFT__QUEUE_IS_EMPTY(&d->events));
+    raft_free(d->peers);
+    raft_free(d);
+}
+
+void raft_io_delay_set_disk(struct raft_io *io,
+                            unsigned min,
+                            unsigned max,
+                            unsigned bandwidth)
+{
+    struct io_delay *d = io->impl;
+    assert(min <= max);
+    d->disk.min_latency = min;
+    d->disk.max_latency = max;
+    d->disk.bandwidth = bandwidth;
+}
+
+int raft_io_delay_set_network(struct raft_io *io,
+                              unsigned id,
+                              unsigned min,
+                              unsigned max,
+                              unsigned bandwidth)
+{
+    struct io_delay *d = io->impl;
+    struct io_delay__link *link = &d->network;
+    struct io_delay__peer *peer;
+
+    assert(min <= max);
+
+    if (id != 0) {
+        peer = get_peer(d, id);
+        if (peer == NULL) {
+            return RAFT_ENOMEM;
+        }
+        peer->custom = true;
+        link = &peer->link;
+    }
+
+    link->min_latency = min;
+    link->max_latency = max;
+    link->bandwidth = bandwidth;
+
+    return 0;
+}
@@ -14,28 +14,45 @@
 /* Set to 1 to enable tracing. */
 #if 0
 #define tracef(S, MSG, ...) debugf(S->io, MSG, __VA_ARGS__)
-static const char *message_names[6] = {
-    NULL,           "append entries",      "append entries result",
-    "request vote", "request vote result", "install snapshot"};
+static const char *message_names[13] = {
+    NULL,
+    "append entries",
+    "append entries result",
+    "request vote",
+    "request vote result",
+    "install snapshot",
+    "read index",
+    "read index result",
+    "timeout now",
+    "send snapshot",
+    "send snapshot result",
+    "propose",
+    "propose result"};
 
 #else
 #define tracef(S, MSG, ...)
 #endif
 
-/* Maximum number of messages inflight on the network. This should be enough for
- * testing purposes. */
-#define MAX_TRANSMIT 64
+/* Maximum number of servers that can be reported as congested. */
+#define MAX_CONGESTED 8
 
-/* Maximum number of peer stub instances connected to a certain stub
- * instance. This should be enough for testing purposes. */
-#define MAX_PEERS 8
-
-#define REQUEST \
-    int type;   \
+#define REQUEST                                                 \
+    int type;                                                   \
+    raft_time time; /* Completion time, if in flight on disk */ \
     raft__queue queue
 
 /* Request types. */
-enum { APPEND = 1, SEND, SNAPSHOT_PUT, SNAPSHOT_GET };
+enum {
+    APPEND = 1,
+    SEND,
+    SNAPSHOT_PUT,
+    SNAPSHOT_GET,
+    SNAPSHOT_READ,
+    READ,
+    DEFER,
+    SET_META,
+    LOAD
+};
 
 /* Base type for an asynchronous request submitted to the stub I/o
  * implementation. */
@@ -68,6 +85,14 @@ struct snapshot_put
     REQUEST;
     struct raft_io_snapshot_put *req;
     const struct raft_snapshot *snapshot;
+    bool chunk;                    /* Whether this is a put chunk request */
+    size_t offset;                 /* Offset of the chunk */
+    const struct raft_buffer *buf; /* Chunk data */
+    bool done;                     /* Whether this is the last chunk */
+    bool patch;                    /* Whether this is a put patch request */
+    const struct raft_snapshot_patch *patches; /* Changes to the last one */
+    unsigned n_patches;                        /* Number of changes */
+    size_t size;                               /* Size of the patched data */
 };
 
 /* Pending request to load a snapshot. */
@@ -77,13 +102,56 @@ struct snapshot_get
     struct raft_io_snapshot_get *req;
 };
 
+/* Pending request to load a chunk of a snapshot. */
+struct snapshot_read
+{
+    REQUEST;
+    struct raft_io_snapshot_read *req;
+    raft_term term;
+    raft_index index;
+    size_t offset;
+    size_t len;
+};
+
+/* Pending request to read persisted entries. */
+struct read
+{
+    REQUEST;
+    struct raft_io_read *req;
+    raft_index index;
+    unsigned n;
+};
+
+/* Pending request to run a callback at the end of the loop iteration. */
+struct defer
+{
+    REQUEST;
+    struct raft_io_defer *req;
+};
+
+/* Pending request to persist the term and vote. */
+struct set_meta
+{
+    REQUEST;
+    struct raft_io_set_meta *req;
+    raft_term term;
+    unsigned voted_for;
+};
+
+/* Pending request to load the persisted state. */
+struct load
+{
+    REQUEST;
+    struct raft_io_load *req;
+};
+
 /* Message that has been written to the network and is waiting to be delivered
  * (or discarded) */
 struct transmit
 {
     struct raft_message message; /* Message to deliver */
-    int timer;                   /* Deliver after this n of msecs. */
-    raft__queue queue;
+    raft_time time;              /* Deliver when the stub time reaches this. */
+    unsigned long long seq;      /* Transmit order, to break ties. */
 };
 
 /* Information about a peer server. */
@@ -101,12 +169,14 @@ struct io_stub
     struct raft_io *io; /* I/O object we're implementing */
     raft_time time;     /* Elapsed time since the backend was started. */
 
-    /* Term and vote */
+    /* Term, vote and commit index hint */
     raft_term term;
     unsigned voted_for;
+    raft_index commit;
 
     /* Log */
     struct raft_snapshot *snapshot; /* Latest snapshot */
+    struct raft_buffer partial;     /* Chunks of a snapshot being stored */
     struct raft_entry *entries;     /* Array or persisted entries */
     size_t n;                       /* Size of the persisted entries array */
 
@@ -116,6 +186,10 @@ struct io_stub
     raft_io_tick_cb tick_cb;
     raft_io_recv_cb recv_cb;
 
+    /* Set via raft_io->set_wakeup, and whether raft_io->wakeup was called. */
+    raft_io_wakeup_cb wakeup_cb;
+    bool woken;
+
     /* Queue of pending asynchronous requests, whose callbacks still haven't
      * been fired. */
     raft__queue requests;
@@ -124,14 +198,24 @@ struct io_stub
     unsigned n_send;         /* Number of pending send message requests */
     unsigned n_snapshot_put; /* Number of pending snapshot put requests */
     unsigned n_snapshot_get; /* Number of pending snapshot get requests */
-
-    /* Queue of messages that have been written to the network, i.e. the
-     * callback of the associated raft_io->send() request has been fired. */
-    raft__queue transmit;
+    unsigned n_read;         /* Number of pending read entries requests */
+    unsigned n_defer;        /* Number of pending defer requests */
+    unsigned n_set_meta;     /* Number of pending set meta requests */
+    unsigned n_load;         /* Number of pending load requests */
+    unsigned n_broadcast;    /* Number of raft_io->broadcast() calls */
+    unsigned n_replace;      /* Number of raft_io->replace() calls */
+
+    /* Messages that have been written to the network, i.e. the callback of
+     * the associated raft_io->send() request has been fired. They are kept in
+     * a binary min-heap ordered by delivery time, so the next message to be
+     * delivered is always the first one. */
+    struct transmit **transmit;
     unsigned n_transmit;
+    unsigned transmit_cap;
+    unsigned long long transmit_seq;
 
     /* Peers connected to us. */
-    struct peer peers[MAX_PEERS];
+    struct peer *peers;
     unsigned n_peers;
 
     /* Minimum and maximum values for the random latency assigned to messages in
@@ -141,6 +225,22 @@ struct io_stub
     unsigned min_latency;
     unsigned max_latency;
 
+    /* Model of the disk used by append and snapshot put requests, enabled
+     * when the queue depth is not zero. Once flushed, the data of a request is
+     * stored immediately, but its callback is fired only when the stub time
+     * reaches the completion time of its write. */
+    struct
+    {
+        unsigned min_latency; /* Minimum sync latency, in milliseconds */
+        unsigned max_latency; /* Maximum sync latency, in milliseconds */
+        unsigned bandwidth;   /* Bytes per second, or zero if unlimited */
+        unsigned depth;       /* Maximum number of writes in flight */
+        raft_time *slots;     /* Time each slot gets free, in microseconds */
+        raft_time transfer;   /* Time the last transfer ends, in microseconds */
+        raft_time last;       /* Completion time of the last write */
+        raft__queue writes;   /* Writes in flight, by completion time */
+    } disk;
+
     int (*random)(int, int); /* Random integer generator */
 
     struct
@@ -150,6 +250,10 @@ struct io_stub
     } fault;
 
     bool drop[5];
+
+    /* IDs of the servers reported as congested. */
+    unsigned congested[MAX_CONGESTED];
+    unsigned n_congested;
 };
 
 /**
@@ -222,7 +326,87 @@ static int io_stub__start(struct raft_io *io,
     return 0;
 }
 
-static void drop_transmit(struct io_stub *s, struct transmit *transmit)
+/* Return true if @t1 must be delivered before @t2. */
+static bool transmit_before(const struct transmit *t1,
+                            const struct transmit *t2)
+{
+    if (t1->time != t2->time) {
+        return t1->time < t2->time;
+    }
+    return t1->seq < t2->seq;
+}
+
+/* Add a message to the transmit heap. */
+static void transmit_push(struct io_stub *s, struct transmit *transmit)
+{
+    unsigned i;
+
+    if (s->n_transmit == s->transmit_cap) {
+        unsigned cap = s->transmit_cap == 0 ? 16 : s->transmit_cap * 2;
+        struct transmit **heap;
+        heap = raft_realloc(s->transmit, cap * sizeof *heap);
+        assert(heap != NULL);
+        s->transmit = heap;
+        s->transmit_cap = cap;
+    }
+
+    transmit->seq = s->transmit_seq++;
+
+    /* Sift the new message up to its position. */
+    i = s->n_transmit;
+    while (i > 0) {
+        unsigned parent = (i - 1) / 2;
+        if (!transmit_before(transmit, s->transmit[parent])) {
+            break;
+        }
+        s->transmit[i] = s->transmit[parent];
+        i = parent;
+    }
+    s->transmit[i] = transmit;
+    s->n_transmit++;
+}
+
+/* Remove and return the first message of the transmit heap. */
+static struct transmit *transmit_pop(struct io_stub *s)
+{
+    struct transmit *first;
+    struct transmit *last;
+    unsigned n;
+    unsigned i;
+
+    assert(s->n_transmit > 0);
+
+    first = s->transmit[0];
+    s->n_transmit--;
+    n = s->n_transmit;
+    if (n == 0) {
+        return first;
+    }
+
+    /* Sift the last message down from the root. */
+    last = s->transmit[n];
+    i = 0;
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            transmit_before(s->transmit[child + 1], s->transmit[child])) {
+            child++;
+        }
+        if (!transmit_before(s->transmit[child], last)) {
+            break;
+        }
+        s->transmit[i] = s->transmit[child];
+        i = child;
+    }
+    s->transmit[i] = last;
+
+    return first;
+}
+
+static void drop_transmit(struct transmit *transmit)
 {
     struct raft_message *message;
     message = &transmit->message;
@@ -238,27 +422,25 @@ static void drop_transmit(struct io_stub *s, struct transmit *transmit)
             raft_configuration_close(&message->install_snapshot.conf);
             raft_free(message->install_snapshot.data.base);
             break;
+        case RAFT_IO_PROPOSE:
+            raft_free(message->propose.entries[0].batch);
+            raft_free(message->propose.entries);
+            break;
     }
 
     raft_free(transmit);
-    s->n_transmit--;
 }
 
 /* Drop all messages in the transmit queue. */
 static void drop_all_transmit(struct io_stub *s)
 {
-    while (!RAFT__QUEUE_IS_EMPTY(&s->transmit)) {
-        raft__queue *head;
-        struct transmit *transmit;
-
-        head = RAFT__QUEUE_HEAD(&s->transmit);
-        RAFT__QUEUE_REMOVE(head);
-        transmit = RAFT__QUEUE_DATA(head, struct transmit, queue);
-        drop_transmit(s, transmit);
+    while (s->n_transmit > 0) {
+        drop_transmit(transmit_pop(s));
     }
-    assert(s->n_transmit == 0);
 }
 
+static void io_stub__disk_done(struct io_stub *s, struct request *r);
+
 static int io_stub__close(struct raft_io *io, void (*cb)(struct raft_io *io))
 {
     struct io_stub *s;
@@ -268,6 +450,12 @@ static int io_stub__close(struct raft_io *io, void (*cb)(struct raft_io *io))
 
     raft_io_stub_flush_all(io);
 
+    /* Complete the writes still in flight. */
+    while (!RAFT__QUEUE_IS_EMPTY(&s->disk.writes)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&s->disk.writes);
+        io_stub__disk_done(s, RAFT__QUEUE_DATA(head, struct request, queue));
+    }
+
     for (i = 0; i < s->n; i++) {
         struct raft_entry *entry = &s->entries[i];
         raft_free(entry->buf.base);
@@ -284,6 +472,10 @@ static int io_stub__close(struct raft_io *io, void (*cb)(struct raft_io *io))
         raft_free(s->snapshot);
     }
 
+    if (s->partial.base != NULL) {
+        raft_free(s->partial.base);
+    }
+
     if (cb != NULL) {
         cb(io);
     }
@@ -303,6 +495,7 @@ static void snapshot_copy(const struct raft_snapshot *s1,
 
     s2->term = s1->term;
     s2->index = s1->index;
+    s2->configuration_index = s1->configuration_index;
 
     rv = configuration__copy(&s1->configuration, &s2->configuration);
     assert(rv == 0);
@@ -315,14 +508,16 @@ static void snapshot_copy(const struct raft_snapshot *s1,
     s2->bufs = raft_malloc(sizeof *s2->bufs);
     assert(s2->bufs != NULL);
 
-    s2->bufs[0].base = raft_malloc(size);
+    s2->bufs[0].base = raft_malloc(size > 0 ? size : 1);
     s2->bufs[0].len = size;
     assert(s2->bufs[0].base != NULL);
 
     cursor = s2->bufs[0].base;
 
     for (i = 0; i < s1->n_bufs; i++) {
-        memcpy(cursor, s1->bufs[i].base, s1->bufs[i].len);
+        if (s1->bufs[i].len > 0) {
+            memcpy(cursor, s1->bufs[i].base, s1->bufs[i].len);
+        }
         cursor += s1->bufs[i].len;
     }
 
@@ -373,7 +568,7 @@ static int io_stub__load(struct raft_io *io,
         size += s->entries[i].buf.len;
     }
 
-    batch = raft_malloc(size);
+    batch = raft_malloc(size > 0 ? size : 1);
     if (batch == NULL) {
         rv = RAFT_ENOMEM;
         goto err_after_entries_alloc;
@@ -383,7 +578,9 @@ static int io_stub__load(struct raft_io *io,
 
     for (i = 0; i < s->n; i++) {
         struct raft_entry *entry = &(*entries)[i];
-        memcpy(cursor, s->entries[i].buf.base, s->entries[i].buf.len);
+        if (s->entries[i].buf.len > 0) {
+            memcpy(cursor, s->entries[i].buf.base, s->entries[i].buf.len);
+        }
 
         entry->term = s->entries[i].term;
         entry->type = s->entries[i].type;
@@ -413,6 +610,30 @@ err:
     return rv;
 }
 
+static int io_stub__load_async(struct raft_io *io,
+                               struct raft_io_load *req,
+                               raft_io_load_batch_cb batch,
+                               raft_io_load_cb cb)
+{
+    struct io_stub *s;
+    struct load *r;
+
+    s = io->impl;
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = LOAD;
+    r->req = req;
+    r->req->batch = batch;
+    r->req->cb = cb;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_load++;
+
+    return 0;
+}
+
 static int io_stub__bootstrap(struct raft_io *io,
                               const struct raft_configuration *conf)
 {
@@ -491,14 +712,11 @@ static int io_stub__set_vote(struct raft_io *io, const unsigned server_id)
     return 0;
 }
 
-static int io_stub__append(struct raft_io *io,
-                           const struct raft_entry entries[],
-                           unsigned n,
-                           void *data,
-                           void (*cb)(void *data, int status))
+static int io_stub__set_term_and_vote(struct raft_io *io,
+                                      const raft_term term,
+                                      const unsigned server_id)
 {
     struct io_stub *s;
-    struct append *r;
 
     s = io->impl;
 
@@ -506,6 +724,65 @@ static int io_stub__append(struct raft_io *io,
         return RAFT_ERR_IO;
     }
 
+    s->term = term;
+    s->voted_for = server_id;
+
+    return 0;
+}
+
+static void io_stub__set_commit(struct raft_io *io, raft_index commit)
+{
+    struct io_stub *s;
+    s = io->impl;
+    s->commit = commit;
+}
+
+static raft_index io_stub__load_commit(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+    return s->commit;
+}
+
+static int io_stub__set_meta(struct raft_io *io,
+                             struct raft_io_set_meta *req,
+                             const raft_term term,
+                             const unsigned server_id,
+                             raft_io_set_meta_cb cb)
+{
+    struct io_stub *s;
+    struct set_meta *r;
+
+    s = io->impl;
+
+    if (io_stub__fault_tick(s)) {
+        return RAFT_ERR_IO;
+    }
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = SET_META;
+    r->req = req;
+    r->req->cb = cb;
+    r->term = term;
+    r->voted_for = server_id;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_set_meta++;
+
+    return 0;
+}
+
+/* Queue a request to append the given entries. */
+static void push_append(struct io_stub *s,
+                        const struct raft_entry entries[],
+                        unsigned n,
+                        void *data,
+                        void (*cb)(void *data, int status))
+{
+    struct append *r;
+
     r = raft_malloc(sizeof *r);
     assert(r != NULL);
 
@@ -518,29 +795,41 @@ static int io_stub__append(struct raft_io *io,
     RAFT__QUEUE_PUSH(&s->requests, &r->queue);
 
     s->n_append++;
+}
+
+static int io_stub__append(struct raft_io *io,
+                           const struct raft_entry entries[],
+                           unsigned n,
+                           void *data,
+                           void (*cb)(void *data, int status))
+{
+    struct io_stub *s;
+
+    s = io->impl;
+
+    if (io_stub__fault_tick(s)) {
+        return RAFT_ERR_IO;
+    }
+
+    push_append(s, entries, n, data, cb);
 
     return 0;
 }
 
-static int io_stub__truncate(struct raft_io *io, raft_index index)
+/* Discard all entries from the given index onwards. */
+static int truncate_entries(struct io_stub *s, raft_index index)
 {
-    struct io_stub *s;
     size_t n;
     raft_index start_index;
 
-    s = io->impl;
-
     if (s->snapshot == NULL) {
         start_index = 1;
     } else {
         start_index = s->snapshot->index;
     }
 
-    assert(index >= start_index);
-
-    if (io_stub__fault_tick(s)) {
-        return RAFT_ERR_IO;
-    }
+    /* Followers installing a snapshot discard their whole log. */
+    assert(index == 1 || index >= start_index);
 
     n = index - 1; /* Number of entries left after truncation */
 
@@ -580,6 +869,46 @@ static int io_stub__truncate(struct raft_io *io, raft_index index)
     return 0;
 }
 
+static int io_stub__truncate(struct raft_io *io, raft_index index)
+{
+    struct io_stub *s;
+
+    s = io->impl;
+
+    if (io_stub__fault_tick(s)) {
+        return RAFT_ERR_IO;
+    }
+
+    return truncate_entries(s, index);
+}
+
+static int io_stub__replace(struct raft_io *io,
+                            raft_index index,
+                            const struct raft_entry entries[],
+                            unsigned n,
+                            void *data,
+                            void (*cb)(void *data, int status))
+{
+    struct io_stub *s;
+    int rv;
+
+    s = io->impl;
+
+    if (io_stub__fault_tick(s)) {
+        return RAFT_ERR_IO;
+    }
+
+    rv = truncate_entries(s, index);
+    if (rv != 0) {
+        return rv;
+    }
+
+    push_append(s, entries, n, data, cb);
+    s->n_replace++;
+
+    return 0;
+}
+
 static int io_stub__snapshot_put(struct raft_io *io,
                                  struct raft_io_snapshot_put *req,
                                  const struct raft_snapshot *snapshot,
@@ -598,6 +927,76 @@ static int io_stub__snapshot_put(struct raft_io *io,
     r->req = req;
     r->req->cb = cb;
     r->snapshot = snapshot;
+    r->chunk = false;
+    r->patch = false;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_snapshot_put++;
+
+    return 0;
+}
+
+static int io_stub__snapshot_put_chunk(struct raft_io *io,
+                                       struct raft_io_snapshot_put *req,
+                                       const struct raft_snapshot *snapshot,
+                                       size_t offset,
+                                       const struct raft_buffer *buf,
+                                       bool done,
+                                       raft_io_snapshot_put_cb cb)
+{
+    struct io_stub *s;
+    struct snapshot_put *r;
+    s = io->impl;
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = SNAPSHOT_PUT;
+    r->req = req;
+    r->req->cb = cb;
+    r->snapshot = snapshot;
+    r->chunk = true;
+    r->offset = offset;
+    r->buf = buf;
+    r->done = done;
+    r->patch = false;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_snapshot_put++;
+
+    return 0;
+}
+
+static int io_stub__snapshot_put_patch(
+    struct raft_io *io,
+    struct raft_io_snapshot_put *req,
+    const struct raft_snapshot *snapshot,
+    raft_index base,
+    const struct raft_snapshot_patch patches[],
+    unsigned n_patches,
+    size_t size,
+    raft_io_snapshot_put_cb cb)
+{
+    struct io_stub *s;
+    struct snapshot_put *r;
+    s = io->impl;
+
+    assert(s->n_snapshot_put == 0);
+    assert(s->snapshot != NULL && s->snapshot->index == base);
+    (void)base;
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = SNAPSHOT_PUT;
+    r->req = req;
+    r->req->cb = cb;
+    r->snapshot = snapshot;
+    r->chunk = false;
+    r->patch = true;
+    r->patches = patches;
+    r->n_patches = n_patches;
+    r->size = size;
 
     RAFT__QUEUE_PUSH(&s->requests, &r->queue);
     s->n_snapshot_put++;
@@ -628,42 +1027,160 @@ static int io_stub__snapshot_get(struct raft_io *io,
     return 0;
 }
 
-static raft_time io_stub__time(struct raft_io *io)
+static void io_stub__set_wakeup(struct raft_io *io, raft_io_wakeup_cb cb)
 {
     struct io_stub *s;
     s = io->impl;
-
-    return s->time;
+    s->wakeup_cb = cb;
 }
 
-static int io_stub__random(struct raft_io *io, int min, int max)
+static void io_stub__wakeup(struct raft_io *io)
 {
     struct io_stub *s;
     s = io->impl;
-
-    return s->random(min, max);
+    __atomic_store_n(&s->woken, true, __ATOMIC_RELEASE);
 }
 
-static void io_stub__emit(struct raft_io *io,
-                          int level,
-                          const char *format,
-                          ...)
+static bool io_stub__congested(struct raft_io *io, unsigned id)
 {
     struct io_stub *s;
-    va_list args;
-    va_start(args, format);
+    unsigned i;
     s = io->impl;
-    emit_to_stream(stderr, s->id, s->time, level, format, args);
-    va_end(args);
+    for (i = 0; i < s->n_congested; i++) {
+        if (s->congested[i] == id) {
+            return true;
+        }
+    }
+    return false;
 }
 
-/**
- * Queue up a request which will be processed later, when io_stub_flush()
- * is invoked.
- */
-static int io_stub__send(struct raft_io *io,
-                         struct raft_io_send *req,
-                         const struct raft_message *message,
+static int io_stub__snapshot_read(struct raft_io *io,
+                                  struct raft_io_snapshot_read *req,
+                                  raft_term term,
+                                  raft_index index,
+                                  size_t offset,
+                                  size_t len,
+                                  raft_io_snapshot_read_cb cb)
+{
+    struct io_stub *s;
+    struct snapshot_read *r;
+    s = io->impl;
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = SNAPSHOT_READ;
+    r->req = req;
+    r->req->cb = cb;
+    r->term = term;
+    r->index = index;
+    r->offset = offset;
+    r->len = len;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_snapshot_get++;
+
+    return 0;
+}
+
+static int io_stub__read(struct raft_io *io,
+                         struct raft_io_read *req,
+                         raft_index index,
+                         unsigned n,
+                         raft_io_read_cb cb)
+{
+    struct io_stub *s;
+    struct read *r;
+    s = io->impl;
+
+    assert(index > 0);
+    assert(n > 0);
+
+    if (io_stub__fault_tick(s)) {
+        return RAFT_ERR_IO;
+    }
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = READ;
+    r->req = req;
+    r->req->cb = cb;
+    r->index = index;
+    r->n = n;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_read++;
+
+    return 0;
+}
+
+static raft_index io_stub__last_readable(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+
+    /* Persisted entries always start at index 1. */
+    return s->n;
+}
+
+static int io_stub__defer(struct raft_io *io,
+                          struct raft_io_defer *req,
+                          raft_io_defer_cb cb)
+{
+    struct io_stub *s;
+    struct defer *r;
+    s = io->impl;
+
+    r = raft_malloc(sizeof *r);
+    assert(r != NULL);
+
+    r->type = DEFER;
+    r->req = req;
+    r->req->cb = cb;
+
+    RAFT__QUEUE_PUSH(&s->requests, &r->queue);
+    s->n_defer++;
+
+    return 0;
+}
+
+static raft_time io_stub__time(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+
+    return s->time;
+}
+
+static int io_stub__random(struct raft_io *io, int min, int max)
+{
+    struct io_stub *s;
+    s = io->impl;
+
+    return s->random(min, max);
+}
+
+static void io_stub__emit(struct raft_io *io,
+                          int level,
+                          const char *format,
+                          ...)
+{
+    struct io_stub *s;
+    va_list args;
+    va_start(args, format);
+    s = io->impl;
+    emit_to_stream(stderr, s->id, s->time, level, format, args);
+    va_end(args);
+}
+
+/**
+ * Queue up a request which will be processed later, when io_stub_flush()
+ * is invoked.
+ */
+static int io_stub__send(struct raft_io *io,
+                         struct raft_io_send *req,
+                         const struct raft_message *message,
                          raft_io_send_cb cb)
 {
     struct io_stub *s;
@@ -689,6 +1206,33 @@ static int io_stub__send(struct raft_io *io,
     return 0;
 }
 
+static int io_stub__broadcast(struct raft_io *io,
+                              struct raft_io_send *reqs[],
+                              const struct raft_message messages[],
+                              unsigned n,
+                              int statuses[],
+                              raft_io_send_cb cb)
+{
+    struct io_stub *s;
+    unsigned i;
+    int rv = 0;
+
+    s = io->impl;
+    s->n_broadcast++;
+
+    for (i = 0; i < n; i++) {
+        assert(messages[i].type == RAFT_IO_APPEND_ENTRIES);
+        assert(messages[i].append_entries.n_entries ==
+               messages[0].append_entries.n_entries);
+        statuses[i] = io_stub__send(io, reqs[i], &messages[i], cb);
+        if (statuses[i] != 0 && rv == 0) {
+            rv = statuses[i];
+        }
+    }
+
+    return rv;
+}
+
 static int default_random(int min, int max)
 {
     assert(min < max);
@@ -710,7 +1254,10 @@ int raft_io_stub_init(struct raft_io *io)
     s->time = 0;
     s->term = 0;
     s->voted_for = 0;
+    s->commit = 0;
     s->snapshot = NULL;
+    s->partial.base = NULL;
+    s->partial.len = 0;
     s->entries = NULL;
     s->n = 0;
 
@@ -718,17 +1265,35 @@ int raft_io_stub_init(struct raft_io *io)
 
     s->n_append = 0;
     s->n_send = 0;
+    s->n_broadcast = 0;
+    s->n_replace = 0;
     s->n_snapshot_put = 0;
     s->n_snapshot_get = 0;
+    s->n_read = 0;
+    s->n_defer = 0;
+    s->n_set_meta = 0;
+    s->n_load = 0;
 
-    RAFT__QUEUE_INIT(&s->transmit);
+    s->transmit = NULL;
     s->n_transmit = 0;
+    s->transmit_cap = 0;
+    s->transmit_seq = 0;
 
+    s->peers = NULL;
     s->n_peers = 0;
 
     s->min_latency = 0;
     s->max_latency = 0;
 
+    s->disk.min_latency = 0;
+    s->disk.max_latency = 0;
+    s->disk.bandwidth = 0;
+    s->disk.depth = 0;
+    s->disk.slots = NULL;
+    s->disk.transfer = 0;
+    s->disk.last = 0;
+    RAFT__QUEUE_INIT(&s->disk.writes);
+
     s->random = default_random;
 
     s->fault.countdown = -1;
@@ -736,53 +1301,86 @@ int raft_io_stub_init(struct raft_io *io)
 
     memset(s->drop, 0, sizeof s->drop);
 
+    s->n_congested = 0;
+    s->wakeup_cb = NULL;
+    s->woken = false;
+
     io->impl = s;
+    io->log_level = RAFT_DEBUG;
     io->init = io_stub__init;
     io->start = io_stub__start;
+    io->tick_after = NULL;
     io->close = io_stub__close;
     io->load = io_stub__load;
     io->bootstrap = io_stub__bootstrap;
     io->set_term = io_stub__set_term;
     io->set_vote = io_stub__set_vote;
+    io->set_term_and_vote = io_stub__set_term_and_vote;
     io->append = io_stub__append;
     io->truncate = io_stub__truncate;
     io->send = io_stub__send;
     io->snapshot_put = io_stub__snapshot_put;
     io->snapshot_get = io_stub__snapshot_get;
+    io->snapshot_put_chunk = io_stub__snapshot_put_chunk;
+    io->snapshot_read = io_stub__snapshot_read;
+    io->read = io_stub__read;
+    io->last_readable = io_stub__last_readable;
+    io->defer = io_stub__defer;
     io->time = io_stub__time;
     io->random = io_stub__random;
     io->emit = io_stub__emit;
+    io->set_meta = io_stub__set_meta;
+    io->congested = io_stub__congested;
+    io->set_recv_batch = NULL;
+    io->set_wakeup = io_stub__set_wakeup;
+    io->wakeup = io_stub__wakeup;
+    io->set_commit = io_stub__set_commit;
+    io->load_commit = io_stub__load_commit;
+    io->snapshot_put_patch = io_stub__snapshot_put_patch;
+    io->broadcast = io_stub__broadcast;
+    io->load_async = io_stub__load_async;
+    io->replace = io_stub__replace;
+
+    /* Asynchronous metadata writes, chunked snapshot writes and reads,
+     * congestion reports, wakeups, commit index hints, patched snapshots,
+     * broadcasts, asynchronous loads, replacements, reads of persisted
+     * entries, deferred work, tick deadlines and single term and vote writes
+     * are opt-in, by bumping the version. */
+    io->version = 1;
 
     return 0;
 }
 
 void raft_io_stub_close(struct raft_io *io)
 {
-    raft_free(io->impl);
+    struct io_stub *s;
+    s = io->impl;
+    raft_free(s->transmit);
+    raft_free(s->peers);
+    raft_free(s->disk.slots);
+    raft_free(s);
 }
 
+static struct peer *get_peer(struct io_stub *s, unsigned id);
+
 static void deliver_transmit(struct io_stub *s, struct transmit *transmit)
 {
     struct raft_message *message = &transmit->message;
-    unsigned i;
+    struct peer *peer;
 
     /* If this message type is in the drop list, let's discard it */
     if (s->drop[message->type - 1]) {
-        drop_transmit(s, transmit);
+        drop_transmit(transmit);
         return;
     }
 
     /* Search for the destination server. */
-    for (i = 0; i < s->n_peers; i++) {
-        if (s->peers[i].s->id == message->server_id) {
-            break;
-        }
-    }
+    peer = get_peer(s, message->server_id);
 
     /* We don't have any peer with this ID or if the peers is disconnect, let's
      * drop the message */
-    if (i == s->n_peers || !s->peers[i].connected) {
-        drop_transmit(s, transmit);
+    if (peer == NULL || !peer->connected) {
+        drop_transmit(transmit);
         return;
     }
 
@@ -790,45 +1388,27 @@ static void deliver_transmit(struct io_stub *s, struct transmit *transmit)
     message->server_id = s->id;
     message->server_address = s->address;
 
-    raft_io_stub_deliver(s->peers[i].s->io, message);
+    raft_io_stub_deliver(peer->s->io, message);
     raft_free(transmit);
-    s->n_transmit--;
 }
 
-void raft_io_stub_advance(struct raft_io *io, unsigned msecs)
+void raft_io_stub_transmit(struct raft_io *io)
 {
     struct io_stub *s;
-    raft__queue queue;
+    s = io->impl;
+    while (s->n_transmit > 0 && s->transmit[0]->time <= s->time) {
+        deliver_transmit(s, transmit_pop(s));
+    }
+}
 
+void raft_io_stub_advance(struct raft_io *io, unsigned msecs)
+{
+    struct io_stub *s;
     s = io->impl;
     s->time += msecs;
+    raft_io_stub_complete(io);
     s->tick_cb(io);
-
-    /* Deliver or messages whose timer expires */
-    RAFT__QUEUE_INIT(&queue);
-    while (!RAFT__QUEUE_IS_EMPTY(&s->transmit)) {
-        raft__queue *head;
-        struct transmit *transmit;
-
-        head = RAFT__QUEUE_HEAD(&s->transmit);
-        RAFT__QUEUE_REMOVE(head);
-        transmit = RAFT__QUEUE_DATA(head, struct transmit, queue);
-
-        transmit->timer -= msecs;
-
-        if (transmit->timer <= 0) {
-            deliver_transmit(s, transmit);
-        } else {
-            RAFT__QUEUE_PUSH(&queue, &transmit->queue);
-        }
-    }
-
-    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
-        raft__queue *head;
-        head = RAFT__QUEUE_HEAD(&queue);
-        RAFT__QUEUE_REMOVE(head);
-        RAFT__QUEUE_PUSH(&s->transmit, head);
-    }
+    raft_io_stub_transmit(io);
 }
 
 void raft_io_stub_set_time(struct raft_io *io, unsigned time)
@@ -856,6 +1436,32 @@ void raft_io_stub_set_latency(struct raft_io *io, unsigned min, unsigned max)
     s->max_latency = max;
 }
 
+void raft_io_stub_set_disk(struct raft_io *io,
+                           unsigned min,
+                           unsigned max,
+                           unsigned bandwidth,
+                           unsigned depth)
+{
+    struct io_stub *s;
+    unsigned i;
+    s = io->impl;
+    assert(min <= max);
+    assert(RAFT__QUEUE_IS_EMPTY(&s->disk.writes));
+    s->disk.min_latency = min;
+    s->disk.max_latency = max;
+    s->disk.bandwidth = bandwidth;
+    s->disk.depth = depth;
+    raft_free(s->disk.slots);
+    s->disk.slots = NULL;
+    if (depth > 0) {
+        s->disk.slots = raft_malloc(depth * sizeof *s->disk.slots);
+        assert(s->disk.slots != NULL);
+        for (i = 0; i < depth; i++) {
+            s->disk.slots[i] = 0;
+        }
+    }
+}
+
 void raft_io_stub_set_term(struct raft_io *io, raft_term term) {
     struct io_stub *s;
     s = io->impl;
@@ -880,6 +1486,20 @@ void raft_io_stub_set_entries(struct raft_io *io,
     s->n = n;
 }
 
+/**
+ * Return a copy of the data of the given buffer. Empty buffers, such as the
+ * payloads of entries sent to witnesses, get a valid pointer too.
+ */
+static void *io_stub__dup(const struct raft_buffer *buf)
+{
+    void *base = raft_malloc(buf->len > 0 ? buf->len : 1);
+    assert(base != NULL);
+    if (buf->len > 0) {
+        memcpy(base, buf->base, buf->len);
+    }
+    return base;
+}
+
 /**
  * Copy all entries in @src into @dst.
  */
@@ -903,7 +1523,7 @@ static void io_stub__copy_entries(const struct raft_entry *src,
         size += src[i].buf.len;
     }
 
-    batch = raft_malloc(size);
+    batch = raft_malloc(size > 0 ? size : 1);
     assert(batch != NULL);
 
     /* Copy the entries. */
@@ -916,7 +1536,9 @@ static void io_stub__copy_entries(const struct raft_entry *src,
         (*dst)[i] = src[i];
 
         (*dst)[i].buf.base = cursor;
-        memcpy((*dst)[i].buf.base, src[i].buf.base, src[i].buf.len);
+        if (src[i].buf.len > 0) {
+            memcpy((*dst)[i].buf.base, src[i].buf.base, src[i].buf.len);
+        }
 
         (*dst)[i].batch = batch;
 
@@ -924,9 +1546,81 @@ static void io_stub__copy_entries(const struct raft_entry *src,
     }
 }
 
+/* Submit a write of the given size to the disk model and return its
+ * completion time.
+ *
+ * The write waits for the least busy of the queue depth slots, then for the
+ * transfer of the previous writes, which share the bandwidth, and finally for
+ * a random sync latency. Writes complete in submission order, since the sync
+ * of a write also covers all the writes submitted before it. */
+static raft_time io_stub__disk_submit(struct io_stub *s, size_t size)
+{
+    raft_time now = s->time * 1000;
+    raft_time start;
+    raft_time end;
+    unsigned latency;
+    unsigned slot = 0;
+    unsigned i;
+
+    for (i = 1; i < s->disk.depth; i++) {
+        if (s->disk.slots[i] < s->disk.slots[slot]) {
+            slot = i;
+        }
+    }
+    start = s->disk.slots[slot] > now ? s->disk.slots[slot] : now;
+
+    if (s->disk.bandwidth != 0) {
+        if (s->disk.transfer > start) {
+            start = s->disk.transfer;
+        }
+        start += (raft_time)size * 1000000 / s->disk.bandwidth;
+        s->disk.transfer = start;
+    }
+
+    latency = s->disk.min_latency;
+    if (s->disk.max_latency > latency) {
+        latency = (unsigned)s->random((int)latency, (int)s->disk.max_latency);
+    }
+    end = start + (raft_time)latency * 1000;
+    s->disk.slots[slot] = end;
+
+    /* Round up to the next millisecond. */
+    end = (end + 999) / 1000;
+    if (end < s->disk.last) {
+        end = s->disk.last;
+    }
+    s->disk.last = end;
+
+    return end;
+}
+
+/* If the disk model is enabled, queue the given flushed request until its
+ * write completes and return true. */
+static bool io_stub__disk_write(struct io_stub *s,
+                                struct request *r,
+                                size_t size)
+{
+    if (s->disk.depth == 0) {
+        return false;
+    }
+    r->time = io_stub__disk_submit(s, size);
+    RAFT__QUEUE_PUSH(&s->disk.writes, &r->queue);
+    return true;
+}
+
+static void io_stub__append_done(struct io_stub *s, struct append *append)
+{
+    s->n_append--;
+    if (append->cb != NULL) {
+        append->cb(append->data, 0);
+    }
+    raft_free(append);
+}
+
 static void io_stub__flush_append(struct io_stub *s, struct append *append)
 {
     struct raft_entry *entries;
+    size_t size = 0;
     unsigned i;
 
     /* Allocate an array for the old entries plus the new ones. */
@@ -939,20 +1633,17 @@ static void io_stub__flush_append(struct io_stub *s, struct append *append)
         struct raft_entry *entry = &entries[s->n + i];
 
         /* Make a copy of the actual entry data. */
-        entry->buf.base = raft_malloc(entry->buf.len);
-        assert(entry->buf.base != NULL);
-        memcpy(entry->buf.base, append->entries[i].buf.base, entry->buf.len);
+        entry->buf.base = io_stub__dup(&append->entries[i].buf);
+        size += entry->buf.len;
     }
 
     s->entries = entries;
     s->n += append->n;
 
-    if (append->cb != NULL) {
-        append->cb(append->data, 0);
+    if (io_stub__disk_write(s, (struct request *)append, size)) {
+        return;
     }
-    free(append);
-
-    s->n_append--;
+    io_stub__append_done(s, append);
 }
 
 static void io_stub__flush_send(struct io_stub *s, struct send *send)
@@ -965,17 +1656,15 @@ static void io_stub__flush_send(struct io_stub *s, struct send *send)
     transmit = raft_malloc(sizeof *transmit);
     assert(transmit != NULL);
 
+    transmit->time = s->time;
     if (s->min_latency != 0) {
-        transmit->timer = s->random(s->min_latency, s->max_latency);
-    } else {
-        transmit->timer = 0;
+        transmit->time += s->random(s->min_latency, s->max_latency);
     }
 
     src = &send->message;
     dst = &transmit->message;
 
-    RAFT__QUEUE_PUSH(&s->transmit, &transmit->queue);
-    s->n_transmit++;
+    transmit_push(s, transmit);
 
     *dst = *src;
 
@@ -991,13 +1680,13 @@ static void io_stub__flush_send(struct io_stub *s, struct send *send)
             raft_configuration_init(&dst->install_snapshot.conf);
             rv = configuration__copy(&src->install_snapshot.conf,
                                      &dst->install_snapshot.conf);
-            dst->install_snapshot.data.base =
-                raft_malloc(dst->install_snapshot.data.len);
-            assert(dst->install_snapshot.data.base != NULL);
             assert(rv == 0);
-            memcpy(dst->install_snapshot.data.base,
-                   src->install_snapshot.data.base,
-                   src->install_snapshot.data.len);
+            dst->install_snapshot.data.base =
+                io_stub__dup(&src->install_snapshot.data);
+            break;
+        case RAFT_IO_PROPOSE:
+            io_stub__copy_entries(src->propose.entries, &dst->propose.entries,
+                                  src->propose.n_entries);
             break;
     }
 
@@ -1011,9 +1700,96 @@ static void io_stub__flush_send(struct io_stub *s, struct send *send)
     s->n_send--;
 }
 
+/* Add the chunk of the given request to the partial snapshot, returning true
+ * if the snapshot is now complete. */
+static bool io_stub__flush_snapshot_chunk(struct io_stub *s,
+                                          struct snapshot_put *r)
+{
+    size_t len = r->offset + r->buf->len;
+
+    if (r->offset == 0 && s->partial.base != NULL) {
+        raft_free(s->partial.base);
+        s->partial.base = NULL;
+        s->partial.len = 0;
+    }
+
+    assert(r->offset == s->partial.len);
+    s->partial.base = raft_realloc(s->partial.base, len);
+    assert(s->partial.base != NULL);
+    memcpy((char *)s->partial.base + r->offset, r->buf->base, r->buf->len);
+    s->partial.len = len;
+
+    return r->done;
+}
+
+static void io_stub__snapshot_put_done(struct io_stub *s,
+                                      struct snapshot_put *r)
+{
+    s->n_snapshot_put--;
+    if (r->req->cb != NULL) {
+        r->req->cb(r->req, 0);
+    }
+    raft_free(r);
+}
+
+/* Apply the patches of the given request to the data of the last snapshot,
+ * returning the new data. */
+static struct raft_buffer io_stub__patch_snapshot(struct io_stub *s,
+                                                  struct snapshot_put *r)
+{
+    struct raft_buffer buf;
+    const struct raft_snapshot_patch *patch;
+    size_t len = s->snapshot->bufs[0].len;
+    unsigned i;
+
+    buf.len = r->size;
+    buf.base = raft_calloc(1, buf.len > 0 ? buf.len : 1);
+    assert(buf.base != NULL);
+    memcpy(buf.base, s->snapshot->bufs[0].base, len < buf.len ? len : buf.len);
+
+    for (i = 0; i < r->n_patches; i++) {
+        patch = &r->patches[i];
+        assert(patch->offset + patch->buf.len <= buf.len);
+        memcpy((char *)buf.base + patch->offset, patch->buf.base,
+               patch->buf.len);
+    }
+
+    return buf;
+}
+
 static void io_stub__flush_snapshot_put(struct io_stub *s,
                                         struct snapshot_put *r)
 {
+    struct raft_snapshot snapshot;
+    struct raft_buffer patched;
+    size_t size = 0;
+    unsigned i;
+
+    if (r->chunk) {
+        size = r->buf->len;
+    } else if (r->patch) {
+        for (i = 0; i < r->n_patches; i++) {
+            size += r->patches[i].buf.len;
+        }
+        patched = io_stub__patch_snapshot(s, r);
+        snapshot = *r->snapshot;
+        snapshot.bufs = &patched;
+        snapshot.n_bufs = 1;
+    } else {
+        for (i = 0; i < r->snapshot->n_bufs; i++) {
+            size += r->snapshot->bufs[i].len;
+        }
+    }
+
+    if (r->chunk) {
+        if (!io_stub__flush_snapshot_chunk(s, r)) {
+            goto out;
+        }
+        snapshot = *r->snapshot;
+        snapshot.bufs = &s->partial;
+        snapshot.n_bufs = 1;
+    }
+
     if (s->snapshot == NULL) {
         s->snapshot = raft_malloc(sizeof *s->snapshot);
         assert(s->snapshot != NULL);
@@ -1021,13 +1797,24 @@ static void io_stub__flush_snapshot_put(struct io_stub *s,
         snapshot__close(s->snapshot);
     }
 
-    snapshot_copy(r->snapshot, s->snapshot);
+    snapshot_copy(r->chunk || r->patch ? &snapshot : r->snapshot,
+                  s->snapshot);
 
-    if (r->req->cb != NULL) {
-        r->req->cb(r->req, 0);
+    if (r->patch) {
+        raft_free(patched.base);
     }
-    raft_free(r);
-    s->n_snapshot_put--;
+
+    if (r->chunk) {
+        raft_free(s->partial.base);
+        s->partial.base = NULL;
+        s->partial.len = 0;
+    }
+
+out:
+    if (io_stub__disk_write(s, (struct request *)r, size)) {
+        return;
+    }
+    io_stub__snapshot_put_done(s, r);
 }
 
 static void io_stub__flush_snapshot_get(struct io_stub *s,
@@ -1041,6 +1828,123 @@ static void io_stub__flush_snapshot_get(struct io_stub *s,
     s->n_snapshot_get--;
 }
 
+static void io_stub__flush_snapshot_read(struct io_stub *s,
+                                         struct snapshot_read *r)
+{
+    struct raft_snapshot *snapshot;
+    struct raft_snapshot chunk;
+    struct raft_buffer buf;
+    size_t size;
+
+    s->n_snapshot_get--;
+
+    if (s->snapshot == NULL ||
+        (r->index != 0 &&
+         (s->snapshot->term != r->term || s->snapshot->index != r->index))) {
+        r->req->cb(r->req, NULL, 0, RAFT_ERR_IO);
+        raft_free(r);
+        return;
+    }
+
+    assert(s->snapshot->n_bufs == 1);
+    size = s->snapshot->bufs[0].len;
+    assert(r->offset <= size);
+
+    buf.base = (char *)s->snapshot->bufs[0].base + r->offset;
+    buf.len = size - r->offset;
+    if (buf.len > r->len) {
+        buf.len = r->len;
+    }
+
+    chunk = *s->snapshot;
+    chunk.bufs = &buf;
+    chunk.n_bufs = 1;
+
+    snapshot = raft_malloc(sizeof *snapshot);
+    assert(snapshot != NULL);
+    snapshot_copy(&chunk, snapshot);
+    r->req->cb(r->req, snapshot, size, 0);
+    raft_free(r);
+}
+
+static void io_stub__flush_read(struct io_stub *s, struct read *r)
+{
+    struct raft_entry *entries = NULL;
+    unsigned n = 0;
+
+    /* Persisted entries always start at index 1. */
+    if (r->index <= s->n) {
+        n = r->n;
+        if (r->index - 1 + n > s->n) {
+            n = (unsigned)(s->n - (r->index - 1));
+        }
+        io_stub__copy_entries(&s->entries[r->index - 1], &entries, n);
+    }
+
+    r->req->cb(r->req, entries, n, 0);
+    raft_free(r);
+    s->n_read--;
+}
+
+static void io_stub__flush_defer(struct io_stub *s, struct defer *r)
+{
+    r->req->cb(r->req);
+    raft_free(r);
+    s->n_defer--;
+}
+
+static void io_stub__flush_set_meta(struct io_stub *s, struct set_meta *r)
+{
+    /* A synchronous term change might have happened in the meantime, in that
+     * case don't regress it. */
+    if (r->term >= s->term) {
+        s->term = r->term;
+        s->voted_for = r->voted_for;
+    }
+    r->req->cb(r->req, 0);
+    raft_free(r);
+    s->n_set_meta--;
+}
+
+/* Stream the loaded entries one per batch, each with its own buffer. */
+static void io_stub__flush_load(struct io_stub *s, struct load *r)
+{
+    struct raft_io_load *req = r->req;
+    struct raft_entry *entries;
+    size_t n;
+    size_t i;
+    int rv;
+
+    s->n_load--;
+    rv = io_stub__load(s->io, &req->term, &req->voted_for, &req->snapshot,
+                       &entries, &n);
+    if (rv != 0) {
+        req->snapshot = NULL;
+        goto out;
+    }
+
+    for (i = 0; i < n && rv == 0; i++) {
+        struct raft_entry *entry = raft_malloc(sizeof *entry);
+        assert(entry != NULL);
+        *entry = entries[i];
+        entry->batch = raft_malloc(entry->buf.len > 0 ? entry->buf.len : 1);
+        assert(entry->batch != NULL);
+        if (entry->buf.len > 0) {
+            memcpy(entry->batch, entries[i].buf.base, entry->buf.len);
+        }
+        entry->buf.base = entry->batch;
+        rv = req->batch(req, entry, 1);
+    }
+    if (n > 0) {
+        raft_free(entries[0].batch);
+        raft_free(entries);
+    }
+
+out:
+    raft_free(r);
+    req->cb(req, rv);
+}
+
 bool raft_io_stub_flush(struct raft_io *io)
 {
     struct io_stub *s;
@@ -1066,6 +1970,21 @@ bool raft_io_stub_flush(struct raft_io *io)
         case SNAPSHOT_GET:
             io_stub__flush_snapshot_get(s, (struct snapshot_get *)r);
             break;
+        case SNAPSHOT_READ:
+            io_stub__flush_snapshot_read(s, (struct snapshot_read *)r);
+            break;
+        case READ:
+            io_stub__flush_read(s, (struct read *)r);
+            break;
+        case DEFER:
+            io_stub__flush_defer(s, (struct defer *)r);
+            break;
+        case SET_META:
+            io_stub__flush_set_meta(s, (struct set_meta *)r);
+            break;
+        case LOAD:
+            io_stub__flush_load(s, (struct load *)r);
+            break;
     }
 
     return !RAFT__QUEUE_IS_EMPTY(&s->requests);
@@ -1080,10 +1999,63 @@ void raft_io_stub_flush_all(struct raft_io *io)
         raft_io_stub_flush(io);
     };
 
+    /* Writes in flight on the disk model complete later. */
+    if (!RAFT__QUEUE_IS_EMPTY(&s->disk.writes)) {
+        return;
+    }
+
     assert(s->n_append == 0);
     assert(s->n_send == 0);
     assert(s->n_snapshot_put == 0);
     assert(s->n_snapshot_get == 0);
+    assert(s->n_read == 0);
+    assert(s->n_defer == 0);
+    assert(s->n_set_meta == 0);
+    assert(s->n_load == 0);
+}
+
+/* Fire the callback of a disk write that has completed. */
+static void io_stub__disk_done(struct io_stub *s, struct request *r)
+{
+    RAFT__QUEUE_REMOVE(&r->queue);
+    switch (r->type) {
+        case APPEND:
+            io_stub__append_done(s, (struct append *)r);
+            break;
+        case SNAPSHOT_PUT:
+            io_stub__snapshot_put_done(s, (struct snapshot_put *)r);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+void raft_io_stub_complete(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+    while (!RAFT__QUEUE_IS_EMPTY(&s->disk.writes)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&s->disk.writes);
+        struct request *r = RAFT__QUEUE_DATA(head, struct request, queue);
+        if (r->time > s->time) {
+            break;
+        }
+        io_stub__disk_done(s, r);
+    }
+}
+
+int raft_io_stub_next_complete_timeout(struct raft_io *io)
+{
+    struct io_stub *s;
+    raft__queue *head;
+    struct request *r;
+    s = io->impl;
+    if (RAFT__QUEUE_IS_EMPTY(&s->disk.writes)) {
+        return -1;
+    }
+    head = RAFT__QUEUE_HEAD(&s->disk.writes);
+    r = RAFT__QUEUE_DATA(head, struct request, queue);
+    return r->time > s->time ? (int)(r->time - s->time) : 0;
 }
 
 unsigned raft_io_stub_n_appending(struct raft_io *io)
@@ -1142,6 +2114,20 @@ unsigned raft_io_stub_n_sending(struct raft_io *io)
     return s->n_send;
 }
 
+unsigned raft_io_stub_n_broadcasts(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+    return s->n_broadcast;
+}
+
+unsigned raft_io_stub_n_replaces(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+    return s->n_replace;
+}
+
 void raft_io_stub_sending(struct raft_io *io,
                           unsigned i,
                           struct raft_message **message)
@@ -1162,20 +2148,13 @@ void raft_io_stub_sending(struct raft_io *io,
 int raft_io_stub_next_deliver_timeout(struct raft_io *io)
 {
     struct io_stub *s;
-    int lowest_timer = -1;
-    raft__queue *head;
+    struct transmit *first;
     s = io->impl;
-    RAFT__QUEUE_FOREACH(head, &s->transmit)
-    {
-        struct transmit *t = RAFT__QUEUE_DATA(head, struct transmit, queue);
-        if (lowest_timer == -1) {
-            lowest_timer = t->timer;
-        } else if (t->timer < lowest_timer) {
-            lowest_timer = t->timer;
-        }
+    if (s->n_transmit == 0) {
+        return -1;
     }
-    assert(lowest_timer == -1 || lowest_timer >= 0);
-    return lowest_timer;
+    first = s->transmit[0];
+    return first->time > s->time ? (int)(first->time - s->time) : 0;
 }
 
 void raft_io_stub_deliver(struct raft_io *io, struct raft_message *message)
@@ -1211,22 +2190,38 @@ void raft_io_stub_connect(struct raft_io *io, struct raft_io *other)
 {
     struct io_stub *s;
     struct io_stub *s_other;
+    struct peer *peers;
+    unsigned i;
     s = io->impl;
     s_other = other->impl;
-    assert(s->n_peers < MAX_PEERS);
-    s->peers[s->n_peers].s = s_other;
-    s->peers[s->n_peers].connected = true;
+    peers = raft_realloc(s->peers, (s->n_peers + 1) * sizeof *peers);
+    assert(peers != NULL);
+    s->peers = peers;
+
+    /* Keep the peers sorted by ID, so they can be looked up quickly. */
+    for (i = s->n_peers; i > 0 && s->peers[i - 1].s->id > s_other->id; i--) {
+        s->peers[i] = s->peers[i - 1];
+    }
+    s->peers[i].s = s_other;
+    s->peers[i].connected = true;
     s->n_peers++;
 }
 
 static struct peer *get_peer(struct io_stub *s, unsigned id)
 {
-    unsigned i;
-    for (i = 0; i < s->n_peers; i++) {
+    unsigned low = 0;
+    unsigned high = s->n_peers;
+    while (low < high) {
+        unsigned i = low + (high - low) / 2;
         struct peer *peer = &s->peers[i];
         if (peer->s->id == id) {
             return peer;
         }
+        if (peer->s->id < id) {
+            low = i + 1;
+        } else {
+            high = i;
+        }
     }
     return NULL;
 }
@@ -1270,3 +2265,36 @@ void raft_io_stub_drop(struct raft_io *io, int type, bool flag)
     s = io->impl;
     s->drop[type - 1] = flag;
 }
+
+void raft_io_stub_congest(struct raft_io *io, unsigned id, bool flag)
+{
+    struct io_stub *s;
+    unsigned i;
+    s = io->impl;
+    for (i = 0; i < s->n_congested; i++) {
+        if (s->congested[i] == id) {
+            break;
+        }
+    }
+    if (flag && i == s->n_congested) {
+        assert(s->n_congested < MAX_CONGESTED);
+        s->congested[s->n_congested] = id;
+        s->n_congested++;
+    } else if (!flag && i < s->n_congested) {
+        s->n_congested--;
+        s->congested[i] = s->congested[s->n_congested];
+    }
+}
+
+bool raft_io_stub_wakeup(struct raft_io *io)
+{
+    struct io_stub *s;
+    s = io->impl;
+    if (!__atomic_exchange_n(&s->woken, false, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    if (s->wakeup_cb != NULL) {
+        s->wakeup_cb(io);
+    }
+    return true;
+}
@@ -10,16 +10,105 @@
 #include "assert.h"
 #include "byte.h"
 #include "configuration.h"
+#include "entry.h"
 #include "io_uv.h"
 #include "io_uv_encoding.h"
 #include "io_uv_fs.h"
 #include "io_uv_load.h"
 #include "logging.h"
+#include "pool.h"
 
-/* Retry to connect to peer servers every second.
- *
- * TODO: implement an exponential backoff instead.  */
-#define IO_UV__CONNECT_RETRY_DELAY 1000
+/* Loop statistics of the given kind of stall. */
+static struct raft_io_uv_latency *stall_latency(struct io_uv *uv, int kind)
+{
+    struct raft_io_uv_loop_stats *loop = &uv->stats.loop;
+    switch (kind) {
+        case RAFT_IO_UV_STALL_TICK:
+            return &loop->tick;
+        case RAFT_IO_UV_STALL_RECV:
+            return &loop->recv;
+        case RAFT_IO_UV_STALL_APPEND:
+            return &loop->append;
+        case RAFT_IO_UV_STALL_DEFER:
+            return &loop->defer;
+        default:
+            return &loop->busy;
+    }
+}
+
+uint64_t io_uv__stall_start(struct io_uv *uv)
+{
+    return uv->stall_threshold > 0 ? uv_hrtime() : 0;
+}
+
+void io_uv__stall_end(struct io_uv *uv, int kind, uint64_t start)
+{
+    uint64_t duration;
+
+    if (start == 0) {
+        return;
+    }
+
+    duration = uv_hrtime() - start;
+    io_uv__record_latency(stall_latency(uv, kind), duration);
+
+    if (duration / 1000 < uv->stall_threshold) {
+        return;
+    }
+    uv->stats.loop.n_stalls++;
+    if (uv->stall_cb != NULL) {
+        uv->stall_cb(uv->io, kind, duration / 1000);
+    }
+}
+
+/* The loop is about to poll for I/O: the current iteration is over. */
+static void stall_prepare_cb(uv_prepare_t *prepare)
+{
+    struct io_uv *uv = prepare->data;
+    if (uv->stall_poll_end != 0) {
+        io_uv__stall_end(uv, RAFT_IO_UV_STALL_BUSY, uv->stall_poll_end);
+        uv->stall_poll_end = 0;
+    }
+}
+
+/* The loop has polled for I/O and is running check handles. Since the defer
+ * handle might run first, it marks the end of the poll as well. */
+static void stall_poll_done(struct io_uv *uv)
+{
+    if (uv->stall_poll_end == 0) {
+        uv->stall_poll_end = io_uv__stall_start(uv);
+    }
+}
+
+static void stall_check_cb(uv_check_t *check)
+{
+    stall_poll_done(check->data);
+}
+
+/* Start or stop the handles measuring loop iterations, depending on the stall
+ * threshold. They don't keep the loop alive. */
+static void stall_update(struct io_uv *uv)
+{
+    int rv;
+    if (uv->stall_threshold == 0) {
+        uv_prepare_stop(&uv->stall_prepare);
+        uv_check_stop(&uv->stall_check);
+        uv->stall_poll_end = 0;
+        return;
+    }
+    rv = uv_prepare_start(&uv->stall_prepare, stall_prepare_cb);
+    assert(rv == 0);
+    rv = uv_check_start(&uv->stall_check, stall_check_cb);
+    assert(rv == 0);
+}
+
+static void wakeup_cb(uv_async_t *async)
+{
+    struct io_uv *uv = async->data;
+    if (uv->state == IO_UV__ACTIVE && uv->wakeup_cb != NULL) {
+        uv->wakeup_cb(uv->io);
+    }
+}
 
 /* Implementation of raft_io->init. */
 static int io_uv__init(struct raft_io *io, unsigned id, const char *address)
@@ -29,13 +118,40 @@ static int io_uv__init(struct raft_io *io, unsigned id, const char *address)
     uv = io->impl;
     assert(uv->state == 0);
     uv->id = id;
-    rv = uv->transport->init(uv->transport, id, address);
+    rv = io_uv__host_setup(uv->host, id, address);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = io_uv__disk_start(uv);
     if (rv != 0) {
         return rv;
     }
     rv = uv_timer_init(uv->loop, &uv->timer);
     assert(rv == 0); /* This should never fail */
     uv->timer.data = uv;
+    rv = uv_timer_init(uv->loop, &uv->append_timer);
+    assert(rv == 0); /* This should never fail */
+    uv->append_timer.data = uv;
+    rv = uv_check_init(uv->loop, &uv->check);
+    assert(rv == 0); /* This should never fail */
+    uv->check.data = uv;
+    rv = uv_idle_init(uv->loop, &uv->idle);
+    assert(rv == 0); /* This should never fail */
+    uv->idle.data = uv;
+    rv = uv_async_init(uv->loop, &uv->wakeup, wakeup_cb);
+    assert(rv == 0); /* This should never fail */
+    uv->wakeup.data = uv;
+    /* Only wake up a loop that is kept alive by something else. */
+    uv_unref((uv_handle_t *)&uv->wakeup);
+    rv = uv_prepare_init(uv->loop, &uv->stall_prepare);
+    assert(rv == 0); /* This should never fail */
+    uv->stall_prepare.data = uv;
+    uv_unref((uv_handle_t *)&uv->stall_prepare);
+    rv = uv_check_init(uv->loop, &uv->stall_check);
+    assert(rv == 0); /* This should never fail */
+    uv->stall_check.data = uv;
+    uv_unref((uv_handle_t *)&uv->stall_check);
+    stall_update(uv);
     uv->state = IO_UV__ACTIVE;
     return 0;
 }
@@ -44,10 +160,30 @@ static int io_uv__init(struct raft_io *io, unsigned id, const char *address)
 static void timer_cb(uv_timer_t *timer)
 {
     struct io_uv *uv;
+    uint64_t start;
     uv = timer->data;
+    if (uv->state == IO_UV__ACTIVE) {
+        io_uv__prepare_trim(uv);
+    }
     if (uv->tick_cb != NULL) {
+        start = io_uv__stall_start(uv);
         uv->tick_cb(uv->io);
+        io_uv__stall_end(uv, RAFT_IO_UV_STALL_TICK, start);
+    }
+}
+
+/* Implementation of raft_io->tick_after. */
+static void io_uv__tick_after(struct raft_io *io, unsigned msecs)
+{
+    struct io_uv *uv;
+    int rv;
+    uv = io->impl;
+    if (uv->state != IO_UV__ACTIVE) {
+        return;
     }
+    /* Replace the periodic timer with a one-shot one. */
+    rv = uv_timer_start(&uv->timer, timer_cb, msecs, 0);
+    assert(rv == 0);
 }
 
 /* Implementation of raft_io->start. */
@@ -62,7 +198,7 @@ static int io_uv__start(struct raft_io *io,
     assert(uv->state == IO_UV__ACTIVE);
     uv->tick_cb = tick_cb;
     uv->recv_cb = recv_cb;
-    rv = io_uv__listen(uv);
+    rv = io_uv__host_listen(uv->host);
     if (rv != 0) {
         return rv;
     }
@@ -71,15 +207,48 @@ static int io_uv__start(struct raft_io *io,
     return 0;
 }
 
+/* Implementation of raft_io->set_recv_batch. */
+static void io_uv__set_recv_batch(struct raft_io *io, raft_io_recv_batch_cb cb)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->recv_batch_cb = cb;
+}
+
+/* Implementation of raft_io->set_wakeup. */
+static void io_uv__set_wakeup(struct raft_io *io, raft_io_wakeup_cb cb)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->wakeup_cb = cb;
+}
+
+/* Implementation of raft_io->wakeup. */
+static void io_uv__wakeup(struct raft_io *io)
+{
+    struct io_uv *uv;
+    int rv;
+    uv = io->impl;
+    rv = uv_async_send(&uv->wakeup);
+    assert(rv == 0);
+}
+
 static bool has_pending_disk_io(struct io_uv *uv)
 {
     return !RAFT__QUEUE_IS_EMPTY(&uv->append_segments) ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->append_syncing_reqs) ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->append_round_reqs) ||
            !RAFT__QUEUE_IS_EMPTY(&uv->finalize_reqs) ||
            uv->finalize_work.data != NULL ||
            !RAFT__QUEUE_IS_EMPTY(&uv->truncate_reqs) ||
            uv->truncate_work.data != NULL ||
            !RAFT__QUEUE_IS_EMPTY(&uv->snapshot_put_reqs) ||
-           !RAFT__QUEUE_IS_EMPTY(&uv->snapshot_get_reqs);
+           uv->compact_work.data != NULL ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->snapshot_get_reqs) ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->read_reqs) ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->read_waiting_reqs) ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->set_meta_reqs) ||
+           uv->set_meta_work.data != NULL || uv->load != NULL;
 }
 
 void io_uv__maybe_close(struct io_uv *uv)
@@ -95,31 +264,144 @@ void io_uv__maybe_close(struct io_uv *uv)
 
     assert(uv->state == IO_UV__CLOSING);
 
-    if (has_pending_disk_io(uv)) {
+    if (!uv->stopped) {
+        return;
+    }
+
+    if (has_pending_disk_io(uv) || uv->n_sending > 0) {
         return;
     }
 
+    /* No more disk work can be queued, let the disk threads exit. */
+    if (uv->disk_state != IO_UV__CLOSED) {
+        if (uv->disk_state == IO_UV__ACTIVE) {
+            io_uv__disk_stop(uv);
+        }
+        return;
+    }
+
+    /* If we own our host, wait for it to be closed too. */
+    if (uv->host == &uv->own_host && uv->own_host.state != IO_UV__CLOSED) {
+        return;
+    }
+
+    pool__close(&uv->send_pool);
+    pool__close(&uv->append_pool);
+    io_uv__arena_close(uv);
+
     uv->state = IO_UV__CLOSED;
     if (uv->close_cb != NULL) {
         uv->close_cb(uv->io);
     }
 }
 
-static void transport_close_cb(struct raft_io_uv_transport *t)
+static void own_host_close_cb(struct io_uv__host *h)
 {
-    struct io_uv *uv = t->data;
+    struct io_uv *uv = h->data;
     io_uv__maybe_close(uv);
 }
 
-static void timer_close_cb(uv_handle_t *handle)
+/* Pending raft_io->defer request. */
+struct defer
+{
+    struct raft_io_defer *req;
+    raft__queue queue;
+};
+
+/* Keep the loop from blocking for I/O while deferred requests are pending. */
+static void idle_cb(uv_idle_t *idle)
+{
+    (void)idle;
+}
+
+/* Fire the deferred requests submitted before the current loop iteration
+ * completed. Requests submitted by the callbacks themselves wait for the next
+ * iteration, which is not allowed to block waiting for I/O. */
+static void check_cb(uv_check_t *check)
+{
+    struct io_uv *uv = check->data;
+    raft__queue *head;
+    unsigned n = 0;
+
+    stall_poll_done(uv);
+
+    RAFT__QUEUE_FOREACH(head, &uv->defer_reqs)
+    {
+        n++;
+    }
+
+    for (; n > 0; n--) {
+        struct defer *d;
+        struct raft_io_defer *req;
+        head = RAFT__QUEUE_HEAD(&uv->defer_reqs);
+        d = RAFT__QUEUE_DATA(head, struct defer, queue);
+        req = d->req;
+        uint64_t start;
+        RAFT__QUEUE_REMOVE(head);
+        raft_free(d);
+        start = io_uv__stall_start(uv);
+        req->cb(req);
+        io_uv__stall_end(uv, RAFT_IO_UV_STALL_DEFER, start);
+    }
+
+    if (RAFT__QUEUE_IS_EMPTY(&uv->defer_reqs)) {
+        uv_check_stop(check);
+        uv_idle_stop(&uv->idle);
+        return;
+    }
+
+    uv_idle_start(&uv->idle, idle_cb);
+}
+
+/* Implementation of raft_io->defer. */
+static int io_uv__defer(struct raft_io *io,
+                        struct raft_io_defer *req,
+                        raft_io_defer_cb cb)
+{
+    struct io_uv *uv;
+    struct defer *d;
+    int rv;
+    uv = io->impl;
+    assert(uv->state == IO_UV__ACTIVE);
+
+    d = raft_malloc(sizeof *d);
+    if (d == NULL) {
+        return RAFT_ENOMEM;
+    }
+    d->req = req;
+    req->cb = cb;
+
+    if (RAFT__QUEUE_IS_EMPTY(&uv->defer_reqs)) {
+        rv = uv_check_start(&uv->check, check_cb);
+        assert(rv == 0);
+    }
+    RAFT__QUEUE_PUSH(&uv->defer_reqs, &d->queue);
+
+    return 0;
+}
+
+/* Invoked once the tick timer, the append timer, the check and idle handles,
+ * the wakeup handle or the stall detector handles are closed. When all of them
+ * are, stop the sub-systems. */
+static void handle_close_cb(uv_handle_t *handle)
 {
     struct io_uv *uv = handle->data;
-    io_uv__clients_stop(uv);
-    io_uv__servers_stop(uv);
+    assert(uv->n_closing > 0);
+    uv->n_closing--;
+    if (uv->n_closing > 0) {
+        return;
+    }
+    io_uv__clients_cancel(uv);
     io_uv__prepare_stop(uv);
     io_uv__append_stop(uv);
     io_uv__truncate_stop(uv);
-    uv->transport->close(uv->transport, transport_close_cb);
+    io_uv__read_unblock(uv);
+    uv->stopped = true;
+    if (uv->host == &uv->own_host) {
+        io_uv__host_close(uv->host, own_host_close_cb);
+        return;
+    }
+    io_uv__maybe_close(uv);
 }
 
 /* Implementation of raft_io->close. */
@@ -131,10 +413,42 @@ static int io_uv__close(struct raft_io *io, void (*cb)(struct raft_io *io))
     assert(uv->state == IO_UV__ACTIVE);
     uv->close_cb = cb;
     uv->state = IO_UV__CLOSING;
+    /* Write the latest commit index hint, so that after a clean restart the
+     * committed entries can be applied right away. This is best-effort. */
+    if (uv->metadata.commit > 0) {
+        uv_mutex_lock(&uv->metadata_mutex);
+        uv->metadata.version++;
+        rv = io_uv__metadata_store(io, uv->metadata_dir, &uv->metadata);
+        uv_mutex_unlock(&uv->metadata_mutex);
+        if (rv != 0) {
+            warnf(io, "persist commit index: %s", raft_strerror(rv));
+        }
+    }
+    /* Stop receiving messages for our group. */
+    io_uv__host_remove(uv->host, uv);
     rv = uv_timer_stop(&uv->timer);
     assert(rv == 0);
-    /* Start the shutdown sequence by closing the timer handle. */
-    uv_close((uv_handle_t *)&uv->timer, timer_close_cb);
+    rv = uv_timer_stop(&uv->append_timer);
+    assert(rv == 0);
+    /* Drop any pending defer request, their callbacks won't be fired. */
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->defer_reqs)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->defer_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        raft_free(RAFT__QUEUE_DATA(head, struct defer, queue));
+    }
+    uv_check_stop(&uv->check);
+    uv_idle_stop(&uv->idle);
+    uv_prepare_stop(&uv->stall_prepare);
+    uv_check_stop(&uv->stall_check);
+    /* Start the shutdown sequence by closing our handles. */
+    uv->n_closing = 7;
+    uv_close((uv_handle_t *)&uv->timer, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->append_timer, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->check, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->idle, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->wakeup, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->stall_prepare, handle_close_cb);
+    uv_close((uv_handle_t *)&uv->stall_check, handle_close_cb);
     return 0;
 }
 
@@ -158,18 +472,27 @@ static int io_uv__load(struct raft_io *io,
     *voted_for = uv->metadata.voted_for;
     *snapshot = NULL;
 
+    rv = io_uv__truncate_recover(uv);
+    if (rv != 0) {
+        return rv;
+    }
+
     rv = io_uv__load_all(uv, snapshot, entries, n_entries);
     if (rv != 0) {
         return rv;
     }
 
+    io_uv__prepare_adopt(uv);
+
     if (*snapshot != NULL) {
         start_index = (*snapshot)->index + 1;
     }
     last_index = start_index + *n_entries - 1;
 
-    /* Set the index of the last entry that was persisted. */
+    /* Set the index of the last entry that was persisted. Open segments have
+     * been closed by the load, so all entries can be read back. */
     uv->finalize_last_index = last_index;
+    uv->finalize_done_index = last_index;
 
     /* Set the index of the next entry that will be appended. */
     uv->append_next_index = last_index + 1;
@@ -177,6 +500,135 @@ static int io_uv__load(struct raft_io *io,
     return 0;
 }
 
+/* Pending raft_io->load_async request, proceeding a few segments at a time in
+ * a disk thread. */
+struct io_uv__load
+{
+    struct io_uv *uv;
+    struct raft_io_load *req;
+    struct io_uv__load_cursor cursor;
+    bool begun;                 /* Whether the directory was listed */
+    struct raft_entry *entries; /* Entries loaded by the last step */
+    size_t n;                   /* Number of entries loaded by it */
+    struct io_uv__work work;
+    int status;
+};
+
+static void load_work_cb(struct io_uv__work *work)
+{
+    struct io_uv__load *l = work->data;
+    struct io_uv *uv = l->uv;
+    int rv;
+
+    if (!l->begun) {
+        rv = io_uv__truncate_recover(uv);
+        if (rv != 0) {
+            goto err;
+        }
+        rv = io_uv__load_begin(uv, &l->cursor, &l->req->snapshot);
+        if (rv != 0) {
+            goto err;
+        }
+        l->begun = true;
+    }
+
+    rv = io_uv__load_next(uv, &l->cursor, IO_UV__LOAD_STEP_SEGMENTS,
+                          &l->entries, &l->n);
+    if (rv != 0) {
+        goto err;
+    }
+
+    l->status = 0;
+    return;
+
+err:
+    l->status = rv;
+}
+
+static void load_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct io_uv__load *l = work->data;
+    struct io_uv *uv = l->uv;
+    struct raft_io_load *req = l->req;
+    raft_index last_index;
+    assert(status == 0);
+
+    status = l->status;
+
+    /* Stop streaming if we're being closed. */
+    if (status == 0 && uv->state != IO_UV__ACTIVE) {
+        entry_batches__destroy(l->entries, (unsigned)l->n);
+        status = RAFT_ERR_IO_CANCELED;
+    }
+
+    /* The batch callback takes ownership of the entries in any case. */
+    if (status == 0 && l->n > 0) {
+        status = req->batch(req, l->entries, l->n);
+    }
+    l->entries = NULL;
+    l->n = 0;
+
+    if (status == 0 && l->cursor.next < l->cursor.n_segments) {
+        io_uv__queue_work(uv, &l->work, load_work_cb, load_after_work_cb);
+        return;
+    }
+
+    if (status == 0) {
+        io_uv__prepare_adopt(uv);
+        last_index = l->cursor.next_index - 1;
+        uv->finalize_last_index = last_index;
+        uv->finalize_done_index = last_index;
+        uv->append_next_index = last_index + 1;
+    }
+
+    io_uv__load_end(&l->cursor);
+    uv->load = NULL;
+    raft_free(l);
+
+    req->cb(req, status);
+
+    io_uv__maybe_close(uv);
+}
+
+/* Implementation of raft_io->load_async. */
+static int io_uv__load_async(struct raft_io *io,
+                             struct raft_io_load *req,
+                             raft_io_load_batch_cb batch,
+                             raft_io_load_cb cb)
+{
+    struct io_uv *uv;
+    struct io_uv__load *l;
+
+    uv = io->impl;
+    assert(uv->state == IO_UV__ACTIVE);
+    assert(uv->metadata.version > 0);
+    assert(uv->load == NULL);
+
+    l = raft_malloc(sizeof *l);
+    if (l == NULL) {
+        return RAFT_ENOMEM;
+    }
+    l->uv = uv;
+    l->req = req;
+    l->begun = false;
+    l->entries = NULL;
+    l->n = 0;
+    l->cursor.segments = NULL;
+    l->work.data = l;
+    l->status = 0;
+
+    req->term = uv->metadata.term;
+    req->voted_for = uv->metadata.voted_for;
+    req->snapshot = NULL;
+    req->batch = batch;
+    req->cb = cb;
+
+    uv->load = l;
+    io_uv__queue_work(uv, &l->work, load_work_cb, load_after_work_cb);
+
+    return 0;
+}
+
 static int io_uv__bootstrap(struct raft_io *io,
                             const struct raft_configuration *conf);
 
@@ -186,35 +638,173 @@ static int io_uv__set_term(struct raft_io *io, const raft_term term)
     struct io_uv *uv;
     int rv;
     uv = io->impl;
+    uv_mutex_lock(&uv->metadata_mutex);
     assert(uv->metadata.version > 0);
     uv->metadata.version++;
     uv->metadata.term = term;
     uv->metadata.voted_for = 0;
-    rv = io_uv__metadata_store(uv->io, uv->dir, &uv->metadata);
+    rv = io_uv__metadata_store(uv->io, uv->metadata_dir, &uv->metadata);
+    uv_mutex_unlock(&uv->metadata_mutex);
     if (rv != 0) {
         return rv;
     }
     return 0;
 }
 
-/* Implementation of raft_io->set_term. */
+/* Implementation of raft_io->set_vote. */
 static int io_uv__set_vote(struct raft_io *io, const unsigned server_id)
 {
     struct io_uv *uv;
     int rv;
     uv = io->impl;
+    uv_mutex_lock(&uv->metadata_mutex);
+    assert(uv->metadata.version > 0);
+    uv->metadata.version++;
+    uv->metadata.voted_for = server_id;
+    rv = io_uv__metadata_store(uv->io, uv->metadata_dir, &uv->metadata);
+    uv_mutex_unlock(&uv->metadata_mutex);
+    if (rv != 0) {
+        return rv;
+    }
+    return 0;
+}
+
+/* Implementation of raft_io->set_term_and_vote. Both changes are written to
+ * the same metadata file, so they cost a single fsync. */
+static int io_uv__set_term_and_vote(struct raft_io *io,
+                                    const raft_term term,
+                                    const unsigned server_id)
+{
+    struct io_uv *uv;
+    int rv;
+    uv = io->impl;
+    uv_mutex_lock(&uv->metadata_mutex);
     assert(uv->metadata.version > 0);
     uv->metadata.version++;
+    uv->metadata.term = term;
     uv->metadata.voted_for = server_id;
-    rv = io_uv__metadata_store(uv->io, uv->dir, &uv->metadata);
+    rv = io_uv__metadata_store(uv->io, uv->metadata_dir, &uv->metadata);
+    uv_mutex_unlock(&uv->metadata_mutex);
     if (rv != 0) {
         return rv;
     }
     return 0;
 }
 
-/* Implementation of raft_io->time. */
-static raft_time io_uv__time(struct raft_io *io)
+/* Implementation of raft_io->set_commit. The commit index is only cached, and
+ * gets written along with the next metadata change, or when closing. */
+static void io_uv__set_commit(struct raft_io *io, const raft_index commit)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv_mutex_lock(&uv->metadata_mutex);
+    uv->metadata.commit = commit;
+    uv_mutex_unlock(&uv->metadata_mutex);
+}
+
+/* Implementation of raft_io->load_commit. */
+static raft_index io_uv__load_commit(struct raft_io *io)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    return uv->metadata.commit;
+}
+
+/* Pending request to persist the term and vote, see raft_io->set_meta. */
+struct set_meta
+{
+    struct raft_io_set_meta *req;
+    raft__queue queue;
+};
+
+/* Write the latest metadata to disk. Holding the mutex also prevents a
+ * synchronous setter from writing the same file concurrently. */
+static void set_meta_work_cb(struct io_uv__work *work)
+{
+    struct io_uv *uv = work->data;
+    uv_mutex_lock(&uv->metadata_mutex);
+    uv->metadata.version++;
+    uv->set_meta_status =
+        io_uv__metadata_store(uv->io, uv->metadata_dir, &uv->metadata);
+    uv_mutex_unlock(&uv->metadata_mutex);
+}
+
+static void set_meta_process(struct io_uv *uv);
+
+static void set_meta_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct io_uv *uv = work->data;
+    assert(status == 0);
+    uv->set_meta_work.data = NULL;
+    io_uv__record_latency(&uv->stats.metadata, work->duration);
+
+    /* The write covered all requests that were pending when it started. */
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->set_meta_writing)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->set_meta_writing);
+        struct set_meta *m = RAFT__QUEUE_DATA(head, struct set_meta, queue);
+        RAFT__QUEUE_REMOVE(head);
+        m->req->cb(m->req, uv->set_meta_status);
+        raft_free(m);
+    }
+
+    set_meta_process(uv);
+    io_uv__maybe_close(uv);
+}
+
+/* Start writing the metadata if there are pending requests and no write is in
+ * flight. A single write satisfies all pending requests, since it stores the
+ * latest values. */
+static void set_meta_process(struct io_uv *uv)
+{
+    if (uv->set_meta_work.data != NULL ||
+        RAFT__QUEUE_IS_EMPTY(&uv->set_meta_reqs)) {
+        return;
+    }
+
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->set_meta_reqs)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->set_meta_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&uv->set_meta_writing, head);
+    }
+
+    uv->set_meta_work.data = uv;
+    io_uv__queue_work(uv, &uv->set_meta_work, set_meta_work_cb,
+                      set_meta_after_work_cb);
+}
+
+/* Implementation of raft_io->set_meta. The in-memory cache is updated right
+ * away, and the write happens in a disk thread. */
+static int io_uv__set_meta(struct raft_io *io,
+                           struct raft_io_set_meta *req,
+                           const raft_term term,
+                           const unsigned server_id,
+                           raft_io_set_meta_cb cb)
+{
+    struct io_uv *uv;
+    struct set_meta *m;
+    uv = io->impl;
+    assert(uv->state == IO_UV__ACTIVE);
+
+    m = raft_malloc(sizeof *m);
+    if (m == NULL) {
+        return RAFT_ENOMEM;
+    }
+    m->req = req;
+    req->cb = cb;
+
+    uv_mutex_lock(&uv->metadata_mutex);
+    assert(uv->metadata.version > 0);
+    uv->metadata.term = term;
+    uv->metadata.voted_for = server_id;
+    uv_mutex_unlock(&uv->metadata_mutex);
+
+    RAFT__QUEUE_PUSH(&uv->set_meta_reqs, &m->queue);
+    set_meta_process(uv);
+
+    return 0;
+}
+
+raft_time io_uv__time(struct raft_io *io)
 {
     struct io_uv *uv;
     uv = io->impl;
@@ -267,10 +857,14 @@ static void copy_dir(const char *dir1, char **dir2)
     }
 }
 
-int raft_io_uv_init(struct raft_io *io,
-                    struct uv_loop_s *loop,
-                    const char *dir,
-                    struct raft_io_uv_transport *transport)
+/* Common logic of raft_io_uv_init() and raft_io_uv_init_group(). If @host is
+ * NULL, a dedicated host using @transport is created. */
+static int init(struct raft_io *io,
+                struct uv_loop_s *loop,
+                const char *dir,
+                struct raft_io_uv_transport *transport,
+                struct io_uv__host *host,
+                unsigned group)
 {
     struct io_uv *uv;
     int rv;
@@ -293,37 +887,97 @@ int raft_io_uv_init(struct raft_io *io,
         rv = RAFT_ENOMEM;
         goto err_after_uv_alloc;
     }
-    uv->transport = transport;
-    uv->transport->data = uv;
+    uv->snapshot_dir = uv->dir;
+    uv->metadata_dir = uv->dir;
+    uv->archive_dir = NULL;
+    if (host == NULL) {
+        io_uv__host_init(&uv->own_host, loop, transport);
+        uv->own_host.data = uv;
+        host = &uv->own_host;
+    }
+    uv->host = host;
+    uv->group = group;
     uv->id = 0;
     uv->state = 0;
+    uv->stopped = false;
+    uv->n_closing = 0;
     uv->errored = false;
     uv->block_size = 0; /* Detected in raft_io->init() */
+    uv->async_writes = false;
+    uv->direct_io = true;
     uv->n_blocks = 0;   /* Calculated in raft_io->init() */
-    uv->clients = NULL;
-    uv->n_clients = 0;
-    uv->servers = NULL;
-    uv->n_servers = 0;
-    uv->connect_retry_delay = IO_UV__CONNECT_RETRY_DELAY;
+    uv->n_sending = 0;
+    pool__init(&uv->send_pool);
+    RAFT__QUEUE_INIT(&uv->send_batches);
     uv->preparing = NULL;
+    uv->prepare_pool_size = RAFT_IO_UV_PREPARE_POOL_SIZE;
+    uv->prepare_last_used = 0;
+    uv->prepare_interval = 0;
     RAFT__QUEUE_INIT(&uv->prepare_reqs);
     RAFT__QUEUE_INIT(&uv->prepare_pool);
+    RAFT__QUEUE_INIT(&uv->prepare_recycled);
     uv->prepare_next_counter = 1;
     uv->append_next_index = 1;
     RAFT__QUEUE_INIT(&uv->append_segments);
     RAFT__QUEUE_INIT(&uv->append_pending_reqs);
     RAFT__QUEUE_INIT(&uv->append_writing_reqs);
+    RAFT__QUEUE_INIT(&uv->append_syncing_reqs);
+    RAFT__QUEUE_INIT(&uv->append_round_reqs);
+    RAFT__QUEUE_INIT(&uv->sync_queue);
+    uv->sync_queued = false;
+    uv->sync_dev = 0;
+    uv->sync_status = 0;
+    uv->append_coalesce_delay = 0;
+    uv->append_coalesce_bytes = 0;
+    uv->append_encode_threshold = IO_UV__ENCODE_THRESHOLD;
+    uv->append_write_latency = 0;
+    pool__init(&uv->append_pool);
+    uv->n_arenas = 0;
+    uv->huge_pages = false;
+    memset(&uv->stats, 0, sizeof uv->stats);
+    uv->n_load_threads = IO_UV__LOAD_THREADS;
+    uv->load_mmap = true;
+    uv->format = IO_UV__DISK_FORMAT;
+    uv->load_checksum_time = 0;
     RAFT__QUEUE_INIT(&uv->finalize_reqs);
+    RAFT__QUEUE_INIT(&uv->finalize_batch);
     uv->finalize_last_index = 0;
+    uv->finalize_done_index = 0;
     uv->finalize_work.data = NULL;
     RAFT__QUEUE_INIT(&uv->truncate_reqs);
     uv->truncate_work.data = NULL;
+    uv->truncate_blocking = false;
     RAFT__QUEUE_INIT(&uv->snapshot_put_reqs);
     RAFT__QUEUE_INIT(&uv->snapshot_get_reqs);
     uv->snapshot_put_work.data = NULL;
+    uv->compact_work.data = NULL;
+    uv->compact_pending = false;
+    uv->compact_since = 0;
+    uv->snapshot_part.offset = 0;
+    uv->snapshot_part.valid = false;
+    io_uv__snapshot_checksums_init(&uv->snapshot_part.checksums,
+                                   IO_UV__SNAPSHOT_BLOCK_SIZE);
+    RAFT__QUEUE_INIT(&uv->read_reqs);
+    RAFT__QUEUE_INIT(&uv->read_waiting_reqs);
+    RAFT__QUEUE_INIT(&uv->defer_reqs);
+    RAFT__QUEUE_INIT(&uv->set_meta_reqs);
+    RAFT__QUEUE_INIT(&uv->set_meta_writing);
+    uv->set_meta_work.data = NULL;
+    uv->set_meta_status = 0;
+    uv->load = NULL;
+    uv->n_disk_threads = IO_UV__DISK_THREADS;
+    memset(uv->disk_cpus, 0, sizeof uv->disk_cpus);
+    uv->n_disk_cpus = 0;
+    uv->numa_node = -1;
+    uv->disk_state = 0;
+    uv->disk_exiting = false;
+    RAFT__QUEUE_INIT(&uv->disk_pending);
+    RAFT__QUEUE_INIT(&uv->disk_done);
+    uv->disk_n_inflight = 0;
 
     io->emit = io_uv__emit; /* Used below */
     io->impl = uv;
+    io->log_level = RAFT_DEBUG;
 
     /* Ensure that the data directory exists and is accessible */
     rv = io_uv__ensure_dir(uv->io, uv->dir);
@@ -336,13 +990,15 @@ int raft_io_uv_init(struct raft_io *io,
     if (rv != 0) {
         goto err_after_dir_alloc;
     }
+    rv = uv_mutex_init(&uv->metadata_mutex);
+    assert(rv == 0); /* This should never fail */
 
-    /* Detect the file system block size */
-    rv = uv__file_block_size(uv->dir, &uv->block_size);
+    /* Detect the file system block size, or use the cached one */
+    rv = uv__file_probe(uv->dir, &uv->block_size, &uv->async_writes);
     if (rv != 0) {
         errorf(io, "detect block size: %s", uv_strerror(rv));
         rv = RAFT_ERR_IO;
-        goto err_after_dir_alloc;
+        goto err_after_mutex_init;
     }
 
     /* We expect the maximum segment size to be a multiple of the block size */
@@ -350,26 +1006,63 @@ int raft_io_uv_init(struct raft_io *io,
     uv->n_blocks = RAFT_IO_UV_MAX_SEGMENT_SIZE / uv->block_size;
 
     uv->tick_cb = NULL;
+    uv->recv_cb = NULL;
+    uv->recv_batch_cb = NULL;
+    uv->wakeup_cb = NULL;
+    uv->stall_threshold = 0;
+    uv->stall_cb = NULL;
+    uv->stall_poll_end = 0;
+    uv->record.fd = -1;
+    uv->record.buf = NULL;
+    uv->record.len = 0;
+    uv->record.start = 0;
     uv->close_cb = NULL;
 
+    /* Register the group, so it can receive messages once started. */
+    rv = io_uv__host_add(uv->host, uv);
+    if (rv != 0) {
+        goto err_after_mutex_init;
+    }
+
     /* Set the raft_io implementation. */
     io->init = io_uv__init;
     io->start = io_uv__start;
+    io->tick_after = io_uv__tick_after;
     io->close = io_uv__close;
     io->load = io_uv__load;
     io->bootstrap = io_uv__bootstrap;
     io->set_term = io_uv__set_term;
     io->set_vote = io_uv__set_vote;
+    io->set_term_and_vote = io_uv__set_term_and_vote;
     io->append = io_uv__append;
     io->truncate = io_uv__truncate;
     io->send = io_uv__send;
+    io->broadcast = io_uv__broadcast;
+    io->load_async = io_uv__load_async;
+    io->replace = io_uv__replace;
     io->snapshot_put = io_uv__snapshot_put;
     io->snapshot_get = io_uv__snapshot_get;
+    io->snapshot_put_chunk = io_uv__snapshot_put_chunk;
+    io->snapshot_read = io_uv__snapshot_read;
+    io->read = io_uv__read;
+    io->last_readable = io_uv__last_readable;
+    io->defer = io_uv__defer;
     io->time = io_uv__time;
     io->random = io_uv__random;
+    io->set_meta = io_uv__set_meta;
+    io->congested = io_uv__congested;
+    io->set_recv_batch = io_uv__set_recv_batch;
+    io->set_wakeup = io_uv__set_wakeup;
+    io->wakeup = io_uv__wakeup;
+    io->set_commit = io_uv__set_commit;
+    io->load_commit = io_uv__load_commit;
+    io->snapshot_put_patch = io_uv__snapshot_put_patch;
+    io->version = 16;
 
     return 0;
 
+err_after_mutex_init:
+    uv_mutex_destroy(&uv->metadata_mutex);
 err_after_dir_alloc:
     raft_free(uv->dir);
 err_after_uv_alloc:
@@ -379,20 +1072,337 @@ err:
     return rv;
 }
 
+int raft_io_uv_init(struct raft_io *io,
+                    struct uv_loop_s *loop,
+                    const char *dir,
+                    struct raft_io_uv_transport *transport)
+{
+    return init(io, loop, dir, transport, NULL, 0);
+}
+
+int raft_io_uv_init_group(struct raft_io *io,
+                          struct raft_io_uv_host *host,
+                          const char *dir,
+                          unsigned group)
+{
+    struct io_uv__host *h;
+    assert(host != NULL);
+    h = host->impl;
+    return init(io, h->loop, dir, NULL, h, group);
+}
+
 void raft_io_uv_close(struct raft_io *io)
 {
     struct io_uv *uv;
     uv = io->impl;
-    if (uv->clients != NULL) {
-        raft_free(uv->clients);
+    io_uv__record_stop(uv);
+    io_uv__host_remove(uv->host, uv);
+    if (uv->host == &uv->own_host && uv->own_host.groups != NULL) {
+        /* The dedicated host was never closed. */
+        raft_free(uv->own_host.groups);
+    }
+    uv_mutex_destroy(&uv->metadata_mutex);
+    io_uv__snapshot_checksums_close(&uv->snapshot_part.checksums);
+    if (uv->snapshot_dir != uv->dir) {
+        raft_free(uv->snapshot_dir);
+    }
+    if (uv->metadata_dir != uv->dir) {
+        raft_free(uv->metadata_dir);
     }
-    if (uv->servers != NULL) {
-        raft_free(uv->servers);
+    if (uv->archive_dir != NULL) {
+        raft_free(uv->archive_dir);
     }
     raft_free(uv->dir);
     raft_free(uv);
 }
 
+int raft_io_uv_set_segment_size(struct raft_io *io, size_t size)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (size == 0 || size % uv->block_size != 0) {
+        return RAFT_EINVAL;
+    }
+    if (uv->preparing != NULL || !RAFT__QUEUE_IS_EMPTY(&uv->prepare_pool) ||
+        !RAFT__QUEUE_IS_EMPTY(&uv->append_segments)) {
+        return RAFT_ERR_BUSY;
+    }
+    uv->n_blocks = size / uv->block_size;
+    return 0;
+}
+
+int raft_io_uv_set_prepare_pool_size(struct raft_io *io, unsigned n)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (n == 0) {
+        return RAFT_EINVAL;
+    }
+    uv->prepare_pool_size = n;
+    return 0;
+}
+
+int raft_io_uv_set_disk_threads(struct raft_io *io, unsigned n)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (n == 0 || n > IO_UV__MAX_DISK_THREADS) {
+        return RAFT_EINVAL;
+    }
+    if (uv->disk_state != 0) {
+        return RAFT_ERR_BUSY;
+    }
+    uv->n_disk_threads = n;
+    return 0;
+}
+
+int raft_io_uv_set_disk_cpus(struct raft_io *io,
+                             const unsigned cpus[],
+                             unsigned n)
+{
+    struct io_uv *uv;
+    unsigned i;
+    uv = io->impl;
+    for (i = 0; i < n; i++) {
+        if (cpus[i] >= IO_UV__MAX_CPUS) {
+            return RAFT_EINVAL;
+        }
+    }
+    if (uv->disk_state != 0) {
+        return RAFT_ERR_BUSY;
+    }
+    memset(uv->disk_cpus, 0, sizeof uv->disk_cpus);
+    for (i = 0; i < n; i++) {
+        uv->disk_cpus[cpus[i] / 64] |= (uint64_t)1 << (cpus[i] % 64);
+    }
+    uv->n_disk_cpus = n;
+    return 0;
+}
+
+int raft_io_uv_set_numa_node(struct raft_io *io, int node)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (node < -1 || node >= IO_UV__MAX_NUMA_NODES) {
+        return RAFT_EINVAL;
+    }
+    uv->numa_node = node;
+    uv->host->numa_node = node;
+    return 0;
+}
+
+void raft_io_uv_set_append_coalescing(struct raft_io *io,
+                                      unsigned max_delay,
+                                      size_t min_bytes)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->append_coalesce_delay = max_delay;
+    uv->append_coalesce_bytes = min_bytes;
+}
+
+void io_uv__record_latency(struct raft_io_uv_latency *l, uint64_t nsecs)
+{
+    uint64_t usecs = nsecs / 1000;
+    uint64_t value = usecs;
+    unsigned bucket = 0;
+
+    while (value > 0 && bucket < RAFT_IO_UV_LATENCY_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    l->count++;
+    l->total += usecs;
+    if (usecs > l->max) {
+        l->max = usecs;
+    }
+    l->buckets[bucket]++;
+}
+
+void raft_io_uv_stats(struct raft_io *io, struct raft_io_uv_stats *stats)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    *stats = uv->stats;
+}
+
+void raft_io_uv_set_stall_threshold(struct raft_io *io,
+                                    unsigned threshold,
+                                    raft_io_uv_stall_cb cb)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->stall_threshold = threshold;
+    uv->stall_cb = cb;
+    if (uv->state == IO_UV__ACTIVE) {
+        stall_update(uv);
+    }
+}
+
+void raft_io_uv_set_huge_pages(struct raft_io *io, bool enabled)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->huge_pages = enabled;
+}
+
+void raft_io_uv_set_direct_io(struct raft_io *io, bool enabled)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->direct_io = enabled;
+}
+
+int raft_io_uv_set_load_threads(struct raft_io *io, unsigned n)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (n == 0 || n > IO_UV__MAX_LOAD_THREADS) {
+        return RAFT_EINVAL;
+    }
+    uv->n_load_threads = n;
+    return 0;
+}
+
+void raft_io_uv_set_load_mmap(struct raft_io *io, bool enabled)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->load_mmap = enabled;
+}
+
+/* Replace the directory pointed by @dir with a copy of @path, creating it if
+ * needed. */
+static int set_dir(struct io_uv *uv, const char *path, char **dir)
+{
+    char *copy;
+    int rv;
+
+    copy_dir(path, &copy);
+    if (copy == NULL) {
+        return RAFT_ENOMEM;
+    }
+    rv = io_uv__ensure_dir(uv->io, copy);
+    if (rv != 0) {
+        raft_free(copy);
+        return rv;
+    }
+    if (*dir != uv->dir) {
+        raft_free(*dir);
+    }
+    *dir = copy;
+
+    return 0;
+}
+
+int raft_io_uv_set_snapshot_dir(struct raft_io *io, const char *dir)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    return set_dir(uv, dir, &uv->snapshot_dir);
+}
+
+int raft_io_uv_set_metadata_dir(struct raft_io *io, const char *dir)
+{
+    struct io_uv *uv;
+    struct io_uv__metadata metadata;
+    int rv;
+
+    uv = io->impl;
+
+    rv = set_dir(uv, dir, &uv->metadata_dir);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = io_uv__metadata_load(io, uv->metadata_dir, &metadata);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* The metadata in the previous directory is more recent, e.g. because the
+     * new one was just created: carry it over, so no term or vote is lost. */
+    if (metadata.version < uv->metadata.version) {
+        metadata = uv->metadata;
+        rv = io_uv__metadata_ensure(io, uv->metadata_dir, &metadata);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    uv->metadata = metadata;
+
+    return 0;
+}
+
+int raft_io_uv_set_archive_dir(struct raft_io *io, const char *dir)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    return set_dir(uv, dir, &uv->archive_dir);
+}
+
+/* Return the format version of new segments with the given features. */
+static uint64_t segment_format(bool compact, bool entry_checksums)
+{
+    if (compact) {
+        return entry_checksums ? IO_UV__DISK_FORMAT_COMPACT_ENTRY_CHECKSUMS
+                               : IO_UV__DISK_FORMAT_COMPACT;
+    }
+    return entry_checksums ? IO_UV__DISK_FORMAT_ENTRY_CHECKSUMS
+                           : IO_UV__DISK_FORMAT;
+}
+
+void raft_io_uv_set_entry_checksums(struct raft_io *io, bool enabled)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->format = segment_format(io_uv__format_is_compact(uv->format), enabled);
+}
+
+void raft_io_uv_set_compact_entries(struct raft_io *io, bool enabled)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->format =
+        segment_format(enabled, io_uv__format_has_entry_checksums(uv->format));
+}
+
+void raft_io_uv_set_send_queue_size(struct raft_io *io, size_t size)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    uv->host->send_queue_size = size;
+}
+
+int raft_io_uv_set_compression(struct raft_io *io, size_t threshold)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+#if !defined(HAVE_LZ4)
+    if (threshold > 0) {
+        return RAFT_EINVAL;
+    }
+#endif
+    uv->host->compress_threshold = threshold;
+    return 0;
+}
+
+int raft_io_uv_set_connect_retry_delay(struct raft_io *io,
+                                       unsigned min_delay,
+                                       unsigned max_delay)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+    if (min_delay == 0 || min_delay > max_delay) {
+        return RAFT_EINVAL;
+    }
+    uv->host->connect_retry_min_delay = min_delay;
+    uv->host->connect_retry_max_delay = max_delay;
+    return 0;
+}
+
 static int io_uv__bootstrap(struct raft_io *io,
                             const struct raft_configuration *configuration)
 {
@@ -523,10 +1533,10 @@ static int raft__io_uv_write_closed_1_1(struct io_uv *uv,
 
     memcpy(cursor, conf->base, conf->len);
 
-    crc1 = byte__crc32(header, io_uv__sizeof_batch_header(1), 0);
+    crc1 = byte__crc32c(header, io_uv__sizeof_batch_header(1), 0);
     byte__put32(&crc1_p, crc1);
 
-    crc2 = byte__crc32(conf->base, conf->len, 0);
+    crc2 = byte__crc32c(conf->base, conf->len, 0);
     byte__put32(&crc2_p, crc2);
 
     rv = write(fd, buf, len);
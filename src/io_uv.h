@@ -6,25 +6,172 @@
 #define RAFT_IO_UV_H_
 
 #include "../include/raft.h"
+#include "../include/raft/io_uv.h"
 
+#include "io_uv_encoding.h"
 #include "io_uv_metadata.h"
 #include "uv_file.h"
 
 /**
- * Current disk format version.
+ * Current disk format version. Version 1 used CRC32 checksums, version 2 uses
+ * CRC32C ones, which are cheaper to compute. Version 3 is written only when
+ * per-entry checksums are enabled, and replaces the checksum of the batch data
+ * with one checksum for each entry. Versions 4 and 5 are written only when
+ * compact entries are enabled, and are the same as versions 2 and 3, except
+ * that batch headers use the compact encoding. All of them can be loaded.
  */
-#define IO_UV__DISK_FORMAT 1
+#define IO_UV__DISK_FORMAT 2
+#define IO_UV__DISK_FORMAT_ENTRY_CHECKSUMS 3
+#define IO_UV__DISK_FORMAT_COMPACT 4
+#define IO_UV__DISK_FORMAT_COMPACT_ENTRY_CHECKSUMS 5
+
+/**
+ * Maximum number of concurrent writes against the same open segment.
+ */
+#define IO_UV__MAX_CONCURRENT_WRITES 4
+
+/**
+ * Maximum number of obsolete segment files kept around in order to be reused
+ * as new open segments.
+ */
+#define IO_UV__MAX_RECYCLED_SEGMENTS 4
+
+/**
+ * Maximum number of obsolete files removed by a single compaction pass, and
+ * maximum time in milliseconds that a compaction waits for appends to pause
+ * before it runs anyway.
+ */
+#define IO_UV__COMPACT_BATCH 8
+#define IO_UV__COMPACT_MAX_DELAY 1000
+
+/**
+ * Default and maximum number of threads running blocking disk I/O.
+ */
+#define IO_UV__DISK_THREADS 2
+#define IO_UV__MAX_DISK_THREADS 8
+
+/**
+ * Default and maximum number of threads loading closed segments.
+ */
+#define IO_UV__LOAD_THREADS 4
+#define IO_UV__MAX_LOAD_THREADS 8
+
+/**
+ * Time worth of writes, in milliseconds, that the prepared open segments
+ * should be able to hold at the rate segments have recently been filled.
+ */
+#define IO_UV__PREPARE_HORIZON 3000
+
+/**
+ * Number of segments loaded by each step of an asynchronous load, which is
+ * enough for the closed ones to be loaded in parallel.
+ */
+#define IO_UV__LOAD_STEP_SEGMENTS 16
+
+/**
+ * Maximum number of CPUs and of NUMA nodes that threads and buffers can be
+ * placed on.
+ */
+#define IO_UV__MAX_CPUS 1024
+#define IO_UV__MAX_NUMA_NODES 1024
+
+/**
+ * Default minimum number of payload bytes of an append batch for it to be
+ * checksummed and copied in a disk thread, instead of in the loop thread.
+ */
+#define IO_UV__ENCODE_THRESHOLD (256 * 1024)
+
+/**
+ * Maximum number of released segment write buffers kept around in order to be
+ * reused, and size of the huge pages they can be backed by.
+ */
+#define IO_UV__MAX_FREE_ARENAS 8
+#define IO_UV__HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Prefix of the name of obsolete segment files waiting to be reused.
+ */
+#define IO_UV__RECYCLED_PREFIX "recycle-"
 
 /**
  * State codes.
  */
 enum { IO_UV__ACTIVE = 1, IO_UV__CLOSING, IO_UV__CLOSED };
 
+struct io_uv;
 struct io_uv__client;
+struct io_uv__load;
 struct io_uv__server;
 
 typedef unsigned long long io_uv__counter;
 
+/**
+ * Request to run blocking disk I/O in one of the disk threads of an io_uv
+ * object. The @work_cb callback runs in the disk thread, the @after_work_cb
+ * one in the loop thread once the former has returned. The status passed to
+ * @after_work_cb is always 0, since requests are never cancelled.
+ */
+struct io_uv__work;
+typedef void (*io_uv__work_cb)(struct io_uv__work *work);
+typedef void (*io_uv__after_work_cb)(struct io_uv__work *work, int status);
+struct io_uv__work
+{
+    void *data;                         /* User data */
+    io_uv__work_cb work_cb;             /* Run in a disk thread */
+    io_uv__after_work_cb after_work_cb; /* Run in the loop thread */
+    raft__queue queue;                  /* Pending or done queue */
+    uint64_t duration;                  /* Time spent in work_cb, in nsecs */
+};
+
+/**
+ * Network state shared by all raft groups attached to the same transport.
+ *
+ * The host owns the outgoing connections to peer servers and the incoming
+ * connections from them. Each message carries the ID of the group it belongs
+ * to, which is used to dispatch received messages to the relevant io_uv
+ * object.
+ *
+ * Heartbeats sent by groups attached to a shared host are buffered for up to
+ * heartbeat_delay milliseconds and then sent to each peer server as a single
+ * message.
+ */
+struct io_uv__host;
+typedef void (*io_uv__host_close_cb)(struct io_uv__host *h);
+struct io_uv__host
+{
+    void *data;                             /* User data */
+    struct uv_loop_s *loop;                 /* UV event loop */
+    struct raft_io_uv_transport *transport; /* Network transport */
+    unsigned id;                            /* Server ID */
+    int state;                              /* Current state */
+    bool listening;                         /* If listen() was called */
+    struct io_uv **groups;                  /* Attached raft groups */
+    unsigned n_groups;                      /* Length of the groups array */
+    struct io_uv__client **clients;         /* Outgoing connections */
+    unsigned n_clients;                     /* Length of the clients array */
+    struct io_uv__server **servers;         /* Incoming connections */
+    unsigned n_servers;                     /* Length of the servers array */
+    unsigned connect_retry_min_delay;       /* First connection retry delay */
+    unsigned connect_retry_max_delay;       /* Max connection retry delay */
+    size_t send_queue_size;                 /* Max bytes queued per client */
+    size_t compress_threshold;              /* Min payload to compress or 0 */
+    size_t bulk_chunk_size;                 /* Max bytes of a bulk write */
+    int numa_node;                          /* Node of buffers, or -1 */
+    struct uv_timer_s heartbeat_timer;      /* Flush buffered heartbeats */
+    unsigned heartbeat_delay;               /* Max delay of a heartbeat */
+    struct uv_prepare_s cork;               /* Flush corked messages */
+    unsigned n_closing;                     /* Handles still being closed */
+    bool shared_sync;                       /* Groups share data syncs */
+    unsigned prepare_budget;                /* Max ready segments, or 0 */
+    unsigned n_prepared;                    /* Ready segments of all groups */
+    raft__queue sync_groups;                /* Groups waiting for a sync */
+    raft__queue sync_round;                 /* Groups covered by sync_work */
+    struct uv_work_s sync_work;             /* Sync the groups file systems */
+    bool syncing;                           /* Whether sync_work is running */
+    unsigned n_syncs;                       /* File system syncs performed */
+    io_uv__host_close_cb close_cb;          /* Invoked when closed */
+};
+
 /**
  * Implementation of the raft_io interface.
  */
@@ -33,40 +180,192 @@ struct io_uv
     struct raft_io *io;                     /* I/O object we're implementing */
     struct uv_loop_s *loop;                 /* UV event loop */
     char *dir;                              /* Data directory */
-    struct raft_io_uv_transport *transport; /* Network transport */
+    char *snapshot_dir;                     /* Where snapshots are written */
+    char *metadata_dir;                     /* Where term and vote are kept */
+    char *archive_dir;                      /* Where old segments are moved */
+    struct io_uv__host *host;               /* Shared network state */
+    struct io_uv__host own_host;            /* Used when not sharing a host */
+    unsigned group;                         /* ID of our raft group */
     unsigned id;                            /* Server ID */
     int state;                              /* Current state */
+    bool stopped;                           /* If sub-systems were stopped */
+    unsigned n_closing;                     /* Handles still being closed */
     bool errored;                           /* If a disk I/O error was hit */
     size_t block_size;                      /* Block size of the data dir */
+    bool async_writes;                      /* If NOWAIT writes are supported */
+    bool direct_io;                         /* If O_DIRECT should be tried */
     unsigned n_blocks;                      /* N. of blocks in a segment */
-    struct io_uv__client **clients;         /* Outgoing connections */
-    unsigned n_clients;                     /* Length of the clients array */
-    struct io_uv__server **servers;         /* Incoming connections */
-    unsigned n_servers;                     /* Length of the servers array */
-    unsigned connect_retry_delay;           /* Client connection retry delay */
+    unsigned prepare_pool_size;             /* Max n. of ready segments */
+    uint64_t prepare_last_used;             /* When a segment was last taken */
+    uint64_t prepare_interval;              /* Smoothed msecs between takes */
+    unsigned n_sending;                     /* Send requests in flight */
+    struct raft_pool send_pool;             /* Recycled send requests */
+    raft__queue send_batches;               /* Entries shared by sends */
     struct uv__file *preparing;             /* File segment being prepared */
     raft__queue prepare_reqs;               /* Pending prepare requests. */
     raft__queue prepare_pool;               /* Prepared open segments */
+    raft__queue prepare_recycled;           /* Segment files to reuse */
     io_uv__counter prepare_next_counter;    /* Counter of next open segment */
     raft_index append_next_index;           /* Index of next entry to append */
     raft__queue append_segments;            /* Open segments in use. */
     raft__queue append_pending_reqs;        /* Pending append requests. */
     raft__queue append_writing_reqs;        /* Append requests in flight */
+    raft__queue append_syncing_reqs;        /* Written, waiting for a sync */
+    raft__queue append_round_reqs;          /* Covered by the host sync */
+    raft__queue sync_queue;                 /* Link into host sync queues */
+    bool sync_queued;                       /* If in the host sync_groups */
+    unsigned long sync_dev;                 /* Device of dir, set by sync */
+    int sync_status;                        /* Result of the last sync */
+    unsigned append_coalesce_delay;         /* Max usecs to hold back writes */
+    size_t append_coalesce_bytes;           /* Never hold back this much */
+    size_t append_encode_threshold;         /* Encode larger batches off-loop */
+    uint64_t append_write_latency;          /* Average write latency, nsecs */
+    struct raft_pool append_pool;           /* Recycled append requests */
+    uv_buf_t arenas[IO_UV__MAX_FREE_ARENAS]; /* Released write buffers */
+    unsigned n_arenas;                      /* N. of released write buffers */
+    bool huge_pages;                        /* Back write buffers by 2M pages */
+    struct raft_io_uv_stats stats;          /* Disk statistics */
+    unsigned n_load_threads;                /* Threads loading segments */
+    bool load_mmap;                         /* Map closed segments to load */
+    uint64_t format;                        /* Format of new segments */
+    uint64_t load_checksum_time;            /* Checksum nsecs while loading */
+    struct uv_timer_s append_timer;         /* Submit held back writes */
     raft__queue finalize_reqs;              /* Segments waiting to be closed */
+    raft__queue finalize_batch;             /* Segments being closed */
     raft_index finalize_last_index;         /* Last index of last closed seg */
-    struct uv_work_s finalize_work;         /* Resize and rename segments */
+    raft_index finalize_done_index;         /* Last index readable by read */
+    struct io_uv__work finalize_work;       /* Resize and rename segments */
     raft__queue truncate_reqs;              /* Pending truncate requests */
-    struct uv_work_s truncate_work;         /* Execute truncate log requests */
+    struct io_uv__work truncate_work;       /* Execute truncate log requests */
+    bool truncate_blocking;                 /* Appends wait for truncation */
     raft__queue snapshot_put_reqs;          /* Inflight put snapshot requests */
     raft__queue snapshot_get_reqs;          /* Inflight get snapshot requests */
-    struct uv_work_s snapshot_put_work;     /* Execute snapshot put requests */
+    struct io_uv__work snapshot_put_work;   /* Execute snapshot put requests */
+    struct io_uv__work compact_work;        /* Remove obsolete files */
+    bool compact_pending;                   /* Obsolete files to remove */
+    uint64_t compact_since;                 /* When they became obsolete */
+    struct
+    {
+        size_t offset;                      /* Size of the data written */
+        bool valid;                         /* Chunks written in order */
+        struct io_uv__snapshot_checksums checksums; /* Of chunks written */
+    } snapshot_part;                        /* Partial chunked snapshot */
+    raft__queue read_reqs;                  /* Inflight read entries requests */
+    raft__queue read_waiting_reqs;          /* Reads waiting for truncations */
     struct io_uv__metadata metadata;        /* Cache of metadata on disk */
+    uv_mutex_t metadata_mutex;              /* Serialize metadata writes */
+    raft__queue set_meta_reqs;              /* Pending set meta requests */
+    raft__queue set_meta_writing;           /* Set meta requests in flight */
+    struct io_uv__work set_meta_work;       /* Write metadata in disk thread */
+    int set_meta_status;                    /* Result of last metadata write */
+    struct io_uv__load *load;               /* Pending asynchronous load */
     struct uv_timer_s timer;                /* Timer for periodic ticks */
+    raft__queue defer_reqs;                 /* Pending defer requests */
+    struct uv_check_s check;                /* Fire deferred requests */
+    struct uv_idle_s idle;                  /* Don't block while deferring */
+    struct uv_async_s wakeup;               /* Fire the wakeup callback */
+    raft_io_wakeup_cb wakeup_cb;
+    unsigned stall_threshold;               /* Report stalls above, usecs */
+    raft_io_uv_stall_cb stall_cb;           /* Stall report callback */
+    struct uv_prepare_s stall_prepare;      /* Mark the end of an iteration */
+    struct uv_check_s stall_check;          /* Mark the start of an iteration */
+    uint64_t stall_poll_end;                /* When the last poll returned */
+    struct
+    {
+        int fd;                             /* Trace file, or -1 if stopped */
+        uint8_t *buf;                       /* Records not written yet */
+        size_t len;                         /* Bytes used in the buffer */
+        uint64_t start;                     /* When recording started */
+    } record;                               /* Workload trace */
+    unsigned n_disk_threads;                /* N. of disk threads to run */
+    uint64_t disk_cpus[IO_UV__MAX_CPUS / 64]; /* CPUs to pin threads to */
+    unsigned n_disk_cpus;                   /* N. of CPUs, 0 for no pinning */
+    int numa_node;                          /* Node of buffers, or -1 */
+    uv_thread_t disk_threads[IO_UV__MAX_DISK_THREADS]; /* Disk threads */
+    int disk_state;                         /* State of the disk threads */
+    bool disk_exiting;                      /* Disk threads must exit */
+    uv_mutex_t disk_mutex;                  /* Serialize access to queues */
+    uv_cond_t disk_cond;                    /* Signal new pending work */
+    raft__queue disk_pending;               /* Work waiting for a thread */
+    raft__queue disk_done;                  /* Work completed by a thread */
+    unsigned disk_n_inflight;               /* Work not yet completed */
+    struct uv_async_s disk_async;           /* Notify completed work */
+    struct raft_heap *disk_heap;            /* Allocator of disk threads */
     raft_io_tick_cb tick_cb;
     raft_io_recv_cb recv_cb;
+    raft_io_recv_batch_cb recv_batch_cb;
     raft_io_close_cb close_cb;
 };
 
+/**
+ * Initialize a host object using the given transport.
+ */
+void io_uv__host_init(struct io_uv__host *h,
+                      struct uv_loop_s *loop,
+                      struct raft_io_uv_transport *transport);
+
+/**
+ * Initialize the transport of the host with the given server identity, if not
+ * done already. All groups attached to the same host must use the same server
+ * ID.
+ */
+int io_uv__host_setup(struct io_uv__host *h, unsigned id, const char *address);
+
+/**
+ * Attach the given io_uv object to the host. No other io_uv object with the
+ * same group ID must be attached.
+ */
+int io_uv__host_add(struct io_uv__host *h, struct io_uv *uv);
+
+/**
+ * Detach the given io_uv object from the host, if it was attached. Received
+ * messages for its group will be discarded from now on.
+ */
+void io_uv__host_remove(struct io_uv__host *h, struct io_uv *uv);
+
+/**
+ * Return the attached io_uv object with the given group ID, or NULL.
+ */
+struct io_uv *io_uv__host_group(struct io_uv__host *h, unsigned group);
+
+/**
+ * Start listening for incoming connections, if not done already.
+ */
+int io_uv__host_listen(struct io_uv__host *h);
+
+/**
+ * Notify the host that a heartbeat has been buffered, so it can schedule a
+ * flush.
+ */
+void io_uv__host_heartbeat(struct io_uv__host *h);
+
+/**
+ * Notify the host that a message has been corked, so it can flush it together
+ * with the other messages sent during the current loop iteration.
+ */
+void io_uv__host_cork(struct io_uv__host *h);
+
+/**
+ * Notify the host that the given group has append requests waiting for a sync
+ * of their data, so it can schedule one. All groups waiting at the time it
+ * starts are covered by the same sync.
+ */
+void io_uv__host_sync(struct io_uv__host *h, struct io_uv *uv);
+
+/**
+ * Stop all clients and servers and close the transport. All groups must have
+ * been detached.
+ */
+void io_uv__host_close(struct io_uv__host *h, io_uv__host_close_cb cb);
+
+/**
+ * Emit a log message on behalf of the host.
+ */
+void io_uv__host_emit(struct io_uv__host *h,
+                      int level,
+                      const char *format,
+                      ...);
+
 /**
  * Request to obtain a newly prepared open segment.
  */
@@ -89,6 +388,25 @@ void io_uv__prepare(struct io_uv *uv,
                     struct io_uv__prepare *req,
                     io_uv__prepare_cb cb);
 
+/**
+ * Make the obsolete segment file with the given name, which must start with
+ * IO_UV__RECYCLED_PREFIX, available for reuse as a new open segment. If there
+ * are already enough files to reuse, remove it.
+ */
+void io_uv__prepare_recycle(struct io_uv *uv, const char *filename);
+
+/**
+ * Make available for reuse the obsolete segment files left in the data
+ * directory by a previous run.
+ */
+void io_uv__prepare_adopt(struct io_uv *uv);
+
+/**
+ * Remove the prepared open segments that the recent write rate doesn't
+ * justify keeping around.
+ */
+void io_uv__prepare_trim(struct io_uv *uv);
+
 /**
  * Cancel all pending prepare requests and remove all unused prepared open
  * segments. If a segment currently being created, wait for it to complete and
@@ -106,9 +424,9 @@ int io_uv__append(struct raft_io *io,
                   void (*cb)(void *data, int status));
 
 /**
- * Callback invoked after completing a truncate request. If there are append
- * requests that have accumulated in while the truncate request was executed,
- * they will be processed now.
+ * Callback invoked after completing a truncate request. The entries appended
+ * after it, which might have been encoded while the truncate request was
+ * executed, are written now.
  */
 void io_uv__append_unblock(struct io_uv *uv);
 
@@ -118,18 +436,31 @@ void io_uv__append_unblock(struct io_uv *uv);
  */
 void io_uv__append_stop(struct io_uv *uv);
 
+/**
+ * Callbacks invoked by the host right before syncing the data of the append
+ * requests that wait for it and right after the sync is done.
+ */
+void io_uv__append_sync_start(struct io_uv *uv);
+void io_uv__append_synced(struct io_uv *uv, int status);
+
 /**
  * Tell the append implementation that the open segment currently being written
  * must be flushed. The implementation will:
  *
  * - Request a new prepared segment and target all newly submitted append
- *   requests to it.
+ *   requests to it. Nothing is written to it until io_uv__append_unblock() is
+ *   called.
  *
  * - Wait for any inflight write against the current segment to complete and
  *   then submit a request to finalize it.
  */
 int io_uv__append_flush(struct io_uv *uv);
 
+/**
+ * Implementation of raft_io->time.
+ */
+raft_time io_uv__time(struct raft_io *io);
+
 /**
  * Implementation of raft_io->send.
  */
@@ -138,33 +469,90 @@ int io_uv__send(struct raft_io *io,
                 const struct raft_message *message,
                 raft_io_send_cb cb);
 
+/**
+ * Implementation of raft_io->broadcast.
+ */
+int io_uv__broadcast(struct raft_io *io,
+                     struct raft_io_send *reqs[],
+                     const struct raft_message messages[],
+                     unsigned n,
+                     int statuses[],
+                     raft_io_send_cb cb);
+
+/**
+ * Record the features advertised by the given server, which tell which
+ * optional encodings can be used in the messages sent to it.
+ */
+void io_uv__clients_set_features(struct io_uv__host *h,
+                                 unsigned id,
+                                 uint64_t features);
+
+/**
+ * Implementation of raft_io->congested.
+ */
+bool io_uv__congested(struct raft_io *io, unsigned id);
+
+/**
+ * Cancel all send requests of the given group that are still queued waiting
+ * for a connection.
+ */
+void io_uv__clients_cancel(struct io_uv *uv);
+
+/**
+ * Send the heartbeats buffered by each client, coalesced in a single message
+ * per peer server.
+ */
+void io_uv__clients_flush(struct io_uv__host *h);
+
+/**
+ * Write the messages corked by each client, using a single write request per
+ * peer server.
+ */
+void io_uv__clients_uncork(struct io_uv__host *h);
+
 /**
  * Stop all clients by closing the outbound stream handles and canceling all
  * pending send requests.
  */
-void io_uv__clients_stop(struct io_uv *uv);
+void io_uv__clients_stop(struct io_uv__host *h);
 
 /**
  * Start listening for new incoming connections.
  */
-int io_uv__listen(struct io_uv *uv);
+int io_uv__listen(struct io_uv__host *h);
 
 /**
  * Stop all servers by closing the inbound stream handles and aborting all
  * requests being received.
  */
-void io_uv__servers_stop(struct io_uv *uv);
+void io_uv__servers_stop(struct io_uv__host *h);
 
 /**
  * Implementation of raft_io->truncate.
  */
 int io_uv__truncate(struct raft_io *io, raft_index index);
 
+/**
+ * Implementation of raft_io->replace.
+ */
+int io_uv__replace(struct raft_io *io,
+                   raft_index index,
+                   const struct raft_entry entries[],
+                   unsigned n,
+                   void *data,
+                   void (*cb)(void *data, int status));
+
 /**
  * Cancel all pending truncate requests.
  */
 void io_uv__truncate_stop(struct io_uv *uv);
 
+/**
+ * Complete any truncation of a closed segment that was interrupted by a crash,
+ * replaying its journal. Must be invoked before loading segments.
+ */
+int io_uv__truncate_recover(struct io_uv *uv);
+
 /**
  * Callback invoked after a segment has been finalized. It will check if there
  * are pending truncate requests waiting for open segments to be finalized, and
@@ -199,12 +587,44 @@ int io_uv__snapshot_put(struct raft_io *io,
                         const struct raft_snapshot *snapshot,
                         raft_io_snapshot_put_cb cb);
 
+/**
+ * Implementation raft_io->snapshot_put_chunk.
+ */
+int io_uv__snapshot_put_chunk(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              size_t offset,
+                              const struct raft_buffer *buf,
+                              bool done,
+                              raft_io_snapshot_put_cb cb);
+
+/**
+ * Implementation raft_io->snapshot_put_patch.
+ */
+int io_uv__snapshot_put_patch(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              raft_index base,
+                              const struct raft_snapshot_patch patches[],
+                              unsigned n_patches,
+                              size_t size,
+                              raft_io_snapshot_put_cb cb);
+
 /**
  * Callback invoked after truncation has completed, possibly unblocking pending
  * snapshot put requests.
  */
 void io_uv__snapshot_put_unblock(struct io_uv *uv);
 
+/**
+ * Remove the segments and snapshots made obsolete by the last snapshot, if not
+ * done yet. The removal runs in the background and in small batches, when no
+ * append is being written or when it has been waiting for too long, and it's
+ * serialized with truncations and snapshot writes. It must be called whenever
+ * one of these conditions might have changed.
+ */
+void io_uv__compact_unblock(struct io_uv *uv);
+
 /**
  * Implementation of raft_io->snapshot_get.
  */
@@ -212,6 +632,128 @@ int io_uv__snapshot_get(struct raft_io *io,
                         struct raft_io_snapshot_get *req,
                         raft_io_snapshot_get_cb cb);
 
+/**
+ * Implementation of raft_io->snapshot_read.
+ */
+int io_uv__snapshot_read(struct raft_io *io,
+                         struct raft_io_snapshot_read *req,
+                         raft_term term,
+                         raft_index index,
+                         size_t offset,
+                         size_t len,
+                         raft_io_snapshot_read_cb cb);
+
+/**
+ * Implementation raft_io->read.
+ */
+int io_uv__read(struct raft_io *io,
+                struct raft_io_read *req,
+                raft_index index,
+                unsigned n,
+                raft_io_read_cb cb);
+
+/**
+ * Implementation raft_io->last_readable.
+ */
+raft_index io_uv__last_readable(struct raft_io *io);
+
+/**
+ * Start the read requests that were waiting for truncations to complete, if
+ * none is pending anymore.
+ */
+void io_uv__read_unblock(struct io_uv *uv);
+
+/**
+ * Add a sample of @nsecs nanoseconds to the given latency histogram.
+ */
+void io_uv__record_latency(struct raft_io_uv_latency *l, uint64_t nsecs);
+
+/**
+ * Return the start time of a raft callback, to be passed to io_uv__stall_end()
+ * once it returns, or 0 if the stall detector is disabled.
+ */
+uint64_t io_uv__stall_start(struct io_uv *uv);
+
+/**
+ * Record the time spent by a raft callback of the given kind, which started at
+ * @start, and report it if it's a stall.
+ */
+void io_uv__stall_end(struct io_uv *uv, int kind, uint64_t start);
+
+/**
+ * Add a record of the given kind to the workload trace, if recording.
+ */
+void io_uv__record(struct io_uv *uv,
+                   int kind,
+                   int type,
+                   unsigned server_id,
+                   unsigned n,
+                   uint64_t size,
+                   unsigned latency);
+
+/**
+ * Add a record of the given kind for a message sent or received.
+ */
+void io_uv__record_message(struct io_uv *uv,
+                           int kind,
+                           const struct raft_message *message);
+
+/**
+ * Write the records buffered so far and stop recording, if recording.
+ */
+void io_uv__record_stop(struct io_uv *uv);
+
+/**
+ * Get a write buffer of at least @size bytes, aligned to the block size of the
+ * data directory, reusing a released one if possible. The length of @buf is
+ * set to the actual size of the buffer.
+ */
+int io_uv__arena_get(struct io_uv *uv, size_t size, uv_buf_t *buf);
+
+/**
+ * Release a write buffer obtained with io_uv__arena_get(), keeping it around
+ * for reuse if there's room. Do nothing if @buf is not set.
+ */
+void io_uv__arena_put(struct io_uv *uv, uv_buf_t *buf);
+
+/**
+ * Free all released write buffers.
+ */
+void io_uv__arena_close(struct io_uv *uv);
+
+/**
+ * Start the disk threads.
+ */
+int io_uv__disk_start(struct io_uv *uv);
+
+/**
+ * Pin the calling thread to the CPUs set with raft_io_uv_set_disk_cpus(), if
+ * any.
+ */
+void io_uv__disk_pin(struct io_uv *uv);
+
+/**
+ * Prefer the given NUMA node for the pages of the given buffer, unless @node is
+ * -1. Its base and length must be multiples of the page size.
+ */
+void io_uv__numa_bind(int node, void *base, size_t len);
+
+/**
+ * Queue a request to run @work_cb in one of the disk threads, and then
+ * @after_work_cb in the loop thread.
+ */
+void io_uv__queue_work(struct io_uv *uv,
+                       struct io_uv__work *work,
+                       io_uv__work_cb work_cb,
+                       io_uv__after_work_cb after_work_cb);
+
+/**
+ * Make the disk threads exit, once all queued requests have completed. The
+ * disk state will be set to IO_UV__CLOSED once done, and io_uv__maybe_close()
+ * invoked.
+ */
+void io_uv__disk_stop(struct io_uv *uv);
+
 void io_uv__maybe_close(struct io_uv *uv);
 
 #endif /* RAFT_IO_UV_H */
@@ -7,6 +7,7 @@
 #include "byte.h"
 #include "io_uv.h"
 #include "io_uv_encoding.h"
+#include "pool.h"
 #include "queue.h"
 #include "logging.h"
 
@@ -21,15 +22,22 @@
  *   and link, then queue the request and link it to the newly requested
  *segment.
  *
- * - Wait for any pending write against the current segment to complete, and
- *also for the prepare request if we asked for a new segment.
+ * - Wait for the prepare request if we asked for a new segment.
  *
  * - Submit a write request for the entries in this append request. The write
  *   request might contain other entries that might have accumulated in the
- *   meantime.
+ *   meantime. Up to IO_UV__MAX_CONCURRENT_WRITES writes can be in flight
+ *   against the same segment, as long as they don't touch the same blocks: if
+ *   the first block of new data is still being written, it's rewritten once
+ *   that write completes, and the rest is written right away.
  *
- * - Wait for the write request to finish and fire the append request's
- *callback.
+ * - Wait for all the data of the request and of the requests preceeding it to
+ *   be written, and fire the append request's callback.
+ *
+ * The payloads of batches larger than uv->append_encode_threshold are
+ * checksummed and copied into the arena by a disk thread, while the data
+ * preceeding them is written. No other request is encoded in the meantime,
+ * since the arena can't be moved or resized.
  *
  * Possible failure modes are:
  *
@@ -41,23 +49,96 @@
  * callbacks.
  **/
 
+/* Number of write slots of a segment. Besides writes in flight, a slot is held
+ * by a completed write until all data preceeding it has been written too. */
+#define N_WRITE_SLOTS (IO_UV__MAX_CONCURRENT_WRITES * 2)
+
+/* State codes of a write slot */
+enum { WRITE_IDLE = 0, WRITE_PENDING, WRITE_DONE };
+
+/* Maximum number of entry payloads that a segment can reference in place of a
+ * copy, until they get submitted. */
+#define N_EXTENTS 16
+
+/* Maximum number of buffers of a single write: all extents, plus the copied
+ * data around them. */
+#define N_WRITE_BUFS (N_EXTENTS * 2 + 1)
+
+/* Minimum number of whole blocks that an entry payload must span in order for
+ * them to be written straight from the entry buffer. */
+#define ZERO_COPY_MIN_BLOCKS 2
+
+/* Whole blocks of an entry payload, to be written without copying them. */
+struct segment_extent
+{
+    size_t offset;    /* Offset of the first block in the segment */
+    const void *base; /* Entry memory holding the content of the blocks */
+    size_t len;       /* Number of bytes, a multiple of the block size */
+};
+
+struct segment_write
+{
+    struct segment *segment;   /* Segment being written */
+    struct uv__file_write req; /* Write request */
+    uv_buf_t arena;            /* Memory for the copied data */
+    uv_buf_t bufs[N_WRITE_BUFS]; /* Write buffers for this write */
+    unsigned n_bufs;           /* Number of write buffers */
+    size_t len;                /* Total number of bytes written */
+    size_t start;              /* Offset of the first byte written */
+    size_t end;                /* Offset past the last byte of data written */
+    uint64_t submitted_at;     /* When the write was submitted, in nsecs */
+    int status;                /* Result of the write */
+    unsigned short state;      /* Idle, pending or done */
+};
+
+/* Payload bytes of a batch to be checksummed and possibly copied. */
+struct encode_run
+{
+    const void *base; /* Payload memory */
+    size_t len;       /* Number of bytes */
+    void *dst;        /* Where to copy them, or NULL if referenced */
+};
+
+/* Checksum and copy of the payloads of a large batch, run in a disk thread. */
+struct encode
+{
+    struct io_uv__work work;  /* Disk thread request */
+    size_t start;             /* Offset of the batch in the segment */
+    void *crc2_p;             /* Pointer to data checksum slot */
+    struct encode_run *runs;  /* Payload runs of the batch */
+    unsigned n_runs;          /* Length of the runs array */
+    bool checksum;            /* Whether to compute the data checksum */
+    unsigned crc2;            /* Data checksum, set by the disk thread */
+};
+
 struct segment
 {
     struct io_uv *uv;              /* Our writer */
     struct io_uv__prepare prepare; /* Prepare segment file request */
     struct uv__file *file;         /* File to write to */
-    struct uv__file_write write;   /* Write request */
     unsigned long long counter;    /* Open segment counter */
     raft_index first_index;        /* Index of the first entry written */
     raft_index last_index;         /* Index of the last entry written */
     size_t size;                   /* Total number of bytes used */
-    unsigned next_block;           /* Next segment block to write */
-    uv_buf_t arena;                /* Memory for the write buffer */
-    uv_buf_t buf;                  /* Write buffer for current write */
-    size_t scheduled;              /* Number of bytes of the next write */
+    unsigned next_block;           /* First block held in the arena */
+    uv_buf_t arena;                /* Memory for data not yet written */
+    size_t scheduled;              /* Number of bytes in the arena */
+    size_t submitted;              /* Offset past the last byte submitted */
     size_t written;                /* Number of bytes actually written */
+    uint64_t queued_at;            /* When unsubmitted data was first queued */
+    struct segment_write writes[N_WRITE_SLOTS]; /* Write slots */
+    unsigned n_pending;            /* Number of writes in flight */
+    unsigned n_busy;               /* Number of non-idle write slots */
+    unsigned holes[IO_UV__MAX_CONCURRENT_WRITES]; /* Blocks to rewrite */
+    unsigned n_holes;              /* Length of the holes array */
+    struct segment_extent extents[N_EXTENTS]; /* Blocks not held in arena */
+    unsigned n_extents;            /* Length of the extents array */
+    struct encode encode;          /* Batch being encoded off-loop */
+    bool encoding;                 /* If the encode request is in flight */
+    int status;                    /* Set to RAFT_ERR_IO if a write fails */
     raft__queue queue;             /* Segment queue */
     bool finalize;                 /* Finalize the segment after writing */
+    bool hold;                     /* Wait for a truncation before writing */
 };
 
 struct append
@@ -67,14 +148,17 @@ struct append
     unsigned n;                       /* Number of entries */
     size_t size;                      /* Size of this batch on disk */
     struct segment *segment;          /* Segment to write to */
+    size_t end;                       /* Offset past the batch in the segment */
     int status;
     void (*cb)(void *data, int status);
+    uint64_t queued_at; /* When the request was queued, in nsecs */
     raft__queue queue;
 };
 
 /* Initialize an append request object. In particular, calculate the number of
  * bytes needed to store this batch in on disk. */
 static void init_append_req(struct append *r,
+                            uint64_t format,
                             const struct raft_entry entries[],
                             unsigned n,
                             void *data,
@@ -87,9 +171,10 @@ static void init_append_req(struct append *r,
     r->data = data;
     r->cb = cb;
 
-    r->size = sizeof(uint32_t) * 2;              /* CRC checksums */
-    r->size += io_uv__sizeof_batch_header(r->n); /* Batch header */
-    for (i = 0; i < r->n; i++) {                 /* Entries data */
+    r->size = sizeof(uint32_t) * 2; /* CRC checksums */
+    r->size += io_uv__sizeof_segment_batch_header(format, entries, n);
+    r->size += io_uv__sizeof_batch_checksums(format, r->n);
+    for (i = 0; i < r->n; i++) { /* Entries data */
         size_t len = r->entries[i].buf.len;
         r->size += len;
         if (len % 8 != 0) {
@@ -119,46 +204,133 @@ static void reserve_segment_capacity(struct segment *s, size_t size)
 static int ensure_segment_write_buf_is_large_enough(struct segment *s,
                                                     size_t size)
 {
-    unsigned n = (size / s->uv->block_size);
-    void *base;
-    size_t len;
+    uv_buf_t buf;
+    size_t n = 0;
+    int rv;
 
     if (s->arena.len >= size) {
         assert(s->arena.base != NULL);
         return 0;
     }
 
-    if (size % s->uv->block_size != 0) {
-        n++;
-    }
-
-    len = s->uv->block_size * n;
-    base = aligned_alloc(s->uv->block_size, len);
-    if (base == NULL) {
-        return RAFT_ENOMEM;
+    rv = io_uv__arena_get(s->uv, size, &buf);
+    if (rv != 0) {
+        return rv;
     }
-    memset(base, 0, len);
 
     /* If the current arena is initialized, we need to copy its first block,
      * since it might have data that we want to retain in the next write. */
     if (s->arena.base != NULL) {
         assert(s->arena.len >= s->uv->block_size);
-        memcpy(base, s->arena.base, s->arena.len);
-        free(s->arena.base);
+        memcpy(buf.base, s->arena.base, s->arena.len);
+        n = s->arena.len;
+        io_uv__arena_put(s->uv, &s->arena);
     }
+    memset(buf.base + n, 0, buf.len - n);
 
-    s->arena.base = base;
-    s->arena.len = len;
+    s->arena = buf;
 
     return 0;
 }
 
+/* Return the offset past the last byte encoded in the segment. */
+static size_t segment_offset(struct segment *s)
+{
+    return s->next_block * s->uv->block_size + s->scheduled;
+}
+
 /* Extend the segment's write buffer by encoding the entries in the given
  * request into it. IOW, previous data in the write buffeer will be retained,
  * and data for these new entries will be appendede. */
+/* Try to make the segment reference the whole blocks spanned by the given
+ * entry payload, instead of copying them into the arena at the given position.
+ * The bytes of the partial blocks at the edges are still copied, since those
+ * blocks hold other data too. Return #true if the payload has been handled. */
+static bool reference_entry_payload(struct segment *s,
+                                    const struct raft_buffer *buf,
+                                    void *cursor)
+{
+    size_t block_size = s->uv->block_size;
+    size_t offset;
+    size_t first; /* Offset of the first whole block */
+    size_t last;  /* Offset past the last whole block */
+    struct segment_extent *e;
+
+    offset = s->next_block * block_size + (cursor - (void *)s->arena.base);
+    first = offset;
+    if (first % block_size != 0) {
+        first += block_size - (first % block_size);
+    }
+    last = (offset + buf->len) / block_size * block_size;
+
+    if (s->n_extents == N_EXTENTS || last < first + ZERO_COPY_MIN_BLOCKS * block_size) {
+        return false;
+    }
+
+    /* With direct I/O the memory of each write buffer must be aligned too,
+     * otherwise let's fall back to copying. */
+    if (s->file->direct &&
+        ((uintptr_t)buf->base + (first - offset)) % block_size != 0) {
+        return false;
+    }
+
+    memcpy(cursor, buf->base, first - offset);
+    memcpy(cursor + (last - offset), buf->base + (last - offset),
+           offset + buf->len - last);
+
+    e = &s->extents[s->n_extents];
+    e->offset = first;
+    e->base = buf->base + (first - offset);
+    e->len = last - first;
+    s->n_extents++;
+
+    return true;
+}
+
+static void process_requests(struct io_uv *uv);
+
+static void encode_work_cb(struct io_uv__work *work)
+{
+    struct segment *s = work->data;
+    struct encode *e = &s->encode;
+    unsigned crc2 = 0;
+    unsigned i;
+
+    for (i = 0; i < e->n_runs; i++) {
+        struct encode_run *run = &e->runs[i];
+        if (e->checksum) {
+            crc2 = byte__crc32c(run->base, run->len, crc2);
+        }
+        if (run->dst != NULL) {
+            memcpy(run->dst, run->base, run->len);
+        }
+    }
+
+    e->crc2 = crc2;
+}
+
+static void encode_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct segment *s = work->data;
+    struct encode *e = &s->encode;
+
+    assert(status == 0);
+    assert(s->encoding);
+
+    byte__put32(&e->crc2_p, e->crc2);
+    raft_free(e->runs);
+    e->runs = NULL;
+    s->encoding = false;
+
+    process_requests(s->uv);
+}
+
 static int encode_entries_to_segment_write_buf(struct segment *s,
                                                struct append *req)
 {
+    struct encode *e = &s->encode;
+    bool offload; /* Whether to checksum and copy payloads in a disk thread */
+    size_t start;
     size_t size;
     void *cursor;
     unsigned crc1; /* Header checksum */
@@ -166,12 +338,16 @@ static int encode_entries_to_segment_write_buf(struct segment *s,
     void *crc1_p;  /* Pointer to header checksum slot */
     void *crc2_p;  /* Pointer to data checksum slot */
     void *header;  /* Pointer to the header section */
+    size_t header_len; /* Size of header and entry checksums */
+    bool checksum; /* Whether the data has a single batch checksum */
     unsigned i;
     int rv;
 
     assert(req->segment == s);
+    assert(!s->encoding);
 
     size = req->size;
+    start = segment_offset(s);
 
     /* If this is the very first write to the segment, we need to include the
      * format version */
@@ -179,7 +355,8 @@ static int encode_entries_to_segment_write_buf(struct segment *s,
         size += sizeof(uint64_t);
     }
 
-    assert(s->written + size <= s->uv->block_size * s->uv->n_blocks);
+    assert(s->next_block * s->uv->block_size + s->scheduled + size <=
+           s->uv->block_size * s->uv->n_blocks);
 
     rv = ensure_segment_write_buf_is_large_enough(s, s->scheduled + size);
     if (rv != 0) {
@@ -189,7 +366,7 @@ static int encode_entries_to_segment_write_buf(struct segment *s,
     cursor = s->arena.base + s->scheduled;
 
     if (s->scheduled == 0 && s->next_block == 0) {
-        byte__put64(&cursor, IO_UV__DISK_FORMAT);
+        byte__put64(&cursor, s->uv->format);
     }
 
     /* Placeholder of the checksums */
@@ -200,31 +377,108 @@ static int encode_entries_to_segment_write_buf(struct segment *s,
 
     /* Batch header */
     header = cursor;
-    io_uv__encode_batch_header(req->entries, req->n, cursor);
-    crc1 = byte__crc32(header, io_uv__sizeof_batch_header(req->n), 0);
-    cursor += io_uv__sizeof_batch_header(req->n);
+    header_len =
+        io_uv__sizeof_segment_batch_header(s->uv->format, req->entries, req->n);
+    io_uv__encode_segment_batch_header(s->uv->format, req->entries, req->n,
+                                       cursor);
+    cursor += header_len;
+
+    /* With per-entry checksums, those are covered by the header checksum and
+     * the data checksum slot is left unused. */
+    checksum = !io_uv__format_has_entry_checksums(s->uv->format);
+    if (!checksum) {
+        size_t len = io_uv__sizeof_batch_checksums(s->uv->format, req->n);
+        void *crc_p = cursor;
+        memset(cursor, 0, len);
+        for (i = 0; i < req->n; i++) {
+            const struct raft_buffer *buf = &req->entries[i].buf;
+            byte__put32(&crc_p, byte__crc32c(buf->base, buf->len, 0));
+        }
+        header_len += len;
+        cursor += len;
+    }
+    crc1 = byte__crc32c(header, header_len, 0);
+
+    /* If the batch is large enough, only decide here which payload bytes get
+     * referenced and which ones copied, leaving the work to a disk thread. If
+     * there's no memory to describe it, just do it inline. */
+    offload = false;
+    if (s->uv->append_encode_threshold > 0 &&
+        req->size - sizeof(uint32_t) * 2 - header_len >=
+            s->uv->append_encode_threshold) {
+        e->runs = raft_malloc(req->n * sizeof *e->runs);
+        e->n_runs = 0;
+        offload = e->runs != NULL;
+    }
 
-    /* Batch data */
+    /* Batch data. Payloads which are adjacent in memory, like the ones of the
+     * entries of a batch received from the leader, are handled as a single
+     * buffer, so their blocks can be written straight from it. */
     crc2 = 0;
-    for (i = 0; i < req->n; i++) {
-        const struct raft_entry *entry = &req->entries[i];
+    i = 0;
+    while (i < req->n) {
+        struct raft_buffer run = req->entries[i].buf;
 
         /* TODO: enforce the requirment of 8-byte aligment also in the
          * higher-level APIs. */
-        assert(entry->buf.len % sizeof(uint64_t) == 0);
+        assert(run.len % sizeof(uint64_t) == 0);
+
+        for (i++; i < req->n; i++) {
+            const struct raft_buffer *buf = &req->entries[i].buf;
+            assert(buf->len % sizeof(uint64_t) == 0);
+            if (buf->len == 0) {
+                continue;
+            }
+            if (run.len == 0) {
+                run = *buf;
+                continue;
+            }
+            if (buf->base != run.base + run.len) {
+                break;
+            }
+            run.len += buf->len;
+        }
+
+        if (run.len == 0) {
+            continue;
+        }
 
-        memcpy(cursor, entry->buf.base, entry->buf.len);
-        crc2 = byte__crc32(cursor, entry->buf.len, crc2);
+        if (offload) {
+            struct encode_run *r = &e->runs[e->n_runs++];
+            r->base = run.base;
+            r->len = run.len;
+            r->dst = reference_entry_payload(s, &run, cursor) ? NULL : cursor;
+        } else {
+            if (checksum) {
+                crc2 = byte__crc32c(run.base, run.len, crc2);
+            }
+            if (!reference_entry_payload(s, &run, cursor)) {
+                memcpy(cursor, run.base, run.len);
+            }
+        }
 
-        cursor += entry->buf.len;
+        cursor += run.len;
     }
 
     byte__put32(&crc1_p, crc1);
-    byte__put32(&crc2_p, crc2);
 
     s->scheduled += size;
     s->last_index += req->n;
 
+    req->end = s->next_block * s->uv->block_size + s->scheduled;
+
+    if (offload) {
+        e->start = start;
+        e->crc2_p = crc2_p;
+        e->checksum = checksum;
+        e->work.data = s;
+        s->encoding = true;
+        io_uv__queue_work(s->uv, &e->work, encode_work_cb,
+                          encode_after_work_cb);
+    } else {
+        byte__put32(&crc2_p, crc2);
+    }
+
     return 0;
 }
 
@@ -232,8 +486,12 @@ static int encode_entries_to_segment_write_buf(struct segment *s,
 static void finalize_segment(struct segment *s)
 {
     struct io_uv *uv = s->uv;
+    unsigned i;
     int rv;
 
+    assert(s->n_busy == 0);
+    assert(!s->encoding);
+
     rv = io_uv__finalize(uv, s->counter, s->written, s->first_index,
                          s->last_index);
     if (rv != 0) {
@@ -244,8 +502,9 @@ static void finalize_segment(struct segment *s)
 
     uv__file_close(s->file, (uv__file_close_cb)raft_free);
 
-    if (s->arena.base != NULL) {
-        free(s->arena.base);
+    io_uv__arena_put(uv, &s->arena);
+    for (i = 0; i < N_WRITE_SLOTS; i++) {
+        io_uv__arena_put(uv, &s->writes[i].arena);
     }
     RAFT__QUEUE_REMOVE(&s->queue);
 
@@ -253,9 +512,26 @@ static void finalize_segment(struct segment *s)
     io_uv__maybe_close(uv);
 }
 
+/* Release the given append request and fire its callback. The request is put
+ * back first, since the callback might close the io_uv object. */
+static void append_finish(struct io_uv *uv, struct append *r, int status)
+{
+    void (*cb)(void *data, int status) = r->cb;
+    void *data = r->data;
+    uint64_t start;
+    io_uv__record(uv, RAFT_IO_UV_RECORD_APPEND_DONE, status, 0, r->n, 0,
+                  (unsigned)((uv_hrtime() - r->queued_at) / 1000));
+    pool__put(&uv->append_pool, r);
+    start = io_uv__stall_start(uv);
+    cb(data, status);
+    io_uv__stall_end(uv, RAFT_IO_UV_STALL_APPEND, start);
+}
+
 /* Flush the append requests in the given queue, firing their callbacks with the
  * given status. */
-static void flush_append_requests(raft__queue *queue, int status)
+static void flush_append_requests(struct io_uv *uv,
+                                  raft__queue *queue,
+                                  int status)
 {
     raft__queue queue_copy;
 
@@ -273,153 +549,426 @@ static void flush_append_requests(raft__queue *queue, int status)
         head = RAFT__QUEUE_HEAD(&queue_copy);
         RAFT__QUEUE_REMOVE(head);
         r = RAFT__QUEUE_DATA(head, struct append, queue);
-        r->cb(r->data, status);
-        raft_free(r);
+        append_finish(uv, r, status);
     }
 }
 
-static void process_requests(struct io_uv *uv);
-static void segment_write_cb(struct uv__file_write *write, const int status)
+
+/* Return #true if a write in flight covers the given block. */
+static bool segment_block_is_busy(struct segment *s, unsigned block)
+{
+    size_t block_size = s->uv->block_size;
+    unsigned i;
+
+    for (i = 0; i < N_WRITE_SLOTS; i++) {
+        struct segment_write *w = &s->writes[i];
+        if (w->state != WRITE_PENDING) {
+            continue;
+        }
+        if (block >= w->start / block_size &&
+            block < (w->start + w->len) / block_size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Move to the given queue the append requests whose data has been entirely
+ * written, setting their status. */
+static void segment_collect_append_requests(struct segment *s,
+                                            raft__queue *queue)
 {
-    struct segment *s = write->data;
     struct io_uv *uv = s->uv;
-    unsigned n_blocks;
-    int result = 0;
+
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs)) {
+        struct append *req;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&uv->append_writing_reqs);
+        req = RAFT__QUEUE_DATA(head, struct append, queue);
+        if (req->segment != s || req->end > s->written) {
+            break;
+        }
+        req->status = s->status;
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(queue, head);
+    }
+}
+
+/* Advance the written marker of the segment past all completed writes that are
+ * contiguous to it, and move to the given queue the append requests that were
+ * fulfilled. Once a write fails, all further requests fail too, since the data
+ * after it can't be loaded anymore. */
+static void segment_advance(struct segment *s, raft__queue *queue)
+{
+    bool advanced;
+    unsigned i;
+
+    do {
+        advanced = false;
+        for (i = 0; i < N_WRITE_SLOTS; i++) {
+            struct segment_write *w = &s->writes[i];
+            if (w->state != WRITE_DONE || w->start > s->written) {
+                continue;
+            }
+            if (w->status != 0) {
+                s->status = w->status;
+            }
+            if (w->end > s->written) {
+                s->written = w->end;
+            }
+            w->state = WRITE_IDLE;
+            s->n_busy--;
+            advanced = true;
+            segment_collect_append_requests(s, queue);
+        }
+    } while (advanced);
+}
+
+static void segment_write_cb(struct uv__file_write *req, const int status)
+{
+    struct segment_write *w = req->data;
+    struct segment *s = w->segment;
+    struct io_uv *uv = s->uv;
+    uint64_t sample;
+    raft__queue queue;
 
     assert(uv->state != IO_UV__CLOSED);
+    assert(w->state == WRITE_PENDING);
 
-    assert(s->buf.len % uv->block_size == 0);
-    assert(s->buf.len >= uv->block_size);
+    assert(w->len % uv->block_size == 0);
+    assert(w->len >= uv->block_size);
 
     /* Check if the write was successful. */
-    if (status != (int)s->buf.len) {
+    w->status = 0;
+    if (status != (int)w->len) {
         assert(status != UV_ECANCELED); /* We never cancel write requests */
         if (status < 0) {
             errorf(uv->io, "write: %s", uv_strerror(status));
         } else {
             errorf(uv->io, "only %d bytes written", status);
         }
-        result = RAFT_ERR_IO;
+        w->status = RAFT_ERR_IO;
         uv->errored = true;
     }
 
-    s->written = s->next_block * uv->block_size + s->scheduled;
+    w->state = WRITE_DONE;
+    s->n_pending--;
 
-    /* Update our write markers.
-     *
-     * We have four cases:
-     *
-     * - The data fit completely in the leftover space of the first block that
-     *   we wrote and there is more space left. In this case we just keep the
-     *   scheduled marker unchanged.
-     *
-     * - The data fit completely in the leftover space of the first block that
-     *   we wrote and there is no space left. In this case we advance the
-     *   current block counter, reset the first write block and set the
-     *   scheduled marker to 0.
-     *
-     * - The data did not fit completely in the leftover space of the first
-     *   block that we wrote, so we wrote more than one block. The last block
-     *   that we wrote was not filled completely and has leftover space. In this
-     *   case we advance the current block counter and copy the memory used for
-     *   the last block to the head of the write arena list, updating the
-     *   scheduled marker accordingly.
-     *
-     * - The data did not fit completely in the leftover space of the first
-     *   block that we wrote, so we wrote more than one block. The last block
-     *   that we wrote was filled exactly and has no leftover space. In this
-     *   case we advance the current block counter, reset the first buffer and
-     *   set the scheduled marker to 0.
-     */
-    n_blocks = s->buf.len / uv->block_size; /* Number of blocks writen. */
-    if (s->scheduled < uv->block_size) {
-        /* Nothing to do */
-        assert(n_blocks == 1);
-    } else if (s->scheduled == uv->block_size) {
-        assert(n_blocks == 1);
-        s->next_block++;
-        s->scheduled = 0;
-        memset(s->arena.base, 0, uv->block_size);
+    /* Update the moving average of the write latency. */
+    sample = uv_hrtime() - w->submitted_at;
+    io_uv__record_latency(&uv->stats.append_write, sample);
+    if (w->req.threadpool) {
+        uv->stats.n_write_fallbacks++;
+    }
+    if (uv->append_write_latency == 0) {
+        uv->append_write_latency = sample;
     } else {
-        assert(s->scheduled > uv->block_size);
-        assert(s->buf.len > uv->block_size);
-
-        if (s->scheduled % uv->block_size > 0) {
-            s->next_block += n_blocks - 1;
-            s->scheduled = s->scheduled % uv->block_size;
-            memcpy(s->arena.base,
-                   s->arena.base + (n_blocks - 1) * uv->block_size,
-                   uv->block_size);
-        } else {
-            s->next_block += n_blocks;
-            s->scheduled = 0;
-            memset(s->arena.base, 0, uv->block_size);
+        uv->append_write_latency = (uv->append_write_latency * 7 + sample) / 8;
+    }
+
+    RAFT__QUEUE_INIT(&queue);
+    segment_advance(s, &queue);
+
+    /* If the data was written without syncing it, let the host sync it
+     * together with the data of the other groups. */
+    if (uv->host->shared_sync && !RAFT__QUEUE_IS_EMPTY(&queue)) {
+        while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
+            raft__queue *head;
+            head = RAFT__QUEUE_HEAD(&queue);
+            RAFT__QUEUE_REMOVE(head);
+            RAFT__QUEUE_PUSH(&uv->append_syncing_reqs, head);
         }
+        io_uv__host_sync(uv->host, uv);
     }
 
-    /* Fire the callbacks of all requests that were fulfilled with this
-     * write. */
-    flush_append_requests(&uv->append_writing_reqs, result);
+    /* Fire the callbacks of all requests that were fulfilled, in order. */
+    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
+        struct append *r;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&queue);
+        RAFT__QUEUE_REMOVE(head);
+        r = RAFT__QUEUE_DATA(head, struct append, queue);
+        append_finish(uv, r, r->status);
+    }
 
     process_requests(uv);
 }
 
-/* Submit a file write request to append the entries encoded in the write buffer
- * of the given segment. */
-static int segment_write(struct segment *s)
+/* Submit a file write request for the segment data between the given offsets.
+ * The blocks of the extents in that range are written straight from the entry
+ * buffers, while the rest of the data, which must be held in the arena, is
+ * copied into the buffer of a write slot, so the arena can keep changing while
+ * the write is in flight. */
+static int segment_write(struct segment *s, size_t start, size_t end)
 {
-    unsigned n_blocks;
+    size_t block_size = s->uv->block_size;
+    size_t arena_offset = s->next_block * block_size;
+    struct segment_write *w = NULL;
+    size_t offset; /* Offset of the next byte to add to the write */
+    size_t size;   /* Number of bytes to copy, including padding */
+    char *cursor;
+    size_t len;
+    unsigned i;
+    unsigned j;
     int rv;
 
     assert(s->file != NULL);
     assert(s->arena.base != NULL);
+    assert(start % block_size == 0);
+    assert(start >= arena_offset);
+    assert(end > start);
+    assert(end <= arena_offset + s->scheduled);
+
+    for (i = 0; i < N_WRITE_SLOTS; i++) {
+        if (s->writes[i].state == WRITE_IDLE) {
+            w = &s->writes[i];
+            break;
+        }
+    }
+    assert(w != NULL);
+
+    len = end - start;
+    if (len % block_size != 0) {
+        len += block_size - (len % block_size);
+    }
 
-    n_blocks = s->scheduled / s->uv->block_size;
-    if (s->scheduled % s->uv->block_size != 0) {
-        n_blocks++;
+    size = len;
+    for (i = 0; i < s->n_extents; i++) {
+        struct segment_extent *e = &s->extents[i];
+        if (e->offset >= start && e->offset < end) {
+            assert(e->offset + e->len <= end);
+            size -= e->len;
+        }
+    }
+
+    if (w->arena.len < size) {
+        uv_buf_t buf;
+        rv = io_uv__arena_get(s->uv, size, &buf);
+        if (rv != 0) {
+            return rv;
+        }
+        io_uv__arena_put(s->uv, &w->arena);
+        w->arena = buf;
     }
 
-    s->buf.base = s->arena.base;
-    s->buf.len = n_blocks * s->uv->block_size;
+    /* Copy the data around the extents, setting the remainder of the last
+     * block to 0. Since extents are made of whole blocks, all buffers but the
+     * last one are block-aligned, as direct I/O requires. */
+    cursor = w->arena.base;
+    offset = start;
+    w->n_bufs = 0;
+    j = 0;
+    for (i = 0; i <= s->n_extents; i++) {
+        struct segment_extent *e = i < s->n_extents ? &s->extents[i] : NULL;
+        size_t n; /* Bytes to copy before the extent */
+        uv_buf_t *buf;
+
+        if (e != NULL && (e->offset < start || e->offset >= end)) {
+            s->extents[j++] = *e; /* Not part of this write, keep it */
+            continue;
+        }
 
-    /* Set the remainder of the last block to 0 */
-    if (s->scheduled % s->uv->block_size != 0) {
-        memset(s->buf.base + s->scheduled, 0,
-               s->uv->block_size - (s->scheduled % s->uv->block_size));
+        n = (e != NULL ? e->offset : start + len) - offset;
+        if (n > 0) {
+            size_t copy = (e != NULL ? e->offset : end) - offset;
+            memcpy(cursor, s->arena.base + (offset - arena_offset), copy);
+            memset(cursor + copy, 0, n - copy);
+            buf = &w->bufs[w->n_bufs++];
+            buf->base = cursor;
+            buf->len = n;
+            cursor += n;
+            offset += n;
+        }
+
+        if (e != NULL) {
+            buf = &w->bufs[w->n_bufs++];
+            buf->base = (char *)e->base;
+            buf->len = e->len;
+            offset += e->len;
+        }
     }
+    assert(offset == start + len);
+    assert((size_t)(cursor - w->arena.base) == size);
+    s->n_extents = j;
 
-    rv = uv__file_write(s->file, &s->write, &s->buf, 1,
-                        s->next_block * s->uv->block_size, segment_write_cb);
+    w->len = len;
+    w->start = start;
+    w->end = end;
+    w->submitted_at = uv_hrtime();
 
+    rv = uv__file_write(s->file, &w->req, w->bufs, w->n_bufs, start,
+                        segment_write_cb);
     if (rv != 0) {
         return rv;
     }
 
+    w->state = WRITE_PENDING;
+    s->n_pending++;
+    s->n_busy++;
+
+    return 0;
+}
+
+/* Drop from the arena the blocks that don't need to be written anymore. */
+static void segment_compact(struct segment *s)
+{
+    size_t block_size = s->uv->block_size;
+    unsigned first = s->submitted / block_size; /* First block still needed */
+    size_t shift;
+    unsigned i;
+
+    /* The disk thread encoding a batch holds pointers into the arena. */
+    if (s->encoding) {
+        return;
+    }
+
+    for (i = 0; i < s->n_holes; i++) {
+        if (s->holes[i] < first) {
+            first = s->holes[i];
+        }
+    }
+
+    if (first <= s->next_block) {
+        return;
+    }
+
+    shift = (first - s->next_block) * block_size;
+    assert(shift <= s->scheduled);
+
+    memmove(s->arena.base, s->arena.base + shift, s->scheduled - shift);
+    s->scheduled -= shift;
+    s->next_block = first;
+}
+
+static void append_timer_cb(uv_timer_t *timer)
+{
+    struct io_uv *uv = timer->data;
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_segments)) {
+        process_requests(uv);
+    }
+}
+
+/* Return #true if the data not yet submitted should be held back for a bit, so
+ * it can be coalesced with data queued shortly after. In that case arm the
+ * append timer to submit it later. */
+static bool segment_hold_back(struct segment *s)
+{
+    struct io_uv *uv = s->uv;
+    uint64_t delay;
+    uint64_t elapsed;
+    int rv;
+
+    if (uv->append_coalesce_delay == 0 || uv->state != IO_UV__ACTIVE ||
+        s->finalize) {
+        return false;
+    }
+
+    if (uv->append_coalesce_bytes > 0 &&
+        segment_offset(s) - s->submitted >= uv->append_coalesce_bytes) {
+        return false;
+    }
+
+    /* Don't wait longer than half of the average write latency, since that
+     * would cost more than an extra write. */
+    delay = (uint64_t)uv->append_coalesce_delay * 1000;
+    if (uv->append_write_latency > 0 && uv->append_write_latency / 2 < delay) {
+        delay = uv->append_write_latency / 2;
+    }
+
+    elapsed = uv_hrtime() - s->queued_at;
+    if (elapsed >= delay) {
+        return false;
+    }
+
+    /* Timers have millisecond resolution, so shorter delays expire at the next
+     * loop iteration. */
+    if (!uv_is_active((uv_handle_t *)&uv->append_timer)) {
+        rv = uv_timer_start(&uv->append_timer, append_timer_cb,
+                            (delay - elapsed) / 1000000, 0);
+        assert(rv == 0);
+    }
+
+    return true;
+}
+
+/* Submit write requests for the data in the arena that hasn't been submitted
+ * yet, as long as they don't overlap with writes in flight. Data of a batch
+ * still being encoded by a disk thread is not submitted. */
+static int segment_flush(struct segment *s)
+{
+    size_t block_size = s->uv->block_size;
+    size_t total = s->encoding ? s->encode.start : segment_offset(s);
+    unsigned first;
+    size_t start;
+    unsigned i;
+    int rv;
+
+    /* Rewrite the blocks that were skipped because they were being written, if
+     * that write has completed. */
+    i = 0;
+    while (i < s->n_holes) {
+        unsigned block = s->holes[i];
+        if (s->n_pending == IO_UV__MAX_CONCURRENT_WRITES ||
+            s->n_busy == N_WRITE_SLOTS || segment_block_is_busy(s, block)) {
+            i++;
+            continue;
+        }
+        rv = segment_write(s, block * block_size, (block + 1) * block_size);
+        if (rv != 0) {
+            return rv;
+        }
+        s->n_holes--;
+        s->holes[i] = s->holes[s->n_holes];
+    }
+
+    if (s->submitted == total ||
+        s->n_pending == IO_UV__MAX_CONCURRENT_WRITES ||
+        s->n_busy >= IO_UV__MAX_CONCURRENT_WRITES || segment_hold_back(s)) {
+        goto out;
+    }
+
+    first = s->submitted / block_size;
+    start = first * block_size;
+
+    /* If the block where the new data begins is still being written, write the
+     * blocks after it right away and the block itself once it's free. If all
+     * new data is in that block, wait. */
+    if (segment_block_is_busy(s, first)) {
+        if (total <= start + block_size ||
+            s->n_holes == IO_UV__MAX_CONCURRENT_WRITES) {
+            goto out;
+        }
+        start += block_size;
+    }
+
+    rv = segment_write(s, start, total);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (start != first * block_size) {
+        s->holes[s->n_holes] = first;
+        s->n_holes++;
+    }
+    s->submitted = total;
+
+out:
+    segment_compact(s);
     return 0;
 }
 
 /* Process pending append requests.
  *
- * Submit the relevant write request if the target open segment is available. */
+ * Encode them in the write buffer of the target open segment and submit the
+ * relevant write requests, if the segment is available. */
 static void process_requests(struct io_uv *uv)
 {
     struct segment *segment;
     struct append *req;
     raft__queue *head;
-    raft__queue queue;
-    unsigned n_reqs;
     int rv;
 
-    /* If we are already writing, let's wait. */
-    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs)) {
-        return;
-    }
-
-    /* If we're truncating, let's wait. */
-    if (uv->truncate_work.data != NULL) {
-        return;
-    }
-
 prepare:
     assert(!RAFT__QUEUE_IS_EMPTY(&uv->append_segments));
 
@@ -432,12 +981,16 @@ prepare:
         return;
     }
 
-    /* Let's add to the segment's write buffer all pending requests targeted to
-     * this segment. */
-    RAFT__QUEUE_INIT(&queue);
+    /* The entries following a truncation can't be encoded before it starts,
+     * since the pending writes of the old entries must drain first. */
+    if (segment->hold && !uv->truncate_blocking) {
+        return;
+    }
 
-    n_reqs = 0;
-    while (!RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs)) {
+    /* Let's add to the segment's write buffer all pending requests targeted to
+     * this segment, unless a disk thread is still encoding one. */
+    while (!segment->encoding &&
+           !RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs)) {
         head = RAFT__QUEUE_HEAD(&uv->append_pending_reqs);
         req = RAFT__QUEUE_DATA(head, struct append, queue);
         assert(req->segment != NULL);
@@ -445,48 +998,59 @@ prepare:
             break; /* Not targeted to this segment */
         }
 
-        RAFT__QUEUE_REMOVE(head);
-        RAFT__QUEUE_PUSH(&queue, head);
-
-        n_reqs++;
+        if (segment->submitted == segment_offset(segment)) {
+            segment->queued_at = uv_hrtime();
+        }
 
         rv = encode_entries_to_segment_write_buf(segment, req);
         if (rv != 0) {
             goto err;
         }
-    }
 
-    /* If we have no more requests for this segment, let's check if it has been
-     * marked for closing, and in that case finalize it and possibly trigger a
-     * write against the next segment (unless there is a truncate request, in
-     * that case we need to wait for it). Otherwise it must mean we have
-     * exhausted the queue of pending append requests. */
-    if (n_reqs == 0) {
-        assert(RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs));
-        if (segment->finalize) {
-            finalize_segment(segment);
-            if (!RAFT__QUEUE_IS_EMPTY(&uv->truncate_reqs)) {
-                return;
-            }
-            if (!RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs)) {
-                goto prepare;
-            }
-        }
-        assert(RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs));
-        return;
-    }
-
-    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
-        head = RAFT__QUEUE_HEAD(&queue);
         RAFT__QUEUE_REMOVE(head);
         RAFT__QUEUE_PUSH(&uv->append_writing_reqs, head);
+        io_uv__record_latency(&uv->stats.append_queue,
+                              uv_hrtime() - req->queued_at);
     }
 
-    rv = segment_write(segment);
+    /* If a truncation is not durable yet, let's wait: the new entries are
+     * already encoded, and get written as soon as it is. Open segments don't
+     * record their first index, so writing them earlier would make them look
+     * like a continuation of the old entries after a crash. */
+    if (uv->truncate_blocking) {
+        return;
+    }
+
+    /* Submit all the writes of this round with a single syscall. */
+    uv__file_cork(segment->file);
+    rv = segment_flush(segment);
+    uv__file_uncork(segment->file);
     if (rv != 0) {
         goto err;
     }
 
+    /* If there's still data to write, let's wait. */
+    if (segment->n_busy > 0 || segment->n_holes > 0 ||
+        segment->submitted < segment_offset(segment)) {
+        return;
+    }
+
+    /* All data has been written, let's check if the segment has been marked
+     * for closing, and in that case finalize it and possibly trigger a write
+     * against the next segment (unless there is a truncate request, in that
+     * case we need to wait for it). Otherwise it must mean we have exhausted
+     * the queue of pending append requests. */
+    assert(RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs));
+    if (segment->finalize) {
+        finalize_segment(segment);
+        if (!RAFT__QUEUE_IS_EMPTY(&uv->truncate_reqs)) {
+            return;
+        }
+        if (!RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs)) {
+            goto prepare;
+        }
+    }
+    assert(RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs));
     return;
 
 err:
@@ -521,7 +1085,7 @@ static void prepare_segment_cb(struct io_uv__prepare *req,
         RAFT__QUEUE_REMOVE(&segment->queue);
         raft_free(segment);
         uv->errored = true;
-        flush_append_requests(&uv->append_writing_reqs, RAFT_ERR_IO);
+        flush_append_requests(uv, &uv->append_writing_reqs, RAFT_ERR_IO);
         return;
     }
 
@@ -537,9 +1101,10 @@ static void prepare_segment_cb(struct io_uv__prepare *req,
 /* Initialize a new open segment object. */
 static void init_segment(struct segment *s, struct io_uv *uv)
 {
+    unsigned i;
+
     s->uv = uv;
     s->prepare.data = s;
-    s->write.data = s;
     s->counter = 0;
     s->file = NULL;
     s->first_index = uv->append_next_index;
@@ -549,8 +1114,26 @@ static void init_segment(struct segment *s, struct io_uv *uv)
     s->arena.base = NULL;
     s->arena.len = 0;
     s->scheduled = 0;
+    s->submitted = 0;
     s->written = 0;
+    s->queued_at = 0;
+    for (i = 0; i < N_WRITE_SLOTS; i++) {
+        struct segment_write *w = &s->writes[i];
+        w->segment = s;
+        w->req.data = w;
+        w->arena.base = NULL;
+        w->arena.len = 0;
+        w->state = WRITE_IDLE;
+    }
+    s->n_pending = 0;
+    s->n_busy = 0;
+    s->n_holes = 0;
+    s->n_extents = 0;
+    s->encode.runs = NULL;
+    s->encoding = false;
+    s->status = 0;
     s->finalize = false;
+    s->hold = false;
 }
 
 /* Submit a prepare request in order to get a new segment, since the append
@@ -604,7 +1187,7 @@ static int enqueue_append_request(struct io_uv *uv, struct append *req)
     if (RAFT__QUEUE_IS_EMPTY(&uv->append_segments)) {
         fits = false;
     } else {
-        tail = RAFT__QUEUE_HEAD(&uv->append_segments);
+        tail = RAFT__QUEUE_TAIL(&uv->append_segments);
         segment = RAFT__QUEUE_DATA(tail, struct segment, queue);
         fits = segment_has_enough_spare_capacity(segment, req->size);
         if (!fits) {
@@ -628,6 +1211,7 @@ static int enqueue_append_request(struct io_uv *uv, struct append *req)
     reserve_segment_capacity(segment, req->size);
 
     req->segment = segment;
+    req->queued_at = uv_hrtime();
 
     RAFT__QUEUE_PUSH(&uv->append_pending_reqs, &req->queue);
 
@@ -651,27 +1235,36 @@ int io_uv__append(struct raft_io *io,
 {
     struct io_uv *uv;
     struct append *req;
+    uint64_t size = 0;
+    unsigned i;
     int rv;
 
     uv = io->impl;
 
-    req = raft_malloc(sizeof *req);
+    req = pool__get(&uv->append_pool, sizeof *req);
     if (req == NULL) {
         rv = RAFT_ENOMEM;
         goto err;
     }
 
-    init_append_req(req, entries, n, data, cb);
+    init_append_req(req, uv->format, entries, n, data, cb);
 
     rv = enqueue_append_request(uv, req);
     if (rv != 0) {
         goto err_after_req_alloc;
     }
 
+    if (uv->record.fd != -1) {
+        for (i = 0; i < n; i++) {
+            size += entries[i].buf.len;
+        }
+        io_uv__record(uv, RAFT_IO_UV_RECORD_APPEND, 0, 0, n, size, 0);
+    }
+
     return 0;
 
 err_after_req_alloc:
-    raft_free(req);
+    pool__put(&uv->append_pool, req);
 
 err:
     assert(rv != 0);
@@ -703,7 +1296,8 @@ static void finalize_current_segment(struct io_uv *uv)
             break;
         }
     }
-    has_writing_reqs = !RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs);
+    has_writing_reqs =
+        !RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs) || s->n_busy > 0;
 
     /* If there is no pending append request or inflight write against the
      * current segment, we can submit a request for it to be closed
@@ -720,6 +1314,8 @@ static void finalize_current_segment(struct io_uv *uv)
 
 int io_uv__append_flush(struct io_uv *uv)
 {
+    struct segment *segment;
+    raft__queue *tail;
     int rv;
 
     finalize_current_segment(uv);
@@ -729,22 +1325,82 @@ int io_uv__append_flush(struct io_uv *uv)
         return rv;
     }
 
+    tail = RAFT__QUEUE_TAIL(&uv->append_segments);
+    segment = RAFT__QUEUE_DATA(tail, struct segment, queue);
+    segment->hold = true;
+
     return 0;
 }
 
 void io_uv__append_unblock(struct io_uv *uv)
 {
-    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs)) {
+    struct segment *segment;
+    raft__queue *head;
+
+    if (RAFT__QUEUE_IS_EMPTY(&uv->append_segments)) {
+        return;
+    }
+
+    /* The truncation is done with the oldest segment being held, the others
+     * might be waiting for later ones. */
+    head = RAFT__QUEUE_HEAD(&uv->append_segments);
+    segment = RAFT__QUEUE_DATA(head, struct segment, queue);
+    segment->hold = false;
+
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_pending_reqs) ||
+        !RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs)) {
         process_requests(uv);
     }
 }
 
+void io_uv__append_sync_start(struct io_uv *uv)
+{
+    assert(RAFT__QUEUE_IS_EMPTY(&uv->append_round_reqs));
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->append_syncing_reqs)) {
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&uv->append_syncing_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&uv->append_round_reqs, head);
+    }
+}
+
+void io_uv__append_synced(struct io_uv *uv, int status)
+{
+    raft__queue queue;
+
+    if (status != 0) {
+        uv->errored = true;
+    }
+
+    RAFT__QUEUE_INIT(&queue);
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->append_round_reqs)) {
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&uv->append_round_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&queue, head);
+    }
+
+    /* Fire the callbacks in order, failing the requests whose data might not
+     * have been persisted. */
+    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
+        struct append *r;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&queue);
+        RAFT__QUEUE_REMOVE(head);
+        r = RAFT__QUEUE_DATA(head, struct append, queue);
+        append_finish(uv, r, r->status != 0 ? r->status : status);
+    }
+
+    io_uv__compact_unblock(uv);
+    io_uv__maybe_close(uv);
+}
+
 void io_uv__append_stop(struct io_uv *uv)
 {
     struct segment *s;
     raft__queue *tail;
 
-    flush_append_requests(&uv->append_pending_reqs, RAFT_ERR_IO_CANCELED);
+    flush_append_requests(uv, &uv->append_pending_reqs, RAFT_ERR_IO_CANCELED);
     finalize_current_segment(uv);
 
     /* Also finalize the segments that we didn't write at all and are just
@@ -759,4 +1415,9 @@ void io_uv__append_stop(struct io_uv *uv)
         assert(s->written == 0);
         finalize_segment(s);
     }
+
+    /* Submit any data that was being held back to be coalesced. */
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_segments)) {
+        process_requests(uv);
+    }
 }
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#include "assert.h"
+#include "io_uv.h"
+
+/* Write buffers of open segments must be aligned to the block size for direct
+ * I/O. Since they are large and an ingesting server keeps creating new open
+ * segments, released buffers are kept around and handed out again, instead of
+ * being freed and allocated from scratch for each segment.
+ *
+ * If huge pages are enabled, buffers of at least half a huge page are rounded
+ * up to a multiple of the huge page size and aligned to it, and the kernel is
+ * advised to back them with transparent huge pages, reducing TLB pressure.
+ *
+ * If a NUMA node is set, buffers are aligned to at least the page size, so
+ * their pages can be bound to it without affecting other allocations. */
+
+/* Round @size up to a multiple of @unit. */
+static size_t round_up(size_t size, size_t unit)
+{
+    if (size % unit != 0) {
+        size += unit - (size % unit);
+    }
+    return size;
+}
+
+void io_uv__numa_bind(int node, void *base, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask[IO_UV__MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    unsigned long bits = 8 * sizeof mask[0];
+
+    if (node < 0) {
+        return;
+    }
+
+    memset(mask, 0, sizeof mask);
+    mask[(unsigned)node / bits] |= 1UL << ((unsigned)node % bits);
+
+    /* Ignore errors, for example if the node has no memory or the kernel has
+     * no NUMA support: the pages are just placed on first touch. */
+    syscall(SYS_mbind, base, len, MPOL_PREFERRED, mask,
+            IO_UV__MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+#else
+    (void)node;
+    (void)base;
+    (void)len;
+#endif
+}
+
+int io_uv__arena_get(struct io_uv *uv, size_t size, uv_buf_t *buf)
+{
+    size_t alignment = uv->block_size;
+    size_t len;
+    unsigned best = uv->n_arenas;
+    unsigned i;
+    void *base;
+
+    assert(uv->block_size > 0);
+
+    /* Pick the smallest released buffer that is large enough. */
+    for (i = 0; i < uv->n_arenas; i++) {
+        if (uv->arenas[i].len < size) {
+            continue;
+        }
+        if (best == uv->n_arenas || uv->arenas[i].len < uv->arenas[best].len) {
+            best = i;
+        }
+    }
+    if (best < uv->n_arenas) {
+        *buf = uv->arenas[best];
+        uv->n_arenas--;
+        uv->arenas[best] = uv->arenas[uv->n_arenas];
+        return 0;
+    }
+
+    len = round_up(size, uv->block_size);
+    if (uv->huge_pages && len >= IO_UV__HUGE_PAGE_SIZE / 2) {
+        alignment = IO_UV__HUGE_PAGE_SIZE;
+        len = round_up(len, IO_UV__HUGE_PAGE_SIZE);
+    }
+    if (uv->numa_node >= 0 && alignment < (size_t)getpagesize()) {
+        alignment = (size_t)getpagesize();
+        len = round_up(len, alignment);
+    }
+
+    base = aligned_alloc(alignment, len);
+    if (base == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    if (alignment == IO_UV__HUGE_PAGE_SIZE) {
+        /* Ignore errors, the buffer just won't be backed by huge pages. */
+        madvise(base, len, MADV_HUGEPAGE);
+    }
+#endif
+    io_uv__numa_bind(uv->numa_node, base, len);
+
+    buf->base = base;
+    buf->len = len;
+
+    return 0;
+}
+
+void io_uv__arena_put(struct io_uv *uv, uv_buf_t *buf)
+{
+    if (buf->base == NULL) {
+        return;
+    }
+    if (uv->n_arenas < IO_UV__MAX_FREE_ARENAS) {
+        uv->arenas[uv->n_arenas] = *buf;
+        uv->n_arenas++;
+    } else {
+        free(buf->base);
+    }
+    buf->base = NULL;
+    buf->len = 0;
+}
+
+void io_uv__arena_close(struct io_uv *uv)
+{
+    unsigned i;
+    for (i = 0; i < uv->n_arenas; i++) {
+        free(uv->arenas[i].base);
+    }
+    uv->n_arenas = 0;
+}
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "../include/raft/io_uv.h"
@@ -5,39 +6,80 @@
 #include "assert.h"
 #include "io_uv.h"
 #include "io_uv_encoding.h"
-#include "logging.h"
+#include "pool.h"
 
 /* The happy path for an io_uv_send request is:
  *
  * - Get the io_uv_client object whose address matches the one of target server.
- * - Encode the message write buffers into the client->stream handle.  Once the
- * - write completes, fire the send request callback.
+ *   Client objects belong to the host, so all groups attached to the same host
+ *   share the same connection to a given peer server.
+ * - Encode the message and cork it in the client->cork_reqs queue. Right before
+ *   the loop blocks for I/O, the host flushes all corked messages of each
+ *   client with a single write request against the client->stream handle.
+ *   Once the write completes, fire the callbacks of the send requests.
+ *   AppendEntries messages in flight that carry the same entries share a
+ *   single encoded batch header, see struct batch.
  *
  * Possible failure modes are:
  *
- * - The io_uv->clients array has no client object with a matching address. In
+ * - The host->clients array has no client object with a matching address. In
  *   this case add a new client object to the array, add the send request to the
  *   queue of pending requests and submit a connection request. Once the
  *   connection request succeeds, try to write the encoded request to the
  *   connected stream handle. If the connection request fails, schedule another
  *   attempt.
  *
- * - The io_uv->clients array has a client object which is not connected. Add
+ * - The host->clients array has a client object which is not connected. Add
  *   the send request to the pending queue, and, if there's no connection
- *   attempt already in progress, start a new one.
+ *   attempt already in progress, start a new one. The pending queue holds at
+ *   most host->send_queue_size bytes: once it's full, the oldest requests fail
+ *   with RAFT_ERR_IO_CONNECT and the peer is reported as congested.
  *
  * - The write request fails (either synchronously or asynchronously). In this
  *   case we fire the request callback with an error, close the connection
  *   stream, and start a re-connection attempt.
+ *
+ * InstallSnapshot messages are sent using a separate client object for each
+ * peer server, with its own connection, see BULK_LANE.
+ *
+ * Messages carrying entries are bulk messages: when uncorking, they are moved
+ * to the client->bulk_reqs queue and written after the other ones, in chunks
+ * of whole messages of at most host->bulk_chunk_size bytes, one chunk at a
+ * time. Since the stream writes in submission order, this way votes, results
+ * and heartbeats submitted while entries are being transferred wait for at
+ * most one chunk, instead of for all the entries queued before them.
+ *
+ * Heartbeats sent by groups attached to a shared host take a different path:
+ * they are buffered in the client->heartbeats queue and, once the host's
+ * heartbeat timer fires, written out as a single IO_UV__HEARTBEATS message. If
+ * no connection is available at that point, they simply fail.
  */
 
 /* Set to 1 to enable tracing. */
 #if 0
-#define tracef(C, MSG, ...) debugf(C->uv->io, MSG, ##__VA_ARGS__)
+#define tracef(C, MSG, ...) \
+    io_uv__host_emit(C->host, RAFT_DEBUG, MSG, ##__VA_ARGS__)
 #else
 #define tracef(C, MSG, ...)
 #endif
 
+/* Connection lanes. Each peer gets a separate connection for InstallSnapshot
+ * messages, so their possibly large payloads don't delay heartbeats, votes and
+ * entries. */
+enum {
+    LATENCY_LANE = 0,
+    BULK_LANE,
+};
+
+/* Scheduling classes of messages. Heartbeats are written along with control
+ * messages, unless a bulk message of the same group is waiting, since they
+ * must not overtake the entries that precede them. */
+enum {
+    CONTROL = 0,
+    HEARTBEAT,
+    BULK,
+};
+
 /* Client state codes. */
 enum {
     CONNECTING = 1,
@@ -47,37 +89,275 @@ enum {
     CLOSED,
 };
 
-/* Maximum number of requests that can be buffered.  */
-#define QUEUE_SIZE 3
-
 struct io_uv__client
 {
-    struct io_uv *uv;                  /* libuv I/O implementation object */
+    struct io_uv__host *host;          /* Host owning the connection */
     struct uv_timer_s timer;           /* Schedule connection attempts */
     struct raft_io_uv_connect connect; /* Connection request */
     struct uv_stream_s *stream;        /* Connection handle */
     unsigned n_connect_attempt;        /* Consecutive connection attempts */
     unsigned id;                       /* ID of the other server */
     char *address;                     /* Address of the other server */
+    int lane;                          /* Kind of traffic carried */
     int state;                         /* Current client state */
     raft__queue send_reqs;             /* Pending send message requests */
-    unsigned n_send_reqs;              /* Number of pending send requests */
+    size_t n_send_bytes;               /* Size of the pending send requests */
+    raft__queue heartbeats;            /* Heartbeats waiting to be coalesced */
+    raft__queue cork_reqs;             /* Messages waiting to be written */
+    raft__queue bulk_reqs;             /* Bulk messages waiting their turn */
+    bool bulk_writing;                 /* A chunk of bulk messages in flight */
+    bool compact;                      /* Peer decodes compact batches */
+    bool seq;                          /* Peer echoes heartbeat rounds */
+};
+
+/* Encoded batch header and payloads of a range of entries, shared by all the
+ * AppendEntries messages carrying them, e.g. when the leader replicates the
+ * same entries to several followers. */
+struct batch
+{
+    raft_index index;  /* Index of the first entry */
+    unsigned n;        /* Number of entries */
+    raft_term term;    /* Term of the last entry */
+    const void *first; /* Payload of the first entry */
+    const void *last;  /* Payload of the last entry */
+    uv_buf_t *bufs;    /* Batch header followed by the entries payloads */
+    unsigned n_bufs;   /* Number of buffers */
+    bool compressed;   /* Whether the payloads were compressed */
+    bool compact;      /* Whether the header uses the compact encoding */
+    unsigned refs;     /* Number of send requests using the batch */
+    raft__queue queue; /* Batches of the group */
 };
 
 /* Hold state for a single send RPC message request. */
 struct send
 {
-    struct io_uv__client *c;  /* Client connected to the target server */
-    struct raft_io_send *req; /* Uer request */
-    uv_buf_t *bufs;           /* Encoded raft RPC message to send */
-    unsigned n_bufs;          /* Number of buffers */
-    uv_write_t write;         /* Stream write request */
-    raft__queue queue;        /* Pending send requests queue */
+    struct io_uv *uv;                  /* Group that submitted the request */
+    struct io_uv__client *c;           /* Client connected to the target */
+    struct raft_io_send *req;          /* Uer request */
+    uv_buf_t *bufs;                    /* Encoded raft RPC message to send */
+    unsigned n_bufs;                   /* Number of buffers */
+    struct batch *batch;               /* Entries to send after the bufs */
+    int kind;                          /* Scheduling class */
+    uv_write_t write;                  /* Stream write request */
+    raft__queue queue;                 /* Pending send requests queue */
+    struct io_uv__heartbeat heartbeat; /* Heartbeat to coalesce, if any */
 };
 
+/* Hold state for a write of coalesced heartbeats. */
+struct heartbeats
+{
+    struct io_uv__client *c; /* Client connected to the target server */
+    uv_buf_t buf;            /* Encoded IO_UV__HEARTBEATS message */
+    uv_write_t write;        /* Stream write request */
+    raft__queue sends;       /* Send requests of the coalesced heartbeats */
+};
+
+/* Hold state for a single write of several corked messages. */
+struct cork
+{
+    struct io_uv__client *c; /* Client connected to the target server */
+    uv_write_t write;        /* Stream write request */
+    raft__queue sends;       /* Send requests of the corked messages */
+    bool bulk;               /* Whether it's a chunk of bulk messages */
+};
+
+/* Replace the entries payloads of the given batch with a single compressed
+ * buffer, if they are big enough and compress well. */
+static int batch_compress(struct io_uv *uv, struct batch *b)
+{
+    size_t threshold = uv->host->compress_threshold;
+    size_t len = 0;
+    uv_buf_t buf;
+    unsigned i;
+    int rv;
+
+    if (threshold == 0) {
+        return 0;
+    }
+    for (i = 0; i < b->n; i++) {
+        len += b->bufs[i + 1].len;
+    }
+    if (len < threshold) {
+        return 0;
+    }
+
+    rv = io_uv__compress(&b->bufs[1], b->n, 0, &buf);
+    if (rv != 0) {
+        return rv;
+    }
+    if (buf.base == NULL) {
+        return 0;
+    }
+
+    b->bufs[1] = buf;
+    b->n_bufs = 2;
+    b->compressed = true;
+
+    return 0;
+}
+
+/* Get a batch holding the given entries, encoding them if no message using
+ * them is in flight.
+ *
+ * A batch is only kept around while some message using it is in flight. Since
+ * the entries of that message can't be released in the meantime, no other
+ * entry can have the same payload address, so comparing the range, the term
+ * of the last entry and the payload addresses of the first and last entries
+ * is enough to tell if a batch holds the given ones. */
+static int batch_get(struct io_uv *uv,
+                     const struct raft_append_entries *p,
+                     bool compact,
+                     struct batch **batch)
+{
+    const struct raft_entry *first = &p->entries[0];
+    const struct raft_entry *last = &p->entries[p->n_entries - 1];
+    struct batch *b;
+    raft__queue *head;
+    unsigned i;
+    int rv;
+
+    RAFT__QUEUE_FOREACH(head, &uv->send_batches)
+    {
+        b = RAFT__QUEUE_DATA(head, struct batch, queue);
+        if (b->index == p->prev_log_index + 1 && b->n == p->n_entries &&
+            b->term == last->term && b->first == first->buf.base &&
+            b->last == last->buf.base && b->compact == compact) {
+            b->refs++;
+            *batch = b;
+            return 0;
+        }
+    }
+
+    b = raft_malloc(sizeof *b);
+    if (b == NULL) {
+        goto oom;
+    }
+    b->bufs = raft_malloc((p->n_entries + 1) * sizeof *b->bufs);
+    if (b->bufs == NULL) {
+        goto oom_after_batch_alloc;
+    }
+    if (compact) {
+        b->bufs[0].len =
+            io_uv__sizeof_compact_batch_header(p->entries, p->n_entries);
+    } else {
+        b->bufs[0].len = io_uv__sizeof_batch_header(p->n_entries);
+    }
+    b->bufs[0].base = raft_malloc(b->bufs[0].len);
+    if (b->bufs[0].base == NULL) {
+        goto oom_after_bufs_alloc;
+    }
+    if (compact) {
+        io_uv__encode_compact_batch_header(p->entries, p->n_entries,
+                                           b->bufs[0].base);
+    } else {
+        io_uv__encode_batch_header(p->entries, p->n_entries, b->bufs[0].base);
+    }
+    for (i = 0; i < p->n_entries; i++) {
+        b->bufs[i + 1].base = p->entries[i].buf.base;
+        b->bufs[i + 1].len = p->entries[i].buf.len;
+    }
+
+    b->index = p->prev_log_index + 1;
+    b->n = p->n_entries;
+    b->n_bufs = p->n_entries + 1;
+    b->compressed = false;
+    b->compact = compact;
+
+    rv = batch_compress(uv, b);
+    if (rv != 0) {
+        goto err_after_header_alloc;
+    }
+
+    b->term = last->term;
+    b->first = first->buf.base;
+    b->last = last->buf.base;
+    b->refs = 1;
+    RAFT__QUEUE_PUSH(&uv->send_batches, &b->queue);
+
+    *batch = b;
+    return 0;
+
+err_after_header_alloc:
+    raft_free(b->bufs[0].base);
+    raft_free(b->bufs);
+    raft_free(b);
+    return rv;
+
+oom_after_bufs_alloc:
+    raft_free(b->bufs);
+oom_after_batch_alloc:
+    raft_free(b);
+oom:
+    return RAFT_ENOMEM;
+}
+
+static void batch_release(struct batch *b)
+{
+    assert(b->refs > 0);
+    b->refs--;
+    if (b->refs > 0) {
+        return;
+    }
+    RAFT__QUEUE_REMOVE(&b->queue);
+    raft_free(b->bufs[0].base);
+    if (b->compressed) {
+        raft_free(b->bufs[1].base);
+    }
+    raft_free(b->bufs);
+    raft_free(b);
+}
+
+/* Return the total number of buffers of the given send request. */
+static unsigned send_n_bufs(struct send *r)
+{
+    unsigned n = r->n_bufs;
+    if (r->batch != NULL) {
+        n += r->batch->n_bufs;
+    }
+    return n;
+}
+
+/* Return the total size of the buffers of the given send request. */
+static size_t send_size(struct send *r)
+{
+    size_t size = 0;
+    unsigned i;
+    for (i = 0; i < r->n_bufs; i++) {
+        size += r->bufs[i].len;
+    }
+    if (r->batch != NULL) {
+        for (i = 0; i < r->batch->n_bufs; i++) {
+            size += r->batch->bufs[i].len;
+        }
+    }
+    return size;
+}
+
+/* Copy the buffers of the given send request into the given array, returning
+ * the number of buffers copied. */
+static unsigned send_copy_bufs(struct send *r, uv_buf_t *bufs)
+{
+    memcpy(bufs, r->bufs, r->n_bufs * sizeof *bufs);
+    if (r->batch != NULL) {
+        memcpy(&bufs[r->n_bufs], r->batch->bufs,
+               r->batch->n_bufs * sizeof *bufs);
+    }
+    return send_n_bufs(r);
+}
+
 /* Free all memory used by the given send request object. */
 static void send_close(struct send *r)
 {
+    if (r->batch != NULL) {
+        batch_release(r->batch);
+        r->batch = NULL;
+    }
+
+    /* Coalesced heartbeats are not encoded individually. */
+    if (r->bufs == NULL) {
+        return;
+    }
+
     /* Just release the first buffer. Further buffers are entry payloads, which
      * we were passed but we don't own. */
     raft_free(r->bufs[0].base);
@@ -86,6 +366,21 @@ static void send_close(struct send *r)
     raft_free(r->bufs);
 }
 
+/* Fire the callback of the given send request and release it. */
+static void send_finish(struct send *r, int status)
+{
+    struct io_uv *uv = r->uv;
+    struct raft_io_send *req = r->req;
+    /* Release the request first, since the callback might release the entries
+     * that a shared batch points to. */
+    send_close(r);
+    pool__put(&uv->send_pool, r);
+    uv->n_sending--;
+    if (req->cb != NULL) {
+        req->cb(req, status);
+    }
+}
+
 static void copy_address(const char *address1, char **address2)
 {
     *address2 = raft_malloc(strlen(address1) + 1);
@@ -97,11 +392,12 @@ static void copy_address(const char *address1, char **address2)
 
 /* Initialize a new client associated with the given server. */
 static int client_init(struct io_uv__client *c,
-                       struct io_uv *uv,
+                       struct io_uv__host *host,
                        unsigned id,
-                       const char *address)
+                       const char *address,
+                       int lane)
 {
-    c->uv = uv;
+    c->host = host;
     c->timer.data = c;
     c->connect.data = c;
     c->stream = NULL;
@@ -111,9 +407,16 @@ static int client_init(struct io_uv__client *c,
     if (c->address == NULL) {
         return RAFT_ENOMEM;
     }
+    c->lane = lane;
     c->state = 0;
     RAFT__QUEUE_INIT(&c->send_reqs);
-    c->n_send_reqs = 0;
+    c->n_send_bytes = 0;
+    RAFT__QUEUE_INIT(&c->heartbeats);
+    RAFT__QUEUE_INIT(&c->cork_reqs);
+    RAFT__QUEUE_INIT(&c->bulk_reqs);
+    c->bulk_writing = false;
+    c->compact = false;
+    c->seq = false;
 
     return 0;
 }
@@ -133,12 +436,12 @@ static void timer_close_cb(struct uv_handle_s *handle)
     raft_free(c);
 }
 
-/* Invoked once an encoded RPC message has been written out. */
+/* Handle the completion of a write against the client stream, returning the
+ * status that the relevant send request callbacks should be fired with. */
 static void client_connect(struct io_uv__client *c);
-static void client_write_cb(struct uv_write_s *write, const int status)
+static void client_requeue_bulk(struct io_uv__client *c);
+static int client_write_done(struct io_uv__client *c, const int status)
 {
-    struct send *r = write->data;
-    struct io_uv__client *c = r->c;
     int cb_status = 0;
 
     tracef(c, "message write completed -> status %d", status);
@@ -154,23 +457,34 @@ static void client_write_cb(struct uv_write_s *write, const int status)
             uv_close((struct uv_handle_s *)c->stream, (uv_close_cb)raft_free);
             c->stream = NULL;
             c->state = CONNECTING;
+            client_requeue_bulk(c);
             client_connect(c); /* Trigger a new connection attempt. */
         } else if (status == UV_ECANCELED) {
             cb_status = RAFT_ERR_IO_CANCELED;
         }
     }
 
-    if (r->req->cb != NULL) {
-        r->req->cb(r->req, cb_status);
-    }
+    return cb_status;
+}
 
-    send_close(r);
-    raft_free(r);
+/* Invoked once an encoded RPC message has been written out. */
+static void client_write_cb(struct uv_write_s *write, const int status)
+{
+    struct send *r = write->data;
+    struct io_uv *uv;
+    int cb_status;
+
+    cb_status = client_write_done(r->c, status);
+
+    uv = r->uv;
+    send_finish(r, cb_status);
+
+    /* The group might be closing and waiting for this request. */
+    io_uv__maybe_close(uv);
 }
 
 int io_uv__client_send(struct io_uv__client *c, struct send *r)
 {
-    int rv;
     assert(c->state == CONNECTED || c->state == DELAY ||
            c->state == CONNECTING);
     r->c = c;
@@ -179,38 +493,46 @@ int io_uv__client_send(struct io_uv__client *c, struct send *r)
      * fail immediately. */
     if (c->state == DELAY || c->state == CONNECTING) {
         assert(c->stream == NULL);
-        if (c->n_send_reqs == QUEUE_SIZE) {
-            /* Fail the last request */
-            tracef(c, "queue full -> evict oldest message");
+        /* Fail the oldest requests until there's room for this one. */
+        while (!RAFT__QUEUE_IS_EMPTY(&c->send_reqs) &&
+               c->n_send_bytes >= c->host->send_queue_size) {
             raft__queue *head;
-            struct send *r;
+            struct send *old;
+            tracef(c, "queue full -> evict oldest message");
             head = RAFT__QUEUE_HEAD(&c->send_reqs);
-            r = RAFT__QUEUE_DATA(head, struct send, queue);
+            old = RAFT__QUEUE_DATA(head, struct send, queue);
             RAFT__QUEUE_REMOVE(head);
-            r->req->cb(r->req, RAFT_ERR_IO_CONNECT);
-            send_close(r);
-            raft_free(r);
-            c->n_send_reqs--;
+            c->n_send_bytes -= send_size(old);
+            send_finish(old, RAFT_ERR_IO_CONNECT);
         }
         tracef(c, "no connection available -> enqueue message");
         RAFT__QUEUE_PUSH(&c->send_reqs, &r->queue);
-        c->n_send_reqs++;
+        c->n_send_bytes += send_size(r);
         return 0;
     }
 
     assert(c->stream != NULL);
-    tracef(c, "connection available -> write message");
-    rv = uv_write(&r->write, c->stream, r->bufs, r->n_bufs, client_write_cb);
-    if (rv != 0) {
-        tracef(c, "write message failed -> rv %d", rv);
-        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
-        return RAFT_ERR_IO;
-    }
-    r->write.data = r;
+    tracef(c, "connection available -> cork message");
+    RAFT__QUEUE_PUSH(&c->cork_reqs, &r->queue);
+    io_uv__host_cork(c->host);
 
     return 0;
 }
 
+/* Move the bulk messages that were waiting for their turn to the queue of
+ * pending requests, after the connection was lost. */
+static void client_requeue_bulk(struct io_uv__client *c)
+{
+    while (!RAFT__QUEUE_IS_EMPTY(&c->bulk_reqs)) {
+        raft__queue *head;
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(&c->bulk_reqs);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        io_uv__client_send(c, r);
+    }
+}
+
 /* Try to execute all send requests that were blocked in the queue waiting for a
  * connection. */
 static void client_flush_queue(struct io_uv__client *c)
@@ -227,14 +549,388 @@ static void client_flush_queue(struct io_uv__client *c)
         RAFT__QUEUE_REMOVE(head);
         rv = io_uv__client_send(c, r);
         if (rv != 0) {
-            if (r->req->cb != NULL) {
-                r->req->cb(r->req, rv);
-            }
-            send_close(r);
-            raft_free(r);
+            send_finish(r, rv);
+        }
+    }
+    c->n_send_bytes = 0;
+}
+
+/* Fire the callbacks of all the given queued send requests. */
+static void client_fail_sends(raft__queue *queue, int status)
+{
+    while (!RAFT__QUEUE_IS_EMPTY(queue)) {
+        raft__queue *head;
+        struct send *r;
+        struct io_uv *uv;
+        head = RAFT__QUEUE_HEAD(queue);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        uv = r->uv;
+        send_finish(r, status);
+        io_uv__maybe_close(uv);
+    }
+}
+
+/* Invoked once a message with coalesced heartbeats has been written out. */
+static void client_heartbeats_write_cb(struct uv_write_s *write,
+                                       const int status)
+{
+    struct heartbeats *w = write->data;
+    int cb_status;
+
+    cb_status = client_write_done(w->c, status);
+    client_fail_sends(&w->sends, cb_status);
+
+    raft_free(w->buf.base);
+    raft_free(w);
+}
+
+/* Write all buffered heartbeats in a single message. */
+static void client_flush_heartbeats(struct io_uv__client *c)
+{
+    struct io_uv__heartbeat *heartbeats;
+    struct heartbeats *w;
+    raft__queue *head;
+    unsigned n = 0;
+    unsigned i;
+    int rv;
+
+    if (RAFT__QUEUE_IS_EMPTY(&c->heartbeats)) {
+        return;
+    }
+
+    /* Heartbeats are retried by raft anyways, don't bother queuing them. */
+    if (c->state != CONNECTED) {
+        rv = RAFT_ERR_IO_CONNECT;
+        goto err;
+    }
+
+    RAFT__QUEUE_FOREACH(head, &c->heartbeats)
+    {
+        n++;
+    }
+
+    w = raft_malloc(sizeof *w);
+    if (w == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    w->c = c;
+    w->write.data = w;
+    RAFT__QUEUE_INIT(&w->sends);
+
+    heartbeats = raft_malloc(n * sizeof *heartbeats);
+    if (heartbeats == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_alloc;
+    }
+    i = 0;
+    RAFT__QUEUE_FOREACH(head, &c->heartbeats)
+    {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        heartbeats[i] = r->heartbeat;
+        i++;
+    }
+    rv = io_uv__encode_heartbeats(heartbeats, n, c->seq, &w->buf);
+    raft_free(heartbeats);
+    if (rv != 0) {
+        goto err_after_alloc;
+    }
+
+    tracef(c, "write %u coalesced heartbeats", n);
+    rv = uv_write(&w->write, c->stream, &w->buf, 1,
+                  client_heartbeats_write_cb);
+    if (rv != 0) {
+        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
+        rv = RAFT_ERR_IO;
+        goto err_after_encode;
+    }
+
+    while (!RAFT__QUEUE_IS_EMPTY(&c->heartbeats)) {
+        head = RAFT__QUEUE_HEAD(&c->heartbeats);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&w->sends, head);
+    }
+
+    return;
+
+err_after_encode:
+    raft_free(w->buf.base);
+err_after_alloc:
+    raft_free(w);
+err:
+    assert(rv != 0);
+    client_fail_sends(&c->heartbeats, rv);
+}
+
+void io_uv__clients_flush(struct io_uv__host *h)
+{
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        client_flush_heartbeats(h->clients[i]);
+    }
+}
+
+/* Write a single message. */
+static int client_write(struct io_uv__client *c, struct send *r)
+{
+    uv_buf_t *bufs = r->bufs;
+    int rv;
+    r->write.data = r;
+    if (r->batch != NULL) {
+        bufs = raft_malloc(send_n_bufs(r) * sizeof *bufs);
+        if (bufs == NULL) {
+            return RAFT_ENOMEM;
+        }
+        send_copy_bufs(r, bufs);
+    }
+    rv = uv_write(&r->write, c->stream, bufs, send_n_bufs(r), client_write_cb);
+    if (bufs != r->bufs) {
+        raft_free(bufs);
+    }
+    if (rv != 0) {
+        tracef(c, "write message failed -> rv %d", rv);
+        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
+        return RAFT_ERR_IO;
+    }
+    return 0;
+}
+
+static void client_write_bulk(struct io_uv__client *c);
+
+/* Invoked once a write of several corked messages has completed. */
+static void client_cork_write_cb(struct uv_write_s *write, const int status)
+{
+    struct cork *w = write->data;
+    struct io_uv__client *c = w->c;
+    bool bulk = w->bulk;
+    int cb_status;
+
+    if (bulk) {
+        c->bulk_writing = false;
+    }
+
+    cb_status = client_write_done(c, status);
+    client_fail_sends(&w->sends, cb_status);
+
+    raft_free(w);
+
+    /* Now it's the turn of the next chunk. */
+    if (bulk) {
+        client_write_bulk(c);
+    }
+}
+
+/* Write all the messages in the given queue with a single write request,
+ * emptying it. */
+static void client_write_sends(struct io_uv__client *c,
+                               raft__queue *sends,
+                               bool bulk)
+{
+    struct cork *w;
+    uv_buf_t *bufs;
+    raft__queue *head;
+    raft__queue queue; /* Messages that could not be written */
+    unsigned n = 0;
+    unsigned n_bufs = 0;
+    int rv;
+
+    RAFT__QUEUE_INIT(&queue);
+
+    RAFT__QUEUE_FOREACH(head, sends)
+    {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        n_bufs += send_n_bufs(r);
+        n++;
+    }
+
+    /* A single control message doesn't need any extra state. */
+    if (n == 1 && !bulk) {
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(sends);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        rv = client_write(c, r);
+        if (rv != 0) {
+            RAFT__QUEUE_PUSH(&queue, head);
+        }
+        client_fail_sends(&queue, RAFT_ERR_IO);
+        return;
+    }
+
+    w = raft_malloc(sizeof *w);
+    if (w == NULL) {
+        goto err;
+    }
+    w->c = c;
+    w->write.data = w;
+    RAFT__QUEUE_INIT(&w->sends);
+    w->bulk = bulk;
+
+    /* The write request keeps its own copy of the buffers array. */
+    bufs = raft_malloc(n_bufs * sizeof *bufs);
+    if (bufs == NULL) {
+        goto err_after_alloc;
+    }
+    n_bufs = 0;
+    RAFT__QUEUE_FOREACH(head, sends)
+    {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        n_bufs += send_copy_bufs(r, &bufs[n_bufs]);
+    }
+
+    tracef(c, "write %u corked messages", n);
+    rv = uv_write(&w->write, c->stream, bufs, n_bufs, client_cork_write_cb);
+    raft_free(bufs);
+    if (rv != 0) {
+        /* UNTESTED: what are the error conditions? perhaps ENOMEM */
+        raft_free(w);
+        client_fail_sends(sends, RAFT_ERR_IO);
+        return;
+    }
+
+    while (!RAFT__QUEUE_IS_EMPTY(sends)) {
+        head = RAFT__QUEUE_HEAD(sends);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&w->sends, head);
+    }
+    if (bulk) {
+        c->bulk_writing = true;
+    }
+
+    return;
+
+err_after_alloc:
+    raft_free(w);
+err:
+    /* Fall back to writing the messages one by one. */
+    while (!RAFT__QUEUE_IS_EMPTY(sends)) {
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(sends);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        rv = client_write(c, r);
+        if (rv != 0) {
+            RAFT__QUEUE_PUSH(&queue, head);
+        }
+    }
+    client_fail_sends(&queue, RAFT_ERR_IO);
+}
+
+/* Write the next chunk of bulk messages, unless one is still in flight. A
+ * chunk holds at least one message. */
+static void client_write_bulk(struct io_uv__client *c)
+{
+    raft__queue chunk;
+    size_t size = 0;
+
+    if (c->bulk_writing || c->state != CONNECTED) {
+        return;
+    }
+
+    RAFT__QUEUE_INIT(&chunk);
+    while (!RAFT__QUEUE_IS_EMPTY(&c->bulk_reqs)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&c->bulk_reqs);
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        size_t len = send_size(r);
+        if (size > 0 && size + len > c->host->bulk_chunk_size) {
+            break;
         }
+        size += len;
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&chunk, head);
+    }
+
+    if (RAFT__QUEUE_IS_EMPTY(&chunk)) {
+        return;
     }
-    c->n_send_reqs = 0;
+
+    tracef(c, "write chunk of %zu bytes of bulk messages", size);
+    client_write_sends(c, &chunk, true);
+}
+
+/* Return true if a bulk message of the given group is waiting its turn. */
+static bool client_has_bulk(struct io_uv__client *c, struct io_uv *uv)
+{
+    raft__queue *head;
+    RAFT__QUEUE_FOREACH(head, &c->bulk_reqs)
+    {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        if (r->uv == uv) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Write all corked control messages with a single write request, and schedule
+ * the bulk ones after them. */
+static void client_uncork(struct io_uv__client *c)
+{
+    raft__queue *head;
+
+    if (RAFT__QUEUE_IS_EMPTY(&c->cork_reqs)) {
+        return;
+    }
+
+    /* If the connection was lost in the meantime, queue the messages until a
+     * new one is established. */
+    if (c->state != CONNECTED) {
+        while (!RAFT__QUEUE_IS_EMPTY(&c->cork_reqs)) {
+            struct send *r;
+            head = RAFT__QUEUE_HEAD(&c->cork_reqs);
+            r = RAFT__QUEUE_DATA(head, struct send, queue);
+            RAFT__QUEUE_REMOVE(head);
+            io_uv__client_send(c, r);
+        }
+        return;
+    }
+
+    /* Move the bulk messages out of the way, preserving their order. */
+    head = RAFT__QUEUE_NEXT(&c->cork_reqs);
+    while (head != &c->cork_reqs) {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        head = RAFT__QUEUE_NEXT(head);
+        if (r->kind == BULK ||
+            (r->kind == HEARTBEAT && client_has_bulk(c, r->uv))) {
+            RAFT__QUEUE_REMOVE(&r->queue);
+            RAFT__QUEUE_PUSH(&c->bulk_reqs, &r->queue);
+        }
+    }
+
+    if (!RAFT__QUEUE_IS_EMPTY(&c->cork_reqs)) {
+        client_write_sends(c, &c->cork_reqs, false);
+    }
+    client_write_bulk(c);
+}
+
+void io_uv__clients_uncork(struct io_uv__host *h)
+{
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        client_uncork(h->clients[i]);
+    }
+}
+
+/* Return the delay before the next connection attempt. The delay doubles after
+ * each consecutive failed attempt, and is randomized between half of it and
+ * all of it, so clients that lost their connection at the same time, e.g.
+ * because the peer restarted, don't all retry at once. */
+static unsigned client_retry_delay(struct io_uv__client *c)
+{
+    struct io_uv__host *h = c->host;
+    unsigned delay = h->connect_retry_min_delay;
+    unsigned i;
+
+    for (i = 1; i < c->n_connect_attempt; i++) {
+        if (delay >= h->connect_retry_max_delay / 2) {
+            delay = h->connect_retry_max_delay;
+            break;
+        }
+        delay *= 2;
+    }
+
+    return delay - (unsigned)rand() % (delay / 2 + 1);
 }
 
 static void client_timer_cb(uv_timer_t *timer)
@@ -262,7 +958,7 @@ static void client_connect_cb(struct raft_io_uv_connect *req,
     /* If the transport has been closed before the connection was fully setup,
      * it means that we're shutting down: let's bail out. */
     if (status == RAFT_ERR_IO_CANCELED) {
-        /* We must be careful to not reference c->uv, since that io_uv object
+        /* We must be careful to not reference c->host, since that host object
          * might have been released already. */
         assert(stream == NULL);
         assert(c->state == CLOSING);
@@ -279,6 +975,10 @@ static void client_connect_cb(struct raft_io_uv_connect *req,
         c->state = CONNECTED;
         c->n_connect_attempt = 0;
         c->stream->data = c;
+        /* The peer might have been restarted with another version, wait for
+         * it to advertise its features again. */
+        c->compact = false;
+        c->seq = false;
         client_flush_queue(c);
         return;
     }
@@ -289,13 +989,12 @@ static void client_connect_cb(struct raft_io_uv_connect *req,
         level = RAFT_WARN;
     }
 
-    c->uv->io->emit(c->uv->io, level, "connect to %d (%s): %s", c->id,
-                    c->address, raft_strerror(status));
+    io_uv__host_emit(c->host, level, "connect to %d (%s): %s", c->id,
+                     c->address, raft_strerror(status));
 
     /* Let's schedule another attempt. */
     c->state = DELAY;
-    rv = uv_timer_start(&c->timer, client_timer_cb, c->uv->connect_retry_delay,
-                        0);
+    rv = uv_timer_start(&c->timer, client_timer_cb, client_retry_delay(c), 0);
     assert(rv == 0);
 }
 
@@ -306,13 +1005,13 @@ static void client_connect(struct io_uv__client *c)
     assert(c->stream == NULL);
 
     c->n_connect_attempt++;
-    rv = c->uv->transport->connect(c->uv->transport, &c->connect, c->id,
-                                   c->address, client_connect_cb);
+    rv = c->host->transport->connect(c->host->transport, &c->connect, c->id,
+                                     c->address, client_connect_cb);
     if (rv != 0) {
         /* Restart the timer, so we can retry. */
         c->state = DELAY;
-        rv = uv_timer_start(&c->timer, client_timer_cb,
-                            c->uv->connect_retry_delay, 0);
+        rv = uv_timer_start(&c->timer, client_timer_cb, client_retry_delay(c),
+                            0);
         assert(rv == 0);
         return;
     }
@@ -326,14 +1025,15 @@ static void client_start(struct io_uv__client *c)
     int rv;
     assert(c->state == 0);
     assert(c->stream == NULL);
-    rv = uv_timer_init(c->uv->loop, &c->timer);
+    rv = uv_timer_init(c->host->loop, &c->timer);
     assert(rv == 0);
     client_connect(c); /* Make a first connection attempt right away. */
 }
 
-static int client_get(struct io_uv *uv,
+static int client_get(struct io_uv__host *h,
                       const unsigned id,
                       const char *address,
+                      int lane,
                       struct io_uv__client **client)
 {
     struct io_uv__client **clients;
@@ -342,10 +1042,10 @@ static int client_get(struct io_uv *uv,
     int rv;
 
     /* Check if we already have a client object for this peer server. */
-    for (i = 0; i < uv->n_clients; i++) {
-        *client = uv->clients[i];
+    for (i = 0; i < h->n_clients; i++) {
+        *client = h->clients[i];
 
-        if ((*client)->id == id) {
+        if ((*client)->id == id && (*client)->lane == lane) {
             /* TODO: handle a change in the address */
             assert(strcmp((*client)->address, address) == 0);
             assert((*client)->state == CONNECTED || (*client)->state == DELAY ||
@@ -355,15 +1055,15 @@ static int client_get(struct io_uv *uv,
     }
 
     /* Grow the connections array */
-    n_clients = uv->n_clients + 1;
-    clients = raft_realloc(uv->clients, n_clients * sizeof *clients);
+    n_clients = h->n_clients + 1;
+    clients = raft_realloc(h->clients, n_clients * sizeof *clients);
     if (clients == NULL) {
         rv = RAFT_ENOMEM;
         goto err;
     }
 
-    uv->clients = clients;
-    uv->n_clients = n_clients;
+    h->clients = clients;
+    h->n_clients = n_clients;
 
     /* Initialize the new connection */
     *client = raft_malloc(sizeof **client);
@@ -374,7 +1074,7 @@ static int client_get(struct io_uv *uv,
 
     clients[n_clients - 1] = *client;
 
-    rv = client_init(*client, uv, id, address);
+    rv = client_init(*client, h, id, address, lane);
     if (rv != 0) {
         goto err_after_client_alloc;
     }
@@ -390,7 +1090,7 @@ err_after_client_alloc:
 
 err_after_clients_realloc:
     /* Simply pretend that the connection was not inserted at all */
-    uv->n_clients--;
+    h->n_clients--;
 
 err:
     assert(rv != 0);
@@ -398,6 +1098,87 @@ err:
     return rv;
 }
 
+/* Encode an AppendEntries message, sharing the encoded entries with the other
+ * messages in flight that carry the same ones. The batch header uses the
+ * compact encoding if the peer has advertised it can decode it, and the
+ * heartbeat round is included if the peer has advertised it can echo it. */
+static int send_encode_append_entries(struct send *r,
+                                      const struct io_uv__client *c,
+                                      const struct raft_append_entries *p)
+{
+    struct batch *b;
+    int rv;
+
+    rv = batch_get(r->uv, p, c->compact, &b);
+    if (rv != 0) {
+        goto err;
+    }
+
+    r->bufs = raft_malloc(sizeof *r->bufs);
+    if (r->bufs == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_batch_get;
+    }
+    r->n_bufs = 1;
+
+    rv = io_uv__encode_append_entries_prefix(p, r->uv->group, b->bufs[0].len,
+                                             b->compact, c->seq, &r->bufs[0]);
+    if (rv != 0) {
+        goto err_after_bufs_alloc;
+    }
+
+    if (b->compressed) {
+        io_uv__encode_compressed(r->bufs[0].base);
+    }
+
+    r->batch = b;
+
+    return 0;
+
+err_after_bufs_alloc:
+    raft_free(r->bufs);
+    r->bufs = NULL;
+    r->n_bufs = 0;
+err_after_batch_get:
+    batch_release(b);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Replace the encoded InstallSnapshot message of the given request with a
+ * single buffer holding its header and compressed data, if the data is big
+ * enough and compresses well. */
+static int send_compress_snapshot(struct send *r)
+{
+    size_t threshold = r->uv->host->compress_threshold;
+    uv_buf_t buf;
+    int rv;
+
+    assert(r->n_bufs == 2);
+
+    if (threshold == 0 || r->bufs[1].len < threshold) {
+        return 0;
+    }
+
+    rv = io_uv__compress(&r->bufs[1], 1, r->bufs[0].len, &buf);
+    if (rv != 0) {
+        return rv;
+    }
+    if (buf.base == NULL) {
+        return 0;
+    }
+
+    memcpy(buf.base, r->bufs[0].base, r->bufs[0].len);
+    io_uv__encode_compressed(buf.base);
+
+    raft_free(r->bufs[0].base);
+    r->bufs[0] = buf;
+    r->n_bufs = 1;
+
+    return 0;
+}
+
 int io_uv__send(struct raft_io *io,
                 struct raft_io_send *req,
                 const struct raft_message *message,
@@ -406,30 +1187,77 @@ int io_uv__send(struct raft_io *io,
     struct io_uv *uv = io->impl;
     struct send *r;
     struct io_uv__client *c;
+    int lane;
     int rv;
 
     assert(uv->state == IO_UV__ACTIVE);
 
+    io_uv__record_message(uv, RAFT_IO_UV_RECORD_SEND, message);
+
     /* Allocate a new request object. */
-    r = raft_malloc(sizeof *r);
+    r = pool__get(&uv->send_pool, sizeof *r);
     if (r == NULL) {
         rv = RAFT_ENOMEM;
         goto err;
     }
 
+    r->uv = uv;
     r->req = req;
+    r->bufs = NULL;
+    r->n_bufs = 0;
+    r->batch = NULL;
+    r->kind = CONTROL;
     req->cb = cb;
 
-    rv = io_uv__encode_message(message, &r->bufs, &r->n_bufs);
+    /* Get a client object connected to the target server on the relevant
+     * lane, creating it if it doesn't exist yet. */
+    lane = message->type == RAFT_IO_INSTALL_SNAPSHOT ? BULK_LANE : LATENCY_LANE;
+    rv = client_get(uv->host, message->server_id, message->server_address,
+                    lane, &c);
     if (rv != 0) {
         goto err_after_request_alloc;
     }
 
-    /* Get a client object connected to the target server, creating it if it
-     * doesn't exist yet. */
-    rv = client_get(uv, message->server_id, message->server_address, &c);
+    /* Groups attached to a shared host coalesce their heartbeats, since all
+     * their peers understand IO_UV__HEARTBEATS messages. */
+    if (uv->host != &uv->own_host &&
+        message->type == RAFT_IO_APPEND_ENTRIES &&
+        message->append_entries.n_entries == 0 &&
+        !message->append_entries.hibernate) {
+        r->c = c;
+        r->heartbeat.group = uv->group;
+        r->heartbeat.args = message->append_entries;
+        RAFT__QUEUE_PUSH(&c->heartbeats, &r->queue);
+        io_uv__host_heartbeat(uv->host);
+        uv->n_sending++;
+        return 0;
+    }
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            r->kind = message->append_entries.n_entries > 0 ? BULK : HEARTBEAT;
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+        case RAFT_IO_PROPOSE:
+            r->kind = BULK;
+            break;
+    }
+
+    if (message->type == RAFT_IO_APPEND_ENTRIES &&
+        message->append_entries.n_entries > 0) {
+        rv = send_encode_append_entries(r, c, &message->append_entries);
+    } else {
+        rv = io_uv__encode_message(message, uv->group, &r->bufs, &r->n_bufs);
+    }
     if (rv != 0) {
-        goto err_after_request_encode;
+        goto err_after_request_alloc;
+    }
+
+    if (message->type == RAFT_IO_INSTALL_SNAPSHOT) {
+        rv = send_compress_snapshot(r);
+        if (rv != 0) {
+            goto err_after_request_encode;
+        }
     }
 
     rv = io_uv__client_send(c, r);
@@ -437,13 +1265,15 @@ int io_uv__send(struct raft_io *io,
         goto err_after_request_encode;
     }
 
+    uv->n_sending++;
+
     return 0;
 
 err_after_request_encode:
     send_close(r);
 
 err_after_request_alloc:
-    raft_free(r);
+    pool__put(&uv->send_pool, r);
 
 err:
     assert(rv != 0);
@@ -451,6 +1281,64 @@ err:
     return rv;
 }
 
+/* Return true if the latency lane client connected to the given server can
+ * decode compact batches. */
+static bool client_compact(struct io_uv__host *h, unsigned id)
+{
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        struct io_uv__client *c = h->clients[i];
+        if (c->id == id && c->lane == LATENCY_LANE) {
+            return c->compact;
+        }
+    }
+    return false;
+}
+
+int io_uv__broadcast(struct raft_io *io,
+                     struct raft_io_send *reqs[],
+                     const struct raft_message messages[],
+                     unsigned n,
+                     int statuses[],
+                     raft_io_send_cb cb)
+{
+    struct io_uv *uv = io->impl;
+    struct batch *batch = NULL;
+    bool compact;
+    unsigned i;
+    int rv = 0;
+
+    assert(uv->state == IO_UV__ACTIVE);
+
+    /* Encode the shared entries upfront and hold a reference to them, so the
+     * failure of one message doesn't release them before the next one. If
+     * this fails, each send will just try again. Peers normally all run the
+     * same version, so use the encoding that the first one can decode. */
+    if (n > 0 && messages[0].append_entries.n_entries > 0) {
+        compact = client_compact(uv->host, messages[0].server_id);
+        if (batch_get(uv, &messages[0].append_entries, compact, &batch) !=
+            0) {
+            batch = NULL;
+        }
+    }
+
+    /* The messages get corked, and written together right before the loop
+     * blocks for I/O. */
+    for (i = 0; i < n; i++) {
+        assert(messages[i].type == RAFT_IO_APPEND_ENTRIES);
+        statuses[i] = io_uv__send(io, reqs[i], &messages[i], cb);
+        if (statuses[i] != 0 && rv == 0) {
+            rv = statuses[i];
+        }
+    }
+
+    if (batch != NULL) {
+        batch_release(batch);
+    }
+
+    return rv;
+}
+
 static void stream_close_cb(struct uv_handle_s *handle)
 {
     struct io_uv__client *c = handle->data;
@@ -470,11 +1358,32 @@ static void client_stop(struct io_uv__client *c)
         head = RAFT__QUEUE_HEAD(&c->send_reqs);
         r = RAFT__QUEUE_DATA(head, struct send, queue);
         RAFT__QUEUE_REMOVE(head);
-        if (r->req->cb != NULL) {
-            r->req->cb(r->req, RAFT_ERR_IO_CANCELED);
-        }
-        send_close(r);
-        raft_free(r);
+        send_finish(r, RAFT_ERR_IO_CANCELED);
+    }
+    c->n_send_bytes = 0;
+    while (!RAFT__QUEUE_IS_EMPTY(&c->heartbeats)) {
+        raft__queue *head;
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(&c->heartbeats);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        send_finish(r, RAFT_ERR_IO_CANCELED);
+    }
+    while (!RAFT__QUEUE_IS_EMPTY(&c->cork_reqs)) {
+        raft__queue *head;
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(&c->cork_reqs);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        send_finish(r, RAFT_ERR_IO_CANCELED);
+    }
+    while (!RAFT__QUEUE_IS_EMPTY(&c->bulk_reqs)) {
+        raft__queue *head;
+        struct send *r;
+        head = RAFT__QUEUE_HEAD(&c->bulk_reqs);
+        r = RAFT__QUEUE_DATA(head, struct send, queue);
+        RAFT__QUEUE_REMOVE(head);
+        send_finish(r, RAFT_ERR_IO_CANCELED);
     }
 
     rv = uv_timer_stop(&c->timer);
@@ -507,10 +1416,74 @@ out:
     c->state = CLOSING;
 }
 
-void io_uv__clients_stop(struct io_uv *uv)
+/* Cancel all send requests of the given group in the given queue. Return the
+ * total size of the canceled requests. */
+static size_t client_cancel(raft__queue *queue, struct io_uv *uv)
+{
+    raft__queue *head;
+    size_t size = 0;
+    head = RAFT__QUEUE_NEXT(queue);
+    while (head != queue) {
+        struct send *r = RAFT__QUEUE_DATA(head, struct send, queue);
+        head = RAFT__QUEUE_NEXT(head);
+        if (r->uv != uv) {
+            continue;
+        }
+        RAFT__QUEUE_REMOVE(&r->queue);
+        size += send_size(r);
+        send_finish(r, RAFT_ERR_IO_CANCELED);
+    }
+    return size;
+}
+
+void io_uv__clients_cancel(struct io_uv *uv)
+{
+    struct io_uv__host *h = uv->host;
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        struct io_uv__client *c = h->clients[i];
+        c->n_send_bytes -= client_cancel(&c->send_reqs, uv);
+        client_cancel(&c->heartbeats, uv);
+        client_cancel(&c->cork_reqs, uv);
+        client_cancel(&c->bulk_reqs, uv);
+    }
+}
+
+void io_uv__clients_set_features(struct io_uv__host *h,
+                                 unsigned id,
+                                 uint64_t features)
+{
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        struct io_uv__client *c = h->clients[i];
+        if (c->id != id) {
+            continue;
+        }
+        c->compact = (features & IO_UV__FEATURE_COMPACT) != 0;
+        c->seq = (features & IO_UV__FEATURE_SEQ) != 0;
+    }
+}
+
+bool io_uv__congested(struct raft_io *io, unsigned id)
+{
+    struct io_uv *uv = io->impl;
+    struct io_uv__host *h = uv->host;
+    unsigned i;
+    for (i = 0; i < h->n_clients; i++) {
+        struct io_uv__client *c = h->clients[i];
+        if (c->id != id || c->lane != LATENCY_LANE) {
+            continue;
+        }
+        return c->state != CONNECTED &&
+               c->n_send_bytes >= h->send_queue_size;
+    }
+    return false;
+}
+
+void io_uv__clients_stop(struct io_uv__host *h)
 {
     unsigned i;
-    for (i = 0; i < uv->n_clients; i++) {
-        client_stop(uv->clients[i]);
+    for (i = 0; i < h->n_clients; i++) {
+        client_stop(h->clients[i]);
     }
 }
@@ -0,0 +1,214 @@
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "assert.h"
+#include "heap.h"
+#include "io_uv.h"
+#include "logging.h"
+
+/* Blocking disk I/O is run in a small pool of threads owned by the io_uv
+ * object, rather than in the libuv threadpool. This way raft's fsync latency
+ * is isolated from work queued by the application with uv_queue_work(), and
+ * doesn't depend on UV_THREADPOOL_SIZE.
+ *
+ * Requests are pushed to a pending queue that the threads pop from. Completed
+ * requests are pushed to a done queue, and an async handle wakes up the loop
+ * thread to fire their after work callbacks in completion order. */
+
+void io_uv__disk_pin(struct io_uv *uv)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    unsigned n;
+    unsigned i;
+
+    if (uv->n_disk_cpus == 0) {
+        return;
+    }
+
+    /* Only the CPUs fitting in both sets can be pinned. */
+    n = IO_UV__MAX_CPUS < CPU_SETSIZE ? IO_UV__MAX_CPUS : CPU_SETSIZE;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < n; i++) {
+        if (uv->disk_cpus[i / 64] & ((uint64_t)1 << (i % 64))) {
+            CPU_SET(i, &set);
+        }
+    }
+
+    /* Ignore errors, for example if none of the CPUs is allowed for this
+     * process: the thread just keeps running on any CPU. */
+    sched_setaffinity(0, sizeof set, &set);
+#else
+    (void)uv;
+#endif
+}
+
+static void disk_thread_run(void *arg)
+{
+    struct io_uv *uv = arg;
+
+    /* Memory allocated here is released in the loop thread. */
+    raft_heap_set_thread(uv->disk_heap);
+    io_uv__disk_pin(uv);
+
+    uv_mutex_lock(&uv->disk_mutex);
+    for (;;) {
+        struct io_uv__work *work;
+        raft__queue *head;
+        uint64_t start;
+
+        while (RAFT__QUEUE_IS_EMPTY(&uv->disk_pending) && !uv->disk_exiting) {
+            uv_cond_wait(&uv->disk_cond, &uv->disk_mutex);
+        }
+        if (RAFT__QUEUE_IS_EMPTY(&uv->disk_pending)) {
+            break;
+        }
+
+        head = RAFT__QUEUE_HEAD(&uv->disk_pending);
+        RAFT__QUEUE_REMOVE(head);
+        work = RAFT__QUEUE_DATA(head, struct io_uv__work, queue);
+
+        uv_mutex_unlock(&uv->disk_mutex);
+        start = uv_hrtime();
+        work->work_cb(work);
+        work->duration = uv_hrtime() - start;
+        uv_mutex_lock(&uv->disk_mutex);
+
+        RAFT__QUEUE_PUSH(&uv->disk_done, &work->queue);
+        uv_async_send(&uv->disk_async);
+    }
+    uv_mutex_unlock(&uv->disk_mutex);
+}
+
+/* Fire the after work callbacks of the completed requests. */
+static void disk_async_cb(uv_async_t *async)
+{
+    struct io_uv *uv = async->data;
+    raft__queue queue;
+
+    RAFT__QUEUE_INIT(&queue);
+
+    uv_mutex_lock(&uv->disk_mutex);
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->disk_done)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->disk_done);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&queue, head);
+    }
+    uv_mutex_unlock(&uv->disk_mutex);
+
+    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&queue);
+        struct io_uv__work *work;
+        RAFT__QUEUE_REMOVE(head);
+        work = RAFT__QUEUE_DATA(head, struct io_uv__work, queue);
+        assert(uv->disk_n_inflight > 0);
+        uv->disk_n_inflight--;
+        /* Like the libuv threadpool, only keep the loop alive while there's
+         * work in flight. */
+        if (uv->disk_n_inflight == 0) {
+            uv_unref((uv_handle_t *)&uv->disk_async);
+        }
+        work->after_work_cb(work, 0);
+    }
+}
+
+int io_uv__disk_start(struct io_uv *uv)
+{
+    unsigned i;
+    int rv;
+
+    assert(uv->disk_state == 0);
+    assert(uv->n_disk_threads > 0);
+
+    rv = uv_async_init(uv->loop, &uv->disk_async, disk_async_cb);
+    assert(rv == 0); /* This should never fail */
+    uv->disk_async.data = uv;
+    uv_unref((uv_handle_t *)&uv->disk_async);
+
+    rv = uv_mutex_init(&uv->disk_mutex);
+    assert(rv == 0); /* This should never fail */
+    rv = uv_cond_init(&uv->disk_cond);
+    assert(rv == 0); /* This should never fail */
+
+    uv->disk_exiting = false;
+    uv->disk_heap = heap__current();
+    for (i = 0; i < uv->n_disk_threads; i++) {
+        rv = uv_thread_create(&uv->disk_threads[i], disk_thread_run, uv);
+        if (rv != 0) {
+            errorf(uv->io, "create disk thread: %s", uv_strerror(rv));
+            goto err_after_thread_create;
+        }
+    }
+
+    uv->disk_state = IO_UV__ACTIVE;
+
+    return 0;
+
+err_after_thread_create:
+    uv_mutex_lock(&uv->disk_mutex);
+    uv->disk_exiting = true;
+    uv_cond_broadcast(&uv->disk_cond);
+    uv_mutex_unlock(&uv->disk_mutex);
+    for (; i > 0; i--) {
+        uv_thread_join(&uv->disk_threads[i - 1]);
+    }
+    uv_cond_destroy(&uv->disk_cond);
+    uv_mutex_destroy(&uv->disk_mutex);
+    /* The handle will be closed when the loop is closed. */
+    uv_close((uv_handle_t *)&uv->disk_async, NULL);
+    return RAFT_ERR_IO;
+}
+
+void io_uv__queue_work(struct io_uv *uv,
+                       struct io_uv__work *work,
+                       io_uv__work_cb work_cb,
+                       io_uv__after_work_cb after_work_cb)
+{
+    assert(uv->disk_state == IO_UV__ACTIVE);
+
+    work->work_cb = work_cb;
+    work->after_work_cb = after_work_cb;
+
+    if (uv->disk_n_inflight == 0) {
+        uv_ref((uv_handle_t *)&uv->disk_async);
+    }
+    uv->disk_n_inflight++;
+
+    uv_mutex_lock(&uv->disk_mutex);
+    RAFT__QUEUE_PUSH(&uv->disk_pending, &work->queue);
+    uv_cond_signal(&uv->disk_cond);
+    uv_mutex_unlock(&uv->disk_mutex);
+}
+
+static void disk_async_close_cb(uv_handle_t *handle)
+{
+    struct io_uv *uv = handle->data;
+    assert(uv->disk_state == IO_UV__CLOSING);
+    uv_cond_destroy(&uv->disk_cond);
+    uv_mutex_destroy(&uv->disk_mutex);
+    uv->disk_state = IO_UV__CLOSED;
+    io_uv__maybe_close(uv);
+}
+
+void io_uv__disk_stop(struct io_uv *uv)
+{
+    unsigned i;
+
+    assert(uv->disk_state == IO_UV__ACTIVE);
+    assert(uv->disk_n_inflight == 0);
+
+    uv->disk_state = IO_UV__CLOSING;
+
+    uv_mutex_lock(&uv->disk_mutex);
+    uv->disk_exiting = true;
+    uv_cond_broadcast(&uv->disk_cond);
+    uv_mutex_unlock(&uv->disk_mutex);
+
+    for (i = 0; i < uv->n_disk_threads; i++) {
+        uv_thread_join(&uv->disk_threads[i]);
+    }
+
+    uv_close((uv_handle_t *)&uv->disk_async, disk_async_close_cb);
+}
@@ -1,17 +1,22 @@
 #include <string.h>
 
+#if defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+
 #include "../include/raft/io_uv.h"
 
 #include "assert.h"
 #include "byte.h"
 #include "configuration.h"
+#include "io_uv.h"
 #include "io_uv_encoding.h"
 
 /**
  * Size of the request preable.
  */
-#define RAFT_IO_UV__PREAMBLE_SIZE           \
-    (sizeof(uint64_t) /* Message type. */ + \
+#define RAFT_IO_UV__PREAMBLE_SIZE             \
+    (sizeof(uint64_t) /* Group and type. */ + \
      sizeof(uint64_t) /* Message size. */)
 
 size_t raft_io_uv_sizeof__request_vote()
@@ -19,32 +24,50 @@ size_t raft_io_uv_sizeof__request_vote()
     return sizeof(uint64_t) + /* Term. */
            sizeof(uint64_t) + /* Candidate ID. */
            sizeof(uint64_t) + /* Last log index. */
-           sizeof(uint64_t) /* Last log term. */;
+           sizeof(uint64_t) + /* Last log term. */
+           sizeof(uint64_t) + /* Pre-vote. */
+           sizeof(uint64_t) /* Disrupt leader. */;
 }
 
 static size_t raft_io_uv_sizeof__request_vote_result()
 {
     return sizeof(uint64_t) + /* Term. */
-           sizeof(uint64_t) /* Vote granted. */;
+           sizeof(uint64_t) + /* Vote granted. */
+           sizeof(uint64_t) /* Pre-vote. */;
+}
+
+/* Size of an AppendEntries message with the given batch header. */
+static size_t sizeof_append_entries(const struct raft_append_entries *p,
+                                    size_t header_len,
+                                    bool seq)
+{
+    return sizeof(uint64_t) +             /* Leader's term. */
+           sizeof(uint64_t) +             /* Leader ID */
+           sizeof(uint64_t) +             /* Previous log entry index */
+           sizeof(uint64_t) +             /* Previous log entry term */
+           sizeof(uint64_t) +             /* Leader's commit index */
+           (seq ? sizeof(uint64_t) : 0) + /* Heartbeat round, if sent */
+           header_len +                   /* Batch header */
+           (p->hibernate ? sizeof(uint64_t) : 0) /* Hibernate, if set */;
 }
 
 static size_t raft_io_uv_sizeof__append_entries(
     const struct raft_append_entries *p)
 {
-    return sizeof(uint64_t) + /* Leader's term. */
-           sizeof(uint64_t) + /* Leader ID */
-           sizeof(uint64_t) + /* Previous log entry index */
-           sizeof(uint64_t) + /* Previous log entry term */
-           sizeof(uint64_t) + /* Leader's commit index */
-           sizeof(uint64_t) + /* Number of entries in the batch */
-           16 * p->n_entries /* One header per entry */;
+    return sizeof_append_entries(p, io_uv__sizeof_batch_header(p->n_entries),
+                                 false);
 }
 
 static size_t raft_io_uv_sizeof__append_entries_result()
 {
-    return sizeof(uint64_t) + /* Term. */
-           sizeof(uint64_t) + /* Success. */
-           sizeof(uint64_t) /* Last log index. */;
+    return sizeof(uint64_t) +     /* Term. */
+           sizeof(uint64_t) +     /* Success. */
+           sizeof(uint64_t) +     /* Last log index. */
+           sizeof(uint64_t) +     /* Conflict term. */
+           sizeof(uint64_t) +     /* Conflict index. */
+           sizeof(uint64_t) * 2 + /* Resume hint, zero if not set */
+           sizeof(uint64_t) +     /* Features. */
+           sizeof(uint64_t) /* Heartbeat round. */;
 }
 
 static size_t raft_io_uv_sizeof__install_snapshot(
@@ -58,7 +81,60 @@ static size_t raft_io_uv_sizeof__install_snapshot(
            sizeof(uint64_t) + /* Configuration's index */
            sizeof(uint64_t) + /* Length of configuration */
            conf_size +        /* Configuration data */
-           sizeof(uint64_t);  /* Length of snapshot data */
+           sizeof(uint64_t) + /* Length of snapshot data */
+           sizeof(uint64_t) + /* Offset of the data chunk */
+           sizeof(uint64_t);  /* Whether this is the last chunk */
+}
+
+static size_t raft_io_uv_sizeof__read_index(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) /* Request ID. */;
+}
+
+static size_t raft_io_uv_sizeof__read_index_result(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Request ID. */
+           sizeof(uint64_t) /* Read index. */;
+}
+
+static size_t raft_io_uv_sizeof__timeout_now(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Last log index. */
+           sizeof(uint64_t) /* Last log term. */;
+}
+
+static size_t raft_io_uv_sizeof__send_snapshot(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Target server ID. */
+           sizeof(uint64_t) /* Minimum snapshot index. */;
+}
+
+static size_t raft_io_uv_sizeof__send_snapshot_result(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Target server ID. */
+           sizeof(uint64_t) + /* Installed index. */
+           sizeof(uint64_t) /* Done flag. */;
+}
+
+static size_t raft_io_uv_sizeof__propose(const struct raft_propose *p)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Request ID. */
+           sizeof(uint64_t) + /* Number of entries in the batch */
+           16 * p->n_entries /* One header per entry */;
+}
+
+static size_t raft_io_uv_sizeof__propose_result(void)
+{
+    return sizeof(uint64_t) + /* Term. */
+           sizeof(uint64_t) + /* Request ID. */
+           sizeof(uint64_t) + /* Index of the first entry. */
+           sizeof(uint64_t) /* Status. */;
 }
 
 size_t io_uv__sizeof_batch_header(size_t n)
@@ -67,6 +143,45 @@ size_t io_uv__sizeof_batch_header(size_t n)
            16 * n /* One header per entry */;
 }
 
+size_t io_uv__sizeof_batch_checksums(uint64_t format, size_t n)
+{
+    if (!io_uv__format_has_entry_checksums(format)) {
+        return 0;
+    }
+    return (4 * n + 7) / 8 * 8;
+}
+
+bool io_uv__format_is_compact(uint64_t format)
+{
+    return format == IO_UV__DISK_FORMAT_COMPACT ||
+           format == IO_UV__DISK_FORMAT_COMPACT_ENTRY_CHECKSUMS;
+}
+
+bool io_uv__format_has_entry_checksums(uint64_t format)
+{
+    return format == IO_UV__DISK_FORMAT_ENTRY_CHECKSUMS ||
+           format == IO_UV__DISK_FORMAT_COMPACT_ENTRY_CHECKSUMS;
+}
+
+size_t io_uv__sizeof_compact_batch_header(const struct raft_entry *entries,
+                                          unsigned n)
+{
+    size_t size = sizeof(uint64_t); /* Number of entries and header size */
+    raft_term term = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+        int64_t delta = (int64_t)(entry->term - term);
+        size += byte__sizeof_varint(byte__zigzag(delta));
+        size += sizeof(uint8_t); /* Entry type */
+        size += byte__sizeof_varint(entry->buf.len);
+        term = entry->term;
+    }
+
+    return byte__pad64(size);
+}
+
 static void raft_io_uv_encode__request_vote(const struct raft_request_vote *p,
                                             void *buf)
 {
@@ -76,6 +191,8 @@ static void raft_io_uv_encode__request_vote(const struct raft_request_vote *p,
     byte__put64(&cursor, p->candidate_id);
     byte__put64(&cursor, p->last_log_index);
     byte__put64(&cursor, p->last_log_term);
+    byte__put64(&cursor, p->pre_vote);
+    byte__put64(&cursor, p->disrupt_leader);
 }
 
 static void raft_io_uv_encode__request_vote_result(
@@ -86,6 +203,7 @@ static void raft_io_uv_encode__request_vote_result(
 
     byte__put64(&cursor, p->term);
     byte__put64(&cursor, p->vote_granted);
+    byte__put64(&cursor, p->pre_vote);
 }
 
 static void raft_io_uv_encode__append_entries(
@@ -103,6 +221,14 @@ static void raft_io_uv_encode__append_entries(
     byte__put64(&cursor, p->leader_commit);  /* Commit index. */
 
     io_uv__encode_batch_header(p->entries, p->n_entries, cursor);
+
+    /* Only heartbeats carry the hibernate flag, after the empty batch header,
+     * so peers not knowing about it just ignore it. */
+    if (p->hibernate) {
+        assert(p->n_entries == 0);
+        cursor = (uint8_t *)cursor + sizeof(uint64_t);
+        byte__put64(&cursor, 1);
+    }
 }
 
 static void raft_io_uv_encode__append_entries_result(
@@ -114,6 +240,15 @@ static void raft_io_uv_encode__append_entries_result(
     byte__put64(&cursor, p->term);
     byte__put64(&cursor, p->success);
     byte__put64(&cursor, p->last_log_index);
+    byte__put64(&cursor, p->conflict_term);
+    byte__put64(&cursor, p->conflict_index);
+    byte__put64(&cursor, p->snapshot_index);
+    byte__put64(&cursor, p->snapshot_offset);
+
+    /* We can decode compact AppendEntries messages, and echo rounds. */
+    byte__put64(&cursor, IO_UV__FEATURE_COMPACT | IO_UV__FEATURE_SEQ);
+
+    byte__put64(&cursor, p->seq);
 }
 
 static void raft_io_uv_encode__install_snapshot(
@@ -134,9 +269,86 @@ static void raft_io_uv_encode__install_snapshot(
     configuration__encode_to_buf(&p->conf, cursor);
     cursor += conf_size;
     byte__put64(&cursor, p->data.len); /* Snapshot data size. */
+    byte__put64(&cursor, p->offset);   /* Offset of the data chunk. */
+    byte__put64(&cursor, p->done);     /* Whether this is the last chunk. */
+}
+
+static void raft_io_uv_encode__read_index(const struct raft_read_index *p,
+                                          void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->id);
+}
+
+static void raft_io_uv_encode__read_index_result(
+    const struct raft_read_index_result *p,
+    void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->id);
+    byte__put64(&cursor, p->index);
+}
+
+static void raft_io_uv_encode__timeout_now(const struct raft_timeout_now *p,
+                                           void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->last_log_index);
+    byte__put64(&cursor, p->last_log_term);
+}
+
+static void raft_io_uv_encode__send_snapshot(const struct raft_send_snapshot *p,
+                                             void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->server_id);
+    byte__put64(&cursor, p->last_index);
+}
+
+static void raft_io_uv_encode__send_snapshot_result(
+    const struct raft_send_snapshot_result *p,
+    void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->server_id);
+    byte__put64(&cursor, p->last_index);
+    byte__put64(&cursor, p->done);
+}
+
+static void raft_io_uv_encode__propose(const struct raft_propose *p, void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->id);
+
+    io_uv__encode_batch_header(p->entries, p->n_entries, cursor);
+}
+
+static void raft_io_uv_encode__propose_result(
+    const struct raft_propose_result *p,
+    void *buf)
+{
+    void *cursor = buf;
+
+    byte__put64(&cursor, p->term);
+    byte__put64(&cursor, p->id);
+    byte__put64(&cursor, p->index);
+    byte__put64(&cursor, (uint64_t)p->status);
 }
 
 int io_uv__encode_message(const struct raft_message *message,
+                          unsigned group,
                           uv_buf_t **bufs,
                           unsigned *n_bufs)
 {
@@ -164,6 +376,27 @@ int io_uv__encode_message(const struct raft_message *message,
             header.len +=
                 raft_io_uv_sizeof__install_snapshot(&message->install_snapshot);
             break;
+        case RAFT_IO_READ_INDEX:
+            header.len += raft_io_uv_sizeof__read_index();
+            break;
+        case RAFT_IO_READ_INDEX_RESULT:
+            header.len += raft_io_uv_sizeof__read_index_result();
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            header.len += raft_io_uv_sizeof__timeout_now();
+            break;
+        case RAFT_IO_SEND_SNAPSHOT:
+            header.len += raft_io_uv_sizeof__send_snapshot();
+            break;
+        case RAFT_IO_SEND_SNAPSHOT_RESULT:
+            header.len += raft_io_uv_sizeof__send_snapshot_result();
+            break;
+        case RAFT_IO_PROPOSE:
+            header.len += raft_io_uv_sizeof__propose(&message->propose);
+            break;
+        case RAFT_IO_PROPOSE_RESULT:
+            header.len += raft_io_uv_sizeof__propose_result();
+            break;
         default:
             return RAFT_ERR_IO_MALFORMED;
     };
@@ -175,8 +408,9 @@ int io_uv__encode_message(const struct raft_message *message,
 
     cursor = header.base;
 
-    /* Encode the request preamble, with message type and message size. */
-    byte__put64(&cursor, message->type);
+    /* Encode the request preamble, with group, message type and message
+     * size. */
+    byte__put64(&cursor, (uint64_t)group << 32 | message->type);
     byte__put64(&cursor, header.len - RAFT_IO_UV__PREAMBLE_SIZE);
 
     /* Encode the request header. */
@@ -199,6 +433,30 @@ int io_uv__encode_message(const struct raft_message *message,
             raft_io_uv_encode__install_snapshot(&message->install_snapshot,
                                                 cursor);
             break;
+        case RAFT_IO_READ_INDEX:
+            raft_io_uv_encode__read_index(&message->read_index, cursor);
+            break;
+        case RAFT_IO_READ_INDEX_RESULT:
+            raft_io_uv_encode__read_index_result(&message->read_index_result,
+                                                 cursor);
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            raft_io_uv_encode__timeout_now(&message->timeout_now, cursor);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT:
+            raft_io_uv_encode__send_snapshot(&message->send_snapshot, cursor);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT_RESULT:
+            raft_io_uv_encode__send_snapshot_result(
+                &message->send_snapshot_result, cursor);
+            break;
+        case RAFT_IO_PROPOSE:
+            raft_io_uv_encode__propose(&message->propose, cursor);
+            break;
+        case RAFT_IO_PROPOSE_RESULT:
+            raft_io_uv_encode__propose_result(&message->propose_result,
+                                              cursor);
+            break;
     };
 
     *n_bufs = 1;
@@ -213,6 +471,11 @@ int io_uv__encode_message(const struct raft_message *message,
         *n_bufs += 1;
     }
 
+    /* For Propose request we also send the commands payload. */
+    if (message->type == RAFT_IO_PROPOSE) {
+        *n_bufs += message->propose.n_entries;
+    }
+
     *bufs = raft_calloc(*n_bufs, sizeof **bufs);
     if (*bufs == NULL) {
         goto oom_after_header_alloc;
@@ -235,6 +498,15 @@ int io_uv__encode_message(const struct raft_message *message,
         (*bufs)[1].len = message->install_snapshot.data.len;
     }
 
+    if (message->type == RAFT_IO_PROPOSE) {
+        unsigned i;
+        for (i = 0; i < message->propose.n_entries; i++) {
+            const struct raft_entry *entry = &message->propose.entries[i];
+            (*bufs)[i + 1].base = entry->buf.base;
+            (*bufs)[i + 1].len = entry->buf.len;
+        }
+    }
+
     return 0;
 
 oom_after_header_alloc:
@@ -244,6 +516,47 @@ oom:
     return RAFT_ENOMEM;
 }
 
+int io_uv__encode_append_entries_prefix(const struct raft_append_entries *p,
+                                        unsigned group,
+                                        size_t header_len,
+                                        bool compact,
+                                        bool seq,
+                                        uv_buf_t *buf)
+{
+    unsigned type = RAFT_IO_APPEND_ENTRIES;
+    void *cursor;
+
+    buf->len = RAFT_IO_UV__PREAMBLE_SIZE + sizeof(uint64_t) * (seq ? 6 : 5);
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    cursor = buf->base;
+
+    if (compact) {
+        type |= IO_UV__COMPACT;
+    }
+    if (seq) {
+        type |= IO_UV__SEQ;
+    }
+
+    /* The message size also covers the batch header sent after us. */
+    byte__put64(&cursor, (uint64_t)group << 32 | type);
+    byte__put64(&cursor, sizeof_append_entries(p, header_len, seq));
+
+    byte__put64(&cursor, p->term);           /* Leader's term. */
+    byte__put64(&cursor, p->leader_id);      /* Leader ID. */
+    byte__put64(&cursor, p->prev_log_index); /* Previous index. */
+    byte__put64(&cursor, p->prev_log_term);  /* Previous term. */
+    byte__put64(&cursor, p->leader_commit);  /* Commit index. */
+    if (seq) {
+        byte__put64(&cursor, p->seq); /* Heartbeat round. */
+    }
+
+    return 0;
+}
+
 void io_uv__encode_batch_header(const struct raft_entry *entries,
                                 unsigned n,
                                 void *buf)
@@ -254,20 +567,69 @@ void io_uv__encode_batch_header(const struct raft_entry *entries,
     /* Number of entries in the batch, little endian */
     byte__put64(&cursor, n);
 
+    /* Each header is written as two words, the second one holding the entry
+     * type in its lowest byte and the size of the entry data in its highest
+     * four bytes, so the unused bytes are zeroed instead of leaking whatever
+     * the buffer contained. */
     for (i = 0; i < n; i++) {
         const struct raft_entry *entry = &entries[i];
 
         /* Term in which the entry was created, little endian. */
         byte__put64(&cursor, entry->term);
 
-        /* Message type (Either RAFT_COMMAND or RAFT_CONFIGURATION) */
-        byte__put8(&cursor, entry->type);
+        /* Entry type (RAFT_COMMAND, RAFT_CONFIGURATION or RAFT_BATCH), three
+         * unused bytes and size of the log entry data, little endian. */
+        byte__put64(&cursor,
+                    (uint64_t)entry->type | (uint64_t)entry->buf.len << 32);
+    }
+}
+
+void io_uv__encode_compact_batch_header(const struct raft_entry *entries,
+                                        unsigned n,
+                                        void *buf)
+{
+    void *cursor = (uint8_t *)buf + sizeof(uint64_t);
+    raft_term term = 0;
+    size_t size;
+    unsigned i;
 
-        cursor += 3; /* Unused */
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+        byte__put_varint(&cursor, byte__zigzag((int64_t)(entry->term - term)));
+        byte__put8(&cursor, (uint8_t)entry->type);
+        byte__put_varint(&cursor, entry->buf.len);
+        term = entry->term;
+    }
 
-        /* Size of the log entry data, little endian. */
-        byte__put32(&cursor, entry->buf.len);
+    /* Zero the padding, and write the size of the header in front of it. */
+    size = (size_t)((uint8_t *)cursor - (uint8_t *)buf);
+    memset(cursor, 0, byte__pad64(size) - size);
+    size = byte__pad64(size);
+
+    cursor = buf;
+    byte__put64(&cursor, (uint64_t)n | (uint64_t)size << 32);
+}
+
+size_t io_uv__sizeof_segment_batch_header(uint64_t format,
+                                          const struct raft_entry *entries,
+                                          unsigned n)
+{
+    if (io_uv__format_is_compact(format)) {
+        return io_uv__sizeof_compact_batch_header(entries, n);
+    }
+    return io_uv__sizeof_batch_header(n);
+}
+
+void io_uv__encode_segment_batch_header(uint64_t format,
+                                        const struct raft_entry *entries,
+                                        unsigned n,
+                                        void *buf)
+{
+    if (io_uv__format_is_compact(format)) {
+        io_uv__encode_compact_batch_header(entries, n, buf);
+        return;
     }
+    io_uv__encode_batch_header(entries, n, buf);
 }
 
 static void raft_io_uv_decode__request_vote(const uv_buf_t *buf,
@@ -281,6 +643,16 @@ static void raft_io_uv_decode__request_vote(const uv_buf_t *buf,
     p->candidate_id = byte__get64(&cursor);
     p->last_log_index = byte__get64(&cursor);
     p->last_log_term = byte__get64(&cursor);
+
+    /* Older peers don't support pre-vote and leadership transfer. */
+    if (buf->len < raft_io_uv_sizeof__request_vote()) {
+        p->pre_vote = false;
+        p->disrupt_leader = false;
+        return;
+    }
+
+    p->pre_vote = byte__get64(&cursor);
+    p->disrupt_leader = byte__get64(&cursor);
 }
 
 static void raft_io_uv_decode__request_vote_result(
@@ -293,87 +665,416 @@ static void raft_io_uv_decode__request_vote_result(
 
     p->term = byte__get64(&cursor);
     p->vote_granted = byte__get64(&cursor);
-}
-
-int io_uv__decode_batch_header(const void *batch,
-                               struct raft_entry **entries,
-                               unsigned *n)
-{
-    const void *cursor = batch;
-    size_t i;
-    int rv;
-
-    *n = byte__get64(&cursor);
 
-    if (*n == 0) {
-        *entries = NULL;
-        return 0;
+    if (buf->len < raft_io_uv_sizeof__request_vote_result()) {
+        p->pre_vote = false;
+        return;
     }
 
-    *entries = raft_malloc(*n * sizeof **entries);
-
-    if (*entries == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err;
-    }
+    p->pre_vote = byte__get64(&cursor);
+}
 
-    for (i = 0; i < *n; i++) {
-        struct raft_entry *entry = &(*entries)[i];
+static void raft_io_uv_decode__read_index(const uv_buf_t *buf,
+                                          struct raft_read_index *p)
+{
+    const void *cursor;
 
-        entry->term = byte__get64(&cursor);
-        entry->type = byte__get8(&cursor);
+    cursor = buf->base;
 
-        if (entry->type != RAFT_COMMAND &&
-            entry->type != RAFT_CONFIGURATION) {
-            rv = RAFT_EMALFORMED;
-            goto err_after_alloc;
-        }
+    p->term = byte__get64(&cursor);
+    p->id = byte__get64(&cursor);
+}
 
-        cursor += 3; /* Unused */
+static void raft_io_uv_decode__read_index_result(
+    const uv_buf_t *buf,
+    struct raft_read_index_result *p)
+{
+    const void *cursor;
 
-        /* Size of the log entry data, little endian. */
-        entry->buf.len = byte__get32(&cursor);
-    }
+    cursor = buf->base;
 
-    return 0;
+    p->term = byte__get64(&cursor);
+    p->id = byte__get64(&cursor);
+    p->index = byte__get64(&cursor);
+}
 
-err_after_alloc:
-    raft_free(entries);
+static void raft_io_uv_decode__timeout_now(const uv_buf_t *buf,
+                                           struct raft_timeout_now *p)
+{
+    const void *cursor;
 
-err:
-    assert(rv != 0);
+    cursor = buf->base;
 
-    return rv;
+    p->term = byte__get64(&cursor);
+    p->last_log_index = byte__get64(&cursor);
+    p->last_log_term = byte__get64(&cursor);
 }
 
-static int raft_io_uv_decode__append_entries(const uv_buf_t *buf,
-                                             struct raft_append_entries *args)
+static void raft_io_uv_decode__send_snapshot(const uv_buf_t *buf,
+                                             struct raft_send_snapshot *p)
 {
     const void *cursor;
-    int rv;
-
-    assert(buf != NULL);
-    assert(args != NULL);
 
     cursor = buf->base;
 
-    args->term = byte__get64(&cursor);
-    args->leader_id = byte__get64(&cursor);
-    args->prev_log_index = byte__get64(&cursor);
-    args->prev_log_term = byte__get64(&cursor);
-    args->leader_commit = byte__get64(&cursor);
-
-    rv = io_uv__decode_batch_header(cursor, &args->entries, &args->n_entries);
-    if (rv != 0) {
-        return rv;
-    }
-
-    return 0;
+    p->term = byte__get64(&cursor);
+    p->server_id = byte__get64(&cursor);
+    p->last_index = byte__get64(&cursor);
 }
 
-static void raft_io_uv_decode__append_entries_result(
+static void raft_io_uv_decode__send_snapshot_result(
     const uv_buf_t *buf,
-    struct raft_append_entries_result *p)
+    struct raft_send_snapshot_result *p)
+{
+    const void *cursor;
+
+    cursor = buf->base;
+
+    p->term = byte__get64(&cursor);
+    p->server_id = byte__get64(&cursor);
+    p->last_index = byte__get64(&cursor);
+    p->done = byte__get64(&cursor);
+}
+
+/* Check that the fixed encoding batch header starting @offset bytes into @buf
+ * fits in it, so that decoding it doesn't read past the end of the buffer. */
+static int check_batch_header(const uv_buf_t *buf, size_t offset)
+{
+    const void *cursor;
+    uint64_t n;
+
+    if (buf->len < offset + sizeof(uint64_t)) {
+        return RAFT_EMALFORMED;
+    }
+
+    cursor = (const uint8_t *)buf->base + offset;
+    n = byte__get64(&cursor);
+
+    /* Each entry takes two words. */
+    if (n > (buf->len - offset - sizeof(uint64_t)) / (sizeof(uint64_t) * 2)) {
+        return RAFT_EMALFORMED;
+    }
+
+    return 0;
+}
+
+static int raft_io_uv_decode__propose(const uv_buf_t *buf,
+                                      struct raft_propose *p)
+{
+    const void *cursor;
+    unsigned i;
+    int rv;
+
+    p->entries = NULL;
+    p->n_entries = 0;
+
+    rv = check_batch_header(buf, sizeof(uint64_t) * 2);
+    if (rv != 0) {
+        return rv;
+    }
+
+    cursor = buf->base;
+
+    p->term = byte__get64(&cursor);
+    p->id = byte__get64(&cursor);
+
+    rv = io_uv__decode_batch_header(cursor, &p->entries, &p->n_entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Commands with no payload don't get a batch. */
+    for (i = 0; i < p->n_entries; i++) {
+        p->entries[i].buf.base = NULL;
+        p->entries[i].batch = NULL;
+    }
+
+    return 0;
+}
+
+static void raft_io_uv_decode__propose_result(const uv_buf_t *buf,
+                                              struct raft_propose_result *p)
+{
+    const void *cursor;
+
+    cursor = buf->base;
+
+    p->term = byte__get64(&cursor);
+    p->id = byte__get64(&cursor);
+    p->index = byte__get64(&cursor);
+    p->status = (int)byte__get64(&cursor);
+}
+
+int io_uv__decode_batch_header(const void *batch,
+                               struct raft_entry **entries,
+                               unsigned *n)
+{
+    const void *cursor = batch;
+    size_t i;
+    int rv;
+
+    *n = byte__get64(&cursor);
+
+    if (*n == 0) {
+        *entries = NULL;
+        return 0;
+    }
+
+    *entries = raft_malloc(*n * sizeof **entries);
+
+    if (*entries == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < *n; i++) {
+        struct raft_entry *entry = &(*entries)[i];
+
+        entry->term = byte__get64(&cursor);
+        entry->type = byte__get8(&cursor);
+
+        if (entry->type != RAFT_COMMAND &&
+            entry->type != RAFT_CONFIGURATION && entry->type != RAFT_BATCH) {
+            rv = RAFT_EMALFORMED;
+            goto err_after_alloc;
+        }
+
+        cursor += 3; /* Unused */
+
+        /* Size of the log entry data, little endian. */
+        entry->buf.len = byte__get32(&cursor);
+    }
+
+    return 0;
+
+err_after_alloc:
+    raft_free(*entries);
+    *entries = NULL;
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
+unsigned io_uv__batch_n_entries(uint64_t format, uint64_t word)
+{
+    if (io_uv__format_is_compact(format)) {
+        return (unsigned)(word & 0xffffffff);
+    }
+    return (unsigned)word;
+}
+
+size_t io_uv__batch_header_size(uint64_t format, uint64_t word)
+{
+    if (io_uv__format_is_compact(format)) {
+        return (size_t)(word >> 32);
+    }
+    return io_uv__sizeof_batch_header((size_t)word);
+}
+
+/* Decode the header of the next entry of a compact batch header, whose term is
+ * relative to the one of the previous entry. */
+static int decode_compact_entry(const void **cursor,
+                                const void *end,
+                                struct raft_entry *entry,
+                                raft_term prev_term)
+{
+    uint64_t value;
+
+    if (!byte__get_varint(cursor, end, &value)) {
+        return RAFT_EMALFORMED;
+    }
+    entry->term = prev_term + (raft_term)byte__unzigzag(value);
+
+    if (*cursor >= end) {
+        return RAFT_EMALFORMED;
+    }
+    entry->type = byte__get8(cursor);
+    if (entry->type != RAFT_COMMAND && entry->type != RAFT_CONFIGURATION &&
+        entry->type != RAFT_BATCH) {
+        return RAFT_EMALFORMED;
+    }
+
+    /* Entry data sizes are limited to 32 bits, like in the fixed encoding. */
+    if (!byte__get_varint(cursor, end, &value) || value > UINT32_MAX) {
+        return RAFT_EMALFORMED;
+    }
+    entry->buf.len = (size_t)value;
+
+    return 0;
+}
+
+int io_uv__decode_compact_batch_header(const void *batch,
+                                       size_t len,
+                                       struct raft_entry **entries,
+                                       unsigned *n)
+{
+    const void *cursor = batch;
+    const void *end;
+    raft_term term = 0;
+    uint64_t word;
+    size_t size;
+    unsigned i;
+    int rv;
+
+    *entries = NULL;
+    *n = 0;
+
+    if (len < sizeof(uint64_t)) {
+        return RAFT_EMALFORMED;
+    }
+    word = byte__get64(&cursor);
+    size = (size_t)(word >> 32);
+
+    /* Each entry header takes at least three bytes. */
+    if (size < sizeof(uint64_t) || size > len || size % sizeof(uint64_t) != 0 ||
+        (word & 0xffffffff) > (size - sizeof(uint64_t)) / 3) {
+        return RAFT_EMALFORMED;
+    }
+    end = (const uint8_t *)batch + size;
+
+    if ((word & 0xffffffff) == 0) {
+        return 0;
+    }
+
+    *n = (unsigned)(word & 0xffffffff);
+    *entries = raft_malloc(*n * sizeof **entries);
+    if (*entries == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < *n; i++) {
+        rv = decode_compact_entry(&cursor, end, &(*entries)[i], term);
+        if (rv != 0) {
+            goto err_after_alloc;
+        }
+        term = (*entries)[i].term;
+    }
+
+    return 0;
+
+err_after_alloc:
+    raft_free(*entries);
+    *entries = NULL;
+
+err:
+    assert(rv != 0);
+    *n = 0;
+
+    return rv;
+}
+
+int io_uv__decode_segment_batch_header(uint64_t format,
+                                       const void *batch,
+                                       size_t len,
+                                       struct raft_entry **entries,
+                                       unsigned *n)
+{
+    if (io_uv__format_is_compact(format)) {
+        return io_uv__decode_compact_batch_header(batch, len, entries, n);
+    }
+    return io_uv__decode_batch_header(batch, entries, n);
+}
+
+int io_uv__sizeof_batch_data(uint64_t format,
+                             const void *batch,
+                             size_t len,
+                             size_t *size)
+{
+    const void *cursor = batch;
+    const void *end = (const uint8_t *)batch + len;
+    struct raft_entry entry;
+    raft_term term = 0;
+    uint64_t word;
+    unsigned n;
+    unsigned i;
+    int rv;
+
+    assert(len >= sizeof(uint64_t));
+
+    word = byte__get64(&cursor);
+    n = io_uv__batch_n_entries(format, word);
+    *size = 0;
+
+    if (!io_uv__format_is_compact(format)) {
+        assert(len >= io_uv__sizeof_batch_header(n));
+        for (i = 0; i < n; i++) {
+            cursor += sizeof(uint64_t) + sizeof(uint32_t); /* Term and type */
+            *size += byte__get32(&cursor);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        rv = decode_compact_entry(&cursor, end, &entry, term);
+        if (rv != 0) {
+            return rv;
+        }
+        *size += entry.buf.len;
+        term = entry.term;
+    }
+
+    return 0;
+}
+
+static int raft_io_uv_decode__append_entries(const uv_buf_t *buf,
+                                             bool compact,
+                                             bool seq,
+                                             struct raft_append_entries *args)
+{
+    size_t fixed = sizeof(uint64_t) * (seq ? 6 : 5);
+    const void *cursor;
+    int rv;
+
+    assert(buf != NULL);
+    assert(args != NULL);
+
+    args->entries = NULL;
+    args->n_entries = 0;
+
+    if (compact) {
+        rv = buf->len < fixed ? RAFT_EMALFORMED : 0;
+    } else {
+        rv = check_batch_header(buf, fixed);
+    }
+    if (rv != 0) {
+        return rv;
+    }
+
+    cursor = buf->base;
+
+    args->term = byte__get64(&cursor);
+    args->leader_id = byte__get64(&cursor);
+    args->prev_log_index = byte__get64(&cursor);
+    args->prev_log_term = byte__get64(&cursor);
+    args->leader_commit = byte__get64(&cursor);
+    args->seq = seq ? byte__get64(&cursor) : 0;
+
+    if (compact) {
+        args->hibernate = false;
+        return io_uv__decode_compact_batch_header(
+            cursor, buf->len - fixed, &args->entries, &args->n_entries);
+    }
+
+    rv = io_uv__decode_batch_header(cursor, &args->entries, &args->n_entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    args->hibernate = false;
+    if (args->n_entries == 0 && buf->len >= fixed + sizeof(uint64_t) * 2) {
+        cursor = (const uint8_t *)cursor + sizeof(uint64_t);
+        args->hibernate = byte__get64(&cursor) != 0;
+    }
+
+    return 0;
+}
+
+static void raft_io_uv_decode__append_entries_result(
+    const uv_buf_t *buf,
+    struct raft_append_entries_result *p)
 {
     const void *cursor;
 
@@ -382,6 +1083,48 @@ static void raft_io_uv_decode__append_entries_result(
     p->term = byte__get64(&cursor);
     p->success = byte__get64(&cursor);
     p->last_log_index = byte__get64(&cursor);
+
+    p->conflict_term = 0;
+    p->conflict_index = 0;
+    p->snapshot_index = 0;
+    p->snapshot_offset = 0;
+    p->seq = 0;
+
+    /* Older peers don't send a conflict hint. */
+    if (buf->len < sizeof(uint64_t) * 5) {
+        return;
+    }
+
+    p->conflict_term = byte__get64(&cursor);
+    p->conflict_index = byte__get64(&cursor);
+
+    /* The resume hint is only sent when set. */
+    if (buf->len < sizeof(uint64_t) * 7) {
+        return;
+    }
+
+    p->snapshot_index = byte__get64(&cursor);
+    p->snapshot_offset = byte__get64(&cursor);
+
+    /* The heartbeat round follows the features word. */
+    if (buf->len < sizeof(uint64_t) * 9) {
+        return;
+    }
+
+    cursor = (const uint8_t *)cursor + sizeof(uint64_t);
+    p->seq = byte__get64(&cursor);
+}
+
+uint64_t io_uv__decode_features(const uv_buf_t *header)
+{
+    const void *cursor;
+
+    if (header->len < sizeof(uint64_t) * 8) {
+        return 0;
+    }
+
+    cursor = header->base + sizeof(uint64_t) * 7;
+    return byte__get64(&cursor);
 }
 
 static int raft_io_uv_decode__install_snapshot(
@@ -412,6 +1155,16 @@ static int raft_io_uv_decode__install_snapshot(
     cursor += conf.len;
     args->data.len = byte__get64(&cursor);
 
+    /* Older peers send the whole snapshot in a single message. */
+    if (buf->len < raft_io_uv_sizeof__install_snapshot(args)) {
+        args->offset = 0;
+        args->done = true;
+        return 0;
+    }
+
+    args->offset = byte__get64(&cursor);
+    args->done = byte__get64(&cursor);
+
     return 0;
 }
 
@@ -420,12 +1173,20 @@ int io_uv__decode_message(unsigned type,
                           struct raft_message *message,
                           size_t *payload_len)
 {
+    bool compact = false;
+    bool seq = false;
+    size_t len = 0;
     unsigned i;
     int rv = 0;
 
-    message->type = type;
+    if ((type & ~(unsigned)(IO_UV__COMPACT | IO_UV__SEQ)) ==
+        RAFT_IO_APPEND_ENTRIES) {
+        compact = (type & IO_UV__COMPACT) != 0;
+        seq = (type & IO_UV__SEQ) != 0;
+        type = RAFT_IO_APPEND_ENTRIES;
+    }
 
-    *payload_len = 0;
+    message->type = type;
 
     /* Decode the header. */
     switch (type) {
@@ -437,10 +1198,13 @@ int io_uv__decode_message(unsigned type,
                 header, &message->request_vote_result);
             break;
         case RAFT_IO_APPEND_ENTRIES:
-            rv = raft_io_uv_decode__append_entries(header,
+            rv = raft_io_uv_decode__append_entries(header, compact, seq,
                                                    &message->append_entries);
+            if (rv != 0) {
+                break;
+            }
             for (i = 0; i < message->append_entries.n_entries; i++) {
-                *payload_len += message->append_entries.entries[i].buf.len;
+                len += message->append_entries.entries[i].buf.len;
             }
             break;
         case RAFT_IO_APPEND_ENTRIES_RESULT:
@@ -450,16 +1214,258 @@ int io_uv__decode_message(unsigned type,
         case RAFT_IO_INSTALL_SNAPSHOT:
             rv = raft_io_uv_decode__install_snapshot(
                 header, &message->install_snapshot);
-            *payload_len += message->install_snapshot.data.len;
+            len += message->install_snapshot.data.len;
+            break;
+        case RAFT_IO_READ_INDEX:
+            raft_io_uv_decode__read_index(header, &message->read_index);
+            break;
+        case RAFT_IO_READ_INDEX_RESULT:
+            raft_io_uv_decode__read_index_result(header,
+                                                 &message->read_index_result);
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            raft_io_uv_decode__timeout_now(header, &message->timeout_now);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT:
+            raft_io_uv_decode__send_snapshot(header, &message->send_snapshot);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT_RESULT:
+            raft_io_uv_decode__send_snapshot_result(
+                header, &message->send_snapshot_result);
+            break;
+        case RAFT_IO_PROPOSE:
+            rv = raft_io_uv_decode__propose(header, &message->propose);
+            if (rv != 0) {
+                break;
+            }
+            for (i = 0; i < message->propose.n_entries; i++) {
+                len += message->propose.entries[i].buf.len;
+            }
+            break;
+        case RAFT_IO_PROPOSE_RESULT:
+            raft_io_uv_decode__propose_result(header,
+                                              &message->propose_result);
             break;
         default:
             rv = RAFT_ERR_IO;
             break;
     };
 
+    if (rv == 0) {
+        *payload_len = len;
+    }
+
     return rv;
 }
 
+int io_uv__compress(const uv_buf_t bufs[],
+                    unsigned n,
+                    size_t prefix,
+                    uv_buf_t *buf)
+{
+#if defined(HAVE_LZ4)
+    const char *src;
+    char *data = NULL;
+    size_t len = 0;
+    void *cursor;
+    int bound;
+    int size;
+    unsigned i;
+
+    buf->base = NULL;
+    buf->len = 0;
+
+    for (i = 0; i < n; i++) {
+        len += bufs[i].len;
+    }
+    if (len == 0 || len > LZ4_MAX_INPUT_SIZE) {
+        return 0;
+    }
+
+    /* LZ4 compresses a single contiguous block. */
+    if (n == 1) {
+        src = bufs[0].base;
+    } else {
+        data = raft_malloc(len);
+        if (data == NULL) {
+            return RAFT_ENOMEM;
+        }
+        cursor = data;
+        for (i = 0; i < n; i++) {
+            memcpy(cursor, bufs[i].base, bufs[i].len);
+            cursor += bufs[i].len;
+        }
+        src = data;
+    }
+
+    bound = LZ4_compressBound((int)len);
+    buf->base = raft_malloc(prefix + sizeof(uint64_t) + (size_t)bound);
+    if (buf->base == NULL) {
+        if (data != NULL) {
+            raft_free(data);
+        }
+        return RAFT_ENOMEM;
+    }
+
+    size = LZ4_compress_default(src, buf->base + prefix + sizeof(uint64_t),
+                                (int)len, bound);
+    if (data != NULL) {
+        raft_free(data);
+    }
+
+    /* Send the data as is, if it doesn't compress. */
+    if (size <= 0 || (size_t)size + sizeof(uint64_t) >= len) {
+        raft_free(buf->base);
+        buf->base = NULL;
+        return 0;
+    }
+
+    cursor = buf->base + prefix;
+    byte__put64(&cursor, (uint64_t)size);
+    buf->len = prefix + sizeof(uint64_t) + (size_t)size;
+#else
+    (void)bufs;
+    (void)n;
+    (void)prefix;
+    buf->base = NULL;
+    buf->len = 0;
+#endif
+
+    return 0;
+}
+
+void io_uv__encode_compressed(void *preamble)
+{
+    uint64_t *words = preamble;
+    words[0] = byte__flip64(byte__flip64(words[0]) | IO_UV__COMPRESSED);
+    words[1] = byte__flip64(byte__flip64(words[1]) + sizeof(uint64_t));
+}
+
+int io_uv__decompress(const uv_buf_t *compressed, uv_buf_t *buf)
+{
+#if defined(HAVE_LZ4)
+    int size;
+    if (compressed->len > LZ4_MAX_INPUT_SIZE || buf->len > LZ4_MAX_INPUT_SIZE) {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+    size = LZ4_decompress_safe(compressed->base, buf->base,
+                               (int)compressed->len, (int)buf->len);
+    if (size < 0 || (size_t)size != buf->len) {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+    return 0;
+#else
+    (void)compressed;
+    (void)buf;
+    return RAFT_ERR_IO_MALFORMED;
+#endif
+}
+
+static size_t raft_io_uv_sizeof__heartbeat(bool seq)
+{
+    return sizeof(uint64_t) +             /* Group ID */
+           sizeof(uint64_t) +             /* Leader's term. */
+           sizeof(uint64_t) +             /* Leader ID */
+           sizeof(uint64_t) +             /* Previous log entry index */
+           sizeof(uint64_t) +             /* Previous log entry term */
+           sizeof(uint64_t) +             /* Leader's commit index */
+           (seq ? sizeof(uint64_t) : 0) /* Heartbeat round, if sent */;
+}
+
+int io_uv__encode_heartbeats(const struct io_uv__heartbeat heartbeats[],
+                             unsigned n,
+                             bool seq,
+                             uv_buf_t *buf)
+{
+    void *cursor;
+    unsigned i;
+
+    assert(n > 0);
+
+    buf->len = RAFT_IO_UV__PREAMBLE_SIZE + sizeof(uint64_t) +
+               n * raft_io_uv_sizeof__heartbeat(seq);
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    cursor = buf->base;
+
+    /* The message is not addressed to any particular group. */
+    byte__put64(&cursor, IO_UV__HEARTBEATS);
+    byte__put64(&cursor, buf->len - RAFT_IO_UV__PREAMBLE_SIZE);
+
+    byte__put64(&cursor, n);
+    for (i = 0; i < n; i++) {
+        const struct io_uv__heartbeat *h = &heartbeats[i];
+        assert(h->args.n_entries == 0);
+        byte__put64(&cursor, h->group);
+        byte__put64(&cursor, h->args.term);
+        byte__put64(&cursor, h->args.leader_id);
+        byte__put64(&cursor, h->args.prev_log_index);
+        byte__put64(&cursor, h->args.prev_log_term);
+        byte__put64(&cursor, h->args.leader_commit);
+        if (seq) {
+            byte__put64(&cursor, h->args.seq);
+        }
+    }
+
+    return 0;
+}
+
+int io_uv__decode_heartbeats(const uv_buf_t *header,
+                             struct io_uv__heartbeat **heartbeats,
+                             unsigned *n)
+{
+    const void *cursor;
+    uint64_t count;
+    size_t size;
+    bool seq;
+    unsigned i;
+
+    if (header->len < sizeof(uint64_t)) {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+
+    cursor = header->base;
+    count = byte__get64(&cursor);
+    if (count == 0 || count > header->len) {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+
+    /* Heartbeats carry their round only if the sender knows about them. */
+    size = header->len - sizeof(uint64_t);
+    if (size == count * raft_io_uv_sizeof__heartbeat(true)) {
+        seq = true;
+    } else if (size == count * raft_io_uv_sizeof__heartbeat(false)) {
+        seq = false;
+    } else {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+
+    *heartbeats = raft_malloc(count * sizeof **heartbeats);
+    if (*heartbeats == NULL) {
+        return RAFT_ENOMEM;
+    }
+    *n = (unsigned)count;
+
+    for (i = 0; i < *n; i++) {
+        struct io_uv__heartbeat *h = &(*heartbeats)[i];
+        h->group = byte__get64(&cursor);
+        h->args.term = byte__get64(&cursor);
+        h->args.leader_id = byte__get64(&cursor);
+        h->args.prev_log_index = byte__get64(&cursor);
+        h->args.prev_log_term = byte__get64(&cursor);
+        h->args.leader_commit = byte__get64(&cursor);
+        h->args.seq = seq ? byte__get64(&cursor) : 0;
+        h->args.entries = NULL;
+        h->args.n_entries = 0;
+        h->args.hibernate = false;
+    }
+
+    return 0;
+}
+
 void io_uv__decode_entries_batch(const struct raft_buffer *buf,
                                  struct raft_entry *entries,
                                  unsigned n)
@@ -489,3 +1495,238 @@ void io_uv__decode_entries_batch(const struct raft_buffer *buf,
         }
     }
 }
+
+unsigned io_uv__checksum(uint64_t format,
+                         const void *buf,
+                         size_t size,
+                         unsigned init)
+{
+    if (format == 1) {
+        return byte__crc32(buf, size, init);
+    }
+    return byte__crc32c(buf, size, init);
+}
+
+size_t io_uv__sizeof_footer(unsigned n)
+{
+    return 16 * n /* One index and offset per batch */ +
+           IO_UV__FOOTER_TRAILER_SIZE;
+}
+
+void io_uv__encode_footer(const struct io_uv__batch_offset *batches,
+                          unsigned n,
+                          void *buf)
+{
+    void *cursor = buf;
+    unsigned crc;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        byte__put64(&cursor, batches[i].index);
+        byte__put64(&cursor, batches[i].offset);
+    }
+
+    crc = byte__crc32c(buf, 16 * n, 0);
+
+    byte__put64(&cursor, n);
+    byte__put32(&cursor, crc);
+    byte__put32(&cursor, 0); /* Unused */
+    byte__put64(&cursor, IO_UV__FOOTER_MAGIC);
+}
+
+unsigned io_uv__decode_footer_trailer(const void *trailer)
+{
+    const void *cursor = trailer;
+    uint64_t n;
+
+    n = byte__get64(&cursor);
+    cursor += sizeof(uint32_t) * 2; /* Checksum and unused */
+
+    if (byte__get64(&cursor) != IO_UV__FOOTER_MAGIC) {
+        return 0;
+    }
+
+    return (unsigned)n;
+}
+
+int io_uv__decode_footer(const void *buf,
+                         unsigned n,
+                         struct io_uv__batch_offset **batches)
+{
+    const void *cursor = buf;
+    unsigned crc1;
+    unsigned crc2;
+    unsigned i;
+
+    assert(n > 0);
+
+    crc1 = byte__crc32c(buf, 16 * n, 0);
+
+    cursor = (const uint8_t *)buf + 16 * n + sizeof(uint64_t);
+    crc2 = byte__get32(&cursor);
+    if (crc1 != crc2) {
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    *batches = raft_malloc(n * sizeof **batches);
+    if (*batches == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    cursor = buf;
+    for (i = 0; i < n; i++) {
+        (*batches)[i].index = byte__get64(&cursor);
+        (*batches)[i].offset = byte__get64(&cursor);
+    }
+
+    return 0;
+}
+
+void io_uv__snapshot_checksums_init(struct io_uv__snapshot_checksums *c,
+                                    size_t block_size)
+{
+    c->block_size = block_size;
+    c->size = 0;
+    c->crcs = NULL;
+    c->n = 0;
+    c->crc = 0;
+}
+
+void io_uv__snapshot_checksums_close(struct io_uv__snapshot_checksums *c)
+{
+    if (c->crcs != NULL) {
+        raft_free(c->crcs);
+    }
+    c->crcs = NULL;
+    c->n = 0;
+}
+
+/* Append the running checksum to the checksums array. */
+static int snapshot_checksums_push(struct io_uv__snapshot_checksums *c)
+{
+    unsigned *crcs;
+
+    crcs = raft_realloc(c->crcs, (c->n + 1) * sizeof *crcs);
+    if (crcs == NULL) {
+        return RAFT_ENOMEM;
+    }
+    crcs[c->n] = c->crc;
+    c->crcs = crcs;
+    c->n++;
+    c->crc = 0;
+
+    return 0;
+}
+
+int io_uv__snapshot_checksums_update(struct io_uv__snapshot_checksums *c,
+                                     const void *buf,
+                                     size_t len)
+{
+    const uint8_t *cursor = buf;
+    size_t n;
+    int rv;
+
+    while (len > 0) {
+        n = c->block_size - c->size % c->block_size;
+        if (n > len) {
+            n = len;
+        }
+        c->crc = byte__crc32c(cursor, n, c->crc);
+        c->size += n;
+        cursor += n;
+        len -= n;
+        if (c->size % c->block_size == 0) {
+            rv = snapshot_checksums_push(c);
+            if (rv != 0) {
+                return rv;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int io_uv__snapshot_checksums_finish(struct io_uv__snapshot_checksums *c)
+{
+    if (c->size % c->block_size == 0) {
+        return 0;
+    }
+    return snapshot_checksums_push(c);
+}
+
+size_t io_uv__sizeof_snapshot_checksums(
+    const struct io_uv__snapshot_checksums *c)
+{
+    return sizeof(uint64_t) * 3 /* Block size, data size, number of blocks */ +
+           sizeof(uint64_t) * c->n /* One checksum per block */ +
+           sizeof(uint64_t) /* Checksum of the section */;
+}
+
+void io_uv__encode_snapshot_checksums(const struct io_uv__snapshot_checksums *c,
+                                      void *buf)
+{
+    void *cursor = buf;
+    unsigned crc;
+    unsigned i;
+
+    byte__put64(&cursor, c->block_size);
+    byte__put64(&cursor, c->size);
+    byte__put64(&cursor, c->n);
+    for (i = 0; i < c->n; i++) {
+        byte__put64(&cursor, c->crcs[i]);
+    }
+
+    crc = byte__crc32c(buf, sizeof(uint64_t) * (3 + c->n), 0);
+    byte__put64(&cursor, crc);
+}
+
+int io_uv__decode_snapshot_checksums(const void *buf,
+                                     size_t len,
+                                     struct io_uv__snapshot_checksums *c)
+{
+    const void *cursor = buf;
+    uint64_t block_size;
+    uint64_t size;
+    uint64_t n;
+    unsigned crc;
+    unsigned i;
+
+    if (len < sizeof(uint64_t) * 4 || len % sizeof(uint64_t) != 0) {
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    block_size = byte__get64(&cursor);
+    size = byte__get64(&cursor);
+    n = byte__get64(&cursor);
+
+    if (n != len / sizeof(uint64_t) - 4 || block_size == 0 ||
+        n != size / block_size + (size % block_size != 0)) {
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    crc = byte__crc32c(buf, len - sizeof(uint64_t), 0);
+    cursor = (const uint8_t *)buf + len - sizeof(uint64_t);
+    if (byte__get64(&cursor) != crc) {
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    io_uv__snapshot_checksums_init(c, block_size);
+    c->size = size;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    c->crcs = raft_malloc(n * sizeof *c->crcs);
+    if (c->crcs == NULL) {
+        return RAFT_ENOMEM;
+    }
+    c->n = (unsigned)n;
+
+    cursor = (const uint8_t *)buf + sizeof(uint64_t) * 3;
+    for (i = 0; i < c->n; i++) {
+        c->crcs[i] = (unsigned)byte__get64(&cursor);
+    }
+
+    return 0;
+}
@@ -5,19 +5,157 @@
 #ifndef RAFT_IO_UV_ENCODING_H
 #define RAFT_IO_UV_ENCODING_H
 
+#include <stdbool.h>
+
 #include <uv.h>
 
 #include "../include/raft.h"
 
+/**
+ * Encode the given message, addressed to the raft group with the given ID.
+ *
+ * The message preamble consists of two 64-bit words. The first one holds the
+ * message type in its low 32 bits and the group ID in its high 32 bits, the
+ * second one the length of the message header.
+ */
 int io_uv__encode_message(const struct raft_message *message,
+                          unsigned group,
                           uv_buf_t **bufs,
                           unsigned *n_bufs);
 
+/**
+ * Encode the preamble and the fields of an AppendEntries message that precede
+ * the batch header of its entries, which must be written right after it,
+ * followed by the entries payloads. This lets messages carrying the same
+ * entries share a single encoded batch header, of @header_len bytes. If
+ * @compact is true, the batch header uses the compact encoding. If @seq is
+ * true, the heartbeat round is included too.
+ */
+int io_uv__encode_append_entries_prefix(const struct raft_append_entries *p,
+                                        unsigned group,
+                                        size_t header_len,
+                                        bool compact,
+                                        bool seq,
+                                        uv_buf_t *buf);
+
+/**
+ * Decode the header of a message of the given type, which can include the
+ * IO_UV__COMPACT and IO_UV__SEQ flags, and set @payload_len to the size of its
+ * payload. On error @payload_len is left untouched, and no entry array is
+ * returned.
+ */
 int io_uv__decode_message(unsigned type,
                           const uv_buf_t *header,
                           struct raft_message *message,
                           size_t *payload_len);
 
+/**
+ * Flag set in the message type of AppendEntries messages whose batch header
+ * uses the compact encoding. It's only set in messages sent to peers that have
+ * advertised IO_UV__FEATURE_COMPACT.
+ */
+#define IO_UV__COMPACT (1 << 17)
+
+/**
+ * Flag set in the message type of AppendEntries messages whose fixed fields are
+ * followed by the heartbeat round of the leader, as a 64-bit word, before the
+ * batch header. It's only set in messages sent to peers that have advertised
+ * IO_UV__FEATURE_SEQ, which also append the last round they received to their
+ * AppendEntries results.
+ */
+#define IO_UV__SEQ (1 << 18)
+
+/**
+ * Bits of the word that servers append to the header of their AppendEntries
+ * results, telling the leader which optional encodings they can decode, since
+ * connections only carry messages in one direction. Older peers don't send it,
+ * and ignore it.
+ */
+#define IO_UV__FEATURE_COMPACT (1 << 0)
+#define IO_UV__FEATURE_SEQ (1 << 1)
+
+/**
+ * Return the features word of the header of an AppendEntries result, or 0 if
+ * the peer didn't send it.
+ */
+uint64_t io_uv__decode_features(const uv_buf_t *header);
+
+/**
+ * Flag set in the message type of messages whose payload is compressed with
+ * LZ4. The header of such messages is followed by an additional 64-bit word
+ * holding the size of the compressed payload, which replaces the plain one.
+ */
+#define IO_UV__COMPRESSED (1 << 16)
+
+/**
+ * Compress the concatenation of the given buffers into a newly allocated
+ * buffer, which starts with @prefix unused bytes, followed by the size of the
+ * compressed data, as 64-bit word, and by the compressed data itself. If the
+ * data doesn't shrink, or LZ4 support is not available, @buf->base is set to
+ * NULL.
+ */
+int io_uv__compress(const uv_buf_t bufs[],
+                    unsigned n,
+                    size_t prefix,
+                    uv_buf_t *buf);
+
+/**
+ * Mark the message with the given encoded preamble as compressed, accounting
+ * for the compressed payload size word in its header length.
+ */
+void io_uv__encode_compressed(void *preamble);
+
+/**
+ * Decompress the given payload into @buf, whose length must match the one of
+ * the uncompressed payload.
+ */
+int io_uv__decompress(const uv_buf_t *compressed, uv_buf_t *buf);
+
+/**
+ * Message type used to send the heartbeats of several raft groups, all led by
+ * the same server, in a single message. This is not a raft message type, and
+ * it's only ever exchanged between io_uv hosts.
+ */
+#define IO_UV__HEARTBEATS 255
+
+/**
+ * A heartbeat for a single raft group, coalesced with others in an
+ * IO_UV__HEARTBEATS message.
+ */
+struct io_uv__heartbeat
+{
+    unsigned group;                  /* ID of the raft group */
+    struct raft_append_entries args; /* AppendEntries with no entries */
+};
+
+/**
+ * Encode an IO_UV__HEARTBEATS message, preamble included, in a single buffer.
+ *
+ * The header of the message has the following layout:
+ *
+ * [8 bytes] Number of heartbeats, little endian.
+ * [8 bytes] Group ID of the first heartbeat.
+ * [8 bytes] Leader's term
+ * [8 bytes] Leader ID
+ * [8 bytes] Previous log entry index
+ * [8 bytes] Previous log entry term
+ * [8 bytes] Leader's commit index
+ * [8 bytes] Heartbeat round, only if @seq is true
+ * [  ...  ] More heartbeats
+ */
+int io_uv__encode_heartbeats(const struct io_uv__heartbeat heartbeats[],
+                             unsigned n,
+                             bool seq,
+                             uv_buf_t *buf);
+
+/**
+ * Decode the header of an IO_UV__HEARTBEATS message, with or without the
+ * heartbeat rounds.
+ */
+int io_uv__decode_heartbeats(const uv_buf_t *header,
+                             struct io_uv__heartbeat **heartbeats,
+                             unsigned *n);
+
 int io_uv__decode_batch_header(const void *batch,
                                struct raft_entry **entries,
                                unsigned *n);
@@ -40,7 +178,7 @@ void io_uv__decode_entries_batch(const struct raft_buffer *buf,
  * An entry header is 16-byte long and has the following layout:
  *
  * [8 bytes] Term in which the entry was created, little endian.
- * [1 byte ] Message type (Either RAFT_COMMAND or RAFT_CONFIGURATION)
+ * [1 byte ] Entry type (RAFT_COMMAND, RAFT_CONFIGURATION or RAFT_BATCH)
  * [3 bytes] Currently unused.
  * [4 bytes] Size of the log entry data, little endian.
  *
@@ -50,8 +188,213 @@ void io_uv__decode_entries_batch(const struct raft_buffer *buf,
  */
 size_t io_uv__sizeof_batch_header(size_t n);
 
+/**
+ * Size of the per-entry checksums that segments with the given format version
+ * store between the header and the data of a batch of @n entries: a 4-byte
+ * CRC32C of the payload of each entry, little endian, padded to 8 bytes. It's
+ * zero for formats without per-entry checksums.
+ */
+size_t io_uv__sizeof_batch_checksums(uint64_t format, size_t n);
+
 void io_uv__encode_batch_header(const struct raft_entry *entries,
                                 unsigned n,
                                 void *buf);
 
+/**
+ * Whether segments with the given format version use the compact encoding of
+ * batch headers, and whether they have per-entry checksums.
+ */
+bool io_uv__format_is_compact(uint64_t format);
+bool io_uv__format_has_entry_checksums(uint64_t format);
+
+/**
+ * The compact encoding of a batch header has the following layout:
+ *
+ * [4 bytes] Number of entries in the batch, little endian.
+ * [4 bytes] Size of the whole header, padding included, little endian.
+ * [varint ] Term of the first entry, see below.
+ * [1 byte ] Type of the first entry.
+ * [varint ] Size of the data of the first entry.
+ * [  ...  ] More entry headers.
+ * [padding] Zero bytes up to the next 8-byte boundary.
+ *
+ * The term of each entry is encoded as the zigzag-mapped difference with the
+ * term of the previous entry, or with 0 for the first one, so entries of the
+ * same term take a single byte for it. The total size of the header doesn't
+ * depend on @n alone, so it's written along with it. It's never larger than
+ * the one of the fixed-size encoding.
+ */
+size_t io_uv__sizeof_compact_batch_header(const struct raft_entry *entries,
+                                          unsigned n);
+
+void io_uv__encode_compact_batch_header(const struct raft_entry *entries,
+                                        unsigned n,
+                                        void *buf);
+
+/**
+ * Decode a compact batch header held in a buffer of @len bytes, allocating the
+ * entries array.
+ */
+int io_uv__decode_compact_batch_header(const void *batch,
+                                       size_t len,
+                                       struct raft_entry **entries,
+                                       unsigned *n);
+
+/**
+ * Size, encoding and decoding of a batch header in a segment with the given
+ * format version, using either encoding.
+ */
+size_t io_uv__sizeof_segment_batch_header(uint64_t format,
+                                          const struct raft_entry *entries,
+                                          unsigned n);
+
+void io_uv__encode_segment_batch_header(uint64_t format,
+                                        const struct raft_entry *entries,
+                                        unsigned n,
+                                        void *buf);
+
+int io_uv__decode_segment_batch_header(uint64_t format,
+                                       const void *batch,
+                                       size_t len,
+                                       struct raft_entry **entries,
+                                       unsigned *n);
+
+/**
+ * Return the number of entries and the size of a batch header in a segment with
+ * the given format version, given the first 8 bytes of the header.
+ */
+unsigned io_uv__batch_n_entries(uint64_t format, uint64_t word);
+size_t io_uv__batch_header_size(uint64_t format, uint64_t word);
+
+/**
+ * Calculate the total size of the entries data of the given batch header,
+ * which must be @len bytes long, without decoding it.
+ */
+int io_uv__sizeof_batch_data(uint64_t format,
+                             const void *batch,
+                             size_t len,
+                             size_t *size);
+
+/**
+ * Position of a batch within a closed segment file.
+ */
+struct io_uv__batch_offset
+{
+    raft_index index; /* Index of the first entry of the batch */
+    uint64_t offset;  /* Offset of the batch in the segment file */
+};
+
+/**
+ * Magic number marking the end of a segment index footer.
+ */
+#define IO_UV__FOOTER_MAGIC 0x7265746f6f662d72 /* "r-footer" */
+
+/**
+ * Size of the fixed trailing part of a segment index footer.
+ */
+#define IO_UV__FOOTER_TRAILER_SIZE (sizeof(uint64_t) * 3)
+
+/**
+ * Closed segments can end with an index footer, which maps the index of the
+ * first entry of each batch to the offset of the batch in the file. The footer
+ * has the following layout:
+ *
+ * [8 bytes] Index of the first entry of the first batch, little endian.
+ * [8 bytes] Offset of the first batch in the file, little endian.
+ * [  ...  ] More batches
+ * [8 bytes] Number of batches, little endian.
+ * [4 bytes] CRC32C checksum of the batch offsets, little endian.
+ * [4 bytes] Currently unused.
+ * [8 bytes] IO_UV__FOOTER_MAGIC, little endian.
+ */
+size_t io_uv__sizeof_footer(unsigned n);
+
+void io_uv__encode_footer(const struct io_uv__batch_offset *batches,
+                          unsigned n,
+                          void *buf);
+
+/**
+ * Return the number of batches in the footer ending with the given trailer, or
+ * 0 if the trailer does not belong to a footer.
+ */
+unsigned io_uv__decode_footer_trailer(const void *trailer);
+
+/**
+ * Decode a footer with the given number of batches, allocating the offsets
+ * array.
+ */
+int io_uv__decode_footer(const void *buf,
+                         unsigned n,
+                         struct io_uv__batch_offset **batches);
+
+/**
+ * Size of the blocks of snapshot data covered by a single checksum.
+ */
+#define IO_UV__SNAPSHOT_BLOCK_SIZE (256 * 1024)
+
+/**
+ * CRC32C checksums of the fixed-size blocks of a snapshot data file, computed
+ * while the data is being written.
+ */
+struct io_uv__snapshot_checksums
+{
+    size_t block_size; /* Size of each block, or 0 if there are none */
+    size_t size;       /* Total size of the data seen so far */
+    unsigned *crcs;    /* Checksum of each complete block */
+    unsigned n;        /* Number of complete blocks */
+    unsigned crc;      /* Running checksum of the current block */
+};
+
+void io_uv__snapshot_checksums_init(struct io_uv__snapshot_checksums *c,
+                                    size_t block_size);
+
+void io_uv__snapshot_checksums_close(struct io_uv__snapshot_checksums *c);
+
+/**
+ * Update the checksums with the next piece of snapshot data.
+ */
+int io_uv__snapshot_checksums_update(struct io_uv__snapshot_checksums *c,
+                                     const void *buf,
+                                     size_t len);
+
+/**
+ * Add the checksum of the last, possibly partial, block.
+ */
+int io_uv__snapshot_checksums_finish(struct io_uv__snapshot_checksums *c);
+
+/**
+ * Snapshot metadata files can end with a checksums section, following the
+ * configuration data. Older metadata files have no such section, and older
+ * readers just ignore it. The section has the following layout:
+ *
+ * [8 bytes] Block size, little endian.
+ * [8 bytes] Total size of the snapshot data, little endian.
+ * [8 bytes] Number of blocks, little endian.
+ * [8 bytes] CRC32C checksum of the first block, little endian.
+ * [  ...  ] More checksums
+ * [8 bytes] CRC32C checksum of all the above, little endian.
+ */
+size_t io_uv__sizeof_snapshot_checksums(
+    const struct io_uv__snapshot_checksums *c);
+
+void io_uv__encode_snapshot_checksums(const struct io_uv__snapshot_checksums *c,
+                                      void *buf);
+
+/**
+ * Decode a checksums section of the given length, allocating the checksums
+ * array.
+ */
+int io_uv__decode_snapshot_checksums(const void *buf,
+                                     size_t len,
+                                     struct io_uv__snapshot_checksums *c);
+
+/**
+ * Calculate the checksum of the given data buffer, using the algorithm of the
+ * given disk format version.
+ */
+unsigned io_uv__checksum(uint64_t format,
+                         const void *buf,
+                         size_t size,
+                         unsigned init);
+
 #endif /* RAFT_IO_UV_ENCODING_H */
@@ -1,6 +1,10 @@
+#include <unistd.h>
+
 #include "assert.h"
 #include "io_uv.h"
+#include "io_uv_encoding.h"
 #include "io_uv_fs.h"
+#include "io_uv_load.h"
 #include "queue.h"
 #include "logging.h"
 
@@ -15,15 +19,14 @@ struct segment
     raft__queue queue;      /* Link to finalize queue */
 };
 
-/* Schedule closing an open segment. */
-static int segment_close(struct segment *s);
-
-/* Run all blocking syscalls involved in closing a used open segment.
+/* Run all blocking syscalls involved in closing a batch of open segments.
  *
- * An open segment is closed by truncating its length to the number of bytes
- * that were actually written into it and then renaming it. */
-static void work_cb(uv_work_t *work);
-static void after_work_cb(uv_work_t *work, int status);
+ * An open segment is closed by writing an index footer right after the bytes
+ * that were actually written into it, truncating its length to the end of the
+ * footer and then renaming it. The renames of all segments in the batch are
+ * made durable with a single sync of the data directory. */
+static void work_cb(struct io_uv__work *work);
+static void after_work_cb(struct io_uv__work *work, int status);
 
 /* Process pending requests to finalize open segments */
 static void process_requests(struct io_uv *uv);
@@ -71,11 +74,7 @@ int io_uv__finalize(struct io_uv *uv,
 
 static void process_requests(struct io_uv *uv)
 {
-    struct segment *segment;
-    raft__queue *head;
-    int rv;
-
-    /* If we're already processing a segment, let's wait. */
+    /* If we're already processing a batch, let's wait. */
     if (uv->finalize_work.data != NULL) {
         return;
     }
@@ -85,50 +84,86 @@ static void process_requests(struct io_uv *uv)
         return;
     }
 
-    head = RAFT__QUEUE_HEAD(&uv->finalize_reqs);
-    segment = RAFT__QUEUE_DATA(head, struct segment, queue);
-    RAFT__QUEUE_REMOVE(&segment->queue);
-
-    rv = segment_close(segment);
-    if (rv != 0) {
-        goto err;
+    /* Close all segments that have queued up so far in one go. */
+    assert(RAFT__QUEUE_IS_EMPTY(&uv->finalize_batch));
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->finalize_reqs)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->finalize_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&uv->finalize_batch, head);
     }
 
-    return;
-err:
-    assert(rv != 0);
+    uv->finalize_work.data = uv;
 
-    uv->errored = true;
+    io_uv__queue_work(uv, &uv->finalize_work, work_cb, after_work_cb);
 }
 
-static int segment_close(struct segment *s)
+/* Write the index footer of the given segment right after its last batch, and
+ * return the size of the segment including the footer. The footer is only an
+ * optimization, so if it can't be written the segment is closed without it.
+ *
+ * The footer is written before the segment gets truncated and renamed: in case
+ * of a crash the bytes after the last batch are either zeros or a footer, and
+ * in both cases they are discarded when the open segment is loaded. */
+static size_t write_footer(struct segment *s, const char *filename)
 {
     struct io_uv *uv = s->uv;
+    struct io_uv__batch_offset *batches;
+    unsigned n;
+    void *buf;
+    size_t len;
+    ssize_t written;
+    int fd;
     int rv;
 
-    assert(uv->finalize_work.data == NULL);
-    assert(s->counter > 0);
-
-    uv->finalize_work.data = s;
+    fd = raft__io_uv_fs_open(uv->dir, filename, O_RDWR);
+    if (fd == -1) {
+        goto err;
+    }
 
-    rv = uv_queue_work(uv->loop, &uv->finalize_work, work_cb, after_work_cb);
+    rv = io_uv__load_batch_offsets(uv, fd, s->used, s->first_index, &batches,
+                                   &n);
     if (rv != 0) {
-        errorf(uv->io, "start to truncate segment file %d: %s",
-                    s->counter, uv_strerror(rv));
-        return RAFT_ERR_IO;
+        goto err_after_open;
     }
 
-    return 0;
+    len = io_uv__sizeof_footer(n);
+    buf = raft_malloc(len);
+    if (buf == NULL) {
+        raft_free(batches);
+        goto err_after_open;
+    }
+    io_uv__encode_footer(batches, n, buf);
+    raft_free(batches);
+
+    written = pwrite(fd, buf, len, s->used);
+    raft_free(buf);
+    if (written != (ssize_t)len) {
+        goto err_after_open;
+    }
+
+    close(fd);
+
+    return s->used + len;
+
+err_after_open:
+    close(fd);
+
+err:
+    warnf(uv->io, "segment %s: can't write index footer", filename);
+    return s->used;
 }
 
-static void work_cb(uv_work_t *work)
+/* Close a single segment of the batch, without syncing the directory. */
+static void segment_close(struct segment *s)
 {
-    struct segment *s = work->data;
     struct io_uv *uv = s->uv;
     io_uv__filename filename1;
     io_uv__filename filename2;
+    size_t size;
     int rv;
 
+    assert(s->counter > 0);
+
     sprintf(filename1, "open-%lld", s->counter);
 
     /* If the segment hasn't actually been used (because the writer has been
@@ -138,8 +173,10 @@ static void work_cb(uv_work_t *work)
         goto out;
     }
 
-    /* Truncate and rename the segment */
-    rv = raft__io_uv_fs_truncate(uv->dir, filename1, s->used);
+    /* Write the footer, then truncate and rename the segment */
+    size = write_footer(s, filename1);
+
+    rv = raft__io_uv_fs_truncate(uv->dir, filename1, size);
     if (rv != 0) {
         errorf(uv->io, "truncate segment file %s: %s", filename1,
                     uv_strerror(rv));
@@ -149,7 +186,7 @@ static void work_cb(uv_work_t *work)
 
     sprintf(filename2, "%llu-%llu", s->first_index, s->last_index);
 
-    rv = raft__io_uv_fs_rename(uv->dir, filename1, filename2);
+    rv = raft__io_uv_fs_rename_no_sync(uv->dir, filename1, filename2);
     if (rv != 0) {
         errorf(uv->io, "rename segment file %d: %s", s->counter,
                     uv_strerror(rv));
@@ -168,20 +205,49 @@ abort:
     s->status = rv;
 }
 
-static void after_work_cb(uv_work_t *work, int status)
+static void work_cb(struct io_uv__work *work)
 {
-    struct segment *s = work->data;
-    struct io_uv *uv = s->uv;
+    struct io_uv *uv = work->data;
+    raft__queue *head;
+    int rv;
+
+    RAFT__QUEUE_FOREACH(head, &uv->finalize_batch)
+    {
+        segment_close(RAFT__QUEUE_DATA(head, struct segment, queue));
+    }
+
+    rv = raft__io_uv_fs_sync_dir(uv->dir);
+    if (rv != 0) {
+        errorf(uv->io, "sync data directory: %s", uv_strerror(rv));
+        RAFT__QUEUE_FOREACH(head, &uv->finalize_batch)
+        {
+            RAFT__QUEUE_DATA(head, struct segment, queue)->status = RAFT_ERR_IO;
+        }
+    }
+}
+
+static void after_work_cb(struct io_uv__work *work, int status)
+{
+    struct io_uv *uv = work->data;
 
     assert(status == 0); /* We don't cancel worker requests */
 
     uv->finalize_work.data = NULL;
-
-    if (s->status != 0) {
-        uv->errored = true;
+    io_uv__record_latency(&uv->stats.finalize, work->duration);
+
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->finalize_batch)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&uv->finalize_batch);
+        struct segment *s = RAFT__QUEUE_DATA(head, struct segment, queue);
+        RAFT__QUEUE_REMOVE(head);
+        if (s->status != 0) {
+            uv->errored = true;
+        } else if (s->used > 0) {
+            /* The segment is now closed and its entries can be read. */
+            uv->finalize_done_index = s->last_index;
+        }
+        raft_free(s);
     }
 
-    raft_free(s);
     process_requests(uv);
     io_uv__truncate_unblock(uv);
     io_uv__maybe_close(uv);
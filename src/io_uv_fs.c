@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -114,13 +115,12 @@ int raft__io_uv_fs_truncate(const char *dir,
     return 0;
 }
 
-int raft__io_uv_fs_rename(const char *dir,
-                          const char *filename1,
-                          const char *filename2)
+int raft__io_uv_fs_rename_no_sync(const char *dir,
+                                  const char *filename1,
+                                  const char *filename2)
 {
     io_uv__path path1;
     io_uv__path path2;
-    int fd;
     int rv;
 
     io_uv__join(dir, filename1, path1);
@@ -132,20 +132,97 @@ int raft__io_uv_fs_rename(const char *dir,
         return uv_translate_sys_error(errno);
     }
 
-    fd = open(dir, O_RDONLY | O_DIRECTORY);
-    if (fd == -1) {
+    return 0;
+}
+
+int raft__io_uv_fs_rename(const char *dir,
+                          const char *filename1,
+                          const char *filename2)
+{
+    int rv;
+
+    rv = raft__io_uv_fs_rename_no_sync(dir, filename1, filename2);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return raft__io_uv_fs_sync_dir(dir);
+}
+
+/* Copy the file at @path1 to @path2 and sync it. */
+static int copy_file(const char *path1, const char *path2)
+{
+    char buf[4096];
+    ssize_t n;
+    int fd1;
+    int fd2;
+    int rv = 0;
+
+    fd1 = open(path1, O_RDONLY);
+    if (fd1 == -1) {
         return uv_translate_sys_error(errno);
     }
+    fd2 = open(path2, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd2 == -1) {
+        rv = uv_translate_sys_error(errno);
+        close(fd1);
+        return rv;
+    }
 
-    rv = fsync(fd);
+    errno = 0;
+    while ((n = read(fd1, buf, sizeof buf)) > 0) {
+        if (write(fd2, buf, (size_t)n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    if (n == -1 || fsync(fd2) == -1) {
+        rv = uv_translate_sys_error(errno != 0 ? errno : EIO);
+    }
 
-    close(fd);
+    close(fd1);
+    close(fd2);
+
+    return rv;
+}
 
+int raft__io_uv_fs_move(const char *dir1,
+                        const char *filename,
+                        const char *dir2)
+{
+    io_uv__path path1;
+    io_uv__path path2;
+    int rv;
+
+    io_uv__join(dir1, filename, path1);
+    io_uv__join(dir2, filename, path2);
+
+    rv = rename(path1, path2);
     if (rv == -1) {
-        return uv_translate_sys_error(errno);
+        if (errno != EXDEV) {
+            return uv_translate_sys_error(errno);
+        }
+        rv = copy_file(path1, path2);
+        if (rv != 0) {
+            unlink(path2);
+            return rv;
+        }
+        rv = raft__io_uv_fs_sync_dir(dir2);
+        if (rv != 0) {
+            return rv;
+        }
+        rv = unlink(path1);
+        if (rv == -1) {
+            return uv_translate_sys_error(errno);
+        }
+    } else {
+        rv = raft__io_uv_fs_sync_dir(dir2);
+        if (rv != 0) {
+            return rv;
+        }
     }
 
-    return 0;
+    return raft__io_uv_fs_sync_dir(dir1);
 }
 
 int raft__io_uv_fs_sync_dir(const char *dir)
@@ -267,3 +344,57 @@ bool raft__io_uv_fs_is_at_eof(const int fd)
 
     return offset == size;
 }
+
+/* Size of the buffer used to copy data when the kernel can't do it. */
+#define COPY_BUF_SIZE (64 * 1024)
+
+int raft__io_uv_fs_copy_n(const int fd1, const int fd2, size_t n)
+{
+    void *buf;
+    ssize_t rv = 0;
+    size_t len;
+
+#if defined(HAVE_COPY_FILE_RANGE)
+    while (n > 0) {
+        rv = copy_file_range(fd1, NULL, fd2, NULL, n, 0);
+        if (rv == -1) {
+            /* Nothing was copied yet if the call is not supported at all, or
+             * not across these two files. */
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                errno == EOPNOTSUPP) {
+                break;
+            }
+            return uv_translate_sys_error(errno);
+        }
+        if (rv == 0) {
+            return UV_EIO;
+        }
+        n -= (size_t)rv;
+    }
+    if (n == 0) {
+        return 0;
+    }
+#endif
+
+    buf = malloc(COPY_BUF_SIZE);
+    if (buf == NULL) {
+        return UV_ENOMEM;
+    }
+
+    while (n > 0) {
+        len = n < COPY_BUF_SIZE ? n : COPY_BUF_SIZE;
+        rv = raft__io_uv_fs_read_n(fd1, buf, len);
+        if (rv != 0) {
+            goto out;
+        }
+        if (write(fd2, buf, len) != (ssize_t)len) {
+            rv = UV_EIO;
+            goto out;
+        }
+        n -= len;
+    }
+
+out:
+    free(buf);
+    return (int)rv;
+}
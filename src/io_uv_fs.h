@@ -70,6 +70,14 @@ int raft__io_uv_fs_truncate(const char *dir,
                             const char *filename,
                             size_t offset);
 
+/**
+ * Like raft__io_uv_fs_rename(), but without syncing the directory, which the
+ * caller must do afterwards, for example once after several renames.
+ */
+int raft__io_uv_fs_rename_no_sync(const char *dir,
+                                  const char *filename1,
+                                  const char *filename2);
+
 /**
  * Synchronously rename a file in a directory. To be run in a threadpool.
  */
@@ -77,6 +85,14 @@ int raft__io_uv_fs_rename(const char *dir,
                           const char *filename1,
                           const char *filename2);
 
+/**
+ * Synchronously move a file from directory @dir1 to directory @dir2, copying
+ * it if they are on different file systems. To be run in a threadpool.
+ */
+int raft__io_uv_fs_move(const char *dir1,
+                        const char *filename,
+                        const char *dir2);
+
 /**
  * Sync the given directory.
  */
@@ -103,4 +119,10 @@ int raft__io_uv_fs_read_n(const int fd, void *buf, size_t n);
  */
 bool raft__io_uv_fs_is_at_eof(const int fd);
 
+/**
+ * Copy @n bytes from the current offset of @fd1 to the current offset of @fd2,
+ * letting the kernel copy or share the underlying blocks when it can.
+ */
+int raft__io_uv_fs_copy_n(const int fd1, const int fd2, size_t n);
+
 #endif /* RAFT_IO_UV_FS_H */
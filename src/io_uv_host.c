@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/raft/io_uv.h"
+
+#include "assert.h"
+#include "io_uv.h"
+#include "logging.h"
+
+/* Retry to connect to peer servers after 100 milliseconds, doubling the delay
+ * after each failed attempt up to 10 seconds. */
+#define IO_UV__CONNECT_RETRY_MIN_DELAY 100
+#define IO_UV__CONNECT_RETRY_MAX_DELAY 10000
+
+/* Maximum amount of milliseconds a heartbeat can be delayed in order to be
+ * coalesced with others. */
+#define IO_UV__HEARTBEAT_DELAY 5
+
+/* Maximum amount of bytes of messages queued for a disconnected peer. */
+#define IO_UV__SEND_QUEUE_SIZE (1024 * 1024)
+
+/* Maximum amount of bytes of bulk messages written at once to a peer. */
+#define IO_UV__BULK_CHUNK_SIZE (256 * 1024)
+
+void io_uv__host_init(struct io_uv__host *h,
+                      struct uv_loop_s *loop,
+                      struct raft_io_uv_transport *transport)
+{
+    h->data = NULL;
+    h->loop = loop;
+    h->transport = transport;
+    h->transport->data = h;
+    h->id = 0;
+    h->state = 0;
+    h->listening = false;
+    h->groups = NULL;
+    h->n_groups = 0;
+    h->clients = NULL;
+    h->n_clients = 0;
+    h->servers = NULL;
+    h->n_servers = 0;
+    h->connect_retry_min_delay = IO_UV__CONNECT_RETRY_MIN_DELAY;
+    h->connect_retry_max_delay = IO_UV__CONNECT_RETRY_MAX_DELAY;
+    h->heartbeat_delay = IO_UV__HEARTBEAT_DELAY;
+    h->send_queue_size = IO_UV__SEND_QUEUE_SIZE;
+    h->compress_threshold = 0;
+    h->bulk_chunk_size = IO_UV__BULK_CHUNK_SIZE;
+    h->numa_node = -1;
+    h->n_closing = 0;
+    h->shared_sync = false;
+    h->prepare_budget = 0;
+    h->n_prepared = 0;
+    RAFT__QUEUE_INIT(&h->sync_groups);
+    RAFT__QUEUE_INIT(&h->sync_round);
+    h->sync_work.data = h;
+    h->syncing = false;
+    h->n_syncs = 0;
+    h->close_cb = NULL;
+}
+
+int io_uv__host_setup(struct io_uv__host *h, unsigned id, const char *address)
+{
+    int rv;
+    if (h->state != 0) {
+        assert(h->state == IO_UV__ACTIVE);
+        if (id != h->id) {
+            return RAFT_EBADID;
+        }
+        return 0;
+    }
+    rv = h->transport->init(h->transport, id, address);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = uv_timer_init(h->loop, &h->heartbeat_timer);
+    assert(rv == 0); /* This should never fail */
+    h->heartbeat_timer.data = h;
+    rv = uv_prepare_init(h->loop, &h->cork);
+    assert(rv == 0); /* This should never fail */
+    h->cork.data = h;
+    h->id = id;
+    h->state = IO_UV__ACTIVE;
+    return 0;
+}
+
+int io_uv__host_add(struct io_uv__host *h, struct io_uv *uv)
+{
+    struct io_uv **groups;
+    unsigned i;
+
+    assert(h->state == 0 || h->state == IO_UV__ACTIVE);
+
+    for (i = 0; i < h->n_groups; i++) {
+        if (h->groups[i]->group == uv->group) {
+            return RAFT_EDUPID;
+        }
+    }
+
+    groups = raft_realloc(h->groups, (h->n_groups + 1) * sizeof *groups);
+    if (groups == NULL) {
+        return RAFT_ENOMEM;
+    }
+    groups[h->n_groups] = uv;
+    h->groups = groups;
+    h->n_groups++;
+
+    return 0;
+}
+
+void io_uv__host_remove(struct io_uv__host *h, struct io_uv *uv)
+{
+    unsigned i;
+    unsigned j;
+
+    for (i = 0; i < h->n_groups; i++) {
+        if (h->groups[i] == uv) {
+            break;
+        }
+    }
+    if (i == h->n_groups) {
+        return;
+    }
+
+    /* Left-shift the pointers of the rest of the groups. */
+    for (j = i + 1; j < h->n_groups; j++) {
+        h->groups[j - 1] = h->groups[j];
+    }
+
+    h->n_groups--;
+}
+
+struct io_uv *io_uv__host_group(struct io_uv__host *h, unsigned group)
+{
+    unsigned i;
+    for (i = 0; i < h->n_groups; i++) {
+        if (h->groups[i]->group == group) {
+            return h->groups[i];
+        }
+    }
+    return NULL;
+}
+
+int io_uv__host_listen(struct io_uv__host *h)
+{
+    int rv;
+    assert(h->state == IO_UV__ACTIVE);
+    if (h->listening) {
+        return 0;
+    }
+    rv = io_uv__listen(h);
+    if (rv != 0) {
+        return rv;
+    }
+    h->listening = true;
+    return 0;
+}
+
+static void heartbeat_timer_cb(uv_timer_t *timer)
+{
+    struct io_uv__host *h = timer->data;
+    io_uv__clients_flush(h);
+}
+
+void io_uv__host_heartbeat(struct io_uv__host *h)
+{
+    int rv;
+    assert(h->state == IO_UV__ACTIVE);
+    if (uv_is_active((uv_handle_t *)&h->heartbeat_timer)) {
+        return;
+    }
+    rv = uv_timer_start(&h->heartbeat_timer, heartbeat_timer_cb,
+                        h->heartbeat_delay, 0);
+    assert(rv == 0);
+}
+
+/* Flush the messages corked during the current loop iteration. This runs right
+ * before the loop blocks for I/O, so messages sent from any callback, including
+ * timer ones, are never held back waiting for the next I/O event. */
+static void cork_cb(uv_prepare_t *prepare)
+{
+    struct io_uv__host *h = prepare->data;
+    uv_prepare_stop(prepare);
+    io_uv__clients_uncork(h);
+}
+
+void io_uv__host_cork(struct io_uv__host *h)
+{
+    int rv;
+    assert(h->state == IO_UV__ACTIVE);
+    if (uv_is_active((uv_handle_t *)&h->cork)) {
+        return;
+    }
+    rv = uv_prepare_start(&h->cork, cork_cb);
+    assert(rv == 0);
+}
+
+/* Sync the file system of the data directory of every group in the current
+ * round, once per file system. */
+static void sync_work_cb(uv_work_t *work)
+{
+    struct io_uv__host *h = work->data;
+    raft__queue *head;
+
+    RAFT__QUEUE_FOREACH(head, &h->sync_round)
+    {
+        struct io_uv *uv = RAFT__QUEUE_DATA(head, struct io_uv, sync_queue);
+        struct stat sb;
+        raft__queue *prev;
+        int fd;
+
+        uv->sync_status = 0;
+
+        fd = open(uv->dir, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            uv->sync_status = -errno;
+            continue;
+        }
+        if (fstat(fd, &sb) == -1) {
+            uv->sync_status = -errno;
+            close(fd);
+            continue;
+        }
+        uv->sync_dev = sb.st_dev;
+
+        /* Check if an earlier group lives on the same file system. */
+        RAFT__QUEUE_FOREACH(prev, &h->sync_round)
+        {
+            struct io_uv *other;
+            if (prev == head) {
+                break;
+            }
+            other = RAFT__QUEUE_DATA(prev, struct io_uv, sync_queue);
+            if (other->sync_dev == uv->sync_dev) {
+                uv->sync_status = other->sync_status;
+                break;
+            }
+        }
+        if (prev == head) {
+            if (syncfs(fd) == -1) {
+                uv->sync_status = -errno;
+            }
+            h->n_syncs++;
+        }
+
+        close(fd);
+    }
+}
+
+static void sync_start(struct io_uv__host *h);
+
+static void sync_after_work_cb(uv_work_t *work, int status)
+{
+    struct io_uv__host *h = work->data;
+
+    assert(status == 0); /* We never cancel sync requests */
+    assert(h->syncing);
+
+    h->syncing = false;
+
+    while (!RAFT__QUEUE_IS_EMPTY(&h->sync_round)) {
+        struct io_uv *uv;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&h->sync_round);
+        uv = RAFT__QUEUE_DATA(head, struct io_uv, sync_queue);
+        RAFT__QUEUE_REMOVE(head);
+        status = 0;
+        if (uv->sync_status != 0) {
+            errorf(uv->io, "sync %s: %s", uv->dir,
+                   uv_strerror(uv->sync_status));
+            status = RAFT_ERR_IO;
+        }
+        /* Requests written while this sync was running need another one. */
+        if (!RAFT__QUEUE_IS_EMPTY(&uv->append_syncing_reqs)) {
+            RAFT__QUEUE_PUSH(&h->sync_groups, &uv->sync_queue);
+            uv->sync_queued = true;
+        }
+        io_uv__append_synced(uv, status);
+    }
+
+    sync_start(h);
+}
+
+/* Start a new sync round covering all groups waiting for one, unless a round
+ * is already running. */
+static void sync_start(struct io_uv__host *h)
+{
+    int rv;
+
+    if (h->syncing || RAFT__QUEUE_IS_EMPTY(&h->sync_groups)) {
+        return;
+    }
+
+    while (!RAFT__QUEUE_IS_EMPTY(&h->sync_groups)) {
+        struct io_uv *uv;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&h->sync_groups);
+        uv = RAFT__QUEUE_DATA(head, struct io_uv, sync_queue);
+        RAFT__QUEUE_REMOVE(head);
+        uv->sync_queued = false;
+        RAFT__QUEUE_PUSH(&h->sync_round, head);
+        io_uv__append_sync_start(uv);
+    }
+
+    rv = uv_queue_work(h->loop, &h->sync_work, sync_work_cb,
+                       sync_after_work_cb);
+    assert(rv == 0); /* This should never fail */
+    h->syncing = true;
+}
+
+void io_uv__host_sync(struct io_uv__host *h, struct io_uv *uv)
+{
+    assert(h->shared_sync);
+
+    /* If the group is part of the running round, it will be queued again once
+     * the round is done. */
+    if (!uv->sync_queued && RAFT__QUEUE_IS_EMPTY(&uv->append_round_reqs)) {
+        RAFT__QUEUE_PUSH(&h->sync_groups, &uv->sync_queue);
+        uv->sync_queued = true;
+    }
+
+    sync_start(h);
+}
+
+static void transport_close_cb(struct raft_io_uv_transport *t)
+{
+    struct io_uv__host *h = t->data;
+    assert(h->state == IO_UV__CLOSING);
+    if (h->groups != NULL) {
+        raft_free(h->groups);
+        h->groups = NULL;
+    }
+    if (h->clients != NULL) {
+        raft_free(h->clients);
+        h->clients = NULL;
+    }
+    if (h->servers != NULL) {
+        raft_free(h->servers);
+        h->servers = NULL;
+    }
+    h->state = IO_UV__CLOSED;
+    if (h->close_cb != NULL) {
+        h->close_cb(h);
+    }
+}
+
+/* Invoked once the heartbeat timer or the cork handle is closed. When both
+ * are, stop the connections. */
+static void handle_close_cb(uv_handle_t *handle)
+{
+    struct io_uv__host *h = handle->data;
+    assert(h->n_closing > 0);
+    h->n_closing--;
+    if (h->n_closing > 0) {
+        return;
+    }
+    io_uv__clients_stop(h);
+    io_uv__servers_stop(h);
+    h->transport->close(h->transport, transport_close_cb);
+}
+
+void io_uv__host_close(struct io_uv__host *h, io_uv__host_close_cb cb)
+{
+    assert(h->n_groups == 0);
+    assert(!h->syncing);
+    assert(h->state != IO_UV__CLOSING && h->state != IO_UV__CLOSED);
+    h->close_cb = cb;
+    /* If no group was ever initialized, the transport wasn't either. */
+    if (h->state == 0) {
+        h->state = IO_UV__CLOSING;
+        transport_close_cb(h->transport);
+        return;
+    }
+    h->state = IO_UV__CLOSING;
+    h->n_closing = 2;
+    uv_close((uv_handle_t *)&h->heartbeat_timer, handle_close_cb);
+    uv_close((uv_handle_t *)&h->cork, handle_close_cb);
+}
+
+void io_uv__host_emit(struct io_uv__host *h,
+                      int level,
+                      const char *format,
+                      ...)
+{
+    va_list args;
+    va_start(args, format);
+    emit_to_stream(stderr, h->id, uv_now(h->loop), level, format, args);
+    va_end(args);
+}
+
+int raft_io_uv_host_init(struct raft_io_uv_host *host,
+                         struct uv_loop_s *loop,
+                         struct raft_io_uv_transport *transport)
+{
+    struct io_uv__host *h;
+
+    assert(host != NULL);
+    assert(loop != NULL);
+    assert(transport != NULL);
+
+    h = raft_malloc(sizeof *h);
+    if (h == NULL) {
+        return RAFT_ENOMEM;
+    }
+    io_uv__host_init(h, loop, transport);
+    h->data = host;
+    host->impl = h;
+    host->close_cb = NULL;
+
+    return 0;
+}
+
+int raft_io_uv_host_set_shared_sync(struct raft_io_uv_host *host,
+                                    bool enabled)
+{
+    struct io_uv__host *h = host->impl;
+    assert(h != NULL);
+    if (h->n_groups > 0) {
+        return RAFT_EINVAL;
+    }
+    h->shared_sync = enabled;
+    return 0;
+}
+
+void raft_io_uv_host_set_prepare_budget(struct raft_io_uv_host *host,
+                                        unsigned n)
+{
+    struct io_uv__host *h = host->impl;
+    assert(h != NULL);
+    h->prepare_budget = n;
+}
+
+static void host_close_cb(struct io_uv__host *h)
+{
+    struct raft_io_uv_host *host = h->data;
+    host->impl = NULL;
+    raft_free(h);
+    if (host->close_cb != NULL) {
+        host->close_cb(host);
+    }
+}
+
+void raft_io_uv_host_close(struct raft_io_uv_host *host,
+                           raft_io_uv_host_close_cb cb)
+{
+    struct io_uv__host *h = host->impl;
+    assert(h != NULL);
+    host->close_cb = cb;
+    io_uv__host_close(h, host_close_cb);
+}
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "../include/raft/io_uv.h"
@@ -7,6 +9,7 @@
 #include "assert.h"
 #include "byte.h"
 #include "configuration.h"
+#include "entry.h"
 #include "io_uv.h"
 #include "io_uv_encoding.h"
 #include "io_uv_load.h"
@@ -23,6 +26,9 @@
 /* Arbitrary maximum configuration size. Should be practically be enough */
 #define SNAPSHOT_META_MAX_CONFIGURATION_SIZE 1024 * 1024
 
+/* Minimum number of closed segments to load in order to use more threads. */
+#define LOAD_MIN_PARALLEL_SEGMENTS 8
+
 /* Template string for open segment filenames: incrementing counter. */
 #define OPEN_SEGMENT_TEMPLATE "open-%llu"
 
@@ -33,6 +39,9 @@
 /* Return true if the given filename should be ignored. */
 static bool is_ignore_filename(const char *filename);
 
+/* Return #true if data in the given disk format version can be loaded. */
+static bool is_supported_format(uint64_t format);
+
 /* Try to match the filename of a snapshot metadata file
  * (snapshot-xxx-yyy-zzz.meta), and return its term and index in case of a
  * match. */
@@ -68,15 +77,23 @@ static int maybe_append_segment_meta(const char *filename,
                                      bool *appended);
 
 /* Parse the metadata file of a snapshot and populate the given snapshot object
- * accordingly. */
+ * accordingly, along with the checksums of its data blocks. The block size of
+ * @checksums is set to zero if the metadata file has no checksums. */
 static int load_snapshot_meta(struct io_uv *uv,
                               struct io_uv__snapshot_meta *meta,
-                              struct raft_snapshot *snapshot);
+                              struct raft_snapshot *snapshot,
+                              struct io_uv__snapshot_checksums *checksums);
 
-/* Load the snapshot data file. */
+/* Load up to @len bytes of the snapshot data file starting at @offset, and set
+ * @size to the size of the whole file. Every data block read is verified
+ * against the given checksums, if any. */
 static int load_snapshot_data(struct io_uv *uv,
                               struct io_uv__snapshot_meta *meta,
-                              struct raft_snapshot *snapshot);
+                              const struct io_uv__snapshot_checksums *checksums,
+                              struct raft_snapshot *snapshot,
+                              size_t offset,
+                              size_t len,
+                              size_t *size);
 
 /* Render the filename of the data file of a snapshot */
 static void snapshot_data_filename(struct io_uv__snapshot_meta *meta,
@@ -88,6 +105,39 @@ static int compare_snapshots(const void *item1, const void *item2);
 /* Compare two segments to decide which one is more recent. */
 static int compare_segments(const void *item1, const void *item2);
 
+/* Result of loading a closed segment ahead of time. */
+struct closed_load
+{
+    bool wanted;                /* Whether the segment needs to be loaded */
+    struct raft_entry *entries; /* Loaded entries */
+    size_t n;                   /* Number of loaded entries */
+    raft_index first;           /* Index of the first loaded entry */
+    int status;                 /* Result of the load */
+};
+
+/* State shared by the threads loading closed segments. */
+struct closed_loader
+{
+    struct io_uv *uv;
+    struct io_uv__segment_meta *segments; /* All segments */
+    struct closed_load *loads;            /* One item for each segment */
+    size_t n;                             /* Number of segments */
+    raft_index start_index;               /* First index needed */
+    size_t next;                          /* Next segment to pick */
+};
+
+/* Load all closed segments holding entries from @start_index on, using several
+ * threads if there are many of them. Each item of the returned array holds the
+ * result for the segment at the same position. */
+static int load_closed_segments(struct io_uv *uv,
+                                const raft_index start_index,
+                                struct io_uv__segment_meta *segments,
+                                size_t n_segments,
+                                struct closed_load **loads);
+
+/* Release the given entries and their batches. */
+static void release_entries(struct raft_entry *entries, size_t n);
+
 /* Load raft entries from the given segments. */
 static int load_entries_from_segments(struct io_uv *uv,
                                       const raft_index start_index,
@@ -113,15 +163,64 @@ static int load_entries_from_open_segment(struct raft_io *io,
                                           size_t *n_entries,
                                           raft_index *next_index);
 
-/* Load a single batch of entries from a segment.
+/* Load a single batch of entries from a segment with the given format version.
+ * If the format has per-entry checksums, the data of the first @skip entries of
+ * the batch is not checked.
  *
  * Set @last to #true if the loaded batch is the last one. */
 static int load_entries_batch_from_segment(struct raft_io *io,
                                            const int fd,
+                                           uint64_t format,
+                                           unsigned skip,
                                            struct raft_entry **entries,
                                            unsigned *n_entries,
                                            bool *last);
 
+/* Load a single batch of entries from a memory mapped segment, starting at the
+ * given offset and advancing it past the batch.
+ *
+ * If @dst is not #NULL, the entries data is copied to its base, which must
+ * have room for it, and its length is set to the size of the data. Otherwise
+ * a new buffer is allocated for it.
+ *
+ * Set @last to #true if the loaded batch is the last one. */
+static int load_entries_batch_from_mapping(struct raft_io *io,
+                                           const uint8_t *map,
+                                           size_t size,
+                                           uint64_t format,
+                                           unsigned skip,
+                                           size_t *offset,
+                                           struct raft_buffer *dst,
+                                           struct raft_entry **entries,
+                                           unsigned *n_entries,
+                                           bool *last);
+
+/* Check the integrity of the data of a batch of @n entries, against either the
+ * data checksum in its preamble or the given per-entry checksums, depending on
+ * the format version. */
+static int check_batch_data(struct raft_io *io,
+                            uint64_t format,
+                            const uint64_t preamble[2],
+                            const void *checksums,
+                            const void *data,
+                            size_t len,
+                            const struct raft_entry *entries,
+                            unsigned n,
+                            unsigned skip);
+
+/* Check if the batch preamble at the current offset of the given segment file
+ * is all zeros. A preamble cut short by the end of the file is not. */
+static int is_zero_preamble(const int fd, bool *flag);
+
+/* Return an upper bound of the number of entries a single batch can hold. */
+static unsigned max_batch_entries(struct io_uv *uv);
+
+/* Checksum a batch header or data buffer, keeping track of the time spent. */
+static unsigned checksum_batch(struct io_uv *uv,
+                               uint64_t format,
+                               const void *buf,
+                               size_t len);
+
 /* Render the filename of a closed segment. */
 static void closed_segment_filename(const raft_index first_index,
                                     const raft_index end_index,
@@ -133,29 +232,26 @@ static int extend_entries(const struct raft_entry *entries1,
                           struct raft_entry **entries2,
                           size_t *n_entries2);
 
-int io_uv__load_list(struct io_uv *uv,
-                     struct io_uv__snapshot_meta *snapshots[],
-                     size_t *n_snapshots,
-                     struct io_uv__segment_meta *segments[],
-                     size_t *n_segments)
+/* Append to the given lists the snapshots and, if @segments is not NULL, the
+ * segments found in @dir. */
+static int list_dir(struct io_uv *uv,
+                    const char *dir,
+                    struct io_uv__snapshot_meta *snapshots[],
+                    size_t *n_snapshots,
+                    struct io_uv__segment_meta *segments[],
+                    size_t *n_segments)
 {
     struct dirent **dirents;
     int n_dirents;
     int i;
     int rv = 0;
 
-    n_dirents = scandir(uv->dir, &dirents, NULL, alphasort);
+    n_dirents = scandir(dir, &dirents, NULL, alphasort);
     if (n_dirents < 0) {
-        errorf(uv->io, "scan %s: %s", uv->dir, uv_strerror(-errno));
+        errorf(uv->io, "scan %s: %s", dir, uv_strerror(-errno));
         return RAFT_ERR_IO;
     }
 
-    *snapshots = NULL;
-    *n_snapshots = 0;
-
-    *segments = NULL;
-    *n_segments = 0;
-
     for (i = 0; i < n_dirents; i++) {
         struct dirent *entry = dirents[i];
         bool ignore = is_ignore_filename(entry->d_name);
@@ -169,9 +265,9 @@ int io_uv__load_list(struct io_uv *uv,
         }
 
         /* Append to the snapshot list if it's a snapshot metadata filename */
-        rv = maybe_append_snapshot_meta(uv->dir, entry->d_name, snapshots,
+        rv = maybe_append_snapshot_meta(dir, entry->d_name, snapshots,
                                         n_snapshots, &appended);
-        if (appended || rv != 0) {
+        if (appended || rv != 0 || segments == NULL) {
             goto next;
         }
 
@@ -186,6 +282,31 @@ int io_uv__load_list(struct io_uv *uv,
     }
     free(dirents);
 
+    return rv;
+}
+
+int io_uv__load_list(struct io_uv *uv,
+                     struct io_uv__snapshot_meta *snapshots[],
+                     size_t *n_snapshots,
+                     struct io_uv__segment_meta *segments[],
+                     size_t *n_segments)
+{
+    int rv;
+
+    *snapshots = NULL;
+    *n_snapshots = 0;
+
+    *segments = NULL;
+    *n_segments = 0;
+
+    /* Snapshots taken before a snapshot directory was set are still found in
+     * the data directory. */
+    rv = list_dir(uv, uv->dir, snapshots, n_snapshots, segments, n_segments);
+    if (rv == 0 && uv->snapshot_dir != uv->dir) {
+        rv = list_dir(uv, uv->snapshot_dir, snapshots, n_snapshots, NULL,
+                      NULL);
+    }
+
     if (rv != 0 && *segments != NULL) {
         raft_free(*segments);
     }
@@ -205,14 +326,18 @@ int io_uv__load_snapshot(struct io_uv *uv,
                          struct io_uv__snapshot_meta *meta,
                          struct raft_snapshot *snapshot)
 {
+    struct io_uv__snapshot_checksums checksums;
+    size_t size;
     int rv;
 
-    rv = load_snapshot_meta(uv, meta, snapshot);
+    rv = load_snapshot_meta(uv, meta, snapshot, &checksums);
     if (rv != 0) {
         return rv;
     }
 
-    rv = load_snapshot_data(uv, meta, snapshot);
+    rv = load_snapshot_data(uv, meta, &checksums, snapshot, 0, SIZE_MAX,
+                            &size);
+    io_uv__snapshot_checksums_close(&checksums);
     if (rv != 0) {
         return rv;
     }
@@ -220,10 +345,227 @@ int io_uv__load_snapshot(struct io_uv *uv,
     return 0;
 }
 
+int io_uv__load_snapshot_checksums(struct io_uv *uv,
+                                   struct io_uv__snapshot_meta *meta,
+                                   struct io_uv__snapshot_checksums *checksums)
+{
+    struct raft_snapshot snapshot;
+    int rv;
+
+    rv = load_snapshot_meta(uv, meta, &snapshot, checksums);
+    if (rv != 0) {
+        return rv;
+    }
+
+    raft_configuration_close(&snapshot.configuration);
+
+    return 0;
+}
+
+int io_uv__load_snapshot_chunk(struct io_uv *uv,
+                               struct io_uv__snapshot_meta *meta,
+                               struct raft_snapshot *snapshot,
+                               size_t offset,
+                               size_t len,
+                               size_t *size)
+{
+    struct io_uv__snapshot_checksums checksums;
+    int rv;
+
+    rv = load_snapshot_meta(uv, meta, snapshot, &checksums);
+    if (rv != 0) {
+        return rv;
+    }
+
+    rv = load_snapshot_data(uv, meta, &checksums, snapshot, offset, len, size);
+    io_uv__snapshot_checksums_close(&checksums);
+    if (rv != 0) {
+        raft_configuration_close(&snapshot->configuration);
+        return rv;
+    }
+
+    return 0;
+}
+
+int io_uv__load_discard(struct io_uv *uv, const char *filename)
+{
+    if (uv->archive_dir != NULL) {
+        return raft__io_uv_fs_move(uv->dir, filename, uv->archive_dir);
+    }
+    return raft__io_uv_fs_unlink(uv->dir, filename);
+}
+
 int io_uv__load_closed(struct io_uv *uv,
                        struct io_uv__segment_meta *segment,
                        struct raft_entry *entries[],
                        size_t *n)
+{
+    raft_index first;
+    return io_uv__load_closed_from(uv, segment, segment->first_index, entries,
+                                   n, &first);
+}
+
+int io_uv__load_footer(struct io_uv *uv,
+                       int fd,
+                       size_t size,
+                       struct io_uv__batch_offset **batches,
+                       unsigned *n)
+{
+    uint8_t trailer[IO_UV__FOOTER_TRAILER_SIZE];
+    void *buf;
+    size_t len;
+    int rv;
+
+    *batches = NULL;
+    *n = 0;
+
+    if (size < sizeof(uint64_t) + IO_UV__FOOTER_TRAILER_SIZE) {
+        return 0;
+    }
+
+    if (lseek(fd, size - sizeof trailer, SEEK_SET) == -1) {
+        return RAFT_ERR_IO;
+    }
+    rv = raft__io_uv_fs_read_n(fd, trailer, sizeof trailer);
+    if (rv != 0) {
+        return RAFT_ERR_IO;
+    }
+
+    /* Segments written before the footer was introduced don't have one. */
+    *n = io_uv__decode_footer_trailer(trailer);
+    if (*n == 0) {
+        return 0;
+    }
+
+    len = io_uv__sizeof_footer(*n);
+    if (*n > max_batch_entries(uv) || len > size - sizeof(uint64_t)) {
+        errorf(uv->io, "footer has %u batches", *n);
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err;
+    }
+
+    buf = raft_malloc(len);
+    if (buf == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    if (lseek(fd, size - len, SEEK_SET) == -1) {
+        rv = RAFT_ERR_IO;
+        goto err_after_alloc;
+    }
+    rv = raft__io_uv_fs_read_n(fd, buf, len);
+    if (rv != 0) {
+        rv = RAFT_ERR_IO;
+        goto err_after_alloc;
+    }
+
+    rv = io_uv__decode_footer(buf, *n, batches);
+    if (rv != 0) {
+        if (rv == RAFT_ERR_IO_CORRUPT) {
+            errorf(uv->io, "corrupted segment footer");
+        }
+        goto err_after_alloc;
+    }
+
+    raft_free(buf);
+
+    return 0;
+
+err_after_alloc:
+    raft_free(buf);
+
+err:
+    assert(rv != 0);
+    *n = 0;
+    return rv;
+}
+
+/* Check that the batch offsets of a footer are consistent with the segment
+ * they belong to, whose batches end at the given offset. */
+static bool is_valid_footer(struct io_uv__segment_meta *segment,
+                            const struct io_uv__batch_offset *batches,
+                            unsigned n,
+                            size_t end)
+{
+    unsigned i;
+
+    if (batches[0].index != segment->first_index ||
+        batches[0].offset != sizeof(uint64_t) /* Format version */) {
+        return false;
+    }
+
+    for (i = 1; i < n; i++) {
+        if (batches[i].index <= batches[i - 1].index ||
+            batches[i].offset <= batches[i - 1].offset) {
+            return false;
+        }
+    }
+
+    return batches[n - 1].index <= segment->end_index &&
+           batches[n - 1].offset < end;
+}
+
+/* Return the position of the batch holding the entry with the given index. */
+static unsigned lookup_batch(const struct io_uv__batch_offset *batches,
+                             unsigned n,
+                             raft_index index)
+{
+    unsigned low = 0;
+    unsigned high = n;
+
+    assert(n > 0);
+    assert(index >= batches[0].index);
+
+    /* Find the last batch whose first index is not greater than @index. */
+    while (high - low > 1) {
+        unsigned mid = low + (high - low) / 2;
+        if (batches[mid].index <= index) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/* Append the @n1 entries of a batch to the @n2 ones loaded so far, in an array
+ * with room for @cap2 entries, growing it if needed. */
+static int append_batch_entries(const struct raft_entry *entries1,
+                                const size_t n1,
+                                struct raft_entry **entries2,
+                                size_t *n2,
+                                size_t *cap2)
+{
+    int rv;
+
+    if (*n2 + n1 <= *cap2) {
+        memcpy(*entries2 + *n2, entries1, n1 * sizeof *entries1);
+        *n2 += n1;
+        return 0;
+    }
+
+    rv = extend_entries(entries1, n1, entries2, n2);
+    if (rv != 0) {
+        return rv;
+    }
+    *cap2 = *n2;
+
+    return 0;
+}
+
+/* Implementation of @io_uv__load_closed_from. If @startup is #true and the
+ * segment can be mapped, the entries array is sized from the index range of the
+ * segment and the data of all batches is copied into a single buffer, which is
+ * used as the batch of all entries. */
+static int load_closed(struct io_uv *uv,
+                       struct io_uv__segment_meta *segment,
+                       raft_index index,
+                       bool startup,
+                       struct raft_entry *entries[],
+                       size_t *n,
+                       raft_index *first)
 {
     bool empty;                     /* Whether the file is empty */
     int fd;                         /* Segment file descriptor */
@@ -231,9 +573,31 @@ int io_uv__load_closed(struct io_uv *uv,
     bool last;                      /* Whether the last batch was reached */
     struct raft_entry *tmp_entries; /* Entries in current batch */
     unsigned tmp_n;                 /* Number of entries in current batch */
+    struct stat sb;                 /* Segment file information */
+    struct io_uv__batch_offset *batches; /* Batch offsets in the footer */
+    unsigned n_batches;                  /* Number of batches in the footer */
+    uint8_t *map;                   /* Memory mapping of the segment file */
+    size_t size;                    /* Size of the segment file */
+    size_t end;                     /* Offset where batches end */
+    size_t offset;                  /* Offset of the next batch */
+    raft_index next;                /* Index of the first entry of a batch */
+    unsigned skip;                  /* N. of entries not needing a check */
+    size_t cap;                     /* Capacity of the entries array */
+    struct raft_buffer buf;         /* Data of all batches, if startup */
+    struct raft_buffer dst;         /* Where to copy the next batch data */
     int i;
     int rv;
 
+    dst.len = 0;
+
+    assert(index >= segment->first_index);
+    assert(index <= segment->end_index);
+
+    map = MAP_FAILED;
+    size = 0;
+    buf.base = NULL;
+    buf.len = 0;
+
     /* If the segment is completely empty, just bail out. */
     rv = raft__io_uv_fs_is_empty(uv->dir, segment->filename, &empty);
     if (rv != 0) {
@@ -252,44 +616,156 @@ int io_uv__load_closed(struct io_uv *uv,
         goto err;
     }
 
-    if (format != IO_UV__DISK_FORMAT) {
+    if (!is_supported_format(format)) {
         errorf(uv->io, "segment %s: unexpected format version: %lu",
                segment->filename, format);
         rv = RAFT_ERR_IO;
         goto err_after_open;
     }
 
+    if (fstat(fd, &sb) != 0) {
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+    size = (size_t)sb.st_size;
+
+    /* If the segment has an index footer, the batches end where the footer
+     * begins, and we can skip directly to the batch holding @index. */
+    rv = io_uv__load_footer(uv, fd, size, &batches, &n_batches);
+    if (rv != 0) {
+        goto err_after_open;
+    }
+    end = size;
+    offset = sizeof format;
+    *first = segment->first_index;
+    if (n_batches > 0) {
+        end = size - io_uv__sizeof_footer(n_batches);
+        if (!is_valid_footer(segment, batches, n_batches, end)) {
+            errorf(uv->io, "segment %s: inconsistent footer",
+                   segment->filename);
+            raft_free(batches);
+            rv = RAFT_ERR_IO_CORRUPT;
+            goto err_after_open;
+        }
+        i = lookup_batch(batches, n_batches, index);
+        offset = batches[i].offset;
+        *first = batches[i].index;
+        raft_free(batches);
+    }
+
+    /* While starting no truncation can cut a closed segment, so we can map it
+     * and parse its batches in place, copying only the entries data. Later
+     * loads are serialized with truncations, but read the file anyway, so a
+     * segment that shrinks under them results in an error rather than in
+     * SIGBUS. If the file can't be mapped, fall back to reading it as well. */
+    if (startup && end > sizeof format && uv->load_mmap) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+        }
+    }
+    if (map == MAP_FAILED && lseek(fd, offset, SEEK_SET) == -1) {
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
     /* Load all batches in the segment. */
     *entries = NULL;
     *n = 0;
+    cap = 0;
+
+    /* Every batch takes more room in the file than its data, so the rest of
+     * the mapping is enough to hold the data of all batches. The number of
+     * entries can't exceed the number of bytes either, unless the filename
+     * is bogus. */
+    if (map != MAP_FAILED) {
+        buf.len = end - offset;
+        buf.base = raft_malloc(buf.len);
+        if (buf.base == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_open;
+        }
+        if (segment->end_index - *first < buf.len) {
+            cap = (size_t)(segment->end_index - *first + 1);
+            *entries = raft_malloc(cap * sizeof **entries);
+            if (*entries == NULL) {
+                rv = RAFT_ENOMEM;
+                goto err_after_buf_alloc;
+            }
+        }
+    }
+    dst.base = buf.base;
 
+    /* The entries preceding @index are not going to be used, so there's no
+     * need to check them if they have their own checksums. */
     last = false;
+    next = *first;
     for (i = 1; !last; i++) {
-        rv = load_entries_batch_from_segment(uv->io, fd, &tmp_entries, &tmp_n,
-                                             &last);
+        skip = index > next ? (unsigned)(index - next) : 0;
+        if (map != MAP_FAILED) {
+            rv = load_entries_batch_from_mapping(
+                uv->io, map, end, format, skip, &offset,
+                buf.base != NULL ? &dst : NULL, &tmp_entries, &tmp_n, &last);
+        } else {
+            rv = load_entries_batch_from_segment(uv->io, fd, format, skip,
+                                                 &tmp_entries, &tmp_n, &last);
+            if (rv == 0 && end != size) {
+                last = lseek(fd, 0, SEEK_CUR) >= (off_t)end;
+            }
+        }
         if (rv != 0) {
-            goto err_after_open;
+            goto err_after_buf_alloc;
+        }
+
+        if (buf.base != NULL) {
+            unsigned j;
+            for (j = 0; j < tmp_n; j++) {
+                tmp_entries[j].batch = buf.base;
+            }
+            /* Keep the data of the next batch aligned. */
+            dst.base = (uint8_t *)dst.base + dst.len;
+            if (dst.len % 8 != 0) {
+                dst.base = (uint8_t *)dst.base + 8 - (dst.len % 8);
+            }
+            assert((uint8_t *)dst.base <= (uint8_t *)buf.base + buf.len);
         }
 
-        rv = extend_entries(tmp_entries, tmp_n, entries, n);
+        rv = append_batch_entries(tmp_entries, tmp_n, entries, n, &cap);
         if (rv != 0) {
             goto err_after_batch_load;
         }
 
         raft_free(tmp_entries);
+        next += tmp_n;
     }
 
     assert(i > 1); /* At least one batch was loaded. */
 
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
     close(fd);
 
     return 0;
 
 err_after_batch_load:
-    raft_free(tmp_entries[0].batch);
+    if (buf.base == NULL) {
+        raft_free(tmp_entries[0].batch);
+    }
     raft_free(tmp_entries);
 
+err_after_buf_alloc:
+    if (buf.base != NULL) {
+        raft_free(*entries);
+        raft_free(buf.base);
+        *entries = NULL;
+        *n = 0;
+    }
+
 err_after_open:
+    if (map != MAP_FAILED) {
+        munmap(map, size);
+    }
     close(fd);
 
 err:
@@ -298,81 +774,486 @@ err:
     return rv;
 }
 
+int io_uv__load_closed_from(struct io_uv *uv,
+                            struct io_uv__segment_meta *segment,
+                            raft_index index,
+                            struct raft_entry *entries[],
+                            size_t *n,
+                            raft_index *first)
+{
+    return load_closed(uv, segment, index, false, entries, n, first);
+}
+
+int io_uv__load_batch_index(struct io_uv *uv,
+                            struct io_uv__segment_meta *segment,
+                            int fd,
+                            size_t size,
+                            struct io_uv__batch_offset **batches,
+                            unsigned *n,
+                            size_t *end)
+{
+    int rv;
+
+    rv = io_uv__load_footer(uv, fd, size, batches, n);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (*n > 0) {
+        *end = size - io_uv__sizeof_footer(*n);
+        if (!is_valid_footer(segment, *batches, *n, *end)) {
+            errorf(uv->io, "segment %s: inconsistent footer",
+                   segment->filename);
+            raft_free(*batches);
+            *batches = NULL;
+            *n = 0;
+            return RAFT_ERR_IO_CORRUPT;
+        }
+        return 0;
+    }
+
+    *end = size;
+    return io_uv__load_batch_offsets(uv, fd, size, segment->first_index,
+                                     batches, n);
+}
+
+int io_uv__load_batch(struct io_uv *uv,
+                      int fd,
+                      uint64_t format,
+                      size_t offset,
+                      struct raft_entry **entries,
+                      unsigned *n)
+{
+    bool last;
+
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        return RAFT_ERR_IO;
+    }
+
+    return load_entries_batch_from_segment(uv->io, fd, format, 0, entries, n,
+                                           &last);
+}
+
+int io_uv__load_batch_offsets(struct io_uv *uv,
+                              int fd,
+                              size_t end,
+                              raft_index first_index,
+                              struct io_uv__batch_offset **batches,
+                              unsigned *n)
+{
+    raft_index index = first_index;
+    uint64_t format;
+    size_t offset = sizeof format; /* Skip the format version */
+    unsigned cap = 0;
+    void *header = NULL;
+    size_t header_cap = 0;
+    int rv;
+
+    *batches = NULL;
+    *n = 0;
+
+    if (pread(fd, &format, sizeof format, 0) != sizeof format) {
+        rv = RAFT_ERR_IO;
+        goto err;
+    }
+    format = byte__flip64(format);
+
+    while (offset < end) {
+        uint64_t preamble[2]; /* CRC32 checksums and number of raft entries */
+        uint64_t word;
+        size_t header_len;
+        size_t data_len;
+        unsigned n_entries;
+
+        if (lseek(fd, offset, SEEK_SET) == -1) {
+            rv = RAFT_ERR_IO;
+            goto err;
+        }
+        rv = raft__io_uv_fs_read_n(fd, preamble, sizeof preamble);
+        if (rv != 0) {
+            rv = RAFT_ERR_IO;
+            goto err;
+        }
+
+        word = byte__flip64(preamble[1]);
+        n_entries = io_uv__batch_n_entries(format, word);
+        if (n_entries == 0 || n_entries > max_batch_entries(uv)) {
+            rv = RAFT_ERR_IO_CORRUPT;
+            goto err;
+        }
+
+        /* Read the entry headers, to figure out the size of the data. */
+        header_len = io_uv__batch_header_size(format, word);
+        if (header_len < sizeof(uint64_t) ||
+            header_len > io_uv__sizeof_batch_header(n_entries)) {
+            rv = RAFT_ERR_IO_CORRUPT;
+            goto err;
+        }
+        if (header_len > header_cap) {
+            void *p = raft_realloc(header, header_len);
+            if (p == NULL) {
+                rv = RAFT_ENOMEM;
+                goto err;
+            }
+            header = p;
+            header_cap = header_len;
+        }
+        *(uint64_t *)header = preamble[1];
+        rv = raft__io_uv_fs_read_n(fd, (uint8_t *)header + sizeof(uint64_t),
+                                   header_len - sizeof(uint64_t));
+        if (rv != 0) {
+            rv = RAFT_ERR_IO;
+            goto err;
+        }
+
+        rv = io_uv__sizeof_batch_data(format, header, header_len, &data_len);
+        if (rv != 0) {
+            rv = RAFT_ERR_IO_CORRUPT;
+            goto err;
+        }
+
+        if (*n == cap) {
+            struct io_uv__batch_offset *p;
+            cap = cap == 0 ? 16 : cap * 2;
+            p = raft_realloc(*batches, cap * sizeof *p);
+            if (p == NULL) {
+                rv = RAFT_ENOMEM;
+                goto err;
+            }
+            *batches = p;
+        }
+        (*batches)[*n].index = index;
+        (*batches)[*n].offset = offset;
+        (*n)++;
+
+        index += n_entries;
+        offset += sizeof preamble[0] + header_len +
+                  io_uv__sizeof_batch_checksums(format, n_entries) + data_len;
+    }
+
+    if (offset != end || *n == 0) {
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err;
+    }
+
+    raft_free(header);
+
+    return 0;
+
+err:
+    assert(rv != 0);
+    if (header != NULL) {
+        raft_free(header);
+    }
+    if (*batches != NULL) {
+        raft_free(*batches);
+        *batches = NULL;
+    }
+    *n = 0;
+    return rv;
+}
+
+int io_uv__load_begin(struct io_uv *uv,
+                      struct io_uv__load_cursor *cursor,
+                      struct raft_snapshot **snapshot)
+{
+    struct raft_io_uv_load_stats *stats = &uv->stats.load;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    uint64_t time;
+    size_t i;
+    int rv;
+
+    *snapshot = NULL;
+    cursor->segments = NULL;
+    cursor->n_segments = 0;
+    cursor->next = 0;
+    cursor->next_index = 1;
+    cursor->n_loaded = 0;
+
+    memset(stats, 0, sizeof *stats);
+
+    /* List available snapshots and segments. */
+    time = uv_hrtime();
+    rv = io_uv__load_list(uv, &snapshots, &n_snapshots, &cursor->segments,
+                          &cursor->n_segments);
+    if (rv != 0) {
+        goto err;
+    }
+    stats->list = (uv_hrtime() - time) / 1000;
+
+    /* Load the most recent snapshot, if any. */
+    if (snapshots != NULL) {
+        time = uv_hrtime();
+        *snapshot = raft_malloc(sizeof **snapshot);
+        if (*snapshot == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
+        rv = io_uv__load_snapshot(uv, &snapshots[n_snapshots - 1], *snapshot);
+        if (rv != 0) {
+            goto err;
+        }
+        raft_free(snapshots);
+        snapshots = NULL;
+        cursor->next_index = (*snapshot)->index + 1;
+        stats->snapshot = (uv_hrtime() - time) / 1000;
+    }
+
+    for (i = 0; i < cursor->n_segments; i++) {
+        struct io_uv__segment_meta *segment = &cursor->segments[i];
+        if (segment->is_open || segment->end_index >= cursor->next_index) {
+            stats->n_segments++;
+        }
+    }
+
+    return 0;
+
+err:
+    if (snapshots != NULL) {
+        raft_free(snapshots);
+    }
+    if (*snapshot != NULL) {
+        raft_free(*snapshot);
+        *snapshot = NULL;
+    }
+    io_uv__load_end(cursor);
+    assert(rv != 0);
+    return rv;
+}
+
+int io_uv__load_next(struct io_uv *uv,
+                     struct io_uv__load_cursor *cursor,
+                     size_t max,
+                     struct raft_entry *entries[],
+                     size_t *n)
+{
+    struct raft_io_uv_load_stats *stats = &uv->stats.load;
+    struct io_uv__segment_meta *segments = &cursor->segments[cursor->next];
+    size_t n_segments = cursor->n_segments - cursor->next;
+    uint64_t checksum_time;
+    uint64_t time;
+    int rv;
+
+    *entries = NULL;
+    *n = 0;
+
+    if (n_segments == 0) {
+        return 0;
+    }
+    if (n_segments > max) {
+        n_segments = max;
+    }
+
+    /* Only the first segment loaded can overlap with the snapshot. */
+    if (cursor->n_loaded > 0 && !segments[0].is_open &&
+        segments[0].first_index != cursor->next_index) {
+        errorf(uv->io, "segment %s: expected first index to be %lld",
+               segments[0].filename, cursor->next_index);
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    checksum_time = uv->load_checksum_time;
+    time = uv_hrtime();
+    rv = load_entries_from_segments(uv, cursor->next_index, segments,
+                                    n_segments, entries, n);
+    if (rv != 0) {
+        return rv;
+    }
+    stats->segments += (uv_hrtime() - time) / 1000;
+    stats->checksum += (uv->load_checksum_time - checksum_time) / 1000;
+    stats->n_entries += *n;
+
+    cursor->next += n_segments;
+    cursor->next_index += *n;
+    cursor->n_loaded += *n;
+
+    return 0;
+}
+
+void io_uv__load_end(struct io_uv__load_cursor *cursor)
+{
+    if (cursor->segments != NULL) {
+        raft_free(cursor->segments);
+        cursor->segments = NULL;
+    }
+    cursor->n_segments = 0;
+    cursor->next = 0;
+}
+
 int io_uv__load_all(struct io_uv *uv,
                     struct raft_snapshot **snapshot,
                     struct raft_entry *entries[],
                     size_t *n)
+{
+    struct io_uv__load_cursor cursor;
+    int rv;
+
+    *entries = NULL;
+    *n = 0;
+
+    rv = io_uv__load_begin(uv, &cursor, snapshot);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Read data from all segments at once, closing any open segments. */
+    rv = io_uv__load_next(uv, &cursor, cursor.n_segments, entries, n);
+    io_uv__load_end(&cursor);
+    if (rv != 0) {
+        if (*snapshot != NULL) {
+            raft_free(*snapshot);
+            *snapshot = NULL;
+        }
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Free the batches of the given entries which are not referenced by any of
+ * the @n_kept entries starting at position @start. */
+static void release_unused_batches(struct raft_entry *entries,
+                                   size_t n,
+                                   size_t start,
+                                   size_t n_kept)
+{
+    void *first = entries[start].batch;
+    void *last = entries[start + n_kept - 1].batch;
+    void *prev = NULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        void *batch = entries[i].batch;
+        if (batch == prev) {
+            continue;
+        }
+        prev = batch;
+        if (batch == first || batch == last) {
+            continue;
+        }
+        if (i >= start && i < start + n_kept) {
+            continue;
+        }
+        raft_free(batch);
+    }
+}
+
+int io_uv__load_range(struct io_uv *uv,
+                      raft_index index,
+                      unsigned max,
+                      struct raft_entry *entries[],
+                      unsigned *n)
 {
     struct io_uv__snapshot_meta *snapshots;
     struct io_uv__segment_meta *segments;
-    raft_index start_index = 1;
+    struct raft_entry *tmp_entries;
     size_t n_snapshots;
     size_t n_segments;
+    size_t n_entries = 0;
+    size_t tmp_n;
+    size_t i;
     int rv;
 
-    *snapshot = NULL;
+    assert(index > 0);
+    assert(max > 0);
+
     *entries = NULL;
     *n = 0;
 
-    /* List available snapshots and segments. */
     rv = io_uv__load_list(uv, &snapshots, &n_snapshots, &segments, &n_segments);
     if (rv != 0) {
         goto err;
     }
 
-    /* Load the most recent snapshot, if any. */
     if (snapshots != NULL) {
-        *snapshot = raft_malloc(sizeof **snapshot);
-        if (*snapshot == NULL) {
-            rv = RAFT_ENOMEM;
-            goto err;
+        raft_free(snapshots);
+    }
+
+    for (i = 0; i < n_segments && n_entries < max; i++) {
+        struct io_uv__segment_meta *segment = &segments[i];
+        raft_index next_index = index + n_entries;
+        raft_index first;
+        size_t start;
+        size_t n_kept;
+
+        /* Open segments might be still being written, and they come after all
+         * closed ones. */
+        if (segment->is_open) {
+            break;
+        }
+
+        if (segment->end_index < next_index) {
+            continue;
+        }
+
+        /* There's a gap, the desired entry is not available. */
+        if (segment->first_index > next_index) {
+            break;
+        }
+
+        rv = io_uv__load_closed_from(uv, segment, next_index, &tmp_entries,
+                                     &tmp_n, &first);
+        if (rv != 0) {
+            goto err_after_list;
         }
-        rv = io_uv__load_snapshot(uv, &snapshots[n_snapshots - 1], *snapshot);
+
+        start = next_index - first;
+        if (start >= tmp_n) {
+            entry_batches__destroy(tmp_entries, tmp_n);
+            break;
+        }
+
+        n_kept = tmp_n - start;
+        if (n_kept > max - n_entries) {
+            n_kept = max - n_entries;
+        }
+
+        rv = extend_entries(&tmp_entries[start], n_kept, entries, &n_entries);
         if (rv != 0) {
-            goto err;
+            entry_batches__destroy(tmp_entries, tmp_n);
+            goto err_after_list;
         }
-        raft_free(snapshots);
-        snapshots = NULL;
-        start_index = (*snapshot)->index + 1;
+
+        release_unused_batches(tmp_entries, tmp_n, start, n_kept);
+        raft_free(tmp_entries);
     }
 
-    /* Read data from segments, closing any open segments. */
     if (segments != NULL) {
-        rv = load_entries_from_segments(uv, start_index, segments, n_segments,
-                                        entries, n);
-        if (rv != 0) {
-            goto err;
-        }
         raft_free(segments);
-        segments = NULL;
     }
 
+    *n = (unsigned)n_entries;
+
     return 0;
 
-err:
-    if (snapshots != NULL) {
-        raft_free(snapshots);
+err_after_list:
+    if (*entries != NULL) {
+        entry_batches__destroy(*entries, (unsigned)n_entries);
+        *entries = NULL;
     }
     if (segments != NULL) {
         raft_free(segments);
     }
-    if (*snapshot != NULL) {
-        raft_free(*snapshot);
-    }
 
+err:
     assert(rv != 0);
-
-    *n = 0;
-
     return rv;
 }
 
-static const char *is_ignore_filenamed_filenames[] = {".", "..", "metadata1",
-                                                      "metadata2", NULL};
+static const char *is_ignore_filenamed_filenames[] = {
+    ".", "..", "metadata1", "metadata2", UV__FILE_PROBE_CACHE, NULL};
 
 /**
  * Return true if this is a segment filename.
  */
+static bool is_supported_format(uint64_t format)
+{
+    return format == 1 || format == IO_UV__DISK_FORMAT ||
+           format == IO_UV__DISK_FORMAT_ENTRY_CHECKSUMS ||
+           io_uv__format_is_compact(format);
+}
+
 static bool is_ignore_filename(const char *filename)
 {
     const char **cursor = is_ignore_filenamed_filenames;
@@ -449,6 +1330,7 @@ static int maybe_append_snapshot_meta(const char *dir,
 
     assert(strlen(filename) < sizeof snapshot.filename);
     strcpy(snapshot.filename, filename);
+    snapshot.dir = dir;
 
     /* Check if there's actually a snapshot file for this snapshot metadata. If
      * there's none, it means that we aborted before finishing the snapshot, so
@@ -528,13 +1410,17 @@ append:
 
 static int load_snapshot_meta(struct io_uv *uv,
                               struct io_uv__snapshot_meta *meta,
-                              struct raft_snapshot *snapshot)
+                              struct raft_snapshot *snapshot,
+                              struct io_uv__snapshot_checksums *checksums)
 {
     uint64_t header[1 + /* Format version */
                     1 + /* CRC checksum */
                     1 + /* Configuration index */
                     1 /* Configuration length */];
     struct raft_buffer buf;
+    struct stat sb;
+    void *section;
+    size_t len;
     unsigned format;
     unsigned crc1;
     unsigned crc2;
@@ -544,7 +1430,7 @@ static int load_snapshot_meta(struct io_uv *uv,
     snapshot->term = meta->term;
     snapshot->index = meta->index;
 
-    fd = raft__io_uv_fs_open(uv->dir, meta->filename, O_RDONLY);
+    fd = raft__io_uv_fs_open(meta->dir, meta->filename, O_RDONLY);
     if (fd == -1) {
         errorf(uv->io, "open %s: %s", meta->filename, uv_strerror(-errno));
         rv = RAFT_ERR_IO;
@@ -559,7 +1445,7 @@ static int load_snapshot_meta(struct io_uv *uv,
     }
 
     format = byte__flip64(header[0]);
-    if (format != IO_UV__DISK_FORMAT) {
+    if (!is_supported_format(format)) {
         errorf(uv->io, "read %s: unsupported format %lu", meta->filename,
                format);
         rv = RAFT_ERR_IO_CORRUPT;
@@ -593,8 +1479,9 @@ static int load_snapshot_meta(struct io_uv *uv,
         goto err_after_buf_malloc;
     }
 
-    crc2 = byte__crc32(header + 2, sizeof header - sizeof(uint64_t) * 2, 0);
-    crc2 = byte__crc32(buf.base, buf.len, crc2);
+    crc2 = io_uv__checksum(format, header + 2,
+                           sizeof header - sizeof(uint64_t) * 2, 0);
+    crc2 = io_uv__checksum(format, buf.base, buf.len, crc2);
 
     if (crc1 != crc2) {
         errorf(uv->io, "read %s: corrupted data", meta->filename);
@@ -602,10 +1489,36 @@ static int load_snapshot_meta(struct io_uv *uv,
         goto err_after_open;
     }
 
+    /* Any data following the configuration is the checksums section. */
+    io_uv__snapshot_checksums_init(checksums, 0);
+    if (fstat(fd, &sb) == -1) {
+        errorf(uv->io, "stat %s: %s", meta->filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_buf_malloc;
+    }
+    len = (size_t)sb.st_size - sizeof header - buf.len;
+    if (len > 0) {
+        section = raft_malloc(len);
+        if (section == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_buf_malloc;
+        }
+        rv = raft__io_uv_fs_read_n(fd, section, len);
+        if (rv == 0) {
+            rv = io_uv__decode_snapshot_checksums(section, len, checksums);
+        }
+        raft_free(section);
+        if (rv != 0) {
+            errorf(uv->io, "read %s: corrupted checksums", meta->filename);
+            rv = rv == RAFT_ENOMEM ? rv : RAFT_ERR_IO_CORRUPT;
+            goto err_after_checksums_decode;
+        }
+    }
+
     raft_configuration_init(&snapshot->configuration);
     rv = configuration__decode(&buf, &snapshot->configuration);
     if (rv != 0) {
-        goto err_after_buf_malloc;
+        goto err_after_checksums_decode;
     }
 
     raft_free(buf.base);
@@ -613,6 +1526,9 @@ static int load_snapshot_meta(struct io_uv *uv,
 
     return 0;
 
+err_after_checksums_decode:
+    io_uv__snapshot_checksums_close(checksums);
+
 err_after_buf_malloc:
     raft_free(buf.base);
 
@@ -624,44 +1540,128 @@ err:
     return rv;
 }
 
+/* Check the given blocks of snapshot data, starting at @offset, against their
+ * checksums. */
+static int verify_snapshot_data(
+    struct io_uv *uv,
+    const char *filename,
+    const struct io_uv__snapshot_checksums *checksums,
+    const uint8_t *data,
+    size_t offset,
+    size_t len)
+{
+    size_t block_size = checksums->block_size;
+    size_t i = offset / block_size;
+    size_t n;
+
+    assert(offset % block_size == 0);
+
+    while (len > 0) {
+        n = len < block_size ? len : block_size;
+        assert(i < checksums->n);
+        if (byte__crc32c(data, n, 0) != checksums->crcs[i]) {
+            errorf(uv->io, "read %s: corrupted data at offset %lu", filename,
+                   i * block_size);
+            return RAFT_ERR_IO_CORRUPT;
+        }
+        data += n;
+        len -= n;
+        i++;
+    }
+
+    return 0;
+}
+
 static int load_snapshot_data(struct io_uv *uv,
                               struct io_uv__snapshot_meta *meta,
-                              struct raft_snapshot *snapshot)
+                              const struct io_uv__snapshot_checksums *checksums,
+                              struct raft_snapshot *snapshot,
+                              size_t offset,
+                              size_t len,
+                              size_t *size)
 {
     struct stat sb;
     io_uv__filename filename;
     struct raft_buffer buf;
+    size_t block_size = checksums->block_size;
+    size_t start; /* Offset of the first byte to read */
+    size_t end;   /* Offset past the last byte to read */
     int fd;
     int rv;
 
     snapshot_data_filename(meta, filename);
 
-    rv = raft__io_uv_fs_stat(uv->dir, filename, &sb);
+    rv = raft__io_uv_fs_stat(meta->dir, filename, &sb);
     if (rv != 0) {
         errorf(uv->io, "stat %s: %s", filename, uv_strerror(-errno));
         rv = RAFT_ERR_IO;
         goto err;
     }
 
-    fd = raft__io_uv_fs_open(uv->dir, filename, O_RDONLY);
+    fd = raft__io_uv_fs_open(meta->dir, filename, O_RDONLY);
     if (fd == -1) {
         errorf(uv->io, "open %s: %s", filename, uv_strerror(-errno));
         rv = RAFT_ERR_IO;
         goto err;
     }
 
-    buf.len = sb.st_size;
-    buf.base = raft_malloc(buf.len);
+    *size = sb.st_size;
+    if (offset > *size) {
+        errorf(uv->io, "read %s: offset %lu past end", filename, offset);
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
+    buf.len = *size - offset;
+    if (buf.len > len) {
+        buf.len = len;
+    }
+
+    /* When verifying checksums, read whole blocks. */
+    start = offset;
+    end = offset + buf.len;
+    if (block_size > 0) {
+        if (checksums->size != *size) {
+            errorf(uv->io, "read %s: size %lu instead of %lu", filename, *size,
+                   checksums->size);
+            rv = RAFT_ERR_IO_CORRUPT;
+            goto err_after_open;
+        }
+        start -= start % block_size;
+        if (end % block_size != 0) {
+            end += block_size - end % block_size;
+            if (end > *size) {
+                end = *size;
+            }
+        }
+    }
+
+    if (start > 0 && lseek(fd, start, SEEK_SET) == -1) {
+        errorf(uv->io, "seek %s: %s", filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
+    buf.base = raft_malloc(end - start);
     if (buf.base == NULL) {
         rv = RAFT_ENOMEM;
         goto err_after_open;
     }
 
-    rv = raft__io_uv_fs_read_n(fd, buf.base, buf.len);
+    rv = raft__io_uv_fs_read_n(fd, buf.base, end - start);
     if (rv != 0) {
         goto err_after_buf_alloc;
     }
 
+    if (block_size > 0) {
+        rv = verify_snapshot_data(uv, filename, checksums, buf.base, start,
+                                  end - start);
+        if (rv != 0) {
+            goto err_after_buf_alloc;
+        }
+        memmove(buf.base, (uint8_t *)buf.base + (offset - start), buf.len);
+    }
+
     snapshot->bufs = raft_malloc(sizeof *snapshot->bufs);
     snapshot->n_bufs = 1;
     if (snapshot->bufs == NULL) {
@@ -752,8 +1752,10 @@ static int load_entries_from_segments(struct io_uv *uv,
                                       size_t *n_entries)
 {
     raft_index next_index; /* Index of the next entry to load from disk */
+    struct closed_load *loads;      /* Closed segments loaded in advance */
     struct raft_entry *tmp_entries; /* Entries in current segment */
     size_t tmp_n;                   /* Number of entries in current segment */
+    size_t cap;                     /* Capacity of the entries array */
     size_t i;
     int rv;
 
@@ -764,6 +1766,26 @@ static int load_entries_from_segments(struct io_uv *uv,
 
     next_index = start_index;
 
+    /* Read, check and decode the closed segments first, possibly in parallel,
+     * then stitch their entries together in index order. */
+    rv = load_closed_segments(uv, start_index, segments, n_segments, &loads);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Size the entries array for all the closed segments at once. */
+    cap = 0;
+    for (i = 0; i < n_segments; i++) {
+        cap += loads[i].n;
+    }
+    if (cap > 0) {
+        *entries = raft_malloc(cap * sizeof **entries);
+        if (*entries == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
+    }
+
     for (i = 0; i < n_segments; i++) {
         struct io_uv__segment_meta *segment = &segments[i];
 
@@ -773,15 +1795,16 @@ static int load_entries_from_segments(struct io_uv *uv,
             if (rv != 0) {
                 goto err;
             }
+            cap = *n_entries;
         } else {
             unsigned prefix = 0; /* N of prefix entries ignored */
             unsigned j;
             void *batch;
 
-            /* If the entries in the segment are no longer needed, just remove
+            /* If the entries in the segment are no longer needed, just discard
              * it. */
             if (segment->end_index < start_index) {
-                rv = raft__io_uv_fs_unlink(uv->dir, segment->filename);
+                rv = io_uv__load_discard(uv, segment->filename);
                 if (rv != 0) {
                     goto err;
                 }
@@ -809,17 +1832,24 @@ static int load_entries_from_segments(struct io_uv *uv,
                     rv = RAFT_ERR_IO_CORRUPT;
                     goto err;
                 }
-                prefix = next_index - segment->first_index;
             }
 
-            rv = io_uv__load_closed(uv, segment, &tmp_entries, &tmp_n);
+            /* The load might have skipped the batches of the segment preceding
+             * the one holding the start index. */
+            assert(loads[i].wanted);
+            assert(loads[i].first <= next_index);
+            prefix = next_index - loads[i].first;
+            rv = loads[i].status;
             if (rv != 0) {
                 goto err;
             }
+            tmp_entries = loads[i].entries;
+            tmp_n = loads[i].n;
+            loads[i].entries = NULL;
 
             if (tmp_n - prefix > 0) {
-                rv = extend_entries(tmp_entries + prefix, tmp_n - prefix,
-                                    entries, n_entries);
+                rv = append_batch_entries(tmp_entries + prefix, tmp_n - prefix,
+                                          entries, n_entries, &cap);
                 if (rv != 0) {
                     /* TODO: release memory of entries in tmp_entries */
                     goto err;
@@ -851,29 +1881,152 @@ static int load_entries_from_segments(struct io_uv *uv,
         }
     }
 
+    raft_free(loads);
+
+    if (*n_entries == 0 && *entries != NULL) {
+        raft_free(*entries);
+        *entries = NULL;
+    }
+
     return 0;
 
 err:
     assert(rv != 0);
 
+    /* Free the closed segments loaded in advance that were not consumed. */
+    for (i = 0; i < n_segments; i++) {
+        if (loads[i].entries != NULL) {
+            release_entries(loads[i].entries, loads[i].n);
+        }
+    }
+    raft_free(loads);
+
     /* Free any batch that we might have allocated and the entries array as
      * well. */
     if (*entries != NULL) {
-        void *batch = NULL;
+        release_entries(*entries, *n_entries);
+        *entries = NULL;
+        *n_entries = 0;
+    }
+
+    return rv;
+}
+
+static void release_entries(struct raft_entry *entries, size_t n)
+{
+    void *batch = NULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct raft_entry *entry = &entries[i];
+        if (entry->batch != batch) {
+            batch = entry->batch;
+            raft_free(batch);
+        }
+    }
+
+    raft_free(entries);
+}
+
+/* Body of the threads loading closed segments, also run by the loop thread. */
+static void closed_loader_run(void *arg)
+{
+    struct closed_loader *l = arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+        struct closed_load *load;
+        raft_index index;
+
+        if (i >= l->n) {
+            break;
+        }
+
+        load = &l->loads[i];
+        if (!load->wanted) {
+            continue;
+        }
+
+        index = l->segments[i].first_index;
+        if (index < l->start_index) {
+            index = l->start_index;
+        }
+
+        load->status = load_closed(l->uv, &l->segments[i], index, true,
+                                   &load->entries, &load->n, &load->first);
+        if (load->status != 0) {
+            load->entries = NULL;
+            load->n = 0;
+        }
+    }
+}
+
+/* Entry point of the threads started to load closed segments. */
+static void closed_loader_thread(void *arg)
+{
+    struct closed_loader *l = arg;
+    io_uv__disk_pin(l->uv);
+    closed_loader_run(arg);
+}
+
+static int load_closed_segments(struct io_uv *uv,
+                                const raft_index start_index,
+                                struct io_uv__segment_meta *segments,
+                                size_t n_segments,
+                                struct closed_load **loads)
+{
+    struct closed_loader loader;
+    uv_thread_t threads[IO_UV__MAX_LOAD_THREADS - 1];
+    unsigned n_threads = 0;
+    unsigned n_wanted = 0;
+    size_t i;
+    int rv;
+
+    *loads = raft_malloc(n_segments * sizeof **loads);
+    if (*loads == NULL) {
+        return RAFT_ENOMEM;
+    }
 
-        for (i = 0; i < *n_entries; i++) {
-            struct raft_entry *entry = &(*entries)[i];
+    for (i = 0; i < n_segments; i++) {
+        struct closed_load *load = &(*loads)[i];
+        load->wanted =
+            !segments[i].is_open && segments[i].end_index >= start_index;
+        load->entries = NULL;
+        load->n = 0;
+        load->first = 0;
+        load->status = 0;
+        if (load->wanted) {
+            n_wanted++;
+        }
+    }
+
+    loader.uv = uv;
+    loader.segments = segments;
+    loader.loads = *loads;
+    loader.n = n_segments;
+    loader.start_index = start_index;
+    loader.next = 0;
 
-            if (entry->batch != batch) {
-                batch = entry->batch;
-                raft_free(batch);
+    /* If we can't start a thread, we'll just do more work in this one. */
+    if (n_wanted >= LOAD_MIN_PARALLEL_SEGMENTS) {
+        while (n_threads < uv->n_load_threads - 1) {
+            rv = uv_thread_create(&threads[n_threads], closed_loader_thread,
+                                  &loader);
+            if (rv != 0) {
+                break;
             }
+            n_threads++;
         }
+    }
 
-        raft_free(*entries);
+    closed_loader_run(&loader);
+
+    for (i = 0; i < n_threads; i++) {
+        rv = uv_thread_join(&threads[i]);
+        assert(rv == 0);
     }
 
-    return rv;
+    return 0;
 }
 
 static int load_entries_from_open_segment(struct raft_io *io,
@@ -916,7 +2069,7 @@ static int load_entries_from_open_segment(struct raft_io *io,
 
     /* Check that the format is the expected one, or perhaps 0, indicating that
      * the segment was allocated but never written. */
-    if (format != IO_UV__DISK_FORMAT) {
+    if (!is_supported_format(format)) {
         if (format == 0) {
             rv = raft__io_uv_fs_is_all_zeros(fd, &all_zeros);
             if (rv != 0) {
@@ -949,7 +2102,7 @@ static int load_entries_from_open_segment(struct raft_io *io,
             return RAFT_ERR_IO;
         }
 
-        rv = load_entries_batch_from_segment(io, fd, &tmp_entries,
+        rv = load_entries_batch_from_segment(io, fd, format, 0, &tmp_entries,
                                              &tmp_n_entries, &last);
         if (rv != 0) {
             int rv2;
@@ -959,21 +2112,28 @@ static int load_entries_from_open_segment(struct raft_io *io,
                 goto err_after_open;
             }
 
-            /* If this is a decoding error, and not an OS error, check if the
-             * rest of the file is filled with zeros. In that case we assume
+            /* If this is a decoding error, and not an OS error, we assume
              * that the server shutdown uncleanly and we just truncate this
-             * incomplete data. */
+             * incomplete data. Segments are preallocated with zeros and
+             * written sequentially, so a zeroed preamble marks the end of the
+             * written data and there's no need to read the rest of the file,
+             * which for a large segment is mostly zeros too. Otherwise check
+             * whether the batch was torn or the tail holds other data. */
             lseek(fd, offset, SEEK_SET);
 
-            rv2 = raft__io_uv_fs_is_all_zeros(fd, &all_zeros);
+            rv2 = is_zero_preamble(fd, &all_zeros);
+            if (rv2 == 0 && !all_zeros) {
+                lseek(fd, offset, SEEK_SET);
+                rv2 = raft__io_uv_fs_is_all_zeros(fd, &all_zeros);
+            }
             if (rv2 != 0) {
                 rv = rv2;
                 goto err_after_open;
             }
 
             if (!all_zeros) {
-                /* TODO: log a warning here, stating that the segment had a
-                 * non-zero partial batch, and reporting the decoding error. */
+                warnf(io, "segment %s: batch %d: discard non-zero data",
+                      segment->filename, i);
             }
 
             rv = ftruncate(fd, offset);
@@ -1045,17 +2205,36 @@ err:
     return rv;
 }
 
+static int is_zero_preamble(const int fd, bool *flag)
+{
+    uint64_t preamble[2];
+    ssize_t rv;
+
+    rv = read(fd, preamble, sizeof preamble);
+    if (rv == -1) {
+        return RAFT_ERR_IO;
+    }
+
+    *flag = rv == sizeof preamble && preamble[0] == 0 && preamble[1] == 0;
+
+    return 0;
+}
+
 static int load_entries_batch_from_segment(struct raft_io *io,
                                            const int fd,
+                                           uint64_t format,
+                                           unsigned skip,
                                            struct raft_entry **entries,
                                            unsigned *n_entries,
                                            bool *last)
 {
+    struct io_uv *uv = io->impl;
     uint64_t preamble[2];      /* CRC32 checksums and number of raft entries */
     unsigned n;                /* Number of entries in the batch */
     unsigned max_n;            /* Maximum number of entries we expect */
     unsigned i;                /* Iterate through the entries */
     struct raft_buffer header; /* Batch header */
+    size_t header_len;         /* Size of the header without checksums */
     struct raft_buffer data;   /* Batch data */
     unsigned crc1;             /* Target checksum */
     unsigned crc2;             /* Actual checksum */
@@ -1070,7 +2249,7 @@ static int load_entries_batch_from_segment(struct raft_io *io,
         return RAFT_ERR_IO;
     }
 
-    n = byte__flip64(preamble[1]);
+    n = io_uv__batch_n_entries(format, byte__flip64(preamble[1]));
 
     if (n == 0) {
         errorf(io, "batch has zero entries");
@@ -1078,21 +2257,25 @@ static int load_entries_batch_from_segment(struct raft_io *io,
         goto err;
     }
 
-    /* Very optimistic upper bound of the number of entries we should
-     * expect. This is mainly a protection against allocating too much
-     * memory. Each entry will consume at least 4 words (for term, type, size
-     * and payload). */
-    max_n = RAFT_IO_UV_MAX_SEGMENT_SIZE / (sizeof(uint64_t) * 4);
-
+    max_n = max_batch_entries(uv);
     if (n > max_n) {
         errorf(io, "batch has %u entries (preamble at %d)", n, pos);
         rv = RAFT_ERR_IO_CORRUPT;
         goto err;
     }
 
-    /* Read the batch header, excluding the first 8 bytes containing the number
-     * of entries, which we have already read. */
-    header.len = io_uv__sizeof_batch_header(n);
+    header_len = io_uv__batch_header_size(format, byte__flip64(preamble[1]));
+    if (header_len < sizeof(uint64_t) ||
+        header_len > io_uv__sizeof_batch_header(n)) {
+        errorf(io, "batch header has bad size %zu", header_len);
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err;
+    }
+
+    /* Read the batch header and the per-entry checksums that might follow it,
+     * excluding the first 8 bytes containing the number of entries, which we
+     * have already read. */
+    header.len = header_len + io_uv__sizeof_batch_checksums(format, n);
     header.base = raft_malloc(header.len);
     if (header.base == NULL) {
         rv = RAFT_ENOMEM;
@@ -1109,7 +2292,7 @@ static int load_entries_batch_from_segment(struct raft_io *io,
 
     /* Check batch header integrity. */
     crc1 = byte__flip32(*(uint64_t *)preamble);
-    crc2 = byte__crc32(header.base, header.len, 0);
+    crc2 = checksum_batch(uv, format, header.base, header.len);
     if (crc1 != crc2) {
         errorf(io, "corrupted batch header");
         rv = RAFT_ERR_IO_CORRUPT;
@@ -1117,7 +2300,8 @@ static int load_entries_batch_from_segment(struct raft_io *io,
     }
 
     /* Decode the batch header, allocating the entries array. */
-    rv = io_uv__decode_batch_header(header.base, entries, n_entries);
+    rv = io_uv__decode_segment_batch_header(format, header.base, header_len,
+                                            entries, n_entries);
     if (rv != 0) {
         goto err_after_header_alloc;
     }
@@ -1141,11 +2325,9 @@ static int load_entries_batch_from_segment(struct raft_io *io,
     }
 
     /* Check batch data integrity. */
-    crc1 = byte__flip32(*((uint32_t *)preamble + 1));
-    crc2 = byte__crc32(data.base, data.len, 0);
-    if (crc1 != crc2) {
-        errorf(io, "corrupted batch data");
-        rv = RAFT_ERR_IO_CORRUPT;
+    rv = check_batch_data(io, format, preamble, header.base + header_len,
+                          data.base, data.len, *entries, n, skip);
+    if (rv != 0) {
         goto err_after_data_alloc;
     }
 
@@ -1172,6 +2354,196 @@ err:
     return rv;
 }
 
+static int load_entries_batch_from_mapping(struct raft_io *io,
+                                           const uint8_t *map,
+                                           size_t size,
+                                           uint64_t format,
+                                           unsigned skip,
+                                           size_t *offset,
+                                           struct raft_buffer *dst,
+                                           struct raft_entry **entries,
+                                           unsigned *n_entries,
+                                           bool *last)
+{
+    struct io_uv *uv = io->impl;
+    const uint8_t *cursor = map + *offset;
+    size_t left = size - *offset;
+    uint64_t preamble[2];      /* CRC32 checksums and number of raft entries */
+    unsigned n;                /* Number of entries in the batch */
+    unsigned i;                /* Iterate through the entries */
+    struct raft_buffer header; /* Batch header, pointing into the mapping */
+    size_t header_len;         /* Size of the header without checksums */
+    struct raft_buffer data;   /* Batch data */
+    unsigned crc1;             /* Target checksum */
+    unsigned crc2;             /* Actual checksum */
+    int rv;
+
+    assert(*offset <= size);
+
+    if (left < sizeof preamble) {
+        return RAFT_ERR_IO;
+    }
+    memcpy(preamble, cursor, sizeof preamble);
+
+    n = io_uv__batch_n_entries(format, byte__flip64(preamble[1]));
+
+    if (n == 0) {
+        errorf(io, "batch has zero entries");
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    if (n > max_batch_entries(uv)) {
+        errorf(io, "batch has %u entries (preamble at %zu)", n, *offset);
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    /* The header starts with the number of entries, right after the
+     * checksums, and it's followed by the per-entry checksums, if any. */
+    header_len = io_uv__batch_header_size(format, byte__flip64(preamble[1]));
+    header.base = (void *)(cursor + sizeof(uint64_t));
+    header.len = header_len + io_uv__sizeof_batch_checksums(format, n);
+    if (header_len < sizeof(uint64_t) ||
+        header_len > io_uv__sizeof_batch_header(n)) {
+        errorf(io, "batch header has bad size %zu", header_len);
+        return RAFT_ERR_IO_CORRUPT;
+    }
+    if (left - sizeof(uint64_t) < header.len) {
+        return RAFT_ERR_IO;
+    }
+
+    /* Check batch header integrity. */
+    crc1 = byte__flip32(*(uint64_t *)preamble);
+    crc2 = checksum_batch(uv, format, header.base, header.len);
+    if (crc1 != crc2) {
+        errorf(io, "corrupted batch header");
+        return RAFT_ERR_IO_CORRUPT;
+    }
+
+    /* Decode the batch header, allocating the entries array. */
+    rv = io_uv__decode_segment_batch_header(format, header.base, header_len,
+                                            entries, n_entries);
+    if (rv != 0) {
+        return rv;
+    }
+
+    /* Calculate the total size of the batch data */
+    data.len = 0;
+    for (i = 0; i < n; i++) {
+        data.len += (*entries)[i].buf.len;
+    }
+
+    cursor += sizeof(uint64_t) + header.len;
+    left -= sizeof(uint64_t) + header.len;
+    if (left < data.len) {
+        rv = RAFT_ERR_IO;
+        goto err_after_header_decode;
+    }
+
+    /* Check batch data integrity before copying it. */
+    rv = check_batch_data(io, format, preamble, header.base + header_len,
+                          cursor, data.len, *entries, n, skip);
+    if (rv != 0) {
+        goto err_after_header_decode;
+    }
+
+    /* The entries data outlives the mapping, so it must be copied into a
+     * regular batch buffer. */
+    if (dst != NULL) {
+        data.base = dst->base;
+        dst->len = data.len;
+    } else {
+        data.base = raft_malloc(data.len);
+        if (data.base == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_header_decode;
+        }
+    }
+    memcpy(data.base, cursor, data.len);
+
+    io_uv__decode_entries_batch(&data, *entries, *n_entries);
+
+    *offset = (size_t)(cursor - map) + data.len;
+    *last = *offset == size;
+
+    return 0;
+
+err_after_header_decode:
+    raft_free(*entries);
+
+    assert(rv != 0);
+
+    return rv;
+}
+
+static int check_batch_data(struct raft_io *io,
+                            uint64_t format,
+                            const uint64_t preamble[2],
+                            const void *checksums,
+                            const void *data,
+                            size_t len,
+                            const struct raft_entry *entries,
+                            unsigned n,
+                            unsigned skip)
+{
+    struct io_uv *uv = io->impl;
+    const void *cursor = checksums;
+    unsigned crc1; /* Target checksum */
+    unsigned crc2; /* Actual checksum */
+    unsigned i;
+
+    if (!io_uv__format_has_entry_checksums(format)) {
+        crc1 = byte__flip32(*((uint32_t *)preamble + 1));
+        crc2 = checksum_batch(uv, format, data, len);
+        if (crc1 != crc2) {
+            errorf(io, "corrupted batch data");
+            return RAFT_ERR_IO_CORRUPT;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        const struct raft_entry *entry = &entries[i];
+        crc1 = byte__get32(&cursor);
+        if (i >= skip) {
+            crc2 = checksum_batch(uv, format, data, entry->buf.len);
+            if (crc1 != crc2) {
+                errorf(io, "corrupted data of batch entry %u", i);
+                return RAFT_ERR_IO_CORRUPT;
+            }
+        }
+        data += entry->buf.len;
+    }
+
+    return 0;
+}
+
+static unsigned max_batch_entries(struct io_uv *uv)
+{
+    size_t max_size;
+
+    /* Very optimistic upper bound of the number of entries we should
+     * expect. This is mainly a protection against allocating too much
+     * memory. Each entry will consume at least 4 words (for term, type, size
+     * and payload). */
+    max_size = uv->block_size * uv->n_blocks;
+    if (max_size < RAFT_IO_UV_MAX_SEGMENT_SIZE) {
+        max_size = RAFT_IO_UV_MAX_SEGMENT_SIZE;
+    }
+    return max_size / (sizeof(uint64_t) * 4);
+}
+
+static unsigned checksum_batch(struct io_uv *uv,
+                               uint64_t format,
+                               const void *buf,
+                               size_t len)
+{
+    uint64_t start = uv_hrtime();
+    unsigned crc = io_uv__checksum(format, buf, len, 0);
+    __atomic_fetch_add(&uv->load_checksum_time, uv_hrtime() - start,
+                       __ATOMIC_RELAXED);
+    return crc;
+}
+
 static void closed_segment_filename(const raft_index first_index,
                                     const raft_index end_index,
                                     char *filename)
@@ -10,6 +10,7 @@
 #include "io_uv_fs.h"
 
 struct io_uv;
+struct io_uv__batch_offset;
 
 /**
  * Info about a snapshot metadata file.
@@ -20,6 +21,7 @@ struct io_uv__snapshot_meta
     raft_index index;
     unsigned long long timestamp;
     io_uv__filename filename;
+    const char *dir; /* Directory holding the snapshot files */
 };
 
 /**
@@ -43,9 +45,10 @@ struct io_uv__segment_meta
 };
 
 /**
- * Return a list of all snapshots and segments found in the data directory. Both
- * snapshots and segments are ordered by filename (closed segments come before
- * open ones).
+ * Return a list of all snapshots and segments found in the data directory, and
+ * of the snapshots found in the snapshot directory, if it's a different one.
+ * Both snapshots and segments are ordered by filename (closed segments come
+ * before open ones).
  */
 int io_uv__load_list(struct io_uv *uv,
                      struct io_uv__snapshot_meta *snapshots[],
@@ -60,6 +63,31 @@ int io_uv__load_snapshot(struct io_uv *uv,
                          struct io_uv__snapshot_meta *meta,
                          struct raft_snapshot *snapshot);
 
+/**
+ * Load the checksums of the data of the snapshot with the given metadata. Their
+ * block size is zero if the snapshot has none.
+ */
+int io_uv__load_snapshot_checksums(struct io_uv *uv,
+                                   struct io_uv__snapshot_meta *meta,
+                                   struct io_uv__snapshot_checksums *checksums);
+
+/**
+ * Load the metadata of the snapshot with the given metadata and up to @len
+ * bytes of its data, starting at @offset. Set @size to the size of the data.
+ */
+int io_uv__load_snapshot_chunk(struct io_uv *uv,
+                               struct io_uv__snapshot_meta *meta,
+                               struct raft_snapshot *snapshot,
+                               size_t offset,
+                               size_t len,
+                               size_t *size);
+
+/**
+ * Get rid of a closed segment whose entries are no longer needed, moving it
+ * to the archive directory if one is set or removing it otherwise.
+ */
+int io_uv__load_discard(struct io_uv *uv, const char *filename);
+
 /**
  * Load all entries contained in the given closed segment.
  */
@@ -68,6 +96,100 @@ int io_uv__load_closed(struct io_uv *uv,
                        struct raft_entry *entries[],
                        size_t *n);
 
+/**
+ * Load the entries of the given closed segment starting from the batch holding
+ * the entry at @index, which is set in @first. If the segment has no index
+ * footer, all its entries are loaded and @first is its first index.
+ */
+int io_uv__load_closed_from(struct io_uv *uv,
+                            struct io_uv__segment_meta *segment,
+                            raft_index index,
+                            struct raft_entry *entries[],
+                            size_t *n,
+                            raft_index *first);
+
+/**
+ * Read the index footer at the end of the segment file with the given
+ * descriptor and size, if any. If there's no footer, @n is set to 0.
+ */
+int io_uv__load_footer(struct io_uv *uv,
+                       int fd,
+                       size_t size,
+                       struct io_uv__batch_offset **batches,
+                       unsigned *n);
+
+/**
+ * Scan the headers of the batches stored in the segment file with the given
+ * descriptor, up to @end, and return their offsets. The data of the batches is
+ * not read and checksums are not verified.
+ */
+int io_uv__load_batch_offsets(struct io_uv *uv,
+                              int fd,
+                              size_t end,
+                              raft_index first_index,
+                              struct io_uv__batch_offset **batches,
+                              unsigned *n);
+
+/**
+ * Return the offsets of the batches of the given closed segment, taking them
+ * from its index footer if it has one, or scanning its batch headers
+ * otherwise. Set @end to the offset where the batches end.
+ */
+int io_uv__load_batch_index(struct io_uv *uv,
+                            struct io_uv__segment_meta *segment,
+                            int fd,
+                            size_t size,
+                            struct io_uv__batch_offset **batches,
+                            unsigned *n,
+                            size_t *end);
+
+/**
+ * Load the single batch of entries found at the given offset of the segment
+ * file with the given descriptor and format version.
+ */
+int io_uv__load_batch(struct io_uv *uv,
+                      int fd,
+                      uint64_t format,
+                      size_t offset,
+                      struct raft_entry **entries,
+                      unsigned *n);
+
+/**
+ * Position of a load of the data directory proceeding a few segments at a
+ * time.
+ */
+struct io_uv__load_cursor
+{
+    struct io_uv__segment_meta *segments; /* All segments found */
+    size_t n_segments;                    /* Number of segments found */
+    size_t next;                          /* Next segment to load */
+    raft_index next_index;                /* Index of the next entry */
+    size_t n_loaded;                      /* Entries loaded so far */
+};
+
+/**
+ * List the data directory and load the last snapshot, if any, positioning
+ * @cursor at the first segment.
+ */
+int io_uv__load_begin(struct io_uv *uv,
+                      struct io_uv__load_cursor *cursor,
+                      struct raft_snapshot **snapshot);
+
+/**
+ * Load the entries contained in the next @max segments of @cursor, closing
+ * any open segment. No entries are returned once all segments are loaded.
+ */
+int io_uv__load_next(struct io_uv *uv,
+                     struct io_uv__load_cursor *cursor,
+                     size_t max,
+                     struct raft_entry *entries[],
+                     size_t *n);
+
+/**
+ * Release the memory used by @cursor.
+ */
+void io_uv__load_end(struct io_uv__load_cursor *cursor);
+
 /**
  * Load the last snapshot (if any) and all entries contained in all segment
  * files of the data directory.
@@ -77,4 +199,15 @@ int io_uv__load_all(struct io_uv *uv,
                     struct raft_entry *entries[],
                     size_t *n);
 
+/**
+ * Load up to @max entries starting from the one at @index, looking only at
+ * closed segments. Stop at the first entry that can't be found, possibly
+ * returning no entries at all.
+ */
+int io_uv__load_range(struct io_uv *uv,
+                      raft_index index,
+                      unsigned max,
+                      struct raft_entry *entries[],
+                      unsigned *n);
+
 #endif /* RAFT_IO_UV_LOAD_H */
@@ -8,14 +8,21 @@
 #include "io_uv_metadata.h"
 #include "logging.h"
 
-/* Current on-disk format version. */
+/* Current on-disk format version. The commit index was added as fifth word
+ * without bumping it: older versions only read the first four words, and files
+ * written by them are loaded with a commit index of zero. */
 #define RAFT__IO_UV_METADATA_FORMAT 1
 
+/* Size of metadata files written before the commit index was added. */
+#define RAFT__IO_UV_METADATA_SIZE_V1 (8 * 4)
+
 /* Encode the content of a metadata file. */
 static void encode(const struct io_uv__metadata *metadata, void *buf);
 
-/* Decode the content of a metadata file. */
-static int decode(const void *buf, struct io_uv__metadata *metadata);
+/* Decode the content of a metadata file of the given size. */
+static int decode(const void *buf,
+                  size_t size,
+                  struct io_uv__metadata *metadata);
 
 /* Read the @n'th metadata file (with @n equal to 1 or 2) and decode the content
  * of the file, populating the given metadata buffer accordingly. */
@@ -24,12 +31,6 @@ static int load_n(struct raft_io *io,
                   const unsigned short n,
                   struct io_uv__metadata *metadata);
 
-/* Update both metadata files using the given one as seed, so they are created
- * if they didn't exist. */
-static int ensure(struct raft_io *io,
-                  const char *dir,
-                  struct io_uv__metadata *metadata);
-
 /* Return the metadata file index associated with the given version. */
 static int index_n(int version);
 
@@ -61,6 +62,7 @@ int io_uv__metadata_load(struct raft_io *io,
         metadata->version = 0;
         metadata->term = 0;
         metadata->voted_for = 0;
+        metadata->commit = 0;
     } else if (metadata1.version == metadata2.version) {
         /* The two metadata files can't have the same version. */
         errorf(io, "metadata1 and metadata2 are both at version %d",
@@ -76,7 +78,7 @@ int io_uv__metadata_load(struct raft_io *io,
     }
 
     /* Update the metadata files, so they are created if they did not exist. */
-    rv = ensure(io, dir, metadata);
+    rv = io_uv__metadata_ensure(io, dir, metadata);
     if (rv != 0) {
         return rv;
     }
@@ -138,9 +140,12 @@ static void encode(const struct io_uv__metadata *metadata, void *buf)
     byte__put64(&cursor, metadata->version);
     byte__put64(&cursor, metadata->term);
     byte__put64(&cursor, metadata->voted_for);
+    byte__put64(&cursor, metadata->commit);
 }
 
-static int decode(const void *buf, struct io_uv__metadata *metadata)
+static int decode(const void *buf,
+                  size_t size,
+                  struct io_uv__metadata *metadata)
 {
     const void *cursor = buf;
     unsigned format;
@@ -154,6 +159,10 @@ static int decode(const void *buf, struct io_uv__metadata *metadata)
     metadata->version = byte__get64(&cursor);
     metadata->term = byte__get64(&cursor);
     metadata->voted_for = byte__get64(&cursor);
+    metadata->commit = 0;
+    if (size == RAFT_IO_UV_METADATA_SIZE) {
+        metadata->commit = byte__get64(&cursor);
+    }
 
     return 0;
 }
@@ -194,7 +203,7 @@ static int load_n(struct raft_io *io,
         close(fd);
         return RAFT_ERR_IO;
     }
-    if (rv != sizeof buf) {
+    if (rv != sizeof buf && rv != RAFT__IO_UV_METADATA_SIZE_V1) {
         /* Assume that the server crashed while writing this metadata file, and
          * pretend it has not been written at all. */
         metadata->version = 0;
@@ -205,7 +214,7 @@ static int load_n(struct raft_io *io,
     close(fd);
 
     /* Decode the content of the metadata file. */
-    rv = decode(buf, metadata);
+    rv = decode(buf, (size_t)rv, metadata);
     if (rv != 0) {
         errorf(io, "decode %s: %s", path, raft_strerror(rv));
         return RAFT_ERR_IO;
@@ -220,9 +229,9 @@ static int load_n(struct raft_io *io,
     return 0;
 }
 
-static int ensure(struct raft_io *io,
-                  const char *dir,
-                  struct io_uv__metadata *metadata)
+int io_uv__metadata_ensure(struct raft_io *io,
+                           const char *dir,
+                           struct io_uv__metadata *metadata)
 {
     int i;
     int rv;
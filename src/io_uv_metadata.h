@@ -15,6 +15,7 @@ struct io_uv__metadata
     unsigned long long version; /* Monotonically increasing version */
     raft_term term;             /* Current term */
     unsigned voted_for;         /* Server ID of last vote, or 0 */
+    raft_index commit;          /* Last known commit index, or 0 */
 };
 
 /**
@@ -34,4 +35,13 @@ int io_uv__metadata_store(struct raft_io *io,
                           const char *dir,
                           const struct io_uv__metadata *metadata);
 
+/**
+ * Update both metadata files in @dir using the given one as seed, so they are
+ * created if they didn't exist. The version of @metadata is increased
+ * accordingly.
+ */
+int io_uv__metadata_ensure(struct raft_io *io,
+                           const char *dir,
+                           struct io_uv__metadata *metadata);
+
 #endif /* RAFT_IO_UV_METADATA_H */
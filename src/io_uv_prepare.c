@@ -1,3 +1,6 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "assert.h"
@@ -14,6 +17,14 @@
  *   possibly kicking off the creation logic if no segment is being created
  *   currently.
  *
+ * New open segments are created by reusing obsolete segment files whenever
+ * some are available, instead of allocating new ones from scratch.
+ *
+ * The pool holds up to uv->prepare_pool_size segments, but only as many as the
+ * writes of the next IO_UV__PREPARE_HORIZON milliseconds would fill at the rate
+ * segments were recently taken from it. Extra segments of instances whose
+ * writes slowed down are removed at the next tick.
+ *
  * Possible failure modes are:
  *
  * - The create file request fails, in that case we fail all pending prepare
@@ -24,15 +35,10 @@
  * - Cancel all pending prepare requests.
  * - Remove unused prepared open segments.
  * - Cancel any pending internal create segment request.
+ * - Forget about obsolete segment files to reuse, which are left on disk and
+ *   picked up again at the next startup.
  */
 
-/* At the moment the io-uv implementation of raft_io->append does not use
- * concurrent writes. */
-#define MAX_CONCURRENT_WRITES 1
-
-/* Number of open segments that we try to keep ready for writing. */
-#define TARGET_POOL_SIZE 2
-
 /* An open segment being prepared or sitting in the pool */
 struct segment
 {
@@ -41,9 +47,17 @@ struct segment
     struct uv__file_create create; /* Create file request */
     unsigned long long counter;    /* Segment counter */
     io_uv__path path;              /* Path of the segment */
+    io_uv__path old_path;          /* Path of the file being recycled */
     raft__queue queue;             /* Pool */
 };
 
+/* An obsolete segment file that can be reused. */
+struct recycled
+{
+    io_uv__filename filename; /* Current name of the file */
+    raft__queue queue;        /* Links in uv->prepare_recycled */
+};
+
 /* Process pending prepare requests.
  *
  * If we have some segments in the pool, use them to complete some pending
@@ -52,8 +66,9 @@ static void process_requests(struct io_uv *uv);
 
 /* Maintain the pool of prepared open segments.
  *
- * If the pool has less than TARGET_POOL_SIZE segments, and we're not already
- * creating a segment, start creating a new segment. */
+ * If the pool has less segments than the current target, the host budget
+ * allows for one more, and we're not already creating a segment, start
+ * creating a new segment. */
 static void maintain_pool(struct io_uv *uv);
 
 /* Start creating a new segment file. */
@@ -88,6 +103,61 @@ static void flush_requests(struct io_uv *uv, int status)
     }
 }
 
+void io_uv__prepare_recycle(struct io_uv *uv, const char *filename)
+{
+    struct recycled *r;
+    raft__queue *head;
+    unsigned n = 0;
+
+    assert(strncmp(filename, IO_UV__RECYCLED_PREFIX,
+                   strlen(IO_UV__RECYCLED_PREFIX)) == 0);
+
+    RAFT__QUEUE_FOREACH(head, &uv->prepare_recycled)
+    {
+        r = RAFT__QUEUE_DATA(head, struct recycled, queue);
+        if (strcmp(r->filename, filename) == 0) {
+            return;
+        }
+        n++;
+    }
+
+    if (n < IO_UV__MAX_RECYCLED_SEGMENTS) {
+        r = raft_malloc(sizeof *r);
+        if (r != NULL) {
+            strcpy(r->filename, filename);
+            RAFT__QUEUE_PUSH(&uv->prepare_recycled, &r->queue);
+            return;
+        }
+    }
+
+    /* We can't keep track of this file, just get rid of it. */
+    raft__io_uv_fs_unlink(uv->dir, filename);
+}
+
+void io_uv__prepare_adopt(struct io_uv *uv)
+{
+    struct dirent **dirents;
+    int n_dirents;
+    int i;
+
+    n_dirents = scandir(uv->dir, &dirents, NULL, alphasort);
+    if (n_dirents < 0) {
+        /* Not a big deal, we'll just create new files. */
+        return;
+    }
+
+    for (i = 0; i < n_dirents; i++) {
+        const char *filename = dirents[i]->d_name;
+        if (strncmp(filename, IO_UV__RECYCLED_PREFIX,
+                    strlen(IO_UV__RECYCLED_PREFIX)) == 0 &&
+            strlen(filename) < sizeof(io_uv__filename)) {
+            io_uv__prepare_recycle(uv, filename);
+        }
+        free(dirents[i]);
+    }
+    free(dirents);
+}
+
 void io_uv__prepare_stop(struct io_uv *uv)
 {
     assert(uv->state == IO_UV__CLOSING);
@@ -95,6 +165,16 @@ void io_uv__prepare_stop(struct io_uv *uv)
     /* Cancel all pending prepare requests. */
     flush_requests(uv, RAFT_ERR_IO_CANCELED);
 
+    /* Forget about the files to reuse. */
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->prepare_recycled)) {
+        raft__queue *head;
+        struct recycled *r;
+        head = RAFT__QUEUE_HEAD(&uv->prepare_recycled);
+        r = RAFT__QUEUE_DATA(head, struct recycled, queue);
+        RAFT__QUEUE_REMOVE(&r->queue);
+        raft_free(r);
+    }
+
     /* Remove any unused prepared segment. */
     while (!RAFT__QUEUE_IS_EMPTY(&uv->prepare_pool)) {
         raft__queue *head;
@@ -112,6 +192,56 @@ void io_uv__prepare_stop(struct io_uv *uv)
     }
 }
 
+/* Account for a prepared segment being taken from the pool, updating the
+ * smoothed interval between takes. */
+static void note_taken(struct io_uv *uv)
+{
+    uint64_t now = uv_now(uv->loop);
+    uint64_t sample;
+
+    if (uv->prepare_last_used != 0) {
+        sample = now - uv->prepare_last_used;
+        if (uv->prepare_interval == 0) {
+            uv->prepare_interval = sample;
+        } else {
+            uv->prepare_interval = (3 * uv->prepare_interval + sample) / 4;
+        }
+    }
+    uv->prepare_last_used = now;
+}
+
+/* Number of prepared segments worth keeping, based on the interval between
+ * takes, or on the time since the last one if that's longer. */
+static unsigned pool_target(struct io_uv *uv)
+{
+    uint64_t interval = uv->prepare_interval;
+    uint64_t idle;
+    uint64_t n;
+
+    /* Until a segment gets used, keep the pool full. */
+    if (uv->prepare_last_used == 0) {
+        return uv->prepare_pool_size;
+    }
+
+    idle = uv_now(uv->loop) - uv->prepare_last_used;
+    if (idle > interval) {
+        interval = idle;
+    }
+    if (interval == 0) {
+        return uv->prepare_pool_size;
+    }
+
+    n = (IO_UV__PREPARE_HORIZON + interval - 1) / interval;
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > uv->prepare_pool_size) {
+        n = uv->prepare_pool_size;
+    }
+
+    return (unsigned)n;
+}
+
 static void process_requests(struct io_uv *uv)
 {
     raft__queue *head;
@@ -136,6 +266,10 @@ static void process_requests(struct io_uv *uv)
         req = RAFT__QUEUE_DATA(head, struct io_uv__prepare, queue);
         RAFT__QUEUE_REMOVE(&req->queue);
 
+        assert(uv->host->n_prepared > 0);
+        uv->host->n_prepared--;
+        note_taken(uv);
+
         /* Finish the request */
         req->cb(req, segment->file, segment->counter, 0);
         raft_free(segment);
@@ -157,12 +291,40 @@ static void maintain_pool(struct io_uv *uv)
     n = 0;
     RAFT__QUEUE_FOREACH(head, &uv->prepare_pool) { n++; }
 
-    if (n < TARGET_POOL_SIZE) {
-        rv = create_segment(uv);
-        if (rv != 0) {
-            flush_requests(uv, rv);
-            uv->errored = true;
-        }
+    if (n >= pool_target(uv)) {
+        return;
+    }
+
+    /* Stay within the budget of the host, unless we're waiting for this
+     * segment. */
+    if (uv->host->prepare_budget > 0 &&
+        uv->host->n_prepared >= uv->host->prepare_budget &&
+        (n > 0 || RAFT__QUEUE_IS_EMPTY(&uv->prepare_reqs))) {
+        return;
+    }
+
+    rv = create_segment(uv);
+    if (rv != 0) {
+        flush_requests(uv, rv);
+        uv->errored = true;
+    }
+}
+
+void io_uv__prepare_trim(struct io_uv *uv)
+{
+    unsigned target = pool_target(uv);
+    raft__queue *head;
+    unsigned n = 0;
+
+    RAFT__QUEUE_FOREACH(head, &uv->prepare_pool) { n++; }
+
+    /* Drop the most recently prepared segments, which would be used last. */
+    for (; n > target; n--) {
+        struct segment *s;
+        head = RAFT__QUEUE_TAIL(&uv->prepare_pool);
+        s = RAFT__QUEUE_DATA(head, struct segment, queue);
+        RAFT__QUEUE_REMOVE(&s->queue);
+        remove_segment(s);
     }
 }
 
@@ -194,6 +356,19 @@ static int create_segment(struct io_uv *uv)
         goto err_after_file_alloc;
     }
 
+    /* Don't try NOWAIT writes if we know they're not supported. */
+    if (!uv->async_writes) {
+        s->file->async = false;
+    }
+    if (!uv->direct_io) {
+        s->file->buffered = true;
+        s->file->async = false;
+    }
+    /* The host syncs the data of all its groups at once. */
+    if (uv->host->shared_sync) {
+        s->file->nosync = true;
+    }
+
     s->file->data = s;
     s->create.data = s;
     s->counter = uv->prepare_next_counter;
@@ -201,9 +376,30 @@ static int create_segment(struct io_uv *uv)
     sprintf(filename, "open-%lld", s->counter);
     io_uv__join(uv->dir, filename, s->path);
 
-    rv = uv__file_create(s->file, &s->create, s->path,
-                         uv->block_size * uv->n_blocks, MAX_CONCURRENT_WRITES,
-                         create_segment_cb);
+    /* Reuse an obsolete segment file if we have one, or create a new file if
+     * that fails right away. */
+    rv = -1;
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->prepare_recycled)) {
+        raft__queue *head;
+        struct recycled *r;
+        head = RAFT__QUEUE_HEAD(&uv->prepare_recycled);
+        r = RAFT__QUEUE_DATA(head, struct recycled, queue);
+        RAFT__QUEUE_REMOVE(&r->queue);
+        io_uv__join(uv->dir, r->filename, s->old_path);
+        raft_free(r);
+        rv = uv__file_recycle(s->file, &s->create, s->old_path, s->path,
+                              uv->block_size * uv->n_blocks,
+                              IO_UV__MAX_CONCURRENT_WRITES, create_segment_cb);
+        if (rv != 0) {
+            warnf(uv->io, "recycle segment %s: %s", s->old_path,
+                  uv_strerror(rv));
+        }
+    }
+    if (rv != 0) {
+        rv = uv__file_create(s->file, &s->create, s->path,
+                             uv->block_size * uv->n_blocks,
+                             IO_UV__MAX_CONCURRENT_WRITES, create_segment_cb);
+    }
     if (rv != 0) {
         errorf(uv->io, "request creation of open segment %d: %s", s->counter,
                uv_strerror(rv));
@@ -213,6 +409,7 @@ static int create_segment(struct io_uv *uv)
 
     uv->preparing = s->file;
     uv->prepare_next_counter++;
+    uv->host->n_prepared++;
 
     return 0;
 
@@ -251,6 +448,8 @@ static void create_segment_cb(struct uv__file_create *req, int status)
     if (status != 0) {
         flush_requests(uv, RAFT_ERR_IO);
         uv->preparing = NULL;
+        assert(uv->host->n_prepared > 0);
+        uv->host->n_prepared--;
         uv->errored = true;
         errorf(uv->io, "create open segment %s: %s", s->path,
                uv_strerror(status));
@@ -273,6 +472,8 @@ static void remove_segment(struct segment *s)
 {
     assert(s->counter > 0);
     assert(s->file != NULL);
+    assert(s->uv->host->n_prepared > 0);
+    s->uv->host->n_prepared--;
     uv__file_close(s->file, remove_segment_cb);
 }
 
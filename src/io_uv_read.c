@@ -0,0 +1,132 @@
+#include "assert.h"
+#include "io_uv.h"
+#include "io_uv_load.h"
+#include "logging.h"
+
+struct read
+{
+    struct io_uv *uv;
+    struct raft_io_read *req;
+    raft_index index;
+    unsigned n;
+    struct raft_entry *entries;
+    unsigned n_entries;
+    struct io_uv__work work;
+    int status;
+    raft__queue queue;
+};
+
+static void read_work_cb(struct io_uv__work *work)
+{
+    struct read *r = work->data;
+    struct io_uv *uv = r->uv;
+
+    r->status =
+        io_uv__load_range(uv, r->index, r->n, &r->entries, &r->n_entries);
+}
+
+static void read_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct read *r = work->data;
+    struct io_uv *uv = r->uv;
+    assert(status == 0);
+
+    RAFT__QUEUE_REMOVE(&r->queue);
+
+    /* Truncations waiting for in-flight reads to drain can now proceed. */
+    if (RAFT__QUEUE_IS_EMPTY(&uv->read_reqs)) {
+        io_uv__truncate_unblock(uv);
+    }
+
+    if (r->status != 0) {
+        assert(r->entries == NULL);
+        assert(r->n_entries == 0);
+    }
+
+    r->req->cb(r->req, r->entries, r->n_entries, r->status);
+    raft_free(r);
+
+    io_uv__maybe_close(uv);
+}
+
+/* Return true if a truncation is running or pending. Since it may cut closed
+ * segments, reads must not run concurrently with it. */
+static bool is_truncating(struct io_uv *uv)
+{
+    return uv->truncate_work.data != NULL ||
+           !RAFT__QUEUE_IS_EMPTY(&uv->truncate_reqs);
+}
+
+static void read_start(struct read *r)
+{
+    struct io_uv *uv = r->uv;
+    RAFT__QUEUE_PUSH(&uv->read_reqs, &r->queue);
+    io_uv__queue_work(uv, &r->work, read_work_cb, read_after_work_cb);
+}
+
+int io_uv__read(struct raft_io *io,
+                struct raft_io_read *req,
+                raft_index index,
+                unsigned n,
+                raft_io_read_cb cb)
+{
+    struct io_uv *uv;
+    struct read *r;
+    int rv;
+
+    uv = io->impl;
+
+    assert(uv->state == IO_UV__ACTIVE);
+    assert(index > 0);
+    assert(n > 0);
+
+    r = raft_malloc(sizeof *r);
+    if (r == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    r->uv = uv;
+    r->req = req;
+    r->index = index;
+    r->n = n;
+    r->entries = NULL;
+    r->n_entries = 0;
+    r->work.data = r;
+    req->cb = cb;
+
+    if (is_truncating(uv)) {
+        RAFT__QUEUE_PUSH(&uv->read_waiting_reqs, &r->queue);
+        return 0;
+    }
+    read_start(r);
+
+    return 0;
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+raft_index io_uv__last_readable(struct raft_io *io)
+{
+    struct io_uv *uv;
+    uv = io->impl;
+
+    /* Reads are served from closed segments only. */
+    return uv->finalize_done_index;
+}
+
+void io_uv__read_unblock(struct io_uv *uv)
+{
+    if (is_truncating(uv)) {
+        return;
+    }
+    while (!RAFT__QUEUE_IS_EMPTY(&uv->read_waiting_reqs)) {
+        raft__queue *head;
+        struct read *r;
+        head = RAFT__QUEUE_HEAD(&uv->read_waiting_reqs);
+        r = RAFT__QUEUE_DATA(head, struct read, queue);
+        RAFT__QUEUE_REMOVE(head);
+        read_start(r);
+    }
+}
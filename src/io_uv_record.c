@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/raft.h"
+#include "../include/raft/io_uv.h"
+
+#include "assert.h"
+#include "byte.h"
+#include "io_uv.h"
+#include "logging.h"
+
+/* Number of records buffered before writing them. */
+#define N_RECORDS 2048
+
+#define BUF_SIZE (N_RECORDS * RAFT_IO_UV_RECORD_SIZE)
+
+/* Write all @len bytes at @buf to the trace file. */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *cursor = buf;
+
+    while (len > 0) {
+        ssize_t rv = write(fd, cursor, len);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        cursor += rv;
+        len -= (size_t)rv;
+    }
+
+    return 0;
+}
+
+static void record_close(struct io_uv *uv)
+{
+    close(uv->record.fd);
+    uv->record.fd = -1;
+    raft_free(uv->record.buf);
+    uv->record.buf = NULL;
+    uv->record.len = 0;
+}
+
+/* Write the buffered records, stopping recording if that fails. */
+static void record_flush(struct io_uv *uv)
+{
+    int rv;
+
+    rv = write_all(uv->record.fd, uv->record.buf, uv->record.len);
+    if (rv != 0) {
+        warnf(uv->io, "write trace: %s", strerror(rv));
+        record_close(uv);
+        return;
+    }
+    uv->record.len = 0;
+}
+
+void io_uv__record(struct io_uv *uv,
+                   int kind,
+                   int type,
+                   unsigned server_id,
+                   unsigned n,
+                   uint64_t size,
+                   unsigned latency)
+{
+    void *cursor;
+
+    if (uv->record.fd == -1) {
+        return;
+    }
+
+    cursor = uv->record.buf + uv->record.len;
+    byte__put64(&cursor, (uv_hrtime() - uv->record.start) / 1000);
+    byte__put64(&cursor, size);
+    byte__put32(&cursor, latency);
+    byte__put32(&cursor, n);
+    byte__put32(&cursor, server_id);
+    byte__put8(&cursor, (uint8_t)kind);
+    byte__put8(&cursor, (uint8_t)type);
+    byte__put8(&cursor, 0);
+    byte__put8(&cursor, 0);
+    uv->record.len += RAFT_IO_UV_RECORD_SIZE;
+
+    if (uv->record.len == BUF_SIZE) {
+        record_flush(uv);
+    }
+}
+
+void io_uv__record_message(struct io_uv *uv,
+                           int kind,
+                           const struct raft_message *message)
+{
+    const struct raft_entry *entries = NULL;
+    uint64_t size = 0;
+    unsigned n = 0;
+    unsigned i;
+
+    if (uv->record.fd == -1) {
+        return;
+    }
+
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            entries = message->append_entries.entries;
+            n = message->append_entries.n_entries;
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            size = message->install_snapshot.data.len;
+            break;
+        case RAFT_IO_PROPOSE:
+            entries = message->propose.entries;
+            n = message->propose.n_entries;
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        size += entries[i].buf.len;
+    }
+
+    io_uv__record(uv, kind, message->type, message->server_id, n, size, 0);
+}
+
+void io_uv__record_stop(struct io_uv *uv)
+{
+    if (uv->record.fd == -1) {
+        return;
+    }
+    record_flush(uv);
+    if (uv->record.fd != -1) {
+        record_close(uv);
+    }
+}
+
+int raft_io_uv_set_recording(struct raft_io *io, const char *path)
+{
+    struct io_uv *uv;
+    uint8_t header[8];
+    void *cursor = header;
+    int rv;
+
+    uv = io->impl;
+    io_uv__record_stop(uv);
+    if (path == NULL) {
+        return 0;
+    }
+
+    uv->record.buf = raft_malloc(BUF_SIZE);
+    if (uv->record.buf == NULL) {
+        return RAFT_ENOMEM;
+    }
+    uv->record.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (uv->record.fd == -1) {
+        errorf(io, "open trace %s: %s", path, strerror(errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_buf_alloc;
+    }
+
+    byte__put64(&cursor, RAFT_IO_UV_RECORD_FORMAT);
+    rv = write_all(uv->record.fd, header, sizeof header);
+    if (rv != 0) {
+        errorf(io, "write trace %s: %s", path, strerror(rv));
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
+    uv->record.len = 0;
+    uv->record.start = uv_hrtime();
+
+    return 0;
+
+err_after_open:
+    close(uv->record.fd);
+    uv->record.fd = -1;
+err_after_buf_alloc:
+    raft_free(uv->record.buf);
+    uv->record.buf = NULL;
+    assert(rv != 0);
+    return rv;
+}
+
+void raft_io_uv_decode_record(const void *buf, struct raft_io_uv_record *record)
+{
+    const void *cursor = buf;
+
+    record->time = byte__get64(&cursor);
+    record->size = byte__get64(&cursor);
+    record->latency = byte__get32(&cursor);
+    record->n = byte__get32(&cursor);
+    record->server_id = byte__get32(&cursor);
+    record->kind = byte__get8(&cursor);
+    record->type = byte__get8(&cursor);
+}
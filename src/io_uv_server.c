@@ -1,4 +1,5 @@
 #include <string.h>
+#include <unistd.h>
 
 #include "../include/raft/io_uv.h"
 
@@ -6,7 +7,6 @@
 #include "byte.h"
 #include "io_uv.h"
 #include "io_uv_encoding.h"
-#include "logging.h"
 
 /* The happy path for a receiving an RPC message is:
  *
@@ -16,15 +16,18 @@
  * - A new server object is created and added to the servers array. It starts
  *   reading from the stream handle of the new connection.
  *
- * - The RPC message preamble is read, which contains the message type and the
- *   message length.
+ * - The RPC message preamble is read, which contains the group ID, the message
+ *   type and the message length.
  *
  * - The RPC message header is read, whose content depends on the message type.
  *
  * - Optionally, the RPC message payload is read (for AppendEntries requests).
  *
- * - The recv callback passed to raft_io->start() gets fired with the received
- *   message.
+ * - The recv callback passed to raft_io->start() by the io_uv object attached
+ *   to the host with a matching group ID gets fired with the received message.
+ *   If no such group is active, the message is discarded. Consecutive messages
+ *   for the same group parsed out of a single read are passed together to the
+ *   recv batch callback instead, if the group has set one.
  *
  * Possible failure modes are:
  *
@@ -36,17 +39,35 @@
  *   handle and act like above.
  */
 
+/* Size of the buffer used to read incoming data. Several small messages can be
+ * received with a single read, while headers and payloads bigger than this are
+ * read directly into their own buffers. */
+#define IO_UV__SERVER_BUF_SIZE (64 * 1024)
+
+/* Maximum number of messages parsed out of a single read that are delivered
+ * together. */
+#define IO_UV__SERVER_BATCH 16
+
 struct io_uv__server
 {
-    struct io_uv *uv;            /* libuv I/O implementation object */
+    struct io_uv__host *host;    /* Host owning the connection */
     unsigned id;                 /* ID of the remote server */
     char *address;               /* Address of the other server */
     struct uv_stream_s *stream;  /* Connection handle */
-    uv_buf_t buf;                /* Sliding buffer for reading incoming data */
+    char *recv;                  /* Buffer for reading incoming data */
+    size_t recv_start;           /* Offset of the first data not yet parsed */
+    size_t recv_end;             /* Offset past the last data received */
+    uv_buf_t buf;                /* Unfilled part of the header or payload */
     uint64_t preamble[2];        /* Static buffer with the request preamble */
-    uv_buf_t header;             /* Dynamic buffer with the request header */
+    uv_buf_t header;             /* Dynamic buffer with a big request header */
     uv_buf_t payload;            /* Dynamic buffer with the request payload */
+    uv_buf_t compressed;         /* Dynamic buffer with a compressed payload */
+    unsigned group;              /* Group of the message being received */
     struct raft_message message; /* The message being received */
+    bool batching;               /* Whether to hold complete messages */
+    struct raft_message batch[IO_UV__SERVER_BATCH]; /* Held messages */
+    unsigned batch_groups[IO_UV__SERVER_BATCH];     /* Their groups */
+    unsigned n_batch;                               /* N. of held messages */
 };
 
 static void copy_address(const char *address1, char **address2)
@@ -61,17 +82,32 @@ static void copy_address(const char *address1, char **address2)
 /* Initialize a new server object for reading requests from an incoming
  * connection. */
 static int server_init(struct io_uv__server *s,
-                       struct io_uv *uv,
+                       struct io_uv__host *host,
                        const unsigned id,
                        const char *address,
                        struct uv_stream_s *stream)
 {
-    s->uv = uv;
+    s->host = host;
     s->id = id;
     copy_address(address, &s->address); /* Make a copy of the address string. */
     if (s->address == NULL) {
         return RAFT_ENOMEM;
     }
+    if (host->numa_node >= 0) {
+        s->recv = raft_aligned_alloc((size_t)getpagesize(),
+                                     IO_UV__SERVER_BUF_SIZE);
+        if (s->recv != NULL) {
+            io_uv__numa_bind(host->numa_node, s->recv, IO_UV__SERVER_BUF_SIZE);
+        }
+    } else {
+        s->recv = raft_malloc(IO_UV__SERVER_BUF_SIZE);
+    }
+    if (s->recv == NULL) {
+        raft_free(s->address);
+        return RAFT_ENOMEM;
+    }
+    s->recv_start = 0;
+    s->recv_end = 0;
     s->stream = stream;
     s->stream->data = s;
     s->buf.base = NULL;
@@ -82,6 +118,11 @@ static int server_init(struct io_uv__server *s,
     s->header.len = 0;
     s->payload.base = NULL;
     s->payload.len = 0;
+    s->compressed.base = NULL;
+    s->compressed.len = 0;
+    s->group = 0;
+    s->batching = false;
+    s->n_batch = 0;
     return 0;
 }
 
@@ -97,16 +138,34 @@ static void server_close(struct io_uv__server *s)
             case RAFT_IO_APPEND_ENTRIES:
                 raft_free(s->message.append_entries.entries);
                 break;
+            case RAFT_IO_PROPOSE:
+                raft_free(s->message.propose.entries);
+                break;
             case RAFT_IO_INSTALL_SNAPSHOT:
                 raft_configuration_close(&s->message.install_snapshot.conf);
                 break;
         }
         raft_free(s->payload.base);
     }
+    if (s->compressed.base != NULL) {
+        raft_free(s->compressed.base);
+    }
+    raft_free(s->recv);
     raft_free(s->address);
     raft_free(s->stream);
 }
 
+/* Move the data not yet parsed to the beginning of the receive buffer. */
+static void server_compact(struct io_uv__server *s)
+{
+    if (s->recv_start == 0) {
+        return;
+    }
+    memmove(s->recv, s->recv + s->recv_start, s->recv_end - s->recv_start);
+    s->recv_end -= s->recv_start;
+    s->recv_start = 0;
+}
+
 /* Invoked to initialize the read buffer for the next asynchronous read on the
  * socket. */
 static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
@@ -114,73 +173,41 @@ static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
     struct io_uv__server *s = handle->data;
     (void)suggested_size;
 
-    /* If this is the first read of the preamble, or of the header, or of the
-     * payload, then initialize the read buffer, according to the chunk of data
-     * that we expect next. */
-    if (s->buf.len == 0) {
-        assert(s->buf.base == NULL);
-
-        /* Check if we expect the preamble. */
-        if (s->header.len == 0) {
-            assert(s->preamble[0] == 0);
-            assert(s->preamble[1] == 0);
-            s->buf.base = (char *)s->preamble;
-            s->buf.len = sizeof s->preamble;
-            goto out;
-        }
-
-        /* Check if we expect the header. */
-        if (s->payload.len == 0) {
-            assert(s->header.len > 0);
-            assert(s->header.base == NULL);
-            s->header.base = raft_malloc(s->header.len);
-            if (s->header.base == NULL) {
-                /* Setting all buffer fields to 0 will make read_cb fail with
-                 * ENOBUFS. */
-                memset(buf, 0, sizeof *buf);
-                return;
-            }
-            s->buf = s->header;
-            goto out;
-        }
-
-        /* If we get here we should be expecting the payload. */
-        assert(s->payload.len > 0);
-        s->payload.base = raft_malloc(s->payload.len);
-        if (s->payload.base == NULL) {
-            /* Setting all buffer fields to 0 will make read_cb fail with
-             * ENOBUFS. */
-            memset(buf, 0, sizeof *buf);
-            return;
-        }
-
-        s->buf = s->payload;
+    /* If a big chunk of the current header or payload is still missing, read
+     * it directly into its buffer, to save a copy. */
+    if (s->buf.len >= IO_UV__SERVER_BUF_SIZE) {
+        *buf = s->buf;
+        return;
     }
 
-out:
-    *buf = s->buf;
+    /* Otherwise read as much data as possible into the receive buffer, that
+     * might contain several messages. */
+    server_compact(s);
+    assert(s->recv_end < IO_UV__SERVER_BUF_SIZE);
+    buf->base = s->recv + s->recv_end;
+    buf->len = IO_UV__SERVER_BUF_SIZE - s->recv_end;
 }
 
 /* Remove the given server connection */
 static void server_remove(struct io_uv__server *s)
 {
-    struct io_uv *uv = s->uv;
+    struct io_uv__host *h = s->host;
     unsigned i;
     unsigned j;
 
-    for (i = 0; i < uv->n_servers; i++) {
-        if (uv->servers[i] == s) {
+    for (i = 0; i < h->n_servers; i++) {
+        if (h->servers[i] == s) {
             break;
         }
     }
-    assert(i < uv->n_servers);
+    assert(i < h->n_servers);
 
     /* Left-shift the pointers of the rest of the servers. */
-    for (j = i + 1; j < uv->n_servers; j++) {
-        uv->servers[j - 1] = uv->servers[j];
+    for (j = i + 1; j < h->n_servers; j++) {
+        h->servers[j - 1] = h->servers[j];
     }
 
-    uv->n_servers--;
+    h->n_servers--;
 }
 
 /* Callback invoked afer the stream handle of this server connection has been
@@ -197,122 +224,499 @@ static void server_stop(struct io_uv__server *s)
     uv_close((struct uv_handle_s *)s->stream, stream_close_cb);
 }
 
-/* Invoke the receive callback. */
-static void server_recv(struct io_uv__server *s)
+/* Release the memory of a received message that no group will consume. */
+static void server_discard(struct io_uv__server *s)
+{
+    switch (s->message.type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            if (s->message.append_entries.entries != NULL) {
+                raft_free(s->message.append_entries.entries);
+            }
+            break;
+        case RAFT_IO_PROPOSE:
+            if (s->message.propose.entries != NULL) {
+                raft_free(s->message.propose.entries);
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            raft_configuration_close(&s->message.install_snapshot.conf);
+            break;
+    }
+    if (s->payload.base != NULL) {
+        raft_free(s->payload.base);
+    }
+    if (s->compressed.base != NULL) {
+        raft_free(s->compressed.base);
+        s->compressed.base = NULL;
+        s->compressed.len = 0;
+    }
+}
+
+/* Release the memory of a complete message that no group will consume. */
+static void message_discard(struct raft_message *message)
+{
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            if (message->append_entries.entries != NULL) {
+                raft_free(message->append_entries.entries[0].batch);
+                raft_free(message->append_entries.entries);
+            }
+            break;
+        case RAFT_IO_PROPOSE:
+            if (message->propose.entries != NULL) {
+                raft_free(message->propose.entries[0].batch);
+                raft_free(message->propose.entries);
+            }
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            raft_configuration_close(&message->install_snapshot.conf);
+            if (message->install_snapshot.data.len > 0) {
+                raft_free(message->install_snapshot.data.base);
+            }
+            break;
+    }
+}
+
+/* Return the group with the given ID if it can receive messages. */
+static struct io_uv *server_group(struct io_uv__server *s, unsigned group)
+{
+    struct io_uv *uv = io_uv__host_group(s->host, group);
+
+    if (uv == NULL || uv->state != IO_UV__ACTIVE || uv->recv_cb == NULL) {
+        io_uv__host_emit(s->host, RAFT_DEBUG,
+                         "discard message for inactive group %u", group);
+        return NULL;
+    }
+
+    return uv;
+}
+
+/* Deliver the held messages, passing consecutive ones for the same group to
+ * its batch callback, if set. The group is looked up again before each
+ * delivery, since a callback might close it. */
+static void server_flush(struct io_uv__server *s)
 {
-    s->uv->recv_cb(s->uv->io, &s->message);
+    unsigned i = 0;
+
+    while (i < s->n_batch) {
+        unsigned group = s->batch_groups[i];
+        struct io_uv *uv = server_group(s, group);
+        unsigned j = i + 1;
+        unsigned k;
+        uint64_t start;
+
+        while (j < s->n_batch && s->batch_groups[j] == group) {
+            j++;
+        }
+
+        if (uv == NULL) {
+            for (; i < j; i++) {
+                message_discard(&s->batch[i]);
+            }
+            continue;
+        }
+
+        for (k = i; k < j; k++) {
+            io_uv__record_message(uv, RAFT_IO_UV_RECORD_RECV, &s->batch[k]);
+        }
+        start = io_uv__stall_start(uv);
+        if (j - i > 1 && uv->recv_batch_cb != NULL) {
+            uv->recv_batch_cb(uv->io, &s->batch[i], j - i);
+            i = j;
+        } else {
+            uv->recv_cb(uv->io, &s->batch[i]);
+            i++;
+        }
+        io_uv__stall_end(uv, RAFT_IO_UV_STALL_RECV, start);
+    }
 
-    /* Reset our state as we'll start reading a new message. We don't need to
-     * release the payload buffer, since ownership was transfered to the
-     * user. */
+    s->n_batch = 0;
+}
+
+/* Invoke the receive callback of the group the message belongs to, or hold
+ * the message if more of them are being parsed. */
+static void server_dispatch(struct io_uv__server *s)
+{
+    struct io_uv *uv;
+
+    if (s->batching) {
+        if (s->n_batch == IO_UV__SERVER_BATCH) {
+            server_flush(s);
+        }
+        s->batch[s->n_batch] = s->message;
+        s->batch_groups[s->n_batch] = s->group;
+        s->n_batch++;
+        return;
+    }
+
+    uv = server_group(s, s->group);
+    if (uv != NULL) {
+        uint64_t start;
+        io_uv__record_message(uv, RAFT_IO_UV_RECORD_RECV, &s->message);
+        start = io_uv__stall_start(uv);
+        uv->recv_cb(uv->io, &s->message);
+        io_uv__stall_end(uv, RAFT_IO_UV_STALL_RECV, start);
+    } else {
+        server_discard(s);
+    }
+}
+
+/* Reset our state, in order to start reading a new message. */
+static void server_reset(struct io_uv__server *s)
+{
+    /* We don't need to release the payload buffer, since ownership was
+     * transfered to the user. */
     memset(s->preamble, 0, sizeof s->preamble);
-    raft_free(s->header.base);
-    s->header.base = NULL;
+    if (s->header.base != NULL) {
+        raft_free(s->header.base);
+        s->header.base = NULL;
+    }
     s->header.len = 0;
     s->payload.base = NULL;
     s->payload.len = 0;
+    s->buf.base = NULL;
+    s->buf.len = 0;
 }
 
-/* Callback invoked when data has been read from the socket. */
-static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+/* Dispatch the received message and get ready for the next one. */
+static void server_recv(struct io_uv__server *s)
 {
-    struct io_uv__server *s = stream->data;
+    server_dispatch(s);
+    server_reset(s);
+}
+
+/* Fan out the heartbeats coalesced in an IO_UV__HEARTBEATS message to their
+ * groups, as regular AppendEntries messages with no entries. */
+static int server_recv_heartbeats(struct io_uv__server *s,
+                                  const uv_buf_t *header)
+{
+    struct io_uv__heartbeat *heartbeats;
+    unsigned n;
+    unsigned i;
     int rv;
 
-    (void)buf;
+    rv = io_uv__decode_heartbeats(header, &heartbeats, &n);
+    if (rv != 0) {
+        return rv;
+    }
 
-    /* If the read was successful, let's check if we have received all the data
-     * we expected. */
-    if (nread > 0) {
-        size_t n = (size_t)nread;
+    for (i = 0; i < n; i++) {
+        s->group = heartbeats[i].group;
+        s->message.type = RAFT_IO_APPEND_ENTRIES;
+        s->message.server_id = s->id;
+        s->message.server_address = s->address;
+        s->message.append_entries = heartbeats[i].args;
+        server_dispatch(s);
+    }
 
-        /* We shouldn't have read more data than the pending amount. */
-        assert(n <= s->buf.len);
+    raft_free(heartbeats);
+    server_reset(s);
 
-        /* Advance the read window */
-        s->buf.base += n;
-        s->buf.len -= n;
+    return 0;
+}
 
-        /* If there's more data to read in order to fill the current
-         * read buffer, just return, we'll be invoked again. */
-        if (s->buf.len > 0) {
-            return;
+/* Handle a complete preamble, which contains the length of the header. */
+static int server_recv_preamble(struct io_uv__server *s)
+{
+    assert(s->header.len == 0);
+
+    s->header.len = byte__flip64(s->preamble[1]);
+
+    /* The length of the header must be greater than zero. */
+    if (s->header.len == 0) {
+        io_uv__host_emit(s->host, RAFT_WARN, "message has zero length");
+        return RAFT_ERR_IO_MALFORMED;
+    }
+
+    /* Big headers are read into their own buffer. */
+    if (s->header.len > IO_UV__SERVER_BUF_SIZE) {
+        s->header.base = raft_malloc(s->header.len);
+        if (s->header.base == NULL) {
+            return RAFT_ENOMEM;
         }
+        s->buf = s->header;
+    }
 
-        if (s->header.len == 0) {
-            /* If the header buffer is not set, it means that we've just
-             * completed reading the preamble. */
-            assert(s->header.base == NULL);
+    return 0;
+}
+
+/* Handle a complete header, allocating the buffer for the payload, if any. */
+static int server_recv_header(struct io_uv__server *s, const uv_buf_t *header)
+{
+    uv_buf_t plain = *header;
+    size_t compressed_len = 0;
+    uint64_t word;
+    unsigned type;
+    int rv;
 
-            s->header.len = byte__flip64(s->preamble[1]);
+    /* The low 32 bits hold the message type, the high ones the ID of the
+     * group the message is addressed to. */
+    word = byte__flip64(s->preamble[0]);
+    type = (unsigned)(word & 0xffffffff);
+    s->group = (unsigned)(word >> 32);
+
+    /* A compressed payload has its size appended to the header. */
+    if (type & IO_UV__COMPRESSED) {
+        const void *cursor;
+        type &= ~IO_UV__COMPRESSED;
+        if (plain.len <= sizeof(uint64_t)) {
+            io_uv__host_emit(s->host, RAFT_WARN, "bad compressed header");
+            return RAFT_ERR_IO_MALFORMED;
+        }
+        plain.len -= sizeof(uint64_t);
+        cursor = plain.base + plain.len;
+        compressed_len = byte__get64(&cursor);
+        if (compressed_len == 0) {
+            io_uv__host_emit(s->host, RAFT_WARN, "bad compressed header");
+            return RAFT_ERR_IO_MALFORMED;
+        }
+    }
 
-            /* The length of the header must be greater than zero. */
-            if (s->header.len == 0) {
-                warnf(s->uv->io, "message has zero length");
-                goto abort;
-            }
-        } else if (s->payload.len == 0) {
-            /* If the payload buffer is not set, it means we just completed
-             * reading the message header. */
-            unsigned type;
+    if (type == IO_UV__HEARTBEATS) {
+        rv = server_recv_heartbeats(s, header);
+        if (rv != 0) {
+            io_uv__host_emit(s->host, RAFT_WARN, "decode heartbeats: %s",
+                             raft_strerror(rv));
+            return rv;
+        }
+        return 0;
+    }
+
+    rv = io_uv__decode_message(type, &plain, &s->message, &s->payload.len);
+    if (rv != 0) {
+        io_uv__host_emit(s->host, RAFT_WARN, "decode message: %s",
+                         raft_strerror(rv));
+        return rv;
+    }
+
+    s->message.server_id = s->id;
+    s->message.server_address = s->address;
+
+    /* Results tell us which encodings the peer can decode in the messages we
+     * send to it. */
+    if (type == RAFT_IO_APPEND_ENTRIES_RESULT) {
+        io_uv__clients_set_features(s->host, s->id,
+                                    io_uv__decode_features(&plain));
+    }
+
+    /* If the message has no payload, we're done. */
+    if (s->payload.len == 0) {
+        if (compressed_len > 0) {
+            io_uv__host_emit(s->host, RAFT_WARN, "bad compressed header");
+            server_discard(s);
+            return RAFT_ERR_IO_MALFORMED;
+        }
+        server_recv(s);
+        return 0;
+    }
+
+    /* The header is not needed anymore. */
+    if (s->header.base != NULL) {
+        raft_free(s->header.base);
+        s->header.base = NULL;
+    }
+
+    /* The payload buffer is handed over to the user along with the message,
+     * so it needs its own allocation. */
+    assert(s->payload.base == NULL);
+    s->payload.base = raft_malloc(s->payload.len);
+    if (s->payload.base == NULL) {
+        server_discard(s);
+        s->payload.len = 0;
+        return RAFT_ENOMEM;
+    }
+    s->buf = s->payload;
+
+    /* Read a compressed payload into its own buffer, and expand it once it's
+     * complete. */
+    if (compressed_len > 0) {
+        s->compressed.base = raft_malloc(compressed_len);
+        if (s->compressed.base == NULL) {
+            server_discard(s);
+            s->payload.base = NULL;
+            s->payload.len = 0;
+            return RAFT_ENOMEM;
+        }
+        s->compressed.len = compressed_len;
+        s->buf = s->compressed;
+    }
 
-            assert(s->header.base != NULL);
+    return 0;
+}
 
-            type = byte__flip64(s->preamble[0]);
-            assert(type > 0);
+/* Handle a complete payload and dispatch the message. */
+static int server_recv_payload(struct io_uv__server *s)
+{
+    struct raft_buffer buf; /* TODO: avoid converting from uv_buf_t */
+    int rv;
+
+    assert(s->payload.base != NULL);
+    assert(s->payload.len > 0);
+
+    if (s->compressed.base != NULL) {
+        rv = io_uv__decompress(&s->compressed, &s->payload);
+        raft_free(s->compressed.base);
+        s->compressed.base = NULL;
+        s->compressed.len = 0;
+        if (rv != 0) {
+            io_uv__host_emit(s->host, RAFT_WARN, "decompress payload: %s",
+                             raft_strerror(rv));
+            return rv;
+        }
+    }
+
+    switch (s->message.type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            buf.base = s->payload.base;
+            buf.len = s->payload.len;
+            io_uv__decode_entries_batch(&buf,
+                                        s->message.append_entries.entries,
+                                        s->message.append_entries.n_entries);
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            s->message.install_snapshot.data.base = s->payload.base;
+            break;
+        case RAFT_IO_PROPOSE:
+            buf.base = s->payload.base;
+            buf.len = s->payload.len;
+            io_uv__decode_entries_batch(&buf, s->message.propose.entries,
+                                        s->message.propose.n_entries);
+            break;
+        default:
+            /* We should never have read a payload in the first place */
+            assert(0);
+    }
+
+    server_recv(s);
+    return 0;
+}
+
+/* Handle a header or payload whose buffer was just filled. */
+static int server_recv_buf(struct io_uv__server *s)
+{
+    assert(s->buf.len == 0);
+    s->buf.base = NULL;
+
+    if (s->payload.len == 0) {
+        return server_recv_header(s, &s->header);
+    }
 
-            rv = io_uv__decode_message(type, &s->header, &s->message,
-                                       &s->payload.len);
+    return server_recv_payload(s);
+}
+
+/* Parse as many messages as possible out of the data in the receive buffer. */
+static int server_parse(struct io_uv__server *s)
+{
+    while (s->recv_start < s->recv_end) {
+        char *cursor = s->recv + s->recv_start;
+        size_t n = s->recv_end - s->recv_start;
+        uv_buf_t header;
+        int rv;
+
+        /* Fill the buffer of the current big header or payload. */
+        if (s->buf.len > 0) {
+            if (n > s->buf.len) {
+                n = s->buf.len;
+            }
+            memcpy(s->buf.base, cursor, n);
+            s->buf.base += n;
+            s->buf.len -= n;
+            s->recv_start += n;
+            if (s->buf.len > 0) {
+                break;
+            }
+            rv = server_recv_buf(s);
             if (rv != 0) {
-                warnf(s->uv->io, "decode message: %s", raft_strerror(rv));
-                goto abort;
+                return rv;
             }
+            continue;
+        }
 
-            s->message.server_id = s->id;
-            s->message.server_address = s->address;
-
-            /* If the message has no payload, we're done. */
-            if (s->payload.len == 0) {
-                server_recv(s);
+        /* Check if we expect the preamble. */
+        if (s->header.len == 0) {
+            if (n < sizeof s->preamble) {
+                break;
             }
-        } else {
-            /* If we get here it means that we've just completed reading the
-             * payload. */
-            struct raft_buffer buf; /* TODO: avoid converting from uv_buf_t */
-            assert(s->payload.base != NULL);
-            assert(s->payload.len > 0);
-
-            switch (s->message.type) {
-                case RAFT_IO_APPEND_ENTRIES:
-                    buf.base = s->payload.base;
-                    buf.len = s->payload.len;
-                    io_uv__decode_entries_batch(
-                        &buf, s->message.append_entries.entries,
-                        s->message.append_entries.n_entries);
-                    break;
-                case RAFT_IO_INSTALL_SNAPSHOT:
-                    s->message.install_snapshot.data.base = s->payload.base;
-                    break;
-                default:
-                    /* We should never have read a payload in the first place */
-                    assert(0);
+            memcpy(s->preamble, cursor, sizeof s->preamble);
+            s->recv_start += sizeof s->preamble;
+            rv = server_recv_preamble(s);
+            if (rv != 0) {
+                return rv;
             }
+            continue;
+        }
 
-            server_recv(s);
+        /* If we get here we should be expecting a small header, which is
+         * decoded in place. */
+        assert(s->payload.len == 0);
+        assert(s->header.len <= IO_UV__SERVER_BUF_SIZE);
+        if (n < s->header.len) {
+            break;
         }
 
-        /* Mark that we're done with this chunk. When the alloc callback will
-         * trigger again it will notice that it needs to change the read
-         * buffer. */
-        assert(s->buf.len == 0);
-        s->buf.base = NULL;
+        /* Make sure the header is 8-byte aligned, as the decoder expects. */
+        if ((uintptr_t)cursor % sizeof(uint64_t) != 0) {
+            server_compact(s);
+            cursor = s->recv;
+        }
 
-        return;
+        header.base = cursor;
+        header.len = s->header.len;
+        s->recv_start += header.len;
+
+        rv = server_recv_header(s, &header);
+        if (rv != 0) {
+            return rv;
+        }
     }
 
-    /* The if nread>0 condition above should always exit the function with a
-     * goto. */
-    assert(nread <= 0);
+    return 0;
+}
+
+/* Callback invoked when data has been read from the socket. */
+static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    struct io_uv__server *s = stream->data;
+    int rv;
+
+    if (nread > 0) {
+        size_t n = (size_t)nread;
+
+        /* If the data was read directly into the buffer of the current header
+         * or payload, advance its window. */
+        if (buf->base == s->buf.base) {
+            /* We shouldn't have read more data than the pending amount. */
+            assert(n <= s->buf.len);
+            s->buf.base += n;
+            s->buf.len -= n;
+
+            /* If there's more data to read in order to fill the current
+             * buffer, just return, we'll be invoked again. */
+            if (s->buf.len > 0) {
+                return;
+            }
+
+            rv = server_recv_buf(s);
+            if (rv != 0) {
+                goto abort;
+            }
+            return;
+        }
+
+        assert(buf->base == s->recv + s->recv_end);
+        assert(s->recv_end + n <= IO_UV__SERVER_BUF_SIZE);
+        s->recv_end += n;
+
+        s->batching = true;
+        rv = server_parse(s);
+        s->batching = false;
+        server_flush(s);
+        if (rv != 0) {
+            goto abort;
+        }
+
+        return;
+    }
 
     if (nread == 0) {
         /* Empty read */
@@ -323,7 +727,8 @@ static void read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
      * with a goto and never reach this point. */
     assert(nread < 0);
 
-    warnf(s->uv->io, "receive data: %s", uv_strerror(nread));
+    io_uv__host_emit(s->host, RAFT_WARN, "receive data: %s",
+                     uv_strerror(nread));
 
 abort:
     server_remove(s);
@@ -337,14 +742,15 @@ static int server_start(struct io_uv__server *s)
 
     rv = uv_read_start(s->stream, alloc_cb, read_cb);
     if (rv != 0) {
-        warnf(s->uv->io, "start reading: %s", uv_strerror(rv));
+        io_uv__host_emit(s->host, RAFT_WARN, "start reading: %s",
+                         uv_strerror(rv));
         return RAFT_ERR_IO;
     }
 
     return 0;
 }
 
-static int server_add(struct io_uv *uv,
+static int server_add(struct io_uv__host *h,
                       unsigned id,
                       const char *address,
                       struct uv_stream_s *stream)
@@ -355,15 +761,15 @@ static int server_add(struct io_uv *uv,
     int rv;
 
     /* Grow the servers array */
-    n_servers = uv->n_servers + 1;
-    servers = raft_realloc(uv->servers, n_servers * sizeof *servers);
+    n_servers = h->n_servers + 1;
+    servers = raft_realloc(h->servers, n_servers * sizeof *servers);
     if (servers == NULL) {
         rv = RAFT_ENOMEM;
         goto err;
     }
 
-    uv->servers = servers;
-    uv->n_servers = n_servers;
+    h->servers = servers;
+    h->n_servers = n_servers;
 
     /* Initialize the new connection */
     s = raft_malloc(sizeof *s);
@@ -373,7 +779,7 @@ static int server_add(struct io_uv *uv,
     }
     servers[n_servers - 1] = s;
 
-    rv = server_init(s, uv, id, address, stream);
+    rv = server_init(s, h, id, address, stream);
     if (rv != 0) {
         goto err_after_server_alloc;
     }
@@ -394,7 +800,7 @@ err_after_server_alloc:
 
 err_after_servers_realloc:
     /* Simply pretend that the connection was not inserted at all */
-    uv->n_servers--;
+    h->n_servers--;
 
 err:
     assert(rv != 0);
@@ -407,18 +813,18 @@ static void accept_cb(struct raft_io_uv_transport *transport,
                       const char *address,
                       struct uv_stream_s *stream)
 {
-    struct io_uv *uv = transport->data;
+    struct io_uv__host *h = transport->data;
     int rv;
 
-    assert(uv->state == IO_UV__ACTIVE || uv->state == IO_UV__CLOSING);
+    assert(h->state == IO_UV__ACTIVE || h->state == IO_UV__CLOSING);
 
-    if (uv->state == IO_UV__CLOSING) {
+    if (h->state == IO_UV__CLOSING) {
         goto abort;
     }
 
-    rv = server_add(uv, id, address, stream);
+    rv = server_add(h, id, address, stream);
     if (rv != 0) {
-        warnf(uv->io, "add server: %s", raft_strerror(rv));
+        io_uv__host_emit(h, RAFT_WARN, "add server: %s", raft_strerror(rv));
         goto abort;
     }
 
@@ -428,20 +834,41 @@ abort:
     uv_close((struct uv_handle_s *)stream, (uv_close_cb)raft_free);
 }
 
-int io_uv__listen(struct io_uv *uv)
+/* The handshake of connections accepted by version 2 transports tells us the
+ * encodings that the peer can decode, before it sends any result. */
+static void accept_features_cb(struct raft_io_uv_transport *transport,
+                               unsigned id,
+                               const char *address,
+                               unsigned long long features,
+                               struct uv_stream_s *stream)
+{
+    struct io_uv__host *h = transport->data;
+    accept_cb(transport, id, address, stream);
+    if (h->state == IO_UV__ACTIVE) {
+        io_uv__clients_set_features(h, id, features);
+    }
+}
+
+int io_uv__listen(struct io_uv__host *h)
 {
+    struct raft_io_uv_transport *t = h->transport;
     int rv;
-    rv = uv->transport->listen(uv->transport, accept_cb);
+    if (t->version >= 2) {
+        t->advertise(t, IO_UV__FEATURE_COMPACT | IO_UV__FEATURE_SEQ);
+        rv = t->listen_features(t, accept_features_cb);
+    } else {
+        rv = t->listen(t, accept_cb);
+    }
     if (rv != 0) {
         return rv;
     }
     return 0;
 }
 
-void io_uv__servers_stop(struct io_uv *uv)
+void io_uv__servers_stop(struct io_uv__host *h)
 {
     unsigned i;
-    for (i = 0; i < uv->n_servers; i++) {
-        server_stop(uv->servers[i]);
+    for (i = 0; i < h->n_servers; i++) {
+        server_stop(h->servers[i]);
     }
 }
@@ -17,6 +17,10 @@
  * index, creation timestamp (milliseconds since epoch). */
 #define SNAPSHOT_META_TEMPLATE SNAPSHOT_TEMPLATE ".meta"
 
+/* Name of the temporary file holding the data chunks of a snapshot being
+ * written. */
+#define SNAPSHOT_PART_FILENAME "snapshot-part"
+
 struct put
 {
     struct io_uv *uv;
@@ -26,18 +30,60 @@ struct put
     {
         unsigned long long timestamp;
         uint64_t header[4];         /* Format, CRC, configuration index/len */
-        struct raft_buffer bufs[2]; /* Premable and configuration */
+        struct raft_buffer bufs[3]; /* Premable, configuration, checksums */
     } meta;
+    struct
+    {
+        bool enabled;                /* Whether this is a put chunk request */
+        size_t offset;               /* Offset of the chunk in the data */
+        const struct raft_buffer *buf; /* Chunk data */
+        bool done;                   /* Whether this is the last chunk */
+    } chunk;
+    struct
+    {
+        bool enabled;    /* Whether this is a put patch request */
+        raft_index base; /* Index of the snapshot being patched */
+        const struct raft_snapshot_patch *patches; /* Changes to the base */
+        unsigned n;                                /* Number of patches */
+        size_t size;                               /* Size of the new data */
+    } patch;
+    bool compact; /* Whether files were made obsolete */
     int status;
     raft__queue queue;
 };
 
+/* Compaction pass removing obsolete segments and snapshots. */
+struct compact
+{
+    struct io_uv *uv;
+    io_uv__filename recycled[IO_UV__MAX_RECYCLED_SEGMENTS]; /* To reuse */
+    unsigned n_recycled; /* Number of obsolete segment files to reuse */
+    unsigned n_removed;  /* Number of files removed or renamed so far */
+    bool more;           /* Whether files were left for the next pass */
+    int status;
+};
+
 struct get
 {
     struct io_uv *uv;
     struct raft_io_snapshot_get *req;
     struct raft_snapshot *snapshot;
-    struct uv_work_s work;
+    struct io_uv__work work;
+    int status;
+    raft__queue queue;
+};
+
+struct read
+{
+    struct io_uv *uv;
+    struct raft_io_snapshot_read *req;
+    raft_term term;   /* Term of the snapshot to read */
+    raft_index index; /* Index of the snapshot to read, or 0 for the last */
+    size_t offset;    /* Offset of the chunk to read */
+    size_t len;       /* Maximum length of the chunk to read */
+    struct raft_snapshot *snapshot;
+    size_t size; /* Total size of the snapshot data */
+    struct io_uv__work work;
     int status;
     raft__queue queue;
 };
@@ -91,6 +137,57 @@ err:
     return RAFT_ERR_IO;
 }
 
+/* Write the given chunk at the given offset of the temporary snapshot data
+ * file, creating it if it's the first chunk, and sync it if it's the last. */
+static int write_chunk(struct raft_io *io,
+                       const char *dir,
+                       size_t offset,
+                       const struct raft_buffer *buf,
+                       bool done)
+{
+    int flags = O_WRONLY | O_CREAT;
+    int fd;
+    ssize_t rv;
+
+    if (offset == 0) {
+        flags |= O_TRUNC;
+    }
+
+    fd = raft__io_uv_fs_open(dir, SNAPSHOT_PART_FILENAME, flags);
+    if (fd == -1) {
+        errorf(io, "open %s: %s", SNAPSHOT_PART_FILENAME, uv_strerror(-errno));
+        return RAFT_ERR_IO;
+    }
+
+    rv = pwrite(fd, buf->base, buf->len, (off_t)offset);
+    if (rv != (ssize_t)buf->len) {
+        errorf(io, "write %s: %s", SNAPSHOT_PART_FILENAME, uv_strerror(-errno));
+        goto err_after_file_open;
+    }
+
+    if (done) {
+        rv = fsync(fd);
+        if (rv == -1) {
+            errorf(io, "fsync %s: %s", SNAPSHOT_PART_FILENAME,
+                   uv_strerror(-errno));
+            goto err_after_file_open;
+        }
+    }
+
+    rv = close(fd);
+    if (rv == -1) {
+        errorf(io, "close %s: %s", SNAPSHOT_PART_FILENAME, uv_strerror(-errno));
+        goto err;
+    }
+
+    return 0;
+
+err_after_file_open:
+    close(fd);
+err:
+    return RAFT_ERR_IO;
+}
+
 /* TODO: remove code duplication with io_uv_load.c */
 static void snapshot_data_filename(struct io_uv__snapshot_meta *meta,
                                    io_uv__filename filename)
@@ -100,17 +197,38 @@ static void snapshot_data_filename(struct io_uv__snapshot_meta *meta,
     filename[len] = 0;
 }
 
-/* Remove all segmens and snapshots that are not needed anymore, but ignore
- * errors.
+/* Return true if the given compaction pass can remove another file, otherwise
+ * flag it as having left files for the next pass. */
+static bool compact_has_budget(struct compact *c)
+{
+    if (c->n_removed == IO_UV__COMPACT_BATCH) {
+        c->more = true;
+        return false;
+    }
+    c->n_removed++;
+    return true;
+}
+
+/* Remove up to IO_UV__COMPACT_BATCH segments and snapshots that are not needed
+ * anymore.
+ *
+ * Closed segments are retained as long as they hold entries that follow the
+ * oldest snapshot kept, so lagging followers can still be sent those entries
+ * instead of a whole snapshot. Up to IO_UV__MAX_RECYCLED_SEGMENTS unused
+ * closed segments are renamed instead of being removed, so their files can be
+ * reused as new open segments, and their names are added to the given
+ * compaction pass. If an archive directory is set, unused segments are moved
+ * there instead.
  *
  * TODO: remove code duplication with io_uv_load.c */
 static int remove_old_segments_and_snapshots(struct io_uv *uv,
-                                             raft_index last_index)
+                                             struct compact *r)
 {
     struct io_uv__snapshot_meta *snapshots;
     struct io_uv__segment_meta *segments;
     size_t n_snapshots;
     size_t n_segments;
+    raft_index last_index = 0;
     size_t i;
     int rv = 0;
 
@@ -124,18 +242,27 @@ static int remove_old_segments_and_snapshots(struct io_uv *uv,
         for (i = 0; i < n_snapshots - 2; i++) {
             struct io_uv__snapshot_meta *s = &snapshots[i];
             io_uv__filename filename;
-            rv = raft__io_uv_fs_unlink(uv->dir, s->filename);
+            if (!compact_has_budget(r)) {
+                goto out;
+            }
+            rv = raft__io_uv_fs_unlink(s->dir, s->filename);
             if (rv != 0) {
                 goto out;
             }
             snapshot_data_filename(s, filename);
-            rv = raft__io_uv_fs_unlink(uv->dir, filename);
+            rv = raft__io_uv_fs_unlink(s->dir, filename);
             if (rv != 0) {
                 goto out;
             }
         }
     }
 
+    /* Index of the oldest snapshot that we keep, if we have more than one,
+     * since snapshots are sorted from oldest to newest. */
+    if (n_snapshots >= 2) {
+        last_index = snapshots[n_snapshots - 2].index;
+    }
+
     /* Remove all unused closed segments */
     for (i = 0; i < n_segments; i++) {
         struct io_uv__segment_meta *segment = &segments[i];
@@ -145,7 +272,22 @@ static int remove_old_segments_and_snapshots(struct io_uv *uv,
         }
 
         if (segment->end_index < last_index) {
-            rv = raft__io_uv_fs_unlink(uv->dir, segment->filename);
+            if (!compact_has_budget(r)) {
+                goto out;
+            }
+            if (uv->archive_dir == NULL &&
+                r->n_recycled < IO_UV__MAX_RECYCLED_SEGMENTS) {
+                char *filename = r->recycled[r->n_recycled];
+                sprintf(filename, IO_UV__RECYCLED_PREFIX "%s",
+                        segment->filename);
+                rv = raft__io_uv_fs_rename(uv->dir, segment->filename,
+                                           filename);
+                if (rv == 0) {
+                    r->n_recycled++;
+                    continue;
+                }
+            }
+            rv = io_uv__load_discard(uv, segment->filename);
             if (rv != 0) {
                 goto out;
             }
@@ -163,17 +305,315 @@ out:
     return rv;
 }
 
-static void put_work_cb(uv_work_t *work)
+/* Update the checksums of the partial chunked snapshot with the chunk just
+ * written. Checksums can only be streamed if chunks are written sequentially,
+ * otherwise the snapshot is stored without them. */
+static void update_part_checksums(struct io_uv *uv, struct put *r)
+{
+    struct io_uv__snapshot_checksums *checksums = &uv->snapshot_part.checksums;
+    int rv;
+
+    if (r->chunk.offset == 0) {
+        io_uv__snapshot_checksums_close(checksums);
+        io_uv__snapshot_checksums_init(checksums, IO_UV__SNAPSHOT_BLOCK_SIZE);
+        uv->snapshot_part.offset = 0;
+        uv->snapshot_part.valid = true;
+    }
+
+    if (!uv->snapshot_part.valid) {
+        return;
+    }
+
+    if (r->chunk.offset != uv->snapshot_part.offset) {
+        uv->snapshot_part.valid = false;
+        return;
+    }
+
+    rv = io_uv__snapshot_checksums_update(checksums, r->chunk.buf->base,
+                                          r->chunk.buf->len);
+    if (rv != 0) {
+        uv->snapshot_part.valid = false;
+        return;
+    }
+    uv->snapshot_part.offset += r->chunk.buf->len;
+}
+
+/* Encode the given checksums into the last buffer of the metadata file. If
+ * there's no memory for them the metadata file just won't have them. */
+static void encode_checksums(struct put *r,
+                             const struct io_uv__snapshot_checksums *checksums)
+{
+    struct raft_buffer *buf = &r->meta.bufs[2];
+
+    buf->len = io_uv__sizeof_snapshot_checksums(checksums);
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        buf->len = 0;
+        return;
+    }
+
+    io_uv__encode_snapshot_checksums(checksums, buf->base);
+}
+
+/* Compute the checksums of the data of a patched snapshot, reusing the ones of
+ * the base snapshot for the blocks that didn't change, and reading back the
+ * others. */
+static int patch_checksums(struct io_uv *uv,
+                           struct put *r,
+                           int fd,
+                           const struct io_uv__snapshot_checksums *base,
+                           struct io_uv__snapshot_checksums *checksums)
+{
+    size_t block_size = base->block_size;
+    size_t n = r->patch.size / block_size + (r->patch.size % block_size != 0);
+    const struct raft_snapshot_patch *patch;
+    bool *dirty;
+    void *buf;
+    size_t len;
+    size_t i;
+    size_t j;
+    int rv;
+
+    io_uv__snapshot_checksums_init(checksums, block_size);
+    checksums->size = r->patch.size;
+    checksums->crcs = raft_malloc((n > 0 ? n : 1) * sizeof *checksums->crcs);
+    dirty = raft_calloc(n > 0 ? n : 1, sizeof *dirty);
+    buf = raft_malloc(block_size);
+    if (checksums->crcs == NULL || dirty == NULL || buf == NULL) {
+        rv = RAFT_ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < r->patch.n; i++) {
+        patch = &r->patch.patches[i];
+        if (patch->buf.len == 0) {
+            continue;
+        }
+        for (j = patch->offset / block_size;
+             j <= (patch->offset + patch->buf.len - 1) / block_size; j++) {
+            dirty[j] = true;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        /* Blocks that didn't exist or were partial in the base, or that got
+         * truncated, have changed too. */
+        len = r->patch.size - i * block_size;
+        if (len > block_size) {
+            len = block_size;
+        }
+        if (!dirty[i] && i < base->n && len == block_size &&
+            (i + 1) * block_size <= base->size) {
+            checksums->crcs[i] = base->crcs[i];
+            continue;
+        }
+        if (pread(fd, buf, len, (off_t)(i * block_size)) != (ssize_t)len) {
+            errorf(uv->io, "read back snapshot: %s", uv_strerror(-errno));
+            rv = RAFT_ERR_IO;
+            goto out;
+        }
+        checksums->crcs[i] = byte__crc32c(buf, len, 0);
+    }
+    checksums->n = (unsigned)n;
+
+    rv = 0;
+
+out:
+    if (buf != NULL) {
+        raft_free(buf);
+    }
+    if (dirty != NULL) {
+        raft_free(dirty);
+    }
+    return rv;
+}
+
+/* Write the data file of a patched snapshot, by cloning the data of the most
+ * recent snapshot, which must be its base, and then writing the patches. */
+static int write_patched_data(struct io_uv *uv,
+                              struct put *r,
+                              const char *filename)
+{
+    struct io_uv__snapshot_meta *snapshots;
+    struct io_uv__segment_meta *segments;
+    struct io_uv__snapshot_meta *meta;
+    struct io_uv__snapshot_checksums base;
+    struct io_uv__snapshot_checksums checksums;
+    const struct raft_snapshot_patch *patch;
+    size_t n_snapshots;
+    size_t n_segments;
+    io_uv__filename base_filename;
+    struct stat sb;
+    size_t len;
+    int fd1;
+    int fd2;
+    unsigned i;
+    int rv;
+
+    rv = io_uv__load_list(uv, &snapshots, &n_snapshots, &segments, &n_segments);
+    if (rv != 0) {
+        goto err;
+    }
+    if (segments != NULL) {
+        raft_free(segments);
+    }
+
+    meta = n_snapshots > 0 ? &snapshots[n_snapshots - 1] : NULL;
+    if (meta == NULL || meta->index != r->patch.base) {
+        errorf(uv->io, "patch snapshot %lld: base not found", r->patch.base);
+        rv = RAFT_ERR_IO;
+        goto err_after_list;
+    }
+
+    rv = io_uv__load_snapshot_checksums(uv, meta, &base);
+    if (rv != 0) {
+        goto err_after_list;
+    }
+
+    snapshot_data_filename(meta, base_filename);
+    fd1 = raft__io_uv_fs_open(meta->dir, base_filename, O_RDONLY);
+    if (fd1 == -1 || fstat(fd1, &sb) == -1) {
+        errorf(uv->io, "open %s: %s", base_filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_base_open;
+    }
+
+    fd2 = raft__io_uv_fs_open(uv->snapshot_dir, filename,
+                              O_RDWR | O_CREAT | O_EXCL);
+    if (fd2 == -1) {
+        errorf(uv->io, "open %s: %s", filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_base_open;
+    }
+
+    len = (size_t)sb.st_size;
+    if (len > r->patch.size) {
+        len = r->patch.size;
+    }
+    rv = raft__io_uv_fs_copy_n(fd1, fd2, len);
+    if (rv != 0) {
+        errorf(uv->io, "copy %s: %s", base_filename, uv_strerror(rv));
+        rv = RAFT_ERR_IO;
+        goto err_after_file_open;
+    }
+
+    if (ftruncate(fd2, (off_t)r->patch.size) == -1) {
+        errorf(uv->io, "truncate %s: %s", filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_file_open;
+    }
+
+    for (i = 0; i < r->patch.n; i++) {
+        patch = &r->patch.patches[i];
+        assert(patch->offset + patch->buf.len <= r->patch.size);
+        if (pwrite(fd2, patch->buf.base, patch->buf.len,
+                   (off_t)patch->offset) != (ssize_t)patch->buf.len) {
+            errorf(uv->io, "write %s: %s", filename, uv_strerror(-errno));
+            rv = RAFT_ERR_IO;
+            goto err_after_file_open;
+        }
+    }
+
+    if (base.block_size > 0) {
+        rv = patch_checksums(uv, r, fd2, &base, &checksums);
+        if (rv == 0) {
+            encode_checksums(r, &checksums);
+        }
+        io_uv__snapshot_checksums_close(&checksums);
+        if (rv != 0) {
+            goto err_after_file_open;
+        }
+    }
+
+    if (fsync(fd2) == -1) {
+        errorf(uv->io, "fsync %s: %s", filename, uv_strerror(-errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_file_open;
+    }
+
+    close(fd2);
+    close(fd1);
+    io_uv__snapshot_checksums_close(&base);
+    raft_free(snapshots);
+
+    return 0;
+
+err_after_file_open:
+    close(fd2);
+    raft__io_uv_fs_unlink(uv->snapshot_dir, filename);
+err_after_base_open:
+    if (fd1 != -1) {
+        close(fd1);
+    }
+    io_uv__snapshot_checksums_close(&base);
+err_after_list:
+    if (snapshots != NULL) {
+        raft_free(snapshots);
+    }
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+static void put_work_cb(struct io_uv__work *work)
 {
     struct put *r = work->data;
     struct io_uv *uv = r->uv;
+    struct io_uv__snapshot_checksums checksums;
     io_uv__filename filename;
+    unsigned i;
     int rv;
 
+    /* The data of a patched snapshot is written first, since the patches are
+     * needed to compute its checksums. */
+    if (r->patch.enabled) {
+        sprintf(filename, SNAPSHOT_TEMPLATE, r->snapshot->term,
+                r->snapshot->index, r->meta.timestamp);
+        rv = write_patched_data(uv, r, filename);
+        if (rv != 0) {
+            r->status = rv;
+            return;
+        }
+    } else if (r->chunk.enabled) {
+        rv = write_chunk(uv->io, uv->snapshot_dir, r->chunk.offset,
+                         r->chunk.buf, r->chunk.done);
+        if (rv != 0) {
+            uv->snapshot_part.valid = false;
+            r->status = rv;
+            return;
+        }
+        update_part_checksums(uv, r);
+        if (!r->chunk.done) {
+            r->status = 0;
+            return;
+        }
+        rv = io_uv__snapshot_checksums_finish(&uv->snapshot_part.checksums);
+        if (uv->snapshot_part.valid && rv == 0) {
+            encode_checksums(r, &uv->snapshot_part.checksums);
+        }
+        io_uv__snapshot_checksums_close(&uv->snapshot_part.checksums);
+        uv->snapshot_part.valid = false;
+    } else {
+        io_uv__snapshot_checksums_init(&checksums, IO_UV__SNAPSHOT_BLOCK_SIZE);
+        for (i = 0; i < r->snapshot->n_bufs; i++) {
+            rv = io_uv__snapshot_checksums_update(
+                &checksums, r->snapshot->bufs[i].base,
+                r->snapshot->bufs[i].len);
+            if (rv != 0) {
+                break;
+            }
+        }
+        if (i == r->snapshot->n_bufs &&
+            io_uv__snapshot_checksums_finish(&checksums) == 0) {
+            encode_checksums(r, &checksums);
+        }
+        io_uv__snapshot_checksums_close(&checksums);
+    }
+
     sprintf(filename, SNAPSHOT_META_TEMPLATE, r->snapshot->term,
             r->snapshot->index, r->meta.timestamp);
 
-    rv = write_file(uv->io, uv->dir, filename, r->meta.bufs, 2);
+    rv = write_file(uv->io, uv->snapshot_dir, filename, r->meta.bufs, 3);
     if (rv != 0) {
         r->status = rv;
         return;
@@ -182,30 +622,33 @@ static void put_work_cb(uv_work_t *work)
     sprintf(filename, SNAPSHOT_TEMPLATE, r->snapshot->term, r->snapshot->index,
             r->meta.timestamp);
 
-    rv = write_file(uv->io, uv->dir, filename, r->snapshot->bufs,
-                    r->snapshot->n_bufs);
-    if (rv != 0) {
-        r->status = rv;
-        return;
+    /* The data of a chunked snapshot is already on disk, it just needs to get
+     * its final name. */
+    if (r->chunk.enabled) {
+        rv = raft__io_uv_fs_rename(uv->snapshot_dir, SNAPSHOT_PART_FILENAME,
+                                   filename);
+    } else if (!r->patch.enabled) {
+        rv = write_file(uv->io, uv->snapshot_dir, filename, r->snapshot->bufs,
+                        r->snapshot->n_bufs);
     }
-
-    rv = raft__io_uv_fs_sync_dir(uv->dir);
     if (rv != 0) {
         r->status = rv;
         return;
     }
 
-    rv = remove_old_segments_and_snapshots(uv, r->snapshot->index);
+    rv = raft__io_uv_fs_sync_dir(uv->snapshot_dir);
     if (rv != 0) {
         r->status = rv;
+        return;
     }
 
+    r->compact = true;
     r->status = 0;
-
-    return;
 }
 
-static void put_after_work_cb(uv_work_t *work, int status)
+static void process_put_requests(struct io_uv *uv);
+
+static void put_after_work_cb(struct io_uv__work *work, int status)
 {
     struct put *r = work->data;
     struct io_uv *uv = r->uv;
@@ -213,12 +656,29 @@ static void put_after_work_cb(uv_work_t *work, int status)
     assert(status == 0);
     RAFT__QUEUE_REMOVE(&r->queue);
     uv->snapshot_put_work.data = NULL;
+    io_uv__record_latency(&uv->stats.snapshot, work->duration);
+
+    /* The files made obsolete by the new snapshot are removed later on, so
+     * they don't compete with the appends for disk bandwidth. */
+    if (r->compact && !uv->compact_pending) {
+        uv->compact_pending = true;
+        uv->compact_since = uv_now(uv->loop);
+    }
 
     r->req->cb(r->req, r->status);
 
-    raft_free(r->meta.bufs[1].base);
+    if (r->meta.bufs[1].base != NULL) {
+        raft_free(r->meta.bufs[1].base);
+    }
+    if (r->meta.bufs[2].base != NULL) {
+        raft_free(r->meta.bufs[2].base);
+    }
     raft_free(r);
 
+    /* Chunks of a streamed snapshot might still be queued behind this one. */
+    process_put_requests(uv);
+    io_uv__compact_unblock(uv);
+
     io_uv__maybe_close(uv);
 }
 
@@ -227,15 +687,15 @@ static void process_put_requests(struct io_uv *uv)
 {
     struct put *r;
     raft__queue *head;
-    int rv;
 
     /* If there aren't pending snapshot put requests, there's nothing to do. */
     if (RAFT__QUEUE_IS_EMPTY(&uv->snapshot_put_reqs)) {
         return;
     }
 
-    /* If we're already writing a snapshot, let's wait. */
-    if (uv->snapshot_put_work.data != NULL) {
+    /* If we're already writing a snapshot or removing obsolete ones, let's
+     * wait. */
+    if (uv->snapshot_put_work.data != NULL || uv->compact_work.data != NULL) {
         return;
     }
 
@@ -251,28 +711,23 @@ static void process_put_requests(struct io_uv *uv)
     r = RAFT__QUEUE_DATA(head, struct put, queue);
 
     uv->snapshot_put_work.data = r;
-    rv = uv_queue_work(uv->loop, &uv->snapshot_put_work, put_work_cb,
-                       put_after_work_cb);
-    if (rv != 0) {
-        errorf(uv->io, "store snapshot %lld: %s", r->snapshot->index,
-               uv_strerror(rv));
-        uv->errored = true;
-    }
+    io_uv__queue_work(uv, &uv->snapshot_put_work, put_work_cb,
+                      put_after_work_cb);
 }
 
-int io_uv__snapshot_put(struct raft_io *io,
-                        struct raft_io_snapshot_put *req,
-                        const struct raft_snapshot *snapshot,
-                        raft_io_snapshot_put_cb cb)
+/* Create a new put request and queue it, encoding the metadata file if @meta
+ * is true. */
+static int put_request(struct io_uv *uv,
+                       struct raft_io_snapshot_put *req,
+                       const struct raft_snapshot *snapshot,
+                       bool meta,
+                       struct put **out)
 {
-    struct io_uv *uv;
     struct put *r;
     void *cursor;
     unsigned crc;
     int rv;
 
-    uv = io->impl;
-
     r = raft_malloc(sizeof *r);
     if (r == NULL) {
         rv = RAFT_ENOMEM;
@@ -282,12 +737,22 @@ int io_uv__snapshot_put(struct raft_io *io,
     r->req = req;
     r->snapshot = snapshot;
     r->meta.timestamp = uv_now(uv->loop);
-
-    req->cb = cb;
+    r->chunk.enabled = false;
+    r->patch.enabled = false;
+    r->compact = false;
 
     /* Prepare the buffers for the metadata file. */
     r->meta.bufs[0].base = r->meta.header;
     r->meta.bufs[0].len = sizeof r->meta.header;
+    r->meta.bufs[1].base = NULL;
+    r->meta.bufs[1].len = 0;
+    r->meta.bufs[2].base = NULL;
+    r->meta.bufs[2].len = 0;
+
+    if (!meta) {
+        *out = r;
+        return 0;
+    }
 
     rv = configuration__encode(&snapshot->configuration, &r->meta.bufs[1]);
     if (rv != 0) {
@@ -300,14 +765,13 @@ int io_uv__snapshot_put(struct raft_io *io,
     byte__put64(&cursor, snapshot->configuration_index);
     byte__put64(&cursor, r->meta.bufs[1].len);
 
-    crc = byte__crc32(&r->meta.header[2], sizeof(uint64_t) * 2, 0);
-    crc = byte__crc32(r->meta.bufs[1].base, r->meta.bufs[1].len, crc);
+    crc = byte__crc32c(&r->meta.header[2], sizeof(uint64_t) * 2, 0);
+    crc = byte__crc32c(r->meta.bufs[1].base, r->meta.bufs[1].len, crc);
 
     cursor = &r->meta.header[1];
     byte__put64(&cursor, crc);
 
-    RAFT__QUEUE_PUSH(&uv->snapshot_put_reqs, &r->queue);
-    process_put_requests(uv);
+    *out = r;
 
     return 0;
 
@@ -318,12 +782,180 @@ err:
     return rv;
 }
 
+int io_uv__snapshot_put(struct raft_io *io,
+                        struct raft_io_snapshot_put *req,
+                        const struct raft_snapshot *snapshot,
+                        raft_io_snapshot_put_cb cb)
+{
+    struct io_uv *uv;
+    struct put *r;
+    int rv;
+
+    uv = io->impl;
+
+    rv = put_request(uv, req, snapshot, true, &r);
+    if (rv != 0) {
+        return rv;
+    }
+    req->cb = cb;
+
+    RAFT__QUEUE_PUSH(&uv->snapshot_put_reqs, &r->queue);
+    process_put_requests(uv);
+
+    return 0;
+}
+
+int io_uv__snapshot_put_chunk(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              size_t offset,
+                              const struct raft_buffer *buf,
+                              bool done,
+                              raft_io_snapshot_put_cb cb)
+{
+    struct io_uv *uv;
+    struct put *r;
+    int rv;
+
+    uv = io->impl;
+
+    rv = put_request(uv, req, snapshot, done, &r);
+    if (rv != 0) {
+        return rv;
+    }
+    req->cb = cb;
+
+    r->chunk.enabled = true;
+    r->chunk.offset = offset;
+    r->chunk.buf = buf;
+    r->chunk.done = done;
+
+    RAFT__QUEUE_PUSH(&uv->snapshot_put_reqs, &r->queue);
+    process_put_requests(uv);
+
+    return 0;
+}
+
+int io_uv__snapshot_put_patch(struct raft_io *io,
+                              struct raft_io_snapshot_put *req,
+                              const struct raft_snapshot *snapshot,
+                              raft_index base,
+                              const struct raft_snapshot_patch patches[],
+                              unsigned n_patches,
+                              size_t size,
+                              raft_io_snapshot_put_cb cb)
+{
+    struct io_uv *uv;
+    struct put *r;
+    int rv;
+
+    uv = io->impl;
+
+    rv = put_request(uv, req, snapshot, true, &r);
+    if (rv != 0) {
+        return rv;
+    }
+    req->cb = cb;
+
+    r->patch.enabled = true;
+    r->patch.base = base;
+    r->patch.patches = patches;
+    r->patch.n = n_patches;
+    r->patch.size = size;
+
+    RAFT__QUEUE_PUSH(&uv->snapshot_put_reqs, &r->queue);
+    process_put_requests(uv);
+
+    return 0;
+}
+
 void io_uv__snapshot_put_unblock(struct io_uv *uv)
 {
     process_put_requests(uv);
 }
 
-static void get_work_cb(uv_work_t *work)
+static void compact_work_cb(struct io_uv__work *work)
+{
+    struct compact *c = work->data;
+    c->status = remove_old_segments_and_snapshots(c->uv, c);
+}
+
+static void compact_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct compact *c = work->data;
+    struct io_uv *uv = c->uv;
+    unsigned i;
+
+    assert(status == 0);
+    uv->compact_work.data = NULL;
+
+    if (c->status != 0) {
+        warnf(uv->io, "remove obsolete files: %s", raft_strerror(c->status));
+    }
+
+    /* If we're closing, the renamed segment files are left on disk and will be
+     * reused after the next startup. */
+    if (uv->state == IO_UV__ACTIVE) {
+        for (i = 0; i < c->n_recycled; i++) {
+            io_uv__prepare_recycle(uv, c->recycled[i]);
+        }
+    }
+
+    /* The remaining files are removed by the next pass, which waits again for
+     * appends to pause. */
+    if (c->more && c->status == 0) {
+        uv->compact_since = uv_now(uv->loop);
+    } else {
+        uv->compact_pending = false;
+    }
+
+    raft_free(c);
+
+    io_uv__truncate_unblock(uv);
+    process_put_requests(uv);
+    io_uv__compact_unblock(uv);
+    io_uv__maybe_close(uv);
+}
+
+void io_uv__compact_unblock(struct io_uv *uv)
+{
+    struct compact *c;
+
+    if (!uv->compact_pending || uv->compact_work.data != NULL ||
+        uv->state != IO_UV__ACTIVE) {
+        return;
+    }
+
+    /* Truncations and snapshot writes list and change the same files. */
+    if (uv->truncate_work.data != NULL ||
+        !RAFT__QUEUE_IS_EMPTY(&uv->truncate_reqs) ||
+        uv->snapshot_put_work.data != NULL) {
+        return;
+    }
+
+    /* Wait for a pause in the appends, unless we've been waiting for too
+     * long. */
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs) &&
+        uv_now(uv->loop) - uv->compact_since < IO_UV__COMPACT_MAX_DELAY) {
+        return;
+    }
+
+    c = raft_malloc(sizeof *c);
+    if (c == NULL) {
+        return; /* Retry later */
+    }
+    c->uv = uv;
+    c->n_recycled = 0;
+    c->n_removed = 0;
+    c->more = false;
+    c->status = 0;
+
+    uv->compact_work.data = c;
+    io_uv__queue_work(uv, &uv->compact_work, compact_work_cb,
+                      compact_after_work_cb);
+}
+
+static void get_work_cb(struct io_uv__work *work)
 {
     struct get *r = work->data;
     struct io_uv *uv = r->uv;
@@ -339,6 +971,8 @@ static void get_work_cb(uv_work_t *work)
         goto out;
     }
 
+    r->status = 0;
+
     if (snapshots != NULL) {
         rv = io_uv__load_snapshot(uv, &snapshots[n_snapshots - 1], r->snapshot);
         if (rv != 0) {
@@ -351,13 +985,11 @@ static void get_work_cb(uv_work_t *work)
         raft_free(segments);
     }
 
-    r->status = 0;
-
 out:
     return;
 }
 
-static void get_after_work_cb(uv_work_t *work, int status)
+static void get_after_work_cb(struct io_uv__work *work, int status)
 {
     struct get *r = work->data;
     struct io_uv *uv = r->uv;
@@ -365,6 +997,12 @@ static void get_after_work_cb(uv_work_t *work, int status)
 
     RAFT__QUEUE_REMOVE(&r->queue);
 
+    if (r->status != 0) {
+        raft_configuration_close(&r->snapshot->configuration);
+        raft_free(r->snapshot);
+        r->snapshot = NULL;
+    }
+
     r->req->cb(r->req, r->snapshot, r->status);
     raft_free(r);
 
@@ -395,20 +1033,126 @@ int io_uv__snapshot_get(struct raft_io *io,
         rv = RAFT_ENOMEM;
         goto err_after_req_alloc;
     }
+    raft_configuration_init(&r->snapshot->configuration);
     r->work.data = r;
 
     RAFT__QUEUE_PUSH(&uv->snapshot_get_reqs, &r->queue);
-    rv = uv_queue_work(uv->loop, &r->work, get_work_cb, get_after_work_cb);
+    io_uv__queue_work(uv, &r->work, get_work_cb, get_after_work_cb);
+
+    return 0;
+
+err_after_req_alloc:
+    raft_free(r);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+static void read_work_cb(struct io_uv__work *work)
+{
+    struct read *r = work->data;
+    struct io_uv *uv = r->uv;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    struct io_uv__segment_meta *segments;
+    size_t n_segments;
+    struct io_uv__snapshot_meta *meta = NULL;
+    size_t i;
+    int rv;
+
+    rv = io_uv__load_list(uv, &snapshots, &n_snapshots, &segments, &n_segments);
     if (rv != 0) {
-        errorf(uv->io, "get last snapshot: %s", uv_strerror(rv));
-        rv = RAFT_ERR_IO;
-        goto err_after_snapshot_alloc;
+        r->status = rv;
+        return;
+    }
+
+    if (segments != NULL) {
+        raft_free(segments);
     }
 
+    if (n_snapshots > 0 && r->index == 0) {
+        meta = &snapshots[n_snapshots - 1];
+    }
+    for (i = 0; i < n_snapshots && r->index != 0; i++) {
+        if (snapshots[i].term == r->term && snapshots[i].index == r->index) {
+            meta = &snapshots[i];
+        }
+    }
+
+    if (meta == NULL) {
+        errorf(uv->io, "read snapshot %lld: not found", r->index);
+        r->status = RAFT_ERR_IO;
+        goto out;
+    }
+
+    r->status = io_uv__load_snapshot_chunk(uv, meta, r->snapshot, r->offset,
+                                           r->len, &r->size);
+
+out:
+    if (snapshots != NULL) {
+        raft_free(snapshots);
+    }
+}
+
+static void read_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct read *r = work->data;
+    struct io_uv *uv = r->uv;
+    assert(status == 0);
+
+    RAFT__QUEUE_REMOVE(&r->queue);
+
+    if (r->status != 0) {
+        raft_free(r->snapshot);
+        r->snapshot = NULL;
+    }
+
+    r->req->cb(r->req, r->snapshot, r->size, r->status);
+    raft_free(r);
+
+    io_uv__maybe_close(uv);
+}
+
+int io_uv__snapshot_read(struct raft_io *io,
+                         struct raft_io_snapshot_read *req,
+                         raft_term term,
+                         raft_index index,
+                         size_t offset,
+                         size_t len,
+                         raft_io_snapshot_read_cb cb)
+{
+    struct io_uv *uv;
+    struct read *r;
+    int rv;
+
+    uv = io->impl;
+
+    r = raft_malloc(sizeof *r);
+    if (r == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    r->uv = uv;
+    r->req = req;
+    r->term = term;
+    r->index = index;
+    r->offset = offset;
+    r->len = len;
+    r->size = 0;
+    req->cb = cb;
+
+    r->snapshot = raft_malloc(sizeof *r->snapshot);
+    if (r->snapshot == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_req_alloc;
+    }
+    r->work.data = r;
+
+    RAFT__QUEUE_PUSH(&uv->snapshot_get_reqs, &r->queue);
+    io_uv__queue_work(uv, &r->work, read_work_cb, read_after_work_cb);
+
     return 0;
 
-err_after_snapshot_alloc:
-    raft_free(r->snapshot);
 err_after_req_alloc:
     raft_free(r);
 err:
@@ -1,4 +1,7 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include "../include/raft.h"
 #include "../include/raft/io_uv.h"
@@ -14,12 +17,10 @@ static int tcp_init(struct raft_io_uv_transport *transport,
                     const char *address)
 {
     struct io_uv__tcp *t;
-    int rv;
     t = transport->impl;
     t->id = id;
     t->address = address;
-    rv = uv_tcp_init(t->loop, &t->listener);
-    assert(rv == 0);
+    io_uv__tcp_handle_init(t, &t->listener);
     return 0;
 }
 
@@ -43,8 +44,107 @@ static void tcp_close(struct raft_io_uv_transport *transport,
     uv_close((struct uv_handle_s *)&t->listener, listener_close_cb);
 }
 
-int raft_io_uv_tcp_init(struct raft_io_uv_transport *transport,
-                        struct uv_loop_s *loop)
+void io_uv__tcp_handle_init(struct io_uv__tcp *t,
+                            union io_uv__tcp_handle *handle)
+{
+    int rv;
+    if (t->family == AF_UNIX) {
+        rv = uv_pipe_init(t->loop, &handle->pipe, 0);
+    } else {
+        rv = uv_tcp_init(t->loop, &handle->tcp);
+    }
+    assert(rv == 0); /* This should never fail */
+}
+
+/* Set an integer socket option on the file descriptor of the given handle. */
+static int set_sockopt(union io_uv__tcp_handle *handle,
+                       int level,
+                       int name,
+                       int value)
+{
+    uv_os_fd_t fd;
+    int rv;
+    rv = uv_fileno((struct uv_handle_s *)handle, &fd);
+    if (rv != 0) {
+        return rv;
+    }
+    rv = setsockopt(fd, level, name, &value, sizeof value);
+    if (rv != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int io_uv__tcp_setup(struct io_uv__tcp *t, union io_uv__tcp_handle *handle)
+{
+    const struct raft_io_uv_tcp_options *o = &t->options;
+    int value;
+    int rv;
+
+    if (o->send_buffer_size > 0) {
+        value = o->send_buffer_size;
+        rv = uv_send_buffer_size((struct uv_handle_s *)handle, &value);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+    if (o->recv_buffer_size > 0) {
+        value = o->recv_buffer_size;
+        rv = uv_recv_buffer_size((struct uv_handle_s *)handle, &value);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+    if (t->family == AF_UNIX) {
+        return 0;
+    }
+    if (o->no_delay) {
+        rv = uv_tcp_nodelay(&handle->tcp, 1);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+    if (o->keepalive > 0) {
+        rv = uv_tcp_keepalive(&handle->tcp, 1, o->keepalive);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+#if defined(TCP_USER_TIMEOUT)
+    if (o->user_timeout > 0) {
+        rv = set_sockopt(handle, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                         (int)o->user_timeout);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+#endif
+#if defined(SO_BUSY_POLL)
+    if (o->busy_poll > 0) {
+        rv = set_sockopt(handle, SOL_SOCKET, SO_BUSY_POLL, (int)o->busy_poll);
+        if (rv != 0) {
+            goto err;
+        }
+    }
+#endif
+
+    return 0;
+
+err:
+    return RAFT_ERR_IO;
+}
+
+/* Implementation of raft_io_uv_transport->advertise. */
+static void tcp_advertise(struct raft_io_uv_transport *transport,
+                          unsigned long long features)
+{
+    struct io_uv__tcp *t = transport->impl;
+    t->features = features;
+}
+
+static int init(struct raft_io_uv_transport *transport,
+                struct uv_loop_s *loop,
+                int family)
 {
     struct io_uv__tcp *t;
 
@@ -55,20 +155,57 @@ int raft_io_uv_tcp_init(struct raft_io_uv_transport *transport,
     }
     t->transport = transport;
     t->loop = loop;
+    t->family = family;
     t->id = 0;
     t->address = NULL;
-    t->listener.data = t;
+    ((struct uv_handle_s *)&t->listener)->data = t;
     t->accept_cb = NULL;
+    t->accept_features_cb = NULL;
+    t->features = 0;
     t->close_cb = NULL;
     RAFT__QUEUE_INIT(&t->accept_conns);
     RAFT__QUEUE_INIT(&t->connect_reqs);
+    memset(&t->options, 0, sizeof t->options);
 
     transport->impl = t;
     transport->init = tcp_init;
     transport->listen = io_uv__tcp_listen;
     transport->connect = io_uv__tcp_connect;
     transport->close = tcp_close;
+    transport->version = 2;
+    transport->advertise = tcp_advertise;
+    transport->listen_features = io_uv__tcp_listen_features;
+
+    return 0;
+}
 
+int raft_io_uv_tcp_init(struct raft_io_uv_transport *transport,
+                        struct uv_loop_s *loop)
+{
+    return init(transport, loop, AF_INET);
+}
+
+int raft_io_uv_unix_init(struct raft_io_uv_transport *transport,
+                         struct uv_loop_s *loop)
+{
+    return init(transport, loop, AF_UNIX);
+}
+
+int raft_io_uv_tcp_set_options(struct raft_io_uv_transport *transport,
+                               const struct raft_io_uv_tcp_options *options)
+{
+    struct io_uv__tcp *t = transport->impl;
+#if !defined(TCP_USER_TIMEOUT)
+    if (options->user_timeout > 0) {
+        return RAFT_EINVAL;
+    }
+#endif
+#if !defined(SO_BUSY_POLL)
+    if (options->busy_poll > 0) {
+        return RAFT_EINVAL;
+    }
+#endif
+    t->options = *options;
     return 0;
 }
 
@@ -6,27 +6,65 @@
 
 #include "queue.h"
 
-/* Protocol version. */
+/* Protocol version.
+ *
+ * The handshake sent on new connections consists of the protocol version, the
+ * ID of the connecting server and the length of the address buffer, as 64-bit
+ * words, followed by the address buffer. That buffer holds the server address,
+ * null-terminated and padded to 8 bytes, optionally followed by a 64-bit word
+ * with the features advertised by the server. Older listeners only read the
+ * address, so the protocol version stays the same. */
 #define TCP_TRANSPORT__HANDSHAKE_PROTOCOL 1
 
+/* Socket handle used by the transport, depending on its address family. */
+union io_uv__tcp_handle {
+    struct uv_tcp_s tcp;   /* AF_INET */
+    struct uv_pipe_s pipe; /* AF_UNIX */
+};
+
+/* Implementation of both the TCP and the Unix domain socket transports, which
+ * only differ in how sockets are created, bound and connected. Addresses of
+ * Unix domain socket transports are file system paths. */
 struct io_uv__tcp
 {
     struct raft_io_uv_transport *transport; /* Interface object we implement */
     struct uv_loop_s *loop;                 /* UV loop */
+    int family;                             /* AF_INET or AF_UNIX */
     unsigned id;                            /* ID of this raft server */
     const char *address;                    /* Address of this raft server */
-    struct uv_tcp_s listener;               /* Listening TCP socket handle */
+    union io_uv__tcp_handle listener;       /* Listening socket handle */
     raft_io_uv_accept_cb accept_cb;         /* After accepting a connection */
+    raft_io_uv_accept_features_cb accept_features_cb; /* Same, with features */
+    uint64_t features;                      /* Advertised in handshakes */
     raft_io_uv_transport_close_cb close_cb; /* When it's safe to free us */
     raft__queue accept_conns;               /* Connections being accepted */
     raft__queue connect_reqs;               /* Pending connection requests */
+    struct raft_io_uv_tcp_options options;  /* Socket options */
 };
 
+/**
+ * Initialize a socket handle of the kind used by the transport.
+ */
+void io_uv__tcp_handle_init(struct io_uv__tcp *t,
+                            union io_uv__tcp_handle *handle);
+
+/**
+ * Apply the socket options of the transport to the given handle, whose socket
+ * must be open. Options specific to TCP are ignored by Unix domain sockets.
+ */
+int io_uv__tcp_setup(struct io_uv__tcp *t, union io_uv__tcp_handle *handle);
+
 /**
  * Implementation of raft_io_uv_transport->listen.
  */
 int io_uv__tcp_listen(struct raft_io_uv_transport *t, raft_io_uv_accept_cb cb);
 
+/**
+ * Implementation of raft_io_uv_transport->listen_features.
+ */
+int io_uv__tcp_listen_features(struct raft_io_uv_transport *t,
+                               raft_io_uv_accept_features_cb cb);
+
 /**
  * Close the listener handle and all pending incoming connections being
  * accepted.
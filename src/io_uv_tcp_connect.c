@@ -11,7 +11,8 @@
  *
  * - Create a TCP handle and submit a connect request.
  *
- * - Once connected, submit a write request for the handshake.
+ * - Once connected, apply the socket options of the transport and submit a
+ *   write request for the handshake.
  *
  * - Once the write completes, fire the request callback.
  *
@@ -35,19 +36,27 @@ struct connect
     struct io_uv__tcp *t;           /* Transport implementation */
     struct raft_io_uv_connect *req; /* User request */
     uv_buf_t handshake;             /* Handshake data */
-    struct uv_tcp_s *tcp;           /* TCP connection socket handle */
+    union io_uv__tcp_handle *tcp;   /* Connection socket handle */
     struct uv_connect_s connect;    /* TCP connectionr request */
     struct uv_write_s write;        /* TCP handshake request */
     int status;                     /* Returned to the request callback */
     raft__queue queue;              /* Pending connect queue */
 };
 
-/* Encode an handshake message into the given buffer. */
-static int encode_handshake(unsigned id, const char *address, uv_buf_t *buf)
+/* Encode an handshake message into the given buffer. The features word is
+ * appended to the address buffer only if there's something to advertise. */
+static int encode_handshake(unsigned id,
+                            const char *address,
+                            uint64_t features,
+                            uv_buf_t *buf)
 {
     void *cursor;
     size_t address_len = byte__pad64(strlen(address) + 1);
 
+    if (features != 0) {
+        address_len += sizeof(uint64_t);
+    }
+
     buf->len = sizeof(uint64_t) + /* Protocol version. */
                sizeof(uint64_t) + /* Server ID. */
                sizeof(uint64_t) /* Size of the address buffer */;
@@ -62,8 +71,14 @@ static int encode_handshake(unsigned id, const char *address, uv_buf_t *buf)
     byte__put64(&cursor, TCP_TRANSPORT__HANDSHAKE_PROTOCOL);
     byte__put64(&cursor, id);
     byte__put64(&cursor, address_len);
+    memset(cursor, 0, address_len);
     strcpy(cursor, address);
 
+    if (features != 0) {
+        cursor = (uint8_t *)cursor + byte__pad64(strlen(address) + 1);
+        byte__put64(&cursor, features);
+    }
+
     return 0;
 }
 
@@ -75,7 +90,7 @@ static void close_cb(struct uv_handle_s *handle)
     /* We must be careful to not reference the r->t field of the connect request
      * object, since that io_uv__tcp object might have been released in the
      * meantime. */
-    assert((struct uv_tcp_s *)handle == r->tcp);
+    assert((union io_uv__tcp_handle *)handle == r->tcp);
     assert(r->status != 0);
 
     r->req->cb(r->req, NULL, r->status);
@@ -135,8 +150,14 @@ static void connect_cb(struct uv_connect_s *connect, int status)
         goto err;
     }
 
+    rv = io_uv__tcp_setup(r->t, r->tcp);
+    if (rv != 0) {
+        goto err;
+    }
+
     /* Initialize the handshake buffer and write it out. */
-    rv = encode_handshake(r->t->id, r->t->address, &r->handshake);
+    rv = encode_handshake(r->t->id, r->t->address, r->t->features,
+                          &r->handshake);
     if (rv != 0) {
         goto err;
     }
@@ -174,16 +195,23 @@ static int tcp_connect__start(struct connect *r, const char *address)
     }
     r->handshake.base = NULL;
 
-    rv = uv_tcp_init(r->t->loop, r->tcp);
-    assert(rv == 0);
-    r->tcp->data = r;
+    io_uv__tcp_handle_init(r->t, r->tcp);
+    ((struct uv_handle_s *)r->tcp)->data = r;
+    r->connect.data = r;
+
+    /* Errors of Unix domain socket connections are reported asynchronously
+     * by the connect callback. */
+    if (r->t->family == AF_UNIX) {
+        uv_pipe_connect(&r->connect, &r->tcp->pipe, address, connect_cb);
+        return 0;
+    }
 
     rv = raft__io_uv_ip_parse(address, &addr);
     if (rv != 0) {
         goto err_after_tcp_init;
     }
 
-    rv = uv_tcp_connect(&r->connect, r->tcp, (struct sockaddr *)&addr,
+    rv = uv_tcp_connect(&r->connect, &r->tcp->tcp, (struct sockaddr *)&addr,
                         connect_cb);
     if (rv != 0) {
         /* UNTESTED: since parsing succeed, this should fail only because of
@@ -191,7 +219,6 @@ static int tcp_connect__start(struct connect *r, const char *address)
         rv = RAFT_ERR_IO_CONNECT;
         goto err_after_tcp_init;
     }
-    r->connect.data = r;
 
     return 0;
 
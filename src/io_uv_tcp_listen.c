@@ -36,10 +36,10 @@ struct handshake
 /* Hold handshake data for a new connection being established. */
 struct conn
 {
-    struct io_uv__tcp *t;       /* Transport implementation */
-    struct uv_tcp_s *tcp;       /* TCP connection socket handle */
-    struct handshake handshake; /* Handshake data */
-    raft__queue queue;          /* Pending accept queue */
+    struct io_uv__tcp *t;         /* Transport implementation */
+    union io_uv__tcp_handle *tcp; /* Connection socket handle */
+    struct handshake handshake;   /* Handshake data */
+    raft__queue queue;            /* Pending accept queue */
 };
 
 /* Read the preamble of the handshake. */
@@ -97,6 +97,27 @@ static void conn_stop(struct conn *c)
     uv_close((struct uv_handle_s *)c->tcp, close_cb);
 }
 
+/* Decode the address buffer of the handshake, which must contain a
+ * null-terminated address, possibly followed by the features word. */
+static int decode_address(struct handshake *h, uint64_t *features)
+{
+    const void *cursor;
+    size_t len;
+
+    if (memchr(h->address.base, 0, h->address.len) == NULL) {
+        return RAFT_ERR_IO_MALFORMED;
+    }
+    len = byte__pad64(strlen(h->address.base) + 1);
+
+    *features = 0;
+    if (h->address.len >= len + sizeof(uint64_t)) {
+        cursor = (const uint8_t *)h->address.base + len;
+        *features = byte__get64(&cursor);
+    }
+
+    return 0;
+}
+
 /* Read the address part of the handshake. */
 static void address_alloc_cb(struct uv_handle_s *handle,
                              size_t suggested_size,
@@ -115,6 +136,7 @@ static void address_read_cb(uv_stream_t *stream,
     struct conn *c = stream->data;
     char *address;
     unsigned id;
+    uint64_t features;
     size_t n;
     int rv;
 
@@ -143,12 +165,23 @@ static void address_read_cb(uv_stream_t *stream,
     }
 
     /* If we have completed reading the address, let's fire the callback. */
+    rv = decode_address(&c->handshake, &features);
+    if (rv != 0) {
+        conn_stop(c);
+        return;
+    }
     rv = uv_read_stop(stream);
     assert(rv == 0);
     id = byte__flip64(c->handshake.preamble[1]);
     address = c->handshake.address.base;
     RAFT__QUEUE_REMOVE(&c->queue);
-    c->t->accept_cb(c->t->transport, id, address, (struct uv_stream_s *)c->tcp);
+    if (c->t->accept_features_cb != NULL) {
+        c->t->accept_features_cb(c->t->transport, id, address, features,
+                                 (struct uv_stream_s *)c->tcp);
+    } else {
+        c->t->accept_cb(c->t->transport, id, address,
+                        (struct uv_stream_s *)c->tcp);
+    }
     raft_free(c->handshake.address.base);
     raft_free(c);
 }
@@ -210,9 +243,8 @@ static int conn_start_handshake(struct conn *c)
     if (c->tcp == NULL) {
         return RAFT_ENOMEM;
     }
-    c->tcp->data = c;
-    rv = uv_tcp_init(c->t->loop, c->tcp);
-    assert(rv == 0);
+    io_uv__tcp_handle_init(c->t, c->tcp);
+    ((struct uv_handle_s *)c->tcp)->data = c;
 
     rv = uv_accept((struct uv_stream_s *)&c->t->listener,
                    (struct uv_stream_s *)c->tcp);
@@ -221,6 +253,11 @@ static int conn_start_handshake(struct conn *c)
         goto err_after_client_init;
     }
 
+    rv = io_uv__tcp_setup(c->t, c->tcp);
+    if (rv != 0) {
+        goto err_after_client_init;
+    }
+
     rv = uv_read_start((uv_stream_t *)c->tcp, preamble_alloc_cb,
                        preamble_read_cb);
     assert(rv == 0);
@@ -271,25 +308,31 @@ err:
     assert(rv != 0);
 }
 
-int io_uv__tcp_listen(struct raft_io_uv_transport *transport,
-                      raft_io_uv_accept_cb cb)
+/* Bind the listener socket and start accepting connections. */
+static int tcp_listen_start(struct io_uv__tcp *t)
 {
-    struct io_uv__tcp *t;
     struct sockaddr_in addr;
     int rv;
 
-    t = transport->impl;
-    t->accept_cb = cb;
-
-    rv = raft__io_uv_ip_parse(t->address, &addr);
-    if (rv != 0) {
-        return rv;
+    if (t->family == AF_UNIX) {
+        rv = uv_pipe_bind(&t->listener.pipe, t->address);
+    } else {
+        rv = raft__io_uv_ip_parse(t->address, &addr);
+        if (rv != 0) {
+            return rv;
+        }
+        rv = uv_tcp_bind(&t->listener.tcp, (const struct sockaddr *)&addr, 0);
     }
-    rv = uv_tcp_bind(&t->listener, (const struct sockaddr *)&addr, 0);
     if (rv != 0) {
         /* UNTESTED: what are the error conditions? */
         return RAFT_ERR_IO;
     }
+    /* Accepted connections inherit the buffer sizes of the listening socket,
+     * which only affect the TCP window if set before they are established. */
+    rv = io_uv__tcp_setup(t, &t->listener);
+    if (rv != 0) {
+        return rv;
+    }
     rv = uv_listen((uv_stream_t *)&t->listener, 1, listen_cb);
     if (rv != 0) {
         /* UNTESTED: what are the error conditions? */
@@ -299,6 +342,24 @@ int io_uv__tcp_listen(struct raft_io_uv_transport *transport,
     return 0;
 }
 
+int io_uv__tcp_listen(struct raft_io_uv_transport *transport,
+                      raft_io_uv_accept_cb cb)
+{
+    struct io_uv__tcp *t = transport->impl;
+    t->accept_cb = cb;
+    t->accept_features_cb = NULL;
+    return tcp_listen_start(t);
+}
+
+int io_uv__tcp_listen_features(struct raft_io_uv_transport *transport,
+                               raft_io_uv_accept_features_cb cb)
+{
+    struct io_uv__tcp *t = transport->impl;
+    t->accept_cb = NULL;
+    t->accept_features_cb = cb;
+    return tcp_listen_start(t);
+}
+
 void io_uv__tcp_listen_stop(struct io_uv__tcp *t)
 {
     /* Abort all connections currently being accepted */
@@ -1,4 +1,8 @@
+#include <dirent.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "assert.h"
@@ -8,164 +12,493 @@
 #include "io_uv_load.h"
 #include "logging.h"
 
+/* Template string for the journal files of closed segment truncations: first
+ * index and new last index of the segment being truncated. */
+#define JOURNAL_PREFIX "truncate-"
+#define JOURNAL_TEMPLATE JOURNAL_PREFIX "%llu-%llu"
+
+/* Size of the header of a journal file. */
+#define JOURNAL_HEADER_SIZE (sizeof(uint64_t) * 4)
+
+/* A closed segment is truncated in place by cutting it at the offset of the
+ * batch holding the truncation index and then appending a tail, made of the
+ * entries of that batch that are kept (if any) and a new index footer. Finally
+ * the segment is renamed to reflect its new last index. Since this modifies a
+ * closed segment, truncations never run concurrently with reads.
+ *
+ * To make this atomic, the tail is first saved in a journal file with the
+ * following layout, which is replayed at startup if the truncation was
+ * interrupted:
+ *
+ * [8 bytes] Last index of the segment before the truncation, little endian.
+ * [8 bytes] Offset at which the segment gets truncated, little endian.
+ * [8 bytes] Size of the tail, little endian.
+ * [8 bytes] CRC32C checksum of the header fields above and of the tail.
+ * [  ...  ] Tail data. */
+struct journal
+{
+    raft_index first_index; /* First index of the segment */
+    raft_index end_index;   /* Last index of the segment before truncation */
+    raft_index last_index;  /* Last index of the segment after truncation */
+    uint64_t offset;        /* Where to cut the segment */
+    struct raft_buffer tail;
+};
+
 struct truncate
 {
     struct io_uv *uv;
     raft_index index;
+    bool apply;             /* Whether the journal must be applied */
+    struct journal journal; /* Journal of the segment to cut, if any */
     int status;
     raft__queue queue;
 };
 
-/* Truncate a segment that was already closed. */
-static int truncate_closed_segment(struct io_uv *uv,
-                                   struct io_uv__segment_meta *segment,
-                                   raft_index index)
+static unsigned journal_checksum(const void *header,
+                                 const struct raft_buffer *tail)
+{
+    unsigned crc;
+    crc = byte__crc32c(header, sizeof(uint64_t) * 3, 0);
+    return byte__crc32c(tail->base, tail->len, crc);
+}
+
+/* Write and sync the journal file of a truncation. */
+static int journal_write(struct io_uv *uv, struct journal *j)
 {
     io_uv__filename filename;
-    struct raft_entry *entries;
-    struct raft_buffer buf;
-    void *cursor;
-    void *header;
-    unsigned crc1; /* Header checksum */
-    unsigned crc2; /* Data checksum */
-    void *crc1_p;  /* Pointer to header checksum slot */
-    void *crc2_p;  /* Pointer to data checksum slot */
-    void *batch;
-    size_t n;
-    size_t m;
-    size_t i;
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    void *cursor = header;
+    struct iovec iov[2];
+    ssize_t written;
     int fd;
-    int rv = 0;
+    int rv;
 
-    infof(uv->io, "truncate %u-%u at %u", segment->first_index,
-          segment->end_index, index);
+    sprintf(filename, JOURNAL_TEMPLATE, j->first_index, j->last_index);
+
+    byte__put64(&cursor, j->end_index);
+    byte__put64(&cursor, j->offset);
+    byte__put64(&cursor, j->tail.len);
+    byte__put64(&cursor, journal_checksum(header, &j->tail));
 
-    rv = io_uv__load_closed(uv, segment, &entries, &n);
+    /* A journal left behind by a previous attempt is stale. */
+    fd = raft__io_uv_fs_open(uv->dir, filename, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1) {
+        errorf(uv->io, "open %s: %s", filename, strerror(errno));
+        return RAFT_ERR_IO;
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = j->tail.base;
+    iov[1].iov_len = j->tail.len;
+
+    written = writev(fd, iov, 2);
+    if (written != (ssize_t)(sizeof header + j->tail.len)) {
+        errorf(uv->io, "write %s: %s", filename,
+               written == -1 ? strerror(errno) : "short write");
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
+    if (fsync(fd) == -1) {
+        errorf(uv->io, "fsync %s: %s", filename, strerror(errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+
+    close(fd);
+
+    rv = raft__io_uv_fs_sync_dir(uv->dir);
     if (rv != 0) {
-        goto out;
+        errorf(uv->io, "sync data directory: %s", uv_strerror(rv));
+        return RAFT_ERR_IO;
     }
 
-    /* Discard all entries after the truncate index (included) */
-    assert(index - segment->first_index < n);
-    m = index - segment->first_index;
+    return 0;
+
+err_after_open:
+    close(fd);
+    return rv;
+}
+
+/* Read the journal file with the given name. Return RAFT_ERR_IO_CORRUPT if the
+ * journal is incomplete, which means the segment was not touched yet. */
+static int journal_read(struct io_uv *uv,
+                        const char *filename,
+                        struct journal *j)
+{
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    const void *cursor = header;
+    struct stat sb;
+    char suffix;
+    int fd;
+    int rv;
 
-    /* Render the path.
-     *
-     * TODO: we should use a temporary file name so in case of crash we don't
-     *      consider this segment as corrupted.
-     */
-    sprintf(filename, "%llu-%llu", segment->first_index, index - 1);
+    if (sscanf(filename, JOURNAL_TEMPLATE "%c", &j->first_index,
+               &j->last_index, &suffix) != 2) {
+        return RAFT_ERR_IO_CORRUPT;
+    }
 
-    /* Open the file. */
-    fd = raft__io_uv_fs_open(uv->dir, filename, O_WRONLY | O_CREAT | O_EXCL);
+    fd = raft__io_uv_fs_open(uv->dir, filename, O_RDONLY);
     if (fd == -1) {
         errorf(uv->io, "open %s: %s", filename, strerror(errno));
-        goto out_after_load;
+        return RAFT_ERR_IO;
     }
 
-    buf.len = sizeof(uint64_t) +     /* Format version */
-              sizeof(uint32_t) * 2 + /* CRC checksum */
-              io_uv__sizeof_batch_header(m) /* Batch header */;
-    buf.base = raft_malloc(buf.len);
+    if (fstat(fd, &sb) == -1) {
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
+    if ((size_t)sb.st_size < sizeof header) {
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err_after_open;
+    }
 
-    if (buf.base == NULL) {
-        rv = RAFT_ENOMEM;
-        goto out_after_open;
+    rv = raft__io_uv_fs_read_n(fd, header, sizeof header);
+    if (rv != 0) {
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
     }
 
-    cursor = buf.base;
+    j->end_index = byte__get64(&cursor);
+    j->offset = byte__get64(&cursor);
+    j->tail.len = byte__get64(&cursor);
 
-    byte__put64(&cursor, IO_UV__DISK_FORMAT); /* Format version */
+    if (j->tail.len != (size_t)sb.st_size - sizeof header ||
+        j->end_index <= j->last_index || j->last_index < j->first_index) {
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err_after_open;
+    }
 
-    crc1_p = cursor;
-    byte__put32(&cursor, 0);
+    j->tail.base = raft_malloc(j->tail.len);
+    if (j->tail.base == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_open;
+    }
 
-    crc2_p = cursor;
-    byte__put32(&cursor, 0);
+    rv = raft__io_uv_fs_read_n(fd, j->tail.base, j->tail.len);
+    if (rv != 0) {
+        rv = RAFT_ERR_IO;
+        goto err_after_alloc;
+    }
 
-    header = cursor;
+    if ((unsigned)byte__get64(&cursor) != journal_checksum(header, &j->tail)) {
+        rv = RAFT_ERR_IO_CORRUPT;
+        goto err_after_alloc;
+    }
 
-    byte__put64(&cursor, m); /* Number of entries */
+    close(fd);
 
-    crc2 = 0;
+    return 0;
 
-    for (i = 0; i < m; i++) {
-        struct raft_entry *entry = &entries[i];
+err_after_alloc:
+    raft_free(j->tail.base);
 
-        byte__put64(&cursor, entry->term);    /* Entry term */
-        byte__put8(&cursor, entry->type);     /* Entry type */
-        byte__put8(&cursor, 0);               /* Unused */
-        byte__put8(&cursor, 0);               /* Unused */
-        byte__put8(&cursor, 0);               /* Unused */
-        byte__put32(&cursor, entry->buf.len); /* Size of entry data */
+err_after_open:
+    close(fd);
 
-        crc2 = byte__crc32(entry->buf.base, entry->buf.len, crc2);
-    }
+    return rv;
+}
 
-    crc1 = byte__crc32(header, io_uv__sizeof_batch_header(m), 0);
+/* Cut the segment described by the given journal, append the tail, rename it
+ * and finally remove the journal. This can be run again if interrupted. */
+static int journal_apply(struct io_uv *uv, const struct journal *j)
+{
+    io_uv__filename journal;
+    io_uv__filename filename1;
+    io_uv__filename filename2;
+    ssize_t written;
+    int fd;
+    int rv;
 
-    byte__put32(&crc1_p, crc1);
-    byte__put32(&crc2_p, crc2);
+    sprintf(journal, JOURNAL_TEMPLATE, j->first_index, j->last_index);
+    sprintf(filename1, "%llu-%llu", j->first_index, j->end_index);
+    sprintf(filename2, "%llu-%llu", j->first_index, j->last_index);
 
-    rv = write(fd, buf.base, buf.len);
+    fd = raft__io_uv_fs_open(uv->dir, filename1, O_RDWR);
+    if (fd == -1) {
+        /* If the segment is gone, it must have been renamed already. */
+        if (errno == ENOENT) {
+            goto out;
+        }
+        errorf(uv->io, "open %s: %s", filename1, strerror(errno));
+        return RAFT_ERR_IO;
+    }
 
-    raft_free(buf.base);
+    if (ftruncate(fd, j->offset) == -1) {
+        errorf(uv->io, "truncate %s: %s", filename1, strerror(errno));
+        rv = RAFT_ERR_IO;
+        goto err_after_open;
+    }
 
-    if (rv == -1) {
-        errorf(uv->io, "write %s: %s", filename, strerror(errno));
+    written = pwrite(fd, j->tail.base, j->tail.len, j->offset);
+    if (written != (ssize_t)j->tail.len) {
+        errorf(uv->io, "write %s: %s", filename1,
+               written == -1 ? strerror(errno) : "short write");
         rv = RAFT_ERR_IO;
-        goto out_after_open;
+        goto err_after_open;
     }
-    if (rv != (int)buf.len) {
-        errorf(uv->io, "write %s: only %d bytes written", filename, rv);
+
+    if (fsync(fd) == -1) {
+        errorf(uv->io, "fsync %s: %s", filename1, strerror(errno));
         rv = RAFT_ERR_IO;
-        goto out_after_open;
+        goto err_after_open;
+    }
+
+    close(fd);
+
+    rv = raft__io_uv_fs_rename(uv->dir, filename1, filename2);
+    if (rv != 0) {
+        errorf(uv->io, "rename %s: %s", filename1, uv_strerror(rv));
+        return RAFT_ERR_IO;
+    }
+
+out:
+    rv = raft__io_uv_fs_unlink(uv->dir, journal);
+    if (rv != 0) {
+        errorf(uv->io, "unlink %s: %s", journal, uv_strerror(rv));
+        return RAFT_ERR_IO;
     }
 
-    for (i = 0; i < m; i++) {
-        struct raft_entry *entry = &entries[i];
+    return 0;
 
-        rv = write(fd, entry->buf.base, entry->buf.len);
-        if (rv == -1) {
-            errorf(uv->io, "write %s: %s", filename, strerror(errno));
-            rv = RAFT_ERR_IO;
-            goto out_after_open;
+err_after_open:
+    close(fd);
+    return rv;
+}
+
+/* Render the tail to append to a closed segment cut at batch @k, which holds
+ * the truncation index: the entries of the batch preceding that index, if
+ * any, followed by a footer for the remaining batches. */
+static int encode_tail(struct io_uv *uv,
+                       int fd,
+                       uint64_t format,
+                       struct io_uv__batch_offset *batches,
+                       unsigned k,
+                       raft_index index,
+                       struct raft_buffer *tail)
+{
+    struct raft_entry *entries = NULL;
+    unsigned n_entries;
+    unsigned m = (unsigned)(index - batches[k].index); /* Entries kept */
+    unsigned n_batches = m > 0 ? k + 1 : k;
+    size_t batch_len = 0;
+    void *cursor;
+    void *header;
+    unsigned crc1; /* Header checksum */
+    unsigned crc2; /* Data checksum */
+    unsigned i;
+    int rv;
+
+    assert(n_batches > 0);
+
+    if (m > 0) {
+        rv = io_uv__load_batch(uv, fd, format, batches[k].offset, &entries,
+                               &n_entries);
+        if (rv != 0) {
+            return rv;
         }
-        if (rv != (int)entry->buf.len) {
-            errorf(uv->io, "write %s: only %d bytes written", filename, rv);
-            rv = RAFT_ERR_IO;
-            goto out_after_open;
+        assert(m < n_entries);
+        batch_len = sizeof(uint32_t) * 2 +
+                    io_uv__sizeof_segment_batch_header(format, entries, m) +
+                    io_uv__sizeof_batch_checksums(format, m);
+        for (i = 0; i < m; i++) {
+            batch_len += entries[i].buf.len;
         }
     }
 
-    rv = fsync(fd);
-    if (rv == -1) {
-        errorf(uv->io, "fsync %s: %s", filename, strerror(errno));
+    tail->len = batch_len + io_uv__sizeof_footer(n_batches);
+    tail->base = raft_malloc(tail->len);
+    if (tail->base == NULL) {
+        rv = RAFT_ENOMEM;
+        goto out;
+    }
+    memset(tail->base, 0, tail->len);
+    cursor = tail->base;
+
+    if (m > 0) {
+        void *crc_p = cursor;
+        void *sums;
+        size_t header_len;
+
+        cursor += sizeof(uint32_t) * 2; /* Checksums */
+        header = cursor;
+        io_uv__encode_segment_batch_header(format, entries, m, header);
+        cursor += io_uv__sizeof_segment_batch_header(format, entries, m);
+
+        /* Per-entry checksums, if the format has them, replace the data
+         * one. */
+        sums = cursor;
+        cursor += io_uv__sizeof_batch_checksums(format, m);
+        header_len = cursor - header;
+
+        crc2 = 0;
+        for (i = 0; i < m; i++) {
+            const struct raft_buffer *buf = &entries[i].buf;
+            memcpy(cursor, buf->base, buf->len);
+            if (io_uv__format_has_entry_checksums(format)) {
+                crc1 = io_uv__checksum(format, cursor, buf->len, 0);
+                byte__put32(&sums, crc1);
+            } else {
+                crc2 = io_uv__checksum(format, cursor, buf->len, crc2);
+            }
+            cursor += buf->len;
+        }
+        crc1 = io_uv__checksum(format, header, header_len, 0);
+
+        byte__put32(&crc_p, crc1);
+        byte__put32(&crc_p, crc2);
+    }
+
+    io_uv__encode_footer(batches, n_batches, cursor);
+
+    rv = 0;
+
+out:
+    if (entries != NULL) {
+        raft_free(entries[0].batch);
+        raft_free(entries);
+    }
+    return rv;
+}
+
+/* Write the journal for truncating a segment that was already closed. Once
+ * this returns, the truncation will happen even in case of a crash. */
+static int journal_closed_segment(struct io_uv *uv,
+                                  struct io_uv__segment_meta *segment,
+                                  raft_index index,
+                                  struct journal *journal)
+{
+    struct io_uv__batch_offset *batches;
+    unsigned n_batches;
+    struct journal j;
+    struct stat sb;
+    uint64_t format;
+    size_t end;
+    unsigned k;
+    int fd;
+    int rv;
+
+    infof(uv->io, "truncate %u-%u at %u", segment->first_index,
+          segment->end_index, index);
+
+    fd = raft__io_uv_fs_open(uv->dir, segment->filename, O_RDONLY);
+    if (fd == -1) {
+        errorf(uv->io, "open %s: %s", segment->filename, strerror(errno));
+        return RAFT_ERR_IO;
+    }
+
+    rv = raft__io_uv_fs_read_n(fd, &format, sizeof format);
+    if (rv != 0 || fstat(fd, &sb) == -1) {
         rv = RAFT_ERR_IO;
         goto out_after_open;
     }
+    format = byte__flip64(format);
+
+    rv = io_uv__load_batch_index(uv, segment, fd, (size_t)sb.st_size,
+                                 &batches, &n_batches, &end);
+    if (rv != 0) {
+        goto out_after_open;
+    }
+
+    /* Find the batch holding the truncation index. */
+    for (k = n_batches - 1; batches[k].index > index; k--) {
+        assert(k > 0);
+    }
+
+    j.first_index = segment->first_index;
+    j.end_index = segment->end_index;
+    j.last_index = index - 1;
+    j.offset = batches[k].offset;
+
+    rv = encode_tail(uv, fd, format, batches, k, index, &j.tail);
+    raft_free(batches);
+    if (rv != 0) {
+        goto out_after_open;
+    }
+
+    close(fd);
+
+    rv = journal_write(uv, &j);
+    if (rv != 0) {
+        raft_free(j.tail.base);
+        return rv;
+    }
+
+    *journal = j;
+
+    return 0;
 
 out_after_open:
     close(fd);
+    return rv;
+}
+
+int io_uv__truncate_recover(struct io_uv *uv)
+{
+    struct dirent **dirents;
+    int n_dirents;
+    int i;
+    int rv = 0;
+
+    n_dirents = scandir(uv->dir, &dirents, NULL, alphasort);
+    if (n_dirents < 0) {
+        errorf(uv->io, "scan data directory: %s", strerror(errno));
+        return RAFT_ERR_IO;
+    }
 
-out_after_load:
-    batch = NULL;
-    for (i = 0; i < n; i++) {
-        struct raft_entry *entry = &entries[i];
-        if (entry->batch != batch) {
-            raft_free(entry->batch);
-            batch = entry->batch;
+    for (i = 0; i < n_dirents; i++) {
+        const char *filename = dirents[i]->d_name;
+        struct journal j;
+
+        if (rv != 0 || strncmp(filename, JOURNAL_PREFIX,
+                               strlen(JOURNAL_PREFIX)) != 0) {
+            goto next;
+        }
+
+        rv = journal_read(uv, filename, &j);
+        if (rv == RAFT_ERR_IO_CORRUPT) {
+            /* The journal was not completely written, so the segment is still
+             * intact. */
+            warnf(uv->io, "discard incomplete journal %s", filename);
+            rv = raft__io_uv_fs_unlink(uv->dir, filename);
+            if (rv != 0) {
+                rv = RAFT_ERR_IO;
+            }
+            goto next;
+        }
+        if (rv != 0) {
+            goto next;
         }
+
+        infof(uv->io, "resume truncation of %llu-%llu", j.first_index,
+              j.end_index);
+        rv = journal_apply(uv, &j);
+        raft_free(j.tail.base);
+
+    next:
+        free(dirents[i]);
     }
+    free(dirents);
 
-    raft_free(entries);
+    if (rv != 0) {
+        return rv;
+    }
 
-out:
-    return rv;
+    rv = raft__io_uv_fs_sync_dir(uv->dir);
+    if (rv != 0) {
+        errorf(uv->io, "sync data directory: %s", uv_strerror(rv));
+        return RAFT_ERR_IO;
+    }
+
+    return 0;
 }
 
-/* Execute a truncate request in a thread. */
-static void work_cb(uv_work_t *work)
+/* Execute the first phase of a truncate request in a thread, removing all
+ * segments past the truncation point and writing the journal of the segment
+ * holding it. After this phase new entries can be appended, while the journal
+ * gets applied in the background. */
+static void work_cb(struct io_uv__work *work)
 {
     struct truncate *r = work->data;
     struct io_uv *uv = r->uv;
@@ -206,16 +539,9 @@ static void work_cb(uv_work_t *work)
         goto out;
     }
 
-    /* If the truncate index is not the first of the segment, we need to
-     * truncate it. */
-    if (r->index > segment->first_index) {
-        rv = truncate_closed_segment(uv, segment, r->index);
-        if (rv != 0) {
-            goto err_after_list;
-        }
-    }
-
-    for (j = i; j < n_segments; j++) {
+    /* Remove the segments past the one holding the truncation point first, so
+     * that if we crash midway the log is still a consistent prefix. */
+    for (j = i + 1; j < n_segments; j++) {
         segment = &segments[j];
 
         if (segment->is_open) {
@@ -231,6 +557,25 @@ static void work_cb(uv_work_t *work)
         }
     }
 
+    /* If the truncate index is not the first of the segment, we need to
+     * truncate it, otherwise it can be removed as well. */
+    segment = &segments[i];
+    if (r->index > segment->first_index) {
+        rv = journal_closed_segment(uv, segment, r->index, &r->journal);
+        if (rv != 0) {
+            goto err_after_list;
+        }
+        r->apply = true;
+    } else {
+        rv = raft__io_uv_fs_unlink(uv->dir, segment->filename);
+        if (rv != 0) {
+            errorf(uv->io, "unlink segment %s: %s", segment->filename,
+                   uv_strerror(rv));
+            rv = RAFT_ERR_IO;
+            goto err_after_list;
+        }
+    }
+
     rv = raft__io_uv_fs_sync_dir(uv->dir);
     if (rv != 0) {
         errorf(uv->io, "sync data directory: %s", uv_strerror(rv));
@@ -256,7 +601,42 @@ err:
     r->status = rv;
 }
 
-static void after_work_cb(uv_work_t *work, int status)
+/* Process pending truncate requests. */
+static void process_requests(struct io_uv *uv);
+
+/* Execute the second phase of a truncate request in a thread. */
+static void apply_work_cb(struct io_uv__work *work)
+{
+    struct truncate *r = work->data;
+    struct io_uv *uv = r->uv;
+
+    r->status = journal_apply(uv, &r->journal);
+}
+
+static void apply_after_work_cb(struct io_uv__work *work, int status)
+{
+    struct truncate *r = work->data;
+    struct io_uv *uv = r->uv;
+
+    assert(status == 0);
+
+    if (r->status != 0) {
+        uv->errored = true;
+    }
+
+    raft_free(r->journal.tail.base);
+
+    uv->truncate_work.data = NULL;
+    raft_free(r);
+
+    io_uv__snapshot_put_unblock(uv);
+    process_requests(uv);
+    io_uv__read_unblock(uv);
+    io_uv__compact_unblock(uv);
+    io_uv__maybe_close(uv);
+}
+
+static void after_work_cb(struct io_uv__work *work, int status)
 {
     struct truncate *r = work->data;
     struct io_uv *uv = r->uv;
@@ -271,12 +651,30 @@ static void after_work_cb(uv_work_t *work, int status)
      * one (i.e. the index of the last entry we truncated), since the next
      * segment to be finalized should start at the truncation index. */
     uv->finalize_last_index = r->index - 1;
+    if (uv->finalize_done_index >= r->index) {
+        uv->finalize_done_index = r->index - 1;
+    }
+
+    /* The truncation is durable, new entries can be written. */
+    uv->truncate_blocking = false;
+    io_uv__append_unblock(uv);
+
+    if (r->status == 0 && r->apply) {
+        io_uv__queue_work(uv, &uv->truncate_work, apply_work_cb,
+                          apply_after_work_cb);
+        return;
+    }
+    if (r->apply) {
+        raft_free(r->journal.tail.base);
+    }
 
     uv->truncate_work.data = NULL;
     raft_free(r);
 
-    io_uv__append_unblock(uv);
     io_uv__snapshot_put_unblock(uv);
+    process_requests(uv);
+    io_uv__read_unblock(uv);
+    io_uv__compact_unblock(uv);
     io_uv__maybe_close(uv);
 }
 
@@ -284,17 +682,12 @@ static void after_work_cb(uv_work_t *work, int status)
 static int truncate_start(struct truncate *r)
 {
     struct io_uv *uv = r->uv;
-    int rv;
 
     assert(uv->truncate_work.data == NULL);
     uv->truncate_work.data = r;
+    uv->truncate_blocking = true;
 
-    rv = uv_queue_work(uv->loop, &uv->truncate_work, work_cb, after_work_cb);
-    if (rv != 0) {
-        errorf(uv->io, "start to truncate log at index %lld: %s", r->index,
-               uv_strerror(rv));
-        return RAFT_ERR_IO;
-    }
+    io_uv__queue_work(uv, &uv->truncate_work, work_cb, after_work_cb);
 
     return 0;
 }
@@ -311,11 +704,23 @@ static void process_requests(struct io_uv *uv)
         return;
     }
 
+    /* If the previous truncate request is still being executed, or obsolete
+     * segments are being removed, let's wait. */
+    if (uv->truncate_work.data != NULL || uv->compact_work.data != NULL) {
+        return;
+    }
+
     /* If there are pending writes in progress, let's wait. */
     if (!RAFT__QUEUE_IS_EMPTY(&uv->append_writing_reqs)) {
         return;
     }
 
+    /* Same for reads, which might be parsing the segment we are going to cut.
+     * New reads wait for the truncation to complete. */
+    if (!RAFT__QUEUE_IS_EMPTY(&uv->read_reqs)) {
+        return;
+    }
+
     /* If there are segments being closed, let's wait. */
     if (!RAFT__QUEUE_IS_EMPTY(&uv->finalize_reqs) ||
         uv->finalize_work.data != NULL) {
@@ -353,6 +758,7 @@ int io_uv__truncate(struct raft_io *io, raft_index index)
     }
     req->uv = uv;
     req->index = index;
+    req->apply = false;
 
     /* The next entry will be appended at the truncation index. */
     uv->append_next_index = index;
@@ -378,6 +784,25 @@ err:
     return rv;
 }
 
+int io_uv__replace(struct raft_io *io,
+                   raft_index index,
+                   const struct raft_entry entries[],
+                   unsigned n,
+                   void *data,
+                   void (*cb)(void *data, int status))
+{
+    int rv;
+
+    /* The new entries are targeted to the segment prepared for the truncation,
+     * where they get encoded while it executes. */
+    rv = io_uv__truncate(io, index);
+    if (rv != 0) {
+        return rv;
+    }
+
+    return io_uv__append(io, entries, n, data, cb);
+}
+
 void io_uv__truncate_unblock(struct io_uv *uv)
 {
     process_requests(uv);
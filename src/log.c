@@ -7,462 +7,351 @@
 #include "log.h"
 
 /**
- * Calculate the reference count hash table key for the given entry index in an
- * table with the given size.
+ * Release the payload of an entry, either directly or, if the entry is part of
+ * a batch, by decrementing the counter of live entries of the batch and
+ * releasing the batch when it drops to zero.
  *
- * The hash is simply the index minus one modulo the size. This minimizes
- * conflicts in the most frequent case, where a new log entry is simpy appended
- * to the log and can use the hash table bucket next to the bucket for the entry
- * with the previous index (possibly resizing the table if its cap is reached).
+ * If @destroy is false, the payload memory itself is not released.
  */
-static size_t refs_key(const raft_index index, const size_t size)
+static void refs_release_payload(struct raft_entry_ref *ref,
+                                 struct raft_entry *entry,
+                                 bool destroy)
 {
-    assert(index > 0);
-    assert(size > 0);
+    if (ref->batch == NULL) {
+        assert(entry->batch == NULL);
+        if (destroy && entry->buf.base != NULL) {
+            raft_free(entry->buf.base);
+        }
+        return;
+    }
+
+    assert(ref->batch->batch == entry->batch);
+    assert(ref->batch->count > 0);
 
-    return (index - 1) % size;
+    ref->batch->count--;
+    if (ref->batch->count == 0) {
+        if (destroy) {
+            raft_free(ref->batch->batch);
+        }
+        raft_free(ref->batch);
+    }
+    ref->batch = NULL;
 }
 
 /**
- * Try to insert a new ref count item into the given reference count hash table.
- *
- * A collision happens when the bucket associated with the hash key of the given
- * index is already used to refcount entries with a different index. In that
- * case the collision output parameter will be set to true and no new entry is
- * inserted into the hash table.
+ * Move the reference count of an entry that is being removed from the log, but
+ * that still has outstanding references, to the list of detached entries.
  *
- * If two entries have the same index but different terms, the associated bucket
- * will be grown accordingly.
+ * If no memory is available to track the detached entry, its payload will be
+ * leaked: that's preferable to releasing memory that is still in use.
  */
-static int refs_try_insert(struct raft_entry_ref *table,
-                           const size_t size,
-                           const raft_term term,
-                           const raft_index index,
-                           const unsigned short count,
-                           bool *collision)
-{
-    struct raft_entry_ref *bucket;    /* Bucket associated with this index. */
-    struct raft_entry_ref *next_slot; /* For traversing the bucket slots */
-    struct raft_entry_ref *last_slot; /* To track the last traversed slot */
-    struct raft_entry_ref *slot;      /* Actual slot to use for this entry */
-    size_t key;
-
-    assert(table != NULL);
-    assert(size > 0);
-    assert(term > 0);
-    assert(index > 0);
-    assert(count > 0);
-    assert(collision != NULL);
-
-    /* Calculate the hash table key for the given index. */
-    key = refs_key(index, size);
-    bucket = &table[key];
-
-    /* If a bucket is empty, then there's no collision and we can fill its first
-     * slot. */
-    if (bucket->count == 0) {
-        assert(bucket->next == NULL);
-
-        slot = bucket;
-        goto fill;
-    }
-
-    /* If the bucket is already used to refcount entries with a different
-     * index, then we have a collision and we must abort here. */
-    if (bucket->index != index) {
-        *collision = true;
-        return 0;
-    }
-
-    /* If we get here it means that the bucket is in use to refcount one or more
-     * entries with the same index as the given one, but different terms.
-     *
-     * We must append a newly allocated slot to refcount the entry with this
-     * term.
-     *
-     * So first let's find the last slot in the bucket. */
-    for (next_slot = bucket; next_slot != NULL; next_slot = next_slot->next) {
-        /* All entries in a bucket must have the same index. */
-        assert(next_slot->index == index);
-
-        /* It should never happen that two entries with the same index and term
-         * get appended. So no existing slot in this bucket must track an entry
-         * with the same term as the given one. */
-        assert(next_slot->term != term);
-
-        last_slot = next_slot;
-    }
+static void refs_detach(struct raft_log *l, const struct raft_entry_ref *ref)
+{
+    struct raft_entry_ref *detached;
 
-    /* The last slot must have no next slot. */
-    assert(last_slot->next == NULL);
+    assert(ref->count > 0);
 
-    slot = raft_malloc(sizeof *slot);
-    if (slot == NULL) {
-        return RAFT_ENOMEM;
+    detached = raft_malloc(sizeof *detached);
+    if (detached == NULL) {
+        return;
     }
 
-    last_slot->next = slot;
+    *detached = *ref;
+    detached->next = l->detached;
+    l->detached = detached;
+}
 
-fill:
-    slot->term = term;
-    slot->index = index;
-    slot->count = count;
-    slot->next = NULL;
+/**
+ * Return the block holding the slot at position @i.
+ */
+static struct raft_log_block *block_of(struct raft_log *l, const size_t i)
+{
+    assert(i < l->size);
+    return l->blocks[(l->head + i / RAFT_LOG_BLOCK_SIZE) % l->n_blocks];
+}
 
-    *collision = false;
+/**
+ * Return the entry in the slot at position @i.
+ */
+static struct raft_entry *entry_at(struct raft_log *l, const size_t i)
+{
+    return &block_of(l, i)->entries[i % RAFT_LOG_BLOCK_SIZE];
+}
 
-    return 0;
+/**
+ * Return the reference count of the entry in the slot at position @i.
+ */
+static struct raft_entry_ref *ref_at(struct raft_log *l, const size_t i)
+{
+    return &block_of(l, i)->refs[i % RAFT_LOG_BLOCK_SIZE];
 }
 
 /**
- * Move the slots of the given bucket into the given reference count hash
- * table. The key of the bucket to use in the given table will be re-calculated
- * according to the given size.
+ * Return true if the payload of the entry in the slot at position @i has been
+ * evicted from memory.
  */
-static int refs_move(struct raft_entry_ref *bucket,
-                     struct raft_entry_ref *table,
-                     const size_t size)
+static bool is_evicted(struct raft_log *l, const size_t i)
 {
-    struct raft_entry_ref *slot;
-    struct raft_entry_ref *next_slot;
+    return ref_at(l, i)->index <= l->evicted &&
+           entry_at(l, i)->type != RAFT_CONFIGURATION;
+}
 
-    assert(bucket != NULL);
-    assert(table != NULL);
-    assert(size > 0);
+/**
+ * Decrement the reference count of an entry that is being removed from the slot
+ * at position @i, because of a truncation or a shift.
+ */
+static void refs_remove(struct raft_log *l, const size_t i, bool destroy)
+{
+    struct raft_entry_ref *ref = ref_at(l, i);
+    struct raft_entry *entry = entry_at(l, i);
 
-    /* Only non-empty buckets should be moved. */
-    assert(bucket->count > 0);
+    assert(ref->count > 0);
 
-    /* For each slot in the bucket, insert the relevant entry in the given
-     * table, then free it. */
-    next_slot = bucket;
-    while (next_slot != NULL) {
-        bool collision;
-        int rv;
+    ref->count--;
 
-        slot = next_slot;
+    /* Evicted entries are never referenced by anything else than the log, and
+     * their payload has already been released. */
+    if (is_evicted(l, i)) {
+        assert(ref->count == 0);
+        return;
+    }
 
-        /* Insert the ref count for this entry into the new table. */
-        rv = refs_try_insert(table, size, slot->term, slot->index, slot->count,
-                             &collision);
+    assert(l->n_bytes >= entry->buf.len);
+    l->n_bytes -= entry->buf.len;
 
-        next_slot = slot->next;
+    if (ref->count == 0) {
+        refs_release_payload(ref, entry, destroy);
+    } else {
+        refs_detach(l, ref);
+    }
+}
 
-        /* Unless this is the very first slot in the bucket, we need to free the
-         * slot. */
-        if (slot != bucket) {
-            raft_free(slot);
-        }
+void log__init(struct raft_log *l)
+{
+    assert(l != NULL);
 
-        if (rv != 0) {
-            return rv;
-        }
+    l->blocks = NULL;
+    l->n_blocks = 0;
+    l->head = 0;
+    l->size = 0;
+    l->front = l->back = 0;
+    l->offset = 0;
+    l->detached = NULL;
+    l->evicted = 0;
+    l->n_bytes = 0;
+    l->runs = NULL;
+    l->n_runs = 0;
+    l->runs_cap = 0;
+}
 
-        /* The given hash table is assumed to be large enough to hold all ref
-         * counts without any conflict. */
-        assert(!collision);
-    };
+void log__set_offset(struct raft_log *l, raft_index offset)
+{
+    /* The terms of entries before the offset aren't known anymore. */
+    l->offset = offset;
+    l->n_runs = 0;
+}
 
-    return 0;
+/**
+ * Return the index of the i'th entry in the log.
+ */
+static raft_index log__index(struct raft_log *l, size_t i)
+{
+    return l->offset + i + 1;
 }
 
 /**
- * Grow the size of the reference count hash table.
+ * Release all blocks and the blocks ring.
  */
-static int refs_grow(struct raft_log *l)
+static void free_blocks(struct raft_log *l)
 {
-    struct raft_entry_ref *table; /* New hash table. */
-    size_t size;                  /* Size of the new hash table. */
     size_t i;
 
-    assert(l != NULL);
-    assert(l->refs_size > 0);
-
-    size = l->refs_size * 2; /* Double the table size */
-
-    table = raft_calloc(size, sizeof *table);
-    if (table == NULL) {
-        return RAFT_ENOMEM;
+    for (i = 0; i < l->size / RAFT_LOG_BLOCK_SIZE; i++) {
+        raft_free(l->blocks[(l->head + i) % l->n_blocks]);
     }
-
-    /* Populate the new hash table, inserting all entries existing in the
-     * current hash table. Each bucket will have a different key in the new hash
-     * table, since the size has changed. */
-    for (i = 0; i < l->refs_size; i++) {
-        struct raft_entry_ref *bucket = &l->refs[i];
-        if (bucket->count > 0) {
-            int rv = refs_move(bucket, table, size);
-            if (rv != 0) {
-                return rv;
-            }
-        } else {
-            /* If the count is zero, we expect that the bucket is unused. */
-            assert(bucket->next == NULL);
-        }
+    if (l->blocks != NULL) {
+        raft_free(l->blocks);
     }
 
-    raft_free(l->refs);
-
-    l->refs = table;
-    l->refs_size = size;
-
-    return 0;
+    l->blocks = NULL;
+    l->n_blocks = 0;
+    l->head = 0;
+    l->size = 0;
 }
 
-/**
- * Initialize the refcount of the entry with the given index, setting it to 1.
- */
-static int refs_init(struct raft_log *l,
-                     const raft_term term,
-                     const raft_index index)
+void log__close(struct raft_log *l)
 {
-    int i;
+    size_t i;
 
     assert(l != NULL);
-    assert(term > 0);
-    assert(index > 0);
 
-    /* Initialize the hash map with a reasonable size */
-    if (l->refs == NULL) {
-        l->refs_size = LOG__REFS_INITIAL_SIZE;
+    for (i = l->front; i < l->back; i++) {
+        struct raft_entry_ref *ref = ref_at(l, i);
 
-        l->refs = raft_calloc(l->refs_size, sizeof *l->refs);
-        if (l->refs == NULL) {
-            return RAFT_ENOMEM;
-        }
-    }
+        /* We require that there are no outstanding references to active
+         * entries. */
+        assert(ref->count == 1);
 
-    /* Check if the bucket associated with the given index is available
-     * (i.e. there are no collisions), or grow the table and re-key it
-     * otherwise.
-     *
-     * We limit the number of times we try to grow the table to 10, to avoid
-     * eating up too much memory. In practice, there should never be a case
-     * where this is not enough. */
-    for (i = 0; i < 10; i++) {
-        bool collision;
-        int rc;
-
-        rc = refs_try_insert(l->refs, l->refs_size, term, index, 1, &collision);
-        if (rc != 0) {
-            return RAFT_ENOMEM;
+        if (is_evicted(l, i)) {
+            continue;
         }
 
-        if (!collision) {
-            return 0;
-        }
+        /* Release the memory used by the entry data (either directly or via a
+         * batch). */
+        ref->count = 0;
+        refs_release_payload(ref, entry_at(l, i), true);
+    }
 
-        rc = refs_grow(l);
-        if (rc != 0) {
-            return rc;
-        }
-    };
+    free_blocks(l);
+
+    while (l->detached != NULL) {
+        struct raft_entry_ref *detached = l->detached;
+        l->detached = detached->next;
+        raft_free(detached);
+    }
 
-    return RAFT_ENOMEM;
+    if (l->runs != NULL) {
+        raft_free(l->runs);
+    }
 }
 
 /**
- * Increment the refcount of the entry with the given term and index.
+ * Grow the blocks ring to the given length, moving the pointers of the blocks
+ * in use to its beginning.
  */
-static void refs_incr(struct raft_log *l,
-                      const raft_term term,
-                      const raft_index index)
+static int grow_ring(struct raft_log *l, size_t n_blocks)
 {
-    size_t key;                  /* Hash table key for the given index. */
-    struct raft_entry_ref *slot; /* Slot for the given term/index */
-
-    assert(l != NULL);
-    assert(term > 0);
-    assert(index > 0);
+    struct raft_log_block **blocks;
+    size_t n = l->size / RAFT_LOG_BLOCK_SIZE; /* Number of blocks in use */
+    size_t i;
 
-    key = refs_key(index, l->refs_size);
+    assert(n_blocks > l->n_blocks);
 
-    /* Lookup the slot associated with the given term/index. */
-    for (slot = &l->refs[key]; slot != NULL; slot = slot->next) {
-        assert(slot->index == index);
-        if (slot->term == term) {
-            break;
-        }
+    blocks = raft_malloc(n_blocks * sizeof *blocks);
+    if (blocks == NULL) {
+        return RAFT_ENOMEM;
     }
+    for (i = 0; i < n; i++) {
+        blocks[i] = l->blocks[(l->head + i) % l->n_blocks];
+    }
+    if (l->blocks != NULL) {
+        raft_free(l->blocks);
+    }
+    l->blocks = blocks;
+    l->n_blocks = n_blocks;
+    l->head = 0;
 
-    assert(slot != NULL);
-
-    slot->count++;
+    return 0;
 }
 
 /**
- * Decrement the refcount of the entry with the given index. Return a boolean
- * indicating whether the entry has now zero references.
+ * Ensure that there is a free slot after the last entry, for adding a new one.
+ *
+ * If all slots are used, a new block is added at the end. Only the ring of
+ * block pointers ever gets reallocated, so entries are never moved.
  */
-static bool refs_decr(struct raft_log *l,
-                      const raft_term term,
-                      const raft_index index)
+static int ensure_capacity(struct raft_log *l)
 {
-    size_t key;                       /* Hash table key for the given index. */
-    struct raft_entry_ref *slot;      /* Slot for the given term/index */
-    struct raft_entry_ref *prev_slot; /* Slot preceeding the one to decrement */
-
-    assert(l != NULL);
-    assert(term > 0);
-    assert(index > 0);
+    struct raft_log_block *block;
+    size_t n = l->size / RAFT_LOG_BLOCK_SIZE; /* Number of blocks in use */
+    int rv;
 
-    key = refs_key(index, l->refs_size);
-    prev_slot = NULL;
+    if (l->back < l->size) {
+        return 0;
+    }
 
-    /* Lookup the slot associated with the given term/index, keeping track of
-     * its previous slot in the bucket list. */
-    for (slot = &l->refs[key]; slot != NULL; slot = slot->next) {
-        assert(slot->index == index);
-        if (slot->term == term) {
-            break;
+    /* If the blocks ring is full, double its length. */
+    if (n == l->n_blocks) {
+        rv = grow_ring(l, l->n_blocks == 0 ? 2 : l->n_blocks * 2);
+        if (rv != 0) {
+            return rv;
         }
-        prev_slot = slot;
     }
 
-    assert(slot != NULL);
-
-    slot->count--;
-
-    if (slot->count > 0) {
-        /* The entry is still referenced. */
-        return false;
+    block = raft_malloc(sizeof *block);
+    if (block == NULL) {
+        return RAFT_ENOMEM;
     }
 
-    /* If the refcount has dropped to zero, delete the slot. */
-    if (prev_slot != NULL) {
-        /* This isn't the very first slot, simply unlink it from the slot
-         * list. */
-        prev_slot->next = slot->next;
-        raft_free(slot);
-    } else if (slot->next != NULL) {
-        /* This is the very first slot, and slot list is not empty. Copy the
-         * second slot into the first one, then delete it. */
-        struct raft_entry_ref *second_slot = slot->next;
-        struct raft_entry_ref *tail_slots = second_slot->next;
+    l->blocks[(l->head + n) % l->n_blocks] = block;
+    l->size += RAFT_LOG_BLOCK_SIZE;
 
-        slot->term = second_slot->term;
-        slot->index = second_slot->index;
-        slot->count = second_slot->count;
-
-        raft_free(second_slot);
-        slot->next = tail_slots;
-    }
-
-    return true;
+    return 0;
 }
 
-void log__init(struct raft_log *l)
+/**
+ * Ensure that a new run can be added to the runs table, for appending an entry
+ * with the given term.
+ */
+static int ensure_run_capacity(struct raft_log *l, const raft_term term)
 {
-    assert(l != NULL);
+    struct raft_log_run *runs;
+    size_t runs_cap;
 
-    l->entries = NULL;
-    l->size = 0;
-    l->front = l->back = 0;
-    l->offset = 0;
-    l->refs = NULL;
-    l->refs_size = 0;
-}
+    if (l->n_runs > 0 && l->runs[l->n_runs - 1].term == term) {
+        return 0;
+    }
+    if (l->n_runs < l->runs_cap) {
+        return 0;
+    }
 
-void log__set_offset(struct raft_log *l, raft_index offset)
-{
-    l->offset = offset;
+    runs_cap = l->runs_cap == 0 ? 4 : l->runs_cap * 2;
+    runs = raft_realloc(l->runs, runs_cap * sizeof *runs);
+    if (runs == NULL) {
+        return RAFT_ENOMEM;
+    }
+    l->runs = runs;
+    l->runs_cap = runs_cap;
+
+    return 0;
 }
 
 /**
- * Return the index of the i'th entry in the log.
+ * Return the position of the run holding the entry with the given index, which
+ * may have been shifted away. If no run holds it return the number of runs.
  */
-static raft_index log__index(struct raft_log *l, size_t i)
-{
-    return l->offset + i + 1;
-}
-
-void log__close(struct raft_log *l)
+static size_t locate_run(struct raft_log *l, const raft_index index)
 {
-    void *batch = NULL; /* Last batch that has been freed */
+    size_t lo = 0;
+    size_t hi = l->n_runs;
 
-    assert(l != NULL);
+    if (l->n_runs == 0 || index < l->runs[0].first ||
+        index > l->offset + log__n_entries(l)) {
+        return l->n_runs;
+    }
 
-    if (l->entries != NULL) {
-        size_t i;
-        size_t n = log__n_entries(l);
-
-        for (i = 0; i < n; i++) {
-            struct raft_entry *entry = &l->entries[(l->front + i) % l->size];
-            raft_index index = log__index(l, i);
-            size_t key = refs_key(index, l->refs_size);
-            struct raft_entry_ref *slot = &l->refs[key];
-
-            /* We require that there are no outstanding references to active
-             * entries. */
-            assert(slot->count == 1);
-            assert(slot->next == NULL);
-
-            /* Release the memory used by the entry data (either directly or via
-             * a batch). */
-            if (entry->batch == NULL) {
-                if (entry->buf.base != NULL) {
-                    raft_free(entry->buf.base);
-                }
-            } else {
-                if (entry->batch != batch) {
-                    /* This batch was not released yet, so let's do it now. */
-                    batch = entry->batch;
-                    raft_free(entry->batch);
-                }
-            }
+    /* Find the last run starting at or before the index. */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l->runs[mid].first <= index) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-
-        raft_free(l->entries);
     }
 
-    if (l->refs != NULL) {
-        raft_free(l->refs);
-    }
+    return lo;
 }
 
-/**
- * Ensure that the entries array has enough free slots for adding a new enty.
- */
-static int ensure_capacity(struct raft_log *l)
+int log__reserve(struct raft_log *l, const size_t n)
 {
-    struct raft_entry *entries; /* New entries array */
-    size_t n;                   /* Current number of entries */
-    size_t size;                /* Size of the new array */
-    size_t i, j;
-
-    n = log__n_entries(l);
-
-    if (n + 1 < l->size) {
-        return 0;
-    }
+    size_t n_blocks = l->n_blocks == 0 ? 2 : l->n_blocks;
+    size_t needed;
 
-    /* Make the new size twice the current size plus one (for the new
-     * entry). Over-allocating now avoids smaller allocations later. */
-    size = (l->size + 1) * 2;
+    assert(l != NULL);
 
-    entries = raft_calloc(size, sizeof *entries);
-    if (entries == NULL) {
-        return RAFT_ENOMEM;
-    }
+    /* Number of blocks needed to hold the current entries and n more ones,
+     * counting the unused slots at the beginning of the first block. */
+    needed = (l->back + n + RAFT_LOG_BLOCK_SIZE - 1) / RAFT_LOG_BLOCK_SIZE;
 
-    /* Copy all active old entries to the beginning of the newly allocated
-     * array. */
-    for (i = 0; i < n; i++) {
-        j = (l->front + i) % l->size; /* Index in the current array */
-        memcpy(&entries[i], &l->entries[j], sizeof *entries);
+    while (n_blocks < needed) {
+        n_blocks *= 2;
     }
-
-    /* Release the old entries array. */
-    if (l->entries != NULL) {
-        raft_free(l->entries);
+    if (n_blocks <= l->n_blocks) {
+        return 0;
     }
 
-    l->entries = entries;
-    l->size = size;
-    l->front = 0;
-    l->back = n;
-
-    return 0;
+    return grow_ring(l, n_blocks);
 }
 
 int log__append(struct raft_log *l,
@@ -473,11 +362,13 @@ int log__append(struct raft_log *l,
 {
     int rv;
     struct raft_entry *entry;
+    struct raft_entry_ref *ref;
     raft_index index;
 
     assert(l != NULL);
     assert(term > 0);
-    assert(type == RAFT_CONFIGURATION || type == RAFT_COMMAND);
+    assert(type == RAFT_CONFIGURATION || type == RAFT_COMMAND ||
+           type == RAFT_BATCH);
     assert(buf != NULL);
 
     rv = ensure_capacity(l);
@@ -485,20 +376,53 @@ int log__append(struct raft_log *l,
         return rv;
     }
 
-    index = l->offset + log__n_entries(l) + 1;
-    rv = refs_init(l, term, index);
+    rv = ensure_run_capacity(l, term);
     if (rv != 0) {
         return rv;
     }
 
-    entry = &l->entries[l->back];
+    index = l->offset + log__n_entries(l) + 1;
+
+    ref = ref_at(l, l->back);
+    ref->term = term;
+    ref->index = index;
+    ref->count = 1;
+    ref->batch = NULL;
+    ref->next = NULL;
+
+    /* Entries belonging to the same batch are always appended contiguously, so
+     * if the previous entry is part of the same batch, share its counter.
+     * Otherwise this is the first entry of a new batch. */
+    if (batch != NULL) {
+        if (log__n_entries(l) > 0 && entry_at(l, l->back - 1)->batch == batch) {
+            ref->batch = ref_at(l, l->back - 1)->batch;
+        } else {
+            ref->batch = raft_malloc(sizeof *ref->batch);
+            if (ref->batch == NULL) {
+                return RAFT_ENOMEM;
+            }
+            ref->batch->batch = batch;
+            ref->batch->count = 0;
+        }
+        ref->batch->count++;
+    }
+
+    entry = entry_at(l, l->back);
     entry->term = term;
     entry->type = type;
     entry->buf = *buf;
     entry->batch = batch;
 
+    l->n_bytes += buf->len;
+
     l->back += 1;
-    l->back = l->back % l->size;
+
+    if (l->n_runs == 0 || l->runs[l->n_runs - 1].term != term) {
+        assert(l->n_runs < l->runs_cap);
+        l->runs[l->n_runs].term = term;
+        l->runs[l->n_runs].first = index;
+        l->n_runs++;
+    }
 
     return 0;
 }
@@ -560,17 +484,44 @@ err:
     return rv;
 }
 
-size_t log__n_entries(struct raft_log *l)
+int log__append_acquire(struct raft_log *l,
+                        struct raft_entry entries[],
+                        const unsigned n)
 {
+    unsigned i;
+    int rv;
+
     assert(l != NULL);
+    assert(entries != NULL);
+    assert(n > 0);
 
-    /* The circular buffer is not wrapped. */
-    if (l->front <= l->back) {
-        return l->back - l->front;
+    for (i = 0; i < n; i++) {
+        struct raft_entry *entry = &entries[i];
+        rv = log__append(l, entry->term, entry->type, &entry->buf,
+                         entry->batch);
+        if (rv != 0) {
+            goto err;
+        }
+        /* Take the reference held by the caller along with the array. */
+        ref_at(l, l->back - 1)->count++;
     }
 
-    /* The circular buffer is wrapped. */
-    return l->size - l->front + l->back;
+    return 0;
+
+err:
+    /* Leave the entries appended so far in the log, but don't keep them
+     * acquired. */
+    for (; i > 0; i--) {
+        ref_at(l, l->back - i)->count--;
+    }
+    assert(rv != 0);
+    return rv;
+}
+
+size_t log__n_entries(struct raft_log *l)
+{
+    assert(l != NULL);
+    return l->back - l->front;
 }
 
 raft_index log__first_index(struct raft_log *l)
@@ -590,10 +541,9 @@ raft_index log__last_index(struct raft_log *l)
 }
 
 /**
- * Return the position of the entry with the given index in the entries array.
+ * Return the position of the slot holding the entry with the given index.
  *
- * If no entry with the given index is in the log return the size of the entries
- * array.
+ * If no entry with the given index is in the log return the number of slots.
  */
 static size_t locate_entry(struct raft_log *l, const raft_index index)
 {
@@ -601,10 +551,10 @@ static size_t locate_entry(struct raft_log *l, const raft_index index)
         return l->size;
     }
 
-    /* Get the array index of the desired entry. Log indexes start at 1, so we
-     * subtract one to get array indexes. We also need to subtract any index
+    /* Get the slot of the desired entry. Log indexes start at 1, so we
+     * subtract one to get slot positions. We also need to subtract any index
      * offset this log might start at. */
-    return (l->front + (index - 1) - l->offset) % l->size;
+    return l->front + (size_t)((index - 1) - l->offset);
 }
 
 raft_term log__term_of(struct raft_log *l, const raft_index index)
@@ -623,7 +573,7 @@ raft_term log__term_of(struct raft_log *l, const raft_index index)
 
     assert(i < l->size);
 
-    return l->entries[i].term;
+    return entry_at(l, i)->term;
 }
 
 raft_term log__last_term(struct raft_log *l)
@@ -631,13 +581,82 @@ raft_term log__last_term(struct raft_log *l)
     return log__term_of(l, log__last_index(l));
 }
 
+raft_term log__known_term_of(struct raft_log *l, const raft_index index)
+{
+    size_t i = locate_run(l, index);
+
+    if (i == l->n_runs) {
+        return 0;
+    }
+
+    return l->runs[i].term;
+}
+
+raft_index log__first_index_of_term(struct raft_log *l, raft_index index)
+{
+    raft_index first = log__first_index(l);
+    size_t i;
+
+    if (log__term_of(l, index) == 0) {
+        return 0;
+    }
+
+    i = locate_run(l, index);
+    assert(i < l->n_runs);
+
+    if (l->runs[i].first > first) {
+        first = l->runs[i].first;
+    }
+
+    return first;
+}
+
+raft_index log__last_index_of_term(struct raft_log *l, raft_term term)
+{
+    raft_index first = log__first_index(l);
+    raft_index last;
+    size_t lo = 0;
+    size_t hi = l->n_runs;
+
+    if (log__n_entries(l) == 0) {
+        return 0;
+    }
+
+    /* Terms are monotonically increasing, so find the last run whose term is
+     * not greater than the given one. */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l->runs[mid].term <= term) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (l->runs[lo].term != term) {
+        return 0;
+    }
+
+    if (lo + 1 < l->n_runs) {
+        last = l->runs[lo + 1].first - 1;
+    } else {
+        last = log__last_index(l);
+    }
+
+    if (last < first) {
+        return 0;
+    }
+
+    return last;
+}
+
 const struct raft_entry *log__get(struct raft_log *l, const raft_index index)
 {
     size_t i;
 
     assert(l != NULL);
 
-    /* Get the array index of the desired entry. */
+    /* Get the slot of the desired entry. */
     i = locate_entry(l, index);
     if (i == l->size) {
         return NULL;
@@ -645,23 +664,71 @@ const struct raft_entry *log__get(struct raft_log *l, const raft_index index)
 
     assert(i < l->size);
 
-    return &l->entries[i];
+    return entry_at(l, i);
 }
 
 int log__acquire(struct raft_log *l,
                  const raft_index index,
                  struct raft_entry *entries[],
                  unsigned *n)
+{
+    return log__acquire_n(l, index, 0, entries, n);
+}
+
+/* Return the number of entries from the one in the slot at position @i to the
+ * last one. */
+static unsigned count_from(struct raft_log *l, const size_t i)
+{
+    return (unsigned)(l->back - i);
+}
+
+/* Copy @n entries starting from the slot at position @i into @dst and
+ * increment their reference counts. The range is copied with one memcpy() for
+ * each block it spans. */
+static void copy_and_ref(struct raft_log *l,
+                         const raft_index index,
+                         const size_t i,
+                         const unsigned n,
+                         struct raft_entry *dst)
+{
+    size_t j = 0;
+
+    while (j < n) {
+        struct raft_log_block *block = block_of(l, i + j);
+        size_t k = (i + j) % RAFT_LOG_BLOCK_SIZE; /* Slot within the block */
+        size_t m = RAFT_LOG_BLOCK_SIZE - k;       /* Slots copied from it */
+        size_t h;
+
+        if (m > n - j) {
+            m = n - j;
+        }
+
+        memcpy(dst + j, &block->entries[k], m * sizeof *dst);
+        for (h = 0; h < m; h++) {
+            struct raft_entry_ref *ref = &block->refs[k + h];
+            assert(ref->index == index + j + h);
+            ref->count++;
+        }
+
+        j += m;
+    }
+}
+
+int log__acquire_n(struct raft_log *l,
+                   const raft_index index,
+                   const unsigned max,
+                   struct raft_entry *entries[],
+                   unsigned *n)
 {
     size_t i;
-    size_t j;
 
     assert(l != NULL);
     assert(index > 0);
+    assert(index > l->evicted);
     assert(entries != NULL);
     assert(n != NULL);
 
-    /* Get the array index of the first entry to acquire. */
+    /* Get the slot of the first entry to acquire. */
     i = locate_entry(l, index);
 
     if (i == l->size) {
@@ -670,126 +737,224 @@ int log__acquire(struct raft_log *l,
         return 0;
     }
 
-    if (i < l->back) {
-        /* The last entry does not wrap with respect to i, so the number of
-         * entries is simply the length of the range [i...l->back). */
-        *n = l->back - i;
-    } else {
-        /* The last entry wraps with respect to i, so the number of entries is
-         * the sum of the lengths of the ranges [i...l->size) and [0...l->back),
-         * which is l->size - i + l->back.*/
-        *n = l->size - i + l->back;
-    }
-
+    *n = count_from(l, i);
     assert(*n > 0);
 
+    if (max > 0 && *n > max) {
+        *n = max;
+    }
+
     *entries = raft_calloc(*n, sizeof **entries);
     if (*entries == NULL) {
         return RAFT_ENOMEM;
     }
 
-    for (j = 0; j < *n; j++) {
-        size_t k = (i + j) % l->size;
-        struct raft_entry *entry = &(*entries)[j];
-        *entry = l->entries[k];
-        refs_incr(l, entry->term, index + j);
+    copy_and_ref(l, index, i, *n, *entries);
+
+    return 0;
+}
+
+int log__acquire_view(struct raft_log *l,
+                      const raft_index index,
+                      const unsigned max,
+                      struct log__view *view)
+{
+    size_t i;
+
+    assert(l != NULL);
+    assert(index > 0);
+    assert(index > l->evicted);
+    assert(view != NULL);
+
+    view->index = index;
+
+    /* Get the slot of the first entry to acquire. */
+    i = locate_entry(l, index);
+
+    if (i == l->size) {
+        view->entries = NULL;
+        view->n = 0;
+        return 0;
     }
 
+    view->n = count_from(l, i);
+    assert(view->n > 0);
+
+    if (max > 0 && view->n > max) {
+        view->n = max;
+    }
+
+    if (view->n <= LOG__VIEW_INLINE) {
+        view->entries = view->inline_entries;
+    } else {
+        view->entries = raft_calloc(view->n, sizeof *view->entries);
+        if (view->entries == NULL) {
+            view->n = 0;
+            return RAFT_ENOMEM;
+        }
+    }
+
+    copy_and_ref(l, index, i, view->n, view->entries);
+
     return 0;
 }
 
 /**
- * Return true if the given batch is referenced by any entry currently in the
- * log.
+ * Find the reference count of the entry with the given term and index, which
+ * can be either in the log or among the detached ones. In the latter case, set
+ * @prev to the detached entry preceeding it, if any.
  */
-static bool is_batch_referenced(struct raft_log *l, const void *batch)
+static struct raft_entry_ref *refs_lookup(struct raft_log *l,
+                                          const raft_term term,
+                                          const raft_index index,
+                                          bool *detached,
+                                          struct raft_entry_ref **prev)
 {
-    size_t n = log__n_entries(l);
+    struct raft_entry_ref *ref;
     size_t i;
 
-    /* Iterate through all live entries to see if there's one
-     * belonging to the same batch. This is slightly inefficient but
-     * this code path should be taken very rarely in practice. */
-    for (i = 0; i < n; i++) {
-        struct raft_entry *entry;
-        entry = &l->entries[(l->front + i) % l->size];
+    i = locate_entry(l, index);
+    if (i != l->size && entry_at(l, i)->term == term) {
+        *detached = false;
+        return ref_at(l, i);
+    }
 
-        if (entry->batch == batch) {
-            return true;
+    *detached = true;
+    *prev = NULL;
+    for (ref = l->detached; ref != NULL; ref = ref->next) {
+        if (ref->term == term && ref->index == index) {
+            return ref;
         }
+        *prev = ref;
     }
 
-    return false;
+    return NULL;
 }
 
-void log__release(struct raft_log *l,
-                  const raft_index index,
-                  struct raft_entry entries[],
-                  const size_t n)
+/* Decrement the reference counts of the given entries, freeing the payload of
+ * the ones that are not referenced anymore. */
+static void unref_entries(struct raft_log *l,
+                          const raft_index index,
+                          struct raft_entry entries[],
+                          const size_t n)
 {
     size_t i;
-    void *batch = NULL; /* Last batch whose memory was freed */
-
-    assert(l != NULL);
-    assert((entries == NULL && n == 0) || (entries != NULL && n > 0));
 
     for (i = 0; i < n; i++) {
         struct raft_entry *entry = &entries[i];
-        bool unref;
-
-        unref = refs_decr(l, entry->term, index + i);
-
-        /* If there are no outstanding references to this entry, free its
-         * payload if it's not part of a batch, or check if we can free the
-         * batch itself. */
-        if (unref) {
-            if (entries[i].batch == NULL) {
-                if (entry->buf.base != NULL) {
-                    raft_free(entries[i].buf.base);
-                }
+        struct raft_entry_ref *ref;
+        struct raft_entry_ref *prev;
+        bool detached;
+
+        ref = refs_lookup(l, entry->term, index + i, &detached, &prev);
+
+        /* The entry was removed from the log but there was no memory to track
+         * it, so its payload has been leaked on purpose. */
+        if (ref == NULL) {
+            continue;
+        }
+
+        assert(ref->count > 0);
+        ref->count--;
+
+        /* Entries still in the log are always referenced by the log itself. */
+        if (!detached) {
+            assert(ref->count > 0);
+            continue;
+        }
+
+        /* If there are no outstanding references to this detached entry, free
+         * its payload and stop tracking it. */
+        if (ref->count == 0) {
+            refs_release_payload(ref, entry, true);
+            if (prev != NULL) {
+                prev->next = ref->next;
             } else {
-                if (entry->batch != batch) {
-                    if (!is_batch_referenced(l, entry->batch)) {
-                        batch = entry->batch;
-                        raft_free(batch);
-                    }
-                }
+                l->detached = ref->next;
             }
+            raft_free(ref);
         }
     }
+}
+
+void log__release(struct raft_log *l,
+                  const raft_index index,
+                  struct raft_entry entries[],
+                  const size_t n)
+{
+    assert(l != NULL);
+    assert((entries == NULL && n == 0) || (entries != NULL && n > 0));
+
+    unref_entries(l, index, entries, n);
 
     if (entries != NULL) {
         raft_free(entries);
     }
 }
 
+void log__release_view(struct raft_log *l, struct log__view *view)
+{
+    assert(l != NULL);
+    assert(view != NULL);
+    assert((view->entries == NULL && view->n == 0) ||
+           (view->entries != NULL && view->n > 0));
+
+    unref_entries(l, view->index, view->entries, view->n);
+
+    if (view->entries != NULL && view->entries != view->inline_entries) {
+        raft_free(view->entries);
+    }
+
+    view->entries = NULL;
+    view->n = 0;
+}
+
 /**
- * Clear the log if it became empty.
+ * Shrink the ring of block pointers if no more than a quarter of it is in use,
+ * halving its length as many times as possible. Since the ring is at least
+ * doubled when growing, this can't make it grow again right away. If no memory
+ * is available the ring is just kept as it is.
  */
-static void clear_if_empty(struct raft_log *l)
+static void shrink_ring(struct raft_log *l)
 {
-    if (log__n_entries(l) == 0) {
-        raft_free(l->entries);
-        l->entries = NULL;
-        l->size = 0;
-        l->front = 0;
-        l->back = 0;
+    struct raft_log_block **blocks;
+    size_t n = l->size / RAFT_LOG_BLOCK_SIZE; /* Number of blocks in use */
+    size_t n_blocks = l->n_blocks;
+    size_t i;
+
+    while (n_blocks > 2 && n <= n_blocks / 4) {
+        n_blocks /= 2;
+    }
+
+    if (n_blocks == l->n_blocks) {
+        return;
     }
+
+    blocks = raft_malloc(n_blocks * sizeof *blocks);
+    if (blocks == NULL) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        blocks[i] = l->blocks[(l->head + i) % l->n_blocks];
+    }
+    raft_free(l->blocks);
+
+    l->blocks = blocks;
+    l->n_blocks = n_blocks;
+    l->head = 0;
 }
 
 /**
- * Destroy an entry, possibly releasing the memory of its buffer.
+ * Clear the log if it became empty.
  */
-static void destroy_entry(struct raft_log *l, struct raft_entry *entry)
+static void clear_if_empty(struct raft_log *l)
 {
-    if (entry->batch == NULL) {
-        if (entry->buf.base != NULL) {
-            raft_free(entry->buf.base);
-        }
-    } else {
-        if (!is_batch_referenced(l, entry->batch)) {
-            raft_free(entry->batch);
-        }
+    if (log__n_entries(l) == 0) {
+        assert(l->n_bytes == 0);
+        free_blocks(l);
+        l->front = 0;
+        l->back = 0;
+        l->evicted = 0;
     }
 }
 
@@ -820,25 +985,28 @@ static void remove_suffix(struct raft_log *l,
     n = (log__last_index(l) - start) + 1;
 
     for (i = 0; i < n; i++) {
-        struct raft_entry *entry;
-        bool unref;
-
-        if (l->back == 0) {
-            l->back = l->size - 1;
-        } else {
-            l->back--;
-        }
+        l->back--;
+        assert(ref_at(l, l->back)->index == start + n - i - 1);
+        refs_remove(l, l->back, destroy);
+    }
 
-        entry = &l->entries[l->back];
+    if (l->evicted >= start) {
+        l->evicted = start - 1;
+    }
 
-        unref = refs_decr(l, entry->term, start + n - i - 1);
+    while (l->n_runs > 0 && l->runs[l->n_runs - 1].first >= start) {
+        l->n_runs--;
+    }
 
-        if (unref && destroy) {
-            destroy_entry(l, entry);
-        }
+    /* Release the blocks at the end that don't hold any entry anymore. */
+    while (l->size - l->back >= RAFT_LOG_BLOCK_SIZE) {
+        size_t last = l->size / RAFT_LOG_BLOCK_SIZE - 1;
+        raft_free(l->blocks[(l->head + last) % l->n_blocks]);
+        l->size -= RAFT_LOG_BLOCK_SIZE;
     }
 
     clear_if_empty(l);
+    shrink_ring(l);
 }
 
 void log__truncate(struct raft_log *l, const raft_index index)
@@ -867,24 +1035,85 @@ void log__shift(struct raft_log *l, const raft_index index)
     n = (index - log__first_index(l)) + 1;
 
     for (i = 0; i < n; i++) {
-        struct raft_entry *entry;
-        bool unref;
-
-        entry = &l->entries[l->front];
+        size_t k = l->front;
 
-        if (l->front == l->size - 1) {
-            l->front = 0;
-        } else {
-            l->front++;
-        }
+        l->front++;
         l->offset++;
 
-        unref = refs_decr(l, entry->term, l->offset);
+        assert(ref_at(l, k)->index == l->offset);
+        refs_remove(l, k, true);
+    }
+
+    /* Keep the run of the last entry shifted away, so its term is still known
+     * when sending the entries following it. */
+    n = locate_run(l, index);
+    if (n > 0 && n < l->n_runs) {
+        memmove(l->runs, l->runs + n, (l->n_runs - n) * sizeof *l->runs);
+        l->n_runs -= n;
+    }
 
-        if (unref) {
-            destroy_entry(l, entry);
-        }
+    /* Release the blocks at the beginning that don't hold any entry anymore,
+     * unless the log is now empty and gets cleared anyway. */
+    while (l->front >= RAFT_LOG_BLOCK_SIZE && l->front < l->back) {
+        raft_free(l->blocks[l->head]);
+        l->head = (l->head + 1) % l->n_blocks;
+        l->size -= RAFT_LOG_BLOCK_SIZE;
+        l->front -= RAFT_LOG_BLOCK_SIZE;
+        l->back -= RAFT_LOG_BLOCK_SIZE;
     }
 
     clear_if_empty(l);
+    shrink_ring(l);
+}
+
+bool log__is_evicted(struct raft_log *l, const raft_index index)
+{
+    assert(l != NULL);
+    return index >= log__first_index(l) && index <= l->evicted;
+}
+
+void log__evict(struct raft_log *l, raft_index index, const size_t max_bytes)
+{
+    raft_index next;
+
+    assert(l != NULL);
+
+    if (index > log__last_index(l)) {
+        index = log__last_index(l);
+    }
+
+    next = l->evicted + 1;
+    if (next < log__first_index(l)) {
+        next = log__first_index(l);
+    }
+
+    while (l->n_bytes > max_bytes && next <= index) {
+        size_t i = locate_entry(l, next);
+        struct raft_entry *entry;
+        struct raft_entry_ref *ref;
+
+        assert(i < l->size);
+
+        entry = entry_at(l, i);
+        ref = ref_at(l, i);
+
+        /* Stop at the first entry still referenced by in-flight I/O, since
+         * evicted entries must form a contiguous range. */
+        if (ref->count > 1) {
+            break;
+        }
+
+        /* Configuration entries are always kept in memory, since they are
+         * needed to rollback uncommitted configuration changes. */
+        if (entry->type != RAFT_CONFIGURATION) {
+            assert(l->n_bytes >= entry->buf.len);
+            l->n_bytes -= entry->buf.len;
+            refs_release_payload(ref, entry, true);
+            entry->buf.base = NULL;
+            entry->batch = NULL;
+        }
+
+        l->evicted = next;
+        next++;
+    }
 }
@@ -8,9 +8,20 @@
 #include "../include/raft.h"
 
 /**
- * Initial size of the entry reference count hash table.
+ * Maximum number of entries that a log view can hold without allocating memory.
  */
-#define LOG__REFS_INITIAL_SIZE 256
+#define LOG__VIEW_INLINE 8
+
+/**
+ * A range of acquired entries, see log__acquire_view().
+ */
+struct log__view
+{
+    raft_index index;           /* Index of the first entry */
+    struct raft_entry *entries; /* Acquired entries */
+    unsigned n;                 /* Length of the entries array */
+    struct raft_entry inline_entries[LOG__VIEW_INLINE]; /* Storage for n <= 8 */
+};
 
 /**
  * Initialize an empty in-memory log of raft entries.
@@ -43,11 +54,32 @@ raft_index log__last_index(struct raft_log *l);
  */
 raft_term log__term_of(struct raft_log *l, raft_index index);
 
+/**
+ * Same as @log__term_of, but also return the term of entries shifted away, as
+ * long as the run of entries with their term is still tracked, which is the
+ * case for the shifted entries with the same term as the last one. Return #0
+ * if the term of the entry is not known.
+ */
+raft_term log__known_term_of(struct raft_log *l, raft_index index);
+
 /**
  * Get the term of the last entry in the log. Return #0 if the log is empty.
  */
 raft_term log__last_term(struct raft_log *l);
 
+/**
+ * Get the index of the first entry having the same term as the entry with the
+ * given index, looking only at entries still present in the log. Return #0 if
+ * there is no entry with the given index.
+ */
+raft_index log__first_index_of_term(struct raft_log *l, raft_index index);
+
+/**
+ * Get the index of the last entry with the given term. Return #0 if there is
+ * no such entry.
+ */
+raft_index log__last_index_of_term(struct raft_log *l, raft_term term);
+
 /**
  * Get the entry with the given index.
  *
@@ -63,6 +95,12 @@ const struct raft_entry *log__get(struct raft_log *l, const raft_index index);
  */
 void log__set_offset(struct raft_log *l, raft_index offset);
 
+/**
+ * Make room in the ring of blocks for appending @n more entries, so it doesn't
+ * get reallocated while they are appended.
+ */
+int log__reserve(struct raft_log *l, size_t n);
+
 /**
  * Append the an entry to the log.
  */
@@ -87,6 +125,16 @@ int log__append_configuration(struct raft_log *l,
                               const raft_term term,
                               const struct raft_configuration *configuration);
 
+/**
+ * Append the given entries, received from another server, and acquire them in
+ * place without copying: the @entries array and the batches of the entries are
+ * handed over to the log, and the array must be released with log__release()
+ * as if it had been returned by log__acquire().
+ */
+int log__append_acquire(struct raft_log *l,
+                        struct raft_entry entries[],
+                        const unsigned n);
+
 
 /**
  * Acquire an array of entries from the given index onwards.
@@ -99,6 +147,16 @@ int log__acquire(struct raft_log *l,
                  struct raft_entry *entries[],
                  unsigned *n);
 
+/**
+ * Like log__acquire(), but acquire at most @max entries. If @max is zero, this
+ * is the same as log__acquire().
+ */
+int log__acquire_n(struct raft_log *l,
+                   const raft_index index,
+                   const unsigned max,
+                   struct raft_entry *entries[],
+                   unsigned *n);
+
 /**
  * Release a previously acquired array of entries.
  */
@@ -107,6 +165,24 @@ void log__release(struct raft_log *l,
                   struct raft_entry entries[],
                   const size_t n);
 
+/**
+ * Like log__acquire_n(), but fill the given view instead of allocating a new
+ * entries array. If no more than #LOG__VIEW_INLINE entries are acquired no
+ * memory is allocated, since the entries are stored inline in the view itself.
+ *
+ * The view must not be moved in memory until it's released, and its entries
+ * are guaranteed to be valid until log__release_view() is called.
+ */
+int log__acquire_view(struct raft_log *l,
+                      const raft_index index,
+                      const unsigned max,
+                      struct log__view *view);
+
+/**
+ * Release a previously acquired view.
+ */
+void log__release_view(struct raft_log *l, struct log__view *view);
+
 /**
  * Delete all entries from the given index (included) onwards. If the log is
  * empty this is a no-op. If @index is lower than or equal to the index of the
@@ -125,4 +201,18 @@ void log__discard(struct raft_log *l, const raft_index index);
  */
 void log__shift(struct raft_log *l, const raft_index index);
 
+/**
+ * Return true if the payload of the entry with the given index has been
+ * evicted from memory, and so it must be read from disk.
+ */
+bool log__is_evicted(struct raft_log *l, const raft_index index);
+
+/**
+ * Evict from memory the payload of the oldest entries up to @index (included),
+ * until the total size of the payloads held in memory drops to @max_bytes or
+ * below. Only entries which are not referenced by in-flight I/O are evicted,
+ * and configuration entries are always kept.
+ */
+void log__evict(struct raft_log *l, raft_index index, const size_t max_bytes);
+
 #endif /* RAFT_LOG_H */
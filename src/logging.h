@@ -10,12 +10,19 @@
 #include "../include/raft.h"
 
 /**
- * Emit a log message with a certain level.
+ * Emit a log message with a certain level, unless it's below the level of the
+ * given I/O backend, in which case the arguments are not even evaluated.
  */
-#define debugf(IO, FORMAT, ...) IO->emit(IO, RAFT_DEBUG, FORMAT, ##__VA_ARGS__);
-#define infof(IO, FORMAT, ...) IO->emit(IO, RAFT_INFO, FORMAT, ##__VA_ARGS__);
-#define warnf(IO, FORMAT, ...) IO->emit(IO, RAFT_WARN, FORMAT, ##__VA_ARGS__);
-#define errorf(IO, FORMAT, ...) IO->emit(IO, RAFT_ERROR, FORMAT, ##__VA_ARGS__);
+#define emitf(IO, LEVEL, FORMAT, ...)                       \
+    do {                                                    \
+        if (LEVEL >= (IO)->log_level) {                     \
+            (IO)->emit(IO, LEVEL, FORMAT, ##__VA_ARGS__);   \
+        }                                                   \
+    } while (0);
+#define debugf(IO, FORMAT, ...) emitf(IO, RAFT_DEBUG, FORMAT, ##__VA_ARGS__)
+#define infof(IO, FORMAT, ...) emitf(IO, RAFT_INFO, FORMAT, ##__VA_ARGS__)
+#define warnf(IO, FORMAT, ...) emitf(IO, RAFT_WARN, FORMAT, ##__VA_ARGS__)
+#define errorf(IO, FORMAT, ...) emitf(IO, RAFT_ERROR, FORMAT, ##__VA_ARGS__)
 
 /**
  * Emit a message to the given stream.
@@ -1,3 +1,5 @@
+#include <limits.h>
+
 #include "../include/raft.h"
 
 #include "assert.h"
@@ -24,13 +26,21 @@ int raft_membership__can_change_configuration(struct raft *r)
         return rv;
     }
 
+    /* The configuration leaving a joint one is about to be appended. */
+    if (configuration__is_joint(&r->configuration)) {
+        rv = RAFT_ERR_CONFIGURATION_BUSY;
+        return rv;
+    }
+
     /* In order to become leader at all we are supposed to have committed at
      * least the initial configuration at index 1. */
     assert(r->configuration_index > 0);
 
     /* The index of the last committed configuration can't be greater than the
-     * last log index. */
-    assert(log__last_index(&r->log) >= r->configuration_index);
+     * last log index, or than the last snapshot index if no entry was retained
+     * after it. */
+    assert(log__last_index(&r->log) >= r->configuration_index ||
+           r->snapshot.index >= r->configuration_index);
 
     /* No catch-up round should be in progress. */
     assert(r->leader_state.round_number == 0);
@@ -40,6 +50,44 @@ int raft_membership__can_change_configuration(struct raft *r)
     return 0;
 }
 
+/* Reset the state of the catch-up round. */
+static void reset_catch_up_round(struct raft *r)
+{
+    r->leader_state.round_number = 0;
+    r->leader_state.round_index = 0;
+    r->leader_state.round_duration = 0;
+    r->leader_state.round_start = 0;
+    r->leader_state.round_deadline = 0;
+    r->leader_state.round_idle = 0;
+}
+
+/* Return the maximum duration of a round that has to replicate @n entries to
+ * the server being promoted, given that the round that just terminated has
+ * replicated @progress entries in @duration milliseconds. */
+static unsigned catch_up_deadline(struct raft *r,
+                                  raft_index n,
+                                  raft_index progress,
+                                  unsigned duration)
+{
+    unsigned long long deadline;
+
+    if (progress == 0) {
+        return r->election_timeout;
+    }
+
+    deadline = (unsigned long long)n * duration / progress;
+    deadline *= RAFT_MEMBERSHIP__CATCH_UP_SLACK;
+
+    if (deadline < r->election_timeout) {
+        return r->election_timeout;
+    }
+    if (deadline > UINT_MAX) {
+        return UINT_MAX;
+    }
+
+    return (unsigned)deadline;
+}
+
 bool raft_membership__update_catch_up_round(struct raft *r)
 {
     size_t server_index;
@@ -57,6 +105,9 @@ bool raft_membership__update_catch_up_round(struct raft *r)
 
     match_index = r->leader_state.replication[server_index].match_index;
 
+    /* We get called whenever the server acknowledges new entries. */
+    r->leader_state.round_idle = 0;
+
     /* If the server did not reach the target index for this round, it did not
      * catch up. */
     if (match_index < r->leader_state.round_index) {
@@ -71,23 +122,53 @@ bool raft_membership__update_catch_up_round(struct raft *r)
     /* If the server's log is fully up-to-date or the round that just terminated
      * was fast enough, then the server as caught up. */
     if (is_up_to_date || is_fast_enough) {
-        r->leader_state.round_number = 0;
-        r->leader_state.round_index = 0;
-        r->leader_state.round_duration = 0;
-
+        reset_catch_up_round(r);
         return true;
     }
 
     /* If we get here it means that this catch-up round is complete, but there
      * are more entries to replicate, or it was not fast enough. Let's start a
-     * new round. */
+     * new round, whose deadline is based on the throughput that the server has
+     * shown in this one, so servers with a lot of entries to catch up with get
+     * promoted as long as they keep up. */
+    r->leader_state.round_deadline = catch_up_deadline(
+        r, last_index - match_index, match_index - r->leader_state.round_start,
+        r->leader_state.round_duration);
     r->leader_state.round_number++;
     r->leader_state.round_index = last_index;
     r->leader_state.round_duration = 0;
+    r->leader_state.round_start = match_index;
 
     return false;
 }
 
+bool raft_membership__abort_catch_up(struct raft *r)
+{
+    bool is_unresponsive;
+    bool is_too_slow;
+    bool is_not_converging;
+
+    assert(r->state == RAFT_LEADER);
+    assert(r->leader_state.promotee_id != 0);
+
+    is_unresponsive =
+        r->leader_state.round_idle > RAFT_MEMBERSHIP__MAX_CATCH_UP_IDLE;
+    is_too_slow =
+        r->leader_state.round_deadline > 0 &&
+        r->leader_state.round_duration > r->leader_state.round_deadline;
+    is_not_converging =
+        r->leader_state.round_number > RAFT_MEMBERSHIP__MAX_CATCH_UP_ROUNDS;
+
+    if (!is_unresponsive && !is_too_slow && !is_not_converging) {
+        return false;
+    }
+
+    r->leader_state.promotee_id = 0;
+    reset_catch_up_round(r);
+
+    return true;
+}
+
 int raft_membership__apply(struct raft *r,
                            const raft_index index,
                            const struct raft_entry *entry)
@@ -14,6 +14,24 @@
  */
 int raft_membership__can_change_configuration(struct raft *r);
 
+/**
+ * Maximum number of catch-up rounds for promoting a server.
+ */
+#define RAFT_MEMBERSHIP__MAX_CATCH_UP_ROUNDS 10
+
+/**
+ * Number of milliseconds after which a server promotion will be aborted if the
+ * server being promoted hasn't made any progress in catching up with the logs.
+ */
+#define RAFT_MEMBERSHIP__MAX_CATCH_UP_IDLE (30 * 1000)
+
+/**
+ * Factor applied to the duration that a catch-up round is expected to take,
+ * based on the throughput measured in the previous round, to obtain its
+ * deadline.
+ */
+#define RAFT_MEMBERSHIP__CATCH_UP_SLACK 2
+
 /**
  * Update the information about the progress that the non-voting server
  * currently being promoted is making in catching with logs.
@@ -26,6 +44,15 @@ int raft_membership__can_change_configuration(struct raft *r);
  */
 bool raft_membership__update_catch_up_round(struct raft *r);
 
+/**
+ * Return true if the promotion in progress must be aborted, either because the
+ * server being promoted has stopped making progress, because the current round
+ * has exceeded the deadline computed from the throughput of the previous one,
+ * or because the maximum number of rounds has been reached without catching
+ * up. In that case the catch-up round state is reset.
+ */
+bool raft_membership__abort_catch_up(struct raft *r);
+
 /**
  * Update the local configuration replacing it with the content of the given
  * RAFT_CONFIGURATION entry, which has just been received in as part of an
@@ -0,0 +1,63 @@
+#include "pool.h"
+#include "assert.h"
+
+void pool__init(struct raft_pool *p)
+{
+    p->free = NULL;
+    p->n_free = 0;
+    p->n_used = 0;
+    p->peak = 0;
+}
+
+void pool__close(struct raft_pool *p)
+{
+    assert(p->n_used == 0);
+
+    while (p->free != NULL) {
+        void *obj = p->free;
+        p->free = *(void **)obj;
+        raft_free(obj);
+    }
+    p->n_free = 0;
+}
+
+void *pool__get(struct raft_pool *p, size_t size)
+{
+    void *obj;
+
+    assert(size >= sizeof(void *));
+
+    if (p->free != NULL) {
+        obj = p->free;
+        p->free = *(void **)obj;
+        p->n_free--;
+    } else {
+        obj = raft_malloc(size);
+        if (obj == NULL) {
+            return NULL;
+        }
+    }
+
+    p->n_used++;
+    if (p->n_used > p->peak) {
+        p->peak = p->n_used;
+    }
+
+    return obj;
+}
+
+void pool__put(struct raft_pool *p, void *obj)
+{
+    assert(p->n_used > 0);
+
+    p->n_used--;
+
+    if (p->n_free >= p->peak || p->n_free >= POOL__MAX_FREE) {
+        raft_free(obj);
+        return;
+    }
+
+    *(void **)obj = p->free;
+    p->free = obj;
+    p->n_free++;
+}
@@ -0,0 +1,41 @@
+/**
+ * Free-lists of fixed-size objects.
+ *
+ * A pool keeps the objects released to it, up to the highest number of objects
+ * that were in use at the same time, so in steady state getting an object
+ * doesn't hit the allocator.
+ */
+
+#ifndef RAFT_POOL_H
+#define RAFT_POOL_H
+
+#include "../include/raft.h"
+
+/**
+ * Maximum number of free objects retained by a pool.
+ */
+#define POOL__MAX_FREE 64
+
+/**
+ * Initialize an empty pool.
+ */
+void pool__init(struct raft_pool *p);
+
+/**
+ * Release all free objects of the pool. All objects must have been put back.
+ */
+void pool__close(struct raft_pool *p);
+
+/**
+ * Get an object of the given size, which must be the same for all objects of
+ * the pool and at least the size of a pointer. Return NULL if a new object is
+ * needed and no memory is available.
+ */
+void *pool__get(struct raft_pool *p, size_t size);
+
+/**
+ * Put back an object obtained with pool__get().
+ */
+void pool__put(struct raft_pool *p, void *obj);
+
+#endif /* RAFT_POOL_H */
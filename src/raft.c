@@ -3,15 +3,30 @@
 #include "../include/raft.h"
 
 #include "assert.h"
+#include "bucket.h"
+#include "client.h"
 #include "configuration.h"
 #include "election.h"
 #include "log.h"
 #include "logging.h"
+#include "pool.h"
+#include "queue.h"
 #include "state.h"
 
 #define DEFAULT_ELECTION_TIMEOUT 1000 /* One second */
 #define DEFAULT_HEARTBEAT_TIMEOUT 100 /* One tenth of a second */
+#define DEFAULT_READ_LEASE_TIMEOUT 0 /* Disabled */
+#define DEFAULT_CONTACT_TIMEOUT 5000 /* Five seconds */
 #define DEFAULT_SNAPSHOT_THRESHOLD 1024
+#define DEFAULT_SNAPSHOT_THRESHOLD_BYTES 0 /* Disabled */
+#define DEFAULT_SNAPSHOT_THRESHOLD_RATIO 0 /* Disabled */
+#define DEFAULT_SNAPSHOT_TRAILING 100
+#define DEFAULT_SNAPSHOT_TRAILING_BYTES 0 /* No limit */
+#define DEFAULT_SNAPSHOT_CHUNK_SIZE (4 * 1024 * 1024)
+#define DEFAULT_SNAPSHOT_DEFERRAL_FACTOR 4
+#define DEFAULT_APPEND_MAX_ENTRIES 0 /* No limit */
+#define DEFAULT_APPEND_MAX_BYTES (4 * 1024 * 1024)
+#define DEFAULT_APPEND_MAX_INFLIGHT_BYTES (16 * 1024 * 1024)
 
 /* Set to 1 to enable tracing. */
 #if 0
@@ -49,22 +64,106 @@ int raft_init(struct raft *r,
     r->configuration_uncommitted_index = 0;
     r->election_timeout = DEFAULT_ELECTION_TIMEOUT;
     r->heartbeat_timeout = DEFAULT_HEARTBEAT_TIMEOUT;
+    r->read_lease_timeout = DEFAULT_READ_LEASE_TIMEOUT;
+    r->hibernate_timeout = 0;
+    r->contact_timeout = DEFAULT_CONTACT_TIMEOUT;
+    r->probe_strategy = RAFT_PROBE_HEARTBEAT;
+    r->pre_vote = false;
+    r->apply_forwarding = false;
+    r->apply_batching = false;
+    r->append_limits.max_entries = DEFAULT_APPEND_MAX_ENTRIES;
+    r->append_limits.max_bytes = DEFAULT_APPEND_MAX_BYTES;
+    r->append_limits.max_inflight_bytes = DEFAULT_APPEND_MAX_INFLIGHT_BYTES;
+    r->learners.custom_limits = false;
+    r->learners.append_limits = r->append_limits;
+    r->learners.heartbeat_timeout = 0;
+    r->backpressure.max_bytes = 0;
+    r->backpressure.rejecting = false;
+    r->log_cache_size = 0;
+    r->group_commit.enabled = false;
+    r->group_commit.scheduled = false;
+    r->group_commit.index = 0;
+    r->broadcast.messages = NULL;
+    r->ack_batch.enabled = false;
+    r->ack_batch.max_delay = 0;
+    r->ack_batch.scheduled = false;
+    r->ack_batch.term = 0;
+    r->ack_batch.leader_id = 0;
+    r->ack_batch.time = 0;
+    r->commit_notify.enabled = false;
+    r->commit_notify.scheduled = false;
+    r->apply_budget.max_entries = 0;
+    r->apply_budget.n = 0;
+    r->apply_budget.scheduled = false;
+    r->background.peer_rate = 0;
+    r->background.total_rate = 0;
+    bucket__init(&r->background.bucket);
+    RAFT__QUEUE_INIT(&r->background.throttled);
+    pool__init(&r->pools.send_append_entries);
+    pool__init(&r->pools.follower_append);
+    pool__init(&r->pools.send);
+    memset(&r->counters, 0, sizeof r->counters);
     r->commit_index = 0;
     r->last_applied = 0;
+    r->batch_applied = 0;
     r->last_stored = 0;
+    r->last_applying = 0;
+    RAFT__QUEUE_INIT(&r->fsm_apply_reqs);
     r->state = RAFT_UNAVAILABLE;
     r->election_timeout_rand = 0;
+    r->election_adaptive.min = 0;
+    r->election_adaptive.max = 0;
+    r->election_adaptive.timeout = 0;
     r->last_tick = 0;
     r->timer = 0;
     r->snapshot.term = 0;
     r->snapshot.index = 0;
     r->snapshot.pending.term = 0;
+    r->snapshot.size = 0;
     r->snapshot.threshold = DEFAULT_SNAPSHOT_THRESHOLD;
+    r->snapshot.threshold_bytes = DEFAULT_SNAPSHOT_THRESHOLD_BYTES;
+    r->snapshot.threshold_ratio = DEFAULT_SNAPSHOT_THRESHOLD_RATIO;
+    r->snapshot.trailing = DEFAULT_SNAPSHOT_TRAILING;
+    r->snapshot.trailing_bytes = DEFAULT_SNAPSHOT_TRAILING_BYTES;
     r->snapshot.put.data = NULL;
+    r->snapshot.take.data = NULL;
+    r->snapshot.start = 0;
+    r->snapshot.chunk_size = DEFAULT_SNAPSHOT_CHUNK_SIZE;
+    r->snapshot.deferral.quiet = 0;
+    r->snapshot.deferral.factor = DEFAULT_SNAPSHOT_DEFERRAL_FACTOR;
+    r->snapshot.deferral.last_apply = 0;
+    r->snapshot.deferral.waiting = false;
+    r->snapshot.delegate = false;
+    r->snapshot.shared = NULL;
+    r->snapshot.patch.base = 0;
+    r->snapshot.patch.patches = NULL;
+    r->snapshot.patch.n = 0;
+    r->snapshot.patch.size = 0;
+    r->snapshot.patch.storing = false;
+    r->snapshot.stream.offset = 0;
+    r->snapshot.stream.n_pending = 0;
+    r->snapshot.stream.done = false;
+    r->snapshot.stream.status = 0;
+    r->snapshot.applied.base = 0;
+    r->snapshot.applied.index = 0;
+    r->snapshot.applied.size = 0;
+    r->snapshot.install.index = 0;
+    r->snapshot.install.term = 0;
+    r->snapshot.install.offset = 0;
+    r->snapshot.install.sender = 0;
+    r->snapshot.install.buf.base = NULL;
+    r->snapshot.install.buf.len = 0;
+    r->snapshot.received.sender = 0;
+    r->snapshot.received.start = 0;
     for (i = 0; i < RAFT_EVENT_N; i++) {
         r->watchers[i] = NULL;
     }
+    r->tracer = NULL;
     r->close_cb = NULL;
+    r->io_closed = false;
+    r->load.start = 0;
+    r->load.pending = false;
+    r->submitted = NULL;
     rv = r->io->init(r->io, r->id, r->address);
     if (rv != 0) {
         return rv;
@@ -75,15 +174,20 @@ int raft_init(struct raft *r,
 static void io_close_cb(struct raft_io *io)
 {
     struct raft *r = io->data;
-    infof(r->io, "stopped");
+    r->io_closed = true;
 
-    raft_free(r->address);
-    log__close(&r->log);
-    raft_configuration_close(&r->configuration);
+    /* Wait for the FSM to complete any pending asynchronous apply request,
+     * since they reference entries from our log. */
+    if (!RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        return;
+    }
 
-    if (r->close_cb != NULL) {
-        r->close_cb(r);
+    /* Same for an asynchronous snapshot request. */
+    if (r->snapshot.take.data != NULL) {
+        return;
     }
+
+    raft_state__close(r);
 }
 
 void raft_close(struct raft *r, void (*cb)(struct raft *r))
@@ -93,6 +197,7 @@ void raft_close(struct raft *r, void (*cb)(struct raft *r))
 
     r->close_cb = cb;
 
+    raft_client__fail_submitted(r, RAFT_ERR_SHUTDOWN);
     raft_state__clear(r);
     r->state = RAFT_UNAVAILABLE;
     r->io->close(r->io, io_close_cb);
@@ -104,11 +209,168 @@ void raft_set_election_timeout(struct raft *r, const unsigned msecs)
     raft_election__reset_timer(r);
 }
 
+void raft_set_adaptive_election_timeout(struct raft *r,
+                                        const unsigned min,
+                                        const unsigned max)
+{
+    assert(max == 0 || min <= max);
+    r->election_adaptive.min = min;
+    r->election_adaptive.max = max;
+    r->election_adaptive.timeout = 0;
+}
+
 void raft_set_heartbeat_timeout(struct raft *r, const unsigned msecs)
 {
     r->heartbeat_timeout = msecs;
 }
 
+void raft_set_read_lease_timeout(struct raft *r, const unsigned msecs)
+{
+    r->read_lease_timeout = msecs;
+}
+
+void raft_set_hibernate_timeout(struct raft *r, const unsigned msecs)
+{
+    r->hibernate_timeout = msecs;
+}
+
+void raft_set_contact_timeout(struct raft *r,
+                              const unsigned msecs,
+                              const int strategy)
+{
+    assert(strategy == RAFT_PROBE_HEARTBEAT || strategy == RAFT_PROBE_REWIND);
+    r->contact_timeout = msecs;
+    r->probe_strategy = strategy;
+}
+
+void raft_set_pre_vote(struct raft *r, const bool enabled)
+{
+    r->pre_vote = enabled;
+}
+
+void raft_set_append_entries_limits(struct raft *r,
+                                    const unsigned max_entries,
+                                    const size_t max_bytes,
+                                    const size_t max_inflight_bytes)
+{
+    r->append_limits.max_entries = max_entries;
+    r->append_limits.max_bytes = max_bytes;
+    r->append_limits.max_inflight_bytes = max_inflight_bytes;
+}
+
+void raft_set_learner_append_entries_limits(struct raft *r,
+                                            const unsigned max_entries,
+                                            const size_t max_bytes,
+                                            const size_t max_inflight_bytes)
+{
+    r->learners.custom_limits = true;
+    r->learners.append_limits.max_entries = max_entries;
+    r->learners.append_limits.max_bytes = max_bytes;
+    r->learners.append_limits.max_inflight_bytes = max_inflight_bytes;
+}
+
+void raft_set_learner_heartbeat_timeout(struct raft *r, const unsigned msecs)
+{
+    r->learners.heartbeat_timeout = msecs;
+}
+
+void raft_set_max_uncommitted_bytes(struct raft *r, const size_t max_bytes)
+{
+    r->backpressure.max_bytes = max_bytes;
+}
+
+void raft_set_log_cache_size(struct raft *r, const size_t bytes)
+{
+    r->log_cache_size = bytes;
+}
+
+void raft_set_group_commit(struct raft *r, const bool enabled)
+{
+    r->group_commit.enabled = enabled;
+}
+
+void raft_set_ack_batching(struct raft *r,
+                           const bool enabled,
+                           const unsigned max_delay)
+{
+    r->ack_batch.enabled = enabled;
+    r->ack_batch.max_delay = max_delay;
+}
+
+void raft_set_commit_notify(struct raft *r, const bool enabled)
+{
+    r->commit_notify.enabled = enabled;
+}
+
+void raft_set_apply_budget(struct raft *r, const unsigned max_entries)
+{
+    r->apply_budget.max_entries = max_entries;
+}
+
+void raft_set_tracer(struct raft *r, raft_trace_cb cb)
+{
+    r->tracer = cb;
+}
+
+void raft_set_log_level(struct raft *r, int level)
+{
+    r->io->log_level = level;
+}
+
+void raft_set_snapshot_threshold(struct raft *r,
+                                 const unsigned n,
+                                 const size_t bytes,
+                                 const unsigned ratio)
+{
+    r->snapshot.threshold = n;
+    r->snapshot.threshold_bytes = bytes;
+    r->snapshot.threshold_ratio = ratio;
+}
+
+void raft_set_snapshot_deferral(struct raft *r,
+                                const unsigned quiet,
+                                const unsigned factor)
+{
+    r->snapshot.deferral.quiet = quiet;
+    r->snapshot.deferral.factor = factor;
+}
+
+void raft_set_snapshot_trailing(struct raft *r,
+                                const unsigned n,
+                                const size_t bytes)
+{
+    r->snapshot.trailing = n;
+    r->snapshot.trailing_bytes = bytes;
+}
+
+void raft_set_snapshot_chunk_size(struct raft *r, const size_t size)
+{
+    r->snapshot.chunk_size = size;
+}
+
+void raft_set_snapshot_delegation(struct raft *r, const bool enabled)
+{
+    r->snapshot.delegate = enabled;
+}
+
+void raft_set_background_rate(struct raft *r,
+                              const size_t peer_rate,
+                              const size_t total_rate)
+{
+    r->background.peer_rate = peer_rate;
+    r->background.total_rate = total_rate;
+}
+
+void raft_set_apply_forwarding(struct raft *r, const bool enabled)
+{
+    r->apply_forwarding = enabled;
+}
+
+void raft_set_apply_batching(struct raft *r, const bool enabled)
+{
+    r->apply_batching = enabled;
+}
+
 const char *raft_state_name(struct raft *r)
 {
     return raft_state_names[r->state];
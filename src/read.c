@@ -0,0 +1,424 @@
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "io.h"
+#include "log.h"
+#include "logging.h"
+#include "queue.h"
+#include "read.h"
+#include "replication.h"
+#include "tick.h"
+#include "trace.h"
+
+void read__new_round(struct raft *r)
+{
+    assert(r->state == RAFT_LEADER);
+    r->leader_state.seq++;
+    r->leader_state.prev_seq_time = r->leader_state.seq_time;
+    r->leader_state.seq_time = io__time(r->io);
+}
+
+raft_time read__round_time(const struct raft *r, raft_index seq)
+{
+    assert(r->state == RAFT_LEADER);
+    if (seq == r->leader_state.seq) {
+        return r->leader_state.seq_time;
+    }
+    if (seq + 1 == r->leader_state.seq) {
+        return r->leader_state.prev_seq_time;
+    }
+    return 0;
+}
+
+/* Start a new heartbeat round and send an AppendEntries RPC to all the other
+ * voting servers, regardless of when we last heard from them, since only
+ * results echoing the new round can confirm our leadership for the pending
+ * reads. */
+static void send_heartbeats(struct raft *r)
+{
+    size_t i;
+    int rv;
+
+    read__new_round(r);
+
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+
+        if (server->id == r->id || !server->voting) {
+            continue;
+        }
+
+        rv = raft_replication__send_append_entries(r, i);
+        if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+            /* This is not a critical failure, let's just log it. */
+            warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
+                  server->id, raft_strerror(rv), rv);
+        }
+    }
+}
+
+static void forward_send_cb(struct raft_io_send *req, int status)
+{
+    (void)status;
+    raft_free(req);
+}
+
+/* Send a single ReadIndex RPC to the current leader on behalf of all the read
+ * requests which haven't been forwarded yet. If sending fails, the RPC will be
+ * retried once it times out. */
+static void forward_reads(struct raft *r)
+{
+    const struct raft_server *leader;
+    struct raft_message message;
+    struct raft_io_send *req;
+    raft__queue *head;
+    bool pending = false;
+    int rv;
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    if (r->follower_state.read_inflight ||
+        r->follower_state.current_leader.id == 0) {
+        return;
+    }
+
+    RAFT__QUEUE_FOREACH(head, &r->follower_state.read_reqs)
+    {
+        struct raft_read *read = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        if (!read->confirmed) {
+            read->confirmed = true;
+            pending = true;
+        }
+    }
+
+    if (!pending) {
+        return;
+    }
+
+    r->follower_state.read_id++;
+    r->follower_state.read_time = io__time(r->io);
+    r->follower_state.read_inflight = true;
+
+    leader = configuration__get(&r->configuration,
+                                r->follower_state.current_leader.id);
+    if (leader == NULL) {
+        return;
+    }
+
+    message.type = RAFT_IO_READ_INDEX;
+    message.server_id = leader->id;
+    message.server_address = leader->address;
+    message.read_index.term = r->current_term;
+    message.read_index.id = r->follower_state.read_id;
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return;
+    }
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, forward_send_cb);
+    if (rv != 0) {
+        debugf(r->io, "forward read requests: %s", raft_strerror(rv));
+        raft_free(req);
+    }
+}
+
+/* Handle a read request submitted to a follower. */
+static int follower_read_index(struct raft *r,
+                               struct raft_read *req,
+                               raft_read_cb cb)
+{
+    if (r->follower_state.current_leader.id == 0) {
+        return RAFT_ERR_NOT_LEADER;
+    }
+
+    req->index = 0;
+    req->time = io__time(r->io);
+    req->confirmed = false;
+    req->cb = cb;
+
+    RAFT__QUEUE_PUSH(&r->follower_state.read_reqs, &req->queue);
+
+    forward_reads(r);
+
+    /* Make sure we'll retry forwarding at the next heartbeat timeout. */
+    tick__schedule(r);
+
+    return 0;
+}
+
+int raft_read_index(struct raft *r, struct raft_read *req, raft_read_cb cb)
+{
+    struct raft_read *last = NULL;
+
+    assert(r != NULL);
+    assert(req != NULL);
+
+    /* Reads need a round of heartbeats, or a leader to forward them to. */
+    tick__wake(r);
+
+    if (r->state == RAFT_FOLLOWER) {
+        return follower_read_index(r, req, cb);
+    }
+
+    if (r->state != RAFT_LEADER) {
+        return RAFT_ERR_NOT_LEADER;
+    }
+
+    debugf(r->io, "read index request: commit index %lld", r->commit_index);
+
+    if (!RAFT__QUEUE_IS_EMPTY(&r->leader_state.read_reqs)) {
+        raft__queue *tail = RAFT__QUEUE_TAIL(&r->leader_state.read_reqs);
+        last = RAFT__QUEUE_DATA(tail, struct raft_read, queue);
+    }
+
+    req->index = r->commit_index;
+    req->time = io__time(r->io);
+    req->seq = r->leader_state.seq + 1;
+    req->confirmed = false;
+    req->cb = cb;
+
+    RAFT__QUEUE_PUSH(&r->leader_state.read_reqs, &req->queue);
+
+    /* While a round is in flight, reads wait for the next one, which starts
+     * once the current one is confirmed and is shared by all of them. */
+    if (last == NULL || last->confirmed) {
+        send_heartbeats(r);
+    }
+
+    return 0;
+}
+
+/* Return true if a majority of voting servers has acknowledged us as leader
+ * with results echoing the given heartbeat round, or a later one. */
+static bool is_confirmed(struct raft *r, raft_index seq)
+{
+    size_t i;
+    struct configuration__quorum acks;
+
+    configuration__quorum_init(&acks);
+
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+
+        if (server->id == r->id ||
+            r->leader_state.replication[i].ack_seq >= seq) {
+            configuration__quorum_add(&r->configuration, i, &acks);
+        }
+    }
+
+    return configuration__quorum_reached(&r->configuration, &acks);
+}
+
+/* Return true if a majority of voting servers has acknowledged us as leader
+ * with results echoing heartbeat rounds started since the given time. */
+static bool is_acked_since(struct raft *r, raft_time time)
+{
+    size_t i;
+    struct configuration__quorum acks;
+
+    configuration__quorum_init(&acks);
+
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+
+        if (server->id == r->id ||
+            r->leader_state.replication[i].ack_time >= time) {
+            configuration__quorum_add(&r->configuration, i, &acks);
+        }
+    }
+
+    return configuration__quorum_reached(&r->configuration, &acks);
+}
+
+/* Return true if an entry of the current term has been committed, meaning that
+ * the commit index is up-to-date (Section 6.4). */
+static bool has_committed_in_current_term(struct raft *r)
+{
+    if (r->commit_index == r->snapshot.index) {
+        return r->snapshot.term == r->current_term;
+    }
+    return log__term_of(&r->log, r->commit_index) == r->current_term;
+}
+
+/* Return true if a majority of voting servers has acknowledged us with results
+ * echoing heartbeat rounds started within the read lease timeout. Those servers
+ * heard from us after their round started, and followers don't grant votes
+ * while they have a leader, so no other leader can be elected before the lease
+ * expires, clock drift permitting.
+ *
+ * The target of a leadership transfer doesn't wait for that, and followers vote
+ * for it even if they have a leader, so there's no lease while a transfer is in
+ * progress, nor for an election timeout after TimeoutNow was sent, since the
+ * target might still be running its election after the transfer timed out. */
+static bool has_read_lease(struct raft *r)
+{
+    raft_time now = io__time(r->io);
+
+    if (r->read_lease_timeout == 0 || now < r->read_lease_timeout) {
+        return false;
+    }
+
+    if (r->leader_state.transfer != NULL ||
+        (r->leader_state.timeout_now != 0 &&
+         now - r->leader_state.timeout_now < r->election_timeout)) {
+        return false;
+    }
+
+    return is_acked_since(r, now - r->read_lease_timeout);
+}
+
+int raft_read_lease(struct raft *r, struct raft_read *req, raft_read_cb cb)
+{
+    assert(r != NULL);
+    assert(req != NULL);
+
+    if (r->state == RAFT_LEADER && has_read_lease(r) &&
+        has_committed_in_current_term(r) &&
+        r->last_applied >= r->commit_index) {
+        req->index = r->commit_index;
+        req->time = io__time(r->io);
+        req->confirmed = true;
+        req->cb = cb;
+        if (cb != NULL) {
+            cb(req, 0);
+        }
+        return 0;
+    }
+
+    return raft_read_index(r, req, cb);
+}
+
+/* Fire the callbacks of the read requests forwarded by this follower whose
+ * read index has been applied, and retry forwarding the others if needed. */
+static void follower_process(struct raft *r)
+{
+    raft_time now = io__time(r->io);
+    raft__queue *head;
+
+    head = RAFT__QUEUE_HEAD(&r->follower_state.read_reqs);
+    while (head != &r->follower_state.read_reqs) {
+        struct raft_read *req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        head = RAFT__QUEUE_NEXT(head);
+
+        if (req->index == 0 || r->last_applied < req->index) {
+            continue;
+        }
+
+        RAFT__QUEUE_REMOVE(&req->queue);
+        if (req->cb != NULL) {
+            req->cb(req, 0);
+        }
+    }
+
+    /* If the leader didn't answer in time, it might have never received the
+     * RPC or it might not be the leader anymore, so send it again. */
+    if (r->follower_state.read_inflight &&
+        now - r->follower_state.read_time >= r->election_timeout) {
+        r->follower_state.read_inflight = false;
+        RAFT__QUEUE_FOREACH(head, &r->follower_state.read_reqs)
+        {
+            struct raft_read *req;
+            req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+            if (req->index == 0) {
+                req->confirmed = false;
+            }
+        }
+    }
+
+    forward_reads(r);
+}
+
+void read__recv_result(struct raft *r,
+                       const struct raft_read_index_result *result)
+{
+    raft__queue *head;
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    if (!r->follower_state.read_inflight ||
+        result->id != r->follower_state.read_id) {
+        debugf(r->io, "stale read index result -> ignore");
+        return;
+    }
+
+    r->follower_state.read_inflight = false;
+
+    head = RAFT__QUEUE_HEAD(&r->follower_state.read_reqs);
+    while (head != &r->follower_state.read_reqs) {
+        struct raft_read *req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        head = RAFT__QUEUE_NEXT(head);
+
+        if (!req->confirmed || req->index != 0) {
+            continue;
+        }
+
+        /* The server we asked is not the leader anymore. */
+        if (result->index == 0) {
+            RAFT__QUEUE_REMOVE(&req->queue);
+            if (req->cb != NULL) {
+                req->cb(req, RAFT_ERR_NOT_LEADER);
+            }
+            continue;
+        }
+
+        req->index = result->index;
+    }
+
+    follower_process(r);
+}
+
+void read__process(struct raft *r)
+{
+    raft__queue *head;
+    bool committed;
+    bool in_flight = false;
+    bool next = false;
+
+    assert(r->state == RAFT_LEADER || r->state == RAFT_FOLLOWER);
+
+    if (r->state == RAFT_FOLLOWER) {
+        follower_process(r);
+        return;
+    }
+
+    committed = has_committed_in_current_term(r);
+
+    head = RAFT__QUEUE_HEAD(&r->leader_state.read_reqs);
+    while (head != &r->leader_state.read_reqs) {
+        struct raft_read *req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        head = RAFT__QUEUE_NEXT(head);
+
+        if (!req->confirmed) {
+            if (!committed || !is_confirmed(r, req->seq)) {
+                if (req->seq <= r->leader_state.seq) {
+                    in_flight = true;
+                } else {
+                    next = true;
+                }
+                continue;
+            }
+            req->confirmed = true;
+            if (req->index < r->commit_index) {
+                req->index = r->commit_index;
+            }
+        }
+
+        if (r->last_applied < req->index) {
+            continue;
+        }
+
+        RAFT__QUEUE_REMOVE(&req->queue);
+        if (req->cb != NULL) {
+            req->cb(req, 0);
+        }
+    }
+
+    /* Start the round that the reads submitted while the last one was in
+     * flight are waiting for. */
+    if (next && !in_flight) {
+        send_heartbeats(r);
+    }
+}
@@ -0,0 +1,37 @@
+/**
+ * Serve linearizable read requests using the ReadIndex protocol.
+ */
+
+#ifndef RAFT_READ_H
+#define RAFT_READ_H
+
+#include "../include/raft.h"
+
+/**
+ * Fire the callbacks of the outstanding read requests whose leadership check
+ * has completed and whose read index has been applied.
+ *
+ * On followers, also forward to the leader any read request which hasn't been
+ * forwarded yet, or whose ReadIndex RPC timed out.
+ */
+void read__process(struct raft *r);
+
+/**
+ * Start a new heartbeat round: the AppendEntries RPCs sent from now on confirm
+ * the leadership of this server for the read requests submitted so far.
+ */
+void read__new_round(struct raft *r);
+
+/**
+ * Return when the given heartbeat round started, or 0 if it's older than the
+ * previous one.
+ */
+raft_time read__round_time(const struct raft *r, raft_index seq);
+
+/**
+ * Handle the result of a ReadIndex RPC sent by this follower to the leader.
+ */
+void read__recv_result(struct raft *r,
+                       const struct raft_read_index_result *result);
+
+#endif /* RAFT_READ_H */
@@ -1,15 +1,30 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "assert.h"
+#include "bucket.h"
+#include "client.h"
 #include "configuration.h"
+#include "election.h"
+#include "entry.h"
 #include "error.h"
+#include "interval.h"
+#include "io.h"
 #include "log.h"
 #include "logging.h"
 #include "membership.h"
+#include "pool.h"
 #include "queue.h"
+#include "read.h"
 #include "replication.h"
 #include "snapshot.h"
 #include "state.h"
+#include "tick.h"
+#include "trace.h"
+#include "trace.h"
+#include "transfer.h"
 #include "watch.h"
 
 #ifndef max
@@ -32,20 +47,54 @@
  */
 struct send_append_entries
 {
-    struct raft *raft;          /* Instance that has submitted the request */
-    raft_index index;           /* Index of the first entry in the request. */
-    struct raft_entry *entries; /* Entries referenced in the request. */
-    unsigned n;                 /* Length of the entries array. */
+    struct raft *raft;         /* Instance that has submitted the request */
+    struct log__view view;     /* Entries referenced in the request. */
+    raft_term term;            /* Term the request was sent in. */
+    unsigned server_id;        /* ID of the receiving follower. */
+    size_t size;               /* Total size of the entries payload. */
+    raft_term prev_log_term;   /* Term of the entry preceeding the view. */
+    bool from_disk;            /* Whether the entries are read from disk. */
+    struct raft_entry *loaded; /* Entries read from disk, if any. */
+    unsigned n_loaded;         /* Length of the loaded array. */
+    unsigned skip;             /* N. of loaded entries preceeding the view. */
+    struct raft_entry *stripped; /* Entries sent to a witness, if any. */
+    struct raft_io_read read;
     struct raft_io_send req;
 };
 
+/* Snapshot loaded whole with raft_io->snapshot_get, shared by all transfers
+ * sending it at the same time. */
+struct shared_snapshot
+{
+    struct raft *raft;
+    raft_index index;               /* Index of our last snapshot at load */
+    struct raft_snapshot *snapshot; /* Loaded snapshot, or NULL if loading */
+    unsigned refs;                  /* Transfers using it, plus the load */
+    void *waiting[2];               /* Transfers waiting for the load */
+    struct raft_io_snapshot_get get;
+};
+
 struct send_install_snapshot
 {
     struct raft *raft;
     struct raft_snapshot *snapshot;
-    struct raft_io_snapshot_get get;
+    struct shared_snapshot *shared; /* Shared snapshot, if loaded whole */
+    struct raft_io_snapshot_read read;
     struct raft_io_send send;
     unsigned server_id; /* ID of follower server to send the snapshot to */
+    unsigned leader_id; /* ID of the leader the snapshot is sent for */
+    bool witness;       /* Whether the follower is a witness */
+    raft_term term;     /* Term the transfer was started in */
+    size_t offset;      /* Offset of the next chunk to send */
+    size_t base;        /* Offset of the data held in snapshot */
+    size_t size;        /* Total size of the snapshot data */
+    size_t n_bytes;     /* Amount of data actually sent */
+    raft_time start;    /* When the transfer was started */
+
+    /* Budget of the transfer, and link in the queue of throttled ones, or of
+     * the ones waiting for the snapshot to be loaded. */
+    struct raft_bucket bucket;
+    void *queue[2];
 };
 
 struct recv_install_snapshot
@@ -54,6 +103,20 @@ struct recv_install_snapshot
     struct raft_snapshot snapshot;
 };
 
+/* Chunk of a snapshot being received, written with raft_io->snapshot_put_chunk.
+ * The configuration is only set for the last chunk. */
+struct recv_snapshot_chunk
+{
+    struct raft *raft;
+    struct raft_snapshot snapshot;
+    struct raft_buffer buf;
+    bool done;
+    struct raft_io_snapshot_put put;
+    struct raft_io_snapshot_get get;
+    struct raft_io_snapshot_read read;
+    size_t offset; /* Offset of the next chunk to restore */
+};
+
 /**
  * Hold context for an append request that was submitted by a leader.
  */
@@ -72,6 +135,151 @@ struct raft_replication__follower_append
     struct raft_append_entries args;
 };
 
+/**
+ * Return true if the I/O backend keeps a hint of the commit index.
+ */
+static bool has_commit_hint(struct raft *r)
+{
+    return r->io->version >= 8 && r->io->set_commit != NULL &&
+           r->io->load_commit != NULL;
+}
+
+/**
+ * Update the commit index hint of the I/O backend. The hint must not cover
+ * entries that are not durable yet, since after a restart they might be missing
+ * or still be the ones they are replacing.
+ */
+static void update_commit_hint(struct raft *r)
+{
+    if (has_commit_hint(r)) {
+        r->io->set_commit(r->io, min(r->commit_index, r->last_stored));
+    }
+}
+
+/**
+ * Update the commit index, counting the newly committed entries and notifying
+ * watchers if it advanced.
+ */
+static void set_commit_index(struct raft *r, raft_index index)
+{
+    raft_index old = r->commit_index;
+
+    r->commit_index = index;
+    if (index > old) {
+        r->counters.n_committed += index - old;
+        trace__point(r, commit, RAFT_TRACE_COMMIT, 0, 0, r->current_term,
+                     index, 0, 0);
+        raft_watch__commit_advanced(r, index);
+        update_commit_hint(r);
+    }
+}
+
+int raft_replication__restore_commit(struct raft *r)
+{
+    raft_index index;
+
+    if (!has_commit_hint(r)) {
+        return 0;
+    }
+
+    /* Entries beyond our last one might have been lost, since the hint can be
+     * more recent than what we had persisted. */
+    index = min(r->io->load_commit(r->io), log__last_index(&r->log));
+    if (index <= r->commit_index) {
+        return 0;
+    }
+
+    r->commit_index = index;
+
+    return raft_replication__apply(r);
+}
+
+/**
+ * Return the index of the follower an AppendEntries request was submitted for,
+ * or the number of servers in the configuration if we have stepped down in the
+ * meantime or the follower was removed, in which case the replication state
+ * the request was accounted in is gone.
+ */
+static size_t send_append_entries_server_index(
+    struct raft *r,
+    const struct send_append_entries *request)
+{
+    if (r->state != RAFT_LEADER || r->current_term != request->term) {
+        return r->configuration.n;
+    }
+    return configuration__index_of(&r->configuration, request->server_id);
+}
+
+/**
+ * Free up @size bytes of the in-flight window of the given follower.
+ */
+static void release_inflight_bytes(struct raft_replication *replication,
+                                   size_t size)
+{
+    if (replication->inflight_bytes >= size) {
+        replication->inflight_bytes -= size;
+    } else {
+        replication->inflight_bytes = 0;
+    }
+}
+
+/**
+ * Return how many bytes of background data can be sent right now to a server
+ * with the given budget, taking into account the one shared by all servers.
+ *
+ * Servers that are not among the fastest ones forming a quorum leave half of
+ * the shared budget to the others, so that a lagging follower needed to commit
+ * entries quickly can always catch up. In the long run they can still use the
+ * whole rate, keeping the shared bucket half full.
+ */
+static size_t background_budget(struct raft *r,
+                                struct raft_bucket *bucket,
+                                bool fast)
+{
+    raft_time now = io__time(r->io);
+    size_t peer = bucket__available(bucket, r->background.peer_rate, now);
+    size_t total = bucket__available(&r->background.bucket,
+                                     r->background.total_rate, now);
+    if (!fast && r->background.total_rate > 0) {
+        size_t reserve = r->background.total_rate / 2;
+        total = total > reserve ? total - reserve : 0;
+    }
+    return min(peer, total);
+}
+
+/* Account for @size bytes of background data sent to a server with the given
+ * budget. */
+static void background_take(struct raft *r,
+                            struct raft_bucket *bucket,
+                            size_t size)
+{
+    bucket__take(bucket, r->background.peer_rate, size);
+    bucket__take(&r->background.bucket, r->background.total_rate, size);
+}
+
+/**
+ * Release the entries referenced by an AppendEntries request and the request
+ * itself.
+ */
+static void send_append_entries_free(struct send_append_entries *request)
+{
+    struct raft *r = request->raft;
+
+    if (request->from_disk) {
+        /* Entries read from disk are owned by the request. */
+        entry_batches__destroy(request->loaded, request->n_loaded);
+    } else {
+        /* Tell the log that we're done referencing these entries. */
+        log__release_view(&r->log, &request->view);
+    }
+
+    if (request->stripped != NULL) {
+        raft_free(request->stripped);
+    }
+
+    pool__put(&r->pools.send_append_entries, request);
+}
+
 /**
  * Callback invoked after request to send an AppendEntries RPC has completed.
  */
@@ -80,1281 +288,4095 @@ static void raft_replication__send_append_entries_cb(struct raft_io_send *req,
 {
     struct send_append_entries *request = req->data;
     struct raft *r = request->raft;
+    size_t i;
 
     debugf(r->io, "send append entries completed: status %d", status);
 
-    /* Tell the log that we're done referencing these entries. */
-    log__release(&r->log, request->index, request->entries, request->n);
+    i = send_append_entries_server_index(r, request);
+    if (i < r->configuration.n) {
+        release_inflight_bytes(&r->leader_state.replication[i], request->size);
+    }
 
-    raft_free(request);
+    send_append_entries_free(request);
 }
 
-static void send_install_snapshot_cb(struct raft_io_send *req, int status)
+/**
+ * Return the replication state of the follower a snapshot is being sent to, or
+ * NULL if we have stepped down in the meantime or the transfer was abandoned.
+ */
+static struct raft_replication *send_install_snapshot_replication(
+    struct raft *r,
+    const struct send_install_snapshot *request)
+{
+    struct raft_replication *replication;
+    size_t i;
+
+    if (r->state != RAFT_LEADER || r->current_term != request->term) {
+        return NULL;
+    }
+    i = configuration__index_of(&r->configuration, request->server_id);
+    if (i == r->configuration.n) {
+        return NULL;
+    }
+    replication = &r->leader_state.replication[i];
+    if (!replication->sending_snapshot) {
+        return NULL;
+    }
+
+    return replication;
+}
+
+/* Return true if the snapshot is being sent on behalf of the leader. */
+static bool send_install_snapshot_is_delegated(
+    const struct send_install_snapshot *request)
+{
+    return request->leader_id != request->raft->id;
+}
+
+/**
+ * Return true if the snapshot transfer can go on, i.e. if we are still the
+ * leader that started it, or still the follower it was delegated to.
+ */
+static bool send_install_snapshot_is_current(
+    struct raft *r,
+    const struct send_install_snapshot *request)
+{
+    if (send_install_snapshot_is_delegated(request)) {
+        return r->state == RAFT_FOLLOWER && r->current_term == request->term &&
+               r->follower_state.snapshot_target == request->server_id &&
+               r->follower_state.snapshot_leader == request->leader_id &&
+               configuration__get(&r->configuration, request->server_id) !=
+                   NULL;
+    }
+
+    return send_install_snapshot_replication(r, request) != NULL;
+}
+
+static void send_snapshot_result_cb(struct raft_io_send *req, int status)
+{
+    struct raft *r = req->data;
+    (void)status;
+    pool__put(&r->pools.send, req);
+}
+
+int raft_replication__report_snapshot(struct raft *r,
+                                      unsigned leader_id,
+                                      const char *address,
+                                      unsigned server_id,
+                                      raft_index last_index,
+                                      bool done)
+{
+    struct raft_message message;
+    struct raft_send_snapshot_result *result = &message.send_snapshot_result;
+    struct raft_io_send *req;
+    int rv;
+
+    result->term = r->current_term;
+    result->server_id = server_id;
+    result->last_index = last_index;
+    result->done = done;
+
+    message.type = RAFT_IO_SEND_SNAPSHOT_RESULT;
+    message.server_id = leader_id;
+    message.server_address = address;
+
+    req = pool__get(&r->pools.send, sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+    req->data = r;
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, send_snapshot_result_cb);
+    if (rv != 0) {
+        pool__put(&r->pools.send, req);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Report the progress of a delegated snapshot transfer to the leader. */
+static void send_install_snapshot_report(struct send_install_snapshot *request,
+                                         raft_index last_index,
+                                         bool done)
 {
-    struct send_install_snapshot *request = req->data;
     struct raft *r = request->raft;
+    const struct raft_server *leader;
+    int rv;
 
-    debugf(r->io, "send install snapshot completed: status %d", status);
-    snapshot__close(request->snapshot);
-    raft_free(request->snapshot);
+    leader = configuration__get(&r->configuration, request->leader_id);
+    if (leader == NULL) {
+        return;
+    }
+
+    rv = raft_replication__report_snapshot(r, leader->id, leader->address,
+                                           request->server_id, last_index,
+                                           done);
+    if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+        warnf(r->io, "report snapshot to server %ld: %s", leader->id,
+              raft_strerror(rv));
+    }
+}
+
+/* Drop a reference to a shared snapshot, releasing it with the last one. */
+static void shared_snapshot_release(struct raft *r,
+                                    struct shared_snapshot *shared)
+{
+    assert(shared->refs > 0);
+    shared->refs--;
+    if (shared->refs > 0) {
+        return;
+    }
+    if (r->snapshot.shared == shared) {
+        r->snapshot.shared = NULL;
+    }
+    if (shared->snapshot != NULL) {
+        snapshot__close(shared->snapshot);
+        raft_free(shared->snapshot);
+    }
+    raft_free(shared);
+}
+
+/**
+ * Mark the snapshot transfer as completed and release its resources. If the
+ * snapshot was sent on behalf of the leader, let it know whether it could be
+ * sent entirely.
+ */
+static void send_install_snapshot_done(struct send_install_snapshot *request,
+                                       bool sent)
+{
+    struct raft *r = request->raft;
+    struct raft_replication *replication;
+
+    if (sent) {
+        raft_watch__lifecycle(r, RAFT_EVENT_SNAPSHOT_SENT, request->server_id,
+                              request->snapshot->index, request->start,
+                              request->n_bytes, 0);
+    }
+
+    if (send_install_snapshot_is_delegated(request)) {
+        if (send_install_snapshot_is_current(r, request)) {
+            send_install_snapshot_report(
+                request, sent ? request->snapshot->index : 0, true);
+            r->follower_state.snapshot_target = 0;
+            r->follower_state.snapshot_leader = 0;
+        }
+    } else {
+        replication = send_install_snapshot_replication(r, request);
+        if (replication != NULL) {
+            replication->sending_snapshot = false;
+        }
+    }
+    if (request->shared != NULL) {
+        shared_snapshot_release(r, request->shared);
+    } else if (request->snapshot != NULL) {
+        snapshot__close(request->snapshot);
+        raft_free(request->snapshot);
+    }
     raft_free(request);
 }
 
-static void snapshot_get_cb(struct raft_io_snapshot_get *req,
-                            struct raft_snapshot *snapshot,
-                            int status)
+/* Return true if the I/O backend can load snapshot data chunk by chunk. */
+static bool has_snapshot_read(struct raft *r)
+{
+    return r->io->version >= 4 && r->io->snapshot_read != NULL;
+}
+
+/* Return true if the I/O backend can defer work to the end of the current loop
+ * iteration. */
+static bool has_defer(struct raft *r)
+{
+    return r->io->version >= 14 && r->io->defer != NULL;
+}
+
+/* Return true if the I/O backend can read back persisted entries. */
+static bool has_read(struct raft *r)
+{
+    return r->io->version >= 13 && r->io->read != NULL &&
+           r->io->last_readable != NULL;
+}
+
+static void send_install_snapshot_cb(struct raft_io_send *req, int status);
+
+/**
+ * Send the next chunk of the snapshot, of at most chunk_size bytes.
+ */
+static int send_install_snapshot_chunk(struct send_install_snapshot *request)
 {
-    struct send_install_snapshot *request = req->data;
     struct raft *r = request->raft;
+    struct raft_snapshot *snapshot = request->snapshot;
     struct raft_message message;
     struct raft_install_snapshot *args = &message.install_snapshot;
     const struct raft_server *server;
+    size_t len;
     int rv;
 
-    if (status != 0) {
-        errorf(r->io, "get snapshot %s", raft_strerror(status));
-        goto err;
-    }
+    server = configuration__get(&r->configuration, request->server_id);
+    assert(server != NULL);
 
-    if (r->state != RAFT_LEADER) {
-        goto err_with_snapshot;
+    assert(request->offset >= request->base);
+    assert(request->offset - request->base <= snapshot->bufs[0].len);
+    len = request->base + snapshot->bufs[0].len - request->offset;
+    len = min(len, request->size - request->offset);
+    if (r->snapshot.chunk_size > 0) {
+        len = min(len, r->snapshot.chunk_size);
     }
 
-    server = configuration__get(&r->configuration, request->server_id);
-    if (server == NULL) {
-        /* Probably the server was removed in the meantime. */
-        goto err_with_snapshot;
+    /* Wait for the next tick if we have exceeded our bandwidth budget. */
+    if (len > 0) {
+        struct raft_replication *replication =
+            send_install_snapshot_replication(r, request);
+        bool fast = replication == NULL || replication->fast;
+        size_t budget = background_budget(r, &request->bucket, fast);
+        if (budget == 0) {
+            RAFT__QUEUE_PUSH(&r->background.throttled, &request->queue);
+            return 0;
+        }
+        len = min(len, budget);
     }
 
-    assert(snapshot->n_bufs == 1);
-
     message.type = RAFT_IO_INSTALL_SNAPSHOT;
     message.server_id = server->id;
     message.server_address = server->address;
 
-    args->term = r->current_term;
-    args->leader_id = r->id;
+    args->term = request->term;
+    args->leader_id = request->leader_id;
     args->last_index = snapshot->index;
     args->last_term = snapshot->term;
     args->conf_index = snapshot->configuration_index;
     args->conf = snapshot->configuration;
-    args->data = snapshot->bufs[0];
-
-    request->snapshot = snapshot;
+    args->offset = request->offset;
+    args->done = request->offset + len == request->size;
+    args->data.base =
+        (char *)snapshot->bufs[0].base + (request->offset - request->base);
+    args->data.len = len;
+
+    request->offset += len;
+    request->n_bytes += len;
     request->send.data = request;
 
-    infof(r->io, "sending snapshot %ld to %ld", snapshot->index, server->id);
-
-    rv = r->io->send(r->io, &request->send, &message, send_install_snapshot_cb);
+    trace__send(r, &message);
+    rv = io__send(r->io, &request->send, &message, send_install_snapshot_cb);
     if (rv != 0) {
-        goto err_with_snapshot;
+        return rv;
     }
+    background_take(r, &request->bucket, len);
 
-    return;
-
-err_with_snapshot:
-    snapshot__close(snapshot);
-    raft_free(snapshot);
-err:
-    raft_free(request);
-    return;
+    return 0;
 }
 
-static int raft_replication__send_snapshot(struct raft *r, size_t i)
-{
-    struct raft_server *server = &r->configuration.servers[i];
-    struct raft_replication *replication = &r->leader_state.replication[i];
-    struct send_install_snapshot *request;
-    int rv;
+static void snapshot_read_cb(struct raft_io_snapshot_read *req,
+                             struct raft_snapshot *snapshot,
+                             size_t size,
+                             int status);
 
-    request = raft_malloc(sizeof *request);
-    if (request == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err;
+/**
+ * Load the chunk of the snapshot starting at the current offset.
+ */
+static int send_install_snapshot_read(struct send_install_snapshot *request)
+{
+    struct raft *r = request->raft;
+    raft_term term = 0;
+    raft_index index = 0;
+
+    /* Keep sending the same snapshot after the first chunk. */
+    if (request->snapshot != NULL) {
+        term = request->snapshot->term;
+        index = request->snapshot->index;
+        snapshot__close(request->snapshot);
+        raft_free(request->snapshot);
+        request->snapshot = NULL;
     }
-    request->raft = r;
-    request->server_id = server->id;
-    request->get.data = request;
 
-    replication->state = REPLICATION__SNAPSHOT;
+    request->read.data = request;
 
-    rv = r->io->snapshot_get(r->io, &request->get, snapshot_get_cb);
-    if (rv != 0) {
-        goto err_after_req_alloc;
-    }
+    return r->io->snapshot_read(r->io, &request->read, term, index,
+                                request->offset, r->snapshot.chunk_size,
+                                snapshot_read_cb);
+}
 
-    return 0;
+/* If the follower reported having part of the snapshot being sent, move to the
+ * offset it asked to resume from. */
+static void send_install_snapshot_seek(struct send_install_snapshot *request)
+{
+    struct raft_replication *replication;
 
-err_after_req_alloc:
-    raft_free(request);
-    replication->state = REPLICATION__PROBE;
-err:
-    assert(rv != 0);
-    return rv;
+    if (send_install_snapshot_is_delegated(request)) {
+        return;
+    }
+    replication = send_install_snapshot_replication(request->raft, request);
+    if (replication == NULL || replication->resume_index == 0) {
+        return;
+    }
+
+    if (replication->resume_index == request->snapshot->index &&
+        replication->resume_offset <= request->size) {
+        request->offset = replication->resume_offset;
+    }
+    replication->resume_index = 0;
+    replication->resume_offset = 0;
 }
 
-int raft_replication__send_append_entries(struct raft *r, size_t i)
+static void send_install_snapshot_cb(struct raft_io_send *req, int status)
 {
-    struct raft_server *server = &r->configuration.servers[i];
-    struct raft_replication *replication = &r->leader_state.replication[i];
-    raft_index next_index;
-    struct raft_message message;
-    struct raft_append_entries *args = &message.append_entries;
-    struct send_append_entries *request;
-    raft_time msecs_without_contact;
+    struct send_install_snapshot *request = req->data;
+    struct raft *r = request->raft;
     int rv;
 
-    assert(r != NULL);
-    assert(r->state == RAFT_LEADER);
-    assert(server != NULL);
-    assert(server->id != r->id);
-    assert(server->id != 0);
-    assert(r->leader_state.replication != NULL);
-
-    args->term = r->current_term;
-    args->leader_id = r->id;
+    debugf(r->io, "send install snapshot completed: status %d", status);
 
-    /* If we have already sent a snapshot or we haven't hear back from the
-     * server since a while, just send heartbeats until we hear back again from
-     * the server (at that point we'll set the state back to probe). */
-    msecs_without_contact = r->io->time(r->io) - replication->last_contact;
-    if (replication->state == REPLICATION__SNAPSHOT ||
-        msecs_without_contact > 5000 /* TODO: make this configurable */) {
-        next_index = log__last_index(&r->log) + 1;
-    } else {
-        next_index = replication->next_index;
+    if (status != 0 || !send_install_snapshot_is_current(r, request)) {
+        goto done;
     }
 
-    /* From Section §3.5:
-     *
-     *   When sending an AppendEntries RPC, the leader includes the index and
-     *   term of the entry in its log that immediately precedes the new
-     *   entries. If the follower does not find an entry in its log with the
-     *   same index and term, then it refuses the new entries. The consistency
-     *   check acts as an induction step: the initial empty state of the logs
-     *   satisfies the Log Matching Property, and the consistency check
-     *   preserves the Log Matching Property whenever logs are extended. As a
-     *   result, whenever AppendEntries returns successfully, the leader knows
-     *   that the follower’s log is identical to its own log up through the new
-     *   entries (Log Matching Property in Figure 3.2).
-     */
-    if (next_index == 1) {
-        /* We're including the very first log entry, so prevIndex and prevTerm
-         * are null. */
-        if (log__term_of(&r->log, 1) == 0) {
-            return raft_replication__send_snapshot(r, i);
-        }
-        args->prev_log_index = 0;
-        args->prev_log_term = 0;
-    } else {
-        /* Set prevIndex and prevTerm to the index and term of the entry at
-         * next_index - 1 */
-        assert(next_index > 1);
-
-        args->prev_log_index = next_index - 1;
-        args->prev_log_term = log__term_of(&r->log, next_index - 1);
-
-        /* If the entry is not anymore in our log, check the last index of the
-         * last snapshot. In case next_index - 1 is behind the snapshot last
-         * index, we don't know anymore about that section of log, so we need to
-         * send the whole snapshot. Otherwise if next_index - 1 is exactly the
-         * snapshot last index, we need to send all the current log. */
-        if (args->prev_log_term == 0) {
-            assert(r->snapshot.index > 0);
-            assert(next_index - 1 <= r->snapshot.index);
-            if (next_index - 1 < r->snapshot.index) {
-                infof(r->io, "missing entry at index %lld -> send snapshot",
-                      next_index - 1);
-                return raft_replication__send_snapshot(r, i);
-            }
-            args->prev_log_term = r->snapshot.term;
-        }
+    /* A server being promoted that receives snapshot chunks is making progress
+     * in catching up, even if its match index does not move. */
+    if (!send_install_snapshot_is_delegated(request) &&
+        r->leader_state.promotee_id == request->server_id) {
+        r->leader_state.round_idle = 0;
     }
 
-    rv = log__acquire(&r->log, next_index, &args->entries, &args->n_entries);
-    if (rv != 0) {
-        goto err;
+    /* Send the next chunk, unless the transfer is over. */
+    if (request->offset == request->size) {
+        send_install_snapshot_done(request, true);
+        return;
     }
 
-    /* From Section §3.5:
-     *
-     *   The leader keeps track of the highest index it knows to be committed,
-     *   and it includes that index in future AppendEntries RPCs (including
-     *   heartbeats) so that the other servers eventually find out. Once a
-     *   follower learns that a log entry is committed, it applies the entry to
-     *   its local state machine (in log order)
-     */
-    args->leader_commit = r->commit_index;
-
-    tracef("send %ld entries to server %ld (log size %ld)", args->n_entries,
-           server->id, log__n_entries(&r->log));
+    /* Tell the leader that we are making progress. */
+    if (send_install_snapshot_is_delegated(request)) {
+        send_install_snapshot_report(request, request->snapshot->index, false);
+    }
 
-    message.type = RAFT_IO_APPEND_ENTRIES;
-    message.server_id = server->id;
-    message.server_address = server->address;
+    send_install_snapshot_seek(request);
 
-    request = raft_malloc(sizeof *request);
-    if (request == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err_after_entries_acquired;
+    /* If the data loaded so far has been sent, or we moved past it, load the
+     * next chunk. */
+    if (request->offset < request->base ||
+        request->offset >= request->base + request->snapshot->bufs[0].len) {
+        rv = send_install_snapshot_read(request);
+        if (rv != 0) {
+            goto done;
+        }
+        return;
     }
-    request->raft = r;
-    request->index = args->prev_log_index + 1;
-    request->entries = args->entries;
-    request->n = args->n_entries;
 
-    request->req.data = request;
-    rv = r->io->send(r->io, &request->req, &message,
-                     raft_replication__send_append_entries_cb);
+    rv = send_install_snapshot_chunk(request);
     if (rv != 0) {
-        goto err_after_request_alloc;
+        goto done;
     }
 
-    return 0;
+    return;
 
-err_after_request_alloc:
-    raft_free(request);
+done:
+    send_install_snapshot_done(request, false);
+}
 
-err_after_entries_acquired:
-    log__release(&r->log, next_index, args->entries, args->n_entries);
+/* Start sending the loaded shared snapshot. */
+static int send_install_snapshot_begin(struct send_install_snapshot *request)
+{
+    struct raft *r = request->raft;
+    struct raft_snapshot *snapshot = request->shared->snapshot;
 
-err:
-    assert(rv != 0);
+    assert(snapshot->n_bufs == 1);
+    request->snapshot = snapshot;
+    request->size = request->witness ? 0 : snapshot->bufs[0].len;
+    send_install_snapshot_seek(request);
 
-    return rv;
+    infof(r->io, "sending snapshot %ld to %ld from offset %lu",
+          snapshot->index, request->server_id, request->offset);
+
+    return send_install_snapshot_chunk(request);
 }
 
-/* Called after a successful append entries I/O request to update the index of
- * the last entry stored on disk. Return how many new entries that are still
- * present in our in-memory log were stored. */
-static size_t update_last_stored(struct raft *r,
-                                 raft_index first_index,
-                                 struct raft_entry *entries,
-                                 size_t n_entries)
+static void snapshot_get_cb(struct raft_io_snapshot_get *req,
+                            struct raft_snapshot *snapshot,
+                            int status)
 {
-    size_t i;
+    struct shared_snapshot *shared = req->data;
+    struct raft *r = shared->raft;
 
-    /* Check which of these entries is still in our in-memory log */
-    for (i = 0; i < n_entries; i++) {
-        struct raft_entry *entry = &entries[i];
-        raft_index index = first_index + i;
-        raft_term local_term = log__term_of(&r->log, index);
+    if (status != 0) {
+        errorf(r->io, "get snapshot %s", raft_strerror(status));
+    } else {
+        shared->snapshot = snapshot;
+    }
 
-        /* If we have no entry at this index, or if the entry we have now has a
-         * different term, it means that this entry got truncated, so let's stop
-         * here. */
-        if (local_term == 0 || (local_term > 0 && local_term != entry->term)) {
-            break;
+    while (!RAFT__QUEUE_IS_EMPTY(&shared->waiting)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&shared->waiting);
+        struct send_install_snapshot *request;
+        RAFT__QUEUE_REMOVE(head);
+        request = RAFT__QUEUE_DATA(head, struct send_install_snapshot, queue);
+
+        /* Probably we stepped down or the server was removed in the
+         * meantime. */
+        if (status != 0 || !send_install_snapshot_is_current(r, request) ||
+            send_install_snapshot_begin(request) != 0) {
+            send_install_snapshot_done(request, false);
         }
-
-        assert(local_term != 0 && local_term == entry->term);
     }
 
-    r->last_stored += i;
-    return i;
+    shared_snapshot_release(r, shared);
 }
 
-static void raft_replication__leader_append_cb(void *data, int status)
+/**
+ * Send our last snapshot loaded whole, joining the transfers already using it
+ * if any, so that a single copy is held in memory.
+ */
+static int send_install_snapshot_share(struct send_install_snapshot *request)
 {
-    struct raft_replication__leader_append *request = data;
     struct raft *r = request->raft;
-    size_t server_index;
+    struct shared_snapshot *shared = r->snapshot.shared;
     int rv;
 
-    debugf(r->io, "write log completed on leader: status %d", status);
-
-    update_last_stored(r, request->index, request->entries, request->n);
+    if (shared == NULL || shared->index != r->snapshot.index) {
+        shared = raft_malloc(sizeof *shared);
+        if (shared == NULL) {
+            return RAFT_ENOMEM;
+        }
+        shared->raft = r;
+        shared->index = r->snapshot.index;
+        shared->snapshot = NULL;
+        shared->refs = 1;
+        RAFT__QUEUE_INIT(&shared->waiting);
+        shared->get.data = shared;
+        rv = r->io->snapshot_get(r->io, &shared->get, snapshot_get_cb);
+        if (rv != 0) {
+            raft_free(shared);
+            return rv;
+        }
+        r->snapshot.shared = shared;
+    }
 
-    /* Tell the log that we're done referencing these entries. */
-    log__release(&r->log, request->index, request->entries, request->n);
+    shared->refs++;
+    request->shared = shared;
 
-    raft_free(request);
+    if (shared->snapshot == NULL) {
+        RAFT__QUEUE_PUSH(&shared->waiting, &request->queue);
+        return 0;
+    }
 
-    /* If we are not leader anymore, just discard the result. */
-    if (r->state != RAFT_LEADER) {
-        debugf(r->io, "local server is not leader -> ignore write log result");
-        return;
+    rv = send_install_snapshot_begin(request);
+    if (rv != 0) {
+        request->shared = NULL;
+        request->snapshot = NULL;
+        shared_snapshot_release(r, shared);
+        return rv;
     }
 
-    /* TODO: in case this is a failed disk write and we were the leader creating
-     * these entries in the first place, should we truncate our log too? since
-     * we have appended these entries to it. */
+    return 0;
+}
+
+static void snapshot_read_cb(struct raft_io_snapshot_read *req,
+                             struct raft_snapshot *snapshot,
+                             size_t size,
+                             int status)
+{
+    struct send_install_snapshot *request = req->data;
+    struct raft *r = request->raft;
+    int rv;
+
     if (status != 0) {
-        return;
+        errorf(r->io, "read snapshot %s", raft_strerror(status));
+        goto err;
     }
 
-    /* If Check if we have reached a quorum. */
-    server_index = configuration__index_of(&r->configuration, r->id);
+    request->snapshot = snapshot;
 
-    /* Only update the next index if we are part of the current
-     * configuration. The only case where this is not true is when we were
-     * asked to remove ourselves from the cluster.
-     *
-     * From Section 4.2.2:
-     *
-     *   there will be a period of time (while it is committing Cnew) when a
-     *   leader can manage a cluster that does not include itself; it
-     *   replicates log entries but does not count itself in majorities.
-     */
-    if (server_index < r->configuration.n) {
-        r->leader_state.replication[server_index].match_index = r->last_stored;
-    } else {
-        const struct raft_entry *entry = log__get(&r->log, r->last_stored);
-        assert(entry->type == RAFT_CONFIGURATION);
+    /* Probably we stepped down or the server was removed in the meantime. */
+    if (!send_install_snapshot_is_current(r, request)) {
+        goto err;
     }
 
-    /* Check if we can commit some new entries. */
-    raft_replication__quorum(r, r->last_stored);
+    assert(snapshot->n_bufs == 1);
+    request->base = request->offset;
+    request->size = size;
 
-    rv = raft_replication__apply(r);
-    if (rv != 0) {
-        /* TODO: just log the error? */
+    /* An empty chunk can only be the last one. */
+    if (snapshot->bufs[0].len == 0 && request->offset != size) {
+        errorf(r->io, "read snapshot: no data at offset %lu", request->offset);
+        goto err;
     }
-}
-
-static int raft_replication__leader_append(struct raft *r, unsigned index)
-{
-    struct raft_entry *entries;
-    unsigned n;
-    struct raft_replication__leader_append *request;
-    int rv;
 
-    assert(r->state == RAFT_LEADER);
+    /* Witnesses only get the snapshot metadata. */
+    if (request->witness) {
+        request->size = 0;
+    }
 
-    if (index == 0) {
-        return 0;
+    if (request->offset == 0) {
+        infof(r->io, "sending snapshot %ld to %ld", snapshot->index,
+              request->server_id);
     }
 
-    /* Acquire all the entries from the given index onwards. */
-    rv = log__acquire(&r->log, index, &entries, &n);
+    rv = send_install_snapshot_chunk(request);
     if (rv != 0) {
         goto err;
     }
 
-    /* We expect this function to be called only when there are actually
-     * some entries to write. */
-    assert(n > 0);
+    return;
+
+err:
+    send_install_snapshot_done(request, false);
+}
+
+/**
+ * Start sending our last snapshot to the given server, either because we are
+ * the leader and the server is the i'th one in our configuration, or on behalf
+ * of the leader with the given ID.
+ */
+static int send_install_snapshot_start(struct raft *r,
+                                       const struct raft_server *server,
+                                       unsigned leader_id)
+{
+    struct send_install_snapshot *request;
+    int rv;
 
-    /* Allocate a new request. */
     request = raft_malloc(sizeof *request);
     if (request == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err_after_entries_acquired;
+        return RAFT_ENOMEM;
     }
-
     request->raft = r;
-    request->index = index;
-    request->entries = entries;
-    request->n = n;
-
-    rv = r->io->append(r->io, entries, n, request,
-                       raft_replication__leader_append_cb);
+    request->snapshot = NULL;
+    request->shared = NULL;
+    request->server_id = server->id;
+    request->leader_id = leader_id;
+    request->witness = server->witness;
+    request->term = r->current_term;
+    request->offset = 0;
+    request->base = 0;
+    request->size = 0;
+    request->n_bytes = 0;
+    request->start = io__time(r->io);
+    bucket__init(&request->bucket);
+
+    /* If the snapshot is sent in chunks, there's no need to load it all. */
+    if (has_snapshot_read(r) && r->snapshot.chunk_size > 0) {
+        rv = send_install_snapshot_read(request);
+    } else {
+        rv = send_install_snapshot_share(request);
+    }
     if (rv != 0) {
-        goto err_after_request_alloc;
+        raft_free(request);
+        return rv;
     }
 
     return 0;
+}
 
-err_after_request_alloc:
-    raft_free(request);
+void raft_replication__resume_throttled(struct raft *r)
+{
+    raft__queue queue;
+    int rv;
 
-err_after_entries_acquired:
-    log__release(&r->log, index, entries, n);
+    /* Transfers still over budget get parked again, so work on a copy. */
+    RAFT__QUEUE_INIT(&queue);
+    while (!RAFT__QUEUE_IS_EMPTY(&r->background.throttled)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&r->background.throttled);
+        RAFT__QUEUE_REMOVE(head);
+        RAFT__QUEUE_PUSH(&queue, head);
+    }
 
-err:
-    assert(rv != 0);
-    return rv;
+    while (!RAFT__QUEUE_IS_EMPTY(&queue)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&queue);
+        struct send_install_snapshot *request;
+        RAFT__QUEUE_REMOVE(head);
+        request = RAFT__QUEUE_DATA(head, struct send_install_snapshot, queue);
+        if (!send_install_snapshot_is_current(r, request)) {
+            send_install_snapshot_done(request, false);
+            continue;
+        }
+        rv = send_install_snapshot_chunk(request);
+        if (rv != 0) {
+            send_install_snapshot_done(request, false);
+        }
+    }
 }
 
-int raft_replication__trigger(struct raft *r, const raft_index index)
+unsigned raft_replication__throttle_delay(struct raft *r)
 {
-    raft_time now;
-    size_t i;
+    unsigned timeout = UINT_MAX;
+    unsigned total;
+    raft__queue *head;
+
+    RAFT__QUEUE_FOREACH(head, &r->background.throttled)
+    {
+        struct send_install_snapshot *request =
+            RAFT__QUEUE_DATA(head, struct send_install_snapshot, queue);
+        unsigned peer = bucket__delay(&request->bucket, r->background.peer_rate,
+                                      r->last_tick);
+        timeout = min(timeout, peer);
+    }
+
+    total = bucket__delay(&r->background.bucket, r->background.total_rate,
+                          r->last_tick);
+
+    return max(timeout, total);
+}
+
+void raft_replication__drop_throttled(struct raft *r)
+{
+    while (!RAFT__QUEUE_IS_EMPTY(&r->background.throttled)) {
+        raft__queue *head = RAFT__QUEUE_HEAD(&r->background.throttled);
+        RAFT__QUEUE_REMOVE(head);
+        send_install_snapshot_done(
+            RAFT__QUEUE_DATA(head, struct send_install_snapshot, queue), false);
+    }
+}
+
+/* Send our own snapshot to the i'th server. */
+static int send_local_snapshot(struct raft *r, size_t i)
+{
+    struct raft_replication *replication = &r->leader_state.replication[i];
     int rv;
 
-    assert(r->state == RAFT_LEADER);
+    replication->state = REPLICATION__SNAPSHOT;
+    replication->sending_snapshot = true;
+    replication->delegate_id = 0;
 
-    rv = raft_replication__leader_append(r, index);
+    rv = send_install_snapshot_start(r, &r->configuration.servers[i], r->id);
     if (rv != 0) {
-        goto err;
+        replication->state = REPLICATION__PROBE;
+        replication->sending_snapshot = false;
+        return rv;
     }
 
-    /* Reset the heartbeat timer: for a full request_timeout period we'll be
-     * good and we won't need to contact followers again, since this was not an
-     * idle period.
-     *
-     * From Figure 3.1:
-     *
-     *   [Rules for Servers] Leaders: Upon election: send initial empty
-     *   AppendEntries RPCs (heartbeat) to each server; repeat during idle
-     *   periods to prevent election timeouts
-     */
-    r->timer = 0;
+    return 0;
+}
 
-    now = r->io->time(r->io);
+/**
+ * Return the index of a follower that can send the snapshot to the i'th server
+ * in our place, or the number of servers if there's none.
+ *
+ * The follower must be a non-witness that we have recently heard from, whose
+ * log has all entries included in our last snapshot, and which is not already
+ * sending a snapshot for us, as far as we know. It will still refuse if its
+ * own last snapshot is older than ours.
+ */
+static size_t snapshot_delegate_index(struct raft *r, size_t i)
+{
+    raft_time now = io__time(r->io);
+    size_t j;
+    size_t k;
 
-    /* Trigger replication for servers we didn't hear from recently. */
-    for (i = 0; i < r->configuration.n; i++) {
-        struct raft_server *server = &r->configuration.servers[i];
-        struct raft_replication *replication = &r->leader_state.replication[i];
-        int rv;
+    for (j = 0; j < r->configuration.n; j++) {
+        const struct raft_server *server = &r->configuration.servers[j];
+        const struct raft_replication *replication =
+            &r->leader_state.replication[j];
+        bool busy = false;
 
-        if (server->id == r->id) {
+        if (j == i || server->id == r->id || server->witness) {
             continue;
         }
-
-        /* Send the heartbeat only if we were idle. */
-        if (index == 0) {
-            /* TODO: since we don't yet keep a last_contact array which is
-             * independent from the replication array, if the value is 0 it
-             * means that this is the very first heartbeat being sent after
-             * election. In this case we unconditionally send a heartbeat
-             * message and we set
-             * last_contact to know to avoid thinking that we lost contact. */
-            if (replication->last_contact == 0) {
-                replication->last_contact = now;
-            } else if (now - replication->last_contact <
-                       r->heartbeat_timeout / 2) {
-                continue;
+        if (replication->state != REPLICATION__PIPELINE ||
+            replication->match_index < r->snapshot.index ||
+            now - replication->last_contact > r->election_timeout) {
+            continue;
+        }
+        for (k = 0; k < r->configuration.n; k++) {
+            const struct raft_replication *other =
+                &r->leader_state.replication[k];
+            if (other->delegate_id == server->id &&
+                now - other->delegate_ack <= r->election_timeout) {
+                busy = true;
+                break;
             }
         }
-
-        rv = raft_replication__send_append_entries(r, i);
-        if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
-            /* This is not a critical failure, let's just log it. */
-            warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
-                  server->id, raft_strerror(rv), rv);
+        if (!busy) {
+            return j;
         }
     }
 
-    return 0;
-
-err:
-    assert(rv != 0);
-
-    return rv;
+    return r->configuration.n;
 }
 
-/**
- * Helper to be invoked after a promotion of a non-voting server has been
- * requested via @raft_promote and that server has caught up with logs.
- *
- * This function changes the local configuration marking the server being
- * promoted as actually voting, appends the a RAFT_CONFIGURATION entry with
- * the new configuration to the local log and triggers its replication.
- */
-static int raft_replication__trigger_promotion(struct raft *r)
+/* Ask the j'th server to send its snapshot to the i'th server. */
+static int send_snapshot_delegate(struct raft *r, size_t i, size_t j)
 {
-    raft_index index;
-    raft_term term = r->current_term;
-    size_t server_index;
-    struct raft_server *server;
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    const struct raft_server *delegate = &r->configuration.servers[j];
+    struct raft_message message;
+    struct raft_send_snapshot *args = &message.send_snapshot;
+    struct raft_io_send *req;
     int rv;
 
-    assert(r->state == RAFT_LEADER);
-    assert(r->leader_state.promotee_id != 0);
+    args->term = r->current_term;
+    args->server_id = r->configuration.servers[i].id;
+    args->last_index = r->snapshot.index;
 
-    server_index =
-        configuration__index_of(&r->configuration, r->leader_state.promotee_id);
-    assert(server_index < r->configuration.n);
+    message.type = RAFT_IO_SEND_SNAPSHOT;
+    message.server_id = delegate->id;
+    message.server_address = delegate->address;
 
-    server = &r->configuration.servers[server_index];
+    req = pool__get(&r->pools.send, sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+    req->data = r;
 
-    assert(!server->voting);
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, send_snapshot_result_cb);
+    if (rv != 0) {
+        pool__put(&r->pools.send, req);
+        return rv;
+    }
 
-    /* Update our current configuration. */
-    server->voting = true;
+    infof(r->io, "asking server %ld to send snapshot to %ld", delegate->id,
+          args->server_id);
 
-    /* Index of the entry being appended. */
-    index = log__last_index(&r->log) + 1;
+    replication->state = REPLICATION__SNAPSHOT;
+    replication->sending_snapshot = true;
+    replication->delegate_id = delegate->id;
+    replication->delegate_ack = io__time(r->io);
 
-    /* Encode the new configuration and append it to the log. */
-    rv = log__append_configuration(&r->log, term, &r->configuration);
-    if (rv != 0) {
-        goto err;
+    return 0;
+}
+
+static int raft_replication__send_snapshot(struct raft *r, size_t i)
+{
+    struct raft_server *server = &r->configuration.servers[i];
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    size_t j;
+
+    /* If a transfer is already in progress, let it complete, unless it was
+     * delegated to a follower which has stopped reporting progress: in that
+     * case send the snapshot ourselves. */
+    if (replication->sending_snapshot) {
+        if (replication->delegate_id == 0 ||
+            io__time(r->io) - replication->delegate_ack <=
+                r->election_timeout) {
+            replication->state = REPLICATION__SNAPSHOT;
+            return 0;
+        }
+        infof(r->io, "server %ld stopped sending snapshot to %ld",
+              replication->delegate_id, server->id);
+        replication->sending_snapshot = false;
+        return send_local_snapshot(r, i);
     }
 
-    /* Start writing the new log entry to disk and send it to the followers. */
-    rv = raft_replication__trigger(r, index);
-    if (rv != 0) {
-        goto err_after_log_append;
+    /* Try to spare our own disk and network, if allowed. */
+    if (r->snapshot.delegate && !server->witness) {
+        j = snapshot_delegate_index(r, i);
+        if (j < r->configuration.n && send_snapshot_delegate(r, i, j) == 0) {
+            return 0;
+        }
     }
 
-    r->leader_state.promotee_id = 0;
-    r->configuration_uncommitted_index = log__last_index(&r->log);
+    return send_local_snapshot(r, i);
+}
 
-    return 0;
+int raft_replication__send_delegated_snapshot(struct raft *r,
+                                              unsigned leader_id,
+                                              const struct raft_server *server)
+{
+    int rv;
 
-err_after_log_append:
-    log__truncate(&r->log, index);
+    assert(r->state == RAFT_FOLLOWER);
+    assert(r->follower_state.snapshot_target == 0);
 
-err:
-    server->voting = false;
+    r->follower_state.snapshot_target = server->id;
+    r->follower_state.snapshot_leader = leader_id;
 
-    assert(rv != 0);
-    return rv;
+    rv = send_install_snapshot_start(r, server, leader_id);
+    if (rv != 0) {
+        r->follower_state.snapshot_target = 0;
+        r->follower_state.snapshot_leader = 0;
+        return rv;
+    }
+
+    infof(r->io, "sending snapshot %ld to %ld for leader %ld",
+          r->snapshot.index, server->id, leader_id);
+
+    return 0;
 }
 
-int raft_replication__update(struct raft *r,
-                             const struct raft_server *server,
-                             const struct raft_append_entries_result *result)
+int raft_replication__delegated_snapshot(
+    struct raft *r,
+    unsigned id,
+    const struct raft_send_snapshot_result *result)
 {
-    size_t server_index;
     struct raft_replication *replication;
-    raft_index last_log_index;
-    bool is_being_promoted;
-    int rv;
+    size_t i;
 
     assert(r->state == RAFT_LEADER);
 
-    server_index = configuration__index_of(&r->configuration, server->id);
-    assert(server_index < r->configuration.n);
+    i = configuration__index_of(&r->configuration, result->server_id);
+    if (i == r->configuration.n) {
+        return 0;
+    }
+    replication = &r->leader_state.replication[i];
 
-    replication = &r->leader_state.replication[server_index];
-    replication->last_contact = r->io->time(r->io);
+    /* Ignore stale results from transfers that we gave up on. */
+    if (!replication->sending_snapshot || replication->delegate_id != id) {
+        debugf(r->io, "no snapshot transfer delegated to %ld -> ignore", id);
+        return 0;
+    }
 
-    /* Reset the replication state to probe, as we might need to send the
-     * snapshot again. */
-    if (replication->state == REPLICATION__SNAPSHOT) {
-        debugf(r->io, "reset replication from snapshot to probe");
-        replication->state = REPLICATION__PROBE;
+    replication->delegate_ack = io__time(r->io);
+    if (r->leader_state.promotee_id == result->server_id) {
+        r->leader_state.round_idle = 0;
     }
 
-    /* If the reported index is lower than the match index, it must be an out of
-     * order response for an old append entries. Ignore it. */
-    if (replication->match_index > replication->next_index - 1) {
-        debugf(r->io, "match index higher than reported next index -> ignore");
+    if (!result->done) {
         return 0;
     }
 
-    last_log_index = log__last_index(&r->log);
-
-    /* If the RPC failed because of a log mismatch, retry.
-     *
-     * From Figure 3.1:
-     *
-     *   [Rules for servers] Leaders:
-     *
-     *   - If AppendEntries fails because of log inconsistency:
-     *     decrement nextIndex and retry.
-     */
-    if (!result->success) {
-        /* If the match index is already up-to-date then the rejection must be
-         * stale and come from an out of order message. */
-        if (replication->match_index == replication->next_index - 1) {
-            debugf(r->io, "match index is up to date -> ignore ");
-            return 0;
-        }
+    replication->sending_snapshot = false;
+    replication->delegate_id = 0;
 
-        /* If the peer reports a last index lower than what we believed was its
-         * next index, decrerment the next index to whatever is shorter: our log
-         * or the peer log. Otherwise just blindly decrement next_index by 1. */
-        if (result->last_log_index < replication->next_index - 1) {
-            replication->next_index =
-                min(result->last_log_index, last_log_index);
-        } else {
-            replication->next_index = replication->next_index - 1;
-        }
+    if (result->last_index == 0) {
+        infof(r->io, "server %ld failed to send snapshot to %ld", id,
+              result->server_id);
+        return send_local_snapshot(r, i);
+    }
 
-        replication->next_index = max(replication->next_index, 1);
+    /* As when we send the snapshot ourselves, the receiving server tells us
+     * about it once it's installed. */
+    return 0;
+}
 
-        infof(r->io, "log mismatch -> send old entries %ld",
-              replication->next_index);
+/* Return true if the given server is a learner, i.e. a non-voting server
+ * which is not being promoted. Learners get their own replication budget. */
+static bool is_learner(const struct raft *r, const struct raft_server *server)
+{
+    return !server->voting && server->id != r->leader_state.promotee_id;
+}
 
-        /* Retry, ignoring errors. */
-        raft_replication__send_append_entries(r, server_index);
+/* Return the limits applied to AppendEntries messages sent to the i'th
+ * server. */
+static const struct raft_append_limits *append_limits_of(const struct raft *r,
+                                                         size_t i)
+{
+    if (r->learners.custom_limits &&
+        is_learner(r, &r->configuration.servers[i])) {
+        return &r->learners.append_limits;
+    }
+    return &r->append_limits;
+}
 
-        return 0;
+/* Return the interval between heartbeats sent to the given server. */
+static unsigned heartbeat_timeout_of(const struct raft *r,
+                                     const struct raft_server *server)
+{
+    unsigned timeout = raft_election__heartbeat_timeout(r);
+    if (r->learners.heartbeat_timeout > timeout && is_learner(r, server)) {
+        return r->learners.heartbeat_timeout;
     }
+    return timeout;
+}
 
-    if (result->last_log_index <= replication->match_index) {
-        /* Like above, this must be a stale response. */
-        debugf(r->io, "match index is up to date -> ignore ");
+/* Return true if the i'th server has a lower round-trip time than the j'th.
+ * Servers whose round-trip time is unknown are the slowest. */
+static bool is_faster(const struct raft *r, size_t i, size_t j)
+{
+    const struct raft_interval *rtt1 = &r->leader_state.replication[i].rtt;
+    const struct raft_interval *rtt2 = &r->leader_state.replication[j].rtt;
 
-        return 0;
+    if (!rtt1->sampled) {
+        return false;
     }
+    if (!rtt2->sampled || rtt1->mean < rtt2->mean) {
+        return true;
+    }
+    return rtt1->mean == rtt2->mean && i < j;
+}
 
-    /* In case of success the remote server is expected to send us back the
-     * value of prevLogIndex + len(entriesToAppend). */
-    assert(result->last_log_index <= last_log_index);
+/* Flag the voting followers with the lowest round-trip times that, along with
+ * us, form a quorum. Commit latency depends only on them, so they get their
+ * entries first. Until round-trip times are known all voting followers are
+ * flagged. */
+static void update_fast_quorum(struct raft *r)
+{
+    unsigned n_voting = configuration__n_voting(&r->configuration);
+    size_t i;
+    size_t j;
 
-    /* If the RPC succeeded, update our counters for this server.
-     *
-     * From Figure 3.1:
-     *
-     *   [Rules for servers] Leaders:
-     *
-     *   If successful update nextIndex and matchIndex for follower.
-     */
-    replication->next_index = result->last_log_index + 1;
-    replication->match_index = result->last_log_index;
-    debugf(r->io, "match/next idx for server %ld: %ld/%ld", server->id,
-           replication->match_index, replication->next_index);
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+        struct raft_replication *replication = &r->leader_state.replication[i];
+        unsigned rank = 0;
 
-    /* If the server is currently being promoted and is catching with logs,
-     * update the information about the current catch-up round, and possibly
-     * proceed with the promotion. */
-    is_being_promoted = r->leader_state.promotee_id != 0 &&
-                        r->leader_state.promotee_id == server->id;
-    if (is_being_promoted) {
-        int is_up_to_date = raft_membership__update_catch_up_round(r);
-        if (is_up_to_date) {
-            rv = raft_replication__trigger_promotion(r);
-            if (rv != 0) {
-                return rv;
+        if (server->id == r->id || is_learner(r, server)) {
+            replication->fast = false;
+            continue;
+        }
+        for (j = 0; j < r->configuration.n; j++) {
+            struct raft_server *other = &r->configuration.servers[j];
+            if (j != i && other->id != r->id && !is_learner(r, other) &&
+                is_faster(r, j, i)) {
+                rank++;
             }
         }
+        replication->fast = rank < n_voting / 2;
     }
+}
 
-    /* TODO: switch to pipeline replication mode. */
+/* Start timing a round trip to the given follower with a request covering the
+ * entries up to @index, unless another one is being timed and didn't get lost
+ * yet. */
+static void rtt_start(struct raft *r,
+                      struct raft_replication *replication,
+                      raft_index index)
+{
+    raft_time now = io__time(r->io);
 
-    return 0;
+    if (replication->rtt_index != 0 &&
+        now - replication->rtt_start <= raft_election__timeout(r)) {
+        return;
+    }
+
+    replication->rtt_start = now;
+    replication->rtt_index = index;
 }
 
-static void raft_replication__follower_respond_cb(struct raft_io_send *req,
-                                                  int status)
+/* Complete the round trip being timed for the given follower, unless the result
+ * is for an earlier request. */
+static void rtt_stop(struct raft *r,
+                     struct raft_replication *replication,
+                     const struct raft_append_entries_result *result)
 {
-    (void)status;
-    raft_free(req);
+    if (replication->rtt_index == 0) {
+        return;
+    }
+    if (result->success && result->last_log_index < replication->rtt_index) {
+        return;
+    }
+
+    interval__sample(&replication->rtt,
+                     (unsigned)(replication->last_contact -
+                                replication->rtt_start));
+    replication->rtt_index = 0;
+
+    raft_election__update_timeout(r);
 }
 
-static void raft_replication__follower_append_cb(void *data, int status)
+/* Set @max_bytes to the maximum size of the entries payload that can be
+ * included in a single AppendEntries message to the i'th server, according to
+ * the configured limit and to the server's in-flight window, or to 0 if there's
+ * no limit. Return false if the in-flight window is full. */
+static bool append_entries_max_bytes(struct raft *r,
+                                     size_t i,
+                                     size_t *max_bytes)
 {
-    struct raft_replication__follower_append *request = data;
-    struct raft *r = request->raft;
-    struct raft_append_entries *args = &request->args;
-    struct raft_message message;
-    struct raft_append_entries_result *result = &message.append_entries_result;
-    struct raft_io_send *req;
-    size_t i;
-    size_t j;
-    int rv;
-
-    debugf(r->io, "I/O completed on follower: status %d", status);
+    const struct raft_append_limits *limits = append_limits_of(r, i);
+    const struct raft_replication *replication;
+    size_t max_inflight_bytes = limits->max_inflight_bytes;
 
-    assert(args->leader_id > 0);
-    assert(args->entries != NULL);
-    assert(args->n_entries > 0);
+    replication = &r->leader_state.replication[i];
 
-    i = update_last_stored(r, request->index, args->entries, args->n_entries);
+    *max_bytes = limits->max_bytes;
 
-    /* If we are not followers anymore, just discard the result. */
-    if (r->state != RAFT_FOLLOWER) {
-        debugf(r->io, "local server is not follower -> ignore I/O result");
-        goto out;
+    if (max_inflight_bytes > 0) {
+        size_t available;
+        if (replication->inflight_bytes >= max_inflight_bytes) {
+            return false;
+        }
+        available = max_inflight_bytes - replication->inflight_bytes;
+        if (*max_bytes == 0 || available < *max_bytes) {
+            *max_bytes = available;
+        }
     }
 
-    if (status != 0) {
-        result->success = false;
-        goto respond;
-    }
+    return true;
+}
+
+/* Return how many entries starting at @next_index can be included in a single
+ * AppendEntries message to the i'th server, according to the configured limits
+ * and to the server's in-flight window. Also set @size to the total size of
+ * their payload. The returned entries are either all evicted or all in
+ * memory. */
+static unsigned append_entries_count(struct raft *r,
+                                     size_t i,
+                                     raft_index next_index,
+                                     size_t *size)
+{
+    unsigned max_entries = append_limits_of(r, i)->max_entries;
+    size_t max_bytes;
+    bool evicted = log__is_evicted(&r->log, next_index);
+    unsigned n = 0;
+
+    *size = 0;
+
+    if (!append_entries_max_bytes(r, i, &max_bytes)) {
+        return 0;
+    }
+
+    while (max_entries == 0 || n < max_entries) {
+        const struct raft_entry *entry = log__get(&r->log, next_index + n);
+        if (entry == NULL) {
+            break;
+        }
+        /* Entries whose payload was evicted are read from disk, so don't mix
+         * them with entries held in memory. */
+        if (log__is_evicted(&r->log, next_index + n) != evicted) {
+            break;
+        }
+        /* Always send at least one entry, even if it's bigger than the limit,
+         * otherwise the follower would never make progress. */
+        if (n > 0 && max_bytes > 0 && *size + entry->buf.len > max_bytes) {
+            break;
+        }
+        *size += entry->buf.len;
+        n++;
+    }
+
+    return n;
+}
+
+/* Make a copy of the entries referenced by the given request without the
+ * payload of RAFT_COMMAND and RAFT_BATCH entries, to be sent to a witness.
+ * Other entries are kept whole, since the witness needs to know about
+ * configuration changes. */
+static int strip_entries(struct send_append_entries *request)
+{
+    unsigned i;
+
+    assert(request->stripped == NULL);
+
+    request->stripped =
+        raft_malloc(request->view.n * sizeof *request->stripped);
+    if (request->stripped == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    for (i = 0; i < request->view.n; i++) {
+        request->stripped[i] = request->view.entries[i];
+        if (request->stripped[i].type != RAFT_CONFIGURATION) {
+            request->stripped[i].buf.base = NULL;
+            request->stripped[i].buf.len = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Fill an AppendEntries message with the entries referenced by the given
+ * request and submit it. */
+static int send_append_entries_request(struct raft *r,
+                                       const struct raft_server *server,
+                                       struct send_append_entries *request)
+{
+    struct raft_message message;
+    struct raft_append_entries *args = &message.append_entries;
+    int rv;
+
+    if (server->witness && request->view.n > 0) {
+        rv = strip_entries(request);
+        if (rv != 0) {
+            return rv;
+        }
+    }
+
+    args->term = r->current_term;
+    args->leader_id = r->id;
+    args->prev_log_index = request->view.index - 1;
+    args->prev_log_term = request->prev_log_term;
+    args->entries = request->stripped != NULL ? request->stripped
+                                              : request->view.entries;
+    args->n_entries = request->view.n;
+
+    /* From Section §3.5:
+     *
+     *   The leader keeps track of the highest index it knows to be committed,
+     *   and it includes that index in future AppendEntries RPCs (including
+     *   heartbeats) so that the other servers eventually find out. Once a
+     *   follower learns that a log entry is committed, it applies the entry to
+     *   its local state machine (in log order)
+     */
+    args->leader_commit = r->commit_index;
+
+    /* Tell followers to suspend their election timers if we hibernate. */
+    args->hibernate = r->leader_state.hibernating && args->n_entries == 0;
+
+    /* Followers echo the round back, confirming the reads submitted before. */
+    args->seq = r->leader_state.seq;
+
+    tracef("send %ld entries to server %ld (log size %ld)", args->n_entries,
+           server->id, log__n_entries(&r->log));
+
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.server_id = server->id;
+    message.server_address = server->address;
+
+    request->req.data = request;
+    trace__send(r, &message);
+
+    /* Messages carrying new entries are submitted later, together with the
+     * ones for the other followers, which normally carry the same entries. */
+    if (r->broadcast.messages != NULL && args->n_entries > 0 &&
+        request->stripped == NULL) {
+        assert(r->broadcast.n < r->configuration.n);
+        r->broadcast.reqs[r->broadcast.n] = &request->req;
+        r->broadcast.messages[r->broadcast.n] = message;
+        r->broadcast.n++;
+        return 0;
+    }
+
+    return io__send(r->io, &request->req, &message,
+                    raft_replication__send_append_entries_cb);
+}
+
+/* Callback invoked after entries which are not held in memory have been read
+ * back from disk. */
+static void read_entries_cb(struct raft_io_read *req,
+                            struct raft_entry *entries,
+                            unsigned n,
+                            int status)
+{
+    struct send_append_entries *request = req->data;
+    struct raft *r = request->raft;
+    struct raft_replication *replication = NULL;
+    unsigned max_entries;
+    size_t max_bytes;
+    size_t budget;
+    size_t size = 0;
+    size_t i;
+    unsigned j;
+    int rv;
+
+    request->loaded = entries;
+    request->n_loaded = n;
+
+    i = send_append_entries_server_index(r, request);
+    if (i < r->configuration.n) {
+        replication = &r->leader_state.replication[i];
+        replication->reading = false;
+    }
+
+    if (status != 0) {
+        errorf(r->io, "read entries: %s", raft_strerror(status));
+        goto err;
+    }
+
+    /* We are not in a position to send the entries anymore. */
+    if (replication == NULL) {
+        goto err;
+    }
+
+    /* The entries are not available on disk. If they follow the last snapshot
+     * they must have been persisted, so the read will be retried at the next
+     * heartbeat, otherwise they might be gone for good and we need to send the
+     * snapshot. */
+    if (n <= request->skip) {
+        raft_index index = request->view.index;
+        if (index > r->snapshot.index) {
+            goto err;
+        }
+        infof(r->io, "missing entry at index %lld -> send snapshot",
+              index - request->skip);
+        release_inflight_bytes(replication, request->size);
+        send_append_entries_free(request);
+        raft_replication__send_snapshot(r, i);
+        return;
+    }
+
+    if (request->skip > 0) {
+        request->prev_log_term = entries[0].term;
+    }
+
+    /* Cap the entries to send according to the message limits and to the
+     * bandwidth budget of background transfers. The ones that don't fit are
+     * released along with the rest of the request. */
+    max_entries = append_limits_of(r, i)->max_entries;
+    append_entries_max_bytes(r, i, &max_bytes);
+    budget = background_budget(r, &replication->bucket, replication->fast);
+    if (budget == 0) {
+        budget = 1;
+    }
+    if (budget != SIZE_MAX && (max_bytes == 0 || budget < max_bytes)) {
+        max_bytes = budget;
+    }
+    for (j = request->skip; j < n; j++) {
+        unsigned k = j - request->skip;
+        if (max_entries > 0 && k >= max_entries) {
+            break;
+        }
+        if (k > 0 && max_bytes > 0 && size + entries[j].buf.len > max_bytes) {
+            break;
+        }
+        size += entries[j].buf.len;
+    }
+    request->view.entries = &entries[request->skip];
+    request->view.n = j - request->skip;
+
+    release_inflight_bytes(replication, request->size);
+    replication->inflight_bytes += size;
+    request->size = size;
+
+    rv = send_append_entries_request(r, &r->configuration.servers[i], request);
+    if (rv != 0) {
+        goto err;
+    }
+
+    background_take(r, &replication->bucket, size);
+    replication->last_send = io__time(r->io);
+    replication->last_commit = r->commit_index;
+    rtt_start(r, replication, request->view.index + request->view.n - 1);
+
+    if (replication->state == REPLICATION__PIPELINE) {
+        replication->next_index = request->view.index + request->view.n;
+    }
+
+    return;
+
+err:
+    if (replication != NULL) {
+        release_inflight_bytes(replication, request->size);
+    }
+    send_append_entries_free(request);
+}
+
+/* Submit a request to read from disk @n entries starting at @index, and send
+ * them to the follower once they are loaded. If @skip is 1, the first entry
+ * read is the one preceeding the entries to send, and it's used only to fill
+ * the prev_log_term field of the message. */
+static int send_append_entries_from_disk(struct raft *r,
+                                         size_t i,
+                                         raft_index index,
+                                         unsigned skip,
+                                         raft_term prev_log_term,
+                                         unsigned n,
+                                         size_t size)
+{
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    struct send_append_entries *request;
+    int rv;
+
+    assert(has_read(r));
+    assert(skip == 0 || skip == 1);
+
+    request = pool__get(&r->pools.send_append_entries, sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    request->raft = r;
+    request->view.index = index + skip;
+    request->view.entries = NULL;
+    request->view.n = 0;
+    request->term = r->current_term;
+    request->server_id = r->configuration.servers[i].id;
+    request->size = size;
+    request->prev_log_term = prev_log_term;
+    request->from_disk = true;
+    request->loaded = NULL;
+    request->n_loaded = 0;
+    request->skip = skip;
+    request->stripped = NULL;
+    request->read.data = request;
+
+    rv = r->io->read(r->io, &request->read, index, n, read_entries_cb);
+    if (rv != 0) {
+        goto err_after_request_alloc;
+    }
+
+    replication->reading = true;
+    replication->inflight_bytes += size;
+
+    return 0;
+
+err_after_request_alloc:
+    pool__put(&r->pools.send_append_entries, request);
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
+/* Read from disk the entries starting at @next_index that are not anymore in
+ * the in-memory log because they were included in a snapshot, along with the
+ * one preceeding them, if any. If they are not available on disk either, the
+ * snapshot will be sent instead. */
+static int send_append_entries_from_segments(struct raft *r,
+                                             size_t i,
+                                             raft_index next_index)
+{
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    unsigned max_entries = append_limits_of(r, i)->max_entries;
+    raft_index index = next_index > 1 ? next_index - 1 : 1;
+    raft_index last_index;
+    size_t max_bytes;
+    unsigned skip = next_index > 1 ? 1 : 0;
+    unsigned n;
+
+    assert(has_read(r));
+
+    /* Wait for the follower's in-flight window to have room, and for the
+     * bandwidth budget of background transfers to be refilled. */
+    if (!append_entries_max_bytes(r, i, &max_bytes) ||
+        background_budget(r, &replication->bucket, replication->fast) == 0) {
+        return 0;
+    }
+
+    /* Read up to the entry preceeding the first one in memory. */
+    if (log__n_entries(&r->log) > 0) {
+        last_index = log__first_index(&r->log) - 1;
+    } else {
+        last_index = r->snapshot.index;
+    }
+
+    /* If only the preceeding entry is missing, read the first entry to send as
+     * well: it's included in the snapshot, so it's on disk. */
+    assert(next_index <= r->snapshot.index);
+    if (last_index < next_index) {
+        last_index = next_index;
+    }
+
+    n = (unsigned)(last_index - index + 1);
+    if (max_entries > 0 && n > max_entries + skip) {
+        n = max_entries + skip;
+    }
+
+    return send_append_entries_from_disk(r, i, index, skip, 0, n, 0);
+}
+
+int raft_replication__send_append_entries(struct raft *r, size_t i)
+{
+    struct raft_server *server = &r->configuration.servers[i];
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    raft_index next_index;
+    raft_term prev_log_term;
+    struct send_append_entries *request;
+    raft_time msecs_without_contact;
+    bool lost_contact;
+    unsigned n;
+    size_t size;
+    int rv;
+
+    assert(r != NULL);
+    assert(r->state == RAFT_LEADER);
+    assert(server != NULL);
+    assert(server->id != r->id);
+    assert(server->id != 0);
+    assert(r->leader_state.replication != NULL);
+
+    /* If we are reading entries from disk for this follower, wait for the read
+     * to complete before sending anything else. */
+    if (replication->reading) {
+        return 0;
+    }
+
+    /* If messages for this follower can't be delivered and keep piling up,
+     * don't add more, since they would just push out the ones already queued
+     * and break the sequence of pipelined entries. */
+    if (r->io->version >= 5 && r->io->congested != NULL &&
+        io__congested(r->io, server->id)) {
+        return 0;
+    }
+
+    /* If we haven't heard back from the server since a while while we were
+     * pipelining, some of the optimistically sent entries might have been
+     * lost, so fall back to probe mode and restart from the last known match
+     * index. */
+    msecs_without_contact = io__time(r->io) - replication->last_contact;
+    lost_contact = msecs_without_contact > r->contact_timeout;
+    if (replication->state == REPLICATION__PIPELINE && lost_contact) {
+        debugf(r->io, "lost contact with server %ld -> probe", server->id);
+        replication->state = REPLICATION__PROBE;
+        replication->next_index = replication->match_index + 1;
+    }
+
+    /* If we have already sent a snapshot, or we haven't heard back from the
+     * server since a while and the probe strategy doesn't resend entries, just
+     * send heartbeats until we hear back again from the server (at that point
+     * we'll set the state back to probe). */
+    if (replication->state == REPLICATION__SNAPSHOT ||
+        (lost_contact && r->probe_strategy == RAFT_PROBE_HEARTBEAT)) {
+        next_index = log__last_index(&r->log) + 1;
+    } else {
+        next_index = replication->next_index;
+    }
+
+    /* From Section §3.5:
+     *
+     *   When sending an AppendEntries RPC, the leader includes the index and
+     *   term of the entry in its log that immediately precedes the new
+     *   entries. If the follower does not find an entry in its log with the
+     *   same index and term, then it refuses the new entries. The consistency
+     *   check acts as an induction step: the initial empty state of the logs
+     *   satisfies the Log Matching Property, and the consistency check
+     *   preserves the Log Matching Property whenever logs are extended. As a
+     *   result, whenever AppendEntries returns successfully, the leader knows
+     *   that the follower’s log is identical to its own log up through the new
+     *   entries (Log Matching Property in Figure 3.2).
+     */
+    if (next_index == 1) {
+        /* We're including the very first log entry, so prevIndex and prevTerm
+         * are null. */
+        if (log__term_of(&r->log, 1) == 0) {
+            if (has_read(r)) {
+                return send_append_entries_from_segments(r, i, next_index);
+            }
+            return raft_replication__send_snapshot(r, i);
+        }
+        prev_log_term = 0;
+    } else {
+        /* Set prevIndex and prevTerm to the index and term of the entry at
+         * next_index - 1 */
+        assert(next_index > 1);
+
+        prev_log_term = log__term_of(&r->log, next_index - 1);
+
+        /* If the entry was shifted away right before the ones still in our
+         * log, its term might still be known, in which case we can send them
+         * from memory. */
+        if (prev_log_term == 0 && next_index == log__first_index(&r->log)) {
+            prev_log_term = log__known_term_of(&r->log, next_index - 1);
+        }
+
+        /* If the entry is not anymore in our log, check the last index of the
+         * last snapshot. In case next_index - 1 is behind the snapshot last
+         * index, we don't know anymore about that section of log, so we need to
+         * send the whole snapshot. Otherwise if next_index - 1 is exactly the
+         * snapshot last index, we need to send all the current log.
+         *
+         * If the I/O implementation supports it, first try to read the missing
+         * entries back from disk, since they might have been retained. */
+        if (prev_log_term == 0) {
+            assert(r->snapshot.index > 0);
+            assert(next_index - 1 <= r->snapshot.index);
+            if (next_index - 1 < r->snapshot.index) {
+                if (has_read(r)) {
+                    return send_append_entries_from_segments(r, i, next_index);
+                }
+                infof(r->io, "missing entry at index %lld -> send snapshot",
+                      next_index - 1);
+                return raft_replication__send_snapshot(r, i);
+            }
+            prev_log_term = r->snapshot.term;
+        }
+    }
+
+    /* Cap the number of entries to send, so a lagging follower doesn't get a
+     * single huge message. If the follower's in-flight window is full, this is
+     * just a heartbeat. */
+    n = append_entries_count(r, i, next_index, &size);
+
+    /* While backtracking to find where the follower's log starts matching
+     * ours, the entries would be thrown away if the consistency check fails
+     * again, so send just the header until a match is confirmed. */
+    if (replication->state == REPLICATION__PROBE && replication->backtracking &&
+        next_index > 1 && next_index - 1 != replication->match_index) {
+        n = 0;
+        size = 0;
+    }
+
+    /* If the payload of the entries to send was evicted from memory, we need
+     * to read them back from disk first, unless we are over the bandwidth
+     * budget of background transfers, in which case this is a heartbeat. */
+    if (n > 0 && log__is_evicted(&r->log, next_index)) {
+        if (background_budget(r, &replication->bucket, replication->fast) > 0) {
+            return send_append_entries_from_disk(r, i, next_index, 0,
+                                                 prev_log_term, n, size);
+        }
+        n = 0;
+        size = 0;
+    }
+
+    request = pool__get(&r->pools.send_append_entries, sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    request->raft = r;
+    request->term = r->current_term;
+    request->server_id = server->id;
+    request->size = size;
+    request->prev_log_term = prev_log_term;
+    request->from_disk = false;
+    request->stripped = NULL;
+
+    /* The entries are acquired in a view embedded in the request, so small
+     * sends don't need to allocate an entries array. */
+    if (n > 0) {
+        rv = log__acquire_view(&r->log, next_index, n, &request->view);
+        if (rv != 0) {
+            goto err_after_request_alloc;
+        }
+        assert(request->view.n == n);
+    } else {
+        request->view.index = next_index;
+        request->view.entries = NULL;
+        request->view.n = 0;
+    }
+
+    rv = send_append_entries_request(r, server, request);
+    if (rv != 0) {
+        goto err_after_entries_acquired;
+    }
+
+    replication->inflight_bytes += size;
+    replication->last_send = io__time(r->io);
+    replication->last_commit = r->commit_index;
+    rtt_start(r, replication, next_index + n - 1);
+
+    /* In pipeline mode we optimistically assume that the entries we just sent
+     * will be appended by the follower, so the next request can start right
+     * after them without waiting for a result. */
+    if (replication->state == REPLICATION__PIPELINE) {
+        replication->next_index = next_index + n;
+    }
+
+    return 0;
+
+err_after_entries_acquired:
+    log__release_view(&r->log, &request->view);
+
+err_after_request_alloc:
+    pool__put(&r->pools.send_append_entries, request);
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
+/* Called after a successful append entries I/O request to update the index of
+ * the last entry stored on disk. Return how many new entries that are still
+ * present in our in-memory log were stored. */
+static size_t update_last_stored(struct raft *r,
+                                 raft_index first_index,
+                                 struct raft_entry *entries,
+                                 size_t n_entries)
+{
+    size_t i;
+
+    /* Check which of these entries is still in our in-memory log */
+    for (i = 0; i < n_entries; i++) {
+        struct raft_entry *entry = &entries[i];
+        raft_index index = first_index + i;
+        raft_term local_term = log__term_of(&r->log, index);
+
+        /* If we have no entry at this index, or if the entry we have now has a
+         * different term, it means that this entry got truncated, so let's stop
+         * here. */
+        if (local_term == 0 || (local_term > 0 && local_term != entry->term)) {
+            break;
+        }
+
+        assert(local_term != 0 && local_term == entry->term);
+    }
+
+    r->last_stored += i;
+    return i;
+}
+
+static void raft_replication__leader_append_cb(void *data, int status)
+{
+    struct raft_replication__leader_append *request = data;
+    struct raft *r = request->raft;
+    size_t server_index;
+    int rv;
+
+    debugf(r->io, "write log completed on leader: status %d", status);
+    trace__point(r, append_done, RAFT_TRACE_APPEND_DONE, 0, 0,
+                 r->current_term, request->index, request->n, status);
+
+    update_last_stored(r, request->index, request->entries, request->n);
+
+    /* Tell the log that we're done referencing these entries. */
+    log__release(&r->log, request->index, request->entries, request->n);
+
+    raft_free(request);
+
+    /* If we are not leader anymore, just discard the result. */
+    if (r->state != RAFT_LEADER) {
+        debugf(r->io, "local server is not leader -> ignore write log result");
+        return;
+    }
+
+    /* TODO: in case this is a failed disk write and we were the leader creating
+     * these entries in the first place, should we truncate our log too? since
+     * we have appended these entries to it. */
+    if (status != 0) {
+        return;
+    }
+
+    /* If Check if we have reached a quorum. */
+    server_index = configuration__index_of(&r->configuration, r->id);
+
+    /* Only update the next index if we are part of the current
+     * configuration. The only case where this is not true is when we were
+     * asked to remove ourselves from the cluster.
+     *
+     * From Section 4.2.2:
+     *
+     *   there will be a period of time (while it is committing Cnew) when a
+     *   leader can manage a cluster that does not include itself; it
+     *   replicates log entries but does not count itself in majorities.
+     */
+    if (server_index < r->configuration.n) {
+        r->leader_state.replication[server_index].match_index = r->last_stored;
+    } else {
+        const struct raft_entry *entry = log__get(&r->log, r->last_stored);
+        assert(entry->type == RAFT_CONFIGURATION);
+    }
+
+    /* Check if we can commit some new entries. A majority of followers might
+     * have stored them already, in which case this is a no-op, but the commit
+     * hint can now cover them. */
+    raft_replication__quorum(r);
+    update_commit_hint(r);
+
+    rv = raft_replication__apply(r);
+    if (rv != 0) {
+        /* TODO: just log the error? */
+    }
+
+    if (r->state == RAFT_LEADER) {
+        read__process(r);
+    }
+}
+
+static int raft_replication__leader_append(struct raft *r, unsigned index)
+{
+    struct raft_entry *entries;
+    unsigned n;
+    struct raft_replication__leader_append *request;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (index == 0) {
+        return 0;
+    }
+
+    /* Acquire all the entries from the given index onwards. */
+    rv = log__acquire(&r->log, index, &entries, &n);
+    if (rv != 0) {
+        goto err;
+    }
+
+    /* We expect this function to be called only when there are actually
+     * some entries to write. */
+    assert(n > 0);
+
+    /* Allocate a new request. */
+    request = raft_malloc(sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_entries_acquired;
+    }
+
+    request->raft = r;
+    request->index = index;
+    request->entries = entries;
+    request->n = n;
+
+    rv = io__append(r->io, entries, n, request,
+                    raft_replication__leader_append_cb);
+    if (rv != 0) {
+        goto err_after_request_alloc;
+    }
+
+    r->counters.n_appended += n;
+    trace__point(r, append, RAFT_TRACE_APPEND, 0, 0, r->current_term, index,
+                 n, 0);
+
+    return 0;
+
+err_after_request_alloc:
+    raft_free(request);
+
+err_after_entries_acquired:
+    log__release(&r->log, index, entries, n);
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Send an AppendEntries message to the i'th server, as part of a
+ * raft_replication__trigger() call for the entries up to @index, or for a
+ * heartbeat round if @index is zero. */
+static void trigger_server(struct raft *r,
+                           size_t i,
+                           raft_index index,
+                           raft_time now)
+{
+    struct raft_server *server = &r->configuration.servers[i];
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    unsigned heartbeat_timeout = heartbeat_timeout_of(r, server);
+    int rv;
+
+    if (server->id == r->id) {
+        return;
+    }
+
+    /* Send the heartbeat only if we were idle. */
+    if (index == 0) {
+        /* Followers that were sent an AppendEntries request within the last
+         * heartbeat timeout don't need a heartbeat yet. */
+        if (replication->last_send != 0 &&
+            now - replication->last_send < heartbeat_timeout) {
+            return;
+        }
+        /* TODO: since we don't yet keep a last_contact array which is
+         * independent from the replication array, if the value is 0 it means
+         * that this is the very first heartbeat being sent after election. In
+         * this case we unconditionally send a heartbeat message and we set
+         * last_contact to know to avoid thinking that we lost contact. */
+        if (replication->last_contact == 0) {
+            replication->last_contact = now;
+        } else if (now - replication->last_contact < heartbeat_timeout / 2) {
+            return;
+        }
+    }
+
+    rv = raft_replication__send_append_entries(r, i);
+    if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+        /* This is not a critical failure, let's just log it. */
+        warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
+              server->id, raft_strerror(rv), rv);
+    }
+}
+
+/* Start collecting the AppendEntries messages carrying new entries, if the
+ * I/O backend can submit them together. */
+static void broadcast_start(struct raft *r)
+{
+    unsigned n = r->configuration.n;
+
+    assert(r->broadcast.messages == NULL);
+
+    if (r->io->version < 10 || r->io->broadcast == NULL || n < 3) {
+        return;
+    }
+
+    r->broadcast.reqs = raft_malloc(n * sizeof *r->broadcast.reqs);
+    r->broadcast.messages = raft_malloc(n * sizeof *r->broadcast.messages);
+    r->broadcast.statuses = raft_malloc(n * sizeof *r->broadcast.statuses);
+    r->broadcast.n = 0;
+
+    /* Just send the messages one by one if we're out of memory. */
+    if (r->broadcast.reqs == NULL || r->broadcast.messages == NULL ||
+        r->broadcast.statuses == NULL) {
+        raft_free(r->broadcast.reqs);
+        raft_free(r->broadcast.messages);
+        raft_free(r->broadcast.statuses);
+        r->broadcast.messages = NULL;
+    }
+}
+
+/* Return true if the given AppendEntries messages carry the same entries. Each
+ * request has its own copy of the entries array, but the payloads are shared
+ * with the in-memory log. */
+static bool broadcast_same_entries(const struct raft_message *m1,
+                                   const struct raft_message *m2)
+{
+    const struct raft_append_entries *a1 = &m1->append_entries;
+    const struct raft_append_entries *a2 = &m2->append_entries;
+    unsigned n = a1->n_entries;
+
+    return a1->prev_log_index == a2->prev_log_index && a2->n_entries == n &&
+           a1->entries[0].buf.base == a2->entries[0].buf.base &&
+           a1->entries[n - 1].buf.base == a2->entries[n - 1].buf.base;
+}
+
+/* Swap the i'th and j'th collected messages. */
+static void broadcast_swap(struct raft_io_send *reqs[],
+                           struct raft_message messages[],
+                           unsigned i,
+                           unsigned j)
+{
+    struct raft_io_send *req = reqs[i];
+    struct raft_message message = messages[i];
+
+    reqs[i] = reqs[j];
+    messages[i] = messages[j];
+    reqs[j] = req;
+    messages[j] = message;
+}
+
+/* Handle a collected message that could not be submitted as if it had failed
+ * right after being sent, rewinding the pipeline of its target, since the
+ * follower won't see those entries. */
+static void broadcast_failed(struct raft *r, struct raft_io_send *req, int rv)
+{
+    struct send_append_entries *request = req->data;
+    struct raft_replication *replication;
+    size_t i;
+
+    i = send_append_entries_server_index(r, request);
+    if (i < r->configuration.n) {
+        replication = &r->leader_state.replication[i];
+        if (replication->state == REPLICATION__PIPELINE &&
+            replication->next_index == request->view.index + request->view.n) {
+            replication->next_index = request->view.index;
+        }
+    }
+
+    if (rv != RAFT_ERR_IO_CONNECT) {
+        warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
+              request->server_id, raft_strerror(rv), rv);
+    }
+
+    raft_replication__send_append_entries_cb(req, rv);
+}
+
+/* Submit the collected messages, passing the ones carrying the same entries
+ * to raft_io->broadcast() in a single call. */
+static void broadcast_flush(struct raft *r)
+{
+    struct raft_io_send **reqs = r->broadcast.reqs;
+    struct raft_message *messages = r->broadcast.messages;
+    int *statuses = r->broadcast.statuses;
+    unsigned n = r->broadcast.n;
+    unsigned i;
+    unsigned j;
+    unsigned k;
+
+    /* Stop collecting, in case a failure triggers new sends. */
+    r->broadcast.messages = NULL;
+
+    for (i = 0; i < n; i = k) {
+        /* Group the messages carrying the same entries as the i'th one. */
+        k = i + 1;
+        for (j = k; j < n; j++) {
+            if (broadcast_same_entries(&messages[i], &messages[j])) {
+                broadcast_swap(reqs, messages, j, k);
+                k++;
+            }
+        }
+        if (k - i > 1) {
+            io__broadcast(r->io, &reqs[i], &messages[i], k - i,
+                          &statuses[i],
+                          raft_replication__send_append_entries_cb);
+        } else {
+            statuses[i] = io__send(r->io, reqs[i], &messages[i],
+                                   raft_replication__send_append_entries_cb);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (statuses[i] != 0) {
+            broadcast_failed(r, reqs[i], statuses[i]);
+        }
+    }
+
+    raft_free(reqs);
+    raft_free(messages);
+    raft_free(statuses);
+}
+
+int raft_replication__trigger(struct raft *r, raft_index index)
+{
+    raft_index grouped = r->group_commit.index;
+    raft_time now;
+    size_t i;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    /* New entries must reach followers, so stop hibernating. */
+    if (index != 0) {
+        tick__wake(r);
+    }
+
+    /* Also write any entry whose replication is waiting for group commit. */
+    if (index != 0 && grouped != 0) {
+        assert(grouped <= index);
+        index = grouped;
+        r->group_commit.index = 0;
+    }
+
+    rv = raft_replication__leader_append(r, index);
+    if (rv != 0) {
+        r->group_commit.index = grouped;
+        goto err;
+    }
+
+    /* Reset the heartbeat timer: for a full request_timeout period we'll be
+     * good and we won't need to contact followers again, since this was not an
+     * idle period.
+     *
+     * From Figure 3.1:
+     *
+     *   [Rules for Servers] Leaders: Upon election: send initial empty
+     *   AppendEntries RPCs (heartbeat) to each server; repeat during idle
+     *   periods to prevent election timeouts
+     */
+    r->timer = 0;
+
+    now = io__time(r->io);
+
+    if (index != 0) {
+        broadcast_start(r);
+    }
+
+    /* Trigger replication for servers we didn't hear from recently, sending
+     * first to the voting servers forming the fastest quorum, then to the
+     * other voting ones, and finally to learners, so that servers far away
+     * don't delay the messages that commit entries. */
+    update_fast_quorum(r);
+    for (i = 0; i < r->configuration.n; i++) {
+        if (r->leader_state.replication[i].fast) {
+            trigger_server(r, i, index, now);
+        }
+    }
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+        if (!r->leader_state.replication[i].fast && !is_learner(r, server)) {
+            trigger_server(r, i, index, now);
+        }
+    }
+    for (i = 0; i < r->configuration.n; i++) {
+        if (is_learner(r, &r->configuration.servers[i])) {
+            trigger_server(r, i, index, now);
+        }
+    }
+
+    if (r->broadcast.messages != NULL) {
+        broadcast_flush(r);
+    }
+
+    return 0;
+
+err:
+    assert(rv != 0);
+
+    return rv;
+}
+
+static void group_commit_cb(struct raft_io_defer *req)
+{
+    struct raft *r = req->data;
+    raft_index index = r->group_commit.index;
+    raft__queue *head;
+    int rv;
+
+    r->group_commit.scheduled = false;
+
+    /* Nothing to do if the entries were already written together with some
+     * other entry, or if we lost leadership. */
+    if (index == 0) {
+        return;
+    }
+    assert(r->state == RAFT_LEADER);
+
+    r->group_commit.index = 0;
+
+    rv = raft_replication__trigger(r, index);
+    if (rv == 0) {
+        return;
+    }
+
+    /* Discard the grouped entries and fail their apply requests. */
+    log__truncate(&r->log, index);
+
+    head = RAFT__QUEUE_HEAD(&r->leader_state.apply_reqs);
+    while (head != &r->leader_state.apply_reqs) {
+        struct raft_apply *apply;
+        apply = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
+        head = RAFT__QUEUE_NEXT(head);
+        if (apply->index < index) {
+            continue;
+        }
+        RAFT__QUEUE_REMOVE(&apply->queue);
+        if (apply->cb != NULL) {
+            apply->cb(apply, rv);
+        }
+    }
+}
+
+int raft_replication__trigger_grouped(struct raft *r, const raft_index index)
+{
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (!r->group_commit.enabled || !has_defer(r)) {
+        return raft_replication__trigger(r, index);
+    }
+
+    if (r->group_commit.index == 0) {
+        r->group_commit.index = index;
+    }
+
+    if (r->group_commit.scheduled) {
+        return 0;
+    }
+
+    r->group_commit.req.data = r;
+    rv = r->io->defer(r->io, &r->group_commit.req, group_commit_cb);
+    if (rv != 0) {
+        /* Fall back to replicating the entries right away. */
+        return raft_replication__trigger(r, index);
+    }
+    r->group_commit.scheduled = true;
+
+    return 0;
+}
+
+/**
+ * Helper to be invoked after a promotion of a non-voting server has been
+ * requested via @raft_promote and that server has caught up with logs.
+ *
+ * This function changes the local configuration marking the server being
+ * promoted as actually voting, appends the a RAFT_CONFIGURATION entry with
+ * the new configuration to the local log and triggers its replication.
+ */
+static int raft_replication__trigger_promotion(struct raft *r)
+{
+    raft_index index;
+    raft_term term = r->current_term;
+    raft_term last_term;
+    size_t server_index;
+    struct raft_server *server;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+    assert(r->leader_state.promotee_id != 0);
+
+    server_index =
+        configuration__index_of(&r->configuration, r->leader_state.promotee_id);
+    assert(server_index < r->configuration.n);
+
+    server = &r->configuration.servers[server_index];
+
+    assert(!server->voting);
+
+    /* Update our current configuration. */
+    configuration__set_voting(&r->configuration, server_index, true);
+
+    /* Index of the entry being appended. */
+    local_last_index_and_term(r, &index, &last_term);
+    index += 1;
+
+    /* Encode the new configuration and append it to the log. */
+    rv = log__append_configuration(&r->log, term, &r->configuration);
+    if (rv != 0) {
+        goto err;
+    }
+
+    /* Start writing the new log entry to disk and send it to the followers. */
+    rv = raft_replication__trigger(r, index);
+    if (rv != 0) {
+        goto err_after_log_append;
+    }
+
+    r->leader_state.promotee_id = 0;
+    r->configuration_uncommitted_index = log__last_index(&r->log);
+
+    return 0;
+
+err_after_log_append:
+    log__truncate(&r->log, index);
+
+err:
+    configuration__set_voting(&r->configuration, server_index, false);
+
+    assert(rv != 0);
+    return rv;
+}
+
+/* Return the payload of the entries that the server being promoted replicated
+ * while catching up, up to @match_index, as far as they're still in the log. */
+static size_t catch_up_bytes(struct raft *r, raft_index match_index)
+{
+    size_t bytes = 0;
+    raft_index i;
+
+    for (i = r->leader_state.catch_up_from + 1; i <= match_index; i++) {
+        const struct raft_entry *entry = log__get(&r->log, i);
+        if (entry != NULL) {
+            bytes += entry->buf.len;
+        }
+    }
+
+    return bytes;
+}
+
+int raft_replication__update(struct raft *r,
+                             const struct raft_server *server,
+                             const struct raft_append_entries_result *result)
+{
+    size_t server_index;
+    struct raft_replication *replication;
+    raft_index last_log_index;
+    bool is_being_promoted;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    server_index = configuration__index_of(&r->configuration, server->id);
+    assert(server_index < r->configuration.n);
+
+    replication = &r->leader_state.replication[server_index];
+    replication->last_contact = io__time(r->io);
+    if (result->seq > replication->ack_seq) {
+        replication->ack_seq = result->seq;
+    }
+    if (read__round_time(r, result->seq) > replication->ack_time) {
+        replication->ack_time = read__round_time(r, result->seq);
+    }
+    rtt_stop(r, replication, result);
+
+    /* The server has part of the snapshot we are sending it: resume from there,
+     * restarting the transfer if it's over. */
+    if (result->snapshot_offset > 0) {
+        replication->resume_index = result->snapshot_index;
+        replication->resume_offset = result->snapshot_offset;
+        if (!replication->sending_snapshot) {
+            replication->state = REPLICATION__PROBE;
+            raft_replication__send_append_entries(r, server_index);
+        }
+        return 0;
+    }
+
+    /* Reset the replication state to probe, as we might need to send the
+     * snapshot again. */
+    if (replication->state == REPLICATION__SNAPSHOT) {
+        debugf(r->io, "reset replication from snapshot to probe");
+        replication->state = REPLICATION__PROBE;
+
+        /* A follower that installed the snapshot and has no entry after it
+         * rejects our heartbeats, but reports the snapshot's last index: probe
+         * right after it instead of sending the snapshot again. */
+        if (!result->success &&
+            result->last_log_index >= replication->next_index) {
+            replication->next_index =
+                min(result->last_log_index, log__last_index(&r->log)) + 1;
+            raft_replication__send_append_entries(r, server_index);
+            return 0;
+        }
+    }
+
+    /* If the reported index is lower than the match index, it must be an out of
+     * order response for an old append entries. Ignore it. */
+    if (replication->match_index > replication->next_index - 1) {
+        debugf(r->io, "match index higher than reported next index -> ignore");
+        return 0;
+    }
+
+    last_log_index = log__last_index(&r->log);
+
+    /* If the RPC failed because of a log mismatch, retry.
+     *
+     * From Figure 3.1:
+     *
+     *   [Rules for servers] Leaders:
+     *
+     *   - If AppendEntries fails because of log inconsistency:
+     *     decrement nextIndex and retry.
+     */
+    if (!result->success) {
+        /* If we were pipelining, the next index is just an optimistic guess
+         * and some of the requests in flight were rejected, so go back to
+         * probing from the last entry we know the follower has. */
+        if (replication->state == REPLICATION__PIPELINE) {
+            replication->state = REPLICATION__PROBE;
+            replication->next_index = replication->match_index + 1;
+
+            infof(r->io, "pipeline rejected -> probe from %ld",
+                  replication->next_index);
+
+            /* Retry, ignoring errors. */
+            raft_replication__send_append_entries(r, server_index);
+
+            return 0;
+        }
+
+        /* If the match index is already up-to-date then the rejection must be
+         * stale and come from an out of order message. */
+        if (replication->match_index == replication->next_index - 1) {
+            debugf(r->io, "match index is up to date -> ignore ");
+            return 0;
+        }
+
+        /* If the peer reports a last index lower than what we believed was its
+         * next index, decrerment the next index to whatever is shorter: our log
+         * or the peer log. If the peer reports a conflicting term, skip all its
+         * entries with that term in one go: either resume right after our last
+         * entry with that term, or from the first index the peer has for it if
+         * we have no such entry. Otherwise just blindly decrement next_index by
+         * 1. */
+        if (result->last_log_index < replication->next_index - 1) {
+            replication->next_index =
+                min(result->last_log_index, last_log_index);
+        } else if (result->conflict_term != 0) {
+            raft_index index;
+            index = log__last_index_of_term(&r->log, result->conflict_term);
+            if (index != 0) {
+                index = index + 1;
+            } else {
+                index = result->conflict_index;
+            }
+            replication->next_index = min(index, replication->next_index - 1);
+        } else {
+            replication->next_index = replication->next_index - 1;
+        }
+
+        replication->next_index =
+            max(replication->next_index, replication->match_index + 1);
+        replication->next_index = max(replication->next_index, 1);
+        replication->backtracking = true;
+
+        infof(r->io, "log mismatch -> send old entries %ld",
+              replication->next_index);
+
+        /* Retry, ignoring errors. */
+        raft_replication__send_append_entries(r, server_index);
+
+        return 0;
+    }
+
+    if (result->last_log_index <= replication->match_index) {
+        /* Like above, this must be a stale response. */
+        debugf(r->io, "match index is up to date -> ignore ");
+
+        return 0;
+    }
+
+    /* In case of success the remote server is expected to send us back the
+     * value of prevLogIndex + len(entriesToAppend). */
+    assert(result->last_log_index <= last_log_index);
+
+    /* If the RPC succeeded, update our counters for this server.
+     *
+     * From Figure 3.1:
+     *
+     *   [Rules for servers] Leaders:
+     *
+     *   If successful update nextIndex and matchIndex for follower.
+     *
+     * When pipelining, the next index might already be ahead of the reported
+     * index because of requests still in flight, so never move it back.
+     */
+    if (replication->state == REPLICATION__PIPELINE) {
+        replication->next_index =
+            max(replication->next_index, result->last_log_index + 1);
+    } else {
+        replication->next_index = result->last_log_index + 1;
+    }
+    replication->match_index = result->last_log_index;
+    debugf(r->io, "match/next idx for server %ld: %ld/%ld", server->id,
+           replication->match_index, replication->next_index);
+
+    /* If the server is currently being promoted and is catching with logs,
+     * update the information about the current catch-up round, and possibly
+     * proceed with the promotion. */
+    is_being_promoted = r->leader_state.promotee_id != 0 &&
+                        r->leader_state.promotee_id == server->id;
+    if (is_being_promoted) {
+        int is_up_to_date = raft_membership__update_catch_up_round(r);
+        if (is_up_to_date) {
+            raft_watch__lifecycle(r, RAFT_EVENT_CATCH_UP_FINISHED, server->id,
+                                  replication->match_index,
+                                  r->leader_state.catch_up_start,
+                                  catch_up_bytes(r, replication->match_index),
+                                  0);
+            rv = raft_replication__trigger_promotion(r);
+            if (rv != 0) {
+                return rv;
+            }
+        }
+    }
+
+    /* If we are transferring leadership to this server, check if it has caught
+     * up with our log. */
+    raft_transfer__progress(r);
+
+    /* Now that we know where the follower's log ends, we can stop probing and
+     * start streaming new entries without waiting for each result. If we were
+     * backtracking, the probe only carried the header, so send the entries
+     * right away. */
+    if (replication->state == REPLICATION__PROBE) {
+        debugf(r->io, "switch server %ld to pipeline mode", server->id);
+        replication->state = REPLICATION__PIPELINE;
+        if (!replication->backtracking) {
+            return 0;
+        }
+        replication->backtracking = false;
+    }
+
+    /* When pipelining the next index points right after the last entry that
+     * was sent, so if it's behind our log it means that the previous messages
+     * were capped by the append limits: keep feeding the follower. */
+    if (replication->next_index <= log__last_index(&r->log)) {
+        /* Send more, ignoring errors. */
+        raft_replication__send_append_entries(r, server_index);
+    }
+
+    return 0;
+}
+
+static void raft_replication__follower_respond_cb(struct raft_io_send *req,
+                                                  int status)
+{
+    struct raft *r = req->data;
+    (void)status;
+    pool__put(&r->pools.send, req);
+}
+
+/* Acknowledge all the entries stored so far with a single AppendEntries
+ * result, if we are still following the leader the held back result is for. */
+static void follower_send_ack(struct raft *r)
+{
+    struct raft_message message;
+    struct raft_append_entries_result *result = &message.append_entries_result;
+    struct raft_io_send *req;
+    raft_term term = r->ack_batch.term;
+    int rv;
+
+    r->ack_batch.term = 0;
+
+    if (r->state != RAFT_FOLLOWER || r->current_term != term ||
+        r->follower_state.current_leader.id != r->ack_batch.leader_id) {
+        return;
+    }
+
+    result->term = r->current_term;
+    result->success = true;
+    result->last_log_index = r->last_stored;
+    result->conflict_term = 0;
+    result->conflict_index = 0;
+    result->snapshot_index = 0;
+    result->snapshot_offset = 0;
+    result->seq = raft_replication__seq(r);
+
+    message.type = RAFT_IO_APPEND_ENTRIES_RESULT;
+    message.server_id = r->follower_state.current_leader.id;
+    message.server_address = r->follower_state.current_leader.address;
+
+    req = pool__get(&r->pools.send, sizeof *req);
+    if (req == NULL) {
+        return;
+    }
+    req->data = r;
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message,
+                  raft_replication__follower_respond_cb);
+    if (rv != 0) {
+        pool__put(&r->pools.send, req);
+    }
+}
+
+void raft_replication__flush_ack(struct raft *r)
+{
+    raft_time now;
+
+    if (r->ack_batch.term == 0) {
+        return;
+    }
+
+    now = io__time(r->io);
+    if (r->ack_batch.max_delay > 0 &&
+        now - r->ack_batch.time < r->ack_batch.max_delay) {
+        return;
+    }
+
+    follower_send_ack(r);
+}
+
+static void ack_batch_cb(struct raft_io_defer *req)
+{
+    struct raft *r = req->data;
+
+    r->ack_batch.scheduled = false;
+    raft_replication__flush_ack(r);
+
+    /* If the result is still held back, make sure we tick by its deadline. */
+    if (r->ack_batch.term != 0) {
+        tick__schedule(r);
+    }
+}
+
+/* Hold back the result acknowledging the entries just persisted, merging it
+ * with the ones of the entries persisted during the same loop iteration. */
+static int follower_batch_ack(struct raft *r)
+{
+    int rv;
+
+    /* Drop any result held back for a previous leader. */
+    if (r->ack_batch.term != r->current_term ||
+        r->ack_batch.leader_id != r->follower_state.current_leader.id) {
+        r->ack_batch.term = 0;
+    }
+
+    if (r->ack_batch.term == 0) {
+        r->ack_batch.term = r->current_term;
+        r->ack_batch.leader_id = r->follower_state.current_leader.id;
+        r->ack_batch.time = io__time(r->io);
+    }
+
+    if (r->ack_batch.scheduled) {
+        return 0;
+    }
+
+    r->ack_batch.req.data = r;
+    rv = r->io->defer(r->io, &r->ack_batch.req, ack_batch_cb);
+    if (rv != 0) {
+        r->ack_batch.term = 0;
+        return rv;
+    }
+    r->ack_batch.scheduled = true;
+
+    return 0;
+}
+
+static void raft_replication__follower_append_cb(void *data, int status)
+{
+    struct raft_replication__follower_append *request = data;
+    struct raft *r = request->raft;
+    struct raft_append_entries *args = &request->args;
+    struct raft_message message;
+    struct raft_append_entries_result *result = &message.append_entries_result;
+    struct raft_io_send *req;
+    size_t i;
+    size_t j;
+    int rv;
+
+    debugf(r->io, "I/O completed on follower: status %d", status);
+    trace__point(r, append_done, RAFT_TRACE_APPEND_DONE, 0, 0,
+                 r->current_term, request->index, args->n_entries, status);
+
+    assert(args->leader_id > 0);
+    assert(args->entries != NULL);
+    assert(args->n_entries > 0);
+
+    i = update_last_stored(r, request->index, args->entries, args->n_entries);
+
+    /* If we are not followers anymore, just discard the result. */
+    if (r->state != RAFT_FOLLOWER) {
+        debugf(r->io, "local server is not follower -> ignore I/O result");
+        goto out;
+    }
+
+    result->conflict_term = 0;
+    result->conflict_index = 0;
+    result->snapshot_index = 0;
+    result->snapshot_offset = 0;
+
+    if (status != 0) {
+        result->success = false;
+        goto respond;
+    }
 
     result->term = r->current_term;
 
-    /* If none of the entries that we persisted is present anymore in our
-     * in-memory log, there's nothing to report or to do. We just discard
-     * them. */
-    if (i == 0) {
+    /* If none of the entries that we persisted is present anymore in our
+     * in-memory log, there's nothing to report or to do. We just discard
+     * them. */
+    if (i == 0) {
+        goto out;
+    }
+
+    /* The commit index might have advanced past the entries we had stored. */
+    if (r->commit_index > r->last_stored - i) {
+        update_commit_hint(r);
+    }
+
+    /* Possibly apply configuration changes. */
+    for (j = 0; j < i; j++) {
+        struct raft_entry *entry = &args->entries[j];
+        raft_index index = request->index + j;
+        raft_term local_term = log__term_of(&r->log, index);
+
+        assert(local_term != 0 && local_term == entry->term);
+
+        /* If this is a configuration change entry, check if the change is about
+         * promoting a non-voting server to voting, and in that case update our
+         * configuration cache. */
+        if (entry->type == RAFT_CONFIGURATION) {
+            rv = raft_membership__apply(r, index, entry);
+            if (rv != 0) {
+                goto out;
+            }
+        }
+    }
+
+    /* From Figure 3.1:
+     *
+     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
+     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
+     *   entry).
+     */
+    if (args->leader_commit > r->commit_index) {
+        set_commit_index(r, min(args->leader_commit, r->last_stored));
+        rv = raft_replication__apply(r);
+        if (rv != 0) {
+            goto out;
+        }
+        read__process(r);
+    }
+
+    result->success = true;
+
+    /* If batching is enabled, acknowledge the entries later, together with
+     * others. Fall back to responding right away if that's not possible. */
+    if (r->ack_batch.enabled && has_defer(r)) {
+        rv = follower_batch_ack(r);
+        if (rv == 0) {
+            goto out;
+        }
+    }
+
+respond:
+    result->last_log_index = r->last_stored;
+    result->seq = raft_replication__seq(r);
+
+    message.type = RAFT_IO_APPEND_ENTRIES_RESULT;
+    message.server_id = r->follower_state.current_leader.id;
+    message.server_address = r->follower_state.current_leader.address;
+
+    req = pool__get(&r->pools.send, sizeof *req);
+    if (req == NULL) {
+        goto out;
+    }
+    req->data = r;
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message,
+                  raft_replication__follower_respond_cb);
+    if (rv != 0) {
+        pool__put(&r->pools.send, req);
+        goto out;
+    }
+
+out:
+    log__release(&r->log, request->index, request->args.entries,
+                 request->args.n_entries);
+
+    pool__put(&r->pools.follower_append, request);
+}
+
+/**
+ * Check that the log matching property against an incoming AppendEntries
+ * request.
+ *
+ * From Figure 3.1:
+ *
+ *   [AppendEntries RPC] Receiver implementation:
+ *
+ *   2. Reply false if log doesn't contain an entry at prevLogIndex whose
+ *   term matches prevLogTerm.
+ *
+ * Return 0 if the check passed.
+ *
+ * Return 1 if the check did not pass and the request needs to be rejected.
+ *
+ * Return -1 if there's a conflict and we need to shutdown.
+ */
+static int raft_replication__check_prev_log_entry(
+    struct raft *r,
+    const struct raft_append_entries *args)
+{
+    raft_term local_prev_term;
+
+    /* If this is the very first entry, there's nothing to check. */
+    if (args->prev_log_index == 0) {
+        return 0;
+    }
+
+    if (r->snapshot.index == args->prev_log_index) {
+        local_prev_term = r->snapshot.term;
+    } else {
+        local_prev_term = log__term_of(&r->log, args->prev_log_index);
+    }
+
+    if (local_prev_term == 0) {
+        debugf(r->io, "no entry at previous index -> reject");
+        return 1;
+    }
+
+    if (local_prev_term != args->prev_log_term) {
+        if (args->prev_log_index <= r->commit_index) {
+            /* Should never happen; something is seriously wrong! */
+            errorf(r->io,
+                   "previous index conflicts with "
+                   "committed entry -> shutdown");
+            return -1;
+        }
+        debugf(r->io, "previous term mismatch -> reject");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Return true if the I/O backend can truncate and append entries in one go. */
+static bool has_replace(struct raft *r)
+{
+    return r->io->version >= 12 && r->io->replace != NULL;
+}
+
+/**
+ * Delete from our log all entries that conflict with the ones in the given
+ * AppendEntries request.
+ *
+ * From Figure 3.1:
+ *
+ *   [AppendEntries RPC] Receiver implementation:
+ *
+ *   3. If an existing entry conflicts with a new one (same index but
+ *   different terms), delete the existing entry and all that follow it.
+ *
+ * The @i parameter will be set to the array index of the first new log entry
+ * that we don't have yet in our log, among the ones included in the given
+ * AppendEntries request.
+ *
+ * If the I/O backend can replace entries in one go, the entries are deleted
+ * only from the in-memory log, and @truncate is set to the index that the
+ * entries on disk must be truncated from, otherwise it's set to 0.
+ */
+static int raft_replication__delete_conflicting_entries(
+    struct raft *r,
+    const struct raft_append_entries *args,
+    size_t *i,
+    raft_index *truncate)
+{
+    size_t j;
+    int rv;
+
+    *truncate = 0;
+
+    for (j = 0; j < args->n_entries; j++) {
+        struct raft_entry *entry = &args->entries[j];
+        raft_index entry_index = args->prev_log_index + 1 + j;
+        raft_term local_term = log__term_of(&r->log, entry_index);
+
+        if (local_term > 0 && local_term != entry->term) {
+            if (entry_index <= r->commit_index) {
+                /* Should never happen; something is seriously wrong! */
+                errorf(r->io,
+                       "new index conflicts with "
+                       "committed entry -> shutdown");
+
+                return RAFT_ERR_SHUTDOWN;
+            }
+
+            debugf(r->io, "log mismatch -> truncate (%ld)", entry_index);
+
+            /* Discard any uncommitted voting change. */
+            rv = raft_membership__rollback(r);
+            if (rv != 0) {
+                return rv;
+            }
+
+            /* Delete all entries from this index on because they don't match */
+            if (has_replace(r)) {
+                *truncate = entry_index;
+            } else {
+                rv = r->io->truncate(r->io, entry_index);
+                if (rv != 0) {
+                    return rv;
+                }
+            }
+            log__truncate(&r->log, entry_index);
+            r->last_stored = entry_index - 1;
+
+            /* We want to append all entries from here on, replacing anything
+             * that we had before. */
+            break;
+        } else if (local_term == 0) {
+            /* We don't have an entry at this index, so we want to append this
+             * new one and all the subsequent ones. */
+            break;
+        }
+    }
+
+    *i = j;
+
+    return 0;
+}
+
+int raft_replication__append(struct raft *r,
+                             const struct raft_append_entries *args,
+                             bool *success,
+                             bool *async)
+{
+    struct raft_replication__follower_append *request;
+    raft_index truncate;
+    int match;
+    size_t n;
+    size_t i;
+    size_t j;
+    int rv;
+
+    assert(r != NULL);
+    assert(args != NULL);
+    assert(success != NULL);
+    assert(async != NULL);
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    *success = false;
+    *async = false;
+
+    /* Check the log matching property. */
+    match = raft_replication__check_prev_log_entry(r, args);
+    if (match != 0) {
+        assert(match == 1 || match == -1);
+        return match == 1 ? 0 : RAFT_ERR_SHUTDOWN;
+    }
+    rv = raft_replication__delete_conflicting_entries(r, args, &i, &truncate);
+    if (rv != 0) {
+        return rv;
+    }
+
+    *success = true;
+
+    n = args->n_entries - i; /* Number of new entries */
+
+    /* This is an empty AppendEntries, there's nothing to write. However we
+     * still want to check if we can commit some entry.
+     *
+     * From Figure 3.1:
+     *
+     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
+     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
+     *   entry).
+     */
+    if (n == 0) {
+        if (args->leader_commit > r->commit_index) {
+            raft_index last_index = log__last_index(&r->log);
+            /* After installing a snapshot the log might be empty. */
+            if (last_index == 0) {
+                last_index = r->snapshot.index;
+            }
+            set_commit_index(r, min(args->leader_commit, last_index));
+            rv = raft_replication__apply(r);
+            if (rv != 0) {
+                return rv;
+            }
+            read__process(r);
+        }
+
+        return 0;
+    }
+
+    *async = true;
+
+    request = pool__get(&r->pools.follower_append, sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+
+    request->raft = r;
+    request->args = *args;
+    request->index = args->prev_log_index + 1 + i;
+
+    /* Free the batches that only hold entries we already had, which might be
+     * the case if several messages were folded together. */
+    for (j = 0; j < i; j++) {
+        void *batch = args->entries[j].batch;
+        if (batch != NULL && batch != args->entries[i].batch &&
+            (j == 0 || batch != args->entries[j - 1].batch)) {
+            raft_free(batch);
+        }
+    }
+
+    /* Hand the new entries over to our in-memory log, along with their
+     * received array, which becomes the one acquired for the write. We'll
+     * notify the leader of a successful append once the write entries request
+     * that we issue below actually completes.  */
+    if (i > 0) {
+        memmove(args->entries, &args->entries[i], n * sizeof *args->entries);
+    }
+    request->args.n_entries = (unsigned)n;
+
+    rv = log__append_acquire(&r->log, request->args.entries, (unsigned)n);
+    if (rv != 0) {
+        /* TODO: we should revert any changes we made to the log */
+        goto err_after_request_alloc;
+    }
+
+    if (truncate > 0) {
+        assert(truncate == request->index);
+        rv = r->io->replace(r->io, truncate, request->args.entries,
+                            request->args.n_entries, request,
+                            raft_replication__follower_append_cb);
+        truncate = 0; /* The backend might have truncated anyway */
+    } else {
+        rv = io__append(r->io, request->args.entries, request->args.n_entries,
+                        request, raft_replication__follower_append_cb);
+    }
+    if (rv != 0) {
+        goto err_after_acquire_entries;
+    }
+
+    r->counters.n_appended += n;
+    trace__point(r, append, RAFT_TRACE_APPEND, 0, 0, r->current_term,
+                 request->index, n, 0);
+
+    *success = true;
+
+    return 0;
+
+err_after_acquire_entries:
+    log__release(&r->log, request->index, request->args.entries,
+                 request->args.n_entries);
+
+err_after_request_alloc:
+    pool__put(&r->pools.follower_append, request);
+
+err:
+    /* Keep the entries on disk in line with the in-memory log. */
+    if (truncate > 0) {
+        r->io->truncate(r->io, truncate);
+    }
+    assert(rv != 0);
+    return rv;
+}
+
+/* Make the log start after the given snapshot. */
+static void restore_snapshot_log(struct raft *r,
+                                 const struct raft_snapshot *snapshot)
+{
+    log__set_offset(&r->log, snapshot->index);
+
+    r->snapshot.index = snapshot->index;
+    r->snapshot.term = snapshot->term;
+    r->last_stored = snapshot->index;
+}
+
+/* Take over the configuration of the given snapshot. */
+static void restore_snapshot_configuration(struct raft *r,
+                                           struct raft_snapshot *snapshot)
+{
+    raft_configuration_close(&r->configuration);
+    r->configuration = snapshot->configuration;
+    r->configuration_index = snapshot->configuration_index;
+}
+
+/* Fire #RAFT_EVENT_SNAPSHOT_INSTALLED once the last snapshot received has been
+ * restored. */
+static void snapshot_installed(struct raft *r, raft_index index)
+{
+    raft_watch__lifecycle(r, RAFT_EVENT_SNAPSHOT_INSTALLED,
+                          r->snapshot.received.sender, index,
+                          r->snapshot.received.start, r->snapshot.size, 0);
+}
+
+/* Reset the log and the state machine using the given snapshot, taking over
+ * its data buffer and its configuration. */
+static void restore_snapshot(struct raft *r, struct raft_snapshot *snapshot)
+{
+    /* raft_term local_term; */
+    raft_index local_first_index;
+    int rv;
+
+    /* From Figure 5.3:
+     *
+     *   6. If existing entry has same index and term as lastIndex and lastTerm,
+     *      discard log up through lastIndex (but retain any following entries)
+     *      and reply.
+     */
+    /* TODO: at the moment we just ignore snapshots of entries that we have */
+    /* local_term = log__term_of(&r->log, snapshot->index); */
+    /* if (local_term == snapshot->term) { */
+    /*     log__shift(&r->log, snapshot->index); */
+    /*     goto err; */
+    /* } */
+
+    /* From Figure 5.3:
+     *
+     *   7. Discard the entire log
+     *   8. Reset state machine using snapshot contents (and load lastConfig
+     *      as cluster configuration).
+     */
+    local_first_index = log__first_index(&r->log);
+    assert(local_first_index == 0);
+    /* if (local_first_index > 0) { */
+    /*     log__truncate(&r->log, local_first_index); */
+    /* } */
+    restore_snapshot_log(r, snapshot);
+
+    r->snapshot.size = snapshot->bufs[0].len;
+
+    /* Witnesses only get the snapshot metadata. */
+    if (configuration__is_witness(&snapshot->configuration, r->id)) {
+        raft_free(snapshot->bufs[0].base);
+        restore_snapshot_configuration(r, snapshot);
+        return;
+    }
+
+    rv = r->fsm->restore(r->fsm, &snapshot->bufs[0]);
+    if (rv != 0) {
+        errorf(r->io, "restore snapshot %d: %s", snapshot->index,
+               raft_strerror(rv));
+        /* In case of error we must also free the snapshot data buffer and
+         * free the configuration. */
+        raft_free(snapshot->bufs[0].base);
+        raft_configuration_close(&snapshot->configuration);
+        return;
+    }
+
+    /* Don't free the snapshot data buffer, as ownership has been trasfered to
+     * the fsm. */
+    restore_snapshot_configuration(r, snapshot);
+    snapshot_installed(r, snapshot->index);
+}
+
+static void put_snapshot_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct recv_install_snapshot *request = req->data;
+    struct raft *r = request->raft;
+    struct raft_snapshot *snapshot = &request->snapshot;
+
+    r->snapshot.put.data = NULL;
+
+    if (status != 0) {
+        errorf(r->io, "save snapshot %d: %s", snapshot->index,
+               raft_strerror(status));
+        raft_free(snapshot->bufs[0].base);
+        raft_configuration_close(&snapshot->configuration);
+        goto out;
+    }
+
+    restore_snapshot(r, snapshot);
+
+out:
+    raft_free(snapshot->bufs);
+    raft_free(request);
+}
+
+/* Store the snapshot carried by the given arguments, taking over its data and
+ * configuration, and restore it once it's on disk. */
+static int install_snapshot_put(struct raft *r,
+                                const struct raft_install_snapshot *args)
+{
+    struct recv_install_snapshot *request;
+    struct raft_snapshot *snapshot;
+    int rv;
+
+    request = raft_malloc(sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    request->raft = r;
+
+    snapshot = &request->snapshot;
+    snapshot->term = args->last_term;
+    snapshot->index = args->last_index;
+    snapshot->configuration_index = args->conf_index;
+    snapshot->configuration = args->conf;
+
+    snapshot->bufs = raft_malloc(sizeof *snapshot->bufs);
+    if (snapshot->bufs == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_request_alloc;
+    }
+    snapshot->bufs[0] = args->data;
+    snapshot->n_bufs = 1;
+
+    /* TODO: we should truncate the in-memory log immediately */
+    assert(r->snapshot.put.data == NULL);
+    r->snapshot.put.data = request;
+    rv =
+        r->io->snapshot_put(r->io, &r->snapshot.put, snapshot, put_snapshot_cb);
+    if (rv != 0) {
+        goto err_after_bufs_alloc;
+    }
+
+    return 0;
+
+err_after_bufs_alloc:
+    raft_free(snapshot->bufs);
+    r->snapshot.put.data = NULL;
+err_after_request_alloc:
+    raft_free(request);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+/* Return true if the I/O backend can write a snapshot chunk by chunk. */
+static bool has_snapshot_put_chunk(struct raft *r)
+{
+    return r->io->version >= 3 && r->io->snapshot_put_chunk != NULL;
+}
+
+/* Return true if snapshots are taken by streaming chunks from the FSM. */
+static bool has_snapshot_stream(struct raft *r)
+{
+    return has_snapshot_put_chunk(r) && r->fsm->version >= 4 &&
+           r->fsm->snapshot_chunk != NULL;
+}
+
+/* Forget about the snapshot being received, if any. */
+static void install_reset(struct raft *r)
+{
+    if (r->snapshot.install.buf.base != NULL) {
+        raft_free(r->snapshot.install.buf.base);
+    }
+    r->snapshot.install.index = 0;
+    r->snapshot.install.term = 0;
+    r->snapshot.install.offset = 0;
+    r->snapshot.install.sender = 0;
+    r->snapshot.install.buf.base = NULL;
+    r->snapshot.install.buf.len = 0;
+}
+
+static void get_installed_snapshot_cb(struct raft_io_snapshot_get *req,
+                                      struct raft_snapshot *snapshot,
+                                      int status)
+{
+    struct recv_snapshot_chunk *chunk = req->data;
+    struct raft *r = chunk->raft;
+
+    r->snapshot.put.data = NULL;
+    raft_free(chunk);
+
+    if (status != 0) {
+        errorf(r->io, "load installed snapshot: %s", raft_strerror(status));
+        return;
+    }
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        snapshot__close(snapshot);
+        raft_free(snapshot);
+        return;
+    }
+
+    assert(snapshot->n_bufs == 1);
+    restore_snapshot(r, snapshot);
+    raft_free(snapshot->bufs);
+    raft_free(snapshot);
+}
+
+/* Return true if installed snapshots can be fed to the FSM chunk by chunk. */
+static bool has_restore_chunk(struct raft *r)
+{
+    return has_snapshot_read(r) && r->snapshot.chunk_size > 0 &&
+           r->fsm->version >= 6 && r->fsm->restore_chunk != NULL;
+}
+
+static void restore_snapshot_chunk_cb(struct raft_io_snapshot_read *req,
+                                      struct raft_snapshot *snapshot,
+                                      size_t size,
+                                      int status);
+
+/* Load the next chunk of the installed snapshot. */
+static int restore_snapshot_read(struct recv_snapshot_chunk *chunk)
+{
+    struct raft *r = chunk->raft;
+
+    chunk->read.data = chunk;
+
+    return r->io->snapshot_read(r->io, &chunk->read, chunk->snapshot.term,
+                                chunk->snapshot.index, chunk->offset,
+                                r->snapshot.chunk_size,
+                                restore_snapshot_chunk_cb);
+}
+
+static void restore_snapshot_chunk_cb(struct raft_io_snapshot_read *req,
+                                      struct raft_snapshot *snapshot,
+                                      size_t size,
+                                      int status)
+{
+    struct recv_snapshot_chunk *chunk = req->data;
+    struct raft *r = chunk->raft;
+    struct raft_buffer buf;
+    bool done;
+    int rv;
+
+    if (status != 0) {
+        errorf(r->io, "load installed snapshot: %s", raft_strerror(status));
         goto out;
     }
 
-    /* Possibly apply configuration changes. */
-    for (j = 0; j < i; j++) {
-        struct raft_entry *entry = &args->entries[j];
-        raft_index index = request->index + j;
-        raft_term local_term = log__term_of(&r->log, index);
+    assert(snapshot->n_bufs == 1);
+    buf = snapshot->bufs[0];
+    raft_free(snapshot->bufs);
+    snapshot->bufs = NULL;
+    snapshot->n_bufs = 0;
 
-        assert(local_term != 0 && local_term == entry->term);
+    if (r->state == RAFT_UNAVAILABLE) {
+        raft_free(buf.base);
+        goto err_after_read;
+    }
 
-        /* If this is a configuration change entry, check if the change is about
-         * promoting a non-voting server to voting, and in that case update our
-         * configuration cache. */
-        if (entry->type == RAFT_CONFIGURATION) {
-            rv = raft_membership__apply(r, index, entry);
-            if (rv != 0) {
-                goto out;
+    done = chunk->offset + buf.len == size;
+    if (!done && buf.len == 0) {
+        errorf(r->io, "load installed snapshot: no data at offset %lu",
+               chunk->offset);
+        raft_free(buf.base);
+        goto err_after_read;
+    }
+
+    /* The FSM takes over the chunk data, unless it fails. */
+    rv = r->fsm->restore_chunk(r->fsm, chunk->offset, &buf, done);
+    if (rv != 0) {
+        errorf(r->io, "restore snapshot %d: %s", snapshot->index,
+               raft_strerror(rv));
+        raft_free(buf.base);
+        goto err_after_read;
+    }
+
+    if (!done) {
+        chunk->offset += buf.len;
+        snapshot__close(snapshot);
+        raft_free(snapshot);
+        rv = restore_snapshot_read(chunk);
+        if (rv != 0) {
+            errorf(r->io, "load installed snapshot: %s", raft_strerror(rv));
+            goto out;
+        }
+        return;
+    }
+
+    restore_snapshot_log(r, snapshot);
+    restore_snapshot_configuration(r, snapshot);
+    r->snapshot.size = size;
+    snapshot_installed(r, snapshot->index);
+    raft_free(snapshot);
+    goto out;
+
+err_after_read:
+    snapshot__close(snapshot);
+    raft_free(snapshot);
+out:
+    r->snapshot.put.data = NULL;
+    raft_free(chunk);
+}
+
+static void put_snapshot_chunk_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct recv_snapshot_chunk *chunk = req->data;
+    struct raft *r = chunk->raft;
+    int rv;
+
+    raft_free(chunk->buf.base);
+    if (chunk->done) {
+        raft_configuration_close(&chunk->snapshot.configuration);
+    }
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        goto out;
+    }
+
+    if (status != 0) {
+        errorf(r->io, "save snapshot chunk %d: %s", chunk->snapshot.index,
+               raft_strerror(status));
+        if (r->snapshot.install.index == chunk->snapshot.index &&
+            r->snapshot.install.term == chunk->snapshot.term) {
+            install_reset(r);
+        }
+        goto out;
+    }
+
+    if (!chunk->done) {
+        goto out;
+    }
+
+    /* The snapshot is now complete on disk, load it back to restore it. */
+    if (has_restore_chunk(r)) {
+        chunk->offset = 0;
+        rv = restore_snapshot_read(chunk);
+    } else {
+        chunk->get.data = chunk;
+        rv = r->io->snapshot_get(r->io, &chunk->get,
+                                 get_installed_snapshot_cb);
+    }
+    if (rv != 0) {
+        errorf(r->io, "load installed snapshot: %s", raft_strerror(rv));
+        goto out;
+    }
+
+    return;
+
+out:
+    if (chunk->done) {
+        r->snapshot.put.data = NULL;
+    }
+    raft_free(chunk);
+}
+
+/* Store the data chunk carried by the given arguments, taking over its data
+ * buffer, and possibly its configuration if it's the last chunk. */
+static int install_snapshot_chunk(struct raft *r,
+                                  const struct raft_install_snapshot *args)
+{
+    struct recv_snapshot_chunk *chunk;
+    struct raft_buffer *buf = &r->snapshot.install.buf;
+    void *base;
+    int rv;
+
+    /* Without support for writing chunks, accumulate them in memory. */
+    if (!has_snapshot_put_chunk(r)) {
+        base = raft_realloc(buf->base, args->offset + args->data.len);
+        if (base == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
+        memcpy((char *)base + args->offset, args->data.base, args->data.len);
+        buf->base = base;
+        buf->len = args->offset + args->data.len;
+        raft_free(args->data.base);
+        goto out;
+    }
+
+    chunk = raft_malloc(sizeof *chunk);
+    if (chunk == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    chunk->raft = r;
+    chunk->snapshot.term = args->last_term;
+    chunk->snapshot.index = args->last_index;
+    chunk->snapshot.configuration_index = args->conf_index;
+    raft_configuration_init(&chunk->snapshot.configuration);
+    if (args->done) {
+        chunk->snapshot.configuration = args->conf;
+    }
+    chunk->snapshot.bufs = NULL;
+    chunk->snapshot.n_bufs = 0;
+    chunk->buf = args->data;
+    chunk->done = args->done;
+    chunk->put.data = chunk;
+
+    rv = r->io->snapshot_put_chunk(r->io, &chunk->put, &chunk->snapshot,
+                                   args->offset, &chunk->buf, args->done,
+                                   put_snapshot_chunk_cb);
+    if (rv != 0) {
+        raft_free(chunk);
+        goto err;
+    }
+
+    /* Mark that we're installing a snapshot, once the last chunk is in. */
+    if (args->done) {
+        assert(r->snapshot.put.data == NULL);
+        r->snapshot.put.data = chunk;
+    }
+
+out:
+    r->snapshot.install.offset += args->data.len;
+    return 0;
+
+err:
+    assert(rv != 0);
+    return rv;
+}
+
+int raft_replication__install_snapshot(struct raft *r,
+                                       unsigned id,
+                                       struct raft_install_snapshot *args,
+                                       bool *success,
+                                       bool *async,
+                                       size_t *offset)
+{
+    struct raft_install_snapshot whole;
+    raft_term local_term;
+    int rv;
+
+    assert(r->state == RAFT_FOLLOWER);
+
+    *success = false;
+    *async = false;
+    *offset = 0;
+
+    /* If we're streaming a snapshot of our own to disk, chunks can't be stored,
+     * the leader will eventually retry. */
+    if (r->snapshot.pending.term != 0 && has_snapshot_stream(r)) {
+        install_reset(r);
+        goto discard;
+    }
+
+    /* If the sender of the snapshot we have part of restarts its transfer, or
+     * skips some data, for example because the connection dropped, tell it
+     * where to resume from. Only the leader's own transfers are resumed, since
+     * the snapshot data of another server might differ. */
+    if (r->snapshot.install.index == args->last_index &&
+        r->snapshot.install.term == args->last_term &&
+        r->snapshot.install.sender == id && args->leader_id == id &&
+        r->snapshot.install.offset > 0 &&
+        r->snapshot.install.offset != args->offset) {
+        debugf(r->io, "snapshot chunk at %lu, resume from %lu", args->offset,
+               r->snapshot.install.offset);
+        *offset = r->snapshot.install.offset;
+        return 0;
+    }
+
+    /* A chunk that doesn't follow the data received so far is dropped, the
+     * leader will eventually send the snapshot again from the start. */
+    if (args->offset > 0 &&
+        (r->snapshot.install.index != args->last_index ||
+         r->snapshot.install.term != args->last_term ||
+         r->snapshot.install.offset != args->offset)) {
+        debugf(r->io, "unexpected snapshot chunk -> ignore");
+        goto discard;
+    }
+
+    if (args->offset == 0) {
+        install_reset(r);
+
+        /* If our last snapshot is more up-to-date, this is a no-op */
+        if (r->snapshot.index >= args->last_index) {
+            *success = true;
+            return 0;
+        }
+
+        /* If we already have all entries in the snapshot, this is a no-op */
+        local_term = log__term_of(&r->log, args->last_index);
+        if (local_term != 0 && local_term >= args->last_term) {
+            *success = true;
+            return 0;
+        }
+
+        r->snapshot.install.index = args->last_index;
+        r->snapshot.install.term = args->last_term;
+        r->snapshot.install.sender = id;
+        r->snapshot.received.sender = id;
+        r->snapshot.received.start = io__time(r->io);
+    }
+
+    *async = true;
+
+    /* Just store the chunk until the last one arrives, we don't need the
+     * configuration until then. */
+    if (!args->done) {
+        raft_configuration_close(&args->conf);
+        rv = install_snapshot_chunk(r, args);
+        if (rv != 0) {
+            install_reset(r);
+            return rv;
+        }
+        return 0;
+    }
+
+    /* If we are taking a snapshot ourselves or installing a snapshot, ignore
+     * the request, the leader will weventually retry. Same if the FSM is still
+     * applying entries. TODO: we should do something smarter. */
+    if (r->snapshot.pending.term != 0 || r->snapshot.put.data != NULL ||
+        !RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        install_reset(r);
+        goto discard;
+    }
+
+    /* Premptively update our in-memory state.
+     * TODO: we should roll this back in case of failure, or something. */
+    r->last_applied = args->last_index;
+
+    /* We need to truncate our entire log */
+    log__truncate(&r->log, 1);
+    rv = r->io->truncate(r->io, 1);
+    if (rv != 0) {
+        install_reset(r);
+        return rv;
+    }
+    r->last_stored = 0;
+
+    /* If the whole snapshot is in this message, store it at once. */
+    if (args->offset == 0) {
+        install_reset(r);
+        return install_snapshot_put(r, args);
+    }
+
+    rv = install_snapshot_chunk(r, args);
+    if (rv != 0) {
+        install_reset(r);
+        return rv;
+    }
+
+    /* If the chunks were accumulated in memory, store them at once. */
+    if (!has_snapshot_put_chunk(r)) {
+        whole = *args;
+        whole.data = r->snapshot.install.buf;
+        r->snapshot.install.buf.base = NULL;
+        install_reset(r);
+        rv = install_snapshot_put(r, &whole);
+        if (rv != 0) {
+            raft_free(whole.data.base);
+            return rv;
+        }
+        return 0;
+    }
+
+    install_reset(r);
+
+    return 0;
+
+discard:
+    *async = true;
+    raft_configuration_close(&args->conf);
+    raft_free(args->data.base);
+    return 0;
+}
+
+void raft_replication__leave_joint(struct raft *r)
+{
+    int rv;
+
+    if (r->state != RAFT_LEADER ||
+        !configuration__is_joint(&r->configuration) ||
+        r->configuration_uncommitted_index != 0) {
+        return;
+    }
+
+    rv = raft_client__leave_joint(r);
+    if (rv != 0) {
+        /* This error is not fatal, we'll retry at the next election. */
+        warnf(r->io, "failed to leave joint configuration: %s (%d)",
+              raft_strerror(rv), rv);
+    }
+}
+
+/**
+ * Apply a RAFT_CONFIGURATION entry that has been committed.
+ */
+static void raft_replication__apply_configuration(struct raft *r,
+                                                  const raft_index index)
+{
+    assert(index > 0);
+
+    /* If this is an uncommitted configuration that we had already applied when
+     * submitting the configuration change (for leaders) or upon receiving it
+     * via an AppendEntries RPC (for followers), then reset the uncommitted
+     * index, since that uncommitted configuration is now committed. */
+    if (r->configuration_uncommitted_index == index) {
+        r->configuration_uncommitted_index = 0;
+    }
+
+    r->configuration_index = index;
+
+    /* If we are leader but not part of this new configuration, step down.
+     *
+     * From Section 4.2.2:
+     *
+     *   In this approach, a leader that is removed from the configuration steps
+     *   down once the Cnew entry is committed.
+     */
+    if (r->state == RAFT_LEADER &&
+        configuration__get(&r->configuration, r->id) == NULL) {
+        /* Ignore the return value, since we can't fail in this case (no actual
+         * write for the new term will be done) */
+        raft_state__convert_to_follower(r, r->current_term);
+    }
+
+    /* A committed joint configuration is followed by the one with just the new
+     * voters. */
+    raft_replication__leave_joint(r);
+
+    raft_watch__configuration_applied(r);
+}
+
+/* Add a sample to the commit latency histogram. */
+static void record_commit_latency(struct raft *r, raft_time latency)
+{
+    unsigned bucket = 0;
+    while (latency > 0 && bucket < RAFT_LATENCY_BUCKETS - 1) {
+        latency >>= 1;
+        bucket++;
+    }
+    r->counters.commit_latency[bucket]++;
+}
+
+/**
+ * Fire the callbacks of the apply requests associated with the given
+ * RAFT_COMMAND or RAFT_BATCH entry, if any, and notify watchers, after the
+ * entry has been applied.
+ */
+static void raft_replication__command_applied(struct raft *r,
+                                              const raft_index index)
+{
+    raft__queue *head;
+
+    r->counters.n_applied++;
+    trace__point(r, apply, RAFT_TRACE_APPLY, 0, 0, r->current_term, index, 0,
+                 0);
+
+    /* Requests are queued in log order, and several of them share the index of
+     * a RAFT_BATCH entry. */
+    if (r->state == RAFT_LEADER) {
+        raft__queue *next;
+        struct raft_apply *req;
+        for (head = RAFT__QUEUE_HEAD(&r->leader_state.apply_reqs);
+             head != &r->leader_state.apply_reqs; head = next) {
+            next = RAFT__QUEUE_NEXT(head);
+            req = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
+            if (req->index < index) {
+                continue;
+            }
+            if (req->index > index) {
+                break;
+            }
+            RAFT__QUEUE_REMOVE(head);
+            record_commit_latency(r, io__time(r->io) - req->time);
+            if (req->cb != NULL) {
+                req->cb(req, 0);
             }
         }
     }
 
-    /* From Figure 3.1:
-     *
-     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
-     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
-     *   entry).
-     */
-    if (args->leader_commit > r->commit_index) {
-        r->commit_index = min(args->leader_commit, r->last_stored);
-        rv = raft_replication__apply(r);
-        if (rv != 0) {
-            goto out;
-        }
+    raft_watch__command_applied(r, index);
+}
+
+/**
+ * Apply a RAFT_COMMAND entry that has been committed.
+ */
+static int raft_replication__apply_command(struct raft *r,
+                                           const raft_index index,
+                                           const struct raft_buffer *buf)
+{
+    int rv;
+
+    rv = r->fsm->apply(r->fsm, buf);
+    if (rv != 0) {
+        return rv;
     }
 
-    result->success = true;
+    raft_replication__command_applied(r, index);
 
-respond:
-    result->last_log_index = r->last_stored;
+    return 0;
+}
 
-    message.type = RAFT_IO_APPEND_ENTRIES_RESULT;
-    message.server_id = r->follower_state.current_leader.id;
-    message.server_address = r->follower_state.current_leader.address;
+/**
+ * Apply the commands packed in a RAFT_BATCH entry that has been committed, one
+ * at a time. If one fails, the ones before it are not applied again on retry.
+ */
+static int raft_replication__apply_batch(struct raft *r,
+                                         const raft_index index,
+                                         const struct raft_buffer *buf)
+{
+    struct raft_buffer *bufs;
+    unsigned n;
+    int rv;
 
-    req = raft_malloc(sizeof *req);
-    if (req == NULL) {
-        goto out;
+    rv = entry__unpack(buf, &bufs, &n);
+    if (rv != 0) {
+        return rv;
     }
 
-    rv = r->io->send(r->io, req, &message,
-                     raft_replication__follower_respond_cb);
-    if (rv != 0) {
-        raft_free(req);
-        goto out;
+    for (; r->batch_applied < n; r->batch_applied++) {
+        rv = r->fsm->apply(r->fsm, &bufs[r->batch_applied]);
+        if (rv != 0) {
+            raft_free(bufs);
+            return rv;
+        }
     }
+    raft_free(bufs);
+    r->batch_applied = 0;
 
-out:
-    log__release(&r->log, request->index, request->args.entries,
-                 request->args.n_entries);
+    raft_replication__command_applied(r, index);
 
-    raft_free(request);
+    return 0;
 }
 
 /**
- * Check that the log matching property against an incoming AppendEntries
- * request.
- *
- * From Figure 3.1:
- *
- *   [AppendEntries RPC] Receiver implementation:
- *
- *   2. Reply false if log doesn't contain an entry at prevLogIndex whose
- *   term matches prevLogTerm.
- *
- * Return 0 if the check passed.
- *
- * Return 1 if the check did not pass and the request needs to be rejected.
- *
- * Return -1 if there's a conflict and we need to shutdown.
+ * Apply @n contiguous committed RAFT_COMMAND entries starting at @index, using
+ * the batch hook of the FSM.
  */
-static int raft_replication__check_prev_log_entry(
-    struct raft *r,
-    const struct raft_append_entries *args)
+static int raft_replication__apply_commands(struct raft *r,
+                                            const raft_index index,
+                                            const unsigned n)
 {
-    raft_term local_prev_term;
+    struct raft_buffer *bufs;
+    unsigned i;
+    int rv;
 
-    /* If this is the very first entry, there's nothing to check. */
-    if (args->prev_log_index == 0) {
-        return 0;
+    bufs = raft_malloc(n * sizeof *bufs);
+    if (bufs == NULL) {
+        return RAFT_ENOMEM;
     }
 
-    if (r->snapshot.index == args->prev_log_index) {
-        local_prev_term = r->snapshot.term;
-    } else {
-        local_prev_term = log__term_of(&r->log, args->prev_log_index);
+    for (i = 0; i < n; i++) {
+        bufs[i] = log__get(&r->log, index + i)->buf;
     }
 
-    if (local_prev_term == 0) {
-        debugf(r->io, "no entry at previous index -> reject");
-        return 1;
+    rv = r->fsm->apply_batch(r->fsm, bufs, index, n);
+    raft_free(bufs);
+    if (rv != 0) {
+        return rv;
     }
 
-    if (local_prev_term != args->prev_log_term) {
-        if (args->prev_log_index <= r->commit_index) {
-            /* Should never happen; something is seriously wrong! */
-            errorf(r->io,
-                   "previous index conflicts with "
-                   "committed entry -> shutdown");
-            return -1;
-        }
-        debugf(r->io, "previous term mismatch -> reject");
-        return 1;
+    for (i = 0; i < n; i++) {
+        raft_replication__command_applied(r, index + i);
     }
 
     return 0;
 }
 
 /**
- * Delete from our log all entries that conflict with the ones in the given
- * AppendEntries request.
- *
- * From Figure 3.1:
- *
- *   [AppendEntries RPC] Receiver implementation:
- *
- *   3. If an existing entry conflicts with a new one (same index but
- *   different terms), delete the existing entry and all that follow it.
- *
- * The @i parameter will be set to the array index of the first new log entry
- * that we don't have yet in our log, among the ones included in the given
- * AppendEntries request.
+ * Return the number of contiguous committed RAFT_COMMAND entries starting at
+ * @index.
  */
-static int raft_replication__delete_conflicting_entries(
-    struct raft *r,
-    const struct raft_append_entries *args,
-    size_t *i)
+static unsigned count_committed_commands(struct raft *r, raft_index index)
 {
-    size_t j;
-    int rv;
+    unsigned n = 0;
 
-    for (j = 0; j < args->n_entries; j++) {
-        struct raft_entry *entry = &args->entries[j];
-        raft_index entry_index = args->prev_log_index + 1 + j;
-        raft_term local_term = log__term_of(&r->log, entry_index);
+    while (index + n <= r->commit_index &&
+           log__get(&r->log, index + n)->type == RAFT_COMMAND) {
+        n++;
+    }
 
-        if (local_term > 0 && local_term != entry->term) {
-            if (entry_index <= r->commit_index) {
-                /* Should never happen; something is seriously wrong! */
-                errorf(r->io,
-                       "new index conflicts with "
-                       "committed entry -> shutdown");
+    return n;
+}
 
-                return RAFT_ERR_SHUTDOWN;
-            }
+/* Return the total payload size of the entries applied since the last
+ * snapshot, accounting only for the entries applied since the last call. */
+static size_t applied_size(struct raft *r)
+{
+    raft_index i;
 
-            debugf(r->io, "log mismatch -> truncate (%ld)", entry_index);
+    if (r->snapshot.applied.base != r->snapshot.index) {
+        r->snapshot.applied.base = r->snapshot.index;
+        r->snapshot.applied.index = r->snapshot.index;
+        r->snapshot.applied.size = 0;
+    }
 
-            /* Discard any uncommitted voting change. */
-            rv = raft_membership__rollback(r);
-            if (rv != 0) {
-                return rv;
-            }
+    for (i = r->snapshot.applied.index + 1; i <= r->last_applied; i++) {
+        const struct raft_entry *entry = log__get(&r->log, i);
+        assert(entry != NULL);
+        r->snapshot.applied.size += entry->buf.len;
+    }
+    if (r->last_applied > r->snapshot.applied.index) {
+        r->snapshot.applied.index = r->last_applied;
+    }
 
-            /* Delete all entries from this index on because they don't match */
-            rv = r->io->truncate(r->io, entry_index);
-            if (rv != 0) {
-                return rv;
-            }
-            log__truncate(&r->log, entry_index);
-            r->last_stored = entry_index - 1;
+    return r->snapshot.applied.size;
+}
 
-            /* We want to append all entries from here on, replacing anything
-             * that we had before. */
-            break;
-        } else if (local_term == 0) {
-            /* We don't have an entry at this index, so we want to append this
-             * new one and all the subsequent ones. */
-            break;
-        }
+/* Return true if the @n entries applied since the last snapshot reach
+ * @factor times any of the configured thresholds. */
+static bool snapshot_is_due(struct raft *r, raft_index n, unsigned factor)
+{
+    unsigned long long size;
+
+    if (r->snapshot.threshold > 0 &&
+        n >= (unsigned long long)r->snapshot.threshold * factor) {
+        return true;
     }
 
-    *i = j;
+    if (r->snapshot.threshold_bytes == 0 && r->snapshot.threshold_ratio == 0) {
+        return false;
+    }
 
-    return 0;
+    size = applied_size(r);
+
+    if (r->snapshot.threshold_bytes > 0 &&
+        size >= (unsigned long long)r->snapshot.threshold_bytes * factor) {
+        return true;
+    }
+
+    /* The ratio is meaningful only once there is a previous snapshot. */
+    if (r->snapshot.threshold_ratio > 0 && r->snapshot.size > 0) {
+        unsigned long long limit = r->snapshot.size;
+        limit *= r->snapshot.threshold_ratio;
+        limit *= factor;
+        if (size * 100 >= limit) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-int raft_replication__append(struct raft *r,
-                             const struct raft_append_entries *args,
-                             bool *success,
-                             bool *async)
+static bool should_take_snapshot(struct raft *r)
 {
-    struct raft_replication__follower_append *request;
-    int match;
-    size_t n;
-    size_t i;
-    size_t j;
-    int rv;
+    raft_time now;
+    raft_index n;
 
-    assert(r != NULL);
-    assert(args != NULL);
-    assert(success != NULL);
-    assert(async != NULL);
+    /* If a snapshot is already in progress, we don't want to start another
+     *  one. */
+    if (r->snapshot.pending.term != 0) {
+        return false;
+    };
 
-    assert(r->state == RAFT_FOLLOWER);
+    /* Same if we're receiving or storing a snapshot from the leader. */
+    if (r->snapshot.install.index != 0 || r->snapshot.put.data != NULL) {
+        return false;
+    }
 
-    *success = false;
-    *async = false;
+    /* If the FSM is still applying entries asynchronously, its state doesn't
+     * match the applied watermark yet. */
+    if (!RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        return false;
+    }
 
-    /* Check the log matching property. */
-    match = raft_replication__check_prev_log_entry(r, args);
-    if (match != 0) {
-        assert(match == 1 || match == -1);
-        return match == 1 ? 0 : RAFT_ERR_SHUTDOWN;
+    n = r->last_applied - r->snapshot.index;
+    if (n == 0 || !snapshot_is_due(r, n, 1)) {
+        r->snapshot.deferral.waiting = false;
+        return false;
     }
-    rv = raft_replication__delete_conflicting_entries(r, args, &i);
-    if (rv != 0) {
-        return rv;
+
+    if (r->snapshot.deferral.quiet == 0) {
+        return true;
     }
 
-    *success = true;
+    /* Wait for a quiet period, unless the log has grown too much. */
+    now = io__time(r->io);
+    if (now - r->snapshot.deferral.last_apply >= r->snapshot.deferral.quiet ||
+        snapshot_is_due(r, n, r->snapshot.deferral.factor)) {
+        r->snapshot.deferral.waiting = false;
+        return true;
+    }
 
-    n = args->n_entries - i; /* Number of new entries */
+    r->snapshot.deferral.waiting = true;
+    return false;
+}
 
-    /* This is an empty AppendEntries, there's nothing to write. However we
-     * still want to check if we can commit some entry.
-     *
-     * From Figure 3.1:
-     *
-     *   AppendEntries RPC: Receiver implementation: If leaderCommit >
-     *   commitIndex, set commitIndex = min(leaderCommit, index of last new
-     *   entry).
-     */
-    if (n == 0) {
-        if (args->leader_commit > r->commit_index) {
-            raft_index last_index = log__last_index(&r->log);
-            r->commit_index = min(args->leader_commit, last_index);
-            rv = raft_replication__apply(r);
-            if (rv != 0) {
-                return rv;
-            }
+/* Return the index of the last entry that can be deleted from the log after a
+ * snapshot at @index was taken, retaining the configured amount of trailing
+ * entries, or 0 if no entry can be deleted. */
+static raft_index trailing_shift_index(struct raft *r, raft_index index)
+{
+    raft_index first_index = log__first_index(&r->log);
+    raft_index last_index = log__last_index(&r->log);
+    size_t trailing_bytes = r->snapshot.trailing_bytes;
+    raft_index shift_index = index;
+    size_t size = 0;
+    raft_index i;
+
+    if (log__n_entries(&r->log) == 0) {
+        return 0;
+    }
+
+    if (shift_index > last_index) {
+        shift_index = last_index;
+    }
+
+    if (last_index - shift_index < r->snapshot.trailing) {
+        if (last_index <= r->snapshot.trailing) {
+            return 0;
+        }
+        shift_index = last_index - r->snapshot.trailing;
+    }
+
+    if (trailing_bytes > 0) {
+        for (i = shift_index + 1; i <= last_index; i++) {
+            size += log__get(&r->log, i)->buf.len;
+        }
+        while (shift_index >= first_index && size < trailing_bytes) {
+            size += log__get(&r->log, shift_index)->buf.len;
+            shift_index--;
         }
+    }
 
+    if (shift_index < first_index) {
         return 0;
     }
 
-    *async = true;
+    return shift_index;
+}
 
-    request = raft_malloc(sizeof *request);
-    if (request == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err;
+/* Release the patches of the snapshot being stored, if any. */
+static void free_snapshot_patches(struct raft *r)
+{
+    unsigned i;
+
+    if (!r->snapshot.patch.storing) {
+        return;
+    }
+    for (i = 0; i < r->snapshot.patch.n; i++) {
+        raft_free(r->snapshot.patch.patches[i].buf.base);
     }
+    if (r->snapshot.patch.patches != NULL) {
+        raft_free(r->snapshot.patch.patches);
+    }
+    r->snapshot.patch.patches = NULL;
+    r->snapshot.patch.n = 0;
+    r->snapshot.patch.storing = false;
+}
 
-    request->raft = r;
-    request->args = *args;
-    request->index = args->prev_log_index + 1 + i;
+static void snapshot_put_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct raft *r = req->data;
+    struct raft_snapshot *snapshot;
+    raft_index shift_index;
 
-    /* Update our in-memory log to reflect that we received these entries. We'll
-     * notify the leader of a successful append once the write entries request
-     * that we issue below actually completes.  */
-    for (j = 0; j < n; j++) {
-        struct raft_entry *entry = &args->entries[i + j];
+    r->snapshot.put.data = NULL;
+    snapshot = &r->snapshot.pending;
 
-        rv = log__append(&r->log, entry->term, entry->type, &entry->buf,
-                         entry->batch);
-        if (rv != 0) {
-            /* TODO: we should revert any changes we made to the log */
-            goto err_after_request_alloc;
-        }
+    if (status != 0) {
+        debugf(r->io, "snapshot %lld at term %lld: %s", snapshot->index,
+               snapshot->term, raft_strerror(status));
+        raft_watch__lifecycle(r, RAFT_EVENT_SNAPSHOT_TAKEN, 0, snapshot->index,
+                              r->snapshot.start, 0, status);
+        goto out;
     }
 
-    /* Acquire the relevant entries from the log. */
-    rv = log__acquire(&r->log, request->index, &request->args.entries,
-                      &request->args.n_entries);
-    if (rv != 0) {
-        goto err_after_request_alloc;
+    r->snapshot.term = snapshot->term;
+    r->snapshot.index = snapshot->index;
+    if (!configuration__is_witness(&snapshot->configuration, r->id)) {
+        r->snapshot.patch.base = snapshot->index;
     }
-
-    assert(request->args.n_entries == n);
-
-    rv = r->io->append(r->io, request->args.entries, request->args.n_entries,
-                       request, raft_replication__follower_append_cb);
-    if (rv != 0) {
-        goto err_after_acquire_entries;
+    if (r->snapshot.patch.storing) {
+        r->snapshot.size = r->snapshot.patch.size;
+    } else if (snapshot->n_bufs > 0) {
+        unsigned i;
+        r->snapshot.size = 0;
+        for (i = 0; i < snapshot->n_bufs; i++) {
+            r->snapshot.size += snapshot->bufs[i].len;
+        }
+    } else {
+        r->snapshot.size = r->snapshot.stream.offset;
     }
 
-    *success = true;
+    shift_index = trailing_shift_index(r, snapshot->index);
+    if (shift_index > 0) {
+        log__shift(&r->log, shift_index);
+    }
 
-    raft_free(args->entries);
+    raft_watch__lifecycle(r, RAFT_EVENT_SNAPSHOT_TAKEN, 0, snapshot->index,
+                          r->snapshot.start, r->snapshot.size, 0);
 
-    return 0;
+out:
+    free_snapshot_patches(r);
+    snapshot__close(&r->snapshot.pending);
+    r->snapshot.pending.term = 0;
+}
 
-err_after_acquire_entries:
-    log__release(&r->log, request->index, request->args.entries,
-                 request->args.n_entries);
+/* Maximum number of chunks being written at the same time while streaming a
+ * snapshot, so the FSM can serialize the next chunk while the previous one is
+ * being written. */
+#define SNAPSHOT_STREAM_MAX_PENDING 2
 
-err_after_request_alloc:
-    raft_free(request);
+/* Chunk of a snapshot being streamed from the FSM to disk. */
+struct take_snapshot_chunk
+{
+    struct raft *raft;
+    struct raft_buffer buf;
+    struct raft_io_snapshot_put put;
+};
 
-err:
-    assert(rv != 0);
-    return rv;
-}
+static void stream_snapshot_cb(struct raft_io_snapshot_put *req, int status);
 
-static void put_snapshot_cb(struct raft_io_snapshot_put *req, int status)
+/* Serialize and submit snapshot chunks, until the FSM is done or the maximum
+ * number of pending chunks is reached. */
+static void stream_snapshot(struct raft *r)
 {
-    struct recv_install_snapshot *request = req->data;
-    struct raft *r = request->raft;
-    struct raft_snapshot *snapshot = &request->snapshot;
-    /* raft_term local_term; */
-    raft_index local_first_index;
+    struct take_snapshot_chunk *chunk;
+    bool done;
     int rv;
 
-    r->snapshot.put.data = NULL;
+    while (!r->snapshot.stream.done && r->snapshot.stream.status == 0 &&
+           r->snapshot.stream.n_pending < SNAPSHOT_STREAM_MAX_PENDING) {
+        chunk = raft_malloc(sizeof *chunk);
+        if (chunk == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
+        chunk->raft = r;
+        chunk->put.data = chunk;
 
-    if (status != 0) {
-        errorf(r->io, "save snapshot %d: %s", snapshot->index,
-               raft_strerror(status));
-        goto err;
+        done = false;
+        rv = r->fsm->snapshot_chunk(r->fsm, r->snapshot.stream.offset,
+                                    &chunk->buf, &done);
+        if (rv != 0) {
+            goto err_after_chunk_alloc;
+        }
+
+        rv = r->io->snapshot_put_chunk(
+            r->io, &chunk->put, &r->snapshot.pending, r->snapshot.stream.offset,
+            &chunk->buf, done, stream_snapshot_cb);
+        if (rv != 0) {
+            goto err_after_fsm_chunk;
+        }
+
+        r->snapshot.stream.offset += chunk->buf.len;
+        r->snapshot.stream.n_pending++;
+        r->snapshot.stream.done = done;
     }
 
-    /* From Figure 5.3:
-     *
-     *   6. If existing entry has same index and term as lastIndex and lastTerm,
-     *      discard log up through lastIndex (but retain any following entries)
-     *      and reply.
-     */
-    /* TODO: at the moment we just ignore snapshots of entries that we have */
-    /* local_term = log__term_of(&r->log, snapshot->index); */
-    /* if (local_term == snapshot->term) { */
-    /*     log__shift(&r->log, snapshot->index); */
-    /*     goto err; */
-    /* } */
+    return;
 
-    /* From Figure 5.3:
-     *
-     *   7. Discard the entire log
-     *   8. Reset state machine using snapshot contents (and load lastConfig
-     *      as cluster configuration).
-     */
-    local_first_index = log__first_index(&r->log);
-    assert(local_first_index == 0);
-    /* if (local_first_index > 0) { */
-    /*     log__truncate(&r->log, local_first_index); */
-    /* } */
-    log__set_offset(&r->log, snapshot->index);
+err_after_fsm_chunk:
+    raft_free(chunk->buf.base);
+err_after_chunk_alloc:
+    raft_free(chunk);
+err:
+    assert(rv != 0);
+    r->snapshot.stream.status = rv;
+}
 
-    r->snapshot.index = snapshot->index;
-    r->snapshot.term = snapshot->term;
-    r->last_stored = snapshot->index;
+static void stream_snapshot_cb(struct raft_io_snapshot_put *req, int status)
+{
+    struct take_snapshot_chunk *chunk = req->data;
+    struct raft *r = chunk->raft;
 
-    rv = r->fsm->restore(r->fsm, &snapshot->bufs[0]);
-    if (rv != 0) {
-        errorf(r->io, "restore snapshot %d: %s", snapshot->index,
-               raft_strerror(status));
-        goto err;
-    }
+    raft_free(chunk->buf.base);
+    raft_free(chunk);
 
-    raft_configuration_close(&r->configuration);
-    r->configuration = snapshot->configuration;
-    r->configuration_index = snapshot->configuration_index;
+    r->snapshot.stream.n_pending--;
 
-    goto out;
+    if (status == 0 && r->state == RAFT_UNAVAILABLE) {
+        status = RAFT_ERR_SHUTDOWN;
+    }
+    if (status != 0 && r->snapshot.stream.status == 0) {
+        r->snapshot.stream.status = status;
+    }
 
-err:
-    /* In case of error we must also free the snapshot data buffer and free the
-     * configuration. */
-    raft_free(snapshot->bufs[0].base);
-    raft_configuration_close(&snapshot->configuration);
+    stream_snapshot(r);
 
-out:
-    /* Don't free the snapshot data buffer, as ownership has been trasfered to
-     * the fsm. */
-    raft_free(snapshot->bufs);
-    raft_free(request);
+    /* Once all chunks are written, or no more will be, we're done. */
+    if (r->snapshot.stream.n_pending == 0) {
+        assert(r->snapshot.stream.done || r->snapshot.stream.status != 0);
+        snapshot_put_cb(&r->snapshot.put, r->snapshot.stream.status);
+    }
 }
 
-int raft_replication__install_snapshot(struct raft *r,
-                                       const struct raft_install_snapshot *args,
-                                       bool *success,
-                                       bool *async)
+/* Take a snapshot by streaming it from the FSM to disk chunk by chunk. */
+static int take_snapshot_stream(struct raft *r)
 {
-    struct recv_install_snapshot *request;
-    struct raft_snapshot *snapshot;
-    raft_term local_term;
-    int rv;
+    struct raft_snapshot *snapshot = &r->snapshot.pending;
 
-    assert(r->state == RAFT_FOLLOWER);
+    snapshot->bufs = NULL;
+    snapshot->n_bufs = 0;
 
-    *success = false;
-    *async = false;
+    r->snapshot.stream.offset = 0;
+    r->snapshot.stream.n_pending = 0;
+    r->snapshot.stream.done = false;
+    r->snapshot.stream.status = 0;
 
-    /* If we are taking a snapshot ourselves or installing a snapshot, ignore
-     * the request, the leader will weventually retry. TODO: we should do
-     * something smarter. */
-    if (r->snapshot.pending.term != 0 || r->snapshot.put.data != NULL) {
-        *async = true;
-        return 0;
-    }
+    assert(r->snapshot.put.data == NULL);
+    r->snapshot.put.data = r;
 
-    /* If our last snapshot is more up-to-date, this is a no-op */
-    if (r->snapshot.index >= args->last_index) {
-        *success = true;
-        return 0;
-    }
+    stream_snapshot(r);
 
-    /* If we already have all entries in the snapshot, this is a no-op */
-    local_term = log__term_of(&r->log, args->last_index);
-    if (local_term != 0 && local_term >= args->last_term) {
-        *success = true;
-        return 0;
+    /* If not even the first chunk could be submitted, give up right away. */
+    if (r->snapshot.stream.n_pending == 0) {
+        assert(r->snapshot.stream.status != 0);
+        r->snapshot.put.data = NULL;
+        return r->snapshot.stream.status;
     }
 
-    *async = true;
+    return 0;
+}
 
-    /* Premptively update our in-memory state.
-     * TODO: we should roll this back in case of failure, or something. */
-    r->last_applied = args->last_index;
+static void take_snapshot_async_cb(struct raft_fsm_snapshot *req,
+                                   struct raft_buffer bufs[],
+                                   unsigned n_bufs,
+                                   int status)
+{
+    struct raft *r = req->raft;
+    struct raft_snapshot *snapshot = &r->snapshot.pending;
+    unsigned i;
+    int rv;
 
-    /* We need to truncate our entire log */
-    log__truncate(&r->log, 1);
-    rv = r->io->truncate(r->io, 1);
-    if (rv != 0) {
-        goto err;
+    r->snapshot.take.data = NULL;
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        status = RAFT_ERR_SHUTDOWN;
     }
-    r->last_stored = 0;
 
-    request = raft_malloc(sizeof *request);
-    if (request == NULL) {
-        rv = RAFT_ENOMEM;
+    if (status != 0) {
+        debugf(r->io, "snapshot %lld at term %lld: %s", snapshot->index,
+               snapshot->term, raft_strerror(status));
+        raft_watch__lifecycle(r, RAFT_EVENT_SNAPSHOT_TAKEN, 0, snapshot->index,
+                              r->snapshot.start, 0, status);
         goto err;
     }
-    request->raft = r;
-
-    snapshot = &request->snapshot;
-    snapshot->term = args->last_term;
-    snapshot->index = args->last_index;
-    snapshot->configuration_index = args->conf_index;
-    snapshot->configuration = args->conf;
 
-    snapshot->bufs = raft_malloc(sizeof *snapshot->bufs);
-    if (snapshot->bufs == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err_after_request_alloc;
-    }
-    snapshot->bufs[0] = args->data;
-    snapshot->n_bufs = 1;
+    snapshot->bufs = bufs;
+    snapshot->n_bufs = n_bufs;
 
-    /* TODO: we should truncate the in-memory log immediately */
     assert(r->snapshot.put.data == NULL);
-    r->snapshot.put.data = request;
+    r->snapshot.put.data = r;
     rv =
-        r->io->snapshot_put(r->io, &r->snapshot.put, snapshot, put_snapshot_cb);
+        r->io->snapshot_put(r->io, &r->snapshot.put, snapshot, snapshot_put_cb);
     if (rv != 0) {
-        goto err_after_bufs_alloc;
+        debugf(r->io, "snapshot %lld at term %lld: %s", snapshot->index,
+               snapshot->term, raft_strerror(rv));
+        r->snapshot.put.data = NULL;
+        goto err;
     }
 
-    return 0;
+    return;
 
-err_after_bufs_alloc:
-    raft_free(snapshot->bufs);
-    r->snapshot.put.data = NULL;
-err_after_request_alloc:
-    raft_free(request);
 err:
-    assert(rv != 0);
-    return rv;
-}
-
-/**
- * Apply a RAFT_CONFIGURATION entry that has been committed.
- */
-static void raft_replication__apply_configuration(struct raft *r,
-                                                  const raft_index index)
-{
-    assert(index > 0);
-
-    /* If this is an uncommitted configuration that we had already applied when
-     * submitting the configuration change (for leaders) or upon receiving it
-     * via an AppendEntries RPC (for followers), then reset the uncommitted
-     * index, since that uncommitted configuration is now committed. */
-    if (r->configuration_uncommitted_index == index) {
-        r->configuration_uncommitted_index = 0;
+    for (i = 0; i < n_bufs; i++) {
+        raft_free(bufs[i].base);
     }
-
-    r->configuration_index = index;
-
-    /* If we are leader but not part of this new configuration, step down.
-     *
-     * From Section 4.2.2:
-     *
-     *   In this approach, a leader that is removed from the configuration steps
-     *   down once the Cnew entry is committed.
-     */
-    if (r->state == RAFT_LEADER &&
-        configuration__get(&r->configuration, r->id) == NULL) {
-        /* Ignore the return value, since we can't fail in this case (no actual
-         * write for the new term will be done) */
-        raft_state__convert_to_follower(r, r->current_term);
+    if (bufs != NULL) {
+        raft_free(bufs);
     }
+    raft_configuration_close(&snapshot->configuration);
+    r->snapshot.pending.term = 0;
 
-    raft_watch__configuration_applied(r);
+    /* If we're shutting down, this was the last thing we were waiting for. */
+    if (r->state == RAFT_UNAVAILABLE && r->io_closed &&
+        RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        raft_state__close(r);
+    }
 }
 
-/**
- * Apply a RAFT_COMMAND entry that has been committed.
- */
-static int raft_replication__apply_command(struct raft *r,
-                                           const raft_index index,
-                                           const struct raft_buffer *buf)
+/* Take a snapshot by letting the FSM serialize a point-in-time view of its
+ * state in the background. */
+static int take_snapshot_async(struct raft *r)
 {
+    struct raft_fsm_snapshot *req = &r->snapshot.take;
     int rv;
-    raft__queue *head;
 
-    rv = r->fsm->apply(r->fsm, buf);
+    req->data = r;
+    req->index = r->snapshot.pending.index;
+    req->raft = r;
+
+    rv = r->fsm->snapshot_async(r->fsm, req, take_snapshot_async_cb);
     if (rv != 0) {
+        req->data = NULL;
         return rv;
     }
 
-    if (r->state == RAFT_LEADER) {
-        struct raft_apply *req;
-        RAFT__QUEUE_FOREACH(head, &r->leader_state.apply_reqs)
-        {
-            req = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
-            if (req->index == index) {
-                RAFT__QUEUE_REMOVE(head);
-                if (req->cb != NULL) {
-                    req->cb(req, 0);
-                }
-                break;
-            }
-        }
-    }
-
-    raft_watch__command_applied(r, index);
-
     return 0;
 }
 
-static bool should_take_snapshot(struct raft *r)
+/* Whether the next snapshot can be stored as a set of changes against the
+ * last one, which must have been taken by the FSM and be the most recent one
+ * on disk. */
+static bool has_snapshot_patch(struct raft *r, raft_index base)
 {
-    /* If a snapshot is already in progress, we don't want to start another
-     *  one. */
-    if (r->snapshot.pending.term != 0) {
-        return false;
-    };
-
-    /* If we didn't reach the threshold yet, do nothing. */
-    if (r->last_applied - r->snapshot.index < r->snapshot.threshold) {
-        return false;
-    }
-
-    return true;
+    return r->fsm->version >= 9 && r->fsm->snapshot_patch != NULL &&
+           r->io->version >= 9 && r->io->snapshot_put_patch != NULL &&
+           base != 0 && base == r->snapshot.index;
 }
 
-static void snapshot_put_cb(struct raft_io_snapshot_put *req, int status)
+/* Store the snapshot as the changes that the FSM made since the last one. */
+static int take_snapshot_patch(struct raft *r, raft_index base)
 {
-    struct raft *r = req->data;
-    struct raft_snapshot *snapshot;
-    size_t n_entries;
-    raft_index last_index;
-    raft_index shift_index;
-
-    r->snapshot.put.data = NULL;
-    snapshot = &r->snapshot.pending;
+    struct raft_snapshot *snapshot = &r->snapshot.pending;
+    struct raft_snapshot_patch *patches;
+    unsigned n;
+    size_t size;
+    int rv;
 
-    if (status != 0) {
-        debugf(r->io, "snapshot %lld at term %lld: %s", snapshot->index,
-               snapshot->term, raft_strerror(status));
-        goto out;
+    rv = r->fsm->snapshot_patch(r->fsm, &patches, &n, &size);
+    if (rv != 0) {
+        return rv;
     }
 
-    r->snapshot.term = snapshot->term;
-    r->snapshot.index = snapshot->index;
-    /* TODO: make the number of trailing entries configurable */
-    n_entries = log__n_entries(&r->log);
-    last_index = log__last_index(&r->log);
-    if (n_entries > 100) {
-        shift_index = last_index - 100;
-        if (snapshot->index < shift_index) {
-            shift_index = snapshot->index;
-        }
-        log__shift(&r->log, shift_index);
+    snapshot->bufs = NULL;
+    snapshot->n_bufs = 0;
+    r->snapshot.patch.patches = patches;
+    r->snapshot.patch.n = n;
+    r->snapshot.patch.size = size;
+    r->snapshot.patch.storing = true;
+
+    assert(r->snapshot.put.data == NULL);
+    r->snapshot.put.data = r;
+    rv = r->io->snapshot_put_patch(r->io, &r->snapshot.put, snapshot, base,
+                                   patches, n, size, snapshot_put_cb);
+    if (rv != 0) {
+        r->snapshot.put.data = NULL;
+        free_snapshot_patches(r);
+        return rv;
     }
 
-out:
-    snapshot__close(&r->snapshot.pending);
-    r->snapshot.pending.term = 0;
+    return 0;
 }
 
 static int take_snapshot(struct raft *r)
 {
     struct raft_snapshot *snapshot;
+    raft_index base;
     unsigned i;
     int rv;
 
+    /* Unless this snapshot gets stored, the FSM and the disk won't agree on
+     * what the last snapshot was. */
+    base = r->snapshot.patch.base;
+    r->snapshot.patch.base = 0;
+
     snapshot = &r->snapshot.pending;
     snapshot->index = r->last_applied;
     snapshot->term = log__term_of(&r->log, r->last_applied);
+    r->snapshot.start = io__time(r->io);
 
     raft_configuration_init(&snapshot->configuration);
     rv = configuration__copy(&r->configuration, &snapshot->configuration);
@@ -1364,11 +4386,48 @@ static int take_snapshot(struct raft *r)
 
     snapshot->configuration_index = r->configuration_index;
 
+    /* Witnesses have no state to save, their snapshots just let them compact
+     * the log. */
+    if (configuration__is_witness(&r->configuration, r->id)) {
+        snapshot->bufs = raft_calloc(1, sizeof *snapshot->bufs);
+        if (snapshot->bufs == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err_after_config_copy;
+        }
+        snapshot->n_bufs = 1;
+        goto put;
+    }
+
+    if (has_snapshot_patch(r, base)) {
+        rv = take_snapshot_patch(r, base);
+        if (rv != 0) {
+            goto err_after_config_copy;
+        }
+        return 0;
+    }
+
+    if (r->fsm->version >= 5 && r->fsm->snapshot_async != NULL) {
+        rv = take_snapshot_async(r);
+        if (rv != 0) {
+            goto err_after_config_copy;
+        }
+        return 0;
+    }
+
+    if (has_snapshot_stream(r)) {
+        rv = take_snapshot_stream(r);
+        if (rv != 0) {
+            goto err_after_config_copy;
+        }
+        return 0;
+    }
+
     rv = r->fsm->snapshot(r->fsm, &snapshot->bufs, &snapshot->n_bufs);
     if (rv != 0) {
         goto err_after_config_copy;
     }
 
+put:
     assert(r->snapshot.put.data == NULL);
     r->snapshot.put.data = r;
     rv =
@@ -1392,24 +4451,309 @@ err:
     return rv;
 }
 
+/* If the size of the in-memory log cache is capped, evict the payload of the
+ * oldest entries which have been both persisted and applied. */
+static void maybe_evict_entries(struct raft *r)
+{
+    raft_index index;
+
+    if (r->log_cache_size == 0 || !has_read(r)) {
+        return;
+    }
+
+    /* Only evict entries that can be read back from the backend. */
+    index = min(r->last_applied, r->last_stored);
+    index = min(index, r->io->last_readable(r->io));
+
+    log__evict(&r->log, index, r->log_cache_size);
+}
+
+static void fsm_apply_cb(struct raft_fsm_apply *req, int status);
+
+/* Whether the FSM wants the commands of each partition applied one at a
+ * time. */
+static bool has_partitions(struct raft *r)
+{
+    return r->fsm->version >= 8 && r->fsm->partition != NULL;
+}
+
+/* Set @partition to the partition of the RAFT_COMMAND entry at @index, and
+ * return whether an earlier command of that partition is still pending. */
+static bool partition_is_busy(struct raft *r,
+                              const raft_index index,
+                              unsigned *partition)
+{
+    struct raft_fsm_apply *req;
+    raft__queue *head;
+
+    if (!has_partitions(r)) {
+        *partition = 0;
+        return false;
+    }
+
+    *partition = r->fsm->partition(r->fsm, &log__get(&r->log, index)->buf);
+
+    RAFT__QUEUE_FOREACH(head, &r->fsm_apply_reqs)
+    {
+        req = RAFT__QUEUE_DATA(head, struct raft_fsm_apply, queue);
+        if (req->partition == *partition &&
+            (!req->done || req->status != 0)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Submit the RAFT_COMMAND entry at @index to the FSM using its asynchronous
+ * hook.
+ */
+static int raft_replication__submit_command(struct raft *r,
+                                            const raft_index index,
+                                            const unsigned partition)
+{
+    struct raft_fsm_apply *req;
+    int rv;
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+    req->index = index;
+    req->partition = partition;
+    req->raft = r;
+    req->cb = fsm_apply_cb;
+    req->status = 0;
+    req->done = false;
+
+    RAFT__QUEUE_PUSH(&r->fsm_apply_reqs, &req->queue);
+    r->last_applying = index;
+
+    rv = r->fsm->apply_async(r->fsm, req, &log__get(&r->log, index)->buf,
+                             fsm_apply_cb);
+    if (rv != 0) {
+        RAFT__QUEUE_REMOVE(&req->queue);
+        r->last_applying = index - 1;
+        raft_free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+/**
+ * Advance the applied watermark past all leading submissions which have
+ * completed, firing the associated callbacks in log order.
+ */
+static void raft_replication__complete_commands(struct raft *r)
+{
+    struct raft_fsm_apply *req;
+    raft__queue *head;
+    raft_index first = r->last_applied + 1;
+    int rv;
+
+    while (!RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        head = RAFT__QUEUE_HEAD(&r->fsm_apply_reqs);
+        req = RAFT__QUEUE_DATA(head, struct raft_fsm_apply, queue);
+        if (!req->done) {
+            break;
+        }
+
+        /* Try again a failed entry, keeping it at the head of the queue. */
+        if (req->status != 0) {
+            req->status = 0;
+            req->done = false;
+            rv = r->fsm->apply_async(r->fsm, req,
+                                     &log__get(&r->log, req->index)->buf,
+                                     fsm_apply_cb);
+            if (rv == 0) {
+                break;
+            }
+            req->status = rv;
+            req->done = true;
+            break;
+        }
+
+        RAFT__QUEUE_REMOVE(head);
+        assert(req->index == r->last_applied + 1);
+        r->last_applied = req->index;
+        raft_free(req);
+
+        raft_replication__command_applied(r, r->last_applied);
+    }
+
+    if (r->last_applied >= first) {
+        raft_watch__range_applied(r, first, r->last_applied);
+    }
+}
+
+static void fsm_apply_cb(struct raft_fsm_apply *req, int status)
+{
+    struct raft *r = req->raft;
+
+    req->status = status;
+    req->done = true;
+
+    /* If we're shutting down, just drop the request. */
+    if (r->state == RAFT_UNAVAILABLE) {
+        RAFT__QUEUE_REMOVE(&req->queue);
+        raft_free(req);
+        if (r->io_closed && RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs) &&
+            r->snapshot.take.data == NULL) {
+            raft_state__close(r);
+        }
+        return;
+    }
+
+    if (status != 0) {
+        debugf(r->io, "apply entry %lld: %s", req->index,
+               raft_strerror(status));
+    }
+
+    raft_replication__complete_commands(r);
+
+    /* Resume submitting entries, which were possibly held by a configuration
+     * change. */
+    if (r->state == RAFT_LEADER || r->state == RAFT_FOLLOWER) {
+        raft_replication__apply(r);
+        read__process(r);
+    }
+
+    maybe_evict_entries(r);
+
+    if (should_take_snapshot(r)) {
+        take_snapshot(r);
+    }
+}
+
+/* Start a new apply budget at the end of the current loop iteration, and
+ * apply the entries left behind by the previous one. */
+static void apply_budget_cb(struct raft_io_defer *req)
+{
+    struct raft *r = req->data;
+
+    r->apply_budget.scheduled = false;
+    r->apply_budget.n = 0;
+
+    if (r->state != RAFT_LEADER && r->state != RAFT_FOLLOWER) {
+        return;
+    }
+
+    raft_replication__apply(r);
+}
+
+/* Return how many entries can still be applied in the current loop iteration,
+ * scheduling the renewal of the budget if needed. */
+static unsigned apply_budget_available(struct raft *r)
+{
+    int rv;
+
+    if (r->apply_budget.max_entries == 0 || !has_defer(r)) {
+        return UINT_MAX;
+    }
+
+    if (!r->apply_budget.scheduled) {
+        r->apply_budget.req.data = r;
+        rv = r->io->defer(r->io, &r->apply_budget.req, apply_budget_cb);
+        if (rv != 0) {
+            /* Better to apply everything than to stall. */
+            return UINT_MAX;
+        }
+        r->apply_budget.scheduled = true;
+        r->apply_budget.n = 0;
+    }
+
+    if (r->apply_budget.n >= r->apply_budget.max_entries) {
+        return 0;
+    }
+
+    return r->apply_budget.max_entries - r->apply_budget.n;
+}
+
 int raft_replication__apply(struct raft *r)
 {
+    raft_index first = r->last_applied + 1;
+    bool witness = configuration__is_witness(&r->configuration, r->id);
+    unsigned available;
+    unsigned n_applied = 0;
     raft_index index;
     int rv;
 
     assert(r->state == RAFT_LEADER || r->state == RAFT_FOLLOWER);
     assert(r->last_applied <= r->commit_index);
 
-    if (r->last_applied == r->commit_index) {
+    if (RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+        r->last_applying = r->last_applied;
+    }
+
+    if (r->last_applying == r->commit_index) {
         /* Nothing to do. */
         return 0;
     }
 
-    for (index = r->last_applied + 1; index <= r->commit_index; index++) {
+    available = apply_budget_available(r);
+    if (available == 0) {
+        /* The remaining entries will be applied in the next iteration. */
+        return 0;
+    }
+
+    for (index = r->last_applying + 1;
+         index <= r->commit_index && n_applied < available; index++) {
         const struct raft_entry *entry = log__get(&r->log, index);
 
         assert(entry->type == RAFT_COMMAND ||
-               entry->type == RAFT_CONFIGURATION);
+               entry->type == RAFT_CONFIGURATION || entry->type == RAFT_BATCH);
+
+        /* Witnesses don't have the payload of commands, so there's nothing to
+         * apply. */
+        if (witness && entry->type != RAFT_CONFIGURATION) {
+            raft_replication__command_applied(r, index);
+            r->last_applied = index;
+            r->last_applying = index;
+            n_applied++;
+            rv = 0;
+            continue;
+        }
+
+        /* If the FSM supports it, submit commands without waiting for them to
+         * be applied. Configuration and batch entries wait for all previous
+         * commands. */
+        if (r->fsm->version >= 3 && r->fsm->apply_async != NULL) {
+            if (entry->type == RAFT_COMMAND) {
+                unsigned partition;
+                if (partition_is_busy(r, index, &partition)) {
+                    rv = 0;
+                    break;
+                }
+                rv = raft_replication__submit_command(r, index, partition);
+                if (rv != 0) {
+                    break;
+                }
+                n_applied++;
+                continue;
+            }
+            if (!RAFT__QUEUE_IS_EMPTY(&r->fsm_apply_reqs)) {
+                rv = 0;
+                break;
+            }
+        }
+
+        /* If the FSM supports it, apply all contiguous commands at once. */
+        if (entry->type == RAFT_COMMAND && r->fsm->version >= 2 &&
+            r->fsm->apply_batch != NULL) {
+            unsigned n = count_committed_commands(r, index);
+            n = min(n, available - n_applied);
+            rv = raft_replication__apply_commands(r, index, n);
+            if (rv != 0) {
+                break;
+            }
+            index += n - 1;
+            r->last_applied = index;
+            r->last_applying = index;
+            n_applied += n;
+            continue;
+        }
 
         switch (entry->type) {
             case RAFT_COMMAND:
@@ -1419,6 +4763,9 @@ int raft_replication__apply(struct raft *r)
                 raft_replication__apply_configuration(r, index);
                 rv = 0;
                 break;
+            case RAFT_BATCH:
+                rv = raft_replication__apply_batch(r, index, &entry->buf);
+                break;
         }
 
         if (rv != 0) {
@@ -1426,8 +4773,22 @@ int raft_replication__apply(struct raft *r)
         }
 
         r->last_applied = index;
+        r->last_applying = index;
+        n_applied++;
+    }
+
+    r->apply_budget.n += n_applied;
+
+    if (n_applied > 0 && r->snapshot.deferral.quiet > 0) {
+        r->snapshot.deferral.last_apply = io__time(r->io);
+    }
+
+    if (r->last_applied >= first) {
+        raft_watch__range_applied(r, first, r->last_applied);
     }
 
+    maybe_evict_entries(r);
+
     if (should_take_snapshot(r)) {
         rv = take_snapshot(r);
     }
@@ -1435,36 +4796,178 @@ int raft_replication__apply(struct raft *r)
     return rv;
 }
 
-void raft_replication__quorum(struct raft *r, const raft_index index)
+void raft_replication__snapshot_tick(struct raft *r)
+{
+    if (!r->snapshot.deferral.waiting) {
+        return;
+    }
+    if (r->state != RAFT_LEADER && r->state != RAFT_FOLLOWER) {
+        return;
+    }
+    if (should_take_snapshot(r)) {
+        take_snapshot(r);
+    }
+}
+
+/* Maximum number of voting servers whose match indexes are sorted on the
+ * stack. */
+#define QUORUM_STACK_VOTERS 32
+
+static int index_cmp_desc(const void *a, const void *b)
+{
+    raft_index i1 = *(const raft_index *)a;
+    raft_index i2 = *(const raft_index *)b;
+    return i1 > i2 ? -1 : i1 < i2;
+}
+
+/* Return the highest index stored by a majority of voting servers, i.e. the
+ * median of their match indexes, or 0 if it can't be determined. */
+/* Return the highest index stored by a majority of the voters, leaving out the
+ * ones on the given side of a joint configuration, if any. */
+static raft_index side_match_index(struct raft *r,
+                                   int excluded,
+                                   raft_index *matches)
 {
-    size_t votes = 0;
     size_t i;
+    size_t j = 0;
 
-    assert(r->state == RAFT_LEADER);
+    for (i = 0; i < r->configuration.n; i++) {
+        struct raft_server *server = &r->configuration.servers[i];
+        if (server->voting && (excluded == 0 || server->joint != excluded)) {
+            matches[j++] = r->leader_state.replication[i].match_index;
+        }
+    }
+    if (j == 0) {
+        return 0;
+    }
 
-    if (index <= r->commit_index) {
-        return;
+    /* Sorted in descending order, the first j / 2 + 1 servers form a majority,
+     * and the last of them has the lowest match index. */
+    qsort(matches, j, sizeof *matches, index_cmp_desc);
+    return matches[j / 2];
+}
+
+static raft_index quorum_match_index(struct raft *r)
+{
+    raft_index stack[QUORUM_STACK_VOTERS];
+    raft_index *matches = stack;
+    size_t n_voting = configuration__n_voting(&r->configuration);
+    raft_index index;
+    raft_index index_new;
+
+    if (n_voting == 0) {
+        return 0;
     }
 
-    if (log__term_of(&r->log, index) != r->current_term) {
+    if (n_voting > QUORUM_STACK_VOTERS) {
+        matches = raft_malloc(n_voting * sizeof *matches);
+        if (matches == NULL) {
+            return 0;
+        }
+    }
+
+    /* In a joint configuration an entry must be stored by a majority of both
+     * the old and the new voters. */
+    if (configuration__is_joint(&r->configuration)) {
+        index = side_match_index(r, RAFT_INCOMING, matches);
+        index_new = side_match_index(r, RAFT_OUTGOING, matches);
+        if (index_new < index) {
+            index = index_new;
+        }
+    } else {
+        index = side_match_index(r, 0, matches);
+    }
+
+    if (matches != stack) {
+        raft_free(matches);
+    }
+
+    return index;
+}
+
+/* Send an AppendEntries request to the followers that weren't told yet about
+ * the current commit index. */
+static void commit_notify_cb(struct raft_io_defer *req)
+{
+    struct raft *r = req->data;
+    size_t i;
+    int rv;
+
+    r->commit_notify.scheduled = false;
+
+    /* Nothing to do if we lost leadership, or if entries waiting for group
+     * commit are about to be sent anyway, carrying the new commit index. */
+    if (r->state != RAFT_LEADER || r->group_commit.index != 0) {
         return;
     }
 
     for (i = 0; i < r->configuration.n; i++) {
         struct raft_server *server = &r->configuration.servers[i];
-        if (!server->voting) {
+        struct raft_replication *replication = &r->leader_state.replication[i];
+
+        if (server->id == r->id ||
+            replication->last_commit >= r->commit_index) {
             continue;
         }
-        if (r->leader_state.replication[i].match_index >= index) {
-            votes++;
+
+        rv = raft_replication__send_append_entries(r, i);
+        if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+            warnf(r->io, "failed to notify commit to server %ld: %s (%d)",
+                  server->id, raft_strerror(rv), rv);
         }
     }
+}
 
-    if (votes > configuration__n_voting(&r->configuration) / 2) {
-        r->commit_index = index;
+/* Schedule a commit notification at the end of the current loop iteration, if
+ * enabled and not already pending. */
+static void commit_notify_schedule(struct raft *r)
+{
+    int rv;
 
-        tracef("new commit index %ld", r->commit_index);
+    if (!r->commit_notify.enabled || r->commit_notify.scheduled ||
+        !has_defer(r)) {
+        return;
     }
 
-    return;
+    r->commit_notify.req.data = r;
+    rv = r->io->defer(r->io, &r->commit_notify.req, commit_notify_cb);
+    if (rv != 0) {
+        /* Followers will learn about it with the next request. */
+        return;
+    }
+    r->commit_notify.scheduled = true;
+}
+
+void raft_replication__quorum(struct raft *r)
+{
+    raft_index index;
+
+    assert(r->state == RAFT_LEADER);
+
+    index = quorum_match_index(r);
+
+    if (index <= r->commit_index) {
+        return;
+    }
+
+    /* From Section §3.6.2:
+     *
+     *   Raft never commits log entries from previous terms by counting
+     *   replicas. Only log entries from the leader's current term are
+     *   committed by counting replicas.
+     */
+    if (log__term_of(&r->log, index) != r->current_term) {
+        return;
+    }
+
+    raft_client__committed(r, r->commit_index + 1, index);
+    set_commit_index(r, index);
+    commit_notify_schedule(r);
+
+    tracef("new commit index %ld", r->commit_index);
+}
+
+raft_index raft_replication__seq(const struct raft *r)
+{
+    return r->state == RAFT_FOLLOWER ? r->follower_state.seq : 0;
 }
@@ -32,6 +32,20 @@ int raft_replication__send_append_entries(struct raft *r, size_t i);
  */
 int raft_replication__trigger(struct raft *r, const raft_index index);
 
+/**
+ * Like raft_replication__trigger(), but if group commit is enabled postpone the
+ * I/O requests to the end of the current event loop iteration, so that all
+ * entries appended in the meantime are written and sent together.
+ */
+int raft_replication__trigger_grouped(struct raft *r, raft_index index);
+
+/**
+ * Bump the commit index to the hint kept by the I/O backend, if any, and apply
+ * all entries up to it. Called at startup, so the state machine catches up
+ * without waiting for the leader to tell us what's committed.
+ */
+int raft_replication__restore_commit(struct raft *r);
+
 /**
  * Update the replication state (match and next indexes) for the given server
  * using the given AppendEntries RPC result.
@@ -64,10 +78,78 @@ int raft_replication__append(struct raft *r,
                              bool *success,
                              bool *async);
 
+/**
+ * Send the AppendEntries result held back for batching, if any, once its delay
+ * has elapsed. Results held back for a leader or a term which is not current
+ * anymore are dropped.
+ */
+void raft_replication__flush_ack(struct raft *r);
+
+/**
+ * Handle an InstallSnapshot RPC from the server with the given ID. If the chunk
+ * doesn't follow the data of the same snapshot received so far from that
+ * server, it's dropped and @offset is set to the amount of that data, so that
+ * the transfer can be resumed from there. Otherwise @offset is set to 0.
+ */
 int raft_replication__install_snapshot(struct raft *r,
-                                       const struct raft_install_snapshot *args,
+                                       unsigned id,
+                                       struct raft_install_snapshot *args,
                                        bool *success,
-                                       bool *async);
+                                       bool *async,
+                                       size_t *offset);
+
+/**
+ * Start sending our last snapshot to the given server on behalf of the leader
+ * with the given ID, which asked for it with a SendSnapshot RPC. The leader is
+ * notified after each chunk and once the transfer is over.
+ *
+ * It must be called only by followers not already sending a snapshot.
+ */
+int raft_replication__send_delegated_snapshot(struct raft *r,
+                                              unsigned leader_id,
+                                              const struct raft_server *server);
+
+/**
+ * Send the leader with the given ID a SendSnapshot result about the transfer
+ * of a snapshot to the server with the given ID.
+ */
+int raft_replication__report_snapshot(struct raft *r,
+                                      unsigned leader_id,
+                                      const char *address,
+                                      unsigned server_id,
+                                      raft_index last_index,
+                                      bool done);
+
+/**
+ * Update the state of the snapshot transfer that was delegated to the server
+ * with the given ID. If the transfer failed, send the snapshot ourselves.
+ *
+ * It must be called only by leaders.
+ */
+int raft_replication__delegated_snapshot(
+    struct raft *r,
+    unsigned id,
+    const struct raft_send_snapshot_result *result);
+
+/**
+ * Send the next chunk of the snapshot transfers that were waiting for their
+ * bandwidth budget to be refilled. The transfers which are not current anymore
+ * are abandoned.
+ */
+void raft_replication__resume_throttled(struct raft *r);
+
+/**
+ * Return the number of milliseconds after the last tick when some throttled
+ * snapshot transfer can be resumed.
+ *
+ * It must be called only if there are throttled transfers.
+ */
+unsigned raft_replication__throttle_delay(struct raft *r);
+
+/**
+ * Abandon all throttled snapshot transfers and release their resources.
+ */
+void raft_replication__drop_throttled(struct raft *r);
 
 /**
  * Apply any committed entry that was not applied yet.
@@ -77,8 +159,26 @@ int raft_replication__install_snapshot(struct raft *r,
 int raft_replication__apply(struct raft *r);
 
 /**
- * Check if a quorum has been reached for the given log index, and update commit
- * index accordingly if so.
+ * Take the snapshot that was deferred to a quiet period, if it has elapsed or
+ * the log has grown too much in the meantime.
+ */
+void raft_replication__snapshot_tick(struct raft *r);
+
+/**
+ * If we are leader and the last configuration is joint and committed, append
+ * the configuration with only its new voters. Failures are only logged.
+ */
+void raft_replication__leave_joint(struct raft *r);
+
+/**
+ * Advance the commit index to the highest index stored by a majority of voting
+ * servers, if that entry was created in the current term. In a joint
+ * configuration that's a majority of both the old and the new voters.
+ *
+ * The leader counts itself only once its own disk write completes, but that
+ * write doesn't need to be part of the majority: entries are sent to followers
+ * along with it, and they get committed as soon as enough followers have
+ * stored them, so a slow local disk doesn't hold back commits.
  *
  * From Figure 3.1:
  *
@@ -87,6 +187,12 @@ int raft_replication__apply(struct raft *r);
  *   If there exists an N such that N > commitIndex, a majority of
  *   matchIndex[i] >= N, and log[N].term == currentTerm: set commitIndex = N
  */
-void raft_replication__quorum(struct raft *r, const raft_index index);
+void raft_replication__quorum(struct raft *r);
+
+/**
+ * Heartbeat round to echo back in AppendEntries results, or 0 if we are not a
+ * follower.
+ */
+raft_index raft_replication__seq(const struct raft *r);
 
 #endif /* RAFT_REPLICATION_H */
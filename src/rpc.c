@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "../include/raft.h"
 
 #include "assert.h"
@@ -5,17 +7,27 @@
 #include "logging.h"
 #include "rpc_append_entries.h"
 #include "rpc_install_snapshot.h"
+#include "rpc_propose.h"
+#include "rpc_read_index.h"
 #include "rpc_request_vote.h"
+#include "rpc_send_snapshot.h"
+#include "rpc_timeout_now.h"
 #include "state.h"
+#include "tick.h"
+#include "trace.h"
 
 static const char *message_descs[] = {"append entries", "append entries result",
                                       "request vote", "request vote result",
-                                      "install snapshot"};
+                                      "install snapshot", "read index",
+                                      "read index result", "timeout now",
+                                      "send snapshot", "send snapshot result",
+                                      "propose", "propose result"};
 
 /* Dispatch a single RPC message to the appropriate handler. */
 static void dispatch(struct raft *r, struct raft_message *message)
 {
     int rc;
+    trace__recv(r, message);
     switch (message->type) {
         case RAFT_IO_APPEND_ENTRIES:
             rc = raft_rpc__recv_append_entries(r, message->server_id,
@@ -42,13 +54,48 @@ static void dispatch(struct raft *r, struct raft_message *message)
                                                  message->server_address,
                                                  &message->install_snapshot);
             break;
+        case RAFT_IO_READ_INDEX:
+            rc = raft_rpc__recv_read_index(r, message->server_id,
+                                           message->server_address,
+                                           &message->read_index);
+            break;
+        case RAFT_IO_READ_INDEX_RESULT:
+            rc = raft_rpc__recv_read_index_result(
+                r, message->server_id, message->server_address,
+                &message->read_index_result);
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            rc = raft_rpc__recv_timeout_now(r, message->server_id,
+                                            message->server_address,
+                                            &message->timeout_now);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT:
+            rc = raft_rpc__recv_send_snapshot(r, message->server_id,
+                                              message->server_address,
+                                              &message->send_snapshot);
+            break;
+        case RAFT_IO_SEND_SNAPSHOT_RESULT:
+            rc = raft_rpc__recv_send_snapshot_result(
+                r, message->server_id, message->server_address,
+                &message->send_snapshot_result);
+            break;
+        case RAFT_IO_PROPOSE:
+            rc = raft_rpc__recv_propose(r, message->server_id,
+                                        message->server_address,
+                                        &message->propose);
+            break;
+        case RAFT_IO_PROPOSE_RESULT:
+            rc = raft_rpc__recv_propose_result(r, message->server_id,
+                                               message->server_address,
+                                               &message->propose_result);
+            break;
         default:
             warnf(r->io, "rpc: unknown message type type: %d", message->type);
             return;
     };
 
     if (rc != 0 && rc != RAFT_ERR_IO_CONNECT) {
-        errorf(r->io, "rpc %s: %s", message_descs[message->type],
+        errorf(r->io, "rpc %s: %s", message_descs[message->type - 1],
                raft_strerror(rc));
     }
 }
@@ -56,7 +103,93 @@ static void dispatch(struct raft *r, struct raft_message *message)
 void rpc__recv_cb(struct raft_io *io, struct raft_message *message) {
     struct raft *r;
     r = io->data;
+    tick__update(r);
     dispatch(r, message);
+    tick__schedule(r);
+}
+
+/* Return true if the entries of the second message directly follow the ones of
+ * the first, and both were sent by the same leader in the same term. */
+static bool can_fold(const struct raft_message *m1,
+                     const struct raft_message *m2)
+{
+    const struct raft_append_entries *a1 = &m1->append_entries;
+    const struct raft_append_entries *a2 = &m2->append_entries;
+
+    if (m1->type != RAFT_IO_APPEND_ENTRIES ||
+        m2->type != RAFT_IO_APPEND_ENTRIES) {
+        return false;
+    }
+
+    return m1->server_id == m2->server_id && a1->term == a2->term &&
+           a1->n_entries > 0 && a2->n_entries > 0 &&
+           a2->prev_log_index == a1->prev_log_index + a1->n_entries &&
+           a2->prev_log_term == a1->entries[a1->n_entries - 1].term;
+}
+
+/* Dispatch the given consecutive AppendEntries messages as a single one
+ * carrying all their entries. */
+static void dispatch_folded(struct raft *r,
+                            struct raft_message messages[],
+                            unsigned n)
+{
+    struct raft_message message = messages[n - 1];
+    struct raft_append_entries *args = &message.append_entries;
+    struct raft_entry *entries;
+    unsigned n_entries = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        n_entries += messages[i].append_entries.n_entries;
+    }
+
+    entries = raft_malloc(n_entries * sizeof *entries);
+    if (entries == NULL) {
+        for (i = 0; i < n; i++) {
+            dispatch(r, &messages[i]);
+        }
+        return;
+    }
+
+    n_entries = 0;
+    for (i = 0; i < n; i++) {
+        struct raft_append_entries *p = &messages[i].append_entries;
+        memcpy(&entries[n_entries], p->entries, p->n_entries * sizeof *entries);
+        n_entries += p->n_entries;
+        raft_free(p->entries);
+    }
+
+    /* The leader commit index is the one of the last message. */
+    args->prev_log_index = messages[0].append_entries.prev_log_index;
+    args->prev_log_term = messages[0].append_entries.prev_log_term;
+    args->entries = entries;
+    args->n_entries = n_entries;
+
+    debugf(r->io, "rpc: fold %u append entries messages", n);
+    dispatch(r, &message);
+}
+
+void rpc__recv_batch_cb(struct raft_io *io,
+                        struct raft_message messages[],
+                        unsigned n)
+{
+    struct raft *r;
+    unsigned i = 0;
+    r = io->data;
+    tick__update(r);
+    while (i < n) {
+        unsigned j = i + 1;
+        while (j < n && can_fold(&messages[j - 1], &messages[j])) {
+            j++;
+        }
+        if (j - i > 1) {
+            dispatch_folded(r, &messages[i], j - i);
+        } else {
+            dispatch(r, &messages[i]);
+        }
+        i = j;
+    }
+    tick__schedule(r);
 }
 
 int raft_rpc__ensure_matching_terms(struct raft *r, raft_term term, int *match)
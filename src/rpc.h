@@ -13,6 +13,14 @@
  */
 void rpc__recv_cb(struct raft_io *io, struct raft_message *message);
 
+/**
+ * Callback to be passed to the @raft_io implementation. It will be invoked upon
+ * receiving several RPC messages together.
+ */
+void rpc__recv_batch_cb(struct raft_io *io,
+                        struct raft_message messages[],
+                        unsigned n);
+
 /**
  * Common logic for RPC handlers, comparing the request's term with the server's
  * current term and possibly deciding to reject the request or step down from
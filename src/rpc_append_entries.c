@@ -2,17 +2,24 @@
 
 #include "assert.h"
 #include "configuration.h"
+#include "election.h"
+#include "io.h"
 #include "log.h"
 #include "logging.h"
+#include "pool.h"
+#include "read.h"
 #include "replication.h"
 #include "rpc.h"
 #include "state.h"
+#include "tick.h"
+#include "trace.h"
 
 static void raft_rpc__recv_append_entries_send_cb(struct raft_io_send *req,
                                                   int status)
 {
+    struct raft *r = req->data;
     (void)status;
-    raft_free(req);
+    pool__put(&r->pools.send, req);
 }
 
 int raft_rpc__recv_append_entries(struct raft *r,
@@ -23,8 +30,10 @@ int raft_rpc__recv_append_entries(struct raft *r,
     struct raft_io_send *req;
     struct raft_message message;
     struct raft_append_entries_result *result = &message.append_entries_result;
+    raft_term last_term;
     int match;
     bool async;
+    unsigned i;
     int rv;
 
     assert(r != NULL);
@@ -34,8 +43,14 @@ int raft_rpc__recv_append_entries(struct raft *r,
 
     debugf(r->io, "received %d entries from server %ld", args->n_entries, id);
 
+    /* Our log might be empty after installing a snapshot, in which case we
+     * tell the leader about the snapshot's last index. */
     result->success = false;
-    result->last_log_index = log__last_index(&r->log);
+    local_last_index_and_term(r, &result->last_log_index, &last_term);
+    result->conflict_term = 0;
+    result->conflict_index = 0;
+    result->snapshot_index = 0;
+    result->snapshot_offset = 0;
 
     rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
     if (rv != 0) {
@@ -97,14 +112,41 @@ int raft_rpc__recv_append_entries(struct raft *r,
      * date. */
     r->follower_state.current_leader.id = id;
     r->follower_state.current_leader.address = address;
+    if (args->seq > r->follower_state.seq) {
+        r->follower_state.seq = args->seq;
+    }
 
     /* Reset the election timer. */
     r->timer = 0;
+    raft_election__leader_contact(r, args->n_entries == 0);
+
+    /* Suspend the election timer if the leader hibernates and we have all its
+     * entries, and resume it with any other message. The interval between
+     * heartbeats is not sampled across the hibernation. */
+    r->follower_state.hibernating =
+        args->hibernate && args->n_entries == 0 &&
+        args->leader_commit == args->prev_log_index &&
+        log__last_index(&r->log) == args->prev_log_index &&
+        log__last_term(&r->log) == args->prev_log_term;
+    if (r->follower_state.hibernating) {
+        r->follower_state.heartbeat_time = 0;
+    }
 
     /* If we are installing a snapshot, ignore these entries. TODO: we should do
      * something smarter, e.g. buffering the entries in the I/O backend, which
-     * should be in charge of serializing everything. */
-    if (r->snapshot.put.data != NULL && args->n_entries > 0) {
+     * should be in charge of serializing everything.
+     *
+     * While receiving or storing a snapshot sent by the leader ignore
+     * heartbeats too: our log doesn't match yet and rejecting them would make
+     * the leader send the snapshot again. We reply once the snapshot is
+     * installed. Our own snapshots are stored with the put request data set to
+     * @r. */
+    if (r->snapshot.put.data != NULL &&
+        (args->n_entries > 0 || r->snapshot.put.data != r)) {
+        return 0;
+    }
+    if (args->n_entries == 0 && r->snapshot.install.index != 0 &&
+        r->snapshot.install.sender == id) {
         return 0;
     }
 
@@ -120,14 +162,27 @@ int raft_rpc__recv_append_entries(struct raft *r,
     if (result->success) {
         /* Echo back to the leader the point that we reached. */
         result->last_log_index = args->prev_log_index + args->n_entries;
+    } else {
+        /* If we have an entry at prev_log_index but with a different term,
+         * tell the leader about that term and where it starts in our log, so
+         * it can skip all its entries in one go instead of probing them one
+         * by one. */
+        result->conflict_term = log__term_of(&r->log, args->prev_log_index);
+        result->conflict_index =
+            log__first_index_of_term(&r->log, args->prev_log_index);
     }
 
 reply:
     result->term = r->current_term;
-
-    /* Free the entries batch, if any. */
-    if (args->n_entries > 0 && args->entries[0].batch != NULL) {
-        raft_free(args->entries[0].batch);
+    result->seq = raft_replication__seq(r);
+
+    /* Free the entries batches, if any. Entries of messages folded together
+     * belong to different batches. */
+    for (i = 0; i < args->n_entries; i++) {
+        void *batch = args->entries[i].batch;
+        if (batch != NULL && (i == 0 || batch != args->entries[i - 1].batch)) {
+            raft_free(batch);
+        }
     }
 
     if (args->entries != NULL) {
@@ -138,15 +193,17 @@ reply:
     message.server_id = id;
     message.server_address = address;
 
-    req = raft_malloc(sizeof *req);
+    req = pool__get(&r->pools.send, sizeof *req);
     if (req == NULL) {
         return RAFT_ENOMEM;
     }
+    req->data = r;
 
-    rv = r->io->send(r->io, req, &message,
-                     raft_rpc__recv_append_entries_send_cb);
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message,
+                  raft_rpc__recv_append_entries_send_cb);
     if (rv != 0) {
-        raft_free(req);
+        pool__put(&r->pools.send, req);
         return rv;
     }
 
@@ -206,6 +263,11 @@ int raft_rpc__recv_append_entries_result(
         return 0;
     }
 
+    /* A follower that doesn't have all our entries needs heartbeats. */
+    if (!result->success) {
+        tick__wake(r);
+    }
+
     /* Update the match/next and the last contact indexes, possibly sending
      * further entries. */
     rv = raft_replication__update(r, server, result);
@@ -214,12 +276,17 @@ int raft_rpc__recv_append_entries_result(
     }
 
     /* Commit entries if possible */
-    raft_replication__quorum(r, result->last_log_index);
+    raft_replication__quorum(r);
 
     rv = raft_replication__apply(r);
     if (rv != 0) {
         return rv;
     }
 
+    /* Serve any read request that the response could unblock. */
+    if (r->state == RAFT_LEADER) {
+        read__process(r);
+    }
+
     return 0;
 }
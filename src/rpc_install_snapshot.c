@@ -1,10 +1,13 @@
 #include "rpc_install_snapshot.h"
 #include "assert.h"
+#include "configuration.h"
+#include "io.h"
 #include "log.h"
 #include "logging.h"
 #include "replication.h"
 #include "rpc.h"
 #include "state.h"
+#include "trace.h"
 
 static void send_append_entries_result_cb(struct raft_io_send *req, int status)
 {
@@ -20,6 +23,8 @@ int raft_rpc__recv_install_snapshot(struct raft *r,
     struct raft_io_send *req;
     struct raft_message message;
     struct raft_append_entries_result *result = &message.append_entries_result;
+    const struct raft_server *leader;
+    size_t offset;
     int rv;
     int match;
     bool async;
@@ -30,6 +35,10 @@ int raft_rpc__recv_install_snapshot(struct raft *r,
 
     result->success = false;
     result->last_log_index = log__last_index(&r->log);
+    result->conflict_term = 0;
+    result->conflict_index = 0;
+    result->snapshot_index = 0;
+    result->snapshot_offset = 0;
 
     rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
     if (rv != 0) {
@@ -53,11 +62,15 @@ int raft_rpc__recv_install_snapshot(struct raft *r,
         }
     }
 
-    r->follower_state.current_leader.id = id;
-    r->follower_state.current_leader.address = address;
+    /* The snapshot might be sent by a follower on behalf of the leader. */
+    if (args->leader_id == id) {
+        r->follower_state.current_leader.id = id;
+        r->follower_state.current_leader.address = address;
+    }
     r->timer = 0;
 
-    rv = raft_replication__install_snapshot(r, args, &result->success, &async);
+    rv = raft_replication__install_snapshot(r, id, args, &result->success,
+                                            &async, &offset);
     if (rv != 0) {
         return rv;
     }
@@ -66,6 +79,12 @@ int raft_rpc__recv_install_snapshot(struct raft *r,
         return 0;
     }
 
+    /* Let the sender resume from the data we already have. */
+    if (offset > 0) {
+        result->snapshot_index = args->last_index;
+        result->snapshot_offset = offset;
+    }
+
     if (result->success) {
         /* Echo back to the leader the point that we reached. */
         result->last_log_index = args->last_index;
@@ -73,6 +92,7 @@ int raft_rpc__recv_install_snapshot(struct raft *r,
 
 reply:
     result->term = r->current_term;
+    result->seq = raft_replication__seq(r);
 
     /* Free the snapshot data. */
     raft_configuration_close(&args->conf);
@@ -82,12 +102,20 @@ reply:
     message.server_id = id;
     message.server_address = address;
 
+    /* Reply to the leader directly, if the snapshot was sent in its place. */
+    leader = configuration__get(&r->configuration, args->leader_id);
+    if (args->leader_id != id && leader != NULL) {
+        message.server_id = leader->id;
+        message.server_address = leader->address;
+    }
+
     req = raft_malloc(sizeof *req);
     if (req == NULL) {
         return RAFT_ENOMEM;
     }
 
-    rv = r->io->send(r->io, req, &message, send_append_entries_result_cb);
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, send_append_entries_result_cb);
     if (rv != 0) {
         raft_free(req);
         return rv;
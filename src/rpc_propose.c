@@ -0,0 +1,241 @@
+#include <string.h>
+
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "client.h"
+#include "configuration.h"
+#include "io.h"
+#include "logging.h"
+#include "rpc.h"
+#include "trace.h"
+
+/* Apply request performed by the leader on behalf of a follower. */
+struct forward
+{
+    struct raft *raft;
+    struct raft_apply apply;
+    unsigned server_id; /* ID of the follower */
+    raft_index id;      /* ID of the follower's Propose RPC */
+};
+
+static void raft_rpc__recv_propose_send_cb(struct raft_io_send *req,
+                                           int status)
+{
+    (void)status;
+    raft_free(req);
+}
+
+/* Send a Propose result with the given index and status to the given
+ * server. */
+static int raft_rpc__send_propose_result(struct raft *r,
+                                         const unsigned id,
+                                         const char *address,
+                                         const raft_index propose_id,
+                                         const raft_index index,
+                                         const int status)
+{
+    struct raft_io_send *req;
+    struct raft_message message;
+    int rv;
+
+    message.type = RAFT_IO_PROPOSE_RESULT;
+    message.server_id = id;
+    message.server_address = address;
+    message.propose_result.term = r->current_term;
+    message.propose_result.id = propose_id;
+    message.propose_result.index = index;
+    message.propose_result.status = status;
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, raft_rpc__recv_propose_send_cb);
+    if (rv != 0) {
+        raft_free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+static void forward_cb(struct raft_apply *req, int status)
+{
+    struct forward *forward = req->data;
+    struct raft *r = forward->raft;
+    const struct raft_server *server;
+
+    /* If we lost leadership the follower will find out by itself. */
+    if (status == RAFT_ERR_LEADERSHIP_LOST) {
+        goto out;
+    }
+
+    server = configuration__get(&r->configuration, forward->server_id);
+    if (server == NULL) {
+        goto out;
+    }
+
+    raft_rpc__send_propose_result(r, server->id, server->address, forward->id,
+                                  status == 0 ? req->index : 0, status);
+
+out:
+    raft_free(forward);
+}
+
+/* Release the memory of the commands of a Propose RPC. */
+static void free_entries(struct raft_entry *entries, unsigned n)
+{
+    if (entries == NULL) {
+        return;
+    }
+    if (n > 0 && entries[0].batch != NULL) {
+        raft_free(entries[0].batch);
+    }
+    raft_free(entries);
+}
+
+/* Make a copy of each command of a Propose RPC, since apply requests take
+ * ownership of every single buffer. */
+static int copy_commands(const struct raft_propose *args,
+                         struct raft_buffer **bufs)
+{
+    unsigned i;
+
+    *bufs = raft_malloc(args->n_entries * sizeof **bufs);
+    if (*bufs == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    for (i = 0; i < args->n_entries; i++) {
+        const struct raft_buffer *src = &args->entries[i].buf;
+        struct raft_buffer *dst = &(*bufs)[i];
+        dst->len = src->len;
+        dst->base = raft_malloc(src->len > 0 ? src->len : 1);
+        if (dst->base == NULL) {
+            goto oom;
+        }
+        memcpy(dst->base, src->base, src->len);
+    }
+
+    return 0;
+
+oom:
+    while (i > 0) {
+        i--;
+        raft_free((*bufs)[i].base);
+    }
+    raft_free(*bufs);
+    return RAFT_ENOMEM;
+}
+
+int raft_rpc__recv_propose(struct raft *r,
+                           const unsigned id,
+                           const char *address,
+                           const struct raft_propose *args)
+{
+    struct forward *forward;
+    struct raft_buffer *bufs;
+    unsigned i;
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(args != NULL);
+
+    debugf(r->io, "received propose from server %ld: %d entries", id,
+           args->n_entries);
+
+    rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
+    if (rv != 0) {
+        goto out;
+    }
+
+    if (match != 0 || r->state != RAFT_LEADER) {
+        debugf(r->io, "local server is not leader -> reject");
+        rv = RAFT_ERR_NOT_LEADER;
+        goto reject;
+    }
+
+    if (args->n_entries == 0) {
+        rv = RAFT_EMALFORMED;
+        goto reject;
+    }
+
+    forward = raft_malloc(sizeof *forward);
+    if (forward == NULL) {
+        rv = RAFT_ENOMEM;
+        goto reject;
+    }
+    forward->raft = r;
+    forward->apply.data = forward;
+    forward->server_id = id;
+    forward->id = args->id;
+
+    rv = copy_commands(args, &bufs);
+    if (rv != 0) {
+        raft_free(forward);
+        goto reject;
+    }
+
+    rv = raft_apply(r, &forward->apply, bufs, args->n_entries, forward_cb);
+    if (rv != 0) {
+        for (i = 0; i < args->n_entries; i++) {
+            raft_free(bufs[i].base);
+        }
+        raft_free(bufs);
+        raft_free(forward);
+        goto reject;
+    }
+    raft_free(bufs);
+
+    free_entries(args->entries, args->n_entries);
+
+    return 0;
+
+reject:
+    assert(rv != 0);
+    rv = raft_rpc__send_propose_result(r, id, address, args->id, 0, rv);
+out:
+    free_entries(args->entries, args->n_entries);
+    return rv;
+}
+
+int raft_rpc__recv_propose_result(struct raft *r,
+                                  const unsigned id,
+                                  const char *address,
+                                  const struct raft_propose_result *result)
+{
+    int match;
+    int rv;
+
+    (void)address;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(result != NULL);
+
+    debugf(r->io, "received propose result from server %ld", id);
+
+    if (r->state != RAFT_FOLLOWER) {
+        debugf(r->io, "local server is not follower -> ignore");
+        return 0;
+    }
+
+    rv = raft_rpc__ensure_matching_terms(r, result->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        debugf(r->io, "local term is higher -> ignore");
+        return 0;
+    }
+
+    raft_client__recv_forwarded(r, result);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/**
+ * Propose RPC handlers.
+ */
+
+#ifndef RAFT_RPC_PROPOSE_H
+#define RAFT_RPC_PROPOSE_H
+
+#include "../include/raft.h"
+
+/**
+ * Process a Propose RPC from the given server. The entries array and the
+ * memory of the commands are released.
+ */
+int raft_rpc__recv_propose(struct raft *r,
+                           const unsigned id,
+                           const char *address,
+                           const struct raft_propose *args);
+
+/**
+ * Process a Propose RPC result from the given server.
+ */
+int raft_rpc__recv_propose_result(struct raft *r,
+                                  const unsigned id,
+                                  const char *address,
+                                  const struct raft_propose_result *result);
+
+#endif /* RAFT_RPC_PROPOSE_H */
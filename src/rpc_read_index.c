@@ -0,0 +1,164 @@
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "io.h"
+#include "logging.h"
+#include "read.h"
+#include "rpc.h"
+#include "trace.h"
+
+/* Read request performed by the leader on behalf of a follower. */
+struct forward
+{
+    struct raft *raft;
+    struct raft_read read;
+    unsigned server_id; /* ID of the follower */
+    raft_index id;      /* ID of the follower's ReadIndex RPC */
+};
+
+static void raft_rpc__recv_read_index_send_cb(struct raft_io_send *req,
+                                              int status)
+{
+    (void)status;
+    raft_free(req);
+}
+
+/* Send a ReadIndex result with the given index to the given server. */
+static int raft_rpc__send_read_index_result(struct raft *r,
+                                            const unsigned id,
+                                            const char *address,
+                                            const raft_index read_id,
+                                            const raft_index index)
+{
+    struct raft_io_send *req;
+    struct raft_message message;
+    int rv;
+
+    message.type = RAFT_IO_READ_INDEX_RESULT;
+    message.server_id = id;
+    message.server_address = address;
+    message.read_index_result.term = r->current_term;
+    message.read_index_result.id = read_id;
+    message.read_index_result.index = index;
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, raft_rpc__recv_read_index_send_cb);
+    if (rv != 0) {
+        raft_free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+static void forward_cb(struct raft_read *req, int status)
+{
+    struct forward *forward = req->data;
+    struct raft *r = forward->raft;
+    const struct raft_server *server;
+
+    /* If we lost leadership the follower will eventually retry. */
+    if (status != 0) {
+        goto out;
+    }
+
+    server = configuration__get(&r->configuration, forward->server_id);
+    if (server == NULL) {
+        goto out;
+    }
+
+    raft_rpc__send_read_index_result(r, server->id, server->address,
+                                     forward->id, req->index);
+
+out:
+    raft_free(forward);
+}
+
+int raft_rpc__recv_read_index(struct raft *r,
+                              const unsigned id,
+                              const char *address,
+                              const struct raft_read_index *args)
+{
+    struct forward *forward;
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(args != NULL);
+
+    debugf(r->io, "received read index request from server %ld", id);
+
+    rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match != 0 || r->state != RAFT_LEADER) {
+        debugf(r->io, "local server is not leader -> reject");
+        goto reject;
+    }
+
+    forward = raft_malloc(sizeof *forward);
+    if (forward == NULL) {
+        return RAFT_ENOMEM;
+    }
+    forward->raft = r;
+    forward->read.data = forward;
+    forward->server_id = id;
+    forward->id = args->id;
+
+    rv = raft_read_index(r, &forward->read, forward_cb);
+    if (rv != 0) {
+        raft_free(forward);
+        return rv;
+    }
+
+    return 0;
+
+reject:
+    return raft_rpc__send_read_index_result(r, id, address, args->id, 0);
+}
+
+int raft_rpc__recv_read_index_result(
+    struct raft *r,
+    const unsigned id,
+    const char *address,
+    const struct raft_read_index_result *result)
+{
+    int match;
+    int rv;
+
+    (void)address;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(result != NULL);
+
+    debugf(r->io, "received read index result from server %ld", id);
+
+    if (r->state != RAFT_FOLLOWER) {
+        debugf(r->io, "local server is not follower -> ignore");
+        return 0;
+    }
+
+    rv = raft_rpc__ensure_matching_terms(r, result->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        debugf(r->io, "local term is higher -> ignore");
+        return 0;
+    }
+
+    read__recv_result(r, result);
+
+    return 0;
+}
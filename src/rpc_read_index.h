@@ -0,0 +1,27 @@
+/**
+ * ReadIndex RPC handlers.
+ */
+
+#ifndef RAFT_RPC_READ_INDEX_H
+#define RAFT_RPC_READ_INDEX_H
+
+#include "../include/raft.h"
+
+/**
+ * Process a ReadIndex RPC from the given server.
+ */
+int raft_rpc__recv_read_index(struct raft *r,
+                              const unsigned id,
+                              const char *address,
+                              const struct raft_read_index *args);
+
+/**
+ * Process a ReadIndex RPC result from the given server.
+ */
+int raft_rpc__recv_read_index_result(
+    struct raft *r,
+    const unsigned id,
+    const char *address,
+    const struct raft_read_index_result *result);
+
+#endif /* RAFT_RPC_READ_INDEX_H */
@@ -1,12 +1,17 @@
+#include <string.h>
+
 #include "../include/raft.h"
 
 #include "assert.h"
 #include "configuration.h"
 #include "election.h"
+#include "io.h"
 #include "logging.h"
 #include "replication.h"
 #include "rpc.h"
 #include "state.h"
+#include "tick.h"
+#include "trace.h"
 
 static void raft_rpc__recv_request_vote_send_cb(struct raft_io_send *req,
                                                 int status)
@@ -15,14 +20,126 @@ static void raft_rpc__recv_request_vote_send_cb(struct raft_io_send *req,
     raft_free(req);
 }
 
+/* Send a RequestVote result to the given server. */
+static int raft_rpc__send_request_vote_result(
+    struct raft *r,
+    const unsigned id,
+    const char *address,
+    const struct raft_request_vote_result *result)
+{
+    struct raft_io_send *req;
+    struct raft_message message;
+    int rv;
+
+    message.type = RAFT_IO_REQUEST_VOTE_RESULT;
+    message.server_id = id;
+    message.server_address = address;
+    message.request_vote_result = *result;
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, raft_rpc__recv_request_vote_send_cb);
+    if (rv != 0) {
+        raft_free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Granted vote whose result is withheld until the vote is durable. */
+struct raft_rpc__vote_persist
+{
+    struct raft_io_set_meta req;
+    struct raft *raft;
+    unsigned id;
+    char *address;
+    struct raft_request_vote_result result;
+};
+
+static void raft_rpc__vote_persist_cb(struct raft_io_set_meta *req,
+                                      int status)
+{
+    struct raft_rpc__vote_persist *request = req->data;
+    struct raft *r = request->raft;
+    int rv;
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        goto out;
+    }
+
+    if (status != 0) {
+        warnf(r->io, "failed to persist vote for server %ld: %s (%d)",
+              request->id, raft_strerror(status), status);
+        goto out;
+    }
+
+    /* The vote is durable, so it can be sent even if our state has changed in
+     * the meantime. */
+    rv = raft_rpc__send_request_vote_result(r, request->id, request->address,
+                                            &request->result);
+    if (rv != 0) {
+        warnf(r->io, "failed to send vote result to server %ld: %s (%d)",
+              request->id, raft_strerror(rv), rv);
+    }
+
+out:
+    raft_free(request->address);
+    raft_free(request);
+}
+
+/* Persist the vote just granted and reply once it's durable. */
+static int raft_rpc__vote_persist(struct raft *r,
+                                  const unsigned id,
+                                  const char *address,
+                                  const struct raft_request_vote_result *result)
+{
+    struct raft_rpc__vote_persist *request;
+    int rv;
+
+    request = raft_malloc(sizeof *request);
+    if (request == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err;
+    }
+    request->address = raft_malloc(strlen(address) + 1);
+    if (request->address == NULL) {
+        rv = RAFT_ENOMEM;
+        goto err_after_request_alloc;
+    }
+    strcpy(request->address, address);
+    request->raft = r;
+    request->id = id;
+    request->result = *result;
+    request->req.data = request;
+
+    rv = r->io->set_meta(r->io, &request->req, r->current_term, r->voted_for,
+                         raft_rpc__vote_persist_cb);
+    if (rv != 0) {
+        goto err_after_address_alloc;
+    }
+
+    return 0;
+
+err_after_address_alloc:
+    raft_free(request->address);
+err_after_request_alloc:
+    raft_free(request);
+err:
+    assert(rv != 0);
+    return rv;
+}
+
 int raft_rpc__recv_request_vote(struct raft *r,
                                 const unsigned id,
                                 const char *address,
                                 const struct raft_request_vote *args)
 {
-    struct raft_io_send *req;
-    struct raft_message message;
-    struct raft_request_vote_result *result = &message.request_vote_result;
+    struct raft_request_vote_result result;
     int match;
     int rv;
 
@@ -30,10 +147,15 @@ int raft_rpc__recv_request_vote(struct raft *r,
     assert(id > 0);
     assert(args != NULL);
 
-    result->vote_granted = false;
+    result.vote_granted = false;
+    result.pre_vote = args->pre_vote;
 
     debugf(r->io, "received vote request from server %ld", id);
 
+    /* The candidate missed our last heartbeat or lost the leader, so resume
+     * the timers suspended by hibernation. */
+    tick__wake(r);
+
     /* Reject the request if we have a leader.
      *
      * From Section §4.2.3:
@@ -42,12 +164,37 @@ int raft_rpc__recv_request_vote(struct raft *r,
      *   is receiving heartbeats. [...] If a server receives a RequestVote
      *   request within the minimum election timeout of hearing from a current
      *   leader, it does not update its term or grant its vote
+     *
+     * Once that timeout has elapsed the leader is presumed dead, even if our
+     * own randomized timer hasn't expired yet. The exception is an election
+     * started because of a leadership transfer, which is meant to disrupt the
+     * current leader.
      */
-    if (r->state == RAFT_FOLLOWER && r->follower_state.current_leader.id != 0) {
+    if (r->state == RAFT_FOLLOWER && r->follower_state.current_leader.id != 0 &&
+        r->timer < raft_election__timeout(r) && !args->disrupt_leader) {
         debugf(r->io, "local server has a leader -> reject ");
         goto reply;
     }
 
+    /* A pre-vote request must not change our term or our vote, so handle it
+     * without going through the usual term checks. A leader never grants a
+     * pre-vote, since it's obviously still alive. */
+    if (args->pre_vote) {
+        if (r->state == RAFT_LEADER) {
+            debugf(r->io, "local server is leader -> reject pre-vote");
+            goto reply;
+        }
+        if (args->term < r->current_term) {
+            debugf(r->io, "local term is higher -> reject pre-vote");
+            goto reply;
+        }
+        rv = raft_election__vote(r, args, &result.vote_granted);
+        if (rv != 0) {
+            return rv;
+        }
+        goto reply;
+    }
+
     rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
     if (rv != 0) {
         return rv;
@@ -68,30 +215,21 @@ int raft_rpc__recv_request_vote(struct raft *r,
      * (otherwise we would have reject the request */
     assert(r->current_term <= args->term);
 
-    rv = raft_election__vote(r, args, &result->vote_granted);
+    rv = raft_election__vote(r, args, &result.vote_granted);
     if (rv != 0) {
         return rv;
     }
 
-reply:
-    result->term = r->current_term;
-
-    message.type = RAFT_IO_REQUEST_VOTE_RESULT;
-    message.server_id = id;
-    message.server_address = address;
-
-    req = raft_malloc(sizeof *req);
-    if (req == NULL) {
-        return RAFT_ENOMEM;
+    /* If the vote wasn't persisted yet, withhold the result until it is. */
+    if (result.vote_granted && raft_election__async_meta(r)) {
+        result.term = r->current_term;
+        return raft_rpc__vote_persist(r, id, address, &result);
     }
 
-    rv = r->io->send(r->io, req, &message, raft_rpc__recv_request_vote_send_cb);
-    if (rv != 0) {
-        raft_free(req);
-        return rv;
-    }
+reply:
+    result.term = r->current_term;
 
-    return 0;
+    return raft_rpc__send_request_vote_result(r, id, address, &result);
 }
 
 int raft_rpc__recv_request_vote_result(
@@ -112,8 +250,9 @@ int raft_rpc__recv_request_vote_result(
 
     debugf(r->io, "received vote request result from server %ld", id);
 
-    votes_index = configuration__index_of_voting(&r->configuration, id);
-    if (votes_index == r->configuration.n) {
+    votes_index = configuration__index_of(&r->configuration, id);
+    if (votes_index == r->configuration.n ||
+        !r->configuration.servers[votes_index].voting) {
         infof(r->io, "non-voting or unknown server -> reject");
         return 0;
     }
@@ -124,6 +263,30 @@ int raft_rpc__recv_request_vote_result(
         return 0;
     }
 
+    /* Ignore responses to requests sent in a different phase of the
+     * election. */
+    if (result->pre_vote != r->candidate_state.in_pre_vote) {
+        debugf(r->io, "result for a different election phase -> ignore");
+        return 0;
+    }
+
+    if (result->pre_vote) {
+        /* If the voter has a higher term than ours, we are stale and can't
+         * win. */
+        if (result->term > r->current_term) {
+            return raft_rpc__ensure_matching_terms(r, result->term, &match);
+        }
+
+        /* Once a majority would vote for us, start the actual election. */
+        if (result->vote_granted && raft_election__tally(r, votes_index)) {
+            infof(r->io, "pre-vote quorum reached -> start election");
+            r->candidate_state.in_pre_vote = false;
+            return raft_election__start(r);
+        }
+
+        return 0;
+    }
+
     rv = raft_rpc__ensure_matching_terms(r, result->term, &match);
     if (rv != 0) {
         return rv;
@@ -170,6 +333,10 @@ int raft_rpc__recv_request_vote_result(
              * index in our log, the AppendEntries RPC that we send here will
              * carry 0 entries, and indeed act as initial heartbeat. */
             raft_replication__trigger(r, 0);
+
+            /* Finish a joint configuration change that the previous leader
+             * didn't complete. */
+            raft_replication__leave_joint(r);
         }
     }
 
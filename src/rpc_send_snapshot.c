@@ -0,0 +1,118 @@
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "logging.h"
+#include "replication.h"
+#include "rpc.h"
+
+int raft_rpc__recv_send_snapshot(struct raft *r,
+                                 const unsigned id,
+                                 const char *address,
+                                 const struct raft_send_snapshot *args)
+{
+    const struct raft_server *local_server;
+    const struct raft_server *server;
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(address != NULL);
+    assert(args != NULL);
+
+    debugf(r->io, "received send snapshot from server %ld", id);
+
+    rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        debugf(r->io, "local term is higher -> reject");
+        goto reject;
+    }
+
+    if (r->state != RAFT_FOLLOWER) {
+        debugf(r->io, "local server is not follower -> reject");
+        goto reject;
+    }
+
+    /* Witnesses only hold the snapshot metadata. */
+    local_server = configuration__get(&r->configuration, r->id);
+    if (local_server == NULL || local_server->witness) {
+        debugf(r->io, "local server has no snapshot data -> reject");
+        goto reject;
+    }
+
+    if (r->snapshot.index == 0 || r->snapshot.index < args->last_index) {
+        debugf(r->io, "local snapshot is older -> reject");
+        goto reject;
+    }
+
+    if (r->follower_state.snapshot_target != 0) {
+        debugf(r->io, "local server is already sending a snapshot -> reject");
+        goto reject;
+    }
+
+    server = configuration__get(&r->configuration, args->server_id);
+    if (server == NULL || server->id == r->id) {
+        debugf(r->io, "unknown server %ld -> reject", args->server_id);
+        goto reject;
+    }
+
+    rv = raft_replication__send_delegated_snapshot(r, id, server);
+    if (rv != 0) {
+        warnf(r->io, "send snapshot to server %ld: %s", server->id,
+              raft_strerror(rv));
+        goto reject;
+    }
+
+    return 0;
+
+reject:
+    return raft_replication__report_snapshot(r, id, address, args->server_id, 0,
+                                             true);
+}
+
+int raft_rpc__recv_send_snapshot_result(
+    struct raft *r,
+    const unsigned id,
+    const char *address,
+    const struct raft_send_snapshot_result *result)
+{
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(address != NULL);
+    assert(result != NULL);
+
+    (void)address;
+
+    debugf(r->io, "received send snapshot result from server %ld", id);
+
+    if (r->state != RAFT_LEADER) {
+        debugf(r->io, "local server is not leader -> ignore");
+        return 0;
+    }
+
+    rv = raft_rpc__ensure_matching_terms(r, result->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        debugf(r->io, "local term is higher -> ignore");
+        return 0;
+    }
+
+    /* If we have stepped down, abort here. */
+    if (match > 0) {
+        assert(r->state == RAFT_FOLLOWER);
+        return 0;
+    }
+
+    return raft_replication__delegated_snapshot(r, id, result);
+}
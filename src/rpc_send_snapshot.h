@@ -0,0 +1,27 @@
+/**
+ * SendSnapshot RPC handlers.
+ */
+
+#ifndef RAFT_RPC_SEND_SNAPSHOT_H
+#define RAFT_RPC_SEND_SNAPSHOT_H
+
+#include "../include/raft.h"
+
+/**
+ * Process a SendSnapshot RPC from the given server.
+ */
+int raft_rpc__recv_send_snapshot(struct raft *r,
+                                 const unsigned id,
+                                 const char *address,
+                                 const struct raft_send_snapshot *args);
+
+/**
+ * Process a SendSnapshot RPC result from the given server.
+ */
+int raft_rpc__recv_send_snapshot_result(
+    struct raft *r,
+    const unsigned id,
+    const char *address,
+    const struct raft_send_snapshot_result *result);
+
+#endif /* RAFT_RPC_SEND_SNAPSHOT_H */
@@ -0,0 +1,74 @@
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "election.h"
+#include "logging.h"
+#include "rpc.h"
+#include "state.h"
+
+int raft_rpc__recv_timeout_now(struct raft *r,
+                               const unsigned id,
+                               const char *address,
+                               const struct raft_timeout_now *args)
+{
+    const struct raft_server *local_server;
+    raft_index local_last_index;
+    raft_term local_last_term;
+    int match;
+    int rv;
+
+    assert(r != NULL);
+    assert(id > 0);
+    assert(args != NULL);
+
+    (void)address;
+
+    debugf(r->io, "received timeout now from server %ld", id);
+
+    /* Ignore the request if we are not voters. */
+    local_server = configuration__get(&r->configuration, r->id);
+    if (local_server == NULL || !local_server->voting) {
+        debugf(r->io, "local server is not voting -> ignore");
+        return 0;
+    }
+
+    /* Witnesses can't become leaders. */
+    if (local_server->witness) {
+        debugf(r->io, "local server is a witness -> ignore");
+        return 0;
+    }
+
+    rv = raft_rpc__ensure_matching_terms(r, args->term, &match);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (match < 0) {
+        debugf(r->io, "local term is higher -> ignore");
+        return 0;
+    }
+
+    if (r->state != RAFT_FOLLOWER) {
+        debugf(r->io, "local server is not follower -> ignore");
+        return 0;
+    }
+
+    /* The leader is supposed to send this message only once our log matches
+     * its own, but check it anyway since we might not have persisted all
+     * entries yet. */
+    local_last_index_and_term(r, &local_last_index, &local_last_term);
+    if (local_last_index != args->last_log_index ||
+        local_last_term != args->last_log_term) {
+        debugf(r->io, "local log is not up-to-date -> ignore");
+        return 0;
+    }
+
+    /* From Section 3.10:
+     *
+     *   When the target server receives TimeoutNow, it immediately starts a
+     *   new election (incrementing its term and becoming a candidate).
+     */
+    infof(r->io, "convert to candidate and start election requested by leader");
+    return raft_state__convert_to_candidate(r, true);
+}
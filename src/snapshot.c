@@ -1,5 +1,6 @@
 #include "snapshot.h"
 #include "assert.h"
+#include "configuration.h"
 #include "log.h"
 #include "logging.h"
 
@@ -10,7 +11,17 @@ void snapshot__close(struct raft_snapshot *s)
     for (i = 0; i < s->n_bufs; i++) {
         raft_free(s->bufs[0].base);
     }
-    raft_free(s->bufs);
+    if (s->bufs != NULL) {
+        raft_free(s->bufs);
+    }
+}
+
+raft_index snapshot__fsm_applied(struct raft *r)
+{
+    if (r->fsm->version < 7 || r->fsm->applied == NULL) {
+        return 0;
+    }
+    return r->fsm->applied(r->fsm);
 }
 
 void snapshot__destroy(struct raft_snapshot *s)
@@ -21,20 +32,31 @@ void snapshot__destroy(struct raft_snapshot *s)
 
 int snapshot__restore(struct raft *r, struct raft_snapshot *snapshot)
 {
+    size_t size;
     int rc;
 
     assert(snapshot->n_bufs == 1);
     assert(log__n_entries(&r->log) == 0);
 
-    rc = r->fsm->restore(r->fsm, &snapshot->bufs[0]);
-    if (rc != 0) {
-        errorf(r->io, "restore snapshot %d: %s", snapshot->index,
-               raft_strerror(rc));
-        return rc;
+    size = snapshot->bufs[0].len;
+
+    /* The snapshots of a witness have no data, and a durable state machine
+     * might already contain the snapshot's one. */
+    if (configuration__is_witness(&snapshot->configuration, r->id) ||
+        snapshot__fsm_applied(r) >= snapshot->index) {
+        raft_free(snapshot->bufs[0].base);
+    } else {
+        rc = r->fsm->restore(r->fsm, &snapshot->bufs[0]);
+        if (rc != 0) {
+            errorf(r->io, "restore snapshot %d: %s", snapshot->index,
+                   raft_strerror(rc));
+            return rc;
+        }
     }
 
     r->snapshot.index = snapshot->index;
     r->snapshot.term = snapshot->term;
+    r->snapshot.size = size;
 
     raft_configuration_close(&r->configuration);
     r->configuration = snapshot->configuration;
@@ -44,6 +66,7 @@ int snapshot__restore(struct raft *r, struct raft_snapshot *snapshot)
 
     r->commit_index = snapshot->index;
     r->last_applied = snapshot->index;
+    r->batch_applied = 0;
     r->last_stored = snapshot->index;
 
     raft_free(snapshot->bufs);
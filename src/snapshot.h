@@ -13,6 +13,12 @@ void snapshot__close(struct raft_snapshot *s);
  */
 void snapshot__destroy(struct raft_snapshot *s);
 
+/**
+ * Return the index of the last entry the FSM has made durable on its own, or
+ * zero if it doesn't keep track of it.
+ */
+raft_index snapshot__fsm_applied(struct raft *r);
+
 /**
  * Restore a snapshot. This will reset the current state of the server as if the
  * last entry contained in the snapshot had just been persisted, committed and
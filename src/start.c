@@ -1,14 +1,18 @@
 #include "../include/raft.h"
 
 #include "assert.h"
+#include "client.h"
 #include "configuration.h"
 #include "entry.h"
+#include "io.h"
 #include "log.h"
 #include "logging.h"
+#include "replication.h"
 #include "rpc.h"
 #include "snapshot.h"
 #include "state.h"
 #include "tick.h"
+#include "watch.h"
 
 /* Set to 1 to enable tracing. */
 #if 0
@@ -44,6 +48,10 @@ static int restore_entries(struct raft *r, struct raft_entry *entries, size_t n)
     raft_index conf_index;
     size_t i;
     int rc;
+    rc = log__reserve(&r->log, n);
+    if (rc != 0) {
+        goto err;
+    }
     for (i = 0; i < n; i++) {
         struct raft_entry *entry = &entries[i];
         rc = log__append(&r->log, entry->term, entry->type, &entry->buf,
@@ -73,6 +81,24 @@ err:
     return rc;
 }
 
+/* Skip the entries that a durable FSM has already applied, which are
+ * necessarily committed. */
+static void restore_fsm_applied(struct raft *r)
+{
+    raft_index applied = snapshot__fsm_applied(r);
+    if (applied > log__last_index(&r->log)) {
+        applied = log__last_index(&r->log);
+    }
+    if (applied <= r->last_applied) {
+        return;
+    }
+    tracef("fsm applied: index %llu", applied);
+    r->last_applied = applied;
+    if (r->commit_index < applied) {
+        r->commit_index = applied;
+    }
+}
+
 /* Automatically self-elect ourselves and convert to leader if we're the only
  * voting server in the configuration. */
 static int maybe_self_elect(struct raft *r)
@@ -80,10 +106,10 @@ static int maybe_self_elect(struct raft *r)
     const struct raft_server *server;
     int rc;
     server = configuration__get(&r->configuration, r->id);
-    if (server != NULL && server->voting &&
+    if (server != NULL && server->voting && !server->witness &&
         configuration__n_voting(&r->configuration) == 1) {
         debugf(r->io, "self elect and convert to leader");
-        rc = raft_state__convert_to_candidate(r);
+        rc = raft_state__convert_to_candidate(r, false);
         if (rc != 0) {
             return rc;
         }
@@ -95,6 +121,156 @@ static int maybe_self_elect(struct raft *r)
     return 0;
 }
 
+/* Start the I/O backend and convert to follower, once the persisted state has
+ * been restored. */
+static int start_backend(struct raft *r)
+{
+    int rc;
+
+    restore_fsm_applied(r);
+
+    /* Initialize the tick timestamp. */
+    r->last_tick = io__time(r->io);
+
+    /* Start the I/O backend. The tick callback is expected to fire every
+     * r->heartbeat_timeout milliseconds, or at the deadlines we request if the
+     * backend supports raft_io->tick_after, and the recv callback whenever an
+     * RPC is received. */
+    tracef("log: %lu entries, offset %lu", log__n_entries(&r->log),
+           r->log.offset);
+    if (raft_client__has_wakeup(r)) {
+        r->io->set_wakeup(r->io, raft_client__submit_cb);
+    }
+    if (r->io->version >= 6 && r->io->set_recv_batch != NULL) {
+        r->io->set_recv_batch(r->io, rpc__recv_batch_cb);
+    }
+    rc = r->io->start(r->io, r->heartbeat_timeout, tick_cb, rpc__recv_cb);
+    if (rc != 0) {
+        return rc;
+    }
+
+    raft_state__start_as_follower(r);
+
+    rc = raft_replication__restore_commit(r);
+    if (rc != 0) {
+        return rc;
+    }
+
+    /* If there's only one voting server, and that is us, it's safe to convert
+     * to leader right away. If that is not us, we're either joining the cluster
+     * or we're simply configured as non-voter, and we'll stay follower. */
+    rc = maybe_self_elect(r);
+    if (rc != 0) {
+        return rc;
+    }
+
+    tick__schedule(r);
+
+    return 0;
+}
+
+/* Whether the backend can load the persisted state asynchronously. */
+static bool has_load_async(struct raft *r)
+{
+    return r->io->version >= 11 && r->io->load_async != NULL;
+}
+
+/* Adopt the term and vote set in the pending load request, and restore its
+ * snapshot if that was not done yet. */
+static int load_begin(struct raft *r)
+{
+    struct raft_io_load *req = &r->load.req;
+    struct raft_snapshot *snapshot = req->snapshot;
+    int rc;
+
+    r->current_term = req->term;
+    r->voted_for = req->voted_for;
+
+    if (snapshot == NULL) {
+        return 0;
+    }
+    req->snapshot = NULL;
+
+    tracef("snapshot: index %llu, term %llu", snapshot->index, snapshot->term);
+    rc = snapshot__restore(r, snapshot);
+    if (rc != 0) {
+        snapshot__destroy(snapshot);
+        return rc;
+    }
+
+    return 0;
+}
+
+/* Append a batch of entries streamed by the backend to the log. */
+static int load_batch_cb(struct raft_io_load *req,
+                         struct raft_entry *entries,
+                         size_t n)
+{
+    struct raft *r = req->data;
+    int rc;
+
+    if (r->close_cb != NULL) {
+        rc = RAFT_ERR_IO_CANCELED;
+        goto err;
+    }
+
+    rc = load_begin(r);
+    if (rc != 0) {
+        goto err;
+    }
+
+    /* Same as in raft_start(), the first entry of a log without snapshot. */
+    if (r->last_stored == 0 && n > 0) {
+        assert(entries[0].type == RAFT_CONFIGURATION);
+        r->commit_index = 1;
+        r->last_applied = 1;
+    }
+
+    rc = restore_entries(r, entries, n);
+    if (rc != 0) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    entry_batches__destroy(entries, n);
+    return rc;
+}
+
+static void load_cb(struct raft_io_load *req, int status)
+{
+    struct raft *r = req->data;
+    int rc = status;
+
+    assert(r->load.pending);
+    r->load.pending = false;
+
+    if (rc == 0 && r->close_cb == NULL) {
+        rc = load_begin(r);
+        if (rc == 0) {
+            rc = start_backend(r);
+        }
+    }
+
+    if (req->snapshot != NULL) {
+        snapshot__destroy(req->snapshot);
+        req->snapshot = NULL;
+    }
+
+    if (r->close_cb != NULL) {
+        return;
+    }
+
+    if (rc != 0) {
+        errorf(r->io, "load: %s", raft_strerror(rc));
+    } else {
+        infof(r->io, "started");
+    }
+    raft_watch__lifecycle(r, RAFT_EVENT_STARTED, 0, r->last_stored,
+                          r->load.start, 0, rc);
+}
+
 int raft_start(struct raft *r)
 {
     int rc;
@@ -108,9 +284,23 @@ int raft_start(struct raft *r)
     assert(r->heartbeat_timeout < r->election_timeout);
     assert(log__n_entries(&r->log) == 0);
     assert(r->last_stored == 0);
+    assert(!r->load.pending);
 
     infof(r->io, "starting");
 
+    /* Let the backend stream the entries while the loop keeps running. */
+    if (has_load_async(r)) {
+        r->load.req.data = r;
+        r->load.req.snapshot = NULL;
+        r->load.start = io__time(r->io);
+        rc = r->io->load_async(r->io, &r->load.req, load_batch_cb, load_cb);
+        if (rc != 0) {
+            return rc;
+        }
+        r->load.pending = true;
+        return 0;
+    }
+
     rc = r->io->load(r->io, &r->current_term, &r->voted_for, &snapshot,
                      &entries, &n_entries);
     if (rc != 0) {
@@ -146,28 +336,5 @@ int raft_start(struct raft *r)
         return rc;
     }
 
-    /* Initialize the tick timestamp. */
-    r->last_tick = r->io->time(r->io);
-
-    /* Start the I/O backend. The tick callback is expected to fire every
-     * r->heartbeat_timeout milliseconds and the recv callback whenever an RPC
-     * is received. */
-    tracef("log: %lu entries, offset %lu", log__n_entries(&r->log),
-           r->log.offset);
-    rc = r->io->start(r->io, r->heartbeat_timeout, tick_cb, rpc__recv_cb);
-    if (rc != 0) {
-        return rc;
-    }
-
-    raft_state__start_as_follower(r);
-
-    /* If there's only one voting server, and that is us, it's safe to convert
-     * to leader right away. If that is not us, we're either joining the cluster
-     * or we're simply configured as non-voter, and we'll stay follower. */
-    rc = maybe_self_elect(r);
-    if (rc != 0) {
-        return rc;
-    }
-
-    return 0;
+    return start_backend(r);
 }
@@ -1,9 +1,17 @@
 #include "state.h"
 #include "assert.h"
+#include "bucket.h"
 #include "configuration.h"
 #include "election.h"
+#include "interval.h"
+#include "io.h"
 #include "log.h"
+#include "logging.h"
+#include "pool.h"
 #include "queue.h"
+#include "replication.h"
+#include "trace.h"
+#include "transfer.h"
 #include "watch.h"
 
 const char *raft_state_names[] = {"unavailable", "follower", "candidate",
@@ -38,6 +46,75 @@ raft_index raft_last_applied(struct raft *r)
     return r->last_applied;
 }
 
+/* Fill the replication progress of the server with the given index. */
+static void raft_state__server_stats(struct raft *r,
+                                     size_t i,
+                                     struct raft_server_stats *stats)
+{
+    struct raft_replication *replication = &r->leader_state.replication[i];
+    raft_index last_index = log__last_index(&r->log);
+    raft_index index;
+
+    stats->id = r->configuration.servers[i].id;
+    stats->next_index = replication->next_index;
+    stats->match_index = replication->match_index;
+    stats->lag = 0;
+    stats->lag_bytes = 0;
+    stats->last_contact = replication->last_contact;
+
+    if (replication->match_index >= last_index) {
+        return;
+    }
+    stats->lag = last_index - replication->match_index;
+    for (index = replication->match_index + 1; index <= last_index; index++) {
+        const struct raft_entry *entry = log__get(&r->log, index);
+        if (entry != NULL) {
+            stats->lag_bytes += entry->buf.len;
+        }
+    }
+}
+
+int raft_stats(struct raft *r, struct raft_stats *stats)
+{
+    size_t i;
+    unsigned j;
+
+    assert(r != NULL);
+    assert(stats != NULL);
+
+    stats->state = r->state;
+    stats->term = r->current_term;
+    stats->last_index = log__last_index(&r->log);
+    stats->commit_index = r->commit_index;
+    stats->last_applied = r->last_applied;
+    stats->counters = r->counters;
+    stats->servers = NULL;
+    stats->n_servers = 0;
+
+    if (r->state != RAFT_LEADER) {
+        return 0;
+    }
+
+    /* The leader might not be part of the configuration, if it's being
+     * removed. */
+    stats->servers = raft_malloc(r->configuration.n * sizeof *stats->servers);
+    if (stats->servers == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    j = 0;
+    for (i = 0; i < r->configuration.n; i++) {
+        if (r->configuration.servers[i].id == r->id) {
+            continue;
+        }
+        raft_state__server_stats(r, i, &stats->servers[j]);
+        j++;
+    }
+    stats->n_servers = j;
+
+    return 0;
+}
+
 /**
  * Clear follower state.
  */
@@ -45,6 +122,30 @@ static void raft_state__clear_follower(struct raft *r)
 {
     r->follower_state.current_leader.id = 0;
     r->follower_state.current_leader.address = NULL;
+
+    /* Fail all outstanding read requests */
+    while (!RAFT__QUEUE_IS_EMPTY(&r->follower_state.read_reqs)) {
+        struct raft_read *req;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&r->follower_state.read_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        if (req->cb != NULL) {
+            req->cb(req, RAFT_ERR_LEADERSHIP_LOST);
+        }
+    }
+
+    /* Fail all apply requests forwarded to the leader */
+    while (!RAFT__QUEUE_IS_EMPTY(&r->follower_state.apply_reqs)) {
+        struct raft_apply *req;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&r->follower_state.apply_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        req = RAFT__QUEUE_DATA(head, struct raft_apply, queue);
+        if (req->cb != NULL) {
+            req->cb(req, RAFT_ERR_LEADERSHIP_LOST);
+        }
+    }
 }
 
 /**
@@ -52,10 +153,11 @@ static void raft_state__clear_follower(struct raft *r)
  */
 static void raft_state__clear_candidate(struct raft *r)
 {
-    if (r->candidate_state.votes != NULL) {
+    if (r->candidate_state.votes != NULL &&
+        r->candidate_state.votes != &r->candidate_state.votes_inline) {
         raft_free(r->candidate_state.votes);
-        r->candidate_state.votes = NULL;
     }
+    r->candidate_state.votes = NULL;
 }
 
 /**
@@ -83,6 +185,29 @@ static void raft_state__clear_leader(struct raft *r)
         raft_watch__promotion_aborted(r, r->leader_state.promotee_id);
     }
 
+    /* If we were transferring leadership, stepping down after sending
+     * TimeoutNow means the transfer succeeded. */
+    if (r->leader_state.transfer != NULL) {
+        raft_transfer__finish(r, r->leader_state.transfer->sent
+                                     ? 0
+                                     : RAFT_ERR_LEADERSHIP_LOST);
+    }
+
+    /* Fail all outstanding read requests */
+    while (!RAFT__QUEUE_IS_EMPTY(&r->leader_state.read_reqs)) {
+        struct raft_read *req;
+        raft__queue *head;
+        head = RAFT__QUEUE_HEAD(&r->leader_state.read_reqs);
+        RAFT__QUEUE_REMOVE(head);
+        req = RAFT__QUEUE_DATA(head, struct raft_read, queue);
+        if (req->cb != NULL) {
+            req->cb(req, RAFT_ERR_LEADERSHIP_LOST);
+        }
+    }
+
+    /* Forget about entries waiting for group commit. */
+    r->group_commit.index = 0;
+
     /* Fail all outstanding apply requests */
     while (!RAFT__QUEUE_IS_EMPTY(&r->leader_state.apply_reqs)) {
         struct raft_apply *req;
@@ -131,6 +256,8 @@ static void raft_state__change(struct raft *r, int state)
            (r->state == RAFT_LEADER && state == RAFT_FOLLOWER));
 
     r->state = state;
+    trace__point(r, state, RAFT_TRACE_STATE, state, 0, r->current_term, 0, 0,
+                 0);
 }
 
 int raft_state__bump_current_term(struct raft *r, raft_term term)
@@ -165,6 +292,24 @@ static void raft_state__reset_follower(struct raft *r)
      * RPC. */
     r->follower_state.current_leader.id = 0;
     r->follower_state.current_leader.address = NULL;
+
+    RAFT__QUEUE_INIT(&r->follower_state.read_reqs);
+    r->follower_state.read_id = 0;
+    r->follower_state.read_time = 0;
+    r->follower_state.read_inflight = false;
+
+    RAFT__QUEUE_INIT(&r->follower_state.apply_reqs);
+    r->follower_state.apply_id = 0;
+
+    r->follower_state.snapshot_target = 0;
+    r->follower_state.snapshot_leader = 0;
+
+    r->follower_state.heartbeat_time = 0;
+    interval__init(&r->follower_state.heartbeat_interval);
+
+    r->follower_state.hibernating = false;
+
+    r->follower_state.seq = 0;
 }
 
 void raft_state__start_as_follower(struct raft *r)
@@ -193,6 +338,7 @@ int raft_state__convert_to_follower(struct raft *r, raft_term term)
     }
 
     raft_state__change(r, RAFT_FOLLOWER);
+    raft_state__reset_follower(r);
 
     /* We only need to write the new term if it differs form the current
      * one. The only case were this is not the case is if the leader decides to
@@ -204,17 +350,16 @@ int raft_state__convert_to_follower(struct raft *r, raft_term term)
         }
     }
 
-    raft_state__reset_follower(r);
-
     /* Notify watchers */
     raft_watch__state_change(r, prev_state);
 
     return 0;
 }
 
-int raft_state__convert_to_candidate(struct raft *r)
+int raft_state__convert_to_candidate(struct raft *r, bool disrupt_leader)
 {
     size_t n_voting = configuration__n_voting(&r->configuration);
+    size_t n_words = (r->configuration.n + 63) / 64;
     int rv;
 
     assert(r->state == RAFT_FOLLOWER);
@@ -224,18 +369,27 @@ int raft_state__convert_to_candidate(struct raft *r)
     /* Change state */
     raft_state__change(r, RAFT_CANDIDATE);
 
-    /* Allocate the votes array. */
-    r->candidate_state.votes = raft_malloc(n_voting * sizeof(bool));
-    if (r->candidate_state.votes == NULL) {
-        rv = RAFT_ENOMEM;
-        goto err;
+    /* Allocate the votes bitset, unless it fits in a single word. */
+    if (n_words <= 1) {
+        r->candidate_state.votes = &r->candidate_state.votes_inline;
+    } else {
+        r->candidate_state.votes =
+            raft_malloc(n_words * sizeof *r->candidate_state.votes);
+        if (r->candidate_state.votes == NULL) {
+            rv = RAFT_ENOMEM;
+            goto err;
+        }
     }
 
-    /* Start a new election round */
+    /* Start a new election round, possibly preceded by pre-vote. There's no
+     * point in running pre-vote if we are the only voter. */
+    r->candidate_state.in_pre_vote =
+        r->pre_vote && !disrupt_leader && n_voting > 1;
+    r->candidate_state.disrupt_leader = disrupt_leader;
     rv = raft_election__start(r);
     if (rv != 0) {
         r->state = RAFT_FOLLOWER;
-        raft_free(r->candidate_state.votes);
+        raft_state__clear_candidate(r);
         return rv;
     }
 
@@ -286,8 +440,21 @@ int raft_state__convert_to_leader(struct raft *r)
 
     raft_state__change(r, RAFT_LEADER);
 
-    /* Reset apply requests queue */
+    /* Reset apply and read requests queues */
     RAFT__QUEUE_INIT(&r->leader_state.apply_reqs);
+    RAFT__QUEUE_INIT(&r->leader_state.read_reqs);
+
+    r->leader_state.transfer = NULL;
+    r->leader_state.priority_transfer = 0;
+    r->leader_state.timeout_now = 0;
+    r->leader_state.uncommitted_bytes = 0;
+    r->leader_state.hibernating = false;
+    r->leader_state.idle_time = 0;
+    r->leader_state.wake_time = 0;
+    r->leader_state.seq = 0;
+    r->leader_state.seq_time = io__time(r->io);
+    r->leader_state.prev_seq_time = r->leader_state.seq_time;
+    r->backpressure.rejecting = false;
 
     /* Allocate the next_index and match_index arrays. */
     rv = alloc_replication(r->configuration.n, &r->leader_state.replication);
@@ -306,6 +473,23 @@ int raft_state__convert_to_leader(struct raft *r)
          * the replication array, and keep it up-to-date.  */
         replication->last_contact = 0;
         replication->state = REPLICATION__PROBE;
+        replication->inflight_bytes = 0;
+        replication->reading = false;
+        replication->ack_time = 0;
+        replication->ack_seq = 0;
+        replication->last_send = 0;
+        replication->last_commit = 0;
+        replication->sending_snapshot = false;
+        replication->delegate_id = 0;
+        replication->delegate_ack = 0;
+        replication->resume_index = 0;
+        replication->resume_offset = 0;
+        bucket__init(&replication->bucket);
+        interval__init(&replication->rtt);
+        replication->rtt_start = 0;
+        replication->rtt_index = 0;
+        replication->backtracking = false;
+        replication->fast = false;
     }
 
     /* Notify watchers */
@@ -316,6 +500,11 @@ int raft_state__convert_to_leader(struct raft *r)
     r->leader_state.round_number = 0;
     r->leader_state.round_index = 0;
     r->leader_state.round_duration = 0;
+    r->leader_state.round_start = 0;
+    r->leader_state.round_deadline = 0;
+    r->leader_state.round_idle = 0;
+    r->leader_state.catch_up_start = 0;
+    r->leader_state.catch_up_from = 0;
 
     return 0;
 
@@ -374,7 +563,24 @@ int raft_state__rebuild_next_and_match_indexes(
 
         replication[i].next_index = log__last_index(&r->log) + 1;
         replication[i].match_index = 0;
-        replication[i].last_contact = r->io->time(r->io);
+        replication[i].last_contact = io__time(r->io);
+        replication[i].inflight_bytes = 0;
+        replication[i].reading = false;
+        replication[i].ack_time = 0;
+        replication[i].ack_seq = 0;
+        replication[i].last_send = 0;
+        replication[i].last_commit = 0;
+        replication[i].sending_snapshot = false;
+        replication[i].delegate_id = 0;
+        replication[i].delegate_ack = 0;
+        replication[i].resume_index = 0;
+        replication[i].resume_offset = 0;
+        bucket__init(&replication[i].bucket);
+        interval__init(&replication[i].rtt);
+        replication[i].rtt_start = 0;
+        replication[i].rtt_index = 0;
+        replication[i].backtracking = false;
+        replication[i].fast = false;
     }
 
     raft_free(r->leader_state.replication);
@@ -387,3 +593,23 @@ err:
     assert(rv != 0);
     return rv;
 }
+
+void raft_state__close(struct raft *r)
+{
+    infof(r->io, "stopped");
+
+    raft_replication__drop_throttled(r);
+    raft_free(r->address);
+    log__close(&r->log);
+    raft_configuration_close(&r->configuration);
+    pool__close(&r->pools.send_append_entries);
+    pool__close(&r->pools.follower_append);
+    pool__close(&r->pools.send);
+    if (r->snapshot.install.buf.base != NULL) {
+        raft_free(r->snapshot.install.buf.base);
+    }
+
+    if (r->close_cb != NULL) {
+        r->close_cb(r);
+    }
+}
@@ -21,6 +21,12 @@ enum {
  */
 void raft_state__clear(struct raft *r);
 
+/**
+ * Release all memory held by a raft instance whose I/O backend has been closed,
+ * and invoke the close callback.
+ */
+void raft_state__close(struct raft *r);
+
 /**
  * Bump the current term to the given value and reset our vote, persiting the
  * change to disk.
@@ -51,8 +57,12 @@ int raft_state__convert_to_follower(struct raft *r, raft_term term);
  * From Figure 3.1:
  *
  *   On conversion to candidate, start election:
+ *
+ * If @disrupt_leader is true, the election was requested by the current leader
+ * through a TimeoutNow message: pre-vote is skipped and voters are asked to
+ * grant their vote even if they have heard from the leader recently.
  */
-int raft_state__convert_to_candidate(struct raft *r);
+int raft_state__convert_to_candidate(struct raft *r, bool disrupt_leader);
 
 /**
  * Convert from candidate to leader.
@@ -1,28 +1,133 @@
 #include "../include/raft.h"
 
 #include "assert.h"
+#include "client.h"
 #include "configuration.h"
 #include "election.h"
+#include "io.h"
+#include "log.h"
 #include "logging.h"
+#include "membership.h"
+#include "queue.h"
+#include "read.h"
 #include "replication.h"
 #include "state.h"
+#include "transfer.h"
 #include "watch.h"
 
-/**
- * Number of milliseconds after which a server promotion will be aborted if the
- * server hasn't caught up with the logs yet.
- */
-#define RAFT_MAX_CATCH_UP_DURATION (30 * 1000)
+/* Ticks are still requested at this interval while hibernating, in case the
+ * backend doesn't implement raft_io->tick_after. */
+#define HIBERNATE_TICK 60000
+
+/* Return true if our timers are suspended because of hibernation. */
+static bool is_hibernating(const struct raft *r)
+{
+    return (r->state == RAFT_LEADER && r->leader_state.hibernating) ||
+           (r->state == RAFT_FOLLOWER && r->follower_state.hibernating);
+}
 
 unsigned raft_next_timeout(struct raft *r)
 {
     unsigned timeout;
-    if (r->state == RAFT_LEADER) {
-        timeout = r->heartbeat_timeout;
+    if (is_hibernating(r)) {
+        timeout = HIBERNATE_TICK;
+    } else if (r->state == RAFT_LEADER) {
+        timeout = raft_election__heartbeat_timeout(r);
+        timeout = timeout > r->timer ? timeout - r->timer : 0;
     } else {
         timeout = r->election_timeout_rand;
+        timeout = timeout > r->timer ? timeout - r->timer : 0;
+    }
+
+    /* Followers retry to forward pending read requests, and check for apply
+     * requests forwarded without result, at every heartbeat timeout. */
+    if (r->state == RAFT_FOLLOWER &&
+        (!RAFT__QUEUE_IS_EMPTY(&r->follower_state.read_reqs) ||
+         !RAFT__QUEUE_IS_EMPTY(&r->follower_state.apply_reqs)) &&
+        r->heartbeat_timeout < timeout) {
+        timeout = r->heartbeat_timeout;
+    }
+
+    /* Followers send the AppendEntries result being held back for batching
+     * once its delay elapses. */
+    if (r->state == RAFT_FOLLOWER && r->ack_batch.term != 0) {
+        raft_time deadline = r->ack_batch.time + r->ack_batch.max_delay;
+        unsigned ack_timeout =
+            deadline > r->last_tick ? (unsigned)(deadline - r->last_tick) : 0;
+        if (ack_timeout < timeout) {
+            timeout = ack_timeout;
+        }
+    }
+
+    /* Snapshot transfers over their bandwidth budget are resumed once it has
+     * been refilled. */
+    if (!RAFT__QUEUE_IS_EMPTY(&r->background.throttled)) {
+        unsigned throttle_timeout = raft_replication__throttle_delay(r);
+        if (throttle_timeout < timeout) {
+            timeout = throttle_timeout;
+        }
+    }
+
+    /* A snapshot waiting for a quiet period is taken once it has elapsed. */
+    if (r->snapshot.deferral.waiting) {
+        raft_time deadline =
+            r->snapshot.deferral.last_apply + r->snapshot.deferral.quiet;
+        unsigned deferral_timeout =
+            deadline > r->last_tick ? (unsigned)(deadline - r->last_tick) : 0;
+        if (deferral_timeout < timeout) {
+            timeout = deferral_timeout;
+        }
+    }
+
+    return timeout;
+}
+
+void tick__update(struct raft *r)
+{
+    raft_time now;
+    unsigned elapsed;
+
+    if (r->state == RAFT_UNAVAILABLE) {
+        return;
+    }
+
+    now = io__time(r->io);
+    elapsed = now - r->last_tick;
+    r->timer += elapsed;
+    r->last_tick = now;
+
+    /* If a server is being promoted, increment the timer of the current
+     * round. */
+    if (r->state == RAFT_LEADER && r->leader_state.promotee_id != 0) {
+        r->leader_state.round_duration += elapsed;
+        r->leader_state.round_idle += elapsed;
     }
-    return timeout > r->timer ? timeout - r->timer : 0;
+}
+
+/* Return true if the I/O backend can be asked for the next tick. */
+static bool has_tick_after(struct raft *r)
+{
+    return r->io->version >= 15 && r->io->tick_after != NULL;
+}
+
+void tick__schedule(struct raft *r)
+{
+    raft_time now;
+    unsigned elapsed;
+    unsigned timeout;
+
+    if (!has_tick_after(r)) {
+        return;
+    }
+
+    now = io__time(r->io);
+    elapsed = now - r->last_tick;
+    timeout = raft_next_timeout(r);
+    timeout = timeout > elapsed ? timeout - elapsed : 0;
+
+    /* Timers expire only once they are strictly greater than their timeout,
+     * so fire one millisecond past the deadline. */
+    r->io->tick_after(r->io, timeout + 1);
 }
 
 /**
@@ -35,6 +140,9 @@ static int follower_tick(struct raft *r)
     assert(r != NULL);
     assert(r->state == RAFT_FOLLOWER);
 
+    /* Possibly send the AppendEntries result held back for batching. */
+    raft_replication__flush_ack(r);
+
     server = configuration__get(&r->configuration, r->id);
 
     /* If we have been removed from the configuration, or maybe we didn't
@@ -43,6 +151,11 @@ static int follower_tick(struct raft *r)
         return 0;
     }
 
+    /* The leader doesn't send heartbeats while hibernating. */
+    if (r->follower_state.hibernating) {
+        return 0;
+    }
+
     /* Check if we need to start an election.
      *
      * From Section §3.3:
@@ -55,12 +168,24 @@ static int follower_tick(struct raft *r)
      *
      *   If election timeout elapses without receiving AppendEntries RPC from
      *   current leader or granting vote to candidate, convert to candidate.
+     *
+     * Witnesses only vote, since they don't have the entries payloads, so they
+     * just forget about the leader, in order to grant their vote to the
+     * candidates of the next election.
      */
-    if (r->timer > r->election_timeout_rand && server->voting) {
+    if (r->timer > r->election_timeout_rand && server->witness) {
+        r->follower_state.current_leader.id = 0;
+        r->follower_state.current_leader.address = NULL;
+    } else if (r->timer > r->election_timeout_rand && server->voting) {
         infof(r->io, "convert to candidate and start new election");
-        return raft_state__convert_to_candidate(r);
+        return raft_state__convert_to_candidate(r, false);
     }
 
+    /* Possibly retry forwarding read requests to the leader, and give up on
+     * forwarded apply requests. */
+    read__process(r);
+    raft_client__expire_forwarded(r);
+
     return 0;
 }
 
@@ -84,6 +209,8 @@ static int candidate_tick(struct raft *r)
      */
     if (r->timer > r->election_timeout_rand) {
         infof(r->io, "start new election");
+        r->candidate_state.in_pre_vote = r->pre_vote;
+        r->candidate_state.disrupt_leader = false;
         return raft_election__start(r);
     }
 
@@ -91,14 +218,16 @@ static int candidate_tick(struct raft *r)
 }
 
 /**
- * Return true if the leader has been contacted by a majority of servers in the
- * last @election_timeout milliseconds.
+ * Return true if the leader has been contacted by a majority of servers within
+ * the last election timeout.
  */
 static bool leader_has_been_contacted_by_majority_of_servers(struct raft *r)
 {
-    raft_time now = r->io->time(r->io);
+    raft_time now = io__time(r->io);
     unsigned i;
-    unsigned contacts = 0;
+    struct configuration__quorum contacts;
+
+    configuration__quorum_init(&contacts);
 
     for (i = 0; i < r->configuration.n; i++) {
         struct raft_server *server = &r->configuration.servers[i];
@@ -110,14 +239,19 @@ static bool leader_has_been_contacted_by_majority_of_servers(struct raft *r)
         }
 
         if (server->id == r->id) {
-            contacts++;
+            configuration__quorum_add(&r->configuration, i, &contacts);
             continue;
         }
 
-        elapsed = now - replication->last_contact;
+        /* Followers don't answer while we hibernate. */
+        if (replication->last_contact < r->leader_state.wake_time) {
+            elapsed = now - r->leader_state.wake_time;
+        } else {
+            elapsed = now - replication->last_contact;
+        }
 
-        if (elapsed <= r->election_timeout) {
-            contacts++;
+        if (elapsed <= raft_election__timeout(r)) {
+            configuration__quorum_add(&r->configuration, i, &contacts);
         } else {
             debugf(r->io,
                    "lost contact with server %d: no message since %u "
@@ -126,19 +260,98 @@ static bool leader_has_been_contacted_by_majority_of_servers(struct raft *r)
         }
     }
 
-    return contacts > configuration__n_voting(&r->configuration) / 2;
+    return configuration__quorum_reached(&r->configuration, &contacts);
+}
+
+/* Return true if all servers have all our entries and no request is being
+ * processed. */
+static bool leader_is_idle(struct raft *r)
+{
+    raft_index last_index = log__last_index(&r->log);
+    unsigned i;
+
+    if (r->commit_index != last_index || r->group_commit.index != 0 ||
+        r->leader_state.promotee_id != 0 || r->leader_state.transfer != NULL ||
+        !RAFT__QUEUE_IS_EMPTY(&r->leader_state.apply_reqs) ||
+        !RAFT__QUEUE_IS_EMPTY(&r->leader_state.read_reqs)) {
+        return false;
+    }
+
+    for (i = 0; i < r->configuration.n; i++) {
+        if (r->configuration.servers[i].id == r->id) {
+            continue;
+        }
+        if (r->leader_state.replication[i].match_index != last_index) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Return true if we have been idle for the hibernate timeout. */
+static bool leader_should_hibernate(struct raft *r)
+{
+    raft_time now;
+
+    if (r->hibernate_timeout == 0) {
+        return false;
+    }
+
+    if (!leader_is_idle(r)) {
+        r->leader_state.idle_time = 0;
+        return false;
+    }
+
+    now = io__time(r->io);
+    if (r->leader_state.idle_time == 0) {
+        r->leader_state.idle_time = now;
+    }
+
+    return now - r->leader_state.idle_time >= r->hibernate_timeout;
+}
+
+/* Send a last heartbeat to all servers, telling them to suspend their election
+ * timers. */
+static void leader_hibernate(struct raft *r)
+{
+    unsigned i;
+    int rv;
+
+    infof(r->io, "idle for %u msecs -> hibernate", r->hibernate_timeout);
+
+    r->leader_state.hibernating = true;
+
+    for (i = 0; i < r->configuration.n; i++) {
+        const struct raft_server *server = &r->configuration.servers[i];
+        if (server->id == r->id) {
+            continue;
+        }
+        rv = raft_replication__send_append_entries(r, i);
+        if (rv != 0 && rv != RAFT_ERR_IO_CONNECT) {
+            /* This is not a critical failure, let's just log it. */
+            warnf(r->io, "failed to send append entries to server %ld: %s (%d)",
+                  server->id, raft_strerror(rv), rv);
+        }
+    }
 }
 
 /**
  * Apply time-dependent rules for leaders (Figure 3.1).
  */
-static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
+static int leader_tick(struct raft *r)
 {
     int rv;
 
     assert(r != NULL);
     assert(r->state == RAFT_LEADER);
 
+    /* Followers have suspended their election timers, there's nothing to do
+     * until we wake up. */
+    if (r->leader_state.hibernating) {
+        return 0;
+    }
+
     /* Check if we still can reach a majority of servers.
      *
      * From Section 6.2:
@@ -153,6 +366,14 @@ static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
         return rv;
     }
 
+    /* Start a new heartbeat round at every heartbeat timeout, even while busy
+     * replicating entries, renewing the read lease and confirming the reads
+     * whose heartbeats were lost. */
+    if (io__time(r->io) - r->leader_state.seq_time >=
+        raft_election__heartbeat_timeout(r)) {
+        read__new_round(r);
+    }
+
     /* Check if we need to send heartbeats.
      *
      * From Figure 3.1:
@@ -160,13 +381,28 @@ static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
      *   Send empty AppendEntries RPC during idle periods to prevent election
      *   timeouts.
      */
-    if (r->timer > r->heartbeat_timeout) {
-        raft_replication__trigger(r, 0);
+    if (r->timer > raft_election__heartbeat_timeout(r)) {
+        if (leader_should_hibernate(r)) {
+            leader_hibernate(r);
+        } else {
+            raft_replication__trigger(r, 0);
+        }
         r->timer = 0;
     }
 
-    /* If a server is being promoted, increment the timer of the current
-     * round or abort the promotion.
+    /* Serve any read request which doesn't need to wait for other servers. */
+    read__process(r);
+
+    /* Check the progress of the leadership transfer, if any, and hand over
+     * leadership to servers with a higher priority. */
+    raft_transfer__tick(r);
+    if (r->state != RAFT_LEADER) {
+        return 0;
+    }
+    raft_transfer__priority(r);
+
+    /* If a server is being promoted, abort the promotion if the current round
+     * is taking too long.
      *
      * From Section 4.2.1:
      *
@@ -176,12 +412,15 @@ static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
      *   unreplicated entries to create a significant availability
      *   gap. Otherwise, the leader aborts the configuration change with an
      *   error.
+     *
+     * Rather than bounding every round by the election timeout, which would
+     * make the promotion of servers with a lot of entries to catch up with
+     * almost always fail, the first round is only required to make progress
+     * and the following ones by the throughput measured in the previous one.
      */
     if (r->leader_state.promotee_id != 0) {
         unsigned id = r->leader_state.promotee_id;
         size_t server_index;
-        bool is_too_slow;
-        bool is_unresponsive;
 
         /* If a promotion is in progress, we expect that our configuration
          * contains an entry for the server being promoted, and that the server
@@ -190,22 +429,7 @@ static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
         assert(server_index < r->configuration.n);
         assert(!r->configuration.servers[server_index].voting);
 
-        r->leader_state.round_duration += msec_since_last_tick;
-
-        is_too_slow = (r->leader_state.round_number == 10 &&
-                       r->leader_state.round_duration > r->election_timeout);
-        is_unresponsive =
-            r->leader_state.round_duration > RAFT_MAX_CATCH_UP_DURATION;
-
-        /* Abort the promotion if we are at the 10'th round and it's still
-         * taking too long, or if the server is unresponsive. */
-        if (is_too_slow || is_unresponsive) {
-            r->leader_state.promotee_id = 0;
-
-            r->leader_state.round_index = 0;
-            r->leader_state.round_number = 0;
-            r->leader_state.round_duration = 0;
-
+        if (raft_membership__abort_catch_up(r)) {
             raft_watch__promotion_aborted(r, id);
         }
     }
@@ -216,8 +440,6 @@ static int leader_tick(struct raft *r, const unsigned msec_since_last_tick)
 static int tick(struct raft *r)
 {
     int rv;
-    raft_time now;
-    unsigned msecs_since_last_tick;
 
     assert(r != NULL);
 
@@ -229,11 +451,13 @@ static int tick(struct raft *r)
         return 0;
     }
 
-    now = r->io->time(r->io);
+    tick__update(r);
 
-    msecs_since_last_tick = now - r->last_tick;
-    r->timer += msecs_since_last_tick;
-    r->last_tick = now;
+    /* Possibly resume snapshot transfers waiting for bandwidth budget. */
+    raft_replication__resume_throttled(r);
+
+    /* Possibly take a snapshot that was waiting for a quiet period. */
+    raft_replication__snapshot_tick(r);
 
     switch (r->state) {
         case RAFT_FOLLOWER:
@@ -243,7 +467,7 @@ static int tick(struct raft *r)
             rv = candidate_tick(r);
             break;
         case RAFT_LEADER:
-            rv = leader_tick(r, msecs_since_last_tick);
+            rv = leader_tick(r);
             break;
     }
 
@@ -255,5 +479,38 @@ void tick_cb(struct raft_io *io)
     struct raft *r;
     r = io->data;
     tick(r);
+    tick__schedule(r);
 }
 
+
+void tick__wake(struct raft *r)
+{
+    if (!is_hibernating(r)) {
+        return;
+    }
+
+    /* Account the time elapsed so far, since the timers restart now. */
+    tick__update(r);
+
+    if (r->state == RAFT_LEADER) {
+        debugf(r->io, "wake up -> resume heartbeats");
+        r->leader_state.hibernating = false;
+        r->leader_state.idle_time = 0;
+        r->leader_state.wake_time = r->last_tick;
+        /* Send heartbeats at the next tick. */
+        r->timer = raft_election__heartbeat_timeout(r);
+    } else {
+        debugf(r->io, "wake up -> resume election timer");
+        r->follower_state.hibernating = false;
+        r->follower_state.heartbeat_time = 0;
+        r->timer = 0;
+    }
+
+    tick__schedule(r);
+}
+
+void raft_wake(struct raft *r)
+{
+    assert(r != NULL);
+    tick__wake(r);
+}
@@ -13,4 +13,23 @@
  */
 void tick_cb(struct raft_io *io);
 
+/**
+ * Add the time elapsed since the last tick to the timers. Called before
+ * handling events that might reset a timer, so that time elapsed before the
+ * reset doesn't get accounted after it.
+ */
+void tick__update(struct raft *r);
+
+/**
+ * If the @raft_io implementation supports it, ask it to invoke the tick
+ * callback only when the next timeout expires.
+ */
+void tick__schedule(struct raft *r);
+
+/**
+ * Resume the timers suspended by hibernation, if any. Leaders send heartbeats
+ * at the next tick, and followers restart their election timer.
+ */
+void tick__wake(struct raft *r);
+
 #endif /* RAFT_TICK_H */
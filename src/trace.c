@@ -0,0 +1,92 @@
+#include "trace.h"
+
+/* Extract the term, index and status to report for a message. */
+static void message_args(const struct raft_message *message,
+                         raft_term *term,
+                         raft_index *index,
+                         unsigned *n,
+                         int *status)
+{
+    *term = 0;
+    *index = 0;
+    *n = 0;
+    *status = 0;
+    switch (message->type) {
+        case RAFT_IO_APPEND_ENTRIES:
+            *term = message->append_entries.term;
+            *index = message->append_entries.prev_log_index + 1;
+            *n = message->append_entries.n_entries;
+            break;
+        case RAFT_IO_APPEND_ENTRIES_RESULT:
+            *term = message->append_entries_result.term;
+            *index = message->append_entries_result.last_log_index;
+            *status = message->append_entries_result.success ? 0 : 1;
+            break;
+        case RAFT_IO_REQUEST_VOTE:
+            *term = message->request_vote.term;
+            *index = message->request_vote.last_log_index;
+            break;
+        case RAFT_IO_REQUEST_VOTE_RESULT:
+            *term = message->request_vote_result.term;
+            *status = message->request_vote_result.vote_granted ? 0 : 1;
+            break;
+        case RAFT_IO_INSTALL_SNAPSHOT:
+            *term = message->install_snapshot.term;
+            *index = message->install_snapshot.last_index;
+            break;
+        case RAFT_IO_TIMEOUT_NOW:
+            *term = message->timeout_now.term;
+            *index = message->timeout_now.last_log_index;
+            break;
+        case RAFT_IO_SEND_SNAPSHOT:
+            *term = message->send_snapshot.term;
+            *index = message->send_snapshot.last_index;
+            break;
+        case RAFT_IO_SEND_SNAPSHOT_RESULT:
+            *term = message->send_snapshot_result.term;
+            *index = message->send_snapshot_result.last_index;
+            *status = message->send_snapshot_result.last_index != 0 ? 0 : 1;
+            break;
+        case RAFT_IO_PROPOSE:
+            *term = message->propose.term;
+            *n = message->propose.n_entries;
+            break;
+        case RAFT_IO_PROPOSE_RESULT:
+            *term = message->propose_result.term;
+            *index = message->propose_result.index;
+            *status = message->propose_result.status;
+            break;
+    }
+}
+
+void trace__send(struct raft *r, const struct raft_message *message)
+{
+    raft_term term;
+    raft_index index;
+    unsigned n;
+    int status;
+#if !defined(HAVE_SYS_SDT_H)
+    if (r->tracer == NULL) {
+        return;
+    }
+#endif
+    message_args(message, &term, &index, &n, &status);
+    trace__point(r, send, RAFT_TRACE_SEND, message->type, message->server_id,
+                 term, index, n, status);
+}
+
+void trace__recv(struct raft *r, const struct raft_message *message)
+{
+    raft_term term;
+    raft_index index;
+    unsigned n;
+    int status;
+#if !defined(HAVE_SYS_SDT_H)
+    if (r->tracer == NULL) {
+        return;
+    }
+#endif
+    message_args(message, &term, &index, &n, &status);
+    trace__point(r, recv, RAFT_TRACE_RECV, message->type, message->server_id,
+                 term, index, n, status);
+}
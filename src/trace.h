@@ -0,0 +1,48 @@
+/**
+ * Trace points.
+ */
+
+#ifndef RAFT_TRACE_H_
+#define RAFT_TRACE_H_
+
+#include "../include/raft.h"
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define TRACE__PROBE(R, NAME, TYPE, SERVER_ID, TERM, INDEX, N, STATUS)        \
+    DTRACE_PROBE8(raft, NAME, (R)->id, TYPE, SERVER_ID, TERM, INDEX, N, STATUS)
+#else
+#define TRACE__PROBE(R, NAME, TYPE, SERVER_ID, TERM, INDEX, N, STATUS)
+#endif
+
+/**
+ * Hit the trace point with the given ID, firing both the USDT probe named
+ * @NAME and the registered tracer, if any.
+ */
+#define trace__point(R, NAME, POINT, TYPE, SERVER_ID, TERM, INDEX, N, STATUS) \
+    do {                                                                      \
+        TRACE__PROBE(R, NAME, TYPE, SERVER_ID, TERM, INDEX, N, STATUS);       \
+        if ((R)->tracer != NULL) {                                            \
+            struct raft_trace trace__;                                        \
+            trace__.point = POINT;                                            \
+            trace__.type = TYPE;                                              \
+            trace__.server_id = SERVER_ID;                                    \
+            trace__.term = TERM;                                              \
+            trace__.index = INDEX;                                            \
+            trace__.n = N;                                                    \
+            trace__.status = STATUS;                                          \
+            (R)->tracer((R)->data, &trace__);                                 \
+        }                                                                     \
+    } while (0)
+
+/**
+ * Hit the RAFT_TRACE_SEND trace point for a message about to be sent.
+ */
+void trace__send(struct raft *r, const struct raft_message *message);
+
+/**
+ * Hit the RAFT_TRACE_RECV trace point for a message just received.
+ */
+void trace__recv(struct raft *r, const struct raft_message *message);
+
+#endif /* RAFT_TRACE_H_ */
@@ -0,0 +1,193 @@
+#include "../include/raft.h"
+
+#include "assert.h"
+#include "configuration.h"
+#include "election.h"
+#include "io.h"
+#include "log.h"
+#include "logging.h"
+#include "trace.h"
+#include "transfer.h"
+#include "watch.h"
+
+static void raft_transfer__send_timeout_now_cb(struct raft_io_send *req,
+                                               int status)
+{
+    (void)status;
+    raft_free(req);
+}
+
+/* Send a TimeoutNow message to the given server. */
+static int raft_transfer__send_timeout_now(struct raft *r,
+                                           const struct raft_server *server)
+{
+    struct raft_message message;
+    struct raft_io_send *req;
+    int rv;
+
+    message.type = RAFT_IO_TIMEOUT_NOW;
+    message.server_id = server->id;
+    message.server_address = server->address;
+    message.timeout_now.term = r->current_term;
+    message.timeout_now.last_log_index = log__last_index(&r->log);
+    message.timeout_now.last_log_term = log__last_term(&r->log);
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    trace__send(r, &message);
+    rv = io__send(r->io, req, &message, raft_transfer__send_timeout_now_cb);
+    if (rv != 0) {
+        raft_free(req);
+        return rv;
+    }
+
+    return 0;
+}
+
+void raft_transfer__progress(struct raft *r)
+{
+    struct raft_transfer *req = r->leader_state.transfer;
+    const struct raft_server *server;
+    size_t server_index;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (req == NULL || req->sent) {
+        return;
+    }
+
+    /* The target might have been removed from the configuration, in which
+     * case the transfer will just time out. */
+    server_index = configuration__index_of(&r->configuration, req->id);
+    if (server_index == r->configuration.n) {
+        return;
+    }
+    server = &r->configuration.servers[server_index];
+
+    if (r->leader_state.replication[server_index].match_index <
+        log__last_index(&r->log)) {
+        return;
+    }
+
+    infof(r->io, "server %ld is up-to-date -> send timeout now", req->id);
+
+    rv = raft_transfer__send_timeout_now(r, server);
+    if (rv != 0) {
+        /* This is not a critical failure, we'll retry at the next tick. */
+        warnf(r->io, "failed to send timeout now to server %ld: %s (%d)",
+              req->id, raft_strerror(rv), rv);
+        return;
+    }
+
+    req->sent = true;
+    r->leader_state.timeout_now = io__time(r->io);
+}
+
+void raft_transfer__tick(struct raft *r)
+{
+    struct raft_transfer *req = r->leader_state.transfer;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (req == NULL) {
+        return;
+    }
+
+    if (io__time(r->io) - req->start >= r->election_timeout) {
+        warnf(r->io, "leadership transfer to server %ld timed out", req->id);
+        raft_transfer__finish(r, RAFT_ERR_TIMEOUT);
+        return;
+    }
+
+    raft_transfer__progress(r);
+}
+
+/* Release a leadership transfer started by raft_transfer__priority(). */
+static void priority_transfer_cb(struct raft_transfer *req, int status)
+{
+    (void)status;
+    raft_free(req);
+}
+
+void raft_transfer__priority(struct raft *r)
+{
+    raft_time now = io__time(r->io);
+    raft_time last = r->leader_state.priority_transfer;
+    const struct raft_server *self;
+    struct raft_transfer *req;
+    unsigned short highest;
+    unsigned id = 0;
+    size_t i;
+    int rv;
+
+    assert(r->state == RAFT_LEADER);
+
+    if (r->leader_state.transfer != NULL ||
+        (last != 0 && now - last < 2 * (raft_time)r->election_timeout)) {
+        return;
+    }
+
+    self = configuration__get(&r->configuration, r->id);
+    if (self == NULL) {
+        return;
+    }
+    highest = self->priority;
+
+    for (i = 0; i < r->configuration.n; i++) {
+        const struct raft_server *server = &r->configuration.servers[i];
+        struct raft_replication *replication = &r->leader_state.replication[i];
+
+        if (server->id == r->id || !server->voting || server->witness ||
+            server->priority <= highest) {
+            continue;
+        }
+        if (replication->match_index < r->commit_index ||
+            now - replication->last_contact >
+                2 * (raft_time)raft_election__heartbeat_timeout(r)) {
+            continue;
+        }
+        highest = server->priority;
+        id = server->id;
+    }
+
+    if (id == 0) {
+        return;
+    }
+
+    req = raft_malloc(sizeof *req);
+    if (req == NULL) {
+        return;
+    }
+
+    infof(r->io, "server %d has a higher priority -> transfer leadership", id);
+
+    rv = raft_transfer_leadership(r, req, id, priority_transfer_cb);
+    if (rv != 0) {
+        raft_free(req);
+        return;
+    }
+
+    r->leader_state.priority_transfer = now;
+}
+
+void raft_transfer__finish(struct raft *r, int status)
+{
+    struct raft_transfer *req = r->leader_state.transfer;
+
+    if (req == NULL) {
+        return;
+    }
+
+    r->leader_state.transfer = NULL;
+
+    raft_watch__lifecycle(r, RAFT_EVENT_LEADERSHIP_TRANSFERRED, req->id, 0,
+                          req->start, 0, status);
+
+    if (req->cb != NULL) {
+        req->cb(req, status);
+    }
+}
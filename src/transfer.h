@@ -0,0 +1,36 @@
+/**
+ * Leadership transfer (Section 3.10).
+ */
+
+#ifndef RAFT_TRANSFER_H
+#define RAFT_TRANSFER_H
+
+#include "../include/raft.h"
+
+/**
+ * If a leadership transfer is in progress and the log of the target server is
+ * up-to-date, send it a TimeoutNow message.
+ */
+void raft_transfer__progress(struct raft *r);
+
+/**
+ * Abort the leadership transfer in progress, if any, when it takes longer than
+ * an election timeout, and retry sending TimeoutNow if it previously failed.
+ */
+void raft_transfer__tick(struct raft *r);
+
+/**
+ * If no leadership transfer is in progress and a voting server has a higher
+ * election priority than this leader, is up-to-date with the commit index and
+ * answered recently, transfer leadership to the one with the highest priority.
+ * After an attempt, no other one is made for two election timeouts.
+ */
+void raft_transfer__priority(struct raft *r);
+
+/**
+ * Complete the leadership transfer in progress, if any, and invoke its
+ * callback with the given status.
+ */
+void raft_transfer__finish(struct raft *r, int status);
+
+#endif /* RAFT_TRANSFER_H */
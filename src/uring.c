@@ -0,0 +1,156 @@
+#include "uring.h"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd,
+                          unsigned to_submit,
+                          unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+int uring__init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    int rv;
+
+    memset(&p, 0, sizeof p);
+
+    r->fd = io_uring_setup(entries, &p);
+    if (r->fd == -1) {
+        return -errno;
+    }
+
+    r->entries = p.sq_entries;
+    r->n_queued = 0;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        rv = -errno;
+        goto err_after_setup;
+    }
+
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+        rv = -errno;
+        goto err_after_sq_ring_mmap;
+    }
+
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        rv = -errno;
+        goto err_after_cq_ring_mmap;
+    }
+
+    r->sq_head = r->sq_ring + p.sq_off.head;
+    r->sq_tail = r->sq_ring + p.sq_off.tail;
+    r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ring + p.sq_off.array;
+    r->cq_head = r->cq_ring + p.cq_off.head;
+    r->cq_tail = r->cq_ring + p.cq_off.tail;
+    r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+    r->cqes = r->cq_ring + p.cq_off.cqes;
+
+    return 0;
+
+err_after_cq_ring_mmap:
+    munmap(r->cq_ring, r->cq_ring_size);
+err_after_sq_ring_mmap:
+    munmap(r->sq_ring, r->sq_ring_size);
+err_after_setup:
+    close(r->fd);
+    r->fd = -1;
+    return rv;
+}
+
+void uring__close(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring__get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->n_queued;
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= r->entries) {
+        return NULL;
+    }
+
+    index = tail & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    r->sq_array[index] = index;
+    r->n_queued++;
+
+    return sqe;
+}
+
+int uring__submit(struct uring *r)
+{
+    unsigned n = r->n_queued;
+    int rv;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    /* Make the new entries visible to the kernel. */
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->n_queued = 0;
+
+    do {
+        rv = io_uring_enter(r->fd, n, 0, 0);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+struct io_uring_cqe *uring__peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring__cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
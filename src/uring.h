@@ -0,0 +1,73 @@
+/**
+ * Minimal io_uring support, built directly on top of the kernel APIs. This
+ * avoids having to depend on liburing.
+ */
+
+#ifndef RAFT_URING_H
+#define RAFT_URING_H
+
+#if defined(HAVE_LINUX_IO_URING_H)
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A submission/completion queue pair shared with the kernel.
+ */
+struct uring
+{
+    int fd;                    /* Ring file descriptor, poll'able */
+    unsigned entries;          /* Number of submission queue entries */
+    void *sq_ring;             /* Mapped submission queue ring */
+    size_t sq_ring_size;       /* Size of the submission queue ring */
+    void *cq_ring;             /* Mapped completion queue ring */
+    size_t cq_ring_size;       /* Size of the completion queue ring */
+    struct io_uring_sqe *sqes; /* Mapped submission queue entries */
+    size_t sqes_size;          /* Size of the sqes array */
+    unsigned *sq_head;         /* Consumed by the kernel */
+    unsigned *sq_tail;         /* Produced by us */
+    unsigned *sq_mask;         /* Mask to get the index of an entry */
+    unsigned *sq_array;        /* Indexes of the entries to submit */
+    unsigned *cq_head;         /* Consumed by us */
+    unsigned *cq_tail;         /* Produced by the kernel */
+    unsigned *cq_mask;         /* Mask to get the index of a completion */
+    struct io_uring_cqe *cqes; /* Completion queue entries */
+    unsigned n_queued;         /* Entries queued but not yet submitted */
+};
+
+/**
+ * Setup a ring with the given number of entries. Return a negative errno value
+ * on failure, e.g. -ENOSYS if the kernel has no io_uring support.
+ */
+int uring__init(struct uring *r, unsigned entries);
+
+/**
+ * Unmap and close the ring.
+ */
+void uring__close(struct uring *r);
+
+/**
+ * Return a zero'ed submission queue entry, or NULL if the queue is full. The
+ * entry will be submitted at the next call to uring__submit().
+ */
+struct io_uring_sqe *uring__get_sqe(struct uring *r);
+
+/**
+ * Submit all queued entries. Return a negative errno value on failure.
+ */
+int uring__submit(struct uring *r);
+
+/**
+ * Return the next available completion entry, or NULL if there's none.
+ */
+struct io_uring_cqe *uring__peek_cqe(struct uring *r);
+
+/**
+ * Release the completion entry returned by uring__peek_cqe().
+ */
+void uring__cqe_seen(struct uring *r);
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif /* RAFT_URING_H */
@@ -1,7 +1,10 @@
+#include <fcntl.h>
 #include <libgen.h>
+#include <linux/falloc.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 #include <xfs/xfs.h>
@@ -10,8 +13,23 @@
 
 #include "aio.h"
 #include "assert.h"
+#include "byte.h"
+#include "uring.h"
 #include "uv_file.h"
 
+/* Number of io_uring submission queue entries of a file. Each write might
+ * take two of them, if a sync operation is linked to it. */
+#define UV__FILE_RING_ENTRIES 16
+
+/* Set in the user data of the sync operation linked to a write. */
+#define UV__FILE_SYNC_TAG 1
+
+/* Format version and size of the probe cache file. It holds the format
+ * version, the identity of the file system (device, type and ID), the block
+ * size and whether async writes are supported, as 64-bit words. */
+#define UV__FILE_PROBE_CACHE_FORMAT 1
+#define UV__FILE_PROBE_CACHE_SIZE (6 * sizeof(uint64_t))
+
 /**
  Handle flags
  */
@@ -106,6 +124,13 @@ static int probe_block_size(int fd, size_t size, bool *ok)
  */
 static void uv__file_create_work_cb(uv_work_t *work);
 
+/**
+ * Zero the content of a recycled file and make sure it has the desired size,
+ * possibly retaining its allocated blocks. Called in a thread as part of file
+ * creation.
+ */
+static int uv__file_create_work_reuse(struct uv__file *f, size_t size);
+
 /**
  * Sync the directory where @path lives in. This is necessary in order to ensure
  * that the new entry is saved in the directory inode. Called in a thread as
@@ -133,6 +158,14 @@ static void uv__file_create_after_work_cb(uv_work_t *work, int status);
  */
 static void uv__file_write_poll_cb(uv_poll_t *poller, int status, int events);
 
+#if defined(HAVE_LINUX_IO_URING_H)
+/**
+ * Callback fired when the io_uring file descriptor is ready for reading
+ * (i.e. when write completion entries are available).
+ */
+static void uv__file_ring_poll_cb(uv_poll_t *poller, int status, int events);
+#endif
+
 /**
  * Run blocking syscalls involved in a file write request.
  *
@@ -162,7 +195,9 @@ static void uv__file_maybe_closed(struct uv__file *f);
  */
 static void uv__file_poll_close_cb(struct uv_handle_s *handle);
 
-int uv__file_block_size(const char *dir, size_t *size)
+/* Probe the file system rooted at @dir, figuring out its block size and
+ * whether it supports fully asynchronous direct I/O writes. */
+static int uv__file_probe_fs(const char *dir, size_t *size, bool *async)
 {
     struct statfs fs_info; /* To get the type code of the underlying fs */
     struct stat info;      /* To get the block size reported by the fs */
@@ -179,6 +214,7 @@ int uv__file_block_size(const char *dir, size_t *size)
     /* If NOWAIT is not supported, just return 4096. In practice it should
      * always work fine. */
     *size = 4096;
+    *async = false;
     return 0;
 #else
 
@@ -222,6 +258,7 @@ int uv__file_block_size(const char *dir, size_t *size)
          * how to figure the device block size.
          */
         *size = attr.d_miniosz > 4096 ? attr.d_miniosz : 4096;
+        *async = true;
 
         goto out;
     }
@@ -239,6 +276,7 @@ int uv__file_block_size(const char *dir, size_t *size)
         case 0x01021994: /* tmpfs */
             /* 4096 is ok. */
             *size = 4096;
+            *async = false;
             goto out;
 
         case 0x2fc12fc1: /* ZFS */
@@ -254,6 +292,7 @@ int uv__file_block_size(const char *dir, size_t *size)
              * not support async writes. We might want to change this once ZFS
              * async support is released. */
             *size = info.st_blksize > 4096 ? 4096 : info.st_blksize;
+            *async = false;
             goto out;
     }
 
@@ -265,13 +304,19 @@ int uv__file_block_size(const char *dir, size_t *size)
         goto err_after_file_open;
     }
 
+    /* If direct I/O is not supported, segments will be written through the
+     * page cache, for which 4096 is ok. */
     flags = fcntl(fd, F_GETFL);
     rv = fcntl(fd, F_SETFL, flags | O_DIRECT);
     if (rv == -1) {
-        /* UNTESTED: this should actually never fail, for the file systems we
-         * currently support. */
-        rv = uv_translate_sys_error(errno);
-        goto err_after_file_open;
+        if (errno != EINVAL) {
+            /* UNTESTED: the parameters are ok, so this should never happen. */
+            rv = uv_translate_sys_error(errno);
+            goto err_after_file_open;
+        }
+        *size = 4096;
+        *async = false;
+        goto out;
     }
 
     *size = 4096;
@@ -286,6 +331,7 @@ int uv__file_block_size(const char *dir, size_t *size)
         }
 
         if (ok) {
+            *async = true;
             goto out;
         }
 
@@ -316,26 +362,202 @@ err:
 #endif /* RWF_NOWAIT */
 }
 
+int uv__file_block_size(const char *dir, size_t *size)
+{
+    bool async;
+    return uv__file_probe_fs(dir, size, &async);
+}
+
+/* Encode the identity of the file system rooted at @dir, using its device
+ * number, type and ID. */
+static int uv__file_probe_identity(const char *dir, uint64_t identity[3])
+{
+    struct statfs fs_info;
+    struct stat info;
+    uint64_t fsid;
+
+    if (stat(dir, &info) != 0 || statfs(dir, &fs_info) != 0) {
+        return uv_translate_sys_error(errno);
+    }
+
+    memcpy(&fsid, &fs_info.f_fsid, sizeof fsid);
+
+    identity[0] = (uint64_t)info.st_dev;
+    identity[1] = (uint64_t)fs_info.f_type;
+    identity[2] = fsid;
+
+    return 0;
+}
+
+/* Render the path of the probe cache file of @dir. The returned string must be
+ * released with free(). */
+static char *uv__file_probe_path(const char *dir)
+{
+    char *path;
+    path = malloc(strlen(dir) + strlen("/") + strlen(UV__FILE_PROBE_CACHE) + 1);
+    if (path != NULL) {
+        sprintf(path, "%s/%s", dir, UV__FILE_PROBE_CACHE);
+    }
+    return path;
+}
+
+/* Read the probe cache file of @dir, returning #true if it was written for the
+ * file system with the given identity. */
+static bool uv__file_probe_load(const char *dir,
+                                const uint64_t identity[3],
+                                size_t *size,
+                                bool *async)
+{
+    uint8_t buf[UV__FILE_PROBE_CACHE_SIZE];
+    const void *cursor = buf;
+    char *path;
+    ssize_t n;
+    uint64_t block_size;
+    unsigned i;
+    int fd;
+
+    path = uv__file_probe_path(dir);
+    if (path == NULL) {
+        return false;
+    }
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return false;
+    }
+    do {
+        n = read(fd, buf, sizeof buf);
+    } while (n == -1 && errno == EINTR);
+    close(fd);
+
+    if (n != sizeof buf) {
+        return false;
+    }
+    if (byte__get64(&cursor) != UV__FILE_PROBE_CACHE_FORMAT) {
+        return false;
+    }
+    for (i = 0; i < 3; i++) {
+        if (byte__get64(&cursor) != identity[i]) {
+            return false;
+        }
+    }
+    block_size = byte__get64(&cursor);
+    if (block_size < 512 || block_size % 512 != 0) {
+        return false;
+    }
+
+    *size = (size_t)block_size;
+    *async = byte__get64(&cursor) != 0;
+
+    return true;
+}
+
+/* Write the probe cache file of @dir. Errors are ignored, since the file
+ * system will just be probed again next time. */
+static void uv__file_probe_store(const char *dir,
+                                 const uint64_t identity[3],
+                                 size_t size,
+                                 bool async)
+{
+    uint8_t buf[UV__FILE_PROBE_CACHE_SIZE];
+    void *cursor = buf;
+    char *path;
+    ssize_t n;
+    unsigned i;
+    int fd;
+
+    byte__put64(&cursor, UV__FILE_PROBE_CACHE_FORMAT);
+    for (i = 0; i < 3; i++) {
+        byte__put64(&cursor, identity[i]);
+    }
+    byte__put64(&cursor, size);
+    byte__put64(&cursor, async ? 1 : 0);
+
+    path = uv__file_probe_path(dir);
+    if (path == NULL) {
+        return;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    free(path);
+    if (fd == -1) {
+        return;
+    }
+    do {
+        n = write(fd, buf, sizeof buf);
+    } while (n == -1 && errno == EINTR);
+    (void)n;
+    close(fd);
+}
+
+int uv__file_probe(const char *dir, size_t *size, bool *async)
+{
+    uint64_t identity[3];
+    int rv;
+
+    assert(dir != NULL);
+    assert(size != NULL);
+    assert(async != NULL);
+
+    rv = uv__file_probe_identity(dir, identity);
+    if (rv != 0) {
+        return rv;
+    }
+
+    if (uv__file_probe_load(dir, identity, size, async)) {
+        return 0;
+    }
+
+    rv = uv__file_probe_fs(dir, size, async);
+    if (rv != 0) {
+        return rv;
+    }
+
+    uv__file_probe_store(dir, identity, *size, *async);
+
+    return 0;
+}
+
 int uv__file_init(struct uv__file *f, struct uv_loop_s *loop)
 {
+    int fd; /* File descriptor to poll for completed writes */
     int rv;
 
     f->loop = loop;
     f->flags = 0;
     f->fd = -1;
     f->async = true;
+    f->direct = false;
+    f->buffered = false;
+    f->nosync = false;
     f->event_fd = -1;
+    f->uring = false;
+
+#if defined(HAVE_LINUX_IO_URING_H)
+    /* If the kernel supports io_uring, use it: write completions are reaped
+     * directly from the ring, whose file descriptor can be poll'ed, and
+     * submissions never need the threadpool. */
+    if (uring__init(&f->ring, UV__FILE_RING_ENTRIES) == 0) {
+        f->uring = true;
+    }
+#endif
 
-    /* Create an event file descriptor to get notified when a write has
-     * completed. */
-    f->event_fd = eventfd(0, EFD_NONBLOCK);
-    if (f->event_fd < 0) {
-        /* UNTESTED: should fail only with ENOMEM */
-        rv = uv_translate_sys_error(errno);
-        goto err;
+    if (f->uring) {
+#if defined(HAVE_LINUX_IO_URING_H)
+        fd = f->ring.fd;
+#endif
+    } else {
+        /* Create an event file descriptor to get notified when a write has
+         * completed. */
+        f->event_fd = eventfd(0, EFD_NONBLOCK);
+        if (f->event_fd < 0) {
+            /* UNTESTED: should fail only with ENOMEM */
+            rv = uv_translate_sys_error(errno);
+            goto err;
+        }
+        fd = f->event_fd;
     }
 
-    rv = uv_poll_init(f->loop, &f->event_poller, f->event_fd);
+    rv = uv_poll_init(f->loop, &f->event_poller, fd);
     if (rv != 0) {
         /* UNTESTED: with the current libuv implementation this should never
          * fail. */
@@ -346,6 +568,9 @@ int uv__file_init(struct uv__file *f, struct uv_loop_s *loop)
     f->ctx = 0;
     f->events = NULL;
     f->n_events = 0;
+    f->corked = false;
+    f->pending = NULL;
+    f->n_pending = 0;
 
     RAFT__QUEUE_INIT(&f->write_queue);
 
@@ -354,7 +579,14 @@ int uv__file_init(struct uv__file *f, struct uv_loop_s *loop)
     return 0;
 
 err_after_event_fd:
-    close(f->event_fd);
+    if (f->event_fd != -1) {
+        close(f->event_fd);
+    }
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (f->uring) {
+        uring__close(&f->ring);
+    }
+#endif
 
 err:
     assert(rv != 0);
@@ -362,14 +594,16 @@ err:
     return rv;
 }
 
-int uv__file_create(struct uv__file *f,
-                    struct uv__file_create *req,
-                    const char *path,
-                    size_t size,
-                    unsigned max_n_writes,
-                    uv__file_create_cb cb)
+/* Common implementation of uv__file_create() and uv__file_recycle(). */
+static int uv__file_open(struct uv__file *f,
+                         struct uv__file_create *req,
+                         const char *old_path,
+                         const char *path,
+                         size_t size,
+                         unsigned max_n_writes,
+                         uv__file_create_cb cb)
 {
-    int flags = O_WRONLY | O_CREAT | O_EXCL; /* Common open flags */
+    int flags = O_WRONLY; /* Common open flags */
     int rv;
 
     assert(path != NULL);
@@ -380,20 +614,38 @@ int uv__file_create(struct uv__file *f,
 
 #if !defined(RWF_DSYNC)
     /* If per-request synchronous I/O is not supported, open the file with the
-     * sync flag. */
-    flags |= O_DSYNC;
+     * sync flag, unless we can link a sync operation to each write. */
+    if (!f->uring && !f->nosync) {
+        flags |= O_DSYNC;
+    }
 #endif
 
     f->events = NULL; /* We'll allocate this in the create callback */
     f->n_events = max_n_writes;
 
-    /* Try to create a brand new file. */
-    f->fd = open(path, flags, S_IRUSR | S_IWUSR);
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (f->uring && max_n_writes * 2 > f->ring.entries) {
+        rv = UV_EINVAL;
+        goto err;
+    }
+#endif
+
+    /* Try to create a brand new file, or open the one to recycle. */
+    if (old_path == NULL) {
+        f->fd = open(path, flags | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    } else {
+        f->fd = open(old_path, flags);
+    }
     if (f->fd == -1) {
         rv = uv_translate_sys_error(errno);
         goto err;
     }
 
+    /* With io_uring there's no AIO context to setup. */
+    if (f->uring) {
+        goto submit;
+    }
+
     /* Setup the AIO context. */
     rv = io_setup(f->n_events /* Maximum concurrent requests */, &f->ctx);
     if (rv == -1) {
@@ -410,9 +662,19 @@ int uv__file_create(struct uv__file *f,
         goto err_after_io_setup;
     }
 
+    /* Initialize the array of requests submitted by uv__file_uncork(). */
+    f->pending = calloc(f->n_events, sizeof *f->pending);
+    if (f->pending == NULL) {
+        /* UNTESTED: define a configurable allocator that can fail? */
+        rv = UV_ENOMEM;
+        goto err_after_events_alloc;
+    }
+
+submit:
     req->file = f;
     req->cb = cb;
     req->path = path;
+    req->old_path = old_path;
     req->size = size;
     req->status = 0;
     req->work.data = req;
@@ -426,13 +688,17 @@ int uv__file_create(struct uv__file *f,
 
     return 0;
 
+err_after_events_alloc:
+    free(f->events);
+    f->events = NULL;
+
 err_after_io_setup:
     io_destroy(f->ctx);
     f->ctx = 0;
 
 err_after_open:
     close(f->fd);
-    unlink(path);
+    unlink(old_path != NULL ? old_path : path);
     f->fd = -1;
 
 err:
@@ -443,6 +709,80 @@ err:
     return rv;
 }
 
+int uv__file_create(struct uv__file *f,
+                    struct uv__file_create *req,
+                    const char *path,
+                    size_t size,
+                    unsigned max_n_writes,
+                    uv__file_create_cb cb)
+{
+    return uv__file_open(f, req, NULL, path, size, max_n_writes, cb);
+}
+
+int uv__file_recycle(struct uv__file *f,
+                     struct uv__file_create *req,
+                     const char *old_path,
+                     const char *path,
+                     size_t size,
+                     unsigned max_n_writes,
+                     uv__file_create_cb cb)
+{
+    assert(old_path != NULL);
+    return uv__file_open(f, req, old_path, path, size, max_n_writes, cb);
+}
+
+#if defined(HAVE_LINUX_IO_URING_H)
+/* Submit a write request through io_uring. */
+static int uv__file_write_uring(struct uv__file *f,
+                                struct uv__file_write *req,
+                                const uv_buf_t bufs[],
+                                unsigned n,
+                                size_t offset)
+{
+    struct io_uring_sqe *sqe;
+    int rv;
+
+    sqe = uring__get_sqe(&f->ring);
+    assert(sqe != NULL); /* We never exceed the max number of writes */
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = f->fd;
+    sqe->addr = (uint64_t)bufs;
+    sqe->len = n;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)req;
+
+    if (f->nosync) {
+        goto submit;
+    }
+
+#if defined(RWF_DSYNC)
+    /* Use per-request synchronous I/O. */
+    sqe->rw_flags = RWF_DSYNC;
+#else
+    /* Link a data sync operation to the write. The kernel runs it only if the
+     * write succeeds and we're notified once it's done. */
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = uring__get_sqe(&f->ring);
+    assert(sqe != NULL);
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = f->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = (uint64_t)req | UV__FILE_SYNC_TAG;
+#endif
+
+submit:
+    rv = uring__submit(&f->ring);
+    if (rv != 0) {
+        return uv_translate_sys_error(-rv);
+    }
+
+    return 0;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
 int uv__file_write(struct uv__file *f,
                    struct uv__file_write *req,
                    const uv_buf_t bufs[],
@@ -455,16 +795,13 @@ int uv__file_write(struct uv__file *f,
 
     assert(!uv__file_is_closing(f));
 
-    /* TODO: at the moment the io-uv-writer isn't actually supposed to leverage
-     *       the support for concurrent writes, so ensure that we're getting
-     *       write requests sequentially. */
+    /* If the file was created for a single concurrent write, ensure that we're
+     * getting write requests sequentially. */
     if (f->n_events == 1) {
         assert(RAFT__QUEUE_IS_EMPTY(&f->write_queue));
     }
 
     assert(f->fd >= 0);
-    assert(f->event_fd >= 0);
-    assert(f->ctx != 0);
 
     assert(req != NULL);
 
@@ -473,6 +810,22 @@ int uv__file_write(struct uv__file *f,
 
     req->file = f;
     req->cb = cb;
+    req->threadpool = false;
+
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (f->uring) {
+        req->status = 0;
+        RAFT__QUEUE_PUSH(&f->write_queue, &req->queue);
+        rv = uv__file_write_uring(f, req, bufs, n, offset);
+        if (rv != 0) {
+            goto err;
+        }
+        return 0;
+    }
+#endif
+
+    assert(f->event_fd >= 0);
+    assert(f->ctx != 0);
 
     memset(&req->iocb, 0, sizeof req->iocb);
 
@@ -494,7 +847,9 @@ int uv__file_write(struct uv__file *f,
 #if defined(RWF_DSYNC)
     /* Use per-request synchronous I/O if available. Otherwise, we have opened
      * the file with O_DSYNC. */
-    req->iocb.aio_rw_flags |= RWF_DSYNC;
+    if (!f->nosync) {
+        req->iocb.aio_rw_flags |= RWF_DSYNC;
+    }
 #endif
 
 #if defined(RWF_NOWAIT)
@@ -513,6 +868,15 @@ int uv__file_write(struct uv__file *f,
 #endif /* RWF_NOWAIT */
 
 #if defined(RWF_NOWAIT)
+    /* If the file is corked, the request will be submitted along with the
+     * other ones queued in the meantime by uv__file_uncork(). */
+    if (f->async && f->corked) {
+        assert(f->n_pending < f->n_events);
+        f->pending[f->n_pending] = iocbs;
+        f->n_pending++;
+        goto done;
+    }
+
     /* Try to submit the write request asynchronously */
     if (f->async) {
         rv = io_submit(f->ctx, 1, &iocbs);
@@ -546,6 +910,7 @@ int uv__file_write(struct uv__file *f,
 
     /* If we got here it means we need to run io_submit in the threadpool. */
     req->work.data = req;
+    req->threadpool = true;
 
     rv = uv_queue_work(f->loop, &req->work, uv__file_write_work_cb,
                        uv__file_write_after_work_cb);
@@ -565,11 +930,59 @@ err:
     return rv;
 }
 
+void uv__file_cork(struct uv__file *f)
+{
+    assert(!f->corked);
+    f->corked = true;
+}
+
+void uv__file_uncork(struct uv__file *f)
+{
+    unsigned n = 0; /* Number of requests submitted asynchronously */
+    unsigned i;
+    int rv;
+
+    assert(f->corked);
+    f->corked = false;
+
+    if (f->n_pending == 0) {
+        return;
+    }
+
+    rv = io_submit(f->ctx, f->n_pending, f->pending);
+    if (rv >= 0) {
+        n = (unsigned)rv;
+    } else if (errno == EOPNOTSUPP) {
+        f->async = false;
+    }
+
+    /* The requests that could not be submitted without blocking, or that
+     * failed, are run in the threadpool, which reports any error to their
+     * callback. */
+    for (i = n; i < f->n_pending; i++) {
+        struct uv__file_write *req = (void *)f->pending[i]->aio_data;
+        req->iocb.aio_flags &= ~IOCB_FLAG_RESFD;
+        req->iocb.aio_resfd = 0;
+#if defined(RWF_NOWAIT)
+        req->iocb.aio_rw_flags &= ~RWF_NOWAIT;
+#endif
+        req->work.data = req;
+        req->threadpool = true;
+        rv = uv_queue_work(f->loop, &req->work, uv__file_write_work_cb,
+                           uv__file_write_after_work_cb);
+        /* UNTESTED: with the current libuv implementation this can't fail. */
+        assert(rv == 0);
+    }
+
+    f->n_pending = 0;
+}
+
 void uv__file_close(struct uv__file *f, uv__file_close_cb cb)
 {
     int rv;
 
     assert(!uv__file_is_closing(f));
+    assert(f->n_pending == 0);
 
     f->flags |= UV__FILE_CLOSING;
     f->close_cb = cb;
@@ -598,6 +1011,14 @@ static void uv__file_create_work_cb(uv_work_t *work)
 
     assert(f->flags & UV__FILE_CREATING);
 
+    /* If we're recycling a file, zero its content first. */
+    if (req->old_path != NULL) {
+        rv = uv__file_create_work_reuse(f, req->size);
+        if (rv == -1) {
+            goto err;
+        }
+    }
+
     /* Allocate the desired size. */
     rv = posix_fallocate(f->fd, 0, req->size);
     if (rv != 0) {
@@ -610,22 +1031,31 @@ static void uv__file_create_work_cb(uv_work_t *work)
         goto err;
     }
 
-    /* Sync the file and its directory */
+    /* Sync the file and its directory. A recycled file gets its new name only
+     * after its old content is gone for good. */
     rv = fsync(f->fd);
     if (rv == -1) {
         /* UNTESTED: should fail only in case of disk errors */
         goto err;
     }
+    if (req->old_path != NULL) {
+        rv = rename(req->old_path, req->path);
+        if (rv == -1) {
+            goto err;
+        }
+    }
     rv = uv__file_create_work_sync_dir(req->path);
     if (rv == -1) {
         /* UNTESTED: should fail only in case of disk errors */
         goto err;
     }
 
-    /* Set direct I/O if possible. */
-    rv = uv__file_create_work_set_direct_io(f);
-    if (rv == -1) {
-        goto err;
+    /* Set direct I/O if possible and wanted. */
+    if (!f->buffered) {
+        rv = uv__file_create_work_set_direct_io(f);
+        if (rv == -1) {
+            goto err;
+        }
     }
 
     req->status = 0;
@@ -636,6 +1066,37 @@ err:
     req->status = uv_translate_sys_error(errno);
 }
 
+static int uv__file_create_work_reuse(struct uv__file *f, size_t size)
+{
+    int rv;
+
+    rv = ftruncate(f->fd, size);
+    if (rv == -1) {
+        return -1;
+    }
+
+#if defined(FALLOC_FL_ZERO_RANGE)
+    /* Convert the allocated blocks to unwritten extents, which read as
+     * zeros. */
+    rv = fallocate(f->fd, FALLOC_FL_ZERO_RANGE, 0, size);
+    if (rv == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP) {
+        return -1;
+    }
+#endif
+
+    /* The file system can't zero a range in place, let's drop the content
+     * altogether and allocate the blocks again. */
+    rv = ftruncate(f->fd, 0);
+    if (rv == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int uv__file_create_work_sync_dir(const char *path)
 {
     char *dir; /* The directory portion of path */
@@ -668,8 +1129,7 @@ static int uv__file_create_work_sync_dir(const char *path)
 
 static int uv__file_create_work_set_direct_io(struct uv__file *f)
 {
-    int flags;             /* Current fcntl flags */
-    struct statfs fs_info; /* To check the file system type */
+    int flags; /* Current fcntl flags */
     int rv;
 
     flags = fcntl(f->fd, F_GETFL);
@@ -681,24 +1141,12 @@ static int uv__file_create_work_set_direct_io(struct uv__file *f)
             return -1;
         }
 
-        rv = fstatfs(f->fd, &fs_info);
-        if (rv == -1) {
-            /* UNTESTED: in practice ENOMEM should be the only failure mode */
-            return -1;
-        }
-
-        switch (fs_info.f_type) {
-            case 0x01021994: /* TMPFS_MAGIC */
-            case 0x2fc12fc1: /* ZFS magic */
-                /* If director I/O is not supported, then io_submit will be
-                 * blocking. */
-                f->async = false;
-                break;
-            default:
-                /* UNTESTED: this is an unsupported file system. */
-                errno = EINVAL;
-                return -1;
-        }
+        /* The file system does not support direct I/O (e.g. tmpfs or ZFS), so
+         * io_submit would just block: write through the page cache instead. */
+        f->buffered = true;
+        f->async = false;
+    } else {
+        f->direct = true;
     }
 
     return 0;
@@ -727,14 +1175,21 @@ static void uv__file_create_after_work_cb(uv_work_t *work, int status)
 
     /* If no error occurred, start polling the event file descriptor. */
     if (req->status == 0) {
-        rv = uv_poll_start(&f->event_poller, UV_READABLE,
-                           uv__file_write_poll_cb);
+        uv_poll_cb poll_cb = uv__file_write_poll_cb;
+#if defined(HAVE_LINUX_IO_URING_H)
+        if (f->uring) {
+            poll_cb = uv__file_ring_poll_cb;
+        }
+#endif
+        rv = uv_poll_start(&f->event_poller, UV_READABLE, poll_cb);
         if (rv != 0) {
             /* UNTESTED: the underlying libuv calls should never fail. */
             req->status = rv;
 
-            io_destroy(f->ctx);
-            close(f->event_fd);
+            if (f->ctx != 0) {
+                io_destroy(f->ctx);
+                f->ctx = 0;
+            }
             close(f->fd);
             unlink(req->path);
         }
@@ -820,7 +1275,7 @@ static void uv__file_write_poll_cb(uv_poll_t *poller, int status, int events)
                 goto finish;
             }
 
-            return;
+            continue;
         }
 #endif /* RWF_NOWAIT */
 
@@ -838,6 +1293,83 @@ static void uv__file_write_poll_cb(uv_poll_t *poller, int status, int events)
     }
 }
 
+#if defined(HAVE_LINUX_IO_URING_H)
+static void uv__file_ring_poll_cb(uv_poll_t *poller, int status, int events)
+{
+    struct uv__file *f = poller->data; /* File handle */
+    struct io_uring_cqe *cqe;          /* Completion entry */
+
+    assert(f != NULL);
+    assert(f->uring);
+
+    /* TODO: it's not clear when polling could fail. In this case we should
+     * probably mark all pending requests as failed. */
+    assert(status == 0);
+
+    assert(events & UV_READABLE);
+
+    /* Reap all available completions, without any syscall. */
+    while ((cqe = uring__peek_cqe(&f->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        struct uv__file_write *req;
+
+        uring__cqe_seen(&f->ring);
+
+        req = (void *)(uintptr_t)(data & ~(uint64_t)UV__FILE_SYNC_TAG);
+
+#if defined(RWF_DSYNC)
+        req->status = res;
+#else
+        /* Wait for the sync operation linked to the write. If the write
+         * failed, the sync gets canceled and we report the write error. */
+        if ((data & UV__FILE_SYNC_TAG) == 0) {
+            req->status = res;
+            if (!f->nosync) {
+                continue;
+            }
+        }
+        if (req->status >= 0 && res < 0) {
+            req->status = res;
+        }
+#endif
+
+        /* If we are closing, we mark the write as canceled, although
+         * technically it might have worked. */
+        if (uv__file_is_closing(f)) {
+            req->status = UV_ECANCELED;
+        }
+
+        uv__file_write_finish(req);
+    }
+
+    /* If we've been closed, let's see if we can stop the poller and fire the
+     * close callback. */
+    if (uv__file_is_closing(f)) {
+        uv__file_maybe_closed(f);
+    }
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Write the data of the given request through the page cache and flush it
+ * with a single fdatasync() call, as a fallback for file systems without
+ * direct I/O. Called in a thread. */
+static void uv__file_write_work_buffered(struct uv__file_write *req)
+{
+    struct iocb *iocb = &req->iocb;
+    ssize_t n;
+
+    n = pwritev((int)iocb->aio_fildes, (const struct iovec *)iocb->aio_buf,
+                (int)iocb->aio_nbytes, (off_t)iocb->aio_offset);
+    if (n == -1 ||
+        (!req->file->nosync && fdatasync((int)iocb->aio_fildes) == -1)) {
+        req->status = uv_translate_sys_error(errno);
+        return;
+    }
+
+    req->status = (int)n;
+}
+
 static void uv__file_write_work_cb(uv_work_t *work)
 {
     struct uv__file_write *req; /* Write file request object */
@@ -858,6 +1390,11 @@ static void uv__file_write_work_cb(uv_work_t *work)
         goto out;
     }
 
+    if (req->file->buffered) {
+        uv__file_write_work_buffered(req);
+        return;
+    }
+
     iocbs = &req->iocb;
 
     /* Perform the request using a dedicated context, to avoid synchronization
@@ -960,15 +1497,24 @@ static void uv__file_poll_close_cb(struct uv_handle_s *handle)
     assert((f->flags & UV__FILE_CLOSED) == 0);
     assert(RAFT__QUEUE_IS_EMPTY(&f->write_queue));
 
-    rv = close(f->event_fd);
-    assert(rv == 0);
+    if (f->event_fd != -1) {
+        rv = close(f->event_fd);
+        assert(rv == 0);
+    }
 
     if (f->ctx != 0) {
         rv = io_destroy(f->ctx);
         assert(rv == 0);
     }
 
+#if defined(HAVE_LINUX_IO_URING_H)
+    if (f->uring) {
+        uring__close(&f->ring);
+    }
+#endif
+
     free(f->events);
+    free(f->pending);
 
     f->flags |= UV__FILE_CLOSED;
 
@@ -1,6 +1,6 @@
 /**
  * Create and write files asynchronously, using libuv on top of Linux AIO (aka
- * KAIO).
+ * KAIO), or on top of io_uring if the kernel supports it.
  */
 
 #ifndef RAFT_UV_FILE_H_
@@ -12,6 +12,7 @@
 #include <uv.h>
 
 #include "queue.h"
+#include "uring.h"
 
 /**
  * Handle to an open file.
@@ -44,11 +45,24 @@ typedef void (*uv__file_write_cb)(struct uv__file_write *req, int status);
  */
 typedef void (*uv__file_close_cb)(struct uv__file *f);
 
+/**
+ * Name of the file where uv__file_probe() caches its results.
+ */
+#define UV__FILE_PROBE_CACHE ".disk-probe"
+
 /**
  * Get the logical block size of the file system rooted at @dir.
  */
 int uv__file_block_size(const char *dir, size_t *size);
 
+/**
+ * Like uv__file_block_size(), but also report in @async whether the file system
+ * supports fully asynchronous writes. Since probing can be slow, the result is
+ * cached in @dir and reused as long as the file system rooted at @dir has the
+ * same identity.
+ */
+int uv__file_probe(const char *dir, size_t *size, bool *async);
+
 /**
  * Initialize a file handle.
  */
@@ -65,6 +79,20 @@ int uv__file_create(struct uv__file *f,
                     unsigned max_concurrent_writes,
                     uv__file_create_cb cb);
 
+/**
+ * Like uv__file_create(), but reuse the existing file at @old_path, which gets
+ * renamed to @path once its content has been zeroed. If the file system
+ * supports it, the blocks already allocated to the file are retained, avoiding
+ * to allocate new ones.
+ */
+int uv__file_recycle(struct uv__file *f,
+                     struct uv__file_create *req,
+                     const char *old_path,
+                     const char *path,
+                     size_t size,
+                     unsigned max_concurrent_writes,
+                     uv__file_create_cb cb);
+
 /**
  * Asynchronously write data to the file associated with the given handle.
  */
@@ -75,6 +103,18 @@ int uv__file_write(struct uv__file *f,
                    size_t offset,
                    uv__file_write_cb cb);
 
+/**
+ * Hold back the write requests that can be submitted asynchronously until
+ * uv__file_uncork() is called, so they are submitted with a single io_submit()
+ * call.
+ */
+void uv__file_cork(struct uv__file *f);
+
+/**
+ * Submit all write requests queued since uv__file_cork() was called.
+ */
+void uv__file_uncork(struct uv__file *f);
+
 /**
  * Close the given file and release all associated resources. There must be no
  * request in progress.
@@ -93,11 +133,21 @@ struct uv__file
     int flags;                     /* State flags */
     int fd;                        /* Operating system file descriptor */
     bool async;                    /* Whether fully async I/O is supported */
+    bool direct;                   /* Whether O_DIRECT is set */
+    bool buffered;                 /* Whether to write via the page cache */
+    bool nosync;                   /* Whether writes skip the data sync */
     int event_fd;                  /* Poll'ed to check if write is finished */
     struct uv_poll_s event_poller; /* To make the loop poll for event_fd */
     aio_context_t ctx;             /* KAIO handle */
     struct io_event *events;       /* Array of KAIO response objects */
     unsigned n_events;             /* Length of the events array */
+    bool corked;                   /* Whether writes are being held back */
+    struct iocb **pending;         /* Writes held back by uv__file_cork() */
+    unsigned n_pending;            /* Length of the pending array */
+    bool uring;                    /* Whether writes go through io_uring */
+#if defined(HAVE_LINUX_IO_URING_H)
+    struct uring ring;             /* io_uring instance, poll'ed for writes */
+#endif
     raft__queue write_queue;       /* Queue of inflight write requests */
     uv__file_close_cb close_cb;    /* Close callback */
 };
@@ -110,6 +160,7 @@ struct uv__file_create
     struct uv_work_s work; /* To execute logic in the threadpool */
     uv__file_create_cb cb; /* Callback to invoke upon request completion */
     const char *path;      /* File path */
+    const char *old_path;  /* Path of the file to recycle, if any */
     size_t size;           /* File size */
 };
 
@@ -121,6 +172,7 @@ struct uv__file_write
     struct uv_work_s work; /* To execute logic in the threadpool */
     uv__file_write_cb cb;  /* Callback to invoke upon request completion */
     struct iocb iocb;      /* KAIO request (for writing) */
+    bool threadpool;       /* Whether io_submit ran in the threadpool */
     raft__queue queue;     /* Prev/next links in the inflight queue */
 };
 
@@ -1,13 +1,12 @@
 #include <assert.h>
 
+#include "io.h"
 #include "watch.h"
 
 void raft_watch(struct raft *r, int event, void (*cb)(void *, int, void *))
 {
     assert(r != NULL);
-    assert(event == RAFT_EVENT_STATE_CHANGE ||
-           event == RAFT_EVENT_COMMAND_APPLIED ||
-           event == RAFT_EVENT_CONFIGURATION_APPLIED);
+    assert(event >= 0 && event < RAFT_EVENT_N);
     assert(cb != NULL);
 
     r->watchers[event] = cb;
@@ -57,3 +56,59 @@ void raft_watch__promotion_aborted(struct raft *r, const unsigned id)
 
     raft_watch__fire(r, RAFT_EVENT_PROMOTION_ABORTED, (void*)(&id));
 }
+
+void raft_watch__pressure_relieved(struct raft *r, const size_t bytes)
+{
+    assert(r != NULL);
+    raft_watch__fire(r, RAFT_EVENT_PRESSURE_RELIEVED, (void*)(&bytes));
+}
+
+void raft_watch__commit_advanced(struct raft *r, const raft_index index)
+{
+    assert(r != NULL);
+    assert(index > 0);
+
+    raft_watch__fire(r, RAFT_EVENT_COMMIT_ADVANCED, (void*)(&index));
+}
+
+void raft_watch__range_applied(struct raft *r,
+                               const raft_index first,
+                               const raft_index last)
+{
+    struct raft_applied_range range;
+
+    assert(r != NULL);
+    assert(first > 0);
+    assert(first <= last);
+
+    range.first = first;
+    range.last = last;
+    raft_watch__fire(r, RAFT_EVENT_RANGE_APPLIED, &range);
+}
+
+void raft_watch__lifecycle(struct raft *r,
+                           int event,
+                           unsigned server_id,
+                           raft_index index,
+                           raft_time start,
+                           size_t bytes,
+                           int status)
+{
+    struct raft_lifecycle_event info;
+    raft_time now;
+
+    assert(r != NULL);
+
+    if (r->watchers[event] == NULL) {
+        return;
+    }
+
+    now = io__time(r->io);
+
+    info.server_id = server_id;
+    info.index = index;
+    info.duration = now > start ? now - start : 0;
+    info.bytes = bytes;
+    info.status = status;
+    raft_watch__fire(r, event, &info);
+}
@@ -27,4 +27,33 @@ void raft_watch__configuration_applied(struct raft *r);
  */
 void raft_watch__promotion_aborted(struct raft *r, const unsigned id);
 
+/**
+ * Fire a #RAFT_EVENT_PRESSURE_RELIEVED.
+ */
+void raft_watch__pressure_relieved(struct raft *r, const size_t bytes);
+
+/**
+ * Fire a #RAFT_EVENT_COMMIT_ADVANCED.
+ */
+void raft_watch__commit_advanced(struct raft *r, const raft_index index);
+
+/**
+ * Fire a #RAFT_EVENT_RANGE_APPLIED.
+ */
+void raft_watch__range_applied(struct raft *r,
+                               const raft_index first,
+                               const raft_index last);
+
+/**
+ * Fire one of the events carrying a @raft_lifecycle_event, for an operation
+ * started at time @start.
+ */
+void raft_watch__lifecycle(struct raft *r,
+                           int event,
+                           unsigned server_id,
+                           raft_index index,
+                           raft_time start,
+                           size_t bytes,
+                           int status);
+
 #endif /* RAFT_WATCH_H */
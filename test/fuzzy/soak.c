@@ -0,0 +1,522 @@
+/**
+ * Run the fuzzy test scenarios across many seeds in parallel.
+ *
+ * Each run executes a single scenario (i.e. a test case with a combination of
+ * its parameters) with a given seed in a forked child process, so failed
+ * assertions and crashes only affect that run. Runs are spread across a number
+ * of concurrent jobs, and their outcome and duration are aggregated per
+ * scenario. A run with a given seed can be reproduced with the fuzzy-test
+ * program, since the simulation is fully determined by the munit seed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/runner.h"
+
+MunitSuite _main_suites[64];
+int _main_suites_n = 0;
+
+/* Maximum number of scenarios and of parameters of a single scenario. */
+#define MAX_SCENARIOS 256
+#define MAX_PARAMS 4
+
+/* Maximum length of the full name of a test case. */
+#define MAX_NAME 128
+
+/* Default number of seeds and run timeout, in seconds. */
+#define DEFAULT_SEEDS 100
+#define DEFAULT_TIMEOUT 60
+
+/* Exit code of a child whose test was skipped. */
+#define EXIT_SKIP 77
+
+/* Outcome of a single run. */
+enum { RUN_OK = 0, RUN_SKIP, RUN_FAIL, RUN_CRASH, RUN_TIMEOUT, RUN_N };
+
+static const char *outcome_names[RUN_N] = {"ok", "skip", "fail", "crash",
+                                           "timeout"};
+
+/* A test case with a certain combination of parameters, along with the
+ * statistics of its runs. */
+struct scenario
+{
+    char name[MAX_NAME];
+    const MunitTest *test;
+    MunitParameter params[MAX_PARAMS + 1];
+    unsigned counts[RUN_N];    /* Number of runs by outcome */
+    double *durations;         /* Duration of each run, in milliseconds */
+    unsigned n_durations;      /* Number of completed runs */
+    bool failed;               /* Whether any run failed, crashed or hung */
+    munit_uint32_t first_seed; /* Lowest seed of a failed run */
+};
+
+/* A run executing in a child process. */
+struct run
+{
+    pid_t pid;
+    struct scenario *scenario;
+    munit_uint32_t seed;
+    struct timespec start;
+};
+
+struct options
+{
+    unsigned jobs;
+    unsigned seeds;
+    munit_uint32_t seed;
+    unsigned timeout;
+    bool verbose;
+    char **filters;
+    unsigned n_filters;
+};
+
+static struct scenario scenarios[MAX_SCENARIOS];
+static unsigned n_scenarios = 0;
+
+static bool matches(const struct options *o, const char *name)
+{
+    unsigned i;
+    if (o->n_filters == 0) {
+        return true;
+    }
+    for (i = 0; i < o->n_filters; i++) {
+        if (strncmp(name, o->filters[i], strlen(o->filters[i])) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Add one scenario for each combination of values of the parameters of the
+ * given test, starting from the @i'th parameter. */
+static void add_scenarios(const struct options *o,
+                          const char *name,
+                          const MunitTest *test,
+                          MunitParameter params[],
+                          unsigned i)
+{
+    struct scenario *s;
+    MunitParameterEnum *param;
+    char **value;
+
+    param = test->parameters != NULL ? &test->parameters[i] : NULL;
+    if (param != NULL && param->name != NULL) {
+        if (i == MAX_PARAMS) {
+            fprintf(stderr, "error: %s: too many parameters\n", name);
+            exit(EXIT_FAILURE);
+        }
+        for (value = param->values; *value != NULL; value++) {
+            params[i].name = param->name;
+            params[i].value = *value;
+            add_scenarios(o, name, test, params, i + 1);
+        }
+        return;
+    }
+
+    if (n_scenarios == MAX_SCENARIOS) {
+        fprintf(stderr, "error: too many scenarios\n");
+        exit(EXIT_FAILURE);
+    }
+    s = &scenarios[n_scenarios++];
+    memset(s, 0, sizeof *s);
+    strcpy(s->name, name);
+    s->test = test;
+    memcpy(s->params, params, i * sizeof *params);
+    s->params[i].name = NULL;
+    s->params[i].value = NULL;
+}
+
+/* Collect the scenarios of all test cases in the given suite and its
+ * children whose name matches the filters. */
+static void collect(const struct options *o,
+                    const MunitSuite *suite,
+                    const char *prefix)
+{
+    MunitParameter params[MAX_PARAMS + 1];
+    char name[MAX_NAME];
+    const MunitTest *test;
+    const MunitSuite *child;
+
+    snprintf(name, sizeof name, "%s%s", prefix,
+             suite->prefix != NULL ? suite->prefix : "");
+    prefix = name;
+
+    for (test = suite->tests; test != NULL && test->name != NULL; test++) {
+        char full[MAX_NAME];
+        snprintf(full, sizeof full, "%s%s", prefix, test->name);
+        if (matches(o, full)) {
+            add_scenarios(o, full, test, params, 0);
+        }
+    }
+
+    for (child = suite->suites; child != NULL && child->prefix != NULL;
+         child++) {
+        collect(o, child, prefix);
+    }
+}
+
+/* Execute a single run in the current process, which is a child. */
+static void execute(const struct options *o,
+                    const struct scenario *s,
+                    munit_uint32_t seed)
+{
+    const MunitTest *test = s->test;
+    MunitResult result;
+    void *data = (void *)"fuzzy";
+
+    if (!o->verbose) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+    }
+
+    /* A timed out run is killed by SIGALRM. */
+    alarm(o->timeout);
+
+    munit_rand_seed(seed);
+    if (test->setup != NULL) {
+        data = test->setup(s->params, data);
+    }
+    result = test->test(s->params, data);
+    if (test->tear_down != NULL) {
+        test->tear_down(data);
+    }
+
+    switch (result) {
+        case MUNIT_OK:
+            _exit(EXIT_SUCCESS);
+        case MUNIT_SKIP:
+            _exit(EXIT_SKIP);
+        default:
+            _exit(EXIT_FAILURE);
+    }
+}
+
+static int start(const struct options *o,
+                 struct run *run,
+                 struct scenario *s,
+                 munit_uint32_t seed)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        execute(o, s, seed);
+    }
+
+    run->pid = pid;
+    run->scenario = s;
+    run->seed = seed;
+    clock_gettime(CLOCK_MONOTONIC, &run->start);
+
+    return 0;
+}
+
+static int outcome_of(int status)
+{
+    if (WIFEXITED(status)) {
+        switch (WEXITSTATUS(status)) {
+            case EXIT_SUCCESS:
+                return RUN_OK;
+            case EXIT_SKIP:
+                return RUN_SKIP;
+            default:
+                return RUN_FAIL;
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        switch (WTERMSIG(status)) {
+            case SIGALRM:
+                return RUN_TIMEOUT;
+            case SIGABRT:
+                /* Failed munit assertions abort, since there's no munit
+                 * runner to jump back to. */
+                return RUN_FAIL;
+            default:
+                return RUN_CRASH;
+        }
+    }
+    return RUN_CRASH;
+}
+
+static void finish(const struct options *o, struct run *run, int status)
+{
+    struct scenario *s = run->scenario;
+    struct timespec end;
+    int outcome = outcome_of(status);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    s->counts[outcome]++;
+    s->durations[s->n_durations++] =
+        (double)(end.tv_sec - run->start.tv_sec) * 1000 +
+        (double)(end.tv_nsec - run->start.tv_nsec) / 1000000;
+
+    if (outcome == RUN_FAIL || outcome == RUN_CRASH ||
+        outcome == RUN_TIMEOUT) {
+        if (!s->failed || run->seed < s->first_seed) {
+            s->first_seed = run->seed;
+        }
+        s->failed = true;
+        if (o->verbose) {
+            fprintf(stderr, "%s: seed 0x%08x: %s\n", s->name, run->seed,
+                    outcome_names[outcome]);
+        }
+    }
+}
+
+static int compare_doubles(const void *p1, const void *p2)
+{
+    double d1 = *(const double *)p1;
+    double d2 = *(const double *)p2;
+    return d1 < d2 ? -1 : d1 > d2;
+}
+
+static double percentile(const double *values, unsigned n, double p)
+{
+    unsigned i;
+    if (n == 0) {
+        return 0;
+    }
+    i = (unsigned)(p * (n - 1) + 0.5);
+    return values[i];
+}
+
+/* Print the statistics of all scenarios, returning the number of failed
+ * ones. */
+static unsigned report(void)
+{
+    unsigned n_failed = 0;
+    unsigned i;
+
+    printf("%-48s %6s %6s %6s %6s %9s %9s %9s\n", "scenario", "runs", "ok",
+           "fail", "hung", "p50 ms", "p99 ms", "max ms");
+
+    for (i = 0; i < n_scenarios; i++) {
+        struct scenario *s = &scenarios[i];
+        char name[MAX_NAME + 32];
+        unsigned j;
+        int k;
+
+        k = snprintf(name, sizeof name, "%s", s->name);
+        for (j = 0; s->params[j].name != NULL; j++) {
+            k += snprintf(name + k, sizeof name - (size_t)k, " %s=%s",
+                          s->params[j].name, s->params[j].value);
+        }
+
+        qsort(s->durations, s->n_durations, sizeof *s->durations,
+              compare_doubles);
+
+        printf("%-48s %6u %6u %6u %6u %9.1f %9.1f %9.1f\n", name,
+               s->n_durations, s->counts[RUN_OK] + s->counts[RUN_SKIP],
+               s->counts[RUN_FAIL] + s->counts[RUN_CRASH],
+               s->counts[RUN_TIMEOUT],
+               percentile(s->durations, s->n_durations, 0.5),
+               percentile(s->durations, s->n_durations, 0.99),
+               percentile(s->durations, s->n_durations, 1));
+
+        if (s->failed) {
+            n_failed++;
+        }
+    }
+
+    /* Print how to reproduce the first failed run of each scenario. */
+    for (i = 0; i < n_scenarios; i++) {
+        struct scenario *s = &scenarios[i];
+        unsigned j;
+        if (!s->failed) {
+            continue;
+        }
+        printf("\nreproduce: ./fuzzy-test %s --seed 0x%08x", s->name,
+               s->first_seed);
+        for (j = 0; s->params[j].name != NULL; j++) {
+            printf(" --param %s %s", s->params[j].name, s->params[j].value);
+        }
+    }
+    if (n_failed > 0) {
+        printf("\n");
+    }
+
+    return n_failed;
+}
+
+static void usage(void)
+{
+    printf("usage: fuzzy-soak [options] [TEST...]\n\n");
+    printf("Run the fuzzy test scenarios whose name starts with any of the\n");
+    printf("given prefixes, or all of them, once for each seed.\n\n");
+    printf("  -j, --jobs=N       number of concurrent runs (number of CPUs)\n");
+    printf("  -n, --seeds=N      number of seeds per scenario (%u)\n",
+           DEFAULT_SEEDS);
+    printf("  -s, --seed=SEED    first seed, incremented for each run (0)\n");
+    printf("  -t, --timeout=SECS kill runs lasting longer than this, or\n");
+    printf("                     never if zero (%u)\n", DEFAULT_TIMEOUT);
+    printf("  -v, --verbose      show the output of runs and their failures\n");
+}
+
+static int parse_unsigned(const char *s, unsigned *value)
+{
+    char *end;
+    unsigned long n;
+    errno = 0;
+    n = strtoul(s, &end, 0);
+    if (errno != 0 || *end != '\0' || n > (unsigned)-1) {
+        return -1;
+    }
+    *value = (unsigned)n;
+    return 0;
+}
+
+static int parse_options(int argc, char *argv[], struct options *o)
+{
+    static struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"seeds", required_argument, NULL, 'n'},
+        {"seed", required_argument, NULL, 's'},
+        {"timeout", required_argument, NULL, 't'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned seed = 0;
+    int c;
+
+    o->jobs = n_cpus > 0 ? (unsigned)n_cpus : 1;
+    o->seeds = DEFAULT_SEEDS;
+    o->timeout = DEFAULT_TIMEOUT;
+    o->verbose = false;
+
+    while ((c = getopt_long(argc, argv, "j:n:s:t:vh", long_options, NULL)) !=
+           -1) {
+        switch (c) {
+            case 'j':
+                if (parse_unsigned(optarg, &o->jobs) != 0 || o->jobs == 0) {
+                    goto err;
+                }
+                break;
+            case 'n':
+                if (parse_unsigned(optarg, &o->seeds) != 0 || o->seeds == 0) {
+                    goto err;
+                }
+                break;
+            case 's':
+                if (parse_unsigned(optarg, &seed) != 0) {
+                    goto err;
+                }
+                break;
+            case 't':
+                if (parse_unsigned(optarg, &o->timeout) != 0) {
+                    goto err;
+                }
+                break;
+            case 'v':
+                o->verbose = true;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                goto err;
+        }
+    }
+
+    o->seed = seed;
+    o->filters = &argv[optind];
+    o->n_filters = (unsigned)(argc - optind);
+
+    return 0;
+
+err:
+    usage();
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    MunitSuite suite = {(char *)"", NULL, _main_suites, 1, 0};
+    struct options o;
+    struct run *runs;
+    unsigned n_running = 0;
+    unsigned next = 0; /* Index of the next run to start */
+    unsigned total;
+    unsigned i;
+
+    if (parse_options(argc, argv, &o) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    collect(&o, &suite, "");
+    if (n_scenarios == 0) {
+        fprintf(stderr, "error: no matching test\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < n_scenarios; i++) {
+        scenarios[i].durations = malloc(o.seeds * sizeof(double));
+        munit_assert_ptr_not_null(scenarios[i].durations);
+    }
+    runs = calloc(o.jobs, sizeof *runs);
+    munit_assert_ptr_not_null(runs);
+
+    /* Iterate seeds in the outer loop, so that all scenarios make progress
+     * at the same pace. */
+    total = n_scenarios * o.seeds;
+    while (next < total || n_running > 0) {
+        int status;
+        pid_t pid;
+
+        while (next < total && n_running < o.jobs) {
+            struct scenario *s = &scenarios[next % n_scenarios];
+            munit_uint32_t seed = o.seed + next / n_scenarios;
+            for (i = 0; runs[i].pid != 0; i++) {
+            }
+            if (start(&o, &runs[i], s, seed) != 0) {
+                return EXIT_FAILURE;
+            }
+            n_running++;
+            next++;
+        }
+
+        pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            perror("waitpid");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < o.jobs; i++) {
+            if (runs[i].pid == pid) {
+                finish(&o, &runs[i], status);
+                runs[i].pid = 0;
+                n_running--;
+                break;
+            }
+        }
+    }
+
+    i = report();
+
+    for (next = 0; next < n_scenarios; next++) {
+        free(scenarios[next].durations);
+    }
+    free(runs);
+
+    return i == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
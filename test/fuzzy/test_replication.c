@@ -177,3 +177,68 @@ TEST_CASE(entries, partitioned, params)
 
     return MUNIT_OK;
 }
+
+/******************************************************************************
+ *
+ * Witness
+ *
+ *****************************************************************************/
+
+/* The third server of a three servers cluster is a witness. */
+#define WITNESS 2
+
+static void *setup_witness(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    struct raft_configuration configuration;
+    int rc;
+    (void)params;
+    (void)user_data;
+    SETUP_CLUSTER(3);
+    CLUSTER_CONFIGURATION(&configuration);
+    configuration.servers[WITNESS].witness = true;
+    rc = raft_fixture_bootstrap(&f->cluster, &configuration);
+    munit_assert_int(rc, ==, 0);
+    raft_configuration_close(&configuration);
+    CLUSTER_START;
+    CLUSTER_STEP_UNTIL_HAS_LEADER(10000);
+    return f;
+}
+
+TEST_SUITE(witness);
+TEST_SETUP(witness, setup_witness);
+TEST_TEAR_DOWN(witness, tear_down);
+
+/* Entries get committed with the vote of the witness, which never applies
+ * them to its FSM and never becomes leader. */
+TEST_CASE(witness, tiebreak, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply *req1 = munit_malloc(sizeof *req1);
+    struct raft_apply *req2 = munit_malloc(sizeof *req2);
+
+    (void)params;
+
+    munit_assert_int(CLUSTER_LEADER, !=, WITNESS);
+
+    APPLY_ADD_ONE(req1);
+    CLUSTER_STEP_UNTIL_APPLIED(CLUSTER_N, 2, 2000);
+    munit_assert_int(test_fsm_get_x(CLUSTER_FSM(WITNESS)), ==, 0);
+
+    /* The other data server takes over, with the vote of the witness. */
+    CLUSTER_KILL_LEADER;
+    CLUSTER_STEP_UNTIL_HAS_NO_LEADER(10000);
+    CLUSTER_STEP_UNTIL_HAS_LEADER(10000);
+    munit_assert_int(CLUSTER_LEADER, !=, WITNESS);
+
+    APPLY_ADD_ONE(req2);
+    CLUSTER_STEP_UNTIL_APPLIED(CLUSTER_LEADER, 3, 2000);
+    CLUSTER_STEP_UNTIL_APPLIED(WITNESS, 3, 2000);
+    munit_assert_int(test_fsm_get_x(CLUSTER_FSM(CLUSTER_LEADER)), ==, 2);
+    munit_assert_int(test_fsm_get_x(CLUSTER_FSM(WITNESS)), ==, 0);
+
+    free(req1);
+    free(req2);
+
+    return MUNIT_OK;
+}
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "../../src/aio.h"
+#include "../../src/uring.h"
 
 #include "fs.h"
 
@@ -373,3 +374,17 @@ void test_aio_destroy(aio_context_t ctx)
     rv = io_destroy(ctx);
     munit_assert_int(rv, ==, 0);
 }
+
+bool test_uring_supported(void)
+{
+#if defined(HAVE_LINUX_IO_URING_H)
+    struct uring ring;
+    if (uring__init(&ring, 1) != 0) {
+        return false;
+    }
+    uring__close(&ring);
+    return true;
+#else
+    return false;
+#endif
+}
@@ -167,4 +167,10 @@ void test_aio_fill(aio_context_t *ctx, unsigned n);
  */
 void test_aio_destroy(aio_context_t ctx);
 
+/**
+ * Return #true if the kernel supports io_uring, in which case file writes
+ * don't use the AIO subsystem.
+ */
+bool test_uring_supported(void);
+
 #endif /* TEST_IO_H */
@@ -8,6 +8,9 @@ struct test_fsm
 {
     int x;
     int y;
+    int snapshot_x; /* Values of x and y when the last snapshot started */
+    int snapshot_y;
+    uint8_t restore[sizeof(uint64_t) * 2]; /* Chunks being restored */
 };
 
 /* Command codes */
@@ -96,9 +99,101 @@ static int test_fsm__snapshot(struct raft_fsm *fsm,
                               unsigned *n_bufs)
 {
     struct test_fsm *t = fsm->data;
+    t->snapshot_x = t->x;
+    t->snapshot_y = t->y;
     return encode_snapshot(t->x, t->y, bufs, n_bufs);
 }
 
+/* Emit a patch for each of x and y that changed since the last snapshot. */
+static int test_fsm__snapshot_patch(struct raft_fsm *fsm,
+                                    struct raft_snapshot_patch *patches[],
+                                    unsigned *n_patches,
+                                    size_t *size)
+{
+    struct test_fsm *t = fsm->data;
+    int values[2] = {t->x, t->y};
+    int last[2] = {t->snapshot_x, t->snapshot_y};
+    struct raft_snapshot_patch *patch;
+    void *cursor;
+    unsigned i;
+
+    *patches = raft_malloc(sizeof **patches * 2);
+    if (*patches == NULL) {
+        return RAFT_ENOMEM;
+    }
+    *n_patches = 0;
+    *size = sizeof(uint64_t) * 2;
+
+    for (i = 0; i < 2; i++) {
+        if (values[i] == last[i]) {
+            continue;
+        }
+        patch = &(*patches)[*n_patches];
+        patch->offset = sizeof(uint64_t) * i;
+        patch->buf.len = sizeof(uint64_t);
+        patch->buf.base = raft_malloc(patch->buf.len);
+        munit_assert_ptr_not_null(patch->buf.base);
+        cursor = patch->buf.base;
+        byte__put64(&cursor, values[i]);
+        (*n_patches)++;
+    }
+
+    t->snapshot_x = t->x;
+    t->snapshot_y = t->y;
+
+    return 0;
+}
+
+/* Serialize the snapshot in two chunks, one for x and one for y. */
+static int test_fsm__snapshot_chunk(struct raft_fsm *fsm,
+                                    size_t offset,
+                                    struct raft_buffer *buf,
+                                    bool *done)
+{
+    struct test_fsm *t = fsm->data;
+    void *cursor;
+
+    if (offset == 0) {
+        t->snapshot_x = t->x;
+        t->snapshot_y = t->y;
+    }
+
+    buf->len = sizeof(uint64_t);
+    buf->base = raft_malloc(buf->len);
+    if (buf->base == NULL) {
+        return RAFT_ENOMEM;
+    }
+
+    cursor = buf->base;
+    byte__put64(&cursor, offset == 0 ? t->snapshot_x : t->snapshot_y);
+
+    *done = offset > 0;
+
+    return 0;
+}
+
+/* Accumulate the restored chunks and decode them at the end. */
+static int test_fsm__restore_chunk(struct raft_fsm *fsm,
+                                   size_t offset,
+                                   struct raft_buffer *buf,
+                                   bool done)
+{
+    struct test_fsm *t = fsm->data;
+    const void *cursor = t->restore;
+
+    munit_assert_int(offset + buf->len, <=, sizeof t->restore);
+    memcpy(t->restore + offset, buf->base, buf->len);
+    raft_free(buf->base);
+
+    if (done) {
+        munit_assert_int(offset + buf->len, ==, sizeof t->restore);
+        t->x = byte__get64(&cursor);
+        t->y = byte__get64(&cursor);
+    }
+
+    return 0;
+}
+
 void test_fsm_setup(const MunitParameter params[], struct raft_fsm *fsm)
 {
     struct test_fsm *t = munit_malloc(sizeof *fsm);
@@ -107,12 +202,24 @@ void test_fsm_setup(const MunitParameter params[], struct raft_fsm *fsm)
 
     t->x = 0;
     t->y = 0;
+    t->snapshot_x = 0;
+    t->snapshot_y = 0;
 
-    fsm->version = 1;
+    fsm->version = 3;
     fsm->data = t;
     fsm->apply = test_fsm__apply;
     fsm->snapshot = test_fsm__snapshot;
     fsm->restore = test_fsm__restore;
+    fsm->apply_batch = NULL;
+    fsm->apply_async = NULL;
+    fsm->snapshot_async = NULL;
+    fsm->applied = NULL;
+    fsm->partition = NULL;
+
+    /* Chunked and patched snapshots are opt-in, by bumping the version. */
+    fsm->snapshot_chunk = test_fsm__snapshot_chunk;
+    fsm->restore_chunk = test_fsm__restore_chunk;
+    fsm->snapshot_patch = test_fsm__snapshot_patch;
 }
 
 void test_fsm_tear_down(struct raft_fsm *fsm)
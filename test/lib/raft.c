@@ -106,13 +106,13 @@ void test_become_candidate(struct raft *r)
     raft_io_stub_flush_all(r->io);
 }
 
-void test_become_leader(struct raft *r)
+/* Deliver enough granted votes to win the current election round. */
+static void deliver_votes(struct raft *r)
 {
     size_t votes = configuration__n_voting(&r->configuration) / 2;
+    bool pre_vote = r->candidate_state.in_pre_vote;
     size_t i;
 
-    test_become_candidate(r);
-
     for (i = 0; i < r->configuration.n; i++) {
         const struct raft_server *server = &r->configuration.servers[i];
         struct raft_message message;
@@ -126,6 +126,7 @@ void test_become_leader(struct raft *r)
         message.server_address = server->address;
         message.request_vote_result.term = r->current_term;
         message.request_vote_result.vote_granted = 1;
+        message.request_vote_result.pre_vote = pre_vote;
 
         raft_io_stub_deliver(r->io, &message);
 
@@ -138,6 +139,21 @@ void test_become_leader(struct raft *r)
     if (votes > 0) {
         munit_error("could not get all required votes");
     }
+}
+
+void test_become_leader(struct raft *r)
+{
+    test_become_candidate(r);
+
+    /* If pre-vote is enabled, win that round first. */
+    if (r->candidate_state.in_pre_vote) {
+        deliver_votes(r);
+        munit_assert_int(r->state, ==, RAFT_CANDIDATE);
+        munit_assert_false(r->candidate_state.in_pre_vote);
+        raft_io_stub_flush_all(r->io);
+    }
+
+    deliver_votes(r);
 
     munit_assert_int(r->state, ==, RAFT_LEADER);
 
@@ -166,6 +182,8 @@ void test_receive_heartbeat(struct raft *r, unsigned leader_id)
     args->entries = NULL;
     args->n_entries = 0;
     args->leader_commit = r->commit_index;
+    args->hibernate = false;
+    args->seq = 0;
 
     raft_io_stub_deliver(r->io, &message);
     raft_io_stub_flush_all(r->io);
@@ -0,0 +1,69 @@
+#include "../../include/raft.h"
+#include "../../src/byte.h"
+
+#include "micro.h"
+
+struct byte_bench
+{
+    void *buf;
+    size_t size;
+    unsigned crc;
+};
+
+static void *byte_setup(unsigned long arg)
+{
+    struct byte_bench *b = raft_malloc(sizeof *b);
+    size_t i;
+    MICRO_ASSERT(b != NULL);
+    b->size = arg;
+    b->buf = raft_malloc(b->size);
+    MICRO_ASSERT(b->buf != NULL);
+    for (i = 0; i < b->size; i++) {
+        ((unsigned char *)b->buf)[i] = (unsigned char)i;
+    }
+    b->crc = 0;
+    return b;
+}
+
+static void byte_tear_down(void *data)
+{
+    struct byte_bench *b = data;
+    raft_free(b->buf);
+    raft_free(b);
+}
+
+/**
+ * Calculate the CRC32 checksum of a buffer of @arg bytes.
+ */
+#define byte_crc32_setup byte_setup
+#define byte_crc32_tear_down byte_tear_down
+
+static void byte_crc32_run(void *data, unsigned long n)
+{
+    struct byte_bench *b = data;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        b->crc = byte__crc32(b->buf, b->size, b->crc);
+    }
+}
+
+MICRO(byte_crc32_4k, byte_crc32, "byte/crc32/4k", 4096)
+MICRO(byte_crc32_64k, byte_crc32, "byte/crc32/64k", 65536)
+
+/**
+ * Same as above, but using CRC32C.
+ */
+#define byte_crc32c_setup byte_setup
+#define byte_crc32c_tear_down byte_tear_down
+
+static void byte_crc32c_run(void *data, unsigned long n)
+{
+    struct byte_bench *b = data;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        b->crc = byte__crc32c(b->buf, b->size, b->crc);
+    }
+}
+
+MICRO(byte_crc32c_4k, byte_crc32c, "byte/crc32c/4k", 4096)
+MICRO(byte_crc32c_64k, byte_crc32c, "byte/crc32c/64k", 65536)
@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../../include/raft.h"
+#include "../../include/raft/io_uv.h"
+#include "../../src/io_uv_encoding.h"
+
+#include "micro.h"
+
+/* Size of the message preamble, holding message type and header length. */
+#define PREAMBLE_SIZE (2 * sizeof(uint64_t))
+
+/* Size of the payload of each entry in the AppendEntries messages. */
+#define ENTRY_SIZE 256
+
+struct encoding_bench
+{
+    struct raft_message message;
+    struct raft_entry *entries;
+    void *payload;
+    uv_buf_t header;
+};
+
+static void *encoding_setup(unsigned long arg)
+{
+    struct encoding_bench *b = raft_malloc(sizeof *b);
+    struct raft_append_entries *p;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    unsigned i;
+    int rv;
+
+    MICRO_ASSERT(b != NULL);
+    b->entries = raft_calloc(arg, sizeof *b->entries);
+    MICRO_ASSERT(b->entries != NULL);
+    b->payload = raft_malloc(arg * ENTRY_SIZE);
+    MICRO_ASSERT(b->payload != NULL);
+    memset(b->payload, 'x', arg * ENTRY_SIZE);
+
+    for (i = 0; i < arg; i++) {
+        struct raft_entry *entry = &b->entries[i];
+        entry->term = 1;
+        entry->type = RAFT_COMMAND;
+        entry->buf.base = (char *)b->payload + i * ENTRY_SIZE;
+        entry->buf.len = ENTRY_SIZE;
+    }
+
+    memset(&b->message, 0, sizeof b->message);
+    b->message.type = RAFT_IO_APPEND_ENTRIES;
+    p = &b->message.append_entries;
+    p->term = 1;
+    p->leader_id = 1;
+    p->prev_log_index = 1;
+    p->prev_log_term = 1;
+    p->leader_commit = 1;
+    p->entries = b->entries;
+    p->n_entries = (unsigned)arg;
+
+    /* Keep a copy of the encoded header, without preamble, for decoding. */
+    rv = io_uv__encode_message(&b->message, 0, &bufs, &n_bufs);
+    MICRO_ASSERT(rv == 0);
+    b->header.len = bufs[0].len - PREAMBLE_SIZE;
+    b->header.base = raft_malloc(b->header.len);
+    MICRO_ASSERT(b->header.base != NULL);
+    memcpy(b->header.base, bufs[0].base + PREAMBLE_SIZE,
+           b->header.len);
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+
+    return b;
+}
+
+static void encoding_tear_down(void *data)
+{
+    struct encoding_bench *b = data;
+    raft_free(b->header.base);
+    raft_free(b->payload);
+    raft_free(b->entries);
+    raft_free(b);
+}
+
+/**
+ * Encode an AppendEntries message with @arg entries.
+ */
+#define io_uv_encode_message_setup encoding_setup
+#define io_uv_encode_message_tear_down encoding_tear_down
+
+static void io_uv_encode_message_run(void *data, unsigned long n)
+{
+    struct encoding_bench *b = data;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    unsigned long i;
+    int rv;
+    for (i = 0; i < n; i++) {
+        rv = io_uv__encode_message(&b->message, 0, &bufs, &n_bufs);
+        MICRO_ASSERT(rv == 0);
+        raft_free(bufs[0].base);
+        raft_free(bufs);
+    }
+}
+
+MICRO(io_uv_encode_message_64,
+      io_uv_encode_message,
+      "io_uv/encode_message/64",
+      64)
+
+MICRO(io_uv_encode_message_4k,
+      io_uv_encode_message,
+      "io_uv/encode_message/4k",
+      4096)
+
+/**
+ * Decode the header and the entries of an AppendEntries message with @arg
+ * entries, as done when receiving it.
+ */
+#define io_uv_decode_entries_setup encoding_setup
+#define io_uv_decode_entries_tear_down encoding_tear_down
+
+static void io_uv_decode_entries_run(void *data, unsigned long n)
+{
+    struct encoding_bench *b = data;
+    struct raft_message message;
+    struct raft_buffer buf;
+    size_t payload_len;
+    unsigned long i;
+    int rv;
+    for (i = 0; i < n; i++) {
+        rv = io_uv__decode_message(RAFT_IO_APPEND_ENTRIES, &b->header,
+                                   &message, &payload_len);
+        MICRO_ASSERT(rv == 0);
+        buf.base = b->payload;
+        buf.len = payload_len;
+        io_uv__decode_entries_batch(&buf, message.append_entries.entries,
+                                    message.append_entries.n_entries);
+        raft_free(message.append_entries.entries);
+    }
+}
+
+MICRO(io_uv_decode_entries_64,
+      io_uv_decode_entries,
+      "io_uv/decode_entries/64",
+      64)
+
+MICRO(io_uv_decode_entries_4k,
+      io_uv_decode_entries,
+      "io_uv/decode_entries/4k",
+      4096)
@@ -0,0 +1,179 @@
+#include "../../include/raft.h"
+#include "../../src/log.h"
+
+#include "micro.h"
+
+/* Payload size of the appended entries. Each payload is allocated with
+ * raft_malloc(), so one allocation per appended entry is expected. */
+#define PAYLOAD_SIZE 8
+
+/* Number of entries pre-filled in the log used by acquire and truncate. */
+#define N_PREFILL 1024
+
+struct log_bench
+{
+    struct raft_log log;
+    unsigned long arg;
+    raft_index index;
+};
+
+static void append(struct raft_log *l)
+{
+    struct raft_buffer buf;
+    int rv;
+    buf.len = PAYLOAD_SIZE;
+    buf.base = raft_malloc(buf.len);
+    MICRO_ASSERT(buf.base != NULL);
+    rv = log__append(l, 1, RAFT_COMMAND, &buf, NULL);
+    MICRO_ASSERT(rv == 0);
+}
+
+static void *log_setup(unsigned long arg)
+{
+    struct log_bench *b = raft_malloc(sizeof *b);
+    MICRO_ASSERT(b != NULL);
+    log__init(&b->log);
+    b->arg = arg;
+    b->index = 1;
+    return b;
+}
+
+static void *log_prefilled_setup(unsigned long arg)
+{
+    struct log_bench *b = log_setup(arg);
+    unsigned i;
+    for (i = 0; i < N_PREFILL; i++) {
+        append(&b->log);
+    }
+    return b;
+}
+
+static void log_tear_down(void *data)
+{
+    struct log_bench *b = data;
+    log__close(&b->log);
+    raft_free(b);
+}
+
+/**
+ * Append entries to a log holding between @arg and 2 * @arg of them, shifting
+ * away the oldest @arg entries whenever the upper bound is reached, as it
+ * happens when taking snapshots.
+ */
+#define log_append_setup log_setup
+#define log_append_tear_down log_tear_down
+
+static void log_append_run(void *data, unsigned long n)
+{
+    struct log_bench *b = data;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        append(&b->log);
+        if (log__n_entries(&b->log) == 2 * b->arg) {
+            log__shift(&b->log, log__first_index(&b->log) + b->arg - 1);
+        }
+    }
+}
+
+MICRO(log_append_1k, log_append, "log/append/1k", 1024)
+MICRO(log_append_100k, log_append, "log/append/100k", 100 * 1024)
+
+/**
+ * Fill an empty log with @arg entries and close it, exercising the growth of
+ * the entries and refs arrays.
+ */
+#define log_fill_setup log_setup
+#define log_fill_tear_down log_tear_down
+
+static void log_fill_run(void *data, unsigned long n)
+{
+    struct log_bench *b = data;
+    unsigned long i;
+    unsigned long j;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < b->arg; j++) {
+            append(&b->log);
+        }
+        log__close(&b->log);
+        log__init(&b->log);
+    }
+}
+
+MICRO(log_fill_1k, log_fill, "log/fill/1k", 1024)
+
+/**
+ * Acquire and release @arg entries, cycling through the log.
+ */
+#define log_acquire_setup log_prefilled_setup
+#define log_acquire_tear_down log_tear_down
+
+static void log_acquire_run(void *data, unsigned long n)
+{
+    struct log_bench *b = data;
+    struct raft_entry *entries;
+    unsigned n_entries;
+    unsigned long i;
+    int rv;
+    for (i = 0; i < n; i++) {
+        rv = log__acquire_n(&b->log, b->index, (unsigned)b->arg, &entries,
+                            &n_entries);
+        MICRO_ASSERT(rv == 0);
+        MICRO_ASSERT(n_entries == b->arg);
+        log__release(&b->log, b->index, entries, n_entries);
+        b->index++;
+        if (b->index + b->arg > N_PREFILL + 1) {
+            b->index = 1;
+        }
+    }
+}
+
+MICRO(log_acquire_64, log_acquire, "log/acquire/64", 64)
+
+/**
+ * Same as above, but using a log view.
+ */
+#define log_acquire_view_setup log_prefilled_setup
+#define log_acquire_view_tear_down log_tear_down
+
+static void log_acquire_view_run(void *data, unsigned long n)
+{
+    struct log_bench *b = data;
+    struct log__view view;
+    unsigned long i;
+    int rv;
+    for (i = 0; i < n; i++) {
+        rv = log__acquire_view(&b->log, b->index, (unsigned)b->arg, &view);
+        MICRO_ASSERT(rv == 0);
+        MICRO_ASSERT(view.n == b->arg);
+        log__release_view(&b->log, &view);
+        b->index++;
+        if (b->index + b->arg > N_PREFILL + 1) {
+            b->index = 1;
+        }
+    }
+}
+
+MICRO(log_acquire_view_8, log_acquire_view, "log/acquire_view/8", 8)
+MICRO(log_acquire_view_64, log_acquire_view, "log/acquire_view/64", 64)
+
+/**
+ * Append @arg entries and truncate them away again, as it happens when a
+ * follower receives conflicting entries.
+ */
+#define log_truncate_setup log_prefilled_setup
+#define log_truncate_tear_down log_tear_down
+
+static void log_truncate_run(void *data, unsigned long n)
+{
+    struct log_bench *b = data;
+    unsigned long i;
+    unsigned long j;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < b->arg; j++) {
+            append(&b->log);
+        }
+        log__truncate(&b->log, N_PREFILL + 1);
+    }
+}
+
+MICRO(log_truncate_16, log_truncate, "log/truncate/16", 16)
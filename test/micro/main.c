@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../include/raft.h"
+
+#include "micro.h"
+
+/* Default minimum duration of each measurement, in milliseconds. */
+#define DEFAULT_TIME 200
+
+static const struct micro *micros[MICRO__CAP];
+static unsigned n_micros = 0;
+
+void micro__register(const struct micro *m)
+{
+    if (n_micros == MICRO__CAP) {
+        fprintf(stderr, "error: too many benchmarks\n");
+        abort();
+    }
+    micros[n_micros++] = m;
+}
+
+void micro__fail(const char *file, int line, const char *cond)
+{
+    fprintf(stderr, "error: %s:%d: assertion failed: %s\n", file, line, cond);
+    abort();
+}
+
+/* Heap counting the allocations performed through raft_malloc() and friends,
+ * forwarding them to the stdlib. */
+static unsigned long long n_allocs = 0;
+
+static void *heap_malloc(void *data, size_t size)
+{
+    (void)data;
+    n_allocs++;
+    return malloc(size);
+}
+
+static void heap_free(void *data, void *ptr)
+{
+    (void)data;
+    free(ptr);
+}
+
+static void *heap_calloc(void *data, size_t nmemb, size_t size)
+{
+    (void)data;
+    n_allocs++;
+    return calloc(nmemb, size);
+}
+
+static void *heap_realloc(void *data, void *ptr, size_t size)
+{
+    (void)data;
+    n_allocs++;
+    return realloc(ptr, size);
+}
+
+static void *heap_aligned_alloc(void *data, size_t alignment, size_t size)
+{
+    (void)data;
+    n_allocs++;
+    return aligned_alloc(alignment, size);
+}
+
+static struct raft_heap heap = {NULL,        heap_malloc,  heap_free,
+                                heap_calloc, heap_realloc, heap_aligned_alloc};
+
+static unsigned long long now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+           (unsigned long long)ts.tv_nsec;
+}
+
+/* Run the benchmark enough times to last at least @time milliseconds, then
+ * print the cost of a single operation. */
+static void measure(const struct micro *m, unsigned time)
+{
+    unsigned long long target = time * 1000000ULL;
+    unsigned long long elapsed;
+    unsigned long long allocs;
+    unsigned long n = 1;
+    void *data;
+
+    data = m->setup(m->arg);
+
+    /* Find out how many operations take about a tenth of the target time. */
+    for (;;) {
+        elapsed = now();
+        m->run(data, n);
+        elapsed = now() - elapsed;
+        if (elapsed >= target / 10 || n >= 1UL << 30) {
+            break;
+        }
+        n *= 2;
+    }
+    if (elapsed > 0) {
+        n = (unsigned long)((double)n * (double)target / (double)elapsed) + 1;
+    }
+
+    allocs = n_allocs;
+    elapsed = now();
+    m->run(data, n);
+    elapsed = now() - elapsed;
+    allocs = n_allocs - allocs;
+
+    m->tear_down(data);
+
+    printf("%-40s %12lu %12.1f %10.2f\n", m->name, n, (double)elapsed / n,
+           (double)allocs / n);
+    fflush(stdout);
+}
+
+static void usage(void)
+{
+    printf("usage: micro-benchmark [-t MSECS] [FILTER...]\n\n");
+    printf("Run the microbenchmarks whose name contains any of the given\n");
+    printf("filters, or all of them, for at least MSECS milliseconds each\n");
+    printf("(%d by default).\n", DEFAULT_TIME);
+}
+
+static int compare_micros(const void *p1, const void *p2)
+{
+    const struct micro *m1 = *(const struct micro **)p1;
+    const struct micro *m2 = *(const struct micro **)p2;
+    int rv = strcmp(m1->name, m2->name);
+    if (rv == 0) {
+        rv = m1->arg < m2->arg ? -1 : m1->arg > m2->arg;
+    }
+    return rv;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned time = DEFAULT_TIME;
+    int first = 1;
+    unsigned i;
+    int j;
+
+    if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+        usage();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        time = (unsigned)strtoul(argv[2], NULL, 10);
+        if (time == 0) {
+            usage();
+            return 1;
+        }
+        first = 3;
+    }
+
+    qsort(micros, n_micros, sizeof *micros, compare_micros);
+
+    raft_heap_set(&heap);
+
+    printf("%-40s %12s %12s %10s\n", "benchmark", "ops", "ns/op", "allocs/op");
+    for (i = 0; i < n_micros; i++) {
+        int match = first == argc;
+        for (j = first; j < argc; j++) {
+            if (strstr(micros[i]->name, argv[j]) != NULL) {
+                match = 1;
+            }
+        }
+        if (match) {
+            measure(micros[i], time);
+        }
+    }
+
+    raft_heap_set_default();
+
+    return 0;
+}
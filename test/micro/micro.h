@@ -0,0 +1,56 @@
+/**
+ * Minimal framework for microbenchmarks of internal primitives.
+ */
+
+#ifndef TEST_MICRO_H
+#define TEST_MICRO_H
+
+/* Maximum number of registered benchmarks. */
+#define MICRO__CAP 64
+
+/**
+ * A benchmark of a single operation.
+ *
+ * The @setup function is passed @arg, typically the size of the data the
+ * operation works on, and returns the state used by @run, which must perform
+ * the operation @n times in a row. The @tear_down function releases the state.
+ */
+struct micro
+{
+    const char *name;
+    unsigned long arg;
+    void *(*setup)(unsigned long arg);
+    void (*run)(void *data, unsigned long n);
+    void (*tear_down)(void *data);
+};
+
+void micro__register(const struct micro *m);
+
+/**
+ * Declare and register a benchmark with the given @NAME, using the functions
+ * ID_setup, ID_run and ID_tear_down. The same functions can be registered more
+ * than once with different identifiers @ID and arguments @ARG.
+ */
+#define MICRO(ID, FUNCS, NAME, ARG)                                       \
+    __attribute__((constructor)) static void micro__init_##ID(void)       \
+    {                                                                     \
+        static const struct micro m = {NAME, ARG, FUNCS##_setup,          \
+                                       FUNCS##_run, FUNCS##_tear_down};   \
+        micro__register(&m);                                              \
+    }
+
+/**
+ * Abort the benchmark run if the given condition is false.
+ */
+#define MICRO_ASSERT(COND)                          \
+    do {                                            \
+        if (!(COND)) {                              \
+            micro__fail(__FILE__, __LINE__, #COND); \
+        }                                           \
+    } while (0)
+
+__attribute__((noreturn)) void micro__fail(const char *file,
+                                         int line,
+                                         const char *cond);
+
+#endif /* TEST_MICRO_H */
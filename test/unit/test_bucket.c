@@ -0,0 +1,148 @@
+#include <stdint.h>
+
+#include "../../src/bucket.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(bucket);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    struct raft_bucket bucket;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    (void)params;
+    (void)user_data;
+    bucket__init(&f->bucket);
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    free(f);
+}
+
+/* Assert the number of bytes available at the given time. */
+#define __assert_available(F, RATE, NOW, N) \
+    munit_assert_int(bucket__available(&F->bucket, RATE, NOW), ==, N)
+
+/**
+ * bucket__available
+ */
+
+TEST_SUITE(available);
+
+TEST_SETUP(available, setup);
+TEST_TEAR_DOWN(available, tear_down);
+
+TEST_GROUP(available, success);
+
+/* A rate of zero means no limit. */
+TEST_CASE(available, success, unlimited, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    munit_assert_true(bucket__available(&f->bucket, 0, 0) == SIZE_MAX);
+    bucket__take(&f->bucket, 0, 1000);
+    munit_assert_true(bucket__available(&f->bucket, 0, 0) == SIZE_MAX);
+
+    return MUNIT_OK;
+}
+
+/* A new bucket holds one second worth of tokens. */
+TEST_CASE(available, success, full, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __assert_available(f, 1000, 0, 1000);
+
+    return MUNIT_OK;
+}
+
+/* Tokens taken out are added back as time goes by, up to one second worth of
+ * them. */
+TEST_CASE(available, success, refill, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __assert_available(f, 1000, 100, 1000);
+    bucket__take(&f->bucket, 1000, 600);
+    __assert_available(f, 1000, 100, 400);
+    __assert_available(f, 1000, 200, 500);
+    __assert_available(f, 1000, 5000, 1000);
+
+    return MUNIT_OK;
+}
+
+/* An overdrawn bucket has no tokens until the debt is paid back. */
+TEST_CASE(available, success, overdrawn, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __assert_available(f, 1000, 0, 1000);
+    bucket__take(&f->bucket, 1000, 1500);
+    __assert_available(f, 1000, 0, 0);
+    __assert_available(f, 1000, 500, 0);
+    __assert_available(f, 1000, 600, 100);
+
+    return MUNIT_OK;
+}
+
+/**
+ * bucket__delay
+ */
+
+TEST_SUITE(delay);
+
+TEST_SETUP(delay, setup);
+TEST_TEAR_DOWN(delay, tear_down);
+
+TEST_GROUP(delay, success);
+
+/* There's no delay if some tokens are available. */
+TEST_CASE(delay, success, available, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    munit_assert_int(bucket__delay(&f->bucket, 1000, 0), ==, 0);
+    bucket__take(&f->bucket, 1000, 999);
+    munit_assert_int(bucket__delay(&f->bucket, 1000, 0), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Once the bucket is empty, the delay lasts until the first token is added. */
+TEST_CASE(delay, success, empty, NULL)
+{
+    struct fixture *f = data;
+    unsigned delay;
+
+    (void)params;
+
+    __assert_available(f, 100, 0, 100);
+    bucket__take(&f->bucket, 100, 200);
+    delay = bucket__delay(&f->bucket, 100, 0);
+    munit_assert_int(delay, ==, 1010);
+    __assert_available(f, 100, delay - 1, 0);
+    munit_assert_int(bucket__available(&f->bucket, 100, delay), >, 0);
+
+    return MUNIT_OK;
+}
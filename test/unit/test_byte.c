@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "../../src/byte.h"
 
 #include "../lib/runner.h"
@@ -55,3 +57,126 @@ TEST_CASE(crc32, invalid, NULL)
 
     return MUNIT_OK;
 }
+
+/**
+ * byte__crc32c
+ */
+
+TEST_SUITE(crc32c);
+
+/* The checksum matches the standard check value of CRC32C. */
+TEST_CASE(crc32c, check_value, NULL)
+{
+    const char *buf = "123456789";
+
+    (void)data;
+    (void)params;
+
+    munit_assert_int(byte__crc32c(buf, strlen(buf), 0), ==, 0xe3069283);
+
+    return MUNIT_OK;
+}
+
+/* The checksum of a buffer can be calculated in several parts, regardless of
+ * their alignment. */
+TEST_CASE(crc32c, parts, NULL)
+{
+    uint8_t buf[1024];
+    unsigned crc1;
+    unsigned crc2;
+    unsigned i;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < sizeof buf; i++) {
+        buf[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    crc1 = byte__crc32c(buf + 1, sizeof buf - 1, 0);
+    crc2 = byte__crc32c(buf + 1, 13, 0);
+    crc2 = byte__crc32c(buf + 14, sizeof buf - 14, crc2);
+
+    munit_assert_int(crc1, ==, crc2);
+
+    return MUNIT_OK;
+}
+
+/**
+ * byte__put_varint
+ */
+
+TEST_SUITE(varint);
+
+/* Values are encoded with as few bytes as needed and decoded back. */
+TEST_CASE(varint, round_trip, NULL)
+{
+    uint64_t values[] = {0, 1, 127, 128, 300, UINT32_MAX, UINT64_MAX};
+    uint8_t buf[10];
+    unsigned i;
+
+    (void)data;
+    (void)params;
+
+    for (i = 0; i < sizeof values / sizeof *values; i++) {
+        void *cursor = buf;
+        const void *end;
+        uint64_t value;
+        size_t len = byte__sizeof_varint(values[i]);
+
+        byte__put_varint(&cursor, values[i]);
+        munit_assert_int((uint8_t *)cursor - buf, ==, len);
+
+        end = cursor;
+        cursor = buf;
+        munit_assert_true(
+            byte__get_varint((const void **)&cursor, end, &value));
+        munit_assert_true(value == values[i]);
+        munit_assert_ptr_equal(cursor, end);
+    }
+
+    munit_assert_int(byte__sizeof_varint(127), ==, 1);
+    munit_assert_int(byte__sizeof_varint(128), ==, 2);
+    munit_assert_int(byte__sizeof_varint(UINT64_MAX), ==, 10);
+
+    return MUNIT_OK;
+}
+
+/* Truncated and overlong varints are rejected. */
+TEST_CASE(varint, invalid, NULL)
+{
+    uint8_t truncated[] = {0x80, 0x80};
+    uint8_t overlong[] = {0xff, 0xff, 0xff, 0xff, 0xff,
+                          0xff, 0xff, 0xff, 0xff, 0x7f};
+    const void *cursor;
+    uint64_t value;
+
+    (void)data;
+    (void)params;
+
+    cursor = truncated;
+    munit_assert_false(
+        byte__get_varint(&cursor, truncated + sizeof truncated, &value));
+    munit_assert_ptr_equal(cursor, truncated);
+
+    cursor = overlong;
+    munit_assert_false(
+        byte__get_varint(&cursor, overlong + sizeof overlong, &value));
+
+    return MUNIT_OK;
+}
+
+/* Signed values close to zero map to small unsigned ones. */
+TEST_CASE(varint, zigzag, NULL)
+{
+    (void)data;
+    (void)params;
+
+    munit_assert_int(byte__zigzag(0), ==, 0);
+    munit_assert_int(byte__zigzag(-1), ==, 1);
+    munit_assert_int(byte__zigzag(1), ==, 2);
+    munit_assert_true(byte__unzigzag(byte__zigzag(INT64_MIN)) == INT64_MIN);
+    munit_assert_true(byte__unzigzag(byte__zigzag(INT64_MAX)) == INT64_MAX);
+
+    return MUNIT_OK;
+}
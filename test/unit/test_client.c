@@ -32,6 +32,22 @@ TEST_MODULE(client);
         munit_assert_int(rv, ==, 0);                        \
     }
 
+/**
+ * Submit a request to append a new RAFT_COMMAND entry with raft_submit(),
+ * using the I-th buffer of the fixture.
+ */
+#define submit_entry(I)                                             \
+    {                                                               \
+        struct raft_apply *req = munit_malloc(sizeof *req);         \
+        int rv;                                                     \
+                                                                    \
+        test_fsm_encode_set_x(123, &f->bufs[I]);                    \
+                                                                    \
+        req->data = f;                                              \
+        rv = raft_submit(&f->raft, req, &f->bufs[I], 1, apply_cb);  \
+        munit_assert_int(rv, ==, 0);                                \
+    }
+
 /**
  * Submit a request to add a new server and check that it returns no error.
  */
@@ -85,6 +101,8 @@ TEST_MODULE(client);
         args.entries = ENTRIES;                                          \
         args.n_entries = N;                                              \
         args.leader_commit = COMMIT;                                     \
+        args.hibernate = false;                                          \
+        args.seq = 0;                                                    \
                                                                          \
         rv = raft_rpc__recv_append_entries(&F->raft, LEADER_ID, address, \
                                            &args);                       \
@@ -107,6 +125,11 @@ TEST_MODULE(client);
         result.term = TERM;                                            \
         result.success = SUCCESS;                                      \
         result.last_log_index = LAST_LOG_INDEX;                        \
+        result.conflict_term = 0;                                      \
+        result.conflict_index = 0;                                     \
+        result.snapshot_index = 0;                                     \
+        result.snapshot_offset = 0;                                    \
+        result.seq = F->raft.leader_state.seq;                         \
                                                                        \
         rv = raft_rpc__recv_append_entries_result(&F->raft, SERVER_ID, \
                                                   address, &result);   \
@@ -170,6 +193,21 @@ TEST_MODULE(client);
         raft_io_stub_advance(&F->io, MSECS); \
     }
 
+/**
+ * Let the given amount of time elapse, ticking every 100 milliseconds and
+ * tracking a contact from server 2 before each tick, to avoid stepping down.
+ */
+#define __tick_with_contact(F, MSECS)                                    \
+    {                                                                    \
+        unsigned elapsed_;                                               \
+        for (elapsed_ = 0; elapsed_ < MSECS; elapsed_ += 100) {          \
+            F->raft.leader_state.replication[1].last_contact =           \
+                F->io.time(&F->io);                                      \
+            __tick(F, 100);                                              \
+            raft_io_stub_flush_all(&F->io);                              \
+        }                                                                \
+    }
+
 /**
  * raft_apply
  */
@@ -180,7 +218,14 @@ struct propose__fixture
 {
     RAFT_FIXTURE;
     bool invoked;
+    unsigned n_invoked;
     int status;
+    struct raft_buffer bufs[2]; /* Payloads of submitted requests */
+    bool relieved;              /* Whether backpressure was relieved */
+    raft_index committed;       /* Last commit index notified */
+    struct raft_applied_range applied; /* Last applied range notified */
+    struct raft_trace traces[16]; /* Trace points hit */
+    unsigned n_traces;
 };
 
 TEST_SETUP(propose)
@@ -189,7 +234,13 @@ TEST_SETUP(propose)
     (void)user_data;
     RAFT_SETUP(f);
     f->invoked = false;
+    f->n_invoked = 0;
     f->status = -1;
+    f->relieved = false;
+    f->committed = 0;
+    f->applied.first = 0;
+    f->applied.last = 0;
+    f->n_traces = 0;
     return f;
 }
 
@@ -204,103 +255,1195 @@ static void apply_cb(struct raft_apply *req, int status)
 {
     struct propose__fixture *f = req->data;
     f->invoked = true;
+    f->n_invoked++;
     f->status = status;
     free(req);
 }
 
-TEST_GROUP(propose, error);
-TEST_GROUP(propose, success);
+static void trace_cb(void *data, const struct raft_trace *trace)
+{
+    struct propose__fixture *f = data;
+    if (f->n_traces < sizeof f->traces / sizeof f->traces[0]) {
+        f->traces[f->n_traces] = *trace;
+        f->n_traces++;
+    }
+}
+
+/* Return the first trace point hit with the given ID, or NULL. */
+static struct raft_trace *find_trace(struct propose__fixture *f, int point)
+{
+    unsigned i;
+    for (i = 0; i < f->n_traces; i++) {
+        if (f->traces[i].point == point) {
+            return &f->traces[i];
+        }
+    }
+    return NULL;
+}
+
+TEST_GROUP(propose, error);
+TEST_GROUP(propose, success);
+
+/* If the raft instance is not in leader state, an error is returned. */
+TEST_CASE(propose, error, not_leader, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* If the raft instance steps down from leader state, the apply callback fires
+ * with an error. */
+TEST_CASE(propose, error, leadership_lost, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    propose_entry;
+
+    /* Advance timer past the election timeout, forcing a step down */
+    raft_io_stub_advance(&f->io, f->raft.election_timeout + 100);
+
+    munit_assert_int(f->status, ==, RAFT_ERR_LEADERSHIP_LOST);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+static char *propose_oom_heap_fault_delay[] = {"0", "1", NULL};
+static char *propose_oom_heap_fault_repeat[] = {"1", NULL};
+
+static MunitParameterEnum propose_oom_params[] = {
+    {TEST_HEAP_FAULT_DELAY, propose_oom_heap_fault_delay},
+    {TEST_HEAP_FAULT_REPEAT, propose_oom_heap_fault_repeat},
+    {NULL, NULL},
+};
+
+/* Out of memory conditions. */
+TEST_CASE(propose, error, oom, propose_oom_params)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    test_heap_fault_enable(&f->heap);
+
+    /* Reset the request queue, to trigger a failure when attempting to grow
+     * it. */
+    /*raft_free(f->raft.io_queue.requests);
+    f->raft.io_queue.requests = NULL;
+    f->raft.io_queue.size = 0;*/
+
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_ENOMEM);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* The raft instance is shutdown. */
+TEST_CASE(propose, error, shutdown, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    req->data = f;
+
+    rv = raft_apply(&f->raft, req, &buf, 1, apply_cb);
+    munit_assert_int(rv, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* I/O error. */
+TEST_CASE(propose, error, io_err, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    raft_io_stub_fault(&f->io, 0, 1);
+
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_ERR_IO);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* If the I/O backend can't wake up the loop, raft_submit() fails. */
+TEST_CASE(propose, error, submit_unsupported, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    rv = raft_submit(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* If the raft instance is not the leader when the submitted requests are
+ * drained, their callbacks fire with an error. */
+TEST_CASE(propose, error, submit_not_leader, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    f->io.version = 7;
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    submit_entry(0);
+    munit_assert_false(f->invoked);
+
+    munit_assert_true(raft_io_stub_wakeup(&f->io));
+    munit_assert_int(f->status, ==, RAFT_ERR_NOT_LEADER);
+
+    raft_free(f->bufs[0].base);
+
+    return MUNIT_OK;
+}
+
+/* Once the uncommitted payload reaches the high-water mark, new commands are
+ * rejected. */
+TEST_CASE(propose, error, backpressure, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply rejected;
+    struct raft_buffer payload;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    raft_set_max_uncommitted_bytes(&f->raft, 8);
+
+    propose_entry;
+
+    test_fsm_encode_set_x(123, &payload);
+
+    rv = raft_apply(&f->raft, &rejected, &payload, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_EBACKPRESSURE);
+
+    raft_free(payload.base);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The new entries are sent to all other servers. */
+TEST_CASE(propose, success, send_entries, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    propose_entry;
+
+    /* A write log and an append entries requests has been submitted. */
+    __assert_io(f, 1, 1);
+
+    return MUNIT_OK;
+}
+
+/* If group commit is enabled, the entries of all the requests submitted in the
+ * same loop iteration are written and sent together. */
+TEST_CASE(propose, success, group_commit, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    f->io.version = 14;
+    raft_set_group_commit(&f->raft, true);
+
+    propose_entry;
+    propose_entry;
+
+    /* Nothing has been submitted yet. */
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* Fire the deferred request. */
+    raft_io_stub_flush(&f->io);
+
+    /* A single write log and append entries requests has been submitted. */
+    __assert_io(f, 1, 1);
+
+    munit_assert_int(log__last_index(&f->raft.log), ==, 3);
+
+    return MUNIT_OK;
+}
+
+static void propose__watch_cb(void *data, int event, void *payload)
+{
+    struct propose__fixture *f = data;
+    munit_assert_int(event, ==, RAFT_EVENT_PRESSURE_RELIEVED);
+    munit_assert_int(*(size_t *)payload, ==, 0);
+    f->relieved = true;
+}
+
+static void propose__batch_watch_cb(void *data, int event, void *payload)
+{
+    struct propose__fixture *f = data;
+    switch (event) {
+        case RAFT_EVENT_COMMIT_ADVANCED:
+            f->committed = *(raft_index *)payload;
+            break;
+        case RAFT_EVENT_RANGE_APPLIED:
+            f->applied = *(struct raft_applied_range *)payload;
+            break;
+        default:
+            munit_error("unexpected event");
+    }
+}
+
+/* Commit index advances and applied batches are notified. */
+TEST_CASE(propose, success, batch_events, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    raft_watch(&f->raft, RAFT_EVENT_COMMIT_ADVANCED, propose__batch_watch_cb);
+    raft_watch(&f->raft, RAFT_EVENT_RANGE_APPLIED, propose__batch_watch_cb);
+
+    propose_entry;
+    __assert_io(f, 1, 1);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+
+    munit_assert_int(f->committed, ==, 2);
+    munit_assert_int(f->applied.first, ==, 2);
+    munit_assert_int(f->applied.last, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Once enough commands are committed, new commands are accepted again and an
+ * event is fired. */
+TEST_CASE(propose, success, backpressure_relieved, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply rejected;
+    struct raft_buffer payload;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    raft_set_max_uncommitted_bytes(&f->raft, 8);
+    raft_watch(&f->raft, RAFT_EVENT_PRESSURE_RELIEVED, propose__watch_cb);
+
+    propose_entry;
+
+    test_fsm_encode_set_x(123, &payload);
+    rv = raft_apply(&f->raft, &rejected, &payload, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_EBACKPRESSURE);
+
+    __assert_io(f, 1, 1);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+
+    munit_assert_true(f->relieved);
+
+    propose_entry;
+    raft_free(payload.base);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The stats report the replication progress of followers and the latency of
+ * committed requests. */
+TEST_CASE(propose, success, stats, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_stats stats;
+    unsigned long long n_committed;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_stats(&f->raft, &stats);
+    munit_assert_int(rv, ==, 0);
+    n_committed = stats.counters.n_committed;
+    munit_assert_int(stats.counters.n_elections, ==, 1);
+    raft_free(stats.servers);
+
+    propose_entry;
+    __assert_io(f, 1, 1);
+
+    rv = raft_stats(&f->raft, &stats);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(stats.state, ==, RAFT_LEADER);
+    munit_assert_int(stats.last_index, ==, 2);
+    munit_assert_int(stats.n_servers, ==, 1);
+    munit_assert_int(stats.servers[0].id, ==, 2);
+    munit_assert_int(stats.servers[0].match_index, ==, 0);
+    munit_assert_int(stats.servers[0].lag, ==, 2);
+    munit_assert_int(stats.servers[0].lag_bytes, >, 0);
+    raft_free(stats.servers);
+
+    __tick(f, 5);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+
+    rv = raft_stats(&f->raft, &stats);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(stats.commit_index, ==, 2);
+    munit_assert_int(stats.counters.n_committed, ==, n_committed + 1);
+    munit_assert_int(stats.counters.n_applied, ==, 1);
+    munit_assert_int(stats.counters.commit_latency[3], ==, 1);
+    munit_assert_int(stats.servers[0].match_index, ==, 2);
+    munit_assert_int(stats.servers[0].lag, ==, 0);
+    munit_assert_int(stats.servers[0].lag_bytes, ==, 0);
+    raft_free(stats.servers);
+
+    return MUNIT_OK;
+}
+
+/* The registered tracer is invoked along the replication path. */
+TEST_CASE(propose, success, trace, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_trace *trace;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    raft_set_tracer(&f->raft, trace_cb);
+
+    propose_entry;
+    __assert_io(f, 1, 1);
+
+    trace = find_trace(f, RAFT_TRACE_APPEND);
+    munit_assert_ptr_not_null(trace);
+    munit_assert_int(trace->index, ==, 2);
+    munit_assert_int(trace->n, ==, 1);
+
+    trace = find_trace(f, RAFT_TRACE_SEND);
+    munit_assert_ptr_not_null(trace);
+    munit_assert_int(trace->type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(trace->server_id, ==, 2);
+
+    __tick(f, 5);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+
+    munit_assert_ptr_not_null(find_trace(f, RAFT_TRACE_APPEND_DONE));
+
+    trace = find_trace(f, RAFT_TRACE_COMMIT);
+    munit_assert_ptr_not_null(trace);
+    munit_assert_int(trace->index, ==, 2);
+
+    trace = find_trace(f, RAFT_TRACE_APPLY);
+    munit_assert_ptr_not_null(trace);
+    munit_assert_int(trace->index, ==, 2);
+
+    raft_set_tracer(&f->raft, NULL);
+
+    return MUNIT_OK;
+}
+
+/* The entries of all the requests submitted before the loop wakes up are
+ * written and sent together. */
+TEST_CASE(propose, success, submit, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    f->io.version = 7;
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    submit_entry(0);
+    submit_entry(1);
+
+    /* Nothing has been appended yet. */
+    munit_assert_int(log__last_index(&f->raft.log), ==, 1);
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 0);
+
+    /* Wake up the loop: a single write log and append entries requests have
+     * been submitted, with the entries in submission order. */
+    munit_assert_true(raft_io_stub_wakeup(&f->io));
+    munit_assert_false(raft_io_stub_wakeup(&f->io));
+    __assert_io(f, 1, 1);
+
+    munit_assert_int(log__last_index(&f->raft.log), ==, 3);
+    munit_assert_ptr_equal(log__get(&f->raft.log, 2)->buf.base,
+                           f->bufs[0].base);
+    munit_assert_ptr_equal(log__get(&f->raft.log, 3)->buf.base,
+                           f->bufs[1].base);
+
+    return MUNIT_OK;
+}
+
+/* If batching is enabled, the commands of a request are packed into a single
+ * entry, and unpacked when applied. */
+TEST_CASE(propose, success, batch, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    struct raft_buffer bufs[2];
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_apply_batching(&f->raft, true);
+
+    test_fsm_encode_add_x(3, &bufs[0]);
+    test_fsm_encode_add_x(4, &bufs[1]);
+    req->data = f;
+    rv = raft_apply(&f->raft, req, bufs, 2, apply_cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 1, 1);
+
+    munit_assert_int(log__last_index(&f->raft.log), ==, 2);
+    munit_assert_int(log__get(&f->raft.log, 2)->type, ==, RAFT_BATCH);
+
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_int(f->n_invoked, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 7);
+
+    return MUNIT_OK;
+}
+
+/* The commands passed to raft_apply_copy() are copied into a single
+ * allocation shared by their entries, and the caller keeps ownership of its
+ * buffers. */
+TEST_CASE(propose, success, copy, NULL)
+{
+    struct propose__fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    struct raft_buffer bufs[2];
+    const struct raft_entry *entry1;
+    const struct raft_entry *entry2;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_add_x(3, &bufs[0]);
+    test_fsm_encode_add_x(4, &bufs[1]);
+    req->data = f;
+    rv = raft_apply_copy(&f->raft, req, bufs, 2, apply_cb);
+    munit_assert_int(rv, ==, 0);
+    raft_free(bufs[0].base);
+    raft_free(bufs[1].base);
+    __assert_io(f, 1, 1);
+
+    entry1 = log__get(&f->raft.log, 2);
+    entry2 = log__get(&f->raft.log, 3);
+    munit_assert_int(entry1->type, ==, RAFT_COMMAND);
+    munit_assert_ptr_not_null(entry1->batch);
+    munit_assert_ptr_equal(entry1->batch, entry2->batch);
+    munit_assert_ptr_equal(entry1->buf.base, entry1->batch);
+
+    __handle_append_entries_response(f, 2, 2, true, 3);
+    munit_assert_int(f->n_invoked, ==, 1);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 7);
+
+    return MUNIT_OK;
+}
+
+/* If batching is enabled, the commands of all the requests submitted before the
+ * loop wakes up are packed into a single entry, and the callback of each
+ * request fires once it's applied. */
+TEST_CASE(propose, success, submit_batch, NULL)
+{
+    struct propose__fixture *f = data;
+
+    (void)params;
+
+    f->io.version = 7;
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_apply_batching(&f->raft, true);
+
+    submit_entry(0);
+    submit_entry(1);
+
+    munit_assert_true(raft_io_stub_wakeup(&f->io));
+    __assert_io(f, 1, 1);
+
+    munit_assert_int(log__last_index(&f->raft.log), ==, 2);
+    munit_assert_int(log__get(&f->raft.log, 2)->type, ==, RAFT_BATCH);
+
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_int(f->n_invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 123);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_read_index
+ */
+
+TEST_SUITE(read_index);
+
+struct read_index__fixture
+{
+    RAFT_FIXTURE;
+    struct raft_read req;
+    bool invoked;
+    int status;
+};
+
+TEST_SETUP(read_index)
+{
+    struct read_index__fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    RAFT_SETUP(f);
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+    return f;
+}
+
+TEST_TEAR_DOWN(read_index)
+{
+    struct read_index__fixture *f = data;
+    RAFT_TEAR_DOWN(f);
+    free(f);
+}
+
+static void read_index__apply_cb(struct raft_apply *req, int status)
+{
+    (void)status;
+    free(req);
+}
+
+static void read_index__read_cb(struct raft_read *req, int status)
+{
+    struct read_index__fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+}
+
+/**
+ * Commit a new entry in the current term, with server 2 acknowledging it.
+ */
+#define __commit_entry(F)                                                    \
+    {                                                                        \
+        struct raft_buffer buf;                                              \
+        struct raft_apply *req = munit_malloc(sizeof *req);                  \
+        int rv;                                                              \
+                                                                             \
+        test_fsm_encode_set_x(123, &buf);                                    \
+        rv = raft_apply(&F->raft, req, &buf, 1, read_index__apply_cb);       \
+        munit_assert_int(rv, ==, 0);                                         \
+        __assert_io(F, 1, 1);                                                \
+        __handle_append_entries_response(F, 2, 2, true, 2);                  \
+        munit_assert_int(F->raft.last_applied, ==, 2);                       \
+    }
+
+TEST_GROUP(read_index, error);
+TEST_GROUP(read_index, success);
+
+/* If the raft instance is not in leader state, an error is returned. */
+TEST_CASE(read_index, error, not_leader, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* If leadership is lost before the read is confirmed, the request fails. */
+TEST_CASE(read_index, error, leadership_lost, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    __commit_entry(f);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    /* Advance timer past the election timeout, forcing a step down */
+    raft_io_stub_advance(&f->io, f->raft.election_timeout + 100);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, RAFT_ERR_LEADERSHIP_LOST);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The read completes once a heartbeat round confirms leadership, without any
+ * new log entry being appended. */
+TEST_CASE(read_index, success, heartbeat, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    __commit_entry(f);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->req.index, ==, 2);
+    munit_assert_false(f->invoked);
+
+    /* A heartbeat has been sent, and no entry was written. */
+    __assert_io(f, 0, 1);
+
+    __handle_append_entries_response(f, 2, 2, true, 2);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(log__last_index(&f->raft.log), ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* A result echoing a heartbeat round that started before the read was
+ * submitted doesn't confirm it. */
+TEST_CASE(read_index, success, stale_round, NULL)
+{
+    struct read_index__fixture *f = data;
+    struct raft_append_entries_result ack;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    __commit_entry(f);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 0, 1);
+
+    ack.term = 2;
+    ack.success = true;
+    ack.last_log_index = 2;
+    ack.conflict_term = 0;
+    ack.conflict_index = 0;
+    ack.snapshot_index = 0;
+    ack.snapshot_offset = 0;
+    ack.seq = f->req.seq - 1;
+
+    rv = raft_rpc__recv_append_entries_result(&f->raft, 2, "2", &ack);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(f->invoked);
+
+    ack.seq = f->req.seq;
+
+    rv = raft_rpc__recv_append_entries_result(&f->raft, 2, "2", &ack);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Reads submitted while a round is in flight share the next one, which starts
+ * once the first round is confirmed. */
+TEST_CASE(read_index, success, next_round, NULL)
+{
+    struct read_index__fixture *f = data;
+    struct raft_read req2;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    __commit_entry(f);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 0, 1);
+
+    req2.data = f;
+    rv = raft_read_index(&f->raft, &req2, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(req2.seq, ==, f->req.seq + 1);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* The first read gets confirmed, and the next round is sent. */
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+    munit_assert_false(req2.confirmed);
+    munit_assert_int(f->raft.leader_state.seq, ==, req2.seq);
+    __assert_io(f, 0, 1);
+
+    f->invoked = false;
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+    munit_assert_true(req2.confirmed);
+
+    return MUNIT_OK;
+}
+
+/* If no entry of the current term has been committed yet, the read waits. */
+TEST_CASE(read_index, success, wait_commit, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    __assert_io(f, 0, 1);
+    __handle_append_entries_response(f, 2, 2, true, 1);
+
+    munit_assert_false(f->invoked);
+
+    __commit_entry(f);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->req.index, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the leader holds a valid read lease, the read is served right away. */
+TEST_CASE(read_index, success, lease, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_read_lease_timeout(&f->raft, 500);
+    __commit_entry(f);
+
+    rv = raft_read_lease(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* If the read lease has expired, fall back to a ReadIndex round. */
+TEST_CASE(read_index, success, lease_expired, NULL)
+{
+    struct read_index__fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_read_lease_timeout(&f->raft, 500);
+    __commit_entry(f);
+
+    raft_io_stub_advance(&f->io, 600);
+    raft_io_stub_flush_all(&f->io);
+
+    rv = raft_read_lease(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_false(f->invoked);
+    __assert_io(f, 0, 1);
+
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+
+    return MUNIT_OK;
+}
+
+/* The read lease counts from the start of the heartbeat round that the results
+ * echo, not from their arrival. */
+TEST_CASE(read_index, success, lease_from_round, NULL)
+{
+    struct read_index__fixture *f = data;
+    struct raft_read req2;
+    raft_time start;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_read_lease_timeout(&f->raft, 500);
+    __commit_entry(f);
+
+    rv = raft_read_index(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 0, 1);
+    start = f->raft.leader_state.seq_time;
+
+    /* The result of the round arrives late. */
+    raft_io_stub_set_time(&f->io, (unsigned)start + 400);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+
+    /* The lease expires 500 milliseconds after the round started. */
+    raft_io_stub_set_time(&f->io, (unsigned)start + 550);
+    f->invoked = false;
+    req2.data = f;
+    rv = raft_read_lease(&f->raft, &req2, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(f->invoked);
+    __assert_io(f, 0, 1);
+
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+
+    return MUNIT_OK;
+}
+
+/* No read lease is held while leadership is being transferred, nor for an
+ * election timeout after TimeoutNow was sent, even if the transfer timed out in
+ * the meantime. */
+TEST_CASE(read_index, success, lease_transfer, NULL)
+{
+    struct read_index__fixture *f = data;
+    struct raft_transfer transfer;
+    struct raft_buffer payload;
+    struct raft_apply *apply = munit_malloc(sizeof *apply);
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+    raft_set_read_lease_timeout(&f->raft, 500);
+    __commit_entry(f);
+
+    /* Server 2 is behind, so TimeoutNow is not sent right away. */
+    test_fsm_encode_set_x(456, &payload);
+    rv = raft_apply(&f->raft, apply, &payload, 1, read_index__apply_cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 1, 1);
+
+    rv = raft_transfer_leadership(&f->raft, &transfer, 2, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    rv = raft_read_lease(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(f->invoked);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_true(f->invoked);
+
+    /* Server 2 catches up 300 milliseconds later and gets TimeoutNow. */
+    raft_io_stub_advance(&f->io, 300);
+    raft_io_stub_flush_all(&f->io);
+    __handle_append_entries_response(f, 2, 2, true, 3);
+    munit_assert_true(transfer.sent);
+    raft_io_stub_flush_all(&f->io);
+
+    /* The transfer times out, but the lease is still not valid. */
+    raft_io_stub_advance(&f->io, 800);
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_ptr_null(f->raft.leader_state.transfer);
+    __handle_append_entries_response(f, 2, 2, true, 3);
+
+    f->invoked = false;
+    rv = raft_read_lease(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(f->invoked);
+    __assert_io(f, 0, 1);
+    __handle_append_entries_response(f, 2, 2, true, 3);
+    munit_assert_true(f->invoked);
+
+    /* An election timeout after TimeoutNow was sent, the lease is back. */
+    raft_io_stub_advance(&f->io, 300);
+    raft_io_stub_flush_all(&f->io);
+    __handle_append_entries_response(f, 2, 2, true, 3);
+
+    f->invoked = false;
+    rv = raft_read_lease(&f->raft, &f->req, read_index__read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(f->invoked);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_transfer_leadership
+ */
+
+TEST_SUITE(transfer);
+
+struct transfer__fixture
+{
+    RAFT_FIXTURE;
+    struct raft_transfer req;
+    bool invoked;
+    int status;
+    struct raft_lifecycle_event event;
+};
+
+TEST_SETUP(transfer)
+{
+    struct transfer__fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    RAFT_SETUP(f);
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+    f->event.server_id = 0;
+    return f;
+}
+
+TEST_TEAR_DOWN(transfer)
+{
+    struct transfer__fixture *f = data;
+    RAFT_TEAR_DOWN(f);
+    free(f);
+}
+
+static void transfer__apply_cb(struct raft_apply *req, int status)
+{
+    (void)status;
+    free(req);
+}
+
+static void transfer__cb(struct raft_transfer *req, int status)
+{
+    struct transfer__fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+}
+
+static void transfer__watch_cb(void *data, int event, void *payload)
+{
+    struct transfer__fixture *f = data;
+    munit_assert_int(event, ==, RAFT_EVENT_LEADERSHIP_TRANSFERRED);
+    munit_assert_false(f->invoked);
+    f->event = *(struct raft_lifecycle_event *)payload;
+}
+
+/**
+ * Submit a new entry, asserting that no error occurs.
+ */
+#define __transfer_propose(F)                                             \
+    {                                                                     \
+        struct raft_buffer buf;                                           \
+        struct raft_apply *req = munit_malloc(sizeof *req);               \
+        int rv;                                                           \
+                                                                          \
+        test_fsm_encode_set_x(123, &buf);                                 \
+        rv = raft_apply(&F->raft, req, &buf, 1, transfer__apply_cb);      \
+        munit_assert_int(rv, ==, 0);                                      \
+    }
+
+/**
+ * Assert that a TimeoutNow message is being sent to the given server.
+ */
+#define __assert_timeout_now(F, SERVER_ID, TERM, LAST_LOG_INDEX)            \
+    {                                                                       \
+        struct raft_message *message;                                       \
+                                                                            \
+        munit_assert_int(raft_io_stub_n_sending(&F->io), ==, 1);            \
+        raft_io_stub_sending(&F->io, 0, &message);                          \
+        munit_assert_int(message->type, ==, RAFT_IO_TIMEOUT_NOW);           \
+        munit_assert_int(message->server_id, ==, SERVER_ID);                \
+        munit_assert_int(message->timeout_now.term, ==, TERM);              \
+        munit_assert_int(message->timeout_now.last_log_index, ==,           \
+                         LAST_LOG_INDEX);                                   \
+    }
+
+TEST_GROUP(transfer, error);
+TEST_GROUP(transfer, success);
 
 /* If the raft instance is not in leader state, an error is returned. */
-TEST_CASE(propose, error, not_leader, NULL)
+TEST_CASE(transfer, error, not_leader, NULL)
 {
-    struct propose__fixture *f = data;
-    struct raft_apply req;
-    struct raft_buffer buf;
+    struct transfer__fixture *f = data;
     int rv;
 
     (void)params;
 
     test_bootstrap_and_start(&f->raft, 2, 1, 2);
 
-    test_fsm_encode_set_x(123, &buf);
-
-    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    rv = raft_transfer_leadership(&f->raft, &f->req, 2, transfer__cb);
     munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
 
-    raft_free(buf.base);
-
     return MUNIT_OK;
 }
 
-/* If the raft instance steps down from leader state, the apply callback fires
- * with an error. */
-TEST_CASE(propose, error, leadership_lost, NULL)
+/* The target must be a voting server other than the leader itself. */
+TEST_CASE(transfer, error, bad_id, NULL)
 {
-    struct propose__fixture *f = data;
+    struct transfer__fixture *f = data;
+    int rv;
 
     (void)params;
 
     test_bootstrap_and_start(&f->raft, 2, 1, 2);
     test_become_leader(&f->raft);
 
-    propose_entry;
-
-    /* Advance timer past the election timeout, forcing a step down */
-    raft_io_stub_advance(&f->io, f->raft.election_timeout + 100);
-
-    munit_assert_int(f->status, ==, RAFT_ERR_LEADERSHIP_LOST);
+    rv = raft_transfer_leadership(&f->raft, &f->req, 1, transfer__cb);
+    munit_assert_int(rv, ==, RAFT_EBADID);
 
-    raft_io_stub_flush_all(&f->io);
+    rv = raft_transfer_leadership(&f->raft, &f->req, 3, transfer__cb);
+    munit_assert_int(rv, ==, RAFT_EBADID);
 
     return MUNIT_OK;
 }
 
-static char *propose_oom_heap_fault_delay[] = {"0", "1", "2", NULL};
-static char *propose_oom_heap_fault_repeat[] = {"1", NULL};
-
-static MunitParameterEnum propose_oom_params[] = {
-    {TEST_HEAP_FAULT_DELAY, propose_oom_heap_fault_delay},
-    {TEST_HEAP_FAULT_REPEAT, propose_oom_heap_fault_repeat},
-    {NULL, NULL},
-};
-
-/* Out of memory conditions. */
-TEST_CASE(propose, error, oom, propose_oom_params)
+/* If the target doesn't start an election within an election timeout, the
+ * transfer fails and the leader accepts new entries again. */
+TEST_CASE(transfer, error, timeout, NULL)
 {
-    struct propose__fixture *f = data;
-    struct raft_apply req;
-    struct raft_buffer buf;
+    struct transfer__fixture *f = data;
     int rv;
 
     (void)params;
 
-    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
     test_become_leader(&f->raft);
+    raft_watch(&f->raft, RAFT_EVENT_LEADERSHIP_TRANSFERRED,
+               transfer__watch_cb);
 
-    test_fsm_encode_set_x(123, &buf);
+    __transfer_propose(f);
+    raft_io_stub_flush_all(&f->io);
+    __handle_append_entries_response(f, 2, 2, true, 2);
 
-    test_heap_fault_enable(&f->heap);
+    rv = raft_transfer_leadership(&f->raft, &f->req, 3, transfer__cb);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
 
-    /* Reset the request queue, to trigger a failure when attempting to grow
-     * it. */
-    /*raft_free(f->raft.io_queue.requests);
-    f->raft.io_queue.requests = NULL;
-    f->raft.io_queue.size = 0;*/
+    /* Server 2 keeps acknowledging heartbeats, while server 3 never catches
+     * up. */
+    __tick(f, f->raft.election_timeout / 2);
+    raft_io_stub_flush_all(&f->io);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    munit_assert_false(f->invoked);
 
-    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
-    munit_assert_int(rv, ==, RAFT_ENOMEM);
+    __tick(f, f->raft.election_timeout / 2 + 10);
+    raft_io_stub_flush_all(&f->io);
 
-    raft_free(buf.base);
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, RAFT_ERR_TIMEOUT);
+    __assert_state(f, RAFT_LEADER);
+
+    /* The outcome was notified, along with the time it took. */
+    munit_assert_int(f->event.server_id, ==, 3);
+    munit_assert_int(f->event.status, ==, RAFT_ERR_TIMEOUT);
+    munit_assert_int(f->event.duration, >, f->raft.election_timeout);
+
+    __transfer_propose(f);
+    raft_io_stub_flush_all(&f->io);
 
     return MUNIT_OK;
 }
 
-/* The raft instance is shutdown. */
-TEST_CASE(propose, error, shutdown, NULL)
+/* If the target is already up-to-date, TimeoutNow is sent right away and no new
+ * entry is accepted. The transfer completes when the leader steps down. */
+TEST_CASE(transfer, success, up_to_date, NULL)
 {
-    struct propose__fixture *f = data;
-    struct raft_apply *req = munit_malloc(sizeof *req);
+    struct transfer__fixture *f = data;
+    struct raft_message vote;
+    struct raft_apply req;
     struct raft_buffer buf;
     int rv;
 
@@ -308,23 +1451,49 @@ TEST_CASE(propose, error, shutdown, NULL)
 
     test_bootstrap_and_start(&f->raft, 2, 1, 2);
     test_become_leader(&f->raft);
+    __handle_append_entries_response(f, 2, 2, true, 1);
+
+    rv = raft_transfer_leadership(&f->raft, &f->req, 2, transfer__cb);
+    munit_assert_int(rv, ==, 0);
+
+    __assert_timeout_now(f, 2, 2, 1);
+    raft_io_stub_flush_all(&f->io);
 
     test_fsm_encode_set_x(123, &buf);
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+    raft_free(buf.base);
 
-    req->data = f;
+    rv = raft_transfer_leadership(&f->raft, &f->req, 2, transfer__cb);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
 
-    rv = raft_apply(&f->raft, req, &buf, 1, apply_cb);
-    munit_assert_int(rv, ==, 0);
+    /* The target starts an election. */
+    vote.type = RAFT_IO_REQUEST_VOTE;
+    vote.server_id = 2;
+    vote.server_address = "2";
+    vote.request_vote.term = 3;
+    vote.request_vote.candidate_id = 2;
+    vote.request_vote.last_log_index = 1;
+    vote.request_vote.last_log_term = 1;
+    vote.request_vote.pre_vote = false;
+    vote.request_vote.disrupt_leader = true;
+
+    raft_io_stub_deliver(&f->io, &vote);
+
+    __assert_state(f, RAFT_FOLLOWER);
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->raft.voted_for, ==, 2);
+
+    raft_io_stub_flush_all(&f->io);
 
     return MUNIT_OK;
 }
 
-/* I/O error. */
-TEST_CASE(propose, error, io_err, NULL)
+/* If the target is behind, the leader first brings it up-to-date. */
+TEST_CASE(transfer, success, catch_up, NULL)
 {
-    struct propose__fixture *f = data;
-    struct raft_apply req;
-    struct raft_buffer buf;
+    struct transfer__fixture *f = data;
     int rv;
 
     (void)params;
@@ -332,32 +1501,44 @@ TEST_CASE(propose, error, io_err, NULL)
     test_bootstrap_and_start(&f->raft, 2, 1, 2);
     test_become_leader(&f->raft);
 
-    test_fsm_encode_set_x(123, &buf);
+    __transfer_propose(f);
+    raft_io_stub_flush_all(&f->io);
 
-    raft_io_stub_fault(&f->io, 0, 1);
+    rv = raft_transfer_leadership(&f->raft, &f->req, 2, transfer__cb);
+    munit_assert_int(rv, ==, 0);
+    __assert_io(f, 0, 1);
 
-    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
-    munit_assert_int(rv, ==, RAFT_ERR_IO);
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    __assert_timeout_now(f, 2, 2, 2);
+    raft_io_stub_flush_all(&f->io);
 
-    raft_free(buf.base);
+    munit_assert_false(f->invoked);
 
     return MUNIT_OK;
 }
 
-/* The new entries are sent to all other servers. */
-TEST_CASE(propose, success, send_entries, NULL)
+/* A leader with a lower priority than an up-to-date follower hands leadership
+ * over to it on its own. */
+TEST_CASE(transfer, success, priority, NULL)
 {
-    struct propose__fixture *f = data;
+    struct transfer__fixture *f = data;
 
     (void)params;
 
     test_bootstrap_and_start(&f->raft, 2, 1, 2);
     test_become_leader(&f->raft);
+    f->raft.configuration.servers[1].priority = 1;
 
-    propose_entry;
+    __tick(f, 10);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
 
-    /* A write log and an append entries requests has been submitted. */
-    __assert_io(f, 1, 1);
+    __handle_append_entries_response(f, 2, 2, true, 1);
+    __tick(f, 10);
+
+    __assert_timeout_now(f, 2, 2, 1);
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_ptr_not_null(f->raft.leader_state.transfer);
 
     return MUNIT_OK;
 }
@@ -519,6 +1700,8 @@ struct promote__fixture
     struct raft_apply req;
     bool invoked;
     int status;
+    struct raft_lifecycle_event started;
+    struct raft_lifecycle_event finished;
 };
 
 TEST_SETUP(promote)
@@ -529,6 +1712,8 @@ TEST_SETUP(promote)
     f->req.data = f;
     f->invoked = false;
     f->status = -1;
+    f->started.server_id = 0;
+    f->finished.server_id = 0;
     return f;
 }
 
@@ -539,8 +1724,25 @@ TEST_TEAR_DOWN(promote)
     free(f);
 }
 
+static void promote__watch_cb(void *data, int event, void *payload)
+{
+    struct promote__fixture *f = data;
+    struct raft_lifecycle_event *info = payload;
+    switch (event) {
+        case RAFT_EVENT_CATCH_UP_STARTED:
+            f->started = *info;
+            break;
+        case RAFT_EVENT_CATCH_UP_FINISHED:
+            f->finished = *info;
+            break;
+        default:
+            munit_error("unexpected event");
+    }
+}
+
 TEST_GROUP(promote, error);
 TEST_GROUP(promote, success);
+TEST_GROUP(promote, abort);
 
 /* Trying to promote a server on a node which is not the leader results in an
  * error. */
@@ -656,14 +1858,26 @@ TEST_CASE(promote, success, catch_up, NULL)
 
     test_bootstrap_and_start(&f->raft, 3, 1, 2);
     test_become_leader(&f->raft);
+    raft_watch(&f->raft, RAFT_EVENT_CATCH_UP_STARTED, promote__watch_cb);
+    raft_watch(&f->raft, RAFT_EVENT_CATCH_UP_FINISHED, promote__watch_cb);
 
     __promote(f, 3);
 
+    munit_assert_int(f->started.server_id, ==, 3);
+    munit_assert_int(f->started.index, ==, 1);
+    munit_assert_int(f->finished.server_id, ==, 0);
+
     /* Advance the match index of server 3, by acknowledging the AppendEntries
      * request that the leader has sent to it. */
     __assert_io(f, 0, 1);
     __handle_append_entries_response(f, 3, f->raft.current_term, true, 1);
 
+    /* The end of the catch-up was notified, with the entries replicated. */
+    munit_assert_int(f->finished.server_id, ==, 3);
+    munit_assert_int(f->finished.index, ==, 1);
+    munit_assert_int(f->finished.bytes, ==,
+                     log__get(&f->raft.log, 1)->buf.len);
+
     /* A configuration change request has been submitted. Let's complete the
      * associated I/O requests. */
     __assert_io(f, 1, 2);
@@ -786,6 +2000,104 @@ TEST_CASE(promote, success, committed, NULL)
     return MUNIT_OK;
 }
 
+/* The first catch-up round is not bounded by the election timeout: as long as
+ * the server being promoted keeps making progress, the promotion goes on. */
+TEST_CASE(promote, success, long_first_round, NULL)
+{
+    struct promote__fixture *f = data;
+    const struct raft_server *server;
+    unsigned i;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 3; i++) {
+        propose_entry;
+        raft_io_stub_flush_all(&f->io);
+    }
+
+    __promote(f, 3);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Server 3 acknowledges one entry every 20 seconds. */
+    for (i = 1; i <= 3; i++) {
+        __tick_with_contact(f, 20000);
+        __handle_append_entries_response(f, 3, f->raft.current_term, true, i);
+        __assert_catch_up_round(f, 3, 1, i * 20000);
+    }
+
+    /* The server catches up with the last entry, the promotion goes through. */
+    __handle_append_entries_response(f, 3, f->raft.current_term, true, 4);
+    __assert_catch_up_round(f, 0, 0, 0);
+    server = configuration__get(&f->raft.configuration, 3);
+    munit_assert_true(server->voting);
+
+    return MUNIT_OK;
+}
+
+/* If the server being promoted makes no progress for too long, the promotion
+ * is aborted. */
+TEST_CASE(promote, abort, unresponsive, NULL)
+{
+    struct promote__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    __promote(f, 3);
+    raft_io_stub_flush_all(&f->io);
+
+    __tick_with_contact(f, 30000);
+    munit_assert_int(f->raft.leader_state.promotee_id, ==, 3);
+
+    __tick_with_contact(f, 100);
+    __assert_catch_up_round(f, 0, 0, 0);
+
+    return MUNIT_OK;
+}
+
+/* The deadline of a round is derived from the throughput measured in the
+ * previous one, and the promotion is aborted if the round exceeds it. */
+TEST_CASE(promote, abort, deadline, NULL)
+{
+    struct promote__fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    propose_entry;
+    raft_io_stub_flush_all(&f->io);
+
+    __promote(f, 3);
+    raft_io_stub_flush_all(&f->io);
+
+    /* A new entry is appended while the first round is in progress. */
+    propose_entry;
+    raft_io_stub_flush_all(&f->io);
+
+    /* The first round replicates two entries in 2 seconds, so the last
+     * remaining entry is expected to be replicated in 1 second, which gets
+     * doubled. */
+    __tick_with_contact(f, 2000);
+    __handle_append_entries_response(f, 3, f->raft.current_term, true, 2);
+    __assert_catch_up_round(f, 3, 2, 0);
+    munit_assert_int(f->raft.leader_state.round_deadline, ==, 2000);
+
+    __tick_with_contact(f, 2000);
+    munit_assert_int(f->raft.leader_state.promotee_id, ==, 3);
+
+    __tick_with_contact(f, 100);
+    __assert_catch_up_round(f, 0, 0, 0);
+
+    return MUNIT_OK;
+}
+
 /* If leadership is lost before the configuration change log entry for promoting
  * the new server is committed, the leader configuration gets rolled back and
  * the server being promoted is not considered any more as voting. */
@@ -866,7 +2178,7 @@ TEST_CASE(promote, success, follower, NULL)
     rv = configuration__copy(&f->raft.configuration, &configuration);
     munit_assert_int(rv, ==, 0);
 
-    configuration.servers[2].voting = true;
+    configuration__set_voting(&configuration, 2, true);
 
     rv = configuration__encode(&configuration, &buf);
     munit_assert_int(rv, ==, 0);
@@ -1083,3 +2395,117 @@ TEST_CASE(remove_server, success, self, NULL)
 
     return MUNIT_OK;
 }
+
+/**
+ * raft_replace_voters
+ */
+
+TEST_SUITE(replace_voters);
+
+struct replace_voters__fixture
+{
+    RAFT_FIXTURE;
+};
+
+TEST_SETUP(replace_voters)
+{
+    struct replace_voters__fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    RAFT_SETUP(f);
+    return f;
+}
+
+TEST_TEAR_DOWN(replace_voters)
+{
+    struct replace_voters__fixture *f = data;
+    RAFT_TEAR_DOWN(f);
+    free(f);
+}
+
+TEST_GROUP(replace_voters, error);
+TEST_GROUP(replace_voters, success);
+
+/* Trying to promote a server which is already voting results in an error. */
+TEST_CASE(replace_voters, error, already_voting, NULL)
+{
+    struct replace_voters__fixture *f = data;
+    unsigned promote[] = {2};
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_replace_voters(&f->raft, promote, 1, NULL, 0);
+    munit_assert_int(rv, ==, RAFT_EALREADYVOTING);
+
+    return MUNIT_OK;
+}
+
+/* Trying to remove all voters results in an error. */
+TEST_CASE(replace_voters, error, no_voters, NULL)
+{
+    struct replace_voters__fixture *f = data;
+    unsigned remove[] = {1, 2};
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_replace_voters(&f->raft, NULL, 0, remove, 2);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+    munit_assert_false(configuration__is_joint(&f->raft.configuration));
+
+    return MUNIT_OK;
+}
+
+/* The joint configuration is committed only once both the old and the new
+ * voters have a majority, then the leader appends the final configuration and
+ * no other change can be made until it's committed too. */
+TEST_CASE(replace_voters, success, committed, NULL)
+{
+    struct replace_voters__fixture *f = data;
+    unsigned promote[] = {3, 4};
+    unsigned remove[] = {2};
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 4, 1, 2);
+    test_become_leader(&f->raft);
+
+    rv = raft_replace_voters(&f->raft, promote, 2, remove, 1);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_true(configuration__is_joint(&f->raft.configuration));
+    munit_assert_int(f->raft.configuration.n_outgoing, ==, 1);
+    munit_assert_int(f->raft.configuration.n_incoming, ==, 2);
+    __assert_configuration_indexes(f, 1, 2);
+    __assert_io(f, 1, 3);
+
+    /* A majority of the new voters isn't enough. */
+    __handle_append_entries_response(f, 3, 2, true, 2);
+    __assert_configuration_indexes(f, 1, 2);
+
+    rv = raft_add_server(&f->raft, 5, "5");
+    munit_assert_int(rv, ==, RAFT_ERR_CONFIGURATION_BUSY);
+
+    /* Once the old voters have a majority too, the final configuration gets
+     * appended. */
+    __handle_append_entries_response(f, 2, 2, true, 2);
+    __assert_configuration_indexes(f, 2, 3);
+
+    munit_assert_false(configuration__is_joint(&f->raft.configuration));
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(f->raft.configuration.n_voting, ==, 3);
+    munit_assert_ptr_null(configuration__get(&f->raft.configuration, 2));
+    __assert_io(f, 1, 2);
+
+    __handle_append_entries_response(f, 4, 2, true, 3);
+    __assert_configuration_indexes(f, 3, 0);
+
+    return MUNIT_OK;
+}
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 #include "../../src/byte.h"
 
 #include "../lib/configuration.h"
@@ -214,6 +216,52 @@ TEST_CASE(index_of_voting, non_voting, NULL)
     return MUNIT_OK;
 }
 
+/* Check the cached lookups of a large configuration against a linear scan. */
+static void assert_lookups(struct raft_configuration *c)
+{
+    unsigned i;
+    unsigned j = 0;
+    for (i = 0; i < c->n; i++) {
+        unsigned id = c->servers[i].id;
+        munit_assert_int(configuration__index_of(c, id), ==, i);
+        if (c->servers[i].voting) {
+            munit_assert_int(configuration__index_of_voting(c, id), ==, j);
+            j++;
+        } else {
+            munit_assert_int(configuration__index_of_voting(c, id), ==, c->n);
+        }
+    }
+    munit_assert_int(configuration__n_voting(c), ==, j);
+    munit_assert_int(configuration__index_of(c, 1000), ==, c->n);
+}
+
+/* Large configurations use a lookup table, which is kept up-to-date when
+ * servers are added, removed or change their voting flag. */
+TEST_CASE(index_of_voting, large, NULL)
+{
+    struct fixture *f = data;
+    char address[32];
+    unsigned i;
+    (void)params;
+
+    for (i = 40; i > 0; i--) {
+        sprintf(address, "192.168.1.%u:666", i);
+        ADD(i, address, i % 3 != 0);
+    }
+    assert_lookups(&f->configuration);
+
+    configuration__set_voting(&f->configuration, 5, false);
+    configuration__set_voting(&f->configuration, 7, true);
+    assert_lookups(&f->configuration);
+
+    REMOVE(40);
+    REMOVE(17);
+    REMOVE(1);
+    assert_lookups(&f->configuration);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * configuration__get
@@ -362,6 +410,53 @@ TEST_CASE(add, two, NULL)
     return MUNIT_OK;
 }
 
+/* Add a witness, which is a voting server. */
+TEST_CASE(add, witness, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    ADD(1, "127.0.0.1:666", true);
+    rv = raft_configuration_add_witness(&f->configuration, 2,
+                                        "192.168.1.1:666");
+    munit_assert_int(rv, ==, 0);
+
+    ASSERT_N(2);
+    ASSERT_SERVER(1, 2, "192.168.1.1:666", true);
+    munit_assert_false(configuration__is_witness(&f->configuration, 1));
+    munit_assert_true(configuration__is_witness(&f->configuration, 2));
+    munit_assert_int(N_VOTING, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Setting the priority of an unknown server or a priority which is too high
+ * fails. */
+TEST_CASE(add, priority, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    ADD(1, "127.0.0.1:666", true);
+
+    rv = raft_configuration_set_priority(&f->configuration, 1, 3);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->configuration.servers[0].priority, ==, 3);
+
+    rv = raft_configuration_set_priority(&f->configuration, 2, 3);
+    munit_assert_int(rv, ==, RAFT_EBADID);
+
+    rv = raft_configuration_set_priority(&f->configuration, 1,
+                                         RAFT_MAX_PRIORITY + 1);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    return MUNIT_OK;
+}
+
 TEST_GROUP(add, error);
 
 /* Add a server with an ID which is already in use. */
@@ -715,6 +810,125 @@ TEST_CASE(decode, two_servers, NULL)
     return MUNIT_OK;
 }
 
+/* A witness is encoded with a distinct value of the voting flag, and decoded
+ * back as a voting witness. */
+TEST_CASE(decode, witness, NULL)
+{
+    struct fixture *f = data;
+    struct raft_configuration configuration;
+    struct raft_buffer buf;
+    uint8_t *bytes;
+    int rv;
+
+    (void)params;
+
+    ADD(1, "127.0.0.1:666", true);
+    rv = raft_configuration_add_witness(&f->configuration, 2,
+                                        "192.168.1.1:666");
+    munit_assert_int(rv, ==, 0);
+
+    rv = configuration__encode(&f->configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+    bytes = buf.base;
+    bytes += 1 + 8 + 8 + strlen("127.0.0.1:666") + 1 + 1; /* Server 2 */
+    munit_assert_int(bytes[8 + strlen("192.168.1.1:666") + 1], ==, 2);
+
+    raft_configuration_init(&configuration);
+    rv = configuration__decode(&buf, &configuration);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(configuration.n, ==, 2);
+    munit_assert_true(configuration.servers[0].voting);
+    munit_assert_false(configuration.servers[0].witness);
+    munit_assert_true(configuration.servers[1].voting);
+    munit_assert_true(configuration.servers[1].witness);
+
+    raft_configuration_close(&configuration);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Election priorities switch the encoding to the second format, and are
+ * decoded back. */
+TEST_CASE(decode, priority, NULL)
+{
+    struct fixture *f = data;
+    struct raft_configuration configuration;
+    struct raft_buffer buf;
+    uint8_t *bytes;
+    int rv;
+
+    (void)params;
+
+    ADD(1, "127.0.0.1:666", true);
+    ADD(2, "192.168.1.1:666", true);
+    rv = raft_configuration_set_priority(&f->configuration, 2, 7);
+    munit_assert_int(rv, ==, 0);
+
+    rv = configuration__encode(&f->configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+    bytes = buf.base;
+    munit_assert_int(bytes[0], ==, 2);
+
+    raft_configuration_init(&configuration);
+    rv = configuration__decode(&buf, &configuration);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(configuration.n, ==, 2);
+    munit_assert_int(configuration.servers[0].priority, ==, 0);
+    munit_assert_int(configuration.servers[1].priority, ==, 7);
+    munit_assert_string_equal(configuration.servers[1].address,
+                              "192.168.1.1:666");
+
+    raft_configuration_close(&configuration);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Joint configurations use the third format, with one role byte per side, and
+ * are decoded back. */
+TEST_CASE(decode, joint, NULL)
+{
+    struct fixture *f = data;
+    struct raft_configuration configuration;
+    struct raft_buffer buf;
+    uint8_t *bytes;
+    int rv;
+
+    (void)params;
+
+    ADD(1, "127.0.0.1:666", true);
+    ADD(2, "192.168.1.1:666", true);
+    ADD(3, "192.168.1.2:666", true);
+    configuration__set_joint(&f->configuration, 1, RAFT_OUTGOING);
+    configuration__set_joint(&f->configuration, 2, RAFT_INCOMING);
+    munit_assert_true(configuration__is_joint(&f->configuration));
+
+    rv = configuration__encode(&f->configuration, &buf);
+    munit_assert_int(rv, ==, 0);
+    bytes = buf.base;
+    munit_assert_int(bytes[0], ==, 3);
+
+    raft_configuration_init(&configuration);
+    rv = configuration__decode(&buf, &configuration);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(configuration.n, ==, 3);
+    munit_assert_int(configuration.n_voting, ==, 3);
+    munit_assert_int(configuration.n_outgoing, ==, 1);
+    munit_assert_int(configuration.n_incoming, ==, 1);
+    munit_assert_int(configuration.servers[0].joint, ==, 0);
+    munit_assert_int(configuration.servers[1].joint, ==, RAFT_OUTGOING);
+    munit_assert_int(configuration.servers[2].joint, ==, RAFT_INCOMING);
+
+    raft_configuration_close(&configuration);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
 TEST_GROUP(decode, error);
 
 /* Not enough memory of the servers array. */
@@ -43,14 +43,18 @@ static void tear_down(void *data)
 
 /**
  * Set the state of the fixture's raft instance to #RAFT_CANDIDATE, and
- * initialize the votes array.
+ * initialize the votes bitset.
  */
-#define __set_state_to_candidate(F)                                           \
-    {                                                                         \
-        int n_voting = configuration__n_voting(&F->raft.configuration);       \
-                                                                              \
-        F->raft.state = RAFT_CANDIDATE;                                       \
-        F->raft.candidate_state.votes = raft_malloc(n_voting * sizeof(bool)); \
+#define __set_state_to_candidate(F)                                      \
+    {                                                                    \
+        F->raft.state = RAFT_CANDIDATE;                                  \
+        F->raft.candidate_state.votes_inline = 0;                        \
+        F->raft.candidate_state.votes =                                  \
+            &F->raft.candidate_state.votes_inline;                       \
+        F->raft.candidate_state.n_votes_old = 0;                         \
+        F->raft.candidate_state.n_votes_new = 0;                         \
+        F->raft.candidate_state.in_pre_vote = false;                     \
+        F->raft.candidate_state.disrupt_leader = false;                  \
     }
 
 /**
@@ -85,6 +89,28 @@ TEST_CASE(reset_timer, success, range, NULL)
     return MUNIT_OK;
 }
 
+/* If a voting server has a higher priority than ours, the timer is delayed in
+ * proportion to the difference. */
+TEST_CASE(reset_timer, success, priority, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->raft.configuration.servers[1].priority = 2;
+
+    raft_election__reset_timer(&f->raft);
+
+    munit_assert_int(f->raft.election_timeout_rand, >=,
+                     f->raft.election_timeout * 2);
+
+    munit_assert_int(f->raft.election_timeout_rand, <=,
+                     f->raft.election_timeout * 3);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_election__start
  */
@@ -122,6 +148,66 @@ TEST_CASE(start, send_request_vote_rpcs, NULL)
     return MUNIT_OK;
 }
 
+/* If the I/O backend persists the term and vote asynchronously, the vote
+ * requests are sent only once they are durable. */
+TEST_CASE(start, async_meta, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    f->io.version = 2;
+
+    __set_state_to_candidate(f);
+
+    rv = raft_election__start(&f->raft);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+    munit_assert_int(raft_io_stub_term(&f->io), ==, 1);
+
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_term(&f->io), ==, 2);
+    munit_assert_int(raft_io_stub_vote(&f->io), ==, 1);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->request_vote.term, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the I/O backend can persist the term and the vote at once, a single write
+ * is made, and the operation following it is the vote request. */
+TEST_CASE(start, term_and_vote, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 16;
+    f->io.set_meta = NULL;
+
+    __set_state_to_candidate(f);
+
+    /* Fail the send, which is ignored. */
+    raft_io_stub_fault(&f->io, 1, 1);
+
+    rv = raft_election__start(&f->raft);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_term(&f->io), ==, 2);
+    munit_assert_int(raft_io_stub_vote(&f->io), ==, 1);
+
+    return MUNIT_OK;
+}
+
 TEST_GROUP(start, error);
 
 /* An error occurs while persisting the new term. */
@@ -184,6 +270,36 @@ TEST_CASE(start, error, send_io_err, NULL)
     return MUNIT_OK;
 }
 
+/**
+ * raft_election__tally
+ */
+
+TEST_SUITE(tally);
+
+TEST_SETUP(tally, setup);
+TEST_TEAR_DOWN(tally, tear_down);
+
+/* A vote granted twice by the same server is counted once. */
+TEST_CASE(tally, duplicate, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 5, 1, 5);
+
+    __set_state_to_candidate(f);
+
+    munit_assert_false(raft_election__tally(&f->raft, 0));
+    munit_assert_false(raft_election__tally(&f->raft, 1));
+    munit_assert_false(raft_election__tally(&f->raft, 1));
+    munit_assert_int(f->raft.candidate_state.votes[0], ==, 3);
+
+    munit_assert_true(raft_election__tally(&f->raft, 2));
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_election__vote
  */
@@ -212,6 +328,8 @@ TEST_CASE(vote, success, newer_term, NULL)
     args.candidate_id = 2;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     rv = raft_election__vote(&f->raft, &args, &granted);
     munit_assert_int(rv, ==, 0);
@@ -237,6 +355,8 @@ TEST_CASE(vote, error, io_err, NULL)
     args.candidate_id = 2;
     args.last_log_index = 1;
     args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = false;
 
     raft_io_stub_fault(&f->io, 0, 1);
 
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "../../src/entry.h"
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(entry);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    FIXTURE_HEAP;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    SETUP_HEAP;
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    TEAR_DOWN_HEAP;
+    free(f);
+}
+
+/**
+ * entry__pack and entry__unpack
+ */
+
+TEST_SUITE(pack);
+
+TEST_SETUP(pack, setup);
+TEST_TEAR_DOWN(pack, tear_down);
+
+TEST_GROUP(pack, success);
+TEST_GROUP(pack, error);
+
+/* Commands are unpacked as they were packed, each padded to 8 bytes. */
+TEST_CASE(pack, success, round_trip, NULL)
+{
+    struct raft_buffer bufs[2];
+    struct raft_buffer *unpacked;
+    struct raft_buffer buf;
+    unsigned n;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    bufs[0].base = "hello";
+    bufs[0].len = 5;
+    bufs[1].base = "raft batches";
+    bufs[1].len = 12;
+
+    rv = entry__pack(bufs, 2, &buf);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(buf.len, ==, 8 + 2 * 8 + 8 + 16);
+
+    rv = entry__unpack(&buf, &unpacked, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(unpacked[0].len, ==, 5);
+    munit_assert_memory_equal(5, unpacked[0].base, "hello");
+    munit_assert_int(unpacked[1].len, ==, 12);
+    munit_assert_memory_equal(12, unpacked[1].base, "raft batches");
+
+    raft_free(unpacked);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* A command whose size exceeds the payload is rejected. */
+TEST_CASE(pack, error, truncated, NULL)
+{
+    struct raft_buffer cmd;
+    struct raft_buffer *unpacked;
+    struct raft_buffer buf;
+    unsigned n;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    cmd.base = "hello";
+    cmd.len = 5;
+
+    rv = entry__pack(&cmd, 1, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    buf.len -= 8;
+    rv = entry__unpack(&buf, &unpacked, &n);
+    munit_assert_int(rv, ==, RAFT_EMALFORMED);
+
+    buf.len = 4;
+    rv = entry__unpack(&buf, &unpacked, &n);
+    munit_assert_int(rv, ==, RAFT_EMALFORMED);
+
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
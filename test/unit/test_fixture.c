@@ -193,3 +193,139 @@ TEST_CASE(step_until_applied, two, NULL)
     free(req2);
     return MUNIT_OK;
 }
+
+/* Disk writes complete only after the sync latency of the disk model. */
+TEST_CASE(step_until_applied, disk, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    raft_time start;
+    unsigned i;
+    (void)params;
+    ELECT(0);
+    for (i = 0; i < N_SERVERS; i++) {
+        raft_fixture_set_disk(&f->fixture, i, 50, 50, 0, 1);
+    }
+    start = f->fixture.time;
+    APPLY(0, req);
+    STEP_UNTIL_APPLIED(2);
+    munit_assert_int(f->fixture.time - start, >=, 50);
+    ASSERT_FSM_X(0, 1);
+    ASSERT_FSM_X(1, 1);
+    ASSERT_FSM_X(2, 1);
+    free(req);
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * raft_fixture_step
+ *
+ *****************************************************************************/
+
+TEST_SUITE(step_to);
+TEST_SETUP(step_to, setup);
+TEST_TEAR_DOWN(step_to, tear_down);
+
+/* The time doesn't go past the given one, even if no event is due by then. */
+TEST_CASE(step_to, before_next_event, NULL)
+{
+    struct fixture *f = data;
+    raft_time time;
+    (void)params;
+    ELECT(0);
+    time = f->fixture.time + 1;
+    raft_fixture_step_to(&f->fixture, time);
+    munit_assert_int(f->fixture.time, ==, time);
+    raft_fixture_step_to(&f->fixture, time);
+    munit_assert_int(f->fixture.time, >, time);
+    ASSERT_STATE(0, RAFT_LEADER);
+    return MUNIT_OK;
+}
+
+/* Entries applied at the given time are committed as if submitted then. */
+TEST_CASE(step_to, apply, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    raft_time time;
+    (void)params;
+    ELECT(0);
+    time = f->fixture.time + 3;
+    while (f->fixture.time < time) {
+        raft_fixture_step_to(&f->fixture, time);
+    }
+    munit_assert_int(f->fixture.time, ==, time);
+    APPLY(0, req);
+    STEP_UNTIL_APPLIED(2);
+    ASSERT_FSM_X(2, 1);
+    free(req);
+    return MUNIT_OK;
+}
+
+#define N_LARGE 50
+
+struct large_fixture
+{
+    struct raft_fsm fsms[N_LARGE];
+    struct raft_fixture fixture;
+};
+
+TEST_SUITE(step);
+
+TEST_SETUP(step)
+{
+    struct large_fixture *f = munit_malloc(sizeof *f);
+    struct raft_configuration configuration;
+    unsigned i;
+    int rc;
+    (void)user_data;
+    for (i = 0; i < N_LARGE; i++) {
+        test_fsm_setup(params, &f->fsms[i]);
+    }
+    rc = raft_fixture_init(&f->fixture, N_LARGE, f->fsms);
+    munit_assert_int(rc, ==, 0);
+    for (i = 0; i < N_LARGE; i++) {
+        raft_fixture_set_random(&f->fixture, i, munit_rand_int_range);
+        raft_set_log_level(raft_fixture_get(&f->fixture, i), RAFT_ERROR);
+    }
+    rc = raft_fixture_configuration(&f->fixture, N_LARGE, &configuration);
+    munit_assert_int(rc, ==, 0);
+    rc = raft_fixture_bootstrap(&f->fixture, &configuration);
+    munit_assert_int(rc, ==, 0);
+    raft_configuration_close(&configuration);
+    rc = raft_fixture_start(&f->fixture);
+    munit_assert_int(rc, ==, 0);
+    return f;
+}
+
+TEST_TEAR_DOWN(step)
+{
+    struct large_fixture *f = data;
+    unsigned i;
+    raft_fixture_close(&f->fixture);
+    for (i = 0; i < N_LARGE; i++) {
+        test_fsm_tear_down(&f->fsms[i]);
+    }
+    free(f);
+}
+
+/* A large cluster elects a stable leader, replicates entries to everyone and
+ * keeps the same leader for ten minutes of simulated time. */
+TEST_CASE(step, large_cluster, NULL)
+{
+    struct large_fixture *f = data;
+    struct raft_apply *req = munit_malloc(sizeof *req);
+    unsigned leader;
+    (void)params;
+    munit_assert_true(raft_fixture_step_until_has_leader(&f->fixture, 10000));
+    leader = raft_fixture_leader_index(&f->fixture);
+    APPLY(leader, req);
+    munit_assert_true(
+        raft_fixture_step_until_applied(&f->fixture, N_LARGE, 2, 5000));
+    raft_fixture_step_until_elapsed(&f->fixture, 10 * 60 * 1000);
+    munit_assert_int(raft_fixture_leader_index(&f->fixture), ==, leader);
+    ASSERT_FSM_X(N_LARGE - 1, 1);
+    free(req);
+    return MUNIT_OK;
+}
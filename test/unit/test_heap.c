@@ -0,0 +1,124 @@
+#include <stdlib.h>
+
+#include "../../include/raft.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(heap);
+
+/**
+ * Helpers
+ */
+
+/* Allocator counting the blocks it has handed out. */
+struct counter
+{
+    struct raft_heap heap;
+    int n;
+};
+
+static void *counter_malloc(void *data, size_t size)
+{
+    struct counter *c = data;
+    c->n++;
+    return malloc(size);
+}
+
+static void counter_free(void *data, void *ptr)
+{
+    struct counter *c = data;
+    c->n--;
+    free(ptr);
+}
+
+static void counter_init(struct counter *c)
+{
+    c->heap.data = c;
+    c->heap.malloc = counter_malloc;
+    c->heap.free = counter_free;
+    c->heap.calloc = NULL;
+    c->heap.realloc = NULL;
+    c->heap.aligned_alloc = NULL;
+    c->n = 0;
+}
+
+struct fixture
+{
+    struct counter global;
+    struct counter thread;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    (void)params;
+    (void)user_data;
+    counter_init(&f->global);
+    counter_init(&f->thread);
+    raft_heap_set(&f->global.heap);
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    raft_heap_set_thread(NULL);
+    raft_heap_set_default();
+    free(f);
+}
+
+/**
+ * raft_heap_set_thread
+ */
+
+TEST_SUITE(set_thread);
+
+TEST_SETUP(set_thread, setup);
+TEST_TEAR_DOWN(set_thread, tear_down);
+
+TEST_GROUP(set_thread, success);
+
+/* The heap of the calling thread overrides the process-wide one. */
+TEST_CASE(set_thread, success, override, NULL)
+{
+    struct fixture *f = data;
+    void *ptr;
+
+    (void)params;
+
+    raft_heap_set_thread(&f->thread.heap);
+
+    ptr = raft_malloc(8);
+    munit_assert_ptr_not_null(ptr);
+
+    munit_assert_int(f->thread.n, ==, 1);
+    munit_assert_int(f->global.n, ==, 0);
+
+    raft_free(ptr);
+
+    munit_assert_int(f->thread.n, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Clearing the heap of the calling thread restores the process-wide one. */
+TEST_CASE(set_thread, success, clear, NULL)
+{
+    struct fixture *f = data;
+    void *ptr;
+
+    (void)params;
+
+    raft_heap_set_thread(&f->thread.heap);
+    raft_heap_set_thread(NULL);
+
+    ptr = raft_malloc(8);
+    munit_assert_ptr_not_null(ptr);
+
+    munit_assert_int(f->thread.n, ==, 0);
+    munit_assert_int(f->global.n, ==, 1);
+
+    raft_free(ptr);
+
+    return MUNIT_OK;
+}
@@ -0,0 +1,100 @@
+#include "../../src/interval.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(interval);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    struct raft_interval interval;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    (void)params;
+    (void)user_data;
+    interval__init(&f->interval);
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    free(f);
+}
+
+/* Add a sample and assert the resulting bound. */
+#define __sample(F, MSECS, BOUND)                  \
+    interval__sample(&F->interval, MSECS);         \
+    munit_assert_int(interval__bound(&F->interval), ==, BOUND)
+
+/**
+ * interval__sample
+ */
+
+TEST_SUITE(sample);
+
+TEST_SETUP(sample, setup);
+TEST_TEAR_DOWN(sample, tear_down);
+
+TEST_GROUP(sample, success);
+
+/* An estimate without samples has no bound. */
+TEST_CASE(sample, success, none, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    munit_assert_int(interval__bound(&f->interval), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* The first sample sets the mean, with a deviation of half of it. */
+TEST_CASE(sample, success, first, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __sample(f, 100, 300);
+
+    return MUNIT_OK;
+}
+
+/* Stable samples shrink the deviation, while outliers widen it. */
+TEST_CASE(sample, success, smooth, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __sample(f, 100, 300);
+    __sample(f, 100, 250);
+    __sample(f, 200, 325);
+
+    return MUNIT_OK;
+}
+
+/* Samples shorter than the mean bring it down. */
+TEST_CASE(sample, success, decrease, NULL)
+{
+    struct fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    __sample(f, 100, 300);
+    for (i = 0; i < 100; i++) {
+        interval__sample(&f->interval, 10);
+    }
+    munit_assert_int(interval__bound(&f->interval), <, 20);
+
+    return MUNIT_OK;
+}
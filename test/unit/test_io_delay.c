@@ -0,0 +1,314 @@
+#include "../../include/raft.h"
+#include "../../include/raft/io_delay.h"
+#include "../../include/raft/io_stub.h"
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(io_delay);
+
+/*******************************************************************************
+ *
+ * Helpers
+ *
+ ******************************************************************************/
+
+struct fixture
+{
+    struct raft_heap heap;
+    struct raft_io stub;
+    struct raft_io io;
+    struct raft_io_send req;
+    struct raft_message message;
+    struct raft_entry entry;
+    bool closed;
+    struct
+    {
+        int invoked;
+        int status;
+    } append_cb;
+    struct
+    {
+        int invoked;
+        int status;
+    } send_cb;
+};
+
+static void __tick_cb(struct raft_io *io)
+{
+    (void)io;
+}
+
+static void __recv_cb(struct raft_io *io, struct raft_message *message)
+{
+    (void)io;
+    (void)message;
+}
+
+static void __append_cb(void *data, const int status)
+{
+    struct fixture *f = data;
+
+    f->append_cb.invoked++;
+    f->append_cb.status = status;
+}
+
+static void __send_cb(struct raft_io_send *req, const int status)
+{
+    struct fixture *f = req->data;
+
+    f->send_cb.invoked++;
+    f->send_cb.status = status;
+}
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    int rv;
+
+    (void)user_data;
+
+    test_heap_setup(params, &f->heap);
+
+    rv = raft_io_stub_init(&f->stub);
+    munit_assert_int(rv, ==, 0);
+
+    rv = raft_io_delay_init(&f->io, &f->stub);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.init(&f->io, 1, "1");
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.start(&f->io, 50, __tick_cb, __recv_cb);
+    munit_assert_int(rv, ==, 0);
+
+    f->io.data = f;
+    f->req.data = f;
+
+    f->entry.term = 1;
+    f->entry.type = RAFT_COMMAND;
+    f->entry.buf.base = munit_malloc(1);
+    f->entry.buf.len = 1;
+    f->entry.batch = NULL;
+
+    f->message.type = RAFT_IO_APPEND_ENTRIES;
+    f->message.server_id = 2;
+    f->message.server_address = "2";
+    f->message.append_entries.term = 1;
+    f->message.append_entries.leader_id = 1;
+    f->message.append_entries.prev_log_index = 1;
+    f->message.append_entries.prev_log_term = 1;
+    f->message.append_entries.leader_commit = 1;
+    f->message.append_entries.entries = &f->entry;
+    f->message.append_entries.n_entries = 1;
+    f->message.append_entries.hibernate = false;
+    f->message.append_entries.seq = 0;
+
+    f->closed = false;
+
+    f->append_cb.invoked = 0;
+    f->append_cb.status = -1;
+
+    f->send_cb.invoked = 0;
+    f->send_cb.status = -1;
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    if (!f->closed) {
+        f->io.close(&f->io, NULL);
+    }
+    raft_io_delay_close(&f->io);
+    raft_io_stub_close(&f->stub);
+    free(f->entry.buf.base);
+    test_heap_tear_down(&f->heap);
+    free(f);
+}
+
+/* Advance the time of the inner stub instance. */
+#define __advance(F, MSECS)                    \
+    {                                          \
+        raft_io_stub_advance(&F->stub, MSECS); \
+    }
+
+/* Send the fixture message to the server with the given ID. */
+#define __send(F, ID)                                                     \
+    {                                                                     \
+        F->message.server_id = ID;                                        \
+        munit_assert_int(F->io.send(&F->io, &F->req, &F->message,         \
+                                    __send_cb),                           \
+                         ==, 0);                                          \
+    }
+
+/* Assert the number of messages handed over to the inner stub instance and not
+ * yet flushed. */
+#define __assert_sending(F, N) \
+    munit_assert_int(raft_io_stub_n_sending(&F->stub), ==, N)
+
+/*******************************************************************************
+ *
+ * raft_io->send
+ *
+ ******************************************************************************/
+
+TEST_SUITE(send);
+
+TEST_SETUP(send, setup);
+TEST_TEAR_DOWN(send, tear_down);
+
+TEST_GROUP(send, success);
+
+/* Without network settings, messages are handed over right away. */
+TEST_CASE(send, success, passthrough, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __send(f, 2);
+    __assert_sending(f, 1);
+
+    raft_io_stub_flush_all(&f->stub);
+    munit_assert_int(f->send_cb.invoked, ==, 1);
+    munit_assert_int(f->send_cb.status, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* A message is handed over once the latency of its link has elapsed. */
+TEST_CASE(send, success, latency, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_delay_set_network(&f->io, 0, 30, 30, 0);
+    munit_assert_int(rv, ==, 0);
+
+    __send(f, 2);
+    __assert_sending(f, 0);
+
+    __advance(f, 29);
+    __assert_sending(f, 0);
+
+    __advance(f, 1);
+    __assert_sending(f, 1);
+
+    raft_io_stub_flush_all(&f->stub);
+    munit_assert_int(f->send_cb.invoked, ==, 1);
+    munit_assert_int(f->send_cb.status, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Settings specific to a server only apply to the messages sent to it. */
+TEST_CASE(send, success, peer, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_delay_set_network(&f->io, 3, 100, 100, 0);
+    munit_assert_int(rv, ==, 0);
+
+    __send(f, 2);
+    __send(f, 3);
+    __assert_sending(f, 1);
+
+    __advance(f, 100);
+    __assert_sending(f, 2);
+
+    return MUNIT_OK;
+}
+
+/* Messages to the same server share the bandwidth of the link. */
+TEST_CASE(send, success, bandwidth, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    /* With the message header, each message transfers 1000 bytes. */
+    free(f->entry.buf.base);
+    f->entry.buf.base = munit_malloc(936);
+    f->entry.buf.len = 936;
+
+    rv = raft_io_delay_set_network(&f->io, 0, 0, 0, 10000);
+    munit_assert_int(rv, ==, 0);
+
+    __send(f, 2);
+    __send(f, 2);
+    __assert_sending(f, 0);
+
+    __advance(f, 100);
+    __assert_sending(f, 1);
+
+    __advance(f, 100);
+    __assert_sending(f, 2);
+
+    return MUNIT_OK;
+}
+
+/* Messages still held when closing are canceled. */
+TEST_CASE(send, success, close, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_delay_set_network(&f->io, 0, 30, 30, 0);
+    munit_assert_int(rv, ==, 0);
+
+    __send(f, 2);
+
+    f->io.close(&f->io, NULL);
+    f->closed = true;
+    munit_assert_int(f->send_cb.invoked, ==, 1);
+    munit_assert_int(f->send_cb.status, ==, RAFT_ERR_IO_CANCELED);
+
+    return MUNIT_OK;
+}
+
+/*******************************************************************************
+ *
+ * raft_io->append
+ *
+ ******************************************************************************/
+
+TEST_SUITE(append);
+
+TEST_SETUP(append, setup);
+TEST_TEAR_DOWN(append, tear_down);
+
+TEST_GROUP(append, success);
+
+/* The completion of a write is delayed by the disk latency. */
+TEST_CASE(append, success, latency, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    raft_io_delay_set_disk(&f->io, 20, 20, 0);
+
+    rv = f->io.append(&f->io, &f->entry, 1, f, __append_cb);
+    munit_assert_int(rv, ==, 0);
+
+    raft_io_stub_flush_all(&f->stub);
+    munit_assert_int(f->append_cb.invoked, ==, 0);
+
+    __advance(f, 20);
+    munit_assert_int(f->append_cb.invoked, ==, 1);
+    munit_assert_int(f->append_cb.status, ==, 0);
+
+    return MUNIT_OK;
+}
@@ -314,6 +314,33 @@ TEST_CASE(set_vote, pristine, NULL)
     return MUNIT_OK;
 }
 
+/*******************************************************************************
+ *
+ * raft_io->set_term_and_vote
+ *
+ ******************************************************************************/
+
+TEST_SUITE(set_term_and_vote);
+
+TEST_SETUP(set_term_and_vote, setup);
+TEST_TEAR_DOWN(set_term_and_vote, tear_down);
+
+/* Set the term and the vote on a pristine store. */
+TEST_CASE(set_term_and_vote, pristine, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    __load(f);
+
+    rv = f->io.set_term_and_vote(&f->io, 2, 3);
+    munit_assert_int(rv, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /*******************************************************************************
  *
  * raft_io->append
@@ -393,6 +420,96 @@ TEST_CASE(append, concurrent, NULL)
     return MUNIT_OK;
 }
 
+/* Submit two one-byte append requests with the disk model enabled. */
+#define __append_two(F)                                                    \
+    {                                                                      \
+        struct raft_entry entry;                                           \
+        int rv2;                                                           \
+                                                                           \
+        __load(F);                                                         \
+                                                                           \
+        entry.term = 1;                                                    \
+        entry.type = RAFT_COMMAND;                                         \
+        entry.buf.base = munit_malloc(1);                                  \
+        entry.buf.len = 1;                                                 \
+                                                                           \
+        rv2 = F->io.append(&F->io, &entry, 1, F, __append_cb);             \
+        munit_assert_int(rv2, ==, 0);                                      \
+        rv2 = F->io.append(&F->io, &entry, 1, F, __append_cb);             \
+        munit_assert_int(rv2, ==, 0);                                      \
+                                                                           \
+        raft_io_stub_flush_all(&F->io);                                    \
+        free(entry.buf.base);                                              \
+    }
+
+/* With a queue depth of one, the second write waits for the sync of the first
+ * one to complete. */
+TEST_CASE(append, disk_latency, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_stub_set_disk(&f->io, 5, 5, 0, 1);
+    __append_two(f);
+
+    munit_assert_int(f->append_cb.invoked, ==, 0);
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 2);
+    munit_assert_int(raft_io_stub_next_complete_timeout(&f->io), ==, 5);
+
+    __advance(f, 4);
+    munit_assert_int(f->append_cb.invoked, ==, 0);
+
+    __advance(f, 1);
+    munit_assert_int(f->append_cb.invoked, ==, 1);
+    munit_assert_int(f->append_cb.status, ==, 0);
+    munit_assert_int(raft_io_stub_next_complete_timeout(&f->io), ==, 5);
+
+    __advance(f, 5);
+    munit_assert_int(f->append_cb.invoked, ==, 2);
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 0);
+    munit_assert_int(raft_io_stub_next_complete_timeout(&f->io), ==, -1);
+
+    return MUNIT_OK;
+}
+
+/* With a larger queue depth, the syncs of the two writes overlap. */
+TEST_CASE(append, disk_depth, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_stub_set_disk(&f->io, 5, 5, 0, 2);
+    __append_two(f);
+
+    __advance(f, 5);
+    munit_assert_int(f->append_cb.invoked, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* The transfers of the two writes share the bandwidth. */
+TEST_CASE(append, disk_bandwidth, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_stub_set_disk(&f->io, 0, 0, 1000, 4);
+    __append_two(f);
+
+    munit_assert_int(raft_io_stub_next_complete_timeout(&f->io), ==, 1);
+
+    __advance(f, 1);
+    munit_assert_int(f->append_cb.invoked, ==, 1);
+
+    __advance(f, 1);
+    munit_assert_int(f->append_cb.invoked, ==, 2);
+
+    return MUNIT_OK;
+}
+
 /*******************************************************************************
  *
  * raft_io->send
@@ -1,11 +1,16 @@
+#include <stdio.h>
+#include <unistd.h>
+
 #include "../../include/raft.h"
 #include "../../include/raft/io_uv.h"
 
 #include "../../src/byte.h"
 #include "../../src/io_uv_encoding.h"
+#include "../../src/io_uv_metadata.h"
 
 #include "../lib/fs.h"
 #include "../lib/heap.h"
+#include "../lib/io_uv.h"
 #include "../lib/runner.h"
 #include "../lib/tcp.h"
 #include "../lib/uv.h"
@@ -40,6 +45,11 @@ struct fixture
         int status;
     } send_cb;
     struct
+    {
+        bool invoked;
+        int status;
+    } set_meta_cb;
+    struct
     {
         bool invoked;
         struct raft_message *message;
@@ -48,6 +58,10 @@ struct fixture
     {
         bool invoked;
     } stop_cb;
+    struct
+    {
+        unsigned n;
+    } wakeup_cb;
 };
 
 static void __tick_cb(struct raft_io *io)
@@ -73,6 +87,14 @@ static void __send_cb(struct raft_io_send *req, int status)
     f->send_cb.status = status;
 }
 
+static void __set_meta_cb(struct raft_io_set_meta *req, int status)
+{
+    struct fixture *f = req->data;
+
+    f->set_meta_cb.invoked = true;
+    f->set_meta_cb.status = status;
+}
+
 static void __recv_cb(struct raft_io *io, struct raft_message *message)
 {
     struct fixture *f = io->data;
@@ -125,8 +147,13 @@ static void *setup(const MunitParameter params[], void *user_data)
     f->send_cb.invoked = false;
     f->send_cb.status = -1;
 
+    f->set_meta_cb.invoked = false;
+    f->set_meta_cb.status = -1;
+
     f->stop_cb.invoked = false;
 
+    f->wakeup_cb.n = 0;
+
     return f;
 }
 
@@ -278,6 +305,111 @@ TEST_CASE(init, access_error, NULL)
     return MUNIT_OK;
 }
 
+/**
+ * raft_io_uv_set_disk_threads
+ */
+
+TEST_SUITE(set_disk_threads);
+TEST_SETUP(set_disk_threads, setup);
+TEST_TEAR_DOWN(set_disk_threads, tear_down);
+
+/* The number of threads must be between 1 and 8. */
+TEST_CASE(set_disk_threads, invalid, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_disk_threads(&f->io, 0);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_disk_threads(&f->io, 9);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    return MUNIT_OK;
+}
+
+/* The disk threads are started by raft_io->init. */
+TEST_CASE(set_disk_threads, busy, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_disk_threads(&f->io, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_BUSY);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv_set_disk_cpus
+ */
+
+TEST_SUITE(set_disk_cpus);
+TEST_SETUP(set_disk_cpus, setup);
+TEST_TEAR_DOWN(set_disk_cpus, tear_down);
+
+/* CPU numbers must be lower than 1024. */
+TEST_CASE(set_disk_cpus, invalid, NULL)
+{
+    struct fixture *f = data;
+    unsigned cpus[2] = {0, 1024};
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_disk_cpus(&f->io, cpus, 2);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    return MUNIT_OK;
+}
+
+/* The disk threads are started by raft_io->init. */
+TEST_CASE(set_disk_cpus, busy, NULL)
+{
+    struct fixture *f = data;
+    unsigned cpus[1] = {0};
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_disk_cpus(&f->io, cpus, 1);
+    munit_assert_int(rv, ==, RAFT_ERR_BUSY);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv_set_numa_node
+ */
+
+TEST_SUITE(set_numa_node);
+TEST_SETUP(set_numa_node, setup);
+TEST_TEAR_DOWN(set_numa_node, tear_down);
+
+/* The node must be -1 or between 0 and 1023. */
+TEST_CASE(set_numa_node, invalid, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_numa_node(&f->io, -2);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_numa_node(&f->io, 1024);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_numa_node(&f->io, -1);
+    munit_assert_int(rv, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_io_uv__start
  */
@@ -330,7 +462,7 @@ TEST_CASE(start, recv, NULL)
     message.server_id = 1;
     message.server_address = "127.0.0.1:9000";
 
-    rv = io_uv__encode_message(&message, &bufs, &n_bufs);
+    rv = io_uv__encode_message(&message, 0, &bufs, &n_bufs);
     munit_assert_int(rv, ==, 0);
     munit_assert_int(n_bufs, ==, 1);
 
@@ -383,6 +515,80 @@ TEST_CASE(load, pristine, NULL)
     return MUNIT_OK;
 }
 
+/* Count the batches streamed by an asynchronous load. */
+struct load__async
+{
+    unsigned n_batches;
+    size_t n_entries;
+    uint64_t last; /* Data of the last entry */
+    bool invoked;
+    int status;
+};
+
+static int load__batch_cb(struct raft_io_load *req,
+                          struct raft_entry *entries,
+                          size_t n)
+{
+    struct load__async *a = req->data;
+    void *batch = NULL;
+    size_t i;
+
+    a->n_batches++;
+    for (i = 0; i < n; i++) {
+        munit_assert_int(*(uint64_t *)entries[i].buf.base, ==, a->last + 1);
+        a->last++;
+        if (entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_free(batch);
+        }
+    }
+    a->n_entries += n;
+    raft_free(entries);
+
+    return 0;
+}
+
+static void load__cb(struct raft_io_load *req, int status)
+{
+    struct load__async *a = req->data;
+    a->invoked = true;
+    a->status = status;
+}
+
+/* Load the entries of many segments asynchronously, a few segments at a
+ * time. */
+TEST_CASE(load, async, NULL)
+{
+    struct fixture *f = data;
+    struct load__async a = {0, 0, 0, false, -1};
+    struct raft_io_load req;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    for (i = 0; i < 20; i++) {
+        test_io_uv_write_closed_segment_file(f->dir, i + 1, 1, i + 1);
+    }
+
+    req.data = &a;
+    rv = f->io.load_async(&f->io, &req, load__batch_cb, load__cb);
+    munit_assert_int(rv, ==, 0);
+
+    for (i = 0; i < 10 && !a.invoked; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+
+    munit_assert_true(a.invoked);
+    munit_assert_int(a.status, ==, 0);
+    munit_assert_int(a.n_batches, ==, 2);
+    munit_assert_int(a.n_entries, ==, 20);
+    munit_assert_int(req.term, ==, 0);
+    munit_assert_ptr_null(req.snapshot);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_io_uv__bootstrap
  */
@@ -440,6 +646,48 @@ TEST_CASE(set_term, term, NULL)
     return MUNIT_OK;
 }
 
+/* The term set before moving the metadata to its own directory is carried
+ * over, and later changes are written there. */
+TEST_CASE(set_term, metadata_dir, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__metadata metadata;
+    raft_term term;
+    unsigned voted_for;
+    struct raft_snapshot *snapshot;
+    struct raft_entry *entries;
+    size_t n_entries;
+    char dir[1024];
+    int rv;
+
+    (void)params;
+
+    rv = f->io.set_term(&f->io, 2);
+    munit_assert_int(rv, ==, 0);
+
+    sprintf(dir, "%s/metadata", f->dir);
+    rv = raft_io_uv_set_metadata_dir(&f->io, dir);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &entries,
+                    &n_entries);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(term, ==, 2);
+
+    rv = f->io.set_term(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    rv = io_uv__metadata_load(&f->io, dir, &metadata);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(metadata.term, ==, 3);
+
+    rv = io_uv__metadata_load(&f->io, f->dir, &metadata);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(metadata.term, ==, 2);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_io_uv__set_vote
  */
@@ -467,6 +715,111 @@ TEST_CASE(set_vote, pristine, NULL)
     return MUNIT_OK;
 }
 
+/**
+ * raft_io_uv__set_term_and_vote
+ */
+
+TEST_SUITE(set_term_and_vote);
+TEST_SETUP(set_term_and_vote, setup);
+TEST_TEAR_DOWN(set_term_and_vote, tear_down);
+
+/* Set both the term and the vote, which end up in the same metadata file. */
+TEST_CASE(set_term_and_vote, pristine, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__metadata metadata;
+    int rv;
+
+    (void)params;
+
+    __load(f);
+
+    rv = f->io.set_term_and_vote(&f->io, 2, 3);
+    munit_assert_int(rv, ==, 0);
+
+    rv = io_uv__metadata_load(&f->io, f->dir, &metadata);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(metadata.term, ==, 2);
+    munit_assert_int(metadata.voted_for, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv__set_commit
+ */
+
+TEST_SUITE(set_commit);
+TEST_SETUP(set_commit, setup);
+TEST_TEAR_DOWN(set_commit, tear_down);
+
+/* The commit index is written along with the next metadata change. */
+TEST_CASE(set_commit, piggyback, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__metadata metadata;
+    int rv;
+
+    (void)params;
+
+    __load(f);
+
+    munit_assert_int(f->io.version, >=, 8);
+    munit_assert_int(f->io.load_commit(&f->io), ==, 0);
+
+    f->io.set_commit(&f->io, 5);
+
+    rv = f->io.set_term(&f->io, 2);
+    munit_assert_int(rv, ==, 0);
+
+    rv = io_uv__metadata_load(&f->io, f->dir, &metadata);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(metadata.term, ==, 2);
+    munit_assert_int(metadata.commit, ==, 5);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv__set_meta
+ */
+
+TEST_SUITE(set_meta);
+TEST_SETUP(set_meta, setup);
+TEST_TEAR_DOWN(set_meta, tear_down);
+
+/* The metadata is written in a disk thread and the callback fires once it's
+ * durable. */
+TEST_CASE(set_meta, pristine, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__metadata metadata;
+    struct raft_io_set_meta req;
+    int rv;
+
+    (void)params;
+
+    __load(f);
+
+    munit_assert_int(f->io.version, >=, 2);
+
+    req.data = f;
+    rv = f->io.set_meta(&f->io, &req, 2, 3, __set_meta_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run(&f->loop, 1);
+
+    munit_assert_true(f->set_meta_cb.invoked);
+    munit_assert_int(f->set_meta_cb.status, ==, 0);
+
+    rv = io_uv__metadata_load(&f->io, f->dir, &metadata);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(metadata.term, ==, 2);
+    munit_assert_int(metadata.voted_for, ==, 3);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_io_uv__append
  */
@@ -537,3 +890,431 @@ TEST_CASE(send, first, NULL)
 
     return MUNIT_OK;
 }
+
+/**
+ * raft_io_uv__defer
+ */
+
+TEST_SUITE(defer);
+TEST_SETUP(defer, setup);
+TEST_TEAR_DOWN(defer, tear_down);
+
+static void __defer_cb(struct raft_io_defer *req)
+{
+    unsigned *n = req->data;
+    (*n)++;
+}
+
+/* Deferred requests are fired at the end of the loop iteration. */
+TEST_CASE(defer, success, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_defer req1;
+    struct raft_io_defer req2;
+    unsigned n = 0;
+    int rv;
+
+    (void)params;
+
+    req1.data = &n;
+    req2.data = &n;
+
+    rv = f->io.defer(&f->io, &req1, __defer_cb);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->io.defer(&f->io, &req2, __defer_cb);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n, ==, 0);
+
+    test_uv_run(&f->loop, 1);
+
+    munit_assert_int(n, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv_set_stall_threshold
+ */
+
+TEST_SUITE(set_stall_threshold);
+TEST_SETUP(set_stall_threshold, setup);
+TEST_TEAR_DOWN(set_stall_threshold, tear_down);
+
+static void __stall_defer_cb(struct raft_io_defer *req)
+{
+    (void)req;
+    usleep(2000);
+}
+
+static void __stall_cb(struct raft_io *io, int kind, unsigned long long usecs)
+{
+    unsigned *n = io->data;
+    if (kind == RAFT_IO_UV_STALL_DEFER) {
+        munit_assert_int(usecs, >=, 2000);
+        (*n)++;
+    }
+}
+
+/* A callback running longer than the threshold is reported as a stall, and so
+ * is the loop iteration that ran it. */
+TEST_CASE(set_stall_threshold, defer, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_uv_stats stats;
+    struct raft_io_defer req;
+    unsigned n = 0;
+    int rv;
+
+    (void)params;
+
+    raft_io_uv_set_stall_threshold(&f->io, 1000, __stall_cb);
+    f->io.data = &n;
+
+    test_uv_run(&f->loop, 1);
+
+    rv = f->io.defer(&f->io, &req, __stall_defer_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run(&f->loop, 2);
+
+    f->io.data = f;
+    munit_assert_int(n, ==, 1);
+
+    raft_io_uv_stats(&f->io, &stats);
+    munit_assert_int(stats.loop.defer.count, ==, 1);
+    munit_assert_int(stats.loop.defer.max, >=, 2000);
+    munit_assert_int(stats.loop.busy.max, >=, 2000);
+    munit_assert_int(stats.loop.n_stalls, >=, 2);
+
+    return MUNIT_OK;
+}
+
+/* By default nothing is measured. */
+TEST_CASE(set_stall_threshold, disabled, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_uv_stats stats;
+    struct raft_io_defer req;
+    int rv;
+
+    (void)params;
+
+    rv = f->io.defer(&f->io, &req, __stall_defer_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run(&f->loop, 1);
+
+    raft_io_uv_stats(&f->io, &stats);
+    munit_assert_int(stats.loop.defer.count, ==, 0);
+    munit_assert_int(stats.loop.busy.count, ==, 0);
+    munit_assert_int(stats.loop.n_stalls, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv_set_recording
+ */
+
+TEST_SUITE(set_recording);
+TEST_SETUP(set_recording, setup);
+TEST_TEAR_DOWN(set_recording, tear_down);
+
+/* Appends, their completions and messages sent are recorded in order. */
+TEST_CASE(set_recording, append_and_send, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_uv_record records[3];
+    struct raft_entry entry;
+    struct raft_message message;
+    uint8_t buf[8 + 3 * RAFT_IO_UV_RECORD_SIZE];
+    const void *cursor = buf;
+    char path[1024];
+    FILE *file;
+    size_t n;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    __load(f);
+
+    sprintf(path, "%s/trace", f->dir);
+    rv = raft_io_uv_set_recording(&f->io, path);
+    munit_assert_int(rv, ==, 0);
+
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = munit_malloc(16);
+    entry.buf.len = 16;
+
+    rv = f->io.append(&f->io, &entry, 1, f, __append_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run(&f->loop, 10);
+    munit_assert_true(f->append_cb.invoked);
+
+    message.type = RAFT_IO_REQUEST_VOTE;
+    message.server_id = 2;
+    message.server_address = f->tcp.server.address;
+
+    rv = f->io.send(&f->io, &f->req, &message, __send_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run(&f->loop, 3);
+    munit_assert_true(f->send_cb.invoked);
+
+    rv = raft_io_uv_set_recording(&f->io, NULL);
+    munit_assert_int(rv, ==, 0);
+
+    file = fopen(path, "rb");
+    munit_assert_ptr_not_null(file);
+    n = fread(buf, 1, sizeof buf, file);
+    munit_assert_int(fgetc(file), ==, EOF);
+    fclose(file);
+    munit_assert_int(n, ==, sizeof buf);
+
+    munit_assert_int(byte__get64(&cursor), ==, RAFT_IO_UV_RECORD_FORMAT);
+    for (i = 0; i < 3; i++) {
+        raft_io_uv_decode_record(buf + 8 + i * RAFT_IO_UV_RECORD_SIZE,
+                                 &records[i]);
+    }
+
+    munit_assert_int(records[0].kind, ==, RAFT_IO_UV_RECORD_APPEND);
+    munit_assert_int(records[0].n, ==, 1);
+    munit_assert_int(records[0].size, ==, 16);
+
+    munit_assert_int(records[1].kind, ==, RAFT_IO_UV_RECORD_APPEND_DONE);
+    munit_assert_int(records[1].n, ==, 1);
+    munit_assert_int(records[1].type, ==, 0);
+    munit_assert_int(records[1].time, >=, records[0].time);
+
+    munit_assert_int(records[2].kind, ==, RAFT_IO_UV_RECORD_SEND);
+    munit_assert_int(records[2].type, ==, RAFT_IO_REQUEST_VOTE);
+    munit_assert_int(records[2].server_id, ==, 2);
+    munit_assert_int(records[2].time, >=, records[1].time);
+
+    free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
+/* If the trace can't be created, an error is returned. */
+TEST_CASE(set_recording, open_error, NULL)
+{
+    struct fixture *f = data;
+    char path[1024];
+    int rv;
+
+    (void)params;
+
+    sprintf(path, "%s/missing/trace", f->dir);
+    rv = raft_io_uv_set_recording(&f->io, path);
+    munit_assert_int(rv, ==, RAFT_ERR_IO);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_io_uv__wakeup
+ */
+
+TEST_SUITE(wakeup);
+TEST_SETUP(wakeup, setup);
+TEST_TEAR_DOWN(wakeup, tear_down);
+
+static void __wakeup_cb(struct raft_io *io)
+{
+    struct fixture *f = io->data;
+    f->wakeup_cb.n++;
+}
+
+static void __wakeup_thread(void *arg)
+{
+    struct raft_io *io = arg;
+    io->wakeup(io);
+}
+
+/* The wakeup callback fires in the loop thread, even if the wakeup came from
+ * another thread. */
+TEST_CASE(wakeup, other_thread, NULL)
+{
+    struct fixture *f = data;
+    uv_thread_t thread;
+    int rv;
+
+    (void)params;
+
+    munit_assert_int(f->io.version, >=, 7);
+
+    f->io.set_wakeup(&f->io, __wakeup_cb);
+
+    rv = uv_thread_create(&thread, __wakeup_thread, &f->io);
+    munit_assert_int(rv, ==, 0);
+    rv = uv_thread_join(&thread);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->wakeup_cb.n, ==, 0);
+
+    test_uv_run(&f->loop, 1);
+
+    munit_assert_int(f->wakeup_cb.n, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/**
+ * io_uv__encode_batch_header
+ */
+
+TEST_SUITE(batch_header);
+
+/* Headers are decoded back as they were encoded, with the unused bytes set to
+ * zero. */
+TEST_CASE(batch_header, round_trip, NULL)
+{
+    struct raft_entry entries[2];
+    struct raft_entry *decoded;
+    uint8_t buf[8 + 2 * 16];
+    unsigned n;
+    int rv;
+
+    (void)data;
+    (void)params;
+
+    entries[0].term = 3;
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.len = 8;
+    entries[1].term = 4;
+    entries[1].type = RAFT_BATCH;
+    entries[1].buf.len = 1 << 20;
+
+    memset(buf, 0xff, sizeof buf);
+    munit_assert_int(io_uv__sizeof_batch_header(2), ==, sizeof buf);
+    io_uv__encode_batch_header(entries, 2, buf);
+    munit_assert_int(buf[8 + 16 + 8], ==, RAFT_BATCH);
+    munit_assert_int(buf[8 + 16 + 9], ==, 0);
+    munit_assert_int(buf[8 + 16 + 11], ==, 0);
+
+    rv = io_uv__decode_batch_header(buf, &decoded, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(decoded[0].term, ==, 3);
+    munit_assert_int(decoded[0].type, ==, RAFT_COMMAND);
+    munit_assert_int(decoded[0].buf.len, ==, 8);
+    munit_assert_int(decoded[1].term, ==, 4);
+    munit_assert_int(decoded[1].type, ==, RAFT_BATCH);
+    munit_assert_int(decoded[1].buf.len, ==, 1 << 20);
+    raft_free(decoded);
+
+    /* An unknown entry type is rejected. */
+    buf[8 + 16 + 8] = 9;
+    rv = io_uv__decode_batch_header(buf, &decoded, &n);
+    munit_assert_int(rv, ==, RAFT_EMALFORMED);
+
+    return MUNIT_OK;
+}
+
+/**
+ * io_uv__decode_message
+ */
+
+TEST_SUITE(decode_message);
+
+/* Encode into @buf a message header with @n_words fixed fields, followed by a
+ * batch header declaring @n entries, with room for two entries of type @type
+ * only. */
+static void encode_batch_message(void *buf,
+                                 unsigned n_words,
+                                 uint64_t n,
+                                 uint8_t type)
+{
+    void *cursor = buf;
+    unsigned i;
+
+    for (i = 0; i < n_words; i++) {
+        byte__put64(&cursor, 1);
+    }
+    byte__put64(&cursor, n);
+    for (i = 0; i < 2; i++) {
+        byte__put64(&cursor, 1); /* Term */
+        byte__put8(&cursor, type);
+        byte__put8(&cursor, 0);
+        byte__put8(&cursor, 0);
+        byte__put8(&cursor, 0);
+        byte__put32(&cursor, 8); /* Data size */
+    }
+}
+
+/* Decode a header of the given type and size, expecting it to be rejected
+ * without returning any entry or payload size. */
+static void assert_malformed(unsigned type, void *buf, size_t len)
+{
+    struct raft_message message;
+    size_t payload_len = 123;
+    uv_buf_t header;
+    int rv;
+
+    memset(&message, 0xff, sizeof message);
+    header.base = buf;
+    header.len = len;
+
+    rv = io_uv__decode_message(type, &header, &message, &payload_len);
+    munit_assert_int(rv, ==, RAFT_EMALFORMED);
+    munit_assert_int(payload_len, ==, 123);
+    if (type == RAFT_IO_APPEND_ENTRIES) {
+        munit_assert_ptr_null(message.append_entries.entries);
+    } else {
+        munit_assert_ptr_null(message.propose.entries);
+    }
+}
+
+/* An AppendEntries message with a batch header that doesn't fit in the message
+ * header or holds an unknown entry type is rejected. */
+TEST_CASE(decode_message, append_entries_malformed, NULL)
+{
+    uint8_t buf[8 * 5 + 8 + 2 * 16];
+
+    (void)data;
+    (void)params;
+
+    /* Truncated in the middle of the second entry. */
+    encode_batch_message(buf, 5, 2, RAFT_COMMAND);
+    assert_malformed(RAFT_IO_APPEND_ENTRIES, buf, sizeof buf - 8);
+
+    /* Way more entries than the header can hold. */
+    encode_batch_message(buf, 5, (uint64_t)1 << 40, RAFT_COMMAND);
+    assert_malformed(RAFT_IO_APPEND_ENTRIES, buf, sizeof buf);
+
+    /* Not even room for the number of entries. */
+    assert_malformed(RAFT_IO_APPEND_ENTRIES, buf, 8 * 5);
+
+    encode_batch_message(buf, 5, 2, 9);
+    assert_malformed(RAFT_IO_APPEND_ENTRIES, buf, sizeof buf);
+
+    return MUNIT_OK;
+}
+
+/* Same for Propose messages. */
+TEST_CASE(decode_message, propose_malformed, NULL)
+{
+    uint8_t buf[8 * 2 + 8 + 2 * 16];
+
+    (void)data;
+    (void)params;
+
+    encode_batch_message(buf, 2, 2, RAFT_COMMAND);
+    assert_malformed(RAFT_IO_PROPOSE, buf, sizeof buf - 8);
+
+    encode_batch_message(buf, 2, (uint64_t)1 << 40, RAFT_COMMAND);
+    assert_malformed(RAFT_IO_PROPOSE, buf, sizeof buf);
+
+    assert_malformed(RAFT_IO_PROPOSE, buf, 8 * 2);
+
+    encode_batch_message(buf, 2, 2, 9);
+    assert_malformed(RAFT_IO_PROPOSE, buf, sizeof buf);
+
+    return MUNIT_OK;
+}
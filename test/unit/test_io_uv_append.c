@@ -1,3 +1,5 @@
+#include <unistd.h>
+
 #include "../lib/io_uv.h"
 #include "../lib/runner.h"
 
@@ -57,8 +59,12 @@ static void append_cb(void *data, int status)
     f->invoked++;
     f->status = status;
 
-    for (i = 0; i < r->n; i++) {
-        raft_free(r->entries[i].buf.base);
+    if (r->entries[0].batch != NULL) {
+        raft_free(r->entries[0].batch);
+    } else {
+        for (i = 0; i < r->n; i++) {
+            raft_free(r->entries[i].buf.base);
+        }
     }
 
     raft_free((struct raft_entry *)r->entries);
@@ -89,6 +95,33 @@ static void append_cb(void *data, int status)
         }                                                        \
     }
 
+/* Same as append_args, but with the payloads of the N entries allocated
+ * contiguously in a single batch buffer, like the ones received from a leader.
+ */
+#define append_args_batch(N, SIZE)                               \
+    {                                                            \
+        void *batch;                                             \
+        int i;                                                   \
+        f->entries = raft_malloc(N * sizeof(struct raft_entry)); \
+        f->n = N;                                                \
+        munit_assert_ptr_not_null(f->entries);                   \
+        batch = raft_malloc(N * SIZE);                           \
+        munit_assert_ptr_not_null(batch);                        \
+        memset(batch, 0, N * SIZE);                              \
+        for (i = 0; i < N; i++) {                                \
+            struct raft_entry *entry = &f->entries[i];           \
+            void *cursor;                                        \
+            entry->term = 1;                                     \
+            entry->type = RAFT_COMMAND;                          \
+            entry->buf.base = batch + i * SIZE;                  \
+            entry->buf.len = SIZE;                               \
+            entry->batch = batch;                                \
+            cursor = entry->buf.base;                            \
+            byte__put64(&cursor, f->count);                      \
+            f->count++;                                          \
+        }                                                        \
+    }
+
 /* Invoke raft_io->append() and assert that it returns the given code. */
 #define append_invoke(RV)                                          \
     {                                                              \
@@ -111,21 +144,21 @@ static void append_cb(void *data, int status)
 
 /* Wait for the given number of append request callbacks to fire and check the
  * last status. */
-#define append_wait_cb(N, STATUS)                \
-    {                                            \
-        int i;                                   \
-        for (i = 0; i < 5; i++) {                \
-            test_uv_run(&f->loop, 1);            \
-            if (f->invoked == N) {               \
-                break;                           \
-            }                                    \
-        }                                        \
-        munit_assert_int(f->invoked, ==, N);     \
-        munit_assert_int(f->status, ==, STATUS); \
-        f->invoked = 0;                          \
+#define append_wait_cb(N, STATUS)                    \
+    {                                                \
+        int i;                                       \
+        for (i = 0; i < TEST_UV_MAX_LOOP_RUN; i++) { \
+            test_uv_run(&f->loop, 1);                \
+            if (f->invoked == N) {                   \
+                break;                               \
+            }                                        \
+        }                                            \
+        munit_assert_int(f->invoked, ==, N);         \
+        munit_assert_int(f->status, ==, STATUS);     \
+        f->invoked = 0;                              \
     }
 
-/* Assert that the open segment with the given counter has format version 1 and
+/* Assert that the open segment with the given counter has format version 2 and
  * N entries with a total data size of S bytes. */
 #define assert_segment(COUNTER, N, SIZE)                                    \
     {                                                                       \
@@ -143,7 +176,7 @@ static void append_cb(void *data, int status)
         test_dir_read_file(f->dir, filename, buf.base, buf.len);            \
                                                                             \
         cursor = buf.base;                                                  \
-        munit_assert_int(byte__get64(&cursor), ==, 1);                      \
+        munit_assert_int(byte__get64(&cursor), ==, 2);                      \
                                                                             \
         while (i < N) {                                                     \
             unsigned crc1 = byte__get32(&cursor);                           \
@@ -173,7 +206,7 @@ static void append_cb(void *data, int status)
                 data_size += entry->buf.len;                                \
             }                                                               \
                                                                             \
-            crc = byte__crc32(header, io_uv__sizeof_batch_header(n), 0);    \
+            crc = byte__crc32c(header, io_uv__sizeof_batch_header(n), 0);   \
             munit_assert_int(crc, ==, crc1);                                \
                                                                             \
             data = cursor;                                                  \
@@ -190,7 +223,7 @@ static void append_cb(void *data, int status)
                 i++;                                                        \
             }                                                               \
                                                                             \
-            crc = byte__crc32(data, data_size, 0);                          \
+            crc = byte__crc32c(data, data_size, 0);                         \
             munit_assert_int(crc, ==, crc2);                                \
                                                                             \
             free(entries);                                                  \
@@ -359,9 +392,229 @@ TEST_CASE(success, wait, NULL)
     append_args(1, 64);
     append_invoke(0);
 
+    append_wait_cb(2, 0);
+
+    return MUNIT_OK;
+}
+
+/* An append request submitted while a write operation is in progress, whose
+ * data spills over the block being written, gets written concurrently, except
+ * for its first block, which is rewritten when the first write completes. */
+TEST_CASE(success, concurrent, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    append_args(1, f->uv->block_size);
+    append_invoke(0);
+
+    test_uv_run(&f->loop, 1);
+
+    append_args(1, f->uv->block_size);
+    append_invoke(0);
+
+    append_wait_cb(2, 0);
+
+    assert_segment(1, 2, 2 * f->uv->block_size);
+
+    return MUNIT_OK;
+}
+
+/* If coalescing is enabled, the write of an append request is held back and
+ * performed together with the one of a request submitted shortly after. */
+TEST_CASE(success, coalesce, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_uv_set_append_coalescing(&f->io, 50 * 1000, 0);
+
+    append_args(1, 64);
+    append_invoke(0);
+
+    append_args(1, 64);
+    append_invoke(0);
+
+    append_wait_cb(2, 0);
+
+    assert_segment(1, 2, 128);
+
+    return MUNIT_OK;
+}
+
+/* The whole blocks spanned by a large entry are written straight from its
+ * buffer, while the bytes of the partial blocks at its edges are kept in the
+ * arena for subsequent writes. */
+TEST_CASE(success, zero_copy, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    append_args(1, 3 * f->uv->block_size);
+    append_invoke(0);
+
     append_wait_cb(1, 0);
+
+    append_args(1, 8);
+    append_invoke(0);
+
+    append_wait_cb(1, 0);
+
+    assert_segment(1, 2, 3 * f->uv->block_size + 8);
+
+    return MUNIT_OK;
+}
+
+/* The payloads of entries received in a single batch are adjacent in memory,
+ * and the whole blocks they span are written straight from the batch buffer,
+ * even if each payload is smaller than a block. */
+TEST_CASE(success, zero_copy_batch, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    append_args_batch(6, f->uv->block_size / 2);
+    append_invoke(0);
+
+    append_wait_cb(1, 0);
+
+    append_args(1, 8);
+    append_invoke(0);
+
+    append_wait_cb(1, 0);
+
+    assert_segment(1, 7, 3 * f->uv->block_size + 8);
+
+    return MUNIT_OK;
+}
+
+/* The payloads of a large batch are checksummed and copied by a disk thread,
+ * and a batch appended in the meantime is written after it. */
+TEST_CASE(success, offload, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    f->uv->append_encode_threshold = f->uv->block_size;
+
+    append_args(2, f->uv->block_size);
+    append_invoke(0);
+
+    append_args(1, 8);
+    append_invoke(0);
+
+    append_wait_cb(2, 0);
+
+    assert_segment(1, 3, 2 * f->uv->block_size + 8);
+
+    return MUNIT_OK;
+}
+
+/* With per-entry checksums, each entry of a batch gets its own checksum, also
+ * when the batch is encoded in a disk thread. */
+TEST_CASE(success, entry_checksums, NULL)
+{
+    struct fixture *f = data;
+    size_t size = f->uv->block_size;
+    struct raft_buffer buf;
+    const void *cursor;
+    const void *header;
+    const void *sums;
+    size_t len;
+    unsigned i;
+
+    (void)params;
+
+    raft_io_uv_set_entry_checksums(&f->io, true);
+    f->uv->append_encode_threshold = size;
+
+    append_args(3, size);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+
+    buf.len = MAX_SEGMENT_BLOCKS * size;
+    buf.base = munit_malloc(buf.len);
+    test_dir_read_file(f->dir, "open-1", buf.base, buf.len);
+
+    cursor = buf.base;
+    munit_assert_int(byte__get64(&cursor), ==, 3);
+    header = cursor + sizeof(uint64_t);
+    sums = header + io_uv__sizeof_batch_header(3);
+    len = io_uv__sizeof_batch_header(3) + io_uv__sizeof_batch_checksums(3, 3);
+    munit_assert_int(byte__get32(&cursor), ==, byte__crc32c(header, len, 0));
+    munit_assert_int(byte__get32(&cursor), ==, 0); /* Unused data checksum */
+
+    cursor = header + len;
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(byte__flip64(*(uint64_t *)cursor), ==, i);
+        munit_assert_int(byte__get32(&sums), ==,
+                         byte__crc32c(cursor, size, 0));
+        cursor += size;
+    }
+
+    free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* With compact entries, batch headers use the compact encoding. */
+TEST_CASE(success, compact_entries, NULL)
+{
+    struct fixture *f = data;
+    struct raft_buffer buf;
+    struct raft_entry *entries;
+    const void *cursor;
+    const void *header;
+    size_t len;
+    unsigned crc1;
+    unsigned crc2;
+    unsigned n;
+    unsigned i;
+
+    (void)params;
+
+    raft_io_uv_set_compact_entries(&f->io, true);
+
+    append_args(3, 8);
+    append_invoke(0);
     append_wait_cb(1, 0);
 
+    buf.len = MAX_SEGMENT_BLOCKS * f->uv->block_size;
+    buf.base = munit_malloc(buf.len);
+    test_dir_read_file(f->dir, "open-1", buf.base, buf.len);
+
+    cursor = buf.base;
+    munit_assert_int(byte__get64(&cursor), ==, IO_UV__DISK_FORMAT_COMPACT);
+    crc1 = byte__get32(&cursor);
+    crc2 = byte__get32(&cursor);
+    header = cursor;
+
+    munit_assert_int(io_uv__decode_compact_batch_header(
+                         header, buf.len - 16, &entries, &n),
+                     ==, 0);
+    munit_assert_int(n, ==, 3);
+    len = io_uv__sizeof_compact_batch_header(entries, n);
+    munit_assert_int(len, <, io_uv__sizeof_batch_header(n));
+    munit_assert_int(crc1, ==, byte__crc32c(header, len, 0));
+    munit_assert_int(crc2, ==, byte__crc32c(header + len, 3 * 8, 0));
+
+    cursor = header + len;
+    for (i = 0; i < n; i++) {
+        munit_assert_int(entries[i].term, ==, 1);
+        munit_assert_int(entries[i].type, ==, RAFT_COMMAND);
+        munit_assert_int(entries[i].buf.len, ==, 8);
+        munit_assert_int(byte__flip64(*(uint64_t *)cursor), ==, i);
+        cursor += 8;
+    }
+
+    raft_free(entries);
+    free(buf.base);
+
     return MUNIT_OK;
 }
 
@@ -472,6 +725,204 @@ TEST_CASE(success, counter, NULL)
     return MUNIT_OK;
 }
 
+static bool spill_pending__closed(void *data)
+{
+    struct fixture *f = data;
+    return test_dir_has_file(f->dir, "1-3");
+}
+
+/* Requests that don't fit in the current segment while it's still being written
+ * all go to the same new segment. */
+TEST_CASE(success, spill_pending, NULL)
+{
+    struct fixture *f = data;
+    size_t size = f->uv->block_size;
+    int i;
+
+    (void)params;
+
+    for (i = 0; i < 5; i++) {
+        append_args(1, size);
+        append_invoke(0);
+    }
+    append_wait_cb(5, 0);
+
+    /* The first segment gets closed in the threadpool. */
+    test_uv_run_until(&f->loop, f, spill_pending__closed);
+
+    return MUNIT_OK;
+}
+
+static bool readable__closed(void *data)
+{
+    struct fixture *f = data;
+    return f->io.last_readable(&f->io) == 3;
+}
+
+static bool readable__truncated(void *data)
+{
+    struct fixture *f = data;
+    return f->io.last_readable(&f->io) == 1;
+}
+
+/* Entries become readable only once the open segment holding them has been
+ * closed. */
+TEST_CASE(success, readable, NULL)
+{
+    struct fixture *f = data;
+    size_t size = f->uv->block_size;
+    int i;
+    int rv;
+
+    (void)params;
+
+    append_args(1, size);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+
+    /* The entry is durable, but it sits in an open segment. */
+    munit_assert_int(f->io.last_readable(&f->io), ==, 0);
+
+    for (i = 0; i < 4; i++) {
+        append_args(1, size);
+        append_invoke(0);
+    }
+    append_wait_cb(4, 0);
+
+    /* The first segment gets closed in the threadpool. */
+    test_uv_run_until(&f->loop, f, readable__closed);
+    munit_assert_true(test_dir_has_file(f->dir, "1-3"));
+
+    /* Truncated entries are not readable anymore. */
+    rv = f->io.truncate(&f->io, 2);
+    munit_assert_int(rv, ==, 0);
+    test_uv_run_until(&f->loop, f, readable__truncated);
+
+    return MUNIT_OK;
+}
+
+/* The latency of appends is recorded in the stats. */
+TEST_CASE(success, stats, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_uv_stats stats;
+    unsigned long long n;
+    unsigned i;
+
+    (void)params;
+
+    append_args(1, 64);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+
+    raft_io_uv_stats(&f->io, &stats);
+
+    munit_assert_int(stats.append_queue.count, ==, 1);
+    munit_assert_int(stats.append_write.count, ==, 1);
+    munit_assert_int(stats.append_write.max, <=, stats.append_write.total);
+
+    n = 0;
+    for (i = 0; i < RAFT_IO_UV_LATENCY_BUCKETS; i++) {
+        n += stats.append_write.buckets[i];
+    }
+    munit_assert_int(n, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* Released write buffers are handed out again to open segments. */
+TEST_CASE(success, reuse_arena, NULL)
+{
+    struct fixture *f = data;
+    uv_buf_t buf;
+    int rv;
+
+    (void)params;
+
+    rv = io_uv__arena_get(f->uv, MAX_SEGMENT_BLOCKS * f->uv->block_size, &buf);
+    munit_assert_int(rv, ==, 0);
+    io_uv__arena_put(f->uv, &buf);
+    munit_assert_int(f->uv->n_arenas, ==, 1);
+
+    append_args(1, 64);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+
+    munit_assert_int(f->uv->n_arenas, ==, 0);
+
+    assert_segment(1, 1, 64);
+
+    return MUNIT_OK;
+}
+
+/* With huge pages enabled, large write buffers are rounded up to a multiple of
+ * the huge page size and aligned to it. */
+TEST_CASE(success, huge_pages, NULL)
+{
+    struct fixture *f = data;
+    uv_buf_t buf;
+    int rv;
+
+    (void)params;
+
+    raft_io_uv_set_huge_pages(&f->io, true);
+
+    rv = io_uv__arena_get(f->uv, IO_UV__HUGE_PAGE_SIZE / 2, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(buf.len, ==, IO_UV__HUGE_PAGE_SIZE);
+    munit_assert_int((uintptr_t)buf.base % IO_UV__HUGE_PAGE_SIZE, ==, 0);
+
+    io_uv__arena_put(f->uv, &buf);
+    munit_assert_ptr_null(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* With a NUMA node set, write buffers are aligned to the page size, and
+ * entries can still be appended if the node can't be used. */
+TEST_CASE(success, numa_node, NULL)
+{
+    struct fixture *f = data;
+    uv_buf_t buf;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_numa_node(&f->io, 0);
+    munit_assert_int(rv, ==, 0);
+
+    rv = io_uv__arena_get(f->uv, 1, &buf);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int((uintptr_t)buf.base % getpagesize(), ==, 0);
+    munit_assert_int(buf.len % getpagesize(), ==, 0);
+    io_uv__arena_put(f->uv, &buf);
+
+    append_args(1, 64);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+    assert_segment(1, 1, 64);
+
+    return MUNIT_OK;
+}
+
+/* With direct I/O disabled, entries are written through the page cache. */
+TEST_CASE(success, buffered, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_uv_set_direct_io(&f->io, false);
+
+    append_args(1, 64);
+    append_invoke(0);
+    append_wait_cb(1, 0);
+    assert_segment(1, 1, 64);
+
+    return MUNIT_OK;
+}
+
 /**
  * Failure scenarios.
  */
@@ -4,6 +4,7 @@
 #include "../lib/runner.h"
 
 #include "../../src/io_uv.h"
+#include "../../src/io_uv_encoding.h"
 
 TEST_MODULE(io_uv_send);
 
@@ -69,10 +70,11 @@ static void send__send_cb(struct raft_io_send *req, int status)
 
 #define send__set_message_type(TYPE) f->message.type = TYPE;
 
-#define send__set_connect_retry_delay(MSECS) \
-    {                                        \
-        struct io_uv *uv = f->io.impl;       \
-        uv->connect_retry_delay = 1;         \
+#define send__set_connect_retry_delay(MSECS)                           \
+    {                                                                  \
+        int rv;                                                        \
+        rv = raft_io_uv_set_connect_retry_delay(&f->io, MSECS, MSECS); \
+        munit_assert_int(rv, ==, 0);                                   \
     }
 
 /**
@@ -115,6 +117,34 @@ TEST_CASE(success, second, NULL)
     return MUNIT_OK;
 }
 
+/* Messages sent during the same loop iteration are written out together. */
+TEST_CASE(success, corked, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_send reqs[3];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    for (i = 0; i < 3; i++) {
+        reqs[i].data = f;
+        rv = f->io.send(&f->io, &reqs[i], &f->message, send__send_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    for (i = 0; i < 5 && f->invoked < 3; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+    munit_assert_int(f->invoked, ==, 3);
+    munit_assert_int(f->status, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /* Send a request vote result message. */
 TEST_CASE(success, vote_result, NULL)
 {
@@ -157,6 +187,187 @@ TEST_CASE(success, append_entries, NULL)
     return MUNIT_OK;
 }
 
+#if defined(HAVE_LZ4)
+/* Send an append entries message with compressed entries. */
+TEST_CASE(success, append_entries_compressed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[2];
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_compression(&f->io, 1024);
+    munit_assert_int(rv, ==, 0);
+
+    entries[0].buf.base = raft_malloc(4096);
+    entries[0].buf.len = 4096;
+    memset(entries[0].buf.base, 'a', entries[0].buf.len);
+
+    entries[1].buf.base = raft_malloc(8);
+    entries[1].buf.len = 8;
+    memset(entries[1].buf.base, 'b', entries[1].buf.len);
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = entries;
+    f->message.append_entries.n_entries = 2;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    raft_free(entries[0].buf.base);
+    raft_free(entries[1].buf.base);
+
+    return MUNIT_OK;
+}
+#endif
+
+/* Append entries messages carrying the same entries share their encoding. */
+TEST_CASE(success, append_entries_shared, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[2];
+    struct raft_io_send reqs[2];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    entries[0].term = 1;
+    entries[0].buf.base = raft_malloc(16);
+    entries[0].buf.len = 16;
+
+    entries[1].term = 1;
+    entries[1].buf.base = raft_malloc(8);
+    entries[1].buf.len = 8;
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = entries;
+    f->message.append_entries.n_entries = 2;
+    f->message.append_entries.prev_log_index = 1;
+
+    for (i = 0; i < 2; i++) {
+        reqs[i].data = f;
+        rv = f->io.send(&f->io, &reqs[i], &f->message, send__send_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    munit_assert_false(RAFT__QUEUE_IS_EMPTY(&f->uv->send_batches));
+    munit_assert_ptr_equal(RAFT__QUEUE_NEXT(&f->uv->send_batches),
+                           RAFT__QUEUE_PREV(&f->uv->send_batches));
+
+    for (i = 0; i < 5 && f->invoked < 2; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+
+    munit_assert_true(RAFT__QUEUE_IS_EMPTY(&f->uv->send_batches));
+
+    raft_free(entries[0].buf.base);
+    raft_free(entries[1].buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Once a peer advertises that it can decode compact batches, the entries sent
+ * to it get a batch header with the compact encoding, which is not shared with
+ * messages using the fixed-size one. */
+TEST_CASE(success, append_entries_compact, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[1];
+    struct raft_io_send reqs[2];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    entries[0].term = 1;
+    entries[0].buf.base = raft_malloc(16);
+    entries[0].buf.len = 16;
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = entries;
+    f->message.append_entries.n_entries = 1;
+    f->message.append_entries.prev_log_index = 1;
+
+    for (i = 0; i < 2; i++) {
+        reqs[i].data = f;
+        rv = f->io.send(&f->io, &reqs[i], &f->message, send__send_cb);
+        munit_assert_int(rv, ==, 0);
+        io_uv__clients_set_features(f->uv->host, 1, IO_UV__FEATURE_COMPACT);
+    }
+
+    munit_assert_ptr_not_equal(RAFT__QUEUE_NEXT(&f->uv->send_batches),
+                               RAFT__QUEUE_PREV(&f->uv->send_batches));
+
+    for (i = 0; i < 5 && f->invoked < 2; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+
+    raft_free(entries[0].buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Broadcast the same entries with a single call, encoding them once. */
+TEST_CASE(success, broadcast, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[1];
+    struct raft_io_send r1;
+    struct raft_io_send r2;
+    struct raft_io_send *reqs[2] = {&r1, &r2};
+    struct raft_message messages[2];
+    int statuses[2];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    entries[0].term = 1;
+    entries[0].buf.base = raft_malloc(16);
+    entries[0].buf.len = 16;
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+
+    f->message.append_entries.entries = entries;
+    f->message.append_entries.n_entries = 1;
+    f->message.append_entries.prev_log_index = 1;
+
+    for (i = 0; i < 2; i++) {
+        reqs[i]->data = f;
+        messages[i] = f->message;
+    }
+
+    rv = f->io.broadcast(&f->io, reqs, messages, 2, statuses, send__send_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(statuses[0], ==, 0);
+    munit_assert_int(statuses[1], ==, 0);
+
+    munit_assert_false(RAFT__QUEUE_IS_EMPTY(&f->uv->send_batches));
+    munit_assert_ptr_equal(RAFT__QUEUE_NEXT(&f->uv->send_batches),
+                           RAFT__QUEUE_PREV(&f->uv->send_batches));
+
+    for (i = 0; i < 5 && f->invoked < 2; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+    munit_assert_int(f->invoked, ==, 2);
+    munit_assert_int(f->status, ==, 0);
+
+    munit_assert_true(RAFT__QUEUE_IS_EMPTY(&f->uv->send_batches));
+
+    raft_free(entries[0].buf.base);
+
+    return MUNIT_OK;
+}
+
 /* Send an append entries message with zero entries (i.e. a heartbeat). */
 TEST_CASE(success, heartbeat, NULL)
 {
@@ -204,11 +415,106 @@ TEST_CASE(success, install_snapshot, NULL)
     rv = raft_configuration_add(&p->conf, 1, "1", true);
     munit_assert_int(rv, ==, 0);
 
+    p->offset = 0;
+    p->done = true;
+    p->data.len = 8;
+    p->data.base = raft_malloc(p->data.len);
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    raft_configuration_close(&p->conf);
+    raft_free(p->data.base);
+
+    return MUNIT_OK;
+}
+
+/* Record the order in which send requests complete. */
+static void send__order_cb(struct raft_io_send *req, int status)
+{
+    struct fixture *f = req->data;
+    munit_assert_int(status, ==, 0);
+    req->data = (void *)(uintptr_t)f->invoked;
+    f->invoked++;
+}
+
+/* Control messages are written ahead of bulk ones submitted before them, and
+ * bulk messages are written one chunk at a time. */
+TEST_CASE(success, control_first, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[1];
+    struct raft_message vote = f->message;
+    struct raft_io_send reqs[3];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+
+    f->uv->host->bulk_chunk_size = 1024;
+
+    entries[0].term = 1;
+    entries[0].buf.len = 2048;
+    entries[0].buf.base = raft_malloc(entries[0].buf.len);
+    memset(entries[0].buf.base, 0, entries[0].buf.len);
+
+    send__set_message_type(RAFT_IO_APPEND_ENTRIES);
+    f->message.append_entries.entries = entries;
+    f->message.append_entries.n_entries = 1;
+    f->message.append_entries.prev_log_index = 1;
+
+    for (i = 0; i < 3; i++) {
+        const struct raft_message *message = i == 2 ? &vote : &f->message;
+        reqs[i].data = f;
+        rv = f->io.send(&f->io, &reqs[i], message, send__order_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    for (i = 0; i < 10 && f->invoked < 3; i++) {
+        test_uv_run(&f->loop, 1);
+    }
+    munit_assert_int(f->invoked, ==, 3);
+
+    munit_assert_int((uintptr_t)reqs[2].data, ==, 0);
+    munit_assert_int((uintptr_t)reqs[0].data, ==, 1);
+    munit_assert_int((uintptr_t)reqs[1].data, ==, 2);
+
+    raft_free(entries[0].buf.base);
+
+    return MUNIT_OK;
+}
+
+/* Install snapshot messages use a separate connection than other messages. */
+TEST_CASE(success, bulk_lane, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot *p = &f->message.install_snapshot;
+    struct io_uv *uv = f->io.impl;
+    int rv;
+
+    (void)params;
+
+    send__invoke(0);
+    send__wait_cb(0);
+    munit_assert_int(uv->host->n_clients, ==, 1);
+
+    send__set_message_type(RAFT_IO_INSTALL_SNAPSHOT);
+
+    raft_configuration_init(&p->conf);
+    rv = raft_configuration_add(&p->conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+
+    p->offset = 0;
+    p->done = true;
     p->data.len = 8;
     p->data.base = raft_malloc(p->data.len);
 
     send__invoke(0);
     send__wait_cb(0);
+    munit_assert_int(uv->host->n_clients, ==, 2);
 
     raft_configuration_close(&p->conf);
     raft_free(p->data.base);
@@ -247,6 +553,48 @@ TEST_CASE(error, connect, NULL)
     return MUNIT_OK;
 }
 
+/* The connection retry delays must be positive and the maximum can't be lower
+ * than the minimum. */
+TEST_CASE(error, connect_retry_delay, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_connect_retry_delay(&f->io, 0, 10);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_connect_retry_delay(&f->io, 20, 10);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_connect_retry_delay(&f->io, 10, 10);
+    munit_assert_int(rv, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Compression can only be enabled if LZ4 support is available. */
+TEST_CASE(error, compression, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_compression(&f->io, 1024);
+#if defined(HAVE_LZ4)
+    munit_assert_int(rv, ==, 0);
+#else
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+#endif
+
+    rv = raft_io_uv_set_compression(&f->io, 0);
+    munit_assert_int(rv, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /* The message has an invalid IPv4 address. */
 TEST_CASE(error, bad_address, NULL)
 {
@@ -305,6 +653,9 @@ TEST_CASE(error, reconnect, NULL)
     return MUNIT_OK;
 }
 
+/* Encoded size of a RequestVote message. */
+#define REQUEST_VOTE_SIZE 64
+
 /* If there's no more space in the queue of pending requests, the oldest request
  * gets evicted and its callback fired with RAFT_ERR_IO_CONNECT. */
 TEST_CASE(error, queue, NULL)
@@ -313,6 +664,7 @@ TEST_CASE(error, queue, NULL)
 
     (void)params;
 
+    raft_io_uv_set_send_queue_size(&f->io, 3 * REQUEST_VOTE_SIZE);
     test_tcp_stop(&f->tcp);
 
     send__invoke(0);
@@ -325,7 +677,32 @@ TEST_CASE(error, queue, NULL)
     return MUNIT_OK;
 }
 
-static char *error_oom_heap_fault_delay[] = {"0", "1", "2", "3", "4", "5", NULL};
+/* A peer is reported as congested once the queue of requests waiting for a
+ * connection to it is full. */
+TEST_CASE(error, congested, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    raft_io_uv_set_send_queue_size(&f->io, 2 * REQUEST_VOTE_SIZE);
+    test_tcp_stop(&f->tcp);
+
+    munit_assert_false(f->io.congested(&f->io, 1));
+
+    send__invoke(0);
+    munit_assert_false(f->io.congested(&f->io, 1));
+
+    send__invoke(0);
+    munit_assert_true(f->io.congested(&f->io, 1));
+    munit_assert_false(f->io.congested(&f->io, 2));
+
+    return MUNIT_OK;
+}
+
+/* The fifth to seventh allocations are made by the first connection attempt,
+ * whose failure just schedules a retry. */
+static char *error_oom_heap_fault_delay[] = {"0", "1", "2", "3", "7", "8", NULL};
 static char *error_oom_heap_fault_repeat[] = {"1", NULL};
 
 static MunitParameterEnum error_oom_params[] = {
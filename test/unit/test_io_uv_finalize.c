@@ -2,6 +2,8 @@
 #include "../lib/runner.h"
 
 #include "../../src/io_uv.h"
+#include "../../src/io_uv_encoding.h"
+#include "../../src/io_uv_load.h"
 
 TEST_MODULE(io_uv__finalize);
 
@@ -122,6 +124,85 @@ TEST_CASE(success, wait, NULL)
     return MUNIT_OK;
 }
 
+/* Requests that queue up while a segment is being finalized are all processed
+ * together in the next batch. */
+TEST_CASE(success, batch, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    write_open_segment(1);
+    invoke(0);
+
+    f->counter = 2;
+    f->first_index = 3;
+    f->last_index = 3;
+
+    write_open_segment(2);
+    invoke(0);
+
+    f->counter = 3;
+    f->first_index = 4;
+    f->last_index = 4;
+
+    write_open_segment(3);
+    invoke(0);
+
+    test_uv_run(&f->loop, 1);
+
+    munit_assert_true(test_dir_has_file(f->dir, "1-2"));
+    munit_assert_false(test_dir_has_file(f->dir, "3-3"));
+
+    test_uv_run(&f->loop, 1);
+
+    munit_assert_true(test_dir_has_file(f->dir, "3-3"));
+    munit_assert_true(test_dir_has_file(f->dir, "4-4"));
+
+    return MUNIT_OK;
+}
+
+/* The finalized segment ends with an index footer, which allows loading its
+ * entries starting from any batch. */
+TEST_CASE(success, footer, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__segment_meta segment;
+    struct raft_entry *entries;
+    raft_index first;
+    size_t n;
+    struct stat sb;
+    int rv;
+
+    (void)params;
+
+    f->used = test_io_uv_write_open_segment_file(f->dir, 1, 2, 1);
+
+    invoke(0);
+
+    test_uv_run(&f->loop, 1);
+
+    rv = raft__io_uv_fs_stat(f->dir, "1-2", &sb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(sb.st_size, ==, f->used + io_uv__sizeof_footer(2));
+
+    segment.is_open = false;
+    segment.first_index = 1;
+    segment.end_index = 2;
+    strcpy(segment.filename, "1-2");
+
+    rv = io_uv__load_closed_from(f->uv, &segment, 2, &entries, &n, &first);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(first, ==, 2);
+    munit_assert_int(n, ==, 1);
+    munit_assert_int(*(uint64_t *)entries[0].buf.base, ==, 2);
+
+    raft_free(entries[0].batch);
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
 /**
  * Failure scenarios.
  */
@@ -0,0 +1,409 @@
+#include "../../include/raft/io_uv.h"
+
+#include "../../src/byte.h"
+#include "../../src/io_uv.h"
+#include "../../src/io_uv_encoding.h"
+
+#include "../lib/fs.h"
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+#include "../lib/tcp.h"
+#include "../lib/uv.h"
+
+TEST_MODULE(io_uv_host);
+
+/**
+ * Helpers.
+ */
+
+#define N_GROUPS 2
+
+struct group
+{
+    struct fixture *f;
+    char *dir;
+    struct raft_io io;
+    int invoked;
+    struct raft_message message; /* Copy of the last received message */
+    int appended;                /* N. of append callbacks fired */
+    int append_status;           /* Status of the last append */
+};
+
+struct fixture
+{
+    struct raft_heap heap;
+    struct test_tcp tcp;
+    struct uv_loop_s loop;
+    struct raft_io_uv_transport transport;
+    struct raft_io_uv_host host;
+    struct group groups[N_GROUPS];
+    unsigned closed;
+    bool host_closed;
+};
+
+static void recv_cb(struct raft_io *io, struct raft_message *message)
+{
+    struct group *g = io->data;
+    g->invoked++;
+    g->message = *message;
+}
+
+static void close_cb(struct raft_io *io)
+{
+    struct group *g = io->data;
+    g->f->closed++;
+}
+
+static void host_close_cb(struct raft_io_uv_host *host)
+{
+    struct fixture *f = host->data;
+    f->host_closed = true;
+}
+
+static void append_cb(void *data, int status)
+{
+    struct group *g = data;
+    g->appended++;
+    g->append_status = status;
+}
+
+static void *setup_host(const MunitParameter params[], bool shared_sync)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    unsigned i;
+    int rv;
+    test_heap_setup(params, &f->heap);
+    test_tcp_setup(params, &f->tcp);
+    test_uv_setup(params, &f->loop);
+    rv = raft_io_uv_tcp_init(&f->transport, &f->loop);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_io_uv_host_init(&f->host, &f->loop, &f->transport);
+    munit_assert_int(rv, ==, 0);
+    f->host.data = f;
+    rv = raft_io_uv_host_set_shared_sync(&f->host, shared_sync);
+    munit_assert_int(rv, ==, 0);
+    for (i = 0; i < N_GROUPS; i++) {
+        struct group *g = &f->groups[i];
+        g->f = f;
+        g->dir = test_dir_setup(params);
+        rv = raft_io_uv_init_group(&g->io, &f->host, g->dir, i + 1);
+        munit_assert_int(rv, ==, 0);
+        g->io.data = g;
+        rv = g->io.init(&g->io, 1, "127.0.0.1:9000");
+        munit_assert_int(rv, ==, 0);
+        rv = g->io.start(&g->io, 10000, NULL, recv_cb);
+        munit_assert_int(rv, ==, 0);
+        g->invoked = 0;
+        g->appended = 0;
+        g->append_status = -1;
+    }
+    f->closed = 0;
+    f->host_closed = false;
+    return f;
+}
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    (void)user_data;
+    return setup_host(params, false);
+}
+
+static void *setup_shared_sync(const MunitParameter params[], void *user_data)
+{
+    (void)user_data;
+    return setup_host(params, true);
+}
+
+static void close_groups(struct fixture *f)
+{
+    unsigned i;
+    int rv;
+    for (i = 0; i < N_GROUPS; i++) {
+        rv = f->groups[i].io.close(&f->groups[i].io, close_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+}
+
+static bool groups_closed(struct fixture *f)
+{
+    return f->closed == N_GROUPS;
+}
+
+static void release_groups(struct fixture *f)
+{
+    unsigned i;
+    for (i = 0; i < N_GROUPS; i++) {
+        raft_io_uv_close(&f->groups[i].io);
+        test_dir_tear_down(f->groups[i].dir);
+    }
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    close_groups(f);
+    test_uv_run_until(&f->loop, f, groups_closed);
+    raft_io_uv_host_close(&f->host, host_close_cb);
+    test_uv_stop(&f->loop);
+    munit_assert_true(f->host_closed);
+    release_groups(f);
+    raft_io_uv_tcp_close(&f->transport);
+    test_uv_tear_down(&f->loop);
+    test_tcp_tear_down(&f->tcp);
+    test_heap_tear_down(&f->heap);
+    free(f);
+}
+
+#define host__peer_handshake                                 \
+    {                                                        \
+        uint8_t handshake[sizeof(uint64_t) * 3 + 16];        \
+        void *cursor = handshake;                            \
+        test_tcp_connect(&f->tcp, 9000);                     \
+        byte__put64(&cursor, 1);  /* Protocol */             \
+        byte__put64(&cursor, 2);  /* Server ID */            \
+        byte__put64(&cursor, 16); /* Address size */         \
+        strcpy(cursor, "127.0.0.1:66");                      \
+        test_tcp_send(&f->tcp, handshake, sizeof handshake); \
+    }
+
+/* Send a RequestVote message with the given term to the given group. */
+#define host__peer_send(GROUP, TERM)                                  \
+    {                                                                 \
+        struct raft_message message;                                  \
+        uv_buf_t *bufs;                                               \
+        unsigned n_bufs;                                              \
+        int rv_;                                                      \
+        memset(&message, 0, sizeof message);                          \
+        message.type = RAFT_IO_REQUEST_VOTE;                          \
+        message.request_vote.term = TERM;                             \
+        rv_ = io_uv__encode_message(&message, GROUP, &bufs, &n_bufs); \
+        munit_assert_int(rv_, ==, 0);                                 \
+        test_tcp_send(&f->tcp, bufs[0].base, bufs[0].len);            \
+        raft_free(bufs[0].base);                                      \
+        raft_free(bufs);                                              \
+    }
+
+/**
+ * raft_io_uv_init_group
+ */
+
+TEST_SUITE(init);
+
+TEST_SETUP(init, setup);
+TEST_TEAR_DOWN(init, tear_down);
+
+/* Group IDs must be unique within the host. */
+TEST_CASE(init, dup_group, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io io;
+    char *dir;
+    int rv;
+
+    (void)params;
+
+    dir = test_dir_setup(params);
+    rv = raft_io_uv_init_group(&io, &f->host, dir, 1);
+    munit_assert_int(rv, ==, RAFT_EDUPID);
+    test_dir_tear_down(dir);
+
+    return MUNIT_OK;
+}
+
+/* All groups must use the same server ID. */
+TEST_CASE(init, bad_id, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io io;
+    char *dir;
+    int rv;
+
+    (void)params;
+
+    dir = test_dir_setup(params);
+    rv = raft_io_uv_init_group(&io, &f->host, dir, 3);
+    munit_assert_int(rv, ==, 0);
+    rv = io.init(&io, 2, "127.0.0.1:9000");
+    munit_assert_int(rv, ==, RAFT_EBADID);
+    raft_io_uv_close(&io);
+    test_dir_tear_down(dir);
+
+    return MUNIT_OK;
+}
+
+/* Shared syncs can't be enabled once groups are attached. */
+TEST_CASE(init, shared_sync_busy, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_host_set_shared_sync(&f->host, true);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Receive messages.
+ */
+
+TEST_SUITE(recv);
+
+TEST_SETUP(recv, setup);
+TEST_TEAR_DOWN(recv, tear_down);
+
+/* Messages are dispatched to the group they are addressed to, over the same
+ * connection. */
+TEST_CASE(recv, dispatch, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    host__peer_handshake;
+    host__peer_send(2, 5);
+    host__peer_send(1, 3);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->groups[0].invoked, ==, 1);
+    munit_assert_int(f->groups[0].message.request_vote.term, ==, 3);
+    munit_assert_int(f->groups[1].invoked, ==, 1);
+    munit_assert_int(f->groups[1].message.request_vote.term, ==, 5);
+
+    return MUNIT_OK;
+}
+
+/* Messages for a group that is not attached to the host are discarded. */
+TEST_CASE(recv, unknown_group, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    host__peer_handshake;
+    host__peer_send(3, 5);
+    host__peer_send(1, 3);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->groups[0].invoked, ==, 1);
+    munit_assert_int(f->groups[1].invoked, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Coalesced heartbeats are fanned out to their groups as AppendEntries
+ * messages with no entries. */
+TEST_CASE(recv, heartbeats, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__heartbeat heartbeats[2];
+    uv_buf_t buf;
+    int rv;
+
+    (void)params;
+
+    memset(heartbeats, 0, sizeof heartbeats);
+    heartbeats[0].group = 1;
+    heartbeats[0].args.term = 3;
+    heartbeats[0].args.leader_commit = 10;
+    heartbeats[0].args.seq = 7;
+    heartbeats[1].group = 2;
+    heartbeats[1].args.term = 5;
+    heartbeats[1].args.leader_commit = 20;
+    heartbeats[1].args.seq = 9;
+
+    rv = io_uv__encode_heartbeats(heartbeats, 2, true, &buf);
+    munit_assert_int(rv, ==, 0);
+
+    host__peer_handshake;
+    test_tcp_send(&f->tcp, buf.base, buf.len);
+    raft_free(buf.base);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->groups[0].invoked, ==, 1);
+    munit_assert_int(f->groups[0].message.type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(f->groups[0].message.append_entries.term, ==, 3);
+    munit_assert_int(f->groups[0].message.append_entries.leader_commit, ==,
+                     10);
+    munit_assert_int(f->groups[0].message.append_entries.n_entries, ==, 0);
+    munit_assert_int(f->groups[0].message.append_entries.seq, ==, 7);
+
+    munit_assert_int(f->groups[1].invoked, ==, 1);
+    munit_assert_int(f->groups[1].message.append_entries.term, ==, 5);
+    munit_assert_int(f->groups[1].message.append_entries.leader_commit, ==,
+                     20);
+    munit_assert_int(f->groups[1].message.append_entries.seq, ==, 9);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Append entries with shared syncs.
+ */
+
+TEST_SUITE(shared_sync);
+
+TEST_SETUP(shared_sync, setup_shared_sync);
+TEST_TEAR_DOWN(shared_sync, tear_down);
+
+static bool groups_appended(struct fixture *f)
+{
+    unsigned i;
+    for (i = 0; i < N_GROUPS; i++) {
+        if (f->groups[i].appended == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Entries appended by all groups are persisted with at most one file system
+ * sync for each group, and usually a single one. */
+TEST_CASE(shared_sync, append, NULL)
+{
+    struct fixture *f = data;
+    struct io_uv__host *h = f->host.impl;
+    struct raft_entry entry;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    entry.term = 1;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = munit_malloc(8);
+    entry.buf.len = 8;
+    memset(entry.buf.base, 'x', entry.buf.len);
+
+    for (i = 0; i < N_GROUPS; i++) {
+        struct group *g = &f->groups[i];
+        raft_term term;
+        unsigned voted_for;
+        struct raft_snapshot *snapshot;
+        struct raft_entry *entries;
+        size_t n_entries;
+        rv = g->io.load(&g->io, &term, &voted_for, &snapshot, &entries,
+                        &n_entries);
+        munit_assert_int(rv, ==, 0);
+        rv = g->io.append(&g->io, &entry, 1, g, append_cb);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    test_uv_run_until(&f->loop, f, groups_appended);
+
+    for (i = 0; i < N_GROUPS; i++) {
+        munit_assert_int(f->groups[i].appended, ==, 1);
+        munit_assert_int(f->groups[i].append_status, ==, 0);
+    }
+    munit_assert_int(h->n_syncs, >=, 1);
+    munit_assert_int(h->n_syncs, <=, N_GROUPS);
+
+    free(entry.buf.base);
+
+    return MUNIT_OK;
+}
@@ -4,6 +4,7 @@
 #include "../lib/runner.h"
 
 #include "../../src/byte.h"
+#include "../../src/io_uv.h"
 #include "../../src/io_uv_encoding.h"
 #include "../../src/io_uv_load.h"
 
@@ -153,6 +154,7 @@ TEST_SETUP(load_snapshot)
     f->meta.timestamp = 123;
     sprintf(f->meta.filename, "snapshot-%llu-%llu-%llu.meta", f->meta.term,
             f->meta.index, f->meta.timestamp);
+    f->meta.dir = f->dir;
     raft_configuration_init(&f->snapshot.configuration);
     return f;
 }
@@ -390,6 +392,90 @@ TEST_TEAR_DOWN(load_all)
         munit_assert_int(rv, ==, RV);                                  \
     }
 
+/* Offset of the data of the I'th entry of a segment written with
+ * write_entry_checksums_segment() holding N entries. */
+#define ENTRY_CHECKSUMS_DATA_OFFSET(N, I)                               \
+    (WORD_SIZE /* Format version */ + WORD_SIZE /* Checksums */ +       \
+     io_uv__sizeof_batch_header(N) + io_uv__sizeof_batch_checksums(3, N) + \
+     WORD_SIZE * (I))
+
+/* Write a closed segment starting at index 1, in the format with per-entry
+ * checksums, holding a single batch of N entries whose data is their index. */
+static void write_entry_checksums_segment(const char *dir, unsigned n)
+{
+    char filename[64];
+    size_t header_size = io_uv__sizeof_batch_header(n);
+    size_t sums_size = io_uv__sizeof_batch_checksums(3, n);
+    size_t size = ENTRY_CHECKSUMS_DATA_OFFSET(n, n);
+    uint8_t *buf = munit_malloc(size);
+    void *header = buf + WORD_SIZE * 2;
+    void *sums = header + header_size;
+    void *cursor = buf;
+    unsigned i;
+
+    memset(buf, 0, size);
+    byte__put64(&cursor, 3); /* Format version */
+    cursor = header;
+    byte__put64(&cursor, n); /* Number of entries */
+    for (i = 0; i < n; i++) {
+        byte__put64(&cursor, 1);                         /* Entry term */
+        byte__put64(&cursor, RAFT_COMMAND | 8ULL << 32); /* Type and size */
+    }
+    cursor = sums + sums_size;
+    for (i = 0; i < n; i++) {
+        void *data = cursor;
+        byte__put64(&cursor, i + 1); /* Entry data */
+        byte__put32(&sums, byte__crc32c(data, WORD_SIZE, 0));
+    }
+    cursor = buf + WORD_SIZE;
+    byte__put32(&cursor, byte__crc32c(header, header_size + sums_size, 0));
+
+    sprintf(filename, "1-%u", n);
+    test_dir_write_file(dir, filename, buf, size);
+    free(buf);
+}
+
+/* Write a segment starting at index 1 with the given name, in the compact
+ * format, holding a single batch of N entries whose data is their index, and
+ * whose term goes up every two entries. */
+static void write_compact_segment(const char *dir,
+                                  const char *filename,
+                                  unsigned n)
+{
+    struct raft_entry *entries = munit_malloc(n * sizeof *entries);
+    size_t header_size;
+    size_t size;
+    uint8_t *buf;
+    void *header;
+    void *cursor;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        entries[i].term = 1 + i / 2;
+        entries[i].type = RAFT_COMMAND;
+        entries[i].buf.len = WORD_SIZE;
+    }
+    header_size = io_uv__sizeof_compact_batch_header(entries, n);
+    size = WORD_SIZE * 2 + header_size + WORD_SIZE * n;
+    buf = munit_malloc(size);
+    header = buf + WORD_SIZE * 2;
+
+    cursor = buf;
+    byte__put64(&cursor, IO_UV__DISK_FORMAT_COMPACT);
+    io_uv__encode_compact_batch_header(entries, n, header);
+    cursor = header + header_size;
+    for (i = 0; i < n; i++) {
+        byte__put64(&cursor, i + 1); /* Entry data */
+    }
+    cursor = buf + WORD_SIZE;
+    byte__put32(&cursor, byte__crc32c(header, header_size, 0));
+    byte__put32(&cursor, byte__crc32c(header + header_size, WORD_SIZE * n, 0));
+
+    test_dir_write_file(dir, filename, buf, size);
+    free(buf);
+    free(entries);
+}
+
 TEST_CASE(load_all, success, ignore_unknown, NULL)
 {
     struct load_all__fixture *f = data;
@@ -437,6 +523,33 @@ TEST_CASE(load_all, success, closed_not_needed, NULL)
     return MUNIT_OK;
 }
 
+/* If an archive directory is set, closed segments that are no longer needed
+ * are moved there. */
+TEST_CASE(load_all, success, closed_archived, NULL)
+{
+    struct load_all__fixture *f = data;
+    uint8_t buf[8];
+    char dir[1024];
+    int rv;
+
+    (void)params;
+
+    sprintf(dir, "%s/archive", f->dir);
+    rv = raft_io_uv_set_archive_dir(&f->io, dir);
+    munit_assert_int(rv, ==, 0);
+
+    test_io_uv_write_snapshot_meta_file(f->dir, 1, 2, 123, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 1, 2, 123, buf, sizeof buf);
+    test_io_uv_write_closed_segment_file(f->dir, 1, 1, 1);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_false(test_dir_has_file(f->dir, "1-1"));
+    munit_assert_true(test_dir_has_file(dir, "1-1"));
+
+    return MUNIT_OK;
+}
+
 /* The data directory has a valid closed and open segments. */
 TEST_CASE(load_all, success, closed, NULL)
 {
@@ -455,6 +568,158 @@ TEST_CASE(load_all, success, closed, NULL)
     return MUNIT_OK;
 }
 
+/* The data of all batches of a mapped closed segment is loaded into a single
+ * buffer, which is the batch of all its entries. */
+TEST_CASE(load_all, success, closed_one_buffer, NULL)
+{
+    struct load_all__fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 3, 1);
+    test_io_uv_write_closed_segment_file(f->dir, 4, 2, 4);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 5);
+    for (i = 0; i < 5; i++) {
+        munit_assert_int(*(uint64_t *)f->entries[i].buf.base, ==, i + 1);
+    }
+    munit_assert_ptr_equal(f->entries[1].batch, f->entries[0].batch);
+    munit_assert_ptr_equal(f->entries[2].batch, f->entries[0].batch);
+    munit_assert_ptr_not_equal(f->entries[3].batch, f->entries[0].batch);
+    munit_assert_ptr_equal(f->entries[4].batch, f->entries[3].batch);
+
+    return MUNIT_OK;
+}
+
+/* The data directory has enough closed segments to be loaded in parallel, and
+ * their entries are still returned in order. */
+TEST_CASE(load_all, success, closed_parallel, NULL)
+{
+    struct load_all__fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    for (i = 0; i < 10; i++) {
+        test_io_uv_write_closed_segment_file(f->dir, i + 1, 1, i + 1);
+    }
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 10);
+    for (i = 0; i < 10; i++) {
+        munit_assert_int(*(uint64_t *)f->entries[i].buf.base, ==, i + 1);
+    }
+
+    return MUNIT_OK;
+}
+
+/* Closed segments can also be loaded by a single thread without mapping them,
+ * and the load is accounted in the stats. */
+TEST_CASE(load_all, success, closed_sequential, NULL)
+{
+    struct load_all__fixture *f = data;
+    struct raft_io_uv_stats stats;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_load_threads(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+    raft_io_uv_set_load_mmap(&f->io, false);
+
+    for (i = 0; i < 10; i++) {
+        test_io_uv_write_closed_segment_file(f->dir, i + 1, 1, i + 1);
+    }
+    test_io_uv_write_open_segment_file(f->dir, 1, 1, 11);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 11);
+    for (i = 0; i < 11; i++) {
+        munit_assert_int(*(uint64_t *)f->entries[i].buf.base, ==, i + 1);
+    }
+
+    raft_io_uv_stats(&f->io, &stats);
+    munit_assert_int(stats.load.n_segments, ==, 11);
+    munit_assert_int(stats.load.n_entries, ==, 11);
+    munit_assert_int(stats.load.checksum, <=, stats.load.segments);
+
+    return MUNIT_OK;
+}
+
+/* A closed segment with per-entry checksums is loaded. */
+TEST_CASE(load_all, success, entry_checksums, NULL)
+{
+    struct load_all__fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    write_entry_checksums_segment(f->dir, 3);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 3);
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(*(uint64_t *)f->entries[i].buf.base, ==, i + 1);
+    }
+
+    return MUNIT_OK;
+}
+
+/* Closed and open segments in the compact format are loaded. */
+TEST_CASE(load_all, success, compact, NULL)
+{
+    struct load_all__fixture *f = data;
+    unsigned i;
+
+    (void)params;
+
+    write_compact_segment(f->dir, "1-3", 3);
+    write_compact_segment(f->dir, "open-1", 1);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 4);
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(f->entries[i].term, ==, 1 + i / 2);
+        munit_assert_int(*(uint64_t *)f->entries[i].buf.base, ==, i + 1);
+    }
+    munit_assert_int(*(uint64_t *)f->entries[3].buf.base, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* The data of entries with their own checksums which are included in the
+ * snapshot is not checked. */
+TEST_CASE(load_all, success, entry_checksums_snapshot, NULL)
+{
+    struct load_all__fixture *f = data;
+    uint8_t buf[WORD_SIZE];
+
+    (void)params;
+
+    test_io_uv_write_snapshot_meta_file(f->dir, 1, 2, 123, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 1, 2, 123, buf, sizeof buf);
+    write_entry_checksums_segment(f->dir, 3);
+
+    memset(buf, 0xff, sizeof buf);
+    test_dir_overwrite_file(f->dir, "1-3", buf, sizeof buf,
+                            ENTRY_CHECKSUMS_DATA_OFFSET(3, 0));
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 1);
+    munit_assert_int(*(uint64_t *)f->entries[0].buf.base, ==, 3);
+
+    return MUNIT_OK;
+}
+
 /* The data directory has an empty open segment. */
 TEST_CASE(load_all, success, open_empty, NULL)
 {
@@ -548,6 +813,32 @@ TEST_CASE(load_all, success, open_truncate, NULL)
     return MUNIT_OK;
 }
 
+/* The data directory has an open segment whose written data is followed by a
+ * zeroed preamble and then by stale non-zero data. Loading stops at the zeroed
+ * preamble and the rest of the file is truncated. */
+TEST_CASE(load_all, success, open_stale_tail, NULL)
+{
+    struct load_all__fixture *f = data;
+    uint8_t buf[256];
+
+    (void)params;
+
+    test_io_uv_write_open_segment_file(f->dir, 1, 1, 1);
+
+    memset(buf, 0, sizeof buf);
+    test_dir_append_file(f->dir, "open-1", buf, sizeof buf);
+    memset(buf, 0xff, sizeof buf);
+    test_dir_append_file(f->dir, "open-1", buf, sizeof buf);
+
+    __load_all_trigger(f, 0);
+
+    munit_assert_int(f->n, ==, 1);
+    munit_assert_false(test_dir_has_file(f->dir, "open-1"));
+    munit_assert_true(test_dir_has_file(f->dir, "1-1"));
+
+    return MUNIT_OK;
+}
+
 /* The data directory has an open segment whose first batch is only
  * partially written. In that case the segment gets removed. */
 TEST_CASE(load_all, success, open_partial_bach, NULL)
@@ -761,6 +1052,44 @@ TEST_CASE(load_all, error, corrupt_data, NULL)
     return MUNIT_OK;
 }
 
+/* The data directory has a closed segment with per-entry checksums, one of
+ * which doesn't match. */
+TEST_CASE(load_all, error, entry_checksums_corrupt, NULL)
+{
+    struct load_all__fixture *f = data;
+    uint8_t buf[WORD_SIZE];
+
+    (void)params;
+
+    write_entry_checksums_segment(f->dir, 3);
+
+    memset(buf, 0xff, sizeof buf);
+    test_dir_overwrite_file(f->dir, "1-3", buf, sizeof buf,
+                            ENTRY_CHECKSUMS_DATA_OFFSET(3, 2));
+
+    __load_all_trigger(f, RAFT_ERR_IO_CORRUPT);
+
+    return MUNIT_OK;
+}
+
+/* The data directory has a closed segment whose last batch is truncated, which
+ * is detected while parsing the memory mapped file. */
+TEST_CASE(load_all, error, closed_short_data, NULL)
+{
+    struct load_all__fixture *f = data;
+    size_t size;
+
+    (void)params;
+
+    size = test_io_uv_write_closed_segment_file(f->dir, 1, 2, 1);
+
+    test_dir_truncate_file(f->dir, "1-2", size - WORD_SIZE / 2);
+
+    __load_all_trigger(f, RAFT_ERR_IO);
+
+    return MUNIT_OK;
+}
+
 /* The data directory has a closed segment whose first index does not match what
  * we expect. */
 TEST_CASE(load_all, error, closed_bad_index, NULL)
@@ -795,7 +1124,7 @@ TEST_CASE(load_all, error, closed_bad_format, NULL)
 {
     struct load_all__fixture *f = data;
 
-    uint8_t buf[8] = {2, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t buf[8] = {3, 0, 0, 0, 0, 0, 0, 0};
 
     (void)params;
 
@@ -852,7 +1181,7 @@ TEST_CASE(load_all, error, open_bad_format, NULL)
 
     (void)params;
 
-    byte__put64(&cursor, 2); /* Format version */
+    byte__put64(&cursor, 6); /* Format version */
 
     test_io_uv_write_open_segment_file(f->dir, 1, 1, 1);
 
@@ -53,10 +53,10 @@ TEST_SETUP(load, setup);
 TEST_TEAR_DOWN(load, tear_down);
 
 /* Write either the metadata1 or metadata2 file, filling it with the given
- * values. */
+ * values. The file has the layout used before the commit index was added. */
 #define load__write(N, FORMAT, VERSION, TERM, VOTED_FOR)        \
     {                                                           \
-        uint8_t buf[RAFT_IO_UV_METADATA_SIZE];                  \
+        uint8_t buf[8 * 4];                                     \
         void *cursor = buf;                                     \
         char filename[strlen("metadataN") + 1];                 \
         sprintf(filename, "metadata%d", N);                     \
@@ -67,6 +67,21 @@ TEST_TEAR_DOWN(load, tear_down);
         test_dir_write_file(f->dir, filename, buf, sizeof buf); \
     }
 
+/* Write either the metadata1 or metadata2 file, including a commit index. */
+#define load__write_commit(N, VERSION, TERM, VOTED_FOR, COMMIT) \
+    {                                                           \
+        uint8_t buf[RAFT_IO_UV_METADATA_SIZE];                  \
+        void *cursor = buf;                                     \
+        char filename[strlen("metadataN") + 1];                 \
+        sprintf(filename, "metadata%d", N);                     \
+        byte__put64(&cursor, 1);                                \
+        byte__put64(&cursor, VERSION);                          \
+        byte__put64(&cursor, TERM);                             \
+        byte__put64(&cursor, VOTED_FOR);                        \
+        byte__put64(&cursor, COMMIT);                           \
+        test_dir_write_file(f->dir, filename, buf, sizeof buf); \
+    }
+
 /* Assert that @io_uv__metadata_load returns the given code. */
 #define load__invoke(RV)                                         \
     {                                                            \
@@ -213,6 +228,41 @@ TEST_CASE(load, 2, NULL)
     return MUNIT_OK;
 }
 
+/* The commit index stored in the most recent file is loaded, and carried over
+ * when rewriting the files. */
+TEST_CASE(load, commit, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[RAFT_IO_UV_METADATA_SIZE];
+    const void *cursor;
+
+    (void)params;
+
+    load__write(1, /* Metadata file index                  */
+                1, /* Format                               */
+                1, /* Version                              */
+                1, /* Term                                 */
+                0 /* Voted for                            */);
+
+    load__write_commit(2, /* Metadata file index           */
+                       2, /* Version                       */
+                       2, /* Term                          */
+                       1, /* Voted for                     */
+                       7 /* Commit index                  */);
+
+    load__invoke(0);
+
+    load__assert_metadata(2, 1);
+    munit_assert_int(f->metadata.commit, ==, 7);
+
+    load__assert_file(1, 3, 2, 1);
+    test_dir_read_file(f->dir, "metadata1", buf, sizeof buf);
+    cursor = buf + 8 * 4;
+    munit_assert_int(byte__get64(&cursor), ==, 7);
+
+    return MUNIT_OK;
+}
+
 /* The metadata1 file has not the expected number of bytes. In this case the
  * file is not considered at all, and the effect is as if this was a brand new
  * server. */
@@ -119,6 +119,104 @@ TEST_CASE(success, second, NULL)
     return MUNIT_OK;
 }
 
+/* Obsolete segment files are reused and their content is zeroed. */
+TEST_CASE(success, recycle, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[8];
+    unsigned i;
+
+    (void)params;
+
+    memset(buf, 0xff, sizeof buf);
+    test_dir_write_file(f->dir, "recycle-1-2", buf, sizeof buf);
+
+    io_uv__prepare_recycle(f->uv, "recycle-1-2");
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+
+    munit_assert_false(test_dir_has_file(f->dir, "recycle-1-2"));
+    munit_assert_true(test_dir_has_file(f->dir, "open-1"));
+
+    test_dir_read_file(f->dir, "open-1", buf, sizeof buf);
+    for (i = 0; i < sizeof buf; i++) {
+        munit_assert_int(buf[i], ==, 0);
+    }
+
+    return MUNIT_OK;
+}
+
+/* The number of prepared segments kept in the pool can be changed. */
+TEST_CASE(success, pool_size, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_prepare_pool_size(&f->io, 3);
+    munit_assert_int(rv, ==, 0);
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+
+    test_uv_run(&f->loop, 3);
+
+    munit_assert_true(test_dir_has_file(f->dir, "open-4"));
+    munit_assert_false(test_dir_has_file(f->dir, "open-5"));
+
+    return MUNIT_OK;
+}
+
+/* Once writes slow down, the segments prepared in excess are removed. */
+TEST_CASE(success, trim_idle, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+    uv__file_close(f->file, (uv__file_close_cb)raft_free);
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+
+    test_uv_run(&f->loop, 2);
+    munit_assert_true(test_dir_has_file(f->dir, "open-3"));
+    munit_assert_true(test_dir_has_file(f->dir, "open-4"));
+
+    /* Pretend no segment was taken for a while. */
+    f->uv->prepare_last_used -= 2 * IO_UV__PREPARE_HORIZON;
+    io_uv__prepare_trim(f->uv);
+
+    test_uv_run(&f->loop, 1);
+    munit_assert_true(test_dir_has_file(f->dir, "open-3"));
+    munit_assert_false(test_dir_has_file(f->dir, "open-4"));
+
+    return MUNIT_OK;
+}
+
+/* The groups of a host don't prepare more segments than its budget. */
+TEST_CASE(success, budget, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    f->uv->host->prepare_budget = 1;
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+
+    test_uv_run(&f->loop, 1);
+    munit_assert_true(test_dir_has_file(f->dir, "open-2"));
+    munit_assert_false(test_dir_has_file(f->dir, "open-3"));
+
+    return MUNIT_OK;
+}
+
 /**
  * Failure scenarios.
  */
@@ -136,6 +234,11 @@ TEST_CASE(error, no_resources, NULL)
 
     (void)params;
 
+    /* With io_uring the AIO subsystem is not used at all. */
+    if (test_uring_supported()) {
+        return MUNIT_SKIP;
+    }
+
     test_aio_fill(&ctx, 0);
 
     prepare__invoke;
@@ -162,6 +265,34 @@ TEST_CASE(error, no_space, NULL)
     return MUNIT_OK;
 }
 
+/* The segment size must be a multiple of the block size, and can't be changed
+ * once segments have been created. */
+TEST_CASE(error, segment_size, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = raft_io_uv_set_segment_size(&f->io, f->uv->block_size + 1);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_segment_size(&f->io, 0);
+    munit_assert_int(rv, ==, RAFT_EINVAL);
+
+    rv = raft_io_uv_set_segment_size(&f->io, 2 * f->uv->block_size);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->uv->n_blocks, ==, 2);
+
+    prepare__invoke;
+    prepare__wait_cb(0);
+
+    rv = raft_io_uv_set_segment_size(&f->io, 4 * f->uv->block_size);
+    munit_assert_int(rv, ==, RAFT_ERR_BUSY);
+
+    return MUNIT_OK;
+}
+
 static char *error_oom_heap_fault_delay[] = {"0", "1", NULL};
 static char *error_oom_heap_fault_repeat[] = {"1", NULL};
 
@@ -0,0 +1,181 @@
+#include "../lib/io_uv.h"
+#include "../lib/runner.h"
+
+#include "../../src/byte.h"
+#include "../../src/entry.h"
+#include "../../src/io_uv.h"
+#include "../../src/queue.h"
+
+TEST_MODULE(io_uv__read);
+
+/**
+ * io_uv__read
+ */
+
+TEST_SUITE(read);
+
+struct read_fixture
+{
+    IO_UV_FIXTURE
+    struct raft_io_read req;
+    bool invoked;
+    int status;
+    struct raft_entry *entries;
+    unsigned n;
+};
+
+static void read_cb(struct raft_io_read *req,
+                    struct raft_entry *entries,
+                    unsigned n,
+                    int status)
+{
+    struct read_fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+    f->entries = entries;
+    f->n = n;
+}
+
+static bool read_cb_was_invoked(void *data)
+{
+    struct read_fixture *f = data;
+    return f->invoked;
+}
+
+TEST_SETUP(read)
+{
+    struct read_fixture *f = munit_malloc(sizeof *f);
+    IO_UV_SETUP;
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+    f->entries = NULL;
+    f->n = 0;
+    return f;
+}
+
+TEST_TEAR_DOWN(read)
+{
+    struct read_fixture *f = data;
+    entry_batches__destroy(f->entries, f->n);
+    IO_UV_TEAR_DOWN;
+}
+
+TEST_GROUP(read, success);
+
+/* Invoke the read method and check that it returns the given code. */
+#define read__invoke(INDEX, N, RV)                           \
+    {                                                        \
+        int rv;                                              \
+        rv = f->io.read(&f->io, &f->req, INDEX, N, read_cb); \
+        munit_assert_int(rv, ==, RV);                        \
+    }
+
+/* Wait for the read callback to fire and check its status. */
+#define read__wait_cb(STATUS)                            \
+    test_uv_run_until(&f->loop, f, read_cb_was_invoked); \
+    munit_assert_int(f->status, ==, STATUS);             \
+    munit_assert_true(RAFT__QUEUE_IS_EMPTY(&f->uv->read_reqs))
+
+/* Assert that the I'th loaded entry has the given data. */
+#define read__assert_entry_data(I, DATA)                                \
+    munit_assert_int(byte__flip64(*(uint64_t *)f->entries[I].buf.base), \
+                     ==, DATA)
+
+/* Read a range of entries from the middle of a closed segment. */
+TEST_CASE(read, success, closed, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 4, 1);
+
+    read__invoke(2, 2, 0);
+    read__wait_cb(0);
+
+    munit_assert_int(f->n, ==, 2);
+    read__assert_entry_data(0, 2);
+    read__assert_entry_data(1, 3);
+
+    return MUNIT_OK;
+}
+
+/* Read a range of entries spanning two closed segments. */
+TEST_CASE(read, success, span, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 2, 1);
+    test_io_uv_write_closed_segment_file(f->dir, 3, 2, 3);
+
+    read__invoke(2, 3, 0);
+    read__wait_cb(0);
+
+    munit_assert_int(f->n, ==, 3);
+    read__assert_entry_data(0, 2);
+    read__assert_entry_data(1, 3);
+    read__assert_entry_data(2, 4);
+
+    return MUNIT_OK;
+}
+
+/* Entries in open segments are not returned. */
+TEST_CASE(read, success, open, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 2, 1);
+    test_io_uv_write_open_segment_file(f->dir, 1, 2, 3);
+
+    read__invoke(2, 3, 0);
+    read__wait_cb(0);
+
+    munit_assert_int(f->n, ==, 1);
+    read__assert_entry_data(0, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the first requested entry is not available, no entry is returned. */
+TEST_CASE(read, success, missing, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 3, 2, 1);
+
+    read__invoke(1, 2, 0);
+    read__wait_cb(0);
+
+    munit_assert_int(f->n, ==, 0);
+    munit_assert_ptr_null(f->entries);
+
+    return MUNIT_OK;
+}
+
+TEST_GROUP(read, error);
+
+/* If a closed segment is cut while being read, the read fails cleanly. */
+TEST_CASE(read, error, shrunk, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 4, 1);
+    test_dir_truncate_file(f->dir, "1-4", 40);
+
+    read__invoke(2, 2, 0);
+    read__wait_cb(RAFT_ERR_IO);
+
+    munit_assert_int(f->n, ==, 0);
+    munit_assert_ptr_null(f->entries);
+
+    return MUNIT_OK;
+}
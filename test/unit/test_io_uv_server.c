@@ -17,9 +17,12 @@ struct fixture
     {
         char handshake[sizeof(uint64_t) * 3 /* Preamble */ + 16 /* Address */];
         struct raft_message message;
+        unsigned group;
     } peer;
     int invoked;
     struct raft_message *message;
+    int batch_invoked;
+    unsigned n_batch;
 };
 
 static void recv_cb(struct raft_io *io, struct raft_message *message)
@@ -29,6 +32,16 @@ static void recv_cb(struct raft_io *io, struct raft_message *message)
     f->message = message;
 }
 
+static void recv_batch_cb(struct raft_io *io,
+                          struct raft_message messages[],
+                          unsigned n)
+{
+    struct fixture *f = io->data;
+    f->batch_invoked++;
+    f->n_batch += n;
+    f->message = &messages[n - 1];
+}
+
 static void *setup(const MunitParameter params[], void *user_data)
 {
     struct fixture *f = munit_malloc(sizeof *f);
@@ -38,8 +51,11 @@ static void *setup(const MunitParameter params[], void *user_data)
     f->peer.message.type = RAFT_IO_REQUEST_VOTE;
     f->peer.message.server_id = 1;
     f->peer.message.server_address = f->tcp.server.address;
+    f->peer.group = 0;
     f->invoked = 0;
     f->message = NULL;
+    f->batch_invoked = 0;
+    f->n_batch = 0;
     return f;
 }
 
@@ -71,7 +87,8 @@ static void tear_down(void *data)
         unsigned n_bufs;                                              \
         unsigned i;                                                   \
         int rv;                                                       \
-        rv = io_uv__encode_message(&f->peer.message, &bufs, &n_bufs); \
+        rv = io_uv__encode_message(&f->peer.message, f->peer.group,   \
+                                   &bufs, &n_bufs);                   \
         munit_assert_int(rv, ==, 0);                                  \
         if (N == 0) {                                                 \
             n = n_bufs;                                               \
@@ -108,6 +125,8 @@ TEST_CASE(success, first, NULL)
     f->peer.message.request_vote.candidate_id = 2;
     f->peer.message.request_vote.last_log_index = 123;
     f->peer.message.request_vote.last_log_term = 2;
+    f->peer.message.request_vote.pre_vote = true;
+    f->peer.message.request_vote.disrupt_leader = false;
 
     recv__peer_connect;
     recv__peer_handshake;
@@ -123,6 +142,8 @@ TEST_CASE(success, first, NULL)
     munit_assert_int(f->message->request_vote.candidate_id, ==, 2);
     munit_assert_int(f->message->request_vote.last_log_index, ==, 123);
     munit_assert_int(f->message->request_vote.last_log_term, ==, 2);
+    munit_assert_true(f->message->request_vote.pre_vote);
+    munit_assert_false(f->message->request_vote.disrupt_leader);
 
     return MUNIT_OK;
 }
@@ -144,6 +165,52 @@ TEST_CASE(success, second, NULL)
     return MUNIT_OK;
 }
 
+/* Several messages sent back to back are all received, possibly by the same
+ * read. */
+TEST_CASE(success, several, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    recv__peer_send;
+    recv__peer_send;
+    recv__peer_send;
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->invoked, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* If a batch callback is set, messages parsed out of the same read are passed
+ * to it all together. */
+TEST_CASE(success, batch, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    f->io.set_recv_batch(&f->io, recv_batch_cb);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    recv__peer_send;
+    recv__peer_send;
+    recv__peer_send;
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->invoked, ==, 0);
+    munit_assert_int(f->batch_invoked, ==, 1);
+    munit_assert_int(f->n_batch, ==, 3);
+
+    return MUNIT_OK;
+}
+
 /* Receive a RequestVote result message. */
 TEST_CASE(success, request_vote_result, NULL)
 {
@@ -154,6 +221,7 @@ TEST_CASE(success, request_vote_result, NULL)
     f->peer.message.type = RAFT_IO_REQUEST_VOTE_RESULT;
     f->peer.message.request_vote_result.term = 3;
     f->peer.message.request_vote_result.vote_granted = true;
+    f->peer.message.request_vote_result.pre_vote = false;
 
     recv__peer_connect;
     recv__peer_handshake;
@@ -164,6 +232,45 @@ TEST_CASE(success, request_vote_result, NULL)
     munit_assert_int(f->message->type, ==, RAFT_IO_REQUEST_VOTE_RESULT);
     munit_assert_int(f->message->request_vote_result.term, ==, 3);
     munit_assert_true(f->message->request_vote_result.vote_granted);
+    munit_assert_false(f->message->request_vote_result.pre_vote);
+
+    return MUNIT_OK;
+}
+
+/* Messages addressed to a group which is not attached to the host are
+ * discarded. */
+TEST_CASE(success, unknown_group, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+
+    (void)params;
+
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = raft_malloc(8);
+    entry.buf.len = 8;
+    strcpy(entry.buf.base, "hello");
+
+    f->peer.message.type = RAFT_IO_APPEND_ENTRIES;
+    f->peer.message.append_entries.entries = &entry;
+    f->peer.message.append_entries.n_entries = 1;
+
+    recv__peer_connect;
+    recv__peer_handshake;
+
+    f->peer.group = 7;
+    recv__peer_send;
+
+    f->peer.group = 0;
+    f->peer.message.type = RAFT_IO_REQUEST_VOTE;
+    recv__peer_send;
+
+    test_uv_run(&f->loop, 2);
+
+    raft_free(entry.buf.base);
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_int(f->message->type, ==, RAFT_IO_REQUEST_VOTE);
 
     return MUNIT_OK;
 }
@@ -213,6 +320,80 @@ TEST_CASE(success, append_entries, NULL)
     return MUNIT_OK;
 }
 
+/* Receive an AppendEntries message whose batch header uses the compact
+ * encoding, carrying the heartbeat round of the leader. */
+TEST_CASE(success, append_entries_compact, NULL)
+{
+    struct fixture *f = data;
+    struct raft_append_entries *p = &f->peer.message.append_entries;
+    struct raft_entry entries[2];
+    char payload1[16] = "hello";
+    char payload2[8] = "world";
+    uv_buf_t prefix;
+    uv_buf_t header;
+    int rv;
+
+    (void)params;
+
+    entries[0].term = 3;
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.base = payload1;
+    entries[0].buf.len = sizeof payload1;
+
+    entries[1].term = 2;
+    entries[1].type = RAFT_CONFIGURATION;
+    entries[1].buf.base = payload2;
+    entries[1].buf.len = sizeof payload2;
+
+    memset(p, 0, sizeof *p);
+    p->term = 3;
+    p->prev_log_index = 10;
+    p->entries = entries;
+    p->n_entries = 2;
+    p->seq = 4;
+
+    header.len = io_uv__sizeof_compact_batch_header(entries, 2);
+    header.base = raft_malloc(header.len);
+    munit_assert_ptr_not_null(header.base);
+    io_uv__encode_compact_batch_header(entries, 2, header.base);
+
+    rv = io_uv__encode_append_entries_prefix(p, f->peer.group, header.len,
+                                             true, true, &prefix);
+    munit_assert_int(rv, ==, 0);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    test_tcp_send(&f->tcp, prefix.base, (int)prefix.len);
+    test_tcp_send(&f->tcp, header.base, (int)header.len);
+    test_tcp_send(&f->tcp, payload1, sizeof payload1);
+    test_tcp_send(&f->tcp, payload2, sizeof payload2);
+
+    raft_free(prefix.base);
+    raft_free(header.base);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_int(f->message->type, ==, RAFT_IO_APPEND_ENTRIES);
+
+    p = &f->message->append_entries;
+    munit_assert_int(p->term, ==, 3);
+    munit_assert_int(p->prev_log_index, ==, 10);
+    munit_assert_int(p->seq, ==, 4);
+    munit_assert_int(p->n_entries, ==, 2);
+    munit_assert_int(p->entries[0].term, ==, 3);
+    munit_assert_int(p->entries[0].type, ==, RAFT_COMMAND);
+    munit_assert_int(p->entries[1].term, ==, 2);
+    munit_assert_int(p->entries[1].type, ==, RAFT_CONFIGURATION);
+    munit_assert_string_equal(p->entries[0].buf.base, "hello");
+    munit_assert_string_equal(p->entries[1].buf.base, "world");
+
+    raft_free(p->entries[0].batch);
+    raft_free(p->entries);
+
+    return MUNIT_OK;
+}
+
 /* Receive an AppendEntries message with no entries (i.e. an heartbeat). */
 TEST_CASE(success, heartbeat, NULL)
 {
@@ -244,6 +425,10 @@ TEST_CASE(success, append_entries_result, NULL)
     f->peer.message.append_entries_result.term = 3;
     f->peer.message.append_entries_result.success = true;
     f->peer.message.append_entries_result.last_log_index = 123;
+    f->peer.message.append_entries_result.conflict_term = 2;
+    f->peer.message.append_entries_result.conflict_index = 100;
+    f->peer.message.append_entries_result.snapshot_index = 20;
+    f->peer.message.append_entries_result.snapshot_offset = 4096;
 
     recv__peer_connect;
     recv__peer_handshake;
@@ -256,6 +441,11 @@ TEST_CASE(success, append_entries_result, NULL)
     munit_assert_int(f->message->append_entries_result.term, ==, 3);
     munit_assert_true(f->message->append_entries_result.success);
     munit_assert_int(f->message->append_entries_result.last_log_index, ==, 123);
+    munit_assert_int(f->message->append_entries_result.conflict_term, ==, 2);
+    munit_assert_int(f->message->append_entries_result.conflict_index, ==, 100);
+    munit_assert_int(f->message->append_entries_result.snapshot_index, ==, 20);
+    munit_assert_int(f->message->append_entries_result.snapshot_offset, ==,
+                     4096);
 
     return MUNIT_OK;
 }
@@ -273,6 +463,8 @@ TEST_CASE(success, install_snapshot, NULL)
     raft_configuration_init(&p->conf);
     rv = raft_configuration_add(&p->conf, 1, "1", true);
     munit_assert_int(rv, ==, 0);
+    p->offset = 0;
+    p->done = true;
     p->data.len = 8;
     p->data.base = raft_malloc(p->data.len);
     *(uint64_t *)p->data.base = byte__flip64(666);
@@ -292,6 +484,8 @@ TEST_CASE(success, install_snapshot, NULL)
     munit_assert_int(f->message->install_snapshot.conf.servers[0].id, ==, 1);
     munit_assert_string_equal(
         f->message->install_snapshot.conf.servers[0].address, "1");
+    munit_assert_int(f->message->install_snapshot.offset, ==, 0);
+    munit_assert_true(f->message->install_snapshot.done);
 
     raft_configuration_close(&f->message->install_snapshot.conf);
 
@@ -303,6 +497,68 @@ TEST_CASE(success, install_snapshot, NULL)
     return MUNIT_OK;
 }
 
+#if defined(HAVE_LZ4)
+/* Receive an InstallSnapshot message with compressed data. */
+TEST_CASE(success, install_snapshot_compressed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot *p = &f->peer.message.install_snapshot;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    uv_buf_t buf;
+    int rv;
+
+    (void)params;
+
+    f->peer.message.type = RAFT_IO_INSTALL_SNAPSHOT;
+    raft_configuration_init(&p->conf);
+    rv = raft_configuration_add(&p->conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    p->offset = 0;
+    p->done = true;
+    p->data.len = 4096;
+    p->data.base = raft_malloc(p->data.len);
+    memset(p->data.base, 'x', p->data.len);
+
+    rv = io_uv__encode_message(&f->peer.message, f->peer.group, &bufs,
+                               &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_bufs, ==, 2);
+
+    rv = io_uv__compress(&bufs[1], 1, bufs[0].len, &buf);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_ptr_not_null(buf.base);
+    munit_assert_int(buf.len, <, bufs[0].len + bufs[1].len);
+    memcpy(buf.base, bufs[0].base, bufs[0].len);
+    io_uv__encode_compressed(buf.base);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    test_tcp_send(&f->tcp, buf.base, buf.len);
+
+    raft_free(buf.base);
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+    raft_free(p->data.base);
+    raft_configuration_close(&p->conf);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->invoked, ==, 1);
+    munit_assert_ptr_not_null(f->message);
+
+    munit_assert_int(f->message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(f->message->install_snapshot.data.len, ==, 4096);
+    munit_assert_int(((char *)f->message->install_snapshot.data.base)[4095],
+                     ==, 'x');
+
+    raft_configuration_close(&f->message->install_snapshot.conf);
+    raft_free(f->message->install_snapshot.data.base);
+
+    return MUNIT_OK;
+}
+#endif
+
 /**
  * Failure scenarios.
  */
@@ -383,6 +639,61 @@ TEST_CASE(error, bad_type, NULL)
     return MUNIT_OK;
 }
 
+/* A message with a compressed payload that can't be decompressed causes the
+ * connection to be aborted. */
+TEST_CASE(error, bad_compressed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot *p = &f->peer.message.install_snapshot;
+    uv_buf_t *bufs;
+    unsigned n_bufs;
+    uint64_t garbage[2] = {0, 0};
+    void *cursor;
+    char *buf;
+    size_t len;
+    int rv;
+
+    (void)params;
+
+    f->peer.message.type = RAFT_IO_INSTALL_SNAPSHOT;
+    raft_configuration_init(&p->conf);
+    rv = raft_configuration_add(&p->conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    p->offset = 0;
+    p->done = true;
+    p->data.len = 64;
+    p->data.base = NULL;
+
+    rv = io_uv__encode_message(&f->peer.message, f->peer.group, &bufs,
+                               &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    raft_configuration_close(&p->conf);
+
+    /* Append the compressed size word and a garbage payload. */
+    len = bufs[0].len + sizeof(uint64_t) + sizeof garbage;
+    buf = raft_malloc(len);
+    munit_assert_ptr_not_null(buf);
+    memcpy(buf, bufs[0].base, bufs[0].len);
+    cursor = buf + bufs[0].len;
+    byte__put64(&cursor, sizeof garbage);
+    memcpy(cursor, garbage, sizeof garbage);
+    io_uv__encode_compressed(buf);
+
+    recv__peer_connect;
+    recv__peer_handshake;
+    test_tcp_send(&f->tcp, buf, (int)len);
+
+    raft_free(buf);
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+
+    test_uv_run(&f->loop, 2);
+
+    munit_assert_int(f->invoked, ==, 0);
+
+    return MUNIT_OK;
+}
+
 static char *error_oom_heap_fault_delay[] = {"3", "4", "5", "6", NULL};
 static char *error_oom_heap_fault_repeat[] = {"1", NULL};
 
@@ -163,6 +163,229 @@ TEST_CASE(put, first, NULL)
     return MUNIT_OK;
 }
 
+/* Snapshots can be written to their own directory, where they are then found
+ * when listing the data directory. */
+TEST_CASE(put, snapshot_dir, NULL)
+{
+    struct put_fixture *f = data;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    struct io_uv__segment_meta *segments;
+    size_t n_segments;
+    struct raft_snapshot snapshot;
+    char dir[1024];
+    int rv;
+
+    (void)params;
+
+    sprintf(dir, "%s/snapshots", f->dir);
+    rv = raft_io_uv_set_snapshot_dir(&f->io, dir);
+    munit_assert_int(rv, ==, 0);
+
+    put__invoke(0);
+    put__wait_cb(0);
+
+    rv = io_uv__load_list(f->uv, &snapshots, &n_snapshots, &segments,
+                          &n_segments);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(n_snapshots, ==, 1);
+    munit_assert_string_equal(snapshots[0].dir, dir);
+    munit_assert_true(test_dir_has_file(dir, snapshots[0].filename));
+    munit_assert_false(test_dir_has_file(f->dir, snapshots[0].filename));
+
+    rv = io_uv__load_snapshot(f->uv, &snapshots[0], &snapshot);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot__close(&snapshot);
+
+    raft_free(snapshots);
+
+    return MUNIT_OK;
+}
+
+static void put_chunk_cb(struct raft_io_snapshot_put *req, int status)
+{
+    bool *invoked = req->data;
+    munit_assert_int(status, ==, 0);
+    *invoked = true;
+}
+
+/* A snapshot can be written chunk by chunk, with the configuration only set
+ * along with the last chunk, which completes even if queued behind the first
+ * one. */
+TEST_CASE(put, chunks, NULL)
+{
+    struct put_fixture *f = data;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    struct io_uv__segment_meta *segments;
+    size_t n_segments;
+    struct raft_snapshot first;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put req;
+    bool invoked = false;
+    size_t size;
+    int rv;
+
+    (void)params;
+
+    memset(f->bufs[0].base, 1, f->bufs[0].len);
+    memset(f->bufs[1].base, 2, f->bufs[1].len);
+
+    first = f->snapshot;
+    raft_configuration_init(&first.configuration);
+    req.data = &invoked;
+
+    rv = f->io.snapshot_put_chunk(&f->io, &req, &first, 0, &f->bufs[0], false,
+                                  put_chunk_cb);
+    munit_assert_int(rv, ==, 0);
+    rv = f->io.snapshot_put_chunk(&f->io, &f->req, &f->snapshot, 8,
+                                  &f->bufs[1], true, put_cb);
+    munit_assert_int(rv, ==, 0);
+
+    put__wait_cb(0);
+    munit_assert_true(invoked);
+    munit_assert_int(f->status, ==, 0);
+
+    rv = io_uv__load_list(f->uv, &snapshots, &n_snapshots, &segments,
+                          &n_segments);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_snapshots, ==, 1);
+
+    rv = io_uv__load_snapshot_chunk(f->uv, &snapshots[0], &snapshot, 6, 4,
+                                    &size);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(size, ==, 16);
+    munit_assert_int(snapshot.configuration.n, ==, 1);
+    munit_assert_int(((uint8_t *)snapshot.bufs[0].base)[1], ==, 1);
+    munit_assert_int(((uint8_t *)snapshot.bufs[0].base)[2], ==, 2);
+    snapshot__close(&snapshot);
+
+    raft_free(snapshots);
+
+    return MUNIT_OK;
+}
+
+/* The metadata file holds the checksums of the snapshot data, which are
+ * verified when loading it, either whole or in chunks. */
+TEST_CASE(put, checksums, NULL)
+{
+    struct put_fixture *f = data;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    struct io_uv__segment_meta *segments;
+    size_t n_segments;
+    struct raft_snapshot snapshot;
+    io_uv__filename filename;
+    uint8_t byte = 0xff;
+    size_t size;
+    int rv;
+
+    (void)params;
+
+    memset(f->bufs[0].base, 1, f->bufs[0].len);
+    memset(f->bufs[1].base, 2, f->bufs[1].len);
+
+    put__invoke(0);
+    put__wait_cb(0);
+
+    rv = io_uv__load_list(f->uv, &snapshots, &n_snapshots, &segments,
+                          &n_segments);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_snapshots, ==, 1);
+
+    rv = io_uv__load_snapshot_chunk(f->uv, &snapshots[0], &snapshot, 6, 4,
+                                    &size);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(size, ==, 16);
+    munit_assert_int(snapshot.bufs[0].len, ==, 4);
+    munit_assert_int(((uint8_t *)snapshot.bufs[0].base)[1], ==, 1);
+    munit_assert_int(((uint8_t *)snapshot.bufs[0].base)[2], ==, 2);
+    snapshot__close(&snapshot);
+
+    strcpy(filename, snapshots[0].filename);
+    filename[strlen(filename) - strlen(".meta")] = 0;
+    test_dir_overwrite_file(f->dir, filename, &byte, sizeof byte, 12);
+
+    rv = io_uv__load_snapshot(f->uv, &snapshots[0], &snapshot);
+    munit_assert_int(rv, ==, RAFT_ERR_IO_CORRUPT);
+
+    rv = io_uv__load_snapshot_chunk(f->uv, &snapshots[0], &snapshot, 0, 4,
+                                    &size);
+    munit_assert_int(rv, ==, RAFT_ERR_IO_CORRUPT);
+
+    raft_free(snapshots);
+
+    return MUNIT_OK;
+}
+
+/* A patched snapshot gets the data of the previous one, with the given ranges
+ * overwritten. */
+TEST_CASE(put, patch, NULL)
+{
+    struct put_fixture *f = data;
+    struct io_uv__snapshot_meta *snapshots;
+    size_t n_snapshots;
+    struct io_uv__segment_meta *segments;
+    size_t n_segments;
+    struct raft_snapshot snapshot;
+    struct raft_snapshot_patch patch;
+    uint8_t bytes[4] = {9, 9, 9, 9};
+    uint8_t *content;
+    int rv;
+
+    (void)params;
+
+    memset(f->bufs[0].base, 1, f->bufs[0].len);
+    memset(f->bufs[1].base, 2, f->bufs[1].len);
+
+    put__invoke(0);
+    put__wait_cb(0);
+
+    patch.offset = 6;
+    patch.buf.base = bytes;
+    patch.buf.len = sizeof bytes;
+
+    f->invoked = false;
+    f->snapshot.index = 9;
+    rv = f->io.snapshot_put_patch(&f->io, &f->req, &f->snapshot, 8, &patch, 1,
+                                  20, put_cb);
+    munit_assert_int(rv, ==, 0);
+    put__wait_cb(0);
+    munit_assert_int(f->status, ==, 0);
+
+    rv = io_uv__load_list(f->uv, &snapshots, &n_snapshots, &segments,
+                          &n_segments);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(n_snapshots, ==, 2);
+    munit_assert_int(snapshots[1].index, ==, 9);
+
+    rv = io_uv__load_snapshot(f->uv, &snapshots[1], &snapshot);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(snapshot.bufs[0].len, ==, 20);
+    content = snapshot.bufs[0].base;
+    munit_assert_int(content[5], ==, 1);
+    munit_assert_int(content[6], ==, 9);
+    munit_assert_int(content[9], ==, 9);
+    munit_assert_int(content[10], ==, 2);
+    munit_assert_int(content[19], ==, 0);
+    snapshot__close(&snapshot);
+
+    raft_free(snapshots);
+
+    /* The base must be the most recent snapshot. */
+    f->invoked = false;
+    f->snapshot.index = 10;
+    rv = f->io.snapshot_put_patch(&f->io, &f->req, &f->snapshot, 8, &patch, 1,
+                                  20, put_cb);
+    munit_assert_int(rv, ==, 0);
+    put__wait_cb(0);
+    munit_assert_int(f->status, ==, RAFT_ERR_IO);
+
+    return MUNIT_OK;
+}
+
 /* Request to install a snapshot right after a truncation request. */
 TEST_CASE(put, after_truncate, NULL)
 {
@@ -181,6 +404,40 @@ TEST_CASE(put, after_truncate, NULL)
     return MUNIT_OK;
 }
 
+static bool compacted(void *data)
+{
+    struct put_fixture *f = data;
+    return !f->uv->compact_pending && f->uv->compact_work.data == NULL;
+}
+
+/* The snapshots made obsolete by a new one are removed in the background after
+ * the request completes. */
+TEST_CASE(put, compact, NULL)
+{
+    struct put_fixture *f = data;
+    uint8_t buf[8];
+
+    (void)params;
+
+    memset(buf, 0, sizeof buf);
+    test_io_uv_write_snapshot_meta_file(f->dir, 1, 2, 123, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 1, 2, 123, buf, sizeof buf);
+    test_io_uv_write_snapshot_meta_file(f->dir, 2, 4, 456, 1, 1);
+    test_io_uv_write_snapshot_data_file(f->dir, 2, 4, 456, buf, sizeof buf);
+
+    put__invoke(0);
+    put__wait_cb(0);
+    munit_assert_int(f->status, ==, 0);
+
+    test_uv_run_until(&f->loop, f, compacted);
+
+    munit_assert_false(test_dir_has_file(f->dir, "snapshot-1-2-123.meta"));
+    munit_assert_false(test_dir_has_file(f->dir, "snapshot-1-2-123"));
+    munit_assert_true(test_dir_has_file(f->dir, "snapshot-2-4-456.meta"));
+
+    return MUNIT_OK;
+}
+
 /**
  * io_uv__snapshot_get
  */
@@ -272,3 +529,122 @@ TEST_CASE(get, first, NULL)
 
     return MUNIT_OK;
 }
+
+/**
+ * io_uv__snapshot_read
+ */
+
+TEST_SUITE(read);
+
+struct read_fixture
+{
+    IO_UV_FIXTURE
+    struct raft_io_snapshot_read req;
+    bool invoked;
+    int status;
+    struct raft_snapshot *snapshot;
+    size_t size;
+};
+
+static void read_cb(struct raft_io_snapshot_read *req,
+                    struct raft_snapshot *snapshot,
+                    size_t size,
+                    int status)
+{
+    struct read_fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+    f->snapshot = snapshot;
+    f->size = size;
+}
+
+static bool read_cb_was_invoked(void *data)
+{
+    struct read_fixture *f = data;
+    return f->invoked;
+}
+
+TEST_SETUP(read)
+{
+    struct read_fixture *f = munit_malloc(sizeof *f);
+    IO_UV_SETUP;
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+    f->snapshot = NULL;
+    f->size = 0;
+    return f;
+}
+
+TEST_TEAR_DOWN(read)
+{
+    struct read_fixture *f = data;
+    if (f->snapshot != NULL) {
+        snapshot__close(f->snapshot);
+        raft_free(f->snapshot);
+    }
+    IO_UV_TEAR_DOWN;
+}
+
+/* Write a snapshot file with 16 bytes of data. */
+#define read__write_snapshot                                      \
+    uint8_t buf[16];                                              \
+    void *cursor = buf;                                           \
+    byte__put64(&cursor, 666);                                    \
+    byte__put64(&cursor, 777);                                    \
+    test_io_uv_write_snapshot_meta_file(f->dir, 3, 8, 123, 1, 1); \
+    test_io_uv_write_snapshot_data_file(f->dir, 3, 8, 123, buf, sizeof buf)
+
+/* Invoke the snapshot_read method and check that it returns the given code. */
+#define read__invoke(TERM, INDEX, OFFSET, LEN, RV)                            \
+    {                                                                         \
+        int rv;                                                               \
+        rv = f->io.snapshot_read(&f->io, &f->req, TERM, INDEX, OFFSET, LEN, \
+                                 read_cb);                                    \
+        munit_assert_int(rv, ==, RV);                                         \
+    }
+
+#define read__wait_cb(STATUS)                               \
+    test_uv_run_until(&f->loop, f, read_cb_was_invoked); \
+    munit_assert_int(f->status, ==, STATUS)
+
+/* Only the requested chunk of the last snapshot is loaded. */
+TEST_CASE(read, chunk, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    read__write_snapshot;
+    read__invoke(0, 0, 8, 8, 0);
+    read__wait_cb(0);
+
+    munit_assert_true(RAFT__QUEUE_IS_EMPTY(&f->uv->snapshot_get_reqs));
+
+    munit_assert_ptr_not_null(f->snapshot);
+    munit_assert_int(f->snapshot->term, ==, 3);
+    munit_assert_int(f->snapshot->index, ==, 8);
+    munit_assert_int(f->size, ==, 16);
+    munit_assert_int(f->snapshot->n_bufs, ==, 1);
+    munit_assert_int(f->snapshot->bufs[0].len, ==, 8);
+    munit_assert_int(byte__flip64(*(uint64_t *)f->snapshot->bufs[0].base), ==,
+                     777);
+
+    return MUNIT_OK;
+}
+
+/* If the requested snapshot is not there anymore, an error is returned. */
+TEST_CASE(read, not_found, NULL)
+{
+    struct read_fixture *f = data;
+
+    (void)params;
+
+    read__write_snapshot;
+    read__invoke(2, 5, 0, 8, 0);
+    read__wait_cb(RAFT_ERR_IO);
+
+    munit_assert_ptr_null(f->snapshot);
+
+    return MUNIT_OK;
+}
@@ -1,3 +1,8 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../lib/fs.h"
 #include "../lib/heap.h"
 #include "../lib/runner.h"
 #include "../lib/tcp.h"
@@ -181,6 +186,26 @@ TEST_CASE(listen, error, bad_protocol, NULL)
     return MUNIT_OK;
 }
 
+/* The address sent by the client is not null-terminated. */
+TEST_CASE(listen, error, bad_address, NULL)
+{
+    struct listen_fixture *f = data;
+
+    (void)params;
+
+    memset(f->handshake.buf + sizeof(uint64_t) * 3, 'x', sizeof(uint64_t) * 2);
+
+    listen__peer_connect;
+    listen__peer_handshake(0);
+
+    listen__wait_connected_cb;
+    listen__wait_read_cb;
+
+    munit_assert_int(f->invoked, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /* Parameters for sending a partial handshake */
 static char *partial_handshake_n[] = {"8", "16", "24", "32", NULL};
 
@@ -377,6 +402,44 @@ TEST_CASE(connect, success, NULL)
     return MUNIT_OK;
 }
 
+/* The socket options of the transport are applied to the connection. */
+TEST_CASE(connect, options, NULL)
+{
+    struct connect_fixture *f = data;
+    struct raft_io_uv_tcp_options options;
+    uv_os_fd_t fd;
+    int value;
+    socklen_t len = sizeof value;
+    int rv;
+
+    (void)params;
+
+    memset(&options, 0, sizeof options);
+    options.no_delay = true;
+    options.keepalive = 10;
+    rv = raft_io_uv_tcp_set_options(&f->transport, &options);
+    munit_assert_int(rv, ==, 0);
+
+    connect__invoke(0);
+    connect__wait_cb(0);
+
+    munit_assert_ptr_not_null(f->stream);
+    rv = uv_fileno((struct uv_handle_s *)f->stream, &fd);
+    munit_assert_int(rv, ==, 0);
+
+    rv = getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, &len);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(value, ==, 1);
+
+    rv = getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, &len);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(value, ==, 1);
+
+    uv_close((struct uv_handle_s *)f->stream, (uv_close_cb)raft_free);
+
+    return MUNIT_OK;
+}
+
 /* The transport is closed immediately after a connect request as been
  * submitted. The request's callback is invoked with RAFT_ERR_IO_CANCELED. */
 TEST_CASE(connect, close, immediately, NULL)
@@ -469,3 +532,217 @@ TEST_CASE(connect, error, oom_async, connect_error_oom_async_params)
 
     return MUNIT_OK;
 }
+
+/**
+ * Unix domain socket transport
+ */
+
+TEST_SUITE(unix_socket);
+
+struct unix_fixture
+{
+    struct raft_heap heap;
+    struct uv_loop_s loop;
+    char *dir;
+    char address1[128];                     /* Address of the listener */
+    char address2[128];                     /* Address of the connector */
+    struct raft_io_uv_transport transport1; /* Listening transport */
+    struct raft_io_uv_transport transport2; /* Connecting transport */
+    struct raft_io_uv_connect req;
+    struct uv_stream_s *connected; /* Stream of the connect callback */
+    struct uv_stream_s *accepted;  /* Stream of the accept callback */
+    unsigned id;
+    char address[128];
+    unsigned long long features;
+    int status;
+};
+
+TEST_SETUP(unix_socket)
+{
+    struct unix_fixture *f = munit_malloc(sizeof *f);
+    int rv;
+    (void)user_data;
+    test_heap_setup(params, &f->heap);
+    test_uv_setup(params, &f->loop);
+    f->dir = test_dir_setup(params);
+    sprintf(f->address1, "%s/1.sock", f->dir);
+    sprintf(f->address2, "%s/2.sock", f->dir);
+    raft_io_uv_unix_init(&f->transport1, &f->loop);
+    raft_io_uv_unix_init(&f->transport2, &f->loop);
+    rv = f->transport1.init(&f->transport1, 1, f->address1);
+    munit_assert_int(rv, ==, 0);
+    rv = f->transport2.init(&f->transport2, 2, f->address2);
+    munit_assert_int(rv, ==, 0);
+    f->transport1.data = f;
+    f->req.data = f;
+    f->connected = NULL;
+    f->accepted = NULL;
+    f->status = -1;
+    return f;
+}
+
+TEST_TEAR_DOWN(unix_socket)
+{
+    struct unix_fixture *f = data;
+    f->transport1.close(&f->transport1, NULL);
+    f->transport2.close(&f->transport2, NULL);
+    test_uv_stop(&f->loop);
+    raft_io_uv_tcp_close(&f->transport1);
+    raft_io_uv_tcp_close(&f->transport2);
+    test_uv_tear_down(&f->loop);
+    test_dir_tear_down(f->dir);
+    test_heap_tear_down(&f->heap);
+    free(f);
+}
+
+static void unix__accept_cb(struct raft_io_uv_transport *t,
+                            unsigned id,
+                            const char *address,
+                            struct uv_stream_s *stream)
+{
+    struct unix_fixture *f = t->data;
+    f->id = id;
+    strcpy(f->address, address);
+    f->accepted = stream;
+}
+
+static void unix__accept_features_cb(struct raft_io_uv_transport *t,
+                                     unsigned id,
+                                     const char *address,
+                                     unsigned long long features,
+                                     struct uv_stream_s *stream)
+{
+    struct unix_fixture *f = t->data;
+    f->features = features;
+    unix__accept_cb(t, id, address, stream);
+}
+
+static void unix__connect_cb(struct raft_io_uv_connect *req,
+                             struct uv_stream_s *stream,
+                             int status)
+{
+    struct unix_fixture *f = req->data;
+    f->status = status;
+    f->connected = stream;
+}
+
+static bool unix__accepted(void *data)
+{
+    struct unix_fixture *f = data;
+    return f->accepted != NULL && f->status != -1;
+}
+
+static bool unix__connect_failed(void *data)
+{
+    struct unix_fixture *f = data;
+    return f->status != -1;
+}
+
+/* A server connects to another one listening on a Unix domain socket, which
+ * accepts the connection once the handshake is received. */
+TEST_CASE(unix_socket, success, NULL)
+{
+    struct unix_fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = f->transport1.listen(&f->transport1, unix__accept_cb);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->transport2.connect(&f->transport2, &f->req, 1, f->address1,
+                               unix__connect_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, unix__accepted);
+
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->id, ==, 2);
+    munit_assert_string_equal(f->address, f->address2);
+
+    uv_close((struct uv_handle_s *)f->connected, (uv_close_cb)raft_free);
+    uv_close((struct uv_handle_s *)f->accepted, (uv_close_cb)raft_free);
+
+    return MUNIT_OK;
+}
+
+/* The features advertised by the connecting server are passed to the accept
+ * callback, after its address. */
+TEST_CASE(unix_socket, features, NULL)
+{
+    struct unix_fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    munit_assert_int(f->transport1.version, ==, 2);
+
+    f->transport2.advertise(&f->transport2, 5);
+    rv = f->transport1.listen_features(&f->transport1,
+                                       unix__accept_features_cb);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->transport2.connect(&f->transport2, &f->req, 1, f->address1,
+                               unix__connect_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, unix__accepted);
+
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->id, ==, 2);
+    munit_assert_string_equal(f->address, f->address2);
+    munit_assert_int(f->features, ==, 5);
+
+    uv_close((struct uv_handle_s *)f->connected, (uv_close_cb)raft_free);
+    uv_close((struct uv_handle_s *)f->accepted, (uv_close_cb)raft_free);
+
+    return MUNIT_OK;
+}
+
+/* A server that advertises no features is accepted with none. */
+TEST_CASE(unix_socket, no_features, NULL)
+{
+    struct unix_fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    f->features = 1;
+    rv = f->transport1.listen_features(&f->transport1,
+                                       unix__accept_features_cb);
+    munit_assert_int(rv, ==, 0);
+
+    rv = f->transport2.connect(&f->transport2, &f->req, 1, f->address1,
+                               unix__connect_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, unix__accepted);
+
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->features, ==, 0);
+
+    uv_close((struct uv_handle_s *)f->connected, (uv_close_cb)raft_free);
+    uv_close((struct uv_handle_s *)f->accepted, (uv_close_cb)raft_free);
+
+    return MUNIT_OK;
+}
+
+/* Connecting to a socket path which nobody is listening on fails. */
+TEST_CASE(unix_socket, refused, NULL)
+{
+    struct unix_fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    rv = f->transport2.connect(&f->transport2, &f->req, 1, f->address1,
+                               unix__connect_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, unix__connect_failed);
+
+    munit_assert_int(f->status, ==, RAFT_ERR_IO_CONNECT);
+    munit_assert_ptr_null(f->connected);
+
+    return MUNIT_OK;
+}
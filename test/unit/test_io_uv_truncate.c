@@ -1,6 +1,7 @@
 #include "../lib/io_uv.h"
 #include "../lib/runner.h"
 
+#include "../../src/entry.h"
 #include "../../src/io_uv.h"
 
 TEST_MODULE(io_uv__truncate);
@@ -13,6 +14,11 @@ struct fixture
 {
     IO_UV_FIXTURE;
     bool appended;
+    struct raft_io_read read;
+    bool read_done;
+    bool read_truncated; /* Whether the segment was cut when the read ended */
+    struct raft_entry *entries;
+    unsigned n;
 };
 
 static void *setup(const MunitParameter params[], void *user_data)
@@ -20,12 +26,18 @@ static void *setup(const MunitParameter params[], void *user_data)
     struct fixture *f = munit_malloc(sizeof *f);
     IO_UV_SETUP;
     f->appended = false;
+    f->read.data = f;
+    f->read_done = false;
+    f->read_truncated = false;
+    f->entries = NULL;
+    f->n = 0;
     return f;
 }
 
 static void tear_down(void *data)
 {
     struct fixture *f = data;
+    entry_batches__destroy(f->entries, f->n);
     IO_UV_TEAR_DOWN;
     free(f);
 }
@@ -68,6 +80,45 @@ static void append_cb(void *data, int status)
         free(entries);                                                  \
     }
 
+/* Return true if the first segment was truncated to only contain the first
+ * entry and the truncate journal was removed. */
+static bool truncated_to_first(struct fixture *f)
+{
+    return test_dir_has_file(f->dir, "1-1") &&
+           !test_dir_has_file(f->dir, "truncate-1-1");
+}
+
+/* Return true if the log was truncated to the first entry and the new entries
+ * were appended. */
+static bool replaced(struct fixture *f)
+{
+    return f->appended && truncated_to_first(f);
+}
+
+static bool truncated_to_third(struct fixture *f)
+{
+    return test_dir_has_file(f->dir, "1-3") &&
+           !test_dir_has_file(f->dir, "truncate-1-3");
+}
+
+static void read_cb(struct raft_io_read *req,
+                    struct raft_entry *entries,
+                    unsigned n,
+                    int status)
+{
+    struct fixture *f = req->data;
+    munit_assert_int(status, ==, 0);
+    f->read_done = true;
+    f->read_truncated = truncated_to_first(f);
+    f->entries = entries;
+    f->n = n;
+}
+
+static bool read_done(struct fixture *f)
+{
+    return f->read_done;
+}
+
 #define invoke(N, RV)                   \
     {                                   \
         int rv;                         \
@@ -120,7 +171,8 @@ TEST_CASE(success, partial_segment, NULL)
     append(3);
     append(1);
     invoke(2, 0);
-    test_uv_run(&f->loop, 3);
+    /* Finalize, write the truncate journal, then apply it. */
+    test_uv_run_until(&f->loop, f, truncated_to_first);
 
     munit_assert_false(test_dir_has_file(f->dir, "1-3"));
     munit_assert_false(test_dir_has_file(f->dir, "4-4"));
@@ -139,6 +191,150 @@ TEST_CASE(success, partial_segment, NULL)
     return MUNIT_OK;
 }
 
+/* Entries appended after a truncate request are written as soon as the
+ * truncation is durable, without waiting for the affected segment to be
+ * rewritten. */
+TEST_CASE(success, append_after, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+    int rv;
+
+    (void)params;
+
+    append(3);
+    append(1);
+    invoke(2, 0);
+
+    entry.term = 2;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = munit_malloc(8);
+    entry.buf.len = 8;
+    entry.batch = NULL;
+
+    f->appended = false;
+    rv = (f->io.append)(&f->io, &entry, 1, f, append_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, replaced);
+    free(entry.buf.base);
+
+    munit_assert_true(test_dir_has_file(f->dir, "1-1"));
+    munit_assert_false(test_dir_has_file(f->dir, "truncate-1-1"));
+
+    return MUNIT_OK;
+}
+
+/* Replacing entries truncates the log and writes the new entries once the
+ * truncation is durable. */
+TEST_CASE(success, replace, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+    int rv;
+
+    (void)params;
+
+    append(3);
+    append(1);
+
+    entry.term = 2;
+    entry.type = RAFT_COMMAND;
+    entry.buf.base = munit_malloc(8);
+    entry.buf.len = 8;
+    entry.batch = NULL;
+
+    f->appended = false;
+    rv = f->io.replace(&f->io, 2, &entry, 1, f, append_cb);
+    munit_assert_int(rv, ==, 0);
+
+    test_uv_run_until(&f->loop, f, replaced);
+
+    munit_assert_false(test_dir_has_file(f->dir, "4-4"));
+
+    free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
+/* A closed segment is not cut while a read is parsing it, and reads submitted
+ * in the meantime wait for the truncation to complete. */
+TEST_CASE(success, read_in_flight, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_read read;
+    int rv;
+
+    (void)params;
+
+    /* Produce the closed segment 1-3, followed by entry 4. */
+    append(3);
+    append(1);
+    invoke(4, 0);
+    test_uv_run_until(&f->loop, f, truncated_to_third);
+    f->appended = false;
+    append(1);
+
+    rv = f->io.read(&f->io, &f->read, 1, 3, read_cb);
+    munit_assert_int(rv, ==, 0);
+
+    /* The truncation waits for the read in flight. */
+    invoke(2, 0);
+    munit_assert_ptr_null(f->uv->truncate_work.data);
+
+    test_uv_run_until(&f->loop, f, read_done);
+    munit_assert_false(f->read_truncated);
+    munit_assert_int(f->n, ==, 3);
+    entry_batches__destroy(f->entries, f->n);
+    f->entries = NULL;
+    f->n = 0;
+
+    /* A read submitted while the truncation is pending waits for it. */
+    f->read_done = false;
+    read.data = f;
+    rv = f->io.read(&f->io, &read, 1, 3, read_cb);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(RAFT__QUEUE_IS_EMPTY(&f->uv->read_reqs));
+
+    test_uv_run_until(&f->loop, f, read_done);
+    munit_assert_true(f->read_truncated);
+    munit_assert_int(f->n, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Recovery of interrupted truncations.
+ */
+
+TEST_SUITE(recover);
+
+TEST_SETUP(recover, setup);
+TEST_TEAR_DOWN(recover, tear_down);
+
+/* An incomplete journal is discarded, leaving the segment untouched. */
+TEST_CASE(recover, incomplete, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[8];
+    int rv;
+
+    (void)params;
+
+    memset(buf, 0, sizeof buf);
+
+    test_io_uv_write_closed_segment_file(f->dir, 1, 3, 1);
+    test_dir_write_file(f->dir, "truncate-1-1", buf, sizeof buf);
+
+    rv = io_uv__truncate_recover(f->uv);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_false(test_dir_has_file(f->dir, "truncate-1-1"));
+    munit_assert_true(test_dir_has_file(f->dir, "1-3"));
+
+    return MUNIT_OK;
+}
+
 /**
  * Failure scenarios.
  */
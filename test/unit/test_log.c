@@ -45,6 +45,8 @@ static void tear_down(void *data)
 #define LAST_INDEX log__last_index(&f->log)
 #define TERM_OF(INDEX) log__term_of(&f->log, INDEX)
 #define LAST_TERM log__last_term(&f->log)
+#define FIRST_INDEX_OF_TERM(INDEX) log__first_index_of_term(&f->log, INDEX)
+#define LAST_INDEX_OF_TERM(TERM) log__last_index_of_term(&f->log, TERM)
 #define GET(INDEX) log__get(&f->log, INDEX)
 
 #define SET_OFFSET(OFFSET) log__set_offset(&f->log, OFFSET)
@@ -99,6 +101,13 @@ static void tear_down(void *data)
         munit_assert_int(rv, ==, 0);                     \
     }
 
+#define ACQUIRE_N(INDEX, MAX)                                   \
+    {                                                           \
+        int rv;                                                 \
+        rv = log__acquire_n(&f->log, INDEX, MAX, &entries, &n); \
+        munit_assert_int(rv, ==, 0);                            \
+    }
+
 #define RELEASE(INDEX) log__release(&f->log, INDEX, entries, n);
 
 #define TRUNCATE(N) log__truncate(&f->log, N)
@@ -130,22 +139,36 @@ static void tear_down(void *data)
         munit_assert_int(entry->term, ==, TERM); \
     }
 
+/* Return the reference count of the entry with the given index, which must be
+ * in the log. */
+static unsigned refcount_of(struct raft_log *l, raft_index index)
+{
+    size_t i = l->front + (size_t)(index - 1 - l->offset);
+    struct raft_log_block *block;
+    block = l->blocks[(l->head + i / RAFT_LOG_BLOCK_SIZE) % l->n_blocks];
+    return block->refs[i % RAFT_LOG_BLOCK_SIZE].count;
+}
+
 /* Assert that the number of outstanding references for the entry at INDEX
- * equals COUNT. */
-#define ASSERT_REFCOUNT(INDEX, COUNT)                                 \
-    {                                                                 \
-        size_t i;                                                     \
-        munit_assert_ptr_not_null(f->log.refs);                       \
-        for (i = 0; i < f->log.refs_size; i++) {                      \
-            if (f->log.refs[i].index == INDEX) {                      \
-                munit_assert_int(f->log.refs[i].count, ==, COUNT);    \
-                break;                                                \
-            }                                                         \
-        }                                                             \
-        if (i == f->log.refs_size) {                                  \
-            munit_errorf("no refcount found for entry with index %d", \
-                         (int)INDEX);                                 \
-        }                                                             \
+ * equals COUNT. The entry is looked up first in the log and then among the
+ * detached ones. An entry which is not found has no references. */
+#define ASSERT_REFCOUNT(INDEX, COUNT)                                \
+    {                                                                \
+        const struct raft_entry *entry_ = log__get(&f->log, INDEX);  \
+        const struct raft_entry_ref *ref_;                           \
+        unsigned count_ = 0;                                         \
+        if (entry_ != NULL) {                                        \
+            count_ = refcount_of(&f->log, INDEX);                    \
+        } else {                                                     \
+            for (ref_ = f->log.detached; ref_ != NULL;               \
+                 ref_ = ref_->next) {                                \
+                if (ref_->index == INDEX) {                          \
+                    count_ = ref_->count;                            \
+                    break;                                           \
+                }                                                    \
+            }                                                        \
+        }                                                            \
+        munit_assert_int(count_, ==, COUNT);                         \
     }
 
 /******************************************************************************
@@ -168,8 +191,8 @@ TEST_CASE(n_entries, empty, NULL)
     return MUNIT_OK;
 }
 
-/* The log is not wrapped. */
-TEST_CASE(n_entries, not_wrapped, NULL)
+/* The log has a single entry. */
+TEST_CASE(n_entries, one, NULL)
 {
     struct fixture *f = data;
     (void)params;
@@ -178,8 +201,8 @@ TEST_CASE(n_entries, not_wrapped, NULL)
     return MUNIT_OK;
 }
 
-/* The log is wrapped. */
-TEST_CASE(n_entries, wrapped, NULL)
+/* The log had its first entries shifted before appending more. */
+TEST_CASE(n_entries, shifted, NULL)
 {
     struct fixture *f = data;
     (void)params;
@@ -211,8 +234,8 @@ TEST_CASE(n_entries, offset_not_empty, NULL)
     return MUNIT_OK;
 }
 
-/* The log has an offset and is wrapped. */
-TEST_CASE(n_entries, offset_and_wrapped, NULL)
+/* The log has an offset and had its first entries shifted. */
+TEST_CASE(n_entries, offset_and_shifted, NULL)
 {
     struct fixture *f = data;
     (void)params;
@@ -424,6 +447,71 @@ TEST_CASE(term_of, two_with_offset, NULL)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * log__known_term_of
+ *
+ *****************************************************************************/
+
+TEST_SUITE(known_term_of);
+
+TEST_SETUP(known_term_of, setup);
+TEST_TEAR_DOWN(known_term_of, tear_down);
+
+/* The terms of entries in the log are known. */
+TEST_CASE(known_term_of, in_log, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND(1 /* term */);
+    APPEND_MANY(2 /* term */, 2 /* n */);
+    munit_assert_int(log__known_term_of(&f->log, 0), ==, 0);
+    munit_assert_int(log__known_term_of(&f->log, 1), ==, 1);
+    munit_assert_int(log__known_term_of(&f->log, 3), ==, 2);
+    munit_assert_int(log__known_term_of(&f->log, 4), ==, 0);
+    return MUNIT_OK;
+}
+
+/* The terms of shifted entries are known back to the first entry with the
+ * term of the last one shifted. */
+TEST_CASE(known_term_of, shifted, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND(1 /* term */);
+    APPEND_MANY(2 /* term */, 3 /* n */);
+    APPEND(3 /* term */);
+    SHIFT(3);
+    munit_assert_int(TERM_OF(3), ==, 0);
+    munit_assert_int(log__known_term_of(&f->log, 1), ==, 0);
+    munit_assert_int(log__known_term_of(&f->log, 2), ==, 2);
+    munit_assert_int(log__known_term_of(&f->log, 3), ==, 2);
+    munit_assert_int(log__known_term_of(&f->log, 5), ==, 3);
+    SHIFT(5);
+    munit_assert_int(N_ENTRIES, ==, 0);
+    munit_assert_int(log__known_term_of(&f->log, 4), ==, 0);
+    munit_assert_int(log__known_term_of(&f->log, 5), ==, 3);
+    return MUNIT_OK;
+}
+
+/* The terms of truncated entries are not known anymore, and appending entries
+ * with a new term at their place starts a new run. */
+TEST_CASE(known_term_of, truncated, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND(1 /* term */);
+    APPEND_MANY(2 /* term */, 3 /* n */);
+    TRUNCATE(3);
+    munit_assert_int(log__known_term_of(&f->log, 2), ==, 2);
+    munit_assert_int(log__known_term_of(&f->log, 3), ==, 0);
+    APPEND(3 /* term */);
+    munit_assert_int(log__known_term_of(&f->log, 3), ==, 3);
+    munit_assert_int(FIRST_INDEX_OF_TERM(3), ==, 3);
+    munit_assert_int(LAST_INDEX_OF_TERM(2), ==, 2);
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * log__last_term
@@ -444,6 +532,103 @@ TEST_CASE(last_term, empty_log, NULL)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * log__first_index_of_term
+ *
+ *****************************************************************************/
+
+TEST_SUITE(first_index_of_term);
+
+TEST_SETUP(first_index_of_term, setup);
+TEST_TEAR_DOWN(first_index_of_term, tear_down);
+
+/* If there's no entry with the given index, 0 is returned. */
+TEST_CASE(first_index_of_term, missing, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    munit_assert_int(FIRST_INDEX_OF_TERM(1), ==, 0);
+    return MUNIT_OK;
+}
+
+/* The first index of the term of the given entry is returned. */
+TEST_CASE(first_index_of_term, many, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    SET_OFFSET(1);
+    APPEND(1 /* term */);
+    APPEND_MANY(2 /* term */, 3 /* n */);
+    APPEND(3 /* term */);
+    munit_assert_int(FIRST_INDEX_OF_TERM(2), ==, 2);
+    munit_assert_int(FIRST_INDEX_OF_TERM(4), ==, 3);
+    munit_assert_int(FIRST_INDEX_OF_TERM(6), ==, 6);
+    return MUNIT_OK;
+}
+
+/* Only entries still in the log are considered. */
+TEST_CASE(first_index_of_term, shifted, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND_MANY(1 /* term */, 4 /* n */);
+    SHIFT(2);
+    munit_assert_int(FIRST_INDEX_OF_TERM(2), ==, 0);
+    munit_assert_int(FIRST_INDEX_OF_TERM(4), ==, 3);
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * log__last_index_of_term
+ *
+ *****************************************************************************/
+
+TEST_SUITE(last_index_of_term);
+
+TEST_SETUP(last_index_of_term, setup);
+TEST_TEAR_DOWN(last_index_of_term, tear_down);
+
+/* If the log is empty, 0 is returned. */
+TEST_CASE(last_index_of_term, empty, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    munit_assert_int(LAST_INDEX_OF_TERM(1), ==, 0);
+    return MUNIT_OK;
+}
+
+/* The last index of the given term is returned, or 0 if there's no entry with
+ * that term. */
+TEST_CASE(last_index_of_term, many, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND(1 /* term */);
+    APPEND_MANY(3 /* term */, 3 /* n */);
+    APPEND(4 /* term */);
+    munit_assert_int(LAST_INDEX_OF_TERM(1), ==, 1);
+    munit_assert_int(LAST_INDEX_OF_TERM(2), ==, 0);
+    munit_assert_int(LAST_INDEX_OF_TERM(3), ==, 4);
+    munit_assert_int(LAST_INDEX_OF_TERM(4), ==, 5);
+    munit_assert_int(LAST_INDEX_OF_TERM(5), ==, 0);
+    return MUNIT_OK;
+}
+
+/* Only entries still in the log are considered. */
+TEST_CASE(last_index_of_term, shifted, NULL)
+{
+    struct fixture *f = data;
+    (void)params;
+    APPEND_MANY(1 /* term */, 2 /* n */);
+    APPEND_MANY(2 /* term */, 2 /* n */);
+    SHIFT(3);
+    munit_assert_int(LAST_INDEX_OF_TERM(1), ==, 0);
+    munit_assert_int(LAST_INDEX_OF_TERM(2), ==, 4);
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * log__get
@@ -558,6 +743,75 @@ TEST_CASE(set_offset, one, NULL)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * log__reserve
+ *
+ *****************************************************************************/
+
+TEST_SUITE(reserve);
+
+TEST_SETUP(reserve, setup);
+TEST_TEAR_DOWN(reserve, tear_down);
+
+/* The blocks ring is grown once to hold all the entries, without allocating
+ * the blocks themselves. */
+TEST_CASE(reserve, empty, NULL)
+{
+    struct fixture *f = data;
+    struct raft_log_block **blocks;
+    int rv;
+    (void)params;
+
+    rv = log__reserve(&f->log, 5 * RAFT_LOG_BLOCK_SIZE);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->log.n_blocks, ==, 8);
+    munit_assert_int(f->log.size, ==, 0);
+
+    blocks = f->log.blocks;
+    APPEND_MANY(1 /* term */, 5 * RAFT_LOG_BLOCK_SIZE /* n */);
+    munit_assert_ptr_equal(f->log.blocks, blocks);
+    munit_assert_int(f->log.n_blocks, ==, 8);
+
+    return MUNIT_OK;
+}
+
+/* If the ring is already long enough, nothing happens. */
+TEST_CASE(reserve, enough, NULL)
+{
+    struct fixture *f = data;
+    struct raft_log_block **blocks;
+    int rv;
+    (void)params;
+
+    APPEND(1 /* term */);
+    blocks = f->log.blocks;
+
+    rv = log__reserve(&f->log, RAFT_LOG_BLOCK_SIZE);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_ptr_equal(f->log.blocks, blocks);
+    munit_assert_int(f->log.n_blocks, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Out of memory. */
+TEST_CASE(reserve, oom, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+    (void)params;
+
+    test_heap_fault_config(&f->heap, 0, 1);
+    test_heap_fault_enable(&f->heap);
+
+    rv = log__reserve(&f->log, 3 * RAFT_LOG_BLOCK_SIZE);
+    munit_assert_int(rv, ==, RAFT_ENOMEM);
+    munit_assert_int(f->log.n_blocks, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * log__append
@@ -577,10 +831,10 @@ TEST_CASE(append, one, NULL)
 
     APPEND(1 /* term */);
 
-    ASSERT(2 /* size                                                    */,
-           0 /* front                                                   */,
-           1 /* back                                                    */,
-           0 /* offset                                                  */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           1 /* back                                                */,
+           0 /* offset                                              */,
            1 /* n */);
     ASSERT_TERM_OF(1 /* entry index */, 1 /* term */);
     ASSERT_REFCOUNT(1 /* entry index */, 1 /* count */);
@@ -597,10 +851,10 @@ TEST_CASE(append, two, NULL)
     APPEND(1 /* term */);
     APPEND(1 /* term */);
 
-    ASSERT(6 /* size                                                    */,
-           0 /* front                                                   */,
-           2 /* back                                                    */,
-           0 /* offset                                                  */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           2 /* back                                                */,
+           0 /* offset                                              */,
            2 /* n */);
     ASSERT_TERM_OF(1 /* entry index */, 1 /* term */);
     ASSERT_TERM_OF(2 /* entry index */, 1 /* term */);
@@ -617,19 +871,14 @@ TEST_CASE(append, three, NULL)
 
     (void)params;
 
-    /* One -> [e1, NULL] */
     APPEND(1 /* term */);
-
-    /* Two -> [e1, e2, NULL, NULL, NULL, NULL] */
     APPEND(1 /* term */);
-
-    /* Three -> [e1, e2, e3, NULL, NULL, NULL] */
     APPEND(1 /* term */);
 
-    ASSERT(6 /* size                                                    */,
-           0 /* front                                                   */,
-           3 /* back                                                    */,
-           0 /* offset                                                  */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           3 /* back                                                */,
+           0 /* offset                                              */,
            3 /* n */);
     ASSERT_TERM_OF(1 /* entry index */, 1 /* term */);
     ASSERT_TERM_OF(2 /* entry index */, 1 /* term */);
@@ -641,8 +890,8 @@ TEST_CASE(append, three, NULL)
     return MUNIT_OK;
 }
 
-/* Append enough entries to force the reference count hash table to be
- * resized. */
+/* Append enough entries to force several blocks to be added and the ring of
+ * blocks to be grown several times. */
 TEST_CASE(append, many, NULL)
 {
     struct fixture *f = data;
@@ -651,54 +900,58 @@ TEST_CASE(append, many, NULL)
     for (i = 0; i < 3000; i++) {
         APPEND(1 /* term */);
     }
-    munit_assert_int(f->log.refs_size, ==, 4096);
+    munit_assert_int(f->log.size, ==,
+                     (3000 + RAFT_LOG_BLOCK_SIZE - 1) / RAFT_LOG_BLOCK_SIZE *
+                         RAFT_LOG_BLOCK_SIZE);
+    for (i = 1; i <= 3000; i++) {
+        ASSERT_REFCOUNT(i, 1);
+    }
     return MUNIT_OK;
 }
 
-/* Append to wrapped log that needs to be grown. */
-TEST_CASE(append, wrap, NULL)
+/* Append to a log whose only block is full, then shift away all entries of the
+ * first block. */
+TEST_CASE(append, blocks, NULL)
 {
     struct fixture *f = data;
     (void)params;
 
-    APPEND_MANY(1 /* term */, 5 /* n */);
+    APPEND_MANY(1 /* term */, RAFT_LOG_BLOCK_SIZE /* n */);
 
-    /* Now the log is [e1, e2, e3, e4, e5, NULL] */
-    ASSERT(6 /* size                                                    */,
-           0 /* front                                                   */,
-           5 /* back                                                    */,
-           0 /* offset                                                  */,
-           5 /* n */);
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           RAFT_LOG_BLOCK_SIZE /* back                              */,
+           0 /* offset                                              */,
+           RAFT_LOG_BLOCK_SIZE /* n */);
 
-    /* Delete the first 4 entries. */
-    SHIFT(4);
+    /* Delete all entries but the last one. */
+    SHIFT(RAFT_LOG_BLOCK_SIZE - 1);
 
-    /* Now the log is [NULL, NULL, NULL, NULL, e5, NULL] */
-    ASSERT(6 /* size                                                    */,
-           4 /* front                                                   */,
-           5 /* back                                                    */,
-           4 /* offset                                                  */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* front                         */,
+           RAFT_LOG_BLOCK_SIZE /* back                              */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* offset                        */,
            1 /* n */);
 
-    /* Append another 3 entries. */
-    APPEND_MANY(1 /* term */, 3 /* n */);
+    /* Append another 2 entries, which go in a new block. */
+    APPEND_MANY(1 /* term */, 2 /* n */);
 
-    /* Now the log is [e7, e8, NULL, NULL, e5, e6] */
-    ASSERT(6 /* size                                                    */,
-           4 /* front                                                   */,
-           2 /* back                                                    */,
-           4 /* offset                                                  */,
-           4 /* n */);
+    ASSERT(2 * RAFT_LOG_BLOCK_SIZE /* size                          */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* front                         */,
+           RAFT_LOG_BLOCK_SIZE + 2 /* back                          */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* offset                        */,
+           3 /* n */);
 
-    /* Append another 3 entries. */
-    APPEND_MANY(1 /* term */, 3 /* n */);
+    /* Delete the last entry of the first block, which gets released. */
+    SHIFT(RAFT_LOG_BLOCK_SIZE);
 
-    /* Now the log is [e5, ..., e11, NULL, ..., NULL] */
-    ASSERT(14 /* size                                                 */,
-           0 /* front                                                 */,
-           7 /* back                                                  */,
-           4 /* offset                                                */,
-           7 /* n */);
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           2 /* back                                                */,
+           RAFT_LOG_BLOCK_SIZE /* offset                            */,
+           2 /* n */);
+    ASSERT_TERM_OF(RAFT_LOG_BLOCK_SIZE + 1 /* entry index */, 1 /* term */);
+    ASSERT_TERM_OF(RAFT_LOG_BLOCK_SIZE + 2 /* entry index */, 1 /* term */);
 
     return MUNIT_OK;
 }
@@ -712,10 +965,10 @@ TEST_CASE(append, batch, NULL)
 
     APPEND_BATCH(3);
 
-    ASSERT(6 /* size                                                 */,
-           0 /* front                                                 */,
-           3 /* back                                                  */,
-           0 /* offset                                                */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           3 /* back                                                */,
+           0 /* offset                                              */,
            3 /* n */);
 
     return MUNIT_OK;
@@ -723,7 +976,7 @@ TEST_CASE(append, batch, NULL)
 
 TEST_GROUP(append, error);
 
-static char *append_oom_heap_fault_delay[] = {"0", "1", NULL};
+static char *append_oom_heap_fault_delay[] = {"0", "1", "2", NULL};
 static char *append_oom_heap_fault_repeat[] = {"1", NULL};
 
 static MunitParameterEnum append_oom_params[] = {
@@ -747,23 +1000,25 @@ TEST_CASE(append, error, oom, append_oom_params)
     return MUNIT_OK;
 }
 
-/* Out of memory when trying to grow the refs count table. */
-TEST_CASE(append, error, oom_refs, NULL)
+/* Out of memory when trying to allocate the counter of a new batch. */
+TEST_CASE(append, error, oom_batch, NULL)
 {
     struct fixture *f = data;
     struct raft_buffer buf;
+    void *batch;
     int rv;
     (void)params;
 
-    APPEND_MANY(1, LOG__REFS_INITIAL_SIZE);
+    APPEND_MANY(1 /* term */, 2 /* n */);
 
     test_heap_fault_config(&f->heap, 0, 1);
     test_heap_fault_enable(&f->heap);
 
+    batch = &buf; /* Any non-NULL pointer works */
     buf.base = NULL;
     buf.len = 0;
 
-    rv = log__append(&f->log, 1, RAFT_COMMAND, &buf, NULL);
+    rv = log__append(&f->log, 1, RAFT_COMMAND, &buf, batch);
     munit_assert_int(rv, ==, RAFT_ENOMEM);
 
     return MUNIT_OK;
@@ -813,6 +1068,99 @@ TEST_CASE(append_configuration, error, oom, append_configuration_oom_params)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * log__append_acquire
+ *
+ *****************************************************************************/
+
+TEST_SUITE(append_acquire);
+
+TEST_SETUP(append_acquire, setup);
+TEST_TEAR_DOWN(append_acquire, tear_down);
+
+/* Append a received batch of entries, which are acquired in place. */
+TEST_CASE(append_acquire, batch, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    unsigned n = 2;
+    void *batch;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    APPEND(1 /* term */);
+
+    batch = raft_malloc(8 * n);
+    munit_assert_ptr_not_null(batch);
+    entries = raft_malloc(n * sizeof *entries);
+    munit_assert_ptr_not_null(entries);
+    for (i = 0; i < n; i++) {
+        entries[i].term = 2;
+        entries[i].type = RAFT_COMMAND;
+        entries[i].buf.base = batch + i * 8;
+        entries[i].buf.len = 8;
+        entries[i].batch = batch;
+    }
+
+    rv = log__append_acquire(&f->log, entries, n);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(N_ENTRIES, ==, 3);
+    ASSERT_TERM_OF(3, 2);
+    ASSERT_REFCOUNT(2, 2);
+    ASSERT_REFCOUNT(3, 2);
+    munit_assert_ptr_equal(GET(2)->buf.base, batch);
+
+    /* Truncate the received entries, so the only references left for their
+     * batch are the acquired ones. */
+    TRUNCATE(2);
+
+    RELEASE(2);
+
+    munit_assert_int(N_ENTRIES, ==, 1);
+
+    return MUNIT_OK;
+}
+
+TEST_GROUP(append_acquire, error);
+
+/* Out of memory when allocating the counter of the batch. The entries
+ * appended so far are not acquired. */
+TEST_CASE(append_acquire, error, oom, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[2];
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    buf.base = NULL;
+    buf.len = 0;
+    for (i = 0; i < 2; i++) {
+        entries[i].term = 1;
+        entries[i].type = RAFT_COMMAND;
+        entries[i].buf = buf;
+        entries[i].batch = i == 0 ? NULL : &buf; /* Any non-NULL pointer */
+    }
+
+    /* Let the allocations of the first block and of the runs table pass. */
+    test_heap_fault_config(&f->heap, 3, 1);
+    test_heap_fault_enable(&f->heap);
+
+    rv = log__append_acquire(&f->log, entries, 2);
+    munit_assert_int(rv, ==, RAFT_ENOMEM);
+
+    munit_assert_int(N_ENTRIES, ==, 1);
+    ASSERT_REFCOUNT(1, 1);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * log__acquire
@@ -880,8 +1228,8 @@ TEST_CASE(acquire, two, NULL)
     return MUNIT_OK;
 }
 
-/* Acquire two log entries in a wrapped log. */
-TEST_CASE(acquire, wrap, NULL)
+/* Acquire log entries spanning two blocks. */
+TEST_CASE(acquire, blocks, NULL)
 {
     struct fixture *f = data;
     struct raft_entry *entries;
@@ -889,40 +1237,28 @@ TEST_CASE(acquire, wrap, NULL)
 
     (void)params;
 
-    APPEND_MANY(1 /* term */, 5 /* n */);
+    APPEND_MANY(1 /* term */, RAFT_LOG_BLOCK_SIZE + 2 /* n */);
 
-    /* Now the log is [e1, e2, e3, e4, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           0 /* front                                                */,
-           5 /* back                                                 */,
-           0 /* offset                                               */,
-           5 /* n */);
+    /* Delete all entries but the last two of the first block. */
+    SHIFT(RAFT_LOG_BLOCK_SIZE - 2);
 
-    /* Delete the first 4 entries. */
-    SHIFT(4);
-
-    /* Now the log is [NULL, NULL, NULL, NULL, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           5 /* back                                                 */,
-           4 /* offset                                               */,
-           1 /* n */);
-
-    /* Append another 3 entries. */
-    APPEND_MANY(1 /* term */, 3 /* n */);
-
-    /* Now the log is [e7, e8, NULL, NULL, e5, e6] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           2 /* back                                                 */,
-           4 /* offset                                               */,
+    ASSERT(2 * RAFT_LOG_BLOCK_SIZE /* size                          */,
+           RAFT_LOG_BLOCK_SIZE - 2 /* front                         */,
+           RAFT_LOG_BLOCK_SIZE + 2 /* back                          */,
+           RAFT_LOG_BLOCK_SIZE - 2 /* offset                        */,
            4 /* n */);
 
-    ACQUIRE(6);
+    ACQUIRE(RAFT_LOG_BLOCK_SIZE - 1);
+
+    munit_assert_ptr_not_null(entries);
+    munit_assert_int(n, ==, 4);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE - 1, 2);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE + 2, 2);
 
-    munit_assert_int(n, ==, 3);
+    RELEASE(RAFT_LOG_BLOCK_SIZE - 1);
 
-    RELEASE(6);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE - 1, 1);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE + 2, 1);
 
     return MUNIT_OK;
 }
@@ -959,6 +1295,34 @@ TEST_CASE(acquire, batch, NULL)
     return MUNIT_OK;
 }
 
+/* Acquire at most a given number of entries. */
+TEST_CASE(acquire, max, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    unsigned n;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, 3 /* n */);
+
+    ACQUIRE_N(1, 2);
+
+    munit_assert_ptr_not_null(entries);
+    munit_assert_int(n, ==, 2);
+
+    ASSERT_REFCOUNT(1, 2);
+    ASSERT_REFCOUNT(2, 2);
+    ASSERT_REFCOUNT(3, 1);
+
+    RELEASE(1);
+
+    ASSERT_REFCOUNT(1, 1);
+    ASSERT_REFCOUNT(2, 1);
+
+    return MUNIT_OK;
+}
+
 TEST_GROUP(acquire, error);
 
 /* Trying to acquire entries out of range results in a NULL pointer. */
@@ -1007,6 +1371,80 @@ TEST_CASE(acquire, error, oom, NULL)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * log__acquire_view
+ *
+ *****************************************************************************/
+
+TEST_SUITE(acquire_view);
+
+TEST_SETUP(acquire_view, setup);
+TEST_TEAR_DOWN(acquire_view, tear_down);
+
+/* A small range of entries is stored inline in the view, even when it spans
+ * two blocks. */
+TEST_CASE(acquire_view, inline, NULL)
+{
+    struct fixture *f = data;
+    struct log__view view;
+    int rv;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, RAFT_LOG_BLOCK_SIZE + 2 /* n */);
+    SHIFT(RAFT_LOG_BLOCK_SIZE - 2);
+
+    rv = log__acquire_view(&f->log, RAFT_LOG_BLOCK_SIZE, 0, &view);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(view.index, ==, RAFT_LOG_BLOCK_SIZE);
+    munit_assert_int(view.n, ==, 3);
+    munit_assert_ptr_equal(view.entries, view.inline_entries);
+    munit_assert_ptr_equal(view.entries[0].buf.base,
+                           log__get(&f->log, RAFT_LOG_BLOCK_SIZE)->buf.base);
+    munit_assert_ptr_equal(
+        view.entries[2].buf.base,
+        log__get(&f->log, RAFT_LOG_BLOCK_SIZE + 2)->buf.base);
+
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE, 2);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE + 2, 2);
+
+    log__release_view(&f->log, &view);
+
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE, 1);
+    ASSERT_REFCOUNT(RAFT_LOG_BLOCK_SIZE + 2, 1);
+
+    return MUNIT_OK;
+}
+
+/* A range bigger than LOG__VIEW_INLINE is stored in a separate array. */
+TEST_CASE(acquire_view, big, NULL)
+{
+    struct fixture *f = data;
+    struct log__view view;
+    int rv;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, LOG__VIEW_INLINE + 2 /* n */);
+
+    rv = log__acquire_view(&f->log, 1, LOG__VIEW_INLINE + 1, &view);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(view.n, ==, LOG__VIEW_INLINE + 1);
+    munit_assert_ptr_not_equal(view.entries, view.inline_entries);
+
+    ASSERT_REFCOUNT(1, 2);
+    ASSERT_REFCOUNT(LOG__VIEW_INLINE + 2, 1);
+
+    log__release_view(&f->log, &view);
+
+    ASSERT_REFCOUNT(1, 1);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * log__truncate
@@ -1047,10 +1485,10 @@ TEST_CASE(truncate, 2_last, NULL)
 
     TRUNCATE(2);
 
-    ASSERT(6 /* size                                                 */,
-           0 /* front                                                */,
-           1 /* back                                                 */,
-           0 /* offset                                               */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           1 /* back                                                */,
+           0 /* offset                                              */,
            1 /* n */);
     ASSERT_TERM_OF(1 /* entry index */, 1 /* term */);
 
@@ -1079,50 +1517,29 @@ TEST_CASE(truncate, compacted, NULL)
     return MUNIT_OK;
 }
 
-/* Truncate from an entry which makes the log wrap. */
-TEST_CASE(truncate, wrap, NULL)
+/* Truncate from an entry in the first block of a log with two blocks, which
+ * releases the second one. */
+TEST_CASE(truncate, blocks, NULL)
 {
     struct fixture *f = data;
     (void)params;
 
-    APPEND_MANY(1 /* term */, 5 /* n entries */);
-
-    /* Now the log is [e1, e2, e3, e4, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           0 /* front                                                */,
-           5 /* back                                                 */,
-           0 /* offset                                               */,
-           5 /* n */);
-
-    /* Delete the first 4 entries. */
-    SHIFT(4);
-
-    /* Now the log is [NULL, NULL, NULL, NULL, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           5 /* back                                                 */,
-           4 /* offset                                               */,
-           1 /* n */);
+    APPEND_MANY(1 /* term */, RAFT_LOG_BLOCK_SIZE + 2 /* n entries */);
 
-    /* Append another 3 entries. */
-    APPEND_MANY(1 /* term */, 3 /* n entries */);
+    ASSERT(2 * RAFT_LOG_BLOCK_SIZE /* size                          */,
+           0 /* front                                               */,
+           RAFT_LOG_BLOCK_SIZE + 2 /* back                          */,
+           0 /* offset                                              */,
+           RAFT_LOG_BLOCK_SIZE + 2 /* n */);
 
-    /* Now the log is [e7, e8, NULL, NULL, e5, e6] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           2 /* back                                                 */,
-           4 /* offset                                               */,
-           4 /* n */);
+    TRUNCATE(RAFT_LOG_BLOCK_SIZE);
 
-    /* Truncate from e6 onward (wrapping) */
-    TRUNCATE(6);
-
-    /* Now the log is [NULL, NULL, NULL, NULL, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           5 /* back                                                 */,
-           4 /* offset                                               */,
-           1 /* n */);
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* back                          */,
+           0 /* offset                                              */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* n */);
+    ASSERT_TERM_OF(RAFT_LOG_BLOCK_SIZE - 1 /* entry index */, 1 /* term */);
 
     return MUNIT_OK;
 }
@@ -1202,7 +1619,7 @@ TEST_CASE(truncate, acquired, NULL)
 }
 
 /* Acquire some entries, truncate the log and then append new ones forcing the
-   log to be grown and the reference count hash table to be re-built. */
+   log and its reference counts to be grown. */
 TEST_CASE(truncate, acquire_append, NULL)
 {
     struct fixture *f = data;
@@ -1221,7 +1638,7 @@ TEST_CASE(truncate, acquire_append, NULL)
 
     TRUNCATE(2);
 
-    for (i = 0; i < LOG__REFS_INITIAL_SIZE; i++) {
+    for (i = 0; i < 256; i++) {
         APPEND(2 /* term */);
     }
 
@@ -1255,15 +1672,13 @@ static MunitParameterEnum truncate_acquired_oom_params[] = {
 };
 
 /* Acquire entries at a certain index. Truncate the log at that index. The
- * truncated entries are still referenced. Then append a new entry, which fails
- * to be appended due to OOM. */
+ * truncated entries are still referenced, but there's no memory to keep track
+ * of them, so their payload is leaked and releasing them is a no-op. */
 TEST_CASE(truncate, error, acquired_oom, truncate_acquired_oom_params)
 {
     struct fixture *f = data;
     struct raft_entry *entries;
     unsigned n;
-    struct raft_buffer buf;
-    int rv;
 
     (void)params;
 
@@ -1273,18 +1688,18 @@ TEST_CASE(truncate, error, acquired_oom, truncate_acquired_oom_params)
     ACQUIRE(2);
     munit_assert_int(n, ==, 1);
 
-    TRUNCATE(2);
+    test_heap_fault_enable(&f->heap);
 
-    buf.base = NULL;
-    buf.len = 0;
+    TRUNCATE(2);
 
-    test_heap_fault_enable(&f->heap);
+    munit_assert_ptr_null(f->log.detached);
 
-    rv = log__append(&f->log, 2, RAFT_COMMAND, &buf, NULL);
-    munit_assert_int(rv, ==, RAFT_ENOMEM);
+    APPEND(2 /* term */);
 
     RELEASE(2);
 
+    ASSERT_REFCOUNT(2, 1);
+
     return MUNIT_OK;
 }
 
@@ -1331,63 +1746,207 @@ TEST_CASE(shift, 2_first, NULL)
 
     SHIFT(1);
 
-    ASSERT(6 /* size                                                 */,
-           1 /* front                                                */,
-           2 /* back                                                 */,
-           1 /* offset                                               */,
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           1 /* front                                               */,
+           2 /* back                                                */,
+           1 /* offset                                              */,
            1 /* n */);
 
     return MUNIT_OK;
 }
 
-/* Shift to an entry which makes the log wrap. */
-TEST_CASE(shift, wrap, NULL)
+/* Shift all entries of the first block of a log with two blocks, which gets
+ * released. */
+TEST_CASE(shift, blocks, NULL)
 {
     struct fixture *f = data;
-    int i;
 
     (void)params;
 
-    for (i = 0; i < 5; i++) {
-        APPEND(1 /* term */);
-    }
+    APPEND_MANY(1 /* term */, RAFT_LOG_BLOCK_SIZE + 2 /* n */);
 
-    /* Now the log is [e1, e2, e3, e4, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           0 /* front                                                */,
-           5 /* back                                                 */,
-           0 /* offset                                               */,
-           5 /* n */);
+    /* Delete all entries of the first block but the last one. */
+    SHIFT(RAFT_LOG_BLOCK_SIZE - 1);
 
-    /* Delete the first 4 entries. */
-    SHIFT(4);
+    ASSERT(2 * RAFT_LOG_BLOCK_SIZE /* size                          */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* front                         */,
+           RAFT_LOG_BLOCK_SIZE + 2 /* back                          */,
+           RAFT_LOG_BLOCK_SIZE - 1 /* offset                        */,
+           3 /* n */);
 
-    /* Now the log is [NULL, NULL, NULL, NULL, e5, NULL] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           5 /* back                                                 */,
-           4 /* offset                                               */,
-           1 /* n */);
+    /* Delete the last entry of the first block. */
+    SHIFT(RAFT_LOG_BLOCK_SIZE);
+
+    ASSERT(RAFT_LOG_BLOCK_SIZE /* size                              */,
+           0 /* front                                               */,
+           2 /* back                                                */,
+           RAFT_LOG_BLOCK_SIZE /* offset                            */,
+           2 /* n */);
+
+    return MUNIT_OK;
+}
+
+/* Once most blocks have been released, the ring of block pointers shrinks
+ * too. */
+TEST_CASE(shift, shrink, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, 8 * RAFT_LOG_BLOCK_SIZE /* n */);
+    munit_assert_int(f->log.n_blocks, ==, 8);
+
+    SHIFT(7 * RAFT_LOG_BLOCK_SIZE);
+
+    munit_assert_int(f->log.n_blocks, ==, 2);
+    munit_assert_int(f->log.size, ==, RAFT_LOG_BLOCK_SIZE);
+
+    APPEND_MANY(1 /* term */, 2 * RAFT_LOG_BLOCK_SIZE /* n */);
+    munit_assert_int(f->log.n_blocks, ==, 4);
+    ASSERT_REFCOUNT(7 * RAFT_LOG_BLOCK_SIZE + 1, 1);
+    ASSERT_REFCOUNT(10 * RAFT_LOG_BLOCK_SIZE, 1);
+
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * log__evict
+ *
+ *****************************************************************************/
+
+TEST_SUITE(evict);
+
+TEST_SETUP(evict, setup);
+TEST_TEAR_DOWN(evict, tear_down);
+
+#define EVICT(INDEX, MAX_BYTES) log__evict(&f->log, INDEX, MAX_BYTES)
+
+/* Evict the oldest entries until the cache size drops below the limit. */
+TEST_CASE(evict, limit, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
 
-    /* Append another 4 entries. */
     APPEND_MANY(1 /* term */, 4 /* n */);
+    munit_assert_int(f->log.n_bytes, ==, 32);
 
-    /* Now the log is [e7, e8, e9, NULL, e5, e6] */
-    ASSERT(6 /* size                                                 */,
-           4 /* front                                                */,
-           3 /* back                                                 */,
-           4 /* offset                                               */,
-           5 /* n */);
-
-    /* Shift up to e7 included (wrapping) */
-    SHIFT(7);
-
-    /* Now the log is [NULL, e8, e9, NULL, NULL, NULL] */
-    ASSERT(6 /* size                                                 */,
-           1 /* front                                                */,
-           3 /* back                                                 */,
-           7 /* offset                                               */,
-           2 /* n */);
+    EVICT(4 /* index */, 16 /* max bytes */);
+
+    munit_assert_int(f->log.n_bytes, ==, 16);
+    munit_assert_true(log__is_evicted(&f->log, 2));
+    munit_assert_false(log__is_evicted(&f->log, 3));
+    munit_assert_ptr_null(GET(1)->buf.base);
+    munit_assert_ptr_null(GET(2)->buf.base);
+    munit_assert_ptr_not_null(GET(3)->buf.base);
+    ASSERT_TERM_OF(2, 1);
+
+    return MUNIT_OK;
+}
+
+/* Entries past the given index are not evicted. */
+TEST_CASE(evict, index, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, 3 /* n */);
+    EVICT(1 /* index */, 0 /* max bytes */);
+
+    munit_assert_int(f->log.n_bytes, ==, 16);
+    munit_assert_false(log__is_evicted(&f->log, 2));
+
+    return MUNIT_OK;
+}
+
+/* Eviction stops at the first entry which is still referenced. */
+TEST_CASE(evict, acquired, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    unsigned n;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, 3 /* n */);
+    ACQUIRE(2);
+
+    EVICT(3 /* index */, 0 /* max bytes */);
+
+    munit_assert_true(log__is_evicted(&f->log, 1));
+    munit_assert_false(log__is_evicted(&f->log, 2));
+    munit_assert_int(f->log.n_bytes, ==, 16);
+
+    RELEASE(2);
+
+    return MUNIT_OK;
+}
+
+/* Configuration entries are never evicted, but they don't stop eviction. */
+TEST_CASE(evict, configuration, NULL)
+{
+    struct fixture *f = data;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    buf.base = raft_malloc(8);
+    buf.len = 8;
+    rv = log__append(&f->log, 1, RAFT_CONFIGURATION, &buf, NULL);
+    munit_assert_int(rv, ==, 0);
+    APPEND(1 /* term */);
+
+    EVICT(2 /* index */, 0 /* max bytes */);
+
+    munit_assert_true(log__is_evicted(&f->log, 2));
+    munit_assert_ptr_not_null(GET(1)->buf.base);
+    munit_assert_ptr_null(GET(2)->buf.base);
+    munit_assert_int(f->log.n_bytes, ==, 8);
+
+    return MUNIT_OK;
+}
+
+/* A batch is released only once all its entries are evicted or removed. */
+TEST_CASE(evict, batch, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    APPEND_BATCH(3 /* n */);
+
+    EVICT(2 /* index */, 0 /* max bytes */);
+
+    munit_assert_int(*(uint64_t *)GET(3)->buf.base, ==, 2000);
+
+    SHIFT(3);
+
+    return MUNIT_OK;
+}
+
+/* Truncating the log also truncates the range of evicted entries. */
+TEST_CASE(evict, truncate, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    APPEND_MANY(1 /* term */, 4 /* n */);
+    EVICT(3 /* index */, 0 /* max bytes */);
+
+    TRUNCATE(2);
+
+    munit_assert_int(f->log.n_bytes, ==, 0);
+    munit_assert_int(f->log.evicted, ==, 1);
+
+    APPEND(2 /* term */);
+
+    munit_assert_false(log__is_evicted(&f->log, 2));
+    munit_assert_int(f->log.n_bytes, ==, 8);
 
     return MUNIT_OK;
 }
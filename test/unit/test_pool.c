@@ -0,0 +1,169 @@
+#include "../../src/pool.h"
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(pool);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    FIXTURE_HEAP;
+    struct raft_pool pool;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    SETUP_HEAP;
+    pool__init(&f->pool);
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+    pool__close(&f->pool);
+    TEAR_DOWN_HEAP;
+    free(f);
+}
+
+/* Get an object from the pool, asserting that it's not NULL. */
+#define __get(F, OBJ)                                \
+    {                                                \
+        OBJ = pool__get(&F->pool, sizeof(uint64_t)); \
+        munit_assert_ptr_not_null(OBJ);              \
+    }
+
+/**
+ * pool__get
+ */
+
+TEST_SUITE(get);
+
+TEST_SETUP(get, setup);
+TEST_TEAR_DOWN(get, tear_down);
+
+TEST_GROUP(get, success);
+TEST_GROUP(get, error);
+
+/* An object that was put back is handed out again. */
+TEST_CASE(get, success, reuse, NULL)
+{
+    struct fixture *f = data;
+    void *obj1;
+    void *obj2;
+
+    (void)params;
+
+    __get(f, obj1);
+    pool__put(&f->pool, obj1);
+    __get(f, obj2);
+
+    munit_assert_ptr_equal(obj1, obj2);
+
+    pool__put(&f->pool, obj2);
+
+    return MUNIT_OK;
+}
+
+/* A free object is handed out without hitting the allocator. */
+TEST_CASE(get, success, no_alloc, NULL)
+{
+    struct fixture *f = data;
+    void *obj;
+
+    (void)params;
+
+    __get(f, obj);
+    pool__put(&f->pool, obj);
+
+    test_heap_fault_config(&f->heap, 0, 1);
+    test_heap_fault_enable(&f->heap);
+
+    __get(f, obj);
+    pool__put(&f->pool, obj);
+
+    return MUNIT_OK;
+}
+
+/* If there's no free object and no memory, NULL is returned. */
+TEST_CASE(get, error, oom, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_heap_fault_config(&f->heap, 0, 1);
+    test_heap_fault_enable(&f->heap);
+
+    munit_assert_ptr_null(pool__get(&f->pool, sizeof(uint64_t)));
+    munit_assert_int(f->pool.n_used, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * pool__put
+ */
+
+TEST_SUITE(put);
+
+TEST_SETUP(put, setup);
+TEST_TEAR_DOWN(put, tear_down);
+
+TEST_GROUP(put, success);
+
+/* The pool retains as many objects as were in use at the same time. */
+TEST_CASE(put, success, peak, NULL)
+{
+    struct fixture *f = data;
+    void *objs[3];
+    unsigned i;
+
+    (void)params;
+
+    __get(f, objs[0]);
+    __get(f, objs[1]);
+    pool__put(&f->pool, objs[1]);
+    pool__put(&f->pool, objs[0]);
+
+    munit_assert_int(f->pool.n_free, ==, 2);
+
+    for (i = 0; i < 3; i++) {
+        __get(f, objs[i]);
+    }
+    for (i = 0; i < 3; i++) {
+        pool__put(&f->pool, objs[i]);
+    }
+
+    munit_assert_int(f->pool.peak, ==, 3);
+    munit_assert_int(f->pool.n_free, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* No more than POOL__MAX_FREE objects are retained. */
+TEST_CASE(put, success, max_free, NULL)
+{
+    struct fixture *f = data;
+    void *objs[POOL__MAX_FREE + 1];
+    unsigned i;
+
+    (void)params;
+
+    for (i = 0; i < POOL__MAX_FREE + 1; i++) {
+        __get(f, objs[i]);
+    }
+    for (i = 0; i < POOL__MAX_FREE + 1; i++) {
+        pool__put(&f->pool, objs[i]);
+    }
+
+    munit_assert_int(f->pool.n_free, ==, POOL__MAX_FREE);
+
+    return MUNIT_OK;
+}
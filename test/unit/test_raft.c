@@ -22,6 +22,7 @@ struct fixture
     {
         bool invoked;
     } stop_cb;
+    struct raft_lifecycle_event started; /* Last start event fired */
 };
 
 /**
@@ -137,7 +138,7 @@ TEST_CASE(init, success, state, NULL)
 
     munit_assert_int(f->raft.current_term, ==, 0);
     munit_assert_int(f->raft.voted_for, ==, 0);
-    munit_assert_ptr_null(f->raft.log.entries);
+    munit_assert_ptr_null(f->raft.log.blocks);
     munit_assert_int(f->raft.log.offset, ==, 0);
 
     munit_assert_int(f->raft.commit_index, ==, 0);
@@ -281,6 +282,162 @@ TEST_CASE(start, success, snapshot, NULL)
     return MUNIT_OK;
 }
 
+/* If the I/O backend has a hint of the commit index, the entries up to it are
+ * applied right away. */
+TEST_CASE(start, success, commit, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+
+    (void)params;
+
+    test_io_bootstrap(&f->io, 2, 1, 2);
+
+    entry.type = RAFT_COMMAND;
+    entry.term = 1;
+    test_fsm_encode_add_x(3, &entry.buf);
+    test_io_append_entry(&f->io, &entry);
+    raft_free(entry.buf.base);
+
+    f->io.version = 8;
+    f->io.set_commit(&f->io, 2);
+
+    __start(f);
+
+    munit_assert_int(f->raft.commit_index, ==, 2);
+    munit_assert_int(f->raft.last_applied, ==, 2);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* Pretend that the FSM has durably applied all entries up to index 2. */
+static raft_index start__fsm_applied(struct raft_fsm *fsm)
+{
+    (void)fsm;
+    return 2;
+}
+
+/* Entries that a durable FSM has already applied are not replayed. */
+TEST_CASE(start, success, fsm_applied, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+
+    (void)params;
+
+    test_io_bootstrap(&f->io, 2, 1, 2);
+
+    entry.type = RAFT_COMMAND;
+    entry.term = 1;
+    test_fsm_encode_add_x(3, &entry.buf);
+    test_io_append_entry(&f->io, &entry);
+    test_io_append_entry(&f->io, &entry);
+    raft_free(entry.buf.base);
+
+    f->fsm.version = 7;
+    f->fsm.applied = start__fsm_applied;
+
+    __start(f);
+
+    munit_assert_int(f->raft.commit_index, ==, 2);
+    munit_assert_int(f->raft.last_applied, ==, 2);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* A snapshot that is not more recent than what a durable FSM has applied is not
+ * restored. */
+TEST_CASE(start, success, fsm_applied_snapshot, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_set_initial_snapshot(&f->raft, 1, 2, 7, 3);
+
+    f->fsm.version = 7;
+    f->fsm.applied = start__fsm_applied;
+
+    __start(f);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+    munit_assert_int(f->raft.last_applied, ==, 2);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 0);
+
+    return MUNIT_OK;
+}
+
+static void start__watch_cb(void *data, int event, void *payload)
+{
+    struct fixture *f = data;
+    munit_assert_int(event, ==, RAFT_EVENT_STARTED);
+    f->started = *(struct raft_lifecycle_event *)payload;
+}
+
+/* A backend loading asynchronously streams the entries, and the instance
+ * completes starting once the load is done. */
+TEST_CASE(start, success, async, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+
+    (void)params;
+
+    test_io_bootstrap(&f->io, 2, 1, 2);
+
+    entry.type = RAFT_COMMAND;
+    entry.term = 1;
+    test_fsm_encode_add_x(3, &entry.buf);
+    test_io_append_entry(&f->io, &entry);
+    test_io_append_entry(&f->io, &entry);
+    raft_free(entry.buf.base);
+
+    f->io.version = 11;
+    f->raft.data = f;
+    raft_watch(&f->raft, RAFT_EVENT_STARTED, start__watch_cb);
+    f->started.status = -1;
+
+    __start(f);
+    __assert_state(f, RAFT_UNAVAILABLE);
+    munit_assert_int(f->started.status, ==, -1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    __assert_state(f, RAFT_FOLLOWER);
+    munit_assert_int(f->started.status, ==, 0);
+    munit_assert_int(f->started.index, ==, 3);
+    munit_assert_int(f->raft.current_term, ==, 1);
+    munit_assert_int(f->raft.last_stored, ==, 3);
+    munit_assert_int(f->raft.configuration.n, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If the asynchronous load fails, the instance stays unavailable. */
+TEST_CASE(start, error, async_io, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_io_bootstrap(&f->io, 2, 1, 2);
+
+    f->io.version = 11;
+    f->raft.data = f;
+    raft_watch(&f->raft, RAFT_EVENT_STARTED, start__watch_cb);
+
+    __start(f);
+    raft_io_stub_fault(&f->io, 0, 1);
+    raft_io_stub_flush_all(&f->io);
+
+    __assert_state(f, RAFT_UNAVAILABLE);
+    munit_assert_int(f->started.status, ==, RAFT_ERR_IO);
+
+    return MUNIT_OK;
+}
+
 static char *start_oom_heap_fault_delay[] = {"0", "1,", "2", "3", NULL};
 static char *start_oom_heap_fault_repeat[] = {"1", NULL};
 
@@ -346,6 +503,8 @@ TEST_CASE(recv_cb, success, append_entries, NULL)
     args->entries = entry;
     args->n_entries = 1;
     args->leader_commit = 2;
+    args->hibernate = false;
+    args->seq = 0;
 
     raft_io_stub_deliver(&f->io, &message);
 
@@ -376,6 +535,9 @@ TEST_CASE(recv_cb, success, request_vote, NULL)
     args->term = 1;
     args->candidate_id = 2;
     args->last_log_index = 2;
+    args->last_log_term = 1;
+    args->pre_vote = false;
+    args->disrupt_leader = false;
 
     raft_io_stub_deliver(&f->io, &message);
 
@@ -404,6 +566,61 @@ TEST_CASE(recv_cb, success, unknown_type, NULL)
     return MUNIT_OK;
 }
 
+/**
+ * raft_set_log_level
+ */
+
+TEST_SUITE(set_log_level);
+
+TEST_SETUP(set_log_level, setup);
+TEST_TEAR_DOWN(set_log_level, tear_down);
+
+TEST_GROUP(set_log_level, success);
+
+static unsigned n_emitted;
+
+static void counting_emit(struct raft_io *io,
+                          int level,
+                          const char *format,
+                          ...)
+{
+    (void)io;
+    (void)level;
+    (void)format;
+    n_emitted++;
+}
+
+/* Messages below the configured level don't reach the backend. */
+TEST_CASE(set_log_level, success, filter, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message message;
+    void (*emit)(struct raft_io * io, int level, const char *format, ...);
+
+    (void)params;
+
+    message.type = 666;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    emit = f->io.emit;
+    f->io.emit = counting_emit;
+    n_emitted = 0;
+
+    /* A message with an unknown type triggers a warning. */
+    raft_set_log_level(&f->raft, RAFT_ERROR);
+    raft_io_stub_deliver(&f->io, &message);
+    munit_assert_int(n_emitted, ==, 0);
+
+    raft_set_log_level(&f->raft, RAFT_WARN);
+    raft_io_stub_deliver(&f->io, &message);
+    munit_assert_int(n_emitted, ==, 1);
+
+    f->io.emit = emit;
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_bootstrap
  */
@@ -1,8 +1,10 @@
 #include "../../include/raft.h"
 
 #include "../../src/configuration.h"
+#include "../../src/interval.h"
 #include "../../src/log.h"
 #include "../../src/replication.h"
+#include "../../src/snapshot.h"
 #include "../../src/state.h"
 
 #include "../lib/fsm.h"
@@ -53,7 +55,7 @@ static void tear_down(void *data)
     {                                                     \
         int rv;                                           \
                                                           \
-        rv = raft_state__convert_to_candidate(&F->raft);  \
+        rv = raft_state__convert_to_candidate(&F->raft, false);  \
         munit_assert_int(rv, ==, 0);                      \
                                                           \
         rv = raft_state__convert_to_leader(&F->raft);     \
@@ -76,7 +78,8 @@ static void tear_down(void *data)
         buf.base = raft_malloc(buf.len);                                      \
         munit_assert_ptr_not_null(buf.base);                                  \
                                                                               \
-        rv = log__append(&F->raft.log, 1, RAFT_COMMAND, &buf, NULL); \
+        rv = log__append(&F->raft.log, F->raft.current_term, RAFT_COMMAND,    \
+                         &buf, NULL);                                         \
         munit_assert_int(rv, ==, 0);                                          \
     }
 
@@ -173,6 +176,1316 @@ TEST_CASE(send_append_entries, success, second_entry, NULL)
     return MUNIT_OK;
 }
 
+/* Put server 2 in pipeline mode, with the last two of three appended entries
+ * optimistically sent, and let the contact timeout expire. */
+#define __lose_contact(F)                                                 \
+    {                                                                     \
+        struct raft_replication *replication;                             \
+                                                                          \
+        test_bootstrap_and_start(&F->raft, 2, 1, 2);                      \
+                                                                          \
+        __convert_to_leader(F);                                           \
+        __append_entry(F);                                                \
+        __append_entry(F);                                                \
+        __append_entry(F);                                                \
+                                                                          \
+        replication = &F->raft.leader_state.replication[1];               \
+        replication->state = REPLICATION__PIPELINE;                       \
+        replication->match_index = 2;                                     \
+        replication->next_index = 5;                                      \
+        replication->last_contact = F->io.time(&F->io);                   \
+                                                                          \
+        raft_io_stub_set_time(&F->io, F->io.time(&F->io) +                \
+                                          F->raft.contact_timeout + 1);   \
+    }
+
+/* By default, a follower that didn't answer within the contact timeout is only
+ * sent heartbeats. */
+TEST_CASE(send_append_entries, success, lost_contact, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    __lose_contact(f);
+
+    rv = raft_replication__send_append_entries(&f->raft, 1);
+    munit_assert_int(rv, ==, 0);
+
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 4);
+    munit_assert_int(message->append_entries.n_entries, ==, 0);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* With the rewind probe strategy, the entries after the match index are sent
+ * again right away. */
+TEST_CASE(send_append_entries, success, lost_contact_rewind, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    raft_set_contact_timeout(&f->raft, 2000, RAFT_PROBE_REWIND);
+    __lose_contact(f);
+
+    rv = raft_replication__send_append_entries(&f->raft, 1);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.replication[1].state, ==,
+                     REPLICATION__PROBE);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 2);
+    munit_assert_int(message->append_entries.n_entries, ==, 2);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* After a log mismatch, the leader backtracks sending only headers, and it
+ * sends the entries only once the follower has confirmed a match. */
+TEST_CASE(send_append_entries, success, backtracking, NULL)
+{
+    struct fixture *f = data;
+    struct raft_append_entries_result result;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+    f->raft.leader_state.replication[1].next_index = 5;
+
+    /* The follower has only two entries, the second of which conflicts. */
+    result.term = f->raft.current_term;
+    result.success = false;
+    result.last_log_index = 2;
+    result.conflict_term = 0;
+    result.conflict_index = 0;
+    result.snapshot_index = 0;
+    result.snapshot_offset = 0;
+    result.seq = 0;
+    rv = raft_replication__update(&f->raft, &f->raft.configuration.servers[1],
+                                  &result);
+    munit_assert_int(rv, ==, 0);
+
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    /* The follower matches the first entry. */
+    result.success = true;
+    result.last_log_index = 1;
+    rv = raft_replication__update(&f->raft, &f->raft.configuration.servers[1],
+                                  &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.leader_state.replication[1].state, ==,
+                     REPLICATION__PIPELINE);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 3);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The number of entries in a single message is capped by the max_entries
+ * limit. */
+TEST_CASE(send_append_entries, success, max_entries, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    raft_set_append_entries_limits(&f->raft, 2, 0, 0);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 2);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* Non-voting servers are subject to their own limits, if set. */
+TEST_CASE(send_append_entries, success, learner_limits, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    raft_set_learner_append_entries_limits(&f->raft, 1, 0, 0);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    i = configuration__index_of(&f->raft.configuration, 3);
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_int(message->append_entries.n_entries, ==, 3);
+    raft_io_stub_sending(&f->io, 1, &message);
+    munit_assert_int(message->server_id, ==, 3);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* Witnesses are sent the entries without the payload of commands. */
+TEST_CASE(send_append_entries, success, witness, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    f->raft.configuration.servers[2].witness = true;
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    i = configuration__index_of(&f->raft.configuration, 3);
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+    munit_assert_int(message->append_entries.entries[0].buf.len, ==, 8);
+    raft_io_stub_sending(&f->io, 1, &message);
+    munit_assert_int(message->server_id, ==, 3);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+    munit_assert_int(message->append_entries.entries[0].type, ==,
+                     RAFT_COMMAND);
+    munit_assert_int(message->append_entries.entries[0].buf.len, ==, 0);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* The number of entries in a single message is capped by the max_bytes limit,
+ * but at least one entry is always sent. */
+TEST_CASE(send_append_entries, success, max_bytes, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    raft_set_append_entries_limits(&f->raft, 0, 4, 0);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* When the in-flight window of a follower is full, only heartbeats are sent
+ * until the pending requests complete. */
+TEST_CASE(send_append_entries, success, inflight_full, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    raft_set_append_entries_limits(&f->raft, 0, 0, 8);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.leader_state.replication[i].inflight_bytes, ==, 8);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+    raft_io_stub_sending(&f->io, 1, &message);
+    munit_assert_int(message->append_entries.n_entries, ==, 0);
+
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(f->raft.leader_state.replication[i].inflight_bytes, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* Nothing is sent to a follower that the I/O backend reports as congested,
+ * until the congestion is over. */
+TEST_CASE(send_append_entries, success, congested, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    f->io.version = 5;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    raft_io_stub_congest(&f->io, 2, true);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    raft_io_stub_congest(&f->io, 2, false);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+static void evicted__append_cb(void *data, int status)
+{
+    (void)data;
+    munit_assert_int(status, ==, 0);
+}
+
+/* Entries whose payload was evicted from the in-memory log are read back from
+ * disk before being sent. */
+TEST_CASE(send_append_entries, success, evicted, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_entry entries[2];
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 13; /* Read back entries from disk */
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    /* Persist the new entries and then evict them from memory. */
+    entries[0] = *log__get(&f->raft.log, 2);
+    entries[1] = *log__get(&f->raft.log, 3);
+    strcpy(entries[1].buf.base, "hello");
+    rv = f->io.append(&f->io, entries, 2, NULL, evicted__append_cb);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    log__evict(&f->raft.log, 3, 0);
+    munit_assert_true(log__is_evicted(&f->raft.log, 3));
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(f->raft.leader_state.replication[i].reading);
+    munit_assert_int(f->raft.leader_state.replication[i].inflight_bytes, ==,
+                     16);
+
+    /* Nothing is sent while the read is in progress. */
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* Complete the read, which submits the send request. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_false(f->raft.leader_state.replication[i].reading);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 2);
+    munit_assert_string_equal(message->append_entries.entries[1].buf.base,
+                              "hello");
+
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(f->raft.leader_state.replication[i].inflight_bytes, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Persist all entries in the in-memory log following the bootstrap one.
+ */
+#define __persist_entries(F)                                             \
+    {                                                                    \
+        struct raft_entry *entries;                                      \
+        unsigned n;                                                      \
+        unsigned j;                                                      \
+        int rv;                                                          \
+                                                                         \
+        n = log__n_entries(&F->raft.log) - 1;                            \
+        entries = munit_malloc(n * sizeof *entries);                     \
+        for (j = 0; j < n; j++) {                                        \
+            entries[j] = *log__get(&F->raft.log, j + 2);                 \
+        }                                                                \
+        rv = F->io.append(&F->io, entries, n, NULL, evicted__append_cb); \
+        munit_assert_int(rv, ==, 0);                                     \
+        raft_io_stub_flush_all(&F->io);                                  \
+        free(entries);                                                   \
+    }
+
+/**
+ * Pretend that a snapshot was taken at the given index, and remove from the
+ * in-memory log all entries up to it.
+ */
+#define __take_snapshot(F, INDEX)        \
+    {                                    \
+        F->raft.snapshot.term = 1;       \
+        F->raft.snapshot.index = INDEX;  \
+        log__shift(&F->raft.log, INDEX); \
+    }
+
+/* Entries which are not anymore in the in-memory log because they were
+ * included in a snapshot are read back from disk, along with the preceeding
+ * one. */
+TEST_CASE(send_append_entries, success, behind_snapshot, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 13; /* Read back entries from disk */
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __persist_entries(f);
+    __take_snapshot(f, 2);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* Complete the read, which submits the send request. */
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.prev_log_term, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* If the snapshot retained trailing entries and only the one preceeding the
+ * first entry to send is missing from memory, its term is still known and the
+ * entries are sent from memory. */
+TEST_CASE(send_append_entries, success, behind_snapshot_trailing, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+    __persist_entries(f);
+
+    /* Pretend a snapshot was taken at index 3, retaining entries from 2. */
+    f->raft.snapshot.term = 1;
+    f->raft.snapshot.index = 3;
+    log__shift(&f->raft.log, 1);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 1);
+    munit_assert_int(message->append_entries.prev_log_term, ==, 1);
+    munit_assert_int(message->append_entries.n_entries, ==, 3);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* If the entries behind the snapshot are not available on disk either, the
+ * snapshot is sent. */
+TEST_CASE(send_append_entries, success, behind_snapshot_missing, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 13; /* Read back entries from disk */
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Complete the read, which finds no entry and then loads the snapshot. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(f->raft.leader_state.replication[i].state, ==,
+                     REPLICATION__SNAPSHOT);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* Followers needing the snapshot at the same time share a single copy of it
+ * loaded from disk. */
+TEST_CASE(send_append_entries, success, snapshot_shared, NULL)
+{
+    struct fixture *f = data;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    size_t i;
+    size_t j;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+    j = configuration__index_of(&f->raft.configuration, 3);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_replication__send_append_entries(&f->raft, j);
+    munit_assert_int(rv, ==, 0);
+
+    /* Both transfers need the snapshot. */
+    munit_assert_ptr_not_null(f->raft.snapshot.shared);
+
+    /* A single load starts both transfers. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+
+    /* The snapshot is released once both transfers are done. */
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_ptr_null(f->raft.snapshot.shared);
+    munit_assert_false(f->raft.leader_state.replication[i].sending_snapshot);
+    munit_assert_false(f->raft.leader_state.replication[j].sending_snapshot);
+
+    return MUNIT_OK;
+}
+
+/* Snapshots larger than the configured chunk size are sent in several
+ * InstallSnapshot messages, each one sent after the previous one. */
+TEST_CASE(send_append_entries, success, snapshot_chunks, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_snapshot_chunk_size(&f->raft, 5);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Load the snapshot. */
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 0);
+    munit_assert_int(message->install_snapshot.data.len, ==, 5);
+    munit_assert_false(message->install_snapshot.done);
+
+    /* Once the first chunk is sent, the second one follows. */
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 5);
+    munit_assert_int(message->install_snapshot.data.len, ==, 3);
+    munit_assert_true(message->install_snapshot.done);
+
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_false(f->raft.leader_state.replication[i].sending_snapshot);
+
+    return MUNIT_OK;
+}
+
+/* If the follower reports having part of the snapshot being sent, the transfer
+ * resumes from the offset it asked for. */
+TEST_CASE(send_append_entries, success, snapshot_resume, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    struct raft_append_entries_result result;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_snapshot_chunk_size(&f->raft, 5);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Load the snapshot. */
+    raft_io_stub_flush(&f->io);
+
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->install_snapshot.offset, ==, 0);
+
+    /* The follower already has the first 3 bytes of the snapshot. */
+    result.term = f->raft.current_term;
+    result.success = false;
+    result.last_log_index = 0;
+    result.conflict_term = 0;
+    result.conflict_index = 0;
+    result.snapshot_index = 2;
+    result.snapshot_offset = 3;
+    rv = raft_replication__update(&f->raft, &f->raft.configuration.servers[i],
+                                  &result);
+    munit_assert_int(rv, ==, 0);
+
+    /* The next chunk starts from there. */
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 3);
+    munit_assert_int(message->install_snapshot.data.len, ==, 5);
+    munit_assert_true(message->install_snapshot.done);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* If a background rate is set, the snapshot is sent in chunks no larger than
+ * the available budget, and the transfer waits for it to be refilled. */
+TEST_CASE(send_append_entries, success, snapshot_throttled, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 13; /* Read back entries from disk */
+    raft_set_background_rate(&f->raft, 4, 0);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Complete the read, which finds no entry and then loads the snapshot. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+
+    /* The first chunk uses all the budget. */
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 0);
+    munit_assert_int(message->install_snapshot.data.len, ==, 4);
+
+    /* The next one waits for it to be refilled. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+    munit_assert_true(f->raft.leader_state.replication[i].sending_snapshot);
+
+    /* After a quarter of a second there's budget for one more byte. */
+    raft_io_stub_advance(&f->io, 250);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 4);
+    munit_assert_int(message->install_snapshot.data.len, ==, 1);
+    munit_assert_false(message->install_snapshot.done);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* If the I/O backend supports it, each chunk of the snapshot is loaded only
+ * when it's about to be sent. */
+TEST_CASE(send_append_entries, success, snapshot_read, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 13;
+    raft_set_snapshot_chunk_size(&f->raft, 5);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    i = configuration__index_of(&f->raft.configuration, 2);
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Complete the read, which finds no entry and then loads the first chunk
+     * of the snapshot. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 0);
+    munit_assert_int(message->install_snapshot.data.len, ==, 5);
+    munit_assert_false(message->install_snapshot.done);
+
+    /* Once the first chunk is sent, the second one is loaded and sent. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->install_snapshot.offset, ==, 5);
+    munit_assert_int(message->install_snapshot.data.len, ==, 3);
+    munit_assert_true(message->install_snapshot.done);
+
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_false(f->raft.leader_state.replication[i].sending_snapshot);
+
+    return MUNIT_OK;
+}
+
+/* If snapshot delegation is enabled, an up-to-date follower is asked to send
+ * the snapshot in place of the leader, which sends it itself if the follower
+ * stops reporting progress. */
+TEST_CASE(send_append_entries, success, snapshot_delegate, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    struct raft_snapshot snapshot;
+    struct raft_io_snapshot_put put;
+    struct raft_replication *replication;
+    size_t i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    f->io.version = 13; /* Read back entries from disk */
+    raft_set_snapshot_delegation(&f->raft, true);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __take_snapshot(f, 2);
+
+    /* Remove all entries from disk and store the snapshot. */
+    rv = f->io.truncate(&f->io, 1);
+    munit_assert_int(rv, ==, 0);
+
+    snapshot.term = 1;
+    snapshot.index = 2;
+    raft_configuration_init(&snapshot.configuration);
+    rv = configuration__copy(&f->raft.configuration, &snapshot.configuration);
+    munit_assert_int(rv, ==, 0);
+    snapshot.configuration_index = 1;
+    snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);
+    snapshot.bufs[0].base = raft_malloc(8);
+    snapshot.bufs[0].len = 8;
+    snapshot.n_bufs = 1;
+    rv = f->io.snapshot_put(&f->io, &put, &snapshot, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+    snapshot__close(&snapshot);
+
+    /* Server 2 is up-to-date. */
+    replication = &f->raft.leader_state.replication[1];
+    replication->state = REPLICATION__PIPELINE;
+    replication->match_index = 3;
+    replication->next_index = 4;
+    replication->last_contact = f->io.time(&f->io);
+
+    i = configuration__index_of(&f->raft.configuration, 3);
+    replication = &f->raft.leader_state.replication[i];
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* Complete the read, which finds no entry and then asks server 2 to send
+     * its snapshot. */
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(replication->state, ==, REPLICATION__SNAPSHOT);
+    munit_assert_int(replication->delegate_id, ==, 2);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_SEND_SNAPSHOT);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_int(message->send_snapshot.server_id, ==, 3);
+    munit_assert_int(message->send_snapshot.last_index, ==, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Server 2 does not report any progress for an election timeout, and
+     * server 3 rejects a heartbeat. */
+    raft_io_stub_set_time(&f->io,
+                          f->io.time(&f->io) + f->raft.election_timeout + 1);
+    replication->state = REPLICATION__PROBE;
+
+    rv = raft_replication__send_append_entries(&f->raft, i);
+    munit_assert_int(rv, ==, 0);
+
+    /* The leader now loads and sends the snapshot itself. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(replication->delegate_id, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->server_id, ==, 3);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/**
+ * raft_replication__apply
+ */
+
+TEST_SUITE(apply);
+
+TEST_SETUP(apply, setup);
+TEST_TEAR_DOWN(apply, tear_down);
+
+TEST_GROUP(apply, success);
+
+struct apply_batch
+{
+    unsigned n_calls;
+    raft_index index;
+    unsigned n;
+};
+
+static int apply_batch(struct raft_fsm *fsm,
+                       const struct raft_buffer bufs[],
+                       raft_index index,
+                       unsigned n)
+{
+    struct fixture *f = fsm->data;
+    struct apply_batch *batch = f->raft.data;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        munit_assert_int(bufs[i].len, ==, 8);
+    }
+
+    batch->n_calls++;
+    batch->index = index;
+    batch->n = n;
+
+    return 0;
+}
+
+/* If the FSM implements the apply_batch hook, all contiguous committed
+ * commands are applied with a single call. */
+TEST_CASE(apply, success, batch, NULL)
+{
+    struct fixture *f = data;
+    struct apply_batch batch = {0, 0, 0};
+    void *fsm_data = f->fsm.data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    f->fsm.data = f;
+    f->fsm.apply_batch = apply_batch;
+    f->raft.data = &batch;
+    f->raft.commit_index = 4;
+
+    rv = raft_replication__apply(&f->raft);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(batch.n_calls, ==, 1);
+    munit_assert_int(batch.index, ==, 2);
+    munit_assert_int(batch.n, ==, 3);
+    munit_assert_int(f->raft.last_applied, ==, 4);
+
+    f->fsm.data = fsm_data;
+
+    return MUNIT_OK;
+}
+
+struct apply_async
+{
+    unsigned n;
+    struct raft_fsm_apply *reqs[4];
+    raft_fsm_apply_cb cb;
+};
+
+static int apply_async(struct raft_fsm *fsm,
+                       struct raft_fsm_apply *req,
+                       const struct raft_buffer *buf,
+                       raft_fsm_apply_cb cb)
+{
+    struct fixture *f = fsm->data;
+    struct apply_async *async = f->raft.data;
+
+    munit_assert_int(buf->len, ==, 8);
+    munit_assert_int(async->n, <, 4);
+
+    async->reqs[async->n] = req;
+    async->cb = cb;
+    async->n++;
+
+    return 0;
+}
+
+/* If the FSM implements the apply_async hook, all committed commands are
+ * submitted at once, and the applied watermark advances only when all previous
+ * entries have completed. */
+TEST_CASE(apply, success, async, NULL)
+{
+    struct fixture *f = data;
+    struct apply_async async;
+    void *fsm_data = f->fsm.data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    async.n = 0;
+    f->fsm.data = f;
+    f->fsm.apply_async = apply_async;
+    f->raft.data = &async;
+    f->raft.commit_index = 4;
+
+    rv = raft_replication__apply(&f->raft);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(async.n, ==, 3);
+    munit_assert_int(async.reqs[0]->index, ==, 2);
+    munit_assert_int(f->raft.last_applying, ==, 4);
+    munit_assert_int(f->raft.last_applied, ==, 1);
+
+    /* Completing the second entry first doesn't move the watermark. */
+    async.cb(async.reqs[1], 0);
+    munit_assert_int(f->raft.last_applied, ==, 1);
+
+    async.cb(async.reqs[0], 0);
+    munit_assert_int(f->raft.last_applied, ==, 3);
+
+    async.cb(async.reqs[2], 0);
+    munit_assert_int(f->raft.last_applied, ==, 4);
+
+    f->fsm.data = fsm_data;
+
+    return MUNIT_OK;
+}
+
+static unsigned partition(struct raft_fsm *fsm, const struct raft_buffer *buf)
+{
+    (void)fsm;
+    (void)buf;
+    return 7;
+}
+
+/* If the FSM implements the partition hook, a command is not submitted while
+ * an earlier one of the same partition is pending. */
+TEST_CASE(apply, success, partition, NULL)
+{
+    struct fixture *f = data;
+    struct apply_async async;
+    void *fsm_data = f->fsm.data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    async.n = 0;
+    f->fsm.version = 8;
+    f->fsm.data = f;
+    f->fsm.apply_async = apply_async;
+    f->fsm.partition = partition;
+    f->raft.data = &async;
+    f->raft.commit_index = 4;
+
+    rv = raft_replication__apply(&f->raft);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(async.n, ==, 1);
+    munit_assert_int(async.reqs[0]->partition, ==, 7);
+    munit_assert_int(f->raft.last_applying, ==, 2);
+
+    /* A failed command is submitted again, before later ones of the same
+     * partition. */
+    async.cb(async.reqs[0], RAFT_ENOMEM);
+    munit_assert_int(async.n, ==, 2);
+    munit_assert_ptr_equal(async.reqs[1], async.reqs[0]);
+
+    async.cb(async.reqs[1], 0);
+    munit_assert_int(async.n, ==, 3);
+    munit_assert_int(async.reqs[2]->index, ==, 3);
+
+    async.cb(async.reqs[2], 0);
+    munit_assert_int(async.n, ==, 4);
+
+    async.cb(async.reqs[3], 0);
+    munit_assert_int(f->raft.last_applied, ==, 4);
+
+    f->fsm.data = fsm_data;
+
+    return MUNIT_OK;
+}
+
+/* With an apply budget, the entries exceeding it are applied in the next loop
+ * iteration. */
+TEST_CASE(apply, success, budget, NULL)
+{
+    struct fixture *f = data;
+    struct apply_batch batch = {0, 0, 0};
+    void *fsm_data = f->fsm.data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    f->fsm.data = f;
+    f->fsm.apply_batch = apply_batch;
+    f->raft.data = &batch;
+    f->io.version = 14;
+    raft_set_apply_budget(&f->raft, 2);
+    f->raft.commit_index = 4;
+
+    rv = raft_replication__apply(&f->raft);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(batch.n, ==, 2);
+    munit_assert_int(f->raft.last_applied, ==, 3);
+
+    /* The budget of this iteration is exhausted. */
+    rv = raft_replication__apply(&f->raft);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(f->raft.last_applied, ==, 3);
+
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(batch.n_calls, ==, 2);
+    munit_assert_int(batch.index, ==, 4);
+    munit_assert_int(f->raft.last_applied, ==, 4);
+
+    f->fsm.data = fsm_data;
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_replication__trigger
  */
@@ -205,3 +1518,317 @@ TEST_CASE(trigger, error, _io, NULL)
 
     return MUNIT_OK;
 }
+
+/* A broadcast message that fails to be submitted doesn't prevent the other
+ * ones from being sent, and the pipeline of its target is rewound. */
+TEST_CASE(trigger, error, broadcast, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    f->io.version = 10;
+
+    __convert_to_leader(f);
+    f->raft.leader_state.replication[1].state = REPLICATION__PIPELINE;
+    f->raft.leader_state.replication[2].state = REPLICATION__PIPELINE;
+    __append_entry(f);
+
+    /* The first I/O request is the disk write, the second one the message to
+     * the second server. */
+    raft_io_stub_fault(&f->io, 1, 1);
+
+    rv = raft_replication__trigger(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_broadcasts(&f->io), ==, 1);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->server_id, ==, 3);
+
+    munit_assert_int(f->raft.leader_state.replication[1].next_index, ==, 2);
+    munit_assert_int(f->raft.leader_state.replication[1].inflight_bytes, ==, 0);
+    munit_assert_int(f->raft.leader_state.replication[2].next_index, ==, 3);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+TEST_GROUP(trigger, success);
+
+/* If the I/O backend supports it, the messages carrying the same new entries
+ * to several followers are submitted with a single broadcast. */
+TEST_CASE(trigger, success, broadcast, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message1;
+    struct raft_message *message2;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    f->io.version = 10;
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    rv = raft_replication__trigger(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_broadcasts(&f->io), ==, 1);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_sending(&f->io, 0, &message1);
+    raft_io_stub_sending(&f->io, 1, &message2);
+    munit_assert_int(message1->server_id, ==, 2);
+    munit_assert_int(message2->server_id, ==, 3);
+    munit_assert_int(message1->append_entries.n_entries, ==, 1);
+    munit_assert_ptr_equal(message1->append_entries.entries[0].buf.base,
+                           message2->append_entries.entries[0].buf.base);
+
+    raft_io_stub_flush_all(&f->io);
+
+    /* Heartbeats are sent one by one. */
+    raft_io_stub_set_time(&f->io, f->raft.heartbeat_timeout + 1);
+    raft_replication__trigger(&f->raft, 0);
+    munit_assert_int(raft_io_stub_n_broadcasts(&f->io), ==, 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* Non-voting servers get heartbeats at their own interval. */
+TEST_CASE(trigger, success, learner_heartbeat, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    unsigned heartbeat_timeout;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    heartbeat_timeout = f->raft.heartbeat_timeout;
+    raft_set_learner_heartbeat_timeout(&f->raft, heartbeat_timeout * 3);
+
+    __convert_to_leader(f);
+
+    /* Send the first heartbeats after the election. */
+    raft_io_stub_set_time(&f->io, 1);
+    raft_replication__trigger(&f->raft, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Only the voting server is due for a heartbeat. */
+    raft_io_stub_set_time(&f->io, heartbeat_timeout + 1);
+    raft_replication__trigger(&f->raft, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->server_id, ==, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Both servers are due for a heartbeat. */
+    raft_io_stub_set_time(&f->io, heartbeat_timeout * 3 + 1);
+    raft_replication__trigger(&f->raft, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* New entries are sent to voting servers before non-voting ones. */
+TEST_CASE(trigger, success, voters_first, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    /* The second server is a learner and the third one is voting. */
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+    configuration__set_voting(&f->raft.configuration, 1, false);
+    configuration__set_voting(&f->raft.configuration, 2, true);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    rv = raft_replication__trigger(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 2);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->server_id, ==, 3);
+    raft_io_stub_sending(&f->io, 1, &message);
+    munit_assert_int(message->server_id, ==, 2);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* New entries are sent first to the voting servers with the lowest round-trip
+ * times that form a quorum along with the leader. */
+TEST_CASE(trigger, success, fastest_quorum, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+    unsigned ids[4] = {4, 5, 2, 3};
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 5, 1, 5);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    /* The second and third servers are far away. */
+    for (i = 1; i < 5; i++) {
+        interval__sample(&f->raft.leader_state.replication[i].rtt,
+                         i < 3 ? 100 : 10);
+    }
+
+    rv = raft_replication__trigger(&f->raft, 2);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 4);
+    for (i = 0; i < 4; i++) {
+        raft_io_stub_sending(&f->io, i, &message);
+        munit_assert_int(message->server_id, ==, ids[i]);
+    }
+
+    munit_assert_false(f->raft.leader_state.replication[1].fast);
+    munit_assert_true(f->raft.leader_state.replication[3].fast);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * raft_replication__quorum
+ *
+ *****************************************************************************/
+
+TEST_SUITE(quorum);
+
+TEST_SETUP(quorum, setup);
+TEST_TEAR_DOWN(quorum, tear_down);
+
+TEST_GROUP(quorum, success);
+
+/* The commit index advances to the median of the match indexes of the voting
+ * servers, regardless of the order in which they were updated. */
+TEST_CASE(quorum, success, median, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 5, 1, 5);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    replication = f->raft.leader_state.replication;
+    replication[0].match_index = 4;
+    replication[1].match_index = 1;
+    replication[2].match_index = 2;
+    replication[3].match_index = 4;
+    replication[4].match_index = 3;
+
+    raft_replication__quorum(&f->raft);
+    munit_assert_int(f->raft.commit_index, ==, 3);
+
+    replication[1].match_index = 4;
+
+    raft_replication__quorum(&f->raft);
+    munit_assert_int(f->raft.commit_index, ==, 4);
+
+    return MUNIT_OK;
+}
+
+/* Non-voting servers are not counted. */
+TEST_CASE(quorum, success, non_voting, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 2);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+    __append_entry(f);
+
+    replication = f->raft.leader_state.replication;
+    replication[0].match_index = 3;
+    replication[1].match_index = 1;
+    replication[2].match_index = 3;
+
+    raft_replication__quorum(&f->raft);
+    munit_assert_int(f->raft.commit_index, ==, 1);
+
+    replication[1].match_index = 2;
+
+    raft_replication__quorum(&f->raft);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If commit notifications are enabled, followers that weren't sent the new
+ * commit index yet get an AppendEntries request at the end of the loop
+ * iteration. */
+TEST_CASE(quorum, success, commit_notify, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    __convert_to_leader(f);
+    __append_entry(f);
+
+    f->io.version = 14;
+    raft_set_commit_notify(&f->raft, true);
+
+    replication = f->raft.leader_state.replication;
+    replication[0].match_index = 2;
+    replication[1].match_index = 2;
+
+    raft_replication__quorum(&f->raft);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* The second server is sent a regular request in the meantime. */
+    rv = raft_replication__send_append_entries(&f->raft, 1);
+    munit_assert_int(rv, ==, 0);
+
+    /* Fire the deferred notification, which only goes to the third server,
+     * and complete the request sent to the second one. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->server_id, ==, 3);
+    munit_assert_int(message->append_entries.leader_commit, ==, 2);
+
+    return MUNIT_OK;
+}
@@ -2,9 +2,14 @@
 
 #include "../../include/raft.h"
 
+#include "../../src/byte.h"
 #include "../../src/configuration.h"
+#include "../../src/election.h"
 #include "../../src/log.h"
+#include "../../src/rpc.h"
 #include "../../src/rpc_append_entries.h"
+#include "../../src/snapshot.h"
+#include "../../src/state.h"
 
 #include "../lib/fsm.h"
 #include "../lib/heap.h"
@@ -83,6 +88,8 @@ static struct raft_entry *__create_entries_batch()
         args.entries = ENTRIES;                                          \
         args.n_entries = N;                                              \
         args.leader_commit = COMMIT;                                     \
+        args.hibernate = false;                                          \
+        args.seq = 0;                                                    \
                                                                          \
         rv = raft_rpc__recv_append_entries(&F->raft, LEADER_ID, address, \
                                            &args);                       \
@@ -105,6 +112,11 @@ static struct raft_entry *__create_entries_batch()
         result.term = TERM;                                            \
         result.success = SUCCESS;                                      \
         result.last_log_index = LAST_LOG_INDEX;                        \
+        result.conflict_term = 0;                                      \
+        result.conflict_index = 0;                                     \
+        result.snapshot_index = 0;                                     \
+        result.snapshot_offset = 0;                                    \
+        result.seq = F->raft.leader_state.seq;                         \
                                                                        \
         rv = raft_rpc__recv_append_entries_result(&F->raft, SERVER_ID, \
                                                   address, &result);   \
@@ -208,6 +220,38 @@ TEST_CASE(request, success, twice, NULL)
     return MUNIT_OK;
 }
 
+/* With the adaptive election timeout, followers derive the timeout from the
+ * interval between the heartbeats of the leader. */
+TEST_CASE(request, success, adaptive_timeout, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_adaptive_election_timeout(&f->raft, 20, 1000);
+
+    raft_io_stub_advance(&f->io, 5);
+    __recv_append_entries(f, 1, 2, 1, 1, NULL, 0, 1);
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(f->raft.election_adaptive.timeout, ==, 0);
+
+    /* The second heartbeat gives the first interval. */
+    raft_io_stub_advance(&f->io, 5);
+    __recv_append_entries(f, 1, 2, 1, 1, NULL, 0, 1);
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(f->raft.election_adaptive.timeout, ==, 150);
+    munit_assert_int(f->raft.election_timeout_rand, >=, 150);
+    munit_assert_int(f->raft.election_timeout_rand, <=, 300);
+
+    /* Entries break the sequence of heartbeats. */
+    __recv_append_entries(f, 1, 2, 1, 1, __create_entries_batch(), 1, 1);
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_int(f->raft.follower_state.heartbeat_time, ==, 0);
+
+    return MUNIT_OK;
+}
+
 /* If a candidate server receives a request contaning an higher term as its
  * own, it it steps down to follower and accept the request . */
 TEST_CASE(request, success, higher_term, NULL)
@@ -297,6 +341,25 @@ TEST_CASE(request, error, missing_entries, NULL)
     return MUNIT_OK;
 }
 
+/* If the server's log is empty after a snapshot, the rejection carries the
+ * snapshot's last index, so the leader doesn't send the snapshot again. */
+TEST_CASE(request, error, missing_entries_snapshot, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_set_initial_snapshot(&f->raft, 2, 4, 1, 1);
+    test_start(&f->raft);
+
+    __recv_append_entries(f, 2, 2, 6, 2, NULL, 0, 4);
+
+    /* The request is unsuccessful */
+    __assert_append_entries_response(f, 2, false, 4);
+
+    return MUNIT_OK;
+}
+
 /* If the term of the last log entry on the server is different from
  * prevLogTerm, and value of prevLogIndex is lower or equal than server's commit
  * index, then an error is returned . */
@@ -317,6 +380,8 @@ TEST_CASE(request, error, prev_index_conflict, NULL)
     args.entries = NULL;
     args.n_entries = 0;
     args.leader_commit = 1;
+    args.hibernate = false;
+    args.seq = 0;
 
     rv = raft_rpc__recv_append_entries(&f->raft, 2, "2", &args);
     munit_assert_int(rv, ==, RAFT_ERR_SHUTDOWN);
@@ -330,6 +395,7 @@ TEST_CASE(request, error, prev_index_conflict, NULL)
 TEST_CASE(request, error, prev_log_term_mismatch, NULL)
 {
     struct fixture *f = data;
+    struct raft_message *reply;
     struct raft_buffer buf;
     struct raft_entry entries[2];
 
@@ -361,6 +427,11 @@ TEST_CASE(request, error, prev_log_term_mismatch, NULL)
     /* The request gets rejected. */
     __assert_append_entries_response(f, 1, false, 3);
 
+    /* The conflicting term and its first index are reported as hint. */
+    raft_io_stub_sending(&f->io, 0, &reply);
+    munit_assert_int(reply->append_entries_result.conflict_term, ==, 1);
+    munit_assert_int(reply->append_entries_result.conflict_index, ==, 1);
+
     raft_free(entries[0].buf.base);
     raft_free(entries[1].buf.base);
 
@@ -385,6 +456,107 @@ TEST_CASE(request, success, write_log, NULL)
     return MUNIT_OK;
 }
 
+/* If acknowledgements batching is enabled, the entries persisted in the same
+ * loop iteration are acknowledged with a single result. */
+TEST_CASE(request, success, ack_batch, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries1 = __create_entries_batch();
+    struct raft_entry *entries2 = __create_entries_batch();
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 14;
+    raft_set_ack_batching(&f->raft, true, 0);
+
+    __recv_append_entries(f, 1, 2, 1, 1, entries1, 1, 1);
+    __recv_append_entries(f, 1, 2, 2, 1, entries2, 1, 1);
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 2);
+
+    /* Complete both writes: no result is sent yet. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    /* Fire the deferred request. */
+    raft_io_stub_flush(&f->io);
+    __assert_append_entries_response(f, 1, true, 3);
+
+    return MUNIT_OK;
+}
+
+/* If acknowledgements batching is enabled with a maximum delay, the result is
+ * held back until the delay elapses. */
+TEST_CASE(request, success, ack_batch_delay, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries = __create_entries_batch();
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 14;
+    raft_set_ack_batching(&f->raft, true, 20);
+
+    __recv_append_entries(f, 1, 2, 1, 1, entries, 1, 1);
+
+    /* Complete the write and fire the deferred request. */
+    raft_io_stub_flush(&f->io);
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    raft_io_stub_advance(&f->io, 10);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    raft_io_stub_advance(&f->io, 10);
+    __assert_append_entries_response(f, 1, true, 2);
+
+    return MUNIT_OK;
+}
+
+/* Consecutive AppendEntries messages received together are folded into a
+ * single write log request. */
+TEST_CASE(request, success, folded, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message messages[2];
+    const struct raft_entry *appended;
+    unsigned n;
+    unsigned i;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    for (i = 0; i < 2; i++) {
+        struct raft_append_entries *args = &messages[i].append_entries;
+        messages[i].type = RAFT_IO_APPEND_ENTRIES;
+        messages[i].server_id = 2;
+        messages[i].server_address = "2";
+        args->term = 1;
+        args->leader_id = 2;
+        args->prev_log_index = 1 + i;
+        args->prev_log_term = 1;
+        args->entries = __create_entries_batch();
+        args->n_entries = 1;
+        args->leader_commit = 1;
+        args->hibernate = false;
+        args->seq = 0;
+    }
+
+    rpc__recv_batch_cb(&f->io, messages, 2);
+
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 1);
+    raft_io_stub_appending(&f->io, 0, &appended, &n);
+    munit_assert_int(n, ==, 2);
+
+    raft_io_stub_flush(&f->io);
+    __assert_append_entries_response(f, 1, true, 3);
+
+    return MUNIT_OK;
+}
+
 /* A write log request is submitted for outstanding log entries. If some entries
  * are already existing in the log, they will be skipped. */
 TEST_CASE(request, success, skip, NULL)
@@ -492,6 +664,129 @@ TEST_CASE(request, success, truncate, NULL)
     return MUNIT_OK;
 }
 
+/* If the I/O backend supports it, the conflicting entries are truncated and
+ * the new ones appended with a single replace request. */
+TEST_CASE(request, success, replace, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+    struct raft_entry *entries = raft_malloc(2 * sizeof *entries);
+    const struct raft_entry *appended;
+    unsigned n;
+    uint8_t *buf1 = raft_malloc(1);
+    uint8_t *buf2 = raft_malloc(1);
+    uint8_t *buf3 = raft_malloc(1);
+    int rv;
+
+    *buf1 = 1;
+    *buf2 = 2;
+    *buf3 = 3;
+
+    (void)params;
+
+    f->io.version = 12;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    entry.type = RAFT_COMMAND;
+    entry.term = 1;
+    entry.buf.base = buf1;
+    entry.buf.len = 1;
+
+    test_io_append_entry(&f->io, &entry);
+    rv = log__append(&f->raft.log, 1, RAFT_COMMAND, &entry.buf, NULL);
+    munit_assert_int(rv, ==, 0);
+
+    entries[0].type = RAFT_COMMAND;
+    entries[0].term = 2;
+    entries[0].buf.base = buf2;
+    entries[0].buf.len = 1;
+    entries[1].type = RAFT_COMMAND;
+    entries[1].term = 2;
+    entries[1].buf.base = buf3;
+    entries[1].buf.len = 1;
+
+    __recv_append_entries(f, 2, 2, 1, 1, entries, 2, 1);
+
+    munit_assert_int(raft_io_stub_n_replaces(&f->io), ==, 1);
+    munit_assert_int(raft_io_stub_n_appending(&f->io), ==, 1);
+
+    raft_io_stub_appending(&f->io, 0, &appended, &n);
+
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(*(uint8_t *)appended[0].buf.base, ==, 2);
+    munit_assert_int(*(uint8_t *)appended[1].buf.base, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* If the leader commits entries that are still being written in place of
+ * conflicting ones, the commit index hint doesn't cover them until they are
+ * durable, so a restart doesn't apply the entries they replace. */
+TEST_CASE(request, success, commit_hint_truncate, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entry;
+    struct raft_entry *entries = raft_malloc(sizeof *entries);
+    struct raft_io io;
+    struct raft_fsm fsm;
+    struct raft raft;
+    raft_index commit;
+    int rv;
+
+    (void)params;
+
+    /* Our log has a second entry from term 1. */
+    test_io_bootstrap(&f->io, 2, 1, 2);
+    entry.type = RAFT_COMMAND;
+    entry.term = 1;
+    test_fsm_encode_add_x(3, &entry.buf);
+    test_io_append_entry(&f->io, &entry);
+    f->io.version = 8;
+    test_start(&f->raft);
+
+    /* The leader of term 2 replaces it, and commits its own entry before the
+     * write completes. */
+    entries[0].type = RAFT_COMMAND;
+    entries[0].term = 2;
+    test_fsm_encode_add_x(5, &entries[0].buf);
+    entries[0].batch = entries[0].buf.base;
+    __recv_append_entries(f, 2, 2, 1, 1, entries, 1, 1);
+    __recv_append_entries(f, 2, 2, 2, 2, NULL, 0, 2);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+
+    commit = f->io.load_commit(&f->io);
+    munit_assert_int(commit, ==, 1);
+
+    /* Restart with the state a crash would leave on a backend truncating
+     * asynchronously, i.e. with the entry of term 1 still there. */
+    test_io_setup(params, &io);
+    test_fsm_setup(params, &fsm);
+    test_io_bootstrap(&io, 2, 1, 2);
+    test_io_append_entry(&io, &entry);
+    io.version = 8;
+    io.set_commit(&io, commit);
+    rv = raft_init(&raft, &io, &fsm, 1, "1");
+    munit_assert_int(rv, ==, 0);
+    test_start(&raft);
+
+    munit_assert_int(raft.last_applied, ==, 1);
+    munit_assert_int(test_fsm_get_x(&fsm), ==, 0);
+
+    raft_close(&raft, NULL);
+    test_fsm_tear_down(&fsm);
+    test_io_tear_down(&io);
+
+    /* Once the new entry is durable, the hint catches up. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(f->io.load_commit(&f->io), ==, 2);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 5);
+
+    raft_free(entry.buf.base);
+
+    return MUNIT_OK;
+}
+
 /* If any of the new entry has the same index of an existing entry in our log,
  * but different term, and that entry index is already committed, we bail out
  * with an error. */
@@ -544,6 +839,8 @@ TEST_CASE(request, error, conflict, NULL)
     args.entries = entries;
     args.n_entries = 2;
     args.leader_commit = 1;
+    args.hibernate = false;
+    args.seq = 0;
 
     /* We return a shutdown error. */
     rv = raft_rpc__recv_append_entries(&f->raft, 2, "2", &args);
@@ -644,6 +941,76 @@ TEST_CASE(response, error, retry, NULL)
     return MUNIT_OK;
 }
 
+/* If the response reports a conflicting term, the leader skips all entries of
+ * that term at once. */
+TEST_CASE(response, error, conflict_term, NULL)
+{
+    struct fixture *f = data;
+    struct raft_append_entries_result result;
+    struct raft_replication *replication;
+    struct raft_buffer buf;
+    struct raft_apply reqs[3];
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    /* Our log has entry 1 from term 1 and entries 2 to 4 from term 2. */
+    for (i = 0; i < 3; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+    }
+    raft_io_stub_flush_all(f->raft.io);
+
+    replication = &f->raft.leader_state.replication[1];
+    replication->next_index = 5;
+
+    /* The follower has entries of term 1 up to index 4. */
+    result.term = 2;
+    result.success = false;
+    result.last_log_index = 4;
+    result.conflict_term = 1;
+    result.conflict_index = 1;
+    result.snapshot_index = 0;
+    result.snapshot_offset = 0;
+    result.seq = 0;
+
+    rv = raft_rpc__recv_append_entries_result(&f->raft, 2, "2", &result);
+    munit_assert_int(rv, ==, 0);
+
+    /* We resume right after our last entry of term 1. */
+    munit_assert_int(replication->next_index, ==, 2);
+    raft_io_stub_flush_all(f->raft.io);
+
+    /* If the conflicting term is unknown to us, resume from the first index
+     * the follower has for it. */
+    replication->next_index = 5;
+    result.conflict_term = 3;
+    result.conflict_index = 3;
+
+    rv = raft_rpc__recv_append_entries_result(&f->raft, 2, "2", &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(replication->next_index, ==, 3);
+    raft_io_stub_flush_all(f->raft.io);
+
+    /* Eventually the follower catches up and all entries get committed. */
+    result.success = true;
+    result.conflict_term = 0;
+    result.conflict_index = 0;
+
+    rv = raft_rpc__recv_append_entries_result(&f->raft, 2, "2", &result);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.commit_index, ==, 4);
+
+    return MUNIT_OK;
+}
+
 /* If a majority of servers has replicated an entry, commit it. */
 TEST_CASE(response, success, commit, NULL)
 {
@@ -675,6 +1042,78 @@ TEST_CASE(response, success, commit, NULL)
     return MUNIT_OK;
 }
 
+/* Entries are sent to followers along with the leader's own disk write, and if
+ * a majority of followers stores them first, they get committed and applied
+ * without waiting for that write to complete. */
+TEST_CASE(response, success, commit_before_local_write, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(123, &buf);
+
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_appending(f->raft.io), ==, 1);
+    munit_assert_int(raft_io_stub_n_sending(f->raft.io), ==, 2);
+
+    __recv_append_entries_result(f, 2, 2, true, 2);
+    munit_assert_int(f->raft.commit_index, ==, 1);
+
+    __recv_append_entries_result(f, 3, 2, true, 2);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+    munit_assert_int(f->raft.last_applied, ==, 2);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 123);
+
+    /* The local write is still in flight. */
+    munit_assert_int(f->raft.last_stored, ==, 1);
+    munit_assert_int(raft_io_stub_n_appending(f->raft.io), ==, 1);
+
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.last_stored, ==, 2);
+    munit_assert_int(f->raft.leader_state.replication[0].match_index, ==, 2);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* With the adaptive election timeout, leaders derive the timeout from the
+ * round-trip time of AppendEntries RPCs, and send heartbeats accordingly. */
+TEST_CASE(response, success, adaptive_timeout, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    raft_set_adaptive_election_timeout(&f->raft, 20, 1000);
+    test_become_leader(&f->raft);
+
+    munit_assert_int(raft_election__heartbeat_timeout(&f->raft), ==,
+                     f->raft.heartbeat_timeout);
+
+    raft_io_stub_advance(&f->io, 30);
+    __recv_append_entries_result(f, 2, 2, true, 1);
+    munit_assert_int(f->raft.election_adaptive.timeout, ==, 900);
+    munit_assert_int(raft_election__heartbeat_timeout(&f->raft), ==, 90);
+
+    /* The slowest follower sets the timeout, up to the upper bound. */
+    raft_io_stub_advance(&f->io, 10);
+    __recv_append_entries_result(f, 3, 2, true, 1);
+    munit_assert_int(f->raft.election_adaptive.timeout, ==, 1000);
+
+    return MUNIT_OK;
+}
+
 /* If after committing an entry the snapshot threshold is hit, a new snapshot is
  * taken. */
 TEST_CASE(response, success, snapshot, NULL)
@@ -720,13 +1159,29 @@ TEST_CASE(response, success, snapshot, NULL)
     return MUNIT_OK;
 }
 
-/* If a follower falls behind the next available log entry, the last snapshot is
- * sent. */
-TEST_CASE(response, success, send_snapshot, NULL)
+static void snapshot_patch_get_cb(struct raft_io_snapshot_get *req,
+                                  struct raft_snapshot *snapshot,
+                                  int status)
+{
+    const void *cursor = snapshot->bufs[0].base;
+    munit_assert_int(status, ==, 0);
+    munit_assert_int(snapshot->index, ==, 4);
+    munit_assert_int(byte__get64(&cursor), ==, 5);
+    munit_assert_int(byte__get64(&cursor), ==, 0);
+    snapshot__close(snapshot);
+    raft_free(snapshot);
+    *(bool *)req->data = true;
+}
+
+/* If both the FSM and the I/O backend support it, a snapshot taken after one
+ * stored by this server is saved as the changes made since then. */
+TEST_CASE(response, success, snapshot_patch, NULL)
 {
     struct fixture *f = data;
-    struct raft_apply reqs[2];
+    struct raft_apply reqs[3];
+    struct raft_io_snapshot_get get;
     struct raft_buffer buf;
+    bool loaded = false;
     unsigned i;
     int rv;
 
@@ -736,9 +1191,9 @@ TEST_CASE(response, success, send_snapshot, NULL)
 
     test_bootstrap_and_start(&f->raft, 3, 1, 3);
     test_become_leader(&f->raft);
+    f->fsm.version = 9;
+    f->io.version = 9;
 
-    /* Append a couple of entries to our log and handle the associated
-     * successful write. */
     for (i = 0; i < 2; i++) {
         test_fsm_encode_set_x(i, &buf);
         rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
@@ -746,7 +1201,491 @@ TEST_CASE(response, success, send_snapshot, NULL)
         raft_io_stub_flush_all(f->raft.io);
     }
 
-    /* Receive a successful append entries response reporting that the peer
+    /* The first snapshot is a full one. */
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_false(f->raft.snapshot.patch.storing);
+    raft_io_stub_flush_all(f->raft.io);
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(f->raft.snapshot.patch.base, ==, 3);
+
+    test_fsm_encode_set_x(5, &buf);
+    rv = raft_apply(&f->raft, &reqs[2], &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    /* The next one just carries the new value of x. */
+    __recv_append_entries_result(f, 2, 2, true, 4);
+    munit_assert_true(f->raft.snapshot.patch.storing);
+    munit_assert_int(f->raft.snapshot.patch.n, ==, 1);
+    raft_io_stub_flush_all(f->raft.io);
+    munit_assert_int(f->raft.snapshot.index, ==, 4);
+    munit_assert_int(f->raft.snapshot.size, ==, 16);
+    munit_assert_false(f->raft.snapshot.patch.storing);
+
+    get.data = &loaded;
+    rv = f->io.snapshot_get(&f->io, &get, snapshot_patch_get_cb);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+    munit_assert_true(loaded);
+
+    return MUNIT_OK;
+}
+
+/* A snapshot can be triggered by the size of the entries applied since the
+ * last snapshot, rather than by their number. */
+TEST_CASE(response, success, snapshot_bytes, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    size_t size = 0;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        size += buf.len;
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    raft_set_snapshot_threshold(&f->raft, 0, size, 0);
+
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_int(f->raft.commit_index, ==, 3);
+
+    /* A snapshot was started and its size recorded once saved. */
+    munit_assert_int(f->raft.snapshot.pending.index, ==, 3);
+
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(f->raft.snapshot.size, >, 0);
+
+    return MUNIT_OK;
+}
+
+/* A snapshot can be triggered when the size of the entries applied since the
+ * last snapshot reaches a percentage of the size of that snapshot. */
+TEST_CASE(response, success, snapshot_ratio, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    /* Pretend there's a previous snapshot, much bigger than the entries. */
+    f->raft.snapshot.size = 4096;
+    raft_set_snapshot_threshold(&f->raft, 0, 0, 50);
+
+    /* Half of the snapshot size is not reached. */
+    __recv_append_entries_result(f, 2, 2, true, 2);
+    munit_assert_int(f->raft.commit_index, ==, 2);
+    munit_assert_int(f->raft.snapshot.pending.term, ==, 0);
+
+    raft_set_snapshot_threshold(&f->raft, 0, 0, 1);
+
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_int(f->raft.commit_index, ==, 3);
+    munit_assert_int(f->raft.snapshot.pending.index, ==, 3);
+
+    raft_io_stub_flush_all(f->raft.io);
+
+    return MUNIT_OK;
+}
+
+/* A due snapshot can be deferred until no entry has been applied for a while,
+ * unless the log has grown too much in the meantime. */
+TEST_CASE(response, success, snapshot_deferred, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    f->raft.snapshot.threshold = 1;
+    raft_set_snapshot_deferral(&f->raft, 20, 4);
+
+    /* The threshold is reached, but entries were just applied. */
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_int(f->raft.commit_index, ==, 3);
+    munit_assert_int(f->raft.snapshot.pending.term, ==, 0);
+    munit_assert_true(f->raft.snapshot.deferral.waiting);
+    munit_assert_int(raft_next_timeout(&f->raft), <=, 20);
+
+    /* Once the quiet period elapses the snapshot is taken. */
+    raft_io_stub_advance(&f->io, 25);
+    munit_assert_int(f->raft.snapshot.pending.index, ==, 3);
+    munit_assert_false(f->raft.snapshot.deferral.waiting);
+
+    raft_io_stub_flush_all(f->raft.io);
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+
+    return MUNIT_OK;
+}
+
+static void __snapshot_get_cb(struct raft_io_snapshot_get *req,
+                              struct raft_snapshot *snapshot,
+                              int status)
+{
+    munit_assert_int(status, ==, 0);
+    req->data = snapshot;
+}
+
+/* If both the FSM and the I/O backend support it, the snapshot is streamed to
+ * disk chunk by chunk. */
+TEST_CASE(response, success, snapshot_stream, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_io_snapshot_get get;
+    struct raft_snapshot *snapshot;
+    struct raft_buffer buf;
+    const void *cursor;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->io.version = 3;
+    f->fsm.version = 4;
+    f->raft.snapshot.threshold = 1;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i + 1, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    __recv_append_entries_result(f, 2, 2, true, 3);
+
+    /* The snapshot was started and both chunks submitted. */
+    munit_assert_int(f->raft.snapshot.pending.index, ==, 3);
+    munit_assert_int(f->raft.snapshot.stream.n_pending, ==, 2);
+
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(f->raft.snapshot.term, ==, 2);
+    munit_assert_int(f->raft.snapshot.pending.term, ==, 0);
+
+    /* The stored snapshot has all the chunks. */
+    rv = f->io.snapshot_get(&f->io, &get, __snapshot_get_cb);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+    snapshot = get.data;
+    munit_assert_int(snapshot->index, ==, 3);
+    munit_assert_int(snapshot->bufs[0].len, ==, 16);
+    cursor = snapshot->bufs[0].base;
+    munit_assert_int(byte__get64(&cursor), ==, 2);
+    munit_assert_int(byte__get64(&cursor), ==, 0);
+    snapshot__close(snapshot);
+    raft_free(snapshot);
+
+    return MUNIT_OK;
+}
+
+struct snapshot_async
+{
+    struct raft_fsm_snapshot *req;
+    raft_fsm_snapshot_cb cb;
+};
+
+static int __snapshot_async(struct raft_fsm *fsm,
+                            struct raft_fsm_snapshot *req,
+                            raft_fsm_snapshot_cb cb)
+{
+    struct snapshot_async *async = req->raft->data;
+    (void)fsm;
+    async->req = req;
+    async->cb = cb;
+    return 0;
+}
+
+/* If the FSM implements the snapshot_async hook, entries keep being applied
+ * while the snapshot is being taken. */
+TEST_CASE(response, success, snapshot_async, NULL)
+{
+    struct fixture *f = data;
+    struct snapshot_async async = {NULL, NULL};
+    struct raft_apply reqs[3];
+    struct raft_buffer buf;
+    struct raft_buffer *bufs;
+    unsigned n_bufs;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->fsm.version = 5;
+    f->fsm.snapshot_async = __snapshot_async;
+    f->raft.snapshot.threshold = 1;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    /* The FSM is asked to take a snapshot, and it keeps it running. */
+    f->raft.data = &async;
+    __recv_append_entries_result(f, 2, 2, true, 3);
+
+    munit_assert_ptr_not_null(async.req);
+    munit_assert_int(async.req->index, ==, 3);
+    munit_assert_int(f->raft.snapshot.pending.index, ==, 3);
+
+    /* A new entry gets applied in the meantime. */
+    test_fsm_encode_set_x(123, &buf);
+    rv = raft_apply(&f->raft, &reqs[2], &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+    __recv_append_entries_result(f, 2, 2, true, 4);
+
+    munit_assert_int(f->raft.last_applied, ==, 4);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 123);
+    munit_assert_int(f->raft.snapshot.index, ==, 0);
+
+    /* Once the FSM is done, the snapshot gets stored. */
+    test_fsm_encode_snapshot(1, 0, &bufs, &n_bufs);
+    async.cb(async.req, bufs, n_bufs, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(f->raft.snapshot.term, ==, 2);
+    munit_assert_int(f->raft.snapshot.pending.term, ==, 0);
+
+    f->raft.data = f;
+
+    return MUNIT_OK;
+}
+
+/* After a snapshot is taken, the configured number of trailing entries is
+ * retained in the log. */
+TEST_CASE(response, success, snapshot_trailing, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->raft.snapshot.threshold = 1;
+    raft_set_snapshot_trailing(&f->raft, 1, 0);
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(log__first_index(&f->raft.log), ==, 3);
+    munit_assert_int(log__last_index(&f->raft.log), ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* Trailing entries can also be retained according to their size. */
+TEST_CASE(response, success, snapshot_trailing_bytes, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    size_t size;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->raft.snapshot.threshold = 1;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    /* Retain just a bit more than the payload of the last entry. */
+    size = log__get(&f->raft.log, 3)->buf.len;
+    raft_set_snapshot_trailing(&f->raft, 0, size + 1);
+
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 3);
+    munit_assert_int(log__first_index(&f->raft.log), ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* If no trailing entry is retained, the log is empty after the snapshot and
+ * new entries, including configuration changes, follow the snapshot. */
+TEST_CASE(response, success, snapshot_trailing_none, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    f->raft.snapshot.threshold = 1;
+    raft_set_snapshot_trailing(&f->raft, 0, 0);
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(1, &buf);
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    __recv_append_entries_result(f, 2, 2, true, 2);
+    raft_io_stub_flush_all(f->raft.io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+    munit_assert_int(log__n_entries(&f->raft.log), ==, 0);
+
+    rv = raft_add_server(&f->raft, 4, "4");
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(f->raft.configuration_uncommitted_index, ==, 3);
+    munit_assert_int(log__first_index(&f->raft.log), ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* A follower that installed the snapshot rejects heartbeats for the entries
+ * after it, and is probed right after the snapshot instead of being sent the
+ * snapshot again. */
+TEST_CASE(response, success, snapshot_installed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    f->raft.snapshot.threshold = 1;
+    raft_set_snapshot_trailing(&f->raft, 0, 0);
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(1, &buf);
+    rv = raft_apply(&f->raft, &reqs[0], &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    __recv_append_entries_result(f, 2, 2, true, 2);
+    raft_io_stub_flush_all(f->raft.io);
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+
+    test_fsm_encode_set_x(2, &buf);
+    rv = raft_apply(&f->raft, &reqs[1], &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    /* Server 3 is being sent the snapshot. */
+    replication = &f->raft.leader_state.replication[2];
+    replication->state = REPLICATION__SNAPSHOT;
+    replication->match_index = 1;
+    replication->next_index = 2;
+
+    __recv_append_entries_result(f, 3, 2, false, 2);
+    munit_assert_int(replication->state, ==, REPLICATION__PROBE);
+    munit_assert_int(replication->next_index, ==, 3);
+
+    raft_io_stub_flush_all(f->raft.io);
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    raft_io_stub_flush_all(f->raft.io);
+
+    return MUNIT_OK;
+}
+
+/* If a follower falls behind the next available log entry, the last snapshot is
+ * sent. */
+TEST_CASE(response, success, send_snapshot, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    f->raft.snapshot.threshold = 1;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    /* Append a couple of entries to our log and handle the associated
+     * successful write. */
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+    }
+
+    /* Receive a successful append entries response reporting that the peer
      * has replicated those entries. */
     __recv_append_entries_result(f, 2, 2, true, 3);
 
@@ -762,3 +1701,112 @@ TEST_CASE(response, success, send_snapshot, NULL)
 
     return MUNIT_OK;
 }
+
+/* After the first successful response the follower is switched to pipeline
+ * mode, and new entries are sent right after the ones in flight without waiting
+ * for a result. */
+TEST_CASE(response, success, pipeline, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[3];
+    struct raft_replication *replication;
+    struct raft_message *message;
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+
+    test_fsm_encode_set_x(1, &buf);
+    rv = raft_apply(&f->raft, &reqs[0], &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(f->raft.io);
+
+    replication = &f->raft.leader_state.replication[1];
+    munit_assert_int(replication->state, ==, REPLICATION__PROBE);
+
+    __recv_append_entries_result(f, 2, 2, true, 2);
+
+    munit_assert_int(replication->state, ==, REPLICATION__PIPELINE);
+    munit_assert_int(replication->next_index, ==, 3);
+
+    /* Submit two more entries without receiving any result. */
+    for (i = 1; i < 3; i++) {
+        test_fsm_encode_set_x(i + 1, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    munit_assert_int(replication->next_index, ==, 5);
+
+    /* The second AppendEntries request for server 2 contains only the entry
+     * that wasn't in flight yet. */
+    raft_io_stub_sending(&f->io, 2, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 3);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(f->raft.io);
+
+    /* A late result for the first request doesn't move next_index back. */
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_int(replication->match_index, ==, 3);
+    munit_assert_int(replication->next_index, ==, 5);
+
+    __recv_append_entries_result(f, 2, 2, true, 4);
+    munit_assert_int(f->raft.commit_index, ==, 4);
+
+    return MUNIT_OK;
+}
+
+/* If a request sent while pipelining gets rejected, the follower goes back to
+ * probe mode and entries are resent starting from the match index. */
+TEST_CASE(response, error, pipeline_reject, NULL)
+{
+    struct fixture *f = data;
+    struct raft_apply reqs[2];
+    struct raft_replication *replication;
+    struct raft_message *message;
+    struct raft_buffer buf;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    for (i = 0; i < 2; i++) {
+        test_fsm_encode_set_x(i, &buf);
+        rv = raft_apply(&f->raft, &reqs[i], &buf, 1, NULL);
+        munit_assert_int(rv, ==, 0);
+        raft_io_stub_flush_all(f->raft.io);
+        if (i == 0) {
+            __recv_append_entries_result(f, 2, 2, true, 2);
+        }
+    }
+
+    replication = &f->raft.leader_state.replication[1];
+    munit_assert_int(replication->state, ==, REPLICATION__PIPELINE);
+    munit_assert_int(replication->next_index, ==, 4);
+
+    __recv_append_entries_result(f, 2, 2, false, 2);
+
+    munit_assert_int(replication->state, ==, REPLICATION__PROBE);
+    munit_assert_int(replication->next_index, ==, 3);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->append_entries.prev_log_index, ==, 2);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+
+    raft_io_stub_flush_all(f->raft.io);
+    __recv_append_entries_result(f, 2, 2, true, 3);
+    munit_assert_int(f->raft.commit_index, ==, 3);
+
+    return MUNIT_OK;
+}
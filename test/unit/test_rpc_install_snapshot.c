@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "../lib/raft.h"
 #include "../lib/runner.h"
@@ -69,6 +70,8 @@ static struct raft_entry *__create_entries_batch()
         args.entries = ENTRIES;                                          \
         args.n_entries = N;                                              \
         args.leader_commit = COMMIT;                                     \
+        args.hibernate = false;                                          \
+        args.seq = 0;                                                    \
                                                                          \
         rv = raft_rpc__recv_append_entries(&F->raft, LEADER_ID, address, \
                                            &args);                       \
@@ -93,6 +96,8 @@ static struct raft_entry *__create_entries_batch()
         args.last_index = LAST_INDEX;                                      \
         args.last_term = LAST_TERM;                                        \
         args.conf_index = 1;                                               \
+        args.offset = 0;                                                   \
+        args.done = true;                                                  \
                                                                            \
         raft_configuration_init(configuration);                            \
         rv = raft_configuration_add(configuration, 1, "1", true);          \
@@ -124,6 +129,84 @@ static struct raft_entry *__create_entries_batch()
         munit_assert_int(rv, ==, 0);                                       \
     }
 
+/**
+ * Call raft_rpc__recv_install_snapshot to send the snapshot data in two chunks,
+ * checking that no error occurs. The snapshot sets x to 333 and y to 666.
+ */
+static void __recv_install_snapshot_chunks(struct fixture *f,
+                                           raft_term term,
+                                           unsigned leader_id,
+                                           raft_index last_index,
+                                           raft_term last_term)
+{
+    struct raft_install_snapshot args;
+    struct raft_buffer buf;
+    struct raft_buffer *bufs;
+    unsigned n_bufs;
+    struct raft_fsm fsm;
+    char address[4];
+    size_t half;
+    int rv;
+
+    sprintf(address, "%d", leader_id);
+
+    test_fsm_setup(NULL, &fsm);
+    test_fsm_encode_set_x(333, &buf);
+    rv = fsm.apply(&fsm, &buf);
+    munit_assert_int(0, ==, rv);
+    raft_free(buf.base);
+    test_fsm_encode_set_y(666, &buf);
+    rv = fsm.apply(&fsm, &buf);
+    munit_assert_int(0, ==, rv);
+    raft_free(buf.base);
+
+    rv = fsm.snapshot(&fsm, &bufs, &n_bufs);
+    munit_assert_int(rv, ==, 0);
+    test_fsm_tear_down(&fsm);
+
+    half = bufs[0].len / 2;
+
+    args.term = term;
+    args.leader_id = leader_id;
+    args.last_index = last_index;
+    args.last_term = last_term;
+    args.conf_index = 1;
+
+    /* First chunk, with no configuration. */
+    args.offset = 0;
+    args.done = false;
+    raft_configuration_init(&args.conf);
+    args.data.len = half;
+    args.data.base = raft_malloc(half);
+    munit_assert_ptr_not_null(args.data.base);
+    memcpy(args.data.base, bufs[0].base, half);
+
+    rv = raft_rpc__recv_install_snapshot(&f->raft, leader_id, address, &args);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Last chunk, with the configuration. */
+    args.offset = half;
+    args.done = true;
+    raft_configuration_init(&args.conf);
+    rv = raft_configuration_add(&args.conf, 1, "1", true);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_configuration_add(&args.conf, 2, "2", true);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_configuration_add(&args.conf, 3, "3", true);
+    munit_assert_int(rv, ==, 0);
+    args.data.len = bufs[0].len - half;
+    args.data.base = raft_malloc(args.data.len);
+    munit_assert_ptr_not_null(args.data.base);
+    memcpy(args.data.base, (char *)bufs[0].base + half, args.data.len);
+
+    raft_free(bufs[0].base);
+    raft_free(bufs);
+
+    rv = raft_rpc__recv_install_snapshot(&f->raft, leader_id, address, &args);
+    munit_assert_int(rv, ==, 0);
+}
+
 /**
  * raft_rpc__recv_install_snapshot
  */
@@ -149,3 +232,222 @@ TEST_CASE(success, replace_log, NULL)
 
     return MUNIT_OK;
 }
+
+/* Heartbeats received while the snapshot is being stored are ignored, instead
+ * of being rejected and making the leader send the snapshot again. */
+TEST_CASE(success, heartbeat_while_storing, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    __recv_install_snapshot(f, 2, 3, 2, 2);
+    munit_assert_ptr_not_null(f->raft.snapshot.put.data);
+
+    __recv_append_entries(f, 2, 3, 2, 2, NULL, 0, 2);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    raft_io_stub_flush_all(&f->io);
+    munit_assert_ptr_null(f->raft.snapshot.put.data);
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* Heartbeats received while the chunks of a snapshot are arriving are ignored
+ * as well. */
+TEST_CASE(success, heartbeat_while_receiving, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot args;
+    struct raft_append_entries heartbeat;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    args.term = 2;
+    args.leader_id = 3;
+    args.last_index = 2;
+    args.last_term = 2;
+    args.conf_index = 1;
+    args.offset = 0;
+    args.done = false;
+    raft_configuration_init(&args.conf);
+    args.data.len = 8;
+    args.data.base = raft_malloc(args.data.len);
+    munit_assert_ptr_not_null(args.data.base);
+    rv = raft_rpc__recv_install_snapshot(&f->raft, 3, "3", &args);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    heartbeat.term = 2;
+    heartbeat.leader_id = 3;
+    heartbeat.prev_log_index = 2;
+    heartbeat.prev_log_term = 2;
+    heartbeat.entries = NULL;
+    heartbeat.n_entries = 0;
+    heartbeat.leader_commit = 2;
+    heartbeat.hibernate = false;
+    heartbeat.seq = 0;
+    rv = raft_rpc__recv_append_entries(&f->raft, 3, "3", &heartbeat);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* A snapshot sent in chunks is accumulated in memory if the I/O backend can't
+ * store chunks, and restored once the last one arrives. */
+TEST_CASE(success, chunks, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    __recv_install_snapshot_chunks(f, 2, 3, 2, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 333);
+    munit_assert_int(test_fsm_get_y(&f->fsm), ==, 666);
+
+    return MUNIT_OK;
+}
+
+/* If the I/O backend supports it, the chunks of a snapshot are stored as they
+ * arrive, and the complete snapshot is loaded back to be restored. */
+TEST_CASE(success, chunks_put_chunk, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    f->io.version = 3;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    __recv_install_snapshot_chunks(f, 2, 3, 2, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 333);
+    munit_assert_int(test_fsm_get_y(&f->fsm), ==, 666);
+
+    return MUNIT_OK;
+}
+
+/* If the FSM supports it, a snapshot stored in chunks is read back from disk
+ * and restored chunk by chunk. */
+TEST_CASE(success, chunks_restore_chunk, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    f->io.version = 4;
+    f->fsm.version = 6;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    raft_set_snapshot_chunk_size(&f->raft, 8);
+
+    __recv_install_snapshot_chunks(f, 2, 3, 2, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    munit_assert_int(f->raft.snapshot.index, ==, 2);
+    munit_assert_int(f->raft.configuration.n, ==, 3);
+    munit_assert_int(test_fsm_get_x(&f->fsm), ==, 333);
+    munit_assert_int(test_fsm_get_y(&f->fsm), ==, 666);
+
+    return MUNIT_OK;
+}
+
+/* If the leader restarts the transfer of a snapshot we have part of, we tell
+ * it to resume from the data we have. */
+TEST_CASE(success, resume, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot args;
+    struct raft_message *message;
+    unsigned i;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    args.term = 2;
+    args.leader_id = 3;
+    args.last_index = 2;
+    args.last_term = 2;
+    args.conf_index = 1;
+    args.offset = 0;
+    args.done = false;
+
+    /* The same first chunk is received twice. */
+    for (i = 0; i < 2; i++) {
+        raft_configuration_init(&args.conf);
+        args.data.len = 8;
+        args.data.base = raft_malloc(args.data.len);
+        munit_assert_ptr_not_null(args.data.base);
+        rv = raft_rpc__recv_install_snapshot(&f->raft, 3, "3", &args);
+        munit_assert_int(rv, ==, 0);
+    }
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES_RESULT);
+    munit_assert_int(message->server_id, ==, 3);
+    munit_assert_false(message->append_entries_result.success);
+    munit_assert_int(message->append_entries_result.snapshot_index, ==, 2);
+    munit_assert_int(message->append_entries_result.snapshot_offset, ==, 8);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
+/* A snapshot sent by a follower on behalf of the leader is acknowledged to the
+ * leader itself. */
+TEST_CASE(success, delegated, NULL)
+{
+    struct fixture *f = data;
+    struct raft_install_snapshot args;
+    struct raft_message *message;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+
+    args.term = 1;
+    args.leader_id = 2;
+    args.last_index = 1;
+    args.last_term = 1;
+    args.conf_index = 1;
+    args.offset = 0;
+    args.done = true;
+    args.data.base = NULL;
+    args.data.len = 0;
+    raft_configuration_init(&args.conf);
+
+    rv = raft_rpc__recv_install_snapshot(&f->raft, 3, "3", &args);
+    munit_assert_int(rv, ==, 0);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_APPEND_ENTRIES_RESULT);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_true(message->append_entries_result.success);
+    munit_assert_int(message->append_entries_result.last_log_index, ==, 1);
+    munit_assert_int(f->raft.follower_state.current_leader.id, ==, 0);
+
+    return MUNIT_OK;
+}
@@ -0,0 +1,348 @@
+#include <stdio.h>
+
+#include "../../include/raft.h"
+#include "../../include/raft/io_stub.h"
+
+#include "../../src/rpc_append_entries.h"
+#include "../../src/rpc_propose.h"
+
+#include "../lib/fsm.h"
+#include "../lib/heap.h"
+#include "../lib/io.h"
+#include "../lib/raft.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(rpc_propose);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    RAFT_FIXTURE;
+    struct raft_apply req;
+    bool invoked;
+    int status;
+};
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    struct fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+}
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    RAFT_SETUP(f);
+
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    RAFT_TEAR_DOWN(f);
+
+    free(f);
+}
+
+/**
+ * Call raft_rpc__recv_propose with the given parameters and a single command
+ * setting x to 123, and check that no error occurs.
+ */
+#define __recv_propose(F, SERVER_ID, TERM, ID)                             \
+    {                                                                      \
+        struct raft_propose args;                                          \
+        struct raft_buffer buf;                                            \
+        char address[4];                                                   \
+        int rv;                                                            \
+                                                                           \
+        sprintf(address, "%d", SERVER_ID);                                 \
+                                                                           \
+        test_fsm_encode_set_x(123, &buf);                                  \
+        args.term = TERM;                                                  \
+        args.id = ID;                                                      \
+        args.entries = raft_malloc(sizeof *args.entries);                  \
+        args.entries[0].term = TERM;                                       \
+        args.entries[0].type = RAFT_COMMAND;                               \
+        args.entries[0].buf = buf;                                         \
+        args.entries[0].batch = buf.base;                                  \
+        args.n_entries = 1;                                                \
+        rv = raft_rpc__recv_propose(&F->raft, SERVER_ID, address, &args);  \
+        munit_assert_int(rv, ==, 0);                                       \
+    }
+
+/**
+ * Call raft_rpc__recv_propose_result with the given parameters and check that
+ * no error occurs.
+ */
+#define __recv_propose_result(F, SERVER_ID, TERM, ID, INDEX, STATUS)          \
+    {                                                                         \
+        struct raft_propose_result result;                                    \
+        char address[4];                                                      \
+        int rv;                                                               \
+                                                                              \
+        sprintf(address, "%d", SERVER_ID);                                    \
+                                                                              \
+        result.term = TERM;                                                   \
+        result.id = ID;                                                       \
+        result.index = INDEX;                                                 \
+        result.status = STATUS;                                               \
+        rv = raft_rpc__recv_propose_result(&F->raft, SERVER_ID, address,      \
+                                           &result);                          \
+        munit_assert_int(rv, ==, 0);                                          \
+    }
+
+/**
+ * Call raft_rpc__recv_append_entries_result with the given parameters and check
+ * that no error occurs.
+ */
+#define __recv_append_entries_result(F, SERVER_ID, TERM, LAST_LOG_INDEX)  \
+    {                                                                     \
+        struct raft_append_entries_result result;                         \
+        char address[4];                                                  \
+        int rv;                                                           \
+                                                                          \
+        sprintf(address, "%d", SERVER_ID);                                \
+                                                                          \
+        result.term = TERM;                                               \
+        result.success = true;                                            \
+        result.last_log_index = LAST_LOG_INDEX;                           \
+        result.conflict_term = 0;                                         \
+        result.conflict_index = 0;                                        \
+        result.snapshot_index = 0;                                        \
+        result.snapshot_offset = 0;                                       \
+        result.seq = F->raft.leader_state.seq;                            \
+        rv = raft_rpc__recv_append_entries_result(&F->raft, SERVER_ID,    \
+                                                  address, &result);      \
+        munit_assert_int(rv, ==, 0);                                      \
+    }
+
+/**
+ * Make the raft instance of the given fixture a follower of server 2, with
+ * forwarding enabled, and submit an apply request.
+ */
+#define __follow_and_apply(F)                                             \
+    {                                                                     \
+        struct raft_buffer buf;                                           \
+                                                                          \
+        test_bootstrap_and_start(&F->raft, 2, 1, 2);                      \
+        raft_set_apply_forwarding(&F->raft, true);                        \
+        test_receive_heartbeat(&F->raft, 2);                              \
+                                                                          \
+        test_fsm_encode_set_x(123, &buf);                                 \
+        munit_assert_int(raft_apply(&F->raft, &F->req, &buf, 1, apply_cb), \
+                         ==, 0);                                          \
+    }
+
+/**
+ * Assert that the I/O queue has exactly one pending message of the given type,
+ * and return it.
+ */
+#define __assert_sending(F, TYPE, MESSAGE)                       \
+    {                                                            \
+        munit_assert_int(raft_io_stub_n_sending(&F->io), ==, 1); \
+        raft_io_stub_sending(&F->io, 0, &MESSAGE);               \
+        munit_assert_int(MESSAGE->type, ==, TYPE);               \
+    }
+
+/**
+ * Receive a Propose request.
+ */
+
+TEST_SUITE(request);
+
+TEST_SETUP(request, setup);
+TEST_TEAR_DOWN(request, tear_down);
+
+TEST_GROUP(request, error);
+TEST_GROUP(request, success);
+
+/* If the local server is not the leader, the request is rejected. */
+TEST_CASE(request, error, not_leader, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __recv_propose(f, 2, 1, 7);
+
+    __assert_sending(f, RAFT_IO_PROPOSE_RESULT, message);
+    munit_assert_int(message->propose_result.id, ==, 7);
+    munit_assert_int(message->propose_result.index, ==, 0);
+    munit_assert_int(message->propose_result.status, ==, RAFT_ERR_NOT_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* The leader appends the commands and answers once they are applied. */
+TEST_CASE(request, success, applied, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    __recv_propose(f, 2, 2, 7);
+
+    /* The command gets replicated. */
+    __assert_sending(f, RAFT_IO_APPEND_ENTRIES, message);
+    munit_assert_int(message->append_entries.n_entries, ==, 1);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_append_entries_result(f, 2, 2, 2);
+    munit_assert_int(f->raft.last_applied, ==, 2);
+
+    __assert_sending(f, RAFT_IO_PROPOSE_RESULT, message);
+    munit_assert_int(message->propose_result.term, ==, 2);
+    munit_assert_int(message->propose_result.id, ==, 7);
+    munit_assert_int(message->propose_result.index, ==, 2);
+    munit_assert_int(message->propose_result.status, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Forward an apply request to the leader and receive the Propose result.
+ */
+
+TEST_SUITE(result);
+
+TEST_SETUP(result, setup);
+TEST_TEAR_DOWN(result, tear_down);
+
+TEST_GROUP(result, error);
+TEST_GROUP(result, success);
+
+/* Followers reject apply requests unless forwarding is enabled. */
+TEST_CASE(result, error, disabled, NULL)
+{
+    struct fixture *f = data;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_receive_heartbeat(&f->raft, 2);
+
+    test_fsm_encode_set_x(123, &buf);
+    rv = raft_apply(&f->raft, &f->req, &buf, 1, apply_cb);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* A follower which doesn't know the current leader can't forward requests. */
+TEST_CASE(result, error, no_leader, NULL)
+{
+    struct fixture *f = data;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_apply_forwarding(&f->raft, true);
+
+    test_fsm_encode_set_x(123, &buf);
+    rv = raft_apply(&f->raft, &f->req, &buf, 1, apply_cb);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+    raft_free(buf.base);
+
+    return MUNIT_OK;
+}
+
+/* If the leader rejects the request, the error is passed to the callback. */
+TEST_CASE(result, error, rejected, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __follow_and_apply(f);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_propose_result(f, 2, 1, 1, 0, RAFT_EBACKPRESSURE);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, RAFT_EBACKPRESSURE);
+
+    return MUNIT_OK;
+}
+
+/* If no result arrives within an election timeout, the request fails. */
+TEST_CASE(result, error, timeout, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    __follow_and_apply(f);
+    raft_io_stub_flush_all(&f->io);
+
+    raft_io_stub_advance(&f->io, f->raft.election_timeout / 2);
+    munit_assert_false(f->invoked);
+
+    /* Keep hearing from the leader, so we don't start an election. */
+    test_receive_heartbeat(&f->raft, 2);
+    raft_io_stub_flush_all(&f->io);
+    raft_io_stub_advance(&f->io, f->raft.election_timeout / 2);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, RAFT_ERR_TIMEOUT);
+
+    return MUNIT_OK;
+}
+
+/* A follower forwards the request to the leader, and completes it once the
+ * leader reports that the commands were applied. */
+TEST_CASE(result, success, applied, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    __follow_and_apply(f);
+
+    __assert_sending(f, RAFT_IO_PROPOSE, message);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_int(message->propose.id, ==, 1);
+    munit_assert_int(message->propose.n_entries, ==, 1);
+    raft_io_stub_flush_all(&f->io);
+
+    /* A result for a different request is ignored. */
+    __recv_propose_result(f, 2, 1, 2, 2, 0);
+    munit_assert_false(f->invoked);
+
+    __recv_propose_result(f, 2, 1, 1, 2, 0);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->req.index, ==, 2);
+
+    return MUNIT_OK;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+
+#include "../../include/raft.h"
+#include "../../include/raft/io_stub.h"
+
+#include "../../src/log.h"
+#include "../../src/rpc_append_entries.h"
+#include "../../src/rpc_read_index.h"
+
+#include "../lib/fsm.h"
+#include "../lib/heap.h"
+#include "../lib/io.h"
+#include "../lib/raft.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(rpc_read_index);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    RAFT_FIXTURE;
+    struct raft_read req;
+    bool invoked;
+    int status;
+};
+
+static void read_cb(struct raft_read *req, int status)
+{
+    struct fixture *f = req->data;
+    f->invoked = true;
+    f->status = status;
+}
+
+static void apply_cb(struct raft_apply *req, int status)
+{
+    (void)status;
+    free(req);
+}
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    RAFT_SETUP(f);
+
+    f->req.data = f;
+    f->invoked = false;
+    f->status = -1;
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    RAFT_TEAR_DOWN(f);
+
+    free(f);
+}
+
+/**
+ * Call raft_rpc__recv_read_index with the given parameters and check that no
+ * error occurs.
+ */
+#define __recv_read_index(F, SERVER_ID, TERM, ID)                              \
+    {                                                                          \
+        struct raft_read_index args;                                           \
+        char address[4];                                                       \
+        int rv;                                                                \
+                                                                               \
+        sprintf(address, "%d", SERVER_ID);                                     \
+                                                                               \
+        args.term = TERM;                                                      \
+        args.id = ID;                                                          \
+        rv = raft_rpc__recv_read_index(&F->raft, SERVER_ID, address, &args);   \
+        munit_assert_int(rv, ==, 0);                                           \
+    }
+
+/**
+ * Call raft_rpc__recv_read_index_result with the given parameters and check
+ * that no error occurs.
+ */
+#define __recv_read_index_result(F, SERVER_ID, TERM, ID, INDEX)         \
+    {                                                                   \
+        struct raft_read_index_result result;                           \
+        char address[4];                                                \
+        int rv;                                                         \
+                                                                        \
+        sprintf(address, "%d", SERVER_ID);                              \
+                                                                        \
+        result.term = TERM;                                             \
+        result.id = ID;                                                 \
+        result.index = INDEX;                                           \
+        rv = raft_rpc__recv_read_index_result(&F->raft, SERVER_ID,      \
+                                              address, &result);        \
+        munit_assert_int(rv, ==, 0);                                    \
+    }
+
+/**
+ * Call raft_rpc__recv_append_entries_result with the given parameters and check
+ * that no error occurs.
+ */
+#define __recv_append_entries_result(F, SERVER_ID, TERM, LAST_LOG_INDEX)  \
+    {                                                                     \
+        struct raft_append_entries_result result;                         \
+        char address[4];                                                  \
+        int rv;                                                           \
+                                                                          \
+        sprintf(address, "%d", SERVER_ID);                                \
+                                                                          \
+        result.term = TERM;                                               \
+        result.success = true;                                            \
+        result.last_log_index = LAST_LOG_INDEX;                           \
+        result.conflict_term = 0;                                         \
+        result.conflict_index = 0;                                        \
+        result.snapshot_index = 0;                                        \
+        result.snapshot_offset = 0;                                       \
+        result.seq = F->raft.leader_state.seq;                            \
+        rv = raft_rpc__recv_append_entries_result(&F->raft, SERVER_ID,    \
+                                                  address, &result);      \
+        munit_assert_int(rv, ==, 0);                                      \
+    }
+
+/**
+ * Make the raft instance of the given fixture leader and commit an entry of
+ * the current term.
+ */
+#define __become_leader_and_commit(F)                                        \
+    {                                                                        \
+        struct raft_buffer buf;                                              \
+        struct raft_apply *req = munit_malloc(sizeof *req);                  \
+                                                                             \
+        test_bootstrap_and_start(&F->raft, 2, 1, 2);                         \
+        test_become_leader(&F->raft);                                        \
+                                                                             \
+        test_fsm_encode_set_x(123, &buf);                                    \
+        munit_assert_int(raft_apply(&F->raft, req, &buf, 1, apply_cb), ==,   \
+                         0);                                                 \
+        raft_io_stub_flush_all(&F->io);                                      \
+        __recv_append_entries_result(F, 2, 2, 2);                            \
+        munit_assert_int(F->raft.last_applied, ==, 2);                       \
+    }
+
+/**
+ * Assert that the I/O queue has exactly one pending message of the given type,
+ * and return it.
+ */
+#define __assert_sending(F, TYPE, MESSAGE)                       \
+    {                                                            \
+        munit_assert_int(raft_io_stub_n_sending(&F->io), ==, 1); \
+        raft_io_stub_sending(&F->io, 0, &MESSAGE);               \
+        munit_assert_int(MESSAGE->type, ==, TYPE);               \
+    }
+
+/**
+ * Receive a ReadIndex request.
+ */
+
+TEST_SUITE(request);
+
+TEST_SETUP(request, setup);
+TEST_TEAR_DOWN(request, tear_down);
+
+TEST_GROUP(request, error);
+TEST_GROUP(request, success);
+
+/* If the local server is not the leader, the request is rejected. */
+TEST_CASE(request, error, not_leader, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __recv_read_index(f, 2, 1, 7);
+
+    __assert_sending(f, RAFT_IO_READ_INDEX_RESULT, message);
+    munit_assert_int(message->read_index_result.id, ==, 7);
+    munit_assert_int(message->read_index_result.index, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* The leader answers with its commit index once a round of heartbeats confirms
+ * its leadership. */
+TEST_CASE(request, success, confirmed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    __become_leader_and_commit(f);
+
+    __recv_read_index(f, 2, 2, 7);
+
+    /* A heartbeat was sent to confirm leadership. */
+    __assert_sending(f, RAFT_IO_APPEND_ENTRIES, message);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_append_entries_result(f, 2, 2, 2);
+
+    __assert_sending(f, RAFT_IO_READ_INDEX_RESULT, message);
+    munit_assert_int(message->read_index_result.term, ==, 2);
+    munit_assert_int(message->read_index_result.id, ==, 7);
+    munit_assert_int(message->read_index_result.index, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Forward a read to the leader and receive the ReadIndex result.
+ */
+
+TEST_SUITE(result);
+
+TEST_SETUP(result, setup);
+TEST_TEAR_DOWN(result, tear_down);
+
+TEST_GROUP(result, error);
+TEST_GROUP(result, success);
+
+/* A follower which doesn't know the current leader can't serve reads. */
+TEST_CASE(result, error, no_leader, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    rv = raft_read_index(&f->raft, &f->req, read_cb);
+    munit_assert_int(rv, ==, RAFT_ERR_NOT_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* If the leader rejects the request, the read fails. */
+TEST_CASE(result, error, rejected, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_receive_heartbeat(&f->raft, 2);
+
+    munit_assert_int(raft_read_index(&f->raft, &f->req, read_cb), ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_read_index_result(f, 2, 1, 1, 0);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, RAFT_ERR_NOT_LEADER);
+
+    return MUNIT_OK;
+}
+
+/* A follower forwards the read to the leader, and completes it once it has
+ * applied the index returned by the leader. */
+TEST_CASE(result, success, applied, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_receive_heartbeat(&f->raft, 2);
+
+    munit_assert_int(raft_read_index(&f->raft, &f->req, read_cb), ==, 0);
+
+    __assert_sending(f, RAFT_IO_READ_INDEX, message);
+    munit_assert_int(message->server_id, ==, 2);
+    munit_assert_int(message->read_index.id, ==, 1);
+    raft_io_stub_flush_all(&f->io);
+
+    /* A result for a different request is ignored. */
+    __recv_read_index_result(f, 2, 1, 2, 1);
+    munit_assert_false(f->invoked);
+
+    __recv_read_index_result(f, 2, 1, 1, 1);
+
+    munit_assert_true(f->invoked);
+    munit_assert_int(f->status, ==, 0);
+    munit_assert_int(f->req.index, ==, 1);
+
+    return MUNIT_OK;
+}
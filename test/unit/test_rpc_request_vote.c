@@ -6,6 +6,7 @@
 #include "../../src/configuration.h"
 #include "../../src/log.h"
 #include "../../src/rpc_request_vote.h"
+#include "../../src/state.h"
 #include "../../src/tick.h"
 
 #include "../lib/fsm.h"
@@ -66,6 +67,8 @@ static void tear_down(void *data)
         args.candidate_id = CANDIDATE_ID;                                 \
         args.last_log_index = LAST_LOG_INDEX;                             \
         args.last_log_term = LAST_LOG_TERM;                               \
+        args.pre_vote = false;                                            \
+        args.disrupt_leader = false;                                      \
                                                                           \
         rv = raft_rpc__recv_request_vote(&F->raft, CANDIDATE_ID, address, \
                                          &args);                          \
@@ -86,6 +89,50 @@ static void tear_down(void *data)
                                                                              \
         result.term = TERM;                                                  \
         result.vote_granted = GRANTED;                                       \
+        result.pre_vote = false;                                             \
+        rv = raft_rpc__recv_request_vote_result(&F->raft, VOTER_ID, address, \
+                                                &result);                    \
+        munit_assert_int(rv, ==, 0);                                         \
+    }
+
+/**
+ * Call raft_rpc__recv_request_vote with a pre-vote request.
+ */
+#define __recv_pre_vote(F, TERM, CANDIDATE_ID, LAST_LOG_INDEX, LAST_LOG_TERM) \
+    {                                                                         \
+        int rv;                                                               \
+        struct raft_request_vote args;                                        \
+        char address[4];                                                      \
+                                                                              \
+        sprintf(address, "%d", CANDIDATE_ID);                                 \
+                                                                              \
+        args.term = TERM;                                                     \
+        args.candidate_id = CANDIDATE_ID;                                     \
+        args.last_log_index = LAST_LOG_INDEX;                                 \
+        args.last_log_term = LAST_LOG_TERM;                                   \
+        args.pre_vote = true;                                                 \
+        args.disrupt_leader = false;                                          \
+                                                                              \
+        rv = raft_rpc__recv_request_vote(&F->raft, CANDIDATE_ID, address,     \
+                                         &args);                              \
+        munit_assert_int(rv, ==, 0);                                          \
+    }
+
+/**
+ * Call raft_rpc__recv_request_vote_result with the result of a pre-vote
+ * request.
+ */
+#define __recv_pre_vote_result(F, VOTER_ID, TERM, GRANTED)                   \
+    {                                                                        \
+        struct raft_request_vote_result result;                              \
+        char address[4];                                                     \
+        int rv;                                                              \
+                                                                             \
+        sprintf(address, "%d", VOTER_ID);                                    \
+                                                                             \
+        result.term = TERM;                                                  \
+        result.vote_granted = GRANTED;                                       \
+        result.pre_vote = true;                                              \
         rv = raft_rpc__recv_request_vote_result(&F->raft, VOTER_ID, address, \
                                                 &result);                    \
         munit_assert_int(rv, ==, 0);                                         \
@@ -296,7 +343,7 @@ TEST_CASE(request, error, empty_log, NULL)
     __configuration_add(f, 1, "1", true);
     __configuration_add(f, 2, "2", true);
 
-    f->raft.state = RAFT_FOLLOWER;
+    raft_state__start_as_follower(&f->raft);
 
     __recv_request_vote(f, f->raft.current_term + 1, 2, 1, 1);
 
@@ -397,6 +444,30 @@ TEST_CASE(request, success, last_idx_same_index, NULL)
     return MUNIT_OK;
 }
 
+/* If the I/O backend persists the vote asynchronously, the result is sent only
+ * once the vote is durable. */
+TEST_CASE(request, success, async_meta, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    f->io.version = 2;
+
+    __recv_request_vote(f, 2, 2, 1, 1);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+    munit_assert_int(raft_io_stub_vote(&f->io), ==, 0);
+
+    raft_io_stub_flush(&f->io);
+
+    munit_assert_int(raft_io_stub_vote(&f->io), ==, 2);
+    __assert_request_vote_result(f, 2, true);
+
+    return MUNIT_OK;
+}
+
 /* If the requester last log entry index is the lower than ours, the vote is not
  * granted. */
 TEST_CASE(request, error, last_idx_lower_index, NULL)
@@ -436,6 +507,99 @@ TEST_CASE(request, error, last_idx_lower_index, NULL)
     return MUNIT_OK;
 }
 
+/* A pre-vote request is granted without changing the local term or vote. */
+TEST_CASE(request, success, pre_vote, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *reply;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+
+    __recv_pre_vote(f, 2, 2, 1, 1);
+
+    __assert_request_vote_result(f, 1, true);
+    raft_io_stub_sending(&f->io, 0, &reply);
+    munit_assert_true(reply->request_vote_result.pre_vote);
+
+    munit_assert_int(f->raft.current_term, ==, 1);
+    munit_assert_int(f->raft.voted_for, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* If the minimum election timeout has elapsed since we last heard from the
+ * leader, the vote is granted even if our own randomized timer hasn't fired. */
+TEST_CASE(request, success, leader_timed_out, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_receive_heartbeat(&f->raft, 2);
+
+    munit_assert_int(f->raft.follower_state.current_leader.id, ==, 2);
+
+    f->raft.timer = f->raft.election_timeout;
+
+    __recv_request_vote(f, f->raft.current_term + 1, 3, 1, 1);
+
+    __assert_request_vote_result(f, 2, true);
+    munit_assert_int(f->raft.voted_for, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* A vote request sent because of a leadership transfer is granted even if the
+ * local server has a leader. */
+TEST_CASE(request, success, disrupt_leader, NULL)
+{
+    struct fixture *f = data;
+    struct raft_request_vote args;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_receive_heartbeat(&f->raft, 2);
+
+    args.term = 2;
+    args.candidate_id = 3;
+    args.last_log_index = 1;
+    args.last_log_term = 1;
+    args.pre_vote = false;
+    args.disrupt_leader = true;
+
+    rv = raft_rpc__recv_request_vote(&f->raft, 3, "3", &args);
+    munit_assert_int(rv, ==, 0);
+
+    __assert_request_vote_result(f, 2, true);
+    munit_assert_int(f->raft.voted_for, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* A pre-vote request is rejected if the local server has a leader, and the
+ * local term is not changed. */
+TEST_CASE(request, error, pre_vote_has_leader, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_receive_heartbeat(&f->raft, 2);
+
+    __recv_pre_vote(f, 2, 2, 1, 1);
+
+    __assert_request_vote_result(f, 1, false);
+    munit_assert_int(f->raft.current_term, ==, 1);
+
+    return MUNIT_OK;
+}
+
 /**
  * raft_rpc__recv_request_vote_result
  */
@@ -471,6 +635,7 @@ TEST_CASE(response, error, oom, res_oom_params)
 
     result.term = 2;
     result.vote_granted = 1;
+    result.pre_vote = false;
 
     test_heap_fault_enable(&f->heap);
 
@@ -598,6 +763,7 @@ TEST_CASE(response, error, io, NULL)
 
     result.term = 3;
     result.vote_granted = 0;
+    result.pre_vote = false;
 
     raft_io_stub_fault(&f->io, 0, 1);
 
@@ -627,3 +793,53 @@ TEST_CASE(response, success, not_granted, NULL)
 
     return MUNIT_OK;
 }
+
+/* With pre-vote enabled, a candidate first gathers pre-votes without bumping
+ * its term, and starts the actual election only once a majority granted
+ * them. */
+TEST_CASE(response, success, pre_vote, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_pre_vote(&f->raft, true);
+
+    raft_io_stub_advance(&f->io, f->raft.election_timeout_rand + 100);
+    __assert_state(f, RAFT_CANDIDATE);
+    munit_assert_true(f->raft.candidate_state.in_pre_vote);
+    munit_assert_int(f->raft.current_term, ==, 1);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->request_vote.term, ==, 2);
+    munit_assert_true(message->request_vote.pre_vote);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_pre_vote_result(f, 2, 1, true);
+
+    /* The actual election has started. */
+    __assert_state(f, RAFT_CANDIDATE);
+    munit_assert_false(f->raft.candidate_state.in_pre_vote);
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_int(f->raft.voted_for, ==, 1);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->request_vote.term, ==, 2);
+    munit_assert_false(message->request_vote.pre_vote);
+    raft_io_stub_flush_all(&f->io);
+
+    /* A late pre-vote result is ignored. */
+    __recv_pre_vote_result(f, 2, 1, true);
+    __assert_state(f, RAFT_CANDIDATE);
+
+    __recv_request_vote_result(f, 2, 2, true);
+    __assert_state(f, RAFT_LEADER);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
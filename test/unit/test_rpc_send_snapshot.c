@@ -0,0 +1,351 @@
+#include <stdio.h>
+
+#include "../../include/raft.h"
+#include "../../include/raft/io_stub.h"
+
+#include "../../src/configuration.h"
+#include "../../src/replication.h"
+#include "../../src/rpc_send_snapshot.h"
+#include "../../src/snapshot.h"
+#include "../../src/state.h"
+
+#include "../lib/fsm.h"
+#include "../lib/heap.h"
+#include "../lib/io.h"
+#include "../lib/raft.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(rpc_send_snapshot);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    RAFT_FIXTURE;
+};
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    RAFT_SETUP(f);
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    RAFT_TEAR_DOWN(f);
+
+    free(f);
+}
+
+/**
+ * Store a snapshot at index 1 with 8 bytes of data.
+ */
+#define __store_snapshot(F)                                     \
+    {                                                           \
+        struct raft_snapshot snapshot;                          \
+        struct raft_io_snapshot_put put;                        \
+        int rv;                                                 \
+                                                                \
+        snapshot.term = 1;                                      \
+        snapshot.index = 1;                                     \
+        raft_configuration_init(&snapshot.configuration);       \
+        rv = configuration__copy(&F->raft.configuration,        \
+                                 &snapshot.configuration);      \
+        munit_assert_int(rv, ==, 0);                            \
+        snapshot.configuration_index = 1;                       \
+        snapshot.bufs = raft_malloc(sizeof *snapshot.bufs);     \
+        snapshot.bufs[0].base = raft_malloc(8);                 \
+        snapshot.bufs[0].len = 8;                               \
+        snapshot.n_bufs = 1;                                    \
+        rv = F->io.snapshot_put(&F->io, &put, &snapshot, NULL); \
+        munit_assert_int(rv, ==, 0);                            \
+        raft_io_stub_flush_all(&F->io);                         \
+        snapshot__close(&snapshot);                             \
+                                                                \
+        F->raft.snapshot.term = 1;                              \
+        F->raft.snapshot.index = 1;                             \
+    }
+
+/**
+ * Call raft_rpc__recv_send_snapshot with the given parameters and check that
+ * no error occurs.
+ */
+#define __recv_send_snapshot(F, LEADER_ID, TERM, SERVER_ID, LAST_INDEX) \
+    {                                                                   \
+        struct raft_send_snapshot args;                                 \
+        char address[4];                                                \
+        int rv;                                                         \
+                                                                        \
+        sprintf(address, "%d", LEADER_ID);                              \
+                                                                        \
+        args.term = TERM;                                               \
+        args.server_id = SERVER_ID;                                     \
+        args.last_index = LAST_INDEX;                                   \
+        rv = raft_rpc__recv_send_snapshot(&F->raft, LEADER_ID, address, \
+                                          &args);                       \
+        munit_assert_int(rv, ==, 0);                                    \
+    }
+
+/**
+ * Call raft_rpc__recv_send_snapshot_result with the given parameters and check
+ * that no error occurs.
+ */
+#define __recv_send_snapshot_result(F, ID, TERM, SERVER_ID, LAST_INDEX, DONE) \
+    {                                                                         \
+        struct raft_send_snapshot_result result;                              \
+        char address[4];                                                      \
+        int rv;                                                               \
+                                                                              \
+        sprintf(address, "%d", ID);                                           \
+                                                                              \
+        result.term = TERM;                                                   \
+        result.server_id = SERVER_ID;                                         \
+        result.last_index = LAST_INDEX;                                       \
+        result.done = DONE;                                                   \
+        rv = raft_rpc__recv_send_snapshot_result(&F->raft, ID, address,       \
+                                                 &result);                    \
+        munit_assert_int(rv, ==, 0);                                          \
+    }
+
+/**
+ * Assert that the only message being sent is a SendSnapshot result for the
+ * given server, with the given values.
+ */
+#define __assert_send_snapshot_result(F, LEADER_ID, SERVER_ID, LAST_INDEX,  \
+                                      DONE)                                 \
+    {                                                                       \
+        struct raft_message *message_;                                      \
+                                                                            \
+        munit_assert_int(raft_io_stub_n_sending(&F->io), ==, 1);            \
+        raft_io_stub_sending(&F->io, 0, &message_);                         \
+        munit_assert_int(message_->type, ==, RAFT_IO_SEND_SNAPSHOT_RESULT); \
+        munit_assert_int(message_->server_id, ==, LEADER_ID);               \
+        munit_assert_int(message_->send_snapshot_result.server_id, ==,      \
+                         SERVER_ID);                                        \
+        munit_assert_int(message_->send_snapshot_result.last_index, ==,     \
+                         LAST_INDEX);                                       \
+        munit_assert_int(message_->send_snapshot_result.done, ==, DONE);    \
+    }
+
+/**
+ * Receive a SendSnapshot request.
+ */
+
+TEST_SUITE(request);
+
+TEST_SETUP(request, setup);
+TEST_TEAR_DOWN(request, tear_down);
+
+TEST_GROUP(request, error);
+TEST_GROUP(request, success);
+
+/* If the request has a stale term, it's rejected. */
+TEST_CASE(request, error, stale_term, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    __store_snapshot(f);
+    test_become_candidate(&f->raft);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_send_snapshot(f, 2, 1, 3, 1);
+
+    __assert_send_snapshot_result(f, 2, 3, 0, true);
+    munit_assert_int(f->raft.follower_state.snapshot_target, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* If the local server has no snapshot as recent as the one requested, the
+ * request is rejected. */
+TEST_CASE(request, error, no_snapshot, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_receive_heartbeat(&f->raft, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_send_snapshot(f, 2, 1, 3, 1);
+
+    __assert_send_snapshot_result(f, 2, 3, 0, true);
+
+    return MUNIT_OK;
+}
+
+/* If the target server is not in the configuration, the request is
+ * rejected. */
+TEST_CASE(request, error, unknown_server, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    __store_snapshot(f);
+    test_receive_heartbeat(&f->raft, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_send_snapshot(f, 2, 1, 4, 1);
+
+    __assert_send_snapshot_result(f, 2, 4, 0, true);
+
+    return MUNIT_OK;
+}
+
+/* The snapshot is sent to the target server on behalf of the leader, which is
+ * told once the transfer is over. */
+TEST_CASE(request, success, send, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    __store_snapshot(f);
+    test_receive_heartbeat(&f->raft, 2);
+    raft_io_stub_flush_all(&f->io);
+
+    __recv_send_snapshot(f, 2, 1, 3, 1);
+    munit_assert_int(f->raft.follower_state.snapshot_target, ==, 3);
+
+    /* Load the snapshot, which gets sent as if it came from the leader. */
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->server_id, ==, 3);
+    munit_assert_int(message->install_snapshot.leader_id, ==, 2);
+    munit_assert_int(message->install_snapshot.last_index, ==, 1);
+    munit_assert_true(message->install_snapshot.done);
+
+    /* Once the data is sent, the leader is notified. */
+    raft_io_stub_flush(&f->io);
+    __assert_send_snapshot_result(f, 2, 3, 1, true);
+    munit_assert_int(f->raft.follower_state.snapshot_target, ==, 0);
+
+    return MUNIT_OK;
+}
+
+/**
+ * Receive a SendSnapshot result.
+ */
+
+TEST_SUITE(result);
+
+TEST_SETUP(result, setup);
+TEST_TEAR_DOWN(result, tear_down);
+
+TEST_GROUP(result, success);
+
+/* Pretend that the leader has delegated the transfer of a snapshot to server 3
+ * to server 2. */
+#define __delegate(F)                                        \
+    {                                                        \
+        struct raft_replication *replication_;               \
+        replication_ = &F->raft.leader_state.replication[2]; \
+        replication_->state = REPLICATION__SNAPSHOT;         \
+        replication_->sending_snapshot = true;               \
+        replication_->delegate_id = 2;                       \
+        replication_->delegate_ack = F->io.time(&F->io);     \
+    }
+
+/* Once the delegate reports that the snapshot was sent, the leader waits for
+ * the target server to acknowledge it, as if it had sent it itself. */
+TEST_CASE(result, success, sent, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+    raft_io_stub_flush_all(&f->io);
+    __delegate(f);
+
+    replication = &f->raft.leader_state.replication[2];
+
+    __recv_send_snapshot_result(f, 2, 2, 3, 1, false);
+    munit_assert_true(replication->sending_snapshot);
+
+    __recv_send_snapshot_result(f, 2, 2, 3, 1, true);
+    munit_assert_false(replication->sending_snapshot);
+    munit_assert_int(replication->delegate_id, ==, 0);
+    munit_assert_int(replication->state, ==, REPLICATION__SNAPSHOT);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
+
+/* If the delegate reports that the snapshot could not be sent, the leader
+ * sends it itself. */
+TEST_CASE(result, success, failed, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    __store_snapshot(f);
+    test_become_leader(&f->raft);
+    raft_io_stub_flush_all(&f->io);
+    __delegate(f);
+
+    replication = &f->raft.leader_state.replication[2];
+
+    __recv_send_snapshot_result(f, 2, 2, 3, 0, true);
+    munit_assert_true(replication->sending_snapshot);
+    munit_assert_int(replication->delegate_id, ==, 0);
+
+    raft_io_stub_flush(&f->io);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_INSTALL_SNAPSHOT);
+    munit_assert_int(message->server_id, ==, 3);
+
+    return MUNIT_OK;
+}
+
+/* Results from a server the transfer was not delegated to are ignored. */
+TEST_CASE(result, success, stale, NULL)
+{
+    struct fixture *f = data;
+    struct raft_replication *replication;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 3, 1, 3);
+    test_become_leader(&f->raft);
+    raft_io_stub_flush_all(&f->io);
+
+    replication = &f->raft.leader_state.replication[2];
+
+    __recv_send_snapshot_result(f, 2, 2, 3, 1, true);
+    munit_assert_false(replication->sending_snapshot);
+    munit_assert_int(replication->match_index, ==, 0);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+
+#include "../../include/raft.h"
+#include "../../include/raft/io_stub.h"
+
+#include "../../src/rpc_timeout_now.h"
+
+#include "../lib/fsm.h"
+#include "../lib/heap.h"
+#include "../lib/io.h"
+#include "../lib/raft.h"
+#include "../lib/runner.h"
+
+TEST_MODULE(rpc_timeout_now);
+
+/**
+ * Helpers
+ */
+
+struct fixture
+{
+    RAFT_FIXTURE;
+};
+
+/**
+ * Setup and tear down
+ */
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+    struct fixture *f = munit_malloc(sizeof *f);
+
+    (void)user_data;
+
+    RAFT_SETUP(f);
+
+    return f;
+}
+
+static void tear_down(void *data)
+{
+    struct fixture *f = data;
+
+    RAFT_TEAR_DOWN(f);
+
+    free(f);
+}
+
+/**
+ * Call raft_rpc__recv_timeout_now with the given parameters and check that no
+ * error occurs.
+ */
+#define __recv_timeout_now(F, SERVER_ID, TERM, LAST_LOG_INDEX, LAST_LOG_TERM) \
+    {                                                                         \
+        struct raft_timeout_now args;                                         \
+        char address[4];                                                      \
+        int rv;                                                               \
+                                                                              \
+        sprintf(address, "%d", SERVER_ID);                                    \
+                                                                              \
+        args.term = TERM;                                                     \
+        args.last_log_index = LAST_LOG_INDEX;                                 \
+        args.last_log_term = LAST_LOG_TERM;                                   \
+        rv = raft_rpc__recv_timeout_now(&F->raft, SERVER_ID, address, &args); \
+        munit_assert_int(rv, ==, 0);                                          \
+    }
+
+/**
+ * Assert the current state of the raft instance of the given fixture.
+ */
+#define __assert_state(F, STATE) munit_assert_int(F->raft.state, ==, STATE);
+
+/**
+ * Receive a TimeoutNow request.
+ */
+
+TEST_SUITE(request);
+
+TEST_SETUP(request, setup);
+TEST_TEAR_DOWN(request, tear_down);
+
+TEST_GROUP(request, error);
+TEST_GROUP(request, success);
+
+/* If the local log is not up-to-date with the leader's one, the request is
+ * ignored. */
+TEST_CASE(request, error, stale_log, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_receive_heartbeat(&f->raft, 2);
+
+    __recv_timeout_now(f, 2, 1, 2, 1);
+
+    __assert_state(f, RAFT_FOLLOWER);
+    munit_assert_int(f->raft.current_term, ==, 1);
+
+    return MUNIT_OK;
+}
+
+/* If the request has a stale term, it's ignored. */
+TEST_CASE(request, error, stale_term, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_candidate(&f->raft);
+
+    __recv_timeout_now(f, 2, 1, 1, 1);
+
+    __assert_state(f, RAFT_CANDIDATE);
+    munit_assert_int(f->raft.current_term, ==, 2);
+
+    return MUNIT_OK;
+}
+
+/* A follower whose log is up-to-date starts an election immediately, skipping
+ * pre-vote and asking voters to disregard the current leader. */
+TEST_CASE(request, success, start_election, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *message;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_pre_vote(&f->raft, true);
+    test_receive_heartbeat(&f->raft, 2);
+
+    __recv_timeout_now(f, 2, 1, 1, 1);
+
+    __assert_state(f, RAFT_CANDIDATE);
+    munit_assert_int(f->raft.current_term, ==, 2);
+    munit_assert_false(f->raft.candidate_state.in_pre_vote);
+
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 1);
+    raft_io_stub_sending(&f->io, 0, &message);
+    munit_assert_int(message->type, ==, RAFT_IO_REQUEST_VOTE);
+    munit_assert_int(message->request_vote.term, ==, 2);
+    munit_assert_false(message->request_vote.pre_vote);
+    munit_assert_true(message->request_vote.disrupt_leader);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
@@ -1,8 +1,11 @@
+#include <stdio.h>
+
 #include "../../include/raft.h"
 #include "../../include/raft/io_stub.h"
 
 #include "../../src/configuration.h"
 #include "../../src/log.h"
+#include "../../src/replication.h"
 #include "../../src/tick.h"
 
 #include "../lib/fsm.h"
@@ -111,6 +114,15 @@ static void tear_down(void *data)
         munit_assert_int(args->n_entries, ==, 0);                             \
     }
 
+/* Record the delay requested by the last tick_after() call. */
+static unsigned tick_after_msecs;
+
+static void tick_after(struct raft_io *io, unsigned msecs)
+{
+    (void)io;
+    tick_after_msecs = msecs;
+}
+
 /**
  * tick
  */
@@ -156,6 +168,29 @@ TEST_CASE(elapse, success, update_timer, NULL)
     return MUNIT_OK;
 }
 
+/* If the I/O backend implements tick_after(), it's asked to fire the next tick
+ * right after the nearest deadline. */
+TEST_CASE(elapse, success, tick_after, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    f->io.version = 15;
+    f->io.tick_after = tick_after;
+    tick_after_msecs = 0;
+
+    __tick(f, 10);
+    munit_assert_int(tick_after_msecs, ==, f->raft.heartbeat_timeout - 10 + 1);
+
+    raft_io_stub_flush_all(&f->io);
+
+    return MUNIT_OK;
+}
+
 /* If there's only a single voting server and that's us, switch to leader
    state. */
 TEST_CASE(elapse, success, self_elect, NULL)
@@ -217,10 +252,9 @@ TEST_CASE(elapse, success, candidate, NULL)
     /* We are candidate */
     __assert_state(f, RAFT_CANDIDATE);
 
-    /* The votes array is initialized */
+    /* The votes bitset is initialized */
     munit_assert_ptr_not_null(f->raft.candidate_state.votes);
-    munit_assert_true(f->raft.candidate_state.votes[0]);
-    munit_assert_false(f->raft.candidate_state.votes[1]);
+    munit_assert_int(f->raft.candidate_state.votes[0], ==, 1);
 
     __assert_request_vote(f, 2, 2, 1, 1);
 
@@ -279,6 +313,33 @@ TEST_CASE(elapse, success, heartbeat, NULL)
     return MUNIT_OK;
 }
 
+/* If we're leader and the heartbeat timeout has elapsed, followers that were
+ * sent an AppendEntries request in the meantime are not sent a heartbeat. */
+TEST_CASE(elapse, success, heartbeat_not_idle, NULL)
+{
+    struct fixture *f = data;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    test_become_leader(&f->raft);
+
+    __tick(f, f->raft.heartbeat_timeout - 10);
+
+    rv = raft_replication__send_append_entries(&f->raft, 1);
+    munit_assert_int(rv, ==, 0);
+    raft_io_stub_flush_all(&f->io);
+
+    /* Expire the heartbeat timeout */
+    __tick(f, 20);
+
+    /* We have sent no heartbeats */
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+
+    return MUNIT_OK;
+}
+
 /* If we're leader and the heartbeat timeout has not elapsed, do nothing. */
 TEST_CASE(elapse, success, no_heartbeat, NULL)
 {
@@ -353,10 +414,9 @@ TEST_CASE(elapse, success, new_election, NULL)
     /* We are still candidate */
     __assert_state(f, RAFT_CANDIDATE);
 
-    /* The votes array is initialized */
+    /* The votes bitset is initialized */
     munit_assert_ptr_not_null(f->raft.candidate_state.votes);
-    munit_assert_true(f->raft.candidate_state.votes[0]);
-    munit_assert_false(f->raft.candidate_state.votes[1]);
+    munit_assert_int(f->raft.candidate_state.votes[0], ==, 1);
 
     /* We have sent vote requests again */
     __assert_request_vote(f, 2, 3, 1, 1);
@@ -406,3 +466,149 @@ TEST_CASE(elapse, success, request_vote_only_to_voters, NULL)
 
     return MUNIT_OK;
 }
+
+/**
+ * hibernate
+ */
+
+TEST_SUITE(hibernate);
+TEST_SETUP(hibernate, setup);
+TEST_TEAR_DOWN(hibernate, tear_down);
+
+/* Deliver a successful AppendEntries result from the given server, reporting
+ * that it has all our entries. */
+#define __deliver_append_entries_result(F, SERVER_ID)                 \
+    {                                                                 \
+        struct raft_message message;                                  \
+        struct raft_append_entries_result *result =                   \
+            &message.append_entries_result;                           \
+        char address[4];                                              \
+        sprintf(address, "%d", SERVER_ID);                            \
+        message.type = RAFT_IO_APPEND_ENTRIES_RESULT;                 \
+        message.server_id = SERVER_ID;                                \
+        message.server_address = address;                             \
+        result->term = F->raft.current_term;                          \
+        result->success = true;                                       \
+        result->last_log_index = log__last_index(&F->raft.log);       \
+        result->conflict_term = 0;                                    \
+        result->conflict_index = 0;                                   \
+        result->snapshot_index = 0;                                   \
+        result->snapshot_offset = 0;                                  \
+        result->seq = F->raft.leader_state.seq;                       \
+        raft_io_stub_deliver(&F->io, &message);                       \
+    }
+
+/* Deliver a heartbeat from the given leader, telling us to hibernate. */
+#define __deliver_hibernate(F, LEADER_ID)                             \
+    {                                                                 \
+        struct raft_message message;                                  \
+        struct raft_append_entries *args = &message.append_entries;   \
+        char address[4];                                              \
+        sprintf(address, "%d", LEADER_ID);                            \
+        message.type = RAFT_IO_APPEND_ENTRIES;                        \
+        message.server_id = LEADER_ID;                                \
+        message.server_address = address;                             \
+        args->term = F->raft.current_term;                            \
+        args->leader_id = LEADER_ID;                                  \
+        args->prev_log_index = log__last_index(&F->raft.log);         \
+        args->prev_log_term = log__last_term(&F->raft.log);           \
+        args->entries = NULL;                                         \
+        args->n_entries = 0;                                          \
+        args->leader_commit = args->prev_log_index;                   \
+        args->hibernate = true;                                       \
+        args->seq = 0;                                                \
+        raft_io_stub_deliver(&F->io, &message);                       \
+        raft_io_stub_flush_all(&F->io);                               \
+    }
+
+TEST_GROUP(hibernate, success);
+
+/* Once all followers have all entries for the hibernate timeout, the leader
+ * sends them a last heartbeat and then stops sending them, without stepping
+ * down. A new entry wakes it up. */
+TEST_CASE(hibernate, success, leader, NULL)
+{
+    struct fixture *f = data;
+    struct raft_message *sent;
+    struct raft_apply req;
+    struct raft_buffer buf;
+    int rv;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    raft_set_hibernate_timeout(&f->raft, f->raft.heartbeat_timeout);
+    test_become_leader(&f->raft);
+    __deliver_append_entries_result(f, 2);
+
+    /* The first idle heartbeat is a regular one. */
+    __tick(f, f->raft.heartbeat_timeout + 1);
+    __assert_heartbeat(f, 2, 2, 1, 1);
+    raft_io_stub_sending(&f->io, 0, &sent);
+    munit_assert_false(sent->append_entries.hibernate);
+    raft_io_stub_flush_all(&f->io);
+    __deliver_append_entries_result(f, 2);
+
+    /* The next one tells the follower to hibernate. */
+    __tick(f, f->raft.heartbeat_timeout + 1);
+    __assert_heartbeat(f, 2, 2, 1, 1);
+    raft_io_stub_sending(&f->io, 0, &sent);
+    munit_assert_true(sent->append_entries.hibernate);
+    raft_io_stub_flush_all(&f->io);
+
+    /* No more heartbeats are sent, and we don't step down. */
+    __tick(f, f->raft.election_timeout * 3);
+    munit_assert_int(raft_io_stub_n_sending(&f->io), ==, 0);
+    __assert_state(f, RAFT_LEADER);
+
+    /* A new entry is sent right away, and heartbeats resume. */
+    test_fsm_encode_set_x(123, &buf);
+    rv = raft_apply(&f->raft, &req, &buf, 1, NULL);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(f->raft.leader_state.hibernating);
+    raft_io_stub_flush_all(&f->io);
+    __deliver_append_entries_result(f, 2);
+
+    return MUNIT_OK;
+}
+
+/* A follower told to hibernate by a leader suspends its election timer, until
+ * it's woken up. */
+TEST_CASE(hibernate, success, follower, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    __deliver_hibernate(f, 2);
+    munit_assert_true(f->raft.follower_state.hibernating);
+
+    __tick(f, f->raft.election_timeout * 3);
+    __assert_state(f, RAFT_FOLLOWER);
+
+    raft_wake(&f->raft);
+    munit_assert_false(f->raft.follower_state.hibernating);
+
+    __tick(f, f->raft.election_timeout_rand + 100);
+    __assert_state(f, RAFT_CANDIDATE);
+
+    return MUNIT_OK;
+}
+
+/* A regular heartbeat resumes the election timer of a hibernating follower. */
+TEST_CASE(hibernate, success, heartbeat, NULL)
+{
+    struct fixture *f = data;
+
+    (void)params;
+
+    test_bootstrap_and_start(&f->raft, 2, 1, 2);
+    __deliver_hibernate(f, 2);
+    munit_assert_true(f->raft.follower_state.hibernating);
+
+    test_receive_heartbeat(&f->raft, 2);
+    munit_assert_false(f->raft.follower_state.hibernating);
+
+    return MUNIT_OK;
+}
@@ -142,6 +142,98 @@ TEST_CASE(block_size, error, no_resources, dir_fs_btrfs_params)
 }
 #endif /* RWF_NOWAIT */
 
+/******************************************************************************
+ *
+ * uv__file_probe
+ *
+ *****************************************************************************/
+
+TEST_SUITE(probe);
+
+TEST_SETUP(probe)
+{
+    struct block_size_fixture *f = munit_malloc(sizeof *f);
+    (void)user_data;
+    SETUP_DIR;
+    SETUP_UV;
+    return f;
+}
+
+TEST_TEAR_DOWN(probe)
+{
+    struct block_size_fixture *f = data;
+    TEAR_DOWN_UV;
+    TEAR_DOWN_DIR;
+    free(f);
+}
+
+TEST_GROUP(probe, success)
+
+/* The result of the first probe is cached and returned by the next ones. */
+TEST_CASE(probe, success, cached, NULL)
+{
+    struct block_size_fixture *f = data;
+    uint8_t buf[8] = {0, 2, 0, 0, 0, 0, 0, 0}; /* 512 in little endian */
+    size_t size;
+    bool async;
+    int rv;
+
+    (void)params;
+
+    rv = uv__file_probe(f->dir, &size, &async);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(test_dir_has_file(f->dir, UV__FILE_PROBE_CACHE));
+
+    /* Tamper with the cached block size. */
+    test_dir_overwrite_file(f->dir, UV__FILE_PROBE_CACHE, buf, sizeof buf,
+                            4 * sizeof(uint64_t));
+
+    rv = uv__file_probe(f->dir, &size, &async);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(size, ==, 512);
+
+    return MUNIT_OK;
+}
+
+/* If the cache was written for another file system, it's ignored and
+ * refreshed. */
+TEST_CASE(probe, success, other_fs, NULL)
+{
+    struct block_size_fixture *f = data;
+    uint8_t buf[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    size_t expected;
+    size_t size;
+    bool async;
+    int rv;
+
+    (void)params;
+
+    rv = uv__file_block_size(f->dir, &expected);
+    munit_assert_int(rv, ==, 0);
+
+    rv = uv__file_probe(f->dir, &size, &async);
+    munit_assert_int(rv, ==, 0);
+
+    /* Tamper with the cached device number and block size. */
+    test_dir_overwrite_file(f->dir, UV__FILE_PROBE_CACHE, buf, sizeof buf,
+                            sizeof(uint64_t));
+    buf[0] = 0;
+    buf[1] = 2;
+    memset(buf + 2, 0, sizeof buf - 2);
+    test_dir_overwrite_file(f->dir, UV__FILE_PROBE_CACHE, buf, sizeof buf,
+                            4 * sizeof(uint64_t));
+
+    rv = uv__file_probe(f->dir, &size, &async);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(size, ==, expected);
+
+    rv = uv__file_probe(f->dir, &size, &async);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_int(size, ==, expected);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * uv__file_create
@@ -276,6 +368,11 @@ TEST_CASE(create, error, no_resources, NULL)
 
     (void)params;
 
+    /* With io_uring the AIO subsystem is not used at all. */
+    if (test_uring_supported()) {
+        return MUNIT_SKIP;
+    }
+
     test_aio_fill(&ctx, 0);
 
     CREATE__INVOKE(UV_EAGAIN);
@@ -498,6 +595,24 @@ TEST_CASE(write, success, vec, dir_fs_supported_params)
     return MUNIT_OK;
 }
 
+/* Write a vector of buffers through the page cache, as done when the file
+ * system does not support direct I/O. */
+TEST_CASE(write, success, buffered, dir_fs_supported_params)
+{
+    struct write_fixture *f = data;
+
+    (void)params;
+
+    f->file.buffered = true;
+    f->file.async = false;
+    f->n_bufs = 2;
+
+    write__complete;
+    write__assert_content(2);
+
+    return MUNIT_OK;
+}
+
 /* Write a vector of buffers twice. */
 TEST_CASE(write, success, vec_twice, dir_fs_supported_params)
 {
@@ -538,6 +653,35 @@ TEST_CASE(write, success, concurrent, dir_fs_supported_params)
     return MUNIT_OK;
 }
 
+/* Write two different blocks while the file is corked, submitting them
+ * only once it's uncorked. */
+TEST_CASE(write, success, corked, dir_fs_supported_params)
+{
+    struct write_fixture *f = data;
+    struct uv__file_write req;
+    int rv;
+
+    (void)params;
+
+    req.data = f;
+
+    uv__file_cork(&f->file);
+
+    write__invoke(0);
+
+    rv =
+        uv__file_write(&f->file, &req, &f->bufs[1], 1, f->block_size, write_cb);
+    munit_assert_int(rv, ==, 0);
+
+    uv__file_uncork(&f->file);
+
+    write__wait_cb(2, f->block_size);
+
+    write__assert_content(2);
+
+    return MUNIT_OK;
+}
+
 /* Write the same block concurrently. */
 TEST_CASE(write, success, concurrent_twice, dir_fs_supported_params)
 {
@@ -572,6 +716,11 @@ TEST_CASE(write, error, no_resources, dir_fs_no_aio_params)
 
     (void)params;
 
+    /* With io_uring the AIO subsystem is not used at all. */
+    if (test_uring_supported()) {
+        return MUNIT_SKIP;
+    }
+
     test_aio_fill(&ctx, 0);
 
     write__invoke(0);